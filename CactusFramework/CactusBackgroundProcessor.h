@@ -33,7 +33,15 @@ typedef NS_ENUM(NSInteger, CactusTaskType) {
     CactusTaskTypeEmbedding = 2,
     CactusTaskTypeBenchmark = 3,
     CactusTaskTypeTokenization = 4,
-    CactusTaskTypeMultimodal = 5
+    CactusTaskTypeMultimodal = 5,
+    CactusTaskTypeTraining = 6
+};
+
+// Resource lanes; each lane has its own queue, QoS and concurrency limit
+typedef NS_ENUM(NSInteger, CactusTaskLane) {
+    CactusTaskLaneGPU = 0,      // generation, multimodal and benchmarks on the model context
+    CactusTaskLaneCompute = 1,  // CPU-bound work such as embeddings, tokenization and training
+    CactusTaskLaneIO = 2        // model loading
 };
 
 @class CactusTask;
@@ -56,6 +64,13 @@ typedef void(^CactusTaskCancellationHandler)(void);
 @property (nonatomic, readonly, nullable) NSDate *completedAt;
 @property (nonatomic, readonly) float progress;
 @property (nonatomic, readonly, nullable) NSString *desc;
+@property (nonatomic, assign) CactusTaskLane lane;                        // Default: derived from type
+@property (nonatomic, readonly) CactusTaskPriority effectivePriority;     // priority raised by waiting time
+@property (nonatomic, assign, getter=isPreemptible) BOOL preemptible;     // Default: NO
+@property (nonatomic, readonly, getter=isPreempted) BOOL preempted;
+// Tasks with equal keys compute the same result: one submitted while another is in flight, or
+// within coalescedResultLifetime of its completion, gets that result instead of running. nil: never coalesced
+@property (nonatomic, copy, nullable) NSString *coalescingKey;
 
 // Task execution block
 @property (nonatomic, copy, readonly) id(^executionBlock)(CactusTask *task, CactusTaskProgressHandler progressHandler);
@@ -75,6 +90,10 @@ typedef void(^CactusTaskCancellationHandler)(void);
 - (void)cancel;
 - (BOOL)isCancelled;
 
+// Preemptible tasks call this at token boundaries; it blocks while a higher-priority task
+// holds the lane and returns NO if the task was cancelled meanwhile
+- (BOOL)yieldIfPreempted;
+
 @end
 
 // MARK: - Background Processor
@@ -95,12 +114,16 @@ typedef void(^CactusTaskCancellationHandler)(void);
 @property (nonatomic, readonly) NSInteger activeTasks;
 @property (nonatomic, readonly) NSInteger pendingTasks;
 @property (nonatomic, readonly) BOOL isRunning;
+@property (nonatomic, assign) NSTimeInterval priorityAgingInterval; // Default: 2.0 (seconds pending per priority level)
+@property (nonatomic, assign) NSTimeInterval coalescedResultLifetime; // Default: 2.0 (0 only joins in-flight tasks)
 
 // Singleton
 + (instancetype)sharedProcessor;
 
 // Configuration
-- (void)setMaxConcurrentTasks:(NSInteger)maxTasks;
+- (void)setMaxConcurrentTasks:(NSInteger)maxTasks; // applies to every lane
+- (void)setMaxConcurrentTasks:(NSInteger)maxTasks forLane:(CactusTaskLane)lane;
+- (NSInteger)maxConcurrentTasksForLane:(CactusTaskLane)lane;
 
 // Task management
 - (CactusTask *)submitTask:(CactusTask *)task;
@@ -122,6 +145,9 @@ typedef void(^CactusTaskCancellationHandler)(void);
 - (NSArray<CactusTask *> *)tasksWithState:(CactusTaskState)state;
 - (NSArray<CactusTask *> *)allTasks;
 
+// Drops the results kept for coalescing, for when the model or its adapters change
+- (void)clearCoalescedResults;
+
 // Processor control
 - (void)start;
 - (void)stop;
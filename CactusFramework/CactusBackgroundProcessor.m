@@ -5,8 +5,38 @@
 
 #import "CactusBackgroundProcessor.h"
 #import "CactusLLMError.h"
+#import "CactusSessionManager.h"
+#import "CactusUtilities.h"
 #import <os/lock.h>
 
+static const NSInteger CactusTaskLaneCount = 3;
+
+static CactusTaskLane CactusTaskLaneForType(CactusTaskType type) {
+    switch (type) {
+        case CactusTaskTypeModelLoad:
+            return CactusTaskLaneIO;
+        case CactusTaskTypeEmbedding:
+        case CactusTaskTypeTokenization:
+        case CactusTaskTypeTraining:
+            return CactusTaskLaneCompute;
+        case CactusTaskTypeGeneration:
+        case CactusTaskTypeBenchmark:
+        case CactusTaskTypeMultimodal:
+        default:
+            return CactusTaskLaneGPU;
+    }
+}
+
+static NSOperationQueuePriority CactusQueuePriorityForTaskPriority(CactusTaskPriority priority) {
+    switch (priority) {
+        case CactusTaskPriorityCritical: return NSOperationQueuePriorityVeryHigh;
+        case CactusTaskPriorityHigh: return NSOperationQueuePriorityHigh;
+        case CactusTaskPriorityNormal: return NSOperationQueuePriorityNormal;
+        case CactusTaskPriorityLow: return NSOperationQueuePriorityLow;
+    }
+    return NSOperationQueuePriorityNormal;
+}
+
 // MARK: - Task Implementation
 
 @interface CactusTask ()
@@ -15,6 +45,16 @@
 @property (nonatomic, readwrite) NSDate *completedAt;
 @property (nonatomic, readwrite) float progress;
 @property (nonatomic, readwrite) BOOL cancelled;
+@property (nonatomic, readwrite) CactusTaskPriority effectivePriority;
+@property (nonatomic, readwrite, getter=isPreempted) BOOL preempted;
+@property (nonatomic, assign) BOOL parked;   // blocked in yieldIfPreempted, or done and holding its slot
+@property (nonatomic, assign) BOOL slotLent; // a preempting task runs in this task's lane slot
+@property (nonatomic, strong) NSCondition *preemptionCondition;
+@property (nonatomic, strong, nullable) CactusTask *preemptedTask; // running task this one paused to get its lane
+- (void)setPreemptionRequested:(BOOL)requested;
+- (void)setSlotLent:(BOOL)lent;
+- (void)waitUntilParked;
+- (void)holdSlotWhileLent;
 @end
 
 @implementation CactusTask
@@ -33,6 +73,9 @@
         _createdAt = [NSDate date];
         _progress = 0.0f;
         _cancelled = NO;
+        _lane = CactusTaskLaneForType(type);
+        _effectivePriority = priority;
+        _preemptionCondition = [[NSCondition alloc] init];
     }
     return self;
 }
@@ -57,6 +100,7 @@
             }
         }
     }
+    [self setPreemptionRequested:NO];
 }
 
 - (BOOL)isCancelled {
@@ -65,6 +109,59 @@
     }
 }
 
+- (void)setPreemptionRequested:(BOOL)requested {
+    [self.preemptionCondition lock];
+    self.preempted = requested;
+    [self.preemptionCondition broadcast];
+    [self.preemptionCondition unlock];
+}
+
+- (void)setSlotLent:(BOOL)lent {
+    [self.preemptionCondition lock];
+    _slotLent = lent;
+    self.preempted = lent;
+    [self.preemptionCondition broadcast];
+    [self.preemptionCondition unlock];
+}
+
+- (BOOL)yieldIfPreempted {
+    [self.preemptionCondition lock];
+    if (self.preempted && !self.isCancelled) {
+        self.parked = YES;
+        [self.preemptionCondition broadcast];
+        while (self.preempted && !self.isCancelled) {
+            [self.preemptionCondition wait];
+        }
+        self.parked = NO;
+    }
+    [self.preemptionCondition unlock];
+    return !self.isCancelled;
+}
+
+// Returns once a task that lent its slot has parked, either at a token boundary or done
+- (void)waitUntilParked {
+    [self.preemptionCondition lock];
+    while (self.slotLent && !self.parked) {
+        [self.preemptionCondition wait];
+    }
+    [self.preemptionCondition unlock];
+}
+
+// A task done while its slot is lent keeps its operation, and so the lane slot, until the
+// preempting task that borrowed it finishes; otherwise the queue would start another one in it
+- (void)holdSlotWhileLent {
+    [self.preemptionCondition lock];
+    if (self.slotLent) {
+        self.parked = YES;
+        [self.preemptionCondition broadcast];
+        while (self.slotLent) {
+            [self.preemptionCondition wait];
+        }
+        self.parked = NO;
+    }
+    [self.preemptionCondition unlock];
+}
+
 - (NSString *)description {
     return [NSString stringWithFormat:@"<CactusTask: %@ type=%ld priority=%ld state=%ld progress=%.2f>",
             self.taskId.UUIDString, (long)self.type, (long)self.priority, (long)self.state, self.progress];
@@ -74,9 +171,20 @@
 
 // MARK: - Background Processor Implementation
 
-@interface CactusBackgroundProcessor ()
-@property (nonatomic, strong) NSOperationQueue *operationQueue;
+@interface CactusBackgroundProcessor () {
+    NSInteger _laneLimits[CactusTaskLaneCount];
+    NSInteger _lanePreemptions[CactusTaskLaneCount];
+    NSInteger _agedPromotions;
+    NSInteger _coalescedTasks;
+    NSInteger _cachedResultHits;
+}
+@property (nonatomic, strong) NSArray<NSOperationQueue *> *laneQueues;
+@property (nonatomic, strong) NSOperationQueue *preemptionQueue; // preempting tasks, run in their victim's slot
 @property (nonatomic, strong) NSMutableDictionary<NSUUID *, CactusTask *> *tasks;
+@property (nonatomic, strong) NSMutableDictionary<NSUUID *, NSOperation *> *pendingOperations;
+@property (nonatomic, strong) NSMutableDictionary<NSString *, CactusTask *> *coalescingLeaders;
+@property (nonatomic, strong) NSMutableDictionary<NSString *, NSMutableArray<CactusTask *> *> *coalescedFollowers;
+@property (nonatomic, strong) NSMutableDictionary<NSString *, NSArray *> *coalescedResults; // @[result, expiry date]
 @property (nonatomic, strong) dispatch_queue_t synchronizationQueue;
 @property (nonatomic, readwrite) BOOL isRunning;
 @property (nonatomic, readwrite) NSInteger maxConcurrentTasks;
@@ -95,13 +203,37 @@
 
 - (instancetype)init {
     if (self = [super init]) {
-        _operationQueue = [[NSOperationQueue alloc] init];
-        _operationQueue.name = @"com.cactus.background.processor";
-        _operationQueue.qualityOfService = NSQualityOfServiceUserInitiated;
+        // Decode shares one model context, so the GPU lane runs one task at a time;
+        // embeddings and tokenization get their own lane and never queue behind chat
+        NSArray<NSString *> *laneNames = @[@"gpu", @"compute", @"io"];
+        const NSQualityOfService laneQoS[CactusTaskLaneCount] = {
+            NSQualityOfServiceUserInitiated, NSQualityOfServiceUtility, NSQualityOfServiceUtility
+        };
+        const NSInteger laneDefaults[CactusTaskLaneCount] = {1, 2, 1};
+        NSMutableArray<NSOperationQueue *> *queues = [NSMutableArray arrayWithCapacity:CactusTaskLaneCount];
+        for (NSInteger lane = 0; lane < CactusTaskLaneCount; lane++) {
+            NSOperationQueue *queue = [[NSOperationQueue alloc] init];
+            queue.name = [NSString stringWithFormat:@"com.cactus.background.processor.%@", laneNames[lane]];
+            queue.qualityOfService = laneQoS[lane];
+            queue.maxConcurrentOperationCount = laneDefaults[lane];
+            _laneLimits[lane] = laneDefaults[lane];
+            [queues addObject:queue];
+        }
+        _laneQueues = [queues copy];
+        // A preempting task never waits in its lane queue, whose slots may all be taken; it runs here
+        // on the slot its victim lends, so the lane's limit counts it through the victim
+        _preemptionQueue = [[NSOperationQueue alloc] init];
+        _preemptionQueue.name = @"com.cactus.background.processor.preempt";
+        _preemptionQueue.qualityOfService = NSQualityOfServiceUserInitiated;
         _maxConcurrentTasks = 2; // Default to 2 concurrent tasks
-        _operationQueue.maxConcurrentOperationCount = _maxConcurrentTasks;
+        _priorityAgingInterval = 2.0;
         
         _tasks = [NSMutableDictionary dictionary];
+        _pendingOperations = [NSMutableDictionary dictionary];
+        _coalescingLeaders = [NSMutableDictionary dictionary];
+        _coalescedFollowers = [NSMutableDictionary dictionary];
+        _coalescedResults = [NSMutableDictionary dictionary];
+        _coalescedResultLifetime = 2.0;
         _synchronizationQueue = dispatch_queue_create("com.cactus.processor.sync", DISPATCH_QUEUE_CONCURRENT);
         _isRunning = YES;
     }
@@ -110,7 +242,30 @@
 
 - (void)setMaxConcurrentTasks:(NSInteger)maxTasks {
     _maxConcurrentTasks = MAX(1, maxTasks);
-    self.operationQueue.maxConcurrentOperationCount = _maxConcurrentTasks;
+    for (NSInteger lane = 0; lane < CactusTaskLaneCount; lane++) {
+        [self setMaxConcurrentTasks:_maxConcurrentTasks forLane:(CactusTaskLane)lane];
+    }
+}
+
+- (void)setMaxConcurrentTasks:(NSInteger)maxTasks forLane:(CactusTaskLane)lane {
+    if (lane < 0 || lane >= CactusTaskLaneCount) {
+        return;
+    }
+    dispatch_barrier_sync(self.synchronizationQueue, ^{
+        self->_laneLimits[lane] = MAX(1, maxTasks);
+        self.laneQueues[lane].maxConcurrentOperationCount = self->_laneLimits[lane];
+    });
+}
+
+- (NSInteger)maxConcurrentTasksForLane:(CactusTaskLane)lane {
+    if (lane < 0 || lane >= CactusTaskLaneCount) {
+        return 0;
+    }
+    __block NSInteger limit = 0;
+    dispatch_sync(self.synchronizationQueue, ^{
+        limit = self->_laneLimits[lane];
+    });
+    return limit;
 }
 
 - (NSInteger)activeTasks {
@@ -142,14 +297,115 @@
         return nil;
     }
     
-    dispatch_barrier_async(self.synchronizationQueue, ^{
+    __block id cachedResult = nil;
+    __block BOOL coalesced = NO;
+    NSString *key = task.coalescingKey;
+    dispatch_barrier_sync(self.synchronizationQueue, ^{
         self.tasks[task.taskId] = task;
+        if (!key) {
+            return;
+        }
+        NSArray *cached = self.coalescedResults[key];
+        if (cached && [cached[1] timeIntervalSinceNow] > 0) {
+            cachedResult = cached[0];
+            self->_cachedResultHits++;
+            return;
+        }
+        [self.coalescedResults removeObjectForKey:key];
+        CactusTask *leader = self.coalescingLeaders[key];
+        if (leader && leader != task && !leader.isCancelled) {
+            if (!self.coalescedFollowers[key]) {
+                self.coalescedFollowers[key] = [NSMutableArray array];
+            }
+            [self.coalescedFollowers[key] addObject:task];
+            self->_coalescedTasks++;
+            coalesced = YES;
+            return;
+        }
+        self.coalescingLeaders[key] = task;
     });
     
-    [self executeTask:task];
+    if (cachedResult) {
+        [self finishCoalescedTasks:@[task] result:cachedResult error:nil];
+    } else if (!coalesced) {
+        [self executeTask:task];
+    }
     return task;
 }
 
+// Completes tasks that waited on another with the same key, on the main queue as executed tasks are
+- (void)finishCoalescedTasks:(NSArray<CactusTask *> *)tasks result:(id)result error:(NSError *)error {
+    NSMutableArray<CactusTask *> *finished = [NSMutableArray arrayWithCapacity:tasks.count];
+    for (CactusTask *task in tasks) {
+        @synchronized(task) {
+            if (task.isCancelled) {
+                continue;
+            }
+            task.state = error ? CactusTaskStateFailed : CactusTaskStateCompleted;
+            task.startedAt = task.startedAt ?: [NSDate date];
+            task.completedAt = [NSDate date];
+            task.progress = error ? task.progress : 1.0f;
+        }
+        [finished addObject:task];
+    }
+    if (finished.count == 0) {
+        return;
+    }
+    dispatch_async(dispatch_get_main_queue(), ^{
+        for (CactusTask *task in finished) {
+            if (task.completionHandler) {
+                task.completionHandler(result, error);
+            }
+            if (error) {
+                if ([self.delegate respondsToSelector:@selector(processor:didFailTask:withError:)]) {
+                    [self.delegate processor:self didFailTask:task withError:error];
+                }
+            } else if ([self.delegate respondsToSelector:@selector(processor:didCompleteTask:withResult:)]) {
+                [self.delegate processor:self didCompleteTask:task withResult:result];
+            }
+        }
+    });
+}
+
+// Hands the leader's outcome to the tasks coalesced onto it. A cancelled leader passes the work on
+// to the first follower still waiting, which the others then wait on.
+- (void)resolveCoalescedTask:(CactusTask *)task result:(id)result error:(NSError *)error {
+    NSString *key = task.coalescingKey;
+    if (!key) {
+        return;
+    }
+    __block NSArray<CactusTask *> *followers = nil;
+    dispatch_barrier_sync(self.synchronizationQueue, ^{
+        if (self.coalescingLeaders[key] != task) {
+            return;
+        }
+        [self.coalescingLeaders removeObjectForKey:key];
+        followers = [self.coalescedFollowers[key] copy];
+        [self.coalescedFollowers removeObjectForKey:key];
+        if (!task.isCancelled && !error && result && self.coalescedResultLifetime > 0) {
+            self.coalescedResults[key] = @[result, [NSDate dateWithTimeIntervalSinceNow:self.coalescedResultLifetime]];
+        }
+    });
+    if (followers.count == 0) {
+        return;
+    }
+    if (task.isCancelled) {
+        for (CactusTask *follower in followers) {
+            if (!follower.isCancelled) {
+                [self submitTask:follower];
+            }
+        }
+        return;
+    }
+    [self finishCoalescedTasks:followers result:result error:error];
+}
+
+- (void)clearCoalescedResults {
+    dispatch_barrier_async(self.synchronizationQueue, ^{
+        [self.coalescedResults removeAllObjects];
+    });
+}
+
 - (void)submitTask:(CactusTask *)task
    progressHandler:(CactusTaskProgressHandler)progressHandler
  completionHandler:(CactusTaskCompletionHandler)completionHandler {
@@ -170,15 +426,31 @@
 }
 
 - (void)executeTask:(CactusTask *)task {
+    if (task.lane < 0 || task.lane >= CactusTaskLaneCount) {
+        task.lane = CactusTaskLaneForType(task.type);
+    }
+    
     NSBlockOperation *operation = [NSBlockOperation blockOperationWithBlock:^{
+        dispatch_barrier_sync(self.synchronizationQueue, ^{
+            [self.pendingOperations removeObjectForKey:task.taskId];
+        });
         if (task.isCancelled) {
             return;
         }
         
+        // A preempting task starts once its victim has parked, so the two never run on the lane's
+        // resource together
+        __block CactusTask *victim = nil;
+        dispatch_sync(self.synchronizationQueue, ^{
+            victim = task.preemptedTask;
+        });
+        [victim waitUntilParked];
+        
         @synchronized(task) {
             task.state = CactusTaskStateRunning;
             task.startedAt = [NSDate date];
         }
+        [[CactusLatencyMetrics globalMetrics].queueWait recordValue:(uint64_t)MAX(0.0, [task.startedAt timeIntervalSinceDate:task.createdAt] * 1e6)];
         
         dispatch_async(dispatch_get_main_queue(), ^{
             if ([self.delegate respondsToSelector:@selector(processor:didStartTask:)]) {
@@ -230,6 +502,7 @@
                     task.completedAt = [NSDate date];
                     task.progress = 1.0f;
                 }
+                [self resolveCoalescedTask:task result:result error:error];
                 
                 dispatch_async(dispatch_get_main_queue(), ^{
                     if (task.completionHandler) {
@@ -252,6 +525,7 @@
                 task.state = CactusTaskStateFailed;
                 task.completedAt = [NSDate date];
             }
+            [self resolveCoalescedTask:task result:nil error:error];
             
             dispatch_async(dispatch_get_main_queue(), ^{
                 if (task.completionHandler) {
@@ -262,25 +536,112 @@
                 }
             });
         }
+        [task holdSlotWhileLent];
     }];
     
     // Set operation priority based on task priority
-    switch (task.priority) {
-        case CactusTaskPriorityCritical:
-            operation.queuePriority = NSOperationQueuePriorityVeryHigh;
-            break;
-        case CactusTaskPriorityHigh:
-            operation.queuePriority = NSOperationQueuePriorityHigh;
-            break;
-        case CactusTaskPriorityNormal:
-            operation.queuePriority = NSOperationQueuePriorityNormal;
-            break;
-        case CactusTaskPriorityLow:
-            operation.queuePriority = NSOperationQueuePriorityLow;
-            break;
+    operation.queuePriority = CactusQueuePriorityForTaskPriority(task.priority);
+    if (task.priority >= CactusTaskPriorityHigh) {
+        operation.qualityOfService = NSQualityOfServiceUserInitiated;
+    }
+    
+    __weak typeof(task) weakTask = task;
+    NSUUID *taskId = task.taskId;
+    operation.completionBlock = ^{
+        dispatch_barrier_async(self.synchronizationQueue, ^{
+            [self.pendingOperations removeObjectForKey:taskId]; // cancelled operations never run their block
+        });
+        [self releasePreemptionHeldByTask:weakTask];
+        // no-op unless the task was cancelled while it still led its key
+        __strong typeof(weakTask) strongTask = weakTask;
+        if (strongTask) {
+            [self resolveCoalescedTask:strongTask result:nil error:nil];
+        }
+    };
+    
+    __block BOOL preempting = NO;
+    dispatch_barrier_sync(self.synchronizationQueue, ^{
+        self.pendingOperations[task.taskId] = operation;
+        [self preemptLaneForTask:task];
+        preempting = task.preemptedTask != nil;
+    });
+    [self scheduleAgingForTask:task];
+    
+    [(preempting ? self.preemptionQueue : self.laneQueues[task.lane]) addOperation:operation];
+}
+
+// Must run on the synchronization queue as a barrier
+- (void)preemptLaneForTask:(CactusTask *)task {
+    if (task.priority < CactusTaskPriorityHigh) {
+        return;
     }
     
-    [self.operationQueue addOperation:operation];
+    NSInteger running = 0;
+    CactusTask *victim = nil;
+    for (CactusTask *candidate in self.tasks.allValues) {
+        if (candidate.lane != task.lane || candidate.state != CactusTaskStateRunning || candidate.isPreempted) {
+            continue;
+        }
+        running++;
+        if (candidate.isPreemptible && candidate.effectivePriority < task.priority &&
+            (!victim || candidate.effectivePriority < victim.effectivePriority)) {
+            victim = candidate;
+        }
+    }
+    if (!victim || running < _laneLimits[task.lane]) {
+        return;
+    }
+    
+    // The victim parks at its next token boundary and lends its slot until this task finishes
+    [victim setSlotLent:YES];
+    task.preemptedTask = victim;
+    _lanePreemptions[task.lane]++;
+}
+
+- (void)releasePreemptionHeldByTask:(CactusTask *)task {
+    if (!task) {
+        return;
+    }
+    dispatch_barrier_async(self.synchronizationQueue, ^{
+        CactusTask *victim = task.preemptedTask;
+        if (!victim) {
+            return;
+        }
+        task.preemptedTask = nil;
+        [victim setSlotLent:NO];
+    });
+}
+
+// Raises a pending task one level per aging interval so low-priority work cannot starve;
+// aging stops at High so only explicitly urgent tasks preempt
+- (void)scheduleAgingForTask:(CactusTask *)task {
+    if (self.priorityAgingInterval <= 0 || task.effectivePriority >= CactusTaskPriorityHigh) {
+        return;
+    }
+    __weak typeof(self) weakSelf = self;
+    __weak typeof(task) weakTask = task;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(self.priorityAgingInterval * NSEC_PER_SEC)),
+                   dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        __strong typeof(weakTask) strongTask = weakTask;
+        if (!strongSelf || !strongTask || strongTask.state != CactusTaskStatePending) {
+            return;
+        }
+        __block BOOL promoted = NO;
+        dispatch_barrier_sync(strongSelf.synchronizationQueue, ^{
+            NSOperation *operation = strongSelf.pendingOperations[strongTask.taskId];
+            if (!operation) {
+                return;
+            }
+            strongTask.effectivePriority = (CactusTaskPriority)(strongTask.effectivePriority + 1);
+            operation.queuePriority = CactusQueuePriorityForTaskPriority(strongTask.effectivePriority);
+            strongSelf->_agedPromotions++;
+            promoted = YES;
+        });
+        if (promoted) {
+            [strongSelf scheduleAgingForTask:strongTask];
+        }
+    });
 }
 
 - (void)cancelTask:(NSUUID *)taskId {
@@ -304,7 +665,10 @@
         [task cancel];
     }
     
-    [self.operationQueue cancelAllOperations];
+    for (NSOperationQueue *queue in self.laneQueues) {
+        [queue cancelAllOperations];
+    }
+    [self.preemptionQueue cancelAllOperations];
 }
 
 - (void)cancelTasksOfType:(CactusTaskType)type {
@@ -378,26 +742,52 @@
 }
 
 - (void)pause {
-    self.operationQueue.suspended = YES;
+    for (NSOperationQueue *queue in self.laneQueues) {
+        queue.suspended = YES;
+    }
+    self.preemptionQueue.suspended = YES;
 }
 
 - (void)resume {
-    self.operationQueue.suspended = NO;
+    for (NSOperationQueue *queue in self.laneQueues) {
+        queue.suspended = NO;
+    }
+    self.preemptionQueue.suspended = NO;
 }
 
 - (NSDictionary *)statistics {
     __block NSInteger pending = 0, running = 0, completed = 0, cancelled = 0, failed = 0;
+    __block NSInteger agedPromotions = 0, coalescedTasks = 0, cachedResultHits = 0;
+    NSMutableDictionary *lanes = [NSMutableDictionary dictionary];
     
     dispatch_sync(self.synchronizationQueue, ^{
+        NSInteger lanePending[CactusTaskLaneCount] = {0}, laneRunning[CactusTaskLaneCount] = {0}, lanePreempted[CactusTaskLaneCount] = {0};
         for (CactusTask *task in self.tasks.allValues) {
             switch (task.state) {
-                case CactusTaskStatePending: pending++; break;
-                case CactusTaskStateRunning: running++; break;
+                case CactusTaskStatePending: pending++; lanePending[task.lane]++; break;
+                case CactusTaskStateRunning: running++; laneRunning[task.lane]++; break;
                 case CactusTaskStateCompleted: completed++; break;
                 case CactusTaskStateCancelled: cancelled++; break;
                 case CactusTaskStateFailed: failed++; break;
             }
+            if (task.state == CactusTaskStateRunning && task.isPreempted) {
+                lanePreempted[task.lane]++;
+            }
+        }
+        
+        NSArray<NSString *> *laneNames = @[@"gpu", @"compute", @"io"];
+        for (NSInteger lane = 0; lane < CactusTaskLaneCount; lane++) {
+            lanes[laneNames[lane]] = @{
+                @"maxConcurrentTasks": @(self->_laneLimits[lane]),
+                @"pendingTasks": @(lanePending[lane]),
+                @"runningTasks": @(laneRunning[lane]),
+                @"preemptedTasks": @(lanePreempted[lane]),
+                @"preemptions": @(self->_lanePreemptions[lane])
+            };
         }
+        agedPromotions = self->_agedPromotions;
+        coalescedTasks = self->_coalescedTasks;
+        cachedResultHits = self->_cachedResultHits;
     });
     
     return @{
@@ -408,7 +798,12 @@
         @"cancelledTasks": @(cancelled),
         @"failedTasks": @(failed),
         @"maxConcurrentTasks": @(self.maxConcurrentTasks),
-        @"isRunning": @(self.isRunning)
+        @"isRunning": @(self.isRunning),
+        @"lanes": [lanes copy],
+        @"priorityAgingInterval": @(self.priorityAgingInterval),
+        @"agedPromotions": @(agedPromotions),
+        @"coalescedTasks": @(coalescedTasks),
+        @"cachedResultHits": @(cachedResultHits)
     };
 }
 
@@ -460,16 +855,30 @@
                         configuration:(id)configuration
                     completionHandler:(CactusTaskCompletionHandler)completionHandler {
     
-    CactusTask *task = [CactusTask taskWithType:CactusTaskTypeEmbedding
-                                       priority:CactusTaskPriorityNormal
-                                    description:[NSString stringWithFormat:@"Computing embedding for text: %@", [text substringToIndex:MIN(50, text.length)]]
-                                 executionBlock:^id(CactusTask *task, CactusTaskProgressHandler progress) {
-                                     // Implementation will be added when integrating with actual embedding
-                                     progress(1.0f);
-                                     return @{@"embedding": @[], @"dimensions": @768};
-                                 }];
-    
-    task.completionHandler = completionHandler;
+    CactusTask *task = [CactusTask embeddingJobWithTexts:@[text ?: @""]
+                                              dimensions:0
+                                              rowHandler:nil
+                                         progressHandler:nil
+                                       completionHandler:^(id result, NSError *error) {
+        if (!completionHandler) {
+            return;
+        }
+        NSDictionary *output = (NSDictionary *)result;
+        NSData *matrix = output[@"matrix"];
+        if (!matrix) {
+            completionHandler(nil, error);
+            return;
+        }
+        const float *values = (const float *)matrix.bytes;
+        NSUInteger dimension = matrix.length / sizeof(float);
+        NSMutableArray<NSNumber *> *embedding = [NSMutableArray arrayWithCapacity:dimension];
+        for (NSUInteger i = 0; i < dimension; i++) {
+            [embedding addObject:@(values[i])];
+        }
+        completionHandler(@{@"embedding": embedding, @"dimensions": @(dimension)}, error);
+    }];
+    // Several views embedding the same text share one run
+    task.coalescingKey = [@"embedding\x1f" stringByAppendingString:text ?: @""];
     return task;
 }
 
@@ -503,6 +912,9 @@
                                  }];
     
     task.completionHandler = completionHandler;
+    // Token counters re-tokenize the same text as it is displayed
+    NSString *media = [mediaPaths ?: @[] componentsJoinedByString:@"\x1f"];
+    task.coalescingKey = [NSString stringWithFormat:@"tokenization\x1f%@\x1f%@", text ?: @"", media];
     return task;
 }
 
@@ -16,7 +16,8 @@ typedef NS_ENUM(NSInteger, CactusContextRetentionStrategy) {
     CactusContextRetentionStrategySlidingWindow = 1,     // Keep last N messages
     CactusContextRetentionStrategySmartCompression = 2,  // Compress old messages
     CactusContextRetentionStrategySummaryBased = 3,      // Replace old with summary
-    CactusContextRetentionStrategyTokenBased = 4         // Keep within token limit
+    CactusContextRetentionStrategyTokenBased = 4,        // Keep within token limit
+    CactusContextRetentionStrategyKVStreaming = 5        // Keep messages, evict old tokens from the KV cache
 };
 
 // Context compression levels
@@ -58,6 +59,8 @@ typedef NS_ENUM(NSInteger, CactusContextCompressionLevel) {
 @property (nonatomic, assign) BOOL enableSmartCompression;
 @property (nonatomic, assign) BOOL enableTokenCounting;
 @property (nonatomic, assign) BOOL enableAutoCleanup;
+@property (nonatomic, assign) NSInteger streamingSinkTokens; // KV streaming: leading tokens always kept
+@property (nonatomic, assign) BOOL generatesModelSummaries;   // Summary mode: sessions write summaries in the background
 
 // Singleton
 + (instancetype)sharedManager;
@@ -74,9 +77,16 @@ typedef NS_ENUM(NSInteger, CactusContextCompressionLevel) {
 - (void)cleanupOldMessages:(NSMutableArray<CactusLLMMessage *> *)messages;
 - (NSArray<CactusLLMMessage *> *)createSummaryFromMessages:(NSArray<CactusLLMMessage *> *)messages;
 
+// Model summaries: the messages the next turn will summarise (nil when nothing new is needed),
+// and the cache the summary strategy reads from instead of the heuristic summary
+- (nullable NSArray<CactusLLMMessage *> *)messagesToSummarizeBeforeNextTurn:(NSArray<CactusLLMMessage *> *)messages;
+- (CactusLLMMessage *)cacheSummary:(NSString *)summary forMessages:(NSArray<CactusLLMMessage *> *)messages;
+- (nullable CactusLLMMessage *)cachedSummaryForMessages:(NSArray<CactusLLMMessage *> *)messages;
+
 // Token management
 - (NSInteger)estimateTokenCountForMessages:(NSArray<CactusLLMMessage *> *)messages;
 - (NSInteger)estimateTokenCountForText:(NSString *)text;
+- (NSInteger)tokenCountForMessage:(CactusLLMMessage *)message;
 - (BOOL)wouldExceedTokenLimit:(NSArray<CactusLLMMessage *> *)messages;
 
 // Statistics and monitoring
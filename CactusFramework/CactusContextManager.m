@@ -7,13 +7,19 @@
 
 #import "CactusContextManager.h"
 #import "CactusLLMMessage.h"
+#import "CactusModelManager.h"
+#import "CactusUtilities.h"
 
 @interface CactusContextManager ()
-@property (nonatomic, strong) NSMutableDictionary<NSString *, NSNumber *> *tokenCache;
+@property (nonatomic, strong) NSCache<NSString *, NSNumber *> *tokenCache;
+@property (nonatomic, strong) NSMapTable<CactusLLMMessage *, NSArray *> *messageTokenCache; // message -> @[content, tokens]
 @property (nonatomic, strong) NSMutableDictionary<NSString *, NSDate *> *lastCompressionCache;
+@property (nonatomic, strong) NSCache<NSString *, CactusLLMMessage *> *summaryCache;
 @property (nonatomic, strong) dispatch_queue_t processingQueue;
 @end
 
+static const NSInteger CactusSummaryRecentMessageCount = 10;
+
 @implementation CactusContextStats
 
 - (instancetype)initWithMessages:(NSArray<CactusLLMMessage *> *)messages {
@@ -64,14 +70,42 @@
         _enableSmartCompression = YES;
         _enableTokenCounting = YES;
         _enableAutoCleanup = YES;
+        _streamingSinkTokens = 4;
+        _generatesModelSummaries = NO;
         
-        _tokenCache = [NSMutableDictionary dictionary];
+        _tokenCache = [[NSCache alloc] init];
+        _tokenCache.countLimit = 1024;
+        _messageTokenCache = [NSMapTable weakToStrongObjectsMapTable];
         _lastCompressionCache = [NSMutableDictionary dictionary];
+        _summaryCache = [[NSCache alloc] init];
+        _summaryCache.countLimit = 16;
         _processingQueue = dispatch_queue_create("com.cactus.context.processing", DISPATCH_QUEUE_SERIAL);
+        
+        // Counts come from the loaded vocabulary, so they go stale when the model changes
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(invalidateTokenCounts)
+                                                     name:CactusModelManagerDidLoadModelNotification
+                                                   object:nil];
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(invalidateTokenCounts)
+                                                     name:CactusModelManagerDidUnloadModelNotification
+                                                   object:nil];
     }
     return self;
 }
 
+- (void)dealloc {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+}
+
+- (void)invalidateTokenCounts {
+    [self.tokenCache removeAllObjects];
+    [self.summaryCache removeAllObjects];
+    @synchronized(self.messageTokenCache) {
+        [self.messageTokenCache removeAllObjects];
+    }
+}
+
 #pragma mark - Configuration
 
 - (void)setMaxContextTokens:(NSInteger)maxTokens {
@@ -89,6 +123,11 @@
         return @[];
     }
     
+    // History is trimmed in the KV cache, rewriting text here would break the cached prefix
+    if (self.retentionStrategy == CactusContextRetentionStrategyKVStreaming) {
+        return messages;
+    }
+    
     // Check if optimization is needed
     if (![self wouldExceedTokenLimit:messages] && messages.count <= self.maxMessages) {
         return messages; // No optimization needed
@@ -125,6 +164,9 @@
         case CactusContextRetentionStrategyTokenBased:
             optimizedMessages = [self applyTokenBasedStrategy:messages];
             break;
+            
+        case CactusContextRetentionStrategyKVStreaming:
+            break;
     }
     
     // Final cleanup if still exceeds limits
@@ -199,7 +241,7 @@
     }
     
     // Keep recent messages (last 10)
-    NSInteger recentCount = MIN(10, messages.count);
+    NSInteger recentCount = MIN(CactusSummaryRecentMessageCount, messages.count);
     NSInteger startIndex = MAX(0, messages.count - recentCount);
     
     for (NSInteger i = startIndex; i < messages.count; i++) {
@@ -227,21 +269,22 @@
     for (CactusLLMMessage *message in messages) {
         if ([message.role isEqualToString:CactusLLMRoleSystem]) {
             [result addObject:message];
-            currentTokens += [self estimateTokenCountForText:message.content];
+            currentTokens += [self tokenCountForMessage:message];
             break;
         }
     }
     
     // Add messages from newest to oldest until token limit
+    NSUInteger insertIndex = result.count;
     for (NSInteger i = messages.count - 1; i >= 0; i--) {
         CactusLLMMessage *message = messages[i];
         if ([message.role isEqualToString:CactusLLMRoleSystem]) {
             continue; // Already added
         }
         
-        NSInteger messageTokens = [self estimateTokenCountForText:message.content];
+        NSInteger messageTokens = [self tokenCountForMessage:message];
         if (currentTokens + messageTokens <= self.maxContextTokens) {
-            [result insertObject:message atIndex:1]; // Insert after system message
+            [result insertObject:message atIndex:insertIndex]; // Insert after system message
             currentTokens += messageTokens;
         } else {
             break; // Token limit reached
@@ -408,6 +451,11 @@
         return @[];
     }
     
+    CactusLLMMessage *modelSummary = [self cachedSummaryForMessages:messages];
+    if (modelSummary) {
+        return @[modelSummary];
+    }
+    
     // Create a summary message
     NSString *summaryContent = [NSString stringWithFormat:@"[Previous conversation summary: %ld messages exchanged covering various topics. Context maintained for continuity.]", (long)messages.count];
     
@@ -417,39 +465,98 @@
     return @[summaryMessage];
 }
 
+- (NSString *)summaryKeyForMessages:(NSArray<CactusLLMMessage *> *)messages {
+    NSUInteger hash = messages.count;
+    for (CactusLLMMessage *message in messages) {
+        hash = hash * 31 + message.role.hash;
+        hash = hash * 31 + message.content.hash;
+        hash = hash * 31 + message.content.length;
+    }
+    return [NSString stringWithFormat:@"%lu:%lx", (unsigned long)messages.count, (unsigned long)hash];
+}
+
+- (NSArray<CactusLLMMessage *> *)messagesToSummarizeBeforeNextTurn:(NSArray<CactusLLMMessage *> *)messages {
+    if (!self.generatesModelSummaries || self.retentionStrategy != CactusContextRetentionStrategySummaryBased) {
+        return nil;
+    }
+    if (![self wouldExceedTokenLimit:messages] && (NSInteger)messages.count + 1 <= self.maxMessages) {
+        return nil;
+    }
+    
+    // The next turn adds the user's message, pushing one more message out of the recent window
+    NSInteger startIndex = (NSInteger)messages.count + 1 - CactusSummaryRecentMessageCount;
+    if (startIndex <= 0) {
+        return nil;
+    }
+    NSArray<CactusLLMMessage *> *olderMessages = [messages subarrayWithRange:NSMakeRange(0, startIndex)];
+    return [self cachedSummaryForMessages:olderMessages] ? nil : olderMessages;
+}
+
+- (CactusLLMMessage *)cacheSummary:(NSString *)summary forMessages:(NSArray<CactusLLMMessage *> *)messages {
+    // One message object per summary so its prompt token span is tokenized once and reused
+    NSString *content = [NSString stringWithFormat:@"[Summary of the earlier conversation: %@]", summary];
+    CactusLLMMessage *summaryMessage = [CactusLLMMessage messageWithRole:CactusLLMRoleSystem content:content];
+    [self.summaryCache setObject:summaryMessage forKey:[self summaryKeyForMessages:messages]];
+    return summaryMessage;
+}
+
+- (CactusLLMMessage *)cachedSummaryForMessages:(NSArray<CactusLLMMessage *> *)messages {
+    return [self.summaryCache objectForKey:[self summaryKeyForMessages:messages]];
+}
+
 #pragma mark - Token Management
 
 - (NSInteger)estimateTokenCountForMessages:(NSArray<CactusLLMMessage *> *)messages {
     NSInteger totalTokens = 0;
     
     for (CactusLLMMessage *message in messages) {
-        totalTokens += [self estimateTokenCountForText:message.content];
-        totalTokens += 4; // Account for role and formatting tokens
+        totalTokens += [self tokenCountForMessage:message];
     }
     
     return totalTokens;
 }
 
+- (NSInteger)tokenCountForMessage:(CactusLLMMessage *)message {
+    NSString *content = message.content ?: @"";
+    
+    // Each message is tokenized once; the entry is reused while its content is unchanged
+    @synchronized(self.messageTokenCache) {
+        NSArray *entry = [self.messageTokenCache objectForKey:message];
+        if (entry && [entry[0] isEqualToString:content]) {
+            return [entry[1] integerValue];
+        }
+    }
+    
+    NSInteger overhead = [CactusTokenizer chatTemplateOverheadTokens];
+    NSInteger tokens = [self estimateTokenCountForText:content] + (overhead >= 0 ? overhead : 4); // Role and formatting tokens
+    
+    @synchronized(self.messageTokenCache) {
+        [self.messageTokenCache setObject:@[[content copy], @(tokens)] forKey:message];
+    }
+    return tokens;
+}
+
 - (NSInteger)estimateTokenCountForText:(NSString *)text {
     if (!text || text.length == 0) {
         return 0;
     }
     
     // Check cache first
-    NSString *cacheKey = [NSString stringWithFormat:@"%ld", (long)text.length];
-    NSNumber *cachedTokens = self.tokenCache[cacheKey];
+    NSNumber *cachedTokens = [self.tokenCache objectForKey:text];
     if (cachedTokens) {
         return cachedTokens.integerValue;
     }
     
-    // Rough estimation: 1 token ≈ 4 characters (English text)
-    // This is a simplified approach; real tokenization would be more complex
-    NSInteger estimatedTokens = (text.length / 4) + 1;
+    // Exact count from the loaded vocabulary, falling back to 1 token ≈ 4 characters without a model
+    NSInteger exactTokens = [CactusTokenizer exactTokenCountForText:text];
+    if (exactTokens < 0) {
+        return (text.length / 4) + 1;
+    }
     
     // Cache the result
-    self.tokenCache[cacheKey] = @(estimatedTokens);
+    [self.tokenCache setObject:@(exactTokens) forKey:[text copy]];
     
-    return estimatedTokens;
+    return exactTokens;
 }
 
 - (BOOL)wouldExceedTokenLimit:(NSArray<CactusLLMMessage *> *)messages {
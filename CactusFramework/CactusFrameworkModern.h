@@ -105,6 +105,15 @@ NS_ASSUME_NONNULL_BEGIN
 - (void)generateEmbeddingForText:(NSString *)text
                completionHandler:(void(^)(NSArray<NSNumber *> * _Nullable embedding, NSError * _Nullable error))completionHandler;
 
+// Batched embeddings: texts.count rows of dimension floats, row-major
+- (void)generateEmbeddingsForTexts:(NSArray<NSString *> *)texts
+                 completionHandler:(void(^)(NSData * _Nullable matrix, NSInteger dimension, NSError * _Nullable error))completionHandler;
+
+// Matryoshka models: keeps the leading dimensions, normalized after truncation; 0 keeps all
+- (void)generateEmbeddingsForTexts:(NSArray<NSString *> *)texts
+                        dimensions:(NSInteger)dimensions
+                 completionHandler:(void(^)(NSData * _Nullable matrix, NSInteger dimension, NSError * _Nullable error))completionHandler;
+
 // MARK: - Tokenization Methods
 
 - (NSArray<NSNumber *> *)tokenizeText:(NSString *)text;
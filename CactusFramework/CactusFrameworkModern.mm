@@ -313,6 +313,28 @@
     }];
 }
 
+- (void)generateEmbeddingsForTexts:(NSArray<NSString *> *)texts
+                 completionHandler:(void(^)(NSData * _Nullable matrix, NSInteger dimension, NSError * _Nullable error))completionHandler {
+    [self generateEmbeddingsForTexts:texts dimensions:0 completionHandler:completionHandler];
+}
+
+- (void)generateEmbeddingsForTexts:(NSArray<NSString *> *)texts
+                        dimensions:(NSInteger)dimensions
+                 completionHandler:(void(^)(NSData * _Nullable matrix, NSInteger dimension, NSError * _Nullable error))completionHandler {
+    
+    if (!self.isModelLoaded) {
+        NSError *error = [NSError cactusErrorWithCode:CactusLLMErrorModelNotLoaded
+                                          description:@"Model not loaded"];
+        if (completionHandler) {
+            completionHandler(nil, 0, error);
+        }
+        return;
+    }
+    
+    CactusSession *session = [CactusSession embeddingSessionWithId:nil];
+    [session generateEmbeddingsForTexts:texts dimensions:dimensions completionHandler:completionHandler];
+}
+
 #pragma mark - Tokenization Methods
 
 - (NSArray<NSNumber *> *)tokenizeText:(NSString *)text {
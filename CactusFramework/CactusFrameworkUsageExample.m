@@ -322,7 +322,8 @@
                                      executionBlock:^id(CactusTask *task, CactusTaskProgressHandler progressHandler) {
             // Simulate work
             for (int j = 0; j < 10; j++) {
-                if (task.isCancelled) break;
+                // Parks here while a higher-priority task borrows the lane
+                if (![task yieldIfPreempted]) break;
                 
                 [NSThread sleepForTimeInterval:0.1];
                 progressHandler((float)j / 10.0f);
@@ -331,6 +332,7 @@
             return [NSString stringWithFormat:@"Task %@ completed", task.taskId.UUIDString];
         }];
         
+        task.preemptible = YES;
         task.progressHandler = ^(float progress) {
             NSLog(@"Task %@ progress: %.1f%%", task.taskId.UUIDString, progress * 100);
         };
@@ -22,7 +22,9 @@ typedef NS_ENUM(NSInteger, CactusLLMError) {
     CactusLLMErrorLoRAApplicationFailed= -12,
     CactusLLMErrorTokenizationFailed   = -13,
     CactusLLMErrorDetokenizationFailed = -14,
-    CactusLLMErrorInvalidModel         = -15
+    CactusLLMErrorInvalidModel         = -15,
+    CactusLLMErrorInsufficientMemory   = -16,
+    CactusLLMErrorControlVectorFailed  = -17
     
 };
 
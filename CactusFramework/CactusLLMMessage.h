@@ -21,6 +21,8 @@ FOUNDATION_EXPORT CactusLLMRole const CactusLLMRoleTool; // cho function-calling
 @property (nonatomic, strong) NSDictionary *tools;
 @property (nonatomic, copy, nullable) NSString *name;     // tên tool (nếu role=tool)
 @property (nonatomic, copy, nullable) NSString *toolCall; // JSON yêu cầu tool (nếu assistant sinh ra)
+@property (nonatomic, copy, nullable) NSData *cachedPromptTokens;      // llama_token span this message adds to a templated prompt
+@property (nonatomic, copy, nullable) NSString *cachedPromptTokensKey; // model/template the span was rendered with; cleared when role or content change
 + (instancetype)messageWithRole:(CactusLLMRole)role content:(NSString *)content;
 + (instancetype)messageWithTools:(NSDictionary *)tools content:(NSString *)content;
 - (NSDictionary *)dictionary;
@@ -28,6 +28,16 @@ CactusLLMRole const CactusLLMRoleTool      = @"tool";
     return m;
 }
 
+- (void)setRole:(CactusLLMRole)role {
+    _role = [role copy];
+    _cachedPromptTokens = nil;
+}
+
+- (void)setContent:(NSString *)content {
+    _content = [content copy];
+    _cachedPromptTokens = nil;
+}
+
 - (NSDictionary *)dictionary {
     NSDictionary *prompt = [NSDictionary dictionaryWithObjectsAndKeys:self.role, @"role", self.content, @"content", nil];
     return prompt;
@@ -22,23 +22,49 @@ NS_ASSUME_NONNULL_BEGIN
 @property (nonatomic, assign) NSInteger ubatchSize;         // Default: 512
 @property (nonatomic, assign) NSInteger gpuLayers;          // Default: -1 (auto)
 @property (nonatomic, assign) NSInteger threads;            // Default: 0 (auto)
+@property (nonatomic, assign) NSInteger batchThreads;       // Default: 0 (same as threads, used for prefill)
+@property (nonatomic, assign) BOOL autoTuneThreads;         // Default: NO (benchmark thread counts at first load)
+@property (nonatomic, assign) BOOL autoTuneBatchSize;       // Default: NO (benchmark prefill ubatch sizes at first load and pick ubatchSize)
+@property (nonatomic, assign) NSInteger batchTuneMemoryLimit; // Default: 0 (with autoTuneBatchSize, bytes of backend buffers a ubatch size may use; 0 = no limit)
+@property (nonatomic, assign) BOOL autoPlaceLayers;         // Default: NO (time layers on CPU and GPU at first load and pick gpuLayers)
+@property (nonatomic, assign) BOOL keepTiedOutputOnCPU;     // Default: NO (with autoPlaceLayers, never offload a head sharing the token embeddings)
+@property (nonatomic, assign) NSInteger maxSequences;       // Default: 1 (KV sequences, one per session; an idle session's is taken over when all are held)
 
 // Memory Management
 @property (nonatomic, assign) BOOL useMMap;                 // Default: YES
 @property (nonatomic, assign) BOOL useMLock;                // Default: NO
 @property (nonatomic, assign) BOOL flashAttention;          // Default: YES
+@property (nonatomic, assign) BOOL warmUpOnLoad;            // Default: YES (prefill + decode warm-up)
 
 // Cache Configuration
 @property (nonatomic, copy, nullable) NSString *cacheTypeK; // Default: "f16"
 @property (nonatomic, copy, nullable) NSString *cacheTypeV; // Default: "f16"
+@property (nonatomic, assign) NSInteger kvDefragMaxCells;   // Default: 512 (KV cells a decode moves defragmenting, the rest on later decodes; 0 = all at once)
+@property (nonatomic, assign) NSInteger computeShrinkMs;    // Default: 10000 (compute buffers sized for decode, grown by prefills and shrunk after this long without one; 0 = worst case up front)
+@property (nonatomic, assign) NSInteger stateCheckpoints;   // Default: 4 (recurrent models: state snapshots per sequence that speculative decoding and prompt reuse roll back to; 0 = none)
+@property (nonatomic, assign) NSInteger stateCheckpointInterval; // Default: 256 (recurrent models: tokens between automatic snapshots; 0 = only before speculative drafts)
+@property (nonatomic, assign) NSInteger kvRecentCells;      // Default: 0 (with a q8_0/q4_0 cache, the newest cells kept in f16 and older ones requantized; disables flash attention)
 
 // Chat Template
 @property (nonatomic, copy, nullable) NSString *chatTemplate;
 
+// Speculative Decoding
+@property (nonatomic, copy, nullable) NSString *draftModelPath;     // Draft model sharing the target vocabulary
+@property (nonatomic, assign) NSInteger draftMaxTokens;             // Default: 16
+
+// Prompt Cache
+@property (nonatomic, copy, nullable) NSString *promptCacheDirectory; // Persisted prompt KV state, nil to disable
+@property (nonatomic, assign) NSInteger prefixCacheSequences;       // Default: 0 (extra KV sequences holding prompt prefixes shared by sessions)
+@property (nonatomic, assign) NSInteger prefixCacheCapacity;        // Default: 0 (half the context, in tokens)
+@property (nonatomic, copy, nullable) NSString *kvSpillDirectory;    // Idle sessions' KV state moved to flash, nil to disable
+@property (nonatomic, copy) NSString *kvSpillCacheType;             // Default: "q8_0" ("q4_0", or "f16" to keep the cache's types)
+
 // Embedding Configuration
 @property (nonatomic, assign) BOOL enableEmbedding;         // Default: NO
 @property (nonatomic, assign) NSInteger poolingType;        // Default: 0
 @property (nonatomic, assign) NSInteger embeddingNormalize; // Default: -1
+@property (nonatomic, copy, nullable) NSString *embeddingCacheDirectory; // Persisted embedding rows, nil to disable
+@property (nonatomic, assign) NSInteger embeddingCacheCapacity;        // Default: 4096 rows
 
 // Progress Callback
 @property (nonatomic, copy, nullable) void (^progressCallback)(float progress);
@@ -54,6 +80,14 @@ NS_ASSUME_NONNULL_BEGIN
 
 // MARK: - Generation Configuration
 
+// Prompt truncation strategies, applied when a prompt does not fit the context
+typedef NS_ENUM(NSInteger, CactusTruncationStrategy) {
+    CactusTruncationStrategyKeepTail = 0,          // Drop just after the kept head (default)
+    CactusTruncationStrategyKeepHead = 1,          // Drop the end of the prompt
+    CactusTruncationStrategyMiddleOut = 2,         // Drop from the middle
+    CactusTruncationStrategyMessageBoundary = 3    // Drop whole chat messages after the first
+};
+
 @interface CactusGenerationConfiguration : NSObject <NSCopying>
 
 // Generation Parameters
@@ -82,9 +116,31 @@ NS_ASSUME_NONNULL_BEGIN
 
 // Grammar
 @property (nonatomic, copy, nullable) NSString *grammar;
+@property (nonatomic, assign) BOOL grammarFastForward;      // Default: NO
 
 // Token Probabilities
 @property (nonatomic, assign) NSInteger nProbs;             // Default: 0
+@property (nonatomic, assign) NSInteger probsHistoryLimit;  // Default: 0 (unbounded)
+@property (nonatomic, assign) BOOL leanSampling;            // Default: NO
+
+// Context Shift
+@property (nonatomic, assign) float contextShiftDiscardFraction; // Default: 0.5
+@property (nonatomic, assign) CactusTruncationStrategy truncationStrategy; // Default: CactusTruncationStrategyKeepTail
+
+// Prompt Lookup Speculation
+@property (nonatomic, assign) NSInteger promptLookupNgramSize; // Default: 0 (disabled)
+
+// Self-Speculation
+@property (nonatomic, assign) NSInteger selfSpeculationSkipLayers; // Default: 0 (disabled); layers skipped by the draft pass
+
+// Deadline
+@property (nonatomic, assign) NSTimeInterval timeoutInterval; // Default: 0 (no deadline)
+
+// Thermal
+@property (nonatomic, assign) BOOL thermalThrottling;       // Default: YES (fewer threads, smaller batches and token pacing as the device heats up)
+
+// Tracing
+@property (nonatomic, assign) BOOL traceStages;             // Default: NO (per-stage spans in metadata["trace"] and os_signpost intervals)
 
 // Factory methods
 + (instancetype)defaultConfiguration;
@@ -108,12 +164,18 @@ NS_ASSUME_NONNULL_BEGIN
 @property (nonatomic, assign) BOOL enableVision;            // Default: YES
 @property (nonatomic, assign) BOOL enableAudio;             // Default: YES
 
+// Projector speed/accuracy trade-offs
+@property (nonatomic, copy, nullable) NSString *projectorWeightType; // e.g. "q8_0" to requantize f16 weights at load; Default: as stored
+@property (nonatomic, assign) NSInteger maxImageSide;       // Caps dynamic-resolution projectors (fewer image tokens); Default: 0 (model default)
+@property (nonatomic, assign) NSInteger maxImageSlices;     // Caps the tiles a slicing projector cuts an image into; Default: 0 (model default)
+
 // TTS/Vocoder Configuration
 @property (nonatomic, copy, nullable) NSString *vocoderPath;
 
 + (instancetype)defaultConfiguration;
 + (instancetype)visionOnlyConfiguration;
 + (instancetype)audioOnlyConfiguration;
++ (instancetype)fastConfiguration;                          // q8_0 projector, 448 px, one slice: for live camera flows
 
 @end
 
@@ -137,4 +199,26 @@ NS_ASSUME_NONNULL_BEGIN
 
 @end
 
+// MARK: - Control Vector Configuration
+
+@interface CactusControlVector : NSObject <NSCopying>
+
+@property (nonatomic, copy) NSString *path;                 // GGUF with direction.<layer> tensors
+@property (nonatomic, assign) float strength;               // Default: 1.0, negative steers away
+
++ (instancetype)vectorWithPath:(NSString *)path;
++ (instancetype)vectorWithPath:(NSString *)path strength:(float)strength;
+
+@end
+
+@interface CactusControlVectorConfiguration : NSObject <NSCopying>
+
+@property (nonatomic, copy) NSArray<CactusControlVector *> *vectors;
+@property (nonatomic, assign) NSInteger layerStart;         // Default: 0, from layer 1
+@property (nonatomic, assign) NSInteger layerEnd;           // Default: 0, through the last layer
+
++ (instancetype)configurationWithVectors:(NSArray<CactusControlVector *> *)vectors;
+
+@end
+
 NS_ASSUME_NONNULL_END
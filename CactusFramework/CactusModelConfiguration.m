@@ -18,14 +18,29 @@
         _ubatchSize = 512;
         _gpuLayers = 0;
         _threads = 0;
+        _batchThreads = 0;
+        _autoTuneThreads = NO;
+        _autoTuneBatchSize = NO;
+        _batchTuneMemoryLimit = 0;
+        _autoPlaceLayers = NO;
+        _keepTiedOutputOnCPU = NO;
+        _maxSequences = 1;
+        _draftMaxTokens = 16;
         _useMMap = YES;
         _useMLock = NO;
+        _warmUpOnLoad = YES;
         _flashAttention = YES;
         _cacheTypeK = @"f16";
         _cacheTypeV = @"f16";
+        _kvDefragMaxCells = 512;
+        _computeShrinkMs = 10000;
+        _stateCheckpoints = 4;
+        _stateCheckpointInterval = 256;
         _enableEmbedding = NO;
         _poolingType = 0;
         _embeddingNormalize = -1;
+        _embeddingCacheCapacity = 4096;
+        _kvSpillCacheType = @"q8_0";
     }
     return self;
 }
@@ -71,6 +86,15 @@
         return NO;
     }
     
+    if (self.maxSequences <= 0) {
+        if (error) {
+            *error = [NSError errorWithDomain:CactusLLMErrorDomain
+                                         code:CactusLLMErrorInvalidArgument
+                                     userInfo:@{NSLocalizedDescriptionKey: @"Max sequences must be positive"}];
+        }
+        return NO;
+    }
+    
     return YES;
 }
 
@@ -78,19 +102,41 @@
     CactusModelConfiguration *copy = [[CactusModelConfiguration alloc] init];
     copy.modelPath = [self.modelPath copyWithZone:zone];
     copy.contextSize = self.contextSize;
+    copy.maxSequences = self.maxSequences;
     copy.batchSize = self.batchSize;
     copy.ubatchSize = self.ubatchSize;
     copy.gpuLayers = self.gpuLayers;
     copy.threads = self.threads;
+    copy.batchThreads = self.batchThreads;
+    copy.autoTuneThreads = self.autoTuneThreads;
+    copy.autoTuneBatchSize = self.autoTuneBatchSize;
+    copy.batchTuneMemoryLimit = self.batchTuneMemoryLimit;
+    copy.autoPlaceLayers = self.autoPlaceLayers;
+    copy.keepTiedOutputOnCPU = self.keepTiedOutputOnCPU;
     copy.useMMap = self.useMMap;
     copy.useMLock = self.useMLock;
+    copy.warmUpOnLoad = self.warmUpOnLoad;
     copy.flashAttention = self.flashAttention;
     copy.cacheTypeK = [self.cacheTypeK copyWithZone:zone];
     copy.cacheTypeV = [self.cacheTypeV copyWithZone:zone];
+    copy.kvDefragMaxCells = self.kvDefragMaxCells;
+    copy.computeShrinkMs = self.computeShrinkMs;
+    copy.stateCheckpoints = self.stateCheckpoints;
+    copy.stateCheckpointInterval = self.stateCheckpointInterval;
+    copy.kvRecentCells = self.kvRecentCells;
     copy.chatTemplate = [self.chatTemplate copyWithZone:zone];
+    copy.promptCacheDirectory = [self.promptCacheDirectory copyWithZone:zone];
+    copy.prefixCacheSequences = self.prefixCacheSequences;
+    copy.prefixCacheCapacity = self.prefixCacheCapacity;
+    copy.kvSpillDirectory = [self.kvSpillDirectory copyWithZone:zone];
+    copy.kvSpillCacheType = [self.kvSpillCacheType copyWithZone:zone];
+    copy.draftModelPath = [self.draftModelPath copyWithZone:zone];
+    copy.draftMaxTokens = self.draftMaxTokens;
     copy.enableEmbedding = self.enableEmbedding;
     copy.poolingType = self.poolingType;
     copy.embeddingNormalize = self.embeddingNormalize;
+    copy.embeddingCacheDirectory = [self.embeddingCacheDirectory copyWithZone:zone];
+    copy.embeddingCacheCapacity = self.embeddingCacheCapacity;
     copy.progressCallback = [self.progressCallback copyWithZone:zone];
     return copy;
 }
@@ -120,6 +166,16 @@
         _mirostatEta = 0.1f;
         _ignoreEOS = NO;
         _nProbs = 0;
+        _promptLookupNgramSize = 0;
+        _selfSpeculationSkipLayers = 0;
+        _contextShiftDiscardFraction = 0.5f;
+        _timeoutInterval = 0;
+        _grammarFastForward = NO;
+        _truncationStrategy = CactusTruncationStrategyKeepTail;
+        _probsHistoryLimit = 0;
+        _leanSampling = NO;
+        _thermalThrottling = YES;
+        _traceStages = NO;
     }
     return self;
 }
@@ -174,7 +230,17 @@
     copy.ignoreEOS = self.ignoreEOS;
     copy.stopSequences = [self.stopSequences copyWithZone:zone];
     copy.grammar = [self.grammar copyWithZone:zone];
+    copy.grammarFastForward = self.grammarFastForward;
     copy.nProbs = self.nProbs;
+    copy.promptLookupNgramSize = self.promptLookupNgramSize;
+    copy.selfSpeculationSkipLayers = self.selfSpeculationSkipLayers;
+    copy.contextShiftDiscardFraction = self.contextShiftDiscardFraction;
+    copy.timeoutInterval = self.timeoutInterval;
+    copy.truncationStrategy = self.truncationStrategy;
+    copy.probsHistoryLimit = self.probsHistoryLimit;
+    copy.leanSampling = self.leanSampling;
+    copy.thermalThrottling = self.thermalThrottling;
+    copy.traceStages = self.traceStages;
     return copy;
 }
 
@@ -254,12 +320,23 @@
     return config;
 }
 
++ (instancetype)fastConfiguration {
+    CactusMultimodalConfiguration *config = [self defaultConfiguration];
+    config.projectorWeightType = @"q8_0";
+    config.maxImageSide = 448;
+    config.maxImageSlices = 1;
+    return config;
+}
+
 - (id)copyWithZone:(NSZone *)zone {
     CactusMultimodalConfiguration *copy = [[CactusMultimodalConfiguration alloc] init];
     copy.mmprojPath = [self.mmprojPath copyWithZone:zone];
     copy.useGPU = self.useGPU;
     copy.enableVision = self.enableVision;
     copy.enableAudio = self.enableAudio;
+    copy.projectorWeightType = [self.projectorWeightType copyWithZone:zone];
+    copy.maxImageSide = self.maxImageSide;
+    copy.maxImageSlices = self.maxImageSlices;
     copy.vocoderPath = [self.vocoderPath copyWithZone:zone];
     return copy;
 }
@@ -315,3 +392,55 @@
 }
 
 @end
+
+// MARK: - Control Vector Implementation
+
+@implementation CactusControlVector
+
+- (instancetype)init {
+    if (self = [super init]) {
+        _strength = 1.0f;
+    }
+    return self;
+}
+
++ (instancetype)vectorWithPath:(NSString *)path {
+    CactusControlVector *vector = [[self alloc] init];
+    vector.path = path;
+    return vector;
+}
+
++ (instancetype)vectorWithPath:(NSString *)path strength:(float)strength {
+    CactusControlVector *vector = [self vectorWithPath:path];
+    vector.strength = strength;
+    return vector;
+}
+
+- (id)copyWithZone:(NSZone *)zone {
+    CactusControlVector *copy = [[CactusControlVector alloc] init];
+    copy.path = [self.path copyWithZone:zone];
+    copy.strength = self.strength;
+    return copy;
+}
+
+@end
+
+// MARK: - Control Vector Configuration Implementation
+
+@implementation CactusControlVectorConfiguration
+
++ (instancetype)configurationWithVectors:(NSArray<CactusControlVector *> *)vectors {
+    CactusControlVectorConfiguration *config = [[self alloc] init];
+    config.vectors = vectors;
+    return config;
+}
+
+- (id)copyWithZone:(NSZone *)zone {
+    CactusControlVectorConfiguration *copy = [[CactusControlVectorConfiguration alloc] init];
+    copy.vectors = [self.vectors copyWithZone:zone];
+    copy.layerStart = self.layerStart;
+    copy.layerEnd = self.layerEnd;
+    return copy;
+}
+
+@end
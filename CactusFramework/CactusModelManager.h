@@ -22,6 +22,21 @@ typedef NS_ENUM(NSInteger, CactusModelState) {
     CactusModelStateError = 3
 };
 
+// Memory-pressure relief steps, applied in this order
+typedef NS_ENUM(NSInteger, CactusMemoryReliefStep) {
+    CactusMemoryReliefStepCompactKVCache = 0,   // shrink compute buffers to decode size, quantize the KV cache to q8_0 or halve the context
+    CactusMemoryReliefStepReleaseAuxiliary = 1, // multimodal projector, vocoder and draft model
+    CactusMemoryReliefStepReleaseCompute = 2,   // KV cache and compute buffers; rebuilt on next use
+    CactusMemoryReliefStepUnloadWeights = 3     // weights; reloadModel maps the file again
+};
+
+// What a sequence drops when it reaches its KV cell quota
+typedef NS_ENUM(NSInteger, CactusKVEvictionPolicy) {
+    CactusKVEvictionPolicyNone = 0,   // the decode fails instead
+    CactusKVEvictionPolicyOldest = 1, // its oldest cells
+    CactusKVEvictionPolicySink = 2    // its oldest cells after the first sinkCells (StreamingLLM)
+};
+
 // MARK: - Model Manager Delegate
 
 @protocol CactusModelManagerDelegate <NSObject>
@@ -31,6 +46,7 @@ typedef NS_ENUM(NSInteger, CactusModelState) {
 - (void)modelManager:(CactusModelManager *)manager didFailToLoadWithError:(NSError *)error;
 - (void)modelManager:(CactusModelManager *)manager didUpdateLoadingProgress:(float)progress;
 - (void)modelManagerDidUnloadModel:(CactusModelManager *)manager;
+- (void)modelManager:(CactusModelManager *)manager didReclaimMemory:(uint64_t)bytes withStep:(CactusMemoryReliefStep)step;
 @end
 
 // MARK: - Model Manager
@@ -44,6 +60,14 @@ typedef NS_ENUM(NSInteger, CactusModelState) {
 @property (nonatomic, readonly, nullable) NSError *lastError;
 @property (nonatomic, readonly) BOOL isLoaded;
 @property (nonatomic, readonly) BOOL isLoading;
+@property (nonatomic, assign) BOOL respondsToMemoryPressure; // Default: YES
+// Keep warm: while YES the Metal buffers (weights, KV cache) are held resident so the first token
+// after an idle spell does not wait for them to be paged back in. Residency is always released
+// while the app is in the background and requested again when it returns. Needs iOS 18; Default: YES
+@property (nonatomic, assign) BOOL keepWarm;
+@property (nonatomic, readonly) NSInteger memoryReliefLevel; // relief steps in effect, 0 when none
+@property (nonatomic, readonly, nullable) CactusModelConfiguration *preloadedConfiguration;
+@property (nonatomic, readonly) BOOL hasPreloadedModel;
 
 // Singleton access
 + (instancetype)sharedManager;
@@ -56,13 +80,32 @@ typedef NS_ENUM(NSInteger, CactusModelState) {
                    progressHandler:(nullable CactusTaskProgressHandler)progressHandler
                  completionHandler:(nullable void(^)(BOOL success, NSError * _Nullable error))completionHandler;
 
+// Loads the model, its projector and the configuration's vocoder in parallel, with one progress
+// over all three files. Fails as a whole: no model stays loaded when any part fails.
+- (void)loadModelWithConfiguration:(CactusModelConfiguration *)configuration
+           multimodalConfiguration:(nullable CactusMultimodalConfiguration *)multimodalConfiguration
+                   progressHandler:(nullable CactusTaskProgressHandler)progressHandler
+                 completionHandler:(nullable void(^)(BOOL success, NSError * _Nullable error))completionHandler;
+
 - (void)unloadModelWithCompletionHandler:(nullable void(^)(void))completionHandler;
 
 - (void)reloadModelWithCompletionHandler:(nullable void(^)(BOOL success, NSError * _Nullable error))completionHandler;
 
+// Hot swap: loads and warms up a second model next to the current one, then swaps it in once
+// no completion is running. Preloading fails with CactusLLMErrorInsufficientMemory when both
+// models would not fit in the memory left to the process.
+- (void)preloadModelWithConfiguration:(CactusModelConfiguration *)configuration
+                    completionHandler:(nullable void(^)(BOOL success, NSError * _Nullable error))completionHandler;
+- (void)swapToPreloadedModelWithCompletionHandler:(nullable void(^)(BOOL success, NSError * _Nullable error))completionHandler;
+- (void)discardPreloadedModel;
+
 // Model information
 - (nullable NSDictionary *)getModelInfoForPath:(NSString *)modelPath;
 - (nullable NSDictionary *)getCurrentModelInfo;
+// @{@"hits", @"misses", @"entries", @"capacity"} of the embedding cache, nil when it is disabled
+- (nullable NSDictionary *)embeddingCacheStatistics;
+// @{@"fragmentation", @"steps", @"cellsMoved", @"bytesMoved", @"pending"} of the KV defrag, nil without a context
+- (nullable NSDictionary *)kvDefragStatistics;
 
 // Model validation
 - (BOOL)validateConfiguration:(CactusModelConfiguration *)configuration error:(NSError **)error;
@@ -75,18 +118,57 @@ typedef NS_ENUM(NSInteger, CactusModelState) {
 - (BOOL)isVisionSupported;
 - (BOOL)isAudioSupported;
 
+// In-memory audio (16 kHz mono float PCM). The returned reference can be passed among media paths
+// until released; a stream's spectrogram is computed as samples are pushed from the capture callback.
+- (nullable NSString *)addAudioSamples:(const float *)samples count:(NSUInteger)count;
+- (nullable NSString *)beginAudioStream;
+- (BOOL)pushAudioSamples:(const float *)samples count:(NSUInteger)count toStream:(NSString *)reference;
+- (void)releaseAudio:(NSString *)reference;
+
 // LoRA support
 - (BOOL)applyLoRAConfiguration:(CactusLoRAConfiguration *)configuration
                          error:(NSError **)error;
 - (void)removeAllLoRAAdapters;
 - (NSArray<CactusLoRAAdapter *> *)loadedLoRAAdapters;
 
+// Control vectors, summed with their strengths into one direction per layer. Files are parsed
+// once; applying another set or other strengths between requests keeps the compute graph.
+- (BOOL)applyControlVectorConfiguration:(CactusControlVectorConfiguration *)configuration
+                                  error:(NSError **)error;
+- (void)removeControlVectors;
+
 // Context management
 - (void)clearContext;
 - (void)resetSampling;
-
-// Internal context access (for other framework components)
+- (void)releaseSequence:(NSInteger)sequenceId;
+// Caps the KV cells of a sequence so one long generation cannot starve the others; 0 cells removes the cap
+- (BOOL)setKVQuota:(NSInteger)maxCells policy:(CactusKVEvictionPolicy)policy sinkCells:(NSInteger)sinkCells forSequence:(NSInteger)sequenceId;
+// Finishes the KV defrag at once, for idle time between completions; NO when nothing moved or one is running
+- (BOOL)defragmentKVCache;
+
+// Embedding context over the loaded weights, so chat and embedding (e.g. for RAG) run side by side
+// without a second copy of the model. Its context size, pooling, KV types and threads come from
+// `configuration`, whose model path is ignored and where embedding is always enabled. It is
+// released with the model and by CactusMemoryReliefStepReleaseAuxiliary.
+- (BOOL)attachEmbeddingContextWithConfiguration:(CactusModelConfiguration *)configuration error:(NSError **)error;
+- (void)detachEmbeddingContext;
+- (BOOL)hasEmbeddingContext;
+// Float vector from the embedding context, or from the model context when it has embedding
+// enabled; `dimensions` <= 0 keeps the model's width. nil when neither can embed.
+- (nullable NSData *)embeddingForText:(NSString *)text dimensions:(NSInteger)dimensions;
+
+// Memory pressure: applies every step up to and including `step` that is not already in effect
+// and returns the bytes reclaimed
+- (uint64_t)relieveMemoryThroughStep:(CactusMemoryReliefStep)step;
+
+// Internal context access (for other framework components); nil while the compute context
+// dropped under memory pressure cannot be rebuilt
 - (nullable void *)internalContext;
+// Holds the context for a generation job, rebuilding its compute context first: memory relief
+// waits for every holder to call releaseContext. nil (nothing held) when there is no context.
+- (nullable void *)acquireContext;
+- (void)releaseContext;
+- (nullable void *)internalEmbeddingContext;
 
 @end
 
@@ -94,13 +176,17 @@ typedef NS_ENUM(NSInteger, CactusModelState) {
 
 @interface CactusModelManager (Utilities)
 
-// Quick model info without loading
+// Quick model info without loading: file attributes plus the GGUF header metadata (architecture,
+// quantization, context length, vocab size, chat template), cached on disk by path, size and mtime
 + (nullable NSDictionary *)quickModelInfoForPath:(NSString *)modelPath;
 
+// The same for a catalog scan, saving the index once; missing files are left out
++ (NSArray<NSDictionary *> *)quickModelInfoForPaths:(NSArray<NSString *> *)modelPaths;
+
 // Device capabilities
 + (NSDictionary *)deviceCapabilities;
 
-// Memory management
+// Memory management (compacts the KV cache and releases auxiliary models)
 + (void)freeUnusedMemory;
 
 @end
@@ -118,4 +204,19 @@ extern NSString * const CactusModelManagerModelInfoKey;
 extern NSString * const CactusModelManagerErrorKey;
 extern NSString * const CactusModelManagerProgressKey;
 
+#ifdef __cplusplus
+// acquireContext for the enclosing scope
+struct CactusContextLease {
+    void * _Nullable context;
+    CactusContextLease() : context([[CactusModelManager sharedManager] acquireContext]) {}
+    ~CactusContextLease() {
+        if (context) {
+            [[CactusModelManager sharedManager] releaseContext];
+        }
+    }
+    CactusContextLease(const CactusContextLease &) = delete;
+    CactusContextLease &operator=(const CactusContextLease &) = delete;
+};
+#endif
+
 NS_ASSUME_NONNULL_END
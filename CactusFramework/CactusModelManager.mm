@@ -6,10 +6,19 @@
 #import "CactusModelManager.h"
 #import "CactusLLMError.h"
 #import "CactusBackgroundProcessor.h"
+#import "CactusUtilities.h"
 #import "cactus/cactus.h"
 #import "cactus/common.h"
+#import "cactus/ggml-metal.h"
 #import "cactus/llama-vocab.h"
+#import <mach/mach.h>
+#import <os/proc.h>
+#import <sys/sysctl.h>
+#import <CommonCrypto/CommonDigest.h>
 #import <mutex>
+#if TARGET_OS_IPHONE
+#import <UIKit/UIKit.h>
+#endif
 
 // Notification names
 NSNotificationName const CactusModelManagerDidChangeStateNotification = @"CactusModelManagerDidChangeStateNotification";
@@ -29,12 +38,118 @@ NSString * const CactusModelManagerProgressKey = @"progress";
 @property (nonatomic, strong, nullable) NSDictionary *modelInfo;
 @property (nonatomic, strong, nullable) NSError *lastError;
 @property (nonatomic, strong) dispatch_queue_t synchronizationQueue;
+@property (nonatomic, strong) dispatch_source_t memoryPressureSource;
+@property (nonatomic, readwrite) NSInteger memoryReliefLevel;
+@property (nonatomic, strong, nullable) CactusModelConfiguration *preloadedConfiguration;
 @end
 
+static uint64_t CactusPhysicalFootprint(void) {
+    task_vm_info_data_t info;
+    mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+    if (task_info(mach_task_self(), TASK_VM_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) {
+        return 0;
+    }
+    return info.phys_footprint;
+}
+
+static const NSTimeInterval CactusSwapPollInterval = 0.05;
+
+static NSString * const CactusTunedThreadsDefaultsKey = @"CactusTunedThreads";
+static NSString * const CactusLayerPlacementDefaultsKey = @"CactusLayerPlacement";
+static NSString * const CactusTunedBatchSizeDefaultsKey = @"CactusTunedBatchSize";
+static const NSUInteger CactusModelFingerprintBytes = 1 << 20;
+static const NSUInteger CactusMaxThreadCandidates = 6;
+
+static NSInteger CactusSysctlInteger(const char *name) {
+    int value = 0;
+    size_t size = sizeof(value);
+    if (sysctlbyname(name, &value, &size, NULL, 0) != 0) {
+        return 0;
+    }
+    return value;
+}
+
+static NSString *CactusDeviceMachine(void) {
+    size_t size = 0;
+    if (sysctlbyname("hw.machine", NULL, &size, NULL, 0) != 0 || size == 0) {
+        return @"unknown";
+    }
+    NSMutableData *data = [NSMutableData dataWithLength:size];
+    if (sysctlbyname("hw.machine", data.mutableBytes, &size, NULL, 0) != 0) {
+        return @"unknown";
+    }
+    return [NSString stringWithUTF8String:(const char *)data.bytes] ?: @"unknown";
+}
+
+// File size plus a digest of the header and first tensors; cheap, and stable across renames
+static NSString *CactusModelFingerprint(NSString *modelPath) {
+    NSFileHandle *handle = [NSFileHandle fileHandleForReadingAtPath:modelPath];
+    if (!handle) {
+        return nil;
+    }
+    unsigned long long fileSize = [handle seekToEndOfFile];
+    [handle seekToFileOffset:0];
+    NSData *head = [handle readDataOfLength:CactusModelFingerprintBytes];
+    [handle closeFile];
+
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256(head.bytes, (CC_LONG)head.length, digest);
+    NSMutableString *fingerprint = [NSMutableString stringWithFormat:@"%llu-", fileSize];
+    for (int i = 0; i < 8; i++) {
+        [fingerprint appendFormat:@"%02x", digest[i]];
+    }
+    return fingerprint;
+}
+
+// Powers of two up to the configured ubatch or 512, whichever is larger
+static std::vector<int32_t> CactusUbatchCandidates(const common_params &params) {
+    std::vector<int32_t> candidates;
+    for (int32_t n = 64; n <= std::max(512, params.n_ubatch) && n <= params.n_ctx; n *= 2) {
+        candidates.push_back(n);
+    }
+    return candidates;
+}
+
+// The winning ubatch depends on which layers run on the GPU and on the attention path
+static NSString *CactusBatchSizeKey(NSString *fingerprint, const common_params &params) {
+    return [NSString stringWithFormat:@"%@|%@|%d|%d|%d|%s|%s", CactusDeviceMachine(), fingerprint, params.n_ctx,
+            params.n_gpu_layers, params.flash_attn, lm_ggml_type_name(params.cache_type_k), lm_ggml_type_name(params.cache_type_v)];
+}
+
+// Performance cores first, then the full core count so efficiency cores are tried once
+static std::vector<int32_t> CactusThreadCandidates(void) {
+    NSInteger performanceCores = CactusSysctlInteger("hw.perflevel0.physicalcpu");
+    NSInteger allCores = CactusSysctlInteger("hw.physicalcpu");
+    if (allCores <= 0) {
+        allCores = (NSInteger)[NSProcessInfo processInfo].activeProcessorCount;
+    }
+    if (performanceCores <= 0) {
+        performanceCores = allCores;
+    }
+
+    std::vector<int32_t> candidates;
+    NSInteger step = MAX(1, (performanceCores + CactusMaxThreadCandidates - 2) / (NSInteger)(CactusMaxThreadCandidates - 1));
+    for (NSInteger n = performanceCores; n >= 1 && candidates.size() < CactusMaxThreadCandidates - 1; n -= step) {
+        candidates.push_back((int32_t)n);
+    }
+    if (allCores > performanceCores) {
+        candidates.push_back((int32_t)allCores);
+    }
+    std::sort(candidates.begin(), candidates.end());
+    return candidates;
+}
+
 @implementation CactusModelManager {
     cactus::cactus_context *_context;
     std::mutex _contextMutex;
+    std::recursive_mutex _usageMutex; // held by generation jobs, taken before _contextMutex
     NSUUID *_currentLoadingTaskId;
+    cactus::cactus_context *_preloadedContext;
+    std::mutex _preloadMutex;
+    cactus::cactus_context *_embeddingContext;
+    std::mutex _embeddingMutex;
+    NSUUID *_preloadTaskId;
+    BOOL _inBackground;
 }
 
 + (instancetype)sharedManager {
@@ -50,12 +165,29 @@ NSString * const CactusModelManagerProgressKey = @"progress";
     if (self = [super init]) {
         _state = CactusModelStateUnloaded;
         _context = nullptr;
+        _embeddingContext = nullptr;
         _synchronizationQueue = dispatch_queue_create("com.cactus.model.manager", DISPATCH_QUEUE_CONCURRENT);
+        _respondsToMemoryPressure = YES;
+        _keepWarm = YES;
+        [self startMonitoringMemoryPressure];
+        [self startObservingApplicationState];
+
+        // Metal pipelines compiled for this GPU are kept across launches
+        NSString *caches = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES).firstObject;
+        if (caches) {
+            lm_ggml_backend_metal_set_pipeline_cache([caches stringByAppendingPathComponent:@"CactusMetalPipelines.bin"].fileSystemRepresentation);
+        }
     }
     return self;
 }
 
 - (void)dealloc {
+    [self discardPreloadedModel];
+    [self detachEmbeddingContext];
+    if (_memoryPressureSource) {
+        dispatch_source_cancel(_memoryPressureSource);
+    }
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
     [self unloadModelWithCompletionHandler:nil];
 }
 
@@ -75,6 +207,8 @@ NSString * const CactusModelManagerProgressKey = @"progress";
     dispatch_barrier_async(self.synchronizationQueue, ^{
         if (self->_state != state) {
             self->_state = state;
+            // results computed for coalescing belong to the previous model
+            [[CactusBackgroundProcessor sharedProcessor] clearCoalescedResults];
             
             dispatch_async(dispatch_get_main_queue(), ^{
                 if ([self.delegate respondsToSelector:@selector(modelManager:didChangeState:)]) {
@@ -98,8 +232,13 @@ NSString * const CactusModelManagerProgressKey = @"progress";
     params.n_ubatch = (int32_t)config.ubatchSize;
     params.n_gpu_layers = (int32_t)config.gpuLayers;
     params.cpuparams.n_threads = (int32_t)config.threads;
+    if (config.batchThreads > 0) {
+        params.cpuparams_batch.n_threads = (int32_t)config.batchThreads;
+    }
+    params.n_parallel = (int32_t)(MAX(1, config.maxSequences) + MAX(0, config.prefixCacheSequences));
     params.use_mmap = config.useMMap;
     params.use_mlock = config.useMLock;
+    params.warmup = config.warmUpOnLoad;
     params.flash_attn = config.flashAttention;
     params.embedding = config.enableEmbedding;
     params.pooling_type = (enum llama_pooling_type)config.poolingType;
@@ -120,11 +259,29 @@ NSString * const CactusModelManagerProgressKey = @"progress";
             // Use default if conversion fails
         }
     }
+    params.cache_n_recent = (uint32_t)MAX(0, config.kvRecentCells);
+    params.defrag_max_cells = (int32_t)MAX(0, config.kvDefragMaxCells);
+    params.compute_shrink_ms = (uint32_t)MAX(0, config.computeShrinkMs);
+    params.n_state_ckpt = (uint32_t)MAX(0, config.stateCheckpoints);
+    params.n_state_ckpt_interval = (uint32_t)MAX(0, config.stateCheckpointInterval);
     
     if (config.chatTemplate) {
         params.chat_template = config.chatTemplate.UTF8String;
     }
     
+    if (config.draftModelPath) {
+        params.speculative.model.path = config.draftModelPath.UTF8String;
+        params.speculative.n_max = (int32_t)MAX(1, config.draftMaxTokens);
+    }
+    
+    if (config.promptCacheDirectory) {
+        [[NSFileManager defaultManager] createDirectoryAtPath:config.promptCacheDirectory
+                                  withIntermediateDirectories:YES
+                                                   attributes:nil
+                                                        error:nil];
+        params.path_prompt_cache = config.promptCacheDirectory.UTF8String;
+    }
+    
     return params;
 }
 
@@ -169,6 +326,10 @@ NSString * const CactusModelManagerProgressKey = @"progress";
         @"size": @(llama_model_size(context->model)),
         @"nEmbd": @(llama_model_n_embd(context->model)),
         @"nParams": @(llama_model_n_params(context->model)),
+        @"warmupDuration": @(context->warmup_ms / 1000.0),
+        @"threads": @(context->params.cpuparams.n_threads),
+        @"batchThreads": @(context->params.cpuparams_batch.n_threads == -1 ?
+                           context->params.cpuparams.n_threads : context->params.cpuparams_batch.n_threads),
         @"chatTemplates": @{
             @"llamaChat": @(context->validateModelChatTemplate(false, nullptr)),
             @"minja": @{
@@ -186,12 +347,161 @@ NSString * const CactusModelManagerProgressKey = @"progress";
             }
         },
         @"metadata": meta,
+        @"memory": [CactusBenchmark backendMemoryUsage],
 
         // deprecated
         @"isChatTemplateSupported": @(context->validateModelChatTemplate(false, nullptr))
     };
 }
 
+- (void)openEmbeddingCacheForContext:(cactus::cactus_context *)context configuration:(CactusModelConfiguration *)config {
+    if (!config.embeddingCacheDirectory || !config.enableEmbedding || !context) {
+        return;
+    }
+    [[NSFileManager defaultManager] createDirectoryAtPath:config.embeddingCacheDirectory
+                              withIntermediateDirectories:YES
+                                               attributes:nil
+                                                    error:nil];
+    if (!context->setEmbeddingCache(config.embeddingCacheDirectory.UTF8String, (size_t)MAX(0, config.embeddingCacheCapacity))) {
+        NSLog(@"Embedding cache disabled: could not open it in %@", config.embeddingCacheDirectory);
+    }
+}
+
+- (void)openPrefixCacheForContext:(cactus::cactus_context *)context configuration:(CactusModelConfiguration *)config {
+    if (config.prefixCacheSequences <= 0 || !context) {
+        return;
+    }
+    if (!context->setPrefixCache((int32_t)config.prefixCacheSequences, (size_t)MAX(0, config.prefixCacheCapacity))) {
+        NSLog(@"Prefix cache disabled: the context has no room for %ld cache sequences", (long)config.prefixCacheSequences);
+    }
+}
+
+- (void)openKVSpillForContext:(cactus::cactus_context *)context configuration:(CactusModelConfiguration *)config {
+    if (!config.kvSpillDirectory || !context) {
+        return;
+    }
+    [[NSFileManager defaultManager] createDirectoryAtPath:config.kvSpillDirectory
+                              withIntermediateDirectories:YES
+                                               attributes:nil
+                                                    error:nil];
+    lm_ggml_type type = LM_GGML_TYPE_Q8_0;
+    if (config.kvSpillCacheType) {
+        try {
+            type = cactus::kv_cache_type_from_str(config.kvSpillCacheType.UTF8String);
+        } catch (...) {
+            // Use default if conversion fails
+        }
+    }
+    if (type == LM_GGML_TYPE_F16) {
+        type = LM_GGML_TYPE_COUNT;
+    }
+    if (!context->setKVSpill(config.kvSpillDirectory.UTF8String, type)) {
+        NSLog(@"KV spill disabled: unsupported cache type %@", config.kvSpillCacheType);
+    }
+}
+
+// Placement depends on the context size and cache types through the GPU memory estimate, and on
+// the thread count and flash attention through the measured per-layer cost
+- (void)placeLayersForParams:(common_params &)params configuration:(CactusModelConfiguration *)config {
+    if (!config.autoPlaceLayers) {
+        return;
+    }
+    NSString *fingerprint = CactusModelFingerprint(config.modelPath);
+    if (!fingerprint) {
+        return;
+    }
+    NSString *key = [NSString stringWithFormat:@"%@|%@|%d|%s|%s|%d|%d|%d", CactusDeviceMachine(), fingerprint, params.n_ctx,
+                     lm_ggml_type_name(params.cache_type_k), lm_ggml_type_name(params.cache_type_v), config.keepTiedOutputOnCPU,
+                     params.cpuparams.n_threads, params.flash_attn];
+    NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+    NSNumber *placed = [defaults dictionaryForKey:CactusLayerPlacementDefaultsKey][key];
+    if (placed) {
+        params.n_gpu_layers = placed.intValue;
+        return;
+    }
+
+    cactus::cactus_layer_placement placement;
+    if (!cactus::plan_layer_placement(params, 0, config.keepTiedOutputOnCPU, placement)) {
+        return;
+    }
+    params.n_gpu_layers = placement.n_gpu_layers;
+    @synchronized (defaults) {
+        NSMutableDictionary *all = [[defaults dictionaryForKey:CactusLayerPlacementDefaultsKey] mutableCopy] ?: [NSMutableDictionary dictionary];
+        all[key] = @(placement.n_gpu_layers);
+        [defaults setObject:all forKey:CactusLayerPlacementDefaultsKey];
+    }
+}
+
+- (void)tuneThreadsForContext:(cactus::cactus_context *)context configuration:(CactusModelConfiguration *)config {
+    if (!config.autoTuneThreads || !context) {
+        return;
+    }
+    NSString *fingerprint = CactusModelFingerprint(config.modelPath);
+    if (!fingerprint) {
+        return;
+    }
+    NSString *key = [NSString stringWithFormat:@"%@|%@", CactusDeviceMachine(), fingerprint];
+    NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+    NSDictionary *tuned = [defaults dictionaryForKey:CactusTunedThreadsDefaultsKey][key];
+    if (tuned) {
+        context->setThreads([tuned[@"decode"] intValue], [tuned[@"prefill"] intValue]);
+        return;
+    }
+
+    int32_t decodeThreads = 0;
+    int32_t prefillThreads = 0;
+    if (!context->tuneThreads(CactusThreadCandidates(), decodeThreads, prefillThreads)) {
+        return;
+    }
+    @synchronized (defaults) {
+        NSMutableDictionary *all = [[defaults dictionaryForKey:CactusTunedThreadsDefaultsKey] mutableCopy] ?: [NSMutableDictionary dictionary];
+        all[key] = @{@"decode": @(decodeThreads), @"prefill": @(prefillThreads)};
+        [defaults setObject:all forKey:CactusTunedThreadsDefaultsKey];
+    }
+}
+
+// A size tuned on an earlier load is applied before the context exists, so it is created once
+- (void)applyTunedBatchSizeForParams:(common_params &)params configuration:(CactusModelConfiguration *)config {
+    if (!config.autoTuneBatchSize) {
+        return;
+    }
+    NSString *fingerprint = CactusModelFingerprint(config.modelPath);
+    if (!fingerprint) {
+        return;
+    }
+    NSDictionary *tuned = [[NSUserDefaults standardUserDefaults] dictionaryForKey:CactusTunedBatchSizeDefaultsKey][CactusBatchSizeKey(fingerprint, params)];
+    if (tuned) {
+        params.n_batch = [tuned[@"batch"] intValue];
+        params.n_ubatch = [tuned[@"ubatch"] intValue];
+    }
+}
+
+- (void)tuneBatchSizeForContext:(cactus::cactus_context *)context configuration:(CactusModelConfiguration *)config {
+    if (!config.autoTuneBatchSize || !context) {
+        return;
+    }
+    NSString *fingerprint = CactusModelFingerprint(config.modelPath);
+    if (!fingerprint) {
+        return;
+    }
+    NSString *key = CactusBatchSizeKey(fingerprint, context->params);
+    NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+    if ([defaults dictionaryForKey:CactusTunedBatchSizeDefaultsKey][key]) {
+        return;
+    }
+
+    int32_t batchSize = 0;
+    int32_t ubatchSize = 0;
+    if (!context->tuneBatchSize(CactusUbatchCandidates(context->params), (size_t)MAX(0, config.batchTuneMemoryLimit), batchSize, ubatchSize)) {
+        return;
+    }
+    @synchronized (defaults) {
+        NSMutableDictionary *all = [[defaults dictionaryForKey:CactusTunedBatchSizeDefaultsKey] mutableCopy] ?: [NSMutableDictionary dictionary];
+        all[key] = @{@"batch": @(batchSize), @"ubatch": @(ubatchSize)};
+        [defaults setObject:all forKey:CactusTunedBatchSizeDefaultsKey];
+    }
+}
+
 #pragma mark - Public Methods
 
 - (void)loadModelWithConfiguration:(CactusModelConfiguration *)configuration
@@ -204,6 +514,16 @@ NSString * const CactusModelManagerProgressKey = @"progress";
 - (void)loadModelWithConfiguration:(CactusModelConfiguration *)configuration
                    progressHandler:(CactusTaskProgressHandler)progressHandler
                  completionHandler:(void(^)(BOOL success, NSError * _Nullable error))completionHandler {
+    [self loadModelWithConfiguration:configuration
+             multimodalConfiguration:nil
+                     progressHandler:progressHandler
+                   completionHandler:completionHandler];
+}
+
+- (void)loadModelWithConfiguration:(CactusModelConfiguration *)configuration
+           multimodalConfiguration:(CactusMultimodalConfiguration *)multimodalConfiguration
+                   progressHandler:(CactusTaskProgressHandler)progressHandler
+                 completionHandler:(void(^)(BOOL success, NSError * _Nullable error))completionHandler {
     
     // Validate configuration
     NSError *validationError = nil;
@@ -247,6 +567,7 @@ NSString * const CactusModelManagerProgressKey = @"progress";
         std::lock_guard<std::mutex> lock(strongSelf->_contextMutex);
         
         // Clean up existing context
+        [strongSelf detachEmbeddingContext];
         if (strongSelf->_context) {
             delete strongSelf->_context;
             strongSelf->_context = nullptr;
@@ -257,6 +578,8 @@ NSString * const CactusModelManagerProgressKey = @"progress";
         
         // Convert configuration
         common_params params = [strongSelf convertConfiguration:configuration];
+        [strongSelf placeLayersForParams:params configuration:configuration];
+        [strongSelf applyTunedBatchSizeForParams:params configuration:configuration];
         
         // Set progress callback if provided
         if (configuration.progressCallback) {
@@ -264,9 +587,14 @@ NSString * const CactusModelManagerProgressKey = @"progress";
             progress(0.1f);
         }
         
-        // Load model
+        // Load model, projector and vocoder side by side
         progress(0.2f);
-        bool success = strongSelf->_context->loadModel(params);
+        std::string mmprojPath = multimodalConfiguration.mmprojPath ? multimodalConfiguration.mmprojPath.UTF8String : "";
+        std::string vocoderPath = multimodalConfiguration.vocoderPath ? multimodalConfiguration.vocoderPath.UTF8String : "";
+        cactus::cactus_multimodal_params mmParams = [strongSelf multimodalParamsForConfiguration:multimodalConfiguration];
+        bool success = strongSelf->_context->loadModelWithComponents(params, mmprojPath, mmParams, vocoderPath, [progress](float fraction) {
+            progress(0.2f + 0.7f * fraction);
+        });
         
         if (!success) {
             delete strongSelf->_context;
@@ -274,12 +602,17 @@ NSString * const CactusModelManagerProgressKey = @"progress";
             
             NSError *error = [NSError errorWithDomain:CactusLLMErrorDomain
                                                  code:CactusLLMErrorModelLoadFailed
-                                             userInfo:@{NSLocalizedDescriptionKey: @"Failed to load model"}];
+                                             userInfo:@{NSLocalizedDescriptionKey: multimodalConfiguration ? @"Failed to load model, projector or vocoder" : @"Failed to load model"}];
             @throw [NSException exceptionWithName:@"ModelLoadException"
                                            reason:error.localizedDescription
                                          userInfo:@{@"error": error}];
         }
         
+        [strongSelf tuneThreadsForContext:strongSelf->_context configuration:configuration];
+        [strongSelf tuneBatchSizeForContext:strongSelf->_context configuration:configuration];
+        [strongSelf openEmbeddingCacheForContext:strongSelf->_context configuration:configuration];
+        [strongSelf openPrefixCacheForContext:strongSelf->_context configuration:configuration];
+        [strongSelf openKVSpillForContext:strongSelf->_context configuration:configuration];
         progress(0.9f);
         
         // Extract model info
@@ -328,6 +661,7 @@ NSString * const CactusModelManagerProgressKey = @"progress";
             }
         } else {
             strongSelf.modelInfo = result;
+            strongSelf.memoryReliefLevel = 0;
             strongSelf.state = CactusModelStateLoaded;
             
             dispatch_async(dispatch_get_main_queue(), ^{
@@ -368,6 +702,7 @@ NSString * const CactusModelManagerProgressKey = @"progress";
     dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
         std::lock_guard<std::mutex> lock(self->_contextMutex);
         
+        [self detachEmbeddingContext];
         if (self->_context) {
             delete self->_context;
             self->_context = nullptr;
@@ -376,6 +711,7 @@ NSString * const CactusModelManagerProgressKey = @"progress";
         self.currentConfiguration = nil;
         self.modelInfo = nil;
         self.lastError = nil;
+        self.memoryReliefLevel = 0;
         self.state = CactusModelStateUnloaded;
         
         dispatch_async(dispatch_get_main_queue(), ^{
@@ -406,9 +742,199 @@ NSString * const CactusModelManagerProgressKey = @"progress";
     }
     
     CactusModelConfiguration *config = [self.currentConfiguration copy];
-    [self unloadModelWithCompletionHandler:^{
+    if (!self.isLoaded) {
         [self loadModelWithConfiguration:config completionHandler:completionHandler];
+        return;
+    }
+    
+    // Load the fresh copy next to the current one when memory allows, so sessions see no outage
+    [self preloadModelWithConfiguration:config completionHandler:^(BOOL success, NSError *error) {
+        if (success) {
+            [self swapToPreloadedModelWithCompletionHandler:completionHandler];
+            return;
+        }
+        [self unloadModelWithCompletionHandler:^{
+            [self loadModelWithConfiguration:config completionHandler:completionHandler];
+        }];
+    }];
+}
+
+#pragma mark - Hot Swap
+
+- (BOOL)hasPreloadedModel {
+    std::lock_guard<std::mutex> lock(_preloadMutex);
+    return _preloadedContext != nullptr;
+}
+
+// Weights plus a margin for KV cache and compute buffers must fit in what the process has left
+- (BOOL)canAffordModelAtPath:(NSString *)modelPath error:(NSError **)error {
+    unsigned long long modelSize = [[[NSFileManager defaultManager] attributesOfItemAtPath:modelPath error:nil] fileSize];
+    unsigned long long required = modelSize + modelSize / 5;
+    unsigned long long available = 0;
+    if (@available(iOS 13.0, macOS 10.15, *)) {
+        available = os_proc_available_memory();
+    }
+    if (available == 0) {
+        unsigned long long physical = [NSProcessInfo processInfo].physicalMemory / 2;
+        uint64_t footprint = CactusPhysicalFootprint();
+        available = physical > footprint ? physical - footprint : 0;
+    }
+    if (required <= available) {
+        return YES;
+    }
+    if (error) {
+        *error = [NSError errorWithDomain:CactusLLMErrorDomain
+                                     code:CactusLLMErrorInsufficientMemory
+                                 userInfo:@{NSLocalizedDescriptionKey:
+                                                [NSString stringWithFormat:@"Preloading needs %llu MB, %llu MB available",
+                                                 required >> 20, available >> 20]}];
+    }
+    return NO;
+}
+
+- (void)preloadModelWithConfiguration:(CactusModelConfiguration *)configuration
+                    completionHandler:(void(^)(BOOL success, NSError * _Nullable error))completionHandler {
+    NSError *error = nil;
+    if (![self validateConfiguration:configuration error:&error] ||
+        ![self canAffordModelAtPath:configuration.modelPath error:&error]) {
+        if (completionHandler) {
+            completionHandler(NO, error);
+        }
+        return;
+    }
+    
+    [self discardPreloadedModel];
+    CactusModelConfiguration *config = [configuration copy];
+    
+    __weak typeof(self) weakSelf = self;
+    CactusTask *preloadTask = [CactusTask taskWithType:CactusTaskTypeModelLoad
+                                              priority:CactusTaskPriorityNormal
+                                           description:[NSString stringWithFormat:@"Preloading model: %@", config.modelPath.lastPathComponent]
+                                        executionBlock:^id(CactusTask *task, CactusTaskProgressHandler progress) {
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        if (!strongSelf) return nil;
+        
+        common_params params = [strongSelf convertConfiguration:config];
+        [strongSelf placeLayersForParams:params configuration:config];
+        [strongSelf applyTunedBatchSizeForParams:params configuration:config];
+        cactus::cactus_context *context = new cactus::cactus_context();
+        if (!context->loadModel(params)) {
+            delete context;
+            @throw [NSException exceptionWithName:@"ModelLoadException"
+                                           reason:@"Failed to preload model"
+                                         userInfo:nil];
+        }
+        if (task.isCancelled) {
+            delete context;
+            return nil;
+        }
+        [strongSelf tuneThreadsForContext:context configuration:config];
+        [strongSelf tuneBatchSizeForContext:context configuration:config];
+        [strongSelf openEmbeddingCacheForContext:context configuration:config];
+        [strongSelf openPrefixCacheForContext:context configuration:config];
+        [strongSelf openKVSpillForContext:context configuration:config];
+        
+        std::lock_guard<std::mutex> lock(strongSelf->_preloadMutex);
+        delete strongSelf->_preloadedContext;
+        strongSelf->_preloadedContext = context;
+        strongSelf.preloadedConfiguration = config;
+        progress(1.0f);
+        return @YES;
     }];
+    
+    preloadTask.completionHandler = ^(id result, NSError *error) {
+        if (completionHandler) {
+            completionHandler(result != nil && error == nil, error);
+        }
+    };
+    
+    _preloadTaskId = preloadTask.taskId;
+    [[CactusBackgroundProcessor sharedProcessor] submitTask:preloadTask];
+}
+
+- (void)swapToPreloadedModelWithCompletionHandler:(void(^)(BOOL success, NSError * _Nullable error))completionHandler {
+    if (!self.hasPreloadedModel) {
+        NSError *error = [NSError errorWithDomain:CactusLLMErrorDomain
+                                             code:CactusLLMErrorInvalidState
+                                         userInfo:@{NSLocalizedDescriptionKey: @"No preloaded model to swap in"}];
+        if (completionHandler) {
+            completionHandler(NO, error);
+        }
+        return;
+    }
+    
+    // Swap at a session boundary: wait for the running completion and any job holding the context
+    __block cactus::cactus_context *retired = nullptr;
+    __block NSDictionary *info = nil;
+    {
+        std::unique_lock<std::recursive_mutex> usage(_usageMutex, std::try_to_lock);
+        std::lock_guard<std::mutex> lock(_contextMutex);
+        if (!usage.owns_lock() || (_context && _context->is_predicting)) {
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(CactusSwapPollInterval * NSEC_PER_SEC)),
+                           dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
+                [self swapToPreloadedModelWithCompletionHandler:completionHandler];
+            });
+            return;
+        }
+        
+        std::lock_guard<std::mutex> preloadLock(_preloadMutex);
+        retired = _context;
+        _context = _preloadedContext;
+        _preloadedContext = nullptr;
+        self.currentConfiguration = self.preloadedConfiguration;
+        self.preloadedConfiguration = nil;
+        info = [self extractModelInfo:_context];
+        self.modelInfo = info;
+        self.lastError = nil;
+        self.memoryReliefLevel = 0;
+        self.state = CactusModelStateLoaded;
+    }
+    
+    // The embedding context would keep the retired weights alive
+    [self detachEmbeddingContext];
+    [self retireContextWhenIdle:retired];
+    
+    dispatch_async(dispatch_get_main_queue(), ^{
+        if ([self.delegate respondsToSelector:@selector(modelManager:didLoadModelWithInfo:)]) {
+            [self.delegate modelManager:self didLoadModelWithInfo:info];
+        }
+        
+        [[NSNotificationCenter defaultCenter] postNotificationName:CactusModelManagerDidLoadModelNotification
+                                                            object:self
+                                                          userInfo:@{CactusModelManagerModelInfoKey: info ?: @{}}];
+        
+        if (completionHandler) {
+            completionHandler(YES, nil);
+        }
+    });
+}
+
+// A session that fetched the old context just before the swap may still be decoding on it, and an
+// embedding, training, draft or summary job may still hold it through a CactusContextLease
+- (void)retireContextWhenIdle:(cactus::cactus_context *)context {
+    if (!context) {
+        return;
+    }
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(CactusSwapPollInterval * NSEC_PER_SEC)),
+                   dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+        std::unique_lock<std::recursive_mutex> usage(self->_usageMutex, std::try_to_lock);
+        if (!usage.owns_lock() || context->is_predicting) {
+            [self retireContextWhenIdle:context];
+            return;
+        }
+        delete context;
+    });
+}
+
+- (void)discardPreloadedModel {
+    if (_preloadTaskId) {
+        [[CactusBackgroundProcessor sharedProcessor] cancelTask:_preloadTaskId];
+        _preloadTaskId = nil;
+    }
+    std::lock_guard<std::mutex> lock(_preloadMutex);
+    delete _preloadedContext;
+    _preloadedContext = nullptr;
+    self.preloadedConfiguration = nil;
 }
 
 - (NSDictionary *)getModelInfoForPath:(NSString *)modelPath {
@@ -419,12 +945,58 @@ NSString * const CactusModelManagerProgressKey = @"progress";
     return self.modelInfo;
 }
 
+- (NSDictionary *)embeddingCacheStatistics {
+    std::lock_guard<std::mutex> lock(_contextMutex);
+    if (!_context || !_context->embedding_cache) {
+        return nil;
+    }
+    return @{
+        @"hits": @(_context->n_embd_cache_hits),
+        @"misses": @(_context->n_embd_cache_misses),
+        @"entries": @(_context->embedding_cache->size()),
+        @"capacity": @(_context->embedding_cache->capacity)
+    };
+}
+
+- (NSDictionary *)kvDefragStatistics {
+    std::lock_guard<std::mutex> lock(_contextMutex);
+    if (!_context || !_context->ctx) {
+        return nil;
+    }
+    const llama_kv_defrag_stats stats = llama_kv_self_defrag_stats(_context->ctx);
+    return @{
+        @"fragmentation": @(stats.fragmentation),
+        @"steps": @(stats.n_steps),
+        @"cellsMoved": @(stats.n_cells_moved),
+        @"bytesMoved": @(stats.n_bytes_moved),
+        @"pending": @(stats.pending)
+    };
+}
+
 - (BOOL)validateConfiguration:(CactusModelConfiguration *)configuration error:(NSError **)error {
     return [configuration isValid:error];
 }
 
 #pragma mark - Multimodal Support
 
+- (cactus::cactus_multimodal_params)multimodalParamsForConfiguration:(CactusMultimodalConfiguration *)configuration {
+    cactus::cactus_multimodal_params mmParams;
+    if (!configuration) {
+        return mmParams;
+    }
+    mmParams.use_gpu = configuration.useGPU;
+    mmParams.image_max_side = (int)MAX(configuration.maxImageSide, 0);
+    mmParams.max_slices = (int)MAX(configuration.maxImageSlices, 0);
+    if (configuration.projectorWeightType) {
+        try {
+            mmParams.weight_type = cactus::kv_cache_type_from_str(configuration.projectorWeightType.UTF8String);
+        } catch (...) {
+            // Keep the stored precision if conversion fails
+        }
+    }
+    return mmParams;
+}
+
 - (BOOL)initializeMultimodalWithConfiguration:(CactusMultimodalConfiguration *)configuration
                                         error:(NSError **)error {
     std::lock_guard<std::mutex> lock(_contextMutex);
@@ -447,7 +1019,8 @@ NSString * const CactusModelManagerProgressKey = @"progress";
         return NO;
     }
     
-    bool success = _context->initMultimodal(configuration.mmprojPath.UTF8String, configuration.useGPU);
+    cactus::cactus_multimodal_params mmParams = [self multimodalParamsForConfiguration:configuration];
+    bool success = _context->initMultimodal(configuration.mmprojPath.UTF8String, mmParams);
     
     if (!success && error) {
         *error = [NSError errorWithDomain:CactusLLMErrorDomain
@@ -487,6 +1060,37 @@ NSString * const CactusModelManagerProgressKey = @"progress";
     return _context->isMultimodalSupportAudio();
 }
 
+- (nullable NSString *)addAudioSamples:(const float *)samples count:(NSUInteger)count {
+    std::lock_guard<std::mutex> lock(_contextMutex);
+    
+    if (!_context || !samples || count == 0) return nil;
+    std::string reference = _context->addAudio(samples, (size_t)count);
+    return reference.empty() ? nil : [NSString stringWithUTF8String:reference.c_str()];
+}
+
+- (nullable NSString *)beginAudioStream {
+    std::lock_guard<std::mutex> lock(_contextMutex);
+    
+    if (!_context) return nil;
+    std::string reference = _context->beginAudioStream();
+    return reference.empty() ? nil : [NSString stringWithUTF8String:reference.c_str()];
+}
+
+- (BOOL)pushAudioSamples:(const float *)samples count:(NSUInteger)count toStream:(NSString *)reference {
+    std::lock_guard<std::mutex> lock(_contextMutex);
+    
+    if (!_context || !reference || (!samples && count > 0)) return NO;
+    return _context->pushAudio(reference.UTF8String, samples, (size_t)count);
+}
+
+- (void)releaseAudio:(NSString *)reference {
+    std::lock_guard<std::mutex> lock(_contextMutex);
+    
+    if (_context && reference) {
+        _context->releaseAudio(reference.UTF8String);
+    }
+}
+
 #pragma mark - LoRA Support
 
 - (BOOL)applyLoRAConfiguration:(CactusLoRAConfiguration *)configuration
@@ -512,6 +1116,7 @@ NSString * const CactusModelManagerProgressKey = @"progress";
     }
     
     int result = _context->applyLoraAdapters(lora_adapters);
+    [[CactusBackgroundProcessor sharedProcessor] clearCoalescedResults];
     
     if (result != 0 && error) {
         *error = [NSError errorWithDomain:CactusLLMErrorDomain
@@ -527,6 +1132,7 @@ NSString * const CactusModelManagerProgressKey = @"progress";
     
     if (_context) {
         _context->removeLoraAdapters();
+        [[CactusBackgroundProcessor sharedProcessor] clearCoalescedResults];
     }
 }
 
@@ -547,6 +1153,50 @@ NSString * const CactusModelManagerProgressKey = @"progress";
     return [adapters copy];
 }
 
+#pragma mark - Control Vectors
+
+- (BOOL)applyControlVectorConfiguration:(CactusControlVectorConfiguration *)configuration
+                                  error:(NSError **)error {
+    std::lock_guard<std::mutex> lock(_contextMutex);
+
+    if (!_context) {
+        if (error) {
+            *error = [NSError errorWithDomain:CactusLLMErrorDomain
+                                         code:CactusLLMErrorInvalidState
+                                     userInfo:@{NSLocalizedDescriptionKey: @"Model not loaded"}];
+        }
+        return NO;
+    }
+
+    std::vector<common_control_vector_load_info> vectors;
+    for (CactusControlVector *vector in configuration.vectors) {
+        common_control_vector_load_info info;
+        info.fname = vector.path.UTF8String;
+        info.strength = vector.strength;
+        vectors.push_back(info);
+    }
+
+    int result = _context->applyControlVectors(vectors, (int32_t)configuration.layerStart, (int32_t)configuration.layerEnd);
+    [[CactusBackgroundProcessor sharedProcessor] clearCoalescedResults];
+
+    if (result != 0 && error) {
+        *error = [NSError errorWithDomain:CactusLLMErrorDomain
+                                     code:CactusLLMErrorControlVectorFailed
+                                 userInfo:@{NSLocalizedDescriptionKey: @"Failed to apply control vectors"}];
+    }
+
+    return result == 0;
+}
+
+- (void)removeControlVectors {
+    std::lock_guard<std::mutex> lock(_contextMutex);
+
+    if (_context) {
+        _context->removeControlVectors();
+        [[CactusBackgroundProcessor sharedProcessor] clearCoalescedResults];
+    }
+}
+
 #pragma mark - Context Management
 
 - (void)clearContext {
@@ -565,14 +1215,381 @@ NSString * const CactusModelManagerProgressKey = @"progress";
     }
 }
 
+- (void)releaseSequence:(NSInteger)sequenceId {
+    std::lock_guard<std::mutex> lock(_contextMutex);
+    
+    if (_context && _context->ctx && sequenceId >= 0 && sequenceId < _context->sessionSequences()) {
+        _context->releaseSequence((llama_seq_id)sequenceId);
+    }
+}
+
+- (BOOL)setKVQuota:(NSInteger)maxCells policy:(CactusKVEvictionPolicy)policy sinkCells:(NSInteger)sinkCells forSequence:(NSInteger)sequenceId {
+    std::lock_guard<std::mutex> lock(_contextMutex);
+    if (!_context || !_context->ctx) {
+        return NO;
+    }
+    if (sequenceId < 0 || sequenceId >= _context->sessionSequences()) {
+        return NO;
+    }
+    return _context->setSequenceQuota((llama_seq_id)sequenceId, (uint32_t)MAX(0, maxCells),
+                                      (llama_kv_evict_policy)policy, (uint32_t)MAX(0, sinkCells));
+}
+
+- (BOOL)defragmentKVCache {
+    std::lock_guard<std::mutex> lock(_contextMutex);
+    return _context && _context->defragKVCache();
+}
+
 - (void *)internalContext {
-    return _context;
+    // Rebuild the compute context dropped under memory pressure before handing it out;
+    // a model load in progress holds the mutex and is not waited for
+    if (_context && !_context->ctx) {
+        std::unique_lock<std::mutex> lock(_contextMutex, std::try_to_lock);
+        if (lock.owns_lock() && _context && !_context->ctx && _context->restoreComputeContext()) {
+            self.memoryReliefLevel = MIN(self.memoryReliefLevel, (NSInteger)CactusMemoryReliefStepReleaseCompute);
+        }
+    }
+    cactus::cactus_context *context = _context;
+    return context && context->ctx ? context : nil;
+}
+
+- (void *)acquireContext {
+    _usageMutex.lock();
+    cactus::cactus_context *context = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(_contextMutex);
+        if (_context && !_context->ctx && _context->restoreComputeContext()) {
+            self.memoryReliefLevel = MIN(self.memoryReliefLevel, (NSInteger)CactusMemoryReliefStepReleaseCompute);
+        }
+        if (_context && _context->ctx) {
+            context = _context;
+        }
+    }
+    if (!context) {
+        _usageMutex.unlock();
+    }
+    return context;
+}
+
+- (void)releaseContext {
+    _usageMutex.unlock();
+}
+
+#pragma mark - Embedding Context
+
+- (BOOL)attachEmbeddingContextWithConfiguration:(CactusModelConfiguration *)configuration error:(NSError **)error {
+    std::lock_guard<std::mutex> lock(_contextMutex);
+    
+    if (!_context) {
+        if (error) {
+            *error = [NSError errorWithDomain:CactusLLMErrorDomain
+                                         code:CactusLLMErrorInvalidState
+                                     userInfo:@{NSLocalizedDescriptionKey: @"Model not loaded"}];
+        }
+        return NO;
+    }
+    
+    // The embedding cache is keyed on the model path, so it is the loaded model's
+    CactusModelConfiguration *config = [configuration copy];
+    config.modelPath = [NSString stringWithUTF8String:_context->params.model.path.c_str()];
+    config.enableEmbedding = YES;
+    config.draftModelPath = nil;
+    config.promptCacheDirectory = nil;
+    common_params params = [self convertConfiguration:config];
+    
+    cactus::cactus_context *context = new cactus::cactus_context();
+    if (!context->loadModel(params, _context->shareWeights())) {
+        delete context;
+        if (error) {
+            *error = [NSError errorWithDomain:CactusLLMErrorDomain
+                                         code:CactusLLMErrorModelLoadFailed
+                                     userInfo:@{NSLocalizedDescriptionKey: @"Failed to create embedding context"}];
+        }
+        return NO;
+    }
+    [self tuneThreadsForContext:context configuration:config];
+    [self openEmbeddingCacheForContext:context configuration:config];
+    
+    std::lock_guard<std::mutex> embeddingLock(_embeddingMutex);
+    delete _embeddingContext;
+    _embeddingContext = context;
+    return YES;
+}
+
+- (void)detachEmbeddingContext {
+    std::lock_guard<std::mutex> lock(_embeddingMutex);
+    delete _embeddingContext;
+    _embeddingContext = nullptr;
+}
+
+- (BOOL)hasEmbeddingContext {
+    std::lock_guard<std::mutex> lock(_embeddingMutex);
+    return _embeddingContext != nullptr;
+}
+
+- (NSData *)embeddingForText:(NSString *)text dimensions:(NSInteger)dimensions {
+    std::vector<float> embedding;
+    {
+        std::lock_guard<std::mutex> lock(_embeddingMutex);
+        if (_embeddingContext) {
+            embedding = _embeddingContext->getEmbedding(text.UTF8String, (int)dimensions);
+            return embedding.empty() ? nil : [NSData dataWithBytes:embedding.data() length:embedding.size() * sizeof(float)];
+        }
+    }
+    
+    std::lock_guard<std::mutex> lock(_contextMutex);
+    if (!_context || !_context->ctx || !_context->params.embedding) {
+        return nil;
+    }
+    embedding = _context->getEmbedding(text.UTF8String, (int)dimensions);
+    return embedding.empty() ? nil : [NSData dataWithBytes:embedding.data() length:embedding.size() * sizeof(float)];
+}
+
+- (void *)internalEmbeddingContext {
+    std::lock_guard<std::mutex> lock(_embeddingMutex);
+    return _embeddingContext;
+}
+
+#pragma mark - Residency
+
+- (void)setKeepWarm:(BOOL)keepWarm {
+    @synchronized (self) {
+        _keepWarm = keepWarm;
+        [self updateResidency];
+    }
+}
+
+- (void)updateResidency {
+    lm_ggml_backend_metal_set_residency(_keepWarm && !_inBackground);
+}
+
+- (void)startObservingApplicationState {
+#if TARGET_OS_IPHONE
+    NSNotificationCenter *center = [NSNotificationCenter defaultCenter];
+    [center addObserver:self selector:@selector(applicationDidEnterBackground:)
+                   name:UIApplicationDidEnterBackgroundNotification object:nil];
+    [center addObserver:self selector:@selector(applicationWillEnterForeground:)
+                   name:UIApplicationWillEnterForegroundNotification object:nil];
+#endif
+}
+
+- (void)applicationDidEnterBackground:(NSNotification *)notification {
+    @synchronized (self) {
+        _inBackground = YES;
+        [self updateResidency];
+    }
+}
+
+// Requested before the first frame, so the weights are paging back in while the UI comes up
+- (void)applicationWillEnterForeground:(NSNotification *)notification {
+    @synchronized (self) {
+        _inBackground = NO;
+        [self updateResidency];
+    }
+}
+
+#pragma mark - Memory Pressure
+
+- (void)startMonitoringMemoryPressure {
+    self.memoryPressureSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_MEMORYPRESSURE, 0,
+                                                       DISPATCH_MEMORYPRESSURE_WARN | DISPATCH_MEMORYPRESSURE_CRITICAL,
+                                                       dispatch_get_global_queue(QOS_CLASS_UTILITY, 0));
+    __weak typeof(self) weakSelf = self;
+    dispatch_source_set_event_handler(self.memoryPressureSource, ^{
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        if (!strongSelf || !strongSelf.respondsToMemoryPressure) {
+            return;
+        }
+        // Each warning escalates one step; critical pressure goes straight to unloading the weights
+        unsigned long pressure = dispatch_source_get_data(strongSelf.memoryPressureSource);
+        CactusMemoryReliefStep step = (pressure & DISPATCH_MEMORYPRESSURE_CRITICAL)
+            ? CactusMemoryReliefStepUnloadWeights
+            : (CactusMemoryReliefStep)MIN(strongSelf.memoryReliefLevel, (NSInteger)CactusMemoryReliefStepUnloadWeights);
+        [strongSelf relieveMemoryThroughStep:step];
+    });
+    dispatch_resume(self.memoryPressureSource);
+}
+
+- (uint64_t)relieveMemoryThroughStep:(CactusMemoryReliefStep)step {
+    // A preloaded model is the cheapest thing to give back
+    uint64_t total = 0;
+    if (self.hasPreloadedModel) {
+        uint64_t before = CactusPhysicalFootprint();
+        [self discardPreloadedModel];
+        uint64_t after = CactusPhysicalFootprint();
+        total += before > after ? before - after : 0;
+    }
+    for (NSInteger next = self.memoryReliefLevel; next <= step; next = self.memoryReliefLevel) {
+        uint64_t before = CactusPhysicalFootprint();
+        if (![self applyMemoryReliefStep:(CactusMemoryReliefStep)next]) {
+            break;
+        }
+        uint64_t after = CactusPhysicalFootprint();
+        uint64_t reclaimed = before > after ? before - after : 0;
+        total += reclaimed;
+        
+        NSLog(@"Memory relief step %ld reclaimed %llu bytes", (long)next, reclaimed);
+        dispatch_async(dispatch_get_main_queue(), ^{
+            if ([self.delegate respondsToSelector:@selector(modelManager:didReclaimMemory:withStep:)]) {
+                [self.delegate modelManager:self didReclaimMemory:reclaimed withStep:(CactusMemoryReliefStep)next];
+            }
+        });
+    }
+    return total;
+}
+
+// Returns NO when the step cannot run now, which stops escalation
+- (BOOL)applyMemoryReliefStep:(CactusMemoryReliefStep)step {
+    // Tearing down buffers under a running job would crash it; the next pressure event retries
+    std::unique_lock<std::recursive_mutex> usage(_usageMutex, std::try_to_lock);
+    if (!usage.owns_lock()) {
+        return NO;
+    }
+    std::lock_guard<std::mutex> lock(_contextMutex);
+    
+    // FFI callers decode without holding the context
+    if (!_context || _context->is_predicting) {
+        return NO;
+    }
+    
+    switch (step) {
+        case CactusMemoryReliefStepCompactKVCache:
+            // Nothing left to compact is not an error, later steps still apply
+            _context->shrinkComputeBuffers();
+            _context->compactKVCache();
+            break;
+        case CactusMemoryReliefStepReleaseAuxiliary:
+            [self detachEmbeddingContext];
+            _context->releaseMultimodal();
+            _context->releaseVocoder();
+            _context->releaseDraftModel();
+            break;
+        case CactusMemoryReliefStepReleaseCompute:
+            _context->releaseComputeContext();
+            break;
+        case CactusMemoryReliefStepUnloadWeights: {
+            // Keep currentConfiguration so reloadModel can map the weights again
+            [self detachEmbeddingContext];
+            delete _context;
+            _context = nullptr;
+            self.modelInfo = nil;
+            self.state = CactusModelStateUnloaded;
+            dispatch_async(dispatch_get_main_queue(), ^{
+                if ([self.delegate respondsToSelector:@selector(modelManagerDidUnloadModel:)]) {
+                    [self.delegate modelManagerDidUnloadModel:self];
+                }
+                [[NSNotificationCenter defaultCenter] postNotificationName:CactusModelManagerDidUnloadModelNotification
+                                                                    object:self
+                                                                  userInfo:nil];
+            });
+            break;
+        }
+    }
+    self.memoryReliefLevel = step + 1;
+    return YES;
 }
 
 @end
 
 #pragma mark - Utilities
 
+static NSString * const CactusModelMetadataIndexFile = @"CactusModelMetadataIndex.plist";
+
+static NSString *CactusModelMetadataIndexPath(void) {
+    NSString *caches = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES).firstObject;
+    return caches ? [caches stringByAppendingPathComponent:CactusModelMetadataIndexFile] : nil;
+}
+
+// Loaded from disk on first use; entries are {size, mtime, metadata} keyed by path
+static NSMutableDictionary<NSString *, NSDictionary *> *CactusModelMetadataIndex(void) {
+    static NSMutableDictionary<NSString *, NSDictionary *> *index = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSString *path = CactusModelMetadataIndexPath();
+        NSDictionary *stored = path ? [NSDictionary dictionaryWithContentsOfFile:path] : nil;
+        index = [stored mutableCopy] ?: [NSMutableDictionary dictionary];
+    });
+    return index;
+}
+
+static NSDictionary *CactusReadModelMetadata(NSString *modelPath) {
+    cactus::cactus_model_metadata meta;
+    if (!cactus::read_model_metadata(modelPath.UTF8String, meta)) {
+        return nil;
+    }
+    NSMutableDictionary *info = [@{
+        @"architecture": [NSString stringWithUTF8String:meta.architecture.c_str()] ?: @"",
+        @"name": [NSString stringWithUTF8String:meta.name.c_str()] ?: @"",
+        @"quantization": [NSString stringWithUTF8String:meta.quantization.c_str()] ?: @"",
+        @"fileType": @(meta.file_type),
+        @"nParams": @(meta.n_params),
+        @"trainContextSize": @(meta.n_ctx_train),
+        @"nEmbd": @(meta.n_embd),
+        @"layers": @(meta.n_layer),
+        @"vocabSize": @(meta.n_vocab),
+        @"tensorBytes": @(meta.tensor_bytes)
+    } mutableCopy];
+    if (!meta.chat_template.empty()) {
+        info[@"chatTemplate"] = [NSString stringWithUTF8String:meta.chat_template.c_str()] ?: @"";
+    }
+    return info;
+}
+
+// File attributes plus the GGUF header metadata, from the index while the file's size and
+// modification date are unchanged; *dirty is set when the index gained or dropped an entry
+static NSDictionary *CactusModelInfoForPath(NSString *modelPath, BOOL *dirty) {
+    NSDictionary *fileAttributes = [[NSFileManager defaultManager] attributesOfItemAtPath:modelPath error:nil];
+    if (!fileAttributes) {
+        return nil;
+    }
+    NSNumber *size = fileAttributes[NSFileSize] ?: @0;
+    NSDate *modificationDate = fileAttributes[NSFileModificationDate] ?: [NSDate distantPast];
+    NSNumber *mtime = @(modificationDate.timeIntervalSince1970);
+    NSMutableDictionary *info = [@{
+        @"path": modelPath,
+        @"size": size,
+        @"modificationDate": modificationDate,
+        @"filename": modelPath.lastPathComponent
+    } mutableCopy];
+
+    NSMutableDictionary<NSString *, NSDictionary *> *index = CactusModelMetadataIndex();
+    NSDictionary *metadata = nil;
+    @synchronized (index) {
+        NSDictionary *entry = index[modelPath];
+        if ([entry[@"size"] isEqual:size] && [entry[@"mtime"] isEqual:mtime]) {
+            metadata = entry[@"metadata"];
+        }
+    }
+    if (!metadata) {
+        metadata = CactusReadModelMetadata(modelPath);
+        @synchronized (index) {
+            if (metadata) {
+                index[modelPath] = @{@"size": size, @"mtime": mtime, @"metadata": metadata};
+                *dirty = YES;
+            } else if (index[modelPath]) {
+                [index removeObjectForKey:modelPath];
+                *dirty = YES;
+            }
+        }
+    }
+    [info addEntriesFromDictionary:metadata ?: @{}];
+    return info;
+}
+
+static void CactusSaveModelMetadataIndex(void) {
+    NSString *path = CactusModelMetadataIndexPath();
+    if (!path) {
+        return;
+    }
+    NSMutableDictionary<NSString *, NSDictionary *> *index = CactusModelMetadataIndex();
+    NSData *data = nil;
+    @synchronized (index) {
+        // binary keeps the full precision of mtime
+        data = [NSPropertyListSerialization dataWithPropertyList:index format:NSPropertyListBinaryFormat_v1_0 options:0 error:nil];
+    }
+    [data writeToFile:path atomically:YES];
+}
+
 @implementation CactusModelManager (Utilities)
 
 + (NSDictionary *)quickModelInfoForPath:(NSString *)modelPath {
@@ -580,19 +1597,28 @@ NSString * const CactusModelManagerProgressKey = @"progress";
         return nil;
     }
     
-    NSError *error = nil;
-    NSDictionary *fileAttributes = [[NSFileManager defaultManager] attributesOfItemAtPath:modelPath error:&error];
-    
-    if (error) {
-        return nil;
+    BOOL dirty = NO;
+    NSDictionary *info = CactusModelInfoForPath(modelPath, &dirty);
+    if (dirty) {
+        CactusSaveModelMetadataIndex();
     }
-    
-    return @{
-        @"path": modelPath,
-        @"size": fileAttributes[NSFileSize] ?: @0,
-        @"modificationDate": fileAttributes[NSFileModificationDate] ?: [NSDate distantPast],
-        @"filename": modelPath.lastPathComponent
-    };
+    return info;
+}
+
++ (NSArray<NSDictionary *> *)quickModelInfoForPaths:(NSArray<NSString *> *)modelPaths {
+    NSMutableArray<NSDictionary *> *infos = [NSMutableArray arrayWithCapacity:modelPaths.count];
+    BOOL dirty = NO;
+    for (NSString *modelPath in modelPaths) {
+        NSDictionary *info = CactusModelInfoForPath(modelPath, &dirty);
+        if (info) {
+            [infos addObject:info];
+        }
+    }
+    // one write for the whole scan
+    if (dirty) {
+        CactusSaveModelMetadataIndex();
+    }
+    return infos;
 }
 
 + (NSDictionary *)deviceCapabilities {
@@ -612,8 +1638,7 @@ NSString * const CactusModelManagerProgressKey = @"progress";
 }
 
 + (void)freeUnusedMemory {
-    // This could trigger garbage collection or memory cleanup
-    // Implementation depends on specific memory management needs
+    [[CactusModelManager sharedManager] relieveMemoryThroughStep:CactusMemoryReliefStepReleaseAuxiliary];
 }
 
 @end
@@ -0,0 +1,43 @@
+//
+//  CactusModelResidencyManager.h
+//  CactusFramework
+//
+//  Keeps several auxiliary models resident under one memory budget
+//
+
+#import <Foundation/Foundation.h>
+#import "CactusModelConfiguration.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+@interface CactusModelResidencyManager : NSObject
+
+// Bytes available to resident models, including the model held by CactusModelManager.
+// Default: half of physical memory
+@property (nonatomic, assign) NSUInteger memoryBudget;
+@property (nonatomic, readonly) NSUInteger residentMemory;
+
++ (instancetype)sharedManager;
+
+// Loads a model under `identifier`, evicting least recently used models until it fits.
+// Fails with CactusLLMErrorInsufficientMemory when even an empty cache cannot hold it.
+- (void)loadModelWithIdentifier:(NSString *)identifier
+                  configuration:(CactusModelConfiguration *)configuration
+              completionHandler:(nullable void(^)(BOOL success, NSError * _Nullable error))completionHandler;
+
+// Runs `block` with the model's cactus_context. The model counts as used and cannot be evicted
+// while the block runs; blocks are serialized because all models share one CPU threadpool.
+- (BOOL)performWithModel:(NSString *)identifier
+                   block:(void(^)(void *context))block
+                   error:(NSError **)error;
+
+- (BOOL)isModelResident:(NSString *)identifier;
+- (NSArray<NSString *> *)residentIdentifiers; // most recently used first
+- (void)evictModelWithIdentifier:(NSString *)identifier;
+- (void)evictAllModels;
+
+- (NSDictionary *)statistics;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,342 @@
+//
+//  CactusModelResidencyManager.mm
+//  CactusFramework
+//
+
+#import "CactusModelResidencyManager.h"
+#import "CactusModelManager.h"
+#import "CactusBackgroundProcessor.h"
+#import "CactusUtilities.h"
+#import "CactusLLMError.h"
+#import "cactus/cactus.h"
+#import "cactus/common.h"
+#import "cactus/ggml-cpu.h"
+#import <mutex>
+
+@interface CactusModelManager (ParameterConversion)
+- (common_params)convertConfiguration:(CactusModelConfiguration *)config;
+- (void)placeLayersForParams:(common_params &)params configuration:(CactusModelConfiguration *)config;
+@end
+
+@interface CactusResidentModel : NSObject
+@property (nonatomic, copy) NSString *identifier;
+@property (nonatomic, strong) CactusModelConfiguration *configuration;
+@property (nonatomic, assign) cactus::cactus_context *context;
+@property (nonatomic, assign) NSUInteger estimatedBytes;
+@property (nonatomic, assign) uint64_t lastUsed;
+@property (nonatomic, assign) NSInteger pinCount;
+@end
+
+@implementation CactusResidentModel
+@end
+
+@interface CactusModelResidencyManager ()
+@property (nonatomic, strong) NSMutableDictionary<NSString *, CactusResidentModel *> *models;
+@property (nonatomic, strong) dispatch_source_t memoryPressureSource;
+@property (nonatomic, assign) uint64_t useClock;
+@property (nonatomic, assign) NSInteger evictions;
+@end
+
+@implementation CactusModelResidencyManager {
+    std::recursive_mutex _computeMutex;
+    lm_ggml_threadpool *_threadpool;
+}
+
++ (instancetype)sharedManager {
+    static CactusModelResidencyManager *sharedInstance = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedInstance = [[self alloc] init];
+    });
+    return sharedInstance;
+}
+
+- (instancetype)init {
+    if (self = [super init]) {
+        _models = [NSMutableDictionary dictionary];
+        _memoryBudget = (NSUInteger)([NSProcessInfo processInfo].physicalMemory / 2);
+        _threadpool = nullptr;
+        llama_backend_init();
+        
+        // Pressure drops idle models oldest first; critical pressure drops all of them
+        _memoryPressureSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_MEMORYPRESSURE, 0,
+                                                       DISPATCH_MEMORYPRESSURE_WARN | DISPATCH_MEMORYPRESSURE_CRITICAL,
+                                                       dispatch_get_global_queue(QOS_CLASS_UTILITY, 0));
+        __weak typeof(self) weakSelf = self;
+        dispatch_source_set_event_handler(_memoryPressureSource, ^{
+            __strong typeof(weakSelf) strongSelf = weakSelf;
+            if (!strongSelf) return;
+            if (dispatch_source_get_data(strongSelf.memoryPressureSource) & DISPATCH_MEMORYPRESSURE_CRITICAL) {
+                [strongSelf evictAllModels];
+            } else {
+                @synchronized(strongSelf) {
+                    [strongSelf evictLeastRecentlyUsedExcluding:nil];
+                }
+            }
+        });
+        dispatch_resume(_memoryPressureSource);
+    }
+    return self;
+}
+
+- (void)dealloc {
+    dispatch_source_cancel(_memoryPressureSource);
+    [self evictAllModels];
+    if (_threadpool) {
+        lm_ggml_threadpool_free(_threadpool);
+    }
+}
+
+#pragma mark - Accounting
+
+// Driven by the same estimators the configuration helpers use
++ (NSUInteger)estimatedBytesForConfiguration:(CactusModelConfiguration *)configuration {
+    NSDictionary<NSString *, NSNumber *> *estimate = [CactusModelUtilities estimateMemoryForConfiguration:configuration
+                                                                                               mmprojPath:nil];
+    if (estimate) {
+        return estimate[@"total"].unsignedIntegerValue;
+    }
+    return [CactusModelUtilities estimateModelMemoryUsage:configuration.modelPath] +
+           [CactusModelUtilities estimateContextMemoryUsage:configuration.contextSize];
+}
+
+// Must be called inside @synchronized(self)
+- (NSUInteger)usedBytes {
+    CactusModelManager *primary = [CactusModelManager sharedManager];
+    NSUInteger used = primary.isLoaded && primary.currentConfiguration
+        ? [CactusModelResidencyManager estimatedBytesForConfiguration:primary.currentConfiguration] : 0;
+    for (CactusResidentModel *model in self.models.allValues) {
+        used += model.estimatedBytes;
+    }
+    return used;
+}
+
+- (NSUInteger)residentMemory {
+    @synchronized(self) {
+        return [self usedBytes];
+    }
+}
+
+// Must be called inside @synchronized(self); returns NO when every model is pinned
+- (BOOL)evictLeastRecentlyUsedExcluding:(NSString *)identifier {
+    CactusResidentModel *victim = nil;
+    for (CactusResidentModel *model in self.models.allValues) {
+        if (model.pinCount > 0 || [model.identifier isEqualToString:identifier]) {
+            continue;
+        }
+        if (!victim || model.lastUsed < victim.lastUsed) {
+            victim = model;
+        }
+    }
+    if (!victim) {
+        return NO;
+    }
+    [self.models removeObjectForKey:victim.identifier];
+    delete victim.context;
+    victim.context = nullptr;
+    self.evictions++;
+    NSLog(@"Evicted resident model %@ (%lu bytes)", victim.identifier, (unsigned long)victim.estimatedBytes);
+    return YES;
+}
+
+#pragma mark - Loading
+
+- (void)loadModelWithIdentifier:(NSString *)identifier
+                  configuration:(CactusModelConfiguration *)configuration
+              completionHandler:(void(^)(BOOL success, NSError * _Nullable error))completionHandler {
+    NSError *error = nil;
+    if (![configuration isValid:&error]) {
+        if (completionHandler) {
+            completionHandler(NO, error);
+        }
+        return;
+    }
+    
+    CactusModelConfiguration *config = [configuration copy];
+    NSUInteger required = [CactusModelResidencyManager estimatedBytesForConfiguration:config];
+    
+    // Admission: make room before loading so two large models never overlap in memory
+    BOOL admitted = YES;
+    @synchronized(self) {
+        [self evictModelWithIdentifierLocked:identifier];
+        while ([self usedBytes] + required > self.memoryBudget) {
+            if (![self evictLeastRecentlyUsedExcluding:nil]) {
+                admitted = NO;
+                break;
+            }
+        }
+    }
+    if (!admitted) {
+        NSError *budgetError = [NSError errorWithDomain:CactusLLMErrorDomain
+                                                   code:CactusLLMErrorInsufficientMemory
+                                               userInfo:@{NSLocalizedDescriptionKey:
+                                                              [NSString stringWithFormat:@"%@ needs %lu MB, budget is %lu MB",
+                                                               identifier, (unsigned long)(required >> 20),
+                                                               (unsigned long)(self.memoryBudget >> 20)]}];
+        if (completionHandler) {
+            completionHandler(NO, budgetError);
+        }
+        return;
+    }
+    
+    __weak typeof(self) weakSelf = self;
+    CactusTask *loadTask = [CactusTask taskWithType:CactusTaskTypeModelLoad
+                                           priority:CactusTaskPriorityNormal
+                                        description:[NSString stringWithFormat:@"Loading resident model: %@", identifier]
+                                     executionBlock:^id(CactusTask *task, CactusTaskProgressHandler progress) {
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        if (!strongSelf) return nil;
+        
+        common_params params = [[CactusModelManager sharedManager] convertConfiguration:config];
+        [[CactusModelManager sharedManager] placeLayersForParams:params configuration:config];
+        if (params.cpuparams.n_threads <= 0) {
+            params.cpuparams.n_threads = cpu_get_num_math();
+        }
+        
+        cactus::cactus_context *context = new cactus::cactus_context();
+        if (!context->loadModel(params)) {
+            delete context;
+            @throw [NSException exceptionWithName:@"ModelLoadException"
+                                           reason:[NSString stringWithFormat:@"Failed to load resident model %@", identifier]
+                                         userInfo:nil];
+        }
+        [strongSelf attachSharedThreadpool:context threads:params.cpuparams.n_threads];
+        
+        CactusResidentModel *model = [[CactusResidentModel alloc] init];
+        model.identifier = identifier;
+        model.configuration = config;
+        model.context = context;
+        model.estimatedBytes = required;
+        BOOL replaced = YES;
+        @synchronized(strongSelf) {
+            [strongSelf evictModelWithIdentifierLocked:identifier];
+            replaced = strongSelf.models[identifier] == nil;
+            if (replaced) {
+                model.lastUsed = ++strongSelf.useClock;
+                strongSelf.models[identifier] = model;
+            }
+        }
+        if (!replaced) {
+            delete context;
+            @throw [NSException exceptionWithName:@"ModelInUse"
+                                           reason:[NSString stringWithFormat:@"Resident model %@ is in use", identifier]
+                                         userInfo:nil];
+        }
+        progress(1.0f);
+        return @YES;
+    }];
+    
+    loadTask.completionHandler = ^(id result, NSError *error) {
+        if (completionHandler) {
+            completionHandler(result != nil && error == nil, error);
+        }
+    };
+    [[CactusBackgroundProcessor sharedProcessor] submitTask:loadTask];
+}
+
+// One CPU threadpool serves every resident model instead of one pool per context
+- (void)attachSharedThreadpool:(cactus::cactus_context *)context threads:(int32_t)threads {
+    std::lock_guard<std::recursive_mutex> lock(_computeMutex);
+    if (!_threadpool) {
+        lm_ggml_threadpool_params tpp = lm_ggml_threadpool_params_default(threads);
+        _threadpool = lm_ggml_threadpool_new(&tpp);
+    }
+    if (_threadpool && context->ctx) {
+        llama_attach_threadpool(context->ctx, _threadpool, nullptr);
+    }
+}
+
+#pragma mark - Use
+
+- (BOOL)performWithModel:(NSString *)identifier block:(void(^)(void *context))block error:(NSError **)error {
+    CactusResidentModel *model = nil;
+    @synchronized(self) {
+        model = self.models[identifier];
+        if (model) {
+            model.pinCount++;
+            model.lastUsed = ++self.useClock;
+        }
+    }
+    if (!model) {
+        if (error) {
+            *error = [NSError errorWithDomain:CactusLLMErrorDomain
+                                         code:CactusLLMErrorModelNotLoaded
+                                     userInfo:@{NSLocalizedDescriptionKey:
+                                                    [NSString stringWithFormat:@"Model %@ is not resident", identifier]}];
+        }
+        return NO;
+    }
+    
+    {
+        std::lock_guard<std::recursive_mutex> lock(_computeMutex);
+        block(model.context);
+    }
+    
+    @synchronized(self) {
+        model.pinCount--;
+    }
+    return YES;
+}
+
+- (BOOL)isModelResident:(NSString *)identifier {
+    @synchronized(self) {
+        return self.models[identifier] != nil;
+    }
+}
+
+- (NSArray<NSString *> *)residentIdentifiers {
+    @synchronized(self) {
+        NSArray<CactusResidentModel *> *ordered = [self.models.allValues sortedArrayUsingComparator:^NSComparisonResult(CactusResidentModel *a, CactusResidentModel *b) {
+            return a.lastUsed > b.lastUsed ? NSOrderedAscending : (a.lastUsed < b.lastUsed ? NSOrderedDescending : NSOrderedSame);
+        }];
+        return [ordered valueForKey:@"identifier"];
+    }
+}
+
+#pragma mark - Eviction
+
+// Must be called inside @synchronized(self)
+- (void)evictModelWithIdentifierLocked:(NSString *)identifier {
+    CactusResidentModel *model = self.models[identifier];
+    if (!model || model.pinCount > 0) {
+        return;
+    }
+    [self.models removeObjectForKey:identifier];
+    delete model.context;
+    model.context = nullptr;
+}
+
+- (void)evictModelWithIdentifier:(NSString *)identifier {
+    @synchronized(self) {
+        [self evictModelWithIdentifierLocked:identifier];
+    }
+}
+
+- (void)evictAllModels {
+    @synchronized(self) {
+        while ([self evictLeastRecentlyUsedExcluding:nil]) {
+        }
+    }
+}
+
+- (NSDictionary *)statistics {
+    @synchronized(self) {
+        NSMutableDictionary *models = [NSMutableDictionary dictionary];
+        for (CactusResidentModel *model in self.models.allValues) {
+            models[model.identifier] = @{
+                @"modelPath": model.configuration.modelPath ?: @"",
+                @"estimatedBytes": @(model.estimatedBytes),
+                @"inUse": @(model.pinCount > 0)
+            };
+        }
+        return @{
+            @"memoryBudget": @(self.memoryBudget),
+            @"residentMemory": @([self usedBytes]),
+            @"residentModels": [models copy],
+            @"evictions": @(self.evictions),
+            @"sharedThreads": @(_threadpool ? lm_ggml_threadpool_get_n_threads(_threadpool) : 0)
+        };
+    }
+}
+
+@end
@@ -17,6 +17,7 @@ NS_ASSUME_NONNULL_BEGIN
 // Forward declarations
 @class CactusSessionManager;
 @class CactusSession;
+@class CactusLatencyMetrics;
 
 // Session types
 typedef NS_ENUM(NSInteger, CactusSessionType) {
@@ -63,6 +64,9 @@ typedef NS_ENUM(NSInteger, CactusGenerationEvent) {
                       duration:(NSTimeInterval)duration
                       metadata:(nullable NSDictionary *)metadata;
 
+// Chrome trace JSON of metadata["trace"], nil unless the generation ran with traceStages
+- (nullable NSData *)chromeTraceData;
+
 @end
 
 // MARK: - Session Delegate
@@ -87,6 +91,7 @@ typedef NS_ENUM(NSInteger, CactusGenerationEvent) {
 @property (nonatomic, readonly) CactusSessionState state;
 @property (nonatomic, readonly) NSDate *createdAt;
 @property (nonatomic, readonly, nullable) NSDate *lastActiveAt;
+@property (nonatomic, readonly) NSInteger sequenceId;       // KV cache sequence owned by this session, NSNotFound when it holds none
 @property (nonatomic, weak, nullable) id<CactusSessionDelegate> delegate;
 
 // Configuration
@@ -102,10 +107,32 @@ typedef NS_ENUM(NSInteger, CactusGenerationEvent) {
 @property (nonatomic, assign) BOOL enableSmartContextManagement;
 @property (nonatomic, assign) NSInteger maxContextTokens;
 
+// Token streaming (the first token is always delivered immediately)
+@property (nonatomic, assign) NSInteger tokenFlushCount;         // Default: 1 (deliver every token)
+@property (nonatomic, assign) NSTimeInterval tokenFlushInterval; // Default: 0 (no time-based flush)
+
+// Prompt prefill
+@property (nonatomic, assign) NSInteger prefillChunkSize;        // Default: 0 (evaluate the prompt in one go)
+
+// Draft prefill: updateDraftMessage: evaluates the user message being typed into this session's KV
+// sequence at low priority, so generating once it is sent only evaluates what changed since
+@property (nonatomic, assign) NSTimeInterval draftPrefillDelay;  // Default: 0.3 (debounce between updates)
+
+// Tool loops: a reply that ends in tool calls stays in the KV cache and the template text around the
+// results is evaluated while the tools run; submitToolResult: then evaluates only the result itself.
+// Once every result is in, the next generateResponse... continues from the cache.
+@property (nonatomic, assign) BOOL keepsToolTurns;               // Default: NO
+
+// Streamed speech: with a vocoder loaded, generated audio codes are vocoded every speechChunkCodes codes
+// and the 24 kHz mono float PCM delivered on the main queue as it becomes final
+@property (nonatomic, copy, nullable) void (^speechChunkHandler)(NSData *samples);
+@property (nonatomic, assign) NSInteger speechChunkCodes;        // Default: 0 (32 codes, ~0.4 s)
+
 // Statistics
 @property (nonatomic, readonly) NSInteger totalTokensGenerated;
 @property (nonatomic, readonly) NSInteger totalPromptTokens;
 @property (nonatomic, readonly) NSTimeInterval totalGenerationTime;
+@property (nonatomic, readonly) CactusLatencyMetrics *latencyMetrics; // This session's share of [CactusLatencyMetrics globalMetrics]
 
 // Factory methods
 + (instancetype)chatSessionWithId:(nullable NSUUID *)sessionId;
@@ -126,6 +153,9 @@ typedef NS_ENUM(NSInteger, CactusGenerationEvent) {
 - (void)removeLastMessage;
 - (void)removeMessageAtIndex:(NSUInteger)index;
 
+// The text of the user message being composed, nil once it was discarded. Safe to call per keystroke.
+- (void)updateDraftMessage:(nullable NSString *)draft;
+
 // Conversation management
 - (NSArray<CactusLLMMessage *> *)getConversationHistory;
 - (NSArray<CactusLLMMessage *> *)getUserMessages;
@@ -156,14 +186,43 @@ typedef NS_ENUM(NSInteger, CactusGenerationEvent) {
 - (NSUUID *)generateEmbeddingForText:(NSString *)text
                    completionHandler:(void(^)(NSArray<NSNumber *> * _Nullable embedding, NSError * _Nullable error))completionHandler;
 
+// Truncated (Matryoshka) embeddings: the leading dimensions, normalized after truncation; 0 keeps all
+- (NSUUID *)generateEmbeddingForText:(NSString *)text
+                          dimensions:(NSInteger)dimensions
+                   completionHandler:(void(^)(NSArray<NSNumber *> * _Nullable embedding, NSError * _Nullable error))completionHandler;
+
+// Embeds all texts in as few decodes as the context's sequences allow. matrix holds texts.count rows
+// of dimension floats, row-major in the order of texts. Clears the KV state of every sequence.
+- (NSUUID *)generateEmbeddingsForTexts:(NSArray<NSString *> *)texts
+                     completionHandler:(void(^)(NSData * _Nullable matrix, NSInteger dimension, NSError * _Nullable error))completionHandler;
+
+- (NSUUID *)generateEmbeddingsForTexts:(NSArray<NSString *> *)texts
+                            dimensions:(NSInteger)dimensions
+                     completionHandler:(void(^)(NSData * _Nullable matrix, NSInteger dimension, NSError * _Nullable error))completionHandler;
+
+// Relevance scores of documents to query, see +[CactusTask rerankJobWithQuery:documents:completionHandler:]
+- (NSUUID *)rerankDocuments:(NSArray<NSString *> *)documents
+                   forQuery:(NSString *)query
+          completionHandler:(void(^)(NSArray<NSNumber *> * _Nullable scores, NSError * _Nullable error))completionHandler;
+
 - (NSUUID *)generateMultimodalResponseWithPrompt:(NSString *)prompt
                                       mediaPaths:(NSArray<NSString *> *)mediaPaths
                                completionHandler:(void(^)(CactusGenerationResult * _Nullable result, NSError * _Nullable error))completionHandler;
 
+// Result of the call with the given index in the toolCalls metadata of the last reply, in any order
+// for parallel calls; adds the tool message to the history
+- (NSUUID *)submitToolResult:(NSString *)result forToolCallAtIndex:(NSUInteger)index;
+
 // Task control
 - (void)cancelGeneration:(NSUUID *)generationId;
 - (void)cancelAllGenerations;
 
+// Snapshots: messages plus the session's KV sequence and token history, so a restored chat resumes
+// without re-prefilling. Compression LZ4-compresses the KV blob; use a q8_0 cacheTypeK to shrink it further.
+- (BOOL)saveSnapshotToURL:(NSURL *)url error:(NSError **)error;
+- (BOOL)saveSnapshotToURL:(NSURL *)url compressed:(BOOL)compressed error:(NSError **)error;
+- (BOOL)restoreFromURL:(NSURL *)url error:(NSError **)error;
+
 @end
 
 // MARK: - Session Manager
@@ -226,6 +285,49 @@ typedef NS_ENUM(NSInteger, CactusGenerationEvent) {
 
 @end
 
+// MARK: - Embedding Jobs
+
+typedef void (^CactusEmbeddingRowHandler)(NSUInteger index, NSData *embedding);
+
+@interface CactusTask (EmbeddingJobs)
+
+// Embeds texts bucketed by token length so each ubatch is filled as far as possible. rowHandler runs
+// on the task's thread with each row (dimension floats) in input order; the task result is
+// @{@"matrix": NSData of texts.count rows, @"dimension": NSNumber}. Clears the KV state of every sequence.
+// dimensions > 0 keeps the leading dimensions of a Matryoshka model; 0 keeps all of them.
++ (instancetype)embeddingJobWithTexts:(NSArray<NSString *> *)texts
+                           dimensions:(NSInteger)dimensions
+                           rowHandler:(nullable CactusEmbeddingRowHandler)rowHandler
+                      progressHandler:(nullable CactusTaskProgressHandler)progressHandler
+                    completionHandler:(nullable CactusTaskCompletionHandler)completionHandler;
+
+// Scores documents against query with a reranker loaded with rank pooling, the pairs packed into as
+// few decodes as the context's sequences allow. The task result is an NSArray<NSNumber *> of scores
+// in the order of documents, higher is more relevant. Clears the KV state of every sequence.
++ (instancetype)rerankJobWithQuery:(NSString *)query
+                         documents:(NSArray<NSString *> *)documents
+                 completionHandler:(nullable CactusTaskCompletionHandler)completionHandler;
+
+@end
+
+// MARK: - Training Jobs
+
+@interface CactusTask (TrainingJobs)
+
+// Low-priority, preemptible job training a LoRA adapter of the given rank on texts over the frozen
+// weights of the loaded model, written to outputPath for applyLoraAdapters. Activations are sized to
+// a quarter of the memory the process has left; the job waits while generation runs and checkpoints
+// as it goes, a cancelled job enqueued again resumes where it stopped. The task result is
+// @{@"path": NSString, @"loss": NSNumber, @"completed": NSNumber (NO when cancelled)}.
++ (instancetype)loraTrainingJobWithTexts:(NSArray<NSString *> *)texts
+                              outputPath:(NSString *)outputPath
+                                    rank:(NSInteger)rank
+                                  epochs:(NSInteger)epochs
+                         progressHandler:(nullable CactusTaskProgressHandler)progressHandler
+                       completionHandler:(nullable CactusTaskCompletionHandler)completionHandler;
+
+@end
+
 // MARK: - Notifications
 
 extern NSNotificationName const CactusSessionDidChangeStateNotification;
@@ -6,9 +6,12 @@
 #import "CactusSessionManager.h"
 #import "CactusModelManager.h"
 #import "CactusLLMError.h"
+#import "CactusUtilities.h"
 #import "cactus/cactus.h"
 #import "cactus/common.h"
 #import <mutex>
+#import <os/proc.h>
+#import <os/signpost.h>
 
 // Notification names
 NSNotificationName const CactusSessionDidChangeStateNotification = @"CactusSessionDidChangeStateNotification";
@@ -56,6 +59,28 @@ NSString * const CactusSessionProgressKey = @"progress";
                              metadata:metadata];
 }
 
+- (NSData *)chromeTraceData {
+    NSArray<NSDictionary *> *spans = self.metadata[@"trace"][@"spans"];
+    if (!spans) {
+        return nil;
+    }
+    NSMutableArray *events = [NSMutableArray arrayWithCapacity:spans.count];
+    for (NSDictionary *span in spans) {
+        [events addObject:@{
+            @"name": span[@"name"],
+            @"cat": @"cactus",
+            @"ph": @"X",
+            @"ts": @(llround([span[@"start"] doubleValue] * 1e6)),
+            @"dur": @(llround([span[@"duration"] doubleValue] * 1e6)),
+            @"pid": @1,
+            @"tid": @1
+        }];
+    }
+    return [NSJSONSerialization dataWithJSONObject:@{@"displayTimeUnit": @"ms", @"traceEvents": events}
+                                           options:0
+                                             error:nil];
+}
+
 - (NSString *)description {
     return [NSString stringWithFormat:@"<CactusGenerationResult: tokens=%ld, duration=%.2fs, speed=%.1f t/s>",
             (long)self.tokensGenerated, self.duration, self.tokensPerSecond];
@@ -65,15 +90,225 @@ NSString * const CactusSessionProgressKey = @"progress";
 
 #pragma mark - Session Implementation
 
+static const CFTimeInterval CactusThermalCheckInterval = 1.0;
+static const int32_t CactusSummaryMaxTokens = 192;
+static const int32_t CactusDraftPrefillChunk = 64; // draft chunks stay short so a send preempts them quickly
+static const NSInteger CactusSnapshotVersion = 1;
+
+static os_log_t CactusSignpostLog(void) {
+    static os_log_t log;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        log = os_log_create("com.cactus.framework", "Completion");
+    });
+    return log;
+}
+
+// Spans relative to the first one, in seconds, plus per-stage totals
+static NSDictionary *CactusTraceMetadata(const cactus::cactus_context *context, int64_t dispatchUs) {
+    const std::vector<cactus::cactus_trace_span> &spans = context->trace_spans;
+    const int64_t origin = spans.empty() ? 0 : spans.front().start_us;
+    NSMutableArray<NSDictionary *> *spanArray = [NSMutableArray arrayWithCapacity:spans.size()];
+    for (const cactus::cactus_trace_span &span : spans) {
+        [spanArray addObject:@{
+            @"name": @(span.name),
+            @"start": @((span.start_us - origin) / 1e6),
+            @"duration": @(span.dur_us / 1e6)
+        }];
+    }
+    const cactus::cactus_completion_profile &profile = context->profile;
+    return @{
+        @"spans": spanArray,
+        @"truncated": @(spans.size() >= context->trace_limit),
+        @"totals": @{
+            @"tokenize": @(profile.prompt_us / 1e6),
+            @"prefill": @(profile.prefill_us / 1e6),
+            @"decode": @(profile.decode_us / 1e6),
+            @"sample": @(profile.sample_us / 1e6),
+            @"grammar": @(profile.grammar_us / 1e6),
+            @"detokenize": @(profile.detokenize_us / 1e6),
+            @"stopMatch": @(profile.stop_us / 1e6),
+            @"dispatch": @(dispatchUs / 1e6)
+        }
+    };
+}
+
+// OpenAI-style tool list for the chat template, nil when there are no tools
+static NSString *CactusToolsJSON(NSArray<CactusLLMTools *> *tools) {
+    if (tools.count == 0) {
+        return nil;
+    }
+    NSMutableArray *toolsArray = [NSMutableArray arrayWithCapacity:tools.count];
+    for (CactusLLMTools *tool in tools) {
+        [toolsArray addObject:@{
+            @"type": @"function",
+            @"function": @{
+                @"name": tool.name ?: @"",
+                @"description": tool.desc ?: @"",
+                @"parameters": tool.parametersJSONSchema ?: @{}
+            }
+        }];
+    }
+    NSData *data = [NSJSONSerialization dataWithJSONObject:toolsArray options:0 error:nil];
+    return data ? [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding] : nil;
+}
+
+// Arguments are handed over parsed when they are a JSON object, as the raw string otherwise
+static NSDictionary *CactusToolCallDictionary(const cactus::cactus_tool_call &call, NSUInteger index) {
+    NSString *arguments = [NSString stringWithUTF8String:call.arguments.c_str()] ?: @"";
+    id parsed = [NSJSONSerialization JSONObjectWithData:[arguments dataUsingEncoding:NSUTF8StringEncoding]
+                                                options:0
+                                                  error:nil];
+    NSMutableDictionary *toolCall = [@{
+        @"name": [NSString stringWithUTF8String:call.name.c_str()] ?: @"",
+        @"arguments": [parsed isKindOfClass:[NSDictionary class]] ? parsed : arguments,
+        @"index": @(index)
+    } mutableCopy];
+    if (!call.id.empty()) {
+        toolCall[@"id"] = [NSString stringWithUTF8String:call.id.c_str()] ?: @"";
+    }
+    return toolCall;
+}
+
+// Chat messages handed to the template directly, without going through JSON
+static std::vector<common_chat_msg> CactusChatMessages(NSArray<CactusLLMMessage *> *messages) {
+    std::vector<common_chat_msg> chatMessages;
+    chatMessages.reserve(messages.count);
+    for (CactusLLMMessage *message in messages) {
+        common_chat_msg msg;
+        msg.role = message.role.UTF8String;
+        msg.content = (message.content ?: @"").UTF8String;
+        chatMessages.push_back(std::move(msg));
+    }
+    return chatMessages;
+}
+
+// Builds the prompt from the token spans cached on each message; only messages without a span
+// for the current model and template are rendered and tokenized. Returns NO when the template
+// cannot be rendered incrementally, in which case the caller formats the whole chat instead.
+static BOOL CactusBuildPromptTokens(cactus::cactus_context *context,
+                                    NSArray<CactusLLMMessage *> *messages,
+                                    const std::vector<common_chat_msg> &chatMessages,
+                                    std::vector<llama_token> &tokens) {
+    NSString *templateKey = [NSString stringWithFormat:@"%p:%p:%llu", context->model, context->templates.get(),
+                             (unsigned long long)llama_model_size(context->model)];
+    NSString *firstKey = [templateKey stringByAppendingString:@":bos"]; // the first span also carries BOS
+    
+    NSUInteger nCached = 0;
+    for (CactusLLMMessage *message in messages) {
+        NSString *key = nCached == 0 ? firstKey : templateKey;
+        if (!message.cachedPromptTokens || ![message.cachedPromptTokensKey isEqualToString:key]) {
+            break;
+        }
+        nCached++;
+    }
+    
+    std::vector<std::string> spans;
+    std::string generationPrompt;
+    if (!context->formatChatSpans(chatMessages, nCached, spans, generationPrompt)) {
+        return NO;
+    }
+    
+    tokens.clear();
+    for (NSUInteger i = 0; i < messages.count; i++) {
+        CactusLLMMessage *message = messages[i];
+        if (i >= nCached) {
+            std::vector<llama_token> span = common_tokenize(context->ctx, spans[i - nCached], i == 0, true);
+            message.cachedPromptTokens = [NSData dataWithBytes:span.data() length:span.size() * sizeof(llama_token)];
+            message.cachedPromptTokensKey = i == 0 ? firstKey : templateKey;
+        }
+        NSData *span = message.cachedPromptTokens;
+        const llama_token *ids = (const llama_token *)span.bytes;
+        tokens.insert(tokens.end(), ids, ids + span.length / sizeof(llama_token));
+    }
+    std::vector<llama_token> suffix = common_tokenize(context->ctx, generationPrompt, messages.count == 0, true);
+    tokens.insert(tokens.end(), suffix.begin(), suffix.end());
+    return YES;
+}
+
+// The prompt up to the stable part of a draft user message: the history's spans, then the draft's
+// turn cut before its last word, which may still grow and tokenize differently
+static BOOL CactusBuildDraftTokens(cactus::cactus_context *context,
+                                   NSArray<CactusLLMMessage *> *messages,
+                                   NSString *draft,
+                                   std::vector<llama_token> &tokens) {
+    std::vector<common_chat_msg> chatMessages = CactusChatMessages(messages);
+    tokens.clear();
+    if (messages.count > 0) {
+        if (!CactusBuildPromptTokens(context, messages, chatMessages, tokens)) {
+            return NO;
+        }
+        // Drop the generation prompt, the draft's turn follows the history
+        size_t historyTokens = 0;
+        for (CactusLLMMessage *message in messages) {
+            historyTokens += message.cachedPromptTokens.length / sizeof(llama_token);
+        }
+        tokens.resize(historyTokens);
+    }
+    
+    NSRange lastBreak = [draft rangeOfCharacterFromSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]
+                                               options:NSBackwardsSearch];
+    const std::string stable = lastBreak.location == NSNotFound ? "" : [draft substringToIndex:lastBreak.location].UTF8String;
+    common_chat_msg user;
+    user.role = "user";
+    user.content = draft.UTF8String;
+    chatMessages.push_back(std::move(user));
+    
+    std::vector<std::string> spans;
+    std::string generationPrompt;
+    if (!context->formatChatSpans(chatMessages, messages.count, spans, generationPrompt) || spans.empty()) {
+        return NO;
+    }
+    const std::string &turn = spans.back();
+    const size_t at = turn.rfind(chatMessages.back().content);
+    if (at == std::string::npos) {
+        return NO;
+    }
+    std::vector<llama_token> head = common_tokenize(context->ctx, turn.substr(0, at + stable.size()), messages.count == 0, true);
+    tokens.insert(tokens.end(), head.begin(), head.end());
+    return YES;
+}
+
+@interface CactusSessionManager (Sequences)
+- (NSInteger)acquireSequenceForSession:(CactusSession *)session capacity:(NSInteger)capacity evicted:(NSInteger *)evicted;
+- (NSInteger)reserveSpareSequenceWithCapacity:(NSInteger)capacity;
+- (void)returnSpareSequence:(NSInteger)sequenceId;
+@end
+
+// The session's own KV sequence, taken over from the session idle the longest when none is free
+// (whose cache is released first); -1 when every sequence belongs to a generating session
+static llama_seq_id CactusSessionSequence(CactusSession *session, cactus::cactus_context *context) {
+    NSInteger evicted = NSNotFound;
+    const NSInteger sequenceId = [[CactusSessionManager sharedManager] acquireSequenceForSession:session
+                                                                                          capacity:context->sessionSequences()
+                                                                                           evicted:&evicted];
+    if (sequenceId == NSNotFound) {
+        return -1;
+    }
+    if (evicted != NSNotFound) {
+        NSLog(@"KV sequence %ld taken over from an idle session, which re-evaluates its history next turn", (long)evicted);
+        context->releaseSequence((llama_seq_id)evicted);
+    }
+    return (llama_seq_id)sequenceId;
+}
+
 @interface CactusSession ()
 @property (nonatomic, readwrite) CactusSessionState state;
 @property (nonatomic, readwrite) NSDate *lastActiveAt;
+@property (nonatomic, readwrite) NSInteger sequenceId;
 @property (nonatomic, strong) NSMutableArray<CactusLLMMessage *> *mutableMessages;
 @property (nonatomic, strong) NSMutableDictionary<NSUUID *, CactusTask *> *activeTasks;
 @property (nonatomic, strong) dispatch_queue_t synchronizationQueue;
 @property (nonatomic, readwrite) NSInteger totalTokensGenerated;
 @property (nonatomic, readwrite) NSInteger totalPromptTokens;
 @property (nonatomic, readwrite) NSTimeInterval totalGenerationTime;
+@property (nonatomic, strong, nullable) CactusLLMMessage *systemPromptMessage;
+@property (nonatomic, strong, nullable) NSUUID *summaryTaskId;
+@property (nonatomic, strong, nullable) NSUUID *draftTaskId;
+@property (nonatomic, assign) NSUInteger draftRevision;
+@property (nonatomic, copy, nullable) NSArray<NSDictionary *> *pendingToolCalls;
+@property (nonatomic, strong) NSMutableDictionary<NSNumber *, NSString *> *pendingToolResults;
+@property (nonatomic, assign) NSUInteger nextToolResultIndex;
 
 @end
 
@@ -85,14 +320,23 @@ NSString * const CactusSessionProgressKey = @"progress";
         _type = type;
         _state = CactusSessionStateIdle;
         _createdAt = [NSDate date];
+        _sequenceId = NSNotFound;
         _mutableMessages = [NSMutableArray array];
         _activeTasks = [NSMutableDictionary dictionary];
+        _pendingToolResults = [NSMutableDictionary dictionary];
+        _latencyMetrics = [[CactusLatencyMetrics alloc] init];
         _synchronizationQueue = dispatch_queue_create("com.cactus.session", DISPATCH_QUEUE_CONCURRENT);
         
         // Initialize context manager
         _contextManager = [CactusContextManager sharedManager];
         _enableSmartContextManagement = YES;
         _maxContextTokens = 4096; // Default 4K context
+        
+        // Deliver every token by default
+        _tokenFlushCount = 1;
+        _tokenFlushInterval = 0;
+        
+        _draftPrefillDelay = 0.3;
     }
     return self;
 }
@@ -150,6 +394,7 @@ NSString * const CactusSessionProgressKey = @"progress";
         self.totalTokensGenerated = 0;
         self.totalPromptTokens = 0;
         self.totalGenerationTime = 0;
+        [self.latencyMetrics reset];
         self.state = CactusSessionStateIdle;
     });
 }
@@ -217,6 +462,39 @@ NSString * const CactusSessionProgressKey = @"progress";
     });
 }
 
+// Prompt messages: the system prompt keeps one message object so its token span stays cached
+- (NSArray<CactusLLMMessage *> *)promptMessagesWithHistory:(NSArray<CactusLLMMessage *> *)history {
+    NSMutableArray<CactusLLMMessage *> *promptMessages = [NSMutableArray array];
+    if (self.systemPrompt) {
+        if (![self.systemPromptMessage.content isEqualToString:self.systemPrompt]) {
+            self.systemPromptMessage = [CactusLLMMessage messageWithRole:CactusLLMRoleSystem
+                                                                 content:self.systemPrompt];
+        }
+        [promptMessages addObject:self.systemPromptMessage];
+    }
+    [promptMessages addObjectsFromArray:history];
+    return promptMessages;
+}
+
+- (void)deliverTokenChunk:(NSString *)chunk tokenHandler:(void(^)(NSString *token))tokenHandler {
+    dispatch_async(dispatch_get_main_queue(), ^{
+        if (tokenHandler) {
+            tokenHandler(chunk);
+        }
+        
+        if ([self.delegate respondsToSelector:@selector(session:didGenerateToken:)]) {
+            [self.delegate session:self didGenerateToken:chunk];
+        }
+        
+        [[NSNotificationCenter defaultCenter] postNotificationName:CactusSessionDidGenerateTokenNotification
+                                                            object:self
+                                                          userInfo:@{
+                                                              CactusSessionIdKey: self.sessionId,
+                                                              CactusSessionTokenKey: chunk
+                                                          }];
+    });
+}
+
 - (NSUUID *)generateResponseWithCompletionHandler:(void(^)(CactusGenerationResult * _Nullable result, NSError * _Nullable error))completionHandler {
     return [self generateResponseWithProgressHandler:nil
                                          tokenHandler:nil
@@ -248,11 +526,14 @@ NSString * const CactusSessionProgressKey = @"progress";
         return [NSUUID UUID]; // Return dummy UUID
     }
     
+    // A background summary or draft prefill must never delay the user's turn
+    [self cancelModelSummary];
+    [self cancelDraftPrefill];
     self.state = CactusSessionStateGenerating;
     
     __weak typeof(self) weakSelf = self;
     CactusTask *generationTask = [CactusTask taskWithType:CactusTaskTypeGeneration
-                                                 priority:CactusTaskPriorityNormal
+                                                 priority:CactusTaskPriorityHigh // interactive chat preempts background lane work
                                               description:@"Generating chat response"
                                            executionBlock:^id(CactusTask *task, CactusTaskProgressHandler progress) {
         __strong typeof(weakSelf) strongSelf = weakSelf;
@@ -260,8 +541,9 @@ NSString * const CactusSessionProgressKey = @"progress";
         
         NSDate *startTime = [NSDate date];
         
-        // Get context from model manager
-        cactus::cactus_context *context = (cactus::cactus_context *)[[CactusModelManager sharedManager] internalContext];
+        // Hold the model context for the whole generation so memory relief cannot tear it down
+        CactusContextLease lease;
+        cactus::cactus_context *context = (cactus::cactus_context *)lease.context;
         if (!context) {
             @throw [NSException exceptionWithName:@"ContextNotAvailable"
                                            reason:@"Model context not available"
@@ -272,33 +554,7 @@ NSString * const CactusSessionProgressKey = @"progress";
         NSArray<CactusLLMMessage *> *optimizedMessages = strongSelf.enableSmartContextManagement ? 
             [strongSelf getOptimizedConversationHistory] : [strongSelf getConversationHistory];
         
-        // Convert optimized messages to chat format
-        NSMutableArray *messagesArray = [NSMutableArray array];
-        
-        // Add system prompt if available
-        if (strongSelf.systemPrompt) {
-            [messagesArray addObject:@{
-                @"role": @"system",
-                @"content": strongSelf.systemPrompt
-            }];
-        }
-        
-        // Add optimized conversation history
-        for (CactusLLMMessage *message in optimizedMessages) {
-            if (message.role != CactusLLMRoleSystem) {
-                [messagesArray addObject:@{
-                    @"role": message.role,
-                    @"content": message.content
-                }];
-            }
-            else {
-                [messagesArray addObject:@{
-                    @"role": message.role,
-                    @"content": message.content,
-//                    @"tools": message.tools
-                }];
-            }
-        }
+        NSArray<CactusLLMMessage *> *promptMessages = [strongSelf promptMessagesWithHistory:optimizedMessages];
         
         // Log optimization results
         if (strongSelf.enableSmartContextManagement) {
@@ -311,21 +567,36 @@ NSString * const CactusSessionProgressKey = @"progress";
             }
         }
         
-        // Convert to JSON
-        NSError *jsonError = nil;
-        NSData *jsonData = [NSJSONSerialization dataWithJSONObject:messagesArray
-                                                           options:0
-                                                             error:&jsonError];
-        if (jsonError) {
-            @throw [NSException exceptionWithName:@"JSONSerializationError"
-                                           reason:jsonError.localizedDescription
-                                         userInfo:@{@"error": jsonError}];
+        // Opt-in stage timing; the template span is recorded once beginCompletion() has reset the trace
+        const BOOL traceStages = strongSelf.generationConfig.traceStages;
+        const os_signpost_id_t signpostId = traceStages ? os_signpost_id_generate(CactusSignpostLog()) : OS_SIGNPOST_ID_NULL;
+        if (traceStages) {
+            os_signpost_interval_begin(CactusSignpostLog(), signpostId, "Prompt");
         }
+        const int64_t templateStart = llama_time_us();
         
-        NSString *messagesJSON = [[NSString alloc] initWithData:jsonData encoding:NSUTF8StringEncoding];
-        
-        // Format chat using context
-        std::string formattedPrompt = context->getFormattedChat(messagesJSON.UTF8String, "");
+        // Reuse cached per-message token spans; fall back to formatting the whole chat.
+        // Tools go through the Jinja template, which also yields the lazy tool-call grammar
+        NSString *toolsJSON = CactusToolsJSON(strongSelf.tools);
+        common_chat_params toolChat;
+        std::vector<llama_token> promptTokenIds;
+        std::string formattedPrompt;
+        std::vector<common_chat_msg> chatMessages = CactusChatMessages(promptMessages);
+        if (toolsJSON || !CactusBuildPromptTokens(context, promptMessages, chatMessages, promptTokenIds)) {
+            if (toolsJSON) {
+                try {
+                    toolChat = context->getFormattedChatWithJinja(std::move(chatMessages), "", "", toolsJSON.UTF8String, false, "");
+                } catch (const std::exception &e) {
+                    @throw [NSException exceptionWithName:@"ChatTemplateError"
+                                                   reason:[NSString stringWithUTF8String:e.what()]
+                                                 userInfo:nil];
+                }
+                formattedPrompt = toolChat.prompt;
+            } else {
+                formattedPrompt = context->getFormattedChat(std::move(chatMessages), "");
+            }
+        }
+        const int64_t templateEnd = llama_time_us();
         
         // Apply generation configuration
         if (strongSelf.generationConfig) {
@@ -342,6 +613,14 @@ NSString * const CactusSessionProgressKey = @"progress";
             context->params.sampling.mirostat = (int32_t)strongSelf.generationConfig.mirostat;
             context->params.sampling.mirostat_tau = strongSelf.generationConfig.mirostatTau;
             context->params.sampling.mirostat_eta = strongSelf.generationConfig.mirostatEta;
+            context->lookup_ngram_size = (int32_t)MAX(0, strongSelf.generationConfig.promptLookupNgramSize);
+            context->self_spec_skip_layers = (int32_t)MAX(0, strongSelf.generationConfig.selfSpeculationSkipLayers);
+            context->context_shift_discard = strongSelf.generationConfig.contextShiftDiscardFraction;
+            context->timeout_ms = (int64_t)MAX(0, strongSelf.generationConfig.timeoutInterval * 1000.0);
+            context->grammar_fast_forward = strongSelf.generationConfig.grammarFastForward;
+            context->truncation = (cactus::truncation_strategy)strongSelf.generationConfig.truncationStrategy;
+            context->lean_sampling = strongSelf.generationConfig.leanSampling;
+            context->probs_history_limit = (size_t)MAX(0, strongSelf.generationConfig.probsHistoryLimit);
             
             if (strongSelf.generationConfig.maxTokens > 0) {
                 context->params.n_predict = (int32_t)strongSelf.generationConfig.maxTokens;
@@ -361,67 +640,225 @@ NSString * const CactusSessionProgressKey = @"progress";
             }
         }
         
+        // The tool-call grammar only binds once its trigger fires; from there grammar fast-forward
+        // appends the schema's keys and punctuation without sampling them
+        const common_params_sampling savedSampling = context->params.sampling;
+        const BOOL savedFastForward = context->grammar_fast_forward;
+        const BOOL toolGrammar = toolsJSON && !toolChat.grammar.empty() && !strongSelf.generationConfig.grammar;
+        if (toolGrammar) {
+            context->params.sampling.grammar = toolChat.grammar;
+            context->params.sampling.grammar_lazy = toolChat.grammar_lazy;
+            context->params.sampling.grammar_triggers = toolChat.grammar_triggers;
+            context->grammar_fast_forward = true;
+        }
+        const std::vector<std::string> savedAntiprompt = context->params.antiprompt;
+        for (const std::string &stop : toolChat.additional_stops) {
+            if (std::find(context->params.antiprompt.begin(), context->params.antiprompt.end(), stop) == context->params.antiprompt.end()) {
+                context->params.antiprompt.push_back(stop);
+            }
+        }
+        context->scan_tool_calls = toolsJSON != nil;
+        const auto restoreToolGrammar = [&]() {
+            context->scan_tool_calls = false;
+            context->params.antiprompt = savedAntiprompt;
+            if (toolGrammar) {
+                context->params.sampling.grammar = savedSampling.grammar;
+                context->params.sampling.grammar_lazy = savedSampling.grammar_lazy;
+                context->params.sampling.grammar_triggers = savedSampling.grammar_triggers;
+                context->grammar_fast_forward = savedFastForward;
+            }
+        };
+        
+        // KV streaming keeps the system prompt and the recent window in the cache, older turns are evicted there
+        CactusContextManager *contextManager = strongSelf.contextManager;
+        if (strongSelf.enableSmartContextManagement && contextManager.retentionStrategy == CactusContextRetentionStrategyKVStreaming) {
+            NSInteger sinkTokens = contextManager.streamingSinkTokens;
+            if (promptTokenIds.size() > 0 && strongSelf.systemPromptMessage.cachedPromptTokens) {
+                sinkTokens = MAX(sinkTokens, (NSInteger)(strongSelf.systemPromptMessage.cachedPromptTokens.length / sizeof(llama_token)));
+            }
+            context->stream_sink = (int32_t)sinkTokens;
+            context->stream_window = (int32_t)MAX(0, MIN(contextManager.maxContextTokens, (NSInteger)context->n_ctx) - sinkTokens);
+        } else {
+            context->stream_window = 0;
+        }
+        
+        // Throttle before the prompt is evaluated; a critical state may also quantize the KV cache here
+        BOOL thermalThrottling = !strongSelf.generationConfig || strongSelf.generationConfig.thermalThrottling;
+        NSProcessInfoThermalState initialThermalState = [NSProcessInfo processInfo].thermalState;
+        NSProcessInfoThermalState peakThermalState = initialThermalState;
+        context->applyThermalState(thermalThrottling ? (cactus::thermal_state)initialThermalState : cactus::THERMAL_NOMINAL, true);
+        context->thermal_paced_us = 0;
+        
         // Set prompt and initialize
         context->params.prompt = formattedPrompt;
         
         if (!context->initSampling()) {
+            restoreToolGrammar();
             @throw [NSException exceptionWithName:@"SamplingInitError"
                                            reason:@"Failed to initialize sampling"
                                          userInfo:nil];
         }
         
-        context->rewind();
+        // Switch to this session's KV sequence, then reuse the prefix shared with the previous turn
+        llama_seq_id seqId = CactusSessionSequence(strongSelf, context);
+        if (seqId < 0) {
+            restoreToolGrammar();
+            @throw [NSException exceptionWithName:@"SequenceError"
+                                           reason:@"Every KV sequence is held by a generating session"
+                                         userInfo:nil];
+        }
+        if (!context->setActiveSequence(seqId)) {
+            restoreToolGrammar();
+            @throw [NSException exceptionWithName:@"SequenceError"
+                                           reason:@"Failed to activate session sequence"
+                                         userInfo:nil];
+        }
+        
+        context->tracing = traceStages;
         context->beginCompletion();
-        context->loadPrompt();
+        if (traceStages) {
+            context->trace_spans.push_back({"chat_template", templateStart, templateEnd - templateStart});
+        }
+        // Let cancellation interrupt a running decode instead of waiting for the next token
+        context->setAbortHook([task]() -> bool { return task.isCancelled; });
+        // Vocode audio codes while they are generated so speech can play before the utterance ends
+        void (^speechChunkHandler)(NSData *samples) = strongSelf.speechChunkHandler;
+        if (speechChunkHandler && context->isVocoderEnabled()) {
+            context->beginSpeechStream((int)strongSelf.speechChunkCodes, [speechChunkHandler](const float *samples, size_t count) {
+                NSData *pcm = [NSData dataWithBytes:samples length:count * sizeof(float)];
+                dispatch_async(dispatch_get_main_queue(), ^{
+                    speechChunkHandler(pcm);
+                });
+                return true;
+            });
+        }
+        // A kept tool turn with every result in is already the prompt, mostly evaluated
+        if (context->toolTurnReady()) {
+            promptTokenIds = context->embd;
+        }
+        context->pretokenized_prompt = std::move(promptTokenIds);
+        context->loadPromptReusingPrefix();
+        const CFAbsoluteTime prefillStart = CFAbsoluteTimeGetCurrent();
+        const size_t prefillTokens = context->embd.size() - MIN(context->n_past, context->embd.size());
+        
+        // Evaluate long prompts in chunks so cancellation and progress stay responsive
+        if (strongSelf.prefillChunkSize > 0) {
+            while (!context->prefillStep((int32_t)strongSelf.prefillChunkSize)) {
+                if (task.isCancelled || context->is_interrupted) {
+                    break;
+                }
+                progress(0.1f * context->prefillProgress());
+            }
+        }
         
         progress(0.1f);
+        if (traceStages) {
+            os_signpost_interval_end(CactusSignpostLog(), signpostId, "Prompt");
+        }
         
         // Generate tokens
         NSMutableString *generatedText = [NSMutableString string];
         NSInteger tokensGenerated = 0;
         NSInteger promptTokens = context->num_prompt_tokens;
+        NSMutableString *pendingChunk = [NSMutableString string];
+        NSInteger pendingChunkTokens = 0;
+        CFAbsoluteTime lastFlushTime = CFAbsoluteTimeGetCurrent();
+        CFAbsoluteTime lastThermalCheck = lastFlushTime;
+        BOOL firstChunkDelivered = NO;
+        int64_t dispatchUs = 0;
+        NSMutableArray<NSDictionary *> *toolCalls = [NSMutableArray array];
+        CactusLatencyMetrics *sessionLatency = strongSelf.latencyMetrics;
+        CactusLatencyMetrics *globalLatency = [CactusLatencyMetrics globalMetrics];
+        const uint64_t queueWaitUs = (uint64_t)MAX(0.0, [task.startedAt timeIntervalSinceDate:task.createdAt] * 1e6);
+        [sessionLatency.queueWait recordValue:queueWaitUs];
+        CFAbsoluteTime lastTokenTime = 0;
         
         while (context->has_next_token && !context->is_interrupted && !task.isCancelled) {
+            CFAbsoluteTime decodeStart = CFAbsoluteTimeGetCurrent();
+            if (traceStages) {
+                os_signpost_interval_begin(CactusSignpostLog(), signpostId, "Token");
+            }
             auto token_data = context->doCompletion();
+            if (traceStages) {
+                os_signpost_interval_end(CactusSignpostLog(), signpostId, "Token");
+            }
+            [CactusPerformanceMonitor recordTokenWithDecodeLatency:CFAbsoluteTimeGetCurrent() - decodeStart];
             
             if (token_data.tok == -1) {
                 break;
             }
             
             tokensGenerated++;
+            const CFAbsoluteTime tokenTime = CFAbsoluteTimeGetCurrent();
+            if (tokensGenerated == 1) {
+                // The first token is timed from the request, it includes the queue wait and the prefill
+                const uint64_t ttftUs = (uint64_t)MAX(0.0, [[NSDate date] timeIntervalSinceDate:task.createdAt] * 1e6);
+                [sessionLatency.timeToFirstToken recordValue:ttftUs];
+                [globalLatency.timeToFirstToken recordValue:ttftUs];
+                if (prefillTokens > 0 && tokenTime > prefillStart) {
+                    const uint64_t tokensPerSecond = (uint64_t)(prefillTokens / (tokenTime - prefillStart));
+                    [sessionLatency.prefillThroughput recordValue:tokensPerSecond];
+                    [globalLatency.prefillThroughput recordValue:tokensPerSecond];
+                }
+            } else {
+                const uint64_t itlUs = (uint64_t)MAX(0.0, (tokenTime - lastTokenTime) * 1e6);
+                [sessionLatency.interTokenLatency recordValue:itlUs];
+                [globalLatency.interTokenLatency recordValue:itlUs];
+            }
+            lastTokenTime = tokenTime;
+            const int64_t dispatchStart = traceStages ? llama_time_us() : 0;
             
-            // Get new text
-            if (context->generated_text.length() > generatedText.length) {
-                NSString *newText = @(context->generated_text.c_str());
-                NSString *newToken = [newText substringFromIndex:generatedText.length];
+            // Get only the bytes added by this token (partial UTF-8 is held back)
+            std::string_view delta = context->lastTextDelta();
+            NSString *newToken = delta.empty() ? nil : [[NSString alloc] initWithBytes:delta.data()
+                                                                                length:delta.size()
+                                                                              encoding:NSUTF8StringEncoding];
+            if (newToken.length > 0) {
                 [generatedText appendString:newToken];
                 
-                // Check for stop sequences using utility method
-                if ([strongSelf.generationConfig containsStopSequence:generatedText]) {
-                    NSString *detectedStopSeq = [strongSelf.generationConfig detectedStopSequence:generatedText];
-                    NSLog(@"Stop sequence detected: '%@'", detectedStopSeq);
-                    NSLog(@"Generation stopped due to stop sequence");
-                    break;
+                // Coalesce tokens and flush every tokenFlushCount tokens or tokenFlushInterval seconds
+                [pendingChunk appendString:newToken];
+                pendingChunkTokens++;
+                CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+                BOOL shouldFlush = !firstChunkDelivered ||
+                                   pendingChunkTokens >= MAX(1, strongSelf.tokenFlushCount) ||
+                                   (strongSelf.tokenFlushInterval > 0 && now - lastFlushTime >= strongSelf.tokenFlushInterval);
+                if (shouldFlush) {
+                    [strongSelf deliverTokenChunk:[pendingChunk copy] tokenHandler:tokenHandler];
+                    [pendingChunk setString:@""];
+                    pendingChunkTokens = 0;
+                    lastFlushTime = now;
+                    firstChunkDelivered = YES;
                 }
-                
-                // Notify token handler
+            }
+            // Calls are reported as soon as their JSON closes, not after the whole reply is parsed
+            while (toolCalls.count < context->tool_scanner.calls.size()) {
+                NSDictionary *toolCall = CactusToolCallDictionary(context->tool_scanner.calls[toolCalls.count], toolCalls.count);
+                [toolCalls addObject:toolCall];
                 dispatch_async(dispatch_get_main_queue(), ^{
-                    if (tokenHandler) {
-                        tokenHandler(newToken);
-                    }
-                    
-                    if ([strongSelf.delegate respondsToSelector:@selector(session:didGenerateToken:)]) {
-                        [strongSelf.delegate session:strongSelf didGenerateToken:newToken];
+                    if ([strongSelf.delegate respondsToSelector:@selector(session:didDetectToolCall:)]) {
+                        [strongSelf.delegate session:strongSelf didDetectToolCall:toolCall];
                     }
-                    
-                    [[NSNotificationCenter defaultCenter] postNotificationName:CactusSessionDidGenerateTokenNotification
-                                                                        object:strongSelf
-                                                                      userInfo:@{
-                                                                          CactusSessionIdKey: strongSelf.sessionId,
-                                                                          CactusSessionTokenKey: newToken
-                                                                      }];
                 });
             }
+            if (traceStages) {
+                context->recordStage(dispatchUs, "dispatch", dispatchStart);
+            }
+            
+            // thermalState is cheap but changes slowly; re-check about once a second
+            if (thermalThrottling && CFAbsoluteTimeGetCurrent() - lastThermalCheck >= CactusThermalCheckInterval) {
+                lastThermalCheck = CFAbsoluteTimeGetCurrent();
+                NSProcessInfoThermalState thermalState = [NSProcessInfo processInfo].thermalState;
+                peakThermalState = MAX(peakThermalState, thermalState);
+                context->applyThermalState((cactus::thermal_state)thermalState, false);
+            }
+            
+            // Stop strings are matched incrementally by the context and never reach the delta
+            if (context->stopped_word) {
+                NSLog(@"Stop sequence detected: '%s'", context->stopping_word.c_str());
+                NSLog(@"Generation stopped due to stop sequence");
+                break;
+            }
             
             // Update progress
             if (strongSelf.generationConfig && strongSelf.generationConfig.maxTokens > 0) {
@@ -430,19 +867,67 @@ NSString * const CactusSessionProgressKey = @"progress";
             }
         }
         
+        if (pendingChunk.length > 0) {
+            [strongSelf deliverTokenChunk:[pendingChunk copy] tokenHandler:tokenHandler];
+        }
+        context->finishSpeechStream();
+        
+        BOOL timedOut = context->timed_out;
+        if (timedOut) {
+            NSLog(@"Generation stopped after exceeding its %.2fs deadline", strongSelf.generationConfig.timeoutInterval);
+        }
+        context->endCompletion();
+        restoreToolGrammar();
+        
+        // Keep the reply's tool calls in the cache and evaluate the framing of the first result while the tools run
+        if (strongSelf.keepsToolTurns && toolCalls.count > 0 && !task.isCancelled && !timedOut &&
+            context->beginToolTurn(CactusChatMessages(promptMessages), toolsJSON.UTF8String)) {
+            context->setAbortHook([task]() -> bool { return task.isCancelled; });
+            while (!context->prefillStep(0)) {
+                if (task.isCancelled || context->is_interrupted) {
+                    break;
+                }
+            }
+            context->setAbortHook(nullptr);
+        }
+        
         progress(1.0f);
         
         NSTimeInterval duration = [[NSDate date] timeIntervalSinceDate:startTime];
         
         // Create result
+        NSMutableDictionary *metadata = [@{
+            @"sessionId": strongSelf.sessionId.UUIDString,
+            @"sessionType": @(strongSelf.type),
+            @"draftTokens": @(context->n_draft_proposed),
+            @"draftAcceptedTokens": @(context->n_draft_accepted),
+            @"timedOut": @(timedOut),
+            @"grammarForcedTokens": @(context->n_grammar_forced),
+            @"cacheShiftedTokens": @(context->n_cache_shifted),
+            @"streamEvictedTokens": @(context->stream_cut > (size_t)context->stream_sink ? context->stream_cut - context->stream_sink : 0),
+            @"thermal": @{
+                @"initialState": @(initialThermalState),
+                @"peakState": @(peakThermalState),
+                @"finalState": @([NSProcessInfo processInfo].thermalState),
+                @"throttleLevel": @(context->thermal),
+                @"threads": @(llama_n_threads(context->ctx)),
+                @"batchThreads": @(llama_n_threads_batch(context->ctx)),
+                @"batchSize": @(context->params.n_batch),
+                @"pacingDuration": @(context->thermal_paced_us / 1e6)
+            }
+        } mutableCopy];
+        if (traceStages) {
+            metadata[@"trace"] = CactusTraceMetadata(context, dispatchUs);
+            context->tracing = false;
+        }
+        if (toolCalls.count > 0) {
+            metadata[@"toolCalls"] = [toolCalls copy];
+        }
         CactusGenerationResult *result = [CactusGenerationResult resultWithText:[generatedText copy]
                                                                 tokensGenerated:tokensGenerated
                                                                    promptTokens:promptTokens
                                                                        duration:duration
-                                                                       metadata:@{
-                                                                           @"sessionId": strongSelf.sessionId.UUIDString,
-                                                                           @"sessionType": @(strongSelf.type)
-                                                                       }];
+                                                                       metadata:metadata];
         
         return result;
     }];
@@ -497,10 +982,21 @@ NSString * const CactusSessionProgressKey = @"progress";
             strongSelf.totalGenerationTime += generationResult.duration;
             
             // Add assistant message to history
+            NSArray<NSDictionary *> *toolCalls = generationResult.metadata[@"toolCalls"];
             if (strongSelf.type == CactusSessionTypeChat) {
                 CactusLLMMessage *assistantMessage = [CactusLLMMessage messageWithRole:CactusLLMRoleAssistant content:generationResult.text];
+                if (toolCalls.count > 0) {
+                    NSData *toolCallJSON = [NSJSONSerialization dataWithJSONObject:toolCalls options:0 error:nil];
+                    assistantMessage.toolCall = toolCallJSON ? [[NSString alloc] initWithData:toolCallJSON encoding:NSUTF8StringEncoding] : nil;
+                }
                 [strongSelf addMessage:assistantMessage];
+                [strongSelf scheduleModelSummary];
             }
+            dispatch_barrier_async(strongSelf.synchronizationQueue, ^{
+                strongSelf.pendingToolCalls = toolCalls.count > 0 ? toolCalls : nil;
+                [strongSelf.pendingToolResults removeAllObjects];
+                strongSelf.nextToolResultIndex = 0;
+            });
             
             strongSelf.state = CactusSessionStateIdle;
             
@@ -544,17 +1040,95 @@ NSString * const CactusSessionProgressKey = @"progress";
 
 - (NSUUID *)generateEmbeddingForText:(NSString *)text
                    completionHandler:(void(^)(NSArray<NSNumber *> * _Nullable embedding, NSError * _Nullable error))completionHandler {
-    // Implementation would use the embedding functionality
-    // This is a placeholder
-    dispatch_async(dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
-        dispatch_async(dispatch_get_main_queue(), ^{
-            if (completionHandler) {
-                completionHandler(@[], nil);
-            }
-        });
+    return [self generateEmbeddingForText:text dimensions:0 completionHandler:completionHandler];
+}
+
+- (NSUUID *)generateEmbeddingForText:(NSString *)text
+                          dimensions:(NSInteger)dimensions
+                   completionHandler:(void(^)(NSArray<NSNumber *> * _Nullable embedding, NSError * _Nullable error))completionHandler {
+    return [self generateEmbeddingsForTexts:@[text ?: @""]
+                                 dimensions:dimensions
+                          completionHandler:^(NSData *matrix, NSInteger dimension, NSError *error) {
+        if (!completionHandler) {
+            return;
+        }
+        if (!matrix) {
+            completionHandler(nil, error);
+            return;
+        }
+        const float *values = (const float *)matrix.bytes;
+        NSMutableArray<NSNumber *> *embedding = [NSMutableArray arrayWithCapacity:dimension];
+        for (NSInteger i = 0; i < dimension; i++) {
+            [embedding addObject:@(values[i])];
+        }
+        completionHandler(embedding, nil);
+    }];
+}
+
+- (NSUUID *)generateEmbeddingsForTexts:(NSArray<NSString *> *)texts
+                     completionHandler:(void(^)(NSData * _Nullable matrix, NSInteger dimension, NSError * _Nullable error))completionHandler {
+    return [self generateEmbeddingsForTexts:texts dimensions:0 completionHandler:completionHandler];
+}
+
+- (NSUUID *)generateEmbeddingsForTexts:(NSArray<NSString *> *)texts
+                            dimensions:(NSInteger)dimensions
+                     completionHandler:(void(^)(NSData * _Nullable matrix, NSInteger dimension, NSError * _Nullable error))completionHandler {
+    __weak typeof(self) weakSelf = self;
+    __block NSUUID *taskId = nil;
+    CactusTask *embeddingTask = [CactusTask embeddingJobWithTexts:texts
+                                                       dimensions:dimensions
+                                                       rowHandler:nil
+                                                  progressHandler:nil
+                                                completionHandler:^(id result, NSError *error) {
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        if (strongSelf && taskId) {
+            dispatch_barrier_async(strongSelf.synchronizationQueue, ^{
+                [strongSelf.activeTasks removeObjectForKey:taskId];
+            });
+        }
+        if (completionHandler) {
+            NSDictionary *output = (NSDictionary *)result;
+            completionHandler(output[@"matrix"], [output[@"dimension"] integerValue], error);
+        }
+    }];
+    taskId = embeddingTask.taskId;
+    
+    dispatch_barrier_async(self.synchronizationQueue, ^{
+        self.activeTasks[embeddingTask.taskId] = embeddingTask;
     });
     
-    return [NSUUID UUID];
+    [[CactusBackgroundProcessor sharedProcessor] submitTask:embeddingTask];
+    
+    return embeddingTask.taskId;
+}
+
+- (NSUUID *)rerankDocuments:(NSArray<NSString *> *)documents
+                   forQuery:(NSString *)query
+          completionHandler:(void(^)(NSArray<NSNumber *> * _Nullable scores, NSError * _Nullable error))completionHandler {
+    __weak typeof(self) weakSelf = self;
+    __block NSUUID *taskId = nil;
+    CactusTask *rerankTask = [CactusTask rerankJobWithQuery:query
+                                                  documents:documents
+                                          completionHandler:^(id result, NSError *error) {
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        if (strongSelf && taskId) {
+            dispatch_barrier_async(strongSelf.synchronizationQueue, ^{
+                [strongSelf.activeTasks removeObjectForKey:taskId];
+            });
+        }
+        if (completionHandler) {
+            completionHandler(result, error);
+        }
+    }];
+    taskId = rerankTask.taskId;
+    
+    dispatch_barrier_async(self.synchronizationQueue, ^{
+        self.activeTasks[rerankTask.taskId] = rerankTask;
+    });
+    
+    [[CactusBackgroundProcessor sharedProcessor] submitTask:rerankTask];
+    
+    return rerankTask.taskId;
 }
 
 - (NSUUID *)generateMultimodalResponseWithPrompt:(NSString *)prompt
@@ -578,6 +1152,281 @@ NSString * const CactusSessionProgressKey = @"progress";
     return [NSUUID UUID];
 }
 
+#pragma mark - Background Summaries
+
+// Summarises the messages the next turn will drop on an idle KV sequence at low priority, then
+// tokenizes and prefills the summarised prompt so the next turn finds it in the cache
+- (void)scheduleModelSummary {
+    if (!self.enableSmartContextManagement || !self.contextManager || self.summaryTaskId) {
+        return;
+    }
+    NSArray<CactusLLMMessage *> *history = [self getConversationHistory];
+    NSArray<CactusLLMMessage *> *olderMessages = [self.contextManager messagesToSummarizeBeforeNextTurn:history];
+    if (olderMessages.count == 0) {
+        return;
+    }
+    NSArray<CactusLLMMessage *> *recentMessages = [history subarrayWithRange:NSMakeRange(olderMessages.count, history.count - olderMessages.count)];
+    
+    NSMutableString *transcript = [NSMutableString string];
+    for (CactusLLMMessage *message in olderMessages) {
+        [transcript appendFormat:@"%@: %@\n", message.role, message.content ?: @""];
+    }
+    NSArray<CactusLLMMessage *> *summaryMessages = @[
+        [CactusLLMMessage messageWithRole:CactusLLMRoleSystem
+                                  content:@"Summarize the conversation below in a few sentences. Keep names, facts, decisions and open questions."],
+        [CactusLLMMessage messageWithRole:CactusLLMRoleUser content:transcript]
+    ];
+    
+    __weak typeof(self) weakSelf = self;
+    CactusTask *summaryTask = [CactusTask taskWithType:CactusTaskTypeGeneration
+                                              priority:CactusTaskPriorityLow
+                                           description:@"Summarizing conversation history"
+                                        executionBlock:^id(CactusTask *task, CactusTaskProgressHandler progress) {
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        CactusContextLease lease;
+        cactus::cactus_context *context = (cactus::cactus_context *)lease.context;
+        if (!strongSelf || !context || task.isCancelled || context->is_predicting) {
+            return nil;
+        }
+        
+        // A sequence no session holds, reserved for the summary and released afterwards
+        const NSInteger spare = [[CactusSessionManager sharedManager] reserveSpareSequenceWithCapacity:context->sessionSequences()];
+        if (spare == NSNotFound) {
+            NSLog(@"No idle KV sequence for a background summary, keeping the heuristic summary");
+            return nil;
+        }
+        const llama_seq_id summarySeq = (llama_seq_id)spare;
+        
+        const common_params_sampling savedSampling = context->params.sampling;
+        const std::vector<std::string> savedAntiprompt = context->params.antiprompt;
+        const int32_t savedPredict = context->params.n_predict;
+        const int32_t savedWindow = context->stream_window;
+        const llama_seq_id previousSeq = context->seq_id;
+        
+        context->params.sampling = common_params_sampling();
+        context->params.sampling.temp = 0.3f;
+        context->params.antiprompt.clear();
+        context->params.n_predict = CactusSummaryMaxTokens;
+        context->stream_window = 0;
+        context->params.prompt = context->getFormattedChat(CactusChatMessages(summaryMessages), "");
+        
+        NSMutableString *summary = [NSMutableString string];
+        if (!context->params.prompt.empty() && context->initSampling() && context->setActiveSequence(summarySeq)) {
+            context->beginCompletion();
+            context->setAbortHook([task]() -> bool { return task.isCancelled; });
+            context->loadPromptReusingPrefix();
+            while (context->has_next_token && !context->is_interrupted && !task.isCancelled) {
+                if (context->doCompletion().tok == -1) {
+                    break;
+                }
+                std::string_view delta = context->lastTextDelta();
+                if (!delta.empty()) {
+                    [summary appendString:[[NSString alloc] initWithBytes:delta.data() length:delta.size() encoding:NSUTF8StringEncoding] ?: @""];
+                }
+            }
+            context->endCompletion();
+            context->setActiveSequence(previousSeq);
+        }
+        context->releaseSequence(summarySeq);
+        [[CactusSessionManager sharedManager] returnSpareSequence:spare];
+        
+        context->params.sampling = savedSampling;
+        context->params.antiprompt = savedAntiprompt;
+        context->params.n_predict = savedPredict;
+        context->stream_window = savedWindow;
+        
+        NSString *text = [summary stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
+        if (task.isCancelled || text.length == 0) {
+            return nil;
+        }
+        
+        CactusLLMMessage *summaryMessage = [strongSelf.contextManager cacheSummary:text forMessages:olderMessages];
+        NSMutableArray<CactusLLMMessage *> *nextMessages = [NSMutableArray array];
+        if (strongSelf.systemPromptMessage) {
+            [nextMessages addObject:strongSelf.systemPromptMessage];
+        }
+        [nextMessages addObject:summaryMessage];
+        [nextMessages addObjectsFromArray:recentMessages];
+        std::vector<llama_token> tokens;
+        if (!CactusBuildPromptTokens(context, nextMessages, CactusChatMessages(nextMessages), tokens) || task.isCancelled || context->is_predicting) {
+            return summaryMessage;
+        }
+        
+        // Prefill the summarised prefix into the session's sequence; the next turn only evaluates its new message
+        const llama_seq_id sessionSeq = CactusSessionSequence(strongSelf, context);
+        if (sessionSeq >= 0 && context->setActiveSequence(sessionSeq)) {
+            context->beginCompletion();
+            context->setAbortHook([task]() -> bool { return task.isCancelled; });
+            context->pretokenized_prompt = std::move(tokens);
+            context->loadPromptReusingPrefix();
+            while (!context->prefillStep(0)) {
+                if (task.isCancelled || context->is_interrupted) {
+                    break;
+                }
+            }
+            context->endCompletion();
+        }
+        return summaryMessage;
+    }];
+    
+    NSUUID *summaryTaskId = summaryTask.taskId;
+    summaryTask.completionHandler = ^(id result, NSError *error) {
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        if ([strongSelf.summaryTaskId isEqual:summaryTaskId]) {
+            strongSelf.summaryTaskId = nil;
+        }
+    };
+    self.summaryTaskId = summaryTaskId;
+    [[CactusBackgroundProcessor sharedProcessor] submitTask:summaryTask];
+}
+
+- (void)cancelModelSummary {
+    NSUUID *taskId = self.summaryTaskId;
+    if (taskId) {
+        self.summaryTaskId = nil;
+        [[CactusBackgroundProcessor sharedProcessor] cancelTask:taskId];
+    }
+}
+
+#pragma mark - Draft Prefill
+
+- (void)updateDraftMessage:(NSString *)draft {
+    NSString *text = [draft copy];
+    const NSUInteger revision = ++self.draftRevision;
+    if (text.length == 0) {
+        [self cancelDraftPrefill];
+        return;
+    }
+    
+    // Only the draft that stood for draftPrefillDelay is prefilled; a running prefill of an older
+    // draft keeps going until then, its chunks are mostly the newer draft's prefix
+    __weak typeof(self) weakSelf = self;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(MAX(0, self.draftPrefillDelay) * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        if (!strongSelf || strongSelf.draftRevision != revision || strongSelf.state == CactusSessionStateGenerating) {
+            return;
+        }
+        [strongSelf scheduleDraftPrefill:text];
+    });
+}
+
+// Prefills the prompt the draft would send into the session's own KV sequence, idle while the user
+// types. The next turn's prefix reuse keeps what matches and rolls back the rest.
+- (void)scheduleDraftPrefill:(NSString *)draft {
+    NSUUID *previousTaskId = self.draftTaskId;
+    if (previousTaskId) {
+        [[CactusBackgroundProcessor sharedProcessor] cancelTask:previousTaskId];
+    }
+    
+    __weak typeof(self) weakSelf = self;
+    CactusTask *draftTask = [CactusTask taskWithType:CactusTaskTypeGeneration
+                                            priority:CactusTaskPriorityLow
+                                         description:@"Prefilling draft message"
+                                      executionBlock:^id(CactusTask *task, CactusTaskProgressHandler progress) {
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        CactusContextLease lease;
+        cactus::cactus_context *context = (cactus::cactus_context *)lease.context;
+        // A pending tool turn lives in the same sequence and would be dropped by the prefill
+        if (!strongSelf || !context || task.isCancelled || context->is_predicting ||
+            strongSelf.state == CactusSessionStateGenerating || strongSelf.pendingToolCalls.count > 0) {
+            return nil;
+        }
+        
+        NSArray<CactusLLMMessage *> *history = strongSelf.enableSmartContextManagement ?
+            [strongSelf getOptimizedConversationHistory] : [strongSelf getConversationHistory];
+        std::vector<llama_token> tokens;
+        if (!CactusBuildDraftTokens(context, [strongSelf promptMessagesWithHistory:history], draft, tokens) || tokens.empty()) {
+            return nil;
+        }
+        
+        const llama_seq_id seqId = CactusSessionSequence(strongSelf, context);
+        if (seqId < 0 || (!context->ctx_sampling && !context->initSampling()) || !context->setActiveSequence(seqId)) {
+            return nil;
+        }
+        context->beginCompletion();
+        context->setAbortHook([task]() -> bool { return task.isCancelled; });
+        context->pretokenized_prompt = std::move(tokens);
+        context->loadPromptReusingPrefix();
+        const int32_t chunk = strongSelf.prefillChunkSize > 0 ? (int32_t)strongSelf.prefillChunkSize : CactusDraftPrefillChunk;
+        while (!context->prefillStep(chunk)) {
+            if (task.isCancelled || context->is_interrupted) {
+                break;
+            }
+        }
+        const size_t prefilled = context->n_past;
+        context->endCompletion();
+        return @(prefilled);
+    }];
+    
+    NSUUID *draftTaskId = draftTask.taskId;
+    draftTask.completionHandler = ^(id result, NSError *error) {
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        if ([strongSelf.draftTaskId isEqual:draftTaskId]) {
+            strongSelf.draftTaskId = nil;
+        }
+    };
+    self.draftTaskId = draftTaskId;
+    [[CactusBackgroundProcessor sharedProcessor] submitTask:draftTask];
+}
+
+- (void)cancelDraftPrefill {
+    self.draftRevision++;
+    NSUUID *taskId = self.draftTaskId;
+    if (taskId) {
+        self.draftTaskId = nil;
+        [[CactusBackgroundProcessor sharedProcessor] cancelTask:taskId];
+    }
+}
+
+#pragma mark - Tool Results
+
+- (NSUUID *)submitToolResult:(NSString *)result forToolCallAtIndex:(NSUInteger)index {
+    // Tool messages enter the history in call order, results that arrive early wait for the ones before
+    dispatch_barrier_async(self.synchronizationQueue, ^{
+        if (index >= self.pendingToolCalls.count || index < self.nextToolResultIndex) {
+            return;
+        }
+        self.pendingToolResults[@(index)] = result ?: @"";
+        NSString *content = nil;
+        while ((content = self.pendingToolResults[@(self.nextToolResultIndex)])) {
+            CactusLLMMessage *toolMessage = [CactusLLMMessage messageWithRole:CactusLLMRoleTool content:content];
+            toolMessage.name = self.pendingToolCalls[self.nextToolResultIndex][@"name"];
+            [self.mutableMessages addObject:toolMessage];
+            [self.pendingToolResults removeObjectForKey:@(self.nextToolResultIndex)];
+            self.nextToolResultIndex++;
+        }
+        self.lastActiveAt = [NSDate date];
+    });
+    
+    // Evaluated on the generation lane, ahead of the reply that continues from it
+    __weak typeof(self) weakSelf = self;
+    CactusTask *resultTask = [CactusTask taskWithType:CactusTaskTypeGeneration
+                                             priority:CactusTaskPriorityHigh
+                                          description:@"Prefilling tool result"
+                                       executionBlock:^id(CactusTask *task, CactusTaskProgressHandler progress) {
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        CactusContextLease lease;
+        cactus::cactus_context *context = (cactus::cactus_context *)lease.context;
+        if (!strongSelf || !context || context->is_predicting) {
+            return nil;
+        }
+        llama_seq_id seqId = CactusSessionSequence(strongSelf, context);
+        if (seqId < 0 || !context->setActiveSequence(seqId) || !context->addToolResult(index, (result ?: @"").UTF8String)) {
+            return nil;
+        }
+        context->setAbortHook([task]() -> bool { return task.isCancelled; });
+        while (!context->prefillStep(0)) {
+            if (task.isCancelled || context->is_interrupted) {
+                break;
+            }
+        }
+        context->setAbortHook(nullptr);
+        return nil;
+    }];
+    [[CactusBackgroundProcessor sharedProcessor] submitTask:resultTask];
+    return resultTask.taskId;
+}
+
 - (void)cancelGeneration:(NSUUID *)generationId {
     __block CactusTask *taskToCancel = nil;
     dispatch_sync(self.synchronizationQueue, ^{
@@ -597,6 +1446,7 @@ NSString * const CactusSessionProgressKey = @"progress";
 }
 
 - (void)cancelAllGenerations {
+    [self cancelDraftPrefill];
     __block NSArray<NSUUID *> *taskIds = nil;
     dispatch_sync(self.synchronizationQueue, ^{
         taskIds = [self.activeTasks.allKeys copy];
@@ -620,6 +1470,127 @@ NSString * const CactusSessionProgressKey = @"progress";
             self.sessionId.UUIDString, (long)self.type, (long)self.state, (long)self.messages.count];
 }
 
+#pragma mark - Snapshots
+
+- (BOOL)saveSnapshotToURL:(NSURL *)url error:(NSError **)error {
+    return [self saveSnapshotToURL:url compressed:NO error:error];
+}
+
+- (BOOL)saveSnapshotToURL:(NSURL *)url compressed:(BOOL)compressed error:(NSError **)error {
+    if (self.state == CactusSessionStateGenerating) {
+        if (error) {
+            *error = [NSError errorWithDomain:CactusLLMErrorDomain
+                                         code:CactusLLMErrorInvalidState
+                                     userInfo:@{NSLocalizedDescriptionKey: @"Cannot snapshot a session while it is generating"}];
+        }
+        return NO;
+    }
+    [self cancelModelSummary];
+    [self cancelDraftPrefill];
+    
+    NSMutableArray<NSDictionary *> *messages = [NSMutableArray array];
+    for (CactusLLMMessage *message in [self getConversationHistory]) {
+        NSMutableDictionary *entry = [@{@"role": message.role, @"content": message.content ?: @""} mutableCopy];
+        if (message.tools && [NSPropertyListSerialization propertyList:message.tools isValidForFormat:NSPropertyListBinaryFormat_v1_0]) {
+            entry[@"tools"] = message.tools;
+        }
+        [messages addObject:entry];
+    }
+    NSMutableDictionary *snapshot = [@{
+        @"version": @(CactusSnapshotVersion),
+        @"type": @(self.type),
+        @"messages": messages
+    } mutableCopy];
+    if (self.systemPrompt) {
+        snapshot[@"systemPrompt"] = self.systemPrompt;
+    }
+    
+    // The KV blob is optional: without a loaded model the snapshot still restores the messages
+    {
+        CactusContextLease lease;
+        cactus::cactus_context *context = (cactus::cactus_context *)lease.context;
+        if (context && context->ctx && !context->is_predicting && self.sequenceId != NSNotFound &&
+            self.sequenceId < context->sessionSequences()) {
+            std::vector<uint8_t> blob;
+            if (context->saveSequenceSnapshot((llama_seq_id)self.sequenceId, blob)) {
+                NSData *sequence = [NSData dataWithBytes:blob.data() length:blob.size()];
+                if (compressed) {
+                    NSData *packed = [sequence compressedDataUsingAlgorithm:NSDataCompressionAlgorithmLZ4 error:nil];
+                    if (packed) {
+                        sequence = packed;
+                        snapshot[@"sequenceCompressed"] = @YES;
+                    }
+                }
+                snapshot[@"sequence"] = sequence;
+            }
+        }
+    }
+    
+    NSData *data = [NSPropertyListSerialization dataWithPropertyList:snapshot
+                                                              format:NSPropertyListBinaryFormat_v1_0
+                                                             options:0
+                                                               error:error];
+    return data && [data writeToURL:url options:NSDataWritingAtomic error:error];
+}
+
+- (BOOL)restoreFromURL:(NSURL *)url error:(NSError **)error {
+    if (self.state == CactusSessionStateGenerating) {
+        if (error) {
+            *error = [NSError errorWithDomain:CactusLLMErrorDomain
+                                         code:CactusLLMErrorInvalidState
+                                     userInfo:@{NSLocalizedDescriptionKey: @"Cannot restore a session while it is generating"}];
+        }
+        return NO;
+    }
+    
+    NSData *data = [NSData dataWithContentsOfURL:url options:NSDataReadingMappedIfSafe error:error];
+    if (!data) {
+        return NO;
+    }
+    NSDictionary *snapshot = [NSPropertyListSerialization propertyListWithData:data options:0 format:NULL error:error];
+    if (![snapshot isKindOfClass:[NSDictionary class]] || [snapshot[@"version"] integerValue] != CactusSnapshotVersion) {
+        if (error && !*error) {
+            *error = [NSError errorWithDomain:CactusLLMErrorDomain
+                                         code:CactusLLMErrorInvalidArgument
+                                     userInfo:@{NSLocalizedDescriptionKey: @"Unsupported session snapshot"}];
+        }
+        return NO;
+    }
+    
+    [self cancelModelSummary];
+    [self cancelDraftPrefill];
+    NSMutableArray<CactusLLMMessage *> *messages = [NSMutableArray array];
+    for (NSDictionary *entry in snapshot[@"messages"]) {
+        CactusLLMMessage *message = [CactusLLMMessage messageWithRole:entry[@"role"] content:entry[@"content"]];
+        if (entry[@"tools"]) {
+            message.tools = entry[@"tools"];
+        }
+        [messages addObject:message];
+    }
+    dispatch_barrier_sync(self.synchronizationQueue, ^{
+        [self.mutableMessages setArray:messages];
+    });
+    self.systemPrompt = snapshot[@"systemPrompt"];
+    
+    // A KV blob from another model or cache layout is rejected; the next turn then re-prefills as usual
+    NSData *sequence = snapshot[@"sequence"];
+    if (!sequence) {
+        return YES;
+    }
+    CactusContextLease lease;
+    cactus::cactus_context *context = (cactus::cactus_context *)lease.context;
+    if (context) {
+        if ([snapshot[@"sequenceCompressed"] boolValue]) {
+            sequence = [sequence decompressedDataUsingAlgorithm:NSDataCompressionAlgorithmLZ4 error:nil];
+        }
+        llama_seq_id seqId = context->ctx ? CactusSessionSequence(self, context) : -1;
+        if (!sequence || seqId < 0 || !context->restoreSequenceSnapshot(seqId, (const uint8_t *)sequence.bytes, sequence.length)) {
+            NSLog(@"Session snapshot KV state not restored, the next turn will re-evaluate the history");
+        }
+    }
+    return YES;
+}
+
 #pragma mark - Conversation Management
 
 - (NSArray<CactusLLMMessage *> *)getConversationHistory {
@@ -773,7 +1744,8 @@ NSString * const CactusSessionProgressKey = @"progress";
 }
 
 - (void)compressConversationHistory {
-    if (!self.enableSmartContextManagement || !self.contextManager) {
+    if (!self.enableSmartContextManagement || !self.contextManager ||
+        self.contextManager.retentionStrategy == CactusContextRetentionStrategyKVStreaming) {
         return;
     }
     
@@ -817,6 +1789,7 @@ NSString * const CactusSessionProgressKey = @"progress";
 @property (nonatomic, strong) NSMutableDictionary<NSUUID *, CactusSession *> *sessions;
 @property (nonatomic, strong) dispatch_queue_t synchronizationQueue;
 @property (nonatomic, readwrite) NSInteger maxConcurrentSessions;
+@property (nonatomic, strong) NSMutableIndexSet *reservedSequences;
 @end
 
 @implementation CactusSessionManager
@@ -835,6 +1808,7 @@ NSString * const CactusSessionProgressKey = @"progress";
         _sessions = [NSMutableDictionary dictionary];
         _synchronizationQueue = dispatch_queue_create("com.cactus.session.manager", DISPATCH_QUEUE_CONCURRENT);
         _maxConcurrentSessions = 5; // Default limit
+        _reservedSequences = [NSMutableIndexSet indexSet];
     }
     return self;
 }
@@ -879,7 +1853,7 @@ NSString * const CactusSessionProgressKey = @"progress";
     }
     
     if (session) {
-        dispatch_barrier_async(self.synchronizationQueue, ^{
+        dispatch_barrier_sync(self.synchronizationQueue, ^{
             self.sessions[session.sessionId] = session;
         });
         
@@ -903,13 +1877,16 @@ NSString * const CactusSessionProgressKey = @"progress";
 
 - (void)destroySession:(NSUUID *)sessionId {
     __block CactusSession *session = nil;
-    dispatch_barrier_async(self.synchronizationQueue, ^{
+    dispatch_barrier_sync(self.synchronizationQueue, ^{
         session = self.sessions[sessionId];
         [self.sessions removeObjectForKey:sessionId];
     });
     
     if (session) {
         [session stop];
+        if (session.sequenceId != NSNotFound) {
+            [[CactusModelManager sharedManager] releaseSequence:session.sequenceId];
+        }
         
         dispatch_async(dispatch_get_main_queue(), ^{
             if ([self.delegate respondsToSelector:@selector(sessionManager:didDestroySession:)]) {
@@ -921,13 +1898,16 @@ NSString * const CactusSessionProgressKey = @"progress";
 
 - (void)destroyAllSessions {
     __block NSArray<CactusSession *> *allSessions = nil;
-    dispatch_barrier_async(self.synchronizationQueue, ^{
+    dispatch_barrier_sync(self.synchronizationQueue, ^{
         allSessions = [self.sessions.allValues copy];
         [self.sessions removeAllObjects];
     });
     
     for (CactusSession *session in allSessions) {
         [session stop];
+        if (session.sequenceId != NSNotFound) {
+            [[CactusModelManager sharedManager] releaseSequence:session.sequenceId];
+        }
         
         dispatch_async(dispatch_get_main_queue(), ^{
             if ([self.delegate respondsToSelector:@selector(sessionManager:didDestroySession:)]) {
@@ -1019,6 +1999,7 @@ NSString * const CactusSessionProgressKey = @"progress";
     });
     
     return @{
+        @"latency": [[CactusLatencyMetrics globalMetrics] dictionaryRepresentation],
         @"totalSessions": @(totalSessions),
         @"chatSessions": @(chatSessions),
         @"completionSessions": @(completionSessions),
@@ -1032,8 +2013,280 @@ NSString * const CactusSessionProgressKey = @"progress";
 
 @end
 
+#pragma mark - KV Sequences
+
+@implementation CactusSessionManager (Sequences)
+
+// Sequences below capacity belong to one session each, or to a background job holding a spare one
+- (NSMutableIndexSet *)heldSequencesExcluding:(CactusSession *)session capacity:(NSInteger)capacity {
+    NSMutableIndexSet *held = [self.reservedSequences mutableCopy];
+    for (CactusSession *other in self.sessions.allValues) {
+        if (other != session && other.sequenceId != NSNotFound && other.sequenceId < capacity) {
+            [held addIndex:(NSUInteger)other.sequenceId];
+        }
+    }
+    return held;
+}
+
+- (NSInteger)acquireSequenceForSession:(CactusSession *)session capacity:(NSInteger)capacity evicted:(NSInteger *)evicted {
+    __block NSInteger sequenceId = NSNotFound;
+    __block NSInteger taken = NSNotFound;
+    dispatch_barrier_sync(self.synchronizationQueue, ^{
+        if (session.sequenceId != NSNotFound && session.sequenceId < capacity) {
+            sequenceId = session.sequenceId;
+            return;
+        }
+        NSMutableIndexSet *held = [self heldSequencesExcluding:session capacity:capacity];
+        for (NSInteger candidate = 0; candidate < capacity && sequenceId == NSNotFound; candidate++) {
+            if (![held containsIndex:(NSUInteger)candidate]) {
+                sequenceId = candidate;
+            }
+        }
+        if (sequenceId == NSNotFound) {
+            // Take over the sequence of the session idle the longest; a generating one keeps its own
+            CactusSession *idlest = nil;
+            for (CactusSession *other in self.sessions.allValues) {
+                if (other == session || other.sequenceId == NSNotFound || other.sequenceId >= capacity ||
+                    other.state == CactusSessionStateGenerating) {
+                    continue;
+                }
+                NSDate *otherActive = other.lastActiveAt ?: other.createdAt;
+                NSDate *idlestActive = idlest.lastActiveAt ?: idlest.createdAt;
+                if (!idlest || [otherActive compare:idlestActive] == NSOrderedAscending) {
+                    idlest = other;
+                }
+            }
+            if (idlest) {
+                sequenceId = idlest.sequenceId;
+                taken = sequenceId;
+                idlest.sequenceId = NSNotFound;
+            }
+        }
+        if (sequenceId != NSNotFound) {
+            session.sequenceId = sequenceId;
+        }
+    });
+    if (evicted) {
+        *evicted = taken;
+    }
+    return sequenceId;
+}
+
+- (NSInteger)reserveSpareSequenceWithCapacity:(NSInteger)capacity {
+    __block NSInteger sequenceId = NSNotFound;
+    dispatch_barrier_sync(self.synchronizationQueue, ^{
+        NSMutableIndexSet *held = [self heldSequencesExcluding:nil capacity:capacity];
+        for (NSInteger candidate = capacity - 1; candidate >= 0 && sequenceId == NSNotFound; candidate--) {
+            if (![held containsIndex:(NSUInteger)candidate]) {
+                sequenceId = candidate;
+            }
+        }
+        if (sequenceId != NSNotFound) {
+            [self.reservedSequences addIndex:(NSUInteger)sequenceId];
+        }
+    });
+    return sequenceId;
+}
+
+- (void)returnSpareSequence:(NSInteger)sequenceId {
+    dispatch_barrier_async(self.synchronizationQueue, ^{
+        [self.reservedSequences removeIndex:(NSUInteger)sequenceId];
+    });
+}
+
+@end
+
 #pragma mark - Convenience Methods
 
+@implementation CactusTask (EmbeddingJobs)
+
++ (instancetype)embeddingJobWithTexts:(NSArray<NSString *> *)texts
+                           dimensions:(NSInteger)dimensions
+                           rowHandler:(CactusEmbeddingRowHandler)rowHandler
+                      progressHandler:(CactusTaskProgressHandler)progressHandler
+                    completionHandler:(CactusTaskCompletionHandler)completionHandler {
+    NSArray<NSString *> *inputs = [texts copy];
+    
+    CactusTask *task = [CactusTask taskWithType:CactusTaskTypeEmbedding
+                                       priority:CactusTaskPriorityNormal
+                                    description:[NSString stringWithFormat:@"Embedding %lu texts", (unsigned long)inputs.count]
+                                 executionBlock:^id(CactusTask *task, CactusTaskProgressHandler progress) {
+        CactusContextLease lease;
+        cactus::cactus_context *context = (cactus::cactus_context *)lease.context;
+        if (!context) {
+            @throw [NSException exceptionWithName:@"ContextNotAvailable"
+                                           reason:@"Model context not available"
+                                         userInfo:nil];
+        }
+        if (!context->params.embedding) {
+            @throw [NSException exceptionWithName:@"EmbeddingNotEnabled"
+                                           reason:@"The model was not loaded with embeddings enabled"
+                                         userInfo:nil];
+        }
+        
+        std::vector<std::string> batch;
+        batch.reserve(inputs.count);
+        for (NSString *text in inputs) {
+            batch.emplace_back(text.UTF8String ?: "");
+        }
+        
+        const int n_embd = context->embeddingDims((int)dimensions);
+        const size_t total = batch.size();
+        std::vector<float> matrix;
+        context->is_interrupted = false;
+        context->setAbortHook([task]() -> bool { return task.isCancelled; });
+        const bool ok = context->getEmbeddings(batch, matrix, [&](size_t index, const float *row) {
+            if (rowHandler) {
+                rowHandler(index, [NSData dataWithBytes:row length:n_embd * sizeof(float)]);
+            }
+            progress((float)(index + 1) / (float)total);
+        }, (int)dimensions);
+        context->setAbortHook(nullptr);
+        if (!ok) {
+            @throw [NSException exceptionWithName:@"EmbeddingError"
+                                           reason:task.isCancelled ? @"Embedding was cancelled" : @"Failed to generate embeddings"
+                                         userInfo:nil];
+        }
+        return @{
+            @"matrix": [NSData dataWithBytes:matrix.data() length:matrix.size() * sizeof(float)],
+            @"dimension": @(n_embd)
+        };
+    }];
+    
+    task.progressHandler = progressHandler;
+    task.completionHandler = completionHandler;
+    return task;
+}
+
++ (instancetype)rerankJobWithQuery:(NSString *)query
+                         documents:(NSArray<NSString *> *)documents
+                 completionHandler:(CactusTaskCompletionHandler)completionHandler {
+    NSString *queryText = [query copy] ?: @"";
+    NSArray<NSString *> *inputs = [documents copy];
+    
+    CactusTask *task = [CactusTask taskWithType:CactusTaskTypeEmbedding
+                                       priority:CactusTaskPriorityNormal
+                                    description:[NSString stringWithFormat:@"Reranking %lu documents", (unsigned long)inputs.count]
+                                 executionBlock:^id(CactusTask *task, CactusTaskProgressHandler progress) {
+        CactusContextLease lease;
+        cactus::cactus_context *context = (cactus::cactus_context *)lease.context;
+        if (!context) {
+            @throw [NSException exceptionWithName:@"ContextNotAvailable"
+                                           reason:@"Model context not available"
+                                         userInfo:nil];
+        }
+        if (!context->params.embedding || llama_pooling_type(context->ctx) != LLAMA_POOLING_TYPE_RANK) {
+            @throw [NSException exceptionWithName:@"RerankNotEnabled"
+                                           reason:@"The model was not loaded with embeddings and rank pooling"
+                                         userInfo:nil];
+        }
+        
+        std::vector<std::string> batch;
+        batch.reserve(inputs.count);
+        for (NSString *text in inputs) {
+            batch.emplace_back(text.UTF8String ?: "");
+        }
+        
+        std::vector<float> scores;
+        context->is_interrupted = false;
+        context->setAbortHook([task]() -> bool { return task.isCancelled; });
+        const bool ok = context->getRerankScores(queryText.UTF8String, batch, scores);
+        context->setAbortHook(nullptr);
+        if (!ok) {
+            @throw [NSException exceptionWithName:@"RerankError"
+                                           reason:task.isCancelled ? @"Reranking was cancelled" : @"Failed to rerank documents"
+                                         userInfo:nil];
+        }
+        NSMutableArray<NSNumber *> *result = [NSMutableArray arrayWithCapacity:scores.size()];
+        for (float score : scores) {
+            [result addObject:@(score)];
+        }
+        return [result copy];
+    }];
+    
+    task.completionHandler = completionHandler;
+    return task;
+}
+
+@end
+
+@implementation CactusTask (TrainingJobs)
+
++ (instancetype)loraTrainingJobWithTexts:(NSArray<NSString *> *)texts
+                              outputPath:(NSString *)outputPath
+                                    rank:(NSInteger)rank
+                                  epochs:(NSInteger)epochs
+                         progressHandler:(CactusTaskProgressHandler)progressHandler
+                       completionHandler:(CactusTaskCompletionHandler)completionHandler {
+    NSArray<NSString *> *inputs = [texts copy];
+    NSString *path = [outputPath copy];
+    
+    CactusTask *task = [CactusTask taskWithType:CactusTaskTypeTraining
+                                       priority:CactusTaskPriorityLow
+                                    description:[NSString stringWithFormat:@"LoRA training on %lu texts", (unsigned long)inputs.count]
+                                 executionBlock:^id(CactusTask *task, CactusTaskProgressHandler progress) {
+        std::vector<std::string> corpus;
+        corpus.reserve(inputs.count);
+        for (NSString *text in inputs) {
+            corpus.emplace_back(text.UTF8String ?: "");
+        }
+        
+        cactus::cactus_train_params params;
+        params.output_path = path.UTF8String ?: "";
+        params.rank = (int32_t)MAX(rank, 1);
+        params.epochs = (int32_t)MAX(epochs, 1);
+        unsigned long long available = 0;
+        if (@available(iOS 13.0, macOS 10.15, *)) {
+            available = os_proc_available_memory();
+        }
+        if (available == 0) {
+            available = [NSProcessInfo processInfo].physicalMemory / 2;
+        }
+        params.memory_budget = (size_t)(available / 4);
+        
+        float loss = 0.0f;
+        int status = 0;
+        do {
+            // A preempted run stops at a checkpoint and gives the context back before parking, the
+            // preempting task needs the lease; the next pass resumes from the saved cursor
+            if (![task yieldIfPreempted]) {
+                status = 1;
+                break;
+            }
+            CactusContextLease lease;
+            cactus::cactus_context *context = (cactus::cactus_context *)lease.context;
+            if (!context) {
+                @throw [NSException exceptionWithName:@"ContextNotAvailable"
+                                               reason:@"Model context not available"
+                                             userInfo:nil];
+            }
+            status = context->trainLoraAdapter(corpus, params, [&](const cactus::cactus_train_progress &p) -> bool {
+                loss = p.loss;
+                const int64_t done = (int64_t)p.epoch * p.n_windows + p.window;
+                progress((float)done / (float)((int64_t)params.epochs * p.n_windows));
+                return !task.isPreempted && !task.isCancelled;
+            });
+        } while (status == 1 && !task.isCancelled);
+        if (status < 0) {
+            @throw [NSException exceptionWithName:@"TrainingError"
+                                           reason:@"Failed to train the LoRA adapter"
+                                         userInfo:nil];
+        }
+        return @{
+            @"path": path,
+            @"loss": @(loss),
+            @"completed": @(status == 0)
+        };
+    }];
+    
+    task.preemptible = YES;
+    task.progressHandler = progressHandler;
+    task.completionHandler = completionHandler;
+    return task;
+}
+
+@end
+
 @implementation CactusSessionManager (Convenience)
 
 - (CactusSession *)createChatSessionWithSystemPrompt:(NSString *)systemPrompt
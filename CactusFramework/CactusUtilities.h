@@ -8,12 +8,21 @@
 #import <Foundation/Foundation.h>
 #import "CactusModelConfiguration.h"
 
+@class CactusLLMMessage;
+@class CactusLLMTools;
+
 NS_ASSUME_NONNULL_BEGIN
 
 // MARK: - Tokenizer
 
 @interface CactusTokenizer : NSObject
 
+// Tokenizer-only load: reads the vocabulary from a GGUF file without mapping its weights or creating
+// backends. The methods below use it while no model is loaded (media paths still need a model)
++ (BOOL)loadVocabularyFromPath:(NSString *)path error:(NSError **)error;
++ (void)unloadVocabulary;
++ (BOOL)isVocabularyLoaded;
+
 // Tokenization
 + (nullable NSArray<NSNumber *> *)tokenizeText:(NSString *)text error:(NSError **)error;
 + (nullable NSArray<NSNumber *> *)tokenizeText:(NSString *)text
@@ -26,6 +35,8 @@ NS_ASSUME_NONNULL_BEGIN
 // Token counting
 + (NSInteger)countTokensInText:(NSString *)text;
 + (NSInteger)countTokensInMessages:(NSArray<NSDictionary *> *)messages;
++ (NSInteger)exactTokenCountForText:(NSString *)text;   // -1 if no model is loaded
++ (NSInteger)chatTemplateOverheadTokens;                // per-message template tokens, -1 if no model is loaded
 
 // Vocabulary info
 + (NSInteger)vocabularySize;
@@ -36,6 +47,32 @@ NS_ASSUME_NONNULL_BEGIN
 
 // MARK: - Benchmark
 
+// One point of a benchmark sweep; zero / nil keep the loaded model's setting
+@interface CactusBenchmarkConfiguration : NSObject <NSCopying>
+
+@property (nonatomic, assign) NSInteger promptTokens;       // Default: 512
+@property (nonatomic, assign) NSInteger generationTokens;   // Default: 128
+@property (nonatomic, assign) NSInteger parallelSequences;  // Default: 1
+@property (nonatomic, assign) NSInteger repetitions;        // Default: 3
+@property (nonatomic, assign) NSInteger warmupRepetitions;  // Default: 1
+@property (nonatomic, assign) NSInteger batchSize;          // Default: 0
+@property (nonatomic, assign) NSInteger ubatchSize;         // Default: 0
+@property (nonatomic, assign) NSInteger threads;            // Default: 0
+@property (nonatomic, assign) NSInteger batchThreads;       // Default: 0
+@property (nonatomic, copy, nullable) NSNumber *flashAttention; // Default: nil
+@property (nonatomic, copy, nullable) NSString *cacheTypeK;     // Default: nil
+@property (nonatomic, copy, nullable) NSString *cacheTypeV;     // Default: nil
+
++ (instancetype)defaultConfiguration;
+
+// Cartesian product over property names, e.g. @{@"threads": @[@2, @4], @"cacheTypeK": @[@"f16", @"q8_0"]}
++ (NSArray<CactusBenchmarkConfiguration *> *)sweepFromConfiguration:(CactusBenchmarkConfiguration *)base
+                                                          parameters:(NSDictionary<NSString *, NSArray *> *)parameters;
+
+- (NSDictionary *)toDictionary;
+
+@end
+
 @interface CactusBenchmarkResult : NSObject
 
 @property (nonatomic, readonly) NSInteger promptProcessingTokens;
@@ -47,6 +84,15 @@ NS_ASSUME_NONNULL_BEGIN
 @property (nonatomic, readonly) double textGenerationSpeed;  // tokens/second
 @property (nonatomic, readonly) double totalTime;           // seconds
 
+@property (nonatomic, readonly) NSTimeInterval timeToFirstToken;     // seconds
+@property (nonatomic, readonly) NSTimeInterval tokenLatencyP50;      // seconds per decode step
+@property (nonatomic, readonly) NSTimeInterval tokenLatencyP95;
+@property (nonatomic, readonly) NSTimeInterval tokenLatencyP99;
+@property (nonatomic, readonly) uint64_t peakMemory;                 // bytes
+@property (nonatomic, readonly) uint64_t peakBufferMemory;           // backend buffers combined, bytes
+@property (nonatomic, readonly) NSArray<NSDictionary *> *bufferUsage; // per category and buffer type: current, peak, count
+@property (nonatomic, readonly, nullable) CactusBenchmarkConfiguration *configuration; // resolved settings
+
 @property (nonatomic, readonly) NSDictionary *detailedResults;
 @property (nonatomic, readonly) NSDate *timestamp;
 
@@ -64,6 +110,33 @@ NS_ASSUME_NONNULL_BEGIN
 
 @end
 
+// Real prompts through the completion path; times are seconds summed over every prompt and repetition
+@interface CactusWorkloadBenchmarkResult : NSObject
+
+@property (nonatomic, readonly) NSInteger repetitions;
+@property (nonatomic, readonly) NSInteger promptCount;
+@property (nonatomic, readonly) NSInteger promptTokens;
+@property (nonatomic, readonly) NSInteger generatedTokens;
+@property (nonatomic, readonly) NSTimeInterval timeToFirstToken;   // mean per prompt
+@property (nonatomic, readonly) double textGenerationSpeed;        // tokens/second
+@property (nonatomic, readonly) NSTimeInterval totalTime;
+
+@property (nonatomic, readonly) NSTimeInterval promptTime;         // sampler setup, tokenization, prompt cache
+@property (nonatomic, readonly) NSTimeInterval prefillTime;
+@property (nonatomic, readonly) NSTimeInterval decodeTime;
+@property (nonatomic, readonly) NSTimeInterval sampleTime;
+@property (nonatomic, readonly) NSTimeInterval grammarTime;
+@property (nonatomic, readonly) NSTimeInterval detokenizeTime;
+@property (nonatomic, readonly) NSTimeInterval stopStringTime;
+@property (nonatomic, readonly) NSTimeInterval callbackTime;
+
+@property (nonatomic, readonly) NSDate *timestamp;
+
+- (NSString *)summaryString;
+- (NSDictionary *)toDictionary;
+
+@end
+
 @interface CactusBenchmark : NSObject
 
 // Simple benchmark
@@ -84,12 +157,36 @@ NS_ASSUME_NONNULL_BEGIN
                                     progressHandler:(nullable void(^)(float progress, NSString *status))progressHandler
                                   completionHandler:(void(^)(CactusBenchmarkResult * _Nullable result, NSError * _Nullable error))completionHandler;
 
+// Benchmark suite: each configuration is measured with warm-up, percentiles, TTFT and peak memory
++ (NSUUID *)runBenchmarkSuiteWithConfigurations:(NSArray<CactusBenchmarkConfiguration *> *)configurations
+                                progressHandler:(nullable void(^)(float progress, NSString *status))progressHandler
+                              completionHandler:(void(^)(NSArray<CactusBenchmarkResult *> * _Nullable results, NSError * _Nullable error))completionHandler;
+
+// Workload benchmark: replays conversations with the given sampling, grammar and tools and
+// reports where the time goes; tokenHandler is timed as the callback cost
++ (NSUUID *)runWorkloadBenchmarkWithConversations:(NSArray<NSArray<CactusLLMMessage *> *> *)conversations
+                          generationConfiguration:(nullable CactusGenerationConfiguration *)configuration
+                                            tools:(nullable NSArray<CactusLLMTools *> *)tools
+                                      repetitions:(NSInteger)repetitions
+                                     tokenHandler:(nullable void(^)(NSString *token))tokenHandler
+                                completionHandler:(void(^)(CactusWorkloadBenchmarkResult * _Nullable result, NSError * _Nullable error))completionHandler;
+
+// Kernel benchmark: times the quantized CPU dot-product and repacked gemv/gemm kernels on
+// 1B-8B projection shapes without a model. Pass JSON data from an earlier run as the baseline to
+// flag kernels whose GFLOP/s dropped by more than tolerance (e.g. 0.05)
++ (NSUUID *)runKernelBenchmarkWithBaseline:(nullable NSData *)baselineJSON
+                                 tolerance:(double)tolerance
+                         completionHandler:(void(^)(NSArray<NSDictionary *> * _Nullable results, BOOL regressed, NSError * _Nullable error))completionHandler;
+
 // Cancel benchmark
 + (void)cancelBenchmark:(NSUUID *)benchmarkId;
 
 // System benchmarks
 + (NSDictionary *)systemPerformanceInfo;
 + (NSDictionary *)memoryUsageInfo;
+// Backend buffer bytes by category (weights, kv_cache, compute, output, mmproj, vocoder, other)
+// and buffer type, with high-water marks since load or the last benchmark run
++ (NSDictionary *)backendMemoryUsage;
 
 @end
 
@@ -135,6 +232,11 @@ NS_ASSUME_NONNULL_BEGIN
 // Model size estimation
 + (NSUInteger)estimateModelMemoryUsage:(NSString *)modelPath;
 + (NSUInteger)estimateContextMemoryUsage:(NSInteger)contextSize;
+// Weights, KV cache, compute buffers and projector from GGUF metadata, split per backend.
+// Keys: weights, weightsGPU, kvCache, kvCacheGPU, computeBuffers, computeBuffersGPU, mmproj,
+// total, totalGPU, layers, trainContextSize
++ (nullable NSDictionary<NSString *, NSNumber *> *)estimateMemoryForConfiguration:(CactusModelConfiguration *)configuration
+                                                                       mmprojPath:(nullable NSString *)mmprojPath;
 
 // Model recommendations
 + (CactusModelConfiguration *)recommendedConfigurationForModel:(NSString *)modelPath;
@@ -144,6 +246,23 @@ NS_ASSUME_NONNULL_BEGIN
 
 // MARK: - Performance Monitor
 
+typedef NS_ENUM(uint8_t, CactusPerformanceSampleKind) {
+    CactusPerformanceSampleKindPeriodic = 0,
+    CactusPerformanceSampleKindToken = 1
+};
+
+// Fixed-size sample; memory and thermal state are refreshed by the monitoring timer,
+// decodeLatency is only set for token samples
+typedef struct {
+    uint64_t timestamp;             // nanoseconds, CLOCK_UPTIME_RAW
+    uint64_t residentBytes;
+    uint64_t virtualBytes;
+    uint32_t decodeLatency;         // microseconds
+    uint16_t activeProcessorCount;
+    uint8_t thermalState;           // NSProcessInfoThermalState
+    CactusPerformanceSampleKind kind;
+} CactusPerformanceSample;
+
 @interface CactusPerformanceMonitor : NSObject
 
 // Monitoring
@@ -156,10 +275,17 @@ NS_ASSUME_NONNULL_BEGIN
 + (NSDictionary *)memoryStats;
 + (NSDictionary *)cpuStats;
 
-// Historical data
+// Historical data: timestamp, memory and cpu as in currentPerformanceStats (sampled by the monitoring
+// timer), plus thermalState, kind (@"periodic" or @"token") and decodeLatency for token samples
 + (NSArray<NSDictionary *> *)performanceHistory;
 + (void)clearPerformanceHistory;
 
+// Samples live in a lock-free ring; recording never blocks and readers never stall writers.
+// Token samples are only recorded while monitoring.
++ (NSUInteger)sampleCapacity;
++ (void)recordTokenWithDecodeLatency:(NSTimeInterval)latency;
++ (NSUInteger)copySamples:(CactusPerformanceSample *)samples maxCount:(NSUInteger)maxCount; // Oldest first
+
 // Alerts
 + (void)setMemoryUsageThreshold:(NSUInteger)thresholdMB
                         handler:(void(^)(NSUInteger currentUsageMB))handler;
@@ -168,6 +294,42 @@ NS_ASSUME_NONNULL_BEGIN
 
 @end
 
+// MARK: - Latency Histograms
+
+// HDR-style log-linear buckets: 16 sub-buckets per power of two keep every percentile within ~6% of
+// the recorded value. Recording is a few relaxed atomic adds and never blocks; readers take a snapshot.
+@interface CactusLatencyHistogram : NSObject
+
+@property (nonatomic, readonly) uint64_t count;
+
+- (void)recordValue:(uint64_t)value;
+- (uint64_t)valueAtPercentile:(double)percentile; // 0-100, 0 while empty
+- (void)reset;
+
+// count, min, max, mean and p50/p90/p95/p99/p99.9, values multiplied by scale
+- (NSDictionary *)summaryWithScale:(double)scale;
+
+@end
+
+// What a user waits on: time queued in CactusBackgroundProcessor, time from the request to the first
+// token, the gap between streamed tokens and how fast the prompt was evaluated.
+// Each session keeps its own set; globalMetrics covers every session, and every task for queueWait.
+@interface CactusLatencyMetrics : NSObject
+
++ (instancetype)globalMetrics;
+
+@property (nonatomic, readonly) CactusLatencyHistogram *queueWait;         // microseconds
+@property (nonatomic, readonly) CactusLatencyHistogram *timeToFirstToken;  // microseconds, includes queueWait
+@property (nonatomic, readonly) CactusLatencyHistogram *interTokenLatency; // microseconds
+@property (nonatomic, readonly) CactusLatencyHistogram *prefillThroughput; // prompt tokens per second
+
+- (void)reset;
+
+// Latencies in seconds, prefill throughput in tokens per second
+- (NSDictionary *)dictionaryRepresentation;
+
+@end
+
 // MARK: - File Utilities
 
 @interface CactusFileUtilities : NSObject
@@ -191,6 +353,70 @@ NS_ASSUME_NONNULL_BEGIN
 
 @end
 
+// MARK: - Embedding Utilities
+
+typedef NS_ENUM(NSInteger, CactusEmbeddingStorage) {
+    CactusEmbeddingStorageFloat32 = 0,
+    CactusEmbeddingStorageInt8 = 1,
+    CactusEmbeddingStorageBinary = 2
+};
+
+@interface CactusEmbeddingUtilities : NSObject
+
+// Quantization: int8 data holds one byte per dimension (x ~= scale * q), binary data one sign bit per dimension
++ (NSData *)quantizeEmbeddingToInt8:(NSData *)embedding scale:(float *)scale;
++ (NSData *)quantizeEmbeddingToBinary:(NSData *)embedding;
+
+// Similarity of two vectors with the same dimension
++ (float)dotProductOfEmbedding:(NSData *)a withEmbedding:(NSData *)b;
++ (float)cosineSimilarityOfEmbedding:(NSData *)a withEmbedding:(NSData *)b;
++ (int32_t)dotProductOfInt8Embedding:(NSData *)a withEmbedding:(NSData *)b;
++ (NSInteger)hammingDistanceOfBinaryEmbedding:(NSData *)a withEmbedding:(NSData *)b;
+
+// Nearest rows of a row-major matrix; each result is @{@"index", @"score"}, best first.
+// Scores are dot products (scaled by rowScales for int8) or Hamming distances for binary
++ (NSArray<NSDictionary *> *)topK:(NSInteger)k
+                  matchesForQuery:(NSData *)query
+                         inMatrix:(NSData *)matrix
+                        dimension:(NSInteger)dimension
+                          storage:(CactusEmbeddingStorage)storage
+                        rowScales:(nullable NSData *)rowScales;
+
+@end
+
+// MARK: - Vector Index
+
+// Embedding index keyed by caller identifiers. Flat scans every vector; HNSW searches a graph and
+// suits sets of more than a few thousand vectors. Rows loaded from a file stay memory-mapped until
+// the first change. Search results are @{@"identifier", @"score"}, best first, scored as topK: does.
+@interface CactusVectorIndex : NSObject
+
+@property (nonatomic, readonly) NSInteger dimension;
+@property (nonatomic, readonly) CactusEmbeddingStorage storage;
+@property (nonatomic, readonly) NSUInteger count;
+
+- (instancetype)initWithDimension:(NSInteger)dimension
+                          storage:(CactusEmbeddingStorage)storage
+                          useHNSW:(BOOL)useHNSW;
++ (nullable instancetype)indexWithContentsOfFile:(NSString *)path error:(NSError **)error;
+- (instancetype)init NS_UNAVAILABLE;
+
+// A vector already stored under an identifier is replaced
+- (void)addEmbedding:(NSData *)embedding identifier:(uint64_t)identifier;
+// Rows of a float matrix such as the one generateEmbeddingsForTexts: returns
+- (void)addEmbeddingMatrix:(NSData *)matrix identifiers:(NSArray<NSNumber *> *)identifiers;
+- (BOOL)removeIdentifier:(uint64_t)identifier;
+- (NSArray<NSDictionary *> *)searchWithEmbedding:(NSData *)query topK:(NSInteger)k;
+- (BOOL)writeToFile:(NSString *)path error:(NSError **)error;
+
+// Embeds texts with the loaded model and adds each row as it is produced, without an intermediate copy;
+// an index narrower than the model takes the leading (Matryoshka) dimensions
+- (NSUUID *)addTexts:(NSArray<NSString *> *)texts
+         identifiers:(NSArray<NSNumber *> *)identifiers
+   completionHandler:(nullable void(^)(NSError * _Nullable error))completionHandler;
+
+@end
+
 // MARK: - Logging
 
 typedef NS_ENUM(NSInteger, CactusLogLevel) {
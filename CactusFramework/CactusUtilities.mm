@@ -7,16 +7,78 @@
 #import "CactusModelManager.h"
 #import "CactusBackgroundProcessor.h"
 #import "CactusLLMError.h"
+#import "CactusLLMMessage.h"
+#import "CactusLLMTools.h"
 #import "cactus/cactus.h"
 #import "cactus/common.h"
 #import "cactus/llama-vocab.h"
+#import <Metal/Metal.h>
 #import <mach/mach.h>
+#import <os/proc.h>
 #import <sys/sysctl.h>
+#import <time.h>
+#import <algorithm>
+#import <atomic>
+#import <mutex>
+
+@interface CactusModelManager (ParameterConversion)
+- (common_params)convertConfiguration:(CactusModelConfiguration *)config;
+@end
 
 // MARK: - Tokenizer Implementation
 
+// Vocabulary loaded by loadVocabularyFromPath:, used when no model is loaded
+static std::shared_ptr<llama_model> CactusStandaloneVocab;
+static std::mutex CactusStandaloneVocabMutex;
+
+// The loaded model's vocabulary, else the standalone one; the returned model keeps it alive
+static const llama_vocab *CactusTokenizerVocab(cactus::cactus_context *context, std::shared_ptr<llama_model> &owner) {
+    if (context && context->model) {
+        return llama_model_get_vocab(context->model);
+    }
+    std::lock_guard<std::mutex> lock(CactusStandaloneVocabMutex);
+    owner = CactusStandaloneVocab;
+    return owner ? llama_model_get_vocab(owner.get()) : nullptr;
+}
+
 @implementation CactusTokenizer
 
++ (BOOL)loadVocabularyFromPath:(NSString *)path error:(NSError **)error {
+    if (![[NSFileManager defaultManager] fileExistsAtPath:path]) {
+        if (error) {
+            *error = [NSError errorWithDomain:CactusLLMErrorDomain
+                                         code:CactusLLMErrorFileNotFound
+                                     userInfo:@{NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Model file not found: %@", path]}];
+        }
+        return NO;
+    }
+    std::shared_ptr<llama_model> model = cactus::load_vocab_only(path.UTF8String);
+    if (!model) {
+        if (error) {
+            *error = [NSError errorWithDomain:CactusLLMErrorDomain
+                                         code:CactusLLMErrorModelLoadFailed
+                                     userInfo:@{NSLocalizedDescriptionKey: @"Failed to load vocabulary"}];
+        }
+        return NO;
+    }
+    std::lock_guard<std::mutex> lock(CactusStandaloneVocabMutex);
+    CactusStandaloneVocab = std::move(model);
+    return YES;
+}
+
++ (void)unloadVocabulary {
+    std::shared_ptr<llama_model> model;
+    {
+        std::lock_guard<std::mutex> lock(CactusStandaloneVocabMutex);
+        model.swap(CactusStandaloneVocab);
+    }
+}
+
++ (BOOL)isVocabularyLoaded {
+    std::lock_guard<std::mutex> lock(CactusStandaloneVocabMutex);
+    return CactusStandaloneVocab != nullptr;
+}
+
 + (NSArray<NSNumber *> *)tokenizeText:(NSString *)text error:(NSError **)error {
     return [self tokenizeText:text mediaPaths:nil error:error];
 }
@@ -25,8 +87,10 @@
                            mediaPaths:(NSArray<NSString *> *)mediaPaths
                                 error:(NSError **)error {
     cactus::cactus_context *context = (cactus::cactus_context *)[[CactusModelManager sharedManager] internalContext];
+    std::shared_ptr<llama_model> owner;
+    const llama_vocab *vocab = context ? nullptr : CactusTokenizerVocab(nullptr, owner);
     
-    if (!context) {
+    if (!context && (!vocab || mediaPaths.count > 0)) {
         if (error) {
             *error = [NSError errorWithDomain:CactusLLMErrorDomain
                                          code:CactusLLMErrorModelNotLoaded
@@ -38,7 +102,9 @@
     @try {
         std::vector<llama_token> tokens;
         
-        if (mediaPaths && mediaPaths.count > 0) {
+        if (!context) {
+            tokens = common_tokenize(vocab, text.UTF8String, false, false);
+        } else if (mediaPaths && mediaPaths.count > 0) {
             // Convert NSArray to std::vector
             std::vector<std::string> media_paths;
             for (NSString *path in mediaPaths) {
@@ -67,8 +133,10 @@
 
 + (NSString *)detokenizeTokens:(NSArray<NSNumber *> *)tokens error:(NSError **)error {
     cactus::cactus_context *context = (cactus::cactus_context *)[[CactusModelManager sharedManager] internalContext];
+    std::shared_ptr<llama_model> owner;
+    const llama_vocab *vocab = CactusTokenizerVocab(context, owner);
     
-    if (!context) {
+    if (!vocab) {
         if (error) {
             *error = [NSError errorWithDomain:CactusLLMErrorDomain
                                          code:CactusLLMErrorModelNotLoaded
@@ -83,7 +151,7 @@
             token_vector.push_back([token intValue]);
         }
         
-        std::string result = common_detokenize(context->ctx, token_vector);
+        std::string result = common_detokenize(vocab, token_vector);
         return @(result.c_str());
     } @catch (NSException *exception) {
         if (error) {
@@ -100,6 +168,45 @@
     return tokens ? tokens.count : 0;
 }
 
++ (NSInteger)exactTokenCountForText:(NSString *)text {
+    cactus::cactus_context *context = (cactus::cactus_context *)[[CactusModelManager sharedManager] internalContext];
+    std::shared_ptr<llama_model> owner;
+    const llama_vocab *vocab = CactusTokenizerVocab(context, owner);
+    if (!vocab || (context && !context->ctx)) return -1;
+    if (text.length == 0) return 0;
+    
+    @try {
+        return (NSInteger)common_tokenize(vocab, text.UTF8String, false, true).size();
+    } @catch (...) {
+        return -1;
+    }
+}
+
++ (NSInteger)chatTemplateOverheadTokens {
+    static const void *cachedModel = NULL;
+    static NSInteger cachedOverhead = -1;
+    
+    cactus::cactus_context *context = (cactus::cactus_context *)[[CactusModelManager sharedManager] internalContext];
+    if (!context || !context->ctx) return -1;
+    
+    @synchronized(self) {
+        if (cachedModel != context->model) {
+            // Tokens the template adds around one message: the span of an empty turn after the first,
+            // without BOS or the generation prompt
+            std::vector<common_chat_msg> turns(2);
+            turns[0].role = "user";
+            turns[1].role = "assistant";
+            std::vector<std::string> spans;
+            std::string generationPrompt;
+            cachedOverhead = context->formatChatSpans(turns, 0, spans, generationPrompt) && spans.size() == 2
+                ? (NSInteger)common_tokenize(context->ctx, spans[1], false, true).size()
+                : 4;
+            cachedModel = context->model;
+        }
+        return cachedOverhead;
+    }
+}
+
 + (NSInteger)countTokensInMessages:(NSArray<NSDictionary *> *)messages {
     NSInteger totalTokens = 0;
     
@@ -114,22 +221,24 @@
 }
 
 + (NSInteger)vocabularySize {
-   
     cactus::cactus_context *context = (cactus::cactus_context *)[[CactusModelManager sharedManager] internalContext];
-    if (!context) return 0;
+    std::shared_ptr<llama_model> owner;
+    const llama_vocab *vocab = CactusTokenizerVocab(context, owner);
+    if (!vocab) return 0;
     
-    const llama_vocab * vocab = llama_model_get_vocab(context->model);
     return vocab->n_tokens();
 }
 
 + (NSString *)tokenToString:(NSInteger)tokenId {
     cactus::cactus_context *context = (cactus::cactus_context *)[[CactusModelManager sharedManager] internalContext];
+    std::shared_ptr<llama_model> owner;
+    const llama_vocab *vocab = CactusTokenizerVocab(context, owner);
     
-    if (!context) return nil;
+    if (!vocab) return nil;
     
     @try {
         std::vector<llama_token> tokens = {(llama_token)tokenId};
-        std::string result = common_detokenize(context->ctx, tokens);
+        std::string result = common_detokenize(vocab, tokens);
         return @(result.c_str());
     } @catch (...) {
         return nil;
@@ -145,6 +254,177 @@
 
 // MARK: - Benchmark Result Implementation
 
+@implementation CactusBenchmarkConfiguration
+
+- (instancetype)init {
+    if (self = [super init]) {
+        _promptTokens = 512;
+        _generationTokens = 128;
+        _parallelSequences = 1;
+        _repetitions = 3;
+        _warmupRepetitions = 1;
+        _batchSize = 0;
+        _ubatchSize = 0;
+        _threads = 0;
+        _batchThreads = 0;
+    }
+    return self;
+}
+
++ (instancetype)defaultConfiguration {
+    return [[self alloc] init];
+}
+
++ (NSArray<CactusBenchmarkConfiguration *> *)sweepFromConfiguration:(CactusBenchmarkConfiguration *)base
+                                                          parameters:(NSDictionary<NSString *, NSArray *> *)parameters {
+    NSArray<CactusBenchmarkConfiguration *> *configurations = @[[base copy]];
+    for (NSString *key in [parameters.allKeys sortedArrayUsingSelector:@selector(compare:)]) {
+        NSMutableArray<CactusBenchmarkConfiguration *> *expanded = [NSMutableArray array];
+        for (CactusBenchmarkConfiguration *configuration in configurations) {
+            for (id value in parameters[key]) {
+                CactusBenchmarkConfiguration *point = [configuration copy];
+                [point setValue:(value == [NSNull null] ? nil : value) forKey:key];
+                [expanded addObject:point];
+            }
+        }
+        configurations = expanded;
+    }
+    return configurations;
+}
+
+- (id)copyWithZone:(NSZone *)zone {
+    CactusBenchmarkConfiguration *copy = [[[self class] allocWithZone:zone] init];
+    copy.promptTokens = self.promptTokens;
+    copy.generationTokens = self.generationTokens;
+    copy.parallelSequences = self.parallelSequences;
+    copy.repetitions = self.repetitions;
+    copy.warmupRepetitions = self.warmupRepetitions;
+    copy.batchSize = self.batchSize;
+    copy.ubatchSize = self.ubatchSize;
+    copy.threads = self.threads;
+    copy.batchThreads = self.batchThreads;
+    copy.flashAttention = self.flashAttention;
+    copy.cacheTypeK = self.cacheTypeK;
+    copy.cacheTypeV = self.cacheTypeV;
+    return copy;
+}
+
+- (NSDictionary *)toDictionary {
+    NSMutableDictionary *dictionary = [@{
+        @"promptTokens": @(self.promptTokens),
+        @"generationTokens": @(self.generationTokens),
+        @"parallelSequences": @(self.parallelSequences),
+        @"repetitions": @(self.repetitions),
+        @"warmupRepetitions": @(self.warmupRepetitions),
+        @"batchSize": @(self.batchSize),
+        @"ubatchSize": @(self.ubatchSize),
+        @"threads": @(self.threads),
+        @"batchThreads": @(self.batchThreads)
+    } mutableCopy];
+    dictionary[@"flashAttention"] = self.flashAttention;
+    dictionary[@"cacheTypeK"] = self.cacheTypeK;
+    dictionary[@"cacheTypeV"] = self.cacheTypeV;
+    return dictionary;
+}
+
+@end
+
+@interface CactusBenchmarkResult ()
+@property (nonatomic, readwrite) NSTimeInterval timeToFirstToken;
+@property (nonatomic, readwrite) NSTimeInterval tokenLatencyP50;
+@property (nonatomic, readwrite) NSTimeInterval tokenLatencyP95;
+@property (nonatomic, readwrite) NSTimeInterval tokenLatencyP99;
+@property (nonatomic, readwrite) uint64_t peakMemory;
+@property (nonatomic, readwrite) uint64_t peakBufferMemory;
+@property (nonatomic, readwrite) NSArray<NSDictionary *> *bufferUsage;
+@property (nonatomic, readwrite, nullable) CactusBenchmarkConfiguration *configuration;
+@end
+
+static NSArray<NSDictionary *> *CactusBufferUsageArray(const std::vector<cactus::cactus_buffer_usage> &rows) {
+    NSMutableArray<NSDictionary *> *buffers = [NSMutableArray arrayWithCapacity:rows.size()];
+    for (const cactus::cactus_buffer_usage &row : rows) {
+        [buffers addObject:@{
+            @"category": @(row.category.c_str()),
+            @"bufferType": @(row.buffer_type.c_str()),
+            @"current": @(row.current),
+            @"peak": @(row.peak),
+            @"count": @(row.n_buffers)
+        }];
+    }
+    return buffers;
+}
+
+static cactus::cactus_bench_config CactusBenchConfigFrom(CactusBenchmarkConfiguration *configuration) {
+    cactus::cactus_bench_config config;
+    config.pp = (int32_t)configuration.promptTokens;
+    config.tg = (int32_t)configuration.generationTokens;
+    config.pl = (int32_t)configuration.parallelSequences;
+    config.nr = (int32_t)configuration.repetitions;
+    config.warmup = (int32_t)configuration.warmupRepetitions;
+    config.n_batch = (int32_t)configuration.batchSize;
+    config.n_ubatch = (int32_t)configuration.ubatchSize;
+    config.n_threads = (int32_t)configuration.threads;
+    config.n_threads_batch = (int32_t)configuration.batchThreads;
+    config.flash_attn = configuration.flashAttention ? (configuration.flashAttention.boolValue ? 1 : 0) : -1;
+    try {
+        if (configuration.cacheTypeK) {
+            config.type_k = cactus::kv_cache_type_from_str(configuration.cacheTypeK.UTF8String);
+        }
+        if (configuration.cacheTypeV) {
+            config.type_v = cactus::kv_cache_type_from_str(configuration.cacheTypeV.UTF8String);
+        }
+    } catch (...) {
+        // Unknown cache types keep the loaded setting
+    }
+    return config;
+}
+
+static CactusBenchmarkResult *CactusBenchmarkResultFrom(const cactus::cactus_bench_result &bench, double totalTime) {
+    CactusBenchmarkConfiguration *configuration = [CactusBenchmarkConfiguration defaultConfiguration];
+    configuration.promptTokens = bench.config.pp;
+    configuration.generationTokens = bench.config.tg;
+    configuration.parallelSequences = bench.config.pl;
+    configuration.repetitions = bench.config.nr;
+    configuration.warmupRepetitions = bench.config.warmup;
+    configuration.batchSize = bench.config.n_batch;
+    configuration.ubatchSize = bench.config.n_ubatch;
+    configuration.threads = bench.config.n_threads;
+    configuration.batchThreads = bench.config.n_threads_batch;
+    configuration.flashAttention = @(bench.config.flash_attn == 1);
+    configuration.cacheTypeK = @(lm_ggml_type_name(bench.config.type_k));
+    configuration.cacheTypeV = @(lm_ggml_type_name(bench.config.type_v));
+    
+    NSDictionary *details = @{
+        @"configuration": [configuration toDictionary],
+        @"runs": @(bench.runs),
+        @"promptProcessingSpeedStd": @(bench.pp_std),
+        @"textGenerationSpeedStd": @(bench.tg_std),
+        @"timeToFirstTokenMs": @(bench.ttft_ms),
+        @"tokenLatencyP50Ms": @(bench.tg_p50_ms),
+        @"tokenLatencyP95Ms": @(bench.tg_p95_ms),
+        @"tokenLatencyP99Ms": @(bench.tg_p99_ms),
+        @"peakMemory": @(bench.peak_memory),
+        @"peakBufferMemory": @(bench.peak_buffers)
+    };
+    CactusBenchmarkResult *result = [CactusBenchmarkResult resultWithPromptTokens:bench.config.pp
+                                                                 generationTokens:bench.config.tg
+                                                                  parallelSequences:bench.config.pl
+                                                                      repetitions:bench.runs
+                                                               promptProcessingSpeed:bench.pp_avg
+                                                                 textGenerationSpeed:bench.tg_avg
+                                                                        totalTime:totalTime
+                                                                  detailedResults:details];
+    result.timeToFirstToken = bench.ttft_ms / 1000.0;
+    result.tokenLatencyP50 = bench.tg_p50_ms / 1000.0;
+    result.tokenLatencyP95 = bench.tg_p95_ms / 1000.0;
+    result.tokenLatencyP99 = bench.tg_p99_ms / 1000.0;
+    result.peakMemory = bench.peak_memory;
+    result.peakBufferMemory = bench.peak_buffers;
+    result.bufferUsage = CactusBufferUsageArray(bench.buffers);
+    result.configuration = configuration;
+    return result;
+}
+
 @implementation CactusBenchmarkResult
 
 - (instancetype)initWithPromptTokens:(NSInteger)promptTokens
@@ -164,6 +444,7 @@
         _textGenerationSpeed = tgSpeed;
         _totalTime = totalTime;
         _detailedResults = [detailedResults copy];
+        _bufferUsage = @[];
         _timestamp = [NSDate date];
     }
     return self;
@@ -208,6 +489,13 @@
         @"promptProcessingSpeed": @(self.promptProcessingSpeed),
         @"textGenerationSpeed": @(self.textGenerationSpeed),
         @"totalTime": @(self.totalTime),
+        @"timeToFirstToken": @(self.timeToFirstToken),
+        @"tokenLatencyP50": @(self.tokenLatencyP50),
+        @"tokenLatencyP95": @(self.tokenLatencyP95),
+        @"tokenLatencyP99": @(self.tokenLatencyP99),
+        @"peakMemory": @(self.peakMemory),
+        @"peakBufferMemory": @(self.peakBufferMemory),
+        @"bufferUsage": self.bufferUsage ?: @[],
         @"timestamp": self.timestamp,
         @"detailedResults": self.detailedResults ?: @{}
     };
@@ -215,6 +503,92 @@
 
 @end
 
+@interface CactusWorkloadBenchmarkResult ()
+@property (nonatomic, readwrite) NSInteger repetitions;
+@property (nonatomic, readwrite) NSInteger promptCount;
+@property (nonatomic, readwrite) NSInteger promptTokens;
+@property (nonatomic, readwrite) NSInteger generatedTokens;
+@property (nonatomic, readwrite) NSTimeInterval timeToFirstToken;
+@property (nonatomic, readwrite) double textGenerationSpeed;
+@property (nonatomic, readwrite) NSTimeInterval totalTime;
+@property (nonatomic, readwrite) NSTimeInterval promptTime;
+@property (nonatomic, readwrite) NSTimeInterval prefillTime;
+@property (nonatomic, readwrite) NSTimeInterval decodeTime;
+@property (nonatomic, readwrite) NSTimeInterval sampleTime;
+@property (nonatomic, readwrite) NSTimeInterval grammarTime;
+@property (nonatomic, readwrite) NSTimeInterval detokenizeTime;
+@property (nonatomic, readwrite) NSTimeInterval stopStringTime;
+@property (nonatomic, readwrite) NSTimeInterval callbackTime;
+@property (nonatomic, readwrite) NSDate *timestamp;
+@end
+
+@implementation CactusWorkloadBenchmarkResult
+
+- (NSString *)summaryString {
+    return [NSString stringWithFormat:@"Workload Benchmark Results:\n"
+            @"  Prompts: %ld x %ld, %ld prompt tokens, %ld generated tokens\n"
+            @"  Time to First Token: %.1f ms, Text Generation: %.1f tokens/sec\n"
+            @"  Prefill %.2fs, Decode %.2fs, Sample %.2fs, Grammar %.2fs\n"
+            @"  Detokenize %.2fs, Stop Strings %.2fs, Callbacks %.2fs, Prompt Setup %.2fs",
+            (long)self.promptCount, (long)self.repetitions, (long)self.promptTokens, (long)self.generatedTokens,
+            self.timeToFirstToken * 1000.0, self.textGenerationSpeed,
+            self.prefillTime, self.decodeTime, self.sampleTime, self.grammarTime,
+            self.detokenizeTime, self.stopStringTime, self.callbackTime, self.promptTime];
+}
+
+- (NSDictionary *)toDictionary {
+    return @{
+        @"repetitions": @(self.repetitions),
+        @"promptCount": @(self.promptCount),
+        @"promptTokens": @(self.promptTokens),
+        @"generatedTokens": @(self.generatedTokens),
+        @"timeToFirstToken": @(self.timeToFirstToken),
+        @"textGenerationSpeed": @(self.textGenerationSpeed),
+        @"totalTime": @(self.totalTime),
+        @"breakdown": @{
+            @"prompt": @(self.promptTime),
+            @"prefill": @(self.prefillTime),
+            @"decode": @(self.decodeTime),
+            @"sample": @(self.sampleTime),
+            @"grammar": @(self.grammarTime),
+            @"detokenize": @(self.detokenizeTime),
+            @"stopStrings": @(self.stopStringTime),
+            @"callbacks": @(self.callbackTime)
+        },
+        @"timestamp": self.timestamp
+    };
+}
+
+@end
+
+static NSString *CactusJSONString(id object) {
+    NSData *data = [NSJSONSerialization dataWithJSONObject:object options:0 error:nil];
+    return data ? [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding] : nil;
+}
+
+static void CactusApplySamplingConfiguration(cactus::cactus_context *context, CactusGenerationConfiguration *configuration) {
+    context->params.sampling.seed = (int32_t)configuration.seed;
+    context->params.sampling.temp = configuration.temperature;
+    context->params.sampling.top_k = (int32_t)configuration.topK;
+    context->params.sampling.top_p = configuration.topP;
+    context->params.sampling.min_p = configuration.minP;
+    context->params.sampling.penalty_last_n = (int32_t)configuration.penaltyLastN;
+    context->params.sampling.penalty_repeat = configuration.penaltyRepeat;
+    context->params.sampling.penalty_freq = configuration.penaltyFreq;
+    context->params.sampling.penalty_present = configuration.penaltyPresent;
+    context->params.sampling.mirostat = (int32_t)configuration.mirostat;
+    context->params.sampling.mirostat_tau = configuration.mirostatTau;
+    context->params.sampling.mirostat_eta = configuration.mirostatEta;
+    context->params.sampling.n_probs = (int32_t)configuration.nProbs;
+    context->params.sampling.ignore_eos = configuration.ignoreEOS;
+    context->params.sampling.grammar = configuration.grammar ? configuration.grammar.UTF8String : "";
+    context->params.n_predict = configuration.maxTokens > 0 ? (int32_t)configuration.maxTokens : -1;
+    context->params.antiprompt.clear();
+    for (NSString *stopSequence in [configuration filteredStopSequences]) {
+        context->params.antiprompt.push_back(stopSequence.UTF8String);
+    }
+}
+
 // MARK: - Benchmark Implementation
 
 @implementation CactusBenchmark
@@ -253,7 +627,8 @@
                                              description:@"Running performance benchmark"
                                           executionBlock:^id(CactusTask *task, CactusTaskProgressHandler progress) {
         
-        cactus::cactus_context *context = (cactus::cactus_context *)[[CactusModelManager sharedManager] internalContext];
+        CactusContextLease lease;
+        cactus::cactus_context *context = (cactus::cactus_context *)lease.context;
         
         if (!context) {
             @throw [NSException exceptionWithName:@"ModelNotLoaded"
@@ -263,39 +638,28 @@
         
         progress(0.1f);
         
-        // Run benchmark using cactus context
-        std::string benchResult = context->bench((int)promptTokens, (int)generationTokens, (int)parallel, (int)repetitions);
-        
-        progress(0.9f);
+        CactusBenchmarkConfiguration *configuration = [CactusBenchmarkConfiguration defaultConfiguration];
+        configuration.promptTokens = promptTokens;
+        configuration.generationTokens = generationTokens;
+        configuration.parallelSequences = parallel;
+        configuration.repetitions = repetitions;
+        configuration.warmupRepetitions = 0;
         
-        // Parse JSON result
-        NSData *jsonData = [NSData dataWithBytes:benchResult.c_str() length:benchResult.length()];
-        NSError *jsonError = nil;
-        id jsonResult = [NSJSONSerialization JSONObjectWithData:jsonData options:0 error:&jsonError];
-        
-        if (jsonError) {
-            @throw [NSException exceptionWithName:@"BenchmarkParseError"
-                                           reason:jsonError.localizedDescription
-                                         userInfo:@{@"error": jsonError}];
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        cactus::cactus_bench_result bench;
+        context->is_interrupted = false;
+        context->setAbortHook([task]() -> bool { return task.isCancelled; });
+        bool success = context->runBench(CactusBenchConfigFrom(configuration), bench);
+        context->setAbortHook(nullptr);
+        if (!success) {
+            @throw [NSException exceptionWithName:@"BenchmarkFailed"
+                                           reason:@"Benchmark did not complete"
+                                         userInfo:nil];
         }
         
         progress(1.0f);
         
-        // Create result object
-        NSDictionary *resultDict = (NSDictionary *)jsonResult;
-        
-        double ppSpeed = [resultDict[@"prompt_processing_speed"] doubleValue];
-        double tgSpeed = [resultDict[@"text_generation_speed"] doubleValue];
-        double totalTime = [resultDict[@"total_time"] doubleValue];
-        
-        CactusBenchmarkResult *result = [CactusBenchmarkResult resultWithPromptTokens:promptTokens
-                                                                     generationTokens:generationTokens
-                                                                      parallelSequences:parallel
-                                                                          repetitions:repetitions
-                                                                   promptProcessingSpeed:ppSpeed
-                                                                     textGenerationSpeed:tgSpeed
-                                                                            totalTime:totalTime
-                                                                      detailedResults:resultDict];
+        CactusBenchmarkResult *result = CactusBenchmarkResultFrom(bench, CFAbsoluteTimeGetCurrent() - start);
         
         return result;
     }];
@@ -324,6 +688,226 @@
     return benchmarkTask.taskId;
 }
 
++ (NSUUID *)runBenchmarkSuiteWithConfigurations:(NSArray<CactusBenchmarkConfiguration *> *)configurations
+                                progressHandler:(void(^)(float progress, NSString *status))progressHandler
+                              completionHandler:(void(^)(NSArray<CactusBenchmarkResult *> * _Nullable results, NSError * _Nullable error))completionHandler {
+    NSArray<CactusBenchmarkConfiguration *> *points = [[NSArray alloc] initWithArray:configurations copyItems:YES];
+    
+    CactusTask *suiteTask = [CactusTask taskWithType:CactusTaskTypeBenchmark
+                                            priority:CactusTaskPriorityLow
+                                         description:[NSString stringWithFormat:@"Running benchmark suite (%lu configurations)", (unsigned long)points.count]
+                                      executionBlock:^id(CactusTask *task, CactusTaskProgressHandler progress) {
+        CactusContextLease lease;
+        cactus::cactus_context *context = (cactus::cactus_context *)lease.context;
+        if (!context) {
+            @throw [NSException exceptionWithName:@"ModelNotLoaded"
+                                           reason:@"Model not loaded for benchmark"
+                                         userInfo:nil];
+        }
+        
+        std::vector<cactus::cactus_bench_config> configs;
+        configs.reserve(points.count);
+        for (CactusBenchmarkConfiguration *configuration in points) {
+            configs.push_back(CactusBenchConfigFrom(configuration));
+        }
+        
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        context->is_interrupted = false;
+        context->setAbortHook([task]() -> bool { return task.isCancelled; });
+        const size_t total = configs.size();
+        std::vector<cactus::cactus_bench_result> runs = context->benchSuite(configs, [progress, total](size_t index) {
+            progress((float)(index + 1) / (float)total);
+        });
+        context->setAbortHook(nullptr);
+        
+        NSMutableArray<CactusBenchmarkResult *> *results = [NSMutableArray arrayWithCapacity:runs.size()];
+        for (const cactus::cactus_bench_result &run : runs) {
+            [results addObject:CactusBenchmarkResultFrom(run, CFAbsoluteTimeGetCurrent() - start)];
+        }
+        return results;
+    }];
+    
+    suiteTask.progressHandler = ^(float progress) {
+        if (progressHandler) {
+            NSUInteger done = (NSUInteger)lroundf(progress * points.count);
+            progressHandler(progress, [NSString stringWithFormat:@"Benchmarked %lu of %lu configurations",
+                                       (unsigned long)done, (unsigned long)points.count]);
+        }
+    };
+    
+    suiteTask.completionHandler = ^(id result, NSError *error) {
+        if (completionHandler) {
+            completionHandler((NSArray<CactusBenchmarkResult *> *)result, error);
+        }
+    };
+    
+    [[CactusBackgroundProcessor sharedProcessor] submitTask:suiteTask];
+    return suiteTask.taskId;
+}
+
++ (NSUUID *)runKernelBenchmarkWithBaseline:(NSData *)baselineJSON
+                                 tolerance:(double)tolerance
+                         completionHandler:(void(^)(NSArray<NSDictionary *> * _Nullable results, BOOL regressed, NSError * _Nullable error))completionHandler {
+    std::string baseline = baselineJSON ? std::string((const char *)baselineJSON.bytes, baselineJSON.length) : std::string();
+    
+    CactusTask *kernelTask = [CactusTask taskWithType:CactusTaskTypeBenchmark
+                                             priority:CactusTaskPriorityLow
+                                          description:@"Running kernel benchmark"
+                                       executionBlock:^id(CactusTask *task, CactusTaskProgressHandler progress) {
+        std::vector<cactus::cactus_kernel_bench_result> runs = cactus::kernel_bench(0, 5);
+        bool passed = baseline.empty() || cactus::kernel_bench_compare(runs, baseline, tolerance);
+        std::string json = cactus::kernel_bench_json(runs);
+        NSData *data = [NSData dataWithBytes:json.data() length:json.size()];
+        NSArray *results = [NSJSONSerialization JSONObjectWithData:data options:0 error:nil] ?: @[];
+        return @{@"results": results, @"regressed": @(!passed)};
+    }];
+    
+    kernelTask.completionHandler = ^(id result, NSError *error) {
+        if (completionHandler) {
+            NSDictionary *outcome = (NSDictionary *)result;
+            completionHandler(outcome[@"results"], [outcome[@"regressed"] boolValue], error);
+        }
+    };
+    
+    [[CactusBackgroundProcessor sharedProcessor] submitTask:kernelTask];
+    return kernelTask.taskId;
+}
+
++ (NSUUID *)runWorkloadBenchmarkWithConversations:(NSArray<NSArray<CactusLLMMessage *> *> *)conversations
+                          generationConfiguration:(CactusGenerationConfiguration *)configuration
+                                            tools:(NSArray<CactusLLMTools *> *)tools
+                                      repetitions:(NSInteger)repetitions
+                                     tokenHandler:(void(^)(NSString *token))tokenHandler
+                                completionHandler:(void(^)(CactusWorkloadBenchmarkResult * _Nullable result, NSError * _Nullable error))completionHandler {
+    NSArray<NSArray<CactusLLMMessage *> *> *recorded = [conversations copy];
+    CactusGenerationConfiguration *generationConfig = [configuration copy] ?: [CactusGenerationConfiguration defaultConfiguration];
+    
+    NSMutableArray *toolsArray = [NSMutableArray arrayWithCapacity:tools.count];
+    for (CactusLLMTools *tool in tools) {
+        [toolsArray addObject:@{
+            @"type": @"function",
+            @"function": @{
+                @"name": tool.name ?: @"",
+                @"description": tool.desc ?: @"",
+                @"parameters": tool.parametersJSONSchema ?: @{}
+            }
+        }];
+    }
+    NSString *toolsJSON = toolsArray.count > 0 ? CactusJSONString(toolsArray) : nil;
+    
+    CactusTask *workloadTask = [CactusTask taskWithType:CactusTaskTypeBenchmark
+                                               priority:CactusTaskPriorityLow
+                                            description:[NSString stringWithFormat:@"Running workload benchmark (%lu prompts)", (unsigned long)recorded.count]
+                                         executionBlock:^id(CactusTask *task, CactusTaskProgressHandler progress) {
+        CactusContextLease lease;
+        cactus::cactus_context *context = (cactus::cactus_context *)lease.context;
+        if (!context) {
+            @throw [NSException exceptionWithName:@"ModelNotLoaded"
+                                           reason:@"Model not loaded for benchmark"
+                                         userInfo:nil];
+        }
+        
+        // Sessions only overwrite what their configuration sets, so the loaded settings come back afterwards
+        const common_params_sampling savedSampling = context->params.sampling;
+        const std::vector<std::string> savedAntiprompt = context->params.antiprompt;
+        const int32_t savedPredict = context->params.n_predict;
+        CactusApplySamplingConfiguration(context, generationConfig);
+        
+        std::vector<std::string> prompts;
+        prompts.reserve(recorded.count);
+        for (NSArray<CactusLLMMessage *> *conversation in recorded) {
+            std::vector<common_chat_msg> chatMessages;
+            chatMessages.reserve(conversation.count);
+            for (CactusLLMMessage *message in conversation) {
+                common_chat_msg msg;
+                msg.role = message.role.UTF8String;
+                msg.content = (message.content ?: @"").UTF8String;
+                chatMessages.push_back(std::move(msg));
+            }
+            if (!toolsJSON) {
+                prompts.push_back(context->getFormattedChat(std::move(chatMessages), ""));
+                continue;
+            }
+            try {
+                common_chat_params chat = context->getFormattedChatWithJinja(std::move(chatMessages), "", "", toolsJSON.UTF8String, false, "");
+                prompts.push_back(chat.prompt);
+                if (!chat.grammar.empty() && !generationConfig.grammar) {
+                    context->params.sampling.grammar = chat.grammar;
+                    context->params.sampling.grammar_lazy = chat.grammar_lazy;
+                    context->params.sampling.grammar_triggers = chat.grammar_triggers;
+                }
+                for (const std::string &stop : chat.additional_stops) {
+                    if (std::find(context->params.antiprompt.begin(), context->params.antiprompt.end(), stop) == context->params.antiprompt.end()) {
+                        context->params.antiprompt.push_back(stop);
+                    }
+                }
+            } catch (const std::exception &e) {
+                context->params.sampling = savedSampling;
+                context->params.antiprompt = savedAntiprompt;
+                context->params.n_predict = savedPredict;
+                @throw [NSException exceptionWithName:@"ChatTemplateError"
+                                               reason:[NSString stringWithUTF8String:e.what()]
+                                             userInfo:nil];
+            }
+        }
+        
+        const size_t total = prompts.size() * (size_t)MAX(1, repetitions);
+        size_t done = 0;
+        context->is_interrupted = false;
+        context->setAbortHook([task]() -> bool { return task.isCancelled; });
+        cactus::cactus_workload_result workload;
+        bool success = context->runWorkloadBench(prompts, (int32_t)repetitions, workload,
+                                                 [&, context](const cactus::completion_token_output &) {
+            if (tokenHandler) {
+                std::string_view delta = context->lastTextDelta();
+                if (!delta.empty()) {
+                    tokenHandler([[NSString alloc] initWithBytes:delta.data() length:delta.size() encoding:NSUTF8StringEncoding] ?: @"");
+                }
+            }
+            if (!context->has_next_token) {
+                progress((float)(++done) / (float)MAX((size_t)1, total));
+            }
+        });
+        context->params.sampling = savedSampling;
+        context->params.antiprompt = savedAntiprompt;
+        context->params.n_predict = savedPredict;
+        if (!success) {
+            @throw [NSException exceptionWithName:@"BenchmarkFailed"
+                                           reason:@"Workload benchmark did not complete"
+                                         userInfo:nil];
+        }
+        
+        const cactus::cactus_completion_profile &profile = workload.profile;
+        CactusWorkloadBenchmarkResult *result = [[CactusWorkloadBenchmarkResult alloc] init];
+        result.repetitions = workload.runs;
+        result.promptCount = (NSInteger)workload.n_prompts;
+        result.promptTokens = (NSInteger)workload.n_prompt_tokens;
+        result.generatedTokens = (NSInteger)workload.n_tokens;
+        result.timeToFirstToken = workload.ttft_ms / 1000.0;
+        result.textGenerationSpeed = workload.tg_avg;
+        result.totalTime = workload.total_us / 1e6;
+        result.promptTime = profile.prompt_us / 1e6;
+        result.prefillTime = profile.prefill_us / 1e6;
+        result.decodeTime = profile.decode_us / 1e6;
+        result.sampleTime = profile.sample_us / 1e6;
+        result.grammarTime = profile.grammar_us / 1e6;
+        result.detokenizeTime = profile.detokenize_us / 1e6;
+        result.stopStringTime = profile.stop_us / 1e6;
+        result.callbackTime = profile.callback_us / 1e6;
+        result.timestamp = [NSDate date];
+        return result;
+    }];
+    
+    workloadTask.completionHandler = ^(id result, NSError *error) {
+        if (completionHandler) {
+            completionHandler((CactusWorkloadBenchmarkResult *)result, error);
+        }
+    };
+    
+    [[CactusBackgroundProcessor sharedProcessor] submitTask:workloadTask];
+    return workloadTask.taskId;
+}
+
 + (void)cancelBenchmark:(NSUUID *)benchmarkId {
     [[CactusBackgroundProcessor sharedProcessor] cancelTask:benchmarkId];
 }
@@ -369,6 +953,24 @@
     return @{};
 }
 
++ (NSDictionary *)backendMemoryUsage {
+    size_t peakTotal = 0;
+    std::vector<cactus::cactus_buffer_usage> rows = cactus::buffer_memory_usage(&peakTotal);
+    size_t currentTotal = 0;
+    NSMutableDictionary<NSString *, NSNumber *> *byCategory = [NSMutableDictionary dictionary];
+    for (const cactus::cactus_buffer_usage &row : rows) {
+        currentTotal += row.current;
+        NSString *category = @(row.category.c_str());
+        byCategory[category] = @(byCategory[category].unsignedLongLongValue + row.current);
+    }
+    return @{
+        @"currentTotal": @(currentTotal),
+        @"peakTotal": @(peakTotal),
+        @"byCategory": byCategory,
+        @"buffers": CactusBufferUsageArray(rows)
+    };
+}
+
 @end
 
 // MARK: - LoRA Manager Implementation
@@ -571,6 +1173,11 @@
 }
 
 + (NSUInteger)estimateModelMemoryUsage:(NSString *)modelPath {
+    cactus::cactus_memory_estimate estimate;
+    if (cactus::estimate_memory(modelPath.UTF8String, common_params(), "", estimate)) {
+        return estimate.weights;
+    }
+    
     NSDictionary *info = [self getModelInfo:modelPath error:nil];
     NSUInteger fileSize = [info[@"size"] unsignedIntegerValue];
     
@@ -583,9 +1190,72 @@
     return contextSize * 4 * 2; // 4 bytes per token, 2x overhead
 }
 
++ (NSDictionary<NSString *, NSNumber *> *)estimateMemoryForConfiguration:(CactusModelConfiguration *)configuration
+                                                              mmprojPath:(NSString *)mmprojPath {
+    common_params params = [[CactusModelManager sharedManager] convertConfiguration:configuration];
+    cactus::cactus_memory_estimate estimate;
+    if (!cactus::estimate_memory(configuration.modelPath.UTF8String, params, mmprojPath ? mmprojPath.UTF8String : "", estimate)) {
+        return nil;
+    }
+    return @{
+        @"weights": @(estimate.weights),
+        @"weightsGPU": @(estimate.weights_gpu),
+        @"kvCache": @(estimate.kv_cache),
+        @"kvCacheGPU": @(estimate.kv_cache_gpu),
+        @"computeBuffers": @(estimate.compute),
+        @"computeBuffersGPU": @(estimate.compute_gpu),
+        @"mmproj": @(estimate.mmproj),
+        @"total": @(estimate.total()),
+        @"totalGPU": @(estimate.gpu()),
+        @"layers": @(estimate.n_layer),
+        @"trainContextSize": @(estimate.n_ctx_train)
+    };
+}
+
 + (CactusModelConfiguration *)recommendedConfigurationForModel:(NSString *)modelPath {
     CactusModelConfiguration *config = [CactusModelConfiguration configurationWithModelPath:modelPath];
     
+    // Largest offload first, then the largest context that still fits both budgets
+    unsigned long long budget = 0;
+    if (@available(iOS 13.0, macOS 10.15, *)) {
+        budget = os_proc_available_memory();
+    }
+    if (budget == 0) {
+        budget = [NSProcessInfo processInfo].physicalMemory / 2;
+    }
+    unsigned long long gpuBudget = budget;
+    id<MTLDevice> device = MTLCreateSystemDefaultDevice();
+    if (@available(iOS 16.0, macOS 10.12, *)) {
+        if (device.recommendedMaxWorkingSetSize > 0) {
+            gpuBudget = MIN(gpuBudget, device.recommendedMaxWorkingSetSize);
+        }
+    }
+    
+    config.batchSize = 512;
+    common_params params = [[CactusModelManager sharedManager] convertConfiguration:config];
+    cactus::cactus_model_profile profile;
+    if (cactus::read_model_profile(modelPath.UTF8String, profile) && profile.n_layer > 0) {
+        const NSInteger contexts[] = {32768, 16384, 8192, 4096, 2048, 1024, 512};
+        const NSInteger layerStep = MAX(1, (NSInteger)profile.n_layer / 8);
+        for (NSInteger minContext : {(NSInteger)2048, (NSInteger)512}) {
+            for (NSInteger layers = (NSInteger)profile.n_layer + 1; layers >= 0; layers = layers > 0 ? MAX(0, layers - layerStep) : -1) {
+                for (NSInteger contextSize : contexts) {
+                    if (contextSize < minContext || (profile.n_ctx_train > 0 && contextSize > profile.n_ctx_train)) {
+                        continue;
+                    }
+                    params.n_ctx = (int32_t)contextSize;
+                    params.n_gpu_layers = (int32_t)layers;
+                    cactus::cactus_memory_estimate candidate = cactus::estimate_memory(profile, params);
+                    if (candidate.total() <= budget && candidate.gpu() <= gpuBudget) {
+                        config.contextSize = contextSize;
+                        config.gpuLayers = layers > profile.n_layer ? -1 : layers;
+                        return config;
+                    }
+                }
+            }
+        }
+    }
+    
     NSUInteger fileSize = [self estimateModelMemoryUsage:modelPath];
     NSUInteger availableMemory = [NSProcessInfo processInfo].physicalMemory;
     
@@ -623,40 +1293,64 @@
 
 // MARK: - Performance Monitor Implementation
 
-static NSMutableArray<NSDictionary *> *performanceHistory = nil;
+static const uint64_t CactusSampleRingCapacity = 1024;
+
+// Seqlock per slot: odd while a writer fills it, 2 * (index + 1) once sample `index` is complete
+struct CactusSampleSlot {
+    std::atomic<uint64_t> sequence{0};
+    CactusPerformanceSample sample;
+};
+
+static CactusSampleSlot sampleRing[CactusSampleRingCapacity];
+static std::atomic<uint64_t> sampleHead{0};
+static std::atomic<uint64_t> sampleFloor{0};
+static std::atomic<uint64_t> cachedResidentBytes{0};
+static std::atomic<uint64_t> cachedVirtualBytes{0};
+static std::atomic<uint16_t> cachedActiveProcessorCount{0};
+static std::atomic<uint8_t> cachedThermalState{0};
+static std::atomic<bool> isCurrentlyMonitoring{false};
 static NSTimer *monitoringTimer = nil;
-static BOOL isCurrentlyMonitoring = NO;
 
-@implementation CactusPerformanceMonitor
-
-+ (void)initialize {
-    if (self == [CactusPerformanceMonitor class]) {
-        performanceHistory = [NSMutableArray array];
+static void CactusRecordSample(CactusPerformanceSampleKind kind, uint32_t decodeLatency) {
+    const uint64_t index = sampleHead.fetch_add(1, std::memory_order_relaxed);
+    CactusSampleSlot &slot = sampleRing[index % CactusSampleRingCapacity];
+    slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.sample.timestamp = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    slot.sample.residentBytes = cachedResidentBytes.load(std::memory_order_relaxed);
+    slot.sample.virtualBytes = cachedVirtualBytes.load(std::memory_order_relaxed);
+    slot.sample.activeProcessorCount = cachedActiveProcessorCount.load(std::memory_order_relaxed);
+    slot.sample.decodeLatency = decodeLatency;
+    slot.sample.thermalState = cachedThermalState.load(std::memory_order_relaxed);
+    slot.sample.kind = kind;
+    slot.sequence.store(2 * index + 2, std::memory_order_release);
+}
+
+static void CactusRefreshCachedStats(void) {
+    struct mach_task_basic_info info;
+    mach_msg_type_number_t size = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &size) == KERN_SUCCESS) {
+        cachedResidentBytes.store(info.resident_size, std::memory_order_relaxed);
+        cachedVirtualBytes.store(info.virtual_size, std::memory_order_relaxed);
     }
+    cachedActiveProcessorCount.store((uint16_t)[NSProcessInfo processInfo].activeProcessorCount, std::memory_order_relaxed);
+    cachedThermalState.store((uint8_t)[NSProcessInfo processInfo].thermalState, std::memory_order_relaxed);
 }
 
+@implementation CactusPerformanceMonitor
+
 + (void)startMonitoring {
-    if (isCurrentlyMonitoring) return;
-    
-    isCurrentlyMonitoring = YES;
+    if (isCurrentlyMonitoring.exchange(true)) return;
     
+    CactusRefreshCachedStats();
     monitoringTimer = [NSTimer scheduledTimerWithTimeInterval:1.0 repeats:YES block:^(NSTimer *timer) {
-        NSDictionary *stats = [self currentPerformanceStats];
-        @synchronized(performanceHistory) {
-            [performanceHistory addObject:stats];
-            
-            // Keep only last 100 entries
-            if (performanceHistory.count > 100) {
-                [performanceHistory removeObjectAtIndex:0];
-            }
-        }
+        CactusRefreshCachedStats();
+        CactusRecordSample(CactusPerformanceSampleKindPeriodic, 0);
     }];
 }
 
 + (void)stopMonitoring {
-    if (!isCurrentlyMonitoring) return;
-    
-    isCurrentlyMonitoring = NO;
+    if (!isCurrentlyMonitoring.exchange(false)) return;
     
     if (monitoringTimer) {
         [monitoringTimer invalidate];
@@ -665,14 +1359,15 @@ static BOOL isCurrentlyMonitoring = NO;
 }
 
 + (BOOL)isMonitoring {
-    return isCurrentlyMonitoring;
+    return isCurrentlyMonitoring.load(std::memory_order_relaxed);
 }
 
 + (NSDictionary *)currentPerformanceStats {
     return @{
         @"timestamp": [NSDate date],
         @"memory": [self memoryStats],
-        @"cpu": [self cpuStats]
+        @"cpu": [self cpuStats],
+        @"thermalState": @([NSProcessInfo processInfo].thermalState)
     };
 }
 
@@ -688,16 +1383,74 @@ static BOOL isCurrentlyMonitoring = NO;
     };
 }
 
++ (NSUInteger)sampleCapacity {
+    return (NSUInteger)CactusSampleRingCapacity;
+}
+
++ (void)recordTokenWithDecodeLatency:(NSTimeInterval)latency {
+    if (!isCurrentlyMonitoring.load(std::memory_order_relaxed)) return;
+    CactusRecordSample(CactusPerformanceSampleKindToken, (uint32_t)MIN(MAX(latency, 0.0) * 1e6, (double)UINT32_MAX));
+}
+
++ (NSUInteger)copySamples:(CactusPerformanceSample *)samples maxCount:(NSUInteger)maxCount {
+    if (!samples || maxCount == 0) return 0;
+    
+    const uint64_t head = sampleHead.load(std::memory_order_acquire);
+    const uint64_t floor = MAX(sampleFloor.load(std::memory_order_relaxed),
+                               head > CactusSampleRingCapacity ? head - CactusSampleRingCapacity : 0);
+    const uint64_t first = MAX(floor, head > maxCount ? head - maxCount : 0);
+    
+    // Slots being rewritten or already lapped by a writer are skipped, never waited on
+    NSUInteger count = 0;
+    for (uint64_t index = first; index < head; index++) {
+        const CactusSampleSlot &slot = sampleRing[index % CactusSampleRingCapacity];
+        const uint64_t before = slot.sequence.load(std::memory_order_acquire);
+        if (before != 2 * index + 2) continue;
+        CactusPerformanceSample sample = slot.sample;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != before) continue;
+        samples[count++] = sample;
+    }
+    return count;
+}
+
 + (NSArray<NSDictionary *> *)performanceHistory {
-    @synchronized(performanceHistory) {
-        return [performanceHistory copy];
+    std::vector<CactusPerformanceSample> samples(CactusSampleRingCapacity);
+    NSUInteger count = [self copySamples:samples.data() maxCount:samples.size()];
+    
+    // Dictionaries are only built here, on the consumer's side
+    const uint64_t now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    NSDate *reference = [NSDate date];
+    const NSUInteger processorCount = [NSProcessInfo processInfo].processorCount;
+    NSMutableArray<NSDictionary *> *history = [NSMutableArray arrayWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) {
+        const CactusPerformanceSample &sample = samples[i];
+        NSMutableDictionary *entry = [@{
+            @"timestamp": [reference dateByAddingTimeInterval:-(double)(now - MIN(now, sample.timestamp)) / 1e9],
+            @"kind": sample.kind == CactusPerformanceSampleKindToken ? @"token" : @"periodic",
+            // memory and cpu keep the keys of currentPerformanceStats
+            @"memory": @{
+                @"residentSize": @(sample.residentBytes),
+                @"virtualSize": @(sample.virtualBytes),
+                @"residentSizeMB": @(sample.residentBytes / (1024 * 1024)),
+                @"virtualSizeMB": @(sample.virtualBytes / (1024 * 1024))
+            },
+            @"cpu": @{
+                @"processorCount": @(processorCount),
+                @"activeProcessorCount": @(sample.activeProcessorCount)
+            },
+            @"thermalState": @(sample.thermalState)
+        } mutableCopy];
+        if (sample.kind == CactusPerformanceSampleKindToken) {
+            entry[@"decodeLatency"] = @(sample.decodeLatency / 1e6);
+        }
+        [history addObject:entry];
     }
+    return history;
 }
 
 + (void)clearPerformanceHistory {
-    @synchronized(performanceHistory) {
-        [performanceHistory removeAllObjects];
-    }
+    sampleFloor.store(sampleHead.load(std::memory_order_acquire), std::memory_order_relaxed);
 }
 
 + (void)setMemoryUsageThreshold:(NSUInteger)thresholdMB
@@ -714,6 +1467,165 @@ static BOOL isCurrentlyMonitoring = NO;
 
 @end
 
+// MARK: - Latency Histogram Implementation
+
+static const int CactusHistogramSubBucketBits = 4;
+static const uint64_t CactusHistogramSubBuckets = 1ull << CactusHistogramSubBucketBits;
+static const int CactusHistogramMaxBits = 40; // values clamp at ~12 days of microseconds
+static const size_t CactusHistogramBucketCount = (CactusHistogramMaxBits - CactusHistogramSubBucketBits + 1) * CactusHistogramSubBuckets;
+
+// Values below 16 get a bucket each; above that a bucket is a power of two and the four bits after it
+static size_t CactusHistogramBucket(uint64_t value) {
+    value = MIN(value, (1ull << CactusHistogramMaxBits) - 1);
+    if (value < CactusHistogramSubBuckets) return (size_t)value;
+    const int shift = 63 - __builtin_clzll(value) - CactusHistogramSubBucketBits;
+    return (size_t)(shift + 1) * CactusHistogramSubBuckets + (size_t)((value >> shift) - CactusHistogramSubBuckets);
+}
+
+// Highest value that lands in bucket
+static uint64_t CactusHistogramBucketValue(size_t bucket) {
+    if (bucket < CactusHistogramSubBuckets) return bucket;
+    const int shift = (int)(bucket / CactusHistogramSubBuckets) - 1;
+    const uint64_t sub = bucket % CactusHistogramSubBuckets + CactusHistogramSubBuckets;
+    return ((sub + 1) << shift) - 1;
+}
+
+static uint64_t CactusHistogramPercentile(const uint64_t *counts, uint64_t total, double percentile,
+                                          uint64_t minValue, uint64_t maxValue) {
+    if (total == 0) return 0;
+    const double fraction = MIN(MAX(percentile, 0.0), 100.0) / 100.0;
+    const uint64_t target = MIN(total, MAX((uint64_t)1, (uint64_t)ceil(fraction * total)));
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < CactusHistogramBucketCount; bucket++) {
+        seen += counts[bucket];
+        if (seen >= target) {
+            return MIN(MAX(CactusHistogramBucketValue(bucket), minValue), maxValue);
+        }
+    }
+    return maxValue;
+}
+
+@implementation CactusLatencyHistogram {
+    std::atomic<uint64_t> _buckets[CactusHistogramBucketCount];
+    std::atomic<uint64_t> _count;
+    std::atomic<uint64_t> _sum;
+    std::atomic<uint64_t> _min;
+    std::atomic<uint64_t> _max;
+}
+
+- (instancetype)init {
+    if (self = [super init]) {
+        [self reset];
+    }
+    return self;
+}
+
+- (uint64_t)count {
+    return _count.load(std::memory_order_relaxed);
+}
+
+- (void)recordValue:(uint64_t)value {
+    _buckets[CactusHistogramBucket(value)].fetch_add(1, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+    _sum.fetch_add(value, std::memory_order_relaxed);
+    uint64_t seen = _min.load(std::memory_order_relaxed);
+    while (value < seen && !_min.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+    seen = _max.load(std::memory_order_relaxed);
+    while (value > seen && !_max.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+}
+
+// Totals come from the copied buckets so percentiles stay consistent with a concurrent writer
+- (uint64_t)copyCounts:(uint64_t *)counts {
+    uint64_t total = 0;
+    for (size_t bucket = 0; bucket < CactusHistogramBucketCount; bucket++) {
+        counts[bucket] = _buckets[bucket].load(std::memory_order_relaxed);
+        total += counts[bucket];
+    }
+    return total;
+}
+
+- (uint64_t)valueAtPercentile:(double)percentile {
+    uint64_t counts[CactusHistogramBucketCount];
+    const uint64_t total = [self copyCounts:counts];
+    return CactusHistogramPercentile(counts, total, percentile,
+                                     _min.load(std::memory_order_relaxed), _max.load(std::memory_order_relaxed));
+}
+
+- (void)reset {
+    for (size_t bucket = 0; bucket < CactusHistogramBucketCount; bucket++) {
+        _buckets[bucket].store(0, std::memory_order_relaxed);
+    }
+    _count.store(0, std::memory_order_relaxed);
+    _sum.store(0, std::memory_order_relaxed);
+    _min.store(UINT64_MAX, std::memory_order_relaxed);
+    _max.store(0, std::memory_order_relaxed);
+}
+
+- (NSDictionary *)summaryWithScale:(double)scale {
+    uint64_t counts[CactusHistogramBucketCount];
+    const uint64_t total = [self copyCounts:counts];
+    if (total == 0) {
+        return @{@"count": @0};
+    }
+    const uint64_t minValue = _min.load(std::memory_order_relaxed);
+    const uint64_t maxValue = _max.load(std::memory_order_relaxed);
+    const auto at = [&](double percentile) {
+        return @(CactusHistogramPercentile(counts, total, percentile, minValue, maxValue) * scale);
+    };
+    return @{
+        @"count": @(total),
+        @"min": @(minValue * scale),
+        @"max": @(maxValue * scale),
+        @"mean": @((double)_sum.load(std::memory_order_relaxed) / total * scale),
+        @"p50": at(50.0),
+        @"p90": at(90.0),
+        @"p95": at(95.0),
+        @"p99": at(99.0),
+        @"p999": at(99.9)
+    };
+}
+
+@end
+
+@implementation CactusLatencyMetrics
+
++ (instancetype)globalMetrics {
+    static CactusLatencyMetrics *metrics = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        metrics = [[CactusLatencyMetrics alloc] init];
+    });
+    return metrics;
+}
+
+- (instancetype)init {
+    if (self = [super init]) {
+        _queueWait = [[CactusLatencyHistogram alloc] init];
+        _timeToFirstToken = [[CactusLatencyHistogram alloc] init];
+        _interTokenLatency = [[CactusLatencyHistogram alloc] init];
+        _prefillThroughput = [[CactusLatencyHistogram alloc] init];
+    }
+    return self;
+}
+
+- (void)reset {
+    [_queueWait reset];
+    [_timeToFirstToken reset];
+    [_interTokenLatency reset];
+    [_prefillThroughput reset];
+}
+
+- (NSDictionary *)dictionaryRepresentation {
+    return @{
+        @"queueWait": [_queueWait summaryWithScale:1e-6],
+        @"timeToFirstToken": [_timeToFirstToken summaryWithScale:1e-6],
+        @"interTokenLatency": [_interTokenLatency summaryWithScale:1e-6],
+        @"prefillThroughput": [_prefillThroughput summaryWithScale:1.0]
+    };
+}
+
+@end
+
 // MARK: - File Utilities Implementation
 
 @implementation CactusFileUtilities
@@ -788,6 +1700,235 @@ static BOOL isCurrentlyMonitoring = NO;
 
 @end
 
+// MARK: - Embedding Utilities Implementation
+
+@implementation CactusEmbeddingUtilities
+
++ (NSData *)quantizeEmbeddingToInt8:(NSData *)embedding scale:(float *)scale {
+    const int n = (int)(embedding.length / sizeof(float));
+    NSMutableData *out = [NSMutableData dataWithLength:n];
+    const float s = n > 0 ? cactus::quantize_embedding_i8((const float *)embedding.bytes, n, (int8_t *)out.mutableBytes) : 0.0f;
+    if (scale) *scale = s;
+    return out;
+}
+
++ (NSData *)quantizeEmbeddingToBinary:(NSData *)embedding {
+    const int n = (int)(embedding.length / sizeof(float));
+    NSMutableData *out = [NSMutableData dataWithLength:(n + 7) / 8];
+    if (n > 0) {
+        cactus::quantize_embedding_binary((const float *)embedding.bytes, n, (uint8_t *)out.mutableBytes);
+    }
+    return out;
+}
+
++ (float)dotProductOfEmbedding:(NSData *)a withEmbedding:(NSData *)b {
+    const int n = (int)(std::min(a.length, b.length) / sizeof(float));
+    return cactus::vec_dot_f32((const float *)a.bytes, (const float *)b.bytes, n);
+}
+
++ (float)cosineSimilarityOfEmbedding:(NSData *)a withEmbedding:(NSData *)b {
+    const int n = (int)(std::min(a.length, b.length) / sizeof(float));
+    return cactus::vec_cosine_f32((const float *)a.bytes, (const float *)b.bytes, n);
+}
+
++ (int32_t)dotProductOfInt8Embedding:(NSData *)a withEmbedding:(NSData *)b {
+    return cactus::vec_dot_i8((const int8_t *)a.bytes, (const int8_t *)b.bytes, (int)std::min(a.length, b.length));
+}
+
++ (NSInteger)hammingDistanceOfBinaryEmbedding:(NSData *)a withEmbedding:(NSData *)b {
+    return cactus::vec_hamming((const uint8_t *)a.bytes, (const uint8_t *)b.bytes, (int)std::min(a.length, b.length));
+}
+
++ (NSArray<NSDictionary *> *)topK:(NSInteger)k
+                  matchesForQuery:(NSData *)query
+                         inMatrix:(NSData *)matrix
+                        dimension:(NSInteger)dimension
+                          storage:(CactusEmbeddingStorage)storage
+                        rowScales:(NSData *)rowScales {
+    if (k <= 0 || dimension <= 0) {
+        return @[];
+    }
+    size_t row_bytes = (size_t)dimension * sizeof(float);
+    if (storage == CactusEmbeddingStorageInt8) {
+        row_bytes = (size_t)dimension;
+    } else if (storage == CactusEmbeddingStorageBinary) {
+        row_bytes = (size_t)(dimension + 7) / 8;
+    }
+    const size_t n_rows = matrix.length / row_bytes;
+    if (query.length < row_bytes || n_rows == 0) {
+        return @[];
+    }
+    const float *scales = rowScales.length >= n_rows * sizeof(float) ? (const float *)rowScales.bytes : nullptr;
+
+    std::vector<cactus::cactus_vector_match> matches = cactus::vector_top_k(
+        (cactus::cactus_vector_type)storage, query.bytes, matrix.bytes, scales, n_rows, (int)dimension, (size_t)k);
+    NSMutableArray<NSDictionary *> *results = [NSMutableArray arrayWithCapacity:matches.size()];
+    for (const auto &match : matches) {
+        [results addObject:@{@"index": @(match.index), @"score": @(match.score)}];
+    }
+    return results;
+}
+
+@end
+
+// MARK: - Vector Index Implementation
+
+@implementation CactusVectorIndex {
+    std::unique_ptr<cactus::cactus_vector_index> _index;
+}
+
+- (instancetype)initWithDimension:(NSInteger)dimension
+                          storage:(CactusEmbeddingStorage)storage
+                          useHNSW:(BOOL)useHNSW {
+    self = [super init];
+    if (self) {
+        _index.reset(new cactus::cactus_vector_index((int)dimension, (cactus::cactus_vector_type)storage, useHNSW));
+    }
+    return self;
+}
+
++ (instancetype)indexWithContentsOfFile:(NSString *)path error:(NSError **)error {
+    std::unique_ptr<cactus::cactus_vector_index> loaded = cactus::cactus_vector_index::load(path.UTF8String ?: "");
+    if (!loaded) {
+        if (error) {
+            *error = [NSError errorWithDomain:CactusLLMErrorDomain
+                                         code:CactusLLMErrorFileNotFound
+                                     userInfo:@{NSLocalizedDescriptionKey: @"Vector index file is missing or unreadable"}];
+        }
+        return nil;
+    }
+    CactusVectorIndex *index = [[CactusVectorIndex alloc] initWithDimension:loaded->dim
+                                                                    storage:(CactusEmbeddingStorage)loaded->storage
+                                                                    useHNSW:loaded->hnsw];
+    index->_index = std::move(loaded);
+    return index;
+}
+
+- (NSInteger)dimension {
+    return _index->dim;
+}
+
+- (CactusEmbeddingStorage)storage {
+    return (CactusEmbeddingStorage)_index->storage;
+}
+
+- (NSUInteger)count {
+    return _index->size();
+}
+
+- (void)addEmbedding:(NSData *)embedding identifier:(uint64_t)identifier {
+    if (embedding.length < (NSUInteger)_index->dim * sizeof(float)) {
+        return;
+    }
+    _index->add((size_t)identifier, (const float *)embedding.bytes);
+}
+
+- (void)addEmbeddingMatrix:(NSData *)matrix identifiers:(NSArray<NSNumber *> *)identifiers {
+    const size_t n = std::min((size_t)identifiers.count, (size_t)(matrix.length / (_index->dim * sizeof(float))));
+    std::vector<size_t> ids(n);
+    for (size_t i = 0; i < n; i++) {
+        ids[i] = (size_t)identifiers[i].unsignedLongLongValue;
+    }
+    _index->add(ids.data(), (const float *)matrix.bytes, n);
+}
+
+- (BOOL)removeIdentifier:(uint64_t)identifier {
+    return _index->remove((size_t)identifier);
+}
+
+- (NSArray<NSDictionary *> *)searchWithEmbedding:(NSData *)query topK:(NSInteger)k {
+    if (k <= 0 || query.length < (NSUInteger)_index->dim * sizeof(float)) {
+        return @[];
+    }
+    std::vector<cactus::cactus_vector_match> matches = _index->search((const float *)query.bytes, (size_t)k);
+    NSMutableArray<NSDictionary *> *results = [NSMutableArray arrayWithCapacity:matches.size()];
+    for (const auto &match : matches) {
+        [results addObject:@{@"identifier": @((uint64_t)match.index), @"score": @(match.score)}];
+    }
+    return results;
+}
+
+- (BOOL)writeToFile:(NSString *)path error:(NSError **)error {
+    if (!_index->save(path.UTF8String ?: "")) {
+        if (error) {
+            *error = [NSError errorWithDomain:CactusLLMErrorDomain
+                                         code:CactusLLMErrorInvalidState
+                                     userInfo:@{NSLocalizedDescriptionKey: @"Failed to write vector index"}];
+        }
+        return NO;
+    }
+    return YES;
+}
+
+- (NSUUID *)addTexts:(NSArray<NSString *> *)texts
+         identifiers:(NSArray<NSNumber *> *)identifiers
+   completionHandler:(void(^)(NSError *error))completionHandler {
+    NSArray<NSString *> *inputs = [texts copy];
+    std::vector<size_t> ids;
+    ids.reserve(identifiers.count);
+    for (NSNumber *identifier in identifiers) {
+        ids.push_back((size_t)identifier.unsignedLongLongValue);
+    }
+    cactus::cactus_vector_index *target = _index.get();
+    
+    CactusTask *indexTask = [CactusTask taskWithType:CactusTaskTypeEmbedding
+                                            priority:CactusTaskPriorityNormal
+                                         description:[NSString stringWithFormat:@"Indexing %lu texts", (unsigned long)inputs.count]
+                                      executionBlock:^id(CactusTask *task, CactusTaskProgressHandler progress) {
+        // Keeps the index alive for the duration of the task
+        CactusVectorIndex *owner = self;
+        CactusContextLease lease;
+        cactus::cactus_context *context = (cactus::cactus_context *)lease.context;
+        if (!context) {
+            @throw [NSException exceptionWithName:@"ContextNotAvailable"
+                                           reason:@"Model context not available"
+                                         userInfo:nil];
+        }
+        if (!context->params.embedding || llama_model_n_embd(context->model) < target->dim) {
+            @throw [NSException exceptionWithName:@"EmbeddingNotEnabled"
+                                           reason:@"The model is not loaded for embeddings of the index dimension"
+                                         userInfo:nil];
+        }
+        if (ids.size() != inputs.count) {
+            @throw [NSException exceptionWithName:@"InvalidArgument"
+                                           reason:@"Every text needs an identifier"
+                                         userInfo:nil];
+        }
+        
+        std::vector<std::string> batch;
+        batch.reserve(inputs.count);
+        for (NSString *text in inputs) {
+            batch.emplace_back(text.UTF8String ?: "");
+        }
+        const size_t total = batch.size();
+        std::vector<float> matrix;
+        context->is_interrupted = false;
+        context->setAbortHook([task]() -> bool { return task.isCancelled; });
+        const bool ok = context->getEmbeddings(batch, matrix, [&](size_t index, const float *row) {
+            target->add(ids[index], row);
+            progress((float)(index + 1) / (float)total);
+        }, target->dim);
+        context->setAbortHook(nullptr);
+        if (!ok) {
+            @throw [NSException exceptionWithName:@"EmbeddingError"
+                                           reason:task.isCancelled ? @"Indexing was cancelled" : @"Failed to generate embeddings"
+                                         userInfo:nil];
+        }
+        return @(owner.count);
+    }];
+    
+    indexTask.completionHandler = ^(id result, NSError *error) {
+        if (completionHandler) {
+            completionHandler(error);
+        }
+    };
+    
+    [[CactusBackgroundProcessor sharedProcessor] submitTask:indexTask];
+    return indexTask.taskId;
+}
+
+@end
+
 // MARK: - Logger Implementation
 
 static CactusLogLevel currentLogLevel = CactusLogLevelInfo;
@@ -4,6 +4,15 @@
 #include <sstream>
 #include <iostream>
 #include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <string_view>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <list>
 #include "chat.h"
 #include "common.h"
 #include "ggml.h"
@@ -16,27 +25,130 @@
 #endif
 
 struct mtmd_context;
+struct mtmd_bitmap;
+struct mtmd_audio_stream;
+struct llama_grammar;
+struct llama_file;
+struct llama_mmap;
 
 namespace cactus {
 
 std::string tokens_to_output_formatted_string(const llama_context *ctx, const llama_token token);
+std::string format_token_piece(std::string_view piece);
+// Text of a token with special tokens rendered, served from the vocab's piece cache without a copy
+const std::string &cached_token_piece(const llama_vocab *vocab, llama_token token);
 
 std::string tokens_to_str(llama_context *ctx, const std::vector<llama_token>::const_iterator begin, const std::vector<llama_token>::const_iterator end);
 
 lm_ggml_type kv_cache_type_from_str(const std::string & s);
 
+#if defined(__APPLE__)
+// Decodes with ImageIO, downsampling during decode so the longest side is at most max_side (0 for
+// full size); nullptr when ImageIO cannot read the data (cactus_image.mm)
+mtmd_bitmap *decode_image_apple(const uint8_t *data, size_t len, int max_side);
+
+// The exact size decode_image_apple produces for an nx x ny image
+void decode_image_apple_size(int nx, int ny, int max_side, int &out_nx, int &out_ny);
+
+// decode_image_apple's output size from the image's properties alone; false when ImageIO cannot read them
+bool decode_image_apple_info(const uint8_t *data, size_t len, int max_side, int &out_nx, int &out_ny);
+#endif
+
+// 64-bit content identity over raw bytes, eight lanes per 64-byte stripe in the style of XXH3
+uint64_t content_hash64(const void *data, size_t len);
+
 enum stop_type
 {
     STOP_FULL,
     STOP_PARTIAL,
 };
 
+enum truncation_strategy {
+    TRUNCATE_KEEP_TAIL = 0,
+    TRUNCATE_KEEP_HEAD = 1,
+    TRUNCATE_MIDDLE_OUT = 2,
+    TRUNCATE_MESSAGE_BOUNDARY = 3,
+};
+
+// Mirrors NSProcessInfoThermalState
+enum thermal_state {
+    THERMAL_NOMINAL = 0,
+    THERMAL_FAIR = 1,
+    THERMAL_SERIOUS = 2,
+    THERMAL_CRITICAL = 3,
+};
+
 enum tts_type {
     TTS_UNKNOWN = -1,
     TTS_OUTETTS_V0_2 = 1,
     TTS_OUTETTS_V0_3 = 2,
 };
 
+// Monotonic memory for one request (cactus_arena.cpp): allocation bumps a pointer, nothing is
+// freed on its own and reset() recycles everything at once. The blocks a request needed are
+// coalesced into one, up to retain_bytes, so steady traffic stops reaching malloc. Not thread-safe.
+class cactus_arena {
+public:
+    explicit cactus_arena(size_t retain_bytes = 4 * 1024 * 1024);
+    ~cactus_arena();
+    cactus_arena(const cactus_arena &) = delete;
+    cactus_arena &operator=(const cactus_arena &) = delete;
+
+    void *alloc(size_t size, size_t align = alignof(std::max_align_t));
+    void reset();
+
+    size_t used() const { return used_bytes; }
+    size_t capacity() const;
+    size_t n_mallocs() const { return n_block_allocs; }
+
+private:
+    struct block {
+        char *data;
+        size_t size;
+    };
+    std::vector<block> blocks;
+    size_t offset = 0; // into blocks.back()
+    size_t used_bytes = 0;
+    size_t retain_bytes;
+    size_t n_block_allocs = 0;
+
+    void add_block(size_t size);
+    void free_blocks();
+};
+
+// STL allocator over a cactus_arena, on the heap when there is none
+template <typename T>
+struct cactus_arena_allocator {
+    using value_type = T;
+    // assignment adopts the source's arena, so moved-in elements are never copied across
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    cactus_arena *arena = nullptr;
+
+    cactus_arena_allocator() = default;
+    explicit cactus_arena_allocator(cactus_arena *arena) : arena(arena) {}
+    template <typename U>
+    cactus_arena_allocator(const cactus_arena_allocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_t n) {
+        if (arena != nullptr) {
+            return static_cast<T *>(arena->alloc(n * sizeof(T), alignof(T)));
+        }
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+    void deallocate(T *p, size_t) {
+        if (arena == nullptr) {
+            ::operator delete(p);
+        }
+    }
+    template <typename U>
+    bool operator==(const cactus_arena_allocator<U> &other) const { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const cactus_arena_allocator<U> &other) const { return arena != other.arena; }
+};
+
 struct completion_token_output
 {
     struct token_prob
@@ -45,8 +157,16 @@ struct completion_token_output
         float prob;
     };
 
-    std::vector<token_prob> probs;
+    // in the context's request arena while the probs history is unbounded
+    std::vector<token_prob, cactus_arena_allocator<token_prob>> probs;
     llama_token tok;
+
+    // Raw-distribution statistics when params.sampling.token_stats is set; probs then holds
+    // the top n_probs tokens of that distribution instead of the sampler's candidates
+    bool has_stats = false;
+    float logsumexp = 0.0f;
+    float logprob = 0.0f;
+    float entropy = 0.0f;
 };
 
 struct conversation_result {
@@ -64,20 +184,713 @@ struct cactus_tokenize_result {
     std::vector<size_t> chunk_pos_media;
 };
 
+struct cactus_stop_matcher {
+    struct node {
+        std::map<unsigned char, int> next;
+        int fail = 0;
+        int word = -1;
+        int output = -1;
+        size_t depth = 0;
+    };
+
+    std::vector<node> nodes;
+    std::vector<std::string> patterns;
+    int state = 0;
+    size_t n_consumed = 0;
+    int matched_word = -1;
+
+    void build(const std::vector<std::string> &words);
+    void reset();
+    size_t feed(std::string_view text);
+    size_t partialLength() const;
+    const std::string &matchedWord() const;
+};
+
+struct cactus_tool_call {
+    std::string name;
+    std::string arguments; // JSON text
+    std::string id;
+};
+
+// Pulls tool calls out of streamed text, reading each byte once: a top-level JSON object is
+// parsed only when its closing brace arrives, and kept if it names a function
+struct cactus_tool_call_scanner {
+    int depth = 0;
+    bool in_string = false;
+    bool escaped = false;
+    std::string object;
+    std::vector<cactus_tool_call> calls;
+
+    void reset();
+    // Returns the number of calls text completed
+    size_t feed(std::string_view text);
+};
+
+// An assistant turn that ended in tool calls, kept in the KV cache while the tools run
+// (cactus_tool_turn.cpp). framing[i] is the template text in front of result i, the last entry
+// follows the final result and ends with the generation prompt
+struct cactus_tool_turn {
+    std::vector<std::string> framing;
+    std::vector<std::string> results;   // by call index, filled in any order
+    std::vector<bool> received;
+    size_t n_appended = 0;              // results in embd, a prefix of the calls in index order
+};
+
+// Custom chat templates passed with requests, parsed once: parsing a Jinja template with minja and
+// probing its capabilities costs far more than rendering it. Formatting runs on any thread, so the
+// entries are guarded by mutex and handed out shared, outliving an eviction while they render.
+struct cactus_chat_template_cache {
+    static constexpr size_t max_entries = 4;
+
+    struct entry {
+        std::string source;
+        bool use_jinja = false;
+        std::shared_ptr<common_chat_templates> templates;
+        uint64_t last_use = 0;
+    };
+
+    std::mutex mutex;
+    std::vector<entry> entries;
+    uint64_t n_uses = 0;
+};
+
+struct cactus_completion_candidate {
+    std::string text;
+    std::vector<llama_token> tokens;
+    bool stopped_eos = false;
+    bool stopped_word = false;
+    bool stopped_limit = false;
+    std::string stopping_word;
+};
+
+// Bytes a configuration needs, split into what lives on the GPU backend and what stays on the CPU
+struct cactus_memory_estimate {
+    size_t weights = 0;
+    size_t weights_gpu = 0;
+    size_t kv_cache = 0;
+    size_t kv_cache_gpu = 0;
+    size_t compute = 0;
+    size_t compute_gpu = 0;
+    size_t mmproj = 0;
+    int32_t n_layer = 0;
+    int32_t n_ctx_train = 0;
+
+    size_t total() const { return weights + kv_cache + compute + mmproj; }
+    size_t gpu() const { return weights_gpu + kv_cache_gpu + compute_gpu; }
+};
+
+// Live backend buffer bytes for one category and buffer type ("weights", "kv_cache", "compute",
+// "output", "mmproj", "vocoder", "other"; buffer types such as "Metal" or "CPU")
+struct cactus_buffer_usage {
+    std::string category;
+    std::string buffer_type;
+    size_t current = 0;
+    size_t peak = 0;
+    size_t n_buffers = 0;
+};
+
+// Buffers created while a scope is alive are counted under its category
+struct cactus_memory_scope {
+    const char *prev;
+    explicit cactus_memory_scope(const char *category) : prev(lm_ggml_backend_memory_scope(category)) {}
+    ~cactus_memory_scope() { lm_ggml_backend_memory_scope(prev); }
+    cactus_memory_scope(const cactus_memory_scope &) = delete;
+    cactus_memory_scope &operator=(const cactus_memory_scope &) = delete;
+};
+
+// Graphs the calling thread runs on the shared threadpool while a scope is alive go ahead of
+// background work (projector, vocoder, embeddings) queued on it
+struct cactus_interactive_scope {
+    bool prev;
+    cactus_interactive_scope();
+    ~cactus_interactive_scope();
+    cactus_interactive_scope(const cactus_interactive_scope &) = delete;
+    cactus_interactive_scope &operator=(const cactus_interactive_scope &) = delete;
+};
+
+// True while any thread holds a cactus_interactive_scope; long background jobs wait it out
+bool cactus_interactive_busy();
+
+// Shape and per-layer weight sizes read once from GGUF metadata
+struct cactus_model_profile {
+    int64_t n_layer = 0;
+    int64_t n_embd = 0;
+    int64_t n_head = 1;
+    int64_t n_head_kv = 1;
+    int64_t head_k = 0;
+    int64_t head_v = 0;
+    int64_t n_ff = 0;
+    int64_t n_vocab = 0;
+    int64_t n_ctx_train = 0;
+    int64_t n_swa = 0;          // sliding window of the SWA layers, 0 when every layer attends the whole context
+    int64_t swa_pattern = 1;    // layer il slides when il % swa_pattern < swa_pattern - 1
+    std::vector<size_t> layer_bytes;
+    size_t input_bytes = 0;
+    size_t output_bytes = 0;
+    bool tied_output = false;   // no output.weight, the head reuses token_embd
+};
+
+// What a model catalog shows for a GGUF, read from the key/value section and tensor infos only
+struct cactus_model_metadata {
+    std::string architecture;
+    std::string name;               // general.name
+    std::string quantization;       // type holding most of the weight bytes, e.g. "q4_K"
+    int32_t file_type = -1;         // general.file_type (a llama_ftype), -1 when absent
+    int64_t n_params = 0;
+    int64_t n_ctx_train = 0;
+    int64_t n_embd = 0;
+    int64_t n_layer = 0;
+    int64_t n_vocab = 0;
+    size_t tensor_bytes = 0;
+    std::string chat_template;      // tokenizer.chat_template, empty when the model has none
+};
+
+// Measured per-token decode cost per layer on each backend and the split chosen from it
+struct cactus_layer_placement {
+    int32_t n_gpu_layers = 0;           // for common_params::n_gpu_layers; n_layer + 1 also offloads the output head
+    double decode_ms = 0.0;             // predicted per-token decode latency of the chosen split
+    size_t gpu_bytes = 0;               // estimate_memory(...).gpu() of the chosen split
+    std::vector<double> cpu_layer_ms;
+    std::vector<double> gpu_layer_ms;   // 0 for layers the budget never lets offload, empty without a GPU
+    double cpu_output_ms = 0.0;         // output norm, head and logits copy
+    double gpu_output_ms = 0.0;         // 0 unless the head fits the budget
+};
+
+// One benchmark point; zero / -1 / LM_GGML_TYPE_COUNT keep the loaded context's setting
+struct cactus_bench_config {
+    int32_t pp = 512;
+    int32_t tg = 128;
+    int32_t pl = 1;
+    int32_t nr = 3;
+    int32_t warmup = 1;
+    int32_t n_batch = 0;
+    int32_t n_ubatch = 0;
+    int32_t n_threads = 0;
+    int32_t n_threads_batch = 0;
+    int32_t flash_attn = -1;
+    lm_ggml_type type_k = LM_GGML_TYPE_COUNT;
+    lm_ggml_type type_v = LM_GGML_TYPE_COUNT;
+};
+
+// LoRA fine-tuning over the frozen base weights (cactus_training.cpp). The text is cut into windows of
+// seq_len tokens, one optimizer step each; <output_path>.json records the next window so a stopped run
+// resumes from the last checkpoint
+struct cactus_train_params {
+    std::string output_path;
+    int32_t rank = 8;
+    float alpha = 16.0f;
+    int32_t seq_len = 256;          // rounded down to a multiple of 32
+    int32_t epochs = 1;
+    float learning_rate = 1e-4f;
+    float weight_decay = 0.0f;
+    uint32_t seed = 42;
+    // activations of one micro-batch stay under this many bytes, gradients accumulate over the
+    // micro-batches of a window; 0 runs each window as one micro-batch
+    size_t memory_budget = 0;
+    bool checkpoint_layers = true;  // recompute layer internals in the backward pass
+    lm_ggml_type opt_state_type = LM_GGML_TYPE_BF16;
+    int32_t checkpoint_interval = 16; // windows between adapter saves
+    bool resume = true;
+    // substrings of the weight names to adapt; empty adapts attn_q, attn_output and the FFN
+    std::vector<std::string> target_modules;
+};
+
+struct cactus_train_progress {
+    int32_t epoch = 0;
+    int32_t window = 0;             // windows done in this epoch
+    int32_t n_windows = 0;
+    int32_t n_ubatch = 0;
+    float loss = 0.0f;              // mean over the epoch so far
+};
+
+// Called after each window; returning false stops the run after saving a checkpoint
+typedef std::function<bool(const cactus_train_progress &progress)> cactus_train_callback;
+
+struct cactus_bench_result {
+    cactus_bench_config config; // with every "keep" value resolved
+    int32_t runs = 0;
+    double pp_avg = 0.0;        // tokens/s
+    double pp_std = 0.0;
+    double tg_avg = 0.0;
+    double tg_std = 0.0;
+    double ttft_ms = 0.0;       // prompt of pp tokens until its logits are ready
+    double tg_p50_ms = 0.0;     // per-step decode latency
+    double tg_p95_ms = 0.0;
+    double tg_p99_ms = 0.0;
+    uint64_t peak_memory = 0;   // process footprint, bytes
+    uint64_t peak_buffers = 0;  // backend buffers combined, bytes
+    std::vector<cactus_buffer_usage> buffers; // per-category high-water marks over the run
+};
+
+// Where completion time goes, in microseconds; filled while cactus_context::profiling is set
+struct cactus_completion_profile {
+    int64_t prompt_us = 0;      // sampler setup, tokenization, truncation, prompt cache
+    int64_t prefill_us = 0;     // prompt evaluation
+    int64_t decode_us = 0;      // generation steps
+    int64_t sample_us = 0;
+    int64_t grammar_us = 0;     // sampler/grammar accept and grammar fast-forward
+    int64_t detokenize_us = 0;
+    int64_t stop_us = 0;        // stop-string matching
+    int64_t callback_us = 0;    // time spent in the caller's token callback
+    size_t n_tokens = 0;
+};
+
+// One timed stage; name points at a string literal
+struct cactus_trace_span {
+    const char *name;
+    int64_t start_us;
+    int64_t dur_us;
+};
+
+struct cactus_workload_result {
+    int32_t runs = 0;
+    size_t n_prompts = 0;
+    size_t n_prompt_tokens = 0;
+    size_t n_tokens = 0;
+    double ttft_ms = 0.0;       // mean, prompt loaded until the first token is sampled
+    double tg_avg = 0.0;        // generated tokens/s over all prompts
+    int64_t total_us = 0;
+    cactus_completion_profile profile; // summed over every recorded run
+};
+
+// One request seen by the request recorder (cactus_replay.cpp). With hashed prompts only the length,
+// a hash and the prefix shared with the previous prompt of the sequence are kept, which is enough to
+// replay the same prefill and cache-reuse shape with stand-in tokens.
+struct cactus_request_record {
+    int64_t t_offset_us = 0;            // prompt loaded, since recording started
+    llama_seq_id seq_id = 0;
+    std::vector<llama_token> prompt_tokens; // empty when hashed
+    size_t n_prompt_tokens = 0;
+    size_t n_shared_prefix = 0;
+    uint64_t prompt_hash = 0;
+    size_t n_media_tokens = 0;          // positions of n_prompt_tokens taken by media
+    std::vector<uint64_t> media_bytes;  // file size of each media input
+    common_params_sampling sampling;    // grammar and triggers included
+    std::vector<std::string> antiprompt;
+    int32_t n_predict = -1;
+    size_t n_generated = 0;
+    int64_t duration_us = 0;            // prompt loaded until the completion ended
+};
+
+// Latency distributions of a replayed trace
+struct cactus_replay_result {
+    size_t n_requests = 0;
+    size_t n_prompt_tokens = 0;
+    size_t n_tokens = 0;
+    double ttft_mean_ms = 0.0;          // request start until its first token is sampled
+    double ttft_p50_ms = 0.0;
+    double ttft_p90_ms = 0.0;
+    double ttft_p99_ms = 0.0;
+    double itl_mean_ms = 0.0;           // between consecutive tokens of a request
+    double itl_p50_ms = 0.0;
+    double itl_p90_ms = 0.0;
+    double itl_p99_ms = 0.0;
+    int64_t total_us = 0;
+};
+
+// Per-op totals keyed by op, weight/output type and operand shapes
+struct cactus_op_stats {
+    std::string op;
+    std::string type;
+    std::string shape;
+    int64_t count = 0;
+    int64_t time_us = 0;    // wall time with a backend sync after every node
+    uint64_t bytes = 0;     // operands read plus result written
+    uint64_t flops = 0;     // estimate; 2*K per output for matmuls, one per output element otherwise
+};
+
+// One quantized kernel timed in isolation; "vec_dot" runs the type's dot product over m rows,
+// "gemv" / "gemm" run a repacked-weight MUL_MAT with n activation columns
+struct cactus_kernel_bench_result {
+    std::string kernel;
+    std::string type;
+    int64_t k = 0;          // reduction length
+    int64_t m = 0;          // weight rows
+    int64_t n = 0;          // activation columns
+    int32_t runs = 0;
+    double us = 0.0;        // median per call
+    double gbps = 0.0;
+    double gflops = 0.0;
+    double baseline_gflops = 0.0; // 0 when the baseline has no matching entry
+    bool regressed = false;
+};
+
+enum cactus_vector_type {
+    VECTOR_F32 = 0,
+    VECTOR_I8 = 1,      // symmetric, one scale per vector
+    VECTOR_BINARY = 2,  // sign bits, (dim + 7) / 8 bytes per vector
+};
+
+struct cactus_vector_match {
+    size_t index;
+    float score;        // dot product, or Hamming distance for binary vectors
+};
+
+// Embedding index with add/search/remove keyed by caller ids (cactus_vector_index.cpp). Rows are
+// stored in cactus_vector_type layout; HNSW keeps a navigable graph for large sets, flat scans every
+// row. load() maps the row data from disk read-only and only copies it on the first mutation.
+struct cactus_vector_index {
+    int dim = 0;
+    cactus_vector_type storage = VECTOR_F32;
+    bool hnsw = false;
+    int hnsw_m = 16;
+    int ef_construction = 100;
+
+    cactus_vector_index(int dim, cactus_vector_type storage, bool hnsw, int hnsw_m = 16, int ef_construction = 100);
+    ~cactus_vector_index();
+
+    // Replaces any vector already stored under id
+    void add(size_t id, const float *vec);
+    void add(const size_t *ids, const float *vecs, size_t n);
+    bool remove(size_t id);
+    // Best k live vectors, scored as vector_top_k does; ef widens the HNSW beam (0 = max(k, 64))
+    std::vector<cactus_vector_match> search(const float *query, size_t k, int ef = 0) const;
+    size_t size() const;
+
+    bool save(const std::string &path) const;
+    static std::unique_ptr<cactus_vector_index> load(const std::string &path);
+
+private:
+    struct node {
+        size_t id;
+        float scale;
+        bool deleted;
+        std::vector<std::vector<uint32_t>> links; // one neighbour list per level
+    };
+
+    size_t row_bytes = 0;
+    std::vector<node> nodes;
+    std::unordered_map<size_t, uint32_t> slots;
+    std::vector<uint8_t> rows;
+    const uint8_t *mapped_rows = nullptr;
+    std::unique_ptr<llama_file> file;
+    std::unique_ptr<llama_mmap> mapping;
+    size_t n_live = 0;
+    int64_t entry = -1;
+    int max_level = -1;
+    std::mt19937 rng{42};
+    mutable std::mutex mutex;
+
+    const uint8_t *row(uint32_t slot) const;
+    void own_rows();
+    float prepare(const float *vec, std::vector<uint8_t> &out) const;
+    float distance(const uint8_t *query, float query_scale, uint32_t slot) const;
+    std::vector<std::pair<float, uint32_t>> searchLayer(const uint8_t *query, float query_scale, uint32_t start, size_t ef, int level) const;
+    uint32_t link(uint32_t slot, const uint8_t *query, float query_scale, uint32_t start, int level);
+    void insert(size_t id, const float *vec);
+};
+
+struct embedding_cache_slot;
+struct cactus_vocoder_istft;
+struct cactus_vocoder_workspace;
+struct cactus_speech_worker;
+struct cactus_lora_merge_job;
+
+// Fixed-capacity embedding rows in a memory-mapped file (cactus_embedding_cache.cpp), evicted
+// least recently used first. Keys are content hashes computed by cactus_context::embeddingCacheKey.
+struct cactus_embedding_cache {
+    std::string path;
+    int n_embd = 0;
+    size_t capacity = 0;
+
+    ~cactus_embedding_cache();
+
+    bool open(const std::string &path, int n_embd, size_t capacity);
+    void close();
+    size_t size() const;
+    // Rows may be shorter than n_embd (truncated embeddings); stored rows are zero-padded
+    bool lookup(uint64_t key, uint64_t check, float *out, int n);
+    void store(uint64_t key, uint64_t check, const float *row, int n);
+
+private:
+    int fd = -1;
+    uint8_t *base = nullptr;
+    size_t mapped_size = 0;
+    size_t slot_bytes = 0;
+    std::list<uint32_t> lru;  // slots, least recently used first
+    std::unordered_map<uint64_t, std::pair<uint32_t, std::list<uint32_t>::iterator>> entries;
+    std::vector<uint32_t> free_slots;
+
+    embedding_cache_slot *slot(uint32_t index) const;
+    void touch(uint32_t index);
+};
+
+// Projected image/audio embeddings keyed by bitmap hash and projector (cactus_media_cache.cpp),
+// evicted least recently used past capacity_bytes; entries are also kept as files in dir when set
+struct cactus_media_embd_cache {
+    size_t capacity_bytes = 32u << 20;
+    std::string dir;
+    size_t bytes = 0;
+    size_t n_hits = 0;
+    size_t n_misses = 0;
+
+    // Valid until the next store() or clear()
+    const float *lookup(const std::string &key, size_t n_floats);
+    void store(const std::string &key, const float *embd, size_t n_floats);
+    void clear();
+
+    // Keeps a present entry (loading it from dir if needed) from being evicted until unpinAll(), so
+    // media whose decode was skipped is sure to find its embeddings
+    bool pin(const std::string &key);
+    // True if lookup() would hit, without touching recency or counters; n_floats 0 accepts any size
+    bool contains(const std::string &key, size_t n_floats) const;
+    bool isPinned(const std::string &key) const;
+    void unpinAll();
+
+    // Key of the first chunk an item (hash and projector) was last encoded or found under, empty
+    // when not seen since the cache was cleared
+    void noteItem(const std::string &item, const std::string &key);
+    std::string itemKey(const std::string &item) const;
+
+private:
+    std::list<std::pair<std::string, std::vector<float>>> lru;  // most recently used first
+    std::unordered_map<std::string, std::list<std::pair<std::string, std::vector<float>>>::iterator> entries;
+    std::unordered_set<std::string> pinned;
+    std::unordered_map<std::string, std::string> item_keys;
+
+    std::string filePath(const std::string &key) const;
+    // n_floats 0 accepts any stored size
+    bool loadFile(const std::string &key, size_t n_floats);
+    void insert(const std::string &key, std::vector<float> &&embd);
+};
+
+// LoRA adapters of one model, each loaded once and kept resident (cactus_lora.cpp) so switching
+// the active set only swaps pointers; inactive adapters are evicted least recently used once more
+// than capacity_bytes are resident, the active ones never are
+struct cactus_lora_registry {
+    size_t capacity_bytes = 128u << 20;
+    size_t bytes = 0;
+    size_t n_loads = 0;
+    size_t n_hits = 0;
+    size_t n_evictions = 0;
+    int64_t t_load_us = 0;    // spent reading adapters, in total
+    int64_t t_evict_us = 0;   // spent freeing adapters, in total
+    int64_t t_switch_us = 0;  // the last change of the active set
+
+    ~cactus_lora_registry();
+
+    // Resident adapter for path, loaded on first use; nullptr if it cannot be loaded
+    llama_adapter_lora *acquire(llama_model *model, const std::string &path);
+    // Evicts adapters not in active until capacity_bytes holds
+    void trim(const std::vector<common_adapter_lora_info> &active);
+    // Frees every adapter; none may still be set on a context
+    void clear();
+    size_t size() const { return lru.size(); }
+
+private:
+    struct entry {
+        std::string path;
+        llama_adapter_lora *adapter = nullptr;
+        size_t bytes = 0;
+    };
+    std::list<entry> lru;  // most recently used first
+    std::unordered_map<std::string, std::list<entry>::iterator> entries;
+};
+
+// Radix tree of prompt prefixes kept in the KV cache across sessions (cactus_prefix_cache.cpp).
+// Sequences [first_seq, first_seq + n_seqs) belong to the cache, each holding one entry's tokens at
+// positions 0..n-1; a new prompt forks the longest cached prefix with llama_kv_self_seq_cp, which
+// shares the cells instead of copying them. Entries are evicted least recently used once the tree
+// holds more than capacity_tokens or no sequence is free. A shared cell has one position for every
+// sequence holding it, so a session sequence is given its own copy (unsharePrefixCells) before it shifts.
+struct cactus_prefix_cache {
+    llama_seq_id first_seq = 0;
+    int32_t n_seqs = 0;
+    size_t capacity_tokens = 0;
+    size_t n_tokens = 0;     // tokens on tree edges, shared prefixes counted once
+    size_t n_hits = 0;
+    size_t n_misses = 0;
+    size_t n_reused = 0;     // prompt tokens forked from the cache instead of evaluated
+
+    bool enabled() const { return n_seqs > 0; }
+    bool owns(llama_seq_id seq) const { return n_seqs > 0 && seq >= first_seq && seq < first_seq + n_seqs; }
+
+    void reset(llama_seq_id first_seq_, int32_t n_seqs_, size_t capacity_tokens_);
+    // Length of the longest cached prefix of tokens (0 for none) and a sequence holding it
+    size_t match(const std::vector<llama_token> &tokens, llama_seq_id &seq);
+    // Sequence to fill with tokens[0, n) at positions 0..n-1, -1 when they are already cached or do
+    // not fit. Evicted entries' sequences (and a superseded one that is handed back) are appended to
+    // cleared and must be emptied by the caller first.
+    llama_seq_id insert(const llama_token *tokens, size_t n, std::vector<llama_seq_id> &cleared);
+    void erase(llama_seq_id seq);
+    // Evicts the least recently used entry, -1 when the cache is empty
+    llama_seq_id evictOldest();
+    void clear();
+    // Session sequence seq may share its cells below end with an entry, or with another sequence
+    // forked from one; this outlives the entries themselves
+    void share(llama_seq_id seq, llama_pos end);
+    bool shares(llama_seq_id seq, llama_pos p0) const;
+    void unshare(llama_seq_id seq);
+
+private:
+    struct node {
+        std::vector<llama_token> label;  // edge from parent
+        std::map<llama_token, int32_t> children;
+        int32_t parent = -1;
+        llama_seq_id seq = -1;           // entry ending here
+    };
+    struct entry {
+        int32_t node = -1;
+        uint64_t last_used = 0;
+    };
+
+    std::vector<node> nodes;             // nodes[0] is the root
+    std::vector<int32_t> free_nodes;
+    std::vector<entry> entries;          // by seq - first_seq
+    std::vector<llama_pos> shared_end;   // by session sequence
+    uint64_t tick = 0;
+
+    int32_t newNode(int32_t parent, std::vector<llama_token> label);
+    void freeNode(int32_t index);
+    // Follows tokens down the tree: the node reached and how many of its label's tokens matched
+    size_t walk(const llama_token *tokens, size_t n, int32_t &at, size_t &in_label) const;
+    llama_seq_id newestBelow(int32_t index) const;
+};
+
+// Projector speed/accuracy trade-offs; the defaults keep the model's own precision and resolution
+struct cactus_multimodal_params {
+    bool use_gpu = true;
+    lm_ggml_type weight_type = LM_GGML_TYPE_COUNT; // e.g. LM_GGML_TYPE_Q8_0 to requantize f16 layer weights at load
+    int image_max_side = 0;                        // cap for dynamic-resolution projectors, lowers the image token count
+    int max_slices = 0;                            // cap on the tiles a slicing projector cuts an image into
+};
+
+// What the vocoder pipeline writes to a caller's buffer (cactus_audio.cpp)
+enum cactus_audio_format {
+    CACTUS_AUDIO_F32 = 0, // float PCM
+    CACTUS_AUDIO_S16 = 1, // int16 PCM
+    CACTUS_AUDIO_AAC = 2, // AAC-LC as an ADTS stream, Apple only (cactus_audio.mm)
+};
+
+struct cactus_audio_output {
+    cactus_audio_format format = CACTUS_AUDIO_F32;
+    int sample_rate = 0; // 0 keeps the vocoder's 24 kHz
+    int bitrate = 0;     // AAC bits per second, 0 for the encoder's choice
+};
+
+static const int VOCODER_SAMPLE_RATE = 24000;
+
+// Mono PCM at rate_in converted to output in dst; the size in bytes, or 0 when it failed or needs
+// more than capacity, which audio_output_bound() never does
+size_t encode_audio(const float *pcm, size_t n_samples, int rate_in, const cactus_audio_output &output, void *dst, size_t capacity);
+size_t audio_output_bound(size_t n_samples, int rate_in, const cactus_audio_output &output);
+
+#if defined(__APPLE__)
+// AudioToolbox AAC-LC, ADTS framed; 0 on failure or when capacity is too small
+size_t encode_aac_apple(const float *pcm, size_t n_samples, int sample_rate, int bitrate, uint8_t *dst, size_t capacity);
+#endif
+
+// Receives finished 24 kHz mono PCM while a completion is still generating audio codes, on the
+// vocoding thread; false stops it
+typedef std::function<bool(const float *samples, size_t n_samples)> cactus_speech_callback;
+
+// Progress of a streamed utterance (cactus_tts.cpp). Codes are cut into chunks, each with a few
+// codes of context either side, and queued for a worker thread that vocodes them while generation
+// goes on and hands the chunk's samples to the callback. Dropping the worker discards what is queued.
+struct cactus_speech_stream {
+    size_t chunk_codes = 0;
+    size_t first_code = 0;    // audio_tokens index of the utterance's first code
+    size_t n_vocoded = 0;     // codes whose chunks were queued
+    std::shared_ptr<cactus_speech_worker> worker;
+};
+
+struct cactus_sequence_state {
+    std::vector<llama_token> embd;
+    size_t n_past = 0;
+    size_t stream_cut = 0;
+    uint64_t stream_hash = 0;
+    uint64_t last_active = 0;
+    bool spilled = false;     // KV state is in its spill file instead of the cache
+};
+
+// KV cells a sequence may hold and what it evicts at the limit; reapplied to a recreated context
+struct cactus_kv_quota {
+    uint32_t n_max_cells = 0;
+    uint32_t n_sink = 0;
+    llama_kv_evict_policy policy = LLAMA_KV_EVICT_POLICY_NONE;
+};
+
 struct cactus_context {
     bool is_predicting = false;
-    bool is_interrupted = false;
+    std::atomic<bool> is_interrupted{false};
     bool has_next_token = false;
+
+    // Polled by ggml between graph nodes so cancels and deadlines interrupt a running decode; set it
+    // through setAbortHook so the callback is installed on the contexts only while one is armed.
+    // Multi-token batches always install it, so a bare stop also cuts a long prefill short.
+    std::function<bool()> abort_hook;
+    bool abort_armed = false;
+    bool abort_batch = false;
+    int64_t timeout_ms = 0;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    bool timed_out = false;
     std::string generated_text;
+    size_t text_delta_offset = 0;
+    size_t text_delta_size = 0;
+    cactus_stop_matcher stop_matcher;
+    // Fed the text deltas while tools are offered, so calls surface as soon as they close; with a
+    // lazy tool grammar only once its trigger has fired
+    bool scan_tool_calls = false;
+    cactus_tool_call_scanner tool_scanner;
+    // per sequence, see beginToolTurn
+    std::unordered_map<llama_seq_id, cactus_tool_turn> tool_turns;
+
+    // Text of the last generated token, a view into the vocab's piece cache
+    std::string_view token_piece;
+    // Continuation bytes the end of generated_text still waits for
+    int utf8_pending = 0;
+
+    // Per-request host memory for the token probs of the completion, recycled when the next one
+    // begins; FFI result strings are separate copies the caller frees
+    cactus_arena request_arena;
+
+    // Buffers reused across tokens so steady-state generation does not allocate
+    std::vector<llama_seq_id> batch_seq_ids;
+    size_t n_hot_path_allocs = 0;
     std::vector<completion_token_output> generated_token_probs;
+    size_t probs_history_limit = 0;
+    common_token_stats token_stats;
+
+    bool profiling = false;
+    cactus_completion_profile profile;
+    // Opt-in timeline of the same stages, capped at trace_limit spans per completion
+    bool tracing = false;
+    std::vector<cactus_trace_span> trace_spans;
+    size_t trace_limit = 65536;
+
+    // Request recording, see setRequestRecording
+    bool recording_requests = false;
+    bool recording_hashed = false;
+    bool recording_open = false;        // the last record waits for its completion to end
+    int64_t recording_start_us = 0;
+    size_t request_record_limit = 4096;
+    std::vector<cactus_request_record> request_records;
+    std::unordered_map<llama_seq_id, std::vector<llama_token>> recorded_prompts; // last prompt per sequence
+
+    // Per-op profiling through the scheduler eval callback; see cactus_op_profile.cpp
+    bool op_profiling = false;
+    int64_t op_start_us = 0;
+    std::unordered_map<std::string, cactus_op_stats> op_stats;
+
+    bool lean_sampling = false;
 
     size_t num_prompt_tokens = 0;
+    std::vector<llama_token> pretokenized_prompt; // consumed by loadPromptReusingPrefix instead of params.prompt
+    std::string tokenized_prompt;                 // last prompt passed to tokenizePrompt
+    std::vector<llama_token> tokenized_prompt_tokens; // its tokens, reused for the prefix the next prompt shares with it
     size_t num_tokens_predicted = 0;
     size_t n_past = 0;
     size_t n_remain = 0;
 
     std::vector<llama_token> embd;
+    llama_seq_id seq_id = 0;
+    std::unordered_map<llama_seq_id, cactus_sequence_state> sequence_states;
+    std::unordered_map<llama_seq_id, cactus_kv_quota> kv_quotas;
+    llama_batch batch = {};
     common_params params;
+    // Weights shared with other contexts (see load_shared_model); declared before llama_init so the
+    // llama_context is freed before this reference to the weights is dropped
+    std::shared_ptr<llama_model> shared_model;
     common_init_result llama_init;
 
     llama_model *model = nullptr;
@@ -87,6 +900,7 @@ struct cactus_context {
     llama_context *ctx = nullptr;
     common_sampler *ctx_sampling = nullptr;
     common_chat_templates_ptr templates;
+    mutable cactus_chat_template_cache custom_templates;
 
     int n_ctx;
 
@@ -98,40 +912,187 @@ struct cactus_context {
     bool incomplete = false;
 
     std::vector<common_adapter_lora_info> lora;
+    // adapters applied to one session sequence only, on top of lora; sequences with different
+    // adapters still decode in the same batch
+    std::map<llama_seq_id, std::vector<common_adapter_lora_info>> seq_lora;
+    cactus_lora_registry lora_registry;
+    // Adapter folded into the weights by mergeLoraAdapter, merged in the background while pending
+    llama_adapter_lora_merge *lora_merge = nullptr;
+    common_adapter_lora_info lora_merge_info = {};
+    std::shared_ptr<cactus_lora_merge_job> lora_merge_job;
+    // Control vectors applied to the context, summed with their strengths into control_vector
+    std::vector<common_control_vector_load_info> control_vectors;
+    common_control_vector_data control_vector = { -1, {} };
+    int32_t control_vector_layer_start = -1;
+    int32_t control_vector_layer_end = -1;
+    // unscaled directions of every file applied so far, a switch re-reads nothing
+    std::map<std::string, common_control_vector_data> control_vector_cache;
 
     bool context_full = false;
+    float context_shift_discard = 0.5f;
+    truncation_strategy truncation = TRUNCATE_KEEP_TAIL;
+    llama_token turn_start_token = -1;
+    bool turn_start_token_ready = false;
+    size_t n_cache_shifted = 0;
+    // Attention-sink streaming: prompts keep stream_sink tokens plus the most recent stream_window,
+    // tokens in [stream_sink, stream_cut) stay evicted across turns
+    int32_t stream_sink = 0;
+    int32_t stream_window = 0;
+    size_t stream_cut = 0;
+    uint64_t stream_hash = 0;
     std::vector<llama_token> guide_tokens;
+    size_t guide_cursor = 0;
+    llama_token guide_newline_token = -1;
+    size_t n_forwarded = 0;
     bool next_token_uses_guide_token = true;
 
+    // Thread counts and n_batch are scaled down from these baselines while the device runs hot
+    thermal_state thermal = THERMAL_NOMINAL;
+    int32_t thermal_base_threads = 0;
+    int32_t thermal_base_threads_batch = 0;
+    int32_t thermal_base_n_batch = 0;
+    int64_t thermal_pacing_us = 0;
+    int64_t thermal_paced_us = 0;
+    size_t n_thermal_changes = 0;
+
+    bool grammar_fast_forward = false;
+    llama_grammar *forced_grammar = nullptr;
+    std::vector<llama_token> forced_tokens;
+    size_t forced_cursor = 0;
+    size_t n_grammar_forced = 0;
+
     struct cactus_context_mtmd {
         mtmd_context* mtmd_ctx = nullptr;
+        // vocab-only model the projector tokenizes with when it loaded ahead of the weights
+        std::shared_ptr<llama_model> text_vocab;
     };
     cactus_context_mtmd *mtmd_wrapper = nullptr;
     bool has_multimodal = false;
     std::vector<std::string> mtmd_bitmap_past_hashes;
+    // Media chunks of the last evaluated prompt, positioned in embd, so an unchanged one can be
+    // kept (or shifted) in the KV cache when text around it is edited
+    struct mtmd_chunk_state {
+        std::string key;
+        size_t pos;
+        size_t n_pos;
+    };
+    std::vector<mtmd_chunk_state> mtmd_past_chunks;
+    // Lets an image skip the projector when it recurs at a position the KV cache cannot reuse
+    cactus_media_embd_cache media_embd_cache;
+    std::string mmproj_identity;
+    // Longest image side the projector's preprocessing can use; 0 when it slices the full image
+    int media_decode_max_side = 0;
+    // In-memory audio, passed among media paths as "pcm:<id>"; pushes may come from a capture thread
+    std::map<std::string, mtmd_audio_stream *> audio_streams;
+    std::mutex audio_streams_mutex;
+    int next_audio_stream_id = 0;
 
     struct cactus_context_vocoder {
         common_init_result init_result;
         llama_model *model = nullptr;
         llama_context *ctx = nullptr;
         tts_type type = TTS_UNKNOWN;
+        // FFT plan and window of a vocoder on the CPU, whose graph stops at the spectrum; null when
+        // the graph runs the ISTFT itself
+        std::unique_ptr<cactus_vocoder_istft> istft;
+        // Batch, FFT buffers and DSP workers reused by every vocoding call
+        std::unique_ptr<cactus_vocoder_workspace> workspace;
     };
     cactus_context_vocoder *vocoder_wrapper = nullptr;
     bool has_vocoder = false;
     std::vector<llama_token> audio_tokens;
+    cactus_speech_stream speech_stream;
+
+    // TTS speakers formatted by getFormattedAudioCompletion, with the KV state of the prompt prefix
+    // their words form ahead of the utterance text, once a prefill has evaluated it
+    struct cactus_speaker_profile {
+        std::string audio_text;
+        std::string audio_data;
+        std::vector<llama_token> prefix;
+        std::vector<uint8_t> state;    // llama_state_seq data of prefix alone, empty until taken
+        uint64_t identity = 0;         // stateIdentity() of state
+    };
+    std::map<std::string, cactus_speaker_profile> speaker_profiles;
+    std::string speaker_capture;       // profile whose prefix state the running prefill takes
+    size_t speaker_capture_at = 0;     // n_past at which it is taken, 0 for none
+
+    struct cactus_context_draft {
+        common_init_result init_result;
+        llama_model *model = nullptr;
+        llama_context *ctx = nullptr;
+        common_sampler *sampler = nullptr;
+        llama_batch batch = {};
+        std::vector<llama_token> embd;
+    };
+    cactus_context_draft *draft_wrapper = nullptr;
+    bool has_draft = false;
+    std::vector<llama_token> pending_tokens;
+    int32_t lookup_ngram_size = 0;
+    // interior layers the main model skips to draft for itself (self-speculation), 0 to disable
+    int32_t self_spec_skip_layers = 0;
+    common_sampler *self_spec_sampler = nullptr;
+    size_t n_draft_proposed = 0;
+    size_t n_draft_accepted = 0;
 
     // Conversation management state
     bool conversation_active = false;
     std::string last_chat_template = "";
 
+    bool prompt_cache_pending = false;
+
+    cactus_prefix_cache prefix_cache;
+    bool prefix_cache_pending = false;
+
+    // Idle sequences' KV state moves to files in kv_spill_dir when the cache runs out of cells,
+    // requantized to kv_spill_type (LM_GGML_TYPE_COUNT keeps the cache's own types)
+    std::string kv_spill_dir;
+    lm_ggml_type kv_spill_type = LM_GGML_TYPE_Q8_0;
+    uint64_t sequence_clock = 0;
+
+    double warmup_ms = 0.0;
+
     ~cactus_context();
 
     void rewind();
 
+    bool setActiveSequence(llama_seq_id id);
+
+    void releaseSequence(llama_seq_id id);
+
+    // Up to n_max session sequences other than the active one that hold no session's state, for
+    // branches that are removed again when they finish
+    std::vector<llama_seq_id> idleSequences(int32_t n_max) const;
+
+    // Caps the KV cells of a session sequence; 0 cells removes the cap. Evicted cells are gone for
+    // good, the sequence's token history still covers them.
+    bool setSequenceQuota(llama_seq_id id, uint32_t n_max_cells, llama_kv_evict_policy policy, uint32_t n_sink);
+
     bool initSampling();
 
     bool loadModel(common_params &params_);
 
+    // Creates only the llama_context (KV cache, compute buffers) over already loaded weights; LoRA
+    // adapters in params are not applied, use applyLoraAdapters
+    bool loadModel(common_params &params_, std::shared_ptr<llama_model> weights);
+
+    // One cold start for the model and its companions: the projector (against a vocab-only copy of
+    // the model, all it uses the text model for) and the vocoder load on their own threads while the
+    // weights are read. Progress is the loaded fraction of the three files' bytes, called from any
+    // of the loading threads. Empty paths are skipped; false when any part fails, in which case
+    // no companion is attached.
+    bool loadModelWithComponents(common_params &params_, const std::string &mmproj_path,
+                                 const cactus_multimodal_params &mm_params, const std::string &vocoder_path,
+                                 const std::function<void(float)> &progress);
+
+    // Moves weights loaded by loadModel(params) into shared ownership so further contexts, e.g. an
+    // embedding context next to this chat one, can be created on them without reading the GGUF again;
+    // null while a LoRA adapter is merged into them
+    std::shared_ptr<llama_model> shareWeights();
+
+    bool initLoadedContext();
+
+    void warmUp();
+
     bool validateModelChatTemplate(bool use_jinja, const char *name) const;
 
     common_chat_params getFormattedChatWithJinja(
@@ -147,28 +1108,204 @@ struct cactus_context {
       const std::string &messages,
       const std::string &chat_template
     ) const;
+
+    // Same as above for callers that already hold the messages, skipping the JSON round-trip
+    common_chat_params getFormattedChatWithJinja(
+      std::vector<common_chat_msg> messages,
+      const std::string &chat_template,
+      const std::string &json_schema,
+      const std::string &tools,
+      const bool &parallel_tool_calls,
+      const std::string &tool_choice
+    ) const;
+
+    std::string getFormattedChat(
+      std::vector<common_chat_msg> messages,
+      const std::string &chat_template
+    ) const;
+
+    std::shared_ptr<const common_chat_templates> customChatTemplates(const std::string &chat_template, bool use_jinja) const;
+
+    bool formatChatSpans(
+      const std::vector<common_chat_msg> &messages,
+      size_t n_cached,
+      std::vector<std::string> &spans,
+      std::string &generation_prompt
+    ) const;
     
     void truncatePrompt(std::vector<llama_token> &prompt_tokens);
 
+    llama_token turnStartToken();
+
+    size_t reuseShiftedCache(const std::vector<llama_token> &prompt_tokens, size_t n_prefix);
+
+    void streamPrompt(std::vector<llama_token> &prompt_tokens);
+
     void loadPrompt();
 
     void loadPrompt(const std::vector<std::string> &media_paths);
 
+    void loadPromptReusingPrefix();
+
+    uint64_t stateIdentity() const;
+
+    std::string promptCacheFile() const;
+
+    size_t restorePromptCache(const std::vector<llama_token> &prompt_tokens);
+
+    bool savePromptCache();
+
+    // Reserves the top n_seqs sequences for prompt prefixes shared across sessions, holding up to
+    // capacity_tokens (0 for half of n_ctx); 0 sequences disables it. Prompts decoded with a LoRA
+    // adapter set or merged neither use nor fill it
+    bool setPrefixCache(int32_t n_seqs, size_t capacity_tokens);
+
+    // Sequences below the prefix cache's, free for sessions and parallel branches
+    int32_t sessionSequences() const;
+
+    size_t reusePrefixCache(const std::vector<llama_token> &prompt_tokens, size_t n_reuse);
+
+    void storePrefixCache();
+
+    bool evictPrefixCache();
+
+    void clearPrefixCache();
+
+    // Re-creates the active sequence's cells from a copy when cells from p0 on may be shared with
+    // the prefix cache, so a later seq_add moves only this sequence. False when the copy could not
+    // be restored and the sequence was cleared (n_past is 0 and the prompt must be evaluated again).
+    bool unsharePrefixCells(llama_pos p0);
+
+    // An empty dir disables spilling; files already spilled are dropped
+    bool setKVSpill(const std::string &dir, lm_ggml_type type);
+
+    std::string kvSpillFile(llama_seq_id id) const;
+
+    bool spillSequence(llama_seq_id id);
+
+    bool unspillSequence(llama_seq_id id);
+
+    void dropSpill(llama_seq_id id);
+
+    bool spillColdestSequence();
+
+    size_t spillIdleSequences();
+
+    // Forgets every sequence whose KV state lives in the cache, keeping the spilled ones
+    void dropResidentSequences();
+
+    bool relieveKVCache();
+
+    bool saveSequenceSnapshot(llama_seq_id id, std::vector<uint8_t> &out);
+
+    bool restoreSequenceSnapshot(llama_seq_id id, const uint8_t *data, size_t size);
+
     void setGuideTokens(const std::vector<llama_token> &tokens);
+
+    bool hasGuideTokens() const;
    
     void beginCompletion();
 
     void endCompletion();
+
+    bool shouldAbort();
+
+    void setAbortHook(std::function<bool()> hook);
+
+    void armAbortCallback();
+
+    void armAbortForBatch(int n_tokens);
     
+    void shiftContext();
+
+    bool prefillStep(int32_t budget);
+
+    float prefillProgress() const;
+
     completion_token_output nextToken();
    
     size_t findStoppingStrings(const std::string &text, const size_t last_token_size, const stop_type type);
    
+    bool canSampleLean() const;
+    void configureLeanSampling();
+    llama_token sampleLean();
+
+    void reserveGenerationBuffers();
+
     completion_token_output doCompletion();
+
+    // Up to n candidates, one per sequence: the active one and the idle ones
+    std::vector<cactus_completion_candidate> doCompletionN(int n);
+
+    std::string_view lastTextDelta() const;
    
-    std::vector<float> getEmbedding(common_params &embd_params);
+    // Null unless setEmbeddingCache() opened one; the counters cover the context's lifetime
+    std::unique_ptr<cactus_embedding_cache> embedding_cache;
+    size_t n_embd_cache_hits = 0;
+    size_t n_embd_cache_misses = 0;
+
+    // Opens <dir>/cactus-embed-<hash>.bin for the loaded model; an empty dir or 0 capacity disables it
+    bool setEmbeddingCache(const std::string &dir, size_t capacity);
+
+    void embeddingCacheKey(const std::string &text, int dims, uint64_t &key, uint64_t &check) const;
+
+    // Row width for a requested dims: the leading dims of a Matryoshka model, n_embd when 0 or too large
+    int embeddingDims(int dims) const;
+
+    // dims > 0 keeps only the leading dims, truncated before normalization
+    std::vector<float> getEmbedding(const std::string &text, int dims = 0);
+    // One row of embeddingDims(dims) floats per text. Texts are bucketed by token length into ubatches
+    // of up to n_seq_max sequences; on_row sees each finished row in input order. Clears every sequence.
+    bool getEmbeddings(const std::vector<std::string> &texts, std::vector<float> &out,
+                       const std::function<void(size_t index, const float *row)> &on_row = nullptr, int dims = 0);
+    // Relevance of each document to the query from a reranker loaded with rank pooling, in input order.
+    // Pairs share the tokenized query and are packed like getEmbeddings, so up to n_seq_max pairs
+    // score in one ubatch. Clears every sequence.
+    bool getRerankScores(const std::string &query, const std::vector<std::string> &documents, std::vector<float> &scores);
     
     std::string bench(int pp, int tg, int pl, int nr);
+
+    bool runBench(const cactus_bench_config &config, cactus_bench_result &result);
+
+    std::vector<cactus_bench_result> benchSuite(const std::vector<cactus_bench_config> &configs,
+                                                const std::function<void(size_t)> &on_config_done = nullptr);
+
+    bool stageTimed() const { return profiling || tracing; }
+
+    int64_t recordStage(int64_t &total_us, const char *name, int64_t start_us);
+
+    std::string traceJSON() const;
+
+    void setOpProfiling(bool enabled);
+
+    void recordOp(const struct lm_ggml_tensor *node, int64_t time_us);
+
+    std::vector<cactus_op_stats> opProfile() const;
+
+    bool runWorkloadBench(const std::vector<std::string> &prompts, int32_t nr, cactus_workload_result &result,
+                          const std::function<void(const completion_token_output &)> &on_token = nullptr);
+
+    // Records the shape of every request loaded from now on: prompt tokens (or their hash with
+    // hash_prompts), media sizes, sampling, grammar and stop strings, and their timing. Enabling
+    // starts a new trace; at most request_record_limit requests are kept.
+    void setRequestRecording(bool enabled, bool hash_prompts = false);
+    void recordRequest(const std::vector<std::string> &media_paths);
+    // Drives records through the regular completion path on their sequences, each generating as many
+    // tokens as it did when recorded (only the prompt for an unlimited one that generated none).
+    // honor_timing waits out the recorded gaps between requests.
+    bool replayRequests(const std::vector<cactus_request_record> &records, bool honor_timing, cactus_replay_result &result);
+
+    void setThreads(int32_t n_threads, int32_t n_threads_batch);
+
+    bool tuneThreads(const std::vector<int32_t> &candidates, int32_t &n_threads, int32_t &n_threads_batch);
+
+    // Sweeps n_ubatch over candidates for prefill, skipping sizes whose backend buffers exceed
+    // memory_cap (0 for no cap), and recreates the context with the fastest one
+    bool tuneBatchSize(const std::vector<int32_t> &candidates, size_t memory_cap, int32_t &n_batch, int32_t &n_ubatch);
+
+    void applyThermalState(thermal_state state, bool allow_kv_compaction);
+
+    void thermalPace();
    
     int applyLoraAdapters(std::vector<common_adapter_lora_info> lora);
    
@@ -176,45 +1313,175 @@ struct cactus_context {
     
     std::vector<common_adapter_lora_info> getLoadedLoraAdapters();
 
+    // Adapters for sequence id only, loaded through the registry like applyLoraAdapters; an empty
+    // list removes them. Returns 0 on success, -1 if an adapter cannot be loaded.
+    int setSequenceLoraAdapters(llama_seq_id id, std::vector<common_adapter_lora_info> lora);
+
+    // Bytes of inactive adapters kept resident for later switches; 0 keeps only the active ones
+    void setLoraCacheCapacity(size_t capacity_bytes);
+
+    // Evicts from the registry past its capacity, sparing adapters set on the context or a sequence
+    void trimLoraAdapters();
+
+    // Folds one adapter into the base weights for decode at base-model speed. In the background the
+    // adapter is applied as usual until its merged weights are ready, they are swapped in by the
+    // next rewind(). Fails on weights shared with other contexts, whose decodes would race the swap.
+    // Returns 0 on success.
+    int mergeLoraAdapter(const std::string &path, float scale, bool background);
+    // Swaps the merged weights in once a background merge is done, true when applied
+    bool finishLoraMerge();
+    // Restores the original weights (a pointer swap) and frees the merged copies; a background merge
+    // still running is cancelled and its adapter removed
+    void unmergeLoraAdapter();
+
+    // Trains a LoRA adapter on texts in a context of its own next to this one, written to
+    // params.output_path for applyLoraAdapters. Waits while interactive work runs. Returns 0 when every
+    // epoch is done, 1 when the callback or is_interrupted stopped it (resumable), -1 on failure.
+    int trainLoraAdapter(const std::vector<std::string> &texts, const cactus_train_params &train_params,
+                         const cactus_train_callback &callback);
+
+    // Sums the control vectors, each scaled by its strength, into the per-layer directions added to
+    // the residual stream of layers il_start..il_end (all but layer 0 when <= 0). Files are parsed
+    // once; switching vectors or strengths keeps the compute graph. Returns 0 on success.
+    int applyControlVectors(const std::vector<common_control_vector_load_info> &vectors, int32_t il_start, int32_t il_end);
+    void removeControlVectors();
+
+    // After a completion that stopped on its end of turn with tool calls, keeps the generated turn
+    // in the active sequence and queues the template framing of the first result, rendered with
+    // placeholders from the messages the prompt was made of. prefillStep() evaluates it while the
+    // tools run; false (nothing changed) when the template output cannot be split that way.
+    bool beginToolTurn(std::vector<common_chat_msg> messages, const std::string &tools);
+    // Queues result index of the active sequence's tool turn, and every later one already received,
+    // behind the framing; results evaluate in call order whatever order they arrive in
+    bool addToolResult(size_t index, const std::string &content);
+    // Every result queued: embd is the prompt of the next completion, framing included
+    bool toolTurnReady() const;
+    void endToolTurn();
+
+    // With media the result is a count: each item's tokens are sized from its header (image dimensions,
+    // audio length) and the projector's configuration, nothing is decoded or preprocessed
     cactus_tokenize_result tokenize(const std::string &text, const std::vector<std::string> &media_paths);
+    cactus_tokenize_result tokenizeMediaSizes(const std::string &prompt, const std::vector<std::string> &media_paths);
+    std::vector<llama_token> tokenizePrompt(const std::string &prompt);
 
     bool initMultimodal(const std::string &mmproj_path, bool use_gpu);
+    bool initMultimodal(const std::string &mmproj_path, const cactus_multimodal_params &mm_params);
+    static mtmd_context *loadProjector(const std::string &mmproj_path, const llama_model *text_model,
+                                       const cactus_multimodal_params &mm_params, const cpu_params &cpuparams);
+    void attachProjector(mtmd_context *mtmd_ctx, const std::string &mmproj_path, const cactus_multimodal_params &mm_params,
+                         std::shared_ptr<llama_model> text_vocab);
     bool isMultimodalEnabled() const;
     bool isMultimodalSupportVision() const;
     bool isMultimodalSupportAudio() const;
     void releaseMultimodal();
     void processMedia(const std::string &prompt, const std::vector<std::string> &media_paths);
+    // 0 capacity disables the cache; an empty dir keeps it in memory only
+    void setMediaEmbeddingCache(size_t capacity_bytes, const std::string &dir);
+    // 16 kHz mono float PCM; the returned reference works as a media path until released, and a
+    // stream's spectrogram is computed as samples are pushed. Empty reference on failure.
+    std::string addAudio(const float *samples, size_t n_samples);
+    std::string beginAudioStream();
+    bool pushAudio(const std::string &ref, const float *samples, size_t n_samples);
+    void releaseAudio(const std::string &ref);
+    mtmd_bitmap *audioStreamBitmap(const std::string &ref);
 
     bool initVocoder(const std::string &vocoder_model_path);
+    static cactus_context_vocoder *loadVocoder(const common_params &base, const std::string &vocoder_model_path);
+    void attachVocoder(cactus_context_vocoder *wrapper);
     bool isVocoderEnabled() const;
     tts_type getTTSType() const;
     std::string getFormattedAudioCompletion(const std::string &speaker_json_str, const std::string &text_to_speak);
     std::vector<llama_token> getAudioCompletionGuideTokens(const std::string &text_to_speak);
     std::vector<float> decodeAudioTokens(const std::vector<llama_token> &tokens);
+    // Vocodes straight into dst in the requested format; bytes written, 0 on failure
+    size_t decodeAudioTokens(const std::vector<llama_token> &tokens, const cactus_audio_output &output, void *dst, size_t capacity);
+    size_t audioOutputBound(size_t n_tokens, const cactus_audio_output &output) const;
+    const float *vocodeAudioTokens(const std::vector<llama_token> &tokens, size_t &n_samples);
+    // Generates each sentence of text on its own sequence forked from the speaker prefix, up to
+    // n_parallel at once (0 for every free sequence) in shared batches, and joins their audio in order
+    std::vector<float> synthesizeSpeech(const std::string &speaker_json_str, const std::string &text, int n_parallel);
+    cactus_speaker_profile *speakerProfile(const std::string &speaker_json_str);
+    std::string speakerPrefixFile(const std::string &key) const;
+    size_t restoreSpeakerPrefix(const std::vector<llama_token> &prompt_tokens, size_t n_reuse);
+    void captureSpeakerPrefix();
+    // Vocodes the audio codes of the running completion every chunk_codes codes (0 for the default)
+    // instead of after it, concurrently with generation; finishSpeechStream() vocodes the rest and
+    // returns once every sample was handed out
+    bool beginSpeechStream(int chunk_codes, const cactus_speech_callback &callback);
+    void finishSpeechStream();
+    bool vocodeSpeechStream(bool final);
     void releaseVocoder();
+
+    bool recreateContext();
+    bool compactKVCache();
+    // Runs the whole KV defrag now instead of in steps across decodes; for idle time
+    bool defragKVCache();
+    // Gives back the compute memory a prefill grew beyond the decode graph; bytes freed
+    size_t shrinkComputeBuffers();
+    void releaseComputeContext();
+    bool restoreComputeContext();
+
+    bool initDraftModel(const std::string &draft_model_path);
+    bool isDraftEnabled() const;
+    void releaseDraftModel();
+    bool canSpeculate() const;
+    std::vector<llama_token> draftTokens(int n_max);
+    std::vector<llama_token> lookupTokens(int n_max) const;
+    // Drafts on the main sequence with self_spec_skip_layers left out, then drops the drafted cells
+    std::vector<llama_token> selfDraftTokens(int n_max);
+    bool speculativeStep();
+    completion_token_output nextPendingToken();
+    void discardPendingTokens();
+    // Drops the main sequence from position p on, n_past follows to where a recurrent state resumed
+    void rollbackSequence(size_t p);
+
+    void initForcedGrammar();
+    void releaseForcedGrammar();
+    void acceptForcedGrammar(llama_token token);
+    // A lazy grammar tracked for fast-forward whose trigger has not fired yet
+    bool awaitingGrammarTrigger() const;
+    size_t queueForcedTokens();
+    completion_token_output nextForcedToken();
 };
 
 extern bool cactus_verbose;
 
-#if CACTUS_VERBOSE != 1
-#define LOG_VERBOSE(MSG, ...)
+// Call sites below CACTUS_LOG_LEVEL compile out, arguments included:
+// 0 verbose, 1 info, 2 warning, 3 error, 4 nothing
+#ifndef CACTUS_LOG_LEVEL
+#if CACTUS_VERBOSE == 1
+#define CACTUS_LOG_LEVEL 0
 #else
-#define LOG_VERBOSE(MSG, ...)                                       \
-    do                                                              \
-    {                                                               \
-        if (cactus_verbose)                                        \
-        {                                                           \
-            log("VERBOSE", __func__, __LINE__, MSG, ##__VA_ARGS__); \
-        }                                                           \
-    } while (0)
+#define CACTUS_LOG_LEVEL 1
 #endif
+#endif
+
+// if (0) keeps the arguments type-checked and referenced; the call itself is never emitted
+#define CACTUS_LOG_AT(LEVEL, NAME, MSG, ...)                            \
+    do                                                                  \
+    {                                                                   \
+        if ((LEVEL) >= CACTUS_LOG_LEVEL)                                \
+        {                                                               \
+            log(NAME, __func__, __LINE__, MSG, ##__VA_ARGS__);          \
+        }                                                               \
+    } while (0)
+
+#define LOG_VERBOSE(MSG, ...)                                           \
+    do                                                                  \
+    {                                                                   \
+        if (0 >= CACTUS_LOG_LEVEL && cactus_verbose)                    \
+        {                                                               \
+            log("VERBOSE", __func__, __LINE__, MSG, ##__VA_ARGS__);     \
+        }                                                               \
+    } while (0)
 
-#define LOG_ERROR(MSG, ...) log("ERROR", __func__, __LINE__, MSG, ##__VA_ARGS__)
+#define LOG_ERROR(MSG, ...) CACTUS_LOG_AT(3, "ERROR", MSG, ##__VA_ARGS__)
 
-#define LOG_WARNING(MSG, ...) log("WARNING", __func__, __LINE__, MSG, ##__VA_ARGS__)
+#define LOG_WARNING(MSG, ...) CACTUS_LOG_AT(2, "WARNING", MSG, ##__VA_ARGS__)
 
-#define LOG_INFO(MSG, ...) log("INFO", __func__, __LINE__, MSG, ##__VA_ARGS__)
+#define LOG_INFO(MSG, ...) CACTUS_LOG_AT(1, "INFO", MSG, ##__VA_ARGS__)
 
+// Hands the line to the common_log worker, which writes it off the calling thread
 void log(const char *level, const char *function, int line, const char *format, ...);
 
 void llama_batch_clear(llama_batch *batch);
@@ -227,6 +1494,71 @@ bool ends_with(const std::string &str, const std::string &suffix);
 
 size_t find_partial_stop_string(const std::string &stop, const std::string &text);
 
+bool cactus_abort_callback(void *data);
+
+bool read_model_profile(const std::string &model_path, cactus_model_profile &out);
+
+cactus_memory_estimate estimate_memory(const cactus_model_profile &profile, const common_params &params);
+
+// No weights are read, so this costs a few pages of the file instead of a model load
+bool read_model_metadata(const std::string &model_path, cactus_model_metadata &out);
+
+bool estimate_memory(const std::string &model_path, const common_params &params, const std::string &mmproj_path, cactus_memory_estimate &out);
+
+// Loads the model all on the CPU and fully offloaded, times single-token decodes per layer through
+// the scheduler's eval callback and picks the split with the lowest predicted decode latency whose
+// GPU estimate fits gpu_budget (0 for the GPU device's free memory). Layers are offloaded from the
+// top as llama.cpp does; keep_tied_output_on_cpu never offloads a head that shares token_embd.
+bool plan_layer_placement(const common_params &params, size_t gpu_budget, bool keep_tied_output_on_cpu, cactus_layer_placement &out);
+
+// Loads the weights once for any number of contexts; each context keeps them alive. Contexts
+// on one model may run on different threads, but a single context must not be used concurrently.
+std::shared_ptr<llama_model> load_shared_model(common_params &params);
+// Reads only the GGUF metadata and builds the vocabulary (and chat template metadata): no weights
+// are mapped and no backend is created, for tokenizing and counting without a loaded model
+std::shared_ptr<llama_model> load_vocab_only(const std::string &path);
+
+// Process-wide, covering every loaded model, projector and vocoder
+std::vector<cactus_buffer_usage> buffer_memory_usage(size_t *peak_total = nullptr);
+
+// One CPU threadpool for every context, projector and vocoder in the process (cactus_threadpool.cpp),
+// so work running at the same time queues up instead of oversubscribing the cores. Created on first
+// use with the first caller's priority and polling; nullptr if it could not be created.
+lm_ggml_threadpool_t shared_threadpool(const cpu_params &params);
+
+void attach_shared_threadpool(llama_context *ctx, const cpu_params &params);
+
+// Embedding storage and similarity (cactus_vector.cpp); returns the scale, x ~= scale * out
+float quantize_embedding_i8(const float *x, int n, int8_t *out);
+
+void quantize_embedding_binary(const float *x, int n, uint8_t *out);
+
+float vec_dot_f32(const float *a, const float *b, int n);
+
+float vec_cosine_f32(const float *a, const float *b, int n);
+
+int32_t vec_dot_i8(const int8_t *a, const int8_t *b, int n);
+
+int32_t vec_hamming(const uint8_t *a, const uint8_t *b, int n_bytes);
+
+// Best k of n_rows contiguous vectors; scales are per-row int8 scales and may be null
+std::vector<cactus_vector_match> vector_top_k(cactus_vector_type type, const void *query, const void *rows,
+                                              const float *scales, size_t n_rows, int dim, size_t k);
+
+std::vector<cactus_kernel_bench_result> kernel_bench(int32_t n_threads, int32_t nr);
+
+// Marks results whose GFLOP/s fell more than tolerance (a fraction) below the baseline, which is
+// JSON previously produced by kernel_bench_json; returns false when any kernel regressed
+bool kernel_bench_compare(std::vector<cactus_kernel_bench_result> &results, const std::string &baseline_json, double tolerance);
+
+std::string kernel_bench_json(const std::vector<cactus_kernel_bench_result> &results);
+
+// Request traces as JSON, so a trace recorded with one build replays on another
+std::string request_trace_json(const std::vector<cactus_request_record> &records);
+// Fields missing from the JSON keep the values of base
+bool parse_request_trace(const std::string &json, const common_params_sampling &base, std::vector<cactus_request_record> &records);
+std::string replay_result_json(const cactus_replay_result &result);
+
 } // namespace cactus
 
 #endif /* CACTUS_H */
\ No newline at end of file
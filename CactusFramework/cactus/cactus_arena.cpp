@@ -0,0 +1,71 @@
+#include "cactus.h"
+#include <algorithm>
+#include <cstdlib>
+
+namespace cactus {
+
+static const size_t ARENA_MIN_BLOCK = 64 * 1024;
+
+cactus_arena::cactus_arena(size_t retain_bytes) : retain_bytes(retain_bytes) {}
+
+cactus_arena::~cactus_arena() {
+    free_blocks();
+}
+
+void cactus_arena::add_block(size_t size) {
+    char *data = static_cast<char *>(std::malloc(size));
+    if (data == nullptr) {
+        throw std::bad_alloc();
+    }
+    blocks.push_back({data, size});
+    offset = 0;
+    n_block_allocs++;
+}
+
+void cactus_arena::free_blocks() {
+    for (const block &b : blocks) {
+        std::free(b.data);
+    }
+    blocks.clear();
+    offset = 0;
+}
+
+void *cactus_arena::alloc(size_t size, size_t align) {
+    size = std::max<size_t>(size, 1);
+    if (!blocks.empty()) {
+        const block &b = blocks.back();
+        const size_t start = (((uintptr_t)b.data + offset + align - 1) & ~(uintptr_t)(align - 1)) - (uintptr_t)b.data;
+        if (start + size <= b.size) {
+            offset = start + size;
+            used_bytes += size;
+            return b.data + start;
+        }
+    }
+    // doubling keeps the number of blocks per request logarithmic
+    add_block(std::max({ARENA_MIN_BLOCK, size + align, blocks.empty() ? (size_t)0 : blocks.back().size * 2}));
+    return alloc(size, align);
+}
+
+void cactus_arena::reset() {
+    used_bytes = 0;
+    offset = 0;
+    if (blocks.size() <= 1 && capacity() <= retain_bytes) {
+        return;
+    }
+    // the next request of the same size fits in a single block
+    const size_t total = std::min(capacity(), retain_bytes);
+    free_blocks();
+    if (total >= ARENA_MIN_BLOCK) {
+        add_block(total);
+    }
+}
+
+size_t cactus_arena::capacity() const {
+    size_t total = 0;
+    for (const block &b : blocks) {
+        total += b.size;
+    }
+    return total;
+}
+
+} // namespace cactus
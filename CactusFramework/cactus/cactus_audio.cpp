@@ -0,0 +1,164 @@
+#include "cactus.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+
+namespace cactus {
+
+static const int AUDIO_RESAMPLE_HALF_ZEROS = 16;   // sinc zero crossings either side of a tap row
+static const float AUDIO_RESAMPLE_ROLLOFF = 0.94f; // passband edge as a fraction of the lower Nyquist
+static const int AUDIO_RESAMPLE_MAX_PHASES = 4096;
+static const size_t AAC_FRAME_SAMPLES = 1024;
+static const size_t AAC_MAX_PACKET_BYTES = 768 + 7; // 6144 bits per channel plus the ADTS header
+
+// Windowed-sinc polyphase filter for rate_out / rate_in == up / down in lowest terms: one row of
+// n_taps per output phase, each normalised to unit gain at DC
+struct polyphase_filter {
+    int up = 1;
+    int down = 1;
+    int n_taps = 0;
+    std::vector<float> taps;
+};
+
+static bool make_polyphase_filter(int rate_in, int rate_out, polyphase_filter &f) {
+    const int g = std::gcd(rate_in, rate_out);
+    f.up = rate_out / g;
+    f.down = rate_in / g;
+    if (f.up > AUDIO_RESAMPLE_MAX_PHASES) {
+        return false;
+    }
+    const double scale = std::min(1.0, (double)f.up / f.down);
+    const double fc = scale * AUDIO_RESAMPLE_ROLLOFF;
+    const int half = (int)std::ceil(AUDIO_RESAMPLE_HALF_ZEROS / scale);
+    f.n_taps = 2 * half;
+    f.taps.resize((size_t)f.up * f.n_taps);
+    for (int p = 0; p < f.up; p++) {
+        float *row = f.taps.data() + (size_t)p * f.n_taps;
+        const double frac = (double)p / f.up;
+        double sum = 0.0;
+        for (int k = 0; k < f.n_taps; k++) {
+            // Tap k weighs input sample n - half + 1 + k for an output at n + frac
+            const double d = (k - half + 1) - frac;
+            const double x = M_PI * fc * d;
+            const double sinc = std::fabs(x) < 1e-9 ? 1.0 : std::sin(x) / x;
+            const double w = 0.5 * (d + half) / half; // Blackman over (-half, half)
+            const double window = 0.42 - 0.5 * std::cos(2.0 * M_PI * w) + 0.08 * std::cos(4.0 * M_PI * w);
+            row[k] = (float)(sinc * window);
+            sum += row[k];
+        }
+        for (int k = 0; k < f.n_taps; k++) {
+            row[k] = (float)(row[k] / sum);
+        }
+    }
+    return true;
+}
+
+static size_t resampled_size(size_t n_samples, int up, int down) {
+    return (n_samples * up + down - 1) / down;
+}
+
+// Hands every output sample to store(index, value) so it lands in its final format without a
+// float staging buffer; samples beyond the input count as silence
+template <typename Store>
+static void resample(const float *pcm, size_t n_samples, const polyphase_filter &f, Store store) {
+    const size_t n_out = resampled_size(n_samples, f.up, f.down);
+    const int half = f.n_taps / 2;
+    for (size_t j = 0; j < n_out; j++) {
+        const size_t pos = j * f.down;
+        const int64_t n = (int64_t)(pos / f.up);
+        const float *row = f.taps.data() + (pos % f.up) * f.n_taps;
+        const int64_t first = n - half + 1;
+        const int k_begin = (int)std::max<int64_t>(0, -first);
+        const int k_end = (int)std::min<int64_t>(f.n_taps, (int64_t)n_samples - first);
+        float acc = 0.0f;
+        for (int k = k_begin; k < k_end; k++) {
+            acc += row[k] * pcm[first + k];
+        }
+        store(j, acc);
+    }
+}
+
+static int16_t to_s16(float x) {
+    return (int16_t)std::lrintf(std::min(1.0f, std::max(-1.0f, x)) * 32767.0f);
+}
+
+static bool valid_output_rate(int rate) {
+    return rate >= 8000 && rate <= 192000;
+}
+
+size_t audio_output_bound(size_t n_samples, int rate_in, const cactus_audio_output &output) {
+    const int rate_out = output.sample_rate > 0 ? output.sample_rate : rate_in;
+    const int g = std::gcd(rate_in, rate_out);
+    const size_t n_out = rate_out == rate_in ? n_samples : resampled_size(n_samples, rate_out / g, rate_in / g);
+    switch (output.format) {
+        case CACTUS_AUDIO_F32:
+            return n_out * sizeof(float);
+        case CACTUS_AUDIO_S16:
+            return n_out * sizeof(int16_t);
+        case CACTUS_AUDIO_AAC:
+            // Encoder priming and the flushed tail add up to a few frames
+            return ((n_out + AAC_FRAME_SAMPLES - 1) / AAC_FRAME_SAMPLES + 3) * AAC_MAX_PACKET_BYTES;
+    }
+    return 0;
+}
+
+size_t encode_audio(const float *pcm, size_t n_samples, int rate_in, const cactus_audio_output &output, void *dst, size_t capacity) {
+    const int rate_out = output.sample_rate > 0 ? output.sample_rate : rate_in;
+    if (!pcm || n_samples == 0 || !dst || rate_in <= 0 || !valid_output_rate(rate_out)) {
+        LOG_ERROR("Unsupported audio output: %d Hz", rate_out);
+        return 0;
+    }
+    polyphase_filter filter;
+    if (rate_out != rate_in && !make_polyphase_filter(rate_in, rate_out, filter)) {
+        LOG_ERROR("Unsupported resampling ratio: %d Hz to %d Hz", rate_in, rate_out);
+        return 0;
+    }
+    const size_t n_out = rate_out == rate_in ? n_samples : resampled_size(n_samples, filter.up, filter.down);
+
+    switch (output.format) {
+        case CACTUS_AUDIO_F32: {
+            if (n_out * sizeof(float) > capacity) {
+                return 0;
+            }
+            float *out = static_cast<float *>(dst);
+            if (rate_out == rate_in) {
+                memcpy(out, pcm, n_out * sizeof(float));
+            } else {
+                resample(pcm, n_samples, filter, [out](size_t j, float v) { out[j] = v; });
+            }
+            return n_out * sizeof(float);
+        }
+        case CACTUS_AUDIO_S16: {
+            if (n_out * sizeof(int16_t) > capacity) {
+                return 0;
+            }
+            int16_t *out = static_cast<int16_t *>(dst);
+            if (rate_out == rate_in) {
+                for (size_t i = 0; i < n_out; i++) {
+                    out[i] = to_s16(pcm[i]);
+                }
+            } else {
+                resample(pcm, n_samples, filter, [out](size_t j, float v) { out[j] = to_s16(v); });
+            }
+            return n_out * sizeof(int16_t);
+        }
+        case CACTUS_AUDIO_AAC: {
+#if defined(__APPLE__)
+            std::vector<float> resampled;
+            if (rate_out != rate_in) {
+                resampled.resize(n_out);
+                resample(pcm, n_samples, filter, [&resampled](size_t j, float v) { resampled[j] = v; });
+                pcm = resampled.data();
+            }
+            return encode_aac_apple(pcm, n_out, rate_out, output.bitrate, static_cast<uint8_t *>(dst), capacity);
+#else
+            LOG_ERROR("AAC output needs AudioToolbox", "");
+            return 0;
+#endif
+        }
+    }
+    return 0;
+}
+
+} // namespace cactus
@@ -0,0 +1,119 @@
+#import <AudioToolbox/AudioToolbox.h>
+#include "cactus.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace cactus {
+
+static const int adts_sample_rates[] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350 };
+
+struct aac_input {
+    const float *pcm;
+    size_t remaining;
+};
+
+// Hands the converter all remaining samples at once; zero packets tells it the stream has ended
+static OSStatus aac_input_proc(AudioConverterRef, UInt32 *io_packets, AudioBufferList *io_data,
+                               AudioStreamPacketDescription **, void *user_data) {
+    aac_input *input = static_cast<aac_input *>(user_data);
+    const UInt32 n = (UInt32)std::min<size_t>(*io_packets, input->remaining);
+    io_data->mBuffers[0].mData = (void *)input->pcm;
+    io_data->mBuffers[0].mDataByteSize = n * sizeof(float);
+    io_data->mBuffers[0].mNumberChannels = 1;
+    input->pcm += n;
+    input->remaining -= n;
+    *io_packets = n;
+    return noErr;
+}
+
+// Each packet goes out behind a 7-byte ADTS header (AAC-LC, mono, no CRC) so the buffer plays as a
+// raw .aac stream without a container
+size_t encode_aac_apple(const float *pcm, size_t n_samples, int sample_rate, int bitrate, uint8_t *dst, size_t capacity) {
+    int freq_index = -1;
+    for (int i = 0; i < (int)(sizeof(adts_sample_rates) / sizeof(adts_sample_rates[0])); i++) {
+        if (adts_sample_rates[i] == sample_rate) {
+            freq_index = i;
+        }
+    }
+    if (freq_index < 0) {
+        LOG_ERROR("AAC does not support %d Hz", sample_rate);
+        return 0;
+    }
+
+    AudioStreamBasicDescription in_format = {};
+    in_format.mSampleRate = sample_rate;
+    in_format.mFormatID = kAudioFormatLinearPCM;
+    in_format.mFormatFlags = kAudioFormatFlagIsFloat | kAudioFormatFlagIsPacked;
+    in_format.mBytesPerPacket = sizeof(float);
+    in_format.mFramesPerPacket = 1;
+    in_format.mBytesPerFrame = sizeof(float);
+    in_format.mChannelsPerFrame = 1;
+    in_format.mBitsPerChannel = 32;
+
+    AudioStreamBasicDescription out_format = {};
+    out_format.mSampleRate = sample_rate;
+    out_format.mFormatID = kAudioFormatMPEG4AAC;
+    out_format.mFormatFlags = kMPEG4Object_AAC_LC;
+    out_format.mFramesPerPacket = 1024;
+    out_format.mChannelsPerFrame = 1;
+
+    AudioConverterRef converter = NULL;
+    if (AudioConverterNew(&in_format, &out_format, &converter) != noErr) {
+        LOG_ERROR("Failed to create AAC encoder", "");
+        return 0;
+    }
+    if (bitrate > 0) {
+        const UInt32 rate = (UInt32)bitrate;
+        AudioConverterSetProperty(converter, kAudioConverterEncodeBitRate, sizeof(rate), &rate);
+    }
+    UInt32 max_packet = 0;
+    UInt32 size = sizeof(max_packet);
+    if (AudioConverterGetProperty(converter, kAudioConverterPropertyMaximumOutputPacketSize, &size, &max_packet) != noErr || max_packet == 0) {
+        max_packet = 768;
+    }
+
+    aac_input input = { pcm, n_samples };
+    std::vector<uint8_t> packet(max_packet);
+    size_t n_written = 0;
+    bool ok = true;
+    while (ok) {
+        AudioBufferList buffers;
+        buffers.mNumberBuffers = 1;
+        buffers.mBuffers[0].mNumberChannels = 1;
+        buffers.mBuffers[0].mDataByteSize = max_packet;
+        buffers.mBuffers[0].mData = packet.data();
+        AudioStreamPacketDescription desc = {};
+        UInt32 n_packets = 1;
+        if (AudioConverterFillComplexBuffer(converter, aac_input_proc, &input, &n_packets, &buffers, &desc) != noErr) {
+            ok = false;
+            break;
+        }
+        if (n_packets == 0) {
+            break;
+        }
+        const size_t frame_len = buffers.mBuffers[0].mDataByteSize + 7;
+        if (n_written + frame_len > capacity) {
+            ok = false;
+            break;
+        }
+        uint8_t *h = dst + n_written;
+        h[0] = 0xff;
+        h[1] = 0xf1;
+        h[2] = (uint8_t)((1 << 6) | (freq_index << 2));
+        h[3] = (uint8_t)((1 << 6) | (frame_len >> 11));
+        h[4] = (uint8_t)((frame_len >> 3) & 0xff);
+        h[5] = (uint8_t)(((frame_len & 7) << 5) | 0x1f);
+        h[6] = 0xfc;
+        memcpy(h + 7, packet.data(), frame_len - 7);
+        n_written += frame_len;
+    }
+    AudioConverterDispose(converter);
+    if (!ok) {
+        LOG_ERROR("AAC encoding failed", "");
+        return 0;
+    }
+    return n_written;
+}
+
+} // namespace cactus
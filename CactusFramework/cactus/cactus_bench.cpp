@@ -1,161 +1,521 @@
 #include "cactus.h"
 #include "llama.h"
+#include "json.hpp"
 #include <vector>
 #include <string>
 #include <cmath>
 #include <algorithm>
+#include <cstdio>
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#elif defined(__linux__)
+#include <unistd.h>
+#endif
 
 namespace cactus {
 
-std::string cactus_context::bench(int pp, int tg, int pl, int nr)
-{
+static uint64_t process_footprint() {
+#if defined(__APPLE__)
+    task_vm_info_data_t info;
+    mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+    if (task_info(mach_task_self(), TASK_VM_INFO, (task_info_t)&info, &count) == KERN_SUCCESS) {
+        return info.phys_footprint;
+    }
+#elif defined(__linux__)
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(statm);
+    }
+    return (uint64_t)pages * (uint64_t)sysconf(_SC_PAGESIZE);
+#endif
+    return 0;
+}
+
+static void mean_std(const std::vector<double> &values, double &mean, double &std) {
+    mean = 0.0;
+    std = 0.0;
+    if (values.empty()) {
+        return;
+    }
+    for (double v : values) {
+        mean += v;
+    }
+    mean /= values.size();
+    if (values.size() > 1) {
+        double var = 0.0;
+        for (double v : values) {
+            var += (v - mean) * (v - mean);
+        }
+        std = sqrt(var / (values.size() - 1));
+    }
+}
+
+static double percentile(std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    const size_t rank = (size_t)std::ceil(p * sorted.size());
+    return sorted[std::min(sorted.size(), std::max<size_t>(1, rank)) - 1];
+}
+
+bool cactus_context::runBench(const cactus_bench_config &config, cactus_bench_result &result) {
     if (is_predicting) {
         LOG_ERROR("cannot benchmark while predicting", "");
-        return std::string("[]");
+        return false;
     }
     if (!ctx || !model) {
         LOG_ERROR("Context or model not initialized for benchmarking.");
-        return std::string("[]");
+        return false;
     }
 
-    is_predicting = true;
-
-    double pp_avg = 0.0;
-    double tg_avg = 0.0;
-    double pp_std = 0.0;
-    double tg_std = 0.0;
-
-    int batch_size = std::min(pp, (int)params.n_batch);
-    if (batch_size <= 0) {
-         LOG_ERROR("Invalid batch size for benchmark: %d (pp=%d, n_batch=%d)", batch_size, pp, params.n_batch);
-         is_predicting = false;
-         return std::string("[]");
+    const int pp = std::max(0, config.pp);
+    const int tg = std::max(0, config.tg);
+    const int pl = std::max(1, std::min(config.pl, (int)llama_n_seq_max(ctx)));
+    const int n_chunk = std::max(1, std::min(params.n_batch, (int)llama_n_batch(ctx)));
+    if (pl != config.pl) {
+        LOG_WARNING("benchmark pl %d exceeds n_seq_max, using %d", config.pl, pl);
+    }
+    if (pp + tg > n_ctx) {
+        LOG_ERROR("benchmark needs %d positions, n_ctx is %d", pp + tg, n_ctx);
+        return false;
     }
 
-    llama_batch batch = llama_batch_init(
-        batch_size,
-        0,
-        pl
-    );
-
+    llama_batch batch = llama_batch_init(std::max(std::min(pp, n_chunk), pl), 0, 1);
     if (!batch.token) {
         LOG_ERROR("Failed to initialize llama_batch for benchmark.");
-        is_predicting = false;
-        return std::string("[]");
+        return false;
     }
 
-    LOG_INFO("Starting benchmark: pp=%d, tg=%d, pl=%d, nr=%d, batch_size=%d", pp, tg, pl, nr, batch_size);
+    LOG_INFO("Starting benchmark: pp=%d, tg=%d, pl=%d, nr=%d, warmup=%d, n_batch=%d", pp, tg, pl, config.nr, config.warmup, n_chunk);
+    is_predicting = true;
+    prefix_cache.clear();
 
-    for (int i = 0; i < nr; ++i)
-    {
-        if (is_interrupted) {
-            LOG_INFO("Benchmark interrupted.");
-            break;
-        }
-
-        llama_batch_clear(&batch);
-        const int n_tokens_pp = pp;
-        for (int k = 0; k < n_tokens_pp; ++k) {
-             if (batch.n_tokens >= batch_size) {
-                 LOG_ERROR("Benchmark batch capacity (%d) exceeded during PP phase.", batch_size);
-                 goto cleanup_and_exit;
-             }
-             llama_batch_add(&batch, 0, k, {0}, false); 
-        }
-        if (batch.n_tokens > 0) {
-            batch.logits[batch.n_tokens - 1] = 1; 
-        }
+    std::vector<double> pp_speeds;
+    std::vector<double> tg_speeds;
+    std::vector<double> ttfts;
+    std::vector<double> step_latencies;
+    step_latencies.reserve((size_t)tg * std::max(0, config.nr));
+    uint64_t peak = process_footprint();
+    lm_ggml_backend_memory_reset_peak();
+    bool ok = true;
 
+    // Negative iterations are warm-up and never recorded
+    for (int i = -std::max(0, config.warmup); i < config.nr && ok && !is_interrupted; ++i) {
         llama_kv_self_clear(ctx);
 
         const int64_t t_pp_start = llama_time_us();
-        if (llama_decode(ctx, batch) != 0)
-        {
-            LOG_ERROR("llama_decode() failed during prompt processing benchmark", "");
-             continue;
+        for (int k = 0; k < pp && ok; k += n_chunk) {
+            llama_batch_clear(&batch);
+            const int n_eval = std::min(n_chunk, pp - k);
+            for (int t = 0; t < n_eval; ++t) {
+                llama_batch_add(&batch, 0, k + t, {0}, k + t == pp - 1);
+            }
+            if (llama_decode(ctx, batch) != 0) {
+                LOG_ERROR("llama_decode() failed during prompt processing benchmark", "");
+                ok = false;
+            }
         }
+        llama_synchronize(ctx);
         const int64_t t_pp_end = llama_time_us();
+        peak = std::max(peak, process_footprint());
 
-        if (is_interrupted) {
-             LOG_INFO("Benchmark interrupted after PP phase.");
-             break;
+        for (int j = 1; j < pl; ++j) {
+            llama_kv_self_seq_cp(ctx, 0, j, -1, -1);
         }
 
         const int64_t t_tg_start = llama_time_us();
-        int n_past_tg = batch.n_tokens;
-
-        for (int k = 0; k < tg; ++k)
-        {
+        for (int k = 0; k < tg && ok && !is_interrupted; ++k) {
             llama_batch_clear(&batch);
-            for (int j = 0; j < pl; ++j)
-            {
-                 if (batch.n_tokens >= batch_size) {
-                      LOG_ERROR("Benchmark batch capacity (%d) exceeded during TG phase.", batch_size);
-                      goto cleanup_and_exit; 
-                 }
-                 llama_batch_add(&batch, 0, n_past_tg + k, {(llama_seq_id)j}, true); 
+            for (int j = 0; j < pl; ++j) {
+                llama_batch_add(&batch, 0, pp + k, {(llama_seq_id)j}, true);
             }
-
-            if (llama_decode(ctx, batch) != 0)
-            {
+            const int64_t t_step = llama_time_us();
+            if (llama_decode(ctx, batch) != 0) {
                 LOG_ERROR("llama_decode() failed during text generation benchmark", "");
-                 break; 
+                ok = false;
+                break;
             }
-            if (is_interrupted) {
-                 LOG_INFO("Benchmark interrupted during TG phase.");
-                 goto cleanup_and_exit;
+            llama_synchronize(ctx);
+            if (i >= 0) {
+                step_latencies.push_back((llama_time_us() - t_step) / 1000.0);
             }
         }
-
         const int64_t t_tg_end = llama_time_us();
+        peak = std::max(peak, process_footprint());
 
+        if (i < 0 || !ok || is_interrupted) {
+            continue;
+        }
         const double t_pp = (t_pp_end - t_pp_start) / 1000000.0;
         const double t_tg = (t_tg_end - t_tg_start) / 1000000.0;
-
-        const double speed_pp = (t_pp > 0) ? (double)n_tokens_pp / t_pp : 0.0;
-        const double speed_tg = (t_tg > 0) ? (double)(pl * tg) / t_tg : 0.0; 
-
-        pp_avg += speed_pp;
-        tg_avg += speed_tg;
-        pp_std += speed_pp * speed_pp;
-        tg_std += speed_tg * speed_tg;
+        pp_speeds.push_back(t_pp > 0 ? pp / t_pp : 0.0);
+        tg_speeds.push_back(t_tg > 0 ? (double)(pl * tg) / t_tg : 0.0);
+        ttfts.push_back(t_pp * 1000.0);
     }
 
-cleanup_and_exit:
     llama_batch_free(batch);
     llama_kv_self_clear(ctx);
     is_predicting = false;
 
-    int valid_repetitions = is_interrupted ? 0 : nr;
-    if (valid_repetitions > 0) {
-        pp_avg /= valid_repetitions;
-        tg_avg /= valid_repetitions;
+    result.config = config;
+    result.config.pl = pl;
+    result.config.n_batch = params.n_batch;
+    result.config.n_ubatch = (int32_t)llama_n_ubatch(ctx);
+    result.config.n_threads = llama_n_threads(ctx);
+    result.config.n_threads_batch = llama_n_threads_batch(ctx);
+    result.config.flash_attn = params.flash_attn ? 1 : 0;
+    result.config.type_k = params.cache_type_k;
+    result.config.type_v = params.cache_type_v;
+    result.runs = (int32_t)pp_speeds.size();
+    mean_std(pp_speeds, result.pp_avg, result.pp_std);
+    mean_std(tg_speeds, result.tg_avg, result.tg_std);
+    double ttft_std = 0.0;
+    mean_std(ttfts, result.ttft_ms, ttft_std);
+    std::sort(step_latencies.begin(), step_latencies.end());
+    result.tg_p50_ms = percentile(step_latencies, 0.50);
+    result.tg_p95_ms = percentile(step_latencies, 0.95);
+    result.tg_p99_ms = percentile(step_latencies, 0.99);
+    result.peak_memory = peak;
+    size_t peak_buffers = 0;
+    result.buffers = buffer_memory_usage(&peak_buffers);
+    result.peak_buffers = peak_buffers;
+
+    LOG_INFO("Benchmark finished: pp %.1f t/s, tg %.1f t/s, ttft %.1f ms, p95 %.2f ms",
+        result.pp_avg, result.tg_avg, result.ttft_ms, result.tg_p95_ms);
+    return result.runs > 0;
+}
+
+// Settings that live in the llama_context are applied by recreating it; the loaded settings
+// are restored afterwards. Every sequence's KV state is lost, as with a single bench().
+std::vector<cactus_bench_result> cactus_context::benchSuite(const std::vector<cactus_bench_config> &configs,
+                                                            const std::function<void(size_t)> &on_config_done) {
+    std::vector<cactus_bench_result> results;
+    if (!ctx || !model || is_predicting) {
+        return results;
+    }
+
+    const int32_t saved_n_batch = params.n_batch;
+    const int32_t saved_n_ubatch = params.n_ubatch;
+    const bool saved_flash_attn = params.flash_attn;
+    const lm_ggml_type saved_type_k = params.cache_type_k;
+    const lm_ggml_type saved_type_v = params.cache_type_v;
+    const int32_t saved_threads = llama_n_threads(ctx);
+    const int32_t saved_threads_batch = llama_n_threads_batch(ctx);
+    bool recreated = false;
+
+    for (size_t index = 0; index < configs.size(); index++) {
+        const cactus_bench_config &config = configs[index];
+        if (is_interrupted) {
+            break;
+        }
+        const int32_t n_batch = config.n_batch > 0 ? config.n_batch : saved_n_batch;
+        const int32_t n_ubatch = config.n_ubatch > 0 ? config.n_ubatch : saved_n_ubatch;
+        const bool flash_attn = config.flash_attn < 0 ? saved_flash_attn : config.flash_attn != 0;
+        const lm_ggml_type type_k = config.type_k == LM_GGML_TYPE_COUNT ? saved_type_k : config.type_k;
+        const lm_ggml_type type_v = config.type_v == LM_GGML_TYPE_COUNT ? saved_type_v : config.type_v;
+
+        if (n_batch != params.n_batch || n_ubatch != params.n_ubatch || flash_attn != params.flash_attn ||
+            type_k != params.cache_type_k || type_v != params.cache_type_v || ctx == nullptr) {
+            params.n_batch = n_batch;
+            params.n_ubatch = std::min(n_ubatch, n_batch);
+            params.flash_attn = flash_attn;
+            params.cache_type_k = type_k;
+            params.cache_type_v = type_v;
+            recreated = true;
+            if (!recreateContext()) {
+                LOG_WARNING("skipping benchmark configuration the context cannot be created with", "");
+                if (on_config_done) {
+                    on_config_done(index);
+                }
+                continue;
+            }
+        }
+        llama_set_n_threads(ctx,
+            config.n_threads > 0 ? config.n_threads : saved_threads,
+            config.n_threads_batch > 0 ? config.n_threads_batch : (config.n_threads > 0 ? config.n_threads : saved_threads_batch));
+
+        cactus_bench_result result;
+        if (runBench(config, result)) {
+            results.push_back(result);
+        }
+        if (on_config_done) {
+            on_config_done(index);
+        }
+    }
+
+    if (recreated) {
+        params.n_batch = saved_n_batch;
+        params.n_ubatch = saved_n_ubatch;
+        params.flash_attn = saved_flash_attn;
+        params.cache_type_k = saved_type_k;
+        params.cache_type_v = saved_type_v;
+        if (!recreateContext()) {
+            LOG_ERROR("failed to restore the context after benchmarking", "");
+            return results;
+        }
+    }
+    llama_set_n_threads(ctx, saved_threads, saved_threads_batch);
+    return results;
+}
+
+static void add_profile(cactus_completion_profile &total, const cactus_completion_profile &run) {
+    total.prompt_us += run.prompt_us;
+    total.prefill_us += run.prefill_us;
+    total.decode_us += run.decode_us;
+    total.sample_us += run.sample_us;
+    total.grammar_us += run.grammar_us;
+    total.detokenize_us += run.detokenize_us;
+    total.stop_us += run.stop_us;
+    total.callback_us += run.callback_us;
+    total.n_tokens += run.n_tokens;
+}
+
+// Replays formatted prompts through the regular completion path with the configured sampling,
+// grammar and stop strings. Each prompt starts from an empty active sequence; other sequences
+// keep their cache.
+bool cactus_context::runWorkloadBench(const std::vector<std::string> &prompts, int32_t nr, cactus_workload_result &result,
+                                      const std::function<void(const completion_token_output &)> &on_token) {
+    if (is_predicting) {
+        LOG_ERROR("cannot benchmark while predicting", "");
+        return false;
+    }
+    if (!ctx || !model || prompts.empty()) {
+        LOG_ERROR("Context, model or prompts missing for workload benchmark.");
+        return false;
+    }
+
+    result = cactus_workload_result();
+    result.n_prompts = prompts.size();
+    const std::function<bool()> hook = abort_hook;
+    double ttft_sum = 0.0;
+    int64_t gen_us = 0;
+    size_t n_first = 0;
+    bool ok = true;
+
+    const int64_t t_bench = llama_time_us();
+    for (int r = 0; r < std::max(1, nr) && ok && !is_interrupted; r++) {
+        for (const std::string &prompt : prompts) {
+            if (is_interrupted) {
+                break;
+            }
+            llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+            embd.clear();
+            n_past = 0;
+            profile = cactus_completion_profile();
+
+            const int64_t t_start = llama_time_us();
+            params.prompt = prompt;
+            if (!initSampling()) {
+                LOG_ERROR("failed to initialize sampling for workload benchmark", "");
+                ok = false;
+                break;
+            }
+            beginCompletion();
+            setAbortHook(hook);
+            loadPrompt();
+            profile.prompt_us = llama_time_us() - t_start;
+
+            profiling = true;
+            int64_t t_first = 0;
+            while (has_next_token && !is_interrupted) {
+                const completion_token_output token = doCompletion();
+                if (token.tok == -1) {
+                    break;
+                }
+                if (t_first == 0) {
+                    t_first = llama_time_us();
+                }
+                if (on_token) {
+                    const int64_t t_callback = llama_time_us();
+                    on_token(token);
+                    recordStage(profile.callback_us, "callback", t_callback);
+                }
+            }
+            profiling = false;
+            endCompletion();
+            setAbortHook(hook);
 
-        if (valid_repetitions > 1) {
-             double pp_var = pp_std / (valid_repetitions - 1) - pp_avg * pp_avg * valid_repetitions / (valid_repetitions - 1);
-             double tg_var = tg_std / (valid_repetitions - 1) - tg_avg * tg_avg * valid_repetitions / (valid_repetitions - 1);
-             pp_std = (pp_var > 0) ? sqrt(pp_var) : 0.0;
-             tg_std = (tg_var > 0) ? sqrt(tg_var) : 0.0;
-        } else {
-            pp_std = 0.0;
-            tg_std = 0.0;
+            if (t_first > 0) {
+                ttft_sum += (t_first - t_start) / 1000.0;
+                gen_us += llama_time_us() - t_first;
+                n_first++;
+            }
+            result.n_prompt_tokens += num_prompt_tokens;
+            add_profile(result.profile, profile);
+        }
+        if (ok && !is_interrupted) {
+            result.runs++;
         }
-    } else {
-         pp_avg = 0.0; tg_avg = 0.0; pp_std = 0.0; tg_std = 0.0;
+    }
+    result.total_us = llama_time_us() - t_bench;
+    setAbortHook(nullptr);
+
+    llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+    embd.clear();
+    n_past = 0;
+
+    result.n_tokens = result.profile.n_tokens;
+    result.ttft_ms = n_first > 0 ? ttft_sum / n_first : 0.0;
+    result.tg_avg = gen_us > 0 ? result.n_tokens * 1000000.0 / gen_us : 0.0;
+
+    const cactus_completion_profile &p = result.profile;
+    LOG_INFO("Workload benchmark finished: %zu tokens, ttft %.1f ms, decode %.1f ms, sample %.1f ms, grammar %.1f ms, detokenize %.1f ms, callbacks %.1f ms",
+        result.n_tokens, result.ttft_ms, p.decode_us / 1000.0, p.sample_us / 1000.0, p.grammar_us / 1000.0,
+        p.detokenize_us / 1000.0, p.callback_us / 1000.0);
+    return result.runs > 0;
+}
+
+std::string cactus_context::bench(int pp, int tg, int pl, int nr)
+{
+    cactus_bench_config config;
+    config.pp = pp;
+    config.tg = tg;
+    config.pl = pl;
+    config.nr = nr;
+    config.warmup = 0;
+    cactus_bench_result result;
+    if (!model || !runBench(config, result)) {
+        return std::string("[]");
     }
 
     char model_desc[128];
     llama_model_desc(model, model_desc, sizeof(model_desc));
-    std::string result_str = "[\"" + std::string(model_desc) + "\"," +
-                             std::to_string(llama_model_size(model)) + "," +
-                             std::to_string(llama_model_n_params(model)) + "," +
-                             std::to_string(pp_avg) + "," +
-                             std::to_string(pp_std) + "," +
-                             std::to_string(tg_avg) + "," +
-                             std::to_string(tg_std) +
-                             "]";
-    LOG_INFO("Benchmark finished. Result: %s", result_str.c_str());
-    return result_str;
+    return nlohmann::json::array({
+        std::string(model_desc),
+        llama_model_size(model),
+        llama_model_n_params(model),
+        result.pp_avg,
+        result.pp_std,
+        result.tg_avg,
+        result.tg_std
+    }).dump();
+}
+
+void cactus_context::setThreads(int32_t n_threads, int32_t n_threads_batch) {
+    params.cpuparams.n_threads = n_threads;
+    params.cpuparams_batch.n_threads = n_threads_batch;
+    if (thermal != THERMAL_NOMINAL) {
+        thermal_base_threads = n_threads;
+        thermal_base_threads_batch = n_threads_batch;
+    }
+    if (ctx != nullptr) {
+        llama_set_n_threads(ctx, n_threads, n_threads_batch);
+    }
+}
+
+// Short prefill and decode runs per thread count; prefill and decode often peak at different
+// counts once efficiency cores join in
+bool cactus_context::tuneThreads(const std::vector<int32_t> &candidates, int32_t &n_threads, int32_t &n_threads_batch) {
+    if (!ctx || candidates.empty()) {
+        return false;
+    }
+    const int pp = std::max(1, std::min(64, (int)params.n_batch));
+    const int tg = 16;
+    double best_pp = 0.0;
+    double best_tg = 0.0;
+    n_threads = params.cpuparams.n_threads;
+    n_threads_batch = params.cpuparams_batch.n_threads;
+
+    for (int32_t candidate : candidates) {
+        if (candidate <= 0 || is_interrupted) {
+            continue;
+        }
+        llama_set_n_threads(ctx, candidate, candidate);
+        cactus_bench_config config;
+        config.pp = pp;
+        config.tg = tg;
+        config.nr = 2;
+        config.warmup = 0;
+        cactus_bench_result result;
+        if (!runBench(config, result)) {
+            LOG_WARNING("thread tuning benchmark failed for %d threads", candidate);
+            continue;
+        }
+        const double speed_pp = result.pp_avg;
+        const double speed_tg = result.tg_avg;
+        LOG_INFO("thread tuning: %d threads, pp %.1f t/s, tg %.1f t/s", candidate, speed_pp, speed_tg);
+        if (speed_pp > best_pp) {
+            best_pp = speed_pp;
+            n_threads_batch = candidate;
+        }
+        if (speed_tg > best_tg) {
+            best_tg = speed_tg;
+            n_threads = candidate;
+        }
+    }
+
+    setThreads(n_threads, n_threads_batch);
+    return best_pp > 0.0 && best_tg > 0.0;
+}
+
+// Every candidate prefills the same prompt, twice the largest ubatch, so small sizes pay for their
+// extra graph launches; n_batch is raised to the ubatch where it is smaller so whole ubatches reach
+// the context. Decode does not depend on n_ubatch and is not timed.
+bool cactus_context::tuneBatchSize(const std::vector<int32_t> &candidates, size_t memory_cap, int32_t &n_batch, int32_t &n_ubatch) {
+    n_batch = params.n_batch;
+    n_ubatch = params.n_ubatch;
+    if (!ctx || !model || is_predicting || params.embedding) {
+        return false;
+    }
+
+    std::vector<cactus_bench_config> configs;
+    int32_t n_max = 0;
+    for (int32_t candidate : candidates) {
+        if (candidate > 0 && candidate <= n_ctx) {
+            n_max = std::max(n_max, candidate);
+        }
+    }
+    for (int32_t candidate : candidates) {
+        if (candidate <= 0 || candidate > n_ctx) {
+            continue;
+        }
+        cactus_bench_config config;
+        config.pp = std::min(n_ctx, 2 * n_max);
+        config.tg = 0;
+        config.nr = 2;
+        config.warmup = 1;
+        config.n_batch = std::max(params.n_batch, candidate);
+        config.n_ubatch = candidate;
+        configs.push_back(config);
+    }
+    if (configs.empty()) {
+        return false;
+    }
+
+    double best_pp = 0.0;
+    for (const cactus_bench_result &result : benchSuite(configs)) {
+        const bool fits = memory_cap == 0 || result.peak_buffers <= memory_cap;
+        LOG_INFO("batch tuning: n_ubatch %d, pp %.1f t/s, buffers %llu MiB%s", result.config.n_ubatch, result.pp_avg,
+            (unsigned long long)(result.peak_buffers >> 20), fits ? "" : ", over the memory cap");
+        if (fits && result.pp_avg > best_pp) {
+            best_pp = result.pp_avg;
+            n_batch = result.config.n_batch;
+            n_ubatch = result.config.n_ubatch;
+        }
+    }
+    if (best_pp <= 0.0 || !ctx) {
+        return false;
+    }
+
+    if (n_batch != params.n_batch || n_ubatch != params.n_ubatch) {
+        const int32_t saved_n_batch = params.n_batch;
+        const int32_t saved_n_ubatch = params.n_ubatch;
+        params.n_batch = n_batch;
+        params.n_ubatch = n_ubatch;
+        if (!recreateContext()) {
+            LOG_ERROR("failed to recreate the context with n_ubatch %d", n_ubatch);
+            params.n_batch = n_batch = saved_n_batch;
+            params.n_ubatch = n_ubatch = saved_n_ubatch;
+            recreateContext();
+            return false;
+        }
+    }
+    LOG_INFO("batch tuning: n_batch %d, n_ubatch %d", n_batch, n_ubatch);
+    return true;
 }
 
 } // namespace cactus
\ No newline at end of file
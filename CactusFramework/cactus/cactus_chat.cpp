@@ -1,6 +1,7 @@
 #include "cactus.h"
 #include "common.h"
 #include "json.hpp"
+#include <algorithm>
 
 using json = nlohmann::ordered_json;
 
@@ -13,6 +14,28 @@ common_chat_params cactus_context::getFormattedChatWithJinja(
   const std::string &tools,
   const bool &parallel_tool_calls,
   const std::string &tool_choice
+) const {
+    if (!model || !templates) {
+         LOG_ERROR("Model or templates not loaded, cannot format chat.");
+         return {}; 
+    }
+    std::vector<common_chat_msg> chat_messages;
+    try {
+        chat_messages = common_chat_msgs_parse_oaicompat(json::parse(messages));
+    } catch (const json::exception& e) {
+        LOG_ERROR("JSON parsing error during chat formatting: %s", e.what());
+        throw std::runtime_error("Invalid JSON input for chat formatting.");
+    }
+    return getFormattedChatWithJinja(std::move(chat_messages), chat_template, json_schema, tools, parallel_tool_calls, tool_choice);
+}
+
+common_chat_params cactus_context::getFormattedChatWithJinja(
+  std::vector<common_chat_msg> messages,
+  const std::string &chat_template,
+  const std::string &json_schema,
+  const std::string &tools,
+  const bool &parallel_tool_calls,
+  const std::string &tool_choice
 ) const {
     if (!model || !templates) {
          LOG_ERROR("Model or templates not loaded, cannot format chat.");
@@ -20,8 +43,8 @@ common_chat_params cactus_context::getFormattedChatWithJinja(
     }
     common_chat_templates_inputs inputs;
     inputs.use_jinja = true;
+    inputs.messages = std::move(messages);
     try {
-        inputs.messages = common_chat_msgs_parse_oaicompat(json::parse(messages));
         auto useTools = !tools.empty();
         if (useTools) {
             inputs.tools = common_chat_tools_parse_oaicompat(json::parse(tools));
@@ -41,11 +64,7 @@ common_chat_params cactus_context::getFormattedChatWithJinja(
 
     if (!chat_template.empty()) {
         try {
-            if (!common_chat_verify_template(chat_template.c_str(), true)) {
-                 LOG_WARNING("Provided custom Jinja template is invalid.");
-            }
-            auto tmps = common_chat_templates_init(model, chat_template);
-            return common_chat_templates_apply(tmps.get(), inputs);
+            return common_chat_templates_apply(customChatTemplates(chat_template, true).get(), inputs);
         } catch (const std::exception& e) {
              LOG_ERROR("Error applying custom chat template: %s", e.what());
               return common_chat_templates_apply(templates.get(), inputs);
@@ -63,22 +82,31 @@ std::string cactus_context::getFormattedChat(
          LOG_ERROR("Model or templates not loaded, cannot format chat.");
          return ""; 
     }
-    common_chat_templates_inputs inputs;
-    inputs.use_jinja = false;
+    std::vector<common_chat_msg> chat_messages;
      try {
-         inputs.messages = common_chat_msgs_parse_oaicompat(json::parse(messages));
+         chat_messages = common_chat_msgs_parse_oaicompat(json::parse(messages));
      } catch (const json::exception& e) {
          LOG_ERROR("JSON parsing error during chat formatting: %s", e.what());
          throw std::runtime_error("Invalid JSON input for chat formatting.");
      }
+    return getFormattedChat(std::move(chat_messages), chat_template);
+}
+
+std::string cactus_context::getFormattedChat(
+  std::vector<common_chat_msg> messages,
+  const std::string &chat_template
+) const {
+    if (!model || !templates) {
+         LOG_ERROR("Model or templates not loaded, cannot format chat.");
+         return ""; 
+    }
+    common_chat_templates_inputs inputs;
+    inputs.use_jinja = false;
+    inputs.messages = std::move(messages);
 
     if (!chat_template.empty()) {
          try {
-             if (!common_chat_verify_template(chat_template.c_str(), false)) {
-                 LOG_WARNING("Provided custom standard template is invalid.");
-             }
-             auto tmps = common_chat_templates_init(model, chat_template);
-             return common_chat_templates_apply(tmps.get(), inputs).prompt;
+             return common_chat_templates_apply(customChatTemplates(chat_template, false).get(), inputs).prompt;
          } catch (const std::exception& e) {
              LOG_ERROR("Error applying custom chat template: %s", e.what());
              return common_chat_templates_apply(templates.get(), inputs).prompt;
@@ -88,4 +116,94 @@ std::string cactus_context::getFormattedChat(
     }
 }
 
+// Verifies and parses a custom template the first time it is seen and keeps it for the requests
+// that pass it again; the least recently used one is dropped once the cache is full. Parsing runs
+// outside the lock, so two threads may both parse a new template and the first one stored wins.
+std::shared_ptr<const common_chat_templates> cactus_context::customChatTemplates(const std::string &chat_template, bool use_jinja) const {
+    auto &cache = custom_templates;
+    const auto find = [&]() -> cactus_chat_template_cache::entry * {
+        for (auto &entry : cache.entries) {
+            if (entry.use_jinja == use_jinja && entry.source == chat_template) {
+                entry.last_use = ++cache.n_uses;
+                return &entry;
+            }
+        }
+        return nullptr;
+    };
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        if (auto *entry = find()) {
+            return entry->templates;
+        }
+    }
+
+    if (!common_chat_verify_template(chat_template.c_str(), use_jinja)) {
+        LOG_WARNING("Provided custom %s template is invalid.", use_jinja ? "Jinja" : "standard");
+    }
+    cactus_chat_template_cache::entry entry;
+    entry.source = chat_template;
+    entry.use_jinja = use_jinja;
+    entry.templates = common_chat_templates_init(model, chat_template);
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if (auto *existing = find()) {
+        return existing->templates;
+    }
+    entry.last_use = ++cache.n_uses;
+    if (cache.entries.size() >= cactus_chat_template_cache::max_entries) {
+        auto oldest = std::min_element(cache.entries.begin(), cache.entries.end(),
+            [](const cactus_chat_template_cache::entry &a, const cactus_chat_template_cache::entry &b) {
+                return a.last_use < b.last_use;
+            });
+        cache.entries.erase(oldest);
+    }
+    cache.entries.push_back(std::move(entry));
+    return cache.entries.back().templates;
+}
+
+// Renders each message past n_cached as the text it adds to the chat, so callers can tokenize
+// new turns alone and reuse token spans for the history. Fails when the template output
+// is not an append-only extension of the previous turns.
+bool cactus_context::formatChatSpans(
+  const std::vector<common_chat_msg> &messages,
+  size_t n_cached,
+  std::vector<std::string> &spans,
+  std::string &generation_prompt
+) const {
+    if (!model || !templates || messages.empty()) {
+        return false;
+    }
+    spans.clear();
+    generation_prompt.clear();
+
+    common_chat_templates_inputs inputs;
+    inputs.use_jinja = false;
+    inputs.add_generation_prompt = false;
+    try {
+        // Each render only covers the window the new message needs (see common_chat_templates_apply)
+        n_cached = std::min(n_cached, messages.size());
+        inputs.messages.assign(messages.begin(), messages.begin() + n_cached);
+        for (size_t i = n_cached; i < messages.size(); i++) {
+            inputs.messages.push_back(messages[i]);
+            inputs.n_past = i;
+            common_chat_params delta = common_chat_templates_apply(templates.get(), inputs);
+            if (i > 0 && !delta.prompt_is_delta) {
+                return false;
+            }
+            spans.push_back(std::move(delta.prompt));
+        }
+        inputs.add_generation_prompt = true;
+        inputs.n_past = messages.size();
+        common_chat_params delta = common_chat_templates_apply(templates.get(), inputs);
+        if (!delta.prompt_is_delta) {
+            return false;
+        }
+        generation_prompt = std::move(delta.prompt);
+    } catch (const std::exception &e) {
+        LOG_WARNING("incremental chat formatting failed: %s", e.what());
+        return false;
+    }
+    return true;
+}
+
 } // namespace cactus 
\ No newline at end of file
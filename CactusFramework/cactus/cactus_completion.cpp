@@ -8,36 +8,16 @@
 
 namespace cactus {
 
-void cactus_context::truncatePrompt(std::vector<llama_token> &prompt_tokens) {
-    const int n_left = n_ctx - params.n_keep;
-    const int n_block_size = (n_left > 0) ? n_left / 2 : 0;
-    const int erased_blocks = (n_block_size > 0) ? (prompt_tokens.size() - params.n_keep - n_block_size) / n_block_size : 0;
-
-    int keep_count = std::max(0, params.n_keep);
-    keep_count = std::min(keep_count, (int)prompt_tokens.size());
-
-    std::vector<llama_token> new_tokens(prompt_tokens.begin(), prompt_tokens.begin() + keep_count);
-
-    size_t end_part_start_index = (size_t)keep_count + (size_t)std::max(0, erased_blocks * n_block_size);
-    if (end_part_start_index < prompt_tokens.size()) {
-        new_tokens.insert(new_tokens.end(), prompt_tokens.begin() + end_part_start_index, prompt_tokens.end());
-    }
-
-    LOG_VERBOSE("input truncated, n_ctx: %d, n_keep: %d, n_left: %d, new_tokens_size: %zu",
-        n_ctx,
-        params.n_keep,
-        n_left,
-        new_tokens.size()
-    );
-
-    truncated = true;
-    prompt_tokens = new_tokens;
-}
-
 void cactus_context::loadPrompt() {
     bool is_continuation = !embd.empty();
 
-    std::vector<llama_token> new_tokens = ::common_tokenize(ctx, params.prompt, !is_continuation, true);
+    const int64_t t_tokenize = stageTimed() ? llama_time_us() : 0;
+    std::vector<llama_token> new_tokens = is_continuation
+        ? ::common_tokenize(ctx, params.prompt, false, true, params.cpuparams.n_threads)
+        : tokenizePrompt(params.prompt);
+    if (stageTimed()) {
+        recordStage(profile.prompt_us, "tokenize", t_tokenize);
+    }
 
     if (is_continuation) {
         embd.insert(embd.end(), new_tokens.begin(), new_tokens.end());
@@ -60,8 +40,16 @@ void cactus_context::loadPrompt() {
         LM_GGML_ASSERT(embd.size() < (size_t) n_ctx || n_ctx == 0);
     }
 
-    for (auto & token : new_tokens) {
-        common_sampler_accept(ctx_sampling, token, false);
+    if (!is_continuation && n_past == 0) {
+        n_past = restorePromptCache(embd);
+        n_past = reusePrefixCache(embd, n_past);
+        n_past = restoreSpeakerPrefix(embd, n_past);
+    }
+
+    common_sampler_accept_prompt(ctx_sampling, embd);
+
+    if (recording_requests) {
+        recordRequest({});
     }
 
     LOG_VERBOSE("prompt ingested, n_past: %d, cached_size: %zu, to_eval_size: %zu",
@@ -73,6 +61,82 @@ void cactus_context::loadPrompt() {
     has_next_token = true;
 }
 
+void cactus_context::loadPromptReusingPrefix() {
+    if (!mtmd_bitmap_past_hashes.empty()) {
+        mtmd_bitmap_past_hashes.clear();
+        mtmd_past_chunks.clear();
+        embd.clear();
+        n_past = 0;
+        llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+    }
+
+    const int64_t t_tokenize = stageTimed() ? llama_time_us() : 0;
+    std::vector<llama_token> new_tokens = pretokenized_prompt.empty()
+        ? tokenizePrompt(params.prompt)
+        : std::move(pretokenized_prompt);
+    if (stageTimed()) {
+        recordStage(profile.prompt_us, "tokenize", t_tokenize);
+    }
+    pretokenized_prompt.clear();
+    // a kept tool turn is either this prompt or superseded by it
+    tool_turns.erase(seq_id);
+
+    streamPrompt(new_tokens);
+    num_prompt_tokens = new_tokens.size();
+
+    if (params.n_keep < 0) {
+        params.n_keep = (int)num_prompt_tokens;
+    }
+    params.n_keep = std::min(n_ctx > 4 ? n_ctx - 4 : 0, params.n_keep);
+    params.n_keep = std::max(0, params.n_keep);
+
+    if (new_tokens.size() >= (size_t) n_ctx) {
+        truncatePrompt(new_tokens);
+        num_prompt_tokens = new_tokens.size();
+        LM_GGML_ASSERT(new_tokens.size() < (size_t) n_ctx || n_ctx == 0);
+    }
+
+    if (embd.empty() && n_past == 0) {
+        n_past = restorePromptCache(new_tokens);
+        embd.assign(new_tokens.begin(), new_tokens.begin() + n_past);
+    }
+
+    size_t n_reuse = std::min(common_part(embd, new_tokens), n_past);
+    n_reuse += reuseShiftedCache(new_tokens, n_reuse);
+    n_reuse = std::min(n_reuse, n_past);
+    n_reuse = reusePrefixCache(new_tokens, n_reuse);
+    n_reuse = restoreSpeakerPrefix(new_tokens, n_reuse);
+    if (n_reuse == new_tokens.size() && n_reuse > 0) {
+        n_reuse--;
+    }
+
+    if (n_reuse < n_past) {
+        // a recurrent state resumes from its newest snapshot before n_reuse
+        const llama_pos p_resume = llama_kv_self_seq_rollback(ctx, seq_id, n_reuse);
+        if (p_resume < 0) {
+            LOG_WARNING("partial KV cache removal failed, clearing sequence %d", seq_id);
+            llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+        }
+        n_reuse = std::max<llama_pos>(0, p_resume);
+    }
+
+    embd = std::move(new_tokens);
+    n_past = n_reuse;
+
+    common_sampler_accept_prompt(ctx_sampling, embd);
+
+    if (recording_requests) {
+        recordRequest({});
+    }
+
+    LOG_VERBOSE("prompt ingested with prefix reuse, n_past: %zu, to_eval_size: %zu",
+        n_past,
+        embd.size() - n_past
+    );
+
+    has_next_token = true;
+}
+
 void cactus_context::loadPrompt(const std::vector<std::string> &media_paths) {
     bool has_media = !media_paths.empty();
 
@@ -98,6 +162,10 @@ void cactus_context::loadPrompt(const std::vector<std::string> &media_paths) {
         n_past--;
     }
 
+    if (recording_requests) {
+        recordRequest(media_paths);
+    }
+
     has_next_token = true;
     LOG_VERBOSE("Input processed: n_past=%d, embd.size=%zu, num_prompt_tokens=%zu, has_media=%d",
              n_past, embd.size(), num_prompt_tokens, has_media ? 1 : 0);
@@ -107,57 +175,228 @@ void cactus_context::beginCompletion() {
     n_remain = params.n_predict;
     llama_perf_context_reset(ctx);
     is_predicting = true;
+    is_interrupted = false;
+    abort_hook = nullptr;
+    timed_out = false;
+    deadline = timeout_ms > 0 ? std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms)
+                              : std::chrono::steady_clock::time_point::max();
+    armAbortCallback();
     num_tokens_predicted = 0;
     num_prompt_tokens = 0;
     generated_text.clear();
+    utf8_pending = 0;
+    text_delta_offset = 0;
+    text_delta_size = 0;
+    stop_matcher.build(params.antiprompt);
+    tool_scanner.reset();
+    generated_token_probs.clear();
+    // the previous request's token probs go with it
+    request_arena.reset();
     stopping_word.clear();
     stopped_eos = false;
     stopped_word = false;
     stopped_limit = false;
     truncated = false;
+    discardPendingTokens();
+    n_draft_proposed = 0;
+    n_draft_accepted = 0;
+    n_hot_path_allocs = 0;
+    forced_tokens.clear();
+    forced_cursor = 0;
+    n_grammar_forced = 0;
+    n_cache_shifted = 0;
+    prefix_cache_pending = false;
+    profile = cactus_completion_profile();
+    trace_spans.clear();
+}
+
+bool cactus_context::prefillStep(int32_t budget) {
+    cactus_interactive_scope interactive;
+    if (n_past >= embd.size()) {
+        return true;
+    }
+    if (embd.size() >= (size_t)params.n_ctx) {
+        shiftContext();
+    }
+
+    const int n_chunk = std::min(budget > 0 ? budget : params.n_batch, params.n_batch);
+    int n_eval = std::min((int)(embd.size() - n_past), n_chunk);
+    if (speaker_capture_at > n_past) {
+        n_eval = std::min(n_eval, (int)(speaker_capture_at - n_past));
+    }
+    const std::vector<llama_seq_id> seq_ids = { seq_id };
+
+    llama_batch_clear(&batch);
+    for (int i = 0; i < n_eval; i++) {
+        llama_batch_add(&batch, embd[n_past + i], n_past + i, seq_ids, n_past + i + 1 == embd.size());
+    }
+
+    armAbortForBatch(n_eval);
+    const int64_t t_decode = stageTimed() ? llama_time_us() : 0;
+    int ret = llama_decode(ctx, batch);
+    while (ret == 1 && relieveKVCache()) {
+        ret = llama_decode(ctx, batch);
+    }
+    if (stageTimed()) {
+        llama_synchronize(ctx);
+        recordStage(profile.prefill_us, "prefill", t_decode);
+    }
+    if (ret == 2) {
+        LOG_INFO("Prefill Interrupted");
+        has_next_token = false;
+        return true;
+    }
+    if (ret != 0) {
+        LOG_ERROR("failed to eval prefill chunk, n_eval: %d, n_past: %zu", n_eval, n_past);
+        has_next_token = false;
+        return true;
+    }
+    n_past += n_eval;
+    if (n_past == speaker_capture_at) {
+        captureSpeakerPrefix();
+    }
+
+    LOG_VERBOSE("prefill chunk evaluated, n_past: %zu, embd_size: %zu", n_past, embd.size());
+    if (n_past < embd.size()) {
+        return false;
+    }
+    storePrefixCache();
+    return true;
+}
+
+float cactus_context::prefillProgress() const {
+    if (embd.empty()) {
+        return 1.0f;
+    }
+    return std::min(1.0f, (float)n_past / (float)embd.size());
+}
+
+void cactus_context::shiftContext() {
+    discardPendingTokens();
+
+    const int n_keep    = params.n_keep;
+    const int n_left    = (int)n_past - n_keep - 1;
+    if (n_left <= 0) {
+        return;
+    }
+    const float fraction = std::min(1.0f, std::max(0.0f, context_shift_discard));
+    const int n_discard = std::min(n_left, std::max(1, (int)(n_left * fraction)));
+
+    llama_kv_self_seq_rm (ctx, seq_id, n_keep + 1            , n_keep + n_discard + 1);
+    const bool kept = unsharePrefixCells(n_keep + 1 + n_discard);
+    if (kept) {
+        llama_kv_self_seq_add(ctx, seq_id, n_keep + 1 + n_discard, n_past, -n_discard);
+    }
+
+    embd.erase(embd.begin() + n_keep + 1, embd.begin() + n_keep + 1 + n_discard);
+
+    // Media cut by the discard can no longer be reused; media after it moved down with the cache
+    const size_t cut_begin = (size_t)n_keep + 1;
+    const size_t cut_end = cut_begin + (size_t)n_discard;
+    std::vector<mtmd_chunk_state> kept_chunks;
+    for (const auto &chunk : mtmd_past_chunks) {
+        if (chunk.pos + chunk.n_pos <= cut_begin) {
+            kept_chunks.push_back(chunk);
+        } else if (chunk.pos >= cut_end) {
+            kept_chunks.push_back({chunk.key, chunk.pos - (size_t)n_discard, chunk.n_pos});
+        }
+    }
+    mtmd_past_chunks = std::move(kept_chunks);
+
+    n_past = kept ? n_past - n_discard : 0;
+    truncated = true;
+    speaker_capture_at = 0;
+    prefix_cache_pending = false;
+
+    // Penalty history still holds the discarded tokens when its window reaches past the cut
+    const int32_t penalty_last_n = params.sampling.penalty_last_n < 0 ? n_ctx : params.sampling.penalty_last_n;
+    const bool window_hits_cut = (int)embd.size() - (n_keep + 1) < penalty_last_n;
+    if (ctx_sampling != nullptr && window_hits_cut && params.sampling.grammar.empty()) {
+        common_sampler_reset(ctx_sampling);
+        for (llama_token token : embd) {
+            common_sampler_accept(ctx_sampling, token, false);
+        }
+    }
+
+    LOG_VERBOSE("context shifted, n_discard: %d, new n_past: %zu, new size: %zu", n_discard, n_past, embd.size());
 }
 
 completion_token_output cactus_context::nextToken()
 {
+    cactus_interactive_scope interactive;
     completion_token_output result;
     result.tok = -1;
 
+    if (!pending_tokens.empty()) {
+        return nextPendingToken();
+    }
+
     if (embd.size() >= (size_t)params.n_ctx)
     {
-        const int n_left    = n_past - params.n_keep - 1;
-        const int n_discard = n_left/2;
-
-        llama_kv_self_seq_rm (ctx, 0, params.n_keep + 1            , params.n_keep + n_discard + 1);
-        llama_kv_self_seq_add(ctx, 0, params.n_keep + 1 + n_discard, n_past, -n_discard);
-
-        for (size_t i = params.n_keep + 1 + n_discard; i < embd.size(); i++)
-        {
-            embd[i - n_discard] = embd[i];
-        }
-        embd.resize(embd.size() - n_discard);
+        shiftContext();
+    }
 
-        n_past -= n_discard;
-        truncated = true;
+    if (forced_cursor < forced_tokens.size()) {
+        return nextForcedToken();
+    }
 
-        LOG_VERBOSE("context shifted, new n_past: %d, new size: %zu", n_past, embd.size());
+    if (n_past + 1 == embd.size() && canSpeculate() && speculativeStep()) {
+        return nextPendingToken();
     }
 
+    // The token after a guided newline is always the next guide word, so it is pushed
+    // without sampling and decoded together with the newline on the next call
+    const bool forward_guide = next_token_uses_guide_token && hasGuideTokens() &&
+                               guide_newline_token >= 0 && !embd.empty() &&
+                               embd.back() == guide_newline_token && params.sampling.n_probs == 0 &&
+                               !params.sampling.token_stats;
+
+    batch_seq_ids.assign(1, seq_id);
     bool tg = true;
-    while ((size_t)n_past < embd.size())
+    while (!forward_guide && (size_t)n_past < embd.size())
     {
         int n_eval = (int)embd.size() - n_past;
-        tg = n_eval == 1;
+        tg = n_eval <= 1 + (int)n_forwarded;
         if (n_eval > params.n_batch)
         {
             n_eval = params.n_batch;
         }
+        if (speaker_capture_at > n_past) {
+            n_eval = std::min(n_eval, (int)(speaker_capture_at - n_past));
+        }
 
         if (n_eval <= 0) {
             LOG_WARNING("No tokens to evaluate (n_eval=%d)", n_eval);
             break;
         }
 
-        if (llama_decode(ctx, llama_batch_get_one(&embd[n_past], n_eval)) != 0)
+        llama_batch_clear(&batch);
+        for (int i = 0; i < n_eval; i++) {
+            llama_batch_add(&batch, embd[n_past + i], n_past + i, batch_seq_ids, i == n_eval - 1);
+        }
+
+        armAbortForBatch(n_eval);
+        const int64_t t_decode = stageTimed() ? llama_time_us() : 0;
+        int ret = llama_decode(ctx, batch);
+        while (ret == 1 && relieveKVCache()) {
+            ret = llama_decode(ctx, batch);
+        }
+        if (stageTimed()) {
+            // Wait for the backend so the decode is not billed to whatever reads the logits next
+            llama_synchronize(ctx);
+            if (tg) {
+                recordStage(profile.decode_us, "decode", t_decode);
+            } else {
+                recordStage(profile.prefill_us, "prefill", t_decode);
+            }
+        }
+        if (ret == 2 || (ret != 0 && is_interrupted)) {
+            LOG_INFO("Decoding Interrupted");
+            embd.resize(n_past);
+            has_next_token = false;
+            return result;
+        }
+        if (ret != 0)
         {
             LOG_ERROR("failed to eval, n_eval: %d, n_past: %d, n_threads: %d, embd_size: %zu",
                 n_eval,
@@ -169,6 +408,9 @@ completion_token_output cactus_context::nextToken()
             return result;
         }
         n_past += n_eval;
+        if (n_past == speaker_capture_at) {
+            captureSpeakerPrefix();
+        }
 
         if(is_interrupted) {
             LOG_INFO("Decoding Interrupted");
@@ -178,6 +420,17 @@ completion_token_output cactus_context::nextToken()
         }
     }
 
+    if (!forward_guide) {
+        n_forwarded = 0;
+    }
+
+    if (prompt_cache_pending && !forward_guide) {
+        savePromptCache();
+    }
+    if (prefix_cache_pending && !forward_guide) {
+        storePrefixCache();
+    }
+
     if (!model) {
         LOG_ERROR("Model is null in nextToken");
         has_next_token = false;
@@ -198,34 +451,62 @@ completion_token_output cactus_context::nextToken()
     }
 
     {
-        std::vector<llama_token_data> candidates;
-        candidates.reserve(llama_vocab_n_tokens(vocab));
-
-        llama_token new_token_id = common_sampler_sample(ctx_sampling, ctx, -1);
-
-        if (next_token_uses_guide_token && !guide_tokens.empty() && 
-            !llama_vocab_is_control(vocab, new_token_id) && 
-            !llama_vocab_is_eog(vocab, new_token_id)) {
-            new_token_id = guide_tokens[0];
-            guide_tokens.erase(guide_tokens.begin());
+        llama_token new_token_id;
+        const bool lean = !forward_guide && canSampleLean();
+        const int64_t t_sample = stageTimed() ? llama_time_us() : 0;
+        if (forward_guide) {
+            new_token_id = guide_tokens[guide_cursor++];
+            n_forwarded++;
+        } else {
+            new_token_id = lean ? sampleLean() : common_sampler_sample(ctx_sampling, ctx, -1);
+            if (next_token_uses_guide_token && hasGuideTokens() &&
+                !llama_vocab_is_control(vocab, new_token_id) &&
+                !llama_vocab_is_eog(vocab, new_token_id)) {
+                new_token_id = guide_tokens[guide_cursor++];
+            }
         }
-        next_token_uses_guide_token = (new_token_id == 198);
+        next_token_uses_guide_token = guide_newline_token >= 0 && new_token_id == guide_newline_token;
         result.tok = new_token_id;
 
-        llama_token_data_array cur_p = *common_sampler_get_candidates(ctx_sampling);
-
         const int32_t n_probs = params.sampling.n_probs;
-        const size_t vocab_size = llama_vocab_n_tokens(vocab);
+        if (probs_history_limit == 0 && (n_probs > 0 || params.sampling.token_stats)) {
+            // kept in the history until the request ends, which then drops them all at once
+            result.probs = decltype(result.probs)(cactus_arena_allocator<completion_token_output::token_prob>(&request_arena));
+        }
+        if (params.sampling.token_stats && !forward_guide) {
+            // Read straight off the logits row, so the cost does not depend on the sampler chain
+            const int n_vocab = llama_vocab_n_tokens(vocab);
+            common_logits_stats(llama_get_logits_ith(ctx, -1), n_vocab, result.tok, std::max(n_probs, 0), token_stats);
+            result.has_stats = true;
+            result.logsumexp = token_stats.logsumexp;
+            result.logprob = token_stats.logprob;
+            result.entropy = token_stats.entropy;
+            result.probs.reserve(token_stats.top.size());
+            for (const auto &c : token_stats.top) {
+                result.probs.push_back({c.id, std::exp(c.p)});
+            }
+        } else if (n_probs > 0) {
+            const llama_token_data_array *cur_p = common_sampler_get_candidates(ctx_sampling);
+            const size_t vocab_size = llama_vocab_n_tokens(vocab);
+            const size_t n_keep = std::min((size_t)cur_p->size, (size_t)n_probs);
 
-        for (size_t i = 0; i < std::min((size_t)cur_p.size, (size_t)n_probs); ++i)
-        {
-            if (cur_p.data[i].id < vocab_size) {
-                 result.probs.push_back({cur_p.data[i].id, cur_p.data[i].p});
+            result.probs.reserve(n_keep);
+            for (size_t i = 0; i < n_keep; ++i)
+            {
+                const llama_token id = cur_p->data[i].id;
+                if (id >= 0 && (size_t)id < vocab_size) {
+                     result.probs.push_back({id, cur_p->data[i].p});
+                }
             }
         }
 
+        const int64_t t_accept = stageTimed() ? recordStage(profile.sample_us, "sample", t_sample) : 0;
         common_sampler_accept(ctx_sampling, result.tok, true);
-        if (tg) {
+        acceptForcedGrammar(result.tok);
+        if (stageTimed()) {
+            recordStage(profile.grammar_us, "grammar", t_accept);
+        }
+        if (tg || forward_guide) {
             num_tokens_predicted++;
         }
     }
@@ -244,6 +525,13 @@ completion_token_output cactus_context::nextToken()
     }
 
     has_next_token = params.n_predict == -1 || n_remain > 0;
+    if (has_next_token && forced_grammar != nullptr) {
+        const int64_t t_forced = stageTimed() ? llama_time_us() : 0;
+        queueForcedTokens();
+        if (stageTimed()) {
+            recordStage(profile.grammar_us, "grammar", t_forced);
+        }
+    }
     return result;
 }
 
@@ -288,62 +576,117 @@ size_t cactus_context::findStoppingStrings(const std::string &text, const size_t
         return stop_pos;
 }
 
+void cactus_context::reserveGenerationBuffers() {
+    if (embd.capacity() < (size_t)params.n_ctx) {
+        embd.reserve(params.n_ctx);
+    }
+    const size_t n_text = (size_t)(params.n_predict > 0 ? params.n_predict : params.n_ctx) * 4;
+    if (generated_text.capacity() < n_text) {
+        generated_text.reserve(n_text);
+    }
+    const size_t n_history = probs_history_limit > 0 && params.n_predict > 0
+        ? std::min(probs_history_limit, (size_t)params.n_predict)
+        : (probs_history_limit > 0 ? probs_history_limit : (size_t)std::max(0, params.n_predict));
+    const bool keep_history = params.sampling.n_probs > 0 || params.sampling.token_stats;
+    if (keep_history && n_history > 0 && generated_token_probs.capacity() < n_history) {
+        generated_token_probs.reserve(n_history);
+    }
+}
+
+// Continuation bytes still missing after the bytes, given those missing before them
+static int utf8_pending_after(int pending, std::string_view bytes) {
+    for (const char ch : bytes) {
+        const unsigned char c = (unsigned char)ch;
+        if ((c & 0xC0) == 0x80) {
+            pending = pending > 0 ? pending - 1 : 0;
+        } else if ((c & 0xE0) == 0xC0) {
+            pending = 1;
+        } else if ((c & 0xF0) == 0xE0) {
+            pending = 2;
+        } else if ((c & 0xF8) == 0xF0) {
+            pending = 3;
+        } else {
+            pending = 0;
+        }
+    }
+    return pending;
+}
+
 completion_token_output cactus_context::doCompletion()
 {
+    reserveGenerationBuffers();
+    const size_t embd_capacity = embd.capacity();
+    const size_t text_capacity = generated_text.capacity();
+    const size_t arena_mallocs = request_arena.n_mallocs();
+
     const completion_token_output token_with_probs = nextToken();
 
     if (token_with_probs.tok == -1 && !has_next_token) {
         return token_with_probs;
     }
     
-    std::string token_text;
+    const int64_t t_detokenize = stageTimed() ? llama_time_us() : 0;
+    token_piece = {};
     if (ctx && token_with_probs.tok != -1) {
-         token_text = common_token_to_piece(ctx, token_with_probs.tok);
+        token_piece = cached_token_piece(llama_model_get_vocab(model), token_with_probs.tok);
     }
+    const std::string_view token_text = token_piece;
     generated_text += token_text;
+    utf8_pending = utf8_pending_after(utf8_pending, token_text);
+
+    const int64_t t_stop = stageTimed() ? recordStage(profile.detokenize_us, "detokenize", t_detokenize) : 0;
+    profile.n_tokens++;
+    const size_t stop_pos = stop_matcher.feed(token_text);
+    if (stop_pos != std::string::npos) {
+        generated_text.erase(stop_pos);
+        // the lead byte of an unfinished sequence is within the last 3 bytes
+        utf8_pending = utf8_pending_after(0, std::string_view(generated_text).substr(generated_text.size() - std::min<size_t>(generated_text.size(), 4)));
+        stopping_word = stop_matcher.matchedWord();
+        stopped_word = true;
+        has_next_token = false;
+        discardPendingTokens();
+    }
+    if (stageTimed()) {
+        recordStage(profile.stop_us, "stop_match", t_stop);
+    }
 
     if (isVocoderEnabled()) {
         tts_type type = getTTSType();
         if ((type == TTS_OUTETTS_V0_2 || type == TTS_OUTETTS_V0_3) && 
             (token_with_probs.tok >= 151672 && token_with_probs.tok <= 155772)) {
             audio_tokens.push_back(token_with_probs.tok);
+            if (speech_stream.worker && !vocodeSpeechStream(false)) {
+                is_interrupted = true;
+            }
         }
     }
 
-    if (params.sampling.n_probs > 0)
+    if (params.sampling.n_probs > 0 || params.sampling.token_stats)
     {
+        // Keep the history bounded by dropping the oldest half at once
+        if (probs_history_limit > 0 && generated_token_probs.size() >= probs_history_limit) {
+            generated_token_probs.erase(generated_token_probs.begin(),
+                                        generated_token_probs.begin() + (generated_token_probs.size() + 1) / 2);
+        }
         generated_token_probs.push_back(token_with_probs);
     }
 
-    incomplete = false;
-    if (!generated_text.empty()) {
-         unsigned char c = generated_text.back();
-         int expected_continuation_bytes = 0;
-         if ((c & 0xC0) == 0x80) {
-             int lookback = 1;
-             while (lookback < 4 && lookback < generated_text.size()) {
-                 unsigned char prev_c = generated_text[generated_text.size() - 1 - lookback];
-                 if ((prev_c & 0xC0) == 0xC0) {
-                     if      ((prev_c & 0xE0) == 0xC0) expected_continuation_bytes = 1;
-                     else if ((prev_c & 0xF0) == 0xE0) expected_continuation_bytes = 2;
-                     else if ((prev_c & 0xF8) == 0xF0) expected_continuation_bytes = 3;
-                     incomplete = lookback < expected_continuation_bytes;
-                     break;
-                 } else if ((prev_c & 0x80) == 0x00) {
-                     break;
-                 }
-                 lookback++;
-             }
-         } else if ((c & 0xE0) == 0xC0) {
-            incomplete = true;
-         } else if ((c & 0xF0) == 0xE0) {
-             incomplete = true;
-         } else if ((c & 0xF8) == 0xF0) {
-             incomplete = true;
-         }
-    }
-
-    if (incomplete && !has_next_token)
+    incomplete = utf8_pending > 0;
+
+    // Hold back bytes that may still turn into a stop string
+    const size_t text_sent = text_delta_offset + text_delta_size;
+    size_t text_ready = generated_text.size();
+    if (has_next_token) {
+        text_ready -= std::min(text_ready, stop_matcher.partialLength());
+    }
+    text_delta_offset = text_sent;
+    text_delta_size = (incomplete || text_ready < text_sent) ? 0 : text_ready - text_sent;
+    // JSON the model writes before a lazy tool grammar triggers is prose, not a call
+    if (scan_tool_calls && !awaitingGrammarTrigger()) {
+        tool_scanner.feed(lastTextDelta());
+    }
+
+    if (incomplete && !has_next_token && !stopped_word)
     {
         has_next_token = true;
         if (params.n_predict != -1) {
@@ -356,9 +699,18 @@ completion_token_output cactus_context::doCompletion()
         stopped_limit = true;
     }
 
+    if (thermal_pacing_us > 0 && has_next_token) {
+        thermalPace();
+    }
+
+    n_hot_path_allocs += (embd.capacity() != embd_capacity) +
+                         (generated_text.capacity() != text_capacity) +
+                         (token_with_probs.probs.capacity() > 0 && token_with_probs.probs.get_allocator().arena == nullptr) +
+                         (request_arena.n_mallocs() - arena_mallocs);
+
     LOG_VERBOSE("next token, token_id: %d, token_text: %s, has_next_token: %d, n_remain: %d, incomplete: %d, num_tokens_predicted: %d, stopped_eos: %d, stopped_word: %d, stopped_limit: %d, stopping_word: %s",
         token_with_probs.tok,
-        tokens_to_output_formatted_string(ctx, token_with_probs.tok).c_str(),
+        format_token_piece(token_piece).c_str(),
         has_next_token,
         n_remain,
         incomplete,
@@ -371,4 +723,8 @@ completion_token_output cactus_context::doCompletion()
     return token_with_probs;
 }
 
+std::string_view cactus_context::lastTextDelta() const {
+    return std::string_view(generated_text).substr(text_delta_offset, text_delta_size);
+}
+
 } // namespace cactus
\ No newline at end of file
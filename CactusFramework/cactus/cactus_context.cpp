@@ -11,13 +11,32 @@ cactus_context::~cactus_context() {
         common_sampler_free(ctx_sampling);
         ctx_sampling = nullptr;
     }
+    if (batch.token != nullptr) {
+        llama_batch_free(batch);
+        batch = {};
+    }
     releaseMultimodal();
     releaseVocoder();
+    releaseDraftModel();
+    releaseForcedGrammar();
+    unmergeLoraAdapter();
+    if (ctx != nullptr && !lora.empty()) {
+        llama_clear_adapter_lora(ctx);
+    }
+    if (ctx != nullptr && !seq_lora.empty()) {
+        llama_clear_adapter_lora_seq(ctx, -1);
+    }
+    lora.clear();
+    seq_lora.clear();
+    lora_registry.clear();
 }
 
 void cactus_context::rewind() {
     is_interrupted = false;
     is_predicting = false;
+    if (lora_merge_job) {
+        finishLoraMerge();
+    }
     params.antiprompt.clear();
     params.sampling.grammar.clear();
     num_prompt_tokens = 0;
@@ -35,10 +54,22 @@ void cactus_context::rewind() {
     n_remain = 0;
     n_past = 0;
     embd.clear();
+    pending_tokens.clear();
+    for (auto &state : sequence_states) {
+        dropSpill(state.first);
+    }
+    sequence_states.clear();
     next_token_uses_guide_token = true;
     guide_tokens.clear();
+    guide_cursor = 0;
+    n_forwarded = 0;
+    forced_tokens.clear();
+    forced_cursor = 0;
     mtmd_bitmap_past_hashes.clear();
+    mtmd_past_chunks.clear();
     audio_tokens.clear();
+    prefix_cache.clear();
+    prefix_cache_pending = false;
     if (ctx_sampling) {
     }
     if (ctx) {
@@ -46,29 +77,192 @@ void cactus_context::rewind() {
     }
 }
 
-bool cactus_context::initSampling() {
-    if (ctx_sampling != nullptr) {
-        common_sampler_free(ctx_sampling);
-        ctx_sampling = nullptr;
+bool cactus_context::setActiveSequence(llama_seq_id id) {
+    if (ctx == nullptr || id < 0 || id >= sessionSequences()) {
+        LOG_ERROR("Invalid sequence id: %d", id);
+        return false;
     }
-    if (model) {
-        ctx_sampling = common_sampler_init(model, params.sampling);
-        if (ctx_sampling) {
-             params.sampling.n_prev = n_ctx;
+    if (id == seq_id) {
+        return true;
+    }
+
+    discardPendingTokens();
+    cactus_sequence_state &current = sequence_states[seq_id];
+    current.embd = std::move(embd);
+    current.n_past = n_past;
+    current.stream_cut = stream_cut;
+    current.stream_hash = stream_hash;
+    current.last_active = ++sequence_clock;
+
+    auto it = sequence_states.find(id);
+    if (it != sequence_states.end() && it->second.spilled) {
+        unspillSequence(id);
+    }
+    if (it != sequence_states.end()) {
+        embd = std::move(it->second.embd);
+        n_past = it->second.n_past;
+        stream_cut = it->second.stream_cut;
+        stream_hash = it->second.stream_hash;
+        sequence_states.erase(it);
+    } else {
+        embd.clear();
+        n_past = 0;
+        stream_cut = 0;
+        stream_hash = 0;
+    }
+    seq_id = id;
+    mtmd_bitmap_past_hashes.clear();
+    mtmd_past_chunks.clear();
+    return true;
+}
+
+void cactus_context::releaseSequence(llama_seq_id id) {
+    if (ctx != nullptr) {
+        llama_kv_self_seq_rm(ctx, id, -1, -1);
+    }
+    dropSpill(id);
+    sequence_states.erase(id);
+    tool_turns.erase(id);
+    if (seq_lora.erase(id) > 0 && ctx != nullptr) {
+        llama_clear_adapter_lora_seq(ctx, id);
+        trimLoraAdapters();
+    }
+    if (id == seq_id) {
+        embd.clear();
+        n_past = 0;
+        stream_cut = 0;
+        stream_hash = 0;
+    }
+}
+
+std::vector<llama_seq_id> cactus_context::idleSequences(int32_t n_max) const {
+    std::vector<llama_seq_id> idle;
+    for (llama_seq_id id = 0; id < sessionSequences() && (int32_t)idle.size() < n_max; id++) {
+        if (id != seq_id && sequence_states.find(id) == sequence_states.end()) {
+            idle.push_back(id);
         }
+    }
+    return idle;
+}
+
+bool cactus_context::setSequenceQuota(llama_seq_id id, uint32_t n_max_cells, llama_kv_evict_policy policy, uint32_t n_sink) {
+    if (ctx == nullptr || id < 0 || id >= sessionSequences()) {
+        LOG_ERROR("Invalid sequence id: %d", id);
+        return false;
+    }
+    if (n_max_cells == 0) {
+        kv_quotas.erase(id);
     } else {
+        kv_quotas[id] = {n_max_cells, n_sink, policy};
+    }
+    llama_kv_self_seq_set_quota(ctx, id, n_max_cells, policy, n_sink);
+    return true;
+}
+
+bool cactus_context::initSampling() {
+    if (!model) {
         LOG_ERROR("Cannot initialize sampling context: model is not loaded.");
         return false;
     }
-    return ctx_sampling != nullptr;
+    // The history has to cover penalty_last_n for the lean sampler to count repeats
+    params.sampling.n_prev = n_ctx;
+    // A sampler from an earlier turn keeps its token history, so loading a prompt that extends it
+    // only accepts the new tokens
+    if (ctx_sampling == nullptr) {
+        ctx_sampling = common_sampler_init(model, params.sampling);
+    } else if (!common_sampler_reconfigure(ctx_sampling, model, params.sampling)) {
+        common_sampler_free(ctx_sampling);
+        ctx_sampling = nullptr;
+    }
+    if (ctx_sampling == nullptr) {
+        return false;
+    }
+    initForcedGrammar();
+    configureLeanSampling();
+    return true;
 }
 
 void cactus_context::setGuideTokens(const std::vector<llama_token> &tokens) {
     guide_tokens = tokens;
+    guide_cursor = 0;
+    n_forwarded = 0;
+    guide_newline_token = -1;
+    if (model) {
+        const std::vector<llama_token> newline = common_tokenize(llama_model_get_vocab(model), "\n", false, true);
+        if (!newline.empty()) {
+            guide_newline_token = newline[0];
+        }
+    }
+}
+
+bool cactus_context::hasGuideTokens() const {
+    return guide_cursor < guide_tokens.size();
 }
 
 void cactus_context::endCompletion() {
     is_predicting = false;
+    abort_hook = nullptr;
+    abort_batch = false;
+    deadline = std::chrono::steady_clock::time_point::max();
+    armAbortCallback();
+    speech_stream = cactus_speech_stream();
+    discardPendingTokens();
+    if (recording_open) {
+        recording_open = false;
+        cactus_request_record &record = request_records.back();
+        // every sampled token is pushed onto embd, the first one included
+        record.n_generated = embd.size() > record.n_prompt_tokens ? embd.size() - record.n_prompt_tokens : num_tokens_predicted;
+        record.duration_us = llama_time_us() - recording_start_us - record.t_offset_us;
+    }
+}
+
+bool cactus_context::shouldAbort() {
+    if (is_interrupted) {
+        return true;
+    }
+    if (abort_hook && abort_hook()) {
+        is_interrupted = true;
+        return true;
+    }
+    if (deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= deadline) {
+        LOG_WARNING("Completion exceeded its %lld ms deadline", (long long)timeout_ms);
+        timed_out = true;
+        is_interrupted = true;
+        return true;
+    }
+    return false;
+}
+
+void cactus_context::setAbortHook(std::function<bool()> hook) {
+    abort_hook = std::move(hook);
+    armAbortCallback();
+}
+
+// A backend with an abort callback checks it between command buffers, which on Metal means it
+// stops encoding ahead of the GPU; the callback is only installed while something can abort, or
+// for batches long enough that is_interrupted must be seen before the graph ends. Single-token
+// decodes leave a bare stop to the check between tokens.
+void cactus_context::armAbortCallback() {
+    const bool armed = abort_hook || abort_batch || deadline != std::chrono::steady_clock::time_point::max();
+    if (armed == abort_armed) {
+        return;
+    }
+    abort_armed = armed;
+    if (ctx) {
+        llama_set_abort_callback(ctx, armed ? cactus_abort_callback : nullptr, armed ? this : nullptr);
+    }
+    if (draft_wrapper && draft_wrapper->ctx) {
+        llama_set_abort_callback(draft_wrapper->ctx, armed ? cactus_abort_callback : nullptr, armed ? this : nullptr);
+    }
+}
+
+void cactus_context::armAbortForBatch(int n_tokens) {
+    abort_batch = n_tokens > 1;
+    armAbortCallback();
+}
+
+bool cactus_abort_callback(void *data) {
+    return static_cast<cactus_context *>(data)->shouldAbort();
 }
 
 } // namespace cactus
\ No newline at end of file
@@ -0,0 +1,74 @@
+#include "cactus.h"
+#include "common.h"
+#include "llama.h"
+#include <algorithm>
+#include <vector>
+#include <string>
+
+namespace cactus {
+
+int cactus_context::applyControlVectors(const std::vector<common_control_vector_load_info> &vectors, int32_t il_start, int32_t il_end) {
+    if (!ctx || !model) {
+        LOG_ERROR("Context or model not initialized for applying control vectors.");
+        return -1;
+    }
+    if (vectors.empty()) {
+        removeControlVectors();
+        return 0;
+    }
+
+    const int64_t t_start = lm_ggml_time_us();
+    common_control_vector_data combined = { -1, {} };
+    for (const auto &cv : vectors) {
+        auto it = control_vector_cache.find(cv.fname);
+        if (it == control_vector_cache.end()) {
+            common_control_vector_data loaded = common_control_vector_load({ { 1.0f, cv.fname } });
+            if (loaded.n_embd == -1) {
+                LOG_ERROR("Failed to load control vector '%s'", cv.fname.c_str());
+                return -1;
+            }
+            it = control_vector_cache.emplace(cv.fname, std::move(loaded)).first;
+        }
+        const common_control_vector_data &cur = it->second;
+        if (combined.n_embd != -1 && combined.n_embd != cur.n_embd) {
+            LOG_ERROR("Control vector '%s' does not match the dimensions of the previous ones", cv.fname.c_str());
+            return -1;
+        }
+        combined.n_embd = cur.n_embd;
+        combined.data.resize(std::max(combined.data.size(), cur.data.size()), 0.0f);
+        for (size_t i = 0; i < cur.data.size(); i++) {
+            combined.data[i] += cur.data[i] * cv.strength;
+        }
+    }
+
+    if (il_start <= 0) {
+        il_start = 1;
+    }
+    if (il_end <= 0) {
+        il_end = llama_model_n_layer(model);
+    }
+    if (llama_apply_adapter_cvec(ctx, combined.data.data(), combined.data.size(), combined.n_embd, il_start, il_end) != 0) {
+        LOG_ERROR("Failed to apply control vectors, n_embd: %d", combined.n_embd);
+        return -1;
+    }
+
+    control_vectors = vectors;
+    control_vector = std::move(combined);
+    control_vector_layer_start = il_start;
+    control_vector_layer_end = il_end;
+    LOG_INFO("Applied %zu control vectors to layers %d-%d in %.3f ms", vectors.size(), il_start, il_end,
+             (lm_ggml_time_us() - t_start) / 1000.0);
+    return 0;
+}
+
+void cactus_context::removeControlVectors() {
+    if (ctx != nullptr && !control_vector.data.empty()) {
+        llama_apply_adapter_cvec(ctx, nullptr, 0, 0, 0, 0);
+    }
+    control_vectors.clear();
+    control_vector = { -1, {} };
+    control_vector_layer_start = -1;
+    control_vector_layer_end = -1;
+}
+
+} // namespace cactus
@@ -1,44 +1,398 @@
 #include "cactus.h"
 #include "common.h"
 #include "llama.h"
+#include <algorithm>
 #include <vector>
 #include <cstdio>
 
 namespace cactus {
 
-std::vector<float> cactus_context::getEmbedding(common_params &embd_params) 
+static int evaluate_embedding_batch(llama_context *ctx, const llama_model *model, llama_batch &batch) {
+    if (llama_model_has_encoder(model) && !llama_model_has_decoder(model)) {
+        return llama_encode(ctx, batch);
+    }
+    return llama_decode(ctx, batch);
+}
+
+// Euclidean normalization of pooled rows runs in the graph, on the device that pooled them
+static bool normalizes_in_graph(llama_context *ctx, int embd_normalize) {
+    const enum llama_pooling_type type = llama_pooling_type(ctx);
+    return embd_normalize == 2 && type != LLAMA_POOLING_TYPE_NONE && type != LLAMA_POOLING_TYPE_RANK;
+}
+
+// A row the graph normalized only needs normalizing again when truncated, which gives the same as
+// normalizing the leading dims of the raw row
+static void finish_embedding(const float *data, float *out, int n_out, int n_embd, int embd_normalize, bool normalized) {
+    if (normalized && n_out == n_embd) {
+        std::copy(data, data + n_out, out);
+    } else {
+        common_embd_normalize(data, out, n_out, embd_normalize);
+    }
+}
+
+int cactus_context::embeddingDims(int dims) const
+{
+    const int n_embd = model ? llama_model_n_embd(model) : 0;
+    return dims > 0 && dims < n_embd ? dims : n_embd;
+}
+
+// Encodes text on the active sequence without a sampler; only the tokens the pooling reads are
+// outputs and only that sequence's KV cells are touched
+std::vector<float> cactus_context::getEmbedding(const std::string &text, int dims)
 {
     if (!ctx || !model) {
-        LOG_ERROR("Context or model not initialized for embedding generation.");
+        LOG_ERROR("Context or model not initialized for embedding generation.", "");
         return {};
     }
-    
-    const int n_embd = llama_model_n_embd(model);
+
+    const int n_out = embeddingDims(dims);
     if (!params.embedding)
     {
-        LOG_WARNING("Embedding mode not enabled for this context.");
-        return std::vector<float>(n_embd, 0.0f);
+        LOG_WARNING("Embedding mode not enabled for this context.", "");
+        return std::vector<float>(n_out, 0.0f);
+    }
+    if (is_predicting) {
+        LOG_ERROR("Cannot embed while a completion is running", "");
+        return {};
     }
 
-    float *data = nullptr;
-    const enum llama_pooling_type pooling_type = llama_pooling_type(ctx);
+    uint64_t cache_key = 0;
+    uint64_t cache_check = 0;
+    if (embedding_cache) {
+        embeddingCacheKey(text, n_out, cache_key, cache_check);
+        std::vector<float> cached(n_out);
+        if (embedding_cache->lookup(cache_key, cache_check, cached.data(), n_out)) {
+            n_embd_cache_hits++;
+            return cached;
+        }
+        n_embd_cache_misses++;
+    }
 
-    if (pooling_type == LLAMA_POOLING_TYPE_NONE) {
-        data = llama_get_embeddings(ctx);
-    } else {
-        data = llama_get_embeddings_seq(ctx, 0);
+    const bool pooled = llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_NONE;
+    const bool normalized = normalizes_in_graph(ctx, params.embd_normalize);
+    llama_set_embeddings_normalize(ctx, normalized);
+    // A pooled sequence must fit one ubatch; unpooled ones are fed in batches up to the last token
+    const int n_chunk = pooled ? (int)llama_n_ubatch(ctx) : params.n_batch;
+    std::vector<llama_token> tokens = common_tokenize(ctx, text, true, true, params.cpuparams.n_threads);
+    if (pooled && (int)tokens.size() > n_chunk) {
+        LOG_WARNING("Embedding input has %zu tokens, truncating to n_ubatch %d", tokens.size(), n_chunk);
+        tokens.resize(n_chunk);
+    }
+    std::vector<float> out(n_out, 0.0f);
+    if (tokens.empty()) {
+        return out;
     }
 
-    if (!data) {
-        LOG_WARNING("Failed to retrieve embeddings from llama context.");
-        return std::vector<float>(n_embd, 0.0f);
+    is_predicting = true;
+    llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+    llama_batch batch = llama_batch_init(n_chunk, 0, 1);
+    bool ok = true;
+    for (size_t k = 0; k < tokens.size() && ok; k += n_chunk) {
+        llama_batch_clear(&batch);
+        const size_t n_eval = std::min((size_t)n_chunk, tokens.size() - k);
+        for (size_t t = 0; t < n_eval; t++) {
+            const bool last = k + t + 1 == tokens.size();
+            llama_batch_add(&batch, tokens[k + t], (llama_pos)(k + t), {seq_id}, pooled || last);
+        }
+        if (evaluate_embedding_batch(ctx, model, batch) < 0) {
+            LOG_ERROR("Failed to evaluate embedding input", "");
+            ok = false;
+        }
     }
 
-    std::vector<float> embedding(data, data + n_embd);
-    std::vector<float> out(n_embd);
+    if (ok) {
+        const float *data = pooled ? llama_get_embeddings_seq(ctx, seq_id) : llama_get_embeddings_ith(ctx, batch.n_tokens - 1);
+        if (data) {
+            // Matryoshka truncation: the leading dims are normalized on their own
+            finish_embedding(data, out.data(), n_out, llama_model_n_embd(model), params.embd_normalize, normalized);
+            if (embedding_cache) {
+                embedding_cache->store(cache_key, cache_check, out.data(), n_out);
+            }
+        } else {
+            LOG_WARNING("Failed to retrieve embeddings from llama context.", "");
+        }
+    }
 
-    common_embd_normalize(embedding.data(), out.data(), n_embd, params.embd_normalize);
+    llama_batch_free(batch);
+    llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+    embd.clear();
+    n_past = 0;
+    is_predicting = false;
     return out;
 }
 
-} // namespace cactus
\ No newline at end of file
+// First-fit decreasing: longest texts first, each into the first ubatch with room for its tokens
+// and a free sequence slot, so short texts fill the space long ones leave
+static std::vector<std::vector<size_t>> pack_embedding_batches(const std::vector<std::vector<llama_token>> &tokens,
+                                                               int n_ubatch, int n_seq_max) {
+    std::vector<size_t> order(tokens.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&tokens](size_t a, size_t b) {
+        return tokens[a].size() > tokens[b].size();
+    });
+
+    std::vector<std::vector<size_t>> batches;
+    std::vector<int> room;
+    // Batches before first_open have no sequence slot or token left
+    size_t first_open = 0;
+    for (size_t index : order) {
+        const int n = (int)tokens[index].size();
+        size_t b = first_open;
+        while (b < batches.size() && (room[b] < n || (int)batches[b].size() >= n_seq_max)) {
+            b++;
+        }
+        if (b == batches.size()) {
+            batches.emplace_back();
+            room.push_back(n_ubatch);
+        }
+        batches[b].push_back(index);
+        room[b] -= n;
+        while (first_open < batches.size() && ((int)batches[first_open].size() >= n_seq_max || room[first_open] == 0)) {
+            first_open++;
+        }
+    }
+    return batches;
+}
+
+bool cactus_context::getEmbeddings(const std::vector<std::string> &texts, std::vector<float> &out,
+                                   const std::function<void(size_t index, const float *row)> &on_row, int dims)
+{
+    if (!ctx || !model || !params.embedding) {
+        LOG_ERROR("Embedding mode not enabled or context not initialized.", "");
+        return false;
+    }
+    if (is_predicting) {
+        LOG_ERROR("Cannot embed while a completion is running", "");
+        return false;
+    }
+
+    const int n_out = embeddingDims(dims);
+    const enum llama_pooling_type pooling_type = llama_pooling_type(ctx);
+    const bool pooled = pooling_type != LLAMA_POOLING_TYPE_NONE;
+    // Pooling needs a whole sequence in one ubatch, so every text has to fit in one
+    const int n_ubatch = (int)llama_n_ubatch(ctx);
+    const int n_seq_max = (int)llama_n_seq_max(ctx);
+
+    out.assign(texts.size() * n_out, 0.0f);
+    std::vector<bool> done(texts.size(), false);
+    // Cached texts are done up front; only the misses are tokenized and packed
+    std::vector<uint64_t> cache_keys(embedding_cache ? texts.size() : 0);
+    std::vector<uint64_t> cache_checks(cache_keys.size());
+    std::vector<size_t> pending;
+    pending.reserve(texts.size());
+    for (size_t i = 0; i < texts.size(); i++) {
+        if (embedding_cache) {
+            embeddingCacheKey(texts[i], n_out, cache_keys[i], cache_checks[i]);
+            if (embedding_cache->lookup(cache_keys[i], cache_checks[i], out.data() + i * n_out, n_out)) {
+                n_embd_cache_hits++;
+                done[i] = true;
+                continue;
+            }
+            n_embd_cache_misses++;
+        }
+        pending.push_back(i);
+    }
+
+    std::vector<std::vector<llama_token>> tokens(pending.size());
+    for (size_t p = 0; p < pending.size(); p++) {
+        tokens[p] = common_tokenize(ctx, texts[pending[p]], true, true);
+        if ((int)tokens[p].size() > n_ubatch) {
+            LOG_WARNING("Embedding input %zu has %zu tokens, truncating to n_ubatch %d", pending[p], tokens[p].size(), n_ubatch);
+            tokens[p].resize(n_ubatch);
+        }
+    }
+    const std::vector<std::vector<size_t>> batches = pack_embedding_batches(tokens, n_ubatch, n_seq_max);
+
+    is_predicting = true;
+    // Every sequence is cleared for the batches, cached prefixes included
+    prefix_cache.clear();
+    llama_batch batch = llama_batch_init(n_ubatch, 0, 1);
+    // The pooled, normalized rows of a batch land in one matrix, row s for sequence s
+    const int n_embd = llama_model_n_embd(model);
+    const bool normalized = normalizes_in_graph(ctx, params.embd_normalize);
+    std::vector<float> pooled_rows(pooled ? (size_t)n_seq_max * n_embd : 0);
+    llama_set_embeddings_normalize(ctx, normalized);
+    // The context writes into pooled_rows until this returns, thrown out of by on_row or not
+    struct seq_out_guard {
+        llama_context *ctx;
+        ~seq_out_guard() {
+            if (ctx) {
+                llama_set_embeddings_seq_out(ctx, nullptr, 0);
+            }
+        }
+    } seq_out{pooled ? ctx : nullptr};
+    if (pooled) {
+        llama_set_embeddings_seq_out(ctx, pooled_rows.data(), n_seq_max);
+    }
+    std::vector<int32_t> last_index;
+    last_index.reserve(n_seq_max);
+    size_t next_row = 0;
+    bool ok = true;
+
+    // Rows are handed out in input order as soon as every earlier row is ready
+    auto emit_ready = [&]() {
+        while (next_row < texts.size() && done[next_row]) {
+            if (on_row) {
+                on_row(next_row, out.data() + next_row * n_out);
+            }
+            next_row++;
+        }
+    };
+    emit_ready();
+
+    for (size_t b = 0; b < batches.size() && ok && !is_interrupted; b++) {
+        const std::vector<size_t> &members = batches[b];
+        llama_batch_clear(&batch);
+        last_index.clear();
+        for (size_t seq = 0; seq < members.size(); seq++) {
+            const std::vector<llama_token> &seq_tokens = tokens[members[seq]];
+            for (size_t t = 0; t < seq_tokens.size(); t++) {
+                llama_batch_add(&batch, seq_tokens[t], (llama_pos)t, {(llama_seq_id)seq}, pooled || t + 1 == seq_tokens.size());
+            }
+            last_index.push_back(batch.n_tokens - 1);
+        }
+
+        if (batch.n_tokens > 0) {
+            llama_kv_self_clear(ctx);
+            if (evaluate_embedding_batch(ctx, model, batch) < 0) {
+                LOG_ERROR("Failed to evaluate embedding batch of %d tokens", batch.n_tokens);
+                ok = false;
+                break;
+            }
+        }
+
+        for (size_t seq = 0; seq < members.size(); seq++) {
+            const size_t i = pending[members[seq]];
+            done[i] = true;
+            if (tokens[members[seq]].empty()) {
+                continue;
+            }
+            const float *data = pooled ? llama_get_embeddings_seq(ctx, (llama_seq_id)seq) : llama_get_embeddings_ith(ctx, last_index[seq]);
+            if (!data) {
+                LOG_WARNING("Failed to retrieve embedding for input %zu", i);
+                continue;
+            }
+            finish_embedding(data, out.data() + i * n_out, n_out, n_embd, params.embd_normalize, normalized);
+            if (embedding_cache) {
+                embedding_cache->store(cache_keys[i], cache_checks[i], out.data() + i * n_out, n_out);
+            }
+        }
+
+        emit_ready();
+    }
+
+    llama_batch_free(batch);
+    llama_kv_self_clear(ctx);
+    embd.clear();
+    n_past = 0;
+    for (auto &state : sequence_states) {
+        dropSpill(state.first);
+    }
+    sequence_states.clear();
+    mtmd_bitmap_past_hashes.clear();
+    mtmd_past_chunks.clear();
+    is_predicting = false;
+    return ok && !is_interrupted;
+}
+
+// [BOS] query [EOS] [SEP] doc [EOS], the pair layout cross-encoder rerankers are trained on
+static void append_rerank_pair(const llama_vocab *vocab, const std::vector<llama_token> &query,
+                               const std::vector<llama_token> &doc, std::vector<llama_token> &out) {
+    auto push = [&out](llama_token token) {
+        if (token != LLAMA_TOKEN_NULL) {
+            out.push_back(token);
+        }
+    };
+    out.clear();
+    out.reserve(query.size() + doc.size() + 4);
+    if (llama_vocab_get_add_bos(vocab)) {
+        push(llama_vocab_bos(vocab));
+    }
+    out.insert(out.end(), query.begin(), query.end());
+    push(llama_vocab_eos(vocab));
+    push(llama_vocab_sep(vocab));
+    out.insert(out.end(), doc.begin(), doc.end());
+    push(llama_vocab_eos(vocab));
+}
+
+bool cactus_context::getRerankScores(const std::string &query, const std::vector<std::string> &documents,
+                                     std::vector<float> &scores)
+{
+    if (!ctx || !model || !params.embedding || llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_RANK) {
+        LOG_ERROR("Reranking needs an embedding context with rank pooling.", "");
+        return false;
+    }
+    if (is_predicting) {
+        LOG_ERROR("Cannot rerank while a completion is running", "");
+        return false;
+    }
+
+    const llama_vocab *vocab = llama_model_get_vocab(model);
+    const int n_ubatch = (int)llama_n_ubatch(ctx);
+    const int n_seq_max = (int)llama_n_seq_max(ctx);
+
+    // The query is tokenized once; documents are cut so each pair fits one ubatch
+    const std::vector<llama_token> query_tokens = common_tokenize(ctx, query, false, false);
+    std::vector<std::vector<llama_token>> tokens(documents.size());
+    std::vector<llama_token> doc_tokens;
+    for (size_t i = 0; i < documents.size(); i++) {
+        doc_tokens = common_tokenize(ctx, documents[i], false, false);
+        append_rerank_pair(vocab, query_tokens, doc_tokens, tokens[i]);
+        if ((int)tokens[i].size() > n_ubatch) {
+            LOG_WARNING("Rerank pair %zu has %zu tokens, truncating to n_ubatch %d", i, tokens[i].size(), n_ubatch);
+            tokens[i].resize(n_ubatch);
+        }
+    }
+    const std::vector<std::vector<size_t>> batches = pack_embedding_batches(tokens, n_ubatch, n_seq_max);
+
+    is_predicting = true;
+    prefix_cache.clear();
+    scores.assign(documents.size(), 0.0f);
+    llama_batch batch = llama_batch_init(n_ubatch, 0, 1);
+    bool ok = true;
+
+    for (size_t b = 0; b < batches.size() && ok && !is_interrupted; b++) {
+        const std::vector<size_t> &members = batches[b];
+        llama_batch_clear(&batch);
+        for (size_t seq = 0; seq < members.size(); seq++) {
+            const std::vector<llama_token> &seq_tokens = tokens[members[seq]];
+            for (size_t t = 0; t < seq_tokens.size(); t++) {
+                llama_batch_add(&batch, seq_tokens[t], (llama_pos)t, {(llama_seq_id)seq}, true);
+            }
+        }
+
+        llama_kv_self_clear(ctx);
+        if (evaluate_embedding_batch(ctx, model, batch) < 0) {
+            LOG_ERROR("Failed to evaluate rerank batch of %d tokens", batch.n_tokens);
+            ok = false;
+            break;
+        }
+        for (size_t seq = 0; seq < members.size(); seq++) {
+            // the classification head's raw score, higher is more relevant
+            const float *score = llama_get_embeddings_seq(ctx, (llama_seq_id)seq);
+            if (!score) {
+                LOG_WARNING("Failed to retrieve rerank score for document %zu", members[seq]);
+                continue;
+            }
+            scores[members[seq]] = score[0];
+        }
+    }
+    LOG_VERBOSE("Reranked %zu documents in %zu batches", documents.size(), batches.size());
+
+    llama_batch_free(batch);
+    llama_kv_self_clear(ctx);
+    embd.clear();
+    n_past = 0;
+    for (auto &state : sequence_states) {
+        dropSpill(state.first);
+    }
+    sequence_states.clear();
+    mtmd_bitmap_past_hashes.clear();
+    mtmd_past_chunks.clear();
+    is_predicting = false;
+    return ok && !is_interrupted;
+}
+
+} // namespace cactus
@@ -0,0 +1,233 @@
+#include "cactus.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cactus {
+
+static const uint32_t EMBED_CACHE_MAGIC = 0x424d4543; // "CEMB"
+static const uint32_t EMBED_CACHE_VERSION = 1;
+
+struct embedding_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t n_embd;
+    uint64_t capacity;
+    uint64_t tick;
+};
+
+// A slot with tick 0 is free; the row of n_embd floats follows each slot header
+struct embedding_cache_slot {
+    uint64_t key;
+    uint64_t check;
+    uint64_t tick;
+};
+
+static uint64_t fnv_hash64(const std::string &data, uint64_t hash) {
+    const uint64_t fnv_prime = 0x100000001b3ULL;
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= fnv_prime;
+    }
+    return hash;
+}
+
+cactus_embedding_cache::~cactus_embedding_cache() {
+    close();
+}
+
+embedding_cache_slot *cactus_embedding_cache::slot(uint32_t index) const {
+    return reinterpret_cast<embedding_cache_slot *>(base + sizeof(embedding_cache_header) + (size_t)index * slot_bytes);
+}
+
+void cactus_embedding_cache::touch(uint32_t index) {
+    embedding_cache_header *header = reinterpret_cast<embedding_cache_header *>(base);
+    slot(index)->tick = ++header->tick;
+    lru.splice(lru.end(), lru, entries[slot(index)->key].second);
+}
+
+// Maps the file shared and writable so stored rows persist without an explicit save; a file
+// written for another row size or capacity is started over
+bool cactus_embedding_cache::open(const std::string &path_, int n_embd_, size_t capacity_) {
+    close();
+    if (n_embd_ <= 0 || capacity_ == 0) {
+        return false;
+    }
+    slot_bytes = sizeof(embedding_cache_slot) + (size_t)n_embd_ * sizeof(float);
+    const size_t size = sizeof(embedding_cache_header) + capacity_ * slot_bytes;
+
+    fd = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        LOG_WARNING("Failed to open embedding cache: %s", path_.c_str());
+        return false;
+    }
+    // The recency index lives in memory, so a second context on the same file would corrupt it
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        LOG_WARNING("Embedding cache is in use by another context: %s", path_.c_str());
+        close();
+        return false;
+    }
+    embedding_cache_header existing = {};
+    struct stat st;
+    const bool reuse = fstat(fd, &st) == 0 && (size_t)st.st_size == size &&
+                       pread(fd, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing) &&
+                       existing.magic == EMBED_CACHE_MAGIC && existing.version == EMBED_CACHE_VERSION &&
+                       existing.n_embd == (uint64_t)n_embd_ && existing.capacity == capacity_;
+    if (!reuse && (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)size) != 0)) {
+        LOG_WARNING("Failed to size embedding cache: %s", path_.c_str());
+        close();
+        return false;
+    }
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        LOG_WARNING("Failed to map embedding cache: %s", path_.c_str());
+        close();
+        return false;
+    }
+    base = static_cast<uint8_t *>(addr);
+    mapped_size = size;
+    n_embd = n_embd_;
+    capacity = capacity_;
+    path = path_;
+
+    embedding_cache_header *header = reinterpret_cast<embedding_cache_header *>(base);
+    if (!reuse) {
+        header->magic = EMBED_CACHE_MAGIC;
+        header->version = EMBED_CACHE_VERSION;
+        header->n_embd = (uint64_t)n_embd;
+        header->capacity = capacity;
+        header->tick = 0;
+    }
+
+    // Rebuild the recency order from the stored ticks, oldest first
+    std::vector<uint32_t> used;
+    for (uint32_t i = 0; i < capacity; i++) {
+        if (slot(i)->tick != 0) {
+            used.push_back(i);
+        } else {
+            free_slots.push_back(i);
+        }
+    }
+    std::sort(used.begin(), used.end(), [this](uint32_t a, uint32_t b) { return slot(a)->tick < slot(b)->tick; });
+    for (uint32_t i : used) {
+        auto inserted = entries.emplace(slot(i)->key, std::make_pair(i, lru.end()));
+        if (!inserted.second) {
+            slot(i)->tick = 0;
+            free_slots.push_back(i);
+            continue;
+        }
+        inserted.first->second.second = lru.insert(lru.end(), i);
+    }
+    LOG_INFO("Embedding cache opened with %zu of %zu entries: %s", entries.size(), capacity, path.c_str());
+    return true;
+}
+
+void cactus_embedding_cache::close() {
+    if (base) {
+        munmap(base, mapped_size);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    base = nullptr;
+    fd = -1;
+    mapped_size = 0;
+    entries.clear();
+    lru.clear();
+    free_slots.clear();
+}
+
+size_t cactus_embedding_cache::size() const {
+    return entries.size();
+}
+
+bool cactus_embedding_cache::lookup(uint64_t key, uint64_t check, float *out, int n) {
+    auto it = entries.find(key);
+    if (!base || it == entries.end() || slot(it->second.first)->check != check) {
+        return false;
+    }
+    const uint32_t index = it->second.first;
+    memcpy(out, slot(index) + 1, (size_t)std::min(n, n_embd) * sizeof(float));
+    touch(index);
+    return true;
+}
+
+void cactus_embedding_cache::store(uint64_t key, uint64_t check, const float *row, int n) {
+    if (!base) {
+        return;
+    }
+    uint32_t index;
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+        index = it->second.first;
+    } else {
+        if (!free_slots.empty()) {
+            index = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            index = lru.front();
+            entries.erase(slot(index)->key);
+            lru.pop_front();
+        }
+        entries[key] = std::make_pair(index, lru.insert(lru.end(), index));
+    }
+    embedding_cache_slot *s = slot(index);
+    s->key = key;
+    s->check = check;
+    n = std::min(n, n_embd);
+    float *values = reinterpret_cast<float *>(s + 1);
+    memcpy(values, row, (size_t)n * sizeof(float));
+    std::fill(values + n, values + n_embd, 0.0f);
+    touch(index);
+}
+
+// Two independently seeded hashes over (model, pooling, normalize, dims, text); the second one
+// guards against a collision on the first
+void cactus_context::embeddingCacheKey(const std::string &text, int dims, uint64_t &key, uint64_t &check) const {
+    char desc[256];
+    llama_model_desc(model, desc, sizeof(desc));
+    std::string identity = desc;
+    identity += "|" + std::to_string(llama_model_n_params(model));
+    identity += "|" + std::to_string(llama_model_size(model));
+    identity += "|" + std::to_string((int)llama_pooling_type(ctx));
+    identity += "|" + std::to_string(params.embd_normalize);
+    identity += "|" + std::to_string(dims);
+    identity += "|";
+    key = fnv_hash64(text, fnv_hash64(identity, 0xcbf29ce484222325ULL));
+    check = fnv_hash64(text, fnv_hash64(identity, 0x84222325cbf29ce4ULL));
+}
+
+bool cactus_context::setEmbeddingCache(const std::string &dir, size_t capacity) {
+    if (dir.empty() || capacity == 0) {
+        embedding_cache.reset();
+        return true;
+    }
+    if (!model || !ctx) {
+        LOG_ERROR("Embedding cache needs a loaded model", "");
+        return false;
+    }
+    // One file per model and pooling setup; the hash of the empty text covers exactly those
+    uint64_t identity = 0;
+    uint64_t unused = 0;
+    embeddingCacheKey("", 0, identity, unused);
+    char name[64];
+    snprintf(name, sizeof(name), "cactus-embed-%016llx.bin", (unsigned long long)identity);
+    std::string file = dir;
+    if (file.back() != '/') {
+        file += '/';
+    }
+    file += name;
+
+    std::unique_ptr<cactus_embedding_cache> cache(new cactus_embedding_cache());
+    if (!cache->open(file, llama_model_n_embd(model), capacity)) {
+        return false;
+    }
+    embedding_cache = std::move(cache);
+    return true;
+}
+
+} // namespace cactus
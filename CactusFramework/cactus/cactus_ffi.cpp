@@ -11,6 +11,10 @@
 #include <sstream>
 #include <iostream>
 #include <climits>
+#include <algorithm>
+#include <memory>
+#include <atomic>
+#include <thread>
 
 static std::vector<std::string> c_str_array_to_vector(const char** arr, int count) {
     std::vector<std::string> vec;
@@ -38,6 +42,102 @@ static char* safe_strdup(const std::string& str) {
 }
 
 
+static void apply_completion_params(cactus::cactus_context* context, const cactus_completion_params_c_t* params) {
+    if (params->n_threads > 0) {
+        context->params.cpuparams.n_threads = params->n_threads;
+    }
+    context->params.n_predict = params->n_predict;
+    context->params.sampling.seed = params->seed;
+    context->params.sampling.temp = params->temperature;
+    context->params.sampling.top_k = params->top_k;
+    context->params.sampling.top_p = params->top_p;
+    context->params.sampling.min_p = params->min_p;
+    context->params.sampling.typ_p = params->typical_p;
+    context->params.sampling.penalty_last_n = params->penalty_last_n;
+    context->params.sampling.penalty_repeat = params->penalty_repeat;
+    context->params.sampling.penalty_freq = params->penalty_freq;
+    context->params.sampling.penalty_present = params->penalty_present;
+    context->params.sampling.mirostat = params->mirostat;
+    context->params.sampling.mirostat_tau = params->mirostat_tau;
+    context->params.sampling.mirostat_eta = params->mirostat_eta;
+    context->params.sampling.ignore_eos = params->ignore_eos;
+    context->params.sampling.n_probs = params->n_probs;
+    context->params.sampling.token_stats = params->token_stats;
+    context->lookup_ngram_size = std::max(0, params->lookup_ngram_size);
+    context->self_spec_skip_layers = std::max(0, params->self_spec_skip_layers);
+    context->context_shift_discard = params->context_shift_discard > 0 ? params->context_shift_discard : 0.5f;
+    context->timeout_ms = std::max<int64_t>(0, params->timeout_ms);
+    context->grammar_fast_forward = params->grammar_fast_forward;
+    context->lean_sampling = params->lean_sampling;
+    context->probs_history_limit = (size_t)std::max(0, params->probs_history_limit);
+    context->truncation = params->truncation_strategy >= cactus::TRUNCATE_KEEP_TAIL && params->truncation_strategy <= cactus::TRUNCATE_MESSAGE_BOUNDARY
+        ? (cactus::truncation_strategy)params->truncation_strategy : cactus::TRUNCATE_KEEP_TAIL;
+    context->params.antiprompt = c_str_array_to_vector(params->stop_sequences, params->stop_sequence_count);
+    if (params->grammar) {
+        context->params.sampling.grammar = params->grammar;
+    }
+    context->tracing = params->trace_stages;
+}
+
+// Weights shared by every context created from the handle; each context holds its own reference
+struct shared_model_handle {
+    std::shared_ptr<llama_model> model;
+    std::string path;
+};
+
+static bool init_params_to_common(const cactus_init_params_c_t* params, common_params& cpp_params) {
+    if (params->model_path) {
+        cpp_params.model.path = params->model_path;
+    }
+    if (params->chat_template) {
+        cpp_params.chat_template = params->chat_template;
+    }
+    cpp_params.n_ctx = params->n_ctx;
+    cpp_params.n_batch = params->n_batch;
+    cpp_params.n_ubatch = params->n_ubatch;
+    cpp_params.n_gpu_layers = params->n_gpu_layers;
+    cpp_params.cpuparams.n_threads = params->n_threads;
+    cpp_params.use_mmap = params->use_mmap;
+    cpp_params.use_mlock = params->use_mlock;
+    cpp_params.embedding = params->embedding;
+    cpp_params.pooling_type = static_cast<enum llama_pooling_type>(params->pooling_type);
+    cpp_params.embd_normalize = params->embd_normalize;
+    cpp_params.flash_attn = params->flash_attn;
+    if (params->cache_type_k) {
+        try {
+            cpp_params.cache_type_k = cactus::kv_cache_type_from_str(params->cache_type_k);
+        } catch (const std::exception& e) {
+            std::cerr << "Warning: Invalid cache_type_k: " << params->cache_type_k << " Error: " << e.what() << std::endl;
+            return false;
+        }
+    }
+    if (params->cache_type_v) {
+        try {
+            cpp_params.cache_type_v = cactus::kv_cache_type_from_str(params->cache_type_v);
+        } catch (const std::exception& e) {
+            std::cerr << "Warning: Invalid cache_type_v: " << params->cache_type_v << " Error: " << e.what() << std::endl;
+            return false;
+        }
+    }
+    if (params->prompt_cache_dir) {
+        cpp_params.path_prompt_cache = params->prompt_cache_dir;
+    }
+    if (params->draft_model_path) {
+        cpp_params.speculative.model.path = params->draft_model_path;
+    }
+    if (params->n_draft > 0) {
+        cpp_params.speculative.n_max = params->n_draft;
+    }
+    cpp_params.warmup = !params->no_warmup;
+    cpp_params.cache_n_recent = (uint32_t)std::max(0, params->n_kv_recent);
+    cpp_params.defrag_max_cells = std::max(0, params->defrag_max_cells);
+    cpp_params.compute_shrink_ms = (uint32_t)std::max(0, params->compute_shrink_ms);
+    cpp_params.n_state_ckpt = (uint32_t)std::max(0, params->n_state_checkpoints);
+    cpp_params.n_state_ckpt_interval = (uint32_t)std::max(0, params->state_checkpoint_interval);
+    cpp_params.n_parallel = 1 + std::max(0, params->n_prefix_cache_seqs);
+    return true;
+}
+
 extern "C" {
 
 cactus_context_handle_t cactus_init_context_c(const cactus_init_params_c_t* params) {
@@ -47,49 +147,18 @@ cactus_context_handle_t cactus_init_context_c(const cactus_init_params_c_t* para
 
     cactus::cactus_context* context = nullptr;
     try {
-        context = new cactus::cactus_context();
-
         common_params cpp_params;
-        cpp_params.model.path = params->model_path;
-        if (params->chat_template) {
-            cpp_params.chat_template = params->chat_template;
-        }
-        cpp_params.n_ctx = params->n_ctx;
-        cpp_params.n_batch = params->n_batch;
-        cpp_params.n_ubatch = params->n_ubatch;
-        cpp_params.n_gpu_layers = params->n_gpu_layers;
-        cpp_params.cpuparams.n_threads = params->n_threads;
-        cpp_params.use_mmap = params->use_mmap;
-        cpp_params.use_mlock = params->use_mlock;
-        cpp_params.embedding = params->embedding;
-        cpp_params.pooling_type = static_cast<enum llama_pooling_type>(params->pooling_type);
-        cpp_params.embd_normalize = params->embd_normalize;
-        cpp_params.flash_attn = params->flash_attn;
-        if (params->cache_type_k) {
-             try {
-                  cpp_params.cache_type_k = cactus::kv_cache_type_from_str(params->cache_type_k);
-             } catch (const std::exception& e) {
-                 std::cerr << "Warning: Invalid cache_type_k: " << params->cache_type_k << " Error: " << e.what() << std::endl;
-                 delete context;
-                 return nullptr;
-             }
-        }
-        if (params->cache_type_v) {
-            try {
-                cpp_params.cache_type_v = cactus::kv_cache_type_from_str(params->cache_type_v);
-            } catch (const std::exception& e) {
-                std::cerr << "Warning: Invalid cache_type_v: " << params->cache_type_v << " Error: " << e.what() << std::endl;
-                delete context;
-                return nullptr;
-            }
+        if (!init_params_to_common(params, cpp_params)) {
+            return nullptr;
         }
-
-
-
+        context = new cactus::cactus_context();
         if (!context->loadModel(cpp_params)) {
             delete context;
             return nullptr;
         }
+        if (params->n_prefix_cache_seqs > 0) {
+            context->setPrefixCache(params->n_prefix_cache_seqs, 0);
+        }
 
         return reinterpret_cast<cactus_context_handle_t>(context);
 
@@ -104,6 +173,78 @@ cactus_context_handle_t cactus_init_context_c(const cactus_init_params_c_t* para
     }
 }
 
+cactus_model_handle_t cactus_load_model_c(const cactus_init_params_c_t* params) {
+    if (!params || !params->model_path) {
+        return nullptr;
+    }
+    try {
+        common_params cpp_params;
+        if (!init_params_to_common(params, cpp_params)) {
+            return nullptr;
+        }
+        std::shared_ptr<llama_model> weights = cactus::load_shared_model(cpp_params);
+        if (!weights) {
+            return nullptr;
+        }
+        return reinterpret_cast<cactus_model_handle_t>(new shared_model_handle{std::move(weights), params->model_path});
+    } catch (const std::exception& e) {
+        std::cerr << "Error loading model: " << e.what() << std::endl;
+        return nullptr;
+    } catch (...) {
+        std::cerr << "Unknown error loading model." << std::endl;
+        return nullptr;
+    }
+}
+
+void cactus_free_model_c(cactus_model_handle_t model) {
+    delete reinterpret_cast<shared_model_handle*>(model);
+}
+
+cactus_context_handle_t cactus_init_context_from_model_c(cactus_model_handle_t model, const cactus_init_params_c_t* params) {
+    if (!model || !params) {
+        return nullptr;
+    }
+    shared_model_handle* shared = reinterpret_cast<shared_model_handle*>(model);
+    cactus::cactus_context* context = nullptr;
+    try {
+        common_params cpp_params;
+        if (!init_params_to_common(params, cpp_params)) {
+            return nullptr;
+        }
+        // Prompt cache and embedding cache identities are derived from the model path
+        cpp_params.model.path = shared->path;
+        context = new cactus::cactus_context();
+        if (!context->loadModel(cpp_params, shared->model)) {
+            delete context;
+            return nullptr;
+        }
+        if (params->n_prefix_cache_seqs > 0) {
+            context->setPrefixCache(params->n_prefix_cache_seqs, 0);
+        }
+        return reinterpret_cast<cactus_context_handle_t>(context);
+    } catch (const std::exception& e) {
+        std::cerr << "Error initializing context from model: " << e.what() << std::endl;
+        if (context) delete context;
+        return nullptr;
+    } catch (...) {
+        std::cerr << "Unknown error initializing context from model." << std::endl;
+        if (context) delete context;
+        return nullptr;
+    }
+}
+
+cactus_model_handle_t cactus_get_model_c(cactus_context_handle_t handle) {
+    if (!handle) {
+        return nullptr;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    std::shared_ptr<llama_model> weights = context->shareWeights();
+    if (!weights) {
+        return nullptr;
+    }
+    return reinterpret_cast<cactus_model_handle_t>(new shared_model_handle{std::move(weights), context->params.model.path});
+}
+
 void cactus_free_context_c(cactus_context_handle_t handle) {
     if (handle) {
         cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
@@ -111,6 +252,207 @@ void cactus_free_context_c(cactus_context_handle_t handle) {
     }
 }
 
+// Holds up to token_event_batch events between callback crossings. Text is kept as offsets into
+// generated_text, which may reallocate while the batch fills, and resolved just before delivery.
+struct token_event_batcher {
+    const cactus_completion_params_c_t* params;
+    cactus::cactus_context* context;
+    size_t batch_size;
+    int64_t t_start_us;
+    int32_t n_tokens = 0;
+    std::vector<cactus_token_event_c_t> events;
+    std::vector<size_t> text_offsets;
+    std::vector<cactus_token_prob_c_t> probs;
+    std::vector<size_t> prob_offsets;
+
+    token_event_batcher(const cactus_completion_params_c_t* params, cactus::cactus_context* context)
+        : params(params), context(context),
+          batch_size((size_t)std::max(params->token_event_batch, 1)), t_start_us(lm_ggml_time_us()) {
+        events.reserve(batch_size);
+        text_offsets.reserve(batch_size);
+        prob_offsets.reserve(batch_size);
+        probs.reserve(batch_size * (size_t)std::max(params->n_probs, 0));
+    }
+
+    bool add(const cactus::completion_token_output& output) {
+        cactus_token_event_c_t event = {};
+        event.token = output.tok;
+        event.index = n_tokens++;
+        event.text_len = (int32_t)context->text_delta_size;
+        event.n_probs = (int32_t)output.probs.size();
+        event.t_us = lm_ggml_time_us() - t_start_us;
+        event.has_stats = output.has_stats;
+        event.logsumexp = output.logsumexp;
+        event.logprob = output.logprob;
+        event.entropy = output.entropy;
+        events.push_back(event);
+        text_offsets.push_back(context->text_delta_offset);
+        prob_offsets.push_back(probs.size());
+        for (const auto& p : output.probs) {
+            probs.push_back({p.tok, p.prob});
+        }
+        return events.size() < batch_size || flush();
+    }
+
+    bool flush() {
+        if (events.empty()) {
+            return true;
+        }
+        // A stop word found later may have cut text the pending events point into
+        const std::string& text = context->generated_text;
+        for (size_t i = 0; i < events.size(); i++) {
+            const size_t offset = std::min(text_offsets[i], text.size());
+            events[i].text = text.data() + offset;
+            events[i].text_len = (int32_t)std::min((size_t)events[i].text_len, text.size() - offset);
+            events[i].probs = events[i].n_probs > 0 ? probs.data() + prob_offsets[i] : nullptr;
+        }
+        const bool keep_going = params->token_event_callback(events.data(), (int32_t)events.size(), params->token_event_user_data);
+        events.clear();
+        text_offsets.clear();
+        probs.clear();
+        prob_offsets.clear();
+        return keep_going;
+    }
+};
+
+// Single producer (the worker's token events), single consumer (the poller). Slots between head
+// and tail belong to the consumer; the producer only waits when the ring is full.
+struct completion_job {
+    static const size_t QUEUE_SIZE = 256;
+
+    struct queued_token {
+        int32_t token = 0;
+        int32_t index = 0;
+        int64_t t_us = 0;
+        bool has_stats = false;
+        float logsumexp = 0.0f;
+        float logprob = 0.0f;
+        float entropy = 0.0f;
+        std::string text;
+        std::vector<cactus_token_prob_c_t> probs;
+    };
+
+    cactus_context_handle_t handle;
+    cactus_completion_params_c_t params;
+    std::string prompt;
+    std::string grammar;
+    std::vector<std::string> stop_sequences;
+    std::vector<const char*> stop_sequence_ptrs;
+
+    std::vector<queued_token> slots;
+    std::vector<queued_token> delivered;
+    std::atomic<size_t> head{0};
+    std::atomic<size_t> tail{0};
+    std::atomic<bool> cancelled{false};
+    std::atomic<bool> abandoned{false};
+    std::atomic<bool> finished{false};
+
+    std::thread worker;
+    int status = 0;
+    cactus_completion_result_c_t result = {};
+
+    completion_job(cactus_context_handle_t handle, const cactus_completion_params_c_t* source)
+        : handle(handle), params(*source), prompt(source->prompt), slots(QUEUE_SIZE) {
+        params.prompt = prompt.c_str();
+        if (source->grammar) {
+            grammar = source->grammar;
+            params.grammar = grammar.c_str();
+        }
+        stop_sequences = c_str_array_to_vector(source->stop_sequences, source->stop_sequence_count);
+        for (const auto& stop : stop_sequences) {
+            stop_sequence_ptrs.push_back(stop.c_str());
+        }
+        params.stop_sequences = stop_sequence_ptrs.empty() ? nullptr : stop_sequence_ptrs.data();
+        params.stop_sequence_count = (int)stop_sequence_ptrs.size();
+        params.token_callback = nullptr;
+        params.token_event_callback = on_events;
+        params.token_event_user_data = this;
+        params.token_event_batch = 1;
+    }
+
+    ~completion_job() {
+        if (worker.joinable()) {
+            abandoned.store(true, std::memory_order_relaxed);
+            worker.join();
+        }
+    }
+
+    static bool on_events(const cactus_token_event_c_t* events, int32_t count, void* user_data) {
+        completion_job* job = static_cast<completion_job*>(user_data);
+        for (int32_t i = 0; i < count; i++) {
+            const size_t tail = job->tail.load(std::memory_order_relaxed);
+            while (tail - job->head.load(std::memory_order_acquire) == QUEUE_SIZE) {
+                if (job->cancelled.load(std::memory_order_relaxed) || job->abandoned.load(std::memory_order_relaxed)) {
+                    return !job->cancelled.load(std::memory_order_relaxed);
+                }
+                std::this_thread::yield();
+            }
+            queued_token& slot = job->slots[tail % QUEUE_SIZE];
+            slot.token = events[i].token;
+            slot.index = events[i].index;
+            slot.t_us = events[i].t_us;
+            slot.has_stats = events[i].has_stats;
+            slot.logsumexp = events[i].logsumexp;
+            slot.logprob = events[i].logprob;
+            slot.entropy = events[i].entropy;
+            slot.text.assign(events[i].text ? events[i].text : "", events[i].text ? (size_t)events[i].text_len : 0);
+            slot.probs.assign(events[i].probs, events[i].probs + (events[i].probs ? events[i].n_probs : 0));
+            job->tail.store(tail + 1, std::memory_order_release);
+        }
+        return !job->cancelled.load(std::memory_order_relaxed);
+    }
+};
+
+// Vocodes what is left of a streamed utterance however the token loop exits
+struct speech_stream_scope {
+    cactus::cactus_context* context;
+    ~speech_stream_scope() {
+        context->finishSpeechStream();
+    }
+};
+
+static void run_token_loop(cactus::cactus_context* context, const cactus_completion_params_c_t* params) {
+    std::string token_text;
+    std::unique_ptr<token_event_batcher> batcher;
+    if (params->token_event_callback) {
+        batcher.reset(new token_event_batcher(params, context));
+    }
+    if (params->audio_chunk_callback && context->isVocoderEnabled()) {
+        cactus_audio_chunk_callback_c callback = params->audio_chunk_callback;
+        void* user_data = params->audio_chunk_user_data;
+        context->beginSpeechStream(params->audio_chunk_codes, [callback, user_data](const float* samples, size_t n_samples) {
+            return callback(samples, (int32_t)n_samples, user_data);
+        });
+    }
+    speech_stream_scope speech_scope{context};
+    while (context->has_next_token && !context->is_interrupted) {
+        const cactus::completion_token_output token_with_probs = context->doCompletion();
+
+        if (token_with_probs.tok == -1 && !context->has_next_token) {
+             break;
+        }
+
+        if (token_with_probs.tok != -1 && batcher && !batcher->add(token_with_probs)) {
+            context->is_interrupted = true;
+            return;
+        }
+
+        std::string_view delta = context->lastTextDelta();
+        if (token_with_probs.tok != -1 && params->token_callback && !delta.empty()) {
+            token_text.assign(delta.data(), delta.size());
+
+            bool continue_completion = params->token_callback(token_text.c_str());
+            if (!continue_completion) {
+                context->is_interrupted = true;
+                return;
+            }
+        }
+    }
+    if (batcher && !batcher->flush()) {
+        context->is_interrupted = true;
+    }
+}
+
 int cactus_completion_c(
     cactus_context_handle_t handle,
     const cactus_completion_params_c_t* params,
@@ -129,29 +471,7 @@ int cactus_completion_c(
         }
         
         context->params.prompt = params->prompt;
-        if (params->n_threads > 0) {
-             context->params.cpuparams.n_threads = params->n_threads;
-        }
-        context->params.n_predict = params->n_predict;
-        context->params.sampling.seed = params->seed;
-        context->params.sampling.temp = params->temperature;
-        context->params.sampling.top_k = params->top_k;
-        context->params.sampling.top_p = params->top_p;
-        context->params.sampling.min_p = params->min_p;
-        context->params.sampling.typ_p = params->typical_p;
-        context->params.sampling.penalty_last_n = params->penalty_last_n;
-        context->params.sampling.penalty_repeat = params->penalty_repeat;
-        context->params.sampling.penalty_freq = params->penalty_freq;
-        context->params.sampling.penalty_present = params->penalty_present;
-        context->params.sampling.mirostat = params->mirostat;
-        context->params.sampling.mirostat_tau = params->mirostat_tau;
-        context->params.sampling.mirostat_eta = params->mirostat_eta;
-        context->params.sampling.ignore_eos = params->ignore_eos;
-        context->params.sampling.n_probs = params->n_probs;
-        context->params.antiprompt = c_str_array_to_vector(params->stop_sequences, params->stop_sequence_count);
-        if (params->grammar) {
-             context->params.sampling.grammar = params->grammar;
-        }
+        apply_completion_params(context, params);
 
         if (context->ctx_sampling == nullptr) {
             if (!context->initSampling()) {
@@ -161,23 +481,7 @@ int cactus_completion_c(
         context->beginCompletion();
         context->loadPrompt();
 
-        while (context->has_next_token && !context->is_interrupted) {
-            const cactus::completion_token_output token_with_probs = context->doCompletion();
-
-            if (token_with_probs.tok == -1 && !context->has_next_token) {
-                 break;
-            }
-            
-            if (token_with_probs.tok != -1 && params->token_callback) {
-                std::string token_text = common_token_to_piece(context->ctx, token_with_probs.tok);
-                
-                bool continue_completion = params->token_callback(token_text.c_str());
-                if (!continue_completion) {
-                    context->is_interrupted = true;
-                    break;
-                }
-            }
-        }
+        run_token_loop(context, params);
 
         result->text = safe_strdup(context->generated_text);
         result->tokens_predicted = context->num_tokens_predicted;
@@ -186,7 +490,14 @@ int cactus_completion_c(
         result->stopped_eos = context->stopped_eos;
         result->stopped_word = context->stopped_word;
         result->stopped_limit = context->stopped_limit;
+        result->draft_tokens = (int32_t)context->n_draft_proposed;
+        result->draft_accepted = (int32_t)context->n_draft_accepted;
+        result->hot_path_allocs = (int32_t)context->n_hot_path_allocs;
+        result->timed_out = context->timed_out;
         result->stopping_word = safe_strdup(context->stopping_word);
+        if (context->tracing) {
+            result->trace_json = safe_strdup(context->traceJSON());
+        }
 
         context->is_predicting = false;
         return 0;
@@ -203,6 +514,151 @@ int cactus_completion_c(
     }
 }
 
+cactus_completion_job_handle_t cactus_completion_start_c(
+    cactus_context_handle_t handle,
+    const cactus_completion_params_c_t* params
+) {
+    if (!handle || !params || !params->prompt) {
+        return nullptr;
+    }
+    completion_job* job = nullptr;
+    try {
+        job = new completion_job(handle, params);
+        job->worker = std::thread([job]() {
+            job->status = cactus_completion_c(job->handle, &job->params, &job->result);
+            job->finished.store(true, std::memory_order_release);
+        });
+        return reinterpret_cast<cactus_completion_job_handle_t>(job);
+    } catch (const std::exception& e) {
+        std::cerr << "Error starting completion: " << e.what() << std::endl;
+        delete job;
+        return nullptr;
+    }
+}
+
+int32_t cactus_completion_poll_c(
+    cactus_completion_job_handle_t handle,
+    cactus_token_event_c_t* events,
+    int32_t max_events
+) {
+    if (!handle || (!events && max_events > 0) || max_events < 0) {
+        return -2;
+    }
+    completion_job* job = reinterpret_cast<completion_job*>(handle);
+    // Read before tail so a finished worker's last tokens are always seen
+    const bool finished = job->finished.load(std::memory_order_acquire);
+    const size_t head = job->head.load(std::memory_order_relaxed);
+    const size_t tail = job->tail.load(std::memory_order_acquire);
+    if (finished && head == tail) {
+        return -1;
+    }
+    const size_t n = std::min(tail - head, (size_t)max_events);
+    job->delivered.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        std::swap(job->delivered[i], job->slots[(head + i) % completion_job::QUEUE_SIZE]);
+    }
+    job->head.store(head + n, std::memory_order_release);
+
+    for (size_t i = 0; i < n; i++) {
+        const completion_job::queued_token& queued = job->delivered[i];
+        events[i].token = queued.token;
+        events[i].index = queued.index;
+        events[i].text = queued.text.c_str();
+        events[i].text_len = (int32_t)queued.text.size();
+        events[i].probs = queued.probs.empty() ? nullptr : queued.probs.data();
+        events[i].n_probs = (int32_t)queued.probs.size();
+        events[i].t_us = queued.t_us;
+        events[i].has_stats = queued.has_stats;
+        events[i].logsumexp = queued.logsumexp;
+        events[i].logprob = queued.logprob;
+        events[i].entropy = queued.entropy;
+    }
+    return (int32_t)n;
+}
+
+void cactus_completion_cancel_c(cactus_completion_job_handle_t handle) {
+    if (!handle) {
+        return;
+    }
+    completion_job* job = reinterpret_cast<completion_job*>(handle);
+    job->cancelled.store(true, std::memory_order_relaxed);
+    reinterpret_cast<cactus::cactus_context*>(job->handle)->is_interrupted = true;
+}
+
+int cactus_completion_finish_c(
+    cactus_completion_job_handle_t handle,
+    cactus_completion_result_c_t* result
+) {
+    if (!handle) {
+        return -1;
+    }
+    completion_job* job = reinterpret_cast<completion_job*>(handle);
+    // Nobody polls from here on; keep a full queue from stalling the worker
+    job->abandoned.store(true, std::memory_order_relaxed);
+    if (job->worker.joinable()) {
+        job->worker.join();
+    }
+    const int status = job->status;
+    if (result) {
+        *result = job->result;
+    } else {
+        cactus_free_completion_result_members_c(&job->result);
+    }
+    delete job;
+    return status;
+}
+
+int cactus_completion_n_c(
+    cactus_context_handle_t handle,
+    const cactus_completion_params_c_t* params,
+    int n,
+    cactus_completion_result_c_t* results
+) {
+    if (!handle || !params || !params->prompt || !results || n <= 0) {
+        return -1; // Invalid arguments
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+
+    memset(results, 0, sizeof(cactus_completion_result_c_t) * n);
+
+    try {
+        context->rewind();
+
+        context->params.prompt = params->prompt;
+        apply_completion_params(context, params);
+
+        if (!context->initSampling()) {
+            return -2;
+        }
+        context->beginCompletion();
+        context->loadPrompt();
+
+        std::vector<cactus::cactus_completion_candidate> candidates = context->doCompletionN(n);
+
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            const cactus::cactus_completion_candidate& candidate = candidates[i];
+            results[i].text = safe_strdup(candidate.text);
+            results[i].tokens_predicted = (int32_t)candidate.tokens.size();
+            results[i].tokens_evaluated = (int32_t)context->num_prompt_tokens;
+            results[i].truncated = context->truncated;
+            results[i].stopped_eos = candidate.stopped_eos;
+            results[i].stopped_word = candidate.stopped_word;
+            results[i].stopped_limit = candidate.stopped_limit;
+            results[i].stopping_word = safe_strdup(candidate.stopping_word);
+        }
+
+        return (int)candidates.size();
+
+    } catch (const std::exception& e) {
+        std::cerr << "Error during parallel completion: " << e.what() << std::endl;
+        context->is_predicting = false;
+        return -3;
+    } catch (...) {
+        context->is_predicting = false;
+        return -4;
+    }
+}
+
 int cactus_multimodal_completion_c(
     cactus_context_handle_t handle,
     const cactus_completion_params_c_t* params,
@@ -221,29 +677,7 @@ int cactus_multimodal_completion_c(
         context->rewind();
 
         context->params.prompt = params->prompt ? params->prompt : "";
-        if (params->n_threads > 0) {
-            context->params.cpuparams.n_threads = params->n_threads;
-        }
-        context->params.n_predict = params->n_predict;
-        context->params.sampling.seed = params->seed;
-        context->params.sampling.temp = params->temperature;
-        context->params.sampling.top_k = params->top_k;
-        context->params.sampling.top_p = params->top_p;
-        context->params.sampling.min_p = params->min_p;
-        context->params.sampling.typ_p = params->typical_p;
-        context->params.sampling.penalty_last_n = params->penalty_last_n;
-        context->params.sampling.penalty_repeat = params->penalty_repeat;
-        context->params.sampling.penalty_freq = params->penalty_freq;
-        context->params.sampling.penalty_present = params->penalty_present;
-        context->params.sampling.mirostat = params->mirostat;
-        context->params.sampling.mirostat_tau = params->mirostat_tau;
-        context->params.sampling.mirostat_eta = params->mirostat_eta;
-        context->params.sampling.ignore_eos = params->ignore_eos;
-        context->params.sampling.n_probs = params->n_probs;
-        context->params.antiprompt = c_str_array_to_vector(params->stop_sequences, params->stop_sequence_count);
-        if (params->grammar) {
-            context->params.sampling.grammar = params->grammar;
-        }
+        apply_completion_params(context, params);
 
         if (!context->initSampling()) {
             return -2;
@@ -263,23 +697,7 @@ int cactus_multimodal_completion_c(
             context->loadPrompt();
         }
 
-        while (context->has_next_token && !context->is_interrupted) {
-            const cactus::completion_token_output token_with_probs = context->doCompletion();
-            
-            if (token_with_probs.tok == -1 && !context->has_next_token) {
-                break;
-            }
-            
-            if (token_with_probs.tok != -1 && params->token_callback) {
-                std::string token_text = common_token_to_piece(context->ctx, token_with_probs.tok);
-                
-                bool continue_completion = params->token_callback(token_text.c_str());
-                if (!continue_completion) {
-                    context->is_interrupted = true;
-                    break;
-                }
-            }
-        }
+        run_token_loop(context, params);
 
         result->text = safe_strdup(context->generated_text);
         result->tokens_predicted = context->num_tokens_predicted;
@@ -288,7 +706,14 @@ int cactus_multimodal_completion_c(
         result->stopped_eos = context->stopped_eos;
         result->stopped_word = context->stopped_word;
         result->stopped_limit = context->stopped_limit;
+        result->draft_tokens = (int32_t)context->n_draft_proposed;
+        result->draft_accepted = (int32_t)context->n_draft_accepted;
+        result->hot_path_allocs = (int32_t)context->n_hot_path_allocs;
+        result->timed_out = context->timed_out;
         result->stopping_word = safe_strdup(context->stopping_word);
+        if (context->tracing) {
+            result->trace_json = safe_strdup(context->traceJSON());
+        }
 
         context->is_predicting = false;
         return 0;
@@ -323,7 +748,7 @@ cactus_token_array_c_t cactus_tokenize_c(cactus_context_handle_t handle, const c
     }
 
     try {
-        std::vector<llama_token> tokens_vec = ::common_tokenize(context->ctx, text, false, true);
+        std::vector<llama_token> tokens_vec = ::common_tokenize(context->ctx, text, false, true, context->params.cpuparams.n_threads);
         if (!tokens_vec.empty()) {
             result.count = tokens_vec.size();
             result.tokens = (int32_t*)malloc(result.count * sizeof(int32_t));
@@ -367,6 +792,10 @@ char* cactus_detokenize_c(cactus_context_handle_t handle, const int32_t* tokens,
 }
 
 cactus_float_array_c_t cactus_embedding_c(cactus_context_handle_t handle, const char* text) {
+    return cactus_embedding_dims_c(handle, text, 0);
+}
+
+cactus_float_array_c_t cactus_embedding_dims_c(cactus_context_handle_t handle, const char* text, int32_t dims) {
     cactus_float_array_c_t result = {nullptr, 0};
      if (!handle || !text) {
         return result;
@@ -378,19 +807,7 @@ cactus_float_array_c_t cactus_embedding_c(cactus_context_handle_t handle, const
     }
 
     try {
-        context->rewind();
-        context->params.prompt = text;
-        context->params.n_predict = 0;
-
-        if (!context->initSampling()) { return result; }
-        context->beginCompletion();
-        context->loadPrompt();
-        context->doCompletion();
-
-        common_params dummy_embd_params;
-        dummy_embd_params.embd_normalize = context->params.embd_normalize;
-
-        std::vector<float> embedding_vec = context->getEmbedding(dummy_embd_params);
+        std::vector<float> embedding_vec = context->getEmbedding(text, dims);
 
         if (!embedding_vec.empty()) {
             result.count = embedding_vec.size();
@@ -401,7 +818,6 @@ cactus_float_array_c_t cactus_embedding_c(cactus_context_handle_t handle, const
                 result.count = 0;
             }
         }
-        context->is_predicting = false;
         return result;
 
     } catch (const std::exception& e) {
@@ -415,6 +831,262 @@ cactus_float_array_c_t cactus_embedding_c(cactus_context_handle_t handle, const
     }
 }
 
+bool cactus_set_embedding_cache_c(cactus_context_handle_t handle, const char* dir, int32_t capacity) {
+    if (!handle) {
+        return false;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    try {
+        return context->setEmbeddingCache(dir ? dir : "", capacity > 0 ? (size_t)capacity : 0);
+    } catch (const std::exception& e) {
+        std::cerr << "Error opening embedding cache: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+void cactus_get_embedding_cache_stats_c(cactus_context_handle_t handle, int64_t* hits, int64_t* misses, int64_t* entries) {
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    if (hits) {
+        *hits = context ? (int64_t)context->n_embd_cache_hits : 0;
+    }
+    if (misses) {
+        *misses = context ? (int64_t)context->n_embd_cache_misses : 0;
+    }
+    if (entries) {
+        *entries = context && context->embedding_cache ? (int64_t)context->embedding_cache->size() : 0;
+    }
+}
+
+cactus_float_array_c_t cactus_embedding_batch_c(cactus_context_handle_t handle, const char** texts, int32_t n, int32_t* n_embd) {
+    return cactus_embedding_batch_dims_c(handle, texts, n, 0, n_embd);
+}
+
+cactus_float_array_c_t cactus_embedding_batch_dims_c(cactus_context_handle_t handle, const char** texts, int32_t n,
+                                                     int32_t dims, int32_t* n_embd) {
+    cactus_float_array_c_t result = {nullptr, 0};
+    if (n_embd) {
+        *n_embd = 0;
+    }
+    if (!handle || !texts || n <= 0) {
+        return result;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+
+    try {
+        std::vector<std::string> inputs;
+        inputs.reserve(n);
+        for (int32_t i = 0; i < n; ++i) {
+            inputs.emplace_back(texts[i] ? texts[i] : "");
+        }
+        context->is_interrupted = false;
+        std::vector<float> matrix;
+        if (!context->getEmbeddings(inputs, matrix, nullptr, dims) || matrix.empty()) {
+            return result;
+        }
+        result.values = (float*)malloc(matrix.size() * sizeof(float));
+        if (!result.values) {
+            return result;
+        }
+        std::copy(matrix.begin(), matrix.end(), result.values);
+        result.count = (int32_t)matrix.size();
+        if (n_embd) {
+            *n_embd = context->embeddingDims(dims);
+        }
+        return result;
+    } catch (const std::exception& e) {
+        std::cerr << "Error during batch embedding generation: " << e.what() << std::endl;
+        free(result.values);
+        return {nullptr, 0};
+    }
+}
+
+cactus_float_array_c_t cactus_rerank_c(cactus_context_handle_t handle, const char* query, const char** docs, int32_t n) {
+    cactus_float_array_c_t result = {nullptr, 0};
+    if (!handle || !query || !docs || n <= 0) {
+        return result;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+
+    try {
+        std::vector<std::string> documents;
+        documents.reserve(n);
+        for (int32_t i = 0; i < n; ++i) {
+            documents.emplace_back(docs[i] ? docs[i] : "");
+        }
+        context->is_interrupted = false;
+        std::vector<float> scores;
+        if (!context->getRerankScores(query, documents, scores)) {
+            return result;
+        }
+        result.values = (float*)malloc(scores.size() * sizeof(float));
+        if (!result.values) {
+            return result;
+        }
+        std::copy(scores.begin(), scores.end(), result.values);
+        result.count = (int32_t)scores.size();
+        return result;
+    } catch (const std::exception& e) {
+        std::cerr << "Error during reranking: " << e.what() << std::endl;
+        free(result.values);
+        return {nullptr, 0};
+    }
+}
+
+float cactus_quantize_embedding_i8_c(const float* values, int32_t n, int8_t* out) {
+    if (!values || !out || n <= 0) {
+        return 0.0f;
+    }
+    return cactus::quantize_embedding_i8(values, n, out);
+}
+
+void cactus_quantize_embedding_binary_c(const float* values, int32_t n, uint8_t* out) {
+    if (!values || !out || n <= 0) {
+        return;
+    }
+    cactus::quantize_embedding_binary(values, n, out);
+}
+
+float cactus_vector_dot_f32_c(const float* a, const float* b, int32_t n) {
+    return (a && b && n > 0) ? cactus::vec_dot_f32(a, b, n) : 0.0f;
+}
+
+float cactus_vector_cosine_f32_c(const float* a, const float* b, int32_t n) {
+    return (a && b && n > 0) ? cactus::vec_cosine_f32(a, b, n) : 0.0f;
+}
+
+int32_t cactus_vector_dot_i8_c(const int8_t* a, const int8_t* b, int32_t n) {
+    return (a && b && n > 0) ? cactus::vec_dot_i8(a, b, n) : 0;
+}
+
+int32_t cactus_vector_hamming_c(const uint8_t* a, const uint8_t* b, int32_t n_bytes) {
+    return (a && b && n_bytes > 0) ? cactus::vec_hamming(a, b, n_bytes) : 0;
+}
+
+int32_t cactus_vector_top_k_c(int32_t type, const void* query, const void* rows, const float* scales,
+                              int32_t n_rows, int32_t dim, int32_t k, int32_t* indices, float* scores) {
+    if (!query || !rows || !indices || n_rows <= 0 || dim <= 0 || k <= 0 ||
+        type < cactus::VECTOR_F32 || type > cactus::VECTOR_BINARY) {
+        return 0;
+    }
+    try {
+        std::vector<cactus::cactus_vector_match> matches = cactus::vector_top_k(
+            (cactus::cactus_vector_type)type, query, rows, scales, (size_t)n_rows, dim, (size_t)k);
+        for (size_t i = 0; i < matches.size(); ++i) {
+            indices[i] = (int32_t)matches[i].index;
+            if (scores) {
+                scores[i] = matches[i].score;
+            }
+        }
+        return (int32_t)matches.size();
+    } catch (const std::exception& e) {
+        std::cerr << "Error during vector search: " << e.what() << std::endl;
+        return 0;
+    }
+}
+
+cactus_vector_index_handle_t cactus_vector_index_create_c(int32_t dim, int32_t storage, bool hnsw,
+                                                          int32_t hnsw_m, int32_t ef_construction) {
+    if (dim <= 0 || storage < cactus::VECTOR_F32 || storage > cactus::VECTOR_BINARY) {
+        return nullptr;
+    }
+    try {
+        return reinterpret_cast<cactus_vector_index_handle_t>(new cactus::cactus_vector_index(
+            dim, (cactus::cactus_vector_type)storage, hnsw, hnsw_m > 0 ? hnsw_m : 16, ef_construction > 0 ? ef_construction : 100));
+    } catch (const std::exception& e) {
+        std::cerr << "Error creating vector index: " << e.what() << std::endl;
+        return nullptr;
+    }
+}
+
+cactus_vector_index_handle_t cactus_vector_index_load_c(const char* path) {
+    if (!path) {
+        return nullptr;
+    }
+    return reinterpret_cast<cactus_vector_index_handle_t>(cactus::cactus_vector_index::load(path).release());
+}
+
+bool cactus_vector_index_save_c(cactus_vector_index_handle_t index, const char* path) {
+    if (!index || !path) {
+        return false;
+    }
+    return reinterpret_cast<cactus::cactus_vector_index*>(index)->save(path);
+}
+
+void cactus_vector_index_free_c(cactus_vector_index_handle_t index) {
+    delete reinterpret_cast<cactus::cactus_vector_index*>(index);
+}
+
+void cactus_vector_index_add_c(cactus_vector_index_handle_t index, const uint64_t* ids, const float* vectors, int32_t n) {
+    if (!index || !ids || !vectors || n <= 0) {
+        return;
+    }
+    try {
+        std::vector<size_t> keys(ids, ids + n);
+        reinterpret_cast<cactus::cactus_vector_index*>(index)->add(keys.data(), vectors, (size_t)n);
+    } catch (const std::exception& e) {
+        std::cerr << "Error adding to vector index: " << e.what() << std::endl;
+    }
+}
+
+bool cactus_vector_index_remove_c(cactus_vector_index_handle_t index, uint64_t id) {
+    return index && reinterpret_cast<cactus::cactus_vector_index*>(index)->remove((size_t)id);
+}
+
+int32_t cactus_vector_index_size_c(cactus_vector_index_handle_t index) {
+    return index ? (int32_t)reinterpret_cast<cactus::cactus_vector_index*>(index)->size() : 0;
+}
+
+int32_t cactus_vector_index_search_c(cactus_vector_index_handle_t index, const float* query, int32_t k,
+                                     int32_t ef, uint64_t* ids, float* scores) {
+    if (!index || !query || !ids || k <= 0) {
+        return 0;
+    }
+    try {
+        std::vector<cactus::cactus_vector_match> matches =
+            reinterpret_cast<cactus::cactus_vector_index*>(index)->search(query, (size_t)k, ef);
+        for (size_t i = 0; i < matches.size(); ++i) {
+            ids[i] = (uint64_t)matches[i].index;
+            if (scores) {
+                scores[i] = matches[i].score;
+            }
+        }
+        return (int32_t)matches.size();
+    } catch (const std::exception& e) {
+        std::cerr << "Error searching vector index: " << e.what() << std::endl;
+        return 0;
+    }
+}
+
+bool cactus_vector_index_add_texts_c(cactus_context_handle_t handle, cactus_vector_index_handle_t index,
+                                     const char** texts, const uint64_t* ids, int32_t n) {
+    if (!handle || !index || !texts || !ids || n <= 0) {
+        return false;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    cactus::cactus_vector_index* target = reinterpret_cast<cactus::cactus_vector_index*>(index);
+    // A smaller index takes the leading dims of a Matryoshka model
+    if (target->dim > llama_model_n_embd(context->model)) {
+        std::cerr << "Vector index dimension exceeds the model embedding size" << std::endl;
+        return false;
+    }
+
+    try {
+        std::vector<std::string> inputs;
+        inputs.reserve(n);
+        for (int32_t i = 0; i < n; ++i) {
+            inputs.emplace_back(texts[i] ? texts[i] : "");
+        }
+        context->is_interrupted = false;
+        std::vector<float> matrix;
+        return context->getEmbeddings(inputs, matrix, [&](size_t row, const float* values) {
+            target->add((size_t)ids[row], values);
+        }, target->dim);
+    } catch (const std::exception& e) {
+        std::cerr << "Error embedding texts into vector index: " << e.what() << std::endl;
+        return false;
+    }
+}
+
 void cactus_free_string_c(char* str) {
     if (str) {
         free(str);
@@ -437,8 +1109,10 @@ void cactus_free_completion_result_members_c(cactus_completion_result_c_t* resul
     if (result) {
         cactus_free_string_c(result->text);
         cactus_free_string_c(result->stopping_word);
+        cactus_free_string_c(result->trace_json);
         result->text = nullptr;
         result->stopping_word = nullptr;
+        result->trace_json = nullptr;
     }
 }
 
@@ -582,6 +1256,31 @@ int cactus_init_multimodal_c(cactus_context_handle_t handle, const char* mmproj_
     }
 }
 
+int cactus_init_multimodal_with_params_c(cactus_context_handle_t handle, const char* mmproj_path, const cactus_multimodal_params_c_t* params) {
+    if (!handle || !mmproj_path || !params) {
+        return -1;
+    }
+
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    try {
+        cactus::cactus_multimodal_params mm_params;
+        mm_params.use_gpu = params->use_gpu;
+        if (params->weight_type && params->weight_type[0] != '\0') {
+            mm_params.weight_type = cactus::kv_cache_type_from_str(params->weight_type);
+        }
+        mm_params.image_max_side = std::max(params->image_max_side, 0);
+        mm_params.max_slices = std::max(params->max_slices, 0);
+        bool success = context->initMultimodal(mmproj_path, mm_params);
+        return success ? 0 : -2;
+    } catch (const std::exception& e) {
+        std::cerr << "Error initializing multimodal: " << e.what() << std::endl;
+        return -3;
+    } catch (...) {
+        std::cerr << "Unknown error initializing multimodal." << std::endl;
+        return -4;
+    }
+}
+
 bool cactus_is_multimodal_enabled_c(cactus_context_handle_t handle) {
     if (!handle) {
         return false;
@@ -602,38 +1301,190 @@ bool cactus_supports_vision_c(cactus_context_handle_t handle) {
     
     cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
     try {
-        return context->isMultimodalSupportVision();
+        return context->isMultimodalSupportVision();
+    } catch (...) {
+        return false;
+    }
+}
+
+bool cactus_supports_audio_c(cactus_context_handle_t handle) {
+    if (!handle) {
+        return false;
+    }
+    
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    try {
+        return context->isMultimodalSupportAudio();
+    } catch (...) {
+        return false;
+    }
+}
+
+void cactus_release_multimodal_c(cactus_context_handle_t handle) {
+    if (!handle) {
+        return;
+    }
+    
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    try {
+        context->releaseMultimodal();
+    } catch (const std::exception& e) {
+        std::cerr << "Error releasing multimodal: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Unknown error releasing multimodal." << std::endl;
+    }
+}
+
+void cactus_set_media_embedding_cache_c(cactus_context_handle_t handle, int64_t capacity_bytes, const char* dir) {
+    if (!handle) {
+        return;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    context->setMediaEmbeddingCache(capacity_bytes > 0 ? (size_t)capacity_bytes : 0, dir ? dir : "");
+}
+
+void cactus_get_media_embedding_cache_stats_c(cactus_context_handle_t handle, int64_t* hits, int64_t* misses, int64_t* bytes) {
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    if (hits) {
+        *hits = context ? (int64_t)context->media_embd_cache.n_hits : 0;
+    }
+    if (misses) {
+        *misses = context ? (int64_t)context->media_embd_cache.n_misses : 0;
+    }
+    if (bytes) {
+        *bytes = context ? (int64_t)context->media_embd_cache.bytes : 0;
+    }
+}
+
+bool cactus_set_prefix_cache_c(cactus_context_handle_t handle, int32_t n_seqs, int64_t capacity_tokens) {
+    if (!handle) {
+        return false;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    return context->setPrefixCache(n_seqs, capacity_tokens > 0 ? (size_t)capacity_tokens : 0);
+}
+
+void cactus_get_prefix_cache_stats_c(cactus_context_handle_t handle, int64_t* hits, int64_t* misses, int64_t* reused_tokens) {
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    if (hits) {
+        *hits = context ? (int64_t)context->prefix_cache.n_hits : 0;
+    }
+    if (misses) {
+        *misses = context ? (int64_t)context->prefix_cache.n_misses : 0;
+    }
+    if (reused_tokens) {
+        *reused_tokens = context ? (int64_t)context->prefix_cache.n_reused : 0;
+    }
+}
+
+bool cactus_set_sequence_quota_c(cactus_context_handle_t handle, int32_t seq_id, int32_t n_max_cells, int32_t policy, int32_t n_sink) {
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    if (!context || policy < LLAMA_KV_EVICT_POLICY_NONE || policy > LLAMA_KV_EVICT_POLICY_SINK) {
+        return false;
+    }
+    return context->setSequenceQuota(seq_id, (uint32_t)std::max(0, n_max_cells), (llama_kv_evict_policy)policy, (uint32_t)std::max(0, n_sink));
+}
+
+bool cactus_defrag_kv_cache_c(cactus_context_handle_t handle) {
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    return context && context->defragKVCache();
+}
+
+int64_t cactus_shrink_compute_buffers_c(cactus_context_handle_t handle) {
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    return context ? (int64_t)context->shrinkComputeBuffers() : 0;
+}
+
+void cactus_get_kv_defrag_stats_c(cactus_context_handle_t handle, float* fragmentation, int64_t* steps, int64_t* cells_moved, int64_t* bytes_moved) {
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    const llama_kv_defrag_stats stats = context && context->ctx ? llama_kv_self_defrag_stats(context->ctx) : llama_kv_defrag_stats{};
+    if (fragmentation) {
+        *fragmentation = stats.fragmentation;
+    }
+    if (steps) {
+        *steps = stats.n_steps;
+    }
+    if (cells_moved) {
+        *cells_moved = (int64_t)stats.n_cells_moved;
+    }
+    if (bytes_moved) {
+        *bytes_moved = (int64_t)stats.n_bytes_moved;
+    }
+}
+
+bool cactus_set_kv_spill_c(cactus_context_handle_t handle, const char* dir, const char* cache_type) {
+    if (!handle) {
+        return false;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    try {
+        lm_ggml_type type = cache_type ? cactus::kv_cache_type_from_str(cache_type) : LM_GGML_TYPE_Q8_0;
+        if (type == LM_GGML_TYPE_F16) {
+            type = LM_GGML_TYPE_COUNT;
+        }
+        return context->setKVSpill(dir ? dir : "", type);
+    } catch (const std::exception& e) {
+        std::cerr << "Error configuring KV spill: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+char* cactus_add_audio_c(cactus_context_handle_t handle, const float* samples, int64_t n_samples) {
+    if (!handle || !samples || n_samples <= 0) {
+        return nullptr;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    try {
+        const std::string ref = context->addAudio(samples, (size_t)n_samples);
+        return ref.empty() ? nullptr : safe_strdup(ref);
+    } catch (const std::exception& e) {
+        std::cerr << "Error adding audio: " << e.what() << std::endl;
+        return nullptr;
+    } catch (...) {
+        std::cerr << "Unknown error adding audio." << std::endl;
+        return nullptr;
+    }
+}
+
+char* cactus_begin_audio_stream_c(cactus_context_handle_t handle) {
+    if (!handle) {
+        return nullptr;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    try {
+        const std::string ref = context->beginAudioStream();
+        return ref.empty() ? nullptr : safe_strdup(ref);
+    } catch (const std::exception& e) {
+        std::cerr << "Error starting audio stream: " << e.what() << std::endl;
+        return nullptr;
     } catch (...) {
-        return false;
+        std::cerr << "Unknown error starting audio stream." << std::endl;
+        return nullptr;
     }
 }
 
-bool cactus_supports_audio_c(cactus_context_handle_t handle) {
-    if (!handle) {
+bool cactus_push_audio_c(cactus_context_handle_t handle, const char* ref, const float* samples, int64_t n_samples) {
+    if (!handle || !ref || (!samples && n_samples > 0) || n_samples < 0) {
         return false;
     }
-    
     cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
     try {
-        return context->isMultimodalSupportAudio();
+        return context->pushAudio(ref, samples, (size_t)n_samples);
+    } catch (const std::exception& e) {
+        std::cerr << "Error pushing audio: " << e.what() << std::endl;
+        return false;
     } catch (...) {
+        std::cerr << "Unknown error pushing audio." << std::endl;
         return false;
     }
 }
 
-void cactus_release_multimodal_c(cactus_context_handle_t handle) {
-    if (!handle) {
+void cactus_release_audio_c(cactus_context_handle_t handle, const char* ref) {
+    if (!handle || !ref) {
         return;
     }
-    
     cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
-    try {
-        context->releaseMultimodal();
-    } catch (const std::exception& e) {
-        std::cerr << "Error releasing multimodal: " << e.what() << std::endl;
-    } catch (...) {
-        std::cerr << "Unknown error releasing multimodal." << std::endl;
-    }
+    context->releaseAudio(ref);
 }
 
 int cactus_init_vocoder_c(cactus_context_handle_t handle, const char* vocoder_model_path) {
@@ -757,6 +1608,70 @@ cactus_float_array_c_t cactus_decode_audio_tokens_c(cactus_context_handle_t hand
     }
 }
 
+static cactus::cactus_audio_output audio_output_from_c(const cactus_audio_output_c_t* output) {
+    cactus::cactus_audio_output result;
+    if (output) {
+        result.format = (cactus::cactus_audio_format)output->format;
+        result.sample_rate = output->sample_rate;
+        result.bitrate = output->bitrate;
+    }
+    return result;
+}
+
+int64_t cactus_audio_output_bound_c(cactus_context_handle_t handle, int32_t count, const cactus_audio_output_c_t* output) {
+    if (!handle || count <= 0) {
+        return 0;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    return (int64_t)context->audioOutputBound((size_t)count, audio_output_from_c(output));
+}
+
+int64_t cactus_decode_audio_tokens_into_c(cactus_context_handle_t handle, const int32_t* tokens, int32_t count, const cactus_audio_output_c_t* output, void* dst, int64_t capacity) {
+    if (!handle || !tokens || count <= 0 || !dst || capacity <= 0) {
+        return 0;
+    }
+
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    try {
+        std::vector<llama_token> token_vec(tokens, tokens + count);
+        return (int64_t)context->decodeAudioTokens(token_vec, audio_output_from_c(output), dst, (size_t)capacity);
+    } catch (const std::exception& e) {
+        std::cerr << "Error decoding audio tokens: " << e.what() << std::endl;
+        return 0;
+    } catch (...) {
+        std::cerr << "Unknown error decoding audio tokens." << std::endl;
+        return 0;
+    }
+}
+
+cactus_float_array_c_t cactus_synthesize_speech_c(cactus_context_handle_t handle, const char* speaker_json_str, const char* text, int32_t n_parallel) {
+    cactus_float_array_c_t result = {nullptr, 0};
+    if (!handle || !text) {
+        return result;
+    }
+
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    try {
+        std::vector<float> audio = context->synthesizeSpeech(speaker_json_str ? speaker_json_str : "", text, n_parallel);
+        if (!audio.empty()) {
+            result.count = audio.size();
+            result.values = (float*)malloc(result.count * sizeof(float));
+            if (result.values) {
+                std::copy(audio.begin(), audio.end(), result.values);
+            } else {
+                result.count = 0;
+            }
+        }
+        return result;
+    } catch (const std::exception& e) {
+        std::cerr << "Error synthesizing speech: " << e.what() << std::endl;
+        return {nullptr, 0};
+    } catch (...) {
+        std::cerr << "Unknown error synthesizing speech." << std::endl;
+        return {nullptr, 0};
+    }
+}
+
 void cactus_release_vocoder_c(cactus_context_handle_t handle) {
     if (!handle) {
         return;
@@ -786,35 +1701,235 @@ cactus_bench_result_c_t cactus_bench_c(cactus_context_handle_t handle, int pp, i
     
     cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
     try {
-        std::string bench_json = context->bench(pp, tg, pl, nr);
+        cactus::cactus_bench_config config;
+        config.pp = pp;
+        config.tg = tg;
+        config.pl = pl;
+        config.nr = nr;
+        config.warmup = 0;
+        cactus::cactus_bench_result bench;
+        if (!context->model || !context->runBench(config, bench)) {
+            return result;
+        }
         
         char model_desc[128];
         llama_model_desc(context->model, model_desc, sizeof(model_desc));
         result.model_name = safe_strdup(model_desc);
         result.model_size = llama_model_size(context->model);
         result.model_params = llama_model_n_params(context->model);
+        result.pp_avg = bench.pp_avg;
+        result.pp_std = bench.pp_std;
+        result.tg_avg = bench.tg_avg;
+        result.tg_std = bench.tg_std;
+        return result;
+    } catch (const std::exception& e) {
+        std::cerr << "Error during benchmarking: " << e.what() << std::endl;
+        return {0};
+    }
+}
+
+cactus_bench_suite_result_c_t cactus_bench_suite_c(cactus_context_handle_t handle, const cactus_bench_config_c_t* configs, int32_t count) {
+    cactus_bench_suite_result_c_t result = {};
+    if (!handle || !configs || count <= 0) {
+        return result;
+    }
+    
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    if (!context->model) {
+        return result;
+    }
+    try {
+        std::vector<cactus::cactus_bench_config> cpp_configs(count);
+        for (int32_t i = 0; i < count; ++i) {
+            const cactus_bench_config_c_t &c = configs[i];
+            cactus::cactus_bench_config &config = cpp_configs[i];
+            config.pp = c.pp;
+            config.tg = c.tg;
+            config.pl = c.pl;
+            config.nr = c.nr;
+            config.warmup = c.warmup;
+            config.n_batch = c.n_batch;
+            config.n_ubatch = c.n_ubatch;
+            config.n_threads = c.n_threads;
+            config.n_threads_batch = c.n_threads_batch;
+            config.flash_attn = c.flash_attn;
+            config.type_k = c.type_k < 0 ? LM_GGML_TYPE_COUNT : (lm_ggml_type)c.type_k;
+            config.type_v = c.type_v < 0 ? LM_GGML_TYPE_COUNT : (lm_ggml_type)c.type_v;
+        }
         
-        std::istringstream ss(bench_json);
-        std::string token;
-        std::vector<std::string> tokens;
+        std::vector<cactus::cactus_bench_result> runs = context->benchSuite(cpp_configs);
         
-        ss.ignore(1);
-        while (std::getline(ss, token, ',')) {
-            if (token.back() == ']') token.pop_back();
-            tokens.push_back(token);
+        char model_desc[128];
+        llama_model_desc(context->model, model_desc, sizeof(model_desc));
+        result.model_name = safe_strdup(model_desc);
+        result.model_size = llama_model_size(context->model);
+        result.model_params = llama_model_n_params(context->model);
+        if (runs.empty()) {
+            return result;
         }
         
-        if (tokens.size() >= 6) {
-            result.pp_avg = std::stod(tokens[3]);
-            result.pp_std = std::stod(tokens[4]);
-            result.tg_avg = std::stod(tokens[5]);
-            result.tg_std = tokens.size() > 6 ? std::stod(tokens[6]) : 0.0;
+        result.runs = (cactus_bench_run_c_t*)calloc(runs.size(), sizeof(cactus_bench_run_c_t));
+        if (!result.runs) {
+            return result;
+        }
+        result.count = (int32_t)runs.size();
+        for (size_t i = 0; i < runs.size(); ++i) {
+            const cactus::cactus_bench_result &run = runs[i];
+            cactus_bench_run_c_t &out = result.runs[i];
+            out.config = {
+                run.config.pp, run.config.tg, run.config.pl, run.config.nr, run.config.warmup,
+                run.config.n_batch, run.config.n_ubatch, run.config.n_threads, run.config.n_threads_batch,
+                run.config.flash_attn, (int32_t)run.config.type_k, (int32_t)run.config.type_v
+            };
+            out.runs = run.runs;
+            out.pp_avg = run.pp_avg;
+            out.pp_std = run.pp_std;
+            out.tg_avg = run.tg_avg;
+            out.tg_std = run.tg_std;
+            out.ttft_ms = run.ttft_ms;
+            out.tg_p50_ms = run.tg_p50_ms;
+            out.tg_p95_ms = run.tg_p95_ms;
+            out.tg_p99_ms = run.tg_p99_ms;
+            out.peak_memory = (int64_t)run.peak_memory;
+            out.peak_buffers = (int64_t)run.peak_buffers;
         }
-        
         return result;
     } catch (const std::exception& e) {
-        std::cerr << "Error during benchmarking: " << e.what() << std::endl;
-        return {0};
+        std::cerr << "Error during benchmark suite: " << e.what() << std::endl;
+        cactus_free_bench_suite_result_members_c(&result);
+        return result;
+    }
+}
+
+void cactus_set_op_profiling_c(cactus_context_handle_t handle, bool enabled) {
+    if (!handle) {
+        return;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    context->setOpProfiling(enabled);
+}
+
+cactus_op_profile_c_t cactus_get_op_profile_c(cactus_context_handle_t handle) {
+    cactus_op_profile_c_t result = {};
+    if (!handle) {
+        return result;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    try {
+        std::vector<cactus::cactus_op_stats> rows = context->opProfile();
+        if (rows.empty()) {
+            return result;
+        }
+        result.ops = (cactus_op_stats_c_t*)calloc(rows.size(), sizeof(cactus_op_stats_c_t));
+        if (!result.ops) {
+            return result;
+        }
+        result.count = (int32_t)rows.size();
+        for (size_t i = 0; i < rows.size(); ++i) {
+            cactus_op_stats_c_t &op = result.ops[i];
+            op.op = safe_strdup(rows[i].op);
+            op.type = safe_strdup(rows[i].type);
+            op.shape = safe_strdup(rows[i].shape);
+            op.count = rows[i].count;
+            op.time_us = rows[i].time_us;
+            op.bytes = (int64_t)rows[i].bytes;
+            op.flops = (int64_t)rows[i].flops;
+        }
+        return result;
+    } catch (const std::exception& e) {
+        std::cerr << "Error collecting op profile: " << e.what() << std::endl;
+        cactus_free_op_profile_members_c(&result);
+        return result;
+    }
+}
+
+cactus_buffer_usage_list_c_t cactus_get_buffer_memory_usage_c(void) {
+    cactus_buffer_usage_list_c_t result = {};
+    try {
+        size_t peak_total = 0;
+        std::vector<cactus::cactus_buffer_usage> rows = cactus::buffer_memory_usage(&peak_total);
+        result.peak_total = (int64_t)peak_total;
+        if (rows.empty()) {
+            return result;
+        }
+        result.buffers = (cactus_buffer_usage_c_t*)calloc(rows.size(), sizeof(cactus_buffer_usage_c_t));
+        if (!result.buffers) {
+            return result;
+        }
+        result.count = (int32_t)rows.size();
+        for (size_t i = 0; i < rows.size(); ++i) {
+            cactus_buffer_usage_c_t &row = result.buffers[i];
+            row.category = safe_strdup(rows[i].category);
+            row.buffer_type = safe_strdup(rows[i].buffer_type);
+            row.current = (int64_t)rows[i].current;
+            row.peak = (int64_t)rows[i].peak;
+            row.n_buffers = (int32_t)rows[i].n_buffers;
+        }
+        return result;
+    } catch (const std::exception& e) {
+        std::cerr << "Error collecting buffer memory usage: " << e.what() << std::endl;
+        cactus_free_buffer_usage_list_members_c(&result);
+        return result;
+    }
+}
+
+char* cactus_kernel_bench_c(int32_t n_threads, int32_t nr, const char* baseline_json, double tolerance, bool* regressed) {
+    if (regressed) {
+        *regressed = false;
+    }
+    try {
+        std::vector<cactus::cactus_kernel_bench_result> results = cactus::kernel_bench(n_threads, nr);
+        if (baseline_json && baseline_json[0] != '\0') {
+            bool passed = cactus::kernel_bench_compare(results, baseline_json, tolerance);
+            if (regressed) {
+                *regressed = !passed;
+            }
+        }
+        return safe_strdup(cactus::kernel_bench_json(results));
+    } catch (const std::exception& e) {
+        std::cerr << "Error running kernel benchmark: " << e.what() << std::endl;
+        return nullptr;
+    }
+}
+
+void cactus_set_request_recording_c(cactus_context_handle_t handle, bool enabled, bool hash_prompts) {
+    if (!handle) {
+        return;
+    }
+    reinterpret_cast<cactus::cactus_context*>(handle)->setRequestRecording(enabled, hash_prompts);
+}
+
+char* cactus_get_request_trace_c(cactus_context_handle_t handle) {
+    if (!handle) {
+        return nullptr;
+    }
+    try {
+        return safe_strdup(cactus::request_trace_json(reinterpret_cast<cactus::cactus_context*>(handle)->request_records));
+    } catch (const std::exception& e) {
+        std::cerr << "Error serializing request trace: " << e.what() << std::endl;
+        return nullptr;
+    }
+}
+
+char* cactus_replay_request_trace_c(cactus_context_handle_t handle, const char* trace_json, bool honor_timing) {
+    if (!handle || !trace_json) {
+        return nullptr;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    try {
+        std::vector<cactus::cactus_request_record> records;
+        if (!cactus::parse_request_trace(trace_json, context->params.sampling, records)) {
+            return nullptr;
+        }
+        context->is_interrupted = false;
+        cactus::cactus_replay_result result;
+        if (!context->replayRequests(records, honor_timing, result)) {
+            return nullptr;
+        }
+        return safe_strdup(cactus::replay_result_json(result));
+    } catch (const std::exception& e) {
+        std::cerr << "Error replaying request trace: " << e.what() << std::endl;
+        return nullptr;
     }
 }
 
@@ -854,6 +1969,106 @@ void cactus_remove_lora_adapters_c(cactus_context_handle_t handle) {
     }
 }
 
+int cactus_set_sequence_lora_adapters_c(cactus_context_handle_t handle, int32_t seq_id, const cactus_lora_adapters_c_t* adapters) {
+    if (!handle) {
+        return -1;
+    }
+
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    try {
+        std::vector<common_adapter_lora_info> lora_adapters;
+        for (int i = 0; adapters && i < adapters->count; ++i) {
+            common_adapter_lora_info adapter;
+            adapter.path = adapters->adapters[i].path ? adapters->adapters[i].path : "";
+            adapter.scale = adapters->adapters[i].scale;
+            lora_adapters.push_back(adapter);
+        }
+        return context->setSequenceLoraAdapters(seq_id, lora_adapters);
+    } catch (const std::exception& e) {
+        std::cerr << "Error setting sequence LoRA adapters: " << e.what() << std::endl;
+        return -2;
+    }
+}
+
+void cactus_set_lora_cache_capacity_c(cactus_context_handle_t handle, int64_t capacity_bytes) {
+    if (!handle) {
+        return;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    context->setLoraCacheCapacity(capacity_bytes > 0 ? (size_t)capacity_bytes : 0);
+}
+
+cactus_lora_cache_stats_c_t cactus_get_lora_cache_stats_c(cactus_context_handle_t handle) {
+    cactus_lora_cache_stats_c_t result = {};
+    if (!handle) {
+        return result;
+    }
+    const cactus::cactus_lora_registry &registry = reinterpret_cast<cactus::cactus_context*>(handle)->lora_registry;
+    result.capacity_bytes = (int64_t)registry.capacity_bytes;
+    result.bytes = (int64_t)registry.bytes;
+    result.n_resident = (int32_t)registry.size();
+    result.n_loads = (int64_t)registry.n_loads;
+    result.n_hits = (int64_t)registry.n_hits;
+    result.n_evictions = (int64_t)registry.n_evictions;
+    result.load_us = registry.t_load_us;
+    result.evict_us = registry.t_evict_us;
+    result.switch_us = registry.t_switch_us;
+    return result;
+}
+
+int cactus_merge_lora_adapter_c(cactus_context_handle_t handle, const char* path, float scale, bool background) {
+    if (!handle || !path) {
+        return -1;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    try {
+        return context->mergeLoraAdapter(path, scale, background);
+    } catch (const std::exception& e) {
+        std::cerr << "Error merging LoRA adapter: " << e.what() << std::endl;
+        return -2;
+    }
+}
+
+void cactus_unmerge_lora_adapter_c(cactus_context_handle_t handle) {
+    if (!handle) {
+        return;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    context->unmergeLoraAdapter();
+}
+
+int cactus_apply_control_vectors_c(cactus_context_handle_t handle, const cactus_control_vectors_c_t* vectors, int32_t il_start, int32_t il_end) {
+    if (!handle) {
+        return -1;
+    }
+
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    try {
+        std::vector<common_control_vector_load_info> control_vectors;
+        for (int i = 0; vectors && i < vectors->count; ++i) {
+            if (!vectors->vectors[i].path) {
+                continue;
+            }
+            common_control_vector_load_info info;
+            info.fname = vectors->vectors[i].path;
+            info.strength = vectors->vectors[i].strength;
+            control_vectors.push_back(info);
+        }
+        return context->applyControlVectors(control_vectors, il_start, il_end);
+    } catch (const std::exception& e) {
+        std::cerr << "Error applying control vectors: " << e.what() << std::endl;
+        return -2;
+    }
+}
+
+void cactus_remove_control_vectors_c(cactus_context_handle_t handle) {
+    if (!handle) {
+        return;
+    }
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    context->removeControlVectors();
+}
+
 cactus_lora_adapters_c_t cactus_get_loaded_lora_adapters_c(cactus_context_handle_t handle) {
     cactus_lora_adapters_c_t result = {nullptr, 0};
     if (!handle) {
@@ -1041,6 +2256,31 @@ void cactus_load_prompt_with_media_c(cactus_context_handle_t handle, const char*
     }
 }
 
+int cactus_prefill_step_c(cactus_context_handle_t handle, int32_t budget) {
+    if (!handle) {
+        return -1;
+    }
+    
+    cactus::cactus_context* context = reinterpret_cast<cactus::cactus_context*>(handle);
+    try {
+        bool done = context->prefillStep(budget);
+        if (!context->has_next_token) {
+            return -2;
+        }
+        return done ? 1 : 0;
+    } catch (const std::exception& e) {
+        std::cerr << "Error during prefill step: " << e.what() << std::endl;
+        return -3;
+    }
+}
+
+float cactus_get_prefill_progress_c(cactus_context_handle_t handle) {
+    if (!handle) {
+        return 0.0f;
+    }
+    return reinterpret_cast<cactus::cactus_context*>(handle)->prefillProgress();
+}
+
 int cactus_do_completion_step_c(cactus_context_handle_t handle, char** token_text) {
     if (!handle || !token_text) {
         return -1;
@@ -1055,8 +2295,7 @@ int cactus_do_completion_step_c(cactus_context_handle_t handle, char** token_tex
             return -1;
         }
         
-        std::string token_str = cactus::tokens_to_output_formatted_string(context->ctx, token_output.tok);
-        *token_text = safe_strdup(token_str);
+        *token_text = safe_strdup(cactus::format_token_piece(context->token_piece));
         return token_output.tok;
     } catch (const std::exception& e) {
         std::cerr << "Error doing completion step: " << e.what() << std::endl;
@@ -1152,6 +2391,13 @@ int64_t cactus_get_model_params_c(cactus_context_handle_t handle) {
     }
 }
 
+double cactus_get_warmup_ms_c(cactus_context_handle_t handle) {
+    if (!handle) {
+        return 0.0;
+    }
+    return reinterpret_cast<cactus::cactus_context*>(handle)->warmup_ms;
+}
+
 void cactus_free_bench_result_members_c(cactus_bench_result_c_t* result) {
     if (result) {
         cactus_free_string_c(result->model_name);
@@ -1159,6 +2405,41 @@ void cactus_free_bench_result_members_c(cactus_bench_result_c_t* result) {
     }
 }
 
+void cactus_free_bench_suite_result_members_c(cactus_bench_suite_result_c_t* result) {
+    if (result) {
+        cactus_free_string_c(result->model_name);
+        result->model_name = nullptr;
+        free(result->runs);
+        result->runs = nullptr;
+        result->count = 0;
+    }
+}
+
+void cactus_free_op_profile_members_c(cactus_op_profile_c_t* profile) {
+    if (profile && profile->ops) {
+        for (int32_t i = 0; i < profile->count; ++i) {
+            cactus_free_string_c(profile->ops[i].op);
+            cactus_free_string_c(profile->ops[i].type);
+            cactus_free_string_c(profile->ops[i].shape);
+        }
+        free(profile->ops);
+        profile->ops = nullptr;
+        profile->count = 0;
+    }
+}
+
+void cactus_free_buffer_usage_list_members_c(cactus_buffer_usage_list_c_t* list) {
+    if (list && list->buffers) {
+        for (int32_t i = 0; i < list->count; ++i) {
+            cactus_free_string_c(list->buffers[i].category);
+            cactus_free_string_c(list->buffers[i].buffer_type);
+        }
+        free(list->buffers);
+        list->buffers = nullptr;
+        list->count = 0;
+    }
+}
+
 void cactus_free_lora_adapters_c(cactus_lora_adapters_c_t* adapters) {
     if (adapters && adapters->adapters) {
         for (int i = 0; i < adapters->count; ++i) {
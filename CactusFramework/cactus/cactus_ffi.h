@@ -35,6 +35,8 @@ extern "C" {
 #endif
 
 typedef struct cactus_context_opaque* cactus_context_handle_t;
+typedef struct cactus_model_opaque* cactus_model_handle_t;
+typedef struct cactus_completion_job_opaque* cactus_completion_job_handle_t;
 
 
 typedef struct cactus_init_params_c {
@@ -55,9 +57,47 @@ typedef struct cactus_init_params_c {
     const char* cache_type_k; 
     const char* cache_type_v; 
     void (*progress_callback)(float progress); 
+    const char* prompt_cache_dir; // directory for persisted prompt KV state, NULL to disable
+    const char* draft_model_path; // draft model for speculative decoding, NULL to disable
+    int32_t n_draft;              // max tokens drafted per step, <= 0 for default
+    bool no_warmup;               // skip the prefill/decode warm-up at load
+    int32_t n_prefix_cache_seqs;  // extra KV sequences holding prompt prefixes shared across prompts, 0 to disable
+    int32_t n_kv_recent;          // with a quantized KV cache, newest cells kept in f16 before requantizing, 0 to disable
+    int32_t defrag_max_cells;     // KV cells a decode moves defragmenting, the rest on later decodes, 0 for all at once
+    int32_t compute_shrink_ms;    // compute buffers sized for decode and grown by prefills, shrunk again after this idle time, 0 for worst case
+    int32_t n_state_checkpoints;  // recurrent models: state snapshots per sequence for rollback, 0 to disable
+    int32_t state_checkpoint_interval; // recurrent models: tokens between automatic snapshots, 0 for only the speculative ones
 
 } cactus_init_params_c_t;
 
+typedef struct cactus_token_prob_c {
+    int32_t token;
+    float prob;
+} cactus_token_prob_c_t;
+
+// One generated token. text points at the UTF-8 bytes this token added to the output (not
+// NUL-terminated, possibly empty while a multi-byte character or stop word is pending); text and
+// probs are only valid during the callback.
+typedef struct cactus_token_event_c {
+    int32_t token;
+    int32_t index;                      // position among the generated tokens
+    const char* text;
+    int32_t text_len;
+    const cactus_token_prob_c_t* probs; // n_probs candidates when n_probs was requested
+    int32_t n_probs;
+    int64_t t_us;                       // microseconds since generation started
+    bool has_stats;                     // token_stats was requested; probs then come from the raw distribution
+    float logsumexp;                    // log partition function of the raw logits
+    float logprob;                      // raw log-probability of token
+    float entropy;                      // entropy of the raw distribution, in nats
+} cactus_token_event_c_t;
+
+// Receives count consecutive events; return false to stop the completion
+typedef bool (*cactus_token_event_callback_c)(const cactus_token_event_c_t* events, int32_t count, void* user_data);
+
+// Receives streamed TTS audio, 24 kHz mono float PCM, on the vocoding thread; return false to stop it
+typedef bool (*cactus_audio_chunk_callback_c)(const float* samples, int32_t count, void* user_data);
+
 typedef struct cactus_completion_params_c {
     const char* prompt;
     int32_t n_predict; 
@@ -81,6 +121,22 @@ typedef struct cactus_completion_params_c {
     int stop_sequence_count;
     const char* grammar; 
     bool (*token_callback)(const char* token_json);
+    int32_t lookup_ngram_size; // prompt-lookup speculation n-gram size, 0 to disable
+    int32_t self_spec_skip_layers; // layers the model skips to draft for itself, verified by the full model; 0 to disable
+    float context_shift_discard; // fraction of the window dropped on context shift, <= 0 for 0.5
+    int64_t timeout_ms; // wall-clock deadline for the whole request, 0 for none
+    bool grammar_fast_forward; // append grammar-forced tokens without sampling them
+    int32_t truncation_strategy; // 0 keep-tail, 1 keep-head, 2 middle-out, 3 message boundary
+    bool lean_sampling; // sample top-k/greedy straight from the logits when the chain allows it
+    int32_t probs_history_limit; // max tokens of n_probs history kept, 0 for unbounded
+    bool trace_stages; // record per-stage timing spans into cactus_completion_result_c_t.trace_json
+    cactus_token_event_callback_c token_event_callback; // binary alternative to token_callback, NULL to disable
+    void* token_event_user_data;
+    int32_t token_event_batch; // tokens per token_event_callback call, <= 1 for every token
+    cactus_audio_chunk_callback_c audio_chunk_callback; // vocode audio codes while generating, NULL to disable
+    void* audio_chunk_user_data;
+    int32_t audio_chunk_codes; // audio codes vocoded per chunk, <= 0 for the default (32)
+    bool token_stats; // compute logsumexp, entropy and raw log-probs per token from the logits row
 
 } cactus_completion_params_c_t;
 
@@ -95,6 +151,8 @@ typedef struct cactus_float_array_c {
     int32_t count;
 } cactus_float_array_c_t;
 
+// The strings of a completion result are owned by the context and stay valid until its next
+// completion begins; cactus_free_completion_result_members_c on them is a no-op
 typedef struct cactus_completion_result_c {
     char* text; 
     int32_t tokens_predicted;
@@ -104,6 +162,11 @@ typedef struct cactus_completion_result_c {
     bool stopped_word;
     bool stopped_limit;
     char* stopping_word; 
+    int32_t draft_tokens;
+    int32_t draft_accepted;
+    int32_t hot_path_allocs;
+    bool timed_out;
+    char* trace_json; // Chrome trace JSON when trace_stages was set, otherwise NULL
 } cactus_completion_result_c_t;
 
 typedef struct cactus_tokenize_result_c {
@@ -121,12 +184,68 @@ CACTUS_FFI_EXPORT cactus_context_handle_t cactus_init_context_c(const cactus_ini
 
 CACTUS_FFI_EXPORT void cactus_free_context_c(cactus_context_handle_t handle);
 
+// **SHARED WEIGHTS**
+// One model handle, many contexts, each with its own KV cache and state. The library keeps no
+// global mutable state, so different contexts may be driven from different threads at once;
+// a single context handle must still only be used by one thread at a time.
+// Loading reads model_path, n_gpu_layers, use_mmap and use_mlock from params.
+CACTUS_FFI_EXPORT cactus_model_handle_t cactus_load_model_c(const cactus_init_params_c_t* params);
+
+// Contexts created from the model stay valid after it is freed; the weights go with the last one.
+CACTUS_FFI_EXPORT void cactus_free_model_c(cactus_model_handle_t model);
+
+// model_path in params is ignored; LoRA adapters are applied per context afterwards.
+CACTUS_FFI_EXPORT cactus_context_handle_t cactus_init_context_from_model_c(cactus_model_handle_t model, const cactus_init_params_c_t* params);
+
+// Model handle for the weights of a context created by cactus_init_context_c, so contexts with other
+// settings (embedding mode, pooling, n_ctx, KV types) can share them. Free it with cactus_free_model_c.
+CACTUS_FFI_EXPORT cactus_model_handle_t cactus_get_model_c(cactus_context_handle_t handle);
+
 CACTUS_FFI_EXPORT int cactus_completion_c(
     cactus_context_handle_t handle,
     const cactus_completion_params_c_t* params,
     cactus_completion_result_c_t* result
 );
 
+// **ASYNC COMPLETION**
+// Runs cactus_completion_c on an internal worker thread; the context must not be used until
+// cactus_completion_finish_c returns. params is copied, and its token_callback and
+// token_event_callback are ignored: tokens are fetched with cactus_completion_poll_c instead.
+CACTUS_FFI_EXPORT cactus_completion_job_handle_t cactus_completion_start_c(
+    cactus_context_handle_t handle,
+    const cactus_completion_params_c_t* params
+);
+
+// Never blocks. Writes up to max_events pending tokens to events and returns how many; their text
+// and probs stay valid until the next poll or finish on the job. Returns -1 once generation has
+// ended and every token was delivered, -2 on invalid arguments.
+CACTUS_FFI_EXPORT int32_t cactus_completion_poll_c(
+    cactus_completion_job_handle_t job,
+    cactus_token_event_c_t* events,
+    int32_t max_events
+);
+
+// Asks the worker to stop after the current token; does not wait for it.
+CACTUS_FFI_EXPORT void cactus_completion_cancel_c(cactus_completion_job_handle_t job);
+
+// Waits for the worker, moves the outcome into result (which may be NULL) and frees the job.
+// Tokens not yet polled are discarded. Returns the cactus_completion_c status.
+CACTUS_FFI_EXPORT int cactus_completion_finish_c(
+    cactus_completion_job_handle_t job,
+    cactus_completion_result_c_t* result
+);
+
+// **PARALLEL COMPLETION**
+// Generates n candidates from one prompt prefill; results must hold n entries.
+// Returns the number of candidates written, fewer than n when not enough sequences are free, or a
+// negative error code.
+CACTUS_FFI_EXPORT int cactus_completion_n_c(
+    cactus_context_handle_t handle,
+    const cactus_completion_params_c_t* params,
+    int n,
+    cactus_completion_result_c_t* results
+);
+
 // **MULTIMODAL COMPLETION**
 CACTUS_FFI_EXPORT int cactus_multimodal_completion_c(
     cactus_context_handle_t handle,
@@ -143,6 +262,55 @@ CACTUS_FFI_EXPORT cactus_token_array_c_t cactus_tokenize_c(cactus_context_handle
 CACTUS_FFI_EXPORT char* cactus_detokenize_c(cactus_context_handle_t handle, const int32_t* tokens, int32_t count);
 
 CACTUS_FFI_EXPORT cactus_float_array_c_t cactus_embedding_c(cactus_context_handle_t handle, const char* text);
+// dims > 0 keeps the leading dims of a Matryoshka model, truncated before normalization
+CACTUS_FFI_EXPORT cactus_float_array_c_t cactus_embedding_dims_c(cactus_context_handle_t handle, const char* text, int32_t dims);
+// Embeds n texts as one row-major matrix of n * n_embd floats (free with cactus_free_float_array_c);
+// rows of empty texts are zero. Clears the KV state of every sequence.
+CACTUS_FFI_EXPORT cactus_float_array_c_t cactus_embedding_batch_c(cactus_context_handle_t handle, const char** texts, int32_t n, int32_t* n_embd);
+// As above with rows of the leading dims; *n_embd receives the row width actually used
+CACTUS_FFI_EXPORT cactus_float_array_c_t cactus_embedding_batch_dims_c(cactus_context_handle_t handle, const char** texts, int32_t n,
+                                                                       int32_t dims, int32_t* n_embd);
+
+// Scores n documents against query in input order (free with cactus_free_float_array_c); the context
+// must be an embedding one with pooling_type LLAMA_POOLING_TYPE_RANK (4). Higher is more relevant.
+CACTUS_FFI_EXPORT cactus_float_array_c_t cactus_rerank_c(cactus_context_handle_t handle, const char* query, const char** docs, int32_t n);
+
+// Persistent embedding cache in dir (created by the caller); NULL dir or capacity 0 disables it
+CACTUS_FFI_EXPORT bool cactus_set_embedding_cache_c(cactus_context_handle_t handle, const char* dir, int32_t capacity);
+
+CACTUS_FFI_EXPORT void cactus_get_embedding_cache_stats_c(cactus_context_handle_t handle, int64_t* hits, int64_t* misses, int64_t* entries);
+
+// Compact embedding storage: int8 returns the scale (x ~= scale * out); binary packs sign bits into (n + 7) / 8 bytes
+CACTUS_FFI_EXPORT float cactus_quantize_embedding_i8_c(const float* values, int32_t n, int8_t* out);
+CACTUS_FFI_EXPORT void cactus_quantize_embedding_binary_c(const float* values, int32_t n, uint8_t* out);
+CACTUS_FFI_EXPORT float cactus_vector_dot_f32_c(const float* a, const float* b, int32_t n);
+CACTUS_FFI_EXPORT float cactus_vector_cosine_f32_c(const float* a, const float* b, int32_t n);
+CACTUS_FFI_EXPORT int32_t cactus_vector_dot_i8_c(const int8_t* a, const int8_t* b, int32_t n);
+CACTUS_FFI_EXPORT int32_t cactus_vector_hamming_c(const uint8_t* a, const uint8_t* b, int32_t n_bytes);
+// type: 0 float32, 1 int8 (scales per row, may be NULL), 2 binary. Writes up to k matches, best first:
+// highest dot product, or lowest Hamming distance. Returns the number written.
+CACTUS_FFI_EXPORT int32_t cactus_vector_top_k_c(int32_t type, const void* query, const void* rows, const float* scales,
+                                                int32_t n_rows, int32_t dim, int32_t k, int32_t* indices, float* scores);
+
+// Embedding index (flat or HNSW); storage uses the cactus_vector_top_k_c type values
+typedef struct cactus_vector_index_opaque* cactus_vector_index_handle_t;
+
+CACTUS_FFI_EXPORT cactus_vector_index_handle_t cactus_vector_index_create_c(int32_t dim, int32_t storage, bool hnsw,
+                                                                            int32_t hnsw_m, int32_t ef_construction);
+// Maps the row data read-only; returns NULL when the file is missing or not an index
+CACTUS_FFI_EXPORT cactus_vector_index_handle_t cactus_vector_index_load_c(const char* path);
+CACTUS_FFI_EXPORT bool cactus_vector_index_save_c(cactus_vector_index_handle_t index, const char* path);
+CACTUS_FFI_EXPORT void cactus_vector_index_free_c(cactus_vector_index_handle_t index);
+// vectors is n rows of dim floats, for example from cactus_embedding_batch_c
+CACTUS_FFI_EXPORT void cactus_vector_index_add_c(cactus_vector_index_handle_t index, const uint64_t* ids, const float* vectors, int32_t n);
+CACTUS_FFI_EXPORT bool cactus_vector_index_remove_c(cactus_vector_index_handle_t index, uint64_t id);
+CACTUS_FFI_EXPORT int32_t cactus_vector_index_size_c(cactus_vector_index_handle_t index);
+// Writes up to k ids and scores, best first; ef <= 0 uses the default beam. Returns the number written.
+CACTUS_FFI_EXPORT int32_t cactus_vector_index_search_c(cactus_vector_index_handle_t index, const float* query, int32_t k,
+                                                       int32_t ef, uint64_t* ids, float* scores);
+// Embeds texts with the context and adds each row to the index as it is produced
+CACTUS_FFI_EXPORT bool cactus_vector_index_add_texts_c(cactus_context_handle_t handle, cactus_vector_index_handle_t index,
+                                                       const char** texts, const uint64_t* ids, int32_t n);
 
 CACTUS_FFI_EXPORT void cactus_free_string_c(char* str);
 
@@ -160,6 +328,15 @@ CACTUS_FFI_EXPORT void cactus_set_guide_tokens_c(cactus_context_handle_t handle,
 
 CACTUS_FFI_EXPORT int cactus_init_multimodal_c(cactus_context_handle_t handle, const char* mmproj_path, bool use_gpu);
 
+typedef struct {
+    bool use_gpu;
+    const char* weight_type; // e.g. "q8_0" to requantize the projector's f16 weights at load; NULL keeps them as stored
+    int32_t image_max_side;  // 0 = model default
+    int32_t max_slices;      // 0 = model default
+} cactus_multimodal_params_c_t;
+
+CACTUS_FFI_EXPORT int cactus_init_multimodal_with_params_c(cactus_context_handle_t handle, const char* mmproj_path, const cactus_multimodal_params_c_t* params);
+
 CACTUS_FFI_EXPORT bool cactus_is_multimodal_enabled_c(cactus_context_handle_t handle);
 
 CACTUS_FFI_EXPORT bool cactus_supports_vision_c(cactus_context_handle_t handle);
@@ -168,6 +345,49 @@ CACTUS_FFI_EXPORT bool cactus_supports_audio_c(cactus_context_handle_t handle);
 
 CACTUS_FFI_EXPORT void cactus_release_multimodal_c(cactus_context_handle_t handle);
 
+// Projected image/audio embeddings reused across prompts (32 MiB in memory by default); capacity 0
+// disables it, a non-NULL dir (created by the caller) also keeps them on disk
+CACTUS_FFI_EXPORT void cactus_set_media_embedding_cache_c(cactus_context_handle_t handle, int64_t capacity_bytes, const char* dir);
+
+CACTUS_FFI_EXPORT void cactus_get_media_embedding_cache_stats_c(cactus_context_handle_t handle, int64_t* hits, int64_t* misses, int64_t* bytes);
+
+// Keeps evaluated prompts on n_seqs of the context's sequences (the last ones, which completions
+// then cannot use) so a later prompt starting the same way forks the KV of its longest cached prefix
+// instead of evaluating it. capacity_tokens <= 0 holds up to half the context; n_seqs 0 disables it.
+// Returns false when the context has no sequences to spare.
+CACTUS_FFI_EXPORT bool cactus_set_prefix_cache_c(cactus_context_handle_t handle, int32_t n_seqs, int64_t capacity_tokens);
+
+CACTUS_FFI_EXPORT void cactus_get_prefix_cache_stats_c(cactus_context_handle_t handle, int64_t* hits, int64_t* misses, int64_t* reused_tokens);
+
+// Caps the KV cells of sequence seq_id at n_max_cells (0 removes the cap). At the cap, policy 0 fails
+// the decode, 1 evicts the sequence's oldest cells and 2 its oldest after the first n_sink ones.
+CACTUS_FFI_EXPORT bool cactus_set_sequence_quota_c(cactus_context_handle_t handle, int32_t seq_id, int32_t n_max_cells, int32_t policy, int32_t n_sink);
+
+// Runs the whole pending KV defrag now; call between completions. Returns false when nothing moved.
+CACTUS_FFI_EXPORT bool cactus_defrag_kv_cache_c(cactus_context_handle_t handle);
+
+// Frees the compute memory a prefill grew beyond the decode graph; call between completions. Returns the bytes freed.
+CACTUS_FFI_EXPORT int64_t cactus_shrink_compute_buffers_c(cactus_context_handle_t handle);
+
+CACTUS_FFI_EXPORT void cactus_get_kv_defrag_stats_c(cactus_context_handle_t handle, float* fragmentation, int64_t* steps, int64_t* cells_moved, int64_t* bytes_moved);
+
+// Lets idle sequences' KV state move to files in dir (created by the caller) when the cache runs out
+// of cells or the compute context is released, and come back from them when the sequence is used
+// again. cache_type "q8_0" (the default for NULL) or "q4_0" requantizes f16/f32 K and V on the way
+// out, "f16" keeps the cache's own types. A NULL or empty dir disables spilling.
+CACTUS_FFI_EXPORT bool cactus_set_kv_spill_c(cactus_context_handle_t handle, const char* dir, const char* cache_type);
+
+// In-memory audio (16 kHz mono float PCM). The returned reference (free with cactus_free_string_c)
+// can be passed wherever a media path is accepted until released; NULL on failure. A stream runs
+// its spectrogram as samples are pushed and may be used in a prompt at any point.
+CACTUS_FFI_EXPORT char* cactus_add_audio_c(cactus_context_handle_t handle, const float* samples, int64_t n_samples);
+
+CACTUS_FFI_EXPORT char* cactus_begin_audio_stream_c(cactus_context_handle_t handle);
+
+CACTUS_FFI_EXPORT bool cactus_push_audio_c(cactus_context_handle_t handle, const char* ref, const float* samples, int64_t n_samples);
+
+CACTUS_FFI_EXPORT void cactus_release_audio_c(cactus_context_handle_t handle, const char* ref);
+
 CACTUS_FFI_EXPORT int cactus_init_vocoder_c(cactus_context_handle_t handle, const char* vocoder_model_path);
 
 CACTUS_FFI_EXPORT bool cactus_is_vocoder_enabled_c(cactus_context_handle_t handle);
@@ -180,6 +400,23 @@ CACTUS_FFI_EXPORT cactus_token_array_c_t cactus_get_audio_guide_tokens_c(cactus_
 
 CACTUS_FFI_EXPORT cactus_float_array_c_t cactus_decode_audio_tokens_c(cactus_context_handle_t handle, const int32_t* tokens, int32_t count);
 
+// format: 0 float PCM, 1 int16 PCM, 2 AAC-LC in ADTS frames (Apple only); sample_rate 0 keeps 24 kHz
+typedef struct {
+    int32_t format;
+    int32_t sample_rate;
+    int32_t bitrate; // AAC bits per second, 0 for the encoder's choice
+} cactus_audio_output_c_t;
+
+// Upper bound in bytes of what cactus_decode_audio_tokens_into_c writes for count tokens
+CACTUS_FFI_EXPORT int64_t cactus_audio_output_bound_c(cactus_context_handle_t handle, int32_t count, const cactus_audio_output_c_t* output);
+
+// Vocodes, converts and encodes straight into the caller's buffer; bytes written, 0 on failure
+CACTUS_FFI_EXPORT int64_t cactus_decode_audio_tokens_into_c(cactus_context_handle_t handle, const int32_t* tokens, int32_t count, const cactus_audio_output_c_t* output, void* dst, int64_t capacity);
+
+// Speaks text sentence by sentence, up to n_parallel sentences at a time on their own sequences
+// (<= 0 for every sequence of the context), and returns 24 kHz mono PCM in text order
+CACTUS_FFI_EXPORT cactus_float_array_c_t cactus_synthesize_speech_c(cactus_context_handle_t handle, const char* speaker_json_str, const char* text, int32_t n_parallel);
+
 CACTUS_FFI_EXPORT void cactus_release_vocoder_c(cactus_context_handle_t handle);
 
 
@@ -193,6 +430,28 @@ typedef struct {
     int32_t count;
 } cactus_lora_adapters_c_t;
 
+typedef struct {
+    int64_t capacity_bytes;
+    int64_t bytes;          // resident, active adapters included
+    int32_t n_resident;
+    int64_t n_loads;
+    int64_t n_hits;
+    int64_t n_evictions;
+    int64_t load_us;        // total
+    int64_t evict_us;       // total
+    int64_t switch_us;      // last change of the active set
+} cactus_lora_cache_stats_c_t;
+
+typedef struct {
+    const char* path;
+    float strength;
+} cactus_control_vector_c_t;
+
+typedef struct {
+    cactus_control_vector_c_t* vectors;
+    int32_t count;
+} cactus_control_vectors_c_t;
+
 typedef struct {
     char* model_name;
     int64_t model_size;
@@ -203,10 +462,113 @@ typedef struct {
     double tg_std;
 } cactus_bench_result_c_t;
 
+// Zero / -1 keep the loaded context's setting; type_k / type_v are ggml types, -1 keeps
+typedef struct {
+    int32_t pp;
+    int32_t tg;
+    int32_t pl;
+    int32_t nr;
+    int32_t warmup;
+    int32_t n_batch;
+    int32_t n_ubatch;
+    int32_t n_threads;
+    int32_t n_threads_batch;
+    int32_t flash_attn;
+    int32_t type_k;
+    int32_t type_v;
+} cactus_bench_config_c_t;
+
+typedef struct {
+    cactus_bench_config_c_t config;
+    int32_t runs;
+    double pp_avg;
+    double pp_std;
+    double tg_avg;
+    double tg_std;
+    double ttft_ms;
+    double tg_p50_ms;
+    double tg_p95_ms;
+    double tg_p99_ms;
+    int64_t peak_memory;
+    int64_t peak_buffers;
+} cactus_bench_run_c_t;
+
+typedef struct {
+    char* model_name;
+    int64_t model_size;
+    int64_t model_params;
+    cactus_bench_run_c_t* runs;
+    int32_t count;
+} cactus_bench_suite_result_c_t;
+
+typedef struct {
+    char* op;
+    char* type;
+    char* shape;
+    int64_t count;
+    int64_t time_us;
+    int64_t bytes;
+    int64_t flops;
+} cactus_op_stats_c_t;
+
+typedef struct {
+    cactus_op_stats_c_t* ops; // sorted by time_us, descending
+    int32_t count;
+} cactus_op_profile_c_t;
+
+typedef struct {
+    char* category;     // weights, kv_cache, compute, output, mmproj, vocoder, other
+    char* buffer_type;
+    int64_t current;
+    int64_t peak;
+    int32_t n_buffers;
+} cactus_buffer_usage_c_t;
+
+typedef struct {
+    cactus_buffer_usage_c_t* buffers; // sorted by peak, descending
+    int32_t count;
+    int64_t peak_total;
+} cactus_buffer_usage_list_c_t;
+
 CACTUS_FFI_EXPORT cactus_bench_result_c_t cactus_bench_c(cactus_context_handle_t handle, int pp, int tg, int pl, int nr);
+CACTUS_FFI_EXPORT cactus_bench_suite_result_c_t cactus_bench_suite_c(cactus_context_handle_t handle, const cactus_bench_config_c_t* configs, int32_t count);
+// Per-op profiling synchronizes the backend after every node; enabling it clears earlier totals
+CACTUS_FFI_EXPORT void cactus_set_op_profiling_c(cactus_context_handle_t handle, bool enabled);
+CACTUS_FFI_EXPORT cactus_op_profile_c_t cactus_get_op_profile_c(cactus_context_handle_t handle);
+// Process-wide backend buffer accounting; peaks cover everything since load or the last benchmark run
+CACTUS_FFI_EXPORT cactus_buffer_usage_list_c_t cactus_get_buffer_memory_usage_c(void);
+// Model-free timing of the quantized CPU dot-product and repacked gemv/gemm kernels. Returns a JSON
+// array (free with cactus_free_string_c); with a baseline from an earlier run, entries slower than
+// tolerance (a fraction of GFLOP/s) are marked and *regressed is set.
+CACTUS_FFI_EXPORT char* cactus_kernel_bench_c(int32_t n_threads, int32_t nr, const char* baseline_json, double tolerance, bool* regressed);
+// Request traces for reproducing production latency: enabling starts a new trace of every request's
+// prompt tokens (hashed with hash_prompts), media sizes, sampling, grammar and timing
+CACTUS_FFI_EXPORT void cactus_set_request_recording_c(cactus_context_handle_t handle, bool enabled, bool hash_prompts);
+// The trace so far as JSON (free with cactus_free_string_c)
+CACTUS_FFI_EXPORT char* cactus_get_request_trace_c(cactus_context_handle_t handle);
+// Replays a trace through the completion path and returns the TTFT and inter-token latency
+// distributions as JSON (free with cactus_free_string_c), NULL on failure
+CACTUS_FFI_EXPORT char* cactus_replay_request_trace_c(cactus_context_handle_t handle, const char* trace_json, bool honor_timing);
 CACTUS_FFI_EXPORT int cactus_apply_lora_adapters_c(cactus_context_handle_t handle, const cactus_lora_adapters_c_t* adapters);
 CACTUS_FFI_EXPORT void cactus_remove_lora_adapters_c(cactus_context_handle_t handle);
 CACTUS_FFI_EXPORT cactus_lora_adapters_c_t cactus_get_loaded_lora_adapters_c(cactus_context_handle_t handle);
+// Adapters for one session sequence only, on top of the context-wide ones, so sequences with
+// different adapters decode in the same batch; NULL or an empty list removes them
+CACTUS_FFI_EXPORT int cactus_set_sequence_lora_adapters_c(cactus_context_handle_t handle, int32_t seq_id, const cactus_lora_adapters_c_t* adapters);
+// Adapters are loaded once and kept resident so switching between them only swaps pointers;
+// inactive ones are evicted least recently used past capacity_bytes (128 MiB by default)
+CACTUS_FFI_EXPORT void cactus_set_lora_cache_capacity_c(cactus_context_handle_t handle, int64_t capacity_bytes);
+CACTUS_FFI_EXPORT cactus_lora_cache_stats_c_t cactus_get_lora_cache_stats_c(cactus_context_handle_t handle);
+// Folds one adapter into the model weights (requantized, on a background thread when asked) so
+// decode runs at base-model speed; until the merge lands the adapter is applied as usual. The
+// merged weights are seen by every context on the model, unmerging restores the originals
+CACTUS_FFI_EXPORT int cactus_merge_lora_adapter_c(cactus_context_handle_t handle, const char* path, float scale, bool background);
+CACTUS_FFI_EXPORT void cactus_unmerge_lora_adapter_c(cactus_context_handle_t handle);
+// Control vectors summed with their strengths and added to the residual stream of layers
+// il_start..il_end (all when <= 0); files are parsed once, so changing strengths per request is
+// cheap. NULL or an empty list removes them
+CACTUS_FFI_EXPORT int cactus_apply_control_vectors_c(cactus_context_handle_t handle, const cactus_control_vectors_c_t* vectors, int32_t il_start, int32_t il_end);
+CACTUS_FFI_EXPORT void cactus_remove_control_vectors_c(cactus_context_handle_t handle);
 CACTUS_FFI_EXPORT bool cactus_validate_chat_template_c(cactus_context_handle_t handle, bool use_jinja, const char* name);
 CACTUS_FFI_EXPORT char* cactus_get_formatted_chat_c(cactus_context_handle_t handle, const char* messages, const char* chat_template);
 
@@ -236,6 +598,10 @@ CACTUS_FFI_EXPORT void cactus_end_completion_c(cactus_context_handle_t handle);
 CACTUS_FFI_EXPORT void cactus_load_prompt_c(cactus_context_handle_t handle);
 CACTUS_FFI_EXPORT void cactus_load_prompt_with_media_c(cactus_context_handle_t handle, const char** media_paths, int media_count);
 
+// Evaluates at most budget prompt tokens (<= 0 for n_batch); returns 1 when the prompt is fully evaluated,
+// 0 when more chunks remain, negative on error.
+CACTUS_FFI_EXPORT int cactus_prefill_step_c(cactus_context_handle_t handle, int32_t budget);
+CACTUS_FFI_EXPORT float cactus_get_prefill_progress_c(cactus_context_handle_t handle);
 CACTUS_FFI_EXPORT int cactus_do_completion_step_c(cactus_context_handle_t handle, char** token_text);
 CACTUS_FFI_EXPORT size_t cactus_find_stopping_strings_c(cactus_context_handle_t handle, const char* text, size_t last_token_size, int stop_type);
 
@@ -244,8 +610,12 @@ CACTUS_FFI_EXPORT int32_t cactus_get_n_embd_c(cactus_context_handle_t handle);
 CACTUS_FFI_EXPORT char* cactus_get_model_desc_c(cactus_context_handle_t handle);
 CACTUS_FFI_EXPORT int64_t cactus_get_model_size_c(cactus_context_handle_t handle);
 CACTUS_FFI_EXPORT int64_t cactus_get_model_params_c(cactus_context_handle_t handle);
+CACTUS_FFI_EXPORT double cactus_get_warmup_ms_c(cactus_context_handle_t handle);
 
 CACTUS_FFI_EXPORT void cactus_free_bench_result_members_c(cactus_bench_result_c_t* result);
+CACTUS_FFI_EXPORT void cactus_free_bench_suite_result_members_c(cactus_bench_suite_result_c_t* result);
+CACTUS_FFI_EXPORT void cactus_free_op_profile_members_c(cactus_op_profile_c_t* profile);
+CACTUS_FFI_EXPORT void cactus_free_buffer_usage_list_members_c(cactus_buffer_usage_list_c_t* list);
 CACTUS_FFI_EXPORT void cactus_free_lora_adapters_c(cactus_lora_adapters_c_t* adapters);
 CACTUS_FFI_EXPORT void cactus_free_chat_result_members_c(cactus_chat_result_c_t* result);
 
@@ -0,0 +1,156 @@
+#include "cactus.h"
+#include "common.h"
+#include "llama-grammar.h"
+#include "unicode.h"
+#include <string>
+#include <vector>
+
+namespace cactus {
+
+// Longest text every grammar stack agrees on, walked one code point at a time
+static std::string grammar_forced_text(llama_grammar *grammar, size_t max_chars) {
+    std::string text;
+    if (grammar->awaiting_trigger || grammar->partial_utf8.n_remain != 0) {
+        return text;
+    }
+
+    const llama_grammar_stacks saved = grammar->stacks;
+    while (text.size() < max_chars && !grammar->stacks.empty()) {
+        uint32_t chr = 0;
+        bool forced = true;
+        for (const auto &stack : grammar->stacks) {
+            if (stack.empty()) {
+                forced = false;
+                break;
+            }
+            const llama_grammar_element *pos = stack.back();
+            if (pos->type != LLAMA_GRETYPE_CHAR ||
+                pos[1].type == LLAMA_GRETYPE_CHAR_ALT || pos[1].type == LLAMA_GRETYPE_CHAR_RNG_UPPER ||
+                (chr != 0 && pos->value != chr)) {
+                forced = false;
+                break;
+            }
+            chr = pos->value;
+        }
+        if (!forced || chr == 0) {
+            break;
+        }
+        text += unicode_cpt_to_utf8(chr);
+        llama_grammar_accept(grammar, chr);
+    }
+    grammar->stacks = saved;
+    return text;
+}
+
+void cactus_context::initForcedGrammar() {
+    releaseForcedGrammar();
+    if (!grammar_fast_forward || model == nullptr || params.sampling.grammar.empty()) {
+        return;
+    }
+    // A lazy grammar (tool calls) forces nothing until its trigger fires, then forces the
+    // schema's keys and punctuation like any other
+    std::vector<std::string> trigger_patterns;
+    std::vector<llama_token> trigger_tokens;
+    common_grammar_triggers_to_patterns(params.sampling.grammar_triggers, trigger_patterns, trigger_tokens);
+    std::vector<const char *> trigger_patterns_c;
+    for (const std::string &pattern : trigger_patterns) {
+        trigger_patterns_c.push_back(pattern.c_str());
+    }
+    forced_grammar = llama_grammar_init_impl(llama_model_get_vocab(model), params.sampling.grammar.c_str(), "root",
+                                             params.sampling.grammar_lazy,
+                                             trigger_patterns_c.data(), trigger_patterns_c.size(),
+                                             trigger_tokens.data(), trigger_tokens.size());
+    if (forced_grammar == nullptr) {
+        LOG_WARNING("Grammar fast-forward disabled, failed to parse grammar");
+    }
+}
+
+void cactus_context::releaseForcedGrammar() {
+    if (forced_grammar != nullptr) {
+        llama_grammar_free_impl(forced_grammar);
+        forced_grammar = nullptr;
+    }
+    forced_tokens.clear();
+    forced_cursor = 0;
+}
+
+void cactus_context::acceptForcedGrammar(llama_token token) {
+    if (forced_grammar == nullptr || llama_vocab_is_eog(llama_model_get_vocab(model), token)) {
+        return;
+    }
+    try {
+        llama_grammar_accept_impl(*forced_grammar, token);
+    } catch (const std::exception &e) {
+        LOG_WARNING("Grammar fast-forward disabled: %s", e.what());
+        releaseForcedGrammar();
+    }
+}
+
+bool cactus_context::awaitingGrammarTrigger() const {
+    return forced_grammar != nullptr && forced_grammar->awaiting_trigger;
+}
+
+size_t cactus_context::queueForcedTokens() {
+    forced_tokens.clear();
+    forced_cursor = 0;
+    if (forced_grammar == nullptr || params.sampling.n_probs > 0 || params.sampling.token_stats) {
+        return 0;
+    }
+
+    const size_t n_room = std::min((size_t)params.n_batch - 1, (size_t)n_ctx - embd.size() - 1);
+    const std::string text = grammar_forced_text(forced_grammar, 256);
+    if (text.empty() || n_room == 0) {
+        return 0;
+    }
+
+    // The last token could merge with whatever the model writes next, so leave it to the sampler
+    std::vector<llama_token> tokens = common_tokenize(ctx, text, false, false);
+    if (tokens.size() < 2) {
+        return 0;
+    }
+    tokens.pop_back();
+    if (tokens.size() > n_room) {
+        tokens.resize(n_room);
+    }
+    if (params.n_predict > 0) {
+        tokens.resize(std::min(tokens.size(), n_remain > 0 ? n_remain - 1 : 0));
+    }
+
+    // Only keep tokens whose pieces spell out the forced text exactly
+    size_t offset = 0;
+    for (llama_token token : tokens) {
+        const std::string piece = common_token_to_piece(ctx, token);
+        if (piece.empty() || text.compare(offset, piece.size(), piece) != 0) {
+            break;
+        }
+        offset += piece.size();
+        forced_tokens.push_back(token);
+    }
+
+    LOG_VERBOSE("grammar forced %zu tokens: %s", forced_tokens.size(), text.substr(0, offset).c_str());
+    return forced_tokens.size();
+}
+
+completion_token_output cactus_context::nextForcedToken() {
+    completion_token_output result;
+    result.tok = forced_tokens[forced_cursor++];
+    if (forced_cursor == forced_tokens.size()) {
+        forced_tokens.clear();
+        forced_cursor = 0;
+    }
+
+    common_sampler_accept(ctx_sampling, result.tok, true);
+    acceptForcedGrammar(result.tok);
+    embd.push_back(result.tok);
+    n_forwarded++;
+    n_grammar_forced++;
+    num_tokens_predicted++;
+    if (n_remain > 0) {
+        --n_remain;
+    }
+
+    has_next_token = params.n_predict == -1 || n_remain > 0;
+    return result;
+}
+
+} // namespace cactus
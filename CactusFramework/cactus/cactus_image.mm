@@ -0,0 +1,130 @@
+#import <Foundation/Foundation.h>
+#import <ImageIO/ImageIO.h>
+#import <CoreGraphics/CoreGraphics.h>
+#import <Accelerate/Accelerate.h>
+#include "cactus.h"
+#include "tools/mtmd/mtmd.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace cactus {
+
+void decode_image_apple_size(int nx, int ny, int max_side, int &out_nx, int &out_ny) {
+    const int longest = std::max(nx, ny);
+    if (max_side <= 0 || longest <= max_side) {
+        out_nx = nx;
+        out_ny = ny;
+        return;
+    }
+    const double scale = (double)max_side / longest;
+    out_nx = std::max(1, (int)std::lround(nx * scale));
+    out_ny = std::max(1, (int)std::lround(ny * scale));
+}
+
+bool decode_image_apple_info(const uint8_t *data, size_t len, int max_side, int &out_nx, int &out_ny) {
+    @autoreleasepool {
+        CFDataRef cf_data = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, data, (CFIndex)len, kCFAllocatorNull);
+        if (cf_data == NULL) {
+            return false;
+        }
+        CGImageSourceRef source = CGImageSourceCreateWithData(cf_data, NULL);
+        CFRelease(cf_data);
+        if (source == NULL) {
+            return false;
+        }
+        // Reads the container's properties; no pixel data is decoded
+        CFDictionaryRef properties = CGImageSourceGetCount(source) > 0 ? CGImageSourceCopyPropertiesAtIndex(source, 0, NULL) : NULL;
+        CFRelease(source);
+        if (properties == NULL) {
+            return false;
+        }
+        NSDictionary *props = (__bridge NSDictionary *)properties;
+        const int nx = [props[(__bridge id)kCGImagePropertyPixelWidth] intValue];
+        const int ny = [props[(__bridge id)kCGImagePropertyPixelHeight] intValue];
+        CFRelease(properties);
+        if (nx <= 0 || ny <= 0) {
+            return false;
+        }
+        decode_image_apple_size(nx, ny, max_side, out_nx, out_ny);
+        return true;
+    }
+}
+
+// ImageIO subsamples JPEG/HEIC at the DCT level when asked for a thumbnail, so a 12 MP photo never
+// exists at full resolution; the thumbnail is then drawn at the exact target size, as RGBX because
+// CoreGraphics has no 24-bit bitmap context, and packed to the RGB that mtmd expects with vImage
+mtmd_bitmap *decode_image_apple(const uint8_t *data, size_t len, int max_side) {
+    @autoreleasepool {
+        CFDataRef cf_data = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, data, (CFIndex)len, kCFAllocatorNull);
+        if (cf_data == NULL) {
+            return nullptr;
+        }
+        CGImageSourceRef source = CGImageSourceCreateWithData(cf_data, NULL);
+        CFRelease(cf_data);
+        if (source == NULL) {
+            return nullptr;
+        }
+        if (CGImageSourceGetCount(source) == 0) {
+            CFRelease(source);
+            return nullptr;
+        }
+
+        // Target size comes from the full image the same way a skipped decode sizes its placeholder
+        int nx = 0;
+        int ny = 0;
+        CFDictionaryRef properties = CGImageSourceCopyPropertiesAtIndex(source, 0, NULL);
+        if (properties) {
+            NSDictionary *props = (__bridge NSDictionary *)properties;
+            decode_image_apple_size([props[(__bridge id)kCGImagePropertyPixelWidth] intValue],
+                                    [props[(__bridge id)kCGImagePropertyPixelHeight] intValue], max_side, nx, ny);
+            CFRelease(properties);
+        }
+
+        CGImageRef image = NULL;
+        if (max_side > 0) {
+            NSDictionary *options = @{
+                (__bridge id)kCGImageSourceCreateThumbnailFromImageAlways: @YES,
+                (__bridge id)kCGImageSourceThumbnailMaxPixelSize: @(max_side),
+                // stb_image ignores EXIF orientation; keep the same pixels on every platform
+                (__bridge id)kCGImageSourceCreateThumbnailWithTransform: @NO,
+                (__bridge id)kCGImageSourceShouldCacheImmediately: @YES,
+            };
+            image = CGImageSourceCreateThumbnailAtIndex(source, 0, (__bridge CFDictionaryRef)options);
+        } else {
+            image = CGImageSourceCreateImageAtIndex(source, 0, NULL);
+        }
+        CFRelease(source);
+        if (image == NULL) {
+            return nullptr;
+        }
+        if (nx <= 0 || ny <= 0) {
+            nx = (int)CGImageGetWidth(image);
+            ny = (int)CGImageGetHeight(image);
+        }
+
+        std::vector<uint8_t> rgbx((size_t)nx * ny * 4);
+        CGColorSpaceRef color_space = CGColorSpaceCreateDeviceRGB();
+        CGContextRef context = CGBitmapContextCreate(rgbx.data(), nx, ny, 8, (size_t)nx * 4, color_space,
+                                                     kCGImageAlphaNoneSkipLast | kCGBitmapByteOrderDefault);
+        CGColorSpaceRelease(color_space);
+        if (context == NULL) {
+            CGImageRelease(image);
+            return nullptr;
+        }
+        CGContextSetInterpolationQuality(context, kCGInterpolationHigh);
+        CGContextDrawImage(context, CGRectMake(0, 0, nx, ny), image);
+        CGContextRelease(context);
+        CGImageRelease(image);
+
+        std::vector<uint8_t> rgb((size_t)nx * ny * 3);
+        vImage_Buffer src = { rgbx.data(), (vImagePixelCount)ny, (vImagePixelCount)nx, (size_t)nx * 4 };
+        vImage_Buffer dst = { rgb.data(), (vImagePixelCount)ny, (vImagePixelCount)nx, (size_t)nx * 3 };
+        if (vImageConvert_RGBA8888toRGB888(&src, &dst, kvImageNoFlags) != kvImageNoError) {
+            return nullptr;
+        }
+        return mtmd_bitmap_init((uint32_t)nx, (uint32_t)ny, rgb.data());
+    }
+}
+
+} // namespace cactus
@@ -0,0 +1,269 @@
+#include "cactus.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+#include "json.hpp"
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace cactus {
+
+// Weight types with a *_q8_* dot product on the CPU backend
+static const lm_ggml_type kernel_bench_types[] = {
+    LM_GGML_TYPE_Q4_0, LM_GGML_TYPE_Q4_1, LM_GGML_TYPE_Q5_0, LM_GGML_TYPE_Q5_1, LM_GGML_TYPE_Q8_0,
+    LM_GGML_TYPE_Q2_K, LM_GGML_TYPE_Q3_K, LM_GGML_TYPE_Q4_K, LM_GGML_TYPE_Q5_K, LM_GGML_TYPE_Q6_K,
+    LM_GGML_TYPE_IQ4_NL, LM_GGML_TYPE_IQ4_XS,
+};
+
+// Types the CPU_AARCH64 buffer can repack into interleaved gemv/gemm layouts
+static const lm_ggml_type kernel_bench_repack_types[] = {
+    LM_GGML_TYPE_Q4_0, LM_GGML_TYPE_Q8_0, LM_GGML_TYPE_Q4_K, LM_GGML_TYPE_Q5_K, LM_GGML_TYPE_Q6_K,
+    LM_GGML_TYPE_IQ4_NL,
+};
+
+// {K, M} of the attention and FFN projections of 1B (Llama 3.2 1B) and 8B (Llama 3.1 8B) models
+static const int64_t kernel_bench_shapes[][2] = {
+    {2048, 2048}, {2048, 8192}, {8192, 2048},
+    {4096, 4096}, {4096, 14336}, {14336, 4096},
+};
+
+// Prompt columns for gemm; 1 column takes the gemv path
+static const int64_t kernel_bench_columns[] = {1, 16};
+
+static double median_us(std::vector<int64_t> &samples) {
+    std::sort(samples.begin(), samples.end());
+    const size_t n = samples.size();
+    return n % 2 ? (double)samples[n / 2] : 0.5 * (double)(samples[n / 2 - 1] + samples[n / 2]);
+}
+
+static void fill_result(cactus_kernel_bench_result &r, std::vector<int64_t> &samples, double bytes, double flops) {
+    r.runs = (int32_t)samples.size();
+    r.us = median_us(samples);
+    if (r.us > 0.0) {
+        r.gbps = bytes / (r.us * 1e3);
+        r.gflops = flops / (r.us * 1e3);
+    }
+}
+
+static bool bench_vec_dot(lm_ggml_type type, int64_t k, int64_t m, int32_t nr, const std::vector<float> &src,
+                          cactus_kernel_bench_result &out) {
+    const struct lm_ggml_type_traits_cpu *traits = lm_ggml_get_type_traits_cpu(type);
+    if (!traits->vec_dot || k % lm_ggml_blck_size(type) != 0) {
+        return false;
+    }
+    const lm_ggml_type vdt = traits->vec_dot_type;
+    const struct lm_ggml_type_traits_cpu *vdt_traits = lm_ggml_get_type_traits_cpu(vdt);
+    if (vdt != LM_GGML_TYPE_F32 && !vdt_traits->from_float) {
+        return false;
+    }
+
+    const size_t row_size = lm_ggml_row_size(type, k);
+    const size_t act_size = lm_ggml_row_size(vdt, k);
+    std::vector<uint8_t> weights(row_size * m);
+    std::vector<uint8_t> act(act_size);
+    std::vector<float> dst(m);
+    lm_ggml_quantize_chunk(type, src.data(), weights.data(), 0, m, k, nullptr);
+    if (vdt == LM_GGML_TYPE_F32) {
+        memcpy(act.data(), src.data(), act_size);
+    } else {
+        vdt_traits->from_float(src.data(), act.data(), k);
+    }
+
+    std::vector<int64_t> samples;
+    for (int32_t i = -1; i < nr; i++) {
+        const int64_t t_start = lm_ggml_time_us();
+        for (int64_t r = 0; r < m; r++) {
+            traits->vec_dot((int)k, &dst[r], 0, weights.data() + r * row_size, 0, act.data(), 0, 1);
+        }
+        // First pass warms caches and page-faults the buffers
+        if (i >= 0) {
+            samples.push_back(lm_ggml_time_us() - t_start);
+        }
+    }
+
+    out.kernel = "vec_dot";
+    out.type = lm_ggml_type_name(type);
+    out.k = k;
+    out.m = m;
+    out.n = 1;
+    fill_result(out, samples, (double)(weights.size() + act_size + dst.size() * sizeof(float)), 2.0 * k * m);
+    return true;
+}
+
+// Goes through MUL_MAT so the weights take the same repacked layout as a loaded model;
+// the measured time includes quantizing the activations to the kernel's vec_dot type
+static bool bench_repacked(lm_ggml_backend_t backend, lm_ggml_backend_buffer_type_t buft, lm_ggml_type type,
+                           int64_t k, int64_t m, int64_t n, int32_t nr, const std::vector<float> &src,
+                           cactus_kernel_bench_result &out) {
+    if (k % lm_ggml_blck_size(type) != 0) {
+        return false;
+    }
+    struct lm_ggml_init_params wparams = { lm_ggml_tensor_overhead(), nullptr, true };
+    struct lm_ggml_context *ctx_w = lm_ggml_init(wparams);
+    struct lm_ggml_tensor *w = lm_ggml_new_tensor_2d(ctx_w, type, k, m);
+    lm_ggml_backend_buffer_t buf_w = lm_ggml_backend_alloc_ctx_tensors_from_buft(ctx_w, buft);
+    // The buffer leaves extra unset when no repacked layout fits this CPU and shape
+    if (!buf_w || !w->extra) {
+        lm_ggml_backend_buffer_free(buf_w);
+        lm_ggml_free(ctx_w);
+        return false;
+    }
+    std::vector<uint8_t> weights(lm_ggml_nbytes(w));
+    lm_ggml_quantize_chunk(type, src.data(), weights.data(), 0, m, k, nullptr);
+    lm_ggml_backend_tensor_set(w, weights.data(), 0, weights.size());
+
+    struct lm_ggml_init_params cparams = { 4 * lm_ggml_tensor_overhead() + lm_ggml_graph_overhead(), nullptr, true };
+    struct lm_ggml_context *ctx = lm_ggml_init(cparams);
+    struct lm_ggml_tensor *x = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F32, k, n);
+    struct lm_ggml_tensor *y = lm_ggml_mul_mat(ctx, w, x);
+    struct lm_ggml_cgraph *gf = lm_ggml_new_graph(ctx);
+    lm_ggml_build_forward_expand(gf, y);
+    lm_ggml_backend_buffer_t buf = lm_ggml_backend_alloc_ctx_tensors(ctx, backend);
+    bool ok = buf != nullptr;
+    std::vector<int64_t> samples;
+    if (ok) {
+        for (int64_t c = 0; c < n; c++) {
+            lm_ggml_backend_tensor_set(x, src.data() + c * k, c * x->nb[1], k * sizeof(float));
+        }
+        for (int32_t i = -1; i < nr && ok; i++) {
+            const int64_t t_start = lm_ggml_time_us();
+            ok = lm_ggml_backend_graph_compute(backend, gf) == LM_GGML_STATUS_SUCCESS;
+            if (i >= 0) {
+                samples.push_back(lm_ggml_time_us() - t_start);
+            }
+        }
+    }
+    if (ok) {
+        out.kernel = n == 1 ? "gemv" : "gemm";
+        out.type = lm_ggml_type_name(type);
+        out.k = k;
+        out.m = m;
+        out.n = n;
+        fill_result(out, samples, (double)(lm_ggml_nbytes(w) + lm_ggml_nbytes(x) + lm_ggml_nbytes(y)), 2.0 * k * m * n);
+    }
+
+    lm_ggml_backend_buffer_free(buf);
+    lm_ggml_free(ctx);
+    lm_ggml_backend_buffer_free(buf_w);
+    lm_ggml_free(ctx_w);
+    return ok;
+}
+
+static lm_ggml_backend_buffer_type_t repack_buffer_type() {
+    lm_ggml_backend_reg_t reg = lm_ggml_backend_cpu_reg();
+    auto get_extra_bufts = (lm_ggml_backend_dev_get_extra_bufts_t)
+        lm_ggml_backend_reg_get_proc_address(reg, "lm_ggml_backend_dev_get_extra_bufts");
+    if (!get_extra_bufts) {
+        return nullptr;
+    }
+    lm_ggml_backend_buffer_type_t *bufts = get_extra_bufts(lm_ggml_backend_reg_dev_get(reg, 0));
+    for (; bufts && *bufts; bufts++) {
+        if (strcmp(lm_ggml_backend_buft_name(*bufts), "CPU_AARCH64") == 0) {
+            return *bufts;
+        }
+    }
+    return nullptr;
+}
+
+std::vector<cactus_kernel_bench_result> kernel_bench(int32_t n_threads, int32_t nr) {
+    lm_ggml_cpu_init();
+    nr = std::max(nr, 1);
+
+    int64_t max_elems = 0;
+    for (const auto &shape : kernel_bench_shapes) {
+        max_elems = std::max(max_elems, shape[0] * shape[1]);
+    }
+    std::vector<float> src(max_elems);
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for (float &v : src) {
+        v = dist(rng);
+    }
+
+    std::vector<cactus_kernel_bench_result> results;
+    for (lm_ggml_type type : kernel_bench_types) {
+        for (const auto &shape : kernel_bench_shapes) {
+            cactus_kernel_bench_result r;
+            if (bench_vec_dot(type, shape[0], shape[1], nr, src, r)) {
+                results.push_back(r);
+            }
+        }
+    }
+
+    lm_ggml_backend_buffer_type_t buft = repack_buffer_type();
+    lm_ggml_backend_t backend = buft ? lm_ggml_backend_cpu_init() : nullptr;
+    if (!backend) {
+        LOG_INFO("No repacked CPU buffer type, skipping gemv/gemm kernels", "");
+        return results;
+    }
+    if (n_threads > 0) {
+        lm_ggml_backend_cpu_set_n_threads(backend, n_threads);
+    }
+    for (lm_ggml_type type : kernel_bench_repack_types) {
+        for (const auto &shape : kernel_bench_shapes) {
+            for (int64_t n : kernel_bench_columns) {
+                cactus_kernel_bench_result r;
+                if (bench_repacked(backend, buft, type, shape[0], shape[1], n, nr, src, r)) {
+                    results.push_back(r);
+                }
+            }
+        }
+    }
+    lm_ggml_backend_free(backend);
+    return results;
+}
+
+bool kernel_bench_compare(std::vector<cactus_kernel_bench_result> &results, const std::string &baseline_json, double tolerance) {
+    nlohmann::json baseline = nlohmann::json::parse(baseline_json, nullptr, false);
+    if (!baseline.is_array()) {
+        LOG_WARNING("Kernel baseline is not a JSON array", "");
+        return true;
+    }
+    bool passed = true;
+    for (cactus_kernel_bench_result &r : results) {
+        for (const auto &entry : baseline) {
+            if (entry.value("kernel", "") == r.kernel && entry.value("type", "") == r.type &&
+                entry.value("k", (int64_t)0) == r.k && entry.value("m", (int64_t)0) == r.m &&
+                entry.value("n", (int64_t)0) == r.n) {
+                r.baseline_gflops = entry.value("gflops", 0.0);
+                break;
+            }
+        }
+        r.regressed = r.baseline_gflops > 0.0 && r.gflops < r.baseline_gflops * (1.0 - tolerance);
+        if (r.regressed) {
+            LOG_WARNING("%s %s k=%lld m=%lld n=%lld regressed: %.2f GFLOP/s vs baseline %.2f",
+                r.kernel.c_str(), r.type.c_str(), (long long)r.k, (long long)r.m, (long long)r.n,
+                r.gflops, r.baseline_gflops);
+            passed = false;
+        }
+    }
+    return passed;
+}
+
+std::string kernel_bench_json(const std::vector<cactus_kernel_bench_result> &results) {
+    nlohmann::json rows = nlohmann::json::array();
+    for (const cactus_kernel_bench_result &r : results) {
+        nlohmann::json row = {
+            {"kernel", r.kernel},
+            {"type", r.type},
+            {"k", r.k},
+            {"m", r.m},
+            {"n", r.n},
+            {"runs", r.runs},
+            {"us", r.us},
+            {"gbps", r.gbps},
+            {"gflops", r.gflops},
+        };
+        if (r.baseline_gflops > 0.0) {
+            row["baseline_gflops"] = r.baseline_gflops;
+            row["regressed"] = r.regressed;
+        }
+        rows.push_back(row);
+    }
+    return rows.dump();
+}
+
+} // namespace cactus
@@ -0,0 +1,358 @@
+#include "cactus.h"
+#include "llama-cparams.h"
+#include "llama-mmap.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace cactus {
+
+static const char kv_spill_magic[4] = {'C', 'K', 'V', 'S'};
+static const uint32_t kv_spill_version = 1;
+static const size_t KV_SPILL_CHUNK = 32 * 1024; // elements converted per pass, a multiple of every block size
+
+struct kv_spill_header {
+    char magic[4];
+    uint32_t version;
+    int32_t type;         // requantized sections' type, LM_GGML_TYPE_COUNT when stored as is
+    uint32_t reserved;
+    uint64_t identity;
+    uint64_t state_size;  // llama_state_seq data size once expanded
+};
+
+static bool kv_spill_packable(int32_t type) {
+    return type == LM_GGML_TYPE_F16 || type == LM_GGML_TYPE_F32;
+}
+
+static size_t kv_spill_packed_size(lm_ggml_type packed, size_t n_el) {
+    const size_t blck = (size_t)lm_ggml_blck_size(packed);
+    return lm_ggml_row_size(packed, (n_el + blck - 1) / blck * blck);
+}
+
+// Walks llama_state_seq data of the unified cache (cell count, cell metadata, then K and V of every
+// layer) and hands each section to copy() or, for f16/f32 tensor data, to tensor(). With packed set
+// the tensor data in src is in packed layout, as written by kv_state_pack.
+template <typename Copy, typename Tensor>
+static bool kv_state_walk(const uint8_t *src, size_t size, lm_ggml_type packed, bool is_packed, Copy copy, Tensor tensor) {
+    size_t off = 0;
+    auto take = [&](size_t n) -> const uint8_t * {
+        if (n > size - off) {
+            return nullptr;
+        }
+        const uint8_t *p = src + off;
+        off += n;
+        return p;
+    };
+    auto read_u32 = [&](uint32_t &v) {
+        const uint8_t *p = take(sizeof(v));
+        if (p) {
+            memcpy(&v, p, sizeof(v));
+            copy(p, sizeof(v));
+        }
+        return p != nullptr;
+    };
+    auto data = [&](int32_t type, size_t n_bytes) {
+        if (!kv_spill_packable(type)) {
+            const uint8_t *p = take(n_bytes);
+            if (p) {
+                copy(p, n_bytes);
+            }
+            return p != nullptr;
+        }
+        const size_t n_el = n_bytes / lm_ggml_type_size((lm_ggml_type)type);
+        const uint8_t *p = take(is_packed ? kv_spill_packed_size(packed, n_el) : n_bytes);
+        if (p) {
+            tensor((lm_ggml_type)type, p, n_el);
+        }
+        return p != nullptr;
+    };
+
+    uint32_t cell_count = 0;
+    if (!read_u32(cell_count)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < cell_count; i++) {
+        uint32_t pos = 0;
+        uint32_t n_seq_id = 0;
+        if (!read_u32(pos) || !read_u32(n_seq_id) || n_seq_id > LLAMA_MAX_PARALLEL_SEQUENCES) {
+            return false;
+        }
+        const uint8_t *ids = take(n_seq_id * sizeof(llama_seq_id));
+        if (!ids) {
+            return false;
+        }
+        copy(ids, n_seq_id * sizeof(llama_seq_id));
+    }
+
+    uint32_t v_trans = 0;
+    uint32_t n_layer = 0;
+    if (!read_u32(v_trans) || !read_u32(n_layer)) {
+        return false;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        const bool transposed = pass == 1 && v_trans;
+        for (uint32_t il = 0; il < n_layer; il++) {
+            uint32_t type = 0;
+            if (!read_u32(type)) {
+                return false;
+            }
+            size_t n_bytes = 0;
+            if (transposed) {
+                uint32_t el_size = 0;
+                uint32_t n_embd = 0;
+                if (!read_u32(el_size) || !read_u32(n_embd)) {
+                    return false;
+                }
+                n_bytes = (size_t)el_size * n_embd * cell_count;
+            } else {
+                const uint8_t *p = take(sizeof(uint64_t));
+                if (!p) {
+                    return false;
+                }
+                uint64_t row_size = 0;
+                memcpy(&row_size, p, sizeof(row_size));
+                copy(p, sizeof(row_size));
+                n_bytes = (size_t)row_size * cell_count;
+            }
+            if (!data((int32_t)type, n_bytes)) {
+                return false;
+            }
+        }
+    }
+    return off == size;
+}
+
+// f16/f32 K and V data requantized to packed in blocks that run across row boundaries; the last
+// block is zero padded. Fails on state this walker does not understand.
+static bool kv_state_pack(const uint8_t *src, size_t size, lm_ggml_type packed, std::vector<uint8_t> &out) {
+    out.clear();
+    out.reserve(size / 2);
+    std::vector<float> tmp(KV_SPILL_CHUNK);
+    auto copy = [&](const uint8_t *p, size_t n) {
+        out.insert(out.end(), p, p + n);
+    };
+    auto tensor = [&](lm_ggml_type type, const uint8_t *p, size_t n_el) {
+        for (size_t i = 0; i < n_el; i += KV_SPILL_CHUNK) {
+            const size_t n = std::min(KV_SPILL_CHUNK, n_el - i);
+            if (type == LM_GGML_TYPE_F16) {
+                lm_ggml_fp16_to_fp32_row((const lm_ggml_fp16_t *)p + i, tmp.data(), (int64_t)n);
+            } else {
+                memcpy(tmp.data(), (const float *)p + i, n * sizeof(float));
+            }
+            const size_t blck = (size_t)lm_ggml_blck_size(packed);
+            const size_t n_padded = (n + blck - 1) / blck * blck;
+            std::fill(tmp.begin() + n, tmp.begin() + n_padded, 0.0f);
+            const size_t at = out.size();
+            out.resize(at + lm_ggml_row_size(packed, n_padded));
+            lm_ggml_quantize_chunk(packed, tmp.data(), out.data() + at, 0, 1, (int64_t)n_padded, nullptr);
+        }
+    };
+    return kv_state_walk(src, size, packed, false, copy, tensor);
+}
+
+static bool kv_state_unpack(const uint8_t *src, size_t size, lm_ggml_type packed, uint8_t *dst, size_t state_size) {
+    size_t at = 0;
+    bool fits = true;
+    std::vector<float> tmp(KV_SPILL_CHUNK);
+    const auto *traits = lm_ggml_get_type_traits(packed);
+    auto copy = [&](const uint8_t *p, size_t n) {
+        fits = fits && n <= state_size - at;
+        if (fits) {
+            memcpy(dst + at, p, n);
+            at += n;
+        }
+    };
+    auto tensor = [&](lm_ggml_type type, const uint8_t *p, size_t n_el) {
+        const size_t el_size = lm_ggml_type_size(type);
+        fits = fits && n_el * el_size <= state_size - at;
+        for (size_t i = 0; fits && i < n_el; i += KV_SPILL_CHUNK) {
+            const size_t n = std::min(KV_SPILL_CHUNK, n_el - i);
+            const size_t blck = (size_t)lm_ggml_blck_size(packed);
+            traits->to_float(p + lm_ggml_row_size(packed, i), tmp.data(), (int64_t)((n + blck - 1) / blck * blck));
+            if (type == LM_GGML_TYPE_F16) {
+                lm_ggml_fp32_to_fp16_row(tmp.data(), (lm_ggml_fp16_t *)(dst + at) + i, (int64_t)n);
+            } else {
+                memcpy((float *)(dst + at) + i, tmp.data(), n * sizeof(float));
+            }
+        }
+        at += fits ? n_el * el_size : 0;
+    };
+    return kv_state_walk(src, size, packed, true, copy, tensor) && fits && at == state_size;
+}
+
+bool cactus_context::setKVSpill(const std::string &dir, lm_ggml_type type) {
+    if (!dir.empty() && type != LM_GGML_TYPE_Q8_0 && type != LM_GGML_TYPE_Q4_0 && type != LM_GGML_TYPE_COUNT) {
+        LOG_ERROR("KV spill can requantize to q8_0 or q4_0 only, not %s", lm_ggml_type_name(type));
+        return false;
+    }
+    for (auto &state : sequence_states) {
+        dropSpill(state.first);
+    }
+    kv_spill_dir = dir;
+    kv_spill_type = type;
+    return true;
+}
+
+// Named after the context, not the model: spills only live as long as the sequence_states that refer
+// to them, and the header identity check catches a cache whose layout changed in between
+std::string cactus_context::kvSpillFile(llama_seq_id id) const {
+    char name[64];
+    snprintf(name, sizeof(name), "cactus-kv-%016llx-%d.bin", (unsigned long long)(uintptr_t)this, id);
+    std::string path = kv_spill_dir;
+    if (path.back() != '/') {
+        path += '/';
+    }
+    return path + name;
+}
+
+// Moves an idle sequence's KV state to its spill file and frees its cells; the token history stays
+// in sequence_states so switching back restores the state instead of evaluating the history again
+bool cactus_context::spillSequence(llama_seq_id id) {
+    auto it = sequence_states.find(id);
+    if (ctx == nullptr || kv_spill_dir.empty() || id == seq_id || it == sequence_states.end() ||
+        it->second.spilled || it->second.n_past == 0) {
+        return false;
+    }
+
+    std::vector<uint8_t> state(llama_state_seq_get_size(ctx, id));
+    state.resize(llama_state_seq_get_data(ctx, state.data(), state.size(), id));
+    if (state.empty()) {
+        return false;
+    }
+    kv_spill_header header = {};
+    memcpy(header.magic, kv_spill_magic, sizeof(header.magic));
+    header.version = kv_spill_version;
+    header.type = LM_GGML_TYPE_COUNT;
+    header.identity = stateIdentity();
+    header.state_size = state.size();
+    std::vector<uint8_t> packed;
+    if (kv_spill_type != LM_GGML_TYPE_COUNT) {
+        if (kv_state_pack(state.data(), state.size(), kv_spill_type, packed)) {
+            header.type = kv_spill_type;
+        } else {
+            LOG_WARNING("KV state of sequence %d has an unknown layout, spilling it as is", id);
+        }
+    }
+    const std::vector<uint8_t> &body = header.type == LM_GGML_TYPE_COUNT ? state : packed;
+
+    const std::string path = kvSpillFile(id);
+    const std::string tmp = path + ".tmp";
+    FILE *f = lm_ggml_fopen(tmp.c_str(), "wb");
+    if (!f) {
+        LOG_WARNING("Failed to write KV spill file: %s", tmp.c_str());
+        return false;
+    }
+    const bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(body.data(), 1, body.size(), f) == body.size();
+    if (fclose(f) != 0 || !ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        LOG_WARNING("Failed to write KV spill file: %s", path.c_str());
+        remove(tmp.c_str());
+        return false;
+    }
+
+    llama_kv_self_seq_rm(ctx, id, -1, -1);
+    it->second.spilled = true;
+    LOG_VERBOSE("spilled sequence %d, %zu of %zu bytes", id, body.size(), state.size());
+    return true;
+}
+
+// A spill that cannot be read back leaves the sequence empty, so its next turn is evaluated again
+bool cactus_context::unspillSequence(llama_seq_id id) {
+    auto it = sequence_states.find(id);
+    if (it == sequence_states.end() || !it->second.spilled) {
+        return false;
+    }
+    const std::string path = kvSpillFile(id);
+    it->second.spilled = false;
+    bool ok = false;
+    try {
+        llama_file file(path.c_str(), "rb");
+        std::vector<uint8_t> contents;
+        std::unique_ptr<llama_mmap> mapping;
+        const uint8_t *data = nullptr;
+        if (llama_mmap::SUPPORTED) {
+            mapping.reset(new llama_mmap(&file));
+            data = static_cast<const uint8_t *>(mapping->addr());
+        } else {
+            contents.resize(file.size());
+            file.read_raw(contents.data(), contents.size());
+            data = contents.data();
+        }
+
+        kv_spill_header header;
+        const size_t size = file.size();
+        if (size >= sizeof(header)) {
+            memcpy(&header, data, sizeof(header));
+            ok = memcmp(header.magic, kv_spill_magic, sizeof(header.magic)) == 0 && header.version == kv_spill_version &&
+                 header.identity == stateIdentity();
+        }
+        if (ok) {
+            const uint8_t *body = data + sizeof(header);
+            const size_t body_size = size - sizeof(header);
+            std::vector<uint8_t> unpacked;
+            const uint8_t *state = body;
+            size_t state_size = body_size;
+            if (header.type != LM_GGML_TYPE_COUNT) {
+                unpacked.resize(header.state_size);
+                ok = kv_state_unpack(body, body_size, (lm_ggml_type)header.type, unpacked.data(), unpacked.size());
+                state = unpacked.data();
+                state_size = unpacked.size();
+            }
+            llama_kv_self_seq_rm(ctx, id, -1, -1);
+            ok = ok && state_size == header.state_size && llama_state_seq_set_data(ctx, state, state_size, id) != 0;
+        }
+    } catch (const std::exception &e) {
+        LOG_WARNING("Failed to read KV spill file %s: %s", path.c_str(), e.what());
+        ok = false;
+    }
+    remove(path.c_str());
+    if (!ok) {
+        LOG_WARNING("KV state of sequence %d could not be restored, its history will be evaluated again", id);
+        llama_kv_self_seq_rm(ctx, id, -1, -1);
+        it->second.n_past = 0;
+        return false;
+    }
+    LOG_VERBOSE("restored spilled sequence %d", id);
+    return true;
+}
+
+void cactus_context::dropSpill(llama_seq_id id) {
+    auto it = sequence_states.find(id);
+    if (it != sequence_states.end() && it->second.spilled) {
+        remove(kvSpillFile(id).c_str());
+        it->second.spilled = false;
+        it->second.n_past = 0;
+    }
+}
+
+bool cactus_context::spillColdestSequence() {
+    llama_seq_id coldest = -1;
+    uint64_t oldest = UINT64_MAX;
+    for (const auto &state : sequence_states) {
+        if (state.first != seq_id && !state.second.spilled && state.second.n_past > 0 && state.second.last_active < oldest) {
+            coldest = state.first;
+            oldest = state.second.last_active;
+        }
+    }
+    return coldest >= 0 && spillSequence(coldest);
+}
+
+void cactus_context::dropResidentSequences() {
+    for (auto it = sequence_states.begin(); it != sequence_states.end();) {
+        it = it->second.spilled ? std::next(it) : sequence_states.erase(it);
+    }
+}
+
+size_t cactus_context::spillIdleSequences() {
+    size_t n_spilled = 0;
+    while (spillColdestSequence()) {
+        n_spilled++;
+    }
+    return n_spilled;
+}
+
+// Called when a decode finds no free KV cells: cached prefixes go first, then the coldest session
+bool cactus_context::relieveKVCache() {
+    return evictPrefixCache() || spillColdestSequence();
+}
+
+} // namespace cactus
@@ -1,26 +1,302 @@
 #include "cactus.h"
 #include "common.h"
+#include "tools/mtmd/mtmd.h"
 #include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <thread>
 
 namespace cactus {
 
 bool cactus_context::loadModel(common_params &params_)
 {
     params = params_;
-    llama_init = common_init_from_params(params);
+    // common_init's warm-up only runs a 2-token batch; warmUp() below covers both graph shapes
+    common_params init_params = params;
+    init_params.warmup = false;
+    llama_init = common_init_from_params(init_params);
     model = llama_init.model.get();
     ctx = llama_init.context.get();
-    if (model == nullptr)
+    if (model == nullptr || ctx == nullptr)
     {
         LOG_ERROR("unable to load model: %s", params.model.path.c_str());
         return false;
     }
+    return initLoadedContext();
+}
+
+bool cactus_context::loadModel(common_params &params_, std::shared_ptr<llama_model> weights)
+{
+    params = params_;
+    if (!weights) {
+        LOG_ERROR("no shared model to create a context from", "");
+        return false;
+    }
+    shared_model = std::move(weights);
+    model = shared_model.get();
+    ctx = llama_init_from_model(model, common_context_params_to_llama(params));
+    if (ctx == nullptr)
+    {
+        LOG_ERROR("unable to create context for %s, n_ctx: %d", params.model.path.c_str(), params.n_ctx);
+        return false;
+    }
+    llama_init.context.reset(ctx);
+    return initLoadedContext();
+}
+
+std::shared_ptr<llama_model> cactus_context::shareWeights()
+{
+    if (lora_merge != nullptr || lora_merge_job) {
+        LOG_ERROR("Cannot share weights with a LoRA adapter merged into them");
+        return nullptr;
+    }
+    if (!shared_model && llama_init.model) {
+        shared_model = std::shared_ptr<llama_model>(llama_init.model.release(), llama_model_free);
+    }
+    return shared_model;
+}
+
+// Folds the per-file progress of a composite load into one fraction weighted by file size
+struct cactus_load_progress {
+    enum { LLM, MMPROJ, VOCODER, N_PARTS };
+
+    struct slot {
+        cactus_load_progress *owner;
+        int part;
+    };
+
+    std::mutex mutex;
+    std::function<void(float)> callback;
+    double weight[N_PARTS] = {};
+    float fraction[N_PARTS] = {};
+    slot slots[N_PARTS];
+
+    cactus_load_progress(const std::function<void(float)> &callback) : callback(callback) {
+        for (int i = 0; i < N_PARTS; i++) {
+            slots[i] = { this, i };
+        }
+    }
+
+    void add(int part, const std::string &path) {
+        if (path.empty()) {
+            return;
+        }
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        const std::streamoff bytes = file.tellg();
+        weight[part] = bytes > 0 ? (double)bytes : 1.0;
+    }
+
+    void update(int part, float value) {
+        std::lock_guard<std::mutex> lock(mutex);
+        fraction[part] = std::max(fraction[part], std::min(value, 1.0f));
+        double total = 0.0;
+        double done = 0.0;
+        for (int i = 0; i < N_PARTS; i++) {
+            total += weight[i];
+            done += weight[i] * fraction[i];
+        }
+        if (callback && total > 0.0) {
+            callback((float)(done / total));
+        }
+    }
+
+    static bool trampoline(float value, void *user_data) {
+        slot *s = static_cast<slot *>(user_data);
+        s->owner->update(s->part, value);
+        return true;
+    }
+};
+
+bool cactus_context::loadModelWithComponents(common_params &params_, const std::string &mmproj_path,
+                                             const cactus_multimodal_params &mm_params, const std::string &vocoder_path,
+                                             const std::function<void(float)> &progress)
+{
+    if (mmproj_path.empty() && vocoder_path.empty() && !progress) {
+        return loadModel(params_);
+    }
+
+    cactus_load_progress aggregate(progress);
+    aggregate.add(cactus_load_progress::LLM, params_.model.path);
+    aggregate.add(cactus_load_progress::MMPROJ, mmproj_path);
+    aggregate.add(cactus_load_progress::VOCODER, vocoder_path);
+
+    // the companions take the caller's parameters, not the ones loadModel settles on
+    common_params vocoder_params = params_;
+    vocoder_params.load_progress_callback = cactus_load_progress::trampoline;
+    vocoder_params.load_progress_callback_user_data = &aggregate.slots[cactus_load_progress::VOCODER];
+    const cpu_params cpuparams = params_.cpuparams;
+
+    std::shared_ptr<llama_model> text_vocab;
+    mtmd_context *mtmd_ctx = nullptr;
+    std::thread projector_thread;
+    if (!mmproj_path.empty()) {
+        const std::string model_path = params_.model.path;
+        projector_thread = std::thread([&, model_path]() {
+            text_vocab = load_vocab_only(model_path);
+            if (text_vocab) {
+                mtmd_ctx = loadProjector(mmproj_path, text_vocab.get(), mm_params, cpuparams);
+            }
+            // clip reports no progress of its own
+            aggregate.update(cactus_load_progress::MMPROJ, 1.0f);
+        });
+    }
+
+    cactus_context_vocoder *vocoder = nullptr;
+    std::thread vocoder_thread;
+    if (!vocoder_path.empty()) {
+        vocoder_thread = std::thread([&]() {
+            vocoder = loadVocoder(vocoder_params, vocoder_path);
+        });
+    }
+
+    llama_progress_callback user_callback = params_.load_progress_callback;
+    void *user_data = params_.load_progress_callback_user_data;
+    params_.load_progress_callback = cactus_load_progress::trampoline;
+    params_.load_progress_callback_user_data = &aggregate.slots[cactus_load_progress::LLM];
+    const bool llm_ok = loadModel(params_);
+    // the aggregate dies with this frame, later loads must not call into it
+    params_.load_progress_callback = user_callback;
+    params_.load_progress_callback_user_data = user_data;
+    params.load_progress_callback = user_callback;
+    params.load_progress_callback_user_data = user_data;
+
+    if (projector_thread.joinable()) {
+        projector_thread.join();
+    }
+    if (vocoder_thread.joinable()) {
+        vocoder_thread.join();
+    }
+
+    const bool mmproj_ok = mmproj_path.empty() || mtmd_ctx != nullptr;
+    const bool vocoder_ok = vocoder_path.empty() || vocoder != nullptr;
+    if (!llm_ok || !mmproj_ok || !vocoder_ok) {
+        LOG_ERROR("composite load failed: model %s, mmproj %s, vocoder %s", llm_ok ? "ok" : "failed",
+                  mmproj_ok ? "ok" : "failed", vocoder_ok ? "ok" : "failed");
+        if (mtmd_ctx != nullptr) {
+            mtmd_free(mtmd_ctx);
+        }
+        if (vocoder != nullptr) {
+            // the wrapper's workspace is only complete in cactus_tts.cpp
+            attachVocoder(vocoder);
+            releaseVocoder();
+        }
+        return false;
+    }
+
+    if (mtmd_ctx != nullptr) {
+        attachProjector(mtmd_ctx, mmproj_path, mm_params, std::move(text_vocab));
+    }
+    if (vocoder != nullptr) {
+        attachVocoder(vocoder);
+    }
+    return true;
+}
+
+// Per-context setup shared by both loadModel paths
+bool cactus_context::initLoadedContext()
+{
     templates = common_chat_templates_init(model, params.chat_template);
+    {
+        std::lock_guard<std::mutex> lock(custom_templates.mutex);
+        custom_templates.entries.clear();
+    }
+    turn_start_token_ready = false;
+    tokenized_prompt.clear();
+    tokenized_prompt_tokens.clear();
     n_ctx = llama_n_ctx(ctx);
+    if (batch.token != nullptr) {
+        llama_batch_free(batch);
+    }
+    batch = llama_batch_init(params.n_batch, 0, 1);
+    // a fresh context has no abort callback, it is installed once a hook, deadline or long batch arms it
+    abort_armed = false;
+    armAbortCallback();
+    attach_shared_threadpool(ctx, params.cpuparams);
+
+    if (params.warmup) {
+        warmUp();
+    }
+
+    if (!params.speculative.model.path.empty() && !initDraftModel(params.speculative.model.path)) {
+        LOG_WARNING("Speculative decoding disabled, draft model failed to load: %s", params.speculative.model.path.c_str());
+    }
 
     return true;
 }
 
+// Runs one full-size prefill batch and one single-token decode so the allocator is sized for
+// the largest graph, the matrix-matrix and matrix-vector kernels are compiled, and (with
+// warmup mode routing through every expert) all weights are paged in before the first request.
+void cactus_context::warmUp() {
+    const auto t_start = std::chrono::steady_clock::now();
+    const llama_vocab *vocab = llama_model_get_vocab(model);
+
+    llama_token token = llama_vocab_bos(vocab);
+    if (token == LLAMA_TOKEN_NULL) {
+        token = llama_vocab_eos(vocab);
+    }
+    if (token == LLAMA_TOKEN_NULL) {
+        token = 0;
+    }
+
+    llama_set_warmup(ctx, true);
+    if (llama_model_has_encoder(model)) {
+        llama_encode(ctx, llama_batch_get_one(&token, 1));
+    }
+    if (llama_model_has_decoder(model)) {
+        const int n_prefill = std::max(1, std::min({ params.n_batch, (int)llama_n_ubatch(ctx), n_ctx - 1 }));
+        const std::vector<llama_seq_id> seq_ids = { 0 };
+        llama_batch_clear(&batch);
+        for (int i = 0; i < n_prefill; i++) {
+            llama_batch_add(&batch, token, i, seq_ids, i == n_prefill - 1);
+        }
+        if (llama_decode(ctx, batch) != 0) {
+            LOG_WARNING("Warm-up prefill failed, n_tokens: %d", n_prefill);
+        }
+
+        llama_batch_clear(&batch);
+        llama_batch_add(&batch, token, n_prefill, seq_ids, true);
+        if (n_prefill + 1 < n_ctx && llama_decode(ctx, batch) != 0) {
+            LOG_WARNING("Warm-up decode failed");
+        }
+    }
+    llama_kv_self_clear(ctx);
+    llama_synchronize(ctx);
+    llama_perf_context_reset(ctx);
+    llama_set_warmup(ctx, false);
+
+    warmup_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+    LOG_INFO("Model warm-up finished in %.1f ms", warmup_ms);
+}
+
+std::shared_ptr<llama_model> load_shared_model(common_params &params)
+{
+    llama_model *model = llama_model_load_from_file(params.model.path.c_str(), common_model_params_to_llama(params));
+    if (model == nullptr) {
+        LOG_ERROR("unable to load model: %s", params.model.path.c_str());
+        return nullptr;
+    }
+    return std::shared_ptr<llama_model>(model, llama_model_free);
+}
+
+std::shared_ptr<llama_model> load_vocab_only(const std::string &path)
+{
+    llama_model_params mparams = llama_model_default_params();
+    lm_ggml_backend_dev_t no_devices[] = { nullptr };
+    mparams.vocab_only = true;
+    mparams.use_mmap = false;
+    mparams.n_gpu_layers = 0;
+    mparams.devices = no_devices;
+    llama_model *model = llama_model_load_from_file(path.c_str(), mparams);
+    if (model == nullptr) {
+        LOG_ERROR("unable to load vocabulary: %s", path.c_str());
+        return nullptr;
+    }
+    return std::shared_ptr<llama_model>(model, llama_model_free);
+}
+
 bool cactus_context::validateModelChatTemplate(bool use_jinja, const char *name) const {
     const char * tmpl = llama_model_chat_template(model, name);
     if (tmpl == nullptr) {
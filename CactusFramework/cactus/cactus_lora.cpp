@@ -1,34 +1,114 @@
 #include "cactus.h"
 #include "common.h"
 #include "llama.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include <vector>
 #include <string>
 
 namespace cactus {
 
+cactus_lora_registry::~cactus_lora_registry() {
+    clear();
+}
+
+llama_adapter_lora *cactus_lora_registry::acquire(llama_model *model, const std::string &path) {
+    auto it = entries.find(path);
+    if (it != entries.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+        n_hits++;
+        return it->second->adapter;
+    }
+
+    const int64_t t_start = lm_ggml_time_us();
+    llama_adapter_lora *adapter = llama_adapter_lora_init(model, path.c_str());
+    if (adapter == nullptr) {
+        return nullptr;
+    }
+    const int64_t t_us = lm_ggml_time_us() - t_start;
+    t_load_us += t_us;
+    n_loads++;
+
+    entry e;
+    e.path = path;
+    e.adapter = adapter;
+    e.bytes = llama_adapter_lora_n_bytes(adapter);
+    bytes += e.bytes;
+    lru.push_front(std::move(e));
+    entries[path] = lru.begin();
+    LOG_INFO("Loaded LoRA adapter %s: %zu KiB in %.2f ms", path.c_str(), lru.front().bytes >> 10, t_us / 1000.0);
+    return adapter;
+}
+
+void cactus_lora_registry::trim(const std::vector<common_adapter_lora_info> &active) {
+    auto is_active = [&](const llama_adapter_lora *adapter) {
+        return std::any_of(active.begin(), active.end(), [&](const common_adapter_lora_info &la) { return la.ptr == adapter; });
+    };
+    size_t active_bytes = 0;
+    for (const auto &e : lru) {
+        if (is_active(e.adapter)) {
+            active_bytes += e.bytes;
+        }
+    }
+
+    auto it = lru.end();
+    while (bytes - active_bytes > capacity_bytes && it != lru.begin()) {
+        --it;
+        if (is_active(it->adapter)) {
+            continue;
+        }
+        const int64_t t_start = lm_ggml_time_us();
+        llama_adapter_lora_free(it->adapter);
+        const int64_t t_us = lm_ggml_time_us() - t_start;
+        t_evict_us += t_us;
+        n_evictions++;
+        bytes -= it->bytes;
+        LOG_INFO("Evicted LoRA adapter %s in %.2f ms", it->path.c_str(), t_us / 1000.0);
+        entries.erase(it->path);
+        it = lru.erase(it);
+    }
+}
+
+void cactus_lora_registry::clear() {
+    for (auto &e : lru) {
+        llama_adapter_lora_free(e.adapter);
+    }
+    lru.clear();
+    entries.clear();
+    bytes = 0;
+}
+
 int cactus_context::applyLoraAdapters(std::vector<common_adapter_lora_info> lora_adapters) {
     if (!ctx || !model) {
         LOG_ERROR("Context or model not initialized for applying LoRA adapters.");
         return -1;
     }
 
+    std::vector<common_adapter_lora_info> active;
     for (auto &la : lora_adapters) {
         if (la.path.empty()) {
             LOG_WARNING("Skipping LoRA adapter with empty path.");
             continue;
         }
-        la.ptr = llama_adapter_lora_init(model, la.path.c_str());
+        la.ptr = lora_registry.acquire(model, la.path);
         if (la.ptr == nullptr) {
             LOG_ERROR("Failed to initialize LoRA adapter '%s'\n", la.path.c_str());
+            // the current set stays applied, adapters loaded for the failed one stay cached
+            trimLoraAdapters();
             return -1;
         }
         LOG_INFO("Initialized LoRA adapter: %s, Scale: %f", la.path.c_str(), la.scale);
+        active.push_back(la);
     }
 
-    this->lora = lora_adapters; 
-
+    const int64_t t_start = lm_ggml_time_us();
+    this->lora = std::move(active);
     common_set_adapter_lora(ctx, this->lora);
-    LOG_INFO("Applied %zu LoRA adapters.", this->lora.size());
+    lora_registry.t_switch_us = lm_ggml_time_us() - t_start;
+    trimLoraAdapters();
+    LOG_INFO("Applied %zu LoRA adapters in %.3f ms, %zu resident.", this->lora.size(),
+             lora_registry.t_switch_us / 1000.0, lora_registry.size());
     return 0;
 }
 
@@ -37,8 +117,12 @@ void cactus_context::removeLoraAdapters() {
         LOG_ERROR("Context not initialized, cannot remove LoRA adapters.");
         return;
     }
+    const int64_t t_start = lm_ggml_time_us();
     this->lora.clear();
     common_set_adapter_lora(ctx, this->lora);
+    lora_registry.t_switch_us = lm_ggml_time_us() - t_start;
+    // kept resident for the next switch, up to the cache capacity
+    trimLoraAdapters();
     LOG_INFO("Removed all LoRA adapters.");
 }
 
@@ -46,4 +130,189 @@ std::vector<common_adapter_lora_info> cactus_context::getLoadedLoraAdapters() {
     return this->lora;
 }
 
-} // namespace cactus
\ No newline at end of file
+int cactus_context::setSequenceLoraAdapters(llama_seq_id id, std::vector<common_adapter_lora_info> lora_adapters) {
+    if (!ctx || !model || id < 0 || id >= sessionSequences()) {
+        LOG_ERROR("Invalid sequence id for LoRA adapters: %d", id);
+        return -1;
+    }
+
+    std::vector<common_adapter_lora_info> active;
+    for (auto &la : lora_adapters) {
+        if (la.path.empty()) {
+            continue;
+        }
+        la.ptr = lora_registry.acquire(model, la.path);
+        if (la.ptr == nullptr) {
+            LOG_ERROR("Failed to initialize LoRA adapter '%s' for sequence %d", la.path.c_str(), id);
+            trimLoraAdapters();
+            return -1;
+        }
+        active.push_back(la);
+    }
+
+    const int64_t t_start = lm_ggml_time_us();
+    llama_clear_adapter_lora_seq(ctx, id);
+    for (const auto &la : active) {
+        llama_set_adapter_lora_seq(ctx, la.ptr, la.scale, id);
+    }
+    lora_registry.t_switch_us = lm_ggml_time_us() - t_start;
+    if (active.empty()) {
+        seq_lora.erase(id);
+    } else {
+        seq_lora[id] = std::move(active);
+    }
+    trimLoraAdapters();
+    return 0;
+}
+
+void cactus_context::setLoraCacheCapacity(size_t capacity_bytes) {
+    lora_registry.capacity_bytes = capacity_bytes;
+    trimLoraAdapters();
+}
+
+void cactus_context::trimLoraAdapters() {
+    std::vector<common_adapter_lora_info> active = this->lora;
+    for (const auto &it : seq_lora) {
+        active.insert(active.end(), it.second.begin(), it.second.end());
+    }
+    if (lora_merge_job) {
+        // still read by the background merge
+        active.push_back(lora_merge_info);
+    }
+    lora_registry.trim(active);
+}
+
+struct cactus_lora_merge_job {
+    std::thread worker;
+    std::atomic<bool> done{false};
+    std::atomic<bool> cancelled{false};
+    llama_adapter_lora_merge *result = nullptr;
+    int64_t t_us = 0;
+
+    ~cactus_lora_merge_job() {
+        if (worker.joinable()) {
+            worker.join();
+        }
+        if (result != nullptr) {
+            llama_adapter_lora_merge_free(result);
+        }
+    }
+};
+
+int cactus_context::mergeLoraAdapter(const std::string &path, float scale, bool background) {
+    if (!ctx || !model) {
+        LOG_ERROR("Context or model not initialized for merging a LoRA adapter.");
+        return -1;
+    }
+    unmergeLoraAdapter();
+    // the swap exchanges the weights under every context on the model, one of them may be decoding
+    if (shared_model) {
+        LOG_ERROR("Cannot merge LoRA adapter '%s' into weights shared with other contexts", path.c_str());
+        return -1;
+    }
+
+    common_adapter_lora_info la = {};
+    la.path = path;
+    la.scale = scale;
+    la.ptr = lora_registry.acquire(model, path);
+    if (la.ptr == nullptr) {
+        LOG_ERROR("Failed to initialize LoRA adapter '%s'", path.c_str());
+        return -1;
+    }
+    lora_merge_info = la;
+
+    const int32_t n_threads = std::max<int32_t>(1, params.cpuparams.n_threads);
+    if (!background) {
+        const int64_t t_start = lm_ggml_time_us();
+        lora_merge = llama_adapter_lora_merge_init(model, la.ptr, scale, n_threads, nullptr, nullptr);
+        if (lora_merge == nullptr) {
+            LOG_ERROR("Failed to merge LoRA adapter '%s'", path.c_str());
+            return -1;
+        }
+        llama_adapter_lora_merge_apply(lora_merge, true);
+        LOG_INFO("Merged LoRA adapter %s into the weights in %.2f ms", path.c_str(), (lm_ggml_time_us() - t_start) / 1000.0);
+        return 0;
+    }
+
+    // the adapter runs unmerged until the merged weights are swapped in
+    std::vector<common_adapter_lora_info> active = this->lora;
+    active.push_back(la);
+    if (applyLoraAdapters(active) != 0) {
+        return -1;
+    }
+
+    auto job = std::make_shared<cactus_lora_merge_job>();
+    llama_model *merge_model = model;
+    llama_adapter_lora *adapter = la.ptr;
+    cactus_lora_merge_job *state = job.get();
+    job->worker = std::thread([state, merge_model, adapter, scale, n_threads]() {
+        const int64_t t_start = lm_ggml_time_us();
+        state->result = llama_adapter_lora_merge_init(merge_model, adapter, scale, n_threads, [](void *data) {
+            return ((cactus_lora_merge_job *)data)->cancelled.load();
+        }, state);
+        state->t_us = lm_ggml_time_us() - t_start;
+        state->done = true;
+    });
+    lora_merge_job = std::move(job);
+    LOG_INFO("Merging LoRA adapter %s in the background", path.c_str());
+    return 0;
+}
+
+bool cactus_context::finishLoraMerge() {
+    if (!lora_merge_job || !lora_merge_job->done) {
+        return false;
+    }
+    lora_merge_job->worker.join();
+    lora_merge = lora_merge_job->result;
+    lora_merge_job->result = nullptr;
+    const int64_t t_us = lora_merge_job->t_us;
+    lora_merge_job.reset();
+
+    if (lora_merge == nullptr) {
+        LOG_WARNING("Background merge of LoRA adapter %s failed, it stays applied unmerged", lora_merge_info.path.c_str());
+        return false;
+    }
+
+    // drop the unmerged branch before the merged weights take over, or it would apply twice
+    std::vector<common_adapter_lora_info> active;
+    for (const auto &la : this->lora) {
+        if (la.ptr != lora_merge_info.ptr) {
+            active.push_back(la);
+        }
+    }
+    this->lora = std::move(active);
+    common_set_adapter_lora(ctx, this->lora);
+    llama_adapter_lora_merge_apply(lora_merge, true);
+    trimLoraAdapters();
+    LOG_INFO("Merged LoRA adapter %s into the weights in %.2f ms (%zu MiB)", lora_merge_info.path.c_str(),
+             t_us / 1000.0, llama_adapter_lora_merge_n_bytes(lora_merge) >> 20);
+    return true;
+}
+
+void cactus_context::unmergeLoraAdapter() {
+    if (lora_merge_job) {
+        // a merge still running stops at the next weight and is freed unapplied; the adapter it
+        // ran unmerged with until then goes too
+        lora_merge_job->cancelled = true;
+        lora_merge_job.reset();
+        for (auto it = lora.rbegin(); it != lora.rend(); ++it) {
+            if (it->ptr == lora_merge_info.ptr) {
+                lora.erase(std::next(it).base());
+                if (ctx != nullptr) {
+                    common_set_adapter_lora(ctx, lora);
+                }
+                break;
+            }
+        }
+        trimLoraAdapters();
+    }
+    if (lora_merge != nullptr) {
+        const int64_t t_start = lm_ggml_time_us();
+        llama_adapter_lora_merge_free(lora_merge);
+        lora_merge = nullptr;
+        LOG_INFO("Unmerged LoRA adapter %s in %.2f ms", lora_merge_info.path.c_str(), (lm_ggml_time_us() - t_start) / 1000.0);
+    }
+    lora_merge_info = {};
+}
+
+} // namespace cactus
@@ -0,0 +1,184 @@
+#include "cactus.h"
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+namespace cactus {
+
+static const uint32_t MEDIA_CACHE_MAGIC = 0x444d4543; // "CEMD"
+
+struct media_cache_file_header {
+    uint32_t magic;
+    uint32_t key_len;
+    uint64_t n_floats;
+};
+
+static uint64_t fnv_hash64(const std::string &data) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+std::string cactus_media_embd_cache::filePath(const std::string &key) const {
+    char name[64];
+    snprintf(name, sizeof(name), "cactus-media-%016llx.bin", (unsigned long long)fnv_hash64(key));
+    std::string path = dir;
+    if (path.back() != '/') {
+        path += '/';
+    }
+    return path + name;
+}
+
+void cactus_media_embd_cache::insert(const std::string &key, std::vector<float> &&embd) {
+    const size_t size = embd.size() * sizeof(float);
+    if (size > capacity_bytes) {
+        return;
+    }
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+        bytes -= it->second->second.size() * sizeof(float);
+        lru.erase(it->second);
+        entries.erase(it);
+    }
+    auto victim = lru.end();
+    while (bytes + size > capacity_bytes && victim != lru.begin()) {
+        --victim;
+        if (pinned.count(victim->first)) {
+            continue;
+        }
+        bytes -= victim->second.size() * sizeof(float);
+        entries.erase(victim->first);
+        victim = lru.erase(victim);
+    }
+    if (bytes + size > capacity_bytes) {
+        return;
+    }
+    lru.emplace_front(key, std::move(embd));
+    entries[key] = lru.begin();
+    bytes += size;
+}
+
+// The stored key is compared in full so a file name collision reads as a miss
+bool cactus_media_embd_cache::loadFile(const std::string &key, size_t n_floats) {
+    FILE *f = lm_ggml_fopen(filePath(key).c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    media_cache_file_header header = {};
+    std::string stored_key;
+    std::vector<float> embd;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 && header.magic == MEDIA_CACHE_MAGIC &&
+              header.key_len == key.size() && header.n_floats > 0 && (n_floats == 0 || header.n_floats == n_floats);
+    if (ok) {
+        stored_key.resize(header.key_len);
+        embd.resize(header.n_floats);
+        ok = fread(&stored_key[0], 1, stored_key.size(), f) == stored_key.size() && stored_key == key &&
+             fread(embd.data(), sizeof(float), embd.size(), f) == embd.size();
+    }
+    fclose(f);
+    if (ok) {
+        insert(key, std::move(embd));
+    }
+    return ok && entries.count(key) > 0;
+}
+
+const float *cactus_media_embd_cache::lookup(const std::string &key, size_t n_floats) {
+    if (capacity_bytes == 0) {
+        return nullptr;
+    }
+    auto it = entries.find(key);
+    if (it != entries.end() && it->second->second.size() == n_floats) {
+        lru.splice(lru.begin(), lru, it->second);
+        n_hits++;
+        return lru.front().second.data();
+    }
+    if (!dir.empty() && loadFile(key, n_floats)) {
+        n_hits++;
+        return entries[key]->second.data();
+    }
+    n_misses++;
+    return nullptr;
+}
+
+bool cactus_media_embd_cache::pin(const std::string &key) {
+    if (capacity_bytes == 0) {
+        return false;
+    }
+    if (entries.count(key) == 0 && (dir.empty() || !loadFile(key, 0))) {
+        return false;
+    }
+    pinned.insert(key);
+    return true;
+}
+
+bool cactus_media_embd_cache::contains(const std::string &key, size_t n_floats) const {
+    if (capacity_bytes == 0) {
+        return false;
+    }
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+        return n_floats == 0 || it->second->second.size() == n_floats;
+    }
+    return !dir.empty() && access(filePath(key).c_str(), R_OK) == 0;
+}
+
+bool cactus_media_embd_cache::isPinned(const std::string &key) const {
+    return pinned.count(key) > 0;
+}
+
+void cactus_media_embd_cache::unpinAll() {
+    pinned.clear();
+}
+
+void cactus_media_embd_cache::noteItem(const std::string &item, const std::string &key) {
+    item_keys[item] = key;
+}
+
+std::string cactus_media_embd_cache::itemKey(const std::string &item) const {
+    auto it = item_keys.find(item);
+    return it != item_keys.end() ? it->second : std::string();
+}
+
+void cactus_media_embd_cache::store(const std::string &key, const float *embd, size_t n_floats) {
+    if (capacity_bytes == 0) {
+        return;
+    }
+    insert(key, std::vector<float>(embd, embd + n_floats));
+    if (dir.empty()) {
+        return;
+    }
+    const std::string path = filePath(key);
+    const std::string tmp = path + ".tmp";
+    FILE *f = lm_ggml_fopen(tmp.c_str(), "wb");
+    if (!f) {
+        LOG_WARNING("Failed to write media embedding cache: %s", tmp.c_str());
+        return;
+    }
+    const media_cache_file_header header = { MEDIA_CACHE_MAGIC, (uint32_t)key.size(), (uint64_t)n_floats };
+    const bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                    fwrite(key.data(), 1, key.size(), f) == key.size() &&
+                    fwrite(embd, sizeof(float), n_floats, f) == n_floats;
+    if (fclose(f) != 0 || !ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        LOG_WARNING("Failed to write media embedding cache: %s", path.c_str());
+        remove(tmp.c_str());
+    }
+}
+
+void cactus_media_embd_cache::clear() {
+    lru.clear();
+    entries.clear();
+    pinned.clear();
+    item_keys.clear();
+    bytes = 0;
+}
+
+void cactus_context::setMediaEmbeddingCache(size_t capacity_bytes, const std::string &dir) {
+    media_embd_cache.clear();
+    media_embd_cache.capacity_bytes = capacity_bytes;
+    media_embd_cache.dir = dir;
+}
+
+} // namespace cactus
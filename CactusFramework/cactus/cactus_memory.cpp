@@ -0,0 +1,376 @@
+#include "cactus.h"
+#include "common.h"
+#include "llama.h"
+#include "gguf.h"
+#include <algorithm>
+#include <cstdio>
+
+namespace cactus {
+
+static const int32_t KV_SHRINK_MIN_CTX = 512;
+
+static bool kv_type_is_float(lm_ggml_type type) {
+    return type == LM_GGML_TYPE_F32 || type == LM_GGML_TYPE_F16 || type == LM_GGML_TYPE_BF16;
+}
+
+// Rebuilds the llama_context from params; weights, sampler, templates and adapters are kept,
+// every sequence's KV state is lost except what was spilled to flash.
+bool cactus_context::recreateContext() {
+    discardPendingTokens();
+    llama_init.context.reset();
+    ctx = nullptr;
+
+    llama_context *new_ctx = llama_init_from_model(model, common_context_params_to_llama(params));
+    if (new_ctx == nullptr) {
+        LOG_ERROR("unable to recreate context, n_ctx: %d", params.n_ctx);
+        return false;
+    }
+    llama_init.context.reset(new_ctx);
+    ctx = new_ctx;
+    n_ctx = llama_n_ctx(ctx);
+    abort_armed = false;
+    armAbortCallback();
+    attach_shared_threadpool(ctx, params.cpuparams);
+    if (!lora.empty()) {
+        common_set_adapter_lora(ctx, lora);
+    }
+    for (const auto &it : seq_lora) {
+        for (const auto &la : it.second) {
+            llama_set_adapter_lora_seq(ctx, la.ptr, la.scale, it.first);
+        }
+    }
+    if (!control_vector.data.empty()) {
+        llama_apply_adapter_cvec(ctx, control_vector.data.data(), control_vector.data.size(), control_vector.n_embd,
+                                 control_vector_layer_start, control_vector_layer_end);
+    }
+    for (const auto &quota : kv_quotas) {
+        llama_kv_self_seq_set_quota(ctx, quota.first, quota.second.n_max_cells, quota.second.policy, quota.second.n_sink);
+    }
+
+    embd.clear();
+    n_past = 0;
+    dropResidentSequences();
+    mtmd_bitmap_past_hashes.clear();
+    mtmd_past_chunks.clear();
+    prefix_cache.clear();
+    return true;
+}
+
+// First memory-pressure step: quantize an f16 cache to q8_0 (V only with flash attention or a
+// tiered cache), otherwise halve the context window
+bool cactus_context::compactKVCache() {
+    if (ctx == nullptr || model == nullptr) {
+        return false;
+    }
+
+    if (kv_type_is_float(params.cache_type_k)) {
+        params.cache_type_k = LM_GGML_TYPE_Q8_0;
+        if ((params.flash_attn || params.cache_n_recent > 0) && kv_type_is_float(params.cache_type_v)) {
+            params.cache_type_v = LM_GGML_TYPE_Q8_0;
+        }
+    } else if (n_ctx / 2 >= KV_SHRINK_MIN_CTX) {
+        params.n_ctx = n_ctx / 2;
+    } else {
+        return false;
+    }
+
+    LOG_INFO("compacting KV cache, n_ctx: %d, type_k: %s, type_v: %s",
+        params.n_ctx, lm_ggml_type_name(params.cache_type_k), lm_ggml_type_name(params.cache_type_v));
+    return recreateContext();
+}
+
+bool cactus_context::defragKVCache() {
+    if (ctx == nullptr || is_predicting) {
+        return false;
+    }
+
+    const llama_kv_defrag_stats before = llama_kv_self_defrag_stats(ctx);
+    if (!before.pending && before.fragmentation <= 0.0f) {
+        return false;
+    }
+
+    llama_kv_self_defrag(ctx);
+    llama_kv_self_update(ctx);
+
+    const llama_kv_defrag_stats after = llama_kv_self_defrag_stats(ctx);
+    LOG_VERBOSE("KV defrag moved %llu cells, fragmentation: %.2f -> %.2f",
+        (unsigned long long)(after.n_cells_moved - before.n_cells_moved), before.fragmentation, after.fragmentation);
+    return after.n_cells_moved > before.n_cells_moved;
+}
+
+size_t cactus_context::shrinkComputeBuffers() {
+    if (ctx == nullptr || is_predicting) {
+        return 0;
+    }
+    return llama_shrink_compute_buffers(ctx);
+}
+
+// Frees the KV cache and compute buffers; restoreComputeContext() brings them back. Idle sequences
+// are spilled first when a spill directory is set, so they come back without a prefill.
+void cactus_context::releaseComputeContext() {
+    if (ctx == nullptr) {
+        return;
+    }
+    discardPendingTokens();
+    const size_t n_spilled = spillIdleSequences();
+    if (n_spilled > 0) {
+        LOG_INFO("spilled %zu idle sequences before releasing the KV cache", n_spilled);
+    }
+    llama_init.context.reset();
+    ctx = nullptr;
+    embd.clear();
+    n_past = 0;
+    dropResidentSequences();
+    mtmd_bitmap_past_hashes.clear();
+    mtmd_past_chunks.clear();
+    prefix_cache.clear();
+    LOG_INFO("released compute context, weights stay resident");
+}
+
+bool cactus_context::restoreComputeContext() {
+    if (ctx != nullptr) {
+        return true;
+    }
+    if (model == nullptr) {
+        return false;
+    }
+    return recreateContext();
+}
+
+static int64_t gguf_int(const lm_gguf_context *meta, const std::string &key, int64_t fallback) {
+    const int64_t id = lm_gguf_find_key(meta, key.c_str());
+    if (id < 0) {
+        return fallback;
+    }
+    switch (lm_gguf_get_kv_type(meta, id)) {
+        case LM_GGUF_TYPE_UINT32: return lm_gguf_get_val_u32(meta, id);
+        case LM_GGUF_TYPE_INT32:  return lm_gguf_get_val_i32(meta, id);
+        case LM_GGUF_TYPE_ARRAY: {
+            // Per-layer values (e.g. head_count_kv on sliding-window models); size for the largest
+            const enum lm_gguf_type type = lm_gguf_get_arr_type(meta, id);
+            if (type != LM_GGUF_TYPE_INT32 && type != LM_GGUF_TYPE_UINT32) {
+                return fallback;
+            }
+            const int32_t *values = (const int32_t *)lm_gguf_get_arr_data(meta, id);
+            int64_t max_value = 0;
+            for (size_t i = 0; i < lm_gguf_get_arr_n(meta, id); i++) {
+                max_value = std::max<int64_t>(max_value, values[i]);
+            }
+            return max_value > 0 ? max_value : fallback;
+        }
+        default:
+            return fallback;
+    }
+}
+
+static double type_bytes(lm_ggml_type type) {
+    return (double)lm_ggml_type_size(type) / (double)lm_ggml_blck_size(type);
+}
+
+static size_t gguf_tensor_bytes(const std::string &path) {
+    lm_gguf_init_params init = { /*no_alloc =*/ true, /*ctx =*/ nullptr };
+    lm_gguf_context *meta = lm_gguf_init_from_file(path.c_str(), init);
+    if (meta == nullptr) {
+        return 0;
+    }
+    size_t total = 0;
+    for (int64_t i = 0; i < lm_gguf_get_n_tensors(meta); i++) {
+        total += lm_gguf_get_tensor_size(meta, i);
+    }
+    lm_gguf_free(meta);
+    return total;
+}
+
+bool read_model_profile(const std::string &model_path, cactus_model_profile &out) {
+    out = cactus_model_profile();
+    lm_gguf_init_params init = { /*no_alloc =*/ true, /*ctx =*/ nullptr };
+    lm_gguf_context *meta = lm_gguf_init_from_file(model_path.c_str(), init);
+    if (meta == nullptr) {
+        LOG_ERROR("unable to read GGUF metadata: %s", model_path.c_str());
+        return false;
+    }
+
+    const int64_t arch_id = lm_gguf_find_key(meta, "general.architecture");
+    const std::string arch = arch_id >= 0 ? lm_gguf_get_val_str(meta, arch_id) : "llama";
+    out.n_layer     = gguf_int(meta, arch + ".block_count", 0);
+    out.n_embd      = gguf_int(meta, arch + ".embedding_length", 0);
+    out.n_head      = std::max<int64_t>(1, gguf_int(meta, arch + ".attention.head_count", 1));
+    out.n_head_kv   = gguf_int(meta, arch + ".attention.head_count_kv", out.n_head);
+    out.head_k      = gguf_int(meta, arch + ".attention.key_length", out.n_embd / out.n_head);
+    out.head_v      = gguf_int(meta, arch + ".attention.value_length", out.n_embd / out.n_head);
+    out.n_ff        = gguf_int(meta, arch + ".feed_forward_length", 4 * out.n_embd);
+    out.n_ctx_train = gguf_int(meta, arch + ".context_length", 0);
+    // the interleave is fixed per architecture in llama-model.cpp, not stored in the GGUF
+    if (arch == "gemma2") {
+        out.n_swa = gguf_int(meta, arch + ".attention.sliding_window", 4096);
+        out.swa_pattern = 2;
+    } else if (arch == "gemma3") {
+        out.n_swa = gguf_int(meta, arch + ".attention.sliding_window", 0);
+        out.swa_pattern = 6;
+    } else if (arch == "cohere2") {
+        out.n_swa = gguf_int(meta, arch + ".attention.sliding_window", 0);
+        out.swa_pattern = 4;
+    } else if (arch == "llama4") {
+        out.n_swa = 8192;
+        out.swa_pattern = 4;
+    }
+    const int64_t tokens_id = lm_gguf_find_key(meta, "tokenizer.ggml.tokens");
+    out.n_vocab = tokens_id >= 0 ? (int64_t)lm_gguf_get_arr_n(meta, tokens_id) : 32000;
+
+    out.layer_bytes.assign(std::max<int64_t>(0, out.n_layer), 0);
+    for (int64_t i = 0; i < lm_gguf_get_n_tensors(meta); i++) {
+        const std::string name = lm_gguf_get_tensor_name(meta, i);
+        const size_t size = lm_gguf_get_tensor_size(meta, i);
+        int layer = -1;
+        if (sscanf(name.c_str(), "blk.%d.", &layer) == 1 && layer >= 0 && layer < out.n_layer) {
+            out.layer_bytes[layer] += size;
+        } else if (name.rfind("token_embd", 0) == 0) {
+            out.input_bytes += size;
+        } else {
+            out.output_bytes += size;
+        }
+    }
+    out.tied_output = lm_gguf_find_tensor(meta, "output.weight") < 0;
+    lm_gguf_free(meta);
+    return true;
+}
+
+bool read_model_metadata(const std::string &model_path, cactus_model_metadata &out) {
+    out = cactus_model_metadata();
+    lm_gguf_init_params init = { /*no_alloc =*/ true, /*ctx =*/ nullptr };
+    lm_gguf_context *meta = lm_gguf_init_from_file(model_path.c_str(), init);
+    if (meta == nullptr) {
+        LOG_ERROR("unable to read GGUF metadata: %s", model_path.c_str());
+        return false;
+    }
+
+    auto get_str = [meta](const char *key) -> std::string {
+        const int64_t id = lm_gguf_find_key(meta, key);
+        return id >= 0 && lm_gguf_get_kv_type(meta, id) == LM_GGUF_TYPE_STRING ? lm_gguf_get_val_str(meta, id) : "";
+    };
+    out.architecture = get_str("general.architecture");
+    out.name = get_str("general.name");
+    out.chat_template = get_str("tokenizer.chat_template");
+    const std::string arch = out.architecture.empty() ? "llama" : out.architecture;
+    out.file_type   = (int32_t)gguf_int(meta, "general.file_type", -1);
+    out.n_ctx_train = gguf_int(meta, arch + ".context_length", 0);
+    out.n_embd      = gguf_int(meta, arch + ".embedding_length", 0);
+    out.n_layer     = gguf_int(meta, arch + ".block_count", 0);
+    const int64_t tokens_id = lm_gguf_find_key(meta, "tokenizer.ggml.tokens");
+    out.n_vocab = tokens_id >= 0 ? (int64_t)lm_gguf_get_arr_n(meta, tokens_id) : gguf_int(meta, arch + ".vocab_size", 0);
+
+    // norms and biases stay F32 in quantized files, so the type is the one with the most bytes
+    std::vector<size_t> type_bytes_total(LM_GGML_TYPE_COUNT, 0);
+    for (int64_t i = 0; i < lm_gguf_get_n_tensors(meta); i++) {
+        const lm_ggml_type type = lm_gguf_get_tensor_type(meta, i);
+        const size_t size = lm_gguf_get_tensor_size(meta, i);
+        out.tensor_bytes += size;
+        out.n_params += (int64_t)(size / lm_ggml_type_size(type) * lm_ggml_blck_size(type));
+        type_bytes_total[type] += size;
+    }
+    const auto top = std::max_element(type_bytes_total.begin(), type_bytes_total.end());
+    if (*top > 0) {
+        out.quantization = lm_ggml_type_name((lm_ggml_type)(top - type_bytes_total.begin()));
+    }
+    lm_gguf_free(meta);
+    return true;
+}
+
+// Sizes the KV cache from the attention shape and cache types and compute buffers from the
+// worst-case ubatch graph. Layers are offloaded from the top as llama.cpp does; output tensors
+// go to the GPU only when every layer does (a tied head then loads token_embd a second time),
+// token embeddings never do.
+cactus_memory_estimate estimate_memory(const cactus_model_profile &profile, const common_params &params) {
+    cactus_memory_estimate out;
+    out.n_layer = (int32_t)profile.n_layer;
+    out.n_ctx_train = (int32_t)profile.n_ctx_train;
+
+    const int64_t n_layer = profile.n_layer;
+    const int64_t n_gpu = params.n_gpu_layers < 0 ? n_layer + 1 : std::min<int64_t>(params.n_gpu_layers, n_layer + 1);
+    const int64_t first_gpu_layer = n_layer - std::min(n_gpu, n_layer);
+
+    out.weights = profile.input_bytes + profile.output_bytes;
+    for (int64_t il = 0; il < n_layer; il++) {
+        out.weights += profile.layer_bytes[il];
+        if (il >= first_gpu_layer) {
+            out.weights_gpu += profile.layer_bytes[il];
+        }
+    }
+    if (n_gpu > n_layer) {
+        out.weights_gpu += profile.output_bytes;
+        if (profile.tied_output) {
+            out.weights_gpu += profile.input_bytes;
+        }
+    }
+
+    const int64_t n_ctx = params.n_ctx > 0 ? params.n_ctx : (profile.n_ctx_train > 0 ? profile.n_ctx_train : 4096);
+    const int64_t n_ubatch = std::max(1, std::min(params.n_ubatch, params.n_batch));
+    // A tiered cache adds its f16 ring of recent cells and runs without flash attention
+    const bool tiered = params.cache_n_recent > 0 && (!kv_type_is_float(params.cache_type_k) || !kv_type_is_float(params.cache_type_v));
+    const int64_t n_hot = tiered ? std::min<int64_t>(n_ctx, params.cache_n_recent + n_ubatch) : 0;
+    // SWA layers hold the window of each sequence and one ubatch (a whole batch with several sequences)
+    const int64_t n_seq = std::max(1, params.n_parallel);
+    const int64_t n_swa_cells = params.swa_full ? n_ctx :
+        std::min<int64_t>(n_ctx, profile.n_swa * n_seq + (n_seq == 1 ? n_ubatch : std::min<int64_t>(n_ctx, params.n_batch)));
+    const double kv_cell = (double)profile.n_head_kv *
+        (profile.head_k * type_bytes(params.cache_type_k) + profile.head_v * type_bytes(params.cache_type_v));
+    const double kv_hot = (double)n_hot * profile.n_head_kv * (profile.head_k + profile.head_v) * 2.0;
+    double kv_cache = 0.0;
+    double kv_cache_gpu = 0.0;
+    for (int64_t il = 0; il < n_layer; il++) {
+        const bool swa = profile.n_swa > 0 && il % profile.swa_pattern < profile.swa_pattern - 1;
+        const double kv_layer = (swa ? n_swa_cells : n_ctx) * kv_cell + kv_hot;
+        kv_cache += kv_layer;
+        if (il >= first_gpu_layer) {
+            kv_cache_gpu += kv_layer;
+        }
+    }
+    out.kv_cache = (size_t)kv_cache;
+    out.kv_cache_gpu = (size_t)kv_cache_gpu;
+
+    // Activations and logits for one ubatch, plus the KQ matrix unless flash attention tiles it
+    const int64_t kq = params.flash_attn && !tiered ? n_ubatch * profile.n_embd : n_ubatch * n_ctx * profile.n_head;
+    out.compute = (size_t)(4 * (n_ubatch * (3 * profile.n_embd + 2 * profile.n_ff + profile.n_vocab) + kq));
+    out.compute_gpu = n_gpu > 0 ? out.compute : 0;
+    return out;
+}
+
+bool estimate_memory(const std::string &model_path, const common_params &params, const std::string &mmproj_path, cactus_memory_estimate &out) {
+    cactus_model_profile profile;
+    if (!read_model_profile(model_path, profile)) {
+        out = cactus_memory_estimate();
+        return false;
+    }
+    out = estimate_memory(profile, params);
+    if (!mmproj_path.empty()) {
+        const size_t projector = gguf_tensor_bytes(mmproj_path);
+        out.mmproj = projector + projector / 10; // image encoder activations
+    }
+    return true;
+}
+
+std::vector<cactus_buffer_usage> buffer_memory_usage(size_t *peak_total) {
+    std::vector<lm_ggml_backend_memory_stat> stats(lm_ggml_backend_memory_stats(nullptr, 0, nullptr));
+    // Rows are only ever added, so a second call can report more than the first sized for
+    const size_t n = std::min(stats.size(), lm_ggml_backend_memory_stats(stats.data(), stats.size(), peak_total));
+    std::vector<cactus_buffer_usage> rows;
+    rows.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        if (stats[i].peak == 0) {
+            continue;
+        }
+        cactus_buffer_usage row;
+        row.category = stats[i].category;
+        row.buffer_type = stats[i].buft_name;
+        row.current = stats[i].current;
+        row.peak = stats[i].peak;
+        row.n_buffers = stats[i].n_buffers;
+        rows.push_back(row);
+    }
+    std::sort(rows.begin(), rows.end(), [](const cactus_buffer_usage &a, const cactus_buffer_usage &b) {
+        return a.peak > b.peak;
+    });
+    return rows;
+}
+
+} // namespace cactus
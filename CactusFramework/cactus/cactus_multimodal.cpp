@@ -2,83 +2,88 @@
 #include "common.h"
 #include "tools/mtmd/mtmd.h"
 #include "tools/mtmd/clip.h"
+#include "tools/mtmd/stb_image.h"
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <fstream>
 #include <stdexcept>
+#include <string_view>
+#include <cstring>
+#include <future>
 
 namespace cactus {
 
-static std::string fnv_hash(const uint8_t * data, size_t len) {
-    const uint64_t fnv_prime = 0x100000001b3ULL;
-    uint64_t hash = 0xcbf29ce484222325ULL;
+// 0-63 for alphabet characters; whitespace is skipped and anything else ('=' included) ends the data
+static const uint8_t BASE64_SKIP = 0x40;
+static const uint8_t BASE64_END = 0x80;
 
-    for (size_t i = 0; i < len; ++i) {
-        hash ^= data[i];
-        hash *= fnv_prime;
-    }
-    return std::to_string(hash);
-}
+struct base64_table {
+    uint8_t value[256];
 
-static const std::string base64_chars =
-             "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-             "abcdefghijklmnopqrstuvwxyz"
-             "0123456789+/";
-
-static std::vector<uint8_t> base64_decode(const std::string &encoded_string) {
-    std::vector<uint8_t> decoded;
-    int in_len = encoded_string.size();
-    int i = 0;
-    int j = 0;
-    int in_ = 0;
-    unsigned char char_array_4[4], char_array_3[3];
-
-    while (in_len-- && (encoded_string[in_] != '=')) {
-        if (isspace(encoded_string[in_])) {
-            in_++;
-            continue;
+    base64_table() {
+        static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        memset(value, BASE64_END, sizeof(value));
+        for (int i = 0; i < 64; i++) {
+            value[(uint8_t)alphabet[i]] = (uint8_t)i;
         }
-
-        if (encoded_string[in_] == '=' || base64_chars.find(encoded_string[in_]) == std::string::npos) {
-            break;
+        for (char c : std::string(" \t\n\v\f\r")) {
+            value[(uint8_t)c] = BASE64_SKIP;
         }
+    }
+};
 
-        char_array_4[i++] = encoded_string[in_]; in_++;
-        if (i == 4) {
-            for (i = 0; i < 4; i++) {
-                char_array_4[i] = base64_chars.find(char_array_4[i]);
-            }
-
-            char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-            for (i = 0; i < 3; i++) {
-                decoded.push_back(char_array_3[i]);
+// Decodes whole quads with four table lookups and one check; whitespace, padding and the tail
+// fall back to one character at a time
+static void base64_decode(std::string_view in, std::vector<uint8_t> &out) {
+    static const base64_table table;
+    const uint8_t *t = table.value;
+    const uint8_t *src = reinterpret_cast<const uint8_t *>(in.data());
+    const size_t n = in.size();
+    out.resize(n / 4 * 3 + 3);
+    uint8_t *dst = out.data();
+
+    size_t i = 0;
+    uint32_t acc = 0;
+    int pending = 0;
+    while (i < n) {
+        if (pending == 0 && i + 4 <= n) {
+            const uint32_t a = t[src[i]], b = t[src[i + 1]], c = t[src[i + 2]], d = t[src[i + 3]];
+            if (((a | b | c | d) & (BASE64_SKIP | BASE64_END)) == 0) {
+                const uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+                dst[0] = (uint8_t)(v >> 16);
+                dst[1] = (uint8_t)(v >> 8);
+                dst[2] = (uint8_t)v;
+                dst += 3;
+                i += 4;
+                continue;
             }
-            i = 0;
         }
-    }
-
-    if (i) {
-        for (j = i; j < 4; j++) {
-            char_array_4[j] = 0;
+        const uint8_t v = t[src[i++]];
+        if (v == BASE64_SKIP) {
+            continue;
         }
-
-        for (j = 0; j < 4; j++) {
-            char_array_4[j] = base64_chars.find(char_array_4[j]);
+        if (v & BASE64_END) {
+            break;
         }
-
-        char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-        for (j = 0; j < i - 1; j++) {
-            decoded.push_back(char_array_3[j]);
+        acc = (acc << 6) | v;
+        if (++pending == 4) {
+            dst[0] = (uint8_t)(acc >> 16);
+            dst[1] = (uint8_t)(acc >> 8);
+            dst[2] = (uint8_t)acc;
+            dst += 3;
+            acc = 0;
+            pending = 0;
         }
     }
-
-    return decoded;
+    if (pending >= 2) {
+        acc <<= 6 * (4 - pending);
+        *dst++ = (uint8_t)(acc >> 16);
+        if (pending == 3) {
+            *dst++ = (uint8_t)(acc >> 8);
+        }
+    }
+    out.resize(dst - out.data());
 }
 
 struct mtmd_tokenize_result {
@@ -89,75 +94,228 @@ struct mtmd_tokenize_result {
     mtmd_input_chunks* chunks = nullptr;
 };
 
-static mtmd_tokenize_result tokenizeWithMedia(cactus_context::cactus_context_mtmd *mtmd_wrapper, const std::string &prompt, const std::vector<std::string> &media_paths) {
-    mtmd_tokenize_result result;
-    mtmd::bitmaps bitmaps;
+static std::string mediaCacheKey(const cactus_context &c, const std::string &hash) {
+    return hash + "|" + c.mmproj_identity;
+}
 
-    for (const auto& media_path : media_paths) {
-        LOG_VERBOSE("Loading media: %s", media_path.substr(0, 50).c_str());
+// Position of a chunk among those of its item: slices of an image and 30 s windows of an audio
+// clip share the item's id
+static size_t mediaChunkOrdinal(const mtmd_input_chunks *chunks, size_t index) {
+    const char *id = mtmd_input_chunk_get_id(mtmd_input_chunks_get(chunks, index));
+    size_t ordinal = 0;
+    for (size_t j = 0; j < index && id != nullptr; j++) {
+        const char *prev = mtmd_input_chunk_get_id(mtmd_input_chunks_get(chunks, j));
+        if (prev && strcmp(prev, id) == 0) {
+            ordinal++;
+        }
+    }
+    return ordinal;
+}
 
-        if (media_path.compare(0, 11, "data:image/") == 0 || media_path.compare(0, 11, "data:audio/") == 0) {
-            LOG_VERBOSE("Detected base64 encoded media");
+// The item's content hash, the chunk's position in it and the token grid the projector made of it,
+// which follows the decode size and projector settings as well; empty when the chunk has no id
+static std::string mediaChunkKey(const cactus_context &c, const mtmd_input_chunks *chunks, size_t index) {
+    const mtmd_input_chunk *chunk = mtmd_input_chunks_get(chunks, index);
+    const char *id = mtmd_input_chunk_get_id(chunk);
+    if (id == nullptr || id[0] == '\0') {
+        return "";
+    }
+    std::string key = std::string(id) + "#" + std::to_string(mediaChunkOrdinal(chunks, index)) + "/" +
+                      std::to_string(mtmd_input_chunk_get_n_tokens(chunk));
+    const mtmd_image_tokens *image_tokens = mtmd_input_chunk_get_tokens_image(chunk);
+    if (image_tokens != nullptr) {
+        key += ":" + std::to_string(mtmd_image_tokens_get_nx(image_tokens)) + "x" +
+               std::to_string(mtmd_image_tokens_get_ny(image_tokens));
+    }
+    return mediaCacheKey(c, key);
+}
 
-            size_t comma_pos = media_path.find(',');
-            if (comma_pos == std::string::npos) {
-                throw std::runtime_error("Invalid base64 media format, missing comma separator");
-            }
+static bool isAudioStreamRef(const std::string &media_path) {
+    return media_path.compare(0, 4, "pcm:") == 0;
+}
 
-            std::string header = media_path.substr(0, comma_pos);
-            std::string base64_data = media_path.substr(comma_pos + 1);
+// Media whose projected embeddings are already cached needs only its dimensions for tokenizing,
+// so the pixels are left undecoded and a blank bitmap of the same size stands in. The chunk key the
+// item had last is a hint only, tokenizeWithMedia pins the one the blank bitmap tokenizes to. Slicing
+// projectors (no decode size) are excluded, since only the first slice is checked.
+static mtmd_bitmap *placeholderMediaBitmap(cactus_context &c, const std::string &hash, const std::vector<uint8_t> &media_data) {
+    int nx = 0;
+    int ny = 0;
+    int comp = 0;
+    if (c.media_decode_max_side <= 0 || !stbi_info_from_memory(media_data.data(), (int)media_data.size(), &nx, &ny, &comp) ||
+        !c.media_embd_cache.contains(c.media_embd_cache.itemKey(mediaCacheKey(c, hash)), 0)) {
+        return nullptr;
+    }
+    LOG_VERBOSE("Media %s already projected, skipping decode", hash.c_str());
+#if defined(__APPLE__)
+    decode_image_apple_size(nx, ny, c.media_decode_max_side, nx, ny);
+#endif
+    std::vector<unsigned char> blank((size_t)nx * ny * 3);
+    return mtmd_bitmap_init(nx, ny, blank.data());
+}
 
-            if (header.find("base64") == std::string::npos) {
-                bitmaps.entries.clear();
-                throw std::runtime_error("Media must be base64 encoded");
-            }
+// Counting tokens needs only the size, from the header: an image's dimensions as the decode would
+// scale them, or the length of an audio file. nullptr when the header does not say
+static mtmd_bitmap *sizeOnlyMediaBitmap(const cactus_context &c, const std::vector<uint8_t> &media_data) {
+    mtmd_bitmap *bitmap = mtmd_helper_bitmap_init_size_from_buf(media_data.data(), media_data.size());
+#if defined(__APPLE__)
+    int nx = 0;
+    int ny = 0;
+    if (bitmap && !mtmd_bitmap_is_audio(bitmap)) {
+        decode_image_apple_size(mtmd_bitmap_get_nx(bitmap), mtmd_bitmap_get_ny(bitmap), c.media_decode_max_side, nx, ny);
+        mtmd_bitmap_free(bitmap);
+        bitmap = mtmd_bitmap_init_size_only(nx, ny);
+    } else if (!bitmap && decode_image_apple_info(media_data.data(), media_data.size(), c.media_decode_max_side, nx, ny)) {
+        bitmap = mtmd_bitmap_init_size_only(nx, ny);
+    }
+#else
+    (void)c;
+#endif
+    return bitmap;
+}
+
+static mtmd_bitmap *decodeMediaBitmap(const cactus_context &c, const std::vector<uint8_t> &media_data) {
+#if defined(__APPLE__)
+    if (mtmd_bitmap *bitmap = decode_image_apple(media_data.data(), media_data.size(), c.media_decode_max_side)) {
+        return bitmap;
+    }
+#else
+    (void)c;
+#endif
+    return mtmd_helper_bitmap_init_from_buf(media_data.data(), media_data.size());
+}
 
-            std::vector<uint8_t> media_data = base64_decode(base64_data);
-            LOG_VERBOSE("Base64 decoded, size: %zu bytes", media_data.size());
+static void readMedia(const std::string &media_path, std::vector<uint8_t> &media_data) {
+    LOG_VERBOSE("Loading media: %s", media_path.substr(0, 50).c_str());
 
-            mtmd::bitmap bmp(mtmd_helper_bitmap_init_from_buf(media_data.data(), media_data.size()));
-            if (!bmp.ptr) {
-                bitmaps.entries.clear();
-                throw std::runtime_error("Failed to load base64 media");
-            }
+    if (media_path.compare(0, 11, "data:image/") == 0 || media_path.compare(0, 11, "data:audio/") == 0) {
+        LOG_VERBOSE("Detected base64 encoded media");
 
-            std::string hash = fnv_hash(bmp.data(), bmp.n_bytes());
-            bmp.set_id(hash.c_str());
-            LOG_VERBOSE("Media hash: %s", hash.c_str());
-            bitmaps.entries.push_back(std::move(bmp));
-            result.bitmap_hashes.push_back(hash.c_str());
-        } else if (media_path.compare(0, 7, "http://") == 0 || media_path.compare(0, 8, "https://") == 0) {
-            LOG_ERROR("HTTP/HTTPS URLs are not supported yet: %s", media_path.c_str());
-            throw std::runtime_error("HTTP/HTTPS URLs are not supported yet");
-        } else {
-            LOG_VERBOSE("Loading media from file");
+        size_t comma_pos = media_path.find(',');
+        if (comma_pos == std::string::npos) {
+            throw std::runtime_error("Invalid base64 media format, missing comma separator");
+        }
+
+        const std::string_view data_uri(media_path);
+        if (data_uri.substr(0, comma_pos).find("base64") == std::string_view::npos) {
+            throw std::runtime_error("Media must be base64 encoded");
+        }
+
+        base64_decode(data_uri.substr(comma_pos + 1), media_data);
+        LOG_VERBOSE("Base64 decoded, size: %zu bytes", media_data.size());
+    } else if (media_path.compare(0, 7, "http://") == 0 || media_path.compare(0, 8, "https://") == 0) {
+        LOG_ERROR("HTTP/HTTPS URLs are not supported yet: %s", media_path.c_str());
+        throw std::runtime_error("HTTP/HTTPS URLs are not supported yet");
+    } else {
+        LOG_VERBOSE("Loading media from file");
+
+        std::ifstream file(media_path, std::ios::binary | std::ios::ate);
+        if (!file.is_open()) {
+            throw std::runtime_error("File does not exist or cannot be opened");
+        }
+        media_data.resize((size_t)file.tellg());
+        file.seekg(0, std::ios::beg);
+        if (!file.read(reinterpret_cast<char *>(media_data.data()), (std::streamsize)media_data.size())) {
+            throw std::runtime_error("Failed to read media file");
+        }
+        LOG_VERBOSE("File read, size: %zu bytes", media_data.size());
+    }
+}
 
-            std::ifstream file(media_path, std::ios::binary);
-            if (!file.is_open()) {
-                bitmaps.entries.clear();
-                throw std::runtime_error("File does not exist or cannot be opened");
+// Runs fn(0..n-1) with all but the first on worker threads; rethrows the first failure once all are done
+template <typename F>
+static void parallelFor(size_t n, F fn) {
+    std::vector<std::future<void>> workers;
+    for (size_t i = 1; i < n; i++) {
+        workers.push_back(std::async(std::launch::async, fn, i));
+    }
+    std::exception_ptr error;
+    try {
+        if (n > 0) {
+            fn(0);
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+    for (auto &worker : workers) {
+        try {
+            worker.get();
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
             }
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// size_only takes each item's size from its header: the chunks count tokens and positions but cannot be
+// evaluated, nothing is pinned and only media without a readable header is decoded
+static mtmd_tokenize_result tokenizeWithMedia(cactus_context &c, const std::string &prompt, const std::vector<std::string> &media_paths,
+                                              bool size_only = false) {
+    mtmd_tokenize_result result;
+    mtmd::bitmaps bitmaps;
 
-            file.seekg(0, std::ios::end);
-            size_t file_size = file.tellg();
-            file.seekg(0, std::ios::beg);
-            
-            LOG_VERBOSE("File exists and size is %zu bytes", file_size);
-            file.close();
-
-            mtmd::bitmap bmp(mtmd_helper_bitmap_init_from_file(media_path.c_str()));
-            if (!bmp.ptr) {
-                bitmaps.entries.clear();
-                throw std::runtime_error("Failed to load media");
+    // Read and hash every item in parallel, pin cached ones serially, then decode the rest in parallel.
+    // In-memory audio arrives as a finished spectrogram and is hashed as such.
+    const size_t n_media = media_paths.size();
+    std::vector<std::vector<uint8_t>> media_data(n_media);
+    std::vector<std::string> hashes(n_media);
+    std::vector<mtmd_bitmap *> decoded(n_media, nullptr);
+    std::vector<bool> placeholder(n_media, false);
+    auto free_decoded = [&decoded]() {
+        for (mtmd_bitmap *bitmap : decoded) {
+            if (bitmap) {
+                mtmd_bitmap_free(bitmap);
+            }
+        }
+    };
+    try {
+        parallelFor(n_media, [&](size_t i) {
+            if (isAudioStreamRef(media_paths[i])) {
+                decoded[i] = c.audioStreamBitmap(media_paths[i]);
+                hashes[i] = std::to_string(content_hash64(mtmd_bitmap_get_data(decoded[i]), mtmd_bitmap_get_n_bytes(decoded[i])));
+                return;
             }
+            readMedia(media_paths[i], media_data[i]);
+            // Identity of the encoded bytes, known before (and often instead of) decoding
+            hashes[i] = std::to_string(content_hash64(media_data[i].data(), media_data[i].size()));
+            if (size_only) {
+                decoded[i] = sizeOnlyMediaBitmap(c, media_data[i]);
+            }
+        });
+        for (size_t i = 0; i < n_media && !size_only; i++) {
+            if (decoded[i] == nullptr) {
+                decoded[i] = placeholderMediaBitmap(c, hashes[i], media_data[i]);
+                placeholder[i] = decoded[i] != nullptr;
+            }
+        }
+        parallelFor(n_media, [&](size_t i) {
+            if (decoded[i] == nullptr) {
+                decoded[i] = decodeMediaBitmap(c, media_data[i]);
+            }
+        });
+    } catch (...) {
+        free_decoded();
+        throw;
+    }
 
-            std::string hash = fnv_hash(bmp.data(), bmp.nx()*bmp.ny()*3);
-            bmp.set_id(hash.c_str());
-            LOG_VERBOSE("Media hash: %s", hash.c_str());
-            bitmaps.entries.push_back(std::move(bmp));
-            result.bitmap_hashes.push_back(hash.c_str());
+    for (size_t i = 0; i < n_media; i++) {
+        if (decoded[i] == nullptr) {
+            free_decoded();
+            bitmaps.entries.clear();
+            throw std::runtime_error("Failed to load media");
         }
     }
+    for (size_t i = 0; i < n_media; i++) {
+        mtmd::bitmap bmp(decoded[i]);
+        bmp.set_id(hashes[i].c_str());
+        LOG_VERBOSE("Media hash: %s", hashes[i].c_str());
+        bitmaps.entries.push_back(std::move(bmp));
+        result.bitmap_hashes.push_back(hashes[i]);
+    }
 
     LOG_VERBOSE("Initializing input chunks");
     result.chunks = mtmd_input_chunks_init();
@@ -172,12 +330,49 @@ static mtmd_tokenize_result tokenizeWithMedia(cactus_context::cactus_context_mtm
     input_text.parse_special = true;
 
     LOG_VERBOSE("Tokenizing text and %zu media", bitmaps.entries.size());
-    auto bitmaps_c_ptr = bitmaps.c_ptr();
-    int32_t res = mtmd_tokenize(mtmd_wrapper->mtmd_ctx, result.chunks, &input_text, bitmaps_c_ptr.data(), bitmaps_c_ptr.size());
-    if (res != 0) {
+    while (true) {
+        auto bitmaps_c_ptr = bitmaps.c_ptr();
+        int32_t res = mtmd_tokenize(c.mtmd_wrapper->mtmd_ctx, result.chunks, &input_text, bitmaps_c_ptr.data(), bitmaps_c_ptr.size());
+        if (res != 0) {
+            mtmd_input_chunks_free(result.chunks);
+            bitmaps.entries.clear();
+            throw std::runtime_error("Failed to tokenize text and media");
+        }
+
+        // A blank stand-in is only good if the embeddings of the chunk it tokenized to are cached;
+        // otherwise the item is decoded after all and the prompt tokenized again
+        bool redo = false;
+        for (size_t j = 0; j < mtmd_input_chunks_size(result.chunks); j++) {
+            const char *id = mtmd_input_chunk_get_id(mtmd_input_chunks_get(result.chunks, j));
+            if (id == nullptr || mediaChunkOrdinal(result.chunks, j) != 0) {
+                continue;
+            }
+            for (size_t i = 0; i < n_media; i++) {
+                if (!placeholder[i] || hashes[i] != id || c.media_embd_cache.pin(mediaChunkKey(c, result.chunks, j))) {
+                    continue;
+                }
+                mtmd_bitmap *bitmap = decodeMediaBitmap(c, media_data[i]);
+                if (bitmap == nullptr) {
+                    mtmd_input_chunks_free(result.chunks);
+                    bitmaps.entries.clear();
+                    throw std::runtime_error("Failed to load media");
+                }
+                bitmaps.entries[i].ptr.reset(bitmap);
+                bitmaps.entries[i].set_id(hashes[i].c_str());
+                placeholder[i] = false;
+                redo = true;
+            }
+        }
+        if (!redo) {
+            break;
+        }
+        LOG_VERBOSE("Cached media embeddings do not match, tokenizing with decoded media");
         mtmd_input_chunks_free(result.chunks);
-        bitmaps.entries.clear();
-        throw std::runtime_error("Failed to tokenize text and media");
+        result.chunks = mtmd_input_chunks_init();
+        if (result.chunks == nullptr) {
+            bitmaps.entries.clear();
+            throw std::runtime_error("Failed to initialize input chunks");
+        }
     }
 
     size_t num_chunks = mtmd_input_chunks_size(result.chunks);
@@ -217,7 +412,46 @@ static mtmd_tokenize_result tokenizeWithMedia(cactus_context::cactus_context_mtm
     return result;
 }
 
+// Projectors that resize the whole image to fit image_size gain nothing from more pixels than
+// that; slicing projectors (llava-uhd, minicpm-v, llama4) tile the original resolution. image_max_side
+// mirrors the cap clip.cpp applies to the dynamic-resolution ones
+static int projector_input_max_side(const std::string &mmproj_path, int image_max_side) {
+    lm_gguf_init_params init = { /*no_alloc =*/ true, /*ctx =*/ nullptr };
+    lm_gguf_context *meta = lm_gguf_init_from_file(mmproj_path.c_str(), init);
+    if (meta == nullptr) {
+        return 0;
+    }
+    const int64_t type_id = lm_gguf_find_key(meta, "clip.projector_type");
+    const int64_t size_id = lm_gguf_find_key(meta, "clip.vision.image_size");
+    const std::string type = type_id >= 0 ? lm_gguf_get_val_str(meta, type_id) : "mlp";
+    const int image_size = size_id >= 0 ? (int)lm_gguf_get_val_u32(meta, size_id) : 0;
+    const bool tiled = lm_gguf_find_key(meta, "clip.vision.image_grid_pinpoints") >= 0 ||
+                       lm_gguf_find_key(meta, "clip.minicpmv_version") >= 0;
+    lm_gguf_free(meta);
+
+    if (type == "qwen2vl_merger" || type == "qwen2.5vl_merger") {
+        // clip.cpp caps these regardless of the stored image_size
+        return image_max_side > 0 ? std::min(image_max_side, 1024) : 1024;
+    }
+    if (type == "pixtral" && !tiled && image_max_side > 0) {
+        return std::min(image_max_side, image_size);
+    }
+    static const char *fixed_size_types[] = { "mlp", "ldp", "ldpv2", "adapter", "gemma3", "idefics3", "internvl", "pixtral" };
+    for (const char *fixed : fixed_size_types) {
+        if (type == fixed) {
+            return tiled ? 0 : image_size;
+        }
+    }
+    return 0;
+}
+
 bool cactus_context::initMultimodal(const std::string &mmproj_path, bool use_gpu) {
+    cactus_multimodal_params mm_params;
+    mm_params.use_gpu = use_gpu;
+    return initMultimodal(mmproj_path, mm_params);
+}
+
+bool cactus_context::initMultimodal(const std::string &mmproj_path, const cactus_multimodal_params &mm_params) {
     LOG_VERBOSE("Initializing multimodal with mmproj path: %s", mmproj_path.c_str());
 
     if (model == nullptr) {
@@ -227,21 +461,55 @@ bool cactus_context::initMultimodal(const std::string &mmproj_path, bool use_gpu
 
     LOG_VERBOSE("Model info: n_ctx=%d, n_embd=%d", llama_n_ctx(ctx), llama_model_n_embd(model));
 
+    mtmd_context *mtmd_ctx = loadProjector(mmproj_path, model, mm_params, params.cpuparams);
+    if (mtmd_ctx == nullptr) {
+        return false;
+    }
+    attachProjector(mtmd_ctx, mmproj_path, mm_params, nullptr);
+    return true;
+}
+
+// Needs nothing of the context, so it may run on a loader thread
+mtmd_context *cactus_context::loadProjector(const std::string &mmproj_path, const llama_model *text_model,
+                                            const cactus_multimodal_params &mm_params, const cpu_params &cpuparams) {
     mtmd_context_params mtmd_params = mtmd_context_params_default();
-    mtmd_params.use_gpu = use_gpu;
+    mtmd_params.use_gpu = mm_params.use_gpu;
+    mtmd_params.weight_type = mm_params.weight_type;
+    mtmd_params.image_max_side = mm_params.image_max_side;
+    mtmd_params.max_slices = mm_params.max_slices;
     mtmd_params.print_timings = false;
-    mtmd_params.n_threads = params.cpuparams.n_threads;
+    mtmd_params.n_threads = cpuparams.n_threads;
+    mtmd_params.threadpool = shared_threadpool(cpuparams);
     mtmd_params.verbosity = (lm_ggml_log_level)LM_GGML_LOG_LEVEL_INFO;
 
     LOG_VERBOSE("Initializing mtmd context with threads=%d", mtmd_params.n_threads);
 
-    auto mtmd_ctx = mtmd_init_from_file(mmproj_path.c_str(), model, mtmd_params);
+    mtmd_context *mtmd_ctx = nullptr;
+    {
+        cactus_memory_scope scope("mmproj");
+        mtmd_ctx = mtmd_init_from_file(mmproj_path.c_str(), text_model, mtmd_params);
+    }
     if (mtmd_ctx == nullptr) {
         LOG_ERROR("Failed to initialize multimodal context with mmproj: %s", mmproj_path.c_str());
-        return false;
     }
+    return mtmd_ctx;
+}
+
+void cactus_context::attachProjector(mtmd_context *mtmd_ctx, const std::string &mmproj_path, const cactus_multimodal_params &mm_params,
+                                     std::shared_ptr<llama_model> text_vocab) {
     mtmd_wrapper = new cactus_context_mtmd();
     mtmd_wrapper->mtmd_ctx = mtmd_ctx;
+    mtmd_wrapper->text_vocab = std::move(text_vocab);
+    // Cached projections are only valid for the projector that produced them
+    mmproj_identity = mmproj_path;
+    {
+        std::ifstream mmproj_file(mmproj_path, std::ios::binary | std::ios::ate);
+        mmproj_identity += "|" + std::to_string((long long)mmproj_file.tellg());
+    }
+    mmproj_identity += "|" + std::to_string((int)mm_params.weight_type) + "|" + std::to_string(mm_params.image_max_side) +
+                       "|" + std::to_string(mm_params.max_slices);
+    media_embd_cache.clear();
+    media_decode_max_side = projector_input_max_side(mmproj_path, mm_params.image_max_side);
 
     has_multimodal = true;
 
@@ -250,7 +518,6 @@ bool cactus_context::initMultimodal(const std::string &mmproj_path, bool use_gpu
     LOG_VERBOSE("Model multimodal properties: uses_mrope=%d, uses_non_causal=%d", uses_mrope ? 1 : 0, uses_non_causal ? 1 : 0);
 
     LOG_INFO("Multimodal context initialized successfully with mmproj: %s", mmproj_path.c_str());
-    return true;
 }
 
 bool cactus_context::isMultimodalEnabled() const {
@@ -272,7 +539,199 @@ void cactus_context::releaseMultimodal() {
         delete mtmd_wrapper;
         mtmd_wrapper = nullptr;
         has_multimodal = false;
+        media_embd_cache.clear();
+    }
+    std::lock_guard<std::mutex> lock(audio_streams_mutex);
+    for (auto &entry : audio_streams) {
+        mtmd_audio_stream_free(entry.second);
+    }
+    audio_streams.clear();
+}
+
+std::string cactus_context::beginAudioStream() {
+    if (!isMultimodalSupportAudio()) {
+        LOG_ERROR("Audio input needs a multimodal projector with an audio encoder", "");
+        return "";
+    }
+    mtmd_audio_stream *stream = mtmd_audio_stream_init(mtmd_wrapper->mtmd_ctx);
+    if (stream == nullptr) {
+        return "";
+    }
+    std::lock_guard<std::mutex> lock(audio_streams_mutex);
+    const std::string ref = "pcm:" + std::to_string(next_audio_stream_id++);
+    audio_streams[ref] = stream;
+    return ref;
+}
+
+std::string cactus_context::addAudio(const float *samples, size_t n_samples) {
+    const std::string ref = beginAudioStream();
+    if (!ref.empty() && !pushAudio(ref, samples, n_samples)) {
+        releaseAudio(ref);
+        return "";
+    }
+    return ref;
+}
+
+bool cactus_context::pushAudio(const std::string &ref, const float *samples, size_t n_samples) {
+    std::lock_guard<std::mutex> lock(audio_streams_mutex);
+    auto it = audio_streams.find(ref);
+    if (it == audio_streams.end()) {
+        LOG_ERROR("Unknown audio stream: %s", ref.c_str());
+        return false;
+    }
+    if (n_samples > 0) {
+        mtmd_audio_stream_push(it->second, samples, n_samples);
+    }
+    return true;
+}
+
+void cactus_context::releaseAudio(const std::string &ref) {
+    std::lock_guard<std::mutex> lock(audio_streams_mutex);
+    auto it = audio_streams.find(ref);
+    if (it != audio_streams.end()) {
+        mtmd_audio_stream_free(it->second);
+        audio_streams.erase(it);
+    }
+}
+
+mtmd_bitmap *cactus_context::audioStreamBitmap(const std::string &ref) {
+    std::lock_guard<std::mutex> lock(audio_streams_mutex);
+    auto it = audio_streams.find(ref);
+    if (it == audio_streams.end()) {
+        throw std::runtime_error("Unknown audio stream: " + ref);
+    }
+    mtmd_bitmap *bitmap = mtmd_audio_stream_get_bitmap(it->second);
+    if (bitmap == nullptr) {
+        throw std::runtime_error("Audio stream is too short: " + ref);
+    }
+    return bitmap;
+}
+
+static size_t mediaChunkFloats(const cactus_context &c, const mtmd_input_chunk *chunk) {
+    return mtmd_input_chunk_get_n_tokens(chunk) * (size_t)llama_model_n_embd(c.model);
+}
+
+// Keeps the projector one media chunk ahead of the LLM: while a text chunk or the previous media
+// chunk is decoded, the next uncached media chunk encodes on a worker thread. mtmd has a single
+// output buffer, so one encode is in flight at a time and its result is copied out before the next.
+struct media_encode_pipeline {
+    cactus_context &c;
+    mtmd_input_chunks *chunks;
+    // Chunks whose KV is kept from the previous prompt and need no encode
+    const std::vector<bool> &reused;
+    std::future<int32_t> pending;
+    size_t pending_index = SIZE_MAX;
+
+    void start(size_t from) {
+        if (pending.valid()) {
+            return;
+        }
+        for (size_t j = from; j < mtmd_input_chunks_size(chunks); j++) {
+            const mtmd_input_chunk *chunk = mtmd_input_chunks_get(chunks, j);
+            if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT || reused[j]) {
+                continue;
+            }
+            const std::string key = mediaChunkKey(c, chunks, j);
+            if (!key.empty() && c.media_embd_cache.contains(key, mediaChunkFloats(c, chunk))) {
+                continue;
+            }
+            mtmd_context *mtmd_ctx = c.mtmd_wrapper->mtmd_ctx;
+            pending = std::async(std::launch::async, [mtmd_ctx, chunk]() { return mtmd_encode_chunk(mtmd_ctx, chunk); });
+            pending_index = j;
+            return;
+        }
+    }
+
+    // Result of encoding chunk index into mtmd's output buffer, waiting for (or discarding) any encode in flight
+    int32_t encode(size_t index, const mtmd_input_chunk *chunk) {
+        if (pending.valid()) {
+            const int32_t res = pending.get();
+            if (pending_index == index) {
+                pending_index = SIZE_MAX;
+                return res;
+            }
+            pending_index = SIZE_MAX;
+        }
+        return mtmd_encode_chunk(c.mtmd_wrapper->mtmd_ctx, chunk);
+    }
+
+    void wait() {
+        if (pending.valid()) {
+            pending.wait();
+        }
+    }
+
+    ~media_encode_pipeline() {
+        wait();
+    }
+};
+
+// Encodes through the projector only on a cache miss, then decodes the projected embeddings
+static int32_t evalMediaChunk(cactus_context &c, media_encode_pipeline &pipeline, size_t index, llama_pos n_past, llama_pos *new_n_past) {
+    mtmd_context *mtmd_ctx = c.mtmd_wrapper->mtmd_ctx;
+    const mtmd_input_chunk *chunk = mtmd_input_chunks_get(pipeline.chunks, index);
+    const size_t n_floats = mediaChunkFloats(c, chunk);
+    const std::string key = mediaChunkKey(c, pipeline.chunks, index);
+
+    const float *cached = !key.empty() ? c.media_embd_cache.lookup(key, n_floats) : nullptr;
+    if (!key.empty() && mediaChunkOrdinal(pipeline.chunks, index) == 0) {
+        c.media_embd_cache.noteItem(mediaCacheKey(c, mtmd_input_chunk_get_id(chunk)), key);
+    }
+    if (cached) {
+        LOG_VERBOSE("Media embedding cache hit for %s", key.c_str());
+        pipeline.start(index + 1);
+        return mtmd_helper_decode_image_chunk(mtmd_ctx, c.ctx, chunk, const_cast<float *>(cached), n_past, c.seq_id, c.params.n_batch, new_n_past);
+    }
+    if (c.media_embd_cache.isPinned(key)) {
+        LOG_ERROR("Cached embeddings for undecoded media %s are missing", key.c_str());
+        return -1;
+    }
+    int32_t res = pipeline.encode(index, chunk);
+    if (res != 0) {
+        LOG_ERROR("Failed to encode media chunk", "");
+        return res;
+    }
+    const float *output = mtmd_get_output_embd(mtmd_ctx);
+    std::vector<float> embd(output, output + n_floats);
+    if (!key.empty()) {
+        c.media_embd_cache.store(key, embd.data(), n_floats);
     }
+    pipeline.start(index + 1);
+    return mtmd_helper_decode_image_chunk(mtmd_ctx, c.ctx, chunk, embd.data(), n_past, c.seq_id, c.params.n_batch, new_n_past);
+}
+
+// Decodes prompt tokens [from, to) at their own positions without logits
+static int32_t evalTextRange(cactus_context &c, const std::vector<llama_token> &tokens, size_t from, size_t to) {
+    if (from >= to) {
+        return 0;
+    }
+    llama_batch batch = llama_batch_init(c.params.n_batch, 0, 1);
+    int32_t res = 0;
+    for (size_t i = from; i < to && res == 0;) {
+        llama_batch_clear(&batch);
+        for (; i < to && batch.n_tokens < c.params.n_batch; i++) {
+            llama_batch_add(&batch, tokens[i], (llama_pos)i, {c.seq_id}, false);
+        }
+        res = llama_decode(c.ctx, batch);
+    }
+    llama_batch_free(batch);
+    if (res != 0) {
+        LOG_ERROR("Failed to decode text chunk", "");
+    }
+    return res;
+}
+
+cactus_tokenize_result cactus_context::tokenizeMediaSizes(const std::string &prompt, const std::vector<std::string> &media_paths) {
+    mtmd_tokenize_result result = tokenizeWithMedia(*this, prompt, media_paths, true);
+    mtmd_input_chunks_free(result.chunks);
+
+    cactus_tokenize_result tokenize_result;
+    tokenize_result.tokens = std::move(result.tokens);
+    tokenize_result.has_media = true;
+    tokenize_result.bitmap_hashes = std::move(result.bitmap_hashes);
+    tokenize_result.chunk_pos = std::move(result.chunk_pos);
+    tokenize_result.chunk_pos_media = std::move(result.chunk_pos_media);
+    return tokenize_result;
 }
 
 void cactus_context::processMedia(const std::string &prompt, const std::vector<std::string> &media_paths) {
@@ -291,12 +750,17 @@ void cactus_context::processMedia(const std::string &prompt, const std::vector<s
     LOG_VERBOSE("Processing %zu media with prompt: %s", media_paths.size(), prompt.c_str());
     LOG_VERBOSE("Current context state: n_past=%d, n_ctx=%d", n_past, n_ctx);
 
-    auto result = tokenizeWithMedia(mtmd_wrapper, full_prompt, media_paths);
+    // Pins taken while tokenizing hold only for this call
+    struct media_pin_guard {
+        cactus_media_embd_cache &cache;
+        ~media_pin_guard() { cache.unpinAll(); }
+    } pin_guard{media_embd_cache};
+
+    auto result = tokenizeWithMedia(*this, full_prompt, media_paths);
 
     auto all_tokens = result.tokens;
     auto chunks = result.chunks;
     auto chunk_pos = result.chunk_pos;
-    auto chunk_pos_media = result.chunk_pos_media;
     auto bitmap_hashes = result.bitmap_hashes;
 
     if (all_tokens.size() >= (size_t)n_ctx) {
@@ -305,90 +769,158 @@ void cactus_context::processMedia(const std::string &prompt, const std::vector<s
         throw std::runtime_error("Not enough context space");
     }
 
-    n_past = common_part(embd, all_tokens);
-    llama_pos new_n_past = n_past;
-
-    auto adjusted_n_past = -1;
-    for (size_t i = 0; i < chunk_pos.size(); i++) {
-        if (n_past < chunk_pos[i]) {
-            break;
+    const size_t num_chunks = mtmd_input_chunks_size(chunks);
+    const size_t n_total = all_tokens.size();
+    std::vector<size_t> chunk_end(num_chunks);
+    std::vector<std::string> chunk_keys(num_chunks);
+    for (size_t i = 0; i < num_chunks; i++) {
+        chunk_end[i] = i + 1 < num_chunks ? chunk_pos[i + 1] : n_total;
+        if (mtmd_input_chunk_get_type(mtmd_input_chunks_get(chunks, i)) != MTMD_INPUT_CHUNK_TYPE_TEXT) {
+            chunk_keys[i] = mediaChunkKey(*this, chunks, i);
+        }
+    }
+    auto past_chunk_matches = [&](const mtmd_chunk_state &past, size_t i) {
+        if (past.key.empty() || past.key != chunk_keys[i] || past.n_pos != chunk_end[i] - chunk_pos[i] ||
+            past.pos + past.n_pos > std::min((size_t)n_past, embd.size())) {
+            return false;
         }
-        bool is_end = i + 1 == chunk_pos.size();
-        if (chunk_pos[i] < n_past && (!is_end && chunk_pos[i + 1] > n_past)) {
-            adjusted_n_past = chunk_pos[i];
+        return std::all_of(embd.begin() + past.pos, embd.begin() + past.pos + past.n_pos,
+                           [](llama_token t) { return t == LLAMA_TOKEN_NULL; });
+    };
+
+    // Keep the common prefix, up to the first media chunk that differs from the one cached there
+    size_t n_keep = std::min(common_part(embd, all_tokens), (size_t)n_past);
+    for (size_t i = 0; i < num_chunks && chunk_pos[i] < n_keep; i++) {
+        if (mtmd_input_chunk_get_type(mtmd_input_chunks_get(chunks, i)) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+            continue;
+        }
+        const bool same = chunk_end[i] <= n_keep &&
+            std::any_of(mtmd_past_chunks.begin(), mtmd_past_chunks.end(), [&](const mtmd_chunk_state &past) {
+                return past.pos == chunk_pos[i] && past_chunk_matches(past, i);
+            });
+        if (!same) {
+            LOG_VERBOSE("Media chunk %zu changed, keeping %zu of %zu cached tokens", i, chunk_pos[i], n_keep);
+            n_keep = chunk_pos[i];
+            break;
         }
     }
-    if (adjusted_n_past != -1) {
-        n_past = adjusted_n_past;
-        new_n_past = n_past;
-        LOG_VERBOSE("Adjusted n_past to %d", n_past);
+    // The last text token is left for nextToken() to decode; a trailing media chunk is re-evaluated
+    const bool ends_with_text = num_chunks > 0 &&
+        mtmd_input_chunk_get_type(mtmd_input_chunks_get(chunks, num_chunks - 1)) == MTMD_INPUT_CHUNK_TYPE_TEXT;
+    const size_t n_eval_end = ends_with_text && n_total > 0 ? n_total - 1 : n_total;
+    if (n_keep > n_eval_end || (!ends_with_text && num_chunks > 0 && n_keep > chunk_pos[num_chunks - 1])) {
+        n_keep = ends_with_text ? n_eval_end : chunk_pos[num_chunks - 1];
     }
 
-    if (mtmd_bitmap_past_hashes.size() > 0) {
-        for (size_t i = 0; i < bitmap_hashes.size(); i++) {
-            auto pos = chunk_pos_media[i];
-            if (n_past < pos) {
-                break;
-            }
-            if (i >= mtmd_bitmap_past_hashes.size()) {
-                break;
-            }
-            if (bitmap_hashes[i] != mtmd_bitmap_past_hashes[i]) {
-                LOG_VERBOSE("Bitmap hash mismatch at position %zu, %s != %s", i, bitmap_hashes[i].c_str(), mtmd_bitmap_past_hashes[i].c_str());
-                n_past = chunk_pos_media[i];
-                new_n_past = n_past;
-                break;
+    // Past the prefix, an unchanged media chunk keeps its KV when it is found later in the cache, in
+    // order; moving it needs a plain RoPE cache (M-RoPE positions are 3D and cannot be shifted by seq_add).
+    // Its KV attended to the old text before it, the same approximation the text path's cache reuse makes.
+    std::vector<bool> reused(num_chunks, false);
+    struct chunk_move {
+        size_t from;
+        size_t to;
+        size_t n;
+    };
+    std::vector<chunk_move> moves;
+    const bool can_move = llama_kv_self_can_shift(ctx);
+    const bool can_shift = can_move && !mtmd_decode_use_mrope(mtmd_wrapper->mtmd_ctx);
+    size_t cursor = n_keep;
+    for (size_t i = 0; can_move && i + 1 < num_chunks; i++) {
+        if (chunk_pos[i] < n_keep || chunk_keys[i].empty()) {
+            continue;
+        }
+        for (const auto &past : mtmd_past_chunks) {
+            if (past.pos < cursor || !past_chunk_matches(past, i) || (past.pos != chunk_pos[i] && !can_shift)) {
+                continue;
             }
+            reused[i] = true;
+            moves.push_back({past.pos, chunk_pos[i], past.n_pos});
+            cursor = past.pos + past.n_pos;
+            break;
         }
     }
 
-    llama_kv_self_seq_rm(ctx, 0, n_past, -1);
+    // Drop everything past the prefix except the reused chunks, which are parked above both the old
+    // and the new prompt while the rest is removed, then brought down to their new positions
+    const llama_pos far = (llama_pos)std::max({(size_t)n_past, embd.size(), n_total});
+    size_t first_moved = SIZE_MAX;
+    for (const auto &move : moves) {
+        if (move.from != move.to) {
+            first_moved = std::min(first_moved, move.from);
+        }
+    }
+    if (first_moved != SIZE_MAX && !unsharePrefixCells((llama_pos)first_moved)) {
+        moves.clear();
+        reused.assign(num_chunks, false);
+        n_keep = 0;
+    }
+    bool any_shifted = false;
+    for (const auto &move : moves) {
+        if (move.from != move.to) {
+            llama_kv_self_seq_add(ctx, seq_id, (llama_pos)move.from, (llama_pos)(move.from + move.n),
+                                  far + (llama_pos)move.to - (llama_pos)move.from);
+            n_cache_shifted += move.n;
+            any_shifted = true;
+        }
+    }
+    size_t gap = n_keep;
+    for (const auto &move : moves) {
+        if (move.from == move.to) {
+            llama_kv_self_seq_rm(ctx, seq_id, (llama_pos)gap, (llama_pos)move.from);
+            gap = move.from + move.n;
+        }
+    }
+    llama_kv_self_seq_rm(ctx, seq_id, (llama_pos)gap, any_shifted ? far : -1);
+    if (any_shifted) {
+        llama_kv_self_seq_add(ctx, seq_id, far, -1, -far);
+    }
+    if (!moves.empty()) {
+        LOG_VERBOSE("Reused %zu media chunks past the kept prefix", moves.size());
+    }
 
+    n_past = n_keep;
     LOG_VERBOSE("Evaluating chunks: n_past=%d, n_batch=%d", n_past, params.n_batch);
 
-    size_t num_chunks = mtmd_input_chunks_size(chunks);
-
-    for (size_t i = 0; i < chunk_pos.size(); i++) {
+    media_encode_pipeline pipeline{*this, chunks, reused, {}};
+    for (size_t i = 0; i < num_chunks; i++) {
+        if (chunk_end[i] <= n_keep || reused[i]) {
+            continue;
+        }
         LOG_VERBOSE("Evaluating chunk %zu: n_past=%d, chunk_pos=%zu", i, n_past, chunk_pos[i]);
-
-        if (chunk_pos[i] >= n_past) {
-            bool chunk_logits_last = (i == num_chunks - 1);
-            auto chunk = mtmd_input_chunks_get(chunks, i);
-
-            int32_t res = mtmd_helper_eval_chunk_single(
-                mtmd_wrapper->mtmd_ctx,
-                ctx,
-                chunk,
-                n_past,
-                0,
-                params.n_batch,
-                chunk_logits_last,
-                &new_n_past
-            );
-            if (res != 0) {
-                mtmd_input_chunks_free(chunks);
-                throw std::runtime_error("Failed to evaluate chunks");
-            }
-            n_past = new_n_past;
+        auto chunk = mtmd_input_chunks_get(chunks, i);
+        // Overlaps the first media encode with the leading text prefill
+        pipeline.start(i);
+
+        llama_pos new_n_past = (llama_pos)chunk_pos[i];
+        int32_t res = 0;
+        if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+            const size_t from = std::max(chunk_pos[i], n_keep);
+            res = evalTextRange(*this, all_tokens, from, std::min(chunk_end[i], n_eval_end));
+        } else {
+            res = evalMediaChunk(*this, pipeline, i, new_n_past, &new_n_past);
+        }
+        if (res != 0) {
+            pipeline.wait();
+            mtmd_input_chunks_free(chunks);
+            throw std::runtime_error("Failed to evaluate chunks");
         }
     }
-
-    if (n_past == all_tokens.size() && n_past > 0 && all_tokens[n_past - 1] != LLAMA_TOKEN_NULL) {
-        n_past--;
-    }
+    n_past = n_eval_end;
 
     embd = all_tokens;
 
-    for (auto & token : all_tokens) {
-        if (token == LLAMA_TOKEN_NULL) {
-            continue;
-        }
-        common_sampler_accept(ctx_sampling, token, false);
-    }
+    common_sampler_accept_prompt(ctx_sampling, all_tokens);
     
     mtmd_bitmap_past_hashes = bitmap_hashes;
+    mtmd_past_chunks.clear();
+    for (size_t i = 0; i < num_chunks; i++) {
+        if (!chunk_keys[i].empty()) {
+            mtmd_past_chunks.push_back({chunk_keys[i], chunk_pos[i], chunk_end[i] - chunk_pos[i]});
+        }
+    }
 
     LOG_VERBOSE("Multimodal processing completed");
+    pipeline.wait();
     mtmd_input_chunks_free(chunks);
 }
 
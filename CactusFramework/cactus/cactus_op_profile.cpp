@@ -0,0 +1,111 @@
+#include "cactus.h"
+#include "llama.h"
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace cactus {
+
+// Layout-only ops do no work; leaving them out lets the scheduler fold them into the next range
+static bool is_layout_op(enum lm_ggml_op op) {
+    return op == LM_GGML_OP_NONE || op == LM_GGML_OP_VIEW || op == LM_GGML_OP_RESHAPE ||
+           op == LM_GGML_OP_PERMUTE || op == LM_GGML_OP_TRANSPOSE;
+}
+
+// With every node requested, the scheduler computes one node per range and synchronizes the
+// backend before the second call, so the time between the two calls is that node's wall time
+static bool cactus_op_profile_callback(struct lm_ggml_tensor *t, bool ask, void *user_data) {
+    cactus_context *self = static_cast<cactus_context *>(user_data);
+    if (ask) {
+        if (is_layout_op(t->op)) {
+            return false;
+        }
+        self->op_start_us = lm_ggml_time_us();
+        return true;
+    }
+    self->recordOp(t, lm_ggml_time_us() - self->op_start_us);
+    return true;
+}
+
+static void append_shape(std::string &out, const struct lm_ggml_tensor *t) {
+    char dims[96];
+    int n_dims = lm_ggml_n_dims(t);
+    int len = 0;
+    for (int i = 0; i < n_dims && len < (int)sizeof(dims); i++) {
+        len += snprintf(dims + len, sizeof(dims) - len, i == 0 ? "%lld" : "x%lld", (long long)t->ne[i]);
+    }
+    out.append(dims, std::min(len, (int)sizeof(dims) - 1));
+}
+
+void cactus_context::setOpProfiling(bool enabled) {
+    op_profiling = enabled;
+    // Also stored in params so recreateContext() keeps the callback
+    params.cb_eval = enabled ? cactus_op_profile_callback : nullptr;
+    params.cb_eval_user_data = enabled ? this : nullptr;
+    if (ctx) {
+        llama_set_eval_callback(ctx, params.cb_eval, params.cb_eval_user_data);
+    }
+    if (enabled) {
+        op_stats.clear();
+    }
+}
+
+void cactus_context::recordOp(const struct lm_ggml_tensor *node, int64_t time_us) {
+    const struct lm_ggml_tensor *src0 = node->src[0];
+    const struct lm_ggml_tensor *src1 = node->src[1];
+
+    std::string key = lm_ggml_op_desc(node);
+    const size_t n_op = key.size();
+    key += ':';
+    key += lm_ggml_type_name(src0 ? src0->type : node->type);
+    const size_t n_type = key.size();
+    key += ':';
+    for (int i = 0; i < LM_GGML_MAX_SRC && node->src[i]; i++) {
+        if (i > 0) {
+            key += ',';
+        }
+        append_shape(key, node->src[i]);
+    }
+    key += "->";
+    append_shape(key, node);
+
+    cactus_op_stats &stats = op_stats[key];
+    if (stats.count == 0) {
+        stats.op = key.substr(0, n_op);
+        stats.type = key.substr(n_op + 1, n_type - n_op - 1);
+        stats.shape = key.substr(n_type + 1);
+    }
+
+    uint64_t bytes = lm_ggml_nbytes(node);
+    for (int i = 0; i < LM_GGML_MAX_SRC && node->src[i]; i++) {
+        bytes += lm_ggml_nbytes(node->src[i]);
+    }
+    const uint64_t n_out = (uint64_t)lm_ggml_nelements(node);
+    uint64_t flops = n_out;
+    if ((node->op == LM_GGML_OP_MUL_MAT || node->op == LM_GGML_OP_MUL_MAT_ID) && src0) {
+        flops = 2 * (uint64_t)src0->ne[0] * n_out;
+    } else if (node->op == LM_GGML_OP_FLASH_ATTN_EXT && src0 && src1) {
+        // QK^T and PV over every key of every head
+        flops = 4 * (uint64_t)src0->ne[0] * (uint64_t)src0->ne[1] * (uint64_t)src0->ne[2] * (uint64_t)src1->ne[1];
+    }
+
+    stats.count++;
+    stats.time_us += time_us;
+    stats.bytes += bytes;
+    stats.flops += flops;
+}
+
+std::vector<cactus_op_stats> cactus_context::opProfile() const {
+    std::vector<cactus_op_stats> rows;
+    rows.reserve(op_stats.size());
+    for (const auto &entry : op_stats) {
+        rows.push_back(entry.second);
+    }
+    std::sort(rows.begin(), rows.end(), [](const cactus_op_stats &a, const cactus_op_stats &b) {
+        return a.time_us > b.time_us;
+    });
+    return rows;
+}
+
+} // namespace cactus
@@ -0,0 +1,184 @@
+#include "cactus.h"
+#include "common.h"
+#include <algorithm>
+#include <vector>
+#include <string>
+#include "llama.h"
+
+namespace cactus {
+
+struct cactus_branch {
+    llama_seq_id seq_id = 0;
+    common_sampler *sampler = nullptr;
+    llama_token last = -1;
+    size_t n_past = 0;
+    int i_batch = -1;
+    bool active = true;
+    cactus_stop_matcher stop_matcher;
+};
+
+std::vector<cactus_completion_candidate> cactus_context::doCompletionN(int n) {
+    std::vector<cactus_completion_candidate> candidates;
+    if (n <= 0 || ctx == nullptr || embd.empty()) {
+        return candidates;
+    }
+
+    // The first branch continues the active sequence, the others fork into sequences no session holds
+    std::vector<llama_seq_id> branch_seqs = { seq_id };
+    for (llama_seq_id id : idleSequences(n - 1)) {
+        branch_seqs.push_back(id);
+    }
+    if ((int)branch_seqs.size() < n) {
+        LOG_WARNING("Only %zu of %d parallel sequences are free, generating that many candidates", branch_seqs.size(), n);
+        n = (int)branch_seqs.size();
+    }
+
+    discardPendingTokens();
+    is_predicting = true;
+
+    if (n_past == embd.size()) {
+        rollbackSequence(n_past - 1);
+    }
+
+    const std::vector<llama_seq_id> main_seq = { seq_id };
+    while (n_past < embd.size()) {
+        const size_t n_eval = std::min(embd.size() - n_past, (size_t)params.n_batch);
+        llama_batch_clear(&batch);
+        for (size_t i = 0; i < n_eval; i++) {
+            llama_batch_add(&batch, embd[n_past + i], n_past + i, main_seq, n_past + i + 1 == embd.size());
+        }
+        if (llama_decode(ctx, batch) != 0) {
+            throw std::runtime_error("Failed to evaluate prompt for parallel completion");
+        }
+        n_past += n_eval;
+        if (is_interrupted) {
+            is_predicting = false;
+            return candidates;
+        }
+    }
+    // the branches decode into this sequence too, a recurrent one comes back to the prompt from here
+    if (llama_model_is_recurrent(model)) {
+        llama_kv_self_seq_checkpoint(ctx, seq_id);
+    }
+
+    std::vector<cactus_branch> branches(n);
+    candidates.resize(n);
+    for (int i = 0; i < n; i++) {
+        cactus_branch &branch = branches[i];
+        branch.seq_id = branch_seqs[i];
+        branch.n_past = n_past;
+        if (branch.seq_id != seq_id) {
+            llama_kv_self_seq_rm(ctx, branch.seq_id, -1, -1);
+            llama_kv_self_seq_cp(ctx, seq_id, branch.seq_id, -1, -1);
+        }
+
+        common_params_sampling branch_sampling = params.sampling;
+        if (branch_sampling.seed != LLAMA_DEFAULT_SEED) {
+            branch_sampling.seed += i;
+        }
+        branch.sampler = common_sampler_init(model, branch_sampling);
+        if (branch.sampler == nullptr) {
+            for (auto &b : branches) {
+                if (b.sampler) common_sampler_free(b.sampler);
+            }
+            throw std::runtime_error("Failed to initialize sampler for parallel completion");
+        }
+        for (llama_token token : embd) {
+            common_sampler_accept(branch.sampler, token, false);
+        }
+        branch.stop_matcher.build(params.antiprompt);
+        branch.i_batch = -1;
+    }
+
+    const llama_vocab *vocab = llama_model_get_vocab(model);
+    int n_active = n;
+    int n_decoded = 0;
+
+    std::vector<common_sampler *> samplers;
+    std::vector<int> rows;
+    while (n_active > 0 && !is_interrupted) {
+        samplers.clear();
+        rows.clear();
+        for (const cactus_branch &branch : branches) {
+            if (branch.active) {
+                samplers.push_back(branch.sampler);
+                rows.push_back(branch.i_batch);
+            }
+        }
+        const std::vector<llama_token> sampled = common_sampler_sample_batch(samplers, ctx, rows, params.cpuparams.n_threads, shared_threadpool(params.cpuparams));
+        size_t n_sampled = 0;
+
+        for (int i = 0; i < n; i++) {
+            cactus_branch &branch = branches[i];
+            if (!branch.active) continue;
+
+            const llama_token token = sampled[n_sampled++];
+            common_sampler_accept(branch.sampler, token, true);
+
+            cactus_completion_candidate &candidate = candidates[i];
+            if (llama_vocab_is_eog(vocab, token)) {
+                candidate.stopped_eos = true;
+                branch.active = false;
+                n_active--;
+                continue;
+            }
+
+            const std::string &piece = cached_token_piece(vocab, token);
+            candidate.text += piece;
+            candidate.tokens.push_back(token);
+            branch.last = token;
+
+            const size_t stop_pos = branch.stop_matcher.feed(piece);
+            if (stop_pos != std::string::npos) {
+                candidate.text.erase(stop_pos);
+                candidate.stopping_word = branch.stop_matcher.matchedWord();
+                candidate.stopped_word = true;
+                branch.active = false;
+                n_active--;
+            } else if ((params.n_predict > 0 && (int)candidate.tokens.size() >= params.n_predict) ||
+                       branch.n_past + 1 >= (size_t)n_ctx) {
+                candidate.stopped_limit = true;
+                branch.active = false;
+                n_active--;
+            }
+        }
+        n_decoded++;
+
+        if (n_active == 0) {
+            break;
+        }
+
+        llama_batch_clear(&batch);
+        for (auto &branch : branches) {
+            if (!branch.active) continue;
+            llama_batch_add(&batch, branch.last, branch.n_past, { branch.seq_id }, true);
+            branch.i_batch = batch.n_tokens - 1;
+            branch.n_past++;
+        }
+
+        if (llama_decode(ctx, batch) != 0) {
+            LOG_ERROR("Failed to decode parallel batch, n_active: %d", n_active);
+            break;
+        }
+    }
+
+    for (auto &branch : branches) {
+        common_sampler_free(branch.sampler);
+        if (branch.seq_id != seq_id) {
+            llama_kv_self_seq_rm(ctx, branch.seq_id, -1, -1);
+        }
+    }
+    rollbackSequence(n_past);
+
+    num_tokens_predicted = 0;
+    for (const auto &candidate : candidates) {
+        num_tokens_predicted += candidate.tokens.size();
+    }
+    has_next_token = false;
+    is_predicting = false;
+
+    LOG_VERBOSE("parallel completion done, n: %d, steps: %d, tokens: %zu", n, n_decoded, num_tokens_predicted);
+    return candidates;
+}
+
+} // namespace cactus
@@ -0,0 +1,207 @@
+#include "cactus.h"
+#include "common.h"
+#include "llama.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace cactus {
+
+// A short context keeps the probe loads cheap; decode cost is dominated by the weights
+static const int32_t PLACEMENT_N_CTX = 256;
+static const int PLACEMENT_WARMUP = 2;
+static const int PLACEMENT_STEPS = 8;
+
+// Only the per-layer outputs are requested, so the scheduler computes one layer per range and
+// synchronizes the backend before the second call: consecutive timestamps bracket one layer
+struct layer_timer {
+    std::vector<int64_t> t_out;
+};
+
+static int layer_out_index(const struct lm_ggml_tensor *t) {
+    if (strncmp(t->name, "l_out-", 6) != 0) {
+        return -1;
+    }
+    return atoi(t->name + 6);
+}
+
+static bool layer_timer_callback(struct lm_ggml_tensor *t, bool ask, void *user_data) {
+    const int il = layer_out_index(t);
+    if (ask) {
+        return il >= 0;
+    }
+    layer_timer *timer = static_cast<layer_timer *>(user_data);
+    if (il >= 0 && il < (int)timer->t_out.size()) {
+        timer->t_out[il] = lm_ggml_time_us();
+    }
+    return true;
+}
+
+static double median(std::vector<double> values) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+    return values[values.size() / 2];
+}
+
+// Milliseconds per layer and for the output head of a single-token decode with n_gpu_layers
+// offloaded, scaled so they add up to an uninstrumented decode (no per-layer synchronization)
+static bool measure_layer_costs(const common_params &base, int32_t n_gpu_layers, int64_t n_layer,
+                                std::vector<double> &layer_ms, double &output_ms) {
+    common_params params = base;
+    params.n_gpu_layers = n_gpu_layers;
+    params.n_ctx = PLACEMENT_N_CTX;
+    params.n_parallel = 1;
+    params.cb_eval = nullptr;
+    params.cb_eval_user_data = nullptr;
+
+    llama_model *model = llama_model_load_from_file(params.model.path.c_str(), common_model_params_to_llama(params));
+    if (model == nullptr) {
+        LOG_ERROR("unable to load model for layer placement: %s", params.model.path.c_str());
+        return false;
+    }
+    llama_context *ctx = llama_init_from_model(model, common_context_params_to_llama(params));
+    if (ctx == nullptr) {
+        LOG_ERROR("unable to create context for layer placement, n_gpu_layers: %d", n_gpu_layers);
+        llama_model_free(model);
+        return false;
+    }
+
+    const llama_vocab *vocab = llama_model_get_vocab(model);
+    llama_token token = llama_vocab_bos(vocab);
+    if (token == LLAMA_TOKEN_NULL) {
+        token = 0;
+    }
+
+    layer_timer timer;
+    std::vector<std::vector<double>> layer_us(n_layer);
+    std::vector<double> output_us;
+    std::vector<double> timed_us;
+    std::vector<double> plain_us;
+    llama_batch batch = llama_batch_init(1, 0, 1);
+    bool ok = true;
+
+    for (int step = 0; ok && step < PLACEMENT_WARMUP + 2 * PLACEMENT_STEPS; step++) {
+        const bool timed = step >= PLACEMENT_WARMUP + PLACEMENT_STEPS;
+        if (step == PLACEMENT_WARMUP + PLACEMENT_STEPS) {
+            llama_set_eval_callback(ctx, layer_timer_callback, &timer);
+        }
+        timer.t_out.assign(n_layer, 0);
+
+        llama_batch_clear(&batch);
+        llama_batch_add(&batch, token, step, { 0 }, true);
+        const int64_t t_start = lm_ggml_time_us();
+        if (llama_decode(ctx, batch) != 0) {
+            LOG_ERROR("layer placement decode failed, n_gpu_layers: %d", n_gpu_layers);
+            ok = false;
+            break;
+        }
+        llama_synchronize(ctx);
+        const int64_t t_end = lm_ggml_time_us();
+
+        if (step < PLACEMENT_WARMUP) {
+            continue;
+        }
+        if (!timed) {
+            plain_us.push_back((double)(t_end - t_start));
+            continue;
+        }
+        int64_t t_prev = t_start;
+        for (int64_t il = 0; il < n_layer; il++) {
+            if (timer.t_out[il] == 0) {
+                LOG_ERROR("layer placement found no l_out node for layer %lld", (long long)il);
+                ok = false;
+                break;
+            }
+            layer_us[il].push_back((double)(timer.t_out[il] - t_prev));
+            t_prev = timer.t_out[il];
+        }
+        output_us.push_back((double)(t_end - t_prev));
+        timed_us.push_back((double)(t_end - t_start));
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+    llama_model_free(model);
+    if (!ok) {
+        return false;
+    }
+
+    const double instrumented = median(timed_us);
+    const double scale = instrumented > 0.0 ? median(plain_us) / instrumented : 1.0;
+    layer_ms.assign(n_layer, 0.0);
+    for (int64_t il = 0; il < n_layer; il++) {
+        layer_ms[il] = median(layer_us[il]) * scale / 1000.0;
+    }
+    output_ms = median(output_us) * scale / 1000.0;
+    return true;
+}
+
+bool plan_layer_placement(const common_params &params, size_t gpu_budget, bool keep_tied_output_on_cpu, cactus_layer_placement &out) {
+    out = cactus_layer_placement();
+    cactus_model_profile profile;
+    if (!read_model_profile(params.model.path, profile) || profile.n_layer <= 0) {
+        return false;
+    }
+    const int64_t n_layer = profile.n_layer;
+
+    if (!measure_layer_costs(params, 0, n_layer, out.cpu_layer_ms, out.cpu_output_ms)) {
+        return false;
+    }
+
+    lm_ggml_backend_dev_t gpu = lm_ggml_backend_dev_by_type(LM_GGML_BACKEND_DEVICE_TYPE_GPU);
+    common_params candidate = params;
+    int32_t n_fit = 0;
+    if (gpu != nullptr) {
+        if (gpu_budget == 0) {
+            size_t total = 0;
+            lm_ggml_backend_dev_memory(gpu, &gpu_budget, &total);
+        }
+        // The estimate only grows with n_gpu_layers; the largest split that fits is the one probed,
+        // which yields GPU costs for every layer a plan may offload
+        const bool head_gpu = !(keep_tied_output_on_cpu && profile.tied_output);
+        for (int32_t n = (int32_t)n_layer + (head_gpu ? 1 : 0); n > 0; n--) {
+            candidate.n_gpu_layers = n;
+            if (estimate_memory(profile, candidate).gpu() <= gpu_budget) {
+                n_fit = n;
+                break;
+            }
+        }
+    }
+    if (n_fit > 0 && !measure_layer_costs(params, n_fit, n_layer, out.gpu_layer_ms, out.gpu_output_ms)) {
+        LOG_WARNING("GPU layer costs unavailable, keeping every layer on the CPU", "");
+        out.gpu_layer_ms.clear();
+        out.gpu_output_ms = 0.0;
+        n_fit = 0;
+    } else if (n_fit > 0) {
+        // whatever the probe ran on the CPU is not a GPU cost
+        std::fill(out.gpu_layer_ms.begin(), out.gpu_layer_ms.end() - std::min<int64_t>(n_fit, n_layer), 0.0);
+        if (n_fit <= n_layer) {
+            out.gpu_output_ms = 0.0;
+        }
+    }
+
+    for (int32_t n = 0; n <= n_fit; n++) {
+        const bool output_gpu = n > n_layer;
+        const int64_t first_gpu_layer = n_layer - std::min<int64_t>(n, n_layer);
+        double decode_ms = output_gpu ? out.gpu_output_ms : out.cpu_output_ms;
+        for (int64_t il = 0; il < n_layer; il++) {
+            decode_ms += il >= first_gpu_layer ? out.gpu_layer_ms[il] : out.cpu_layer_ms[il];
+        }
+        if (n == 0 || decode_ms < out.decode_ms) {
+            candidate.n_gpu_layers = n;
+            out.n_gpu_layers = n;
+            out.decode_ms = decode_ms;
+            out.gpu_bytes = estimate_memory(profile, candidate).gpu();
+        }
+    }
+
+    LOG_INFO("layer placement: %d of %lld layers on the GPU, output head on the %s, decode %.2f ms predicted, GPU estimate %zu MiB",
+        std::min<int32_t>(out.n_gpu_layers, (int32_t)n_layer), (long long)n_layer, out.n_gpu_layers > n_layer ? "GPU" : "CPU",
+        out.decode_ms, out.gpu_bytes >> 20);
+    return true;
+}
+
+} // namespace cactus
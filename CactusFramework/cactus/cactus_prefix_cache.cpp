@@ -0,0 +1,363 @@
+#include "cactus.h"
+#include <algorithm>
+
+namespace cactus {
+
+// Shorter prompts are cheaper to evaluate again than to keep a sequence for
+static const size_t PREFIX_CACHE_MIN_TOKENS = 32;
+
+void cactus_prefix_cache::reset(llama_seq_id first_seq_, int32_t n_seqs_, size_t capacity_tokens_) {
+    first_seq = first_seq_;
+    n_seqs = n_seqs_;
+    capacity_tokens = capacity_tokens_;
+    entries.assign(n_seqs, entry());
+    n_hits = 0;
+    n_misses = 0;
+    n_reused = 0;
+    clear();
+}
+
+void cactus_prefix_cache::clear() {
+    nodes.assign(1, node());
+    free_nodes.clear();
+    for (auto &e : entries) {
+        e = entry();
+    }
+    n_tokens = 0;
+}
+
+int32_t cactus_prefix_cache::newNode(int32_t parent, std::vector<llama_token> label) {
+    int32_t index;
+    if (!free_nodes.empty()) {
+        index = free_nodes.back();
+        free_nodes.pop_back();
+    } else {
+        index = (int32_t)nodes.size();
+        nodes.emplace_back();
+    }
+    nodes[index].parent = parent;
+    nodes[index].label = std::move(label);
+    return index;
+}
+
+void cactus_prefix_cache::freeNode(int32_t index) {
+    nodes[index] = node();
+    free_nodes.push_back(index);
+}
+
+size_t cactus_prefix_cache::walk(const llama_token *tokens, size_t n, int32_t &at, size_t &in_label) const {
+    at = 0;
+    in_label = 0;
+    size_t depth = 0;
+    while (depth < n && !nodes.empty()) {
+        auto it = nodes[at].children.find(tokens[depth]);
+        if (it == nodes[at].children.end()) {
+            break;
+        }
+        const std::vector<llama_token> &label = nodes[it->second].label;
+        size_t k = 0;
+        while (k < label.size() && depth + k < n && label[k] == tokens[depth + k]) {
+            k++;
+        }
+        at = it->second;
+        in_label = k;
+        depth += k;
+        if (k < label.size()) {
+            break;
+        }
+    }
+    return depth;
+}
+
+// Every leaf ends an entry, so any subtree holds one
+llama_seq_id cactus_prefix_cache::newestBelow(int32_t index) const {
+    llama_seq_id best = -1;
+    std::vector<int32_t> stack = { index };
+    while (!stack.empty()) {
+        const int32_t i = stack.back();
+        stack.pop_back();
+        const llama_seq_id seq = nodes[i].seq;
+        if (seq >= 0 && (best < 0 || entries[seq - first_seq].last_used > entries[best - first_seq].last_used)) {
+            best = seq;
+        }
+        for (const auto &child : nodes[i].children) {
+            stack.push_back(child.second);
+        }
+    }
+    return best;
+}
+
+size_t cactus_prefix_cache::match(const std::vector<llama_token> &tokens, llama_seq_id &seq) {
+    seq = -1;
+    if (!enabled() || tokens.empty()) {
+        return 0;
+    }
+    int32_t at = 0;
+    size_t in_label = 0;
+    const size_t depth = walk(tokens.data(), tokens.size(), at, in_label);
+    if (depth == 0) {
+        return 0;
+    }
+    seq = newestBelow(at);
+    if (seq < 0) {
+        return 0;
+    }
+    entries[seq - first_seq].last_used = ++tick;
+    return depth;
+}
+
+llama_seq_id cactus_prefix_cache::insert(const llama_token *tokens, size_t n, std::vector<llama_seq_id> &cleared) {
+    if (!enabled() || n == 0 || n > capacity_tokens) {
+        return -1;
+    }
+    int32_t at = 0;
+    size_t in_label = 0;
+    size_t depth = walk(tokens, n, at, in_label);
+    if (depth == n) {
+        const llama_seq_id holder = newestBelow(at);
+        if (holder >= 0) {
+            entries[holder - first_seq].last_used = ++tick;
+        }
+        return -1;
+    }
+
+    // An entry that is a prefix of the new one is superseded by it
+    if (at != 0 && in_label == nodes[at].label.size() && nodes[at].seq >= 0) {
+        const llama_seq_id superseded = nodes[at].seq;
+        erase(superseded);
+        cleared.push_back(superseded);
+    }
+
+    llama_seq_id seq = -1;
+    while (true) {
+        depth = walk(tokens, n, at, in_label);
+        seq = -1;
+        for (int32_t i = 0; i < n_seqs && seq < 0; i++) {
+            if (entries[i].node < 0) {
+                seq = first_seq + i;
+            }
+        }
+        if (seq >= 0 && n_tokens + (n - depth) <= capacity_tokens) {
+            break;
+        }
+        const llama_seq_id evicted = evictOldest();
+        if (evicted < 0) {
+            return -1;
+        }
+        cleared.push_back(evicted);
+    }
+
+    if (at != 0 && in_label < nodes[at].label.size()) {
+        // Split the edge where the new tokens leave it
+        const int32_t parent = nodes[at].parent;
+        std::vector<llama_token> head(nodes[at].label.begin(), nodes[at].label.begin() + in_label);
+        const int32_t mid = newNode(parent, std::move(head));
+        nodes[at].label.erase(nodes[at].label.begin(), nodes[at].label.begin() + in_label);
+        nodes[at].parent = mid;
+        nodes[mid].children[nodes[at].label[0]] = at;
+        nodes[parent].children[nodes[mid].label[0]] = mid;
+        at = mid;
+    }
+    const int32_t leaf = newNode(at, std::vector<llama_token>(tokens + depth, tokens + n));
+    nodes[at].children[tokens[depth]] = leaf;
+    n_tokens += n - depth;
+
+    nodes[leaf].seq = seq;
+    entries[seq - first_seq].node = leaf;
+    entries[seq - first_seq].last_used = ++tick;
+    return seq;
+}
+
+void cactus_prefix_cache::erase(llama_seq_id seq) {
+    if (!owns(seq) || entries[seq - first_seq].node < 0) {
+        return;
+    }
+    int32_t at = entries[seq - first_seq].node;
+    entries[seq - first_seq] = entry();
+    nodes[at].seq = -1;
+
+    // Drop the branch that only led to this entry, then fold a node left with a single child into it
+    while (at != 0 && nodes[at].seq < 0 && nodes[at].children.empty()) {
+        const int32_t parent = nodes[at].parent;
+        nodes[parent].children.erase(nodes[at].label[0]);
+        n_tokens -= nodes[at].label.size();
+        freeNode(at);
+        at = parent;
+    }
+    if (at != 0 && nodes[at].seq < 0 && nodes[at].children.size() == 1) {
+        const int32_t child = nodes[at].children.begin()->second;
+        nodes[at].label.insert(nodes[at].label.end(), nodes[child].label.begin(), nodes[child].label.end());
+        nodes[at].children = std::move(nodes[child].children);
+        for (const auto &grandchild : nodes[at].children) {
+            nodes[grandchild.second].parent = at;
+        }
+        nodes[at].seq = nodes[child].seq;
+        if (nodes[at].seq >= 0) {
+            entries[nodes[at].seq - first_seq].node = at;
+        }
+        freeNode(child);
+    }
+}
+
+llama_seq_id cactus_prefix_cache::evictOldest() {
+    int32_t oldest = -1;
+    for (int32_t i = 0; i < n_seqs; i++) {
+        if (entries[i].node >= 0 && (oldest < 0 || entries[i].last_used < entries[oldest].last_used)) {
+            oldest = i;
+        }
+    }
+    if (oldest < 0) {
+        return -1;
+    }
+    erase(first_seq + oldest);
+    return first_seq + oldest;
+}
+
+void cactus_prefix_cache::share(llama_seq_id seq, llama_pos end) {
+    if (seq < 0 || owns(seq)) {
+        return;
+    }
+    if ((size_t)seq >= shared_end.size()) {
+        shared_end.resize(seq + 1, 0);
+    }
+    shared_end[seq] = std::max(shared_end[seq], end);
+}
+
+bool cactus_prefix_cache::shares(llama_seq_id seq, llama_pos p0) const {
+    return seq >= 0 && (size_t)seq < shared_end.size() && shared_end[seq] > std::max<llama_pos>(p0, 0);
+}
+
+void cactus_prefix_cache::unshare(llama_seq_id seq) {
+    if (seq >= 0 && (size_t)seq < shared_end.size()) {
+        shared_end[seq] = 0;
+    }
+}
+
+bool cactus_context::setPrefixCache(int32_t n_seqs, size_t capacity_tokens) {
+    if (ctx == nullptr) {
+        return false;
+    }
+    const int32_t n_seq_max = (int32_t)llama_n_seq_max(ctx);
+    if (n_seqs < 0 || n_seqs >= n_seq_max) {
+        LOG_ERROR("Prefix cache needs fewer than the context's %d sequences", n_seq_max);
+        return false;
+    }
+    const llama_seq_id first_seq = n_seq_max - n_seqs;
+    bool in_use = n_seqs > 0 && seq_id >= first_seq;
+    for (const auto &state : sequence_states) {
+        in_use = in_use || (n_seqs > 0 && state.first >= first_seq);
+    }
+    if (in_use) {
+        LOG_ERROR("Sequences from %d on are in use and cannot hold the prefix cache", first_seq);
+        return false;
+    }
+    clearPrefixCache();
+    prefix_cache.reset(first_seq, n_seqs, capacity_tokens > 0 ? capacity_tokens : (size_t)n_ctx / 2);
+    return true;
+}
+
+int32_t cactus_context::sessionSequences() const {
+    return (int32_t)llama_n_seq_max(ctx) - prefix_cache.n_seqs;
+}
+
+// The cache is keyed on tokens alone, so it only holds and serves KV computed on the bare weights
+static bool adapters_active(const cactus_context &context) {
+    return !context.lora.empty() || context.lora_merge != nullptr || context.seq_lora.count(context.seq_id) > 0;
+}
+
+// Forks the longest cached prefix of prompt_tokens onto the active sequence past its own n_reuse
+// tokens, and marks the prompt to be cached once it is evaluated
+size_t cactus_context::reusePrefixCache(const std::vector<llama_token> &prompt_tokens, size_t n_reuse) {
+    prefix_cache_pending = false;
+    if (!prefix_cache.enabled() || stream_cut > 0 || prompt_tokens.size() < 2 || adapters_active(*this)) {
+        return n_reuse;
+    }
+    prefix_cache_pending = true;
+
+    llama_seq_id source = -1;
+    const size_t n_cached = std::min(prefix_cache.match(prompt_tokens, source), prompt_tokens.size() - 1);
+    if (n_cached <= n_reuse) {
+        if (n_cached == 0) {
+            prefix_cache.n_misses++;
+        }
+        return n_reuse;
+    }
+
+    llama_kv_self_seq_rm(ctx, seq_id, n_reuse, -1);
+    llama_kv_self_seq_cp(ctx, source, seq_id, n_reuse, n_cached);
+    prefix_cache.share(seq_id, (llama_pos)n_cached);
+    prefix_cache.n_hits++;
+    prefix_cache.n_reused += n_cached - n_reuse;
+    LOG_VERBOSE("prefix cache forked %zu tokens from sequence %d", n_cached - n_reuse, source);
+    return n_cached;
+}
+
+void cactus_context::storePrefixCache() {
+    if (!prefix_cache_pending) {
+        return;
+    }
+    prefix_cache_pending = false;
+    const size_t n_tokens = std::min(n_past, embd.size());
+    if (n_tokens < PREFIX_CACHE_MIN_TOKENS || stream_cut > 0 || !mtmd_past_chunks.empty() || adapters_active(*this)) {
+        return;
+    }
+
+    std::vector<llama_seq_id> cleared;
+    const llama_seq_id seq = prefix_cache.insert(embd.data(), n_tokens, cleared);
+    for (llama_seq_id id : cleared) {
+        llama_kv_self_seq_rm(ctx, id, -1, -1);
+    }
+    if (seq < 0) {
+        return;
+    }
+    llama_kv_self_seq_cp(ctx, seq_id, seq, 0, (llama_pos)n_tokens);
+    prefix_cache.share(seq_id, (llama_pos)n_tokens);
+    LOG_VERBOSE("prefix cache stored %zu tokens in sequence %d", n_tokens, seq);
+}
+
+bool cactus_context::evictPrefixCache() {
+    const llama_seq_id seq = prefix_cache.evictOldest();
+    if (seq < 0) {
+        return false;
+    }
+    llama_kv_self_seq_rm(ctx, seq, -1, -1);
+    LOG_VERBOSE("prefix cache evicted sequence %d to free KV cells", seq);
+    return true;
+}
+
+void cactus_context::clearPrefixCache() {
+    if (ctx != nullptr) {
+        for (int32_t i = 0; i < prefix_cache.n_seqs; i++) {
+            llama_kv_self_seq_rm(ctx, prefix_cache.first_seq + i, -1, -1);
+        }
+    }
+    prefix_cache.clear();
+}
+
+bool cactus_context::unsharePrefixCells(llama_pos p0) {
+    if (!prefix_cache.shares(seq_id, p0) || llama_kv_self_seq_pos_max(ctx, seq_id) < p0) {
+        return true;
+    }
+    std::vector<uint8_t> state(llama_state_seq_get_size(ctx, seq_id));
+    state.resize(llama_state_seq_get_data(ctx, state.data(), state.size(), seq_id));
+
+    // Restoring removes the sequence first; only the cells it shared stay taken by the other holders
+    bool ok = !state.empty() && llama_state_seq_set_data(ctx, state.data(), state.size(), seq_id) != 0;
+    if (!ok && !state.empty()) {
+        LOG_WARNING("Dropping the prefix cache to copy the cells of sequence %d", seq_id);
+        clearPrefixCache();
+        ok = llama_state_seq_set_data(ctx, state.data(), state.size(), seq_id) != 0;
+    }
+    if (!ok) {
+        LOG_ERROR("Failed to copy the shared cells of sequence %d, evaluating it again", seq_id);
+        llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+        n_past = 0;
+        mtmd_past_chunks.clear();
+    } else {
+        LOG_VERBOSE("sequence %d no longer shares cells with the prefix cache", seq_id);
+    }
+    prefix_cache.unshare(seq_id);
+    return ok;
+}
+
+} // namespace cactus
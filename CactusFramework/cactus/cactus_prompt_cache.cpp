@@ -0,0 +1,221 @@
+#include "cactus.h"
+#include "common.h"
+#include <cstring>
+#include <fstream>
+#include <vector>
+#include <string>
+#include "llama.h"
+
+namespace cactus {
+
+static uint64_t fnv_hash64(const std::string &data) {
+    const uint64_t fnv_prime = 0x100000001b3ULL;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= fnv_prime;
+    }
+    return hash;
+}
+
+// KV state is only portable between contexts with the same weights and cache layout
+uint64_t cactus_context::stateIdentity() const {
+    char desc[256];
+    llama_model_desc(model, desc, sizeof(desc));
+
+    std::string identity = params.model.path;
+    identity += "|";
+    identity += desc;
+    identity += "|" + std::to_string(llama_model_n_params(model));
+    identity += "|" + std::to_string(llama_model_size(model));
+    identity += "|" + std::to_string(params.cache_type_k);
+    identity += "|" + std::to_string(params.cache_type_v);
+    identity += "|" + std::to_string(params.flash_attn);
+    identity += "|" + std::to_string(params.cache_n_recent > 0);
+    return fnv_hash64(identity);
+}
+
+std::string cactus_context::promptCacheFile() const {
+    if (params.path_prompt_cache.empty() || model == nullptr) {
+        return "";
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "cactus-prompt-%016llx.bin", (unsigned long long)stateIdentity());
+
+    std::string dir = params.path_prompt_cache;
+    if (dir.back() != '/') {
+        dir += '/';
+    }
+    return dir + name;
+}
+
+size_t cactus_context::restorePromptCache(const std::vector<llama_token> &prompt_tokens) {
+    prompt_cache_pending = false;
+    const std::string path = promptCacheFile();
+    if (path.empty() || prompt_tokens.empty()) {
+        return 0;
+    }
+
+    prompt_cache_pending = !params.prompt_cache_ro;
+
+    std::ifstream probe(path, std::ios::binary);
+    if (!probe.good()) {
+        return 0;
+    }
+    probe.close();
+
+    std::vector<llama_token> cached_tokens(n_ctx);
+    size_t n_cached = 0;
+    if (llama_state_seq_load_file(ctx, path.c_str(), seq_id, cached_tokens.data(), cached_tokens.size(), &n_cached) == 0) {
+        LOG_WARNING("Failed to load prompt cache: %s", path.c_str());
+        llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+        return 0;
+    }
+    cached_tokens.resize(n_cached);
+
+    size_t n_reuse = common_part(cached_tokens, prompt_tokens);
+    if (n_reuse == prompt_tokens.size()) {
+        n_reuse--;
+    }
+    llama_kv_self_seq_rm(ctx, seq_id, n_reuse, -1);
+
+    prompt_cache_pending = prompt_cache_pending && n_reuse < n_cached;
+
+    LOG_INFO("Prompt cache restored %zu of %zu cached tokens", n_reuse, n_cached);
+    return n_reuse;
+}
+
+bool cactus_context::savePromptCache() {
+    prompt_cache_pending = false;
+    const std::string path = promptCacheFile();
+    if (path.empty() || n_past == 0) {
+        return false;
+    }
+
+    const size_t n_tokens = std::min(n_past, embd.size());
+    if (llama_state_seq_save_file(ctx, path.c_str(), seq_id, embd.data(), n_tokens) == 0) {
+        LOG_WARNING("Failed to save prompt cache: %s", path.c_str());
+        return false;
+    }
+
+    LOG_VERBOSE("Prompt cache saved, n_tokens: %zu, path: %s", n_tokens, path.c_str());
+    return true;
+}
+
+static const uint32_t SNAPSHOT_MAGIC = 0x504e5343; // "CSNP"
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t identity;
+    uint64_t n_tokens;
+    uint64_t n_past;
+    uint64_t stream_cut;
+    uint64_t stream_hash;
+    uint64_t state_size;
+};
+
+// Header, token history and llama_state_seq data of one sequence. Sampler state is not stored:
+// every completion re-creates the sampler and replays the token history into it.
+bool cactus_context::saveSequenceSnapshot(llama_seq_id id, std::vector<uint8_t> &out) {
+    if (ctx == nullptr || model == nullptr) {
+        return false;
+    }
+    const bool active = id == seq_id;
+    auto it = sequence_states.find(id);
+    if (!active && it == sequence_states.end()) {
+        return false;
+    }
+    if (!active && it->second.spilled) {
+        unspillSequence(id);
+    }
+    const std::vector<llama_token> &tokens = active ? embd : it->second.embd;
+    const size_t n_cached = std::min(active ? n_past : it->second.n_past, tokens.size());
+
+    snapshot_header header = {};
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.identity = stateIdentity();
+    header.n_tokens = n_cached;
+    header.n_past = n_cached;
+    header.stream_cut = active ? stream_cut : it->second.stream_cut;
+    header.stream_hash = active ? stream_hash : it->second.stream_hash;
+    header.state_size = llama_state_seq_get_size(ctx, id);
+
+    const size_t tokens_size = n_cached * sizeof(llama_token);
+    out.resize(sizeof(header) + tokens_size + header.state_size);
+    uint8_t *state = out.data() + sizeof(header) + tokens_size;
+    const size_t n_written = llama_state_seq_get_data(ctx, state, header.state_size, id);
+    if (n_written == 0) {
+        LOG_WARNING("failed to read KV state of sequence %d", id);
+        out.clear();
+        return false;
+    }
+    header.state_size = n_written;
+    out.resize(sizeof(header) + tokens_size + n_written);
+    memcpy(out.data(), &header, sizeof(header));
+    memcpy(out.data() + sizeof(header), tokens.data(), tokens_size);
+
+    LOG_VERBOSE("sequence %d snapshot, n_tokens: %zu, state: %zu bytes", id, n_cached, n_written);
+    return true;
+}
+
+bool cactus_context::restoreSequenceSnapshot(llama_seq_id id, const uint8_t *data, size_t size) {
+    if (ctx == nullptr || is_predicting || id < 0 || id >= sessionSequences()) {
+        return false;
+    }
+    snapshot_header header;
+    if (data == nullptr || size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION) {
+        LOG_WARNING("unsupported session snapshot", "");
+        return false;
+    }
+    if (header.identity != stateIdentity()) {
+        LOG_WARNING("session snapshot was taken with a different model or cache layout", "");
+        return false;
+    }
+    const size_t tokens_size = header.n_tokens * sizeof(llama_token);
+    if (header.n_tokens >= (uint64_t)n_ctx || sizeof(header) + tokens_size + header.state_size > size) {
+        LOG_WARNING("truncated session snapshot", "");
+        return false;
+    }
+
+    if (id == seq_id) {
+        discardPendingTokens();
+    }
+    dropSpill(id);
+    llama_kv_self_seq_rm(ctx, id, -1, -1);
+    const uint8_t *state = data + sizeof(header) + tokens_size;
+    if (llama_state_seq_set_data(ctx, state, header.state_size, id) == 0) {
+        LOG_WARNING("failed to restore KV state of sequence %d", id);
+        llama_kv_self_seq_rm(ctx, id, -1, -1);
+        return false;
+    }
+
+    const llama_token *ids = (const llama_token *)(data + sizeof(header));
+    cactus_sequence_state restored;
+    restored.embd.assign(ids, ids + header.n_tokens);
+    restored.n_past = header.n_past;
+    restored.stream_cut = header.stream_cut;
+    restored.stream_hash = header.stream_hash;
+    if (id == seq_id) {
+        embd = std::move(restored.embd);
+        n_past = restored.n_past;
+        stream_cut = restored.stream_cut;
+        stream_hash = restored.stream_hash;
+        mtmd_bitmap_past_hashes.clear();
+        mtmd_past_chunks.clear();
+    } else {
+        sequence_states[id] = std::move(restored);
+    }
+    LOG_INFO("restored sequence %d from snapshot, n_tokens: %llu", id, (unsigned long long)header.n_tokens);
+    return true;
+}
+
+} // namespace cactus
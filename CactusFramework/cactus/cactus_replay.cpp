@@ -0,0 +1,336 @@
+#include "cactus.h"
+#include "common.h"
+#include "llama.h"
+#include "json.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+
+namespace cactus {
+
+using json = nlohmann::json;
+
+static double percentile(std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    const size_t rank = (size_t)std::ceil(p * sorted.size());
+    return sorted[std::min(sorted.size(), std::max<size_t>(1, rank)) - 1];
+}
+
+static uint64_t splitmix64(uint64_t &state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void cactus_context::setRequestRecording(bool enabled, bool hash_prompts) {
+    recording_requests = enabled;
+    recording_hashed = hash_prompts;
+    recording_open = false;
+    if (enabled) {
+        request_records.clear();
+        recorded_prompts.clear();
+        recording_start_us = llama_time_us();
+    }
+}
+
+void cactus_context::recordRequest(const std::vector<std::string> &media_paths) {
+    if (request_records.size() >= request_record_limit) {
+        return;
+    }
+    cactus_request_record record;
+    record.t_offset_us = llama_time_us() - recording_start_us;
+    record.seq_id = seq_id;
+    record.n_prompt_tokens = embd.size();
+    record.sampling = params.sampling;
+    record.antiprompt = params.antiprompt;
+    record.n_predict = params.n_predict;
+
+    // media positions hold no token id
+    const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    for (llama_token token : embd) {
+        if (token < 0 || token >= n_vocab) {
+            record.n_media_tokens++;
+        }
+    }
+    for (const std::string &path : media_paths) {
+        struct stat st;
+        record.media_bytes.push_back(stat(path.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0);
+    }
+
+    std::vector<llama_token> &previous = recorded_prompts[seq_id];
+    record.n_shared_prefix = common_part(previous, embd);
+    if (recording_hashed) {
+        record.prompt_hash = content_hash64(embd.data(), embd.size() * sizeof(llama_token));
+    } else {
+        record.prompt_tokens = embd;
+    }
+    previous = embd;
+
+    request_records.push_back(std::move(record));
+    recording_open = true;
+}
+
+// Hashed prompts replay as the prefix the replayed sequence shares with the recorded one, then
+// ordinary tokens derived from the hash; media positions get the same stand-ins
+static std::vector<llama_token> replay_prompt(const cactus_request_record &record, const std::vector<llama_token> &previous,
+                                              const llama_vocab *vocab) {
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    std::vector<llama_token> tokens = record.prompt_tokens;
+    if (tokens.empty()) {
+        const size_t n_kept = std::min(record.n_shared_prefix, previous.size());
+        tokens.assign(previous.begin(), previous.begin() + n_kept);
+        tokens.resize(std::max(record.n_prompt_tokens, n_kept), LLAMA_TOKEN_NULL);
+    }
+    uint64_t state = record.prompt_hash;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        if (tokens[i] >= 0 && tokens[i] < n_vocab) {
+            continue;
+        }
+        llama_token token;
+        do {
+            token = (llama_token)(splitmix64(state) % (uint64_t)n_vocab);
+        } while (llama_vocab_is_control(vocab, token) || llama_vocab_is_eog(vocab, token));
+        tokens[i] = token;
+    }
+    return tokens;
+}
+
+bool cactus_context::replayRequests(const std::vector<cactus_request_record> &records, bool honor_timing,
+                                    cactus_replay_result &result) {
+    if (is_predicting) {
+        LOG_ERROR("cannot replay requests while predicting", "");
+        return false;
+    }
+    if (!ctx || !model || records.empty()) {
+        LOG_ERROR("Context, model or requests missing for replay.");
+        return false;
+    }
+
+    result = cactus_replay_result();
+    const llama_vocab *vocab = llama_model_get_vocab(model);
+    const common_params_sampling saved_sampling = params.sampling;
+    const std::vector<std::string> saved_antiprompt = params.antiprompt;
+    const int32_t saved_n_predict = params.n_predict;
+    const llama_seq_id saved_seq = seq_id;
+    const bool saved_recording = recording_requests;
+    const std::function<bool()> hook = abort_hook;
+    recording_requests = false;
+
+    std::unordered_map<llama_seq_id, std::vector<llama_token>> replayed;
+    std::vector<double> ttft;
+    std::vector<double> itl;
+    ttft.reserve(records.size());
+    bool ok = true;
+
+    const int64_t t_replay = llama_time_us();
+    for (const cactus_request_record &record : records) {
+        if (is_interrupted) {
+            break;
+        }
+        if (honor_timing) {
+            const int64_t wait_us = t_replay + record.t_offset_us - llama_time_us();
+            if (wait_us > 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(wait_us));
+            }
+        }
+        const llama_seq_id seq = record.seq_id >= 0 && record.seq_id < sessionSequences() ? record.seq_id : 0;
+        if (!setActiveSequence(seq)) {
+            ok = false;
+            break;
+        }
+        std::vector<llama_token> &previous = replayed[seq];
+        std::vector<llama_token> tokens = replay_prompt(record, previous, vocab);
+        previous = tokens;
+
+        // the recorded length is reproduced whatever the new build samples; a record that generated
+        // nothing without a limit only replays its prompt, since ignore_eos would run it to n_ctx
+        params.sampling = record.sampling;
+        params.sampling.ignore_eos = true;
+        params.antiprompt.clear();
+        params.n_predict = record.n_generated > 0 ? (int32_t)record.n_generated : record.n_predict;
+        const bool prompt_only = params.n_predict < 0;
+
+        const int64_t t_start = llama_time_us();
+        if (!initSampling()) {
+            LOG_ERROR("failed to initialize sampling for request replay", "");
+            ok = false;
+            break;
+        }
+        beginCompletion();
+        setAbortHook(hook);
+        pretokenized_prompt = std::move(tokens);
+        loadPromptReusingPrefix();
+
+        int64_t t_last = 0;
+        while (!prompt_only && has_next_token && !is_interrupted) {
+            const completion_token_output token = doCompletion();
+            if (token.tok == -1) {
+                break;
+            }
+            const int64_t t_now = llama_time_us();
+            if (t_last == 0) {
+                ttft.push_back((t_now - t_start) / 1000.0);
+            } else {
+                itl.push_back((t_now - t_last) / 1000.0);
+            }
+            t_last = t_now;
+            result.n_tokens++;
+        }
+        result.n_prompt_tokens += num_prompt_tokens;
+        endCompletion();
+        setAbortHook(hook);
+        result.n_requests++;
+    }
+    result.total_us = llama_time_us() - t_replay;
+    setAbortHook(nullptr);
+
+    params.sampling = saved_sampling;
+    params.antiprompt = saved_antiprompt;
+    params.n_predict = saved_n_predict;
+    recording_requests = saved_recording;
+    setActiveSequence(saved_seq);
+
+    auto summarize = [](std::vector<double> &values, double &mean, double &p50, double &p90, double &p99) {
+        std::sort(values.begin(), values.end());
+        double sum = 0.0;
+        for (double v : values) {
+            sum += v;
+        }
+        mean = values.empty() ? 0.0 : sum / values.size();
+        p50 = percentile(values, 0.50);
+        p90 = percentile(values, 0.90);
+        p99 = percentile(values, 0.99);
+    };
+    summarize(ttft, result.ttft_mean_ms, result.ttft_p50_ms, result.ttft_p90_ms, result.ttft_p99_ms);
+    summarize(itl, result.itl_mean_ms, result.itl_p50_ms, result.itl_p90_ms, result.itl_p99_ms);
+
+    LOG_INFO("Replayed %zu requests: ttft p50 %.1f ms p99 %.1f ms, itl p50 %.2f ms p99 %.2f ms",
+        result.n_requests, result.ttft_p50_ms, result.ttft_p99_ms, result.itl_p50_ms, result.itl_p99_ms);
+    return ok && result.n_requests > 0;
+}
+
+std::string request_trace_json(const std::vector<cactus_request_record> &records) {
+    json out = json::array();
+    for (const cactus_request_record &record : records) {
+        const common_params_sampling &s = record.sampling;
+        json triggers = json::array();
+        for (const common_grammar_trigger &trigger : s.grammar_triggers) {
+            triggers.push_back({{"type", (int)trigger.type}, {"value", trigger.value}, {"token", trigger.token}});
+        }
+        json entry = {
+            {"t_offset_us", record.t_offset_us},
+            {"seq_id", record.seq_id},
+            {"n_prompt_tokens", record.n_prompt_tokens},
+            {"n_shared_prefix", record.n_shared_prefix},
+            {"n_media_tokens", record.n_media_tokens},
+            {"media_bytes", record.media_bytes},
+            {"n_predict", record.n_predict},
+            {"n_generated", record.n_generated},
+            {"duration_us", record.duration_us},
+            {"antiprompt", record.antiprompt},
+            {"sampling", {
+                {"seed", s.seed},
+                {"temp", s.temp},
+                {"top_k", s.top_k},
+                {"top_p", s.top_p},
+                {"min_p", s.min_p},
+                {"penalty_last_n", s.penalty_last_n},
+                {"penalty_repeat", s.penalty_repeat},
+                {"penalty_freq", s.penalty_freq},
+                {"penalty_present", s.penalty_present},
+                {"mirostat", s.mirostat},
+                {"mirostat_tau", s.mirostat_tau},
+                {"mirostat_eta", s.mirostat_eta},
+                {"grammar", s.grammar},
+                {"grammar_lazy", s.grammar_lazy},
+                {"grammar_triggers", triggers}
+            }}
+        };
+        if (record.prompt_tokens.empty()) {
+            entry["prompt_hash"] = record.prompt_hash;
+        } else {
+            entry["prompt_tokens"] = record.prompt_tokens;
+        }
+        out.push_back(std::move(entry));
+    }
+    return out.dump();
+}
+
+bool parse_request_trace(const std::string &text, const common_params_sampling &base, std::vector<cactus_request_record> &records) {
+    records.clear();
+    try {
+        const json trace = json::parse(text);
+        if (!trace.is_array()) {
+            return false;
+        }
+        for (const json &entry : trace) {
+            cactus_request_record record;
+            record.t_offset_us = entry.value("t_offset_us", (int64_t)0);
+            record.seq_id = entry.value("seq_id", 0);
+            record.prompt_tokens = entry.value("prompt_tokens", std::vector<llama_token>());
+            record.n_prompt_tokens = entry.value("n_prompt_tokens", record.prompt_tokens.size());
+            record.n_shared_prefix = entry.value("n_shared_prefix", (size_t)0);
+            record.prompt_hash = entry.value("prompt_hash", (uint64_t)0);
+            record.n_media_tokens = entry.value("n_media_tokens", (size_t)0);
+            record.media_bytes = entry.value("media_bytes", std::vector<uint64_t>());
+            record.n_predict = entry.value("n_predict", -1);
+            record.n_generated = entry.value("n_generated", (size_t)0);
+            record.duration_us = entry.value("duration_us", (int64_t)0);
+            record.antiprompt = entry.value("antiprompt", std::vector<std::string>());
+
+            common_params_sampling &s = record.sampling;
+            s = base;
+            const json sampling = entry.value("sampling", json::object());
+            s.seed = sampling.value("seed", s.seed);
+            s.temp = sampling.value("temp", s.temp);
+            s.top_k = sampling.value("top_k", s.top_k);
+            s.top_p = sampling.value("top_p", s.top_p);
+            s.min_p = sampling.value("min_p", s.min_p);
+            s.penalty_last_n = sampling.value("penalty_last_n", s.penalty_last_n);
+            s.penalty_repeat = sampling.value("penalty_repeat", s.penalty_repeat);
+            s.penalty_freq = sampling.value("penalty_freq", s.penalty_freq);
+            s.penalty_present = sampling.value("penalty_present", s.penalty_present);
+            s.mirostat = sampling.value("mirostat", s.mirostat);
+            s.mirostat_tau = sampling.value("mirostat_tau", s.mirostat_tau);
+            s.mirostat_eta = sampling.value("mirostat_eta", s.mirostat_eta);
+            s.grammar = sampling.value("grammar", s.grammar);
+            s.grammar_lazy = sampling.value("grammar_lazy", s.grammar_lazy);
+            if (sampling.contains("grammar_triggers")) {
+                s.grammar_triggers.clear();
+                for (const json &trigger : sampling["grammar_triggers"]) {
+                    common_grammar_trigger t;
+                    t.type = (common_grammar_trigger_type)trigger.value("type", 0);
+                    t.value = trigger.value("value", std::string());
+                    t.token = trigger.value("token", (llama_token)LLAMA_TOKEN_NULL);
+                    s.grammar_triggers.push_back(std::move(t));
+                }
+            }
+            records.push_back(std::move(record));
+        }
+    } catch (const std::exception &e) {
+        LOG_ERROR("Failed to parse request trace: %s", e.what());
+        records.clear();
+        return false;
+    }
+    return true;
+}
+
+std::string replay_result_json(const cactus_replay_result &result) {
+    return json{
+        {"n_requests", result.n_requests},
+        {"n_prompt_tokens", result.n_prompt_tokens},
+        {"n_tokens", result.n_tokens},
+        {"ttft_ms", {{"mean", result.ttft_mean_ms}, {"p50", result.ttft_p50_ms}, {"p90", result.ttft_p90_ms}, {"p99", result.ttft_p99_ms}}},
+        {"itl_ms", {{"mean", result.itl_mean_ms}, {"p50", result.itl_p50_ms}, {"p90", result.itl_p90_ms}, {"p99", result.itl_p99_ms}}},
+        {"total_us", result.total_us}
+    }.dump();
+}
+
+} // namespace cactus
@@ -0,0 +1,48 @@
+#include "cactus.h"
+#include "common.h"
+#include <algorithm>
+#include "llama.h"
+
+namespace cactus {
+
+// Most candidates llama_set_logits_top_k selects on the backend
+static const int32_t LEAN_MAX_CANDIDATES = 512;
+
+// The lean path is the sampler's own fused chain (common_sampler_fused_window) fed from candidates
+// selected on the backend, so the full logits row never has to cross to the host
+bool cactus_context::canSampleLean() const {
+    const common_params_sampling &s = params.sampling;
+    if (!lean_sampling || ctx_sampling == nullptr || s.ignore_eos) {
+        return false;
+    }
+    const int32_t window = common_sampler_fused_window(ctx_sampling);
+    return window > 0 && window <= LEAN_MAX_CANDIDATES;
+}
+
+void cactus_context::configureLeanSampling() {
+    if (ctx != nullptr) {
+        const bool lean = canSampleLean();
+        llama_set_logits_top_k(ctx, lean ? common_sampler_fused_window(ctx_sampling) : 0);
+        llama_set_logits_lazy(ctx, lean);
+    }
+}
+
+llama_token cactus_context::sampleLean() {
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    const int32_t window = std::min(common_sampler_fused_window(ctx_sampling), n_vocab);
+
+    // Candidates selected during decode arrive sorted; the sampler may have changed since, so the
+    // count is checked, and otherwise the fused chain scans the host row itself
+    llama_token top_ids[LEAN_MAX_CANDIDATES];
+    float top_logits[LEAN_MAX_CANDIDATES];
+    const int32_t n_top = llama_get_logits_top_k_ith(ctx, -1, top_ids, top_logits);
+    if (n_top == window) {
+        const llama_token id = common_sampler_sample_window(ctx_sampling, top_ids, top_logits, (size_t)n_top);
+        if (id != LLAMA_TOKEN_NULL) {
+            return id;
+        }
+    }
+    return common_sampler_sample(ctx_sampling, ctx, -1);
+}
+
+} // namespace cactus
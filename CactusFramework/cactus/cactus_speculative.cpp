@@ -0,0 +1,357 @@
+#include "cactus.h"
+#include "common.h"
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <string>
+#include "llama.h"
+
+namespace cactus {
+
+bool cactus_context::initDraftModel(const std::string &draft_model_path) {
+    if (draft_wrapper != nullptr) {
+        return true;
+    }
+
+    common_params draft_params = params;
+    draft_params.model.path = draft_model_path;
+    draft_params.n_gpu_layers = params.speculative.n_gpu_layers;
+    draft_params.n_parallel = 1;
+    draft_params.embedding = false;
+    draft_params.lora_adapters.clear();
+    draft_params.path_prompt_cache.clear();
+    draft_params.speculative.model.path.clear();
+    if (params.speculative.n_ctx > 0) {
+        draft_params.n_ctx = params.speculative.n_ctx;
+    }
+
+    cactus_context_draft *wrapper = new cactus_context_draft();
+    wrapper->init_result = common_init_from_params(draft_params);
+
+    wrapper->model = wrapper->init_result.model.get();
+    wrapper->ctx = wrapper->init_result.context.get();
+
+    if (wrapper->model == nullptr || wrapper->ctx == nullptr) {
+        LOG_ERROR("Failed to load draft model: %s", draft_model_path.c_str());
+        delete wrapper;
+        return false;
+    }
+
+    const llama_vocab *vocab_tgt = llama_model_get_vocab(model);
+    const llama_vocab *vocab_dft = llama_model_get_vocab(wrapper->model);
+    if (llama_vocab_type(vocab_tgt) != llama_vocab_type(vocab_dft) ||
+        llama_vocab_n_tokens(vocab_tgt) != llama_vocab_n_tokens(vocab_dft) ||
+        llama_vocab_bos(vocab_tgt) != llama_vocab_bos(vocab_dft) ||
+        llama_vocab_eos(vocab_tgt) != llama_vocab_eos(vocab_dft)) {
+        LOG_ERROR("Draft model vocabulary does not match the target model: %s", draft_model_path.c_str());
+        delete wrapper;
+        return false;
+    }
+
+    common_params_sampling draft_sampling;
+    draft_sampling.no_perf = true;
+    draft_sampling.top_k = 10;
+    draft_sampling.samplers = { COMMON_SAMPLER_TYPE_TOP_K };
+    wrapper->sampler = common_sampler_init(wrapper->model, draft_sampling);
+    wrapper->batch = llama_batch_init(std::max(params.n_batch, params.speculative.n_max + 1), 0, 1);
+    if (abort_armed) {
+        llama_set_abort_callback(wrapper->ctx, cactus_abort_callback, this);
+    }
+    attach_shared_threadpool(wrapper->ctx, draft_params.cpuparams);
+
+    draft_wrapper = wrapper;
+    has_draft = true;
+
+    LOG_INFO("Draft model initialized successfully with model: %s", draft_model_path.c_str());
+    return true;
+}
+
+bool cactus_context::isDraftEnabled() const {
+    return has_draft && draft_wrapper != nullptr;
+}
+
+void cactus_context::releaseDraftModel() {
+    if (draft_wrapper != nullptr) {
+        if (draft_wrapper->sampler != nullptr) {
+            common_sampler_free(draft_wrapper->sampler);
+        }
+        if (draft_wrapper->batch.token != nullptr) {
+            llama_batch_free(draft_wrapper->batch);
+        }
+        delete draft_wrapper;
+        draft_wrapper = nullptr;
+    }
+    has_draft = false;
+    if (self_spec_sampler != nullptr) {
+        common_sampler_free(self_spec_sampler);
+        self_spec_sampler = nullptr;
+    }
+}
+
+bool cactus_context::canSpeculate() const {
+    return (isDraftEnabled() || lookup_ngram_size > 0 || self_spec_skip_layers > 0) &&
+           params.speculative.n_max > 0 &&
+           params.sampling.n_probs == 0 && !params.sampling.token_stats &&
+           !hasGuideTokens();
+}
+
+std::vector<llama_token> cactus_context::lookupTokens(int n_max) const {
+    std::vector<llama_token> result;
+    const int n_embd = (int)embd.size();
+
+    for (int n = std::min(lookup_ngram_size, n_embd - 1); n > 0; n--) {
+        const llama_token *ngram = embd.data() + n_embd - n;
+        for (int i = n_embd - n - 1; i >= 0; i--) {
+            if (!std::equal(ngram, ngram + n, embd.begin() + i)) {
+                continue;
+            }
+            const int start = i + n;
+            const int count = std::min(n_max, n_embd - start);
+            result.assign(embd.begin() + start, embd.begin() + start + count);
+            return result;
+        }
+    }
+    return result;
+}
+
+std::vector<llama_token> cactus_context::draftTokens(int n_max) {
+    std::vector<llama_token> result;
+    if (n_max <= 0 || embd.empty()) {
+        return result;
+    }
+    if (!isDraftEnabled()) {
+        return self_spec_skip_layers > 0 ? selfDraftTokens(n_max) : lookupTokens(n_max);
+    }
+
+    cactus_context_draft *draft = draft_wrapper;
+    const int n_ctx_dft = llama_n_ctx(draft->ctx);
+    if ((int)embd.size() + n_max >= n_ctx_dft) {
+        return result;
+    }
+
+    size_t n_reuse = common_part(draft->embd, embd);
+    if (n_reuse == embd.size()) {
+        n_reuse--;
+    }
+    const llama_pos p_resume = llama_kv_self_seq_rollback(draft->ctx, 0, n_reuse);
+    if (p_resume < 0) {
+        llama_kv_self_seq_rm(draft->ctx, 0, -1, -1);
+    }
+    n_reuse = std::max<llama_pos>(0, p_resume);
+    draft->embd.resize(n_reuse);
+
+    const std::vector<llama_seq_id> seq_ids = { 0 };
+    for (size_t i = n_reuse; i < embd.size(); ) {
+        const size_t n_eval = std::min(embd.size() - i, (size_t)params.n_batch);
+        llama_batch_clear(&draft->batch);
+        for (size_t j = 0; j < n_eval; j++) {
+            llama_batch_add(&draft->batch, embd[i + j], i + j, seq_ids, i + j + 1 == embd.size());
+        }
+        if (llama_decode(draft->ctx, draft->batch) != 0) {
+            LOG_WARNING("Draft model failed to eval, n_eval: %zu", n_eval);
+            llama_kv_self_seq_rm(draft->ctx, 0, -1, -1);
+            draft->embd.clear();
+            return result;
+        }
+        draft->embd.insert(draft->embd.end(), embd.begin() + i, embd.begin() + i + n_eval);
+        i += n_eval;
+    }
+
+    const llama_vocab *vocab = llama_model_get_vocab(draft->model);
+    common_sampler_reset(draft->sampler);
+
+    for (int i = 0; i < n_max; i++) {
+        common_sampler_sample(draft->sampler, draft->ctx, -1, true);
+        const llama_token_data_array *cur_p = common_sampler_get_candidates(draft->sampler);
+        if (cur_p->size == 0 || cur_p->data[0].p < params.speculative.p_min) {
+            break;
+        }
+
+        const llama_token id = cur_p->data[0].id;
+        common_sampler_accept(draft->sampler, id, true);
+        result.push_back(id);
+
+        if ((int)result.size() >= n_max || llama_vocab_is_eog(vocab, id)) {
+            break;
+        }
+
+        llama_batch_clear(&draft->batch);
+        llama_batch_add(&draft->batch, id, draft->embd.size(), seq_ids, true);
+        if (llama_decode(draft->ctx, draft->batch) != 0) {
+            break;
+        }
+        draft->embd.push_back(id);
+    }
+
+    return result;
+}
+
+std::vector<llama_token> cactus_context::selfDraftTokens(int n_max) {
+    std::vector<llama_token> result;
+    const int32_t n_layer = llama_model_n_layer(model);
+    const int32_t n_skip = std::min(self_spec_skip_layers, n_layer - 2);
+    if (n_skip <= 0) {
+        return result;
+    }
+
+    // spread over the interior layers, the first and the last always run
+    std::unique_ptr<bool[]> skip(new bool[n_layer]());
+    for (int32_t i = 0; i < n_skip; i++) {
+        skip[1 + (int64_t)i * (n_layer - 2) / n_skip] = true;
+    }
+    if (llama_model_is_recurrent(model) || !llama_set_layer_skip(ctx, skip.get(), n_layer)) {
+        LOG_WARNING("Self-speculation is not supported by this model, disabled", "");
+        self_spec_skip_layers = 0;
+        return result;
+    }
+
+    if (self_spec_sampler == nullptr) {
+        common_params_sampling draft_sampling;
+        draft_sampling.no_perf = true;
+        draft_sampling.top_k = 10;
+        draft_sampling.samplers = { COMMON_SAMPLER_TYPE_TOP_K };
+        self_spec_sampler = common_sampler_init(model, draft_sampling);
+    }
+    common_sampler_reset(self_spec_sampler);
+
+    const llama_vocab *vocab = llama_model_get_vocab(model);
+    const std::vector<llama_seq_id> seq_ids = { seq_id };
+    llama_token id = embd.back();
+    for (int i = 0; i < n_max; i++) {
+        llama_batch_clear(&batch);
+        llama_batch_add(&batch, id, n_past + i, seq_ids, true);
+        if (llama_decode(ctx, batch) != 0) {
+            break;
+        }
+
+        common_sampler_sample(self_spec_sampler, ctx, -1, true);
+        const llama_token_data_array *cur_p = common_sampler_get_candidates(self_spec_sampler);
+        if (cur_p->size == 0 || cur_p->data[0].p < params.speculative.p_min) {
+            break;
+        }
+        id = cur_p->data[0].id;
+        common_sampler_accept(self_spec_sampler, id, true);
+        result.push_back(id);
+        if (llama_vocab_is_eog(vocab, id)) {
+            break;
+        }
+    }
+
+    llama_set_layer_skip(ctx, nullptr, 0);
+    // the drafted cells hold only the layers that ran; the verify batch writes them again in full
+    llama_kv_self_seq_rm(ctx, seq_id, n_past, -1);
+    return result;
+}
+
+bool cactus_context::speculativeStep() {
+    int n_max = std::min(params.speculative.n_max, params.n_batch - 1);
+    n_max = std::min(n_max, n_ctx - (int)embd.size() - 1);
+    if (params.n_predict > 0) {
+        n_max = std::min(n_max, (int)n_remain - 1);
+    }
+    const int n_min = std::max(1, params.speculative.n_min);
+    if (n_max < n_min) {
+        return false;
+    }
+
+    // a recurrent state cannot drop rejected drafts, it returns to a snapshot taken before them
+    if (llama_model_is_recurrent(model) && !llama_kv_self_seq_checkpoint(ctx, seq_id)) {
+        return false;
+    }
+
+    std::vector<llama_token> draft = draftTokens(n_max);
+    if ((int)draft.size() < n_min) {
+        return false;
+    }
+
+    const std::vector<llama_seq_id> seq_ids = { seq_id };
+    llama_batch_clear(&batch);
+    llama_batch_add(&batch, embd.back(), n_past, seq_ids, true);
+    for (size_t i = 0; i < draft.size(); i++) {
+        llama_batch_add(&batch, draft[i], n_past + 1 + i, seq_ids, true);
+    }
+
+    if (llama_decode(ctx, batch) != 0) {
+        LOG_WARNING("Failed to verify draft, n_draft: %zu, n_past: %zu", draft.size(), n_past);
+        rollbackSequence(n_past);
+        return false;
+    }
+
+    std::vector<llama_token> accepted = common_sampler_sample_and_accept_n(ctx_sampling, ctx, draft);
+
+    n_draft_proposed += draft.size();
+    n_draft_accepted += accepted.size() - 1;
+
+    // KV now holds embd.back() plus the accepted draft tokens; drop the rejected tail
+    const llama_pos p_keep = (llama_pos)(n_past + accepted.size());
+    llama_pos p_resume = llama_kv_self_seq_rollback(ctx, seq_id, p_keep);
+    if (p_resume >= (llama_pos)n_past && p_resume < p_keep) {
+        // a recurrent state went back to its snapshot, the accepted tokens are decoded again
+        llama_batch_clear(&batch);
+        for (llama_pos p = p_resume; p < p_keep; p++) {
+            const llama_token id = p == (llama_pos)n_past ? embd.back() : accepted[p - n_past - 1];
+            llama_batch_add(&batch, id, p, seq_ids, p + 1 == p_keep);
+        }
+        p_resume = llama_decode(ctx, batch) == 0 ? p_keep : -1;
+    }
+    if (p_resume != p_keep) {
+        // the drafts were accepted by the sampler already, only the cache can be recovered
+        LOG_WARNING("Failed to roll back the rejected drafts, n_past: %zu", n_past);
+        llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+        n_past = 0;
+        return false;
+    }
+    pending_tokens = std::move(accepted);
+
+    LOG_VERBOSE("speculative step, drafted: %zu, accepted: %zu", draft.size(), pending_tokens.size() - 1);
+    return true;
+}
+
+completion_token_output cactus_context::nextPendingToken() {
+    completion_token_output result;
+    result.tok = pending_tokens.front();
+    pending_tokens.erase(pending_tokens.begin());
+    acceptForcedGrammar(result.tok);
+
+    n_past++;
+    num_tokens_predicted++;
+    embd.push_back(result.tok);
+    if (n_remain > 0) {
+        --n_remain;
+    }
+
+    if (result.tok == llama_vocab_eos(llama_model_get_vocab(model))) {
+        has_next_token = false;
+        stopped_eos = true;
+        discardPendingTokens();
+        LOG_VERBOSE("eos token found", "");
+        return result;
+    }
+
+    has_next_token = params.n_predict == -1 || n_remain > 0;
+    if (!has_next_token) {
+        discardPendingTokens();
+    }
+    return result;
+}
+
+void cactus_context::discardPendingTokens() {
+    if (pending_tokens.empty()) {
+        return;
+    }
+    pending_tokens.clear();
+    if (ctx != nullptr) {
+        rollbackSequence(n_past);
+    }
+}
+
+void cactus_context::rollbackSequence(size_t p) {
+    const llama_pos p_resume = llama_kv_self_seq_rollback(ctx, seq_id, (llama_pos)p);
+    if (p_resume < 0) {
+        llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+    }
+    // the decode loop evaluates embd again from here
+    n_past = std::max<llama_pos>(0, p_resume);
+}
+
+} // namespace cactus
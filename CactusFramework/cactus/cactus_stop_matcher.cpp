@@ -0,0 +1,94 @@
+#include "cactus.h"
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace cactus {
+
+void cactus_stop_matcher::build(const std::vector<std::string> &words) {
+    nodes.assign(1, node());
+    patterns.clear();
+
+    for (const std::string &word : words) {
+        if (word.empty()) continue;
+        int state = 0;
+        for (unsigned char c : word) {
+            auto it = nodes[state].next.find(c);
+            if (it == nodes[state].next.end()) {
+                nodes.push_back(node());
+                nodes.back().depth = nodes[state].depth + 1;
+                nodes[state].next[c] = (int)nodes.size() - 1;
+                state = (int)nodes.size() - 1;
+            } else {
+                state = it->second;
+            }
+        }
+        nodes[state].word = (int)patterns.size();
+        patterns.push_back(word);
+    }
+
+    std::deque<int> queue;
+    for (auto &edge : nodes[0].next) {
+        nodes[edge.second].fail = 0;
+        queue.push_back(edge.second);
+    }
+    while (!queue.empty()) {
+        const int state = queue.front();
+        queue.pop_front();
+
+        node &current = nodes[state];
+        current.output = current.word >= 0 ? current.word : nodes[current.fail].output;
+
+        for (auto &edge : current.next) {
+            int fail = current.fail;
+            while (fail > 0 && nodes[fail].next.find(edge.first) == nodes[fail].next.end()) {
+                fail = nodes[fail].fail;
+            }
+            auto it = nodes[fail].next.find(edge.first);
+            nodes[edge.second].fail = (it != nodes[fail].next.end() && it->second != edge.second) ? it->second : 0;
+            queue.push_back(edge.second);
+        }
+    }
+
+    reset();
+}
+
+void cactus_stop_matcher::reset() {
+    state = 0;
+    n_consumed = 0;
+    matched_word = -1;
+}
+
+size_t cactus_stop_matcher::feed(std::string_view text) {
+    if (patterns.empty()) {
+        n_consumed += text.size();
+        return std::string::npos;
+    }
+
+    for (unsigned char c : text) {
+        while (state > 0 && nodes[state].next.find(c) == nodes[state].next.end()) {
+            state = nodes[state].fail;
+        }
+        auto it = nodes[state].next.find(c);
+        state = it != nodes[state].next.end() ? it->second : 0;
+        n_consumed++;
+
+        if (nodes[state].output >= 0) {
+            matched_word = nodes[state].output;
+            return n_consumed - patterns[matched_word].size();
+        }
+    }
+    return std::string::npos;
+}
+
+size_t cactus_stop_matcher::partialLength() const {
+    return nodes.empty() ? 0 : nodes[state].depth;
+}
+
+const std::string &cactus_stop_matcher::matchedWord() const {
+    static const std::string empty;
+    return matched_word >= 0 ? patterns[matched_word] : empty;
+}
+
+} // namespace cactus
@@ -0,0 +1,71 @@
+#include "cactus.h"
+#include "common.h"
+#include "llama.h"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+namespace cactus {
+
+static const int32_t THERMAL_MIN_N_BATCH = 32;
+
+struct thermal_step {
+    int threads_num;    // thread counts scale by num / 4
+    int batch_div;      // n_batch divisor
+    int64_t pacing_us;  // sleep after each generated token
+};
+
+static const thermal_step THERMAL_STEPS[] = {
+    { 4, 1, 0 },        // nominal
+    { 3, 1, 0 },        // fair
+    { 2, 2, 10000 },    // serious
+    { 1, 4, 40000 },    // critical
+};
+
+// Trades throughput for steady latency as the device heats up; KV quantization recreates the
+// llama_context, so it is only done between generations
+void cactus_context::applyThermalState(thermal_state state, bool allow_kv_compaction) {
+    if (ctx == nullptr) {
+        return;
+    }
+    state = std::max(THERMAL_NOMINAL, std::min(THERMAL_CRITICAL, state));
+
+    if (state == thermal && !(allow_kv_compaction && state == THERMAL_CRITICAL)) {
+        return;
+    }
+    if (thermal == THERMAL_NOMINAL) {
+        thermal_base_threads = llama_n_threads(ctx);
+        thermal_base_threads_batch = llama_n_threads_batch(ctx);
+        thermal_base_n_batch = params.n_batch;
+    }
+
+    const thermal_step &step = THERMAL_STEPS[state];
+    const int32_t n_threads = std::max(1, thermal_base_threads * step.threads_num / 4);
+    const int32_t n_threads_batch = std::max(1, thermal_base_threads_batch * step.threads_num / 4);
+
+    if (state == THERMAL_CRITICAL && allow_kv_compaction && !is_predicting && !lm_ggml_is_quantized(params.cache_type_k)) {
+        // An f16 cache is only quantized here, never shrunk; the new context keeps the full n_batch
+        params.n_batch = thermal_base_n_batch;
+        if (!compactKVCache()) {
+            return;
+        }
+    }
+
+    llama_set_n_threads(ctx, n_threads, n_threads_batch);
+    params.n_batch = std::max(std::min(THERMAL_MIN_N_BATCH, thermal_base_n_batch), thermal_base_n_batch / step.batch_div);
+    thermal_pacing_us = step.pacing_us;
+    if (state != thermal) {
+        LOG_INFO("thermal state %d -> %d, threads: %d/%d, n_batch: %d, pacing: %lldus",
+            (int)thermal, (int)state, n_threads, n_threads_batch, params.n_batch, (long long)thermal_pacing_us);
+        thermal = state;
+        n_thermal_changes++;
+    }
+}
+
+void cactus_context::thermalPace() {
+    const auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::microseconds(thermal_pacing_us));
+    thermal_paced_us += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+} // namespace cactus
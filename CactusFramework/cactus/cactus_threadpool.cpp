@@ -0,0 +1,63 @@
+#include "cactus.h"
+#include "common.h"
+#include "ggml-cpu.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+namespace cactus {
+
+static std::mutex shared_threadpool_mutex;
+static lm_ggml_threadpool_t shared_threadpool_ptr = nullptr;
+
+// Lives as long as the process: contexts, projectors and vocoders may be released in any order
+lm_ggml_threadpool_t shared_threadpool(const cpu_params &params) {
+    std::lock_guard<std::mutex> lock(shared_threadpool_mutex);
+    if (shared_threadpool_ptr != nullptr) {
+        return shared_threadpool_ptr;
+    }
+
+    // sized for the machine, not the first caller, so a later context asking for more threads
+    // is not clamped; graphs only wake as many workers as their context uses
+    const int32_t n_hw = (int32_t)std::thread::hardware_concurrency();
+    cpu_params pool_params = params;
+    pool_params.n_threads = std::min<int32_t>(std::max(params.n_threads, n_hw), LM_GGML_MAX_N_THREADS);
+    if (pool_params.n_threads <= 0) {
+        pool_params.n_threads = cpu_get_num_math();
+    }
+
+    struct lm_ggml_threadpool_params tpp = lm_ggml_threadpool_params_from_cpu_params(pool_params);
+    shared_threadpool_ptr = lm_ggml_threadpool_new(&tpp);
+    if (shared_threadpool_ptr == nullptr) {
+        LOG_WARNING("failed to create the shared threadpool, contexts keep their own", "");
+        return nullptr;
+    }
+    LOG_INFO("shared threadpool created with %d threads", pool_params.n_threads);
+    return shared_threadpool_ptr;
+}
+
+void attach_shared_threadpool(llama_context *ctx, const cpu_params &params) {
+    lm_ggml_threadpool_t threadpool = shared_threadpool(params);
+    if (ctx != nullptr && threadpool != nullptr) {
+        llama_attach_threadpool(ctx, threadpool, threadpool);
+    }
+}
+
+static std::atomic<int> n_interactive_scopes{0};
+
+cactus_interactive_scope::cactus_interactive_scope()
+    : prev(lm_ggml_threadpool_set_interactive(true)) {
+    n_interactive_scopes++;
+}
+
+cactus_interactive_scope::~cactus_interactive_scope() {
+    n_interactive_scopes--;
+    lm_ggml_threadpool_set_interactive(prev);
+}
+
+bool cactus_interactive_busy() {
+    return n_interactive_scopes.load(std::memory_order_relaxed) > 0;
+}
+
+} // namespace cactus
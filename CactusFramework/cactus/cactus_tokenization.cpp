@@ -18,35 +18,10 @@ cactus_tokenize_result cactus_context::tokenize(const std::string &text, const s
             full_text += default_media_marker;
         }
         
-        std::vector<llama_token> text_tokens = common_tokenize(ctx, full_text, false);
-        std::vector<std::string> bitmap_hashes;
-        std::vector<size_t> chunk_pos = {0};
-        std::vector<size_t> chunk_pos_media;
-        
-        size_t total_token_count = text_tokens.size();
-        
-        for (size_t i = 0; i < media_paths.size(); ++i) {
-            chunk_pos_media.push_back(total_token_count);
-            
-            for (int j = 0; j < 256; ++j) {
-                text_tokens.push_back(LLAMA_TOKEN_NULL);
-            }
-            total_token_count += 256;
-            
-            bitmap_hashes.push_back("placeholder_hash_" + std::to_string(i));
-        }
-        
-        cactus_tokenize_result tokenize_result = {
-            .tokens = text_tokens,
-            .has_media = true,
-            .bitmap_hashes = bitmap_hashes,
-            .chunk_pos = chunk_pos,
-            .chunk_pos_media = chunk_pos_media,
-        };
-        return tokenize_result;
+        return tokenizeMediaSizes(full_text, media_paths);
     }
     
-    std::vector<llama_token> text_tokens = common_tokenize(ctx, text, false);
+    std::vector<llama_token> text_tokens = common_tokenize(ctx, text, false, false, params.cpuparams.n_threads);
     cactus_tokenize_result tokenize_result = {
         .tokens = text_tokens,
         .has_media = false,
@@ -57,4 +32,14 @@ cactus_tokenize_result cactus_context::tokenize(const std::string &text, const s
     return tokenize_result;
 }
 
+// Tokenizes a prompt with special tokens; a chat prompt grows by a turn at a time, so only the
+// text after the part it shares with the previous one is tokenized again
+std::vector<llama_token> cactus_context::tokenizePrompt(const std::string &prompt) {
+    std::vector<llama_token> tokens = common_tokenize_incremental(llama_model_get_vocab(model), tokenized_prompt, tokenized_prompt_tokens,
+                                                                  prompt, true, true, params.cpuparams.n_threads);
+    tokenized_prompt = prompt;
+    tokenized_prompt_tokens = tokens;
+    return tokens;
+}
+
 } // namespace cactus 
\ No newline at end of file
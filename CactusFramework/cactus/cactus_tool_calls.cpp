@@ -0,0 +1,88 @@
+#include "cactus.h"
+#include "json.hpp"
+#include <string>
+
+using json = nlohmann::ordered_json;
+
+namespace cactus {
+
+// Accepts {"name", "arguments"|"parameters"} and the OpenAI {"function": {...}} wrapping;
+// string arguments are kept as they are, anything else is serialized back to JSON
+static bool tool_call_from_json(const json &object, cactus_tool_call &call) {
+    if (!object.is_object()) {
+        return false;
+    }
+    if (object.contains("function") && object.at("function").is_object()) {
+        if (!tool_call_from_json(object.at("function"), call)) {
+            return false;
+        }
+        if (object.contains("id") && object.at("id").is_string()) {
+            call.id = object.at("id").get<std::string>();
+        }
+        return true;
+    }
+    if (!object.contains("name") || !object.at("name").is_string()) {
+        return false;
+    }
+    call.name = object.at("name").get<std::string>();
+    const char *key = object.contains("arguments") ? "arguments" : "parameters";
+    if (!object.contains(key)) {
+        call.arguments = "{}";
+    } else if (object.at(key).is_string()) {
+        call.arguments = object.at(key).get<std::string>();
+    } else {
+        call.arguments = object.at(key).dump();
+    }
+    if (object.contains("id") && object.at("id").is_string()) {
+        call.id = object.at("id").get<std::string>();
+    }
+    return true;
+}
+
+void cactus_tool_call_scanner::reset() {
+    depth = 0;
+    in_string = false;
+    escaped = false;
+    object.clear();
+    calls.clear();
+}
+
+size_t cactus_tool_call_scanner::feed(std::string_view text) {
+    const size_t n_calls = calls.size();
+    for (char c : text) {
+        if (depth == 0) {
+            // Text between calls (tags, "[TOOL_CALLS][", commas) is skipped
+            if (c != '{') {
+                continue;
+            }
+            object.clear();
+        }
+        object += c;
+
+        if (in_string) {
+            if (escaped) {
+                escaped = false;
+            } else if (c == '\\') {
+                escaped = true;
+            } else if (c == '"') {
+                in_string = false;
+            }
+            continue;
+        }
+        if (c == '"') {
+            in_string = true;
+        } else if (c == '{' || c == '[') {
+            depth++;
+        } else if ((c == '}' || c == ']') && --depth == 0) {
+            const json parsed = json::parse(object, nullptr, false);
+            cactus_tool_call call;
+            if (!parsed.is_discarded() && tool_call_from_json(parsed, call)) {
+                calls.push_back(std::move(call));
+            }
+            object.clear();
+        }
+    }
+    return calls.size() - n_calls;
+}
+
+} // namespace cactus
@@ -0,0 +1,173 @@
+#include "cactus.h"
+#include "common.h"
+#include "chat.h"
+#include "llama.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace cactus {
+
+// Stands in for result i when rendering; unlikely to be produced by any template
+static std::string tool_result_placeholder(size_t i) {
+    return "\x1f" "cactus-tool-result-" + std::to_string(i) + "\x1f";
+}
+
+// Trims what ended the turn off embd and returns its text, which the rendered template holds too:
+// the end-of-generation token, or the tokens spelling the stop word. Text a straddling token had
+// in front of the stop word goes into lead. Empty when the turn did not end on either.
+static std::string trim_turn_end(cactus_context &c, std::string &lead) {
+    const llama_vocab *vocab = llama_model_get_vocab(c.model);
+    const size_t n_generated = std::min(c.embd.size(), c.num_tokens_predicted + 1);
+    const size_t floor = c.embd.size() - n_generated;
+    lead.clear();
+
+    if (!c.embd.empty() && llama_vocab_is_eog(vocab, c.embd.back())) {
+        std::string marker = cached_token_piece(vocab, c.embd.back());
+        c.embd.pop_back();
+        return marker;
+    }
+    if (!c.stopped_word || c.stopping_word.empty()) {
+        return "";
+    }
+    std::vector<llama_token> kept = c.embd;
+    std::string removed;
+    size_t pos = std::string::npos;
+    while (kept.size() > floor && (pos = removed.find(c.stopping_word)) == std::string::npos) {
+        removed = cached_token_piece(vocab, kept.back()) + removed;
+        kept.pop_back();
+    }
+    if (pos == std::string::npos) {
+        pos = removed.find(c.stopping_word);
+    }
+    if (pos == std::string::npos) {
+        return "";
+    }
+    lead = removed.substr(0, pos);
+    c.embd = std::move(kept);
+    return c.stopping_word;
+}
+
+bool cactus_context::beginToolTurn(std::vector<common_chat_msg> messages, const std::string &tools) {
+    if (!ctx || !model || tool_scanner.calls.empty()) {
+        return false;
+    }
+
+    common_chat_params prompt;
+    common_chat_params rendered;
+    std::vector<std::string> placeholders;
+    try {
+        prompt = getFormattedChatWithJinja(messages, "", "", tools, true, "");
+
+        common_chat_msg assistant;
+        assistant.role = "assistant";
+        for (size_t i = 0; i < tool_scanner.calls.size(); i++) {
+            const cactus_tool_call &call = tool_scanner.calls[i];
+            const std::string id = call.id.empty() ? "call_" + std::to_string(i) : call.id;
+            assistant.tool_calls.push_back({ call.name, call.arguments, id });
+        }
+        messages.push_back(assistant);
+        for (size_t i = 0; i < tool_scanner.calls.size(); i++) {
+            common_chat_msg result;
+            result.role = "tool";
+            result.tool_name = tool_scanner.calls[i].name;
+            result.tool_call_id = assistant.tool_calls[i].id;
+            placeholders.push_back(tool_result_placeholder(i));
+            result.content = placeholders.back();
+            messages.push_back(std::move(result));
+        }
+        rendered = getFormattedChatWithJinja(std::move(messages), "", "", tools, true, "");
+    } catch (const std::exception &e) {
+        LOG_WARNING("tool turn not kept, the template failed to render it: %s", e.what());
+        return false;
+    }
+
+    // The rendered assistant turn may spell the calls differently from what was generated, only
+    // the text from the turn's end marker on is taken from it
+    const std::string &text = rendered.prompt;
+    if (prompt.prompt.empty() || text.compare(0, prompt.prompt.size(), prompt.prompt) != 0) {
+        LOG_VERBOSE("tool turn not kept, the template rewrites earlier turns", "");
+        return false;
+    }
+    std::vector<size_t> at;
+    size_t from = prompt.prompt.size();
+    for (const std::string &placeholder : placeholders) {
+        const size_t pos = text.find(placeholder, from);
+        if (pos == std::string::npos) {
+            LOG_VERBOSE("tool turn not kept, the template drops tool results", "");
+            return false;
+        }
+        at.push_back(pos);
+        from = pos + placeholder.size();
+    }
+
+    std::vector<llama_token> saved_embd = embd;
+    std::string lead;
+    const std::string marker = trim_turn_end(*this, lead);
+    const size_t marker_pos = marker.empty() ? std::string::npos : text.rfind(marker, at[0]);
+    if (marker_pos == std::string::npos || marker_pos < prompt.prompt.size()) {
+        embd = std::move(saved_embd);
+        LOG_VERBOSE("tool turn not kept, its end of turn is not in the template output", "");
+        return false;
+    }
+
+    cactus_tool_turn turn;
+    turn.framing.push_back(lead + text.substr(marker_pos, at[0] - marker_pos));
+    for (size_t i = 0; i < at.size(); i++) {
+        const size_t end = at[i] + placeholders[i].size();
+        const size_t next = i + 1 < at.size() ? at[i + 1] : text.size();
+        turn.framing.push_back(text.substr(end, next - end));
+    }
+    turn.results.resize(placeholders.size());
+    turn.received.assign(placeholders.size(), false);
+
+    // tokens trimmed off the end may already be in the cache
+    if (n_past > embd.size()) {
+        const llama_pos p_resume = llama_kv_self_seq_rollback(ctx, seq_id, embd.size());
+        if (p_resume < 0) {
+            LOG_WARNING("partial KV cache removal failed, clearing sequence %d", seq_id);
+            llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+        }
+        n_past = p_resume < 0 ? 0 : std::min<size_t>(p_resume, embd.size());
+    }
+    std::vector<llama_token> framing = common_tokenize(ctx, turn.framing[0], false, true);
+    embd.insert(embd.end(), framing.begin(), framing.end());
+    tool_turns[seq_id] = std::move(turn);
+    LOG_INFO("kept tool turn with %zu calls, %zu framing tokens queued", placeholders.size(), framing.size());
+    return true;
+}
+
+bool cactus_context::addToolResult(size_t index, const std::string &content) {
+    auto it = tool_turns.find(seq_id);
+    if (it == tool_turns.end() || index >= it->second.results.size()) {
+        return false;
+    }
+    cactus_tool_turn &turn = it->second;
+    if (turn.received[index]) {
+        return true;
+    }
+    turn.results[index] = content;
+    turn.received[index] = true;
+
+    while (turn.n_appended < turn.results.size() && turn.received[turn.n_appended]) {
+        const size_t i = turn.n_appended++;
+        // the result is plain text, the framing keeps its special tokens
+        std::vector<llama_token> result = common_tokenize(ctx, turn.results[i], false, false);
+        std::vector<llama_token> framing = common_tokenize(ctx, turn.framing[i + 1], false, true);
+        embd.insert(embd.end(), result.begin(), result.end());
+        embd.insert(embd.end(), framing.begin(), framing.end());
+        turn.results[i].clear();
+    }
+    return true;
+}
+
+bool cactus_context::toolTurnReady() const {
+    auto it = tool_turns.find(seq_id);
+    return it != tool_turns.end() && it->second.n_appended == it->second.results.size();
+}
+
+void cactus_context::endToolTurn() {
+    tool_turns.erase(seq_id);
+}
+
+} // namespace cactus
@@ -0,0 +1,32 @@
+#include "cactus.h"
+#include "llama.h"
+#include <cstdio>
+#include <string>
+
+namespace cactus {
+
+int64_t cactus_context::recordStage(int64_t &total_us, const char *name, int64_t start_us) {
+    const int64_t end_us = llama_time_us();
+    total_us += end_us - start_us;
+    if (tracing && trace_spans.size() < trace_limit) {
+        trace_spans.push_back({name, start_us, end_us - start_us});
+    }
+    return end_us;
+}
+
+// Chrome trace event format ("X" complete events), loadable in chrome://tracing and Perfetto
+std::string cactus_context::traceJSON() const {
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    out.reserve(out.size() + trace_spans.size() * 96);
+    char event[160];
+    for (size_t i = 0; i < trace_spans.size(); i++) {
+        const cactus_trace_span &span = trace_spans[i];
+        snprintf(event, sizeof(event), "%s{\"name\":\"%s\",\"cat\":\"cactus\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":1}",
+            i == 0 ? "" : ",", span.name, (long long)span.start_us, (long long)span.dur_us);
+        out += event;
+    }
+    out += "]}";
+    return out;
+}
+
+} // namespace cactus
@@ -0,0 +1,309 @@
+#include "cactus.h"
+#include "common.h"
+#include "llama.h"
+#include "ggml-opt.h"
+#include "json.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+namespace cactus {
+
+static const int32_t TRAIN_SEQ_ALIGN = 32;
+static const int32_t TRAIN_MIN_UBATCH = 8;
+static const int64_t TRAIN_IDLE_POLL_MS = 50;
+
+struct train_targets {
+    std::vector<std::string> names;
+};
+
+// Keys and values read cached entries, which carry no gradient back to attn_k and attn_v
+static bool train_target_filter(const struct lm_ggml_tensor *weight, void *userdata) {
+    const train_targets *targets = static_cast<const train_targets *>(userdata);
+    for (const auto &name : targets->names) {
+        if (strstr(weight->name, name.c_str()) != nullptr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool train_param_filter(const struct lm_ggml_tensor *tensor, void *userdata) {
+    LM_GGML_UNUSED(userdata);
+    const size_t len = strlen(tensor->name);
+    return len > 7 && (strcmp(tensor->name + len - 7, ".lora_a") == 0 || strcmp(tensor->name + len - 7, ".lora_b") == 0);
+}
+
+static struct lm_ggml_opt_optimizer_params train_optimizer_params(void *userdata) {
+    return *static_cast<struct lm_ggml_opt_optimizer_params *>(userdata);
+}
+
+// Activation bytes per micro-batch token: the forward results the backward pass reads and their
+// gradients, with only the layer outputs kept across layers when checkpointing
+static size_t train_bytes_per_token(const cactus_model_profile &profile, int32_t seq_len, bool checkpoint_layers) {
+    const int64_t per_layer = 8 * profile.n_embd + 4 * profile.n_ff + 2 * profile.n_head * seq_len;
+    const int64_t layers = checkpoint_layers ? profile.n_layer * profile.n_embd + per_layer : profile.n_layer * per_layer;
+    return (size_t)(2 * (layers + 3 * profile.n_vocab)) * sizeof(float);
+}
+
+static int32_t train_pick_ubatch(const common_params &params, int32_t seq_len, const cactus_train_params &tp) {
+    if (tp.memory_budget == 0) {
+        return seq_len;
+    }
+    cactus_model_profile profile;
+    if (!read_model_profile(params.model.path, profile)) {
+        return seq_len;
+    }
+    const size_t per_token = train_bytes_per_token(profile, seq_len, tp.checkpoint_layers);
+    int32_t n_ubatch = seq_len;
+    while (n_ubatch > TRAIN_MIN_UBATCH && n_ubatch % 2 == 0 && (size_t)n_ubatch * per_token > tp.memory_budget) {
+        n_ubatch /= 2;
+    }
+    if ((size_t)n_ubatch * per_token > tp.memory_budget) {
+        LOG_WARNING("training micro-batch of %d tokens needs %zu KiB, over the %zu KiB budget", n_ubatch,
+                    ((size_t)n_ubatch * per_token) >> 10, tp.memory_budget >> 10);
+    }
+    return n_ubatch;
+}
+
+struct train_cursor {
+    int32_t epoch = 0;
+    int32_t window = 0;
+    int32_t n_windows = 0;
+    int32_t rank = 0;
+    double loss_sum = 0.0;
+};
+
+static bool read_train_cursor(const std::string &path, train_cursor &cursor) {
+    std::ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    nlohmann::json j = nlohmann::json::parse(in, nullptr, false);
+    if (j.is_discarded() || !j.is_object()) {
+        return false;
+    }
+    cursor.epoch = j.value("epoch", 0);
+    cursor.window = j.value("window", 0);
+    cursor.n_windows = j.value("n_windows", 0);
+    cursor.rank = j.value("rank", 0);
+    cursor.loss_sum = j.value("loss_sum", 0.0);
+    return true;
+}
+
+static bool write_train_cursor(const std::string &path, const train_cursor &cursor) {
+    nlohmann::json j = {
+        {"epoch", cursor.epoch},
+        {"window", cursor.window},
+        {"n_windows", cursor.n_windows},
+        {"rank", cursor.rank},
+        {"loss_sum", cursor.loss_sum},
+    };
+    std::ofstream out(path, std::ios::trunc);
+    out << j.dump();
+    return (bool)out;
+}
+
+// Written next to the destination and renamed over it, a run killed mid-save keeps the last checkpoint
+static bool save_train_checkpoint(const llama_adapter_lora *adapter, const llama_model *model,
+                                  const std::string &path, const train_cursor &cursor) {
+    const std::string tmp = path + ".tmp";
+    if (!llama_adapter_lora_save(adapter, model, tmp.c_str()) || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        LOG_ERROR("failed to save the LoRA checkpoint to %s", path.c_str());
+        return false;
+    }
+    const std::string cursor_path = path + ".json";
+    if (!write_train_cursor(cursor_path + ".tmp", cursor) || std::rename((cursor_path + ".tmp").c_str(), cursor_path.c_str()) != 0) {
+        LOG_ERROR("failed to save the training cursor to %s", cursor_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Copies the weights of a saved adapter into the trainable one, which keeps them in CPU memory
+static bool load_train_checkpoint(llama_model *model, const std::string &path, llama_adapter_lora *adapter) {
+    llama_adapter_lora *saved = llama_adapter_lora_init(model, path.c_str());
+    if (saved == nullptr) {
+        return false;
+    }
+    const bool ok = llama_adapter_lora_copy(adapter, saved);
+    llama_adapter_lora_free(saved);
+    return ok;
+}
+
+int cactus_context::trainLoraAdapter(const std::vector<std::string> &texts, const cactus_train_params &train_params,
+                                     const cactus_train_callback &callback) {
+    if (!ctx || !model) {
+        LOG_ERROR("Context or model not initialized for training a LoRA adapter.");
+        return -1;
+    }
+    if (train_params.output_path.empty()) {
+        LOG_ERROR("No output path for the trained LoRA adapter.");
+        return -1;
+    }
+    if (llama_model_is_recurrent(model)) {
+        LOG_ERROR("LoRA training is not supported for recurrent models.");
+        return -1;
+    }
+    const int32_t seq_len = train_params.seq_len / TRAIN_SEQ_ALIGN * TRAIN_SEQ_ALIGN;
+    if (seq_len <= 0) {
+        LOG_ERROR("Training sequence length %d is under %d tokens.", train_params.seq_len, TRAIN_SEQ_ALIGN);
+        return -1;
+    }
+
+    const llama_vocab *vocab = llama_model_get_vocab(model);
+    std::vector<llama_token> tokens;
+    for (const auto &text : texts) {
+        std::vector<llama_token> t = common_tokenize(vocab, text, true, true);
+        tokens.insert(tokens.end(), t.begin(), t.end());
+        if (llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL) {
+            tokens.push_back(llama_vocab_eos(vocab));
+        }
+    }
+    // every window predicts the token after its last one
+    const int32_t n_windows = tokens.empty() ? 0 : (int32_t)((tokens.size() - 1) / seq_len);
+    if (n_windows == 0) {
+        LOG_ERROR("Training text has %zu tokens, fewer than one window of %d.", tokens.size(), seq_len + 1);
+        return -1;
+    }
+
+    train_targets targets;
+    targets.names = train_params.target_modules;
+    if (targets.names.empty()) {
+        targets.names = { "attn_q.", "attn_output.", "ffn_gate.", "ffn_up.", "ffn_down." };
+    }
+    llama_adapter_lora *adapter = llama_adapter_lora_init_trainable(model, train_params.rank, train_params.alpha,
+                                                                   train_target_filter, &targets, train_params.seed);
+    if (adapter == nullptr) {
+        LOG_ERROR("Failed to create a trainable LoRA adapter of rank %d.", train_params.rank);
+        return -1;
+    }
+
+    train_cursor cursor;
+    cursor.n_windows = n_windows;
+    cursor.rank = train_params.rank;
+    train_cursor saved;
+    if (train_params.resume && read_train_cursor(train_params.output_path + ".json", saved)) {
+        if (saved.n_windows == n_windows && saved.rank == train_params.rank &&
+            load_train_checkpoint(model, train_params.output_path, adapter)) {
+            cursor = saved;
+            LOG_INFO("Resuming LoRA training at epoch %d, window %d of %d", cursor.epoch, cursor.window, n_windows);
+        } else {
+            LOG_WARNING("LoRA checkpoint %s does not match this run, training from scratch", train_params.output_path.c_str());
+        }
+    }
+
+    // F32 cache without flash attention, the backward pass has no kernels for the rest
+    const int32_t n_ubatch = train_pick_ubatch(params, seq_len, train_params);
+    llama_context_params cparams = common_context_params_to_llama(params);
+    cparams.n_ctx = seq_len;
+    cparams.n_batch = seq_len;
+    cparams.n_ubatch = n_ubatch;
+    cparams.n_seq_max = 1;
+    cparams.type_k = LM_GGML_TYPE_F32;
+    cparams.type_v = LM_GGML_TYPE_F32;
+    cparams.flash_attn = false;
+    cparams.embeddings = false;
+    llama_context *train_ctx = llama_init_from_model(model, cparams);
+    if (train_ctx == nullptr) {
+        LOG_ERROR("unable to create the training context, seq_len: %d", seq_len);
+        llama_adapter_lora_free(adapter);
+        return -1;
+    }
+    // never inside an interactive scope, so generation on the shared threadpool goes first
+    attach_shared_threadpool(train_ctx, params.cpuparams_batch);
+    llama_set_adapter_lora(train_ctx, adapter, 1.0f);
+
+    struct lm_ggml_opt_optimizer_params opt_pars = lm_ggml_opt_get_default_optimizer_params(nullptr);
+    opt_pars.adamw.alpha = train_params.learning_rate;
+    opt_pars.adamw.wd = train_params.weight_decay;
+
+    struct llama_opt_params lopt_params = {};
+    lopt_params.n_ctx_train = seq_len;
+    lopt_params.param_filter = train_param_filter;
+    lopt_params.param_filter_ud = nullptr;
+    lopt_params.get_opt_pars = train_optimizer_params;
+    lopt_params.get_opt_pars_ud = &opt_pars;
+    lopt_params.checkpoint_layers = train_params.checkpoint_layers;
+    lopt_params.opt_state_type = train_params.opt_state_type;
+    llama_opt_init(train_ctx, model, lopt_params);
+
+    // one datapoint, refilled with each window so the order and the cursor stay ours
+    lm_ggml_opt_dataset_t dataset = lm_ggml_opt_dataset_init(LM_GGML_TYPE_I32, LM_GGML_TYPE_I32, seq_len, seq_len, 1, 1);
+    lm_ggml_opt_result_t result = lm_ggml_opt_result_init();
+    llama_token *data = (llama_token *)lm_ggml_opt_dataset_data(dataset)->data;
+    llama_token *labels = (llama_token *)lm_ggml_opt_dataset_labels(dataset)->data;
+
+    LOG_INFO("LoRA training: %d windows of %d tokens, micro-batch %d, rank %d, %d epochs", n_windows, seq_len,
+             n_ubatch, train_params.rank, train_params.epochs);
+
+    is_interrupted = false;
+    int status = 0;
+    int32_t since_save = 0;
+    std::vector<int32_t> order(n_windows);
+    while (status == 0 && cursor.epoch < train_params.epochs) {
+        // reshuffled per epoch from the seed alone, a resumed run walks the same order
+        std::iota(order.begin(), order.end(), 0);
+        std::shuffle(order.begin(), order.end(), std::mt19937(train_params.seed + (uint32_t)cursor.epoch));
+
+        for (; cursor.window < n_windows; cursor.window++) {
+            while (cactus_interactive_busy() && !is_interrupted) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(TRAIN_IDLE_POLL_MS));
+            }
+            if (is_interrupted) {
+                status = 1;
+                break;
+            }
+
+            const size_t offset = (size_t)order[cursor.window] * seq_len;
+            memcpy(data, tokens.data() + offset, seq_len * sizeof(llama_token));
+            memcpy(labels, tokens.data() + offset + 1, seq_len * sizeof(llama_token));
+            lm_ggml_opt_result_reset(result);
+            llama_opt_epoch(train_ctx, dataset, result, nullptr, 1, nullptr, nullptr);
+            double loss = 0.0;
+            double unc = 0.0;
+            lm_ggml_opt_result_loss(result, &loss, &unc);
+            cursor.loss_sum += loss;
+
+            cactus_train_progress progress;
+            progress.epoch = cursor.epoch;
+            progress.window = cursor.window + 1;
+            progress.n_windows = n_windows;
+            progress.n_ubatch = n_ubatch;
+            progress.loss = (float)(cursor.loss_sum / (cursor.window + 1));
+            if (++since_save >= std::max(1, train_params.checkpoint_interval)) {
+                train_cursor next = cursor;
+                next.window++;
+                save_train_checkpoint(adapter, model, train_params.output_path, next);
+                since_save = 0;
+            }
+            if (callback && !callback(progress)) {
+                cursor.window++;
+                status = 1;
+                break;
+            }
+        }
+        if (status == 0) {
+            LOG_INFO("LoRA training epoch %d: loss %.4f", cursor.epoch, cursor.loss_sum / n_windows);
+            cursor.epoch++;
+            cursor.window = 0;
+            cursor.loss_sum = 0.0;
+        }
+    }
+
+    if (!save_train_checkpoint(adapter, model, train_params.output_path, cursor)) {
+        status = -1;
+    }
+
+    lm_ggml_opt_result_free(result);
+    lm_ggml_opt_dataset_free(dataset);
+    llama_free(train_ctx);
+    llama_adapter_lora_free(adapter);
+    return status;
+}
+
+} // namespace cactus
@@ -0,0 +1,177 @@
+#include "cactus.h"
+#include "common.h"
+#include <algorithm>
+#include <vector>
+#include <string>
+#include "llama.h"
+
+namespace cactus {
+
+static const size_t CACHE_REUSE_MIN_RUN = 32;
+
+void cactus_context::truncatePrompt(std::vector<llama_token> &prompt_tokens) {
+    const int n_size = (int)prompt_tokens.size();
+    const int n_keep = std::min(std::max(0, params.n_keep), n_size);
+    const int n_left = n_ctx - n_keep;
+
+    // Leave room for the reply instead of discarding half of the window
+    int n_headroom = n_left / 2;
+    if (params.n_predict > 0) {
+        n_headroom = std::min(n_headroom, params.n_predict);
+    }
+    const int n_target = std::max(n_keep, n_ctx - std::max(1, n_headroom));
+    if (n_size <= n_target) {
+        return;
+    }
+    const int n_drop = n_size - n_target;
+
+    int drop_start = n_keep;
+    int drop_end = n_keep + n_drop;
+    switch (truncation) {
+        case TRUNCATE_KEEP_HEAD:
+            drop_start = n_target;
+            drop_end = n_size;
+            break;
+        case TRUNCATE_MIDDLE_OUT: {
+            const int middle = n_keep + (n_size - n_keep) / 2;
+            drop_start = std::max(n_keep, std::min(middle - n_drop / 2, n_size - n_drop));
+            drop_end = drop_start + n_drop;
+            break;
+        }
+        case TRUNCATE_MESSAGE_BOUNDARY: {
+            // Drop whole messages after the first one (usually the system prompt) and after n_keep
+            const llama_token turn_start = turnStartToken();
+            std::vector<int> boundaries;
+            for (int i = 0; i < n_size && turn_start >= 0; i++) {
+                if (prompt_tokens[i] == turn_start) {
+                    boundaries.push_back(i);
+                }
+            }
+            const int first_kept = boundaries.empty() ? n_keep : std::max(n_keep, boundaries[0] + 1);
+            auto start = std::lower_bound(boundaries.begin(), boundaries.end(), first_kept);
+            auto end = start == boundaries.end() ? boundaries.end() : std::lower_bound(start, boundaries.end(), *start + n_drop);
+            if (end != boundaries.end()) {
+                drop_start = *start;
+                drop_end = *end;
+            } else {
+                LOG_VERBOSE("no message boundary fits the truncation, falling back to keep-tail", "");
+            }
+            break;
+        }
+        case TRUNCATE_KEEP_TAIL:
+        default:
+            break;
+    }
+
+    prompt_tokens.erase(prompt_tokens.begin() + drop_start, prompt_tokens.begin() + drop_end);
+
+    LOG_VERBOSE("input truncated, strategy: %d, n_ctx: %d, n_keep: %d, dropped: [%d, %d), new_tokens_size: %zu",
+        (int)truncation,
+        n_ctx,
+        n_keep,
+        drop_start,
+        drop_end,
+        prompt_tokens.size()
+    );
+
+    truncated = true;
+}
+
+llama_token cactus_context::turnStartToken() {
+    if (turn_start_token_ready) {
+        return turn_start_token;
+    }
+    turn_start_token_ready = true;
+    turn_start_token = -1;
+
+    const std::string sample = getFormattedChat("[{\"role\":\"user\",\"content\":\"x\"}]", "");
+    if (sample.empty()) {
+        return turn_start_token;
+    }
+    const llama_vocab *vocab = llama_model_get_vocab(model);
+    for (llama_token token : common_tokenize(ctx, sample, false, true)) {
+        if (token != llama_vocab_bos(vocab) && llama_vocab_is_control(vocab, token)) {
+            turn_start_token = token;
+            break;
+        }
+    }
+    return turn_start_token;
+}
+
+static uint64_t token_prefix_hash(const std::vector<llama_token> &tokens, size_t n) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < n; i++) {
+        hash = (hash ^ (uint32_t)tokens[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// StreamingLLM-style history compression: the message text is untouched, the prompt drops the
+// same middle span every turn so the cached sink and recent window keep matching, and
+// reuseShiftedCache() moves the window down in the KV cache instead of re-evaluating it
+void cactus_context::streamPrompt(std::vector<llama_token> &prompt_tokens) {
+    if (stream_window <= 0) {
+        stream_cut = 0;
+        stream_hash = 0;
+        return;
+    }
+    const size_t n_size = prompt_tokens.size();
+    const size_t n_sink = std::min((size_t)std::max(0, stream_sink), n_size);
+
+    // The conversation was edited or replaced below the cut; start over
+    if (stream_cut > n_size || stream_cut <= n_sink || token_prefix_hash(prompt_tokens, stream_cut) != stream_hash) {
+        stream_cut = 0;
+    }
+    size_t n_start = std::max(n_sink, stream_cut);
+
+    // Advance past the window with slack so the cache is shifted every few turns, not every turn
+    if (n_size - n_start > (size_t)stream_window) {
+        n_start = n_size - (size_t)stream_window * 3 / 4;
+        stream_cut = n_start;
+        stream_hash = token_prefix_hash(prompt_tokens, stream_cut);
+    }
+    if (n_start <= n_sink) {
+        return;
+    }
+
+    prompt_tokens.erase(prompt_tokens.begin() + n_sink, prompt_tokens.begin() + n_start);
+    LOG_VERBOSE("streamed prompt, n_sink: %zu, evicted: %zu, kept: %zu", n_sink, n_start - n_sink, prompt_tokens.size());
+}
+
+size_t cactus_context::reuseShiftedCache(const std::vector<llama_token> &prompt_tokens, size_t n_prefix) {
+    if (n_prefix >= prompt_tokens.size() || n_prefix >= n_past || !llama_kv_self_can_shift(ctx)) {
+        return 0;
+    }
+
+    // Find where the rest of the prompt continues in the cache, e.g. after earlier turns were evicted
+    const size_t n_min = std::min(CACHE_REUSE_MIN_RUN, prompt_tokens.size() - n_prefix);
+    for (size_t head = n_prefix + 1; head < n_past; head++) {
+        if (embd[head] != prompt_tokens[n_prefix]) {
+            continue;
+        }
+        size_t n_match = 0;
+        while (head + n_match < n_past && n_prefix + n_match < prompt_tokens.size() &&
+               embd[head + n_match] == prompt_tokens[n_prefix + n_match]) {
+            n_match++;
+        }
+        if (n_match < n_min) {
+            continue;
+        }
+
+        const size_t n_evict = head - n_prefix;
+        llama_kv_self_seq_rm (ctx, seq_id, n_prefix, head);
+        if (!unsharePrefixCells((llama_pos)head)) {
+            return 0;
+        }
+        llama_kv_self_seq_add(ctx, seq_id, head, n_past, -(llama_pos)n_evict);
+        embd.erase(embd.begin() + n_prefix, embd.begin() + head);
+        n_past -= n_evict;
+        n_cache_shifted += n_match;
+
+        LOG_VERBOSE("reused %zu cached tokens after evicting %zu at %zu", n_match, n_evict, n_prefix);
+        return n_match;
+    }
+    return 0;
+}
+
+} // namespace cactus
@@ -8,7 +8,21 @@
 #include <map>
 #include <algorithm>
 #include <cmath>
+#include <cctype>
+#include <cstring>
 #include <thread>
+#include <deque>
+#include <complex>
+#include <condition_variable>
+#include <atomic>
+#include <mutex>
+#include <unistd.h>
+#include "json.hpp"
+#if defined(__APPLE__)
+#include <Accelerate/Accelerate.h>
+#endif
+
+using json = nlohmann::ordered_json;
 
 namespace cactus {
 
@@ -19,125 +33,123 @@ the<|t_0.08|><|code_start|><|257|><|740|><|636|><|913|><|788|><|1703|><|code_end
 overall<|t_0.36|><|code_start|><|127|><|201|><|191|><|774|><|700|><|532|><|1056|><|557|><|798|><|298|><|1741|><|747|><|1662|><|1617|><|1702|><|1527|><|368|><|1588|><|1049|><|1008|><|1625|><|747|><|1576|><|728|><|1019|><|1696|><|1765|><|code_end|>
 package<|t_0.56|><|code_start|><|935|><|584|><|1319|><|627|><|1016|><|1491|><|1344|><|1117|><|1526|><|1040|><|239|><|1435|><|951|><|498|><|723|><|1180|><|535|><|789|><|1649|><|1637|><|78|><|465|><|1668|><|901|><|595|><|1675|><|117|><|1009|><|1667|><|320|><|840|><|79|><|507|><|1762|><|1508|><|1228|><|1768|><|802|><|1450|><|1457|><|232|><|639|><|code_end|>)";
 
-static const std::map<int, std::string> ones = {
-    {0, "zero"}, {1, "one"}, {2, "two"}, {3, "three"}, {4, "four"},
-    {5, "five"}, {6, "six"}, {7, "seven"}, {8, "eight"}, {9, "nine"},
-    {10, "ten"}, {11, "eleven"}, {12, "twelve"}, {13, "thirteen"}, {14, "fourteen"},
-    {15, "fifteen"}, {16, "sixteen"}, {17, "seventeen"}, {18, "eighteen"}, {19, "nineteen"}
+static const char * const ones[] = {
+    "zero", "one", "two", "three", "four", "five", "six", "seven", "eight", "nine",
+    "ten", "eleven", "twelve", "thirteen", "fourteen", "fifteen", "sixteen", "seventeen", "eighteen", "nineteen"
 };
 
-static const std::map<int, std::string> tens = {
-    {2, "twenty"}, {3, "thirty"}, {4, "forty"}, {5, "fifty"},
-    {6, "sixty"}, {7, "seventy"}, {8, "eighty"}, {9, "ninety"}
+static const char * const tens[] = {
+    "", "", "twenty", "thirty", "forty", "fifty", "sixty", "seventy", "eighty", "ninety"
 };
 
-static std::string convert_less_than_thousand(int num) {
-    std::string result;
-
-    if (num >= 100) {
-        result += ones.at(num / 100) + " hundred ";
-        num %= 100;
+// One scan from raw text to the separated lowercase words the OuteTTS prompt wants: numbers (digits
+// with an optional fraction) become words as they are met, '-', '_', '/', ',', '.', '\' and
+// whitespace separate words, and anything else outside a-z is dropped. Words go straight into the
+// output, a separator between two of them, so per-version rules only change what put() emits.
+struct tts_text_normalizer {
+    const std::string &separator;
+    std::string out;
+    bool pending_separator = false;
+
+    tts_text_normalizer(const std::string &separator, size_t n_input) : separator(separator) {
+        out.reserve(n_input + n_input/2);
     }
 
-    if (num >= 20) {
-        result += tens.at(num / 10);
-        if (num % 10 > 0) {
-            result += "-" + ones.at(num % 10);
+    void put(char c) {
+        c = (char)tolower((unsigned char)c);
+        if (c >= 'a' && c <= 'z') {
+            if (pending_separator && !out.empty()) {
+                out += separator;
+            }
+            pending_separator = false;
+            out += c;
+        } else if (c != '\0' && (isspace((unsigned char)c) || strchr("-_/,.\\", c) != nullptr)) {
+            pending_separator = true;
         }
-    } else if (num > 0) {
-        result += ones.at(num);
     }
 
-    return result;
-}
-
-static std::string number_to_words(const std::string & number_str) {
-    try {
-        size_t decimal_pos = number_str.find('.');
-        std::string integer_part = number_str.substr(0, decimal_pos);
-
-        int int_number = std::stoi(integer_part);
-        std::string result;
-
-        if (int_number == 0) {
-            result = "zero";
-        } else {
-            if (int_number >= 1000000000) {
-                int billions = int_number / 1000000000;
-                result += convert_less_than_thousand(billions) + " billion ";
-                int_number %= 1000000000;
-            }
+    void put(const char *word) {
+        while (*word) {
+            put(*word++);
+        }
+    }
 
-            if (int_number >= 1000000) {
-                int millions = int_number / 1000000;
-                result += convert_less_than_thousand(millions) + " million ";
-                int_number %= 1000000;
+    void putBelowThousand(int num) {
+        if (num >= 100) {
+            put(ones[num / 100]);
+            put(" hundred ");
+            num %= 100;
+        }
+        if (num >= 20) {
+            put(tens[num / 10]);
+            if (num % 10 > 0) {
+                put(' ');
+                put(ones[num % 10]);
             }
+        } else if (num > 0) {
+            put(ones[num]);
+        }
+    }
 
-            if (int_number >= 1000) {
-                int thousands = int_number / 1000;
-                result += convert_less_than_thousand(thousands) + " thousand ";
-                int_number %= 1000;
+    // Digits [begin, point) and, when point != end, the fraction digits (point, end)
+    void putNumber(const char *begin, const char *point, const char *end) {
+        int64_t value = 0;
+        for (const char *p = begin; p < point; p++) {
+            value = value * 10 + (*p - '0');
+            if (value > INT32_MAX) {
+                put(' ');
+                return;
             }
-
-            if (int_number > 0) {
-                result += convert_less_than_thousand(int_number);
+        }
+        if (value == 0) {
+            put("zero");
+        }
+        static const struct { int64_t scale; const char *name; } scales[] = {
+            { 1000000000, " billion " }, { 1000000, " million " }, { 1000, " thousand " },
+        };
+        for (const auto &scale : scales) {
+            if (value >= scale.scale) {
+                putBelowThousand((int)(value / scale.scale));
+                put(scale.name);
+                value %= scale.scale;
             }
         }
-
-        if (decimal_pos != std::string::npos) {
-            result += " point";
-            std::string decimal_part = number_str.substr(decimal_pos + 1);
-            for (char digit : decimal_part) {
-                result += " " + ones.at(digit - '0');
+        putBelowThousand((int)value);
+        if (point != end) {
+            put(" point");
+            for (const char *p = point + 1; p < end; p++) {
+                put(' ');
+                put(ones[*p - '0']);
             }
         }
-
-        return result;
-    } catch (const std::exception& e) {
-        return " ";
-    }
-}
-
-static std::string replace_numbers_with_words(const std::string & input_text) {
-    std::regex number_pattern(R"(\d+(\.\d+)?)");
-    std::string result;
-    auto it = std::sregex_iterator(input_text.begin(), input_text.end(), number_pattern);
-    auto end = std::sregex_iterator();
-
-    size_t last_pos = 0;
-    for (std::sregex_iterator i = it; i != end; ++i) {
-        const std::smatch& match = *i;
-        result.append(input_text, last_pos, match.position() - last_pos);
-        result.append(number_to_words(match.str()));
-        last_pos = match.position() + match.length();
     }
-    result.append(input_text, last_pos);
-
-    return result;
-}
+};
 
 static std::string process_text(const std::string & text, const tts_type tts_type = TTS_OUTETTS_V0_2) {
-    std::string processed_text = replace_numbers_with_words(text);
-
-    std::transform(processed_text.begin(), processed_text.end(),
-                  processed_text.begin(), ::tolower);
-
-    std::regex special_chars(R"([-_/,\.\\])");
-    processed_text = std::regex_replace(processed_text, special_chars, " ");
-
-    std::regex non_alpha(R"([^a-z\s])");
-    processed_text = std::regex_replace(processed_text, non_alpha, "");
-
-    std::regex multiple_spaces(R"(\s+)");
-    processed_text = std::regex_replace(processed_text, multiple_spaces, " ");
-
-    processed_text = std::regex_replace(processed_text, std::regex(R"(^\s+|\s+$)"), "");
-
-    std::string separator = (tts_type == TTS_OUTETTS_V0_3) ? "<|space|>" : "<|text_sep|>";
-    processed_text = std::regex_replace(processed_text, std::regex(R"(\s)"), separator);
-
-    return processed_text;
+    const std::string separator = (tts_type == TTS_OUTETTS_V0_3) ? "<|space|>" : "<|text_sep|>";
+    tts_text_normalizer normalizer(separator, text.size());
+
+    const char *p = text.data();
+    const char *end = p + text.size();
+    while (p < end) {
+        if (!isdigit((unsigned char)*p)) {
+            normalizer.put(*p++);
+            continue;
+        }
+        const char *begin = p;
+        while (p < end && isdigit((unsigned char)*p)) {
+            p++;
+        }
+        const char *point = p;
+        if (p + 1 < end && *p == '.' && isdigit((unsigned char)p[1])) {
+            p++;
+            while (p < end && isdigit((unsigned char)*p)) {
+                p++;
+            }
+        }
+        normalizer.putNumber(begin, point, point == p ? point : p);
+    }
+    return std::move(normalizer.out);
 }
 
 static void fill_hann_window(int length, bool periodic, float * output) {
@@ -150,162 +162,525 @@ static void fill_hann_window(int length, bool periodic, float * output) {
     }
 }
 
-static void twiddle(float * real, float * imag, int k, int N) {
-    float angle = 2 * M_PI * k / N;
-    *real = cos(angle);
-    *imag = sin(angle);
-}
-
-static void irfft(int n, const float * inp_cplx, float * out_real) {
-    int N = n / 2 + 1;
+// Inverse real FFT of the vocoder's n_fft spectrum, for vocoders on the CPU, where the graph's ISTFT
+// would be a direct transform as one matrix product.
+// vDSP on Apple; elsewhere a half-length complex FFT (radix 4/2/5, Cooley-Tukey as in kissfft)
+// with precomputed twiddles and the usual even/odd split for a real output.
+struct cactus_vocoder_istft {
+    int n = 0;
+    int n_hop = 0;
+    int n_pad = 0;
+    std::vector<float> hann;
+#if defined(__APPLE__)
+    vDSP_DFT_Setup setup = nullptr;
+#else
+    // (radix, remaining length) per stage; twiddles are e^{+2*pi*i*k/(n/2)}, split ones e^{+2*pi*i*k/n}
+    std::vector<int> factors;
+    std::vector<std::complex<float>> twiddles;
+    std::vector<std::complex<float>> split;
+#endif
+    // 1/envelope, the sum of the squared windows overlapping a sample: over the first and last n_pad
+    // samples of an utterance, and between them, where it is periodic in n_hop, by phase
+    std::vector<float> inv_env_head;
+    std::vector<float> inv_env_mid;
+    std::vector<float> inv_env_tail;
+
+    cactus_vocoder_istft(int n_fft, int n_hop);
+    ~cactus_vocoder_istft();
+
+    void initEnvelope();
+    // Divides an utterance's samples by the sum of the squared windows overlapping each
+    void normalize(float * audio, size_t n_total) const;
+};
 
-    std::vector<float> real_input(N);
-    std::vector<float> imag_input(N);
-    for (int i = 0; i < N; ++i) {
-        real_input[i] = inp_cplx[2 * i];
-        imag_input[i] = inp_cplx[2 * i + 1];
-    }
+// Spectrum bins 0..n/2 as separate real and imaginary parts, the layout the transform reads
+struct istft_scratch {
+    std::vector<float> re;
+    std::vector<float> im;
+    std::vector<float> out_re;
+    std::vector<float> out_im;
+    std::vector<std::complex<float>> in;
+    std::vector<std::complex<float>> out;
+};
 
-    std::vector<float> real_output(n);
-    std::vector<float> imag_output(n);
+#if defined(__APPLE__)
 
-    for (int k = 0; k < n; ++k) {
-        real_output[k] = 0.0f;
-        imag_output[k] = 0.0f;
-        for (int m = 0; m < N; ++m) {
-            float twiddle_real;
-            float twiddle_imag;
+cactus_vocoder_istft::cactus_vocoder_istft(int n_fft, int n_hop_) : n(n_fft), n_hop(n_hop_), n_pad((n_fft - n_hop_)/2), hann(n_fft) {
+    fill_hann_window(n, true, hann.data());
+    setup = vDSP_DFT_zrop_CreateSetup(nullptr, (vDSP_Length)n, vDSP_DFT_INVERSE);
+    initEnvelope();
+}
 
-            twiddle(&twiddle_real, &twiddle_imag, k * m, n);
+cactus_vocoder_istft::~cactus_vocoder_istft() {
+    if (setup) {
+        vDSP_DFT_DestroySetup(setup);
+    }
+}
 
-            real_output[k] += real_input[m] * twiddle_real - imag_input[m] * twiddle_imag;
-            imag_output[k] += real_input[m] * twiddle_imag + imag_input[m] * twiddle_real;
+#else
+
+cactus_vocoder_istft::cactus_vocoder_istft(int n_fft, int n_hop_) : n(n_fft), n_hop(n_hop_), n_pad((n_fft - n_hop_)/2), hann(n_fft) {
+    fill_hann_window(n, true, hann.data());
+    const int m = n / 2;
+    int rest = m;
+    int p = 4;
+    while (rest > 1) {
+        while (rest % p != 0) {
+            p = p == 4 ? 2 : p == 2 ? 3 : p + 2;
+            if (p * p > rest) {
+                p = rest;
+            }
         }
+        rest /= p;
+        factors.push_back(p);
+        factors.push_back(rest);
     }
-
-    for (int i = 0; i < n; ++i) {
-        out_real[i] = real_output[i] / N;
+    twiddles.resize(m);
+    for (int k = 0; k < m; k++) {
+        const double angle = 2.0 * M_PI * k / m;
+        twiddles[k] = std::complex<float>((float)cos(angle), (float)sin(angle));
     }
+    split.resize(m + 1);
+    for (int k = 0; k <= m; k++) {
+        const double angle = 2.0 * M_PI * k / n;
+        split[k] = std::complex<float>((float)cos(angle), (float)sin(angle));
+    }
+    initEnvelope();
 }
 
-static void fold(const std::vector<float> & data, int64_t n_out, int64_t n_win, int64_t n_hop, int64_t n_pad, std::vector<float> & output) {
-    int64_t output_height = n_out;
-    int64_t kernel_w = n_win;
-    int64_t stride_w = n_hop;
-    int64_t width    = n_out;
-
-    output.resize(width, 0.0f);
+cactus_vocoder_istft::~cactus_vocoder_istft() = default;
 
-    int64_t col_idx = 0;
-    for (int64_t w_col = 0; w_col < width; ++w_col) {
-        int64_t start = w_col * stride_w - n_pad;
-        int64_t end   = start + kernel_w;
+typedef std::complex<float> istft_cpx;
 
-        for (int64_t w_im = start; w_im < end; ++w_im) {
-            if (w_im >= 0 && w_im < output_height && col_idx < (int64_t) data.size()) {
-                output[w_im] += data[col_idx];
-            }
-            col_idx++;
-        }
+static void istft_butterfly2(istft_cpx * out, size_t fstride, const istft_cpx * tw, int m) {
+    for (int k = 0; k < m; k++) {
+        const istft_cpx t = out[k + m] * tw[k * fstride];
+        out[k + m] = out[k] - t;
+        out[k] += t;
     }
-
-    output.resize(n_out - 2 * n_pad);
 }
 
-static std::vector<float> embd_to_audio(
-        const float * embd,
-        const int n_codes,
-        const int n_embd,
-        const int n_thread) {
-    const int n_fft = 1280;
-    const int n_hop = 320;
-    const int n_win = 1280;
-    const int n_pad = (n_win - n_hop)/2;
-    const int n_out = (n_codes - 1)*n_hop + n_win;
+static void istft_butterfly4(istft_cpx * out, size_t fstride, const istft_cpx * tw, int m) {
+    for (int k = 0; k < m; k++) {
+        const istft_cpx s0 = out[k + m] * tw[k * fstride];
+        const istft_cpx s1 = out[k + 2*m] * tw[2 * k * fstride];
+        const istft_cpx s2 = out[k + 3*m] * tw[3 * k * fstride];
+        const istft_cpx s5 = out[k] - s1;
+        const istft_cpx s3 = s0 + s2;
+        const istft_cpx s4 = s0 - s2;
+        out[k] += s1;
+        out[k + 2*m] = out[k] - s3;
+        out[k] += s3;
+        out[k + m]   = istft_cpx(s5.real() - s4.imag(), s5.imag() + s4.real());
+        out[k + 3*m] = istft_cpx(s5.real() + s4.imag(), s5.imag() - s4.real());
+    }
+}
 
-    std::vector<float> hann(n_fft);
+static void istft_butterfly5(istft_cpx * out, size_t fstride, const istft_cpx * tw, int m) {
+    const istft_cpx ya = tw[fstride * m];
+    const istft_cpx yb = tw[fstride * 2 * m];
+    for (int k = 0; k < m; k++) {
+        const istft_cpx s0 = out[k];
+        const istft_cpx s1 = out[k + m] * tw[k * fstride];
+        const istft_cpx s2 = out[k + 2*m] * tw[2 * k * fstride];
+        const istft_cpx s3 = out[k + 3*m] * tw[3 * k * fstride];
+        const istft_cpx s4 = out[k + 4*m] * tw[4 * k * fstride];
+        const istft_cpx s7 = s1 + s4;
+        const istft_cpx s10 = s1 - s4;
+        const istft_cpx s8 = s2 + s3;
+        const istft_cpx s9 = s2 - s3;
+
+        out[k] = s0 + s7 + s8;
+        const istft_cpx s5 = s0 + s7 * ya.real() + s8 * yb.real();
+        const istft_cpx s6(s10.imag() * ya.imag() + s9.imag() * yb.imag(), -(s10.real() * ya.imag() + s9.real() * yb.imag()));
+        out[k + m]   = s5 - s6;
+        out[k + 4*m] = s5 + s6;
+        const istft_cpx s11 = s0 + s7 * yb.real() + s8 * ya.real();
+        const istft_cpx s12(s9.imag() * ya.imag() - s10.imag() * yb.imag(), s10.real() * yb.imag() - s9.real() * ya.imag());
+        out[k + 2*m] = s11 + s12;
+        out[k + 3*m] = s11 - s12;
+    }
+}
 
-    fill_hann_window(hann.size(), true, hann.data());
+// Any other radix; only reached for n_fft sizes with factors above 5
+static void istft_butterfly_generic(istft_cpx * out, size_t fstride, const istft_cpx * tw, int m, int p) {
+    const size_t n_tw = fstride * m * p;
+    std::vector<istft_cpx> scratch(p);
+    for (int u = 0; u < m; u++) {
+        for (int q = 0; q < p; q++) {
+            scratch[q] = out[u + q * m];
+        }
+        for (int q = 0; q < p; q++) {
+            const size_t k = u + q * m;
+            size_t idx = 0;
+            istft_cpx sum = scratch[0];
+            for (int r = 1; r < p; r++) {
+                idx = (idx + fstride * k) % n_tw;
+                sum += scratch[r] * tw[idx];
+            }
+            out[k] = sum;
+        }
+    }
+}
 
-    int n_spec = n_embd*n_codes;
+static void istft_work(istft_cpx * out, const istft_cpx * in, size_t fstride, const int * factors, const istft_cpx * tw) {
+    const int p = factors[0];
+    const int m = factors[1];
+    if (m == 1) {
+        for (int q = 0; q < p; q++) {
+            out[q] = in[q * fstride];
+        }
+    } else {
+        for (int q = 0; q < p; q++) {
+            istft_work(out + q * m, in + q * fstride, fstride * p, factors + 2, tw);
+        }
+    }
+    switch (p) {
+        case 2:  istft_butterfly2(out, fstride, tw, m); break;
+        case 4:  istft_butterfly4(out, fstride, tw, m); break;
+        case 5:  istft_butterfly5(out, fstride, tw, m); break;
+        default: istft_butterfly_generic(out, fstride, tw, m, p); break;
+    }
+}
 
-    std::vector<float> E (n_spec);
-    std::vector<float> S (n_spec);
-    std::vector<float> ST(n_spec);
+#endif
+
+// Matches the former direct sum: out[t] = Re(sum_{k<=n/2} X[k] e^{+2*pi*i*k*t/n}) / (n/2 + 1). That is
+// the Hermitian inverse of X with the DC and Nyquist bins doubled, scaled by 1 / (2 * (n/2 + 1)).
+// X is read from scratch.re and scratch.im (n/2 + 1 each), which are overwritten.
+static void irfft(const cactus_vocoder_istft & plan, istft_scratch & scratch, float * out_real) {
+    const int m = plan.n / 2;
+    const float scale = 1.0f / (2.0f * (m + 1));
+    float * re = scratch.re.data();
+    float * im = scratch.im.data();
+
+#if defined(__APPLE__)
+    scratch.out_re.resize(m);
+    scratch.out_im.resize(m);
+    // zrop packs the real DC and Nyquist bins into the first element
+    im[0] = 2.0f * re[m];
+    re[0] = 2.0f * re[0];
+    vDSP_DFT_Execute(plan.setup, re, im, scratch.out_re.data(), scratch.out_im.data());
+    DSPSplitComplex split = { scratch.out_re.data(), scratch.out_im.data() };
+    vDSP_ztoc(&split, 1, reinterpret_cast<DSPComplex *>(out_real), 2, (vDSP_Length)m);
+    vDSP_vsmul(out_real, 1, &scale, out_real, 1, (vDSP_Length)plan.n);
+#else
+    scratch.in.resize(m);
+    scratch.out.resize(m);
+    re[0] = 2.0f * re[0];
+    im[0] = 0.0f;
+    re[m] = 2.0f * re[m];
+    im[m] = 0.0f;
+    for (int k = 0; k < m; k++) {
+        const istft_cpx a(re[k], im[k]);
+        const istft_cpx b(re[m - k], -im[m - k]);
+        const istft_cpx even = a + b;
+        const istft_cpx odd = (a - b) * plan.split[k];
+        scratch.in[k] = istft_cpx(even.real() - odd.imag(), even.imag() + odd.real());
+    }
+    istft_work(scratch.out.data(), scratch.in.data(), 1, plan.factors.data(), plan.twiddles.data());
+    for (int j = 0; j < m; j++) {
+        out_real[2 * j]     = scratch.out[j].real() * scale;
+        out_real[2 * j + 1] = scratch.out[j].imag() * scale;
+    }
+#endif
+}
 
-    for (int l = 0; l < n_codes; ++l) {
-        for (int k = 0; k < n_embd; ++k) {
-            E[k*n_codes + l] = embd[l*n_embd + k];
+// Adds frames [first_frame, first_frame + n_frames) to out, whose element 0 is sample base. Frame l
+// covers samples [l*n_hop - n_pad, l*n_hop - n_pad + n); those outside out are dropped.
+static void overlap_add(const cactus_vocoder_istft & plan, const float * frames, size_t first_frame, int n_frames,
+                        size_t base, std::vector<float> & out) {
+    const int64_t n_out = (int64_t)out.size();
+    for (int f = 0; f < n_frames; f++) {
+        const int64_t at = (int64_t)(first_frame + f)*plan.n_hop - plan.n_pad - (int64_t)base;
+        const int64_t j_begin = std::max<int64_t>(0, -at);
+        const int64_t j_end = std::min<int64_t>(plan.n, n_out - at);
+        const float * frame = frames + (size_t)f*plan.n;
+        for (int64_t j = j_begin; j < j_end; j++) {
+            out[at + j] += frame[j];
         }
     }
+}
 
-    for (int k = 0; k < n_embd/2; ++k) {
-        for (int l = 0; l < n_codes; ++l) {
-            float mag = E[(k           )*n_codes + l];
-            float phi = E[(k + n_embd/2)*n_codes + l];
+// The envelope of an 8-frame utterance, summed frame by frame like the audio, holds every distinct value
+void cactus_vocoder_istft::initEnvelope() {
+    const int n_frames = 8;
+    std::vector<float> env((size_t)n_frames*n_hop, 0.0f);
+    std::vector<float> hann2(n);
+    for (int j = 0; j < n; j++) {
+        hann2[j] = hann[j] * hann[j];
+    }
+    for (int l = 0; l < n_frames; l++) {
+        overlap_add(*this, hann2.data(), l, 1, 0, env);
+    }
+    inv_env_head.resize(n_pad);
+    inv_env_tail.resize(n_pad);
+    inv_env_mid.resize(n_hop);
+    for (int i = 0; i < n_pad; i++) {
+        inv_env_head[i] = 1.0f / env[i];
+        inv_env_tail[i] = 1.0f / env[env.size() - n_pad + i];
+    }
+    for (int i = 0; i < n_hop; i++) {
+        const int pos = n_pad + i;
+        inv_env_mid[pos % n_hop] = 1.0f / env[pos];
+    }
+}
 
-            mag = exp(mag);
+void cactus_vocoder_istft::normalize(float * audio, size_t n_total) const {
+    // Head and tail overlap below three frames; such utterances are summed directly
+    if (n_total < (size_t)(2*n_pad + n_hop)) {
+        std::vector<float> env(n_total, 0.0f);
+        std::vector<float> hann2(n);
+        for (int j = 0; j < n; j++) {
+            hann2[j] = hann[j] * hann[j];
+        }
+        for (size_t l = 0; l * n_hop < n_total; l++) {
+            overlap_add(*this, hann2.data(), l, 1, 0, env);
+        }
+        for (size_t i = 0; i < n_total; i++) {
+            audio[i] /= env[i];
+        }
+        return;
+    }
+    const size_t tail = n_total - n_pad;
+    size_t i = 0;
+    for (; i < (size_t)n_pad; i++) {
+        audio[i] *= inv_env_head[i];
+    }
+    size_t phase = i % n_hop;
+    for (; i < tail; i++) {
+        audio[i] *= inv_env_mid[phase];
+        phase = phase + 1 == (size_t)n_hop ? 0 : phase + 1;
+    }
+    for (; i < n_total; i++) {
+        audio[i] *= inv_env_tail[i - tail];
+    }
+}
 
-            if (mag > 1e2) {
-                mag = 1e2;
-            }
-            S[2*(k*n_codes + l) + 0] = mag*cosf(phi);
-            S[2*(k*n_codes + l) + 1] = mag*sinf(phi);
+// Streamed speech vocodes this many codes at a time, each window seeing as many again of the codes
+// around it, ~0.1 s; the vocoder is not causal, so a code's samples depend on its neighbours
+static const size_t SPEECH_STREAM_DEFAULT_CODES = 32;
+static const size_t SPEECH_STREAM_CONTEXT_CODES = 8;
+// Chunks waiting for the vocoder before generation blocks on it
+static const size_t SPEECH_STREAM_QUEUE_CHUNKS = 2;
+
+// The batch and, for a vocoder on the CPU, the FFT buffers reused by every vocoding call, with
+// persistent workers for the per-frame DSP, which runs several times a second while speech streams.
+// Workers sleep between calls; the calling thread takes tasks too. Buffers only grow, so a call that
+// fits the largest window seen so far allocates nothing.
+struct cactus_vocoder_workspace {
+    std::vector<std::thread> threads;
+    std::mutex run_mutex;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    void (*job)(void * arg, int task, int worker) = nullptr;
+    void * job_arg = nullptr;
+    std::atomic<int> next_task{0};
+    int n_tasks = 0;
+    int n_busy = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+
+    std::vector<istft_scratch> scratch; // one per worker, the caller's first
+    std::vector<float> frames;
+    std::vector<float> audio;           // PCM of the last call when the ISTFT runs here
+    llama_batch batch = {};
+    int32_t batch_capacity = 0;
+
+    explicit cactus_vocoder_workspace(int n_threads) : scratch(std::max(1, n_threads)) {
+        for (int i = 1; i < (int)scratch.size(); i++) {
+            threads.emplace_back([this, i]() { workerMain(i); });
         }
     }
 
-    for (int l = 0; l < n_codes; ++l) {
-        for (int k = 0; k < n_embd/2; ++k) {
-            ST[l*n_embd + 2*k + 0] = S[2*(k*n_codes + l) + 0];
-            ST[l*n_embd + 2*k + 1] = S[2*(k*n_codes + l) + 1];
+    ~cactus_vocoder_workspace() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto & thread : threads) {
+            thread.join();
+        }
+        if (batch_capacity > 0) {
+            llama_batch_free(batch);
         }
     }
 
-    std::vector<float> res  (n_codes*n_fft);
-    std::vector<float> hann2(n_codes*n_fft);
+    void work(int worker) {
+        for (int task; (task = next_task.fetch_add(1)) < n_tasks;) {
+            job(job_arg, task, worker);
+        }
+    }
 
-    std::vector<std::thread> workers(n_thread);
-    for (int i = 0; i < n_thread; ++i) {
-        workers[i] = std::thread([&, i]() {
-            for (int l = i; l < n_codes; l += n_thread) {
-                irfft(n_fft, ST.data() + l*n_embd, res.data() + l*n_fft);
-                for (int j = 0; j < n_fft; ++j) {
-                    res  [l*n_fft + j] *= hann[j];
-                    hann2[l*n_fft + j]  = hann[j] * hann[j];
-                }
+    void workerMain(int worker) {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            lock.unlock();
+            work(worker);
+            lock.lock();
+            if (--n_busy == 0) {
+                done.notify_one();
             }
-        });
+        }
     }
-    for (int i = 0; i < n_thread; ++i) {
-        workers[i].join();
+
+    // Calls fn(task, worker) for every task in [0, count), worker indexing scratch
+    template <typename F>
+    void run(int count, F & fn) {
+        std::lock_guard<std::mutex> run_lock(run_mutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = [](void * arg, int task, int worker) { (*static_cast<F *>(arg))(task, worker); };
+            job_arg = &fn;
+            n_tasks = count;
+            next_task = 0;
+            n_busy = (int)threads.size();
+            generation++;
+        }
+        wake.notify_all();
+        work(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&]() { return n_busy == 0; });
     }
+};
 
-    std::vector<float> audio;
-    std::vector<float> env;
+// Each code comes back as n_fft/4 samples of PCM, from the graph's ISTFT or the FFT below
+static int vocoder_hop(const llama_model * model) {
+    return (llama_model_n_embd(model) - 2)/4;
+}
 
-    fold(res,   n_out, n_win, n_hop, n_pad, audio);
-    fold(hann2, n_out, n_win, n_hop, n_pad, env);
+// Magnitude/phase embeddings of n_codes codes to their windowed time-domain frames, n_fft each.
+// Each frame's log-magnitudes and phases become the transform's real/imaginary input in one pass.
+static void vocoder_frames(
+        const cactus_vocoder_istft & istft,
+        cactus_vocoder_workspace & workspace,
+        const float * embd,
+        const int n_codes,
+        const int n_embd) {
+    const int n_fft = istft.n;
+    const int n_bins = n_embd/2;
+    std::vector<float> & res = workspace.frames;
+    res.resize((size_t)n_codes*n_fft);
+
+    auto frame = [&](int l, int worker) {
+        istft_scratch & scratch = workspace.scratch[worker];
+        scratch.re.resize(n_bins);
+        scratch.im.resize(n_bins);
+        float * re = scratch.re.data();
+        float * im = scratch.im.data();
+        const float * mag = embd + (size_t)l*n_embd;
+        const float * phi = mag + n_bins;
+        float * out = res.data() + (size_t)l*n_fft;
+#if defined(__APPLE__)
+        // re holds the magnitudes until they scale the sines and cosines
+        const float lo = 0.0f;
+        const float hi = 1e2f;
+        vvexpf(re, mag, &n_bins);
+        vDSP_vclip(re, 1, &lo, &hi, re, 1, (vDSP_Length)n_bins);
+        scratch.out_re.resize(n_bins);
+        scratch.out_im.resize(n_bins);
+        vvsincosf(scratch.out_im.data(), scratch.out_re.data(), phi, &n_bins);
+        vDSP_vmul(re, 1, scratch.out_im.data(), 1, im, 1, (vDSP_Length)n_bins);
+        vDSP_vmul(re, 1, scratch.out_re.data(), 1, re, 1, (vDSP_Length)n_bins);
+        irfft(istft, scratch, out);
+        vDSP_vmul(out, 1, istft.hann.data(), 1, out, 1, (vDSP_Length)n_fft);
+#else
+        for (int k = 0; k < n_bins; ++k) {
+            const float m = std::min(expf(mag[k]), 1e2f);
+            re[k] = m*cosf(phi[k]);
+            im[k] = m*sinf(phi[k]);
+        }
+        irfft(istft, scratch, out);
+        for (int j = 0; j < n_fft; ++j) {
+            out[j] *= istft.hann[j];
+        }
+#endif
+    };
+    workspace.run(n_codes, frame);
+}
+
+// The first n_pad samples of the first frame precede the utterance, which ends n_pad into the last
+static void embd_to_audio(
+        const cactus_vocoder_istft & istft,
+        cactus_vocoder_workspace & workspace,
+        const float * embd,
+        const int n_codes,
+        const int n_embd) {
+    vocoder_frames(istft, workspace, embd, n_codes, n_embd);
+    workspace.audio.assign((size_t)n_codes*istft.n_hop, 0.0f);
+    overlap_add(istft, workspace.frames.data(), 0, n_codes, 0, workspace.audio);
+    istft.normalize(workspace.audio.data(), workspace.audio.size());
+}
 
-    for (size_t i = 0; i < audio.size(); ++i) {
-        audio[i] /= env[i];
+// PCM of codes already offset to the codebook, n_hop samples per code, valid until the next call
+static const float * vocoder_encode(cactus_context::cactus_context_vocoder * vocoder, const std::vector<llama_token> & codes) {
+    cactus_vocoder_workspace & workspace = *vocoder->workspace;
+    const int n_codes = (int)codes.size();
+    if (n_codes > workspace.batch_capacity) {
+        if (workspace.batch_capacity > 0) {
+            llama_batch_free(workspace.batch);
+        }
+        workspace.batch = llama_batch_init(n_codes, 0, 1);
+        workspace.batch_capacity = n_codes;
+    }
+    llama_batch & batch = workspace.batch;
+    batch.n_tokens = n_codes;
+    for (int i = 0; i < n_codes; ++i) {
+        batch.token[i] = codes[i];
+        batch.pos[i] = i;
+        batch.n_seq_id[i] = 1;
+        batch.seq_id[i][0] = 0;
+        batch.logits[i] = true;
     }
 
-    return audio;
+    if (llama_encode(vocoder->ctx, batch) != 0) {
+        LOG_ERROR("llama_encode() failed");
+        return nullptr;
+    }
+    if (vocoder->istft) {
+        embd_to_audio(*vocoder->istft, workspace, llama_get_embeddings(vocoder->ctx), n_codes, llama_model_n_embd(vocoder->model));
+        return workspace.audio.data();
+    }
+    return llama_get_embeddings(vocoder->ctx);
 }
 
 bool cactus_context::initVocoder(const std::string &vocoder_model_path) {
     if (vocoder_wrapper != nullptr) {
         return true;
     }
-    
-    common_params vocoder_params = params;
+
+    cactus_context_vocoder *wrapper = loadVocoder(params, vocoder_model_path);
+    if (wrapper == nullptr) {
+        return false;
+    }
+    attachVocoder(wrapper);
+    return true;
+}
+
+// Needs nothing of the context but its parameters, so it may run on a loader thread
+cactus_context::cactus_context_vocoder *cactus_context::loadVocoder(const common_params &base, const std::string &vocoder_model_path) {
+    common_params vocoder_params = base;
     vocoder_params.model.path = vocoder_model_path;
     vocoder_params.embedding = true;
     vocoder_params.n_ubatch = vocoder_params.n_batch;
 
-    cactus_context_vocoder *wrapper = new cactus_context_vocoder{
-        .init_result = common_init_from_params(vocoder_params),
-    };
+    cactus_context_vocoder *wrapper = nullptr;
+    {
+        cactus_memory_scope scope("vocoder");
+        wrapper = new cactus_context_vocoder{
+            .init_result = common_init_from_params(vocoder_params),
+            .istft = nullptr,
+            .workspace = nullptr,
+        };
+    }
 
     wrapper->model = wrapper->init_result.model.get();
     wrapper->ctx = wrapper->init_result.context.get();
@@ -313,15 +688,27 @@ bool cactus_context::initVocoder(const std::string &vocoder_model_path) {
     if (wrapper->model == nullptr || wrapper->ctx == nullptr) {
         LOG_ERROR("Failed to load vocoder model: %s", vocoder_model_path.c_str());
         delete wrapper;
-        return false;
+        return nullptr;
     }
 
+    // the vocoding thread is background work and yields to decode on the shared pool
+    attach_shared_threadpool(wrapper->ctx, vocoder_params.cpuparams);
     wrapper->type = TTS_OUTETTS_V0_2;
+    // The graph's ISTFT is a direct transform, a single matrix product that suits a GPU; on the CPU
+    // the graph stops at the spectrum and an FFT takes over
+    if (vocoder_params.n_gpu_layers == 0 || !llama_supports_gpu_offload()) {
+        const int n_fft = llama_model_n_embd(wrapper->model) - 2;
+        llama_set_vocoder_istft(wrapper->ctx, false);
+        wrapper->istft.reset(new cactus_vocoder_istft(n_fft, n_fft/4));
+    }
+    wrapper->workspace.reset(new cactus_vocoder_workspace(wrapper->istft ? vocoder_params.cpuparams.n_threads : 1));
+    LOG_INFO("Vocoder initialized successfully with model: %s", vocoder_model_path.c_str());
+    return wrapper;
+}
+
+void cactus_context::attachVocoder(cactus_context_vocoder *wrapper) {
     vocoder_wrapper = wrapper;
     has_vocoder = true;
-    
-    LOG_INFO("Vocoder initialized successfully with model: %s", vocoder_model_path.c_str());
-    return true;
 }
 
 bool cactus_context::isVocoderEnabled() const {
@@ -329,6 +716,7 @@ bool cactus_context::isVocoderEnabled() const {
 }
 
 void cactus_context::releaseVocoder() {
+    speech_stream = cactus_speech_stream();
     if (vocoder_wrapper != nullptr) {
         delete vocoder_wrapper;
         vocoder_wrapper = nullptr;
@@ -354,13 +742,72 @@ tts_type cactus_context::getTTSType() const {
     return TTS_OUTETTS_V0_2;
 }
 
+// Speaker words and codes in the prompt layout of the given OuteTTS version, from a speaker JSON
+// ({"words": [{"word", "duration", "codes"}]}) or, when there is none, the built-in speaker
+static bool format_speaker(const std::string &speaker_json_str, tts_type type, std::string &audio_text, std::string &audio_data) {
+    const std::string separator = type == TTS_OUTETTS_V0_3 ? "<|space|>" : "<|text_sep|>";
+    const std::string code_start = type == TTS_OUTETTS_V0_3 ? "" : "<|code_start|>";
+    const std::string code_end = type == TTS_OUTETTS_V0_3 ? "<|space|>" : "<|code_end|>";
+    if (speaker_json_str.empty()) {
+        audio_text = default_audio_text;
+        audio_data = default_audio_data;
+        if (type == TTS_OUTETTS_V0_3) {
+            audio_text = std::regex_replace(audio_text, std::regex(R"(<\|text_sep\|>)"), separator);
+            audio_data = std::regex_replace(audio_data, std::regex(R"(<\|code_start\|>)"), code_start);
+            audio_data = std::regex_replace(audio_data, std::regex(R"(<\|code_end\|>)"), code_end);
+        }
+        return true;
+    }
+    try {
+        const json speaker = json::parse(speaker_json_str);
+        audio_text = "<|text_start|>";
+        audio_data = "<|audio_start|>\n";
+        for (const auto &word : speaker.at("words")) {
+            const std::string text = word.at("word").get<std::string>();
+            std::ostringstream entry;
+            entry << text << "<|t_" << std::fixed << std::setprecision(2) << word.at("duration").get<double>() << "|>" << code_start;
+            for (int code : word.at("codes").get<std::vector<int>>()) {
+                entry << "<|" << code << "|>";
+            }
+            entry << code_end << "\n";
+            audio_text += text + separator;
+            audio_data += entry.str();
+        }
+        return true;
+    } catch (const std::exception &e) {
+        LOG_ERROR("Invalid speaker profile: %s", e.what());
+        return false;
+    }
+}
+
+static uint64_t speaker_hash(const std::string &data, uint64_t hash) {
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Formatted and tokenized once per speaker; the prefix state is taken by the first prefill over it
+cactus_context::cactus_speaker_profile *cactus_context::speakerProfile(const std::string &speaker_json_str) {
+    const tts_type type = getTTSType();
+    const std::string key = std::to_string((int)type) + "|" + speaker_json_str;
+    auto it = speaker_profiles.find(key);
+    if (it == speaker_profiles.end()) {
+        cactus_speaker_profile profile;
+        if (!format_speaker(speaker_json_str, type, profile.audio_text, profile.audio_data)) {
+            return nullptr;
+        }
+        profile.prefix = ::common_tokenize(ctx, "<|im_start|>\n" + profile.audio_text, true, true);
+        it = speaker_profiles.emplace(key, std::move(profile)).first;
+    }
+    return &it->second;
+}
+
 std::string cactus_context::getFormattedAudioCompletion(const std::string &speaker_json_str, const std::string &text_to_speak) {
     if (!isVocoderEnabled()) {
         throw std::runtime_error("Vocoder is not enabled but audio completion is requested");
     }
-    
-    std::string audio_text = default_audio_text;
-    std::string audio_data = default_audio_data;
 
     const tts_type type = getTTSType();
     if (type == TTS_UNKNOWN) {
@@ -368,13 +815,103 @@ std::string cactus_context::getFormattedAudioCompletion(const std::string &speak
         return "";
     }
 
-    if (type == TTS_OUTETTS_V0_3) {
-        audio_text = std::regex_replace(audio_text, std::regex(R"(<\|text_sep\|>)"), "<|space|>");
-        audio_data = std::regex_replace(audio_data, std::regex(R"(<\|code_start\|>)"), "");
-        audio_data = std::regex_replace(audio_data, std::regex(R"(<\|code_end\|>)"), "<|space|>");
+    const cactus_speaker_profile *profile = speakerProfile(speaker_json_str);
+    if (profile == nullptr) {
+        return "";
     }
+    return "<|im_start|>\n" + profile->audio_text + process_text(text_to_speak, type) + "<|text_end|>\n" + profile->audio_data + "\n";
+}
 
-    return "<|im_start|>\n" + audio_text + process_text(text_to_speak, type) + "<|text_end|>\n" + audio_data + "\n";
+std::string cactus_context::speakerPrefixFile(const std::string &key) const {
+    if (params.path_prompt_cache.empty() || model == nullptr) {
+        return "";
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "cactus-speaker-%016llx.bin",
+             (unsigned long long)speaker_hash(key, stateIdentity()));
+    std::string dir = params.path_prompt_cache;
+    if (dir.back() != '/') {
+        dir += '/';
+    }
+    return dir + name;
+}
+
+// Puts a speaker's prefix state into the active sequence when the prompt starts with that prefix
+// and the cache holds less of it, from memory or from the prompt cache directory. Without a stored
+// state the prefill stops at the end of the prefix once to take it. Returns the tokens now cached.
+size_t cactus_context::restoreSpeakerPrefix(const std::vector<llama_token> &prompt_tokens, size_t n_reuse) {
+    speaker_capture.clear();
+    speaker_capture_at = 0;
+    for (auto &entry : speaker_profiles) {
+        cactus_speaker_profile &profile = entry.second;
+        const size_t n_prefix = profile.prefix.size();
+        if (n_prefix == 0 || n_prefix >= prompt_tokens.size() ||
+            !std::equal(profile.prefix.begin(), profile.prefix.end(), prompt_tokens.begin())) {
+            continue;
+        }
+        if (n_reuse >= n_prefix) {
+            return n_reuse;
+        }
+        if (profile.identity != stateIdentity()) {
+            profile.state.clear();
+        }
+
+        const std::string path = speakerPrefixFile(entry.first);
+        bool restored = false;
+        if (!profile.state.empty()) {
+            llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+            restored = llama_state_seq_set_data(ctx, profile.state.data(), profile.state.size(), seq_id) != 0;
+        } else if (!path.empty() && access(path.c_str(), R_OK) == 0) {
+            std::vector<llama_token> stored(n_prefix);
+            size_t n_stored = 0;
+            llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+            restored = llama_state_seq_load_file(ctx, path.c_str(), seq_id, stored.data(), stored.size(), &n_stored) != 0 &&
+                       n_stored == n_prefix && stored == profile.prefix;
+            if (restored) {
+                profile.state.resize(llama_state_seq_get_size(ctx, seq_id));
+                profile.state.resize(llama_state_seq_get_data(ctx, profile.state.data(), profile.state.size(), seq_id));
+                profile.identity = stateIdentity();
+            }
+        } else {
+            speaker_capture = entry.first;
+            speaker_capture_at = n_prefix;
+            return n_reuse;
+        }
+
+        if (!restored) {
+            LOG_WARNING("Failed to restore speaker prefix, evaluating it again", "");
+            llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+            profile.state.clear();
+            speaker_capture = entry.first;
+            speaker_capture_at = n_prefix;
+            return 0;
+        }
+        LOG_VERBOSE("speaker prefix restored, n_tokens: %zu", n_prefix);
+        return n_prefix;
+    }
+    return n_reuse;
+}
+
+// Called when the prefill reaches the end of the pending speaker prefix, so the sequence holds
+// exactly that prefix
+void cactus_context::captureSpeakerPrefix() {
+    auto it = speaker_profiles.find(speaker_capture);
+    speaker_capture.clear();
+    speaker_capture_at = 0;
+    if (it == speaker_profiles.end()) {
+        return;
+    }
+    cactus_speaker_profile &profile = it->second;
+    profile.state.resize(llama_state_seq_get_size(ctx, seq_id));
+    profile.state.resize(llama_state_seq_get_data(ctx, profile.state.data(), profile.state.size(), seq_id));
+    profile.identity = stateIdentity();
+
+    const std::string path = speakerPrefixFile(it->first);
+    if (!path.empty() && !params.prompt_cache_ro &&
+        llama_state_seq_save_file(ctx, path.c_str(), seq_id, profile.prefix.data(), profile.prefix.size()) == 0) {
+        LOG_WARNING("Failed to save speaker prefix: %s", path.c_str());
+    }
+    LOG_VERBOSE("speaker prefix cached, n_tokens: %zu, state: %zu bytes", profile.prefix.size(), profile.state.size());
 }
 
 std::vector<llama_token> cactus_context::getAudioCompletionGuideTokens(const std::string &text_to_speak) {
@@ -414,7 +951,9 @@ std::vector<llama_token> cactus_context::getAudioCompletionGuideTokens(const std
     return result;
 }
 
-std::vector<float> cactus_context::decodeAudioTokens(const std::vector<llama_token> &tokens) {
+// Points into the vocoder's output, valid until its next run
+const float *cactus_context::vocodeAudioTokens(const std::vector<llama_token> &tokens, size_t &n_samples) {
+    n_samples = 0;
     if (!isVocoderEnabled()) {
         throw std::runtime_error("Vocoder is not enabled but audio decoding is requested");
     }
@@ -431,40 +970,443 @@ std::vector<float> cactus_context::decodeAudioTokens(const std::vector<llama_tok
         }
     } else {
         LOG_ERROR("Unsupported audio token type");
-        return std::vector<float>();
+        return nullptr;
     }
     
     const int n_codes = tokens_audio.size();
     if (n_codes == 0) {
         LOG_WARNING("No valid audio tokens found");
-        return std::vector<float>();
+        return nullptr;
     }
     
-    llama_batch batch = llama_batch_init(n_codes, 0, 1);
-    for (size_t i = 0; i < tokens_audio.size(); ++i) {
-        llama_batch_add(&batch, tokens_audio[i], i, { 0 }, true);
+    const float * audio = vocoder_encode(vocoder_wrapper, tokens_audio);
+    if (audio != nullptr) {
+        n_samples = (size_t)n_codes*vocoder_hop(vocoder_wrapper->model);
     }
-    
-    if (batch.n_tokens != n_codes) {
-        LOG_ERROR("batch.n_tokens != n_codes: %d != %d", batch.n_tokens, n_codes);
-        llama_batch_free(batch);
+    return audio;
+}
+
+std::vector<float> cactus_context::decodeAudioTokens(const std::vector<llama_token> &tokens) {
+    size_t n_samples = 0;
+    const float *audio = vocodeAudioTokens(tokens, n_samples);
+    if (audio == nullptr) {
         return std::vector<float>();
     }
-    
-    if (llama_encode(vocoder_wrapper->ctx, batch) != 0) {
-        LOG_ERROR("llama_encode() failed");
-        llama_batch_free(batch);
-        return std::vector<float>();
+    return std::vector<float>(audio, audio + n_samples);
+}
+
+// Every token counted as an audio code, so the bound holds whatever the tokens turn out to be
+size_t cactus_context::audioOutputBound(size_t n_tokens, const cactus_audio_output &output) const {
+    if (!isVocoderEnabled()) {
+        return 0;
     }
-    
-    llama_synchronize(vocoder_wrapper->ctx);
-    const int n_embd = llama_model_n_embd(vocoder_wrapper->model);
-    const float * embd = llama_get_embeddings(vocoder_wrapper->ctx);
-    
-    std::vector<float> audio_output = embd_to_audio(embd, n_codes, n_embd, params.cpuparams.n_threads);
-    
-    llama_batch_free(batch);
-    return audio_output;
+    return audio_output_bound(n_tokens*vocoder_hop(vocoder_wrapper->model), VOCODER_SAMPLE_RATE, output);
+}
+
+size_t cactus_context::decodeAudioTokens(const std::vector<llama_token> &tokens, const cactus_audio_output &output, void *dst, size_t capacity) {
+    size_t n_samples = 0;
+    const float *audio = vocodeAudioTokens(tokens, n_samples);
+    if (audio == nullptr) {
+        return 0;
+    }
+    return encode_audio(audio, n_samples, VOCODER_SAMPLE_RATE, output, dst, capacity);
+}
+
+// One chunk of a streamed utterance: its codes with the context around them, already offset to the codebook
+struct cactus_speech_chunk {
+    std::vector<llama_token> codes;
+    size_t skip = 0;     // leading context codes
+    size_t count = 0;    // codes whose samples are handed out
+};
+
+// The second stage of streamed speech. The token loop pushes chunks and the worker vocodes them in
+// order on the vocoder context, which nothing else touches until the stream ends. A full queue makes
+// push() wait, so neither stage runs more than a few chunks ahead of the other.
+struct cactus_speech_worker {
+    cactus_context::cactus_context_vocoder *vocoder;
+    cactus_speech_callback callback;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<cactus_speech_chunk> queue;
+    bool closing = false;   // no more chunks are coming
+    bool stopped = false;   // the callback declined or vocoding failed
+    std::thread thread;
+
+    cactus_speech_worker(cactus_context::cactus_context_vocoder *vocoder, const cactus_speech_callback &callback)
+        : vocoder(vocoder), callback(callback), thread([this]() { run(); }) {}
+
+    ~cactus_speech_worker() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.clear();
+            closing = true;
+        }
+        changed.notify_all();
+        finish();
+    }
+
+    bool push(cactus_speech_chunk &&chunk) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]() { return stopped || queue.size() < SPEECH_STREAM_QUEUE_CHUNKS; });
+        if (stopped) {
+            return false;
+        }
+        queue.push_back(std::move(chunk));
+        changed.notify_all();
+        return true;
+    }
+
+    // Waits for the queued chunks to be handed out
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        changed.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    void run() {
+        const size_t n_hop = (size_t)vocoder_hop(vocoder->model);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            changed.wait(lock, [this]() { return closing || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            cactus_speech_chunk chunk = std::move(queue.front());
+            queue.pop_front();
+            changed.notify_all();
+            lock.unlock();
+
+            const float *audio = vocoder_encode(vocoder, chunk.codes);
+            const bool keep_going = audio != nullptr && callback(audio + chunk.skip*n_hop, chunk.count*n_hop);
+
+            lock.lock();
+            if (!keep_going) {
+                stopped = true;
+                queue.clear();
+                changed.notify_all();
+                return;
+            }
+        }
+    }
+};
+
+bool cactus_context::beginSpeechStream(int chunk_codes, const cactus_speech_callback &callback) {
+    if (!isVocoderEnabled()) {
+        LOG_ERROR("Vocoder is not enabled but streamed speech is requested", "");
+        return false;
+    }
+    speech_stream = cactus_speech_stream();
+    speech_stream.chunk_codes = chunk_codes > 0 ? (size_t)chunk_codes : SPEECH_STREAM_DEFAULT_CODES;
+    speech_stream.first_code = audio_tokens.size();
+    speech_stream.worker = std::make_shared<cactus_speech_worker>(vocoder_wrapper, callback);
+    return true;
+}
+
+void cactus_context::finishSpeechStream() {
+    if (speech_stream.worker && isVocoderEnabled()) {
+        vocodeSpeechStream(true);
+        speech_stream.worker->finish();
+    }
+    speech_stream = cactus_speech_stream();
+}
+
+// Queues the next chunk once the codes after it have been generated (all remaining codes when
+// final). Each window reaches far enough past its chunk for every frame overlapping the chunk's
+// samples, so these are the samples decodeAudioTokens() returns over the whole utterance, up to
+// the windowed vocoder context. False once the worker has stopped.
+bool cactus_context::vocodeSpeechStream(bool final) {
+    cactus_speech_stream &s = speech_stream;
+    const size_t n_avail = audio_tokens.size() - std::min(s.first_code, audio_tokens.size());
+
+    while (final ? s.n_vocoded < n_avail : s.n_vocoded + s.chunk_codes + SPEECH_STREAM_CONTEXT_CODES <= n_avail) {
+        const size_t end = final ? n_avail : s.n_vocoded + s.chunk_codes;
+        const size_t window_begin = s.n_vocoded - std::min(s.n_vocoded, SPEECH_STREAM_CONTEXT_CODES);
+        const size_t window_end = std::min(n_avail, end + SPEECH_STREAM_CONTEXT_CODES);
+
+        cactus_speech_chunk chunk;
+        chunk.codes.assign(audio_tokens.begin() + s.first_code + window_begin,
+                           audio_tokens.begin() + s.first_code + window_end);
+        for (auto &code : chunk.codes) {
+            code -= 151672;
+        }
+        chunk.skip = s.n_vocoded - window_begin;
+        chunk.count = end - s.n_vocoded;
+        if (!s.worker->push(std::move(chunk))) {
+            return false;
+        }
+        s.n_vocoded = end;
+    }
+    return true;
+}
+
+// Sentences end at ., ! or ? (and line breaks); ones that process_text leaves empty are dropped
+static std::vector<std::string> split_sentences(const std::string &text, tts_type type) {
+    std::vector<std::string> sentences;
+    std::string current;
+    auto flush = [&]() {
+        if (!process_text(current, type).empty()) {
+            sentences.push_back(current);
+        }
+        current.clear();
+    };
+    for (size_t i = 0; i < text.size(); i++) {
+        const char c = text[i];
+        current += c;
+        const bool terminator = c == '.' || c == '!' || c == '?';
+        const bool boundary = i + 1 == text.size() || isspace((unsigned char)text[i + 1]);
+        if (c == '\n' || (terminator && boundary)) {
+            flush();
+        }
+    }
+    flush();
+    return sentences;
+}
+
+// One sequence of a speech job, working through one sentence at a time
+struct tts_branch {
+    llama_seq_id seq = 0;
+    int sentence = -1;
+    common_sampler *sampler = nullptr;
+    std::vector<llama_token> pending;   // prompt after the speaker prefix, not yet decoded
+    size_t n_pending = 0;               // of pending, decoded
+    size_t n_past = 0;
+    llama_token last = -1;
+    int i_batch = -1;
+    std::vector<llama_token> guide;
+    size_t guide_cursor = 0;
+    bool use_guide = false;
+};
+
+// Every sentence continues the same speaker prefix, which the active sequence holds; each branch
+// forks it with llama_kv_self_seq_cp and decodes its sentence, and all branches share every batch.
+// A finished branch takes the next sentence, so the batch stays full until the text runs out.
+std::vector<float> cactus_context::synthesizeSpeech(const std::string &speaker_json_str, const std::string &text, int n_parallel) {
+    if (!isVocoderEnabled()) {
+        throw std::runtime_error("Vocoder is not enabled but speech synthesis is requested");
+    }
+    if (ctx == nullptr || is_predicting) {
+        return {};
+    }
+    const tts_type type = getTTSType();
+    const cactus_speaker_profile *profile = speakerProfile(speaker_json_str);
+    const std::vector<std::string> sentences = split_sentences(text, type);
+    if (profile == nullptr || sentences.empty()) {
+        return {};
+    }
+
+    const std::vector<llama_token> prefix = profile->prefix;
+    const size_t n_prefix = prefix.size();
+    std::vector<std::vector<llama_token>> suffixes;
+    for (const auto &sentence : sentences) {
+        suffixes.push_back(::common_tokenize(ctx, process_text(sentence, type) + "<|text_end|>\n" + profile->audio_data + "\n", false, true));
+    }
+
+    discardPendingTokens();
+    is_predicting = true;
+    // a stop, hook or deadline left over from the previous request must not end this one
+    is_interrupted = false;
+    abort_hook = nullptr;
+    timed_out = false;
+    deadline = timeout_ms > 0 ? std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms)
+                              : std::chrono::steady_clock::time_point::max();
+    armAbortCallback();
+
+    // The speaker prefix into the active sequence, restored or evaluated
+    size_t n_cached = std::min(std::min(common_part(embd, prefix), n_past), n_prefix);
+    llama_kv_self_seq_rm(ctx, seq_id, n_cached, -1);
+    std::vector<llama_token> first_prompt = prefix;
+    first_prompt.insert(first_prompt.end(), suffixes[0].begin(), suffixes[0].end());
+    n_cached = restoreSpeakerPrefix(first_prompt, n_cached);
+    const std::vector<llama_seq_id> main_seq = { seq_id };
+    while (n_cached < n_prefix) {
+        const size_t n_eval = std::min(n_prefix - n_cached, (size_t)params.n_batch);
+        llama_batch_clear(&batch);
+        for (size_t i = 0; i < n_eval; i++) {
+            llama_batch_add(&batch, prefix[n_cached + i], n_cached + i, main_seq, false);
+        }
+        if (llama_decode(ctx, batch) != 0) {
+            LOG_ERROR("Failed to evaluate the speaker prefix", "");
+            llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+            embd.clear();
+            n_past = 0;
+            is_predicting = false;
+            return {};
+        }
+        n_cached += n_eval;
+    }
+    if (speaker_capture_at == n_prefix) {
+        captureSpeakerPrefix();
+    }
+    embd = prefix;
+    n_past = n_prefix;
+
+    // Branches on sequences no session holds; without one, the active sequence restarts after its prefix
+    const std::vector<llama_seq_id> idle = idleSequences(n_parallel > 0 ? n_parallel : sessionSequences());
+    const int n_forks = idle.empty() ? 1 : (int)idle.size();
+    const int n_branches = std::min((int)sentences.size(), n_forks);
+    std::vector<tts_branch> branches(n_branches);
+    for (int i = 0; i < n_branches; i++) {
+        branches[i].seq = idle.empty() ? seq_id : idle[i];
+    }
+
+    llama_token newline = -1;
+    const std::vector<llama_token> newline_tokens = common_tokenize(llama_model_get_vocab(model), "\n", false, true);
+    if (!newline_tokens.empty()) {
+        newline = newline_tokens[0];
+    }
+
+    std::vector<std::vector<llama_token>> codes(sentences.size());
+    size_t next_sentence = 0;
+    auto start = [&](tts_branch &branch) {
+        if (branch.sampler) {
+            common_sampler_free(branch.sampler);
+            branch.sampler = nullptr;
+        }
+        if (next_sentence == sentences.size()) {
+            branch.sentence = -1;
+            return true;
+        }
+        if (branch.seq == seq_id) {
+            llama_kv_self_seq_rm(ctx, seq_id, n_prefix, -1);
+        } else {
+            llama_kv_self_seq_rm(ctx, branch.seq, -1, -1);
+            llama_kv_self_seq_cp(ctx, seq_id, branch.seq, 0, n_prefix);
+        }
+        branch.sampler = common_sampler_init(model, params.sampling);
+        if (branch.sampler == nullptr) {
+            return false;
+        }
+        branch.sentence = (int)next_sentence++;
+        branch.pending = suffixes[branch.sentence];
+        branch.n_pending = 0;
+        branch.n_past = n_prefix;
+        branch.guide = getAudioCompletionGuideTokens(sentences[branch.sentence]);
+        branch.guide_cursor = 0;
+        branch.use_guide = false;
+        for (llama_token token : prefix) {
+            common_sampler_accept(branch.sampler, token, false);
+        }
+        for (llama_token token : branch.pending) {
+            common_sampler_accept(branch.sampler, token, false);
+        }
+        return true;
+    };
+
+    bool ok = true;
+    for (auto &branch : branches) {
+        ok = ok && start(branch);
+    }
+
+    const llama_vocab *vocab = llama_model_get_vocab(model);
+    int n_steps = 0;
+    while (ok && !is_interrupted) {
+        llama_batch_clear(&batch);
+        for (auto &branch : branches) {
+            branch.i_batch = -1;
+            if (branch.sentence < 0) {
+                continue;
+            }
+            const size_t budget = (size_t)params.n_batch - (size_t)batch.n_tokens;
+            if (branch.n_pending < branch.pending.size()) {
+                const size_t n_eval = std::min(branch.pending.size() - branch.n_pending, budget);
+                for (size_t i = 0; i < n_eval; i++) {
+                    const bool done = branch.n_pending + 1 == branch.pending.size();
+                    llama_batch_add(&batch, branch.pending[branch.n_pending], branch.n_past, { branch.seq }, done);
+                    branch.n_pending++;
+                    branch.n_past++;
+                    if (done) {
+                        branch.i_batch = batch.n_tokens - 1;
+                    }
+                }
+            } else if (budget > 0) {
+                llama_batch_add(&batch, branch.last, branch.n_past, { branch.seq }, true);
+                branch.n_past++;
+                branch.i_batch = batch.n_tokens - 1;
+            }
+        }
+        if (batch.n_tokens == 0) {
+            break;
+        }
+        if (llama_decode(ctx, batch) != 0) {
+            LOG_ERROR("Failed to decode speech batch, n_tokens: %d", batch.n_tokens);
+            ok = false;
+            break;
+        }
+        n_steps++;
+
+        std::vector<common_sampler *> samplers;
+        std::vector<int> rows;
+        for (const auto &branch : branches) {
+            if (branch.i_batch >= 0) {
+                samplers.push_back(branch.sampler);
+                rows.push_back(branch.i_batch);
+            }
+        }
+        const std::vector<llama_token> sampled = common_sampler_sample_batch(samplers, ctx, rows, params.cpuparams.n_threads, shared_threadpool(params.cpuparams));
+        size_t n_sampled = 0;
+
+        for (auto &branch : branches) {
+            if (branch.i_batch < 0) {
+                continue;
+            }
+            llama_token token = sampled[n_sampled++];
+            if (branch.use_guide && branch.guide_cursor < branch.guide.size() &&
+                !llama_vocab_is_control(vocab, token) && !llama_vocab_is_eog(vocab, token)) {
+                token = branch.guide[branch.guide_cursor++];
+            }
+            common_sampler_accept(branch.sampler, token, true);
+            branch.use_guide = newline >= 0 && token == newline;
+
+            std::vector<llama_token> &out = codes[branch.sentence];
+            const bool eog = llama_vocab_is_eog(vocab, token);
+            if (!eog) {
+                out.push_back(token);
+                branch.last = token;
+            }
+            const bool limit = (params.n_predict > 0 && (int)out.size() >= params.n_predict) ||
+                               branch.n_past + 1 >= (size_t)n_ctx;
+            if ((eog || limit) && !start(branch)) {
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    size_t n_generated = 0;
+    for (auto &branch : branches) {
+        if (branch.sampler) {
+            common_sampler_free(branch.sampler);
+        }
+        if (branch.seq != seq_id) {
+            llama_kv_self_seq_rm(ctx, branch.seq, -1, -1);
+        }
+    }
+    llama_kv_self_seq_rm(ctx, seq_id, n_prefix, -1);
+    has_next_token = false;
+    is_predicting = false;
+    if (!ok || is_interrupted) {
+        return {};
+    }
+
+    // Each sentence is its own utterance to the vocoder, joined in text order
+    std::vector<float> audio;
+    audio_tokens.clear();
+    for (const auto &sentence_codes : codes) {
+        n_generated += sentence_codes.size();
+        audio_tokens.insert(audio_tokens.end(), sentence_codes.begin(), sentence_codes.end());
+        const std::vector<float> pcm = decodeAudioTokens(sentence_codes);
+        audio.insert(audio.end(), pcm.begin(), pcm.end());
+    }
+    num_tokens_predicted = n_generated;
+
+    LOG_VERBOSE("speech synthesized, sentences: %zu, branches: %d, steps: %d, tokens: %zu",
+                sentences.size(), n_branches, n_steps, n_generated);
+    return audio;
 }
 
 } // namespace cactus 
\ No newline at end of file
@@ -1,6 +1,8 @@
 #include "cactus.h"
 #include "llama.h"
+#include "llama-vocab.h"
 #include "common.h"
+#include "log.h"
 
 #include <vector>
 #include <string>
@@ -41,11 +43,11 @@ void log(const char *level, const char *function, int line,
         if (!cactus_verbose && strcmp(level, "VERBOSE") == 0) {
             return;
         }
-        printf("[%s] %s:%d ", level, function, line);
+        char prefix[128];
+        snprintf(prefix, sizeof(prefix), "[%s] %s:%d ", level, function, line);
         va_start(args, format);
-        vprintf(format, args);
+        common_log_addv(common_log_main(), LM_GGML_LOG_LEVEL_NONE, prefix, true, format, args);
         va_end(args);
-        printf("\n");
     #endif
 }
 
@@ -109,7 +111,12 @@ size_t find_partial_stop_string(const std::string &stop,
 std::string tokens_to_output_formatted_string(const llama_context *ctx, const llama_token token)
 {
     if (!ctx) return "<null_ctx>"; 
-    std::string out = token == -1 ? "" : common_token_to_piece(ctx, token);
+    return format_token_piece(token == -1 ? "" : common_token_to_piece(ctx, token));
+}
+
+std::string format_token_piece(std::string_view piece)
+{
+    std::string out(piece);
     if (out.size() == 1 && (out[0] & 0x80) == 0x80)
     {
         std::stringstream ss;
@@ -123,6 +130,11 @@ std::string tokens_to_output_formatted_string(const llama_context *ctx, const ll
     return out;
 }
 
+const std::string &cached_token_piece(const llama_vocab *vocab, llama_token token)
+{
+    return vocab->token_to_piece(token);
+}
+
 std::string tokens_to_str(llama_context *ctx, const std::vector<llama_token>::const_iterator begin, const std::vector<llama_token>::const_iterator end)
 {
     std::string ret;
@@ -0,0 +1,219 @@
+#include "cactus.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define CACTUS_VECTOR_NEON 1
+#endif
+
+namespace cactus {
+
+float quantize_embedding_i8(const float *x, int n, int8_t *out) {
+    float amax = 0.0f;
+    for (int i = 0; i < n; i++) {
+        amax = std::max(amax, std::fabs(x[i]));
+    }
+    const float scale = amax / 127.0f;
+    const float inv = scale > 0.0f ? 1.0f / scale : 0.0f;
+    for (int i = 0; i < n; i++) {
+        out[i] = (int8_t)std::lround(x[i] * inv);
+    }
+    return scale;
+}
+
+void quantize_embedding_binary(const float *x, int n, uint8_t *out) {
+    memset(out, 0, (size_t)(n + 7) / 8);
+    for (int i = 0; i < n; i++) {
+        if (x[i] > 0.0f) {
+            out[i / 8] |= (uint8_t)(1u << (i % 8));
+        }
+    }
+}
+
+// Four independent accumulators hide the FMA latency, as LM_GGML_F32_STEP does in ggml-cpu
+float vec_dot_f32(const float *a, const float *b, int n) {
+    int i = 0;
+    float sum = 0.0f;
+#if defined(CACTUS_VECTOR_NEON)
+    float32x4_t acc[4] = { vdupq_n_f32(0.0f), vdupq_n_f32(0.0f), vdupq_n_f32(0.0f), vdupq_n_f32(0.0f) };
+    for (; i + 16 <= n; i += 16) {
+        for (int j = 0; j < 4; j++) {
+            acc[j] = vfmaq_f32(acc[j], vld1q_f32(a + i + 4 * j), vld1q_f32(b + i + 4 * j));
+        }
+    }
+    for (; i + 4 <= n; i += 4) {
+        acc[0] = vfmaq_f32(acc[0], vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    sum = vaddvq_f32(vaddq_f32(vaddq_f32(acc[0], acc[1]), vaddq_f32(acc[2], acc[3])));
+#endif
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+float vec_cosine_f32(const float *a, const float *b, int n) {
+    const float norm = std::sqrt(vec_dot_f32(a, a, n) * vec_dot_f32(b, b, n));
+    return norm > 0.0f ? vec_dot_f32(a, b, n) / norm : 0.0f;
+}
+
+int32_t vec_dot_i8(const int8_t *a, const int8_t *b, int n) {
+    int i = 0;
+    int32_t sum = 0;
+#if defined(CACTUS_VECTOR_NEON)
+    int32x4_t acc = vdupq_n_s32(0);
+    for (; i + 16 <= n; i += 16) {
+        const int8x16_t va = vld1q_s8(a + i);
+        const int8x16_t vb = vld1q_s8(b + i);
+#if defined(__ARM_FEATURE_DOTPROD)
+        acc = vdotq_s32(acc, va, vb);
+#else
+        const int16x8_t lo = vmull_s8(vget_low_s8(va), vget_low_s8(vb));
+        const int16x8_t hi = vmull_s8(vget_high_s8(va), vget_high_s8(vb));
+        acc = vpadalq_s16(vpadalq_s16(acc, lo), hi);
+#endif
+    }
+    sum = vaddvq_s32(acc);
+#endif
+    for (; i < n; i++) {
+        sum += (int32_t)a[i] * (int32_t)b[i];
+    }
+    return sum;
+}
+
+int32_t vec_hamming(const uint8_t *a, const uint8_t *b, int n_bytes) {
+    int i = 0;
+    int32_t dist = 0;
+#if defined(CACTUS_VECTOR_NEON)
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; i + 16 <= n_bytes; i += 16) {
+        const uint8x16_t bits = vcntq_u8(veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+        acc = vpadalq_u16(acc, vpaddlq_u8(bits));
+    }
+    dist = (int32_t)vaddvq_u32(acc);
+#endif
+    for (; i < n_bytes; i++) {
+        dist += __builtin_popcount((unsigned)(a[i] ^ b[i]));
+    }
+    return dist;
+}
+
+static const uint64_t HASH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t HASH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t HASH_PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t HASH_PRIME32_1 = 0x9E3779B1U;
+static const uint64_t HASH_SECRET[8] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+static const size_t HASH_STRIPE = 64;
+static const size_t HASH_STRIPES_PER_BLOCK = 16;
+
+// Per lane: acc += swapped neighbour word, acc += lo32(word ^ secret) * hi32(word ^ secret)
+static void hash_accumulate(uint64_t *acc, const uint8_t *p) {
+#if defined(CACTUS_VECTOR_NEON)
+    for (int i = 0; i < 8; i += 2) {
+        const uint64x2_t data = vreinterpretq_u64_u8(vld1q_u8(p + 8 * i));
+        const uint64x2_t keyed = veorq_u64(data, vld1q_u64(HASH_SECRET + i));
+        const uint64x2_t product = vmull_u32(vmovn_u64(keyed), vshrn_n_u64(keyed, 32));
+        const uint64x2_t sum = vaddq_u64(vld1q_u64(acc + i), vextq_u64(data, data, 1));
+        vst1q_u64(acc + i, vaddq_u64(sum, product));
+    }
+#else
+    for (int i = 0; i < 8; i++) {
+        uint64_t data;
+        memcpy(&data, p + 8 * i, sizeof(data));
+        const uint64_t keyed = data ^ HASH_SECRET[i];
+        acc[i ^ 1] += data;
+        acc[i] += (keyed & 0xffffffffULL) * (keyed >> 32);
+    }
+#endif
+}
+
+static void hash_scramble(uint64_t *acc) {
+    for (int i = 0; i < 8; i++) {
+        acc[i] = (acc[i] ^ (acc[i] >> 47) ^ HASH_SECRET[i]) * HASH_PRIME32_1;
+    }
+}
+
+uint64_t content_hash64(const void *data, size_t len) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    uint64_t acc[8] = {
+        HASH_PRIME32_1, HASH_PRIME64_1, HASH_PRIME64_2, HASH_PRIME64_3,
+        HASH_PRIME64_1 ^ HASH_PRIME64_2, HASH_PRIME64_2 ^ HASH_PRIME64_3, HASH_PRIME64_3 ^ HASH_PRIME32_1, HASH_PRIME64_1 ^ HASH_PRIME64_3,
+    };
+    size_t n_stripes = len / HASH_STRIPE;
+    for (size_t s = 0; s < n_stripes; s++) {
+        hash_accumulate(acc, p + s * HASH_STRIPE);
+        if ((s + 1) % HASH_STRIPES_PER_BLOCK == 0) {
+            hash_scramble(acc);
+        }
+    }
+    const size_t rest = len - n_stripes * HASH_STRIPE;
+    if (rest > 0) {
+        uint8_t last[HASH_STRIPE] = {};
+        memcpy(last, p + n_stripes * HASH_STRIPE, rest);
+        hash_accumulate(acc, last);
+    }
+
+    uint64_t h = (uint64_t)len * HASH_PRIME64_1;
+    for (int i = 0; i < 8; i++) {
+        h ^= acc[i] * HASH_PRIME64_2;
+        h = ((h << 27) | (h >> 37)) * HASH_PRIME64_1 + HASH_PRIME64_3;
+    }
+    h ^= h >> 33;
+    h *= HASH_PRIME64_2;
+    h ^= h >> 29;
+    h *= HASH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Scores every row against the query and keeps the k best; higher is better for dot products,
+// lower for Hamming distance
+std::vector<cactus_vector_match> vector_top_k(cactus_vector_type type, const void *query, const void *rows,
+                                              const float *scales, size_t n_rows, int dim, size_t k) {
+    std::vector<float> scores(n_rows);
+    switch (type) {
+        case VECTOR_F32: {
+            const float *q = static_cast<const float *>(query);
+            const float *m = static_cast<const float *>(rows);
+            for (size_t r = 0; r < n_rows; r++) {
+                scores[r] = vec_dot_f32(q, m + r * dim, dim);
+            }
+        } break;
+        case VECTOR_I8: {
+            const int8_t *q = static_cast<const int8_t *>(query);
+            const int8_t *m = static_cast<const int8_t *>(rows);
+            for (size_t r = 0; r < n_rows; r++) {
+                scores[r] = (float)vec_dot_i8(q, m + r * dim, dim) * (scales ? scales[r] : 1.0f);
+            }
+        } break;
+        case VECTOR_BINARY: {
+            const size_t n_bytes = (size_t)(dim + 7) / 8;
+            const uint8_t *q = static_cast<const uint8_t *>(query);
+            const uint8_t *m = static_cast<const uint8_t *>(rows);
+            for (size_t r = 0; r < n_rows; r++) {
+                scores[r] = (float)vec_hamming(q, m + r * n_bytes, (int)n_bytes);
+            }
+        } break;
+    }
+
+    std::vector<size_t> order(n_rows);
+    std::iota(order.begin(), order.end(), 0);
+    k = std::min(k, n_rows);
+    const bool ascending = type == VECTOR_BINARY;
+    std::partial_sort(order.begin(), order.begin() + k, order.end(), [&scores, ascending](size_t a, size_t b) {
+        return ascending ? scores[a] < scores[b] : scores[a] > scores[b];
+    });
+
+    std::vector<cactus_vector_match> matches(k);
+    for (size_t i = 0; i < k; i++) {
+        matches[i] = { order[i], scores[order[i]] };
+    }
+    return matches;
+}
+
+} // namespace cactus
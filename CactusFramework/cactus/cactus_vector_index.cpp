@@ -0,0 +1,398 @@
+#include "cactus.h"
+#include "llama-mmap.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <queue>
+
+namespace cactus {
+
+static const char vector_index_magic[4] = {'C', 'V', 'I', 'X'};
+static const uint32_t vector_index_version = 1;
+// Row data starts on this boundary so the mapped rows stay aligned for the SIMD loads
+static const size_t vector_index_row_align = 64;
+
+struct vector_index_header {
+    char magic[4];
+    uint32_t version;
+    int32_t dim;
+    int32_t storage;
+    int32_t hnsw;
+    int32_t hnsw_m;
+    int32_t ef_construction;
+    int32_t max_level;
+    int64_t entry;
+    uint64_t n_nodes;
+};
+
+static size_t vector_row_bytes(cactus_vector_type storage, int dim) {
+    switch (storage) {
+        case VECTOR_I8:     return (size_t)dim;
+        case VECTOR_BINARY: return (size_t)(dim + 7) / 8;
+        default:            return (size_t)dim * sizeof(float);
+    }
+}
+
+cactus_vector_index::cactus_vector_index(int dim, cactus_vector_type storage, bool hnsw, int hnsw_m, int ef_construction)
+    : dim(dim), storage(storage), hnsw(hnsw), hnsw_m(std::max(hnsw_m, 2)), ef_construction(std::max(ef_construction, 1)),
+      row_bytes(vector_row_bytes(storage, dim)) {
+}
+
+cactus_vector_index::~cactus_vector_index() = default;
+
+const uint8_t *cactus_vector_index::row(uint32_t slot) const {
+    return (mapped_rows ? mapped_rows : rows.data()) + (size_t)slot * row_bytes;
+}
+
+// Mapped rows are read-only; the first add after load() moves them into memory
+void cactus_vector_index::own_rows() {
+    if (!mapped_rows) {
+        return;
+    }
+    rows.assign(mapped_rows, mapped_rows + nodes.size() * row_bytes);
+    mapped_rows = nullptr;
+    mapping.reset();
+    file.reset();
+}
+
+// Converts a float vector to the storage layout; returns its int8 scale
+float cactus_vector_index::prepare(const float *vec, std::vector<uint8_t> &out) const {
+    out.resize(row_bytes);
+    switch (storage) {
+        case VECTOR_I8:
+            return quantize_embedding_i8(vec, dim, reinterpret_cast<int8_t *>(out.data()));
+        case VECTOR_BINARY:
+            quantize_embedding_binary(vec, dim, out.data());
+            return 1.0f;
+        default:
+            memcpy(out.data(), vec, row_bytes);
+            return 1.0f;
+    }
+}
+
+// Lower is closer: negated similarity for dot products, the bit count for Hamming
+float cactus_vector_index::distance(const uint8_t *query, float query_scale, uint32_t slot) const {
+    const uint8_t *r = row(slot);
+    switch (storage) {
+        case VECTOR_I8:
+            return -(float)vec_dot_i8(reinterpret_cast<const int8_t *>(query), reinterpret_cast<const int8_t *>(r), dim) *
+                   query_scale * nodes[slot].scale;
+        case VECTOR_BINARY:
+            return (float)vec_hamming(query, r, (int)row_bytes);
+        default:
+            return -vec_dot_f32(reinterpret_cast<const float *>(query), reinterpret_cast<const float *>(r), dim);
+    }
+}
+
+// Beam search over one graph level; returns up to ef nodes, closest first
+std::vector<std::pair<float, uint32_t>> cactus_vector_index::searchLayer(const uint8_t *query, float query_scale,
+                                                                         uint32_t start, size_t ef, int level) const {
+    typedef std::pair<float, uint32_t> scored;
+    std::vector<char> visited(nodes.size(), 0);
+    std::priority_queue<scored, std::vector<scored>, std::greater<scored>> candidates;
+    std::priority_queue<scored> best;
+
+    const float d0 = distance(query, query_scale, start);
+    candidates.push({d0, start});
+    best.push({d0, start});
+    visited[start] = 1;
+
+    while (!candidates.empty()) {
+        const scored cur = candidates.top();
+        if (best.size() >= ef && cur.first > best.top().first) {
+            break;
+        }
+        candidates.pop();
+        const node &n = nodes[cur.second];
+        if (level >= (int)n.links.size()) {
+            continue;
+        }
+        for (uint32_t nb : n.links[level]) {
+            if (visited[nb]) {
+                continue;
+            }
+            visited[nb] = 1;
+            const float d = distance(query, query_scale, nb);
+            if (best.size() < ef || d < best.top().first) {
+                candidates.push({d, nb});
+                best.push({d, nb});
+                if (best.size() > ef) {
+                    best.pop();
+                }
+            }
+        }
+    }
+
+    std::vector<scored> out(best.size());
+    for (size_t i = out.size(); i-- > 0;) {
+        out[i] = best.top();
+        best.pop();
+    }
+    return out;
+}
+
+// Connects a new slot to its nearest neighbours on one level and trims their lists back to the cap;
+// returns the closest node found, where the search on the next level down starts
+uint32_t cactus_vector_index::link(uint32_t slot, const uint8_t *query, float query_scale, uint32_t start, int level) {
+    const size_t max_links = level == 0 ? 2 * (size_t)hnsw_m : (size_t)hnsw_m;
+    std::vector<std::pair<float, uint32_t>> near = searchLayer(query, query_scale, start, (size_t)ef_construction, level);
+    std::vector<uint32_t> &own = nodes[slot].links[level];
+    for (size_t i = 0; i < near.size() && own.size() < (size_t)hnsw_m; i++) {
+        if (near[i].second != slot) {
+            own.push_back(near[i].second);
+        }
+    }
+
+    for (uint32_t nb : own) {
+        std::vector<uint32_t> &links = nodes[nb].links[level];
+        links.push_back(slot);
+        if (links.size() <= max_links) {
+            continue;
+        }
+        const uint8_t *nb_row = row(nb);
+        const float nb_scale = nodes[nb].scale;
+        std::vector<std::pair<float, uint32_t>> scored;
+        scored.reserve(links.size());
+        for (uint32_t other : links) {
+            scored.push_back({distance(nb_row, nb_scale, other), other});
+        }
+        std::partial_sort(scored.begin(), scored.begin() + max_links, scored.end());
+        links.resize(max_links);
+        for (size_t i = 0; i < max_links; i++) {
+            links[i] = scored[i].second;
+        }
+    }
+    return near.front().second;
+}
+
+void cactus_vector_index::insert(size_t id, const float *vec) {
+    own_rows();
+    auto existing = slots.find(id);
+    if (existing != slots.end()) {
+        nodes[existing->second].deleted = true;
+        slots.erase(existing);
+        n_live--;
+    }
+
+    std::vector<uint8_t> query;
+    const float query_scale = prepare(vec, query);
+    const uint32_t slot = (uint32_t)nodes.size();
+    int level = 0;
+    if (hnsw) {
+        std::uniform_real_distribution<double> unit(0.0, 1.0);
+        level = (int)std::floor(-std::log(1.0 - unit(rng)) / std::log((double)hnsw_m));
+    }
+    nodes.push_back({ id, query_scale, false, std::vector<std::vector<uint32_t>>(hnsw ? level + 1 : 0) });
+    rows.insert(rows.end(), query.begin(), query.end());
+    slots[id] = slot;
+    n_live++;
+
+    if (!hnsw) {
+        return;
+    }
+    if (entry < 0) {
+        entry = slot;
+        max_level = level;
+        return;
+    }
+
+    // Greedy descent through the levels above the new node, then link on each level it occupies
+    uint32_t cur = (uint32_t)entry;
+    for (int l = max_level; l > level; l--) {
+        cur = searchLayer(query.data(), query_scale, cur, 1, l).front().second;
+    }
+    for (int l = std::min(level, max_level); l >= 0; l--) {
+        cur = link(slot, query.data(), query_scale, cur, l);
+    }
+    if (level > max_level) {
+        max_level = level;
+        entry = slot;
+    }
+}
+
+void cactus_vector_index::add(size_t id, const float *vec) {
+    std::lock_guard<std::mutex> lock(mutex);
+    insert(id, vec);
+}
+
+void cactus_vector_index::add(const size_t *ids, const float *vecs, size_t n) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < n; i++) {
+        insert(ids[i], vecs + i * dim);
+    }
+}
+
+// Removed nodes stay in the graph as waypoints and are only filtered out of results
+bool cactus_vector_index::remove(size_t id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = slots.find(id);
+    if (it == slots.end()) {
+        return false;
+    }
+    nodes[it->second].deleted = true;
+    slots.erase(it);
+    n_live--;
+    return true;
+}
+
+size_t cactus_vector_index::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return n_live;
+}
+
+std::vector<cactus_vector_match> cactus_vector_index::search(const float *query, size_t k, int ef) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<cactus_vector_match> matches;
+    if (n_live == 0 || k == 0) {
+        return matches;
+    }
+    std::vector<uint8_t> q;
+    const float q_scale = prepare(query, q);
+
+    std::vector<std::pair<float, uint32_t>> scored;
+    if (hnsw) {
+        uint32_t cur = (uint32_t)entry;
+        for (int l = max_level; l > 0; l--) {
+            cur = searchLayer(q.data(), q_scale, cur, 1, l).front().second;
+        }
+        // Widen the beam by the tombstones so removals do not starve the result
+        const size_t beam = std::max((size_t)(ef > 0 ? ef : 64), k) + (nodes.size() - n_live);
+        scored = searchLayer(q.data(), q_scale, cur, std::min(beam, nodes.size()), 0);
+    } else {
+        scored.reserve(n_live);
+        for (uint32_t slot = 0; slot < nodes.size(); slot++) {
+            if (!nodes[slot].deleted) {
+                scored.push_back({distance(q.data(), q_scale, slot), slot});
+            }
+        }
+        const size_t n = std::min(k, scored.size());
+        std::partial_sort(scored.begin(), scored.begin() + n, scored.end());
+    }
+
+    for (const auto &s : scored) {
+        if (matches.size() == k) {
+            break;
+        }
+        if (!nodes[s.second].deleted) {
+            matches.push_back({ nodes[s.second].id, storage == VECTOR_BINARY ? s.first : -s.first });
+        }
+    }
+    return matches;
+}
+
+// Written to a temporary file and renamed over path, so an index mapped from path stays valid
+bool cactus_vector_index::save(const std::string &path) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    const std::string tmp_path = path + ".tmp";
+    try {
+        llama_file out(tmp_path.c_str(), "wb");
+        vector_index_header header = {};
+        memcpy(header.magic, vector_index_magic, sizeof(header.magic));
+        header.version = vector_index_version;
+        header.dim = dim;
+        header.storage = storage;
+        header.hnsw = hnsw ? 1 : 0;
+        header.hnsw_m = hnsw_m;
+        header.ef_construction = ef_construction;
+        header.max_level = max_level;
+        header.entry = entry;
+        header.n_nodes = nodes.size();
+        out.write_raw(&header, sizeof(header));
+
+        for (const node &n : nodes) {
+            const uint64_t id = n.id;
+            const uint8_t deleted = n.deleted ? 1 : 0;
+            out.write_raw(&id, sizeof(id));
+            out.write_raw(&n.scale, sizeof(n.scale));
+            out.write_raw(&deleted, sizeof(deleted));
+            out.write_u32((uint32_t)n.links.size());
+            for (const std::vector<uint32_t> &links : n.links) {
+                out.write_u32((uint32_t)links.size());
+                out.write_raw(links.data(), links.size() * sizeof(uint32_t));
+            }
+        }
+
+        static const uint8_t zeros[vector_index_row_align] = {};
+        out.write_raw(zeros, (vector_index_row_align - out.tell() % vector_index_row_align) % vector_index_row_align);
+        if (!nodes.empty()) {
+            out.write_raw(row(0), nodes.size() * row_bytes);
+        }
+    } catch (const std::exception &e) {
+        LOG_ERROR("Failed to write vector index %s: %s", tmp_path.c_str(), e.what());
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        LOG_ERROR("Failed to move vector index into place at %s", path.c_str());
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::unique_ptr<cactus_vector_index> cactus_vector_index::load(const std::string &path) {
+    try {
+        std::unique_ptr<llama_file> file(new llama_file(path.c_str(), "rb"));
+        const size_t file_size = file->size();
+        vector_index_header header;
+        if (file_size < sizeof(header)) {
+            LOG_ERROR("Vector index %s is truncated", path.c_str());
+            return nullptr;
+        }
+        file->read_raw(&header, sizeof(header));
+        if (memcmp(header.magic, vector_index_magic, sizeof(header.magic)) != 0 || header.version != vector_index_version ||
+            header.dim <= 0 || header.storage < VECTOR_F32 || header.storage > VECTOR_BINARY) {
+            LOG_ERROR("%s is not a vector index this build can read", path.c_str());
+            return nullptr;
+        }
+
+        std::unique_ptr<cactus_vector_index> index(new cactus_vector_index(
+            header.dim, (cactus_vector_type)header.storage, header.hnsw != 0, header.hnsw_m, header.ef_construction));
+        index->max_level = header.max_level;
+        index->entry = header.entry;
+        index->nodes.resize(header.n_nodes);
+        for (uint32_t slot = 0; slot < header.n_nodes; slot++) {
+            node &n = index->nodes[slot];
+            uint64_t id = 0;
+            uint8_t deleted = 0;
+            file->read_raw(&id, sizeof(id));
+            file->read_raw(&n.scale, sizeof(n.scale));
+            file->read_raw(&deleted, sizeof(deleted));
+            n.id = (size_t)id;
+            n.deleted = deleted != 0;
+            n.links.resize(file->read_u32());
+            for (std::vector<uint32_t> &links : n.links) {
+                links.resize(file->read_u32());
+                file->read_raw(links.data(), links.size() * sizeof(uint32_t));
+            }
+            if (!n.deleted) {
+                index->slots[n.id] = slot;
+                index->n_live++;
+            }
+        }
+
+        const size_t offset = (file->tell() + vector_index_row_align - 1) / vector_index_row_align * vector_index_row_align;
+        const size_t n_bytes = (size_t)header.n_nodes * index->row_bytes;
+        if (offset + n_bytes > file_size) {
+            LOG_ERROR("Vector index %s is truncated", path.c_str());
+            return nullptr;
+        }
+        if (llama_mmap::SUPPORTED) {
+            // No prefetch: pages fault in as searches touch them
+            index->mapping.reset(new llama_mmap(file.get(), 0));
+            index->mapped_rows = static_cast<const uint8_t *>(index->mapping->addr()) + offset;
+            index->file = std::move(file);
+        } else {
+            index->rows.resize(n_bytes);
+            file->seek(offset, SEEK_SET);
+            file->read_raw(index->rows.data(), n_bytes);
+        }
+        return index;
+    } catch (const std::exception &e) {
+        LOG_ERROR("Failed to load vector index %s: %s", path.c_str(), e.what());
+        return nullptr;
+    }
+}
+
+} // namespace cactus
@@ -1738,16 +1738,176 @@ static common_chat_params common_chat_templates_apply_legacy(
     return params;
 }
 
-common_chat_params common_chat_templates_apply(
+static common_chat_params common_chat_templates_render(
     const struct common_chat_templates * tmpls,
     const struct common_chat_templates_inputs & inputs)
 {
-    LM_GGML_ASSERT(tmpls != nullptr);
     return inputs.use_jinja
         ? common_chat_templates_apply_jinja(tmpls, inputs)
         : common_chat_templates_apply_legacy(tmpls, inputs);
 }
 
+// Renders all messages and the first n_past of them, and keeps what the former adds to the latter.
+// Fails when the shorter render is not a prefix of the longer one.
+static bool common_chat_render_delta(
+    const struct common_chat_templates * tmpls,
+    const struct common_chat_templates_inputs & inputs,
+    size_t n_past,
+    common_chat_params & params)
+{
+    common_chat_templates_inputs past;
+    past.use_jinja = inputs.use_jinja;
+    past.tools = inputs.tools;
+    past.tool_choice = inputs.tool_choice;
+    past.parallel_tool_calls = inputs.parallel_tool_calls;
+    past.extract_reasoning = inputs.extract_reasoning;
+    past.now = inputs.now;
+    past.add_generation_prompt = false;
+    past.messages.assign(inputs.messages.begin(), inputs.messages.begin() + n_past);
+    const std::string prefix = common_chat_templates_render(tmpls, past).prompt;
+
+    params = common_chat_templates_render(tmpls, inputs);
+    if (params.prompt.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    params.prompt.erase(0, prefix.size());
+    return true;
+}
+
+// Cuts the history down to the leading system message and the last already-rendered message,
+// moved back by one when needed so the window keeps the user/assistant parity of the full
+// conversation (templates that check role alternation count from the first message).
+// Returns false when the window would not be shorter than the conversation.
+static bool common_chat_delta_window(
+    const struct common_chat_templates_inputs & inputs,
+    common_chat_templates_inputs & window,
+    size_t & n_window_past)
+{
+    const auto & messages = inputs.messages;
+    const size_t first = messages[0].role == "system" ? 1 : 0;
+    size_t start = inputs.n_past - 1;
+    if (start <= first || start >= messages.size()) {
+        return false;
+    }
+    if ((start - first) % 2 != 0) {
+        start--;
+    }
+    window.use_jinja = inputs.use_jinja;
+    window.grammar = inputs.grammar;
+    window.json_schema = inputs.json_schema;
+    window.add_generation_prompt = inputs.add_generation_prompt;
+    window.tools = inputs.tools;
+    window.tool_choice = inputs.tool_choice;
+    window.parallel_tool_calls = inputs.parallel_tool_calls;
+    window.extract_reasoning = inputs.extract_reasoning;
+    window.now = inputs.now;
+    window.messages.clear();
+    window.messages.reserve(first + messages.size() - start);
+    window.messages.insert(window.messages.end(), messages.begin(), messages.begin() + first);
+    window.messages.insert(window.messages.end(), messages.begin() + start, messages.end());
+    n_window_past = first + inputs.n_past - start;
+    return true;
+}
+
+// Checks once per template and mode, on a sample conversation, that every turn is an append-only
+// extension of the previous render and that windowed deltas match the full ones byte for byte
+static bool common_chat_delta_window_probe(
+    const struct common_chat_templates * tmpls,
+    const struct common_chat_templates_inputs & inputs)
+{
+    std::atomic<int> & verdict = tmpls->delta_window_ok[(inputs.use_jinja ? 2 : 0) + (inputs.tools.empty() ? 0 : 1)];
+    const int known = verdict.load(std::memory_order_relaxed);
+    if (known != 0) {
+        return known > 0;
+    }
+
+    common_chat_templates_inputs probe;
+    probe.use_jinja = inputs.use_jinja;
+    probe.tools = inputs.tools;
+    probe.tool_choice = inputs.tool_choice;
+    probe.parallel_tool_calls = inputs.parallel_tool_calls;
+    probe.extract_reasoning = inputs.extract_reasoning;
+    probe.now = inputs.now;
+    const std::pair<const char *, const char *> turns[] = {
+        {"system", "You are a helpful assistant."},
+        {"user", "Hello!"},
+        {"assistant", "Hi there, how can I help?"},
+        {"user", "What is the capital of France?"},
+        {"assistant", "The capital of France is Paris."},
+        {"user", "And of Italy?"},
+    };
+    for (const auto & turn : turns) {
+        common_chat_msg msg;
+        msg.role = turn.first;
+        msg.content = turn.second;
+        probe.messages.push_back(std::move(msg));
+    }
+    probe.messages[4].reasoning_content = "The user asks about France.";
+
+    bool ok = true;
+    try {
+        std::string previous;
+        for (size_t n_past = 1; ok && n_past <= probe.messages.size(); n_past++) {
+            probe.n_past = n_past;
+            common_chat_params expected;
+            ok = common_chat_render_delta(tmpls, probe, n_past, expected);
+
+            // Earlier turns must survive later ones unchanged, not only the last rendered prefix
+            common_chat_templates_inputs head = probe;
+            head.messages.resize(n_past);
+            head.add_generation_prompt = false;
+            const std::string rendered = common_chat_templates_render(tmpls, head).prompt;
+            ok = ok && rendered.compare(0, previous.size(), previous) == 0;
+            previous = rendered;
+
+            common_chat_templates_inputs window;
+            size_t n_window_past = 0;
+            if (ok && common_chat_delta_window(probe, window, n_window_past)) {
+                common_chat_params windowed;
+                ok = common_chat_render_delta(tmpls, window, n_window_past, windowed) && windowed.prompt == expected.prompt;
+            }
+        }
+    } catch (const std::exception & e) {
+        LOG_DBG("%s: incremental rendering disabled, template failed on the probe: %s\n", __func__, e.what());
+        ok = false;
+    }
+    verdict.store(ok ? 1 : -1, std::memory_order_relaxed);
+    return ok;
+}
+
+static common_chat_params common_chat_templates_apply_delta(
+    const struct common_chat_templates * tmpls,
+    const struct common_chat_templates_inputs & inputs)
+{
+    common_chat_params params;
+    common_chat_templates_inputs window;
+    size_t n_window_past = 0;
+    if (common_chat_delta_window_probe(tmpls, inputs) && common_chat_delta_window(inputs, window, n_window_past)) {
+        try {
+            if (common_chat_render_delta(tmpls, window, n_window_past, params)) {
+                params.prompt_is_delta = true;
+                return params;
+            }
+        } catch (const std::exception & e) {
+            LOG_DBG("%s: windowed render failed, rendering the full chat: %s\n", __func__, e.what());
+        }
+    }
+    // On failure the params hold the full render
+    params.prompt_is_delta = common_chat_render_delta(tmpls, inputs, inputs.n_past, params);
+    return params;
+}
+
+common_chat_params common_chat_templates_apply(
+    const struct common_chat_templates * tmpls,
+    const struct common_chat_templates_inputs & inputs)
+{
+    LM_GGML_ASSERT(tmpls != nullptr);
+    if (inputs.n_past > 0 && inputs.n_past <= inputs.messages.size()) {
+        return common_chat_templates_apply_delta(tmpls, inputs);
+    }
+    return common_chat_templates_render(tmpls, inputs);
+}
+
 static common_chat_msg common_chat_parse_content_only(const std::string & input) {
     common_chat_msg msg;
     msg.role = "assistant";
@@ -3,6 +3,7 @@
 #pragma once
 
 #include "common.h"
+#include <atomic>
 #include <chrono>
 #include <string>
 #include <vector>
@@ -15,6 +16,9 @@ struct common_chat_templates {
     bool has_explicit_template; // Model had builtin template or template overridde was specified.
     std::unique_ptr<common_chat_template> template_default; // always set (defaults to chatml)
     std::unique_ptr<common_chat_template> template_tool_use;
+    // Whether rendering a window of the trailing messages reproduces the delta of a full render,
+    // probed once per {legacy, jinja} x {no tools, tools}: 0 unknown, 1 yes, -1 no
+    mutable std::atomic<int> delta_window_ok[4] = {};
 };
 
 struct common_chat_tool_call {
@@ -81,6 +85,9 @@ struct common_chat_templates_inputs {
     bool parallel_tool_calls = false;
     bool extract_reasoning     = true;
     std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
+    // When > 0, the first n_past messages were already rendered (without generation prompt) and
+    // the prompt only holds the text the remaining messages and the generation prompt add
+    size_t n_past = 0;
 };
 
 struct common_chat_params {
@@ -91,6 +98,9 @@ struct common_chat_params {
     std::vector<common_grammar_trigger> grammar_triggers;
     std::vector<std::string>            preserved_tokens;
     std::vector<std::string>            additional_stops;
+    // False when a delta was requested but the template re-renders earlier turns differently,
+    // in which case the prompt holds the full render instead
+    bool                                prompt_is_delta = false;
 };
 
 // Check if the template supplied via "--chat-template" is supported or not. Returns true if it's valid
@@ -1095,6 +1095,8 @@ struct llama_model_params common_model_params_to_llama(common_params & params) {
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
+    mparams.use_repack_cache = params.use_repack_cache;
+    mparams.use_layer_streaming = params.use_layer_streaming;
 
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
@@ -1143,6 +1145,10 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.defrag_max_cells  = std::max(0, params.defrag_max_cells);
+    cparams.compute_shrink_ms = params.compute_shrink_ms;
+    cparams.n_state_ckpt      = params.n_state_ckpt;
+    cparams.n_state_ckpt_interval = params.n_state_ckpt_interval;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
@@ -1158,6 +1164,7 @@ struct llama_context_params common_context_params_to_llama(const common_params &
 
     cparams.type_k = params.cache_type_k;
     cparams.type_v = params.cache_type_v;
+    cparams.n_kv_recent = params.cache_n_recent;
 
     return cparams;
 }
@@ -1174,6 +1181,7 @@ struct lm_ggml_threadpool_params lm_ggml_threadpool_params_from_cpu_params(const
     tpp.prio       = params.priority;
     tpp.poll       = params.poll;
     tpp.strict_cpu = params.strict_cpu;
+    tpp.hybrid     = params.hybrid;
 
     return tpp;
 }
@@ -1273,24 +1281,26 @@ std::vector<llama_token> common_tokenize(
   const struct llama_context * ctx,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special) {
+                        bool   parse_special,
+                     int32_t   n_threads) {
     const llama_model * model = llama_get_model(ctx);
     const llama_vocab * vocab = llama_model_get_vocab(model);
-    return common_tokenize(vocab, text, add_special, parse_special);
+    return common_tokenize(vocab, text, add_special, parse_special, n_threads);
 }
 
 std::vector<llama_token> common_tokenize(
     const struct llama_vocab * vocab,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special) {
+                        bool   parse_special,
+                     int32_t   n_threads) {
     // upper limit for the number of tokens
     int n_tokens = text.length() + 2 * add_special;
     std::vector<llama_token> result(n_tokens);
-    n_tokens = llama_tokenize(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special);
+    n_tokens = llama_tokenize_parallel(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special, n_threads);
     if (n_tokens < 0) {
         result.resize(-n_tokens);
-        int check = llama_tokenize(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special);
+        int check = llama_tokenize_parallel(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special, n_threads);
         LM_GGML_ASSERT(check == -n_tokens);
     } else {
         result.resize(n_tokens);
@@ -1298,6 +1308,36 @@ std::vector<llama_token> common_tokenize(
     return result;
 }
 
+std::vector<llama_token> common_tokenize_incremental(
+    const struct llama_vocab * vocab,
+           const std::string & prev_text,
+const std::vector<llama_token> & prev_tokens,
+           const std::string & text,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    const size_t n_check  = std::min(prev_text.size(), text.size());
+    const size_t n_shared = std::mismatch(text.begin(), text.begin() + n_check, prev_text.begin()).first - text.begin();
+
+    int32_t n_reused = 0;
+    // upper limit for the number of tokens, also when nothing can be reused
+    std::vector<llama_token> tokens(text.length() + 2 * add_special);
+    int n_tokens = llama_tokenize_incremental(vocab, text.data(), text.length(), prev_tokens.data(), prev_tokens.size(), n_shared,
+                                              tokens.data(), tokens.size(), add_special, parse_special, n_threads, &n_reused);
+    if (n_tokens < 0) {
+        tokens.resize(-n_tokens);
+        int check = llama_tokenize_incremental(vocab, text.data(), text.length(), prev_tokens.data(), prev_tokens.size(), n_shared,
+                                               tokens.data(), tokens.size(), add_special, parse_special, n_threads, &n_reused);
+        LM_GGML_ASSERT(check == -n_tokens);
+    } else {
+        tokens.resize(n_tokens);
+    }
+
+    std::vector<llama_token> result(prev_tokens.begin(), prev_tokens.begin() + n_reused);
+    result.insert(result.end(), tokens.begin(), tokens.end());
+    return result;
+}
+
 std::string common_token_to_piece(const struct llama_context * ctx, llama_token token, bool special) {
     const llama_model * model = llama_get_model(ctx);
     const llama_vocab * vocab = llama_model_get_vocab(model);
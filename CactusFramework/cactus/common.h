@@ -54,6 +54,7 @@ struct cpu_params {
     enum lm_ggml_sched_priority  priority   = LM_GGML_SCHED_PRIO_NORMAL;  // Scheduling prio : (0 - normal, 1 - medium, 2 - high, 3 - realtime)
     bool     strict_cpu                  = false;   // Use strict CPU placement
     uint32_t poll                        = 50;      // Polling (busywait) level (0 - no polling, 100 - mostly polling)
+    bool     hybrid                      = true;    // Core-type aware scheduling on P/E core CPUs
 };
 
 int32_t cpu_get_num_physical_cores();
@@ -155,6 +156,7 @@ struct common_params_sampling {
     bool    ignore_eos         = false;
     bool    no_perf            = false; // disable performance metrics
     bool    timing_per_token   = false;
+    bool    token_stats        = false; // output logsumexp, entropy and log-probs of the raw distribution (top n_probs from it too)
 
     std::vector<std::string> dry_sequence_breakers = {"\n", ":", "\"", "*"};     // default sequence breakers for DRY
 
@@ -239,6 +241,10 @@ struct common_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          =  0.1f; // KV cache defragmentation threshold
+    int32_t defrag_max_cells      =     0; // KV cells moved per defrag step (0 = whole defrag at once)
+    uint32_t compute_shrink_ms    =     0; // compute buffers sized for decode, shrunk this long after a prefill grew them (0 = worst case)
+    uint32_t n_state_ckpt         =     0; // recurrent state snapshots kept per sequence for rollback (0 = disabled)
+    uint32_t n_state_ckpt_interval =     0; // tokens between automatic snapshots (0 = only when requested)
 
     // offload params
     std::vector<lm_ggml_backend_dev_t> devices; // devices to use for offloading
@@ -334,6 +340,8 @@ struct common_params {
     bool no_kv_offload     = false; // disable KV offloading
     bool warmup            = true;  // warmup run
     bool check_tensors     = false; // validate tensor data
+    bool use_repack_cache  = true;  // cache the weights repacked for the CPU next to the model
+    bool use_layer_streaming = false; // stream mmap'd layer weights for models larger than RAM
     bool no_op_offload     = false; // globally disable offload host tensor operations to device
 
     bool single_turn       = false; // single turn chat conversation
@@ -343,6 +351,7 @@ struct common_params {
 
     lm_ggml_type cache_type_k = LM_GGML_TYPE_F16; // KV cache data type for the K
     lm_ggml_type cache_type_v = LM_GGML_TYPE_F16; // KV cache data type for the V
+    uint32_t  cache_n_recent  = 0;                // F16 cells kept ahead of a quantized KV cache (0 = not tiered)
 
     common_conversation_mode conversation_mode = COMMON_CONVERSATION_MODE_AUTO;
 
@@ -588,17 +597,31 @@ size_t common_lcs(const llama_tokens & a, const llama_tokens & b);
 
 // tokenizes a string into a vector of tokens
 // should work similar to Python's `tokenizer.encode`
+// n_threads > 1 splits long inputs of BPE vocabs across threads (see llama_tokenize_parallel)
 std::vector<llama_token> common_tokenize(
   const struct llama_context * ctx,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special = false);
+                        bool   parse_special = false,
+                     int32_t   n_threads     = 1);
 
 std::vector<llama_token> common_tokenize(
     const struct llama_vocab * vocab,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special = false);
+                        bool   parse_special = false,
+                     int32_t   n_threads     = 1);
+
+// tokenizes text reusing prev_tokens, the tokens of prev_text: only what follows the last safe
+// boundary in their common prefix is tokenized again
+std::vector<llama_token> common_tokenize_incremental(
+    const struct llama_vocab * vocab,
+           const std::string & prev_text,
+const std::vector<llama_token> & prev_tokens,
+           const std::string & text,
+                        bool   add_special,
+                        bool   parse_special = false,
+                     int32_t   n_threads     = 1);
 
 // tokenizes a token into a piece, optionally renders special/control tokens
 // should work similar to Python's `tokenizer.id_to_piece`
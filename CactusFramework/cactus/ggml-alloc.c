@@ -934,6 +934,26 @@ size_t lm_ggml_gallocr_get_buffer_size(lm_ggml_gallocr_t galloc, int buffer_id)
     return lm_ggml_backend_buffer_get_size(galloc->buffers[buffer_id]);
 }
 
+void lm_ggml_gallocr_release(lm_ggml_gallocr_t galloc) {
+    for (int i = 0; i < galloc->n_buffers; i++) {
+        if (galloc->buffers[i] == NULL) {
+            continue;
+        }
+        // buffers shared by a buffer type used multiple times are freed once
+        for (int j = i + 1; j < galloc->n_buffers; j++) {
+            if (galloc->buffers[j] == galloc->buffers[i]) {
+                galloc->buffers[j] = NULL;
+            }
+        }
+        lm_ggml_backend_buffer_free(galloc->buffers[i]);
+        galloc->buffers[i] = NULL;
+    }
+
+    // no graph matches the previous assignments any more
+    galloc->n_nodes = 0;
+    galloc->n_leafs = 0;
+}
+
 // utils
 
 static void free_buffers(lm_ggml_backend_buffer_t ** buffers, const size_t * n_buffers) {
@@ -66,6 +66,9 @@ LM_GGML_API bool lm_ggml_gallocr_alloc_graph(lm_ggml_gallocr_t galloc, struct lm
 
 LM_GGML_API size_t lm_ggml_gallocr_get_buffer_size(lm_ggml_gallocr_t galloc, int buffer_id);
 
+// free the buffers, the next reserve or alloc_graph allocates them again at the size that graph needs
+LM_GGML_API void lm_ggml_gallocr_release(lm_ggml_gallocr_t galloc);
+
 // Utils
 // Create a buffer and allocate all the tensors in a lm_ggml_context
 LM_GGML_API struct lm_ggml_backend_buffer * lm_ggml_backend_alloc_ctx_tensors_from_buft(struct lm_ggml_context * ctx, lm_ggml_backend_buffer_type_t buft);
@@ -63,6 +63,8 @@ extern "C" {
         void * context;
         size_t size;
         enum lm_ggml_backend_buffer_usage usage;
+        const char * category; // memory accounting label, NULL to derive it from usage
+        bool accounted;
     };
 
     LM_GGML_API lm_ggml_backend_buffer_t lm_ggml_backend_buffer_init(
@@ -12,6 +12,7 @@
 #include "ggml-backend-impl.h"
 #include "ggml-alloc.h"
 #include "ggml-impl.h"
+#include "ggml-signpost.h"
 
 #include <assert.h>
 #include <limits.h>
@@ -22,6 +23,7 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <mutex>
 
 #ifdef __APPLE__
 #include <sys/types.h>
@@ -77,8 +79,99 @@ lm_ggml_backend_dev_t lm_ggml_backend_buft_get_device(lm_ggml_backend_buffer_typ
     return buft->device;
 }
 
+// memory accounting
+
+struct lm_ggml_backend_memory_slot {
+    const char * category;
+    lm_ggml_backend_buffer_type_t buft;
+    size_t current;
+    size_t peak;
+    size_t n_buffers;
+};
+
+static std::mutex lm_ggml_backend_memory_mutex;
+static std::vector<lm_ggml_backend_memory_slot> lm_ggml_backend_memory_slots;
+static size_t lm_ggml_backend_memory_current = 0;
+static size_t lm_ggml_backend_memory_peak = 0;
+static thread_local const char * lm_ggml_backend_memory_scope_category = NULL;
+
+static const char * lm_ggml_backend_buffer_category(lm_ggml_backend_buffer_t buffer) {
+    if (buffer->category != NULL) {
+        return buffer->category;
+    }
+    switch (buffer->usage) {
+        case LM_GGML_BACKEND_BUFFER_USAGE_WEIGHTS: return "weights";
+        case LM_GGML_BACKEND_BUFFER_USAGE_COMPUTE: return "compute";
+        default:                                return "other";
+    }
+}
+
+static void lm_ggml_backend_memory_account(lm_ggml_backend_buffer_t buffer, bool add) {
+    if (!buffer->accounted) {
+        return;
+    }
+    const char * category = lm_ggml_backend_buffer_category(buffer);
+
+    std::lock_guard<std::mutex> lock(lm_ggml_backend_memory_mutex);
+    lm_ggml_backend_memory_slot * slot = NULL;
+    for (auto & s : lm_ggml_backend_memory_slots) {
+        if (s.buft == buffer->buft && strcmp(s.category, category) == 0) {
+            slot = &s;
+            break;
+        }
+    }
+    if (slot == NULL) {
+        lm_ggml_backend_memory_slots.push_back({ category, buffer->buft, 0, 0, 0 });
+        slot = &lm_ggml_backend_memory_slots.back();
+    }
+    if (add) {
+        slot->current += buffer->size;
+        slot->n_buffers++;
+        slot->peak = std::max(slot->peak, slot->current);
+        lm_ggml_backend_memory_current += buffer->size;
+        lm_ggml_backend_memory_peak = std::max(lm_ggml_backend_memory_peak, lm_ggml_backend_memory_current);
+    } else {
+        slot->current -= buffer->size;
+        slot->n_buffers--;
+        lm_ggml_backend_memory_current -= buffer->size;
+    }
+}
+
+const char * lm_ggml_backend_memory_scope(const char * category) {
+    const char * prev = lm_ggml_backend_memory_scope_category;
+    lm_ggml_backend_memory_scope_category = category;
+    return prev;
+}
+
+size_t lm_ggml_backend_memory_stats(struct lm_ggml_backend_memory_stat * stats, size_t n_max, size_t * peak_total) {
+    std::lock_guard<std::mutex> lock(lm_ggml_backend_memory_mutex);
+    const size_t n = lm_ggml_backend_memory_slots.size();
+    for (size_t i = 0; i < n && i < n_max; i++) {
+        const auto & slot = lm_ggml_backend_memory_slots[i];
+        stats[i].category  = slot.category;
+        stats[i].buft_name = slot.buft ? lm_ggml_backend_buft_name(slot.buft) : "unknown";
+        stats[i].current   = slot.current;
+        stats[i].peak      = slot.peak;
+        stats[i].n_buffers = slot.n_buffers;
+    }
+    if (peak_total) {
+        *peak_total = lm_ggml_backend_memory_peak;
+    }
+    return n;
+}
+
+void lm_ggml_backend_memory_reset_peak(void) {
+    std::lock_guard<std::mutex> lock(lm_ggml_backend_memory_mutex);
+    for (auto & slot : lm_ggml_backend_memory_slots) {
+        slot.peak = slot.current;
+    }
+    lm_ggml_backend_memory_peak = lm_ggml_backend_memory_current;
+}
+
 // backend buffer
 
+static void lm_ggml_backend_multi_buffer_free_buffer(lm_ggml_backend_buffer_t buffer);
+
 lm_ggml_backend_buffer_t lm_ggml_backend_buffer_init(
                lm_ggml_backend_buffer_type_t buft,
         struct lm_ggml_backend_buffer_i      iface,
@@ -89,8 +182,12 @@ lm_ggml_backend_buffer_t lm_ggml_backend_buffer_init(
         /* .buft      = */ buft,
         /* .context   = */ context,
         /* .size      = */ size,
-        /* .usage     = */ LM_GGML_BACKEND_BUFFER_USAGE_ANY
+        /* .usage     = */ LM_GGML_BACKEND_BUFFER_USAGE_ANY,
+        /* .category  = */ lm_ggml_backend_memory_scope_category,
+        // a multi buffer only groups buffers that are already counted
+        /* .accounted = */ size > 0 && iface.free_buffer != lm_ggml_backend_multi_buffer_free_buffer
     };
+    lm_ggml_backend_memory_account(buffer, true);
 
     return buffer;
 }
@@ -104,6 +201,7 @@ void lm_ggml_backend_buffer_free(lm_ggml_backend_buffer_t buffer) {
         return;
     }
 
+    lm_ggml_backend_memory_account(buffer, false);
     if (buffer->iface.free_buffer != NULL) {
         buffer->iface.free_buffer(buffer);
     }
@@ -161,7 +259,9 @@ bool lm_ggml_backend_buffer_is_host(lm_ggml_backend_buffer_t buffer) {
 }
 
 void lm_ggml_backend_buffer_set_usage(lm_ggml_backend_buffer_t buffer, enum lm_ggml_backend_buffer_usage usage) {
+    lm_ggml_backend_memory_account(buffer, false);
     buffer->usage = usage;
+    lm_ggml_backend_memory_account(buffer, true);
 
     // FIXME: add a generic callback to the buffer interface
     if (lm_ggml_backend_buffer_is_multi_buffer(buffer)) {
@@ -593,6 +693,22 @@ void lm_ggml_backend_multi_buffer_set_usage(lm_ggml_backend_buffer_t buffer, enu
     }
 }
 
+// The first category sticks, so buffers created inside a scope keep the scope's
+void lm_ggml_backend_buffer_set_category(lm_ggml_backend_buffer_t buffer, const char * category) {
+    if (buffer->category == NULL) {
+        lm_ggml_backend_memory_account(buffer, false);
+        buffer->category = category;
+        lm_ggml_backend_memory_account(buffer, true);
+    }
+
+    if (lm_ggml_backend_buffer_is_multi_buffer(buffer)) {
+        lm_ggml_backend_multi_buffer_context * ctx = (lm_ggml_backend_multi_buffer_context *) buffer->context;
+        for (size_t i = 0; i < ctx->n_buffers; i++) {
+            lm_ggml_backend_buffer_set_category(ctx->buffers[i], category);
+        }
+    }
+}
+
 // creates a copy of the tensor with the same memory layout
 static struct lm_ggml_tensor * lm_ggml_dup_tensor_layout(struct lm_ggml_context * ctx, const struct lm_ggml_tensor * tensor) {
     struct lm_ggml_tensor * dup = lm_ggml_dup_tensor(ctx, tensor);
@@ -1361,8 +1477,11 @@ static enum lm_ggml_status lm_ggml_backend_sched_compute_splits(lm_ggml_backend_
         struct lm_ggml_backend_sched_split * split = &splits[i];
         int split_backend_id = split->backend_id;
         lm_ggml_backend_t split_backend = sched->backends[split_backend_id];
+        LM_GGML_SIGNPOST_BEGIN(sp_split, "sched_split", "split=%d backend=%{public}s nodes=%d inputs=%d",
+            i, lm_ggml_backend_name(split_backend), split->graph.n_nodes, split->n_inputs);
 
         // copy the input tensors to the split backend
+        LM_GGML_SIGNPOST_BEGIN(sp_inputs, "split_inputs", "split=%d", i);
         for (int j = 0; j < split->n_inputs; j++) {
             lm_ggml_backend_t input_backend = lm_ggml_backend_sched_get_tensor_backend(sched, split->inputs[j]);
             struct lm_ggml_tensor * input = split->inputs[j];
@@ -1396,6 +1515,7 @@ static enum lm_ggml_status lm_ggml_backend_sched_compute_splits(lm_ggml_backend_
                 }
             }
         }
+        LM_GGML_SIGNPOST_END(sp_inputs, "split_inputs");
 
         if (!sched->callback_eval) {
             enum lm_ggml_status ec = lm_ggml_backend_graph_compute_async(split_backend, &split->graph);
@@ -1442,6 +1562,7 @@ static enum lm_ggml_status lm_ggml_backend_sched_compute_splits(lm_ggml_backend_
                 lm_ggml_backend_event_record(sched->events[split_backend_id][sched->cur_copy], split_backend);
             }
         }
+        LM_GGML_SIGNPOST_END(sp_split, "sched_split");
     }
 
     sched->cur_copy = (sched->cur_copy + 1) % sched->n_copies;
@@ -1629,6 +1750,12 @@ size_t lm_ggml_backend_sched_get_buffer_size(lm_ggml_backend_sched_t sched, lm_g
     return lm_ggml_gallocr_get_buffer_size(sched->galloc, backend_index);
 }
 
+void lm_ggml_backend_sched_release_buffers(lm_ggml_backend_sched_t sched) {
+    lm_ggml_backend_sched_synchronize(sched);
+    lm_ggml_backend_sched_reset(sched);
+    lm_ggml_gallocr_release(sched->galloc);
+}
+
 void lm_ggml_backend_sched_set_tensor_backend(lm_ggml_backend_sched_t sched, struct lm_ggml_tensor * node, lm_ggml_backend_t backend) {
     int backend_index = lm_ggml_backend_sched_backend_id(sched, backend);
     LM_GGML_ASSERT(backend_index >= 0 && backend_index < sched->n_backends);
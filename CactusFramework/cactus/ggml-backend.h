@@ -67,6 +67,28 @@ extern "C" {
     LM_GGML_API lm_ggml_backend_buffer_type_t     lm_ggml_backend_buffer_get_type      (lm_ggml_backend_buffer_t buffer);
     LM_GGML_API void                           lm_ggml_backend_buffer_reset         (lm_ggml_backend_buffer_t buffer);
 
+    //
+    // Memory accounting
+    //
+
+    // Live buffer bytes grouped by category and buffer type. A buffer's category is the scope it was
+    // created in, else the one set with lm_ggml_backend_buffer_set_category, else its usage
+    // ("weights", "compute" or "other"). Category strings must outlive the buffers that use them.
+    struct lm_ggml_backend_memory_stat {
+        const char * category;
+        const char * buft_name;
+        size_t current;
+        size_t peak;
+        size_t n_buffers;
+    };
+
+    // Sets the category of buffers created on this thread until the scope is changed again; returns the previous scope
+    LM_GGML_API const char * lm_ggml_backend_memory_scope(const char * category);
+    LM_GGML_API void         lm_ggml_backend_buffer_set_category(lm_ggml_backend_buffer_t buffer, const char * category);
+    // Copies up to n_max rows and returns the number of rows available; peak_total is the high-water mark of all buffers combined
+    LM_GGML_API size_t       lm_ggml_backend_memory_stats(struct lm_ggml_backend_memory_stat * stats, size_t n_max, size_t * peak_total);
+    LM_GGML_API void         lm_ggml_backend_memory_reset_peak(void);
+
     // tensor copy between different backends
     LM_GGML_API void lm_ggml_backend_tensor_copy(struct lm_ggml_tensor * src, struct lm_ggml_tensor * dst);
 
@@ -304,6 +326,9 @@ extern "C" {
 
     LM_GGML_API size_t               lm_ggml_backend_sched_get_buffer_size(lm_ggml_backend_sched_t sched, lm_ggml_backend_t backend);
 
+    // Free the compute buffers; the next reserve or graph allocation sizes them for that graph
+    LM_GGML_API void                 lm_ggml_backend_sched_release_buffers(lm_ggml_backend_sched_t sched);
+
     LM_GGML_API void                 lm_ggml_backend_sched_set_tensor_backend(lm_ggml_backend_sched_t sched, struct lm_ggml_tensor * node, lm_ggml_backend_t backend);
     LM_GGML_API lm_ggml_backend_t       lm_ggml_backend_sched_get_tensor_backend(lm_ggml_backend_sched_t sched, struct lm_ggml_tensor * node);
 
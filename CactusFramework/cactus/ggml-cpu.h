@@ -58,6 +58,11 @@ extern "C" {
     LM_GGML_BACKEND_API void                          lm_ggml_threadpool_pause         (struct lm_ggml_threadpool * threadpool);
     LM_GGML_BACKEND_API void                          lm_ggml_threadpool_resume        (struct lm_ggml_threadpool * threadpool);
 
+    // A threadpool may be shared by several contexts: their graphs run one at a time, and while a
+    // thread marked interactive is waiting no other graph is started. Sets the flag for the calling
+    // thread and returns the previous value.
+    LM_GGML_BACKEND_API bool                          lm_ggml_threadpool_set_interactive(bool interactive);
+
     // lm_ggml_graph_plan() has to be called before lm_ggml_graph_compute()
     // when plan.work_size > 0, caller must allocate memory for plan.work_data
     LM_GGML_BACKEND_API struct lm_ggml_cplan lm_ggml_graph_plan(
@@ -131,6 +136,10 @@ extern "C" {
     LM_GGML_BACKEND_API void lm_ggml_backend_cpu_set_threadpool    (lm_ggml_backend_t backend_cpu, lm_ggml_threadpool_t threadpool);
     LM_GGML_BACKEND_API void lm_ggml_backend_cpu_set_abort_callback(lm_ggml_backend_t backend_cpu, lm_ggml_abort_callback abort_callback, void * abort_callback_data);
 
+    // name of the interleaved layout a weight in a CPU repack buffer is stored in (e.g. "q4_K_4x4"), NULL if it is not repacked
+    // the repacked bytes are host memory at tensor->data, the same size as the original data
+    LM_GGML_BACKEND_API const char * lm_ggml_backend_cpu_repack_layout(const struct lm_ggml_tensor * tensor);
+
     LM_GGML_BACKEND_API lm_ggml_backend_reg_t lm_ggml_backend_cpu_reg(void);
 
     LM_GGML_BACKEND_API void lm_ggml_cpu_fp32_to_fp16(const float *, lm_ggml_fp16_t *, int64_t);
@@ -138,6 +147,10 @@ extern "C" {
     LM_GGML_BACKEND_API void lm_ggml_cpu_fp32_to_bf16(const float *, lm_ggml_bf16_t *, int64_t);
     LM_GGML_BACKEND_API void lm_ggml_cpu_bf16_to_fp32(const lm_ggml_bf16_t *, float *, int64_t);
 
+    // y = exp(x - max) with the vectorized exp of the CPU backend, returns the sum of y
+    // softmax over data that is not in a graph, e.g. the sampler's candidates
+    LM_GGML_BACKEND_API double lm_ggml_cpu_exp_sum_f32(const float * x, float * y, int64_t n, float max);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,179 @@
+#include "accelerate.h"
+#include "ggml-backend-impl.h"
+#include "ggml-backend.h"
+#include "ggml-impl.h"
+#include "ggml-cpu.h"
+#include "ggml-cpu-traits.h"
+
+#if defined(__APPLE__)
+
+#include <Accelerate/Accelerate.h>
+
+#include <algorithm>
+
+// rows of src0 per sgemm call, F16 rows are widened into wdata first
+#define LM_GGML_ACCELERATE_CHUNK_ROWS 256
+
+// below this many src1 rows (i.e. token generation) the vec_dot kernels win
+#define LM_GGML_ACCELERATE_MIN_BATCH 32
+
+// Accelerate's sgemm runs on the Apple matrix coprocessor, so batched F32/F16 matmuls
+// (prompt processing, attention over the cache) are routed through it. Weights are not
+// repacked: the buffer type below is never chosen for weights, it only hooks the
+// extra-op dispatch so tensors keep living in the default, mmap-backed CPU buffer.
+namespace ggml::cpu::accelerate {
+
+static bool can_mul_mat(const struct lm_ggml_tensor * op) {
+    if (op->op != LM_GGML_OP_MUL_MAT) {
+        return false;
+    }
+
+    const struct lm_ggml_tensor * src0 = op->src[0];
+    const struct lm_ggml_tensor * src1 = op->src[1];
+
+    if (src0->type != LM_GGML_TYPE_F32 && src0->type != LM_GGML_TYPE_F16) {
+        return false;
+    }
+    if (src1->type != LM_GGML_TYPE_F32 || op->type != LM_GGML_TYPE_F32) {
+        return false;
+    }
+    // repacked or device-side weights belong to their own buffer type
+    if (src0->buffer && !lm_ggml_backend_buft_is_host(src0->buffer->buft)) {
+        return false;
+    }
+    if (src1->ne[1] < LM_GGML_ACCELERATE_MIN_BATCH || src0->ne[1] < 32 || src0->ne[0] < 32) {
+        return false;
+    }
+    // rows must be contiguous, everything else is addressed through the strides
+    return src0->nb[0] == lm_ggml_type_size(src0->type) &&
+           src1->nb[0] == sizeof(float) &&
+           op->nb[0]   == sizeof(float);
+}
+
+static void mul_mat(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * dst) {
+    const struct lm_ggml_tensor * src0 = dst->src[0];
+    const struct lm_ggml_tensor * src1 = dst->src[1];
+
+    LM_GGML_TENSOR_BINARY_OP_LOCALS
+
+    // Accelerate spreads each sgemm over the matrix units by itself, calls from every graph thread
+    // would only contend for them: thread 0 runs the whole product, the others go on to the barrier
+    if (params->ith != 0) {
+        return;
+    }
+
+    const int64_t r2 = ne12/ne02;
+    const int64_t r3 = ne13/ne03;
+
+    const int64_t n_chunk0 = (ne01 + LM_GGML_ACCELERATE_CHUNK_ROWS - 1)/LM_GGML_ACCELERATE_CHUNK_ROWS;
+    const int64_t n_chunk  = n_chunk0*ne12*ne13;
+
+    float * wdata = (float *) params->wdata;
+
+    for (int64_t c = 0; c < n_chunk; c++) {
+        const int64_t i13 = c/(n_chunk0*ne12);
+        const int64_t i12 = (c/n_chunk0) % ne12;
+        const int64_t ir0 = (c % n_chunk0)*LM_GGML_ACCELERATE_CHUNK_ROWS;
+        const int64_t nr  = std::min<int64_t>(LM_GGML_ACCELERATE_CHUNK_ROWS, ne01 - ir0);
+
+        const char  * x = (const char  *) src0->data + ir0*nb01 + (i12/r2)*nb02 + (i13/r3)*nb03;
+        const float * y = (const float *) ((const char *) src1->data + i12*nb12 + i13*nb13);
+        float       * d = (float       *) ((char *) dst->data + ir0*nb0 + i12*nb2 + i13*nb3);
+
+        const float * a   = (const float *) x;
+        int64_t       lda = nb01/sizeof(float);
+
+        if (src0->type == LM_GGML_TYPE_F16) {
+            for (int64_t i = 0; i < nr; i++) {
+                lm_ggml_cpu_fp16_to_fp32((const lm_ggml_fp16_t *) (x + i*nb01), wdata + i*ne00, ne00);
+            }
+            a   = wdata;
+            lda = ne00;
+        }
+
+        // d[ne11, nr] = y[ne11, ne00] * a[nr, ne00]^T
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                    ne11, nr, ne00,
+                    1.0f, y, nb11/sizeof(float),
+                          a, lda,
+                    0.0f, d, nb1/sizeof(float));
+    }
+}
+
+class tensor_traits : public ggml::cpu::tensor_traits {
+    bool work_size(int n_threads, const struct lm_ggml_tensor * op, size_t & size) override {
+        if (!can_mul_mat(op)) {
+            return false;
+        }
+        size = 0;
+        if (op->src[0]->type == LM_GGML_TYPE_F16) {
+            size = sizeof(float)*op->src[0]->ne[0]*LM_GGML_ACCELERATE_CHUNK_ROWS;
+        }
+        LM_GGML_UNUSED(n_threads);
+        return true;
+    }
+
+    bool compute_forward(struct lm_ggml_compute_params * params, struct lm_ggml_tensor * op) override {
+        if (!can_mul_mat(op)) {
+            return false;
+        }
+        mul_mat(params, op);
+        return true;
+    }
+};
+
+class extra_buffer_type : ggml::cpu::extra_buffer_type {
+    bool supports_op(lm_ggml_backend_dev_t, const struct lm_ggml_tensor *) override {
+        // nothing is stored in this buffer type, see above
+        return false;
+    }
+
+    ggml::cpu::tensor_traits * get_tensor_traits(const struct lm_ggml_tensor * op) override {
+        static tensor_traits traits;
+        return can_mul_mat(op) ? &traits : nullptr;
+    }
+};
+
+}  // namespace ggml::cpu::accelerate
+
+static const char * lm_ggml_backend_cpu_accelerate_buffer_type_get_name(lm_ggml_backend_buffer_type_t buft) {
+    return "CPU_ACCELERATE";
+
+    LM_GGML_UNUSED(buft);
+}
+
+static lm_ggml_backend_buffer_t lm_ggml_backend_cpu_accelerate_buffer_type_alloc_buffer(lm_ggml_backend_buffer_type_t buft, size_t size) {
+    lm_ggml_backend_buffer_t buffer = lm_ggml_backend_buft_alloc_buffer(lm_ggml_backend_cpu_buffer_type(), size);
+
+    if (buffer == nullptr) {
+        return nullptr;
+    }
+
+    buffer->buft = buft;
+    return buffer;
+}
+
+static size_t lm_ggml_backend_cpu_accelerate_buffer_type_get_alignment(lm_ggml_backend_buffer_type_t buft) {
+    return TENSOR_ALIGNMENT;
+
+    LM_GGML_UNUSED(buft);
+}
+
+lm_ggml_backend_buffer_type_t lm_ggml_backend_cpu_accelerate_buffer_type(void) {
+    static struct lm_ggml_backend_buffer_type lm_ggml_backend_cpu_buffer_type_accelerate = {
+        /* .iface    = */ {
+                           /* .get_name         = */ lm_ggml_backend_cpu_accelerate_buffer_type_get_name,
+                           /* .alloc_buffer     = */ lm_ggml_backend_cpu_accelerate_buffer_type_alloc_buffer,
+                           /* .get_alignment    = */ lm_ggml_backend_cpu_accelerate_buffer_type_get_alignment,
+                           /* .get_max_size     = */ nullptr,  // defaults to SIZE_MAX
+                           /* .get_alloc_size   = */ nullptr,  // defaults to lm_ggml_nbytes
+                           /* .is_host          = */ nullptr,  // keeps llama from placing weights here
+                           },
+        /* .device  = */ lm_ggml_backend_reg_dev_get(lm_ggml_backend_cpu_reg(), 0),
+        /* .context = */ new ggml::cpu::accelerate::extra_buffer_type(),
+    };
+
+    return &lm_ggml_backend_cpu_buffer_type_accelerate;
+}
+
+#endif // __APPLE__
@@ -0,0 +1,8 @@
+#include "ggml-backend.h"
+#include "ggml-cpu-impl.h"
+
+// GGML internal header
+
+#if defined(__APPLE__)
+lm_ggml_backend_buffer_type_t lm_ggml_backend_cpu_accelerate_buffer_type(void);
+#endif
@@ -15,9 +15,23 @@
 #include <cfloat>
 #include <cstdlib> // for qsort
 #include <cstdio>  // for LM_GGML_ASSERT
+#include <string>
 
 #include "ggml-cpu-aarch64.h"
 
+// The dotprod kernels carry the feature as a target attribute when the file is built for baseline
+// armv8, so nothing else in it can use sdot. They only run for layouts that
+// lm_ggml_aarch64_get_optimal_repack_type picked after lm_ggml_cpu_has_dotprod() found the feature.
+#if defined(__ARM_FEATURE_DOTPROD)
+#define LM_GGML_AARCH64_DOTPROD 1
+#define LM_GGML_AARCH64_DOTPROD_TARGET
+#elif defined(__clang__) && defined(__aarch64__) && defined(__ARM_NEON)
+#define LM_GGML_AARCH64_DOTPROD 1
+#define LM_GGML_AARCH64_DOTPROD_TARGET __attribute__((target("dotprod")))
+#else
+#define LM_GGML_AARCH64_DOTPROD_TARGET
+#endif
+
 // TODO: move to include file?
 template <int K> constexpr int QK_0() {
     if constexpr (K == 4) {
@@ -63,6 +77,37 @@ struct block_q8_Kx4 {
 
 static_assert(sizeof(block_q8_Kx4) == sizeof(float) * 4 + QK_K * 4 + (QK_K / 4) * sizeof(int16_t), "wrong q8_K block size/padding");
 
+// 4x4 interleaved K-quants for the NEON dotprod kernels: four rows are interleaved four bytes
+// at a time. The 6-bit scales and mins keep the 12-byte block_q4_K packing, but each group of
+// 12 bytes holds two sub-blocks of all four rows, so one group unpacks to [sub-block][row]
+struct block_q4_Kx4 {
+    lm_ggml_half d[4];      // super-block scales for quantized scales
+    lm_ggml_half dmin[4];   // super-block scales for quantized mins
+    uint8_t scales[48];  // scales and mins, quantized with 6 bits
+    uint8_t qs[512];     // 4--bit quants
+};
+
+static_assert(sizeof(block_q4_Kx4) == sizeof(lm_ggml_half) * 8 + K_SCALE_SIZE * 4 + QK_K * 2, "wrong q4_Kx4 block size/padding");
+
+struct block_q5_Kx4 {
+    lm_ggml_half d[4];      // super-block scales for quantized scales
+    lm_ggml_half dmin[4];   // super-block scales for quantized mins
+    uint8_t scales[48];  // scales and mins, quantized with 6 bits, grouped as in block_q4_Kx4
+    uint8_t qh[128];     // quants, high bit
+    uint8_t qs[512];     // quants, low 4 bits
+};
+
+static_assert(sizeof(block_q5_Kx4) == sizeof(lm_ggml_half) * 8 + K_SCALE_SIZE * 4 + QK_K / 2 + QK_K * 2, "wrong q5_Kx4 block size/padding");
+
+struct block_q6_Kx4 {
+    lm_ggml_half d[4];      // super-block scales
+    int8_t  scales[64];  // 8-bit scales, [group of 16][row]
+    uint8_t ql[512];     // quants, lower 4 bits
+    uint8_t qh[256];     // quants, upper 2 bits
+};
+
+static_assert(sizeof(block_q6_Kx4) == sizeof(lm_ggml_half) * 4 + QK_K / 4 + QK_K * 3, "wrong q6_Kx4 block size/padding");
+
 struct block_iq4_nlx4 {
     lm_ggml_half d[4];            // deltas for 4 iq4_nl blocks
     uint8_t   qs[QK4_NL * 2];  // nibbles / quants for 4 iq4_nl blocks
@@ -817,6 +862,38 @@ static void lm_ggml_quantize_mat_q8_K_4x8(const float * LM_GGML_RESTRICT x, void
 #endif
 }
 
+
+static void lm_ggml_quantize_mat_q8_K_4x4(const float * LM_GGML_RESTRICT x, void * LM_GGML_RESTRICT vy, int64_t k) {
+    assert(QK_K == 256);
+    assert(k % QK_K == 0);
+    const int nb = k / QK_K;
+
+    block_q8_Kx4 * LM_GGML_RESTRICT y = (block_q8_Kx4 *) vy;
+
+    const lm_ggml_from_float_t from_float = lm_ggml_get_type_traits_cpu(LM_GGML_TYPE_Q8_K)->from_float;
+    block_q8_K tmp[4];
+
+    // Rows are quantized one by one as q8_K, the quants are then interleaved in sequence of four bytes
+    // from the four rows, and the bsums are stored row minor (bsums[4 * g + row] for group g of 16 quants)
+    for (int i = 0; i < nb; i++) {
+        for (int row_iter = 0; row_iter < 4; row_iter++) {
+            from_float(x + row_iter * k + i * QK_K, &tmp[row_iter], QK_K);
+            y[i].d[row_iter] = tmp[row_iter].d;
+        }
+
+        for (int j = 0; j < QK_K; j += 4) {
+            for (int row_iter = 0; row_iter < 4; row_iter++) {
+                memcpy(&y[i].qs[j * 4 + row_iter * 4], &tmp[row_iter].qs[j], 4);
+            }
+        }
+
+        for (int g = 0; g < QK_K / 16; g++) {
+            for (int row_iter = 0; row_iter < 4; row_iter++) {
+                y[i].bsums[g * 4 + row_iter] = tmp[row_iter].bsums[g];
+            }
+        }
+    }
+}
 template <int64_t INTER_SIZE, lm_ggml_type PARAM_TYPE>
 void lm_ggml_quantize_mat_t(const float * LM_GGML_RESTRICT x, void * LM_GGML_RESTRICT vy, int64_t nrow, int64_t n_per_row);
 
@@ -838,7 +915,13 @@ template <> void lm_ggml_quantize_mat_t<8, LM_GGML_TYPE_Q8_K>(const float * LM_G
     lm_ggml_quantize_mat_q8_K_4x8(x, vy, n_per_row);
 }
 
-static void lm_ggml_gemv_q4_0_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
+template <> void lm_ggml_quantize_mat_t<4, LM_GGML_TYPE_Q8_K>(const float * LM_GGML_RESTRICT x, void * LM_GGML_RESTRICT vy, int64_t nrow, int64_t n_per_row) {
+    assert(nrow == 4);
+    UNUSED(nrow);
+    lm_ggml_quantize_mat_q8_K_4x4(x, vy, n_per_row);
+}
+
+LM_GGML_AARCH64_DOTPROD_TARGET static void lm_ggml_gemv_q4_0_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
     const int qk = QK8_0;
     const int nb = n / qk;
     const int ncols_interleaved = 4;
@@ -857,7 +940,7 @@ static void lm_ggml_gemv_q4_0_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size_t
     UNUSED(ncols_interleaved);
     UNUSED(blocklen);
 
-#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(__ARM_FEATURE_DOTPROD)
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(LM_GGML_AARCH64_DOTPROD)
     if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
         const block_q4_0x4 * b_ptr = (const block_q4_0x4 *) vx;
 
@@ -897,7 +980,7 @@ static void lm_ggml_gemv_q4_0_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size_t
         }
         return;
     }
-#endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(__ARM_FEATURE_DOTPROD)
+#endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(LM_GGML_AARCH64_DOTPROD)
     float sumf[4];
     int sumi;
 
@@ -923,7 +1006,7 @@ static void lm_ggml_gemv_q4_0_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size_t
     }
 }
 
-static void lm_ggml_gemv_q4_0_4x8_q8_0(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
+LM_GGML_AARCH64_DOTPROD_TARGET static void lm_ggml_gemv_q4_0_4x8_q8_0(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
     const int qk = QK8_0;
     const int nb = n / qk;
     const int ncols_interleaved = 4;
@@ -942,7 +1025,7 @@ static void lm_ggml_gemv_q4_0_4x8_q8_0(int n, float * LM_GGML_RESTRICT s, size_t
     UNUSED(ncols_interleaved);
     UNUSED(blocklen);
 
-#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(__ARM_FEATURE_DOTPROD)
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(LM_GGML_AARCH64_DOTPROD)
     if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
         const block_q4_0x4 * b_ptr = (const block_q4_0x4 *) vx;
 
@@ -987,7 +1070,7 @@ static void lm_ggml_gemv_q4_0_4x8_q8_0(int n, float * LM_GGML_RESTRICT s, size_t
         }
         return;
     }
-#endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(__ARM_FEATURE_DOTPROD)
+#endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(LM_GGML_AARCH64_DOTPROD)
     float sumf[4];
     int sumi;
 
@@ -1561,7 +1644,7 @@ static void lm_ggml_gemv_q4_K_8x8_q8_K(int n, float * LM_GGML_RESTRICT s, size_t
 }
 
 
-static void lm_ggml_gemv_iq4_nl_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
+LM_GGML_AARCH64_DOTPROD_TARGET static void lm_ggml_gemv_iq4_nl_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
     const int qk = QK8_0;
     const int nb = n / qk;
     const int ncols_interleaved = 4;
@@ -1580,7 +1663,7 @@ static void lm_ggml_gemv_iq4_nl_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size
     UNUSED(ncols_interleaved);
     UNUSED(blocklen);
 
-#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(__ARM_FEATURE_DOTPROD)
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(LM_GGML_AARCH64_DOTPROD)
     if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
         const int8x16_t kvalues = vld1q_s8(kvalues_iq4nl);
         const block_q8_0 * a_ptr = (const block_q8_0 *) vy;
@@ -1657,14 +1740,398 @@ static void lm_ggml_gemv_iq4_nl_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size
     }
 }
 
-static void lm_ggml_gemm_q4_0_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
+// unpacks the scales and mins of a block_q4_Kx4/block_q5_Kx4 to one byte each, [sub-block][row]
+static inline void lm_ggml_unpack_scales_mins_Kx4(const uint8_t * LM_GGML_RESTRICT q, uint8_t * LM_GGML_RESTRICT scales, uint8_t * LM_GGML_RESTRICT mins) {
+    static const uint32_t kmask1 = 0x3f3f3f3f;
+    static const uint32_t kmask2 = 0x0f0f0f0f;
+    static const uint32_t kmask3 = 0x03030303;
+
+    uint32_t utmp[4];
+    for (int j = 0; j < 4; j++) {
+        memcpy(utmp, q + K_SCALE_SIZE * j, K_SCALE_SIZE);
+        utmp[3] = ((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4);
+        const uint32_t uaux = utmp[1] & kmask1;
+        utmp[1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+        utmp[2] = uaux;
+        utmp[0] &= kmask1;
+
+        memcpy(scales + 8 * j, utmp + 0, 8);
+        memcpy(mins   + 8 * j, utmp + 2, 8);
+    }
+}
+
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(LM_GGML_AARCH64_DOTPROD)
+// acc[j] += dot(b_i[4j .. 4j+3], a[4i .. 4i+3]) for the four columns j of a 4x4 interleaved weight block
+LM_GGML_AARCH64_DOTPROD_TARGET static inline int32x4_t lm_ggml_vdotq_laneq_x4(int32x4_t acc, int8x16_t b_0, int8x16_t b_1, int8x16_t b_2, int8x16_t b_3, int8x16_t a) {
+    acc = vdotq_laneq_s32(acc, b_0, a, 0);
+    acc = vdotq_laneq_s32(acc, b_1, a, 1);
+    acc = vdotq_laneq_s32(acc, b_2, a, 2);
+    acc = vdotq_laneq_s32(acc, b_3, a, 3);
+    return acc;
+}
+
+// acc[m][j] += dot(b[4j .. 4j+3], a[4m .. 4m+3]) for four rows m of a 4x4 interleaved activation block
+LM_GGML_AARCH64_DOTPROD_TARGET static inline void lm_ggml_vdotq_rows_x4(int32x4_t * acc, int8x16_t b, int8x16_t a) {
+    acc[0] = vdotq_laneq_s32(acc[0], b, a, 0);
+    acc[1] = vdotq_laneq_s32(acc[1], b, a, 1);
+    acc[2] = vdotq_laneq_s32(acc[2], b, a, 2);
+    acc[3] = vdotq_laneq_s32(acc[3], b, a, 3);
+}
+#endif
+
+LM_GGML_AARCH64_DOTPROD_TARGET static void lm_ggml_gemv_q4_K_4x4_q8_K(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 4;
+    const int blocklen = 4;
+
+    assert (n % qk == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(LM_GGML_AARCH64_DOTPROD)
+    if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
+        const uint8x16_t m4b = vdupq_n_u8(0x0F);
+        const block_q8_K * a_ptr = (const block_q8_K *) vy;
+
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q4_Kx4 * b_ptr = (const block_q4_Kx4 *) vx + (x * nb);
+
+            float32x4_t sumf = vdupq_n_f32(0);
+            for (int l = 0; l < nb; l++) {
+                uint8_t scales[32];
+                uint8_t mins[32];
+                lm_ggml_unpack_scales_mins_Kx4(b_ptr[l].scales, scales, mins);
+
+                int32x4_t sumi = vdupq_n_s32(0);
+
+                // 64 quants per iteration: the low nibbles hold sub-block 2j, the high nibbles sub-block 2j + 1
+                for (int j = 0; j < 4; j++) {
+                    int32x4_t sumi_lo = vdupq_n_s32(0);
+                    int32x4_t sumi_hi = vdupq_n_s32(0);
+
+                    for (int k = 0; k < 2; k++) {
+                        const uint8x16_t b_0 = vld1q_u8(b_ptr[l].qs + 128 * j + 64 * k + 0);
+                        const uint8x16_t b_1 = vld1q_u8(b_ptr[l].qs + 128 * j + 64 * k + 16);
+                        const uint8x16_t b_2 = vld1q_u8(b_ptr[l].qs + 128 * j + 64 * k + 32);
+                        const uint8x16_t b_3 = vld1q_u8(b_ptr[l].qs + 128 * j + 64 * k + 48);
+
+                        const int8x16_t a_lo = vld1q_s8(a_ptr[l].qs + 64 * j + 16 * k);
+                        const int8x16_t a_hi = vld1q_s8(a_ptr[l].qs + 64 * j + 16 * k + 32);
+
+                        sumi_lo = lm_ggml_vdotq_laneq_x4(sumi_lo,
+                                vreinterpretq_s8_u8(vandq_u8(b_0, m4b)), vreinterpretq_s8_u8(vandq_u8(b_1, m4b)),
+                                vreinterpretq_s8_u8(vandq_u8(b_2, m4b)), vreinterpretq_s8_u8(vandq_u8(b_3, m4b)), a_lo);
+                        sumi_hi = lm_ggml_vdotq_laneq_x4(sumi_hi,
+                                vreinterpretq_s8_u8(vshrq_n_u8(b_0, 4)), vreinterpretq_s8_u8(vshrq_n_u8(b_1, 4)),
+                                vreinterpretq_s8_u8(vshrq_n_u8(b_2, 4)), vreinterpretq_s8_u8(vshrq_n_u8(b_3, 4)), a_hi);
+                    }
+
+                    const uint16x8_t sc = vmovl_u8(vld1_u8(scales + 8 * j));
+                    sumi = vmlaq_s32(sumi, sumi_lo, vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(sc))));
+                    sumi = vmlaq_s32(sumi, sumi_hi, vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(sc))));
+                }
+
+                int32x4_t summ = vdupq_n_s32(0);
+                for (int j = 0; j < 4; j++) {
+                    const int16x8_t mn = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(mins + 8 * j)));
+                    summ = vmlal_n_s16(summ, vget_low_s16(mn),  a_ptr[l].bsums[4 * j + 0] + a_ptr[l].bsums[4 * j + 1]);
+                    summ = vmlal_n_s16(summ, vget_high_s16(mn), a_ptr[l].bsums[4 * j + 2] + a_ptr[l].bsums[4 * j + 3]);
+                }
+
+                const float32x4_t b_d    = vcvt_f32_f16(vld1_f16((const float16_t *) b_ptr[l].d));
+                const float32x4_t b_dmin = vcvt_f32_f16(vld1_f16((const float16_t *) b_ptr[l].dmin));
+
+                sumf = vmlaq_f32(sumf, vmulq_n_f32(b_d,    a_ptr[l].d), vcvtq_f32_s32(sumi));
+                sumf = vmlsq_f32(sumf, vmulq_n_f32(b_dmin, a_ptr[l].d), vcvtq_f32_s32(summ));
+            }
+
+            vst1q_f32(s + x * ncols_interleaved, sumf);
+        }
+        return;
+    }
+#endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON)
+    {
+        float sumf[4];
+
+        const block_q8_K * a_ptr = (const block_q8_K *) vy;
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q4_Kx4 * b_ptr = (const block_q4_Kx4 *) vx + (x * nb);
+
+            for (int j = 0; j < ncols_interleaved; j++) sumf[j] = 0.0;
+            for (int l = 0; l < nb; l++) {
+                uint8_t scales[32];
+                uint8_t mins[32];
+                lm_ggml_unpack_scales_mins_Kx4(b_ptr[l].scales, scales, mins);
+
+                for (int j = 0; j < ncols_interleaved; j++) {
+                    int sumi = 0;
+                    int summ = 0;
+                    for (int sb = 0; sb < 8; sb++) {
+                        int sumsb = 0;
+                        for (int i = 0; i < 32; i++) {
+                            const int b = (sb / 2) * 32 + i;
+                            const uint8_t q = b_ptr[l].qs[(b / blocklen) * ncols_interleaved * blocklen + j * blocklen + b % blocklen];
+                            sumsb += ((sb % 2) ? (q >> 4) : (q & 0x0F)) * a_ptr[l].qs[sb * 32 + i];
+                        }
+                        sumi += sumsb * scales[sb * 4 + j];
+                        summ += mins[sb * 4 + j] * (a_ptr[l].bsums[sb * 2] + a_ptr[l].bsums[sb * 2 + 1]);
+                    }
+                    sumf[j] += a_ptr[l].d * (LM_GGML_FP16_TO_FP32(b_ptr[l].d[j]) * sumi - LM_GGML_FP16_TO_FP32(b_ptr[l].dmin[j]) * summ);
+                }
+            }
+            for (int j = 0; j < ncols_interleaved; j++) s[x * ncols_interleaved + j] = sumf[j];
+        }
+    }
+}
+
+LM_GGML_AARCH64_DOTPROD_TARGET static void lm_ggml_gemv_q5_K_4x4_q8_K(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 4;
+    const int blocklen = 4;
+
+    assert (n % qk == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(LM_GGML_AARCH64_DOTPROD)
+    if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
+        const uint8x16_t m4b  = vdupq_n_u8(0x0F);
+        const uint8x16_t m16b = vdupq_n_u8(0x10);
+        const block_q8_K * a_ptr = (const block_q8_K *) vy;
+
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q5_Kx4 * b_ptr = (const block_q5_Kx4 *) vx + (x * nb);
+
+            float32x4_t sumf = vdupq_n_f32(0);
+            for (int l = 0; l < nb; l++) {
+                uint8_t scales[32];
+                uint8_t mins[32];
+                lm_ggml_unpack_scales_mins_Kx4(b_ptr[l].scales, scales, mins);
+
+                int32x4_t sumi = vdupq_n_s32(0);
+
+                // as for q4_K, with the fifth bit of sub-block sb taken from bit sb of qh
+                for (int j = 0; j < 4; j++) {
+                    const uint8x16_t mlo = vdupq_n_u8(1 << (2 * j));
+                    const uint8x16_t mhi = vdupq_n_u8(2 << (2 * j));
+
+                    int32x4_t sumi_lo = vdupq_n_s32(0);
+                    int32x4_t sumi_hi = vdupq_n_s32(0);
+
+                    for (int k = 0; k < 2; k++) {
+                        int8x16_t b_lo[4];
+                        int8x16_t b_hi[4];
+                        for (int i = 0; i < 4; i++) {
+                            const uint8x16_t b = vld1q_u8(b_ptr[l].qs + 128 * j + 64 * k + 16 * i);
+                            const uint8x16_t h = vld1q_u8(b_ptr[l].qh + 64 * k + 16 * i);
+                            b_lo[i] = vreinterpretq_s8_u8(vorrq_u8(vandq_u8(b, m4b), vandq_u8(vtstq_u8(h, mlo), m16b)));
+                            b_hi[i] = vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(b, 4), vandq_u8(vtstq_u8(h, mhi), m16b)));
+                        }
+
+                        const int8x16_t a_lo = vld1q_s8(a_ptr[l].qs + 64 * j + 16 * k);
+                        const int8x16_t a_hi = vld1q_s8(a_ptr[l].qs + 64 * j + 16 * k + 32);
+
+                        sumi_lo = lm_ggml_vdotq_laneq_x4(sumi_lo, b_lo[0], b_lo[1], b_lo[2], b_lo[3], a_lo);
+                        sumi_hi = lm_ggml_vdotq_laneq_x4(sumi_hi, b_hi[0], b_hi[1], b_hi[2], b_hi[3], a_hi);
+                    }
+
+                    const uint16x8_t sc = vmovl_u8(vld1_u8(scales + 8 * j));
+                    sumi = vmlaq_s32(sumi, sumi_lo, vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(sc))));
+                    sumi = vmlaq_s32(sumi, sumi_hi, vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(sc))));
+                }
+
+                int32x4_t summ = vdupq_n_s32(0);
+                for (int j = 0; j < 4; j++) {
+                    const int16x8_t mn = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(mins + 8 * j)));
+                    summ = vmlal_n_s16(summ, vget_low_s16(mn),  a_ptr[l].bsums[4 * j + 0] + a_ptr[l].bsums[4 * j + 1]);
+                    summ = vmlal_n_s16(summ, vget_high_s16(mn), a_ptr[l].bsums[4 * j + 2] + a_ptr[l].bsums[4 * j + 3]);
+                }
+
+                const float32x4_t b_d    = vcvt_f32_f16(vld1_f16((const float16_t *) b_ptr[l].d));
+                const float32x4_t b_dmin = vcvt_f32_f16(vld1_f16((const float16_t *) b_ptr[l].dmin));
+
+                sumf = vmlaq_f32(sumf, vmulq_n_f32(b_d,    a_ptr[l].d), vcvtq_f32_s32(sumi));
+                sumf = vmlsq_f32(sumf, vmulq_n_f32(b_dmin, a_ptr[l].d), vcvtq_f32_s32(summ));
+            }
+
+            vst1q_f32(s + x * ncols_interleaved, sumf);
+        }
+        return;
+    }
+#endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON)
+    {
+        float sumf[4];
+
+        const block_q8_K * a_ptr = (const block_q8_K *) vy;
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q5_Kx4 * b_ptr = (const block_q5_Kx4 *) vx + (x * nb);
+
+            for (int j = 0; j < ncols_interleaved; j++) sumf[j] = 0.0;
+            for (int l = 0; l < nb; l++) {
+                uint8_t scales[32];
+                uint8_t mins[32];
+                lm_ggml_unpack_scales_mins_Kx4(b_ptr[l].scales, scales, mins);
+
+                for (int j = 0; j < ncols_interleaved; j++) {
+                    int sumi = 0;
+                    int summ = 0;
+                    for (int sb = 0; sb < 8; sb++) {
+                        int sumsb = 0;
+                        for (int i = 0; i < 32; i++) {
+                            const int b = (sb / 2) * 32 + i;
+                            const uint8_t q = b_ptr[l].qs[(b / blocklen) * ncols_interleaved * blocklen + j * blocklen + b % blocklen];
+                            const uint8_t h = b_ptr[l].qh[(i / blocklen) * ncols_interleaved * blocklen + j * blocklen + i % blocklen];
+                            const int v = ((sb % 2) ? (q >> 4) : (q & 0x0F)) | (((h >> sb) & 1) << 4);
+                            sumsb += v * a_ptr[l].qs[sb * 32 + i];
+                        }
+                        sumi += sumsb * scales[sb * 4 + j];
+                        summ += mins[sb * 4 + j] * (a_ptr[l].bsums[sb * 2] + a_ptr[l].bsums[sb * 2 + 1]);
+                    }
+                    sumf[j] += a_ptr[l].d * (LM_GGML_FP16_TO_FP32(b_ptr[l].d[j]) * sumi - LM_GGML_FP16_TO_FP32(b_ptr[l].dmin[j]) * summ);
+                }
+            }
+            for (int j = 0; j < ncols_interleaved; j++) s[x * ncols_interleaved + j] = sumf[j];
+        }
+    }
+}
+
+LM_GGML_AARCH64_DOTPROD_TARGET static void lm_ggml_gemv_q6_K_4x4_q8_K(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 4;
+    const int blocklen = 4;
+
+    assert (n % qk == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(LM_GGML_AARCH64_DOTPROD)
+    if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
+        const uint8x16_t m4b = vdupq_n_u8(0x0F);
+        const uint8x16_t m3b = vdupq_n_u8(0x30);
+        const block_q8_K * a_ptr = (const block_q8_K *) vy;
+
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q6_Kx4 * b_ptr = (const block_q6_Kx4 *) vx + (x * nb);
+
+            float32x4_t sumf = vdupq_n_f32(0);
+            for (int l = 0; l < nb; l++) {
+                int16x8_t sc[8];
+                for (int i = 0; i < 8; i++) {
+                    sc[i] = vmovl_s8(vld1_s8(b_ptr[l].scales + 8 * i));
+                }
+
+                int32x4_t sumi = vdupq_n_s32(0);
+
+                // quarter q of each 128-quant half h takes its nibble from ql (low for q < 2) and bits 2q, 2q + 1 of qh
+                for (int h = 0; h < 2; h++) {
+                    for (int q = 0; q < 4; q++) {
+                        const int8x16_t shift = vdupq_n_s8(4 - 2 * q);
+                        for (int k = 0; k < 2; k++) {
+                            int8x16_t b[4];
+                            for (int i = 0; i < 4; i++) {
+                                const uint8x16_t ql = vld1q_u8(b_ptr[l].ql + 16 * (16 * h + 8 * (q % 2) + 4 * k + i));
+                                const uint8x16_t qh = vld1q_u8(b_ptr[l].qh + 16 * (8 * h + 4 * k + i));
+                                const uint8x16_t lo = q < 2 ? vandq_u8(ql, m4b) : vshrq_n_u8(ql, 4);
+                                b[i] = vreinterpretq_s8_u8(vorrq_u8(lo, vandq_u8(vshlq_u8(qh, shift), m3b)));
+                            }
+
+                            const int8x16_t a = vld1q_s8(a_ptr[l].qs + 128 * h + 32 * q + 16 * k);
+                            const int32x4_t sumi_k = lm_ggml_vdotq_laneq_x4(vdupq_n_s32(0), b[0], b[1], b[2], b[3], a);
+
+                            // scale group 8h + 2q + k
+                            const int16x8_t scq = sc[4 * h + q];
+                            sumi = vmlaq_s32(sumi, sumi_k, vmovl_s16(k ? vget_high_s16(scq) : vget_low_s16(scq)));
+                        }
+                    }
+                }
+
+                // the quants were used unsigned, take the -32 offset out through the bsums
+                int32x4_t sumb = vdupq_n_s32(0);
+                for (int i = 0; i < 8; i++) {
+                    sumb = vmlal_n_s16(sumb, vget_low_s16(sc[i]),  a_ptr[l].bsums[2 * i]);
+                    sumb = vmlal_n_s16(sumb, vget_high_s16(sc[i]), a_ptr[l].bsums[2 * i + 1]);
+                }
+                sumi = vsubq_s32(sumi, vshlq_n_s32(sumb, 5));
+
+                const float32x4_t b_d = vcvt_f32_f16(vld1_f16((const float16_t *) b_ptr[l].d));
+                sumf = vmlaq_f32(sumf, vmulq_n_f32(b_d, a_ptr[l].d), vcvtq_f32_s32(sumi));
+            }
+
+            vst1q_f32(s + x * ncols_interleaved, sumf);
+        }
+        return;
+    }
+#endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON)
+    {
+        float sumf[4];
+
+        const block_q8_K * a_ptr = (const block_q8_K *) vy;
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q6_Kx4 * b_ptr = (const block_q6_Kx4 *) vx + (x * nb);
+
+            for (int j = 0; j < ncols_interleaved; j++) sumf[j] = 0.0;
+            for (int l = 0; l < nb; l++) {
+                for (int j = 0; j < ncols_interleaved; j++) {
+                    int sumi = 0;
+                    for (int g = 0; g < QK_K / 16; g++) {
+                        int sumg = 0;
+                        for (int i = 0; i < 16; i++) {
+                            const int e  = g * 16 + i;
+                            const int q  = (e % 128) / 32;
+                            const int bl = (e / 128) * 64 + (q % 2) * 32 + e % 32;
+                            const int bh = (e / 128) * 32 + e % 32;
+                            const uint8_t ql = b_ptr[l].ql[(bl / blocklen) * ncols_interleaved * blocklen + j * blocklen + bl % blocklen];
+                            const uint8_t qh = b_ptr[l].qh[(bh / blocklen) * ncols_interleaved * blocklen + j * blocklen + bh % blocklen];
+                            const int v = ((q < 2 ? (ql & 0x0F) : (ql >> 4)) | (((qh >> (2 * q)) & 3) << 4)) - 32;
+                            sumg += v * a_ptr[l].qs[e];
+                        }
+                        sumi += sumg * b_ptr[l].scales[g * 4 + j];
+                    }
+                    sumf[j] += sumi * LM_GGML_FP16_TO_FP32(b_ptr[l].d[j]) * a_ptr[l].d;
+                }
+            }
+            for (int j = 0; j < ncols_interleaved; j++) s[x * ncols_interleaved + j] = sumf[j];
+        }
+    }
+}
+
+LM_GGML_AARCH64_DOTPROD_TARGET static void lm_ggml_gemv_q8_0_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
     const int qk = QK8_0;
     const int nb = n / qk;
     const int ncols_interleaved = 4;
     const int blocklen = 4;
 
     assert (n % qk == 0);
-    assert (nr % 4 == 0);
     assert (nc % ncols_interleaved == 0);
 
     UNUSED(s);
@@ -1677,34 +2144,108 @@ static void lm_ggml_gemm_q4_0_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size_t
     UNUSED(ncols_interleaved);
     UNUSED(blocklen);
 
-#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON)
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(LM_GGML_AARCH64_DOTPROD)
     if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
-        const void * b_ptr = vx;
-        const void * a_ptr = vy;
-        float * res_ptr = s;
-        size_t res_stride = bs * sizeof(float);
+        const block_q8_0 * a_ptr = (const block_q8_0 *) vy;
 
-        __asm__ __volatile__(
-            "mov x10, %x[nr]\n"
-            "mov x9, #0x88\n"
-            "cmp x10, #0x10\n"
-            "mul x9, %x[nb], x9\n"
-            "blt 4f\n"
-            "1:"  // Row loop
-            "add x28, %x[b_ptr], #0x8\n"
-            "mov x27, %x[nc]\n"
-            "add x26, %x[res_ptr], %x[res_stride], LSL #4\n"
-            "2:"  // Column loop
-            "add x25, %x[a_ptr], #0x8\n"
-            "movi v15.16b, #0x0\n"
-            "movi v19.16b, #0x0\n"
-            "mov x24, %x[nb]\n"
-            "add x23, x25, x9\n"
-            "movi v18.16b, #0x0\n"
-            "movi v14.16b, #0x0\n"
-            "add x22, x23, x9\n"
-            "movi v11.16b, #0x0\n"
-            "movi v13.16b, #0x0\n"
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q8_0x4 * b_ptr = (const block_q8_0x4 *) vx + (x * nb);
+
+            float32x4_t sumf = vdupq_n_f32(0);
+            for (int l = 0; l < nb; l++) {
+                const int8x16_t a_0 = vld1q_s8(a_ptr[l].qs + 0);
+                const int8x16_t a_1 = vld1q_s8(a_ptr[l].qs + 16);
+
+                int32x4_t sumi = vdupq_n_s32(0);
+                sumi = lm_ggml_vdotq_laneq_x4(sumi, vld1q_s8(b_ptr[l].qs +  0), vld1q_s8(b_ptr[l].qs + 16),
+                                                 vld1q_s8(b_ptr[l].qs + 32), vld1q_s8(b_ptr[l].qs + 48), a_0);
+                sumi = lm_ggml_vdotq_laneq_x4(sumi, vld1q_s8(b_ptr[l].qs + 64), vld1q_s8(b_ptr[l].qs + 80),
+                                                 vld1q_s8(b_ptr[l].qs + 96), vld1q_s8(b_ptr[l].qs + 112), a_1);
+
+                const float32x4_t a_d = vcvt_f32_f16(vld1_dup_f16((const float16_t *) &a_ptr[l].d));
+                const float32x4_t b_d = vcvt_f32_f16(vld1_f16((const float16_t *) b_ptr[l].d));
+
+                sumf = vmlaq_f32(sumf, vmulq_f32(a_d, b_d), vcvtq_f32_s32(sumi));
+            }
+
+            vst1q_f32(s + x * ncols_interleaved, sumf);
+        }
+        return;
+    }
+#endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON)
+    {
+        float sumf[4];
+        int sumi;
+
+        const block_q8_0 * a_ptr = (const block_q8_0 *) vy;
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q8_0x4 * b_ptr = (const block_q8_0x4 *) vx + (x * nb);
+
+            for (int j = 0; j < ncols_interleaved; j++) sumf[j] = 0.0;
+            for (int l = 0; l < nb; l++) {
+                for (int k = 0; k < (qk / blocklen); k++) {
+                    for (int j = 0; j < ncols_interleaved; j++) {
+                        sumi = 0;
+                        for (int i = 0; i < blocklen; ++i) {
+                            sumi += b_ptr[l].qs[k * ncols_interleaved * blocklen + j * blocklen + i] * a_ptr[l].qs[k * blocklen + i];
+                        }
+                        sumf[j] += sumi * LM_GGML_FP16_TO_FP32(b_ptr[l].d[j]) * LM_GGML_FP16_TO_FP32(a_ptr[l].d);
+                    }
+                }
+            }
+            for (int j = 0; j < ncols_interleaved; j++) s[x * ncols_interleaved + j] = sumf[j];
+        }
+    }
+}
+
+static void lm_ggml_gemm_q4_0_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+    const int ncols_interleaved = 4;
+    const int blocklen = 4;
+
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON)
+    if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
+        const void * b_ptr = vx;
+        const void * a_ptr = vy;
+        float * res_ptr = s;
+        size_t res_stride = bs * sizeof(float);
+
+        __asm__ __volatile__(
+            "mov x10, %x[nr]\n"
+            "mov x9, #0x88\n"
+            "cmp x10, #0x10\n"
+            "mul x9, %x[nb], x9\n"
+            "blt 4f\n"
+            "1:"  // Row loop
+            "add x28, %x[b_ptr], #0x8\n"
+            "mov x27, %x[nc]\n"
+            "add x26, %x[res_ptr], %x[res_stride], LSL #4\n"
+            "2:"  // Column loop
+            "add x25, %x[a_ptr], #0x8\n"
+            "movi v15.16b, #0x0\n"
+            "movi v19.16b, #0x0\n"
+            "mov x24, %x[nb]\n"
+            "add x23, x25, x9\n"
+            "movi v18.16b, #0x0\n"
+            "movi v14.16b, #0x0\n"
+            "add x22, x23, x9\n"
+            "movi v11.16b, #0x0\n"
+            "movi v13.16b, #0x0\n"
             "add x21, x22, x9\n"
             "movi v23.16b, #0x0\n"
             "movi v16.16b, #0x0\n"
@@ -5534,7 +6075,7 @@ static void lm_ggml_gemm_q4_K_8x8_q8_K(int n, float * LM_GGML_RESTRICT s, size_t
 #endif
 }
 
-static void lm_ggml_gemm_iq4_nl_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
+LM_GGML_AARCH64_DOTPROD_TARGET static void lm_ggml_gemm_iq4_nl_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
     const int qk = QK8_0;
     const int nb = n / qk;
     const int ncols_interleaved = 4;
@@ -5554,7 +6095,7 @@ static void lm_ggml_gemm_iq4_nl_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size
     UNUSED(ncols_interleaved);
     UNUSED(blocklen);
 
-#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(__ARM_FEATURE_DOTPROD)
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(LM_GGML_AARCH64_DOTPROD)
     if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
         const int8x16_t kvalues = vld1q_s8(kvalues_iq4nl);
 
@@ -5645,132 +6186,638 @@ static void lm_ggml_gemm_iq4_nl_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size
     }
 }
 
-static block_q4_0x4 make_block_q4_0x4(block_q4_0 * in, unsigned int blck_size_interleave) {
-    block_q4_0x4 out;
-
-    for (int i = 0; i < 4; i++) {
-        out.d[i] = in[i].d;
-    }
-
-    const int end = QK4_0 * 2 / blck_size_interleave;
+LM_GGML_AARCH64_DOTPROD_TARGET static void lm_ggml_gemm_q4_K_4x4_q8_K(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 4;
+    const int blocklen = 4;
 
-    if (blck_size_interleave == 8) {
-        const uint64_t xor_mask = 0x8888888888888888ULL;
-        for (int i = 0; i < end; ++i) {
-            int src_id = i % 4;
-            int src_offset = (i / 4) * blck_size_interleave;
-            int dst_offset = i * blck_size_interleave;
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
 
-            uint64_t elems;
-            // Using memcpy to avoid unaligned memory accesses
-            memcpy(&elems, &in[src_id].qs[src_offset], sizeof(uint64_t));
-            elems ^= xor_mask;
-            memcpy(&out.qs[dst_offset], &elems, sizeof(uint64_t));
-        }
-    } else if (blck_size_interleave == 4) {
-        const uint32_t xor_mask = 0x88888888;
-        for (int i = 0; i < end; ++i) {
-            int src_id = i % 4;
-            int src_offset = (i / 4) * blck_size_interleave;
-            int dst_offset = i * blck_size_interleave;
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
 
-            uint32_t elems;
-            memcpy(&elems, &in[src_id].qs[src_offset], sizeof(uint32_t));
-            elems ^= xor_mask;
-            memcpy(&out.qs[dst_offset], &elems, sizeof(uint32_t));
-        }
-    } else {
-        LM_GGML_ASSERT(false);
-    }
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(LM_GGML_AARCH64_DOTPROD)
+    if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
+        const uint8x16_t m4b = vdupq_n_u8(0x0F);
 
-    return out;
-}
+        for (int y = 0; y < nr / 4; y++) {
+            const block_q8_Kx4 * a_ptr = (const block_q8_Kx4 *) vy + (y * nb);
+            for (int x = 0; x < nc / ncols_interleaved; x++) {
+                const block_q4_Kx4 * b_ptr = (const block_q4_Kx4 *) vx + (x * nb);
 
-// interleave 8 block_q4_0s in blocks of blck_size_interleave
-// returns an interleaved block_q4_0x8
-// in the interleaved block_q4_0x8, place deltas for 8 block_q4_0 blocks
-// first, then interleave quants from 8 block_q4_0s in blocks of blck_size_interleave
-static block_q4_0x8 make_block_q4_0x8(block_q4_0 * in, unsigned int blck_size_interleave) {
-    block_q4_0x8 out;
+                float32x4_t sumf[4];
+                for (int m = 0; m < 4; m++) {
+                    sumf[m] = vdupq_n_f32(0);
+                }
 
-    for (int i = 0; i < 8; i++) {
-        out.d[i] = in[i].d;
-    }
+                for (int l = 0; l < nb; l++) {
+                    uint8_t scales[32];
+                    uint8_t mins[32];
+                    lm_ggml_unpack_scales_mins_Kx4(b_ptr[l].scales, scales, mins);
 
-    const int end = QK4_0 * 4 / blck_size_interleave;
-    const uint64_t xor_mask = 0x8888888888888888ULL;
+                    int32x4_t sumi[4];
+                    int32x4_t summ[4];
+                    for (int m = 0; m < 4; m++) {
+                        sumi[m] = vdupq_n_s32(0);
+                        summ[m] = vdupq_n_s32(0);
+                    }
 
-    for (int i = 0; i < end; ++i) {
-        int src_id = i % 8;
-        int src_offset = (i / 8) * blck_size_interleave;
-        int dst_offset = i * blck_size_interleave;
+                    for (int j = 0; j < 4; j++) {
+                        int32x4_t sumi_lo[4];
+                        int32x4_t sumi_hi[4];
+                        for (int m = 0; m < 4; m++) {
+                            sumi_lo[m] = vdupq_n_s32(0);
+                            sumi_hi[m] = vdupq_n_s32(0);
+                        }
 
-        uint64_t elems;
-        memcpy(&elems, &in[src_id].qs[src_offset], sizeof(uint64_t));
-        elems ^= xor_mask;
-        memcpy(&out.qs[dst_offset], &elems, sizeof(uint64_t));
-    }
+                        for (int k = 0; k < 8; k++) {
+                            const uint8x16_t b = vld1q_u8(b_ptr[l].qs + 128 * j + 16 * k);
+                            lm_ggml_vdotq_rows_x4(sumi_lo, vreinterpretq_s8_u8(vandq_u8(b, m4b)), vld1q_s8(a_ptr[l].qs + 16 * (16 * j + k)));
+                            lm_ggml_vdotq_rows_x4(sumi_hi, vreinterpretq_s8_u8(vshrq_n_u8(b, 4)), vld1q_s8(a_ptr[l].qs + 16 * (16 * j + k + 8)));
+                        }
 
-    return out;
-}
+                        const uint16x8_t sc = vmovl_u8(vld1_u8(scales + 8 * j));
+                        const int32x4_t sc_lo = vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(sc)));
+                        const int32x4_t sc_hi = vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(sc)));
 
-static block_q4_Kx8 make_block_q4_Kx8(block_q4_K * in, unsigned int blck_size_interleave) {
-    block_q4_Kx8 out;
-    //Delta(scale) and dmin values of the eight Q4_K structures are copied onto the output interleaved structure
-    for (int i = 0; i < 8; i++) {
-        out.d[i] = in[i].LM_GGML_COMMON_AGGR_U.LM_GGML_COMMON_AGGR_S.d;
-    }
+                        const int16x8_t mn = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(mins + 8 * j)));
+                        const int16_t * bsums = a_ptr[l].bsums + 16 * j;
 
-    for (int i = 0; i < 8; i++) {
-        out.dmin[i] = in[i].LM_GGML_COMMON_AGGR_U.LM_GGML_COMMON_AGGR_S.dmin;
-    }
+                        for (int m = 0; m < 4; m++) {
+                            sumi[m] = vmlaq_s32(sumi[m], sumi_lo[m], sc_lo);
+                            sumi[m] = vmlaq_s32(sumi[m], sumi_hi[m], sc_hi);
+                            summ[m] = vmlal_n_s16(summ[m], vget_low_s16(mn),  bsums[m]     + bsums[m + 4]);
+                            summ[m] = vmlal_n_s16(summ[m], vget_high_s16(mn), bsums[m + 8] + bsums[m + 12]);
+                        }
+                    }
 
-    const int end = QK_K * 4 / blck_size_interleave;
+                    const float32x4_t b_d    = vcvt_f32_f16(vld1_f16((const float16_t *) b_ptr[l].d));
+                    const float32x4_t b_dmin = vcvt_f32_f16(vld1_f16((const float16_t *) b_ptr[l].dmin));
 
-    // Interleave Q4_K quants by taking 8 bytes at a time
-    for (int i = 0; i < end; ++i) {
-        int src_id = i % 8;
-        int src_offset = (i / 8) * blck_size_interleave;
-        int dst_offset = i * blck_size_interleave;
+                    for (int m = 0; m < 4; m++) {
+                        sumf[m] = vmlaq_f32(sumf[m], vmulq_n_f32(b_d,    a_ptr[l].d[m]), vcvtq_f32_s32(sumi[m]));
+                        sumf[m] = vmlsq_f32(sumf[m], vmulq_n_f32(b_dmin, a_ptr[l].d[m]), vcvtq_f32_s32(summ[m]));
+                    }
+                }
 
-        uint64_t elems;
-        memcpy(&elems, &in[src_id].qs[src_offset], sizeof(uint64_t));
-        memcpy(&out.qs[dst_offset], &elems, sizeof(uint64_t));
+                for (int m = 0; m < 4; m++) {
+                    vst1q_f32(s + (y * 4 + m) * bs + x * 4, sumf[m]);
+                }
+            }
+        }
+        return;
     }
+#endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON)
+    {
+        float sumf[4][4];
 
-    // The below logic is designed so as to unpack and rearrange scales and mins values in Q4_K
-    // Currently the Q4_K structure has 8 scales and 8 mins packed in 12 bytes ( 6 bits for each value)
-    // The output Q4_Kx8 structure has 96 bytes
-    // Every 12 byte is packed such that it contains scales and mins for corresponding sub blocks from Q4_K structure
-    // For eg - First 12 bytes contains 8 scales and 8 mins - each of first sub block from different Q4_K structures
-    uint8_t s[8], m[8];
+        for (int y = 0; y < nr / 4; y++) {
+            const block_q8_Kx4 * a_ptr = (const block_q8_Kx4 *) vy + (y * nb);
+            for (int x = 0; x < nc / ncols_interleaved; x++) {
+                const block_q4_Kx4 * b_ptr = (const block_q4_Kx4 *) vx + (x * nb);
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++) sumf[m][j] = 0.0;
+                }
+                for (int l = 0; l < nb; l++) {
+                    uint8_t scales[32];
+                    uint8_t mins[32];
+                    lm_ggml_unpack_scales_mins_Kx4(b_ptr[l].scales, scales, mins);
 
-    for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 8; j++) {
-            s[j] = in[j].scales[i] & 63;
-            m[j] = in[j].scales[i + 4] & 63;
+                    for (int m = 0; m < 4; m++) {
+                        for (int j = 0; j < ncols_interleaved; j++) {
+                            int sumi = 0;
+                            int summ = 0;
+                            for (int sb = 0; sb < 8; sb++) {
+                                int sumsb = 0;
+                                for (int i = 0; i < 32; i++) {
+                                    const int b = (sb / 2) * 32 + i;
+                                    const int e = sb * 32 + i;
+                                    const uint8_t q = b_ptr[l].qs[(b / blocklen) * ncols_interleaved * blocklen + j * blocklen + b % blocklen];
+                                    sumsb += ((sb % 2) ? (q >> 4) : (q & 0x0F)) * a_ptr[l].qs[(e / blocklen) * 4 * blocklen + m * blocklen + e % blocklen];
+                                }
+                                sumi += sumsb * scales[sb * 4 + j];
+                                summ += mins[sb * 4 + j] * (a_ptr[l].bsums[(sb * 2) * 4 + m] + a_ptr[l].bsums[(sb * 2 + 1) * 4 + m]);
+                            }
+                            sumf[m][j] += a_ptr[l].d[m] * (LM_GGML_FP16_TO_FP32(b_ptr[l].d[j]) * sumi - LM_GGML_FP16_TO_FP32(b_ptr[l].dmin[j]) * summ);
+                        }
+                    }
+                }
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++)
+                        s[(y * 4 + m) * bs + x * ncols_interleaved + j] = sumf[m][j];
+                }
+            }
         }
-
-        out.scales[i * 12]      = (s[0] & 63) + ((s[4] & 48) << 2);
-        out.scales[i * 12 + 1]  = (s[1] & 63) + ((s[5] & 48) << 2);
-        out.scales[i * 12 + 2]  = (s[2] & 63) + ((s[6] & 48) << 2);
-        out.scales[i * 12 + 3]  = (s[3] & 63) + ((s[7] & 48) << 2);
-        out.scales[i * 12 + 4]  = (m[0] & 63) + ((m[4] & 48) << 2);
-        out.scales[i * 12 + 5]  = (m[1] & 63) + ((m[5] & 48) << 2);
-        out.scales[i * 12 + 6]  = (m[2] & 63) + ((m[6] & 48) << 2);
-        out.scales[i * 12 + 7]  = (m[3] & 63) + ((m[7] & 48) << 2);
-        out.scales[i * 12 + 8]  = (s[4] & 15) + ((m[4] & 15) << 4);
-        out.scales[i * 12 + 9]  = (s[5] & 15) + ((m[5] & 15) << 4);
-        out.scales[i * 12 + 10] = (s[6] & 15) + ((m[6] & 15) << 4);
-        out.scales[i * 12 + 11] = (s[7] & 15) + ((m[7] & 15) << 4);
-
     }
+}
 
-    for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 8; j++) {
-            s[j] = ((in[j].scales[i] & 192) >> 2) | (in[j].scales[i+8] & 15);
-            m[j] = ((in[j].scales[i + 4] & 192) >> 2) | ((in[j].scales[i+8] & 240) >> 4);
-        }
+LM_GGML_AARCH64_DOTPROD_TARGET static void lm_ggml_gemm_q5_K_4x4_q8_K(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 4;
+    const int blocklen = 4;
+
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(LM_GGML_AARCH64_DOTPROD)
+    if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
+        const uint8x16_t m4b  = vdupq_n_u8(0x0F);
+        const uint8x16_t m16b = vdupq_n_u8(0x10);
+
+        for (int y = 0; y < nr / 4; y++) {
+            const block_q8_Kx4 * a_ptr = (const block_q8_Kx4 *) vy + (y * nb);
+            for (int x = 0; x < nc / ncols_interleaved; x++) {
+                const block_q5_Kx4 * b_ptr = (const block_q5_Kx4 *) vx + (x * nb);
+
+                float32x4_t sumf[4];
+                for (int m = 0; m < 4; m++) {
+                    sumf[m] = vdupq_n_f32(0);
+                }
+
+                for (int l = 0; l < nb; l++) {
+                    uint8_t scales[32];
+                    uint8_t mins[32];
+                    lm_ggml_unpack_scales_mins_Kx4(b_ptr[l].scales, scales, mins);
+
+                    int32x4_t sumi[4];
+                    int32x4_t summ[4];
+                    for (int m = 0; m < 4; m++) {
+                        sumi[m] = vdupq_n_s32(0);
+                        summ[m] = vdupq_n_s32(0);
+                    }
+
+                    for (int j = 0; j < 4; j++) {
+                        const uint8x16_t mlo = vdupq_n_u8(1 << (2 * j));
+                        const uint8x16_t mhi = vdupq_n_u8(2 << (2 * j));
+
+                        int32x4_t sumi_lo[4];
+                        int32x4_t sumi_hi[4];
+                        for (int m = 0; m < 4; m++) {
+                            sumi_lo[m] = vdupq_n_s32(0);
+                            sumi_hi[m] = vdupq_n_s32(0);
+                        }
+
+                        for (int k = 0; k < 8; k++) {
+                            const uint8x16_t b = vld1q_u8(b_ptr[l].qs + 128 * j + 16 * k);
+                            const uint8x16_t h = vld1q_u8(b_ptr[l].qh + 16 * k);
+                            const int8x16_t b_lo = vreinterpretq_s8_u8(vorrq_u8(vandq_u8(b, m4b), vandq_u8(vtstq_u8(h, mlo), m16b)));
+                            const int8x16_t b_hi = vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(b, 4), vandq_u8(vtstq_u8(h, mhi), m16b)));
+                            lm_ggml_vdotq_rows_x4(sumi_lo, b_lo, vld1q_s8(a_ptr[l].qs + 16 * (16 * j + k)));
+                            lm_ggml_vdotq_rows_x4(sumi_hi, b_hi, vld1q_s8(a_ptr[l].qs + 16 * (16 * j + k + 8)));
+                        }
+
+                        const uint16x8_t sc = vmovl_u8(vld1_u8(scales + 8 * j));
+                        const int32x4_t sc_lo = vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(sc)));
+                        const int32x4_t sc_hi = vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(sc)));
+
+                        const int16x8_t mn = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(mins + 8 * j)));
+                        const int16_t * bsums = a_ptr[l].bsums + 16 * j;
+
+                        for (int m = 0; m < 4; m++) {
+                            sumi[m] = vmlaq_s32(sumi[m], sumi_lo[m], sc_lo);
+                            sumi[m] = vmlaq_s32(sumi[m], sumi_hi[m], sc_hi);
+                            summ[m] = vmlal_n_s16(summ[m], vget_low_s16(mn),  bsums[m]     + bsums[m + 4]);
+                            summ[m] = vmlal_n_s16(summ[m], vget_high_s16(mn), bsums[m + 8] + bsums[m + 12]);
+                        }
+                    }
+
+                    const float32x4_t b_d    = vcvt_f32_f16(vld1_f16((const float16_t *) b_ptr[l].d));
+                    const float32x4_t b_dmin = vcvt_f32_f16(vld1_f16((const float16_t *) b_ptr[l].dmin));
+
+                    for (int m = 0; m < 4; m++) {
+                        sumf[m] = vmlaq_f32(sumf[m], vmulq_n_f32(b_d,    a_ptr[l].d[m]), vcvtq_f32_s32(sumi[m]));
+                        sumf[m] = vmlsq_f32(sumf[m], vmulq_n_f32(b_dmin, a_ptr[l].d[m]), vcvtq_f32_s32(summ[m]));
+                    }
+                }
+
+                for (int m = 0; m < 4; m++) {
+                    vst1q_f32(s + (y * 4 + m) * bs + x * 4, sumf[m]);
+                }
+            }
+        }
+        return;
+    }
+#endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON)
+    {
+        float sumf[4][4];
+
+        for (int y = 0; y < nr / 4; y++) {
+            const block_q8_Kx4 * a_ptr = (const block_q8_Kx4 *) vy + (y * nb);
+            for (int x = 0; x < nc / ncols_interleaved; x++) {
+                const block_q5_Kx4 * b_ptr = (const block_q5_Kx4 *) vx + (x * nb);
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++) sumf[m][j] = 0.0;
+                }
+                for (int l = 0; l < nb; l++) {
+                    uint8_t scales[32];
+                    uint8_t mins[32];
+                    lm_ggml_unpack_scales_mins_Kx4(b_ptr[l].scales, scales, mins);
+
+                    for (int m = 0; m < 4; m++) {
+                        for (int j = 0; j < ncols_interleaved; j++) {
+                            int sumi = 0;
+                            int summ = 0;
+                            for (int sb = 0; sb < 8; sb++) {
+                                int sumsb = 0;
+                                for (int i = 0; i < 32; i++) {
+                                    const int b = (sb / 2) * 32 + i;
+                                    const int e = sb * 32 + i;
+                                    const uint8_t q = b_ptr[l].qs[(b / blocklen) * ncols_interleaved * blocklen + j * blocklen + b % blocklen];
+                                    const uint8_t h = b_ptr[l].qh[(i / blocklen) * ncols_interleaved * blocklen + j * blocklen + i % blocklen];
+                                    const int v = ((sb % 2) ? (q >> 4) : (q & 0x0F)) | (((h >> sb) & 1) << 4);
+                                    sumsb += v * a_ptr[l].qs[(e / blocklen) * 4 * blocklen + m * blocklen + e % blocklen];
+                                }
+                                sumi += sumsb * scales[sb * 4 + j];
+                                summ += mins[sb * 4 + j] * (a_ptr[l].bsums[(sb * 2) * 4 + m] + a_ptr[l].bsums[(sb * 2 + 1) * 4 + m]);
+                            }
+                            sumf[m][j] += a_ptr[l].d[m] * (LM_GGML_FP16_TO_FP32(b_ptr[l].d[j]) * sumi - LM_GGML_FP16_TO_FP32(b_ptr[l].dmin[j]) * summ);
+                        }
+                    }
+                }
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++)
+                        s[(y * 4 + m) * bs + x * ncols_interleaved + j] = sumf[m][j];
+                }
+            }
+        }
+    }
+}
+
+LM_GGML_AARCH64_DOTPROD_TARGET static void lm_ggml_gemm_q6_K_4x4_q8_K(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 4;
+    const int blocklen = 4;
+
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(LM_GGML_AARCH64_DOTPROD)
+    if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
+        const uint8x16_t m4b = vdupq_n_u8(0x0F);
+        const uint8x16_t m3b = vdupq_n_u8(0x30);
+
+        for (int y = 0; y < nr / 4; y++) {
+            const block_q8_Kx4 * a_ptr = (const block_q8_Kx4 *) vy + (y * nb);
+            for (int x = 0; x < nc / ncols_interleaved; x++) {
+                const block_q6_Kx4 * b_ptr = (const block_q6_Kx4 *) vx + (x * nb);
+
+                float32x4_t sumf[4];
+                for (int m = 0; m < 4; m++) {
+                    sumf[m] = vdupq_n_f32(0);
+                }
+
+                for (int l = 0; l < nb; l++) {
+                    int16x8_t sc[8];
+                    for (int i = 0; i < 8; i++) {
+                        sc[i] = vmovl_s8(vld1_s8(b_ptr[l].scales + 8 * i));
+                    }
+
+                    int32x4_t sumi[4];
+                    for (int m = 0; m < 4; m++) {
+                        sumi[m] = vdupq_n_s32(0);
+                    }
+
+                    for (int h = 0; h < 2; h++) {
+                        for (int q = 0; q < 4; q++) {
+                            const int8x16_t shift = vdupq_n_s8(4 - 2 * q);
+                            for (int k = 0; k < 2; k++) {
+                                int32x4_t sumi_k[4];
+                                for (int m = 0; m < 4; m++) {
+                                    sumi_k[m] = vdupq_n_s32(0);
+                                }
+
+                                for (int i = 0; i < 4; i++) {
+                                    const uint8x16_t ql = vld1q_u8(b_ptr[l].ql + 16 * (16 * h + 8 * (q % 2) + 4 * k + i));
+                                    const uint8x16_t qh = vld1q_u8(b_ptr[l].qh + 16 * (8 * h + 4 * k + i));
+                                    const uint8x16_t lo = q < 2 ? vandq_u8(ql, m4b) : vshrq_n_u8(ql, 4);
+                                    const int8x16_t  b  = vreinterpretq_s8_u8(vorrq_u8(lo, vandq_u8(vshlq_u8(qh, shift), m3b)));
+                                    lm_ggml_vdotq_rows_x4(sumi_k, b, vld1q_s8(a_ptr[l].qs + 16 * (32 * h + 8 * q + 4 * k + i)));
+                                }
+
+                                const int16x8_t scq = sc[4 * h + q];
+                                const int32x4_t scale = vmovl_s16(k ? vget_high_s16(scq) : vget_low_s16(scq));
+                                for (int m = 0; m < 4; m++) {
+                                    sumi[m] = vmlaq_s32(sumi[m], sumi_k[m], scale);
+                                }
+                            }
+                        }
+                    }
+
+                    const float32x4_t b_d = vcvt_f32_f16(vld1_f16((const float16_t *) b_ptr[l].d));
+
+                    for (int m = 0; m < 4; m++) {
+                        int32x4_t sumb = vdupq_n_s32(0);
+                        for (int i = 0; i < 8; i++) {
+                            sumb = vmlal_n_s16(sumb, vget_low_s16(sc[i]),  a_ptr[l].bsums[(2 * i) * 4 + m]);
+                            sumb = vmlal_n_s16(sumb, vget_high_s16(sc[i]), a_ptr[l].bsums[(2 * i + 1) * 4 + m]);
+                        }
+                        sumi[m] = vsubq_s32(sumi[m], vshlq_n_s32(sumb, 5));
+                        sumf[m] = vmlaq_f32(sumf[m], vmulq_n_f32(b_d, a_ptr[l].d[m]), vcvtq_f32_s32(sumi[m]));
+                    }
+                }
+
+                for (int m = 0; m < 4; m++) {
+                    vst1q_f32(s + (y * 4 + m) * bs + x * 4, sumf[m]);
+                }
+            }
+        }
+        return;
+    }
+#endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON)
+    {
+        float sumf[4][4];
+
+        for (int y = 0; y < nr / 4; y++) {
+            const block_q8_Kx4 * a_ptr = (const block_q8_Kx4 *) vy + (y * nb);
+            for (int x = 0; x < nc / ncols_interleaved; x++) {
+                const block_q6_Kx4 * b_ptr = (const block_q6_Kx4 *) vx + (x * nb);
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++) sumf[m][j] = 0.0;
+                }
+                for (int l = 0; l < nb; l++) {
+                    for (int m = 0; m < 4; m++) {
+                        for (int j = 0; j < ncols_interleaved; j++) {
+                            int sumi = 0;
+                            for (int g = 0; g < QK_K / 16; g++) {
+                                int sumg = 0;
+                                for (int i = 0; i < 16; i++) {
+                                    const int e  = g * 16 + i;
+                                    const int q  = (e % 128) / 32;
+                                    const int bl = (e / 128) * 64 + (q % 2) * 32 + e % 32;
+                                    const int bh = (e / 128) * 32 + e % 32;
+                                    const uint8_t ql = b_ptr[l].ql[(bl / blocklen) * ncols_interleaved * blocklen + j * blocklen + bl % blocklen];
+                                    const uint8_t qh = b_ptr[l].qh[(bh / blocklen) * ncols_interleaved * blocklen + j * blocklen + bh % blocklen];
+                                    const int v = ((q < 2 ? (ql & 0x0F) : (ql >> 4)) | (((qh >> (2 * q)) & 3) << 4)) - 32;
+                                    sumg += v * a_ptr[l].qs[(e / blocklen) * 4 * blocklen + m * blocklen + e % blocklen];
+                                }
+                                sumi += sumg * b_ptr[l].scales[g * 4 + j];
+                            }
+                            sumf[m][j] += sumi * LM_GGML_FP16_TO_FP32(b_ptr[l].d[j]) * a_ptr[l].d[m];
+                        }
+                    }
+                }
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++)
+                        s[(y * 4 + m) * bs + x * ncols_interleaved + j] = sumf[m][j];
+                }
+            }
+        }
+    }
+}
+
+LM_GGML_AARCH64_DOTPROD_TARGET static void lm_ggml_gemm_q8_0_4x4_q8_0(int n, float * LM_GGML_RESTRICT s, size_t bs, const void * LM_GGML_RESTRICT vx, const void * LM_GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+    const int ncols_interleaved = 4;
+    const int blocklen = 4;
+
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON) && defined(LM_GGML_AARCH64_DOTPROD)
+    if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
+        for (int y = 0; y < nr / 4; y++) {
+            const block_q8_0x4 * a_ptr = (const block_q8_0x4 *) vy + (y * nb);
+            for (int x = 0; x < nc / ncols_interleaved; x++) {
+                const block_q8_0x4 * b_ptr = (const block_q8_0x4 *) vx + (x * nb);
+
+                float32x4_t sumf[4];
+                for (int m = 0; m < 4; m++) {
+                    sumf[m] = vdupq_n_f32(0);
+                }
+
+                for (int l = 0; l < nb; l++) {
+                    int32x4_t sumi[4];
+                    for (int m = 0; m < 4; m++) {
+                        sumi[m] = vdupq_n_s32(0);
+                    }
+
+                    for (int k = 0; k < 8; k++) {
+                        lm_ggml_vdotq_rows_x4(sumi, vld1q_s8(b_ptr[l].qs + 16 * k), vld1q_s8(a_ptr[l].qs + 16 * k));
+                    }
+
+                    float a_d[4];
+                    vst1q_f32(a_d, vcvt_f32_f16(vld1_f16((const float16_t *) a_ptr[l].d)));
+                    const float32x4_t b_d = vcvt_f32_f16(vld1_f16((const float16_t *) b_ptr[l].d));
+
+                    for (int m = 0; m < 4; m++) {
+                        sumf[m] = vmlaq_f32(sumf[m], vmulq_n_f32(b_d, a_d[m]), vcvtq_f32_s32(sumi[m]));
+                    }
+                }
+
+                for (int m = 0; m < 4; m++) {
+                    vst1q_f32(s + (y * 4 + m) * bs + x * 4, sumf[m]);
+                }
+            }
+        }
+        return;
+    }
+#endif // #if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__) && defined(__ARM_NEON)
+    {
+        float sumf[4][4];
+        int sumi;
+
+        for (int y = 0; y < nr / 4; y++) {
+            const block_q8_0x4 * a_ptr = (const block_q8_0x4 *) vy + (y * nb);
+            for (int x = 0; x < nc / ncols_interleaved; x++) {
+                const block_q8_0x4 * b_ptr = (const block_q8_0x4 *) vx + (x * nb);
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++) sumf[m][j] = 0.0;
+                }
+                for (int l = 0; l < nb; l++) {
+                    for (int k = 0; k < (qk / blocklen); k++) {
+                        for (int m = 0; m < 4; m++) {
+                            for (int j = 0; j < ncols_interleaved; j++) {
+                                sumi = 0;
+                                for (int i = 0; i < blocklen; ++i) {
+                                    sumi += b_ptr[l].qs[k * ncols_interleaved * blocklen + j * blocklen + i] *
+                                            a_ptr[l].qs[k * 4 * blocklen + m * blocklen + i];
+                                }
+                                sumf[m][j] += sumi * LM_GGML_FP16_TO_FP32(b_ptr[l].d[j]) * LM_GGML_FP16_TO_FP32(a_ptr[l].d[m]);
+                            }
+                        }
+                    }
+                }
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++)
+                        s[(y * 4 + m) * bs + x * ncols_interleaved + j] = sumf[m][j];
+                }
+            }
+        }
+    }
+}
+
+static block_q4_0x4 make_block_q4_0x4(block_q4_0 * in, unsigned int blck_size_interleave) {
+    block_q4_0x4 out;
+
+    for (int i = 0; i < 4; i++) {
+        out.d[i] = in[i].d;
+    }
+
+    const int end = QK4_0 * 2 / blck_size_interleave;
+
+    if (blck_size_interleave == 8) {
+        const uint64_t xor_mask = 0x8888888888888888ULL;
+        for (int i = 0; i < end; ++i) {
+            int src_id = i % 4;
+            int src_offset = (i / 4) * blck_size_interleave;
+            int dst_offset = i * blck_size_interleave;
+
+            uint64_t elems;
+            // Using memcpy to avoid unaligned memory accesses
+            memcpy(&elems, &in[src_id].qs[src_offset], sizeof(uint64_t));
+            elems ^= xor_mask;
+            memcpy(&out.qs[dst_offset], &elems, sizeof(uint64_t));
+        }
+    } else if (blck_size_interleave == 4) {
+        const uint32_t xor_mask = 0x88888888;
+        for (int i = 0; i < end; ++i) {
+            int src_id = i % 4;
+            int src_offset = (i / 4) * blck_size_interleave;
+            int dst_offset = i * blck_size_interleave;
+
+            uint32_t elems;
+            memcpy(&elems, &in[src_id].qs[src_offset], sizeof(uint32_t));
+            elems ^= xor_mask;
+            memcpy(&out.qs[dst_offset], &elems, sizeof(uint32_t));
+        }
+    } else {
+        LM_GGML_ASSERT(false);
+    }
+
+    return out;
+}
+
+// interleave 8 block_q4_0s in blocks of blck_size_interleave
+// returns an interleaved block_q4_0x8
+// in the interleaved block_q4_0x8, place deltas for 8 block_q4_0 blocks
+// first, then interleave quants from 8 block_q4_0s in blocks of blck_size_interleave
+static block_q4_0x8 make_block_q4_0x8(block_q4_0 * in, unsigned int blck_size_interleave) {
+    block_q4_0x8 out;
+
+    for (int i = 0; i < 8; i++) {
+        out.d[i] = in[i].d;
+    }
+
+    const int end = QK4_0 * 4 / blck_size_interleave;
+    const uint64_t xor_mask = 0x8888888888888888ULL;
+
+    for (int i = 0; i < end; ++i) {
+        int src_id = i % 8;
+        int src_offset = (i / 8) * blck_size_interleave;
+        int dst_offset = i * blck_size_interleave;
+
+        uint64_t elems;
+        memcpy(&elems, &in[src_id].qs[src_offset], sizeof(uint64_t));
+        elems ^= xor_mask;
+        memcpy(&out.qs[dst_offset], &elems, sizeof(uint64_t));
+    }
+
+    return out;
+}
+
+static block_q4_Kx8 make_block_q4_Kx8(block_q4_K * in, unsigned int blck_size_interleave) {
+    block_q4_Kx8 out;
+    //Delta(scale) and dmin values of the eight Q4_K structures are copied onto the output interleaved structure
+    for (int i = 0; i < 8; i++) {
+        out.d[i] = in[i].LM_GGML_COMMON_AGGR_U.LM_GGML_COMMON_AGGR_S.d;
+    }
+
+    for (int i = 0; i < 8; i++) {
+        out.dmin[i] = in[i].LM_GGML_COMMON_AGGR_U.LM_GGML_COMMON_AGGR_S.dmin;
+    }
+
+    const int end = QK_K * 4 / blck_size_interleave;
+
+    // Interleave Q4_K quants by taking 8 bytes at a time
+    for (int i = 0; i < end; ++i) {
+        int src_id = i % 8;
+        int src_offset = (i / 8) * blck_size_interleave;
+        int dst_offset = i * blck_size_interleave;
+
+        uint64_t elems;
+        memcpy(&elems, &in[src_id].qs[src_offset], sizeof(uint64_t));
+        memcpy(&out.qs[dst_offset], &elems, sizeof(uint64_t));
+    }
+
+    // The below logic is designed so as to unpack and rearrange scales and mins values in Q4_K
+    // Currently the Q4_K structure has 8 scales and 8 mins packed in 12 bytes ( 6 bits for each value)
+    // The output Q4_Kx8 structure has 96 bytes
+    // Every 12 byte is packed such that it contains scales and mins for corresponding sub blocks from Q4_K structure
+    // For eg - First 12 bytes contains 8 scales and 8 mins - each of first sub block from different Q4_K structures
+    uint8_t s[8], m[8];
+
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 8; j++) {
+            s[j] = in[j].scales[i] & 63;
+            m[j] = in[j].scales[i + 4] & 63;
+        }
+
+        out.scales[i * 12]      = (s[0] & 63) + ((s[4] & 48) << 2);
+        out.scales[i * 12 + 1]  = (s[1] & 63) + ((s[5] & 48) << 2);
+        out.scales[i * 12 + 2]  = (s[2] & 63) + ((s[6] & 48) << 2);
+        out.scales[i * 12 + 3]  = (s[3] & 63) + ((s[7] & 48) << 2);
+        out.scales[i * 12 + 4]  = (m[0] & 63) + ((m[4] & 48) << 2);
+        out.scales[i * 12 + 5]  = (m[1] & 63) + ((m[5] & 48) << 2);
+        out.scales[i * 12 + 6]  = (m[2] & 63) + ((m[6] & 48) << 2);
+        out.scales[i * 12 + 7]  = (m[3] & 63) + ((m[7] & 48) << 2);
+        out.scales[i * 12 + 8]  = (s[4] & 15) + ((m[4] & 15) << 4);
+        out.scales[i * 12 + 9]  = (s[5] & 15) + ((m[5] & 15) << 4);
+        out.scales[i * 12 + 10] = (s[6] & 15) + ((m[6] & 15) << 4);
+        out.scales[i * 12 + 11] = (s[7] & 15) + ((m[7] & 15) << 4);
+
+    }
+
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 8; j++) {
+            s[j] = ((in[j].scales[i] & 192) >> 2) | (in[j].scales[i+8] & 15);
+            m[j] = ((in[j].scales[i + 4] & 192) >> 2) | ((in[j].scales[i+8] & 240) >> 4);
+        }
 
         out.scales[i * 12 + 48] = (s[0] & 63) + ((s[4] & 48) << 2);
         out.scales[i * 12 + 49] = (s[1] & 63) + ((s[5] & 48) << 2);
@@ -5949,6 +6996,271 @@ static int repack_iq4_nl_to_iq4_nl_4_bl(struct lm_ggml_tensor * t, int interleav
     LM_GGML_UNUSED(data_size);
 }
 
+static inline void get_scale_min_k4(int j, const uint8_t * LM_GGML_RESTRICT q, uint8_t * LM_GGML_RESTRICT d, uint8_t * LM_GGML_RESTRICT m) {
+    if (j < 4) {
+        *d = q[j] & 63; *m = q[j + 4] & 63;
+    } else {
+        *d = (q[j+4] & 0xF) | ((q[j-4] >> 6) << 4);
+        *m = (q[j+4] >>  4) | ((q[j-0] >> 6) << 4);
+    }
+}
+
+// regroups the 6-bit scales and mins of four q4_K/q5_K blocks: group j holds sub-blocks 2j and
+// 2j + 1 of all four rows, packed the same way block_q4_K packs its eight sub-blocks
+template <typename BLOC_TYPE>
+static void pack_scales_mins_Kx4(const BLOC_TYPE * in, uint8_t * out) {
+    uint8_t s[8];
+    uint8_t m[8];
+    for (int j = 0; j < 4; j++) {
+        for (int i = 0; i < 4; i++) {
+            get_scale_min_k4(2 * j,     in[i].scales, &s[i],     &m[i]);
+            get_scale_min_k4(2 * j + 1, in[i].scales, &s[i + 4], &m[i + 4]);
+        }
+
+        uint8_t * q = out + K_SCALE_SIZE * j;
+        for (int k = 0; k < 4; k++) {
+            q[k]     = (s[k] & 63) + ((s[k + 4] & 48) << 2);
+            q[k + 4] = (m[k] & 63) + ((m[k + 4] & 48) << 2);
+            q[k + 8] = (s[k + 4] & 15) + ((m[k + 4] & 15) << 4);
+        }
+    }
+}
+
+// interleave 4 block_q4_Ks in blocks of blck_size_interleave bytes
+static block_q4_Kx4 make_block_q4_Kx4(block_q4_K * in, unsigned int blck_size_interleave) {
+    block_q4_Kx4 out;
+
+    for (int i = 0; i < 4; i++) {
+        out.d[i]    = in[i].LM_GGML_COMMON_AGGR_U.LM_GGML_COMMON_AGGR_S.d;
+        out.dmin[i] = in[i].LM_GGML_COMMON_AGGR_U.LM_GGML_COMMON_AGGR_S.dmin;
+    }
+
+    pack_scales_mins_Kx4(in, out.scales);
+
+    const int end = QK_K * 2 / blck_size_interleave;
+    for (int i = 0; i < end; ++i) {
+        int src_id = i % 4;
+        int src_offset = (i / 4) * blck_size_interleave;
+        int dst_offset = i * blck_size_interleave;
+
+        memcpy(&out.qs[dst_offset], &in[src_id].qs[src_offset], blck_size_interleave);
+    }
+
+    return out;
+}
+
+// same as make_block_q4_Kx4, qh is interleaved the same way as qs
+static block_q5_Kx4 make_block_q5_Kx4(block_q5_K * in, unsigned int blck_size_interleave) {
+    block_q5_Kx4 out;
+
+    for (int i = 0; i < 4; i++) {
+        out.d[i]    = in[i].LM_GGML_COMMON_AGGR_U.LM_GGML_COMMON_AGGR_S.d;
+        out.dmin[i] = in[i].LM_GGML_COMMON_AGGR_U.LM_GGML_COMMON_AGGR_S.dmin;
+    }
+
+    pack_scales_mins_Kx4(in, out.scales);
+
+    const int end = QK_K * 2 / blck_size_interleave;
+    for (int i = 0; i < end; ++i) {
+        int src_id = i % 4;
+        int src_offset = (i / 4) * blck_size_interleave;
+        int dst_offset = i * blck_size_interleave;
+
+        memcpy(&out.qs[dst_offset], &in[src_id].qs[src_offset], blck_size_interleave);
+    }
+
+    const int end_h = QK_K / 2 / blck_size_interleave;
+    for (int i = 0; i < end_h; ++i) {
+        int src_id = i % 4;
+        int src_offset = (i / 4) * blck_size_interleave;
+        int dst_offset = i * blck_size_interleave;
+
+        memcpy(&out.qh[dst_offset], &in[src_id].qh[src_offset], blck_size_interleave);
+    }
+
+    return out;
+}
+
+// interleave 4 block_q6_Ks, ql and qh in blocks of blck_size_interleave bytes, scales one byte at a time
+static block_q6_Kx4 make_block_q6_Kx4(block_q6_K * in, unsigned int blck_size_interleave) {
+    block_q6_Kx4 out;
+
+    for (int i = 0; i < 4; i++) {
+        out.d[i] = in[i].d;
+    }
+
+    for (int g = 0; g < QK_K / 16; g++) {
+        for (int i = 0; i < 4; i++) {
+            out.scales[g * 4 + i] = in[i].scales[g];
+        }
+    }
+
+    const int end_l = QK_K * 2 / blck_size_interleave;
+    for (int i = 0; i < end_l; ++i) {
+        int src_id = i % 4;
+        int src_offset = (i / 4) * blck_size_interleave;
+        int dst_offset = i * blck_size_interleave;
+
+        memcpy(&out.ql[dst_offset], &in[src_id].ql[src_offset], blck_size_interleave);
+    }
+
+    const int end_h = QK_K / blck_size_interleave;
+    for (int i = 0; i < end_h; ++i) {
+        int src_id = i % 4;
+        int src_offset = (i / 4) * blck_size_interleave;
+        int dst_offset = i * blck_size_interleave;
+
+        memcpy(&out.qh[dst_offset], &in[src_id].qh[src_offset], blck_size_interleave);
+    }
+
+    return out;
+}
+
+// interleave 4 block_q8_0s in blocks of blck_size_interleave bytes, the same layout as the
+// activations produced by lm_ggml_quantize_mat_q8_0_4x4
+static block_q8_0x4 make_block_q8_0x4(block_q8_0 * in, unsigned int blck_size_interleave) {
+    block_q8_0x4 out;
+
+    for (int i = 0; i < 4; i++) {
+        out.d[i] = in[i].d;
+    }
+
+    const int end = QK8_0 * 4 / blck_size_interleave;
+    for (int i = 0; i < end; ++i) {
+        int src_id = i % 4;
+        int src_offset = (i / 4) * blck_size_interleave;
+        int dst_offset = i * blck_size_interleave;
+
+        memcpy(&out.qs[dst_offset], &in[src_id].qs[src_offset], blck_size_interleave);
+    }
+
+    return out;
+}
+
+static int repack_q4_K_to_q4_K_4_bl(struct lm_ggml_tensor * t, int interleave_block, const void * LM_GGML_RESTRICT data, size_t data_size) {
+    LM_GGML_ASSERT(t->type == LM_GGML_TYPE_Q4_K);
+    LM_GGML_ASSERT(interleave_block == 4);
+    constexpr int nrows_interleaved = 4;
+
+    block_q4_Kx4 * dst = (block_q4_Kx4 *)t->data;
+    const block_q4_K * src = (const block_q4_K *) data;
+    block_q4_K dst_tmp[4];
+    int nrow = lm_ggml_nrows(t);
+    int nblocks = t->ne[0] / QK_K;
+
+    LM_GGML_ASSERT(data_size == nrow * nblocks * sizeof(block_q4_K));
+
+    if (t->ne[1] % nrows_interleaved != 0 || t->ne[0] % 8 != 0) {
+        return -1;
+    }
+
+    for (int b = 0; b < nrow; b += nrows_interleaved) {
+        for (int64_t x = 0; x < nblocks; x++) {
+            for (int i = 0; i < nrows_interleaved; i++) {
+                dst_tmp[i] = src[x + i * nblocks];
+            }
+            *dst++ = make_block_q4_Kx4(dst_tmp, interleave_block);
+        }
+        src += nrows_interleaved * nblocks;
+    }
+    return 0;
+
+    LM_GGML_UNUSED(data_size);
+}
+
+static int repack_q5_K_to_q5_K_4_bl(struct lm_ggml_tensor * t, int interleave_block, const void * LM_GGML_RESTRICT data, size_t data_size) {
+    LM_GGML_ASSERT(t->type == LM_GGML_TYPE_Q5_K);
+    LM_GGML_ASSERT(interleave_block == 4);
+    constexpr int nrows_interleaved = 4;
+
+    block_q5_Kx4 * dst = (block_q5_Kx4 *)t->data;
+    const block_q5_K * src = (const block_q5_K *) data;
+    block_q5_K dst_tmp[4];
+    int nrow = lm_ggml_nrows(t);
+    int nblocks = t->ne[0] / QK_K;
+
+    LM_GGML_ASSERT(data_size == nrow * nblocks * sizeof(block_q5_K));
+
+    if (t->ne[1] % nrows_interleaved != 0 || t->ne[0] % 8 != 0) {
+        return -1;
+    }
+
+    for (int b = 0; b < nrow; b += nrows_interleaved) {
+        for (int64_t x = 0; x < nblocks; x++) {
+            for (int i = 0; i < nrows_interleaved; i++) {
+                dst_tmp[i] = src[x + i * nblocks];
+            }
+            *dst++ = make_block_q5_Kx4(dst_tmp, interleave_block);
+        }
+        src += nrows_interleaved * nblocks;
+    }
+    return 0;
+
+    LM_GGML_UNUSED(data_size);
+}
+
+static int repack_q6_K_to_q6_K_4_bl(struct lm_ggml_tensor * t, int interleave_block, const void * LM_GGML_RESTRICT data, size_t data_size) {
+    LM_GGML_ASSERT(t->type == LM_GGML_TYPE_Q6_K);
+    LM_GGML_ASSERT(interleave_block == 4);
+    constexpr int nrows_interleaved = 4;
+
+    block_q6_Kx4 * dst = (block_q6_Kx4 *)t->data;
+    const block_q6_K * src = (const block_q6_K *) data;
+    block_q6_K dst_tmp[4];
+    int nrow = lm_ggml_nrows(t);
+    int nblocks = t->ne[0] / QK_K;
+
+    LM_GGML_ASSERT(data_size == nrow * nblocks * sizeof(block_q6_K));
+
+    if (t->ne[1] % nrows_interleaved != 0 || t->ne[0] % 8 != 0) {
+        return -1;
+    }
+
+    for (int b = 0; b < nrow; b += nrows_interleaved) {
+        for (int64_t x = 0; x < nblocks; x++) {
+            for (int i = 0; i < nrows_interleaved; i++) {
+                dst_tmp[i] = src[x + i * nblocks];
+            }
+            *dst++ = make_block_q6_Kx4(dst_tmp, interleave_block);
+        }
+        src += nrows_interleaved * nblocks;
+    }
+    return 0;
+
+    LM_GGML_UNUSED(data_size);
+}
+
+static int repack_q8_0_to_q8_0_4_bl(struct lm_ggml_tensor * t, int interleave_block, const void * LM_GGML_RESTRICT data, size_t data_size) {
+    LM_GGML_ASSERT(t->type == LM_GGML_TYPE_Q8_0);
+    LM_GGML_ASSERT(interleave_block == 4);
+    constexpr int nrows_interleaved = 4;
+
+    block_q8_0x4 * dst = (block_q8_0x4 *)t->data;
+    const block_q8_0 * src = (const block_q8_0 *) data;
+    block_q8_0 dst_tmp[4];
+    int nrow = lm_ggml_nrows(t);
+    int nblocks = t->ne[0] / QK8_0;
+
+    LM_GGML_ASSERT(data_size == nrow * nblocks * sizeof(block_q8_0));
+
+    if (t->ne[1] % nrows_interleaved != 0 || t->ne[0] % 8 != 0) {
+        return -1;
+    }
+
+    for (int b = 0; b < nrow; b += nrows_interleaved) {
+        for (int64_t x = 0; x < nblocks; x++) {
+            for (int i = 0; i < nrows_interleaved; i++) {
+                dst_tmp[i] = src[x + i * nblocks];
+            }
+            *dst++ = make_block_q8_0x4(dst_tmp, interleave_block);
+        }
+        src += nrows_interleaved * nblocks;
+    }
+    return 0;
+
+    LM_GGML_UNUSED(data_size);
+}
+
 namespace ggml::cpu::aarch64 {
 // repack
 template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS>
@@ -5975,6 +7287,22 @@ template <> int repack<block_iq4_nl, 4, 4>(struct lm_ggml_tensor * t, const void
     return repack_iq4_nl_to_iq4_nl_4_bl(t, 4, data, data_size);
 }
 
+template <> int repack<block_q4_K, 4, 4>(struct lm_ggml_tensor * t, const void * data, size_t data_size) {
+    return repack_q4_K_to_q4_K_4_bl(t, 4, data, data_size);
+}
+
+template <> int repack<block_q5_K, 4, 4>(struct lm_ggml_tensor * t, const void * data, size_t data_size) {
+    return repack_q5_K_to_q5_K_4_bl(t, 4, data, data_size);
+}
+
+template <> int repack<block_q6_K, 4, 4>(struct lm_ggml_tensor * t, const void * data, size_t data_size) {
+    return repack_q6_K_to_q6_K_4_bl(t, 4, data, data_size);
+}
+
+template <> int repack<block_q8_0, 4, 4>(struct lm_ggml_tensor * t, const void * data, size_t data_size) {
+    return repack_q8_0_to_q8_0_4_bl(t, 4, data, data_size);
+}
+
 // TODO: needs to be revisited
 //template <> int repack<block_iq4_nl, 8, 4>(struct lm_ggml_tensor * t, const void * data, size_t data_size) {
 //    return repack_iq4_nl_to_iq4_nl_4_bl(t, 8, data, data_size);
@@ -6004,6 +7332,22 @@ template <> void gemv<block_iq4_nl, 4, 4, LM_GGML_TYPE_Q8_0>(int n, float * s, s
     lm_ggml_gemv_iq4_nl_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
 }
 
+template <> void gemv<block_q4_K, 4, 4, LM_GGML_TYPE_Q8_K>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    lm_ggml_gemv_q4_K_4x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemv<block_q5_K, 4, 4, LM_GGML_TYPE_Q8_K>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    lm_ggml_gemv_q5_K_4x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemv<block_q6_K, 4, 4, LM_GGML_TYPE_Q8_K>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    lm_ggml_gemv_q6_K_4x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemv<block_q8_0, 4, 4, LM_GGML_TYPE_Q8_0>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    lm_ggml_gemv_q8_0_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
+}
+
 // gemm
 template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS, lm_ggml_type PARAM_TYPE>
 void gemm(int, float *, size_t, const void *, const void *, int, int);
@@ -6028,18 +7372,47 @@ template <> void gemm<block_iq4_nl, 4, 4, LM_GGML_TYPE_Q8_0>(int n, float * s, s
     lm_ggml_gemm_iq4_nl_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
 }
 
+template <> void gemm<block_q4_K, 4, 4, LM_GGML_TYPE_Q8_K>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    lm_ggml_gemm_q4_K_4x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemm<block_q5_K, 4, 4, LM_GGML_TYPE_Q8_K>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    lm_ggml_gemm_q5_K_4x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemm<block_q6_K, 4, 4, LM_GGML_TYPE_Q8_K>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    lm_ggml_gemm_q6_K_4x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemm<block_q8_0, 4, 4, LM_GGML_TYPE_Q8_0>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    lm_ggml_gemm_q8_0_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
+}
+
 class tensor_traits_base : public ggml::cpu::tensor_traits {
   public:
     virtual int repack(struct lm_ggml_tensor * t, const void * data, size_t data_size) = 0;
+    virtual const char * layout(const struct lm_ggml_tensor * t) const = 0;
 };
 
 template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS, lm_ggml_type PARAM_TYPE> class tensor_traits : public tensor_traits_base {
 
-    bool work_size(int /* n_threads */, const struct lm_ggml_tensor * op, size_t & size) override {
+    // Decode batches (gemv only) are quantized by every thread into its own slot, which drops the
+    // barrier that would publish a shared copy; the rows of src0 are split statically anyway
+    static bool quantize_per_thread(const struct lm_ggml_tensor * op) {
+        return op->src[1]->ne[1] < 4;
+    }
+
+    static size_t thread_slot_size(const struct lm_ggml_tensor * op) {
+        // padded to a cache line so the threads' slots are not falsely shared
+        return LM_GGML_PAD(lm_ggml_row_size(PARAM_TYPE, lm_ggml_nelements(op->src[1])), 64);
+    }
+
+    bool work_size(int n_threads, const struct lm_ggml_tensor * op, size_t & size) override {
         // not realy a LM_GGML_TYPE_Q8_0 but same size.
         switch (op->op) {
             case LM_GGML_OP_MUL_MAT:
-                size = lm_ggml_row_size(PARAM_TYPE, lm_ggml_nelements(op->src[1]));
+                size = quantize_per_thread(op) ? thread_slot_size(op) * n_threads
+                                               : lm_ggml_row_size(PARAM_TYPE, lm_ggml_nelements(op->src[1]));
                 return true;
             case LM_GGML_OP_MUL_MAT_ID:
                 size = lm_ggml_row_size(PARAM_TYPE, lm_ggml_nelements(op->src[1]));
@@ -6101,19 +7474,26 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS, lm_ggml_type
 
         const lm_ggml_from_float_t from_float = lm_ggml_get_type_traits_cpu(PARAM_TYPE)->from_float;
 
-        int64_t i11_processed = 0;
-        for (int64_t i11 = ith * 4; i11 < ne11 - ne11 % 4; i11 += nth * 4) {
-            lm_ggml_quantize_mat_t<INTER_SIZE, PARAM_TYPE>((float *) ((char *) src1->data + i11 * nb11), (void *) (wdata + i11 * nbw1), 4, ne10);
-        }
+        if (quantize_per_thread(op)) {
+            wdata += ith * thread_slot_size(op);
+            for (int64_t i11 = 0; i11 < ne11; i11++) {
+                from_float((float *) ((char *) src1->data + i11 * nb11), (void *) (wdata + i11 * nbw1), ne10);
+            }
+        } else {
+            int64_t i11_processed = 0;
+            for (int64_t i11 = ith * 4; i11 < ne11 - ne11 % 4; i11 += nth * 4) {
+                lm_ggml_quantize_mat_t<INTER_SIZE, PARAM_TYPE>((float *) ((char *) src1->data + i11 * nb11), (void *) (wdata + i11 * nbw1), 4, ne10);
+            }
 
-        i11_processed = ne11 - ne11 % 4;
-        for (int64_t i11 = i11_processed + ith; i11 < ne11; i11 += nth) {
-            from_float((float *) ((char *) src1->data + i11 * nb11), (void *) (wdata + i11 * nbw1), ne10);
-        }
+            i11_processed = ne11 - ne11 % 4;
+            for (int64_t i11 = i11_processed + ith; i11 < ne11; i11 += nth) {
+                from_float((float *) ((char *) src1->data + i11 * nb11), (void *) (wdata + i11 * nbw1), ne10);
+            }
 
-        lm_ggml_barrier(params->threadpool);
+            lm_ggml_barrier(params->threadpool);
+        }
 
-        const void * src1_wdata      = params->wdata;
+        const void * src1_wdata      = wdata;
         const size_t src1_col_stride = lm_ggml_row_size(PARAM_TYPE, ne10);
         int64_t      src0_start      = (ith * ne01) / nth;
         int64_t      src0_end        = ((ith + 1) * ne01) / nth;
@@ -6271,6 +7651,13 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS, lm_ggml_type
                        (int) NB_COLS, (int) INTER_SIZE);
         return ggml::cpu::aarch64::repack<BLOC_TYPE, INTER_SIZE, NB_COLS>(t, data, data_size);
     }
+
+    const char * layout(const struct lm_ggml_tensor * t) const override {
+        // each instance serves a single block type
+        static const std::string name = std::string(lm_ggml_type_name(t->type)) + "_" +
+            std::to_string((int) NB_COLS) + "x" + std::to_string((int) INTER_SIZE);
+        return name.c_str();
+    }
 };
 
 // instance for Q4
@@ -6278,6 +7665,14 @@ static const tensor_traits<block_q4_0, 4, 4, LM_GGML_TYPE_Q8_0> q4_0_4x4_q8_0;
 static const tensor_traits<block_q4_0, 8, 4, LM_GGML_TYPE_Q8_0> q4_0_4x8_q8_0;
 static const tensor_traits<block_q4_0, 8, 8, LM_GGML_TYPE_Q8_0> q4_0_8x8_q8_0;
 static const tensor_traits<block_q4_K, 8, 8, LM_GGML_TYPE_Q8_K> q4_K_8x8_q8_K;
+static const tensor_traits<block_q4_K, 4, 4, LM_GGML_TYPE_Q8_K> q4_K_4x4_q8_K;
+
+// instance for Q5_K, Q6_K
+static const tensor_traits<block_q5_K, 4, 4, LM_GGML_TYPE_Q8_K> q5_K_4x4_q8_K;
+static const tensor_traits<block_q6_K, 4, 4, LM_GGML_TYPE_Q8_K> q6_K_4x4_q8_K;
+
+// instance for Q8_0
+static const tensor_traits<block_q8_0, 4, 4, LM_GGML_TYPE_Q8_0> q8_0_4x4_q8_0;
 
 // instance for IQ4
 static const tensor_traits<block_iq4_nl, 4, 4, LM_GGML_TYPE_Q8_0> iq4_nl_4x4_q8_0;
@@ -6307,6 +7702,29 @@ static const ggml::cpu::tensor_traits * lm_ggml_aarch64_get_optimal_repack_type(
                 return &ggml::cpu::aarch64::q4_K_8x8_q8_K;
             }
         }
+        if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
+            if (cur->ne[1] % 4 == 0) {
+                return &ggml::cpu::aarch64::q4_K_4x4_q8_K;
+            }
+        }
+    } else if (cur->type == LM_GGML_TYPE_Q5_K) {
+        if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
+            if (cur->ne[1] % 4 == 0) {
+                return &ggml::cpu::aarch64::q5_K_4x4_q8_K;
+            }
+        }
+    } else if (cur->type == LM_GGML_TYPE_Q6_K) {
+        if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
+            if (cur->ne[1] % 4 == 0) {
+                return &ggml::cpu::aarch64::q6_K_4x4_q8_K;
+            }
+        }
+    } else if (cur->type == LM_GGML_TYPE_Q8_0) {
+        if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
+            if (cur->ne[1] % 4 == 0) {
+                return &ggml::cpu::aarch64::q8_0_4x4_q8_0;
+            }
+        }
     } else if (cur->type == LM_GGML_TYPE_IQ4_NL) {
         if (lm_ggml_cpu_has_neon() && lm_ggml_cpu_has_dotprod()) {
             if (cur->ne[1] % 4 == 0) {
@@ -6337,6 +7755,14 @@ static void lm_ggml_backend_cpu_aarch64_buffer_set_tensor(lm_ggml_backend_buffer
     LM_GGML_UNUSED(buffer);
 }
 
+const char * lm_ggml_backend_cpu_repack_layout(const struct lm_ggml_tensor * tensor) {
+    if (tensor->buffer == nullptr || tensor->buffer->buft != lm_ggml_backend_cpu_aarch64_buffer_type() || tensor->extra == nullptr) {
+        return nullptr;
+    }
+
+    return ((const ggml::cpu::aarch64::tensor_traits_base *) tensor->extra)->layout(tensor);
+}
+
 static const char * lm_ggml_backend_cpu_aarch64_buffer_type_get_name(lm_ggml_backend_buffer_type_t buft) {
     return "CPU_AARCH64";
 
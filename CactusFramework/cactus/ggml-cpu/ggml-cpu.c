@@ -7,6 +7,7 @@
 #include "ggml-cpu-impl.h"
 #include "ggml-cpu.h"
 #include "ggml-impl.h"
+#include "ggml-signpost.h"
 #include "ggml-cpu-quants.h"
 #include "ggml-threading.h"
 #include "unary-ops.h"
@@ -453,6 +454,13 @@ struct lm_ggml_threadpool {
 
     int32_t      prio;        // Scheduling priority
     uint32_t     poll;        // Polling level (0 - no polling)
+    int          n_perf;      // Workers [0, n_perf) run on performance cores (0 - all cores alike)
+
+    // graphs submitted from several threads run one at a time, interactive submitters first
+    lm_ggml_mutex_t submit_mutex;
+    lm_ggml_cond_t  submit_cond;
+    atomic_flag  submit_busy;
+    atomic_int   n_interactive_waiting;
 
     enum lm_ggml_status ec;
 };
@@ -469,6 +477,12 @@ struct lm_ggml_compute_state {
     int ith;
 };
 
+#if defined(_MSC_VER)
+static __declspec(thread) bool lm_ggml_submit_interactive = false;
+#else
+static _Thread_local bool lm_ggml_submit_interactive = false;
+#endif
+
 // Helpers for polling loops
 #if defined(__aarch64__) && ( defined(__clang__) || defined(__GNUC__) )
 static inline void lm_ggml_thread_cpu_relax(void) {
@@ -482,6 +496,28 @@ static inline void lm_ggml_thread_cpu_relax(void) {
 static inline void lm_ggml_thread_cpu_relax(void) {;}
 #endif
 
+// Hybrid (P/E core) threadpools: a thread on a performance core claims this many MUL_MAT chunks
+// for every one claimed on an efficiency core, which runs the dot kernels at roughly a third of the rate
+#define LM_GGML_PERF_CHUNK_WEIGHT 3
+
+// Spin rounds before a waiting thread in a hybrid barrier starts yielding its core
+#define LM_GGML_BARRIER_SPIN_ROUNDS (1024 * 16)
+
+// Nodes up to this many elements cost less than a barrier when split over the threads: a run of
+// independent ones is spread over the threads, one whole node per thread, with one barrier after it
+#define LM_GGML_WAVE_MAX_NELEMENTS 8192
+#define LM_GGML_WAVE_MAX_NODES     16
+
+static inline int lm_ggml_thread_n_chunks(const struct lm_ggml_threadpool * tp, int ith) {
+    return ith < tp->n_perf ? LM_GGML_PERF_CHUNK_WEIGHT : 1;
+}
+
+// first chunk of worker ith, i.e. the chunks claimed by workers [0, ith) in the first round
+static inline int lm_ggml_thread_first_chunk(const struct lm_ggml_threadpool * tp, int ith) {
+    const int n_perf = MIN(ith, tp->n_perf);
+    return n_perf * LM_GGML_PERF_CHUNK_WEIGHT + (ith - n_perf);
+}
+
 //
 // NUMA support
 //
@@ -513,6 +549,7 @@ struct lm_ggml_numa_nodes {
 
 struct lm_ggml_state {
     struct lm_ggml_numa_nodes numa;
+    int n_perf_cores; // performance cores on a heterogeneous CPU, 0 if all cores are alike
 };
 
 static struct lm_ggml_state g_state = {0};
@@ -541,8 +578,16 @@ void lm_ggml_barrier(struct lm_ggml_threadpool * tp) {
     }
 
     // wait for other threads
+    // in a hybrid pool the last thread is often on an efficiency core, so stop burning the
+    // performance cores after a while and let the straggler (or anything else) run
+    const bool hybrid = tp->n_perf > 0;
+    int n_spin = LM_GGML_BARRIER_SPIN_ROUNDS;
     while (atomic_load_explicit(&tp->n_barrier_passed, memory_order_relaxed) == n_passed) {
-        lm_ggml_thread_cpu_relax();
+        if (!hybrid || n_spin-- > 0) {
+            lm_ggml_thread_cpu_relax();
+        } else {
+            sched_yield();
+        }
     }
 
     // exit barrier (full seq-cst fence)
@@ -1254,6 +1299,20 @@ static void lm_ggml_compute_forward_mul_mat_one_chunk(
     }
 }
 
+// A single activation row (decode) is quantized by every thread into its own slot of the work
+// buffer: repeating that short from_float pass on each thread is cheaper than the barrier that
+// publishes one shared copy, and with a static split of the rows the op needs no synchronisation
+static bool lm_ggml_mul_mat_quantize_per_thread(const struct lm_ggml_tensor * dst) {
+    const struct lm_ggml_tensor * src1 = dst->src[1];
+    return src1->type == LM_GGML_TYPE_F32 && src1->type != type_traits_cpu[dst->src[0]->type].vec_dot_type &&
+           lm_ggml_nelements(src1) == src1->ne[0];
+}
+
+static size_t lm_ggml_mul_mat_thread_slot_size(const struct lm_ggml_tensor * dst) {
+    const enum lm_ggml_type vec_dot_type = type_traits_cpu[dst->src[0]->type].vec_dot_type;
+    return LM_GGML_PAD(lm_ggml_row_size(vec_dot_type, dst->src[1]->ne[0]), CACHE_LINE_SIZE);
+}
+
 static void lm_ggml_compute_forward_mul_mat(
         const struct lm_ggml_compute_params * params,
               struct lm_ggml_tensor * dst) {
@@ -1316,6 +1375,22 @@ static void lm_ggml_compute_forward_mul_mat(
 UseGgmlGemm1:;
 #endif
 
+    // a plan sized for fewer threads than run the op has no slot for each; every thread sees the
+    // same wsize and nth, so they all fall back to the one shared copy together
+    if (lm_ggml_mul_mat_quantize_per_thread(dst) && params->wsize >= nth*lm_ggml_mul_mat_thread_slot_size(dst)) {
+        struct lm_ggml_compute_params lparams = *params;
+        lparams.wdata = (char *) params->wdata + ith*lm_ggml_mul_mat_thread_slot_size(dst);
+        from_float((const float *) src1->data, lparams.wdata, ne10);
+
+        // each thread owns its first chunks, weighted towards performance cores
+        const int n_first = lm_ggml_thread_first_chunk(params->threadpool, nth);
+        const int64_t dr0 = (ne0 + n_first - 1)/n_first;
+        const int64_t ir0_start = MIN(dr0*lm_ggml_thread_first_chunk(params->threadpool, ith), ne0);
+        const int64_t ir0_end   = MIN(ir0_start + dr0*lm_ggml_thread_n_chunks(params->threadpool, ith), ne0);
+        lm_ggml_compute_forward_mul_mat_one_chunk(&lparams, dst, src0->type, 1, ir0_start, ir0_end, 0, 1);
+        return;
+    }
+
     if (src1->type != vec_dot_type) {
         char * wdata = params->wdata;
 
@@ -1353,9 +1428,13 @@ UseGgmlGemm1:;
     #endif
     }
 
+    // Chunks handed out before any thread touches current_chunk (nth, unless the pool is hybrid)
+    const int n_first = lm_ggml_thread_first_chunk(params->threadpool, nth);
+    const int n_claim = lm_ggml_thread_n_chunks(params->threadpool, ith);
+
     if (ith == 0) {
-        // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
-        atomic_store_explicit(&params->threadpool->current_chunk, nth, memory_order_relaxed);
+        // Every thread starts at its first chunk, so the first unprocessed chunk is n_first.  This save a bit of coordination right at the start.
+        atomic_store_explicit(&params->threadpool->current_chunk, n_first, memory_order_relaxed);
     }
 
     lm_ggml_barrier(params->threadpool);
@@ -1407,18 +1486,19 @@ UseGgmlGemm2:;
     // If the chunking is poor for the number of threads on this setup, scrap the whole plan.  Re-chunk it by thread.
     //   Also, chunking by thread was measured to have perform better on NUMA systems.  See https://github.com/ggml-org/llama.cpp/pull/6915
     //   In theory, chunking should be just as useful on NUMA and non NUMA systems, but testing disagreed with that.
-    if (nchunk0 * nchunk1 < nth * 4 || lm_ggml_is_numa()) {
+    if (nchunk0 * nchunk1 < n_first * 4 || lm_ggml_is_numa()) {
         // distribute the thread work across the inner or outer loop based on which one is larger
-        nchunk0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
-        nchunk1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
+        nchunk0 = nr0 > nr1 ? n_first : 1; // parallelize by src0 rows
+        nchunk1 = nr0 > nr1 ? 1 : n_first; // parallelize by src1 rows
     }
 
     // The number of elements in each chunk
     const int64_t dr0 = (nr0 + nchunk0 - 1) / nchunk0;
     const int64_t dr1 = (nr1 + nchunk1 - 1) / nchunk1;
 
-    // The first chunk comes from our thread_id, the rest will get auto-assigned.
-    int current_chunk = ith;
+    // The first chunks come from our thread_id, the rest will get auto-assigned n_claim at a time.
+    int current_chunk = lm_ggml_thread_first_chunk(params->threadpool, ith);
+    int chunk_end     = current_chunk + n_claim;
 
     while (current_chunk < nchunk0 * nchunk1) {
         const int64_t ith0 = current_chunk % nchunk0;
@@ -1440,11 +1520,16 @@ UseGgmlGemm2:;
         }
         lm_ggml_compute_forward_mul_mat_one_chunk(params, dst, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, ir1_start, ir1_end);
 
-        if (nth >= nchunk0 * nchunk1) {
+        if (++current_chunk < chunk_end) {
+            continue;
+        }
+
+        if (n_first >= nchunk0 * nchunk1) {
             break;
         }
 
-        current_chunk = atomic_fetch_add_explicit(&params->threadpool->current_chunk, 1, memory_order_relaxed);
+        current_chunk = atomic_fetch_add_explicit(&params->threadpool->current_chunk, n_claim, memory_order_relaxed);
+        chunk_end     = current_chunk + n_claim;
     }
 }
 
@@ -1633,10 +1718,13 @@ static void lm_ggml_compute_forward_mul_mat_id(
         }
     }
 
+    const int n_first = lm_ggml_thread_first_chunk(params->threadpool, nth);
+    const int n_claim = lm_ggml_thread_n_chunks(params->threadpool, ith);
+
     // reset current_chunk
     for (int cur_a = ith; cur_a < n_as; cur_a += nth) {
         atomic_int * current_chunk_ctr = (atomic_int *)(atomic_current_chunk + cur_a);
-        *current_chunk_ctr = nth;
+        *current_chunk_ctr = n_first;
     }
 
     lm_ggml_barrier(params->threadpool);
@@ -1671,15 +1759,16 @@ static void lm_ggml_compute_forward_mul_mat_id(
         int64_t nchunk0 = (nr0 + chunk_size - 1) / chunk_size;
         int64_t nchunk1 = (nr1 + chunk_size - 1) / chunk_size;
 
-        if (nchunk0 * nchunk1 < nth * 4 || disable_chunking) {
-            nchunk0 = nr0 > nr1 ? nth : 1;
-            nchunk1 = nr0 > nr1 ? 1 : nth;
+        if (nchunk0 * nchunk1 < n_first * 4 || disable_chunking) {
+            nchunk0 = nr0 > nr1 ? n_first : 1;
+            nchunk1 = nr0 > nr1 ? 1 : n_first;
         }
 
         const int64_t dr0 = (nr0 + nchunk0 - 1) / nchunk0;
         const int64_t dr1 = (nr1 + nchunk1 - 1) / nchunk1;
 
-        int current_chunk = ith;
+        int current_chunk = lm_ggml_thread_first_chunk(params->threadpool, ith);
+        int chunk_end     = current_chunk + n_claim;
 
         atomic_int * current_chunk_ctr = (atomic_int *)(atomic_current_chunk + cur_a);
 
@@ -1699,11 +1788,16 @@ static void lm_ggml_compute_forward_mul_mat_id(
                 src0_cur, matrix_rows, row_size, src1_cont, wdata
             );
 
-            if (nth >= nchunk0 * nchunk1) {
+            if (++current_chunk < chunk_end) {
+                continue;
+            }
+
+            if (n_first >= nchunk0 * nchunk1) {
                 break;
             }
 
-            current_chunk = atomic_fetch_add_explicit(current_chunk_ctr, 1, memory_order_relaxed);
+            current_chunk = atomic_fetch_add_explicit(current_chunk_ctr, n_claim, memory_order_relaxed);
+            chunk_end     = current_chunk + n_claim;
         }
     }
 }
@@ -2537,6 +2631,52 @@ static bool lm_ggml_thread_apply_priority(int32_t prio) {
 
 #endif
 
+// Workers of a hybrid threadpool are steered to their core type. Apple platforms have no
+// affinity API, the QoS class is what the scheduler uses to pick P or E cores.
+#if defined(__APPLE__)
+#include <pthread/qos.h>
+#include <sys/sysctl.h>
+
+static int lm_ggml_get_n_perf_cores(void) {
+    int n_levels = 0;
+    size_t size = sizeof(n_levels);
+    if (sysctlbyname("hw.nperflevels", &n_levels, &size, NULL, 0) != 0 || n_levels < 2) {
+        return 0;
+    }
+
+    int n_perf = 0;
+    size = sizeof(n_perf);
+    if (sysctlbyname("hw.perflevel0.physicalcpu", &n_perf, &size, NULL, 0) != 0) {
+        return 0;
+    }
+    return n_perf;
+}
+
+static bool lm_ggml_thread_apply_core_class(bool perf) {
+    const qos_class_t qos = perf ? QOS_CLASS_USER_INTERACTIVE : QOS_CLASS_UTILITY;
+
+    int32_t err = pthread_set_qos_class_self_np(qos, 0);
+    if (err != 0) {
+        fprintf(stderr, "warn: failed to set thread QoS class %d : %s (%d)\n", (int) qos, strerror(err), err);
+        return false;
+    }
+
+    return true;
+}
+
+#else
+
+static int lm_ggml_get_n_perf_cores(void) {
+    return 0;
+}
+
+static bool lm_ggml_thread_apply_core_class(bool perf) {
+    UNUSED(perf);
+    return true;
+}
+
+#endif
+
 static bool lm_ggml_thread_cpumask_is_valid(const bool * mask) {
     for (int i = 0; i < LM_GGML_MAX_N_THREADS; i++) {
         if (mask[i]) { return true; }
@@ -2592,6 +2732,9 @@ void lm_ggml_threadpool_free(struct lm_ggml_threadpool* threadpool) {
     lm_ggml_cond_destroy(&threadpool->cond);
 #endif // LM_GGML_USE_OPENMP
 
+    lm_ggml_mutex_destroy(&threadpool->submit_mutex);
+    lm_ggml_cond_destroy(&threadpool->submit_cond);
+
     const size_t workers_size = sizeof(struct lm_ggml_compute_state) * n_threads;
     lm_ggml_aligned_free(threadpool->workers, workers_size);
     lm_ggml_aligned_free(threadpool, sizeof(struct lm_ggml_threadpool));
@@ -2612,13 +2755,58 @@ static void lm_ggml_threadpool_resume_locked(struct lm_ggml_threadpool * threadp
 }
 #endif
 
+static bool lm_ggml_threadpool_try_submit(struct lm_ggml_threadpool * threadpool, bool interactive) {
+    if (!interactive && atomic_load(&threadpool->n_interactive_waiting) > 0) {
+        return false;
+    }
+    return !atomic_flag_test_and_set(&threadpool->submit_busy);
+}
+
+// Waits until the calling thread owns the threadpool. Ownership only changes between graphs, so an
+// interactive submitter overtakes queued background graphs but not the one that is running.
+static void lm_ggml_threadpool_submit_begin(struct lm_ggml_threadpool * threadpool) {
+    const bool interactive = lm_ggml_submit_interactive;
+
+    if (interactive) {
+        atomic_fetch_add(&threadpool->n_interactive_waiting, 1);
+    }
+    if (!lm_ggml_threadpool_try_submit(threadpool, interactive)) {
+        lm_ggml_mutex_lock_shared(&threadpool->submit_mutex);
+        while (!lm_ggml_threadpool_try_submit(threadpool, interactive)) {
+            lm_ggml_cond_wait(&threadpool->submit_cond, &threadpool->submit_mutex);
+        }
+        lm_ggml_mutex_unlock_shared(&threadpool->submit_mutex);
+    }
+    if (interactive) {
+        atomic_fetch_add(&threadpool->n_interactive_waiting, -1);
+    }
+}
+
+static void lm_ggml_threadpool_submit_end(struct lm_ggml_threadpool * threadpool) {
+    atomic_flag_clear(&threadpool->submit_busy);
+
+    // taking the mutex exclusively orders this against a waiter between its check and its wait
+    lm_ggml_mutex_lock(&threadpool->submit_mutex);
+    lm_ggml_cond_broadcast(&threadpool->submit_cond);
+    lm_ggml_mutex_unlock(&threadpool->submit_mutex);
+}
+
+bool lm_ggml_threadpool_set_interactive(bool interactive) {
+    const bool prev = lm_ggml_submit_interactive;
+    lm_ggml_submit_interactive = interactive;
+    return prev;
+}
+
 void lm_ggml_threadpool_pause(struct lm_ggml_threadpool * threadpool) {
 #ifndef LM_GGML_USE_OPENMP
+    // a shared threadpool may be running another caller's graph
+    lm_ggml_threadpool_submit_begin(threadpool);
     lm_ggml_mutex_lock(&threadpool->mutex);
     if (!threadpool->pause) {
        lm_ggml_threadpool_pause_locked(threadpool);
     }
     lm_ggml_mutex_unlock(&threadpool->mutex);
+    lm_ggml_threadpool_submit_end(threadpool);
 #else
     UNUSED(threadpool);
 #endif
@@ -2698,7 +2886,9 @@ struct lm_ggml_cplan lm_ggml_graph_plan(
                     {
                         const enum lm_ggml_type vec_dot_type = type_traits_cpu[node->src[0]->type].vec_dot_type;
 
-                        if (node->src[1]->type != vec_dot_type) {
+                        if (lm_ggml_mul_mat_quantize_per_thread(node)) {
+                            cur = lm_ggml_mul_mat_thread_slot_size(node)*n_tasks;
+                        } else if (node->src[1]->type != vec_dot_type) {
                             cur = lm_ggml_row_size(vec_dot_type, lm_ggml_nelements(node->src[1]));
                         }
                     } break;
@@ -2723,8 +2913,8 @@ struct lm_ggml_cplan lm_ggml_graph_plan(
                     } break;
                 case LM_GGML_OP_OUT_PROD:
                     {
-                        if (lm_ggml_is_quantized(node->src[0]->type)) {
-                            cur = lm_ggml_type_size(LM_GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                        if (node->src[0]->type != LM_GGML_TYPE_F32) {
+                            cur = lm_ggml_type_size(LM_GGML_TYPE_F32) * (node->src[0]->ne[0] + CACHE_LINE_SIZE_F32) * n_tasks;
                         }
                     } break;
                 case LM_GGML_OP_SOFT_MAX:
@@ -2778,6 +2968,7 @@ struct lm_ggml_cplan lm_ggml_graph_plan(
                         const int64_t ne20 = node->src[2]->ne[0]; // DV
 
                         cur = sizeof(float)*(1*ne10 + 2*ne20)*n_tasks; // 1x head size K + 2x head size V (per thread)
+                        cur = MAX(cur, lm_ggml_flash_attn_ext_tiled_wsize(node, n_tasks));
                     } break;
                 case LM_GGML_OP_FLASH_ATTN_BACK:
                     {
@@ -2824,6 +3015,123 @@ struct lm_ggml_cplan lm_ggml_graph_plan(
     return cplan;
 }
 
+// nodes that compute nothing need no barrier before or after them
+static bool lm_ggml_node_is_nop(const struct lm_ggml_tensor * node) {
+    switch (node->op) {
+        case LM_GGML_OP_NONE:
+        case LM_GGML_OP_RESHAPE:
+        case LM_GGML_OP_VIEW:
+        case LM_GGML_OP_PERMUTE:
+        case LM_GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return lm_ggml_is_empty(node);
+    }
+}
+
+// work buffer a node needs when it runs alone on one thread, SIZE_MAX if it cannot run in a wave:
+// only ops without barriers, shared chunk counters or shared scratch qualify
+static size_t lm_ggml_wave_node_wsize(const struct lm_ggml_tensor * node) {
+    if (lm_ggml_nelements(node) > LM_GGML_WAVE_MAX_NELEMENTS) {
+        return SIZE_MAX;
+    }
+    const struct lm_ggml_tensor * src0 = node->src[0];
+    switch (node->op) {
+        case LM_GGML_OP_ADD:
+        case LM_GGML_OP_SUB:
+        case LM_GGML_OP_MUL:
+        case LM_GGML_OP_DIV:
+            return lm_ggml_is_quantized(src0->type) ? SIZE_MAX : 0;
+        case LM_GGML_OP_DUP:
+        case LM_GGML_OP_CPY:
+        case LM_GGML_OP_CONT:
+            // the f16 and bf16 paths convert through the work buffer of all threads
+            return src0->type == LM_GGML_TYPE_F32 ? 0 : SIZE_MAX;
+        case LM_GGML_OP_SCALE:
+        case LM_GGML_OP_NORM:
+        case LM_GGML_OP_RMS_NORM:
+        case LM_GGML_OP_GET_ROWS:
+        case LM_GGML_OP_UNARY:
+            return 0;
+        case LM_GGML_OP_SOFT_MAX:
+            return src0->type == LM_GGML_TYPE_F32 ? (src0->ne[0] + CACHE_LINE_SIZE_F32)*sizeof(float) : SIZE_MAX;
+        case LM_GGML_OP_ROPE:
+            return (node->ne[0] + CACHE_LINE_SIZE_F32)*sizeof(float);
+        default:
+            return SIZE_MAX;
+    }
+}
+
+static bool lm_ggml_tensors_overlap(const struct lm_ggml_tensor * a, const struct lm_ggml_tensor * b) {
+    if (a == NULL || b == NULL || a->data == NULL || b->data == NULL) {
+        return false;
+    }
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+    return a0 < b0 + lm_ggml_nbytes(b) && b0 < a0 + lm_ggml_nbytes(a);
+}
+
+// whether node neither reads nor writes anything that other writes, and does not write what other reads
+static bool lm_ggml_nodes_independent(const struct lm_ggml_tensor * node, const struct lm_ggml_tensor * other) {
+    if (lm_ggml_tensors_overlap(node, other)) {
+        return false;
+    }
+    for (int i = 0; i < LM_GGML_MAX_SRC; i++) {
+        if (lm_ggml_tensors_overlap(node->src[i], other) || lm_ggml_tensors_overlap(node, other->src[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// a run of nodes that share one barrier: either a single node computed by all threads, or up to
+// LM_GGML_WAVE_MAX_NODES independent small nodes computed by one thread each, with nops in between
+struct lm_ggml_graph_wave {
+    struct lm_ggml_tensor * nodes[LM_GGML_WAVE_MAX_NODES];
+    size_t                  offs[LM_GGML_WAVE_MAX_NODES]; // work buffer slice of each node
+    int                     n;
+};
+
+// every thread builds the same waves from the graph, so they agree on where the barriers are
+// returns the index of the first node after the wave
+static int lm_ggml_graph_next_wave(const struct lm_ggml_cgraph * cgraph, const struct lm_ggml_cplan * cplan,
+                                   int node_n, int n_threads, struct lm_ggml_graph_wave * wave) {
+    wave->n = 0;
+    size_t offs = 0;
+    bool open = false;
+
+    int i = node_n;
+    for (; i < cgraph->n_nodes; i++) {
+        struct lm_ggml_tensor * node = cgraph->nodes[i];
+        if (lm_ggml_node_is_nop(node)) {
+            continue;
+        }
+        const size_t wsize = lm_ggml_wave_node_wsize(node);
+        const bool fits = wsize != SIZE_MAX && offs + wsize <= cplan->work_size;
+        if (wave->n > 0) {
+            if (!open || !fits || wave->n == LM_GGML_WAVE_MAX_NODES) {
+                break;
+            }
+            bool independent = true;
+            for (int j = 0; j < wave->n && independent; j++) {
+                independent = lm_ggml_nodes_independent(node, wave->nodes[j]);
+            }
+            if (!independent) {
+                break;
+            }
+        }
+        open = n_threads > 1 && fits;
+        wave->nodes[wave->n] = node;
+        wave->offs[wave->n]  = offs;
+        wave->n++;
+        if (fits) {
+            offs += LM_GGML_PAD(wsize, CACHE_LINE_SIZE);
+        }
+    }
+
+    return i;
+}
+
 static thread_ret_t lm_ggml_graph_compute_thread(void * data) {
     struct lm_ggml_compute_state * state = (struct lm_ggml_compute_state *) data;
     struct lm_ggml_threadpool    * tp    = state->threadpool;
@@ -2841,24 +3149,42 @@ static thread_ret_t lm_ggml_graph_compute_thread(void * data) {
         /*.threadpool=*/ tp,
     };
 
-    for (int node_n = 0; node_n < cgraph->n_nodes && atomic_load_explicit(&tp->abort, memory_order_relaxed) != node_n; node_n++) {
-        struct lm_ggml_tensor * node = cgraph->nodes[node_n];
+    LM_GGML_SIGNPOST_BEGIN(sp_thread, "cpu_thread_compute", "ith=%d nth=%d nodes=%d", params.ith, params.nth, cgraph->n_nodes);
+
+    struct lm_ggml_graph_wave wave;
 
-        lm_ggml_compute_forward(&params, node);
+    for (int node_n = 0; node_n < cgraph->n_nodes && atomic_load_explicit(&tp->abort, memory_order_relaxed) != node_n; ) {
+        const int node_e = lm_ggml_graph_next_wave(cgraph, cplan, node_n, params.nth, &wave);
+
+        if (wave.n == 1) {
+            lm_ggml_compute_forward(&params, wave.nodes[0]);
+        } else {
+            for (int j = params.ith; j < wave.n; j += params.nth) {
+                struct lm_ggml_compute_params wparams = params;
+                wparams.ith   = 0;
+                wparams.nth   = 1;
+                wparams.wsize = cplan->work_size - wave.offs[j];
+                wparams.wdata = (char *) cplan->work_data + wave.offs[j];
+                lm_ggml_compute_forward(&wparams, wave.nodes[j]);
+            }
+        }
 
         if (state->ith == 0 && cplan->abort_callback &&
                 cplan->abort_callback(cplan->abort_callback_data)) {
-            atomic_store_explicit(&tp->abort, node_n + 1, memory_order_relaxed);
+            atomic_store_explicit(&tp->abort, node_e, memory_order_relaxed);
             tp->ec    = LM_GGML_STATUS_ABORTED;
         }
 
-        if (node_n + 1 < cgraph->n_nodes) {
+        if (node_e < cgraph->n_nodes) {
             lm_ggml_barrier(state->threadpool);
         }
+        node_n = node_e;
     }
 
     lm_ggml_barrier(state->threadpool);
 
+    LM_GGML_SIGNPOST_END(sp_thread, "cpu_thread_compute");
+
     return 0;
 }
 
@@ -2941,6 +3267,10 @@ static thread_ret_t lm_ggml_graph_compute_secondary_thread(void* data) {
     struct lm_ggml_compute_state * state = (struct lm_ggml_compute_state *) data;
     struct lm_ggml_threadpool * threadpool = state->threadpool;
 
+    // an explicit priority opts the thread out of QoS, so it wins over the core class
+    if (threadpool->n_perf > 0 && threadpool->prio == LM_GGML_SCHED_PRIO_NORMAL) {
+        lm_ggml_thread_apply_core_class(state->ith < threadpool->n_perf);
+    }
     lm_ggml_thread_apply_priority(threadpool->prio);
     if (lm_ggml_thread_cpumask_is_valid(state->cpumask)) {
         lm_ggml_thread_apply_affinity(state->cpumask);
@@ -3031,9 +3361,21 @@ static struct lm_ggml_threadpool * lm_ggml_threadpool_new_impl(
         threadpool->n_threads_cur    = tpp->n_threads;
         threadpool->poll             = tpp->poll;
         threadpool->prio             = tpp->prio;
+        threadpool->n_perf           = 0;
+        threadpool->n_interactive_waiting = 0;
         threadpool->ec               = LM_GGML_STATUS_SUCCESS;
     }
 
+    lm_ggml_mutex_init(&threadpool->submit_mutex);
+    lm_ggml_cond_init(&threadpool->submit_cond);
+    atomic_flag_clear(&threadpool->submit_busy);
+
+    // Only mixed pools are hybrid: with every thread on a performance core the default scheduling applies.
+    // The main thread (worker 0) is expected to already run at a performance core's QoS.
+    if (tpp->hybrid && g_state.n_perf_cores > 0 && tpp->n_threads > g_state.n_perf_cores) {
+        threadpool->n_perf = g_state.n_perf_cores;
+    }
+
     // Allocate and init workers state
     const size_t workers_size = sizeof(struct lm_ggml_compute_state) * tpp->n_threads;
     struct lm_ggml_compute_state * workers = lm_ggml_aligned_malloc(workers_size);
@@ -3099,6 +3441,8 @@ enum lm_ggml_status lm_ggml_graph_compute(struct lm_ggml_cgraph * cgraph, struct
         struct lm_ggml_threadpool_params ttp = lm_ggml_threadpool_params_default(n_threads);
         threadpool = lm_ggml_threadpool_new_impl(&ttp, cgraph, cplan);
     } else {
+        lm_ggml_threadpool_submit_begin(threadpool);
+
         // Reset some of the parameters that need resetting
         // No worker threads should be accessing the parameters below at this stage
         threadpool->cgraph           = cgraph;
@@ -3108,6 +3452,8 @@ enum lm_ggml_status lm_ggml_graph_compute(struct lm_ggml_cgraph * cgraph, struct
         threadpool->ec               = LM_GGML_STATUS_SUCCESS;
     }
 
+    LM_GGML_SIGNPOST_BEGIN(sp_graph, "cpu_graph_compute", "threads=%d nodes=%d", n_threads, cgraph->n_nodes);
+
 #ifdef LM_GGML_USE_OPENMP
     if (n_threads > 1) {
         #pragma omp parallel num_threads(n_threads)
@@ -3141,10 +3487,14 @@ enum lm_ggml_status lm_ggml_graph_compute(struct lm_ggml_cgraph * cgraph, struct
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
 
+    LM_GGML_SIGNPOST_END(sp_graph, "cpu_graph_compute");
+
     enum lm_ggml_status ret = threadpool->ec;
 
     if (disposable_threadpool) {
         lm_ggml_threadpool_free(threadpool);
+    } else {
+        lm_ggml_threadpool_submit_end(threadpool);
     }
 
     return ret;
@@ -3246,6 +3596,11 @@ void lm_ggml_cpu_bf16_to_fp32(const lm_ggml_bf16_t * x, float * y, int64_t n) {
     }
 }
 
+double lm_ggml_cpu_exp_sum_f32(const float * x, float * y, int64_t n, float max) {
+    LM_GGML_ASSERT(n <= INT_MAX);
+    return (double) lm_ggml_vec_soft_max_f32((int) n, y, x, max);
+}
+
 int lm_ggml_cpu_has_avx(void) {
 #if defined(__AVX__)
     return 1;
@@ -3490,6 +3845,8 @@ void lm_ggml_cpu_init(void) {
         lm_ggml_init_arm_arch_features();
 #endif
 
+        g_state.n_perf_cores = lm_ggml_get_n_perf_cores();
+
         is_first_call = false;
     }
 
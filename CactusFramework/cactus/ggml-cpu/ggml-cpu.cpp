@@ -5,6 +5,7 @@
 #include "ggml-cpu-traits.h"
 #include "ggml-impl.h"
 #include "amx/amx.h"
+#include "accelerate/accelerate.h"
 
 #include <cctype>
 #include <string>
@@ -57,6 +58,12 @@ std::vector<lm_ggml_backend_buffer_type_t>& lm_ggml_backend_cpu_get_extra_buffer
         }
 #endif
 
+#if defined(__APPLE__)
+        if (lm_ggml_backend_cpu_accelerate_buffer_type()) {
+            bufts.push_back(lm_ggml_backend_cpu_accelerate_buffer_type());
+        }
+#endif
+
         bufts.push_back(NULL);
 
         return bufts;
@@ -441,7 +448,8 @@ static bool lm_ggml_backend_cpu_device_supports_op(lm_ggml_backend_dev_t dev, co
         case LM_GGML_OP_GET_ROWS_BACK:
             return src0->type == LM_GGML_TYPE_F32 || src0->type == LM_GGML_TYPE_F16;
         case LM_GGML_OP_OUT_PROD:
-            return (src0->type == LM_GGML_TYPE_F32 || (lm_ggml_is_quantized(src0->type) && src0->ne[2] == src1->ne[2] && src0->ne[3] == src1->ne[3])) &&
+            return (src0->type == LM_GGML_TYPE_F32 || ((lm_ggml_is_quantized(src0->type) || src0->type == LM_GGML_TYPE_F16 || src0->type == LM_GGML_TYPE_BF16) &&
+                    src0->ne[2] == src1->ne[2] && src0->ne[3] == src1->ne[3])) &&
                 src1->type == LM_GGML_TYPE_F32 && op->type == LM_GGML_TYPE_F32;
         default:
             return true;
@@ -631,6 +639,9 @@ static void * lm_ggml_backend_cpu_get_proc_address(lm_ggml_backend_reg_t reg, co
     if (strcmp(name, "lm_ggml_backend_cpu_is_numa") == 0) {
         return (void *)lm_ggml_is_numa;
     }
+    if (strcmp(name, "lm_ggml_backend_cpu_repack_layout") == 0) {
+        return (void *)lm_ggml_backend_cpu_repack_layout;
+    }
 
     // threadpool - TODO:  move to ggml-base
     if (strcmp(name, "lm_ggml_threadpool_new") == 0) {
@@ -3906,14 +3906,12 @@ void lm_ggml_compute_forward_out_prod(
         case LM_GGML_TYPE_IQ4_XS:
         case LM_GGML_TYPE_IQ3_S:
         case LM_GGML_TYPE_IQ2_S:
+        case LM_GGML_TYPE_F16:
+        case LM_GGML_TYPE_BF16:
             {
+                // rows are converted with the type's to_float, like the quantized types
                 lm_ggml_compute_forward_out_prod_q_f32(params, dst);
             } break;
-        case LM_GGML_TYPE_F16:
-            {
-                LM_GGML_ABORT("fatal error"); // todo
-                // lm_ggml_compute_forward_out_prod_f16_f32(params, dst);
-            }
         case LM_GGML_TYPE_F32:
             {
                 lm_ggml_compute_forward_out_prod_f32(params, dst);
@@ -7164,6 +7162,210 @@ static void lm_ggml_compute_forward_flash_attn_ext_f16(
     }
 }
 
+// Prefill runs query tiles of one head against K/V tiles instead of one query row at a time:
+// a K/V tile is read (and V converted to F32) once for LM_GGML_FA_TILE_Q rows rather than once
+// per row, and the online softmax rescales once per tile. Tiles sized for L1/L2 with DK=DV=128.
+
+static bool lm_ggml_flash_attn_ext_use_tiled(const lm_ggml_tensor * dst, int nth) {
+    const lm_ggml_tensor * q = dst->src[0];
+    const lm_ggml_tensor * k = dst->src[1];
+    const lm_ggml_tensor * v = dst->src[2];
+    if (q->type != LM_GGML_TYPE_F32 || k->type != LM_GGML_TYPE_F16 || v->type != LM_GGML_TYPE_F16) {
+        return false;
+    }
+    if (q->ne[1] < LM_GGML_FA_TILE_Q_MIN) {
+        return false;
+    }
+    // fewer tiles than threads leaves threads idle that the row kernel would use
+    const int64_t n_tiles = (q->ne[1] + LM_GGML_FA_TILE_Q - 1)/LM_GGML_FA_TILE_Q*q->ne[2]*q->ne[3];
+    return n_tiles >= nth;
+}
+
+// per-thread scratch in floats: Q tile as F16, KQ tile, V tile as F32, VKQ accumulators, M and S
+static size_t lm_ggml_flash_attn_ext_tiled_floats(int64_t DK, int64_t DV) {
+    return (LM_GGML_FA_TILE_Q*DK + 1)/2 + LM_GGML_FA_TILE_Q*LM_GGML_FA_TILE_KV + LM_GGML_FA_TILE_KV*DV +
+           LM_GGML_FA_TILE_Q*DV + 2*LM_GGML_FA_TILE_Q + CACHE_LINE_SIZE_F32;
+}
+
+size_t lm_ggml_flash_attn_ext_tiled_wsize(const struct lm_ggml_tensor * dst, int n_tasks) {
+    if (!lm_ggml_flash_attn_ext_use_tiled(dst, n_tasks)) {
+        return 0;
+    }
+    return sizeof(float)*lm_ggml_flash_attn_ext_tiled_floats(dst->src[1]->ne[0], dst->src[2]->ne[0])*n_tasks;
+}
+
+static void lm_ggml_compute_forward_flash_attn_ext_f16_tiled(
+        const lm_ggml_compute_params * params,
+        const lm_ggml_tensor * q,
+        const lm_ggml_tensor * k,
+        const lm_ggml_tensor * v,
+        const lm_ggml_tensor * mask,
+        lm_ggml_tensor * dst) {
+
+    LM_GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    LM_GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    LM_GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    LM_GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    LM_GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    LM_GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    LM_GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    LM_GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t DK = nek0;
+    const int64_t DV = nev0;
+    const int64_t N  = neq1;
+
+    LM_GGML_ASSERT(ne0 == DV);
+    LM_GGML_ASSERT(ne2 == N);
+
+    LM_GGML_ASSERT(nbq0 == lm_ggml_type_size(q->type));
+    LM_GGML_ASSERT(nbk0 == lm_ggml_type_size(k->type));
+    LM_GGML_ASSERT(nbv0 == lm_ggml_type_size(v->type));
+
+    LM_GGML_ASSERT(neq0 == DK);
+    LM_GGML_ASSERT(nb0 == sizeof(float));
+    LM_GGML_ASSERT(nb0 <= nb1);
+    LM_GGML_ASSERT(nb1 <= nb2);
+    LM_GGML_ASSERT(nb2 <= nb3);
+
+    const int64_t rk2 = neq2/nek2;
+    const int64_t rk3 = neq3/nek3;
+
+    const int64_t rv2 = neq2/nev2;
+    const int64_t rv3 = neq3/nev3;
+
+    float scale         = 1.0f;
+    float max_bias      = 0.0f;
+    float logit_softcap = 0.0f;
+
+    memcpy(&scale,         (float *) dst->op_params + 0, sizeof(float));
+    memcpy(&max_bias,      (float *) dst->op_params + 1, sizeof(float));
+    memcpy(&logit_softcap, (float *) dst->op_params + 2, sizeof(float));
+
+    if (logit_softcap != 0) {
+        scale /= logit_softcap;
+    }
+
+    const uint32_t n_head      = neq2;
+    const uint32_t n_head_log2 = 1u << (uint32_t) floor(log2(n_head));
+
+    const float m0 = powf(2.0f, -(max_bias       ) / n_head_log2);
+    const float m1 = powf(2.0f, -(max_bias / 2.0f) / n_head_log2);
+
+    float          * wdata = (float *) params->wdata + ith*lm_ggml_flash_attn_ext_tiled_floats(DK, DV);
+    lm_ggml_fp16_t * Q16   = (lm_ggml_fp16_t *) wdata;                      // [TILE_Q][DK]
+    float          * KQ    = wdata + (LM_GGML_FA_TILE_Q*DK + 1)/2;          // [TILE_Q][TILE_KV]
+    float          * V32   = KQ  + LM_GGML_FA_TILE_Q*LM_GGML_FA_TILE_KV;     // [TILE_KV][DV]
+    float          * VKQ   = V32 + LM_GGML_FA_TILE_KV*DV;                   // [TILE_Q][DV]
+    float          * M     = VKQ + LM_GGML_FA_TILE_Q*DV;                    // running max per row
+    float          * S     = M   + LM_GGML_FA_TILE_Q;                       // running sum per row
+
+    const int64_t n_qt = (N + LM_GGML_FA_TILE_Q - 1)/LM_GGML_FA_TILE_Q;
+    const int64_t n_units = n_qt*neq2*neq3;
+
+    // units are handed out round-robin: with a causal mask later query tiles see more keys,
+    // so contiguous ranges would leave the last thread with the most work
+    for (int64_t unit = ith; unit < n_units; unit += nth) {
+        const int64_t iq3 = unit/(neq2*n_qt);
+        const int64_t iq2 = (unit - iq3*neq2*n_qt)/n_qt;
+        const int64_t iq1_0 = (unit - iq3*neq2*n_qt - iq2*n_qt)*LM_GGML_FA_TILE_Q;
+        const int64_t nq = MIN(LM_GGML_FA_TILE_Q, N - iq1_0);
+
+        const uint32_t h = iq2; // head index
+        const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+
+        const int64_t ik3 = iq3/rk3;
+        const int64_t ik2 = iq2/rk2;
+        const int64_t iv3 = iq3/rv3;
+        const int64_t iv2 = iq2/rv2;
+
+        for (int64_t iq = 0; iq < nq; ++iq) {
+            const float * pq = (const float *) ((char *) q->data + ((iq1_0 + iq)*nbq1 + iq2*nbq2 + iq3*nbq3));
+            lm_ggml_cpu_fp32_to_fp16(pq, Q16 + iq*DK, DK);
+            M[iq] = -INFINITY;
+            S[iq] = 0.0f;
+        }
+        memset(VKQ, 0, nq*DV*sizeof(float));
+
+        for (int64_t ic0 = 0; ic0 < nek1; ic0 += LM_GGML_FA_TILE_KV) {
+            const int64_t nc = MIN(LM_GGML_FA_TILE_KV, nek1 - ic0);
+
+            // KQ tile, masked entries stay -INF and drop out of the softmax
+            bool any = false;
+            for (int64_t iq = 0; iq < nq; ++iq) {
+                const lm_ggml_fp16_t * mp = mask ? (lm_ggml_fp16_t *)((char *) mask->data + (iq1_0 + iq)*mask->nb[1]) + ic0 : NULL;
+                float * kq = KQ + iq*LM_GGML_FA_TILE_KV;
+                for (int64_t ic = 0; ic < nc; ++ic) {
+                    const float mv = mp ? slope*LM_GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
+                    if (mv == -INFINITY) {
+                        kq[ic] = -INFINITY;
+                        continue;
+                    }
+
+                    float s;
+                    const char * k_data = (const char *) k->data + ((ic0 + ic)*nbk1 + ik2*nbk2 + ik3*nbk3);
+                    lm_ggml_vec_dot_f16(DK, &s, 0, (lm_ggml_fp16_t *) k_data, 0, Q16 + iq*DK, 0, 1);
+
+                    s = s*scale;
+                    if (logit_softcap != 0.0f) {
+                        s = logit_softcap*tanhf(s);
+                    }
+                    kq[ic] = s + mv;
+                    any = true;
+                }
+            }
+            if (!any) {
+                continue;
+            }
+
+            for (int64_t ic = 0; ic < nc; ++ic) {
+                const char * v_data = (const char *) v->data + ((ic0 + ic)*nbv1 + iv2*nbv2 + iv3*nbv3);
+                lm_ggml_cpu_fp16_to_fp32((const lm_ggml_fp16_t *) v_data, V32 + ic*DV, DV);
+            }
+
+            // online softmax, one rescale per row and tile
+            for (int64_t iq = 0; iq < nq; ++iq) {
+                float * kq = KQ + iq*LM_GGML_FA_TILE_KV;
+                float tile_max = -INFINITY;
+                lm_ggml_vec_max_f32(nc, &tile_max, kq);
+                if (tile_max == -INFINITY) {
+                    continue;
+                }
+
+                float * vkq = VKQ + iq*DV;
+                if (tile_max > M[iq]) {
+                    const float ms = expf(M[iq] - tile_max);
+                    lm_ggml_vec_scale_f32(DV, vkq, ms);
+                    S[iq] *= ms;
+                    M[iq] = tile_max;
+                }
+                S[iq] += (float) lm_ggml_vec_soft_max_f32(nc, kq, kq, M[iq]);
+
+                for (int64_t ic = 0; ic < nc; ++ic) {
+                    if (kq[ic] != 0.0f) {
+                        lm_ggml_vec_mad_f32(DV, vkq, V32 + ic*DV, kq[ic]);
+                    }
+                }
+            }
+        }
+
+        for (int64_t iq = 0; iq < nq; ++iq) {
+            float * vkq = VKQ + iq*DV;
+            lm_ggml_vec_scale_f32(DV, vkq, 1.0f/S[iq]);
+
+            const int64_t i1 = iq1_0 + iq;
+            const int64_t i2 = iq2;
+            const int64_t i3 = iq3;
+
+            // permute(0, 2, 1, 3)
+            memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, vkq, nb1);
+        }
+    }
+}
+
 void lm_ggml_compute_forward_flash_attn_ext(
         const lm_ggml_compute_params * params,
         const lm_ggml_tensor * q,
@@ -7175,8 +7377,14 @@ void lm_ggml_compute_forward_flash_attn_ext(
         case LM_GGML_PREC_DEFAULT:
         case LM_GGML_PREC_F32:
             {
-                // uses F32 accumulators
-                lm_ggml_compute_forward_flash_attn_ext_f16(params, q, k, v, mask, dst);
+                // uses F32 accumulators; the plan sized wdata for its n_tasks, which may be fewer
+                // threads than run now, so the tiles also need the scratch to cover nth of them
+                if (lm_ggml_flash_attn_ext_use_tiled(dst, params->nth) &&
+                    params->wsize >= sizeof(float)*lm_ggml_flash_attn_ext_tiled_floats(k->ne[0], v->ne[0])*params->nth) {
+                    lm_ggml_compute_forward_flash_attn_ext_f16_tiled(params, q, k, v, mask, dst);
+                } else {
+                    lm_ggml_compute_forward_flash_attn_ext_f16(params, q, k, v, mask, dst);
+                }
             } break;
         default:
             {
@@ -8818,6 +9026,15 @@ void lm_ggml_compute_forward_cross_entropy_loss_back(
     }
 }
 
+// AdamW momenta may be kept in half precision to halve the optimizer memory
+static inline float adamw_state_load(float x)          { return x; }
+static inline float adamw_state_load(lm_ggml_fp16_t x)    { return LM_GGML_FP16_TO_FP32(x); }
+static inline float adamw_state_load(lm_ggml_bf16_t x)    { return LM_GGML_BF16_TO_FP32(x); }
+static inline void  adamw_state_store(float * p, float x)       { *p = x; }
+static inline void  adamw_state_store(lm_ggml_fp16_t * p, float x) { *p = LM_GGML_FP32_TO_FP16(x); }
+static inline void  adamw_state_store(lm_ggml_bf16_t * p, float x) { *p = LM_GGML_FP32_TO_BF16(x); }
+
+template <typename state_t>
 static void lm_ggml_compute_forward_opt_step_adamw_f32(
         const lm_ggml_compute_params * params,
         lm_ggml_tensor * dst) {
@@ -8831,6 +9048,7 @@ static void lm_ggml_compute_forward_opt_step_adamw_f32(
     LM_GGML_ASSERT(lm_ggml_are_same_shape(src0, src0_grad));
     LM_GGML_ASSERT(lm_ggml_are_same_shape(src0, src0_grad_m));
     LM_GGML_ASSERT(lm_ggml_are_same_shape(src0, src0_grad_v));
+    LM_GGML_ASSERT(src0_grad_m->type == src0_grad_v->type && lm_ggml_is_contiguous(src0_grad_m) && lm_ggml_is_contiguous(src0_grad_v));
     LM_GGML_ASSERT(lm_ggml_nelements(adamw_params) == 7);
 
     const int ith = params->ith;
@@ -8866,15 +9084,17 @@ static void lm_ggml_compute_forward_opt_step_adamw_f32(
 
         float       * w = (float       *) ((char       *) src0->data        + offset); // weight
         const float * g = (const float *) ((const char *) src0_grad->data   + offset); // grad
-        float       * m = (float       *) ((char       *) src0_grad_m->data + offset);
-        float       * v = (float       *) ((char       *) src0_grad_v->data + offset);
+        state_t     * m = (state_t     *) src0_grad_m->data + ir*ne00;
+        state_t     * v = (state_t     *) src0_grad_v->data + ir*ne00;
 
         for (int i00 = 0; i00 < ne00; ++i00) {
-            m[i00] = m[i00]*beta1 +        g[i00]*(1.0f - beta1);
-            v[i00] = v[i00]*beta2 + g[i00]*g[i00]*(1.0f - beta2);
+            const float mi = adamw_state_load(m[i00])*beta1 +        g[i00]*(1.0f - beta1);
+            const float vi = adamw_state_load(v[i00])*beta2 + g[i00]*g[i00]*(1.0f - beta2);
+            adamw_state_store(&m[i00], mi);
+            adamw_state_store(&v[i00], vi);
 
-            const float mh =       m[i00]*beta1h;
-            const float vh = sqrtf(v[i00]*beta2h) + eps;
+            const float mh =       mi*beta1h;
+            const float vh = sqrtf(vi*beta2h) + eps;
 
             // The weight decay is applied independently of the Adam momenta m and v.
             // This is NOT equivalent to l2 regularization that adds w[i00]*w[i00] to the loss.
@@ -8893,7 +9113,11 @@ void lm_ggml_compute_forward_opt_step_adamw(
     switch (src0->type) {
         case LM_GGML_TYPE_F32:
             {
-                lm_ggml_compute_forward_opt_step_adamw_f32(params, dst);
+                switch (dst->src[2]->type) {
+                    case LM_GGML_TYPE_F16:  lm_ggml_compute_forward_opt_step_adamw_f32<lm_ggml_fp16_t>(params, dst); break;
+                    case LM_GGML_TYPE_BF16: lm_ggml_compute_forward_opt_step_adamw_f32<lm_ggml_bf16_t>(params, dst); break;
+                    default:             lm_ggml_compute_forward_opt_step_adamw_f32<float>(params, dst);       break;
+                }
             } break;
         default:
             {
@@ -20,10 +20,19 @@
 
 static const size_t CACHE_LINE_SIZE_F32 = CACHE_LINE_SIZE/sizeof(float);
 
+// flash attention: batches of at least LM_GGML_FA_TILE_Q_MIN query rows run the tiled kernel,
+// LM_GGML_FA_TILE_Q rows of one head against LM_GGML_FA_TILE_KV keys at a time
+#define LM_GGML_FA_TILE_Q_MIN 8
+#define LM_GGML_FA_TILE_Q     32
+#define LM_GGML_FA_TILE_KV    64
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// work buffer of the tiled flash attention kernel for dst, 0 when it runs row by row
+size_t lm_ggml_flash_attn_ext_tiled_wsize(const struct lm_ggml_tensor * dst, int n_tasks);
+
 void lm_ggml_compute_forward_dup(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * dst);
 void lm_ggml_compute_forward_add(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * dst);
 void lm_ggml_compute_forward_add1(const struct lm_ggml_compute_params * params, struct lm_ggml_tensor * dst);
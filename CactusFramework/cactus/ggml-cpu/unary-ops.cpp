@@ -1,4 +1,7 @@
 #include "unary-ops.h"
+#include "vec.h"
+
+#include <type_traits>
 
 static inline float op_abs(float x) {
     return fabsf(x);
@@ -74,7 +77,8 @@ static inline void vec_unary_op(int64_t n, dst_t * y, const src0_t * x) {
     }
 }
 
-template <float (*op)(float), typename src0_t, typename dst_t>
+// vec_f32, when given, computes whole f32 rows with the vectorized kernel from vec.h
+template <float (*op)(float), typename src0_t, typename dst_t, void (*vec_f32)(const int, float *, const float *) = nullptr>
 static void apply_unary_op(const lm_ggml_compute_params * params, lm_ggml_tensor * dst) {
     const lm_ggml_tensor * src0 = dst->src[0];
 
@@ -95,17 +99,21 @@ static void apply_unary_op(const lm_ggml_compute_params * params, lm_ggml_tensor
         dst_t        * dst_ptr  = (dst_t  *)       ((char *)       dst->data  + i03*nb3  + i02*nb2  + i01*nb1 );
         const src0_t * src0_ptr = (const src0_t *) ((const char *) src0->data + i03*nb03 + i02*nb02 + i01*nb01);
 
-        vec_unary_op<op>(ne0, dst_ptr, src0_ptr);
+        if constexpr (vec_f32 != nullptr && std::is_same_v<src0_t, float> && std::is_same_v<dst_t, float>) {
+            vec_f32(ne0, dst_ptr, src0_ptr);
+        } else {
+            vec_unary_op<op>(ne0, dst_ptr, src0_ptr);
+        }
     }
 }
 
 // TODO: Use the 'traits' lookup table (for type conversion fns), instead of a mass of 'if' conditions with long templates
-template <float (*op)(float)>
+template <float (*op)(float), void (*vec_f32)(const int, float *, const float *) = nullptr>
 static void unary_op(const lm_ggml_compute_params * params, lm_ggml_tensor * dst) {
     const lm_ggml_tensor * src0 = dst->src[0];
 
     /*  */ if (src0->type == LM_GGML_TYPE_F32  && dst->type == LM_GGML_TYPE_F32) { // all f32
-        apply_unary_op<op, float, float>(params, dst);
+        apply_unary_op<op, float, float, vec_f32>(params, dst);
     } else if (src0->type == LM_GGML_TYPE_F16  && dst->type == LM_GGML_TYPE_F16) { // all f16
         apply_unary_op<op, lm_ggml_fp16_t, lm_ggml_fp16_t>(params, dst);
     } else if (src0->type == LM_GGML_TYPE_BF16 && dst->type == LM_GGML_TYPE_BF16) { // all bf16
@@ -150,7 +158,7 @@ void lm_ggml_compute_forward_relu(const lm_ggml_compute_params * params, lm_ggml
 }
 
 void lm_ggml_compute_forward_sigmoid(const lm_ggml_compute_params * params, lm_ggml_tensor * dst) {
-    unary_op<op_sigmoid>(params, dst);
+    unary_op<op_sigmoid, lm_ggml_vec_sigmoid_f32>(params, dst);
 }
 
 void lm_ggml_compute_forward_hardsigmoid(const lm_ggml_compute_params * params, lm_ggml_tensor * dst) {
@@ -158,7 +166,7 @@ void lm_ggml_compute_forward_hardsigmoid(const lm_ggml_compute_params * params,
 }
 
 void lm_ggml_compute_forward_exp(const lm_ggml_compute_params * params, lm_ggml_tensor * dst) {
-    unary_op<op_exp>(params, dst);
+    unary_op<op_exp, lm_ggml_vec_exp_f32>(params, dst);
 }
 
 void lm_ggml_compute_forward_hardswish(const lm_ggml_compute_params * params, lm_ggml_tensor * dst) {
@@ -43,6 +43,8 @@ void lm_ggml_vec_dot_bf16(int n, float * LM_GGML_RESTRICT s, size_t bs, lm_ggml_
 void lm_ggml_vec_dot_f16(int n, float * LM_GGML_RESTRICT s, size_t bs, lm_ggml_fp16_t * LM_GGML_RESTRICT x, size_t bx, lm_ggml_fp16_t * LM_GGML_RESTRICT y, size_t by, int nrc);
 
 void lm_ggml_vec_silu_f32(const int n, float * y, const float * x);
+void lm_ggml_vec_sigmoid_f32(const int n, float * y, const float * x);
+void lm_ggml_vec_exp_f32(const int n, float * y, const float * x);
 lm_ggml_float lm_ggml_vec_soft_max_f32(const int n, float * y, const float * x, float max);
 lm_ggml_float lm_ggml_vec_log_soft_max_f32(const int n, float * y, const float * x, float max);
 
@@ -398,7 +400,6 @@ inline static void lm_ggml_vec_leaky_relu_f16 (const int n, lm_ggml_fp16_t * y,
         y[i] = LM_GGML_FP32_TO_FP16(((v > 0.f) ? v : 0.f) + ns * ((v < 0.0f) ? v : 0.f));
     }
 }
-inline static void lm_ggml_vec_sigmoid_f32 (const int n, float * y, const float * x) { for (int i = 0; i < n; ++i) y[i] = 1.f / (1.f + expf(-x[i])); }
 inline static void lm_ggml_vec_sigmoid_f16 (const int n, lm_ggml_fp16_t * y, const lm_ggml_fp16_t * x) {
     for (int i = 0; i < n; ++i) {
         y[i] = LM_GGML_FP32_TO_FP16(1.f / (1.f + expf(-LM_GGML_FP16_TO_FP32(x[i]))));
@@ -418,7 +419,6 @@ inline static void lm_ggml_vec_hardsigmoid_f16 (const int n, lm_ggml_fp16_t * y,
         y[i] = LM_GGML_FP32_TO_FP16(fminf(1.0f, fmaxf(0.0f, (LM_GGML_FP16_TO_FP32(x[i]) + 3.0f) / 6.0f)));
     }
 }
-inline static void lm_ggml_vec_exp_f32 (const int n, float * y, const float * x) { for (int i = 0; i < n; ++i) y[i] = expf(x[i]); }
 inline static void lm_ggml_vec_exp_f16 (const int n, lm_ggml_fp16_t * y, const lm_ggml_fp16_t * x) {
     for (int i = 0; i < n; ++i) {
         y[i] = LM_GGML_FP32_TO_FP16(expf(LM_GGML_FP16_TO_FP32(x[i])));
@@ -567,6 +567,14 @@ inline static float32x4_t lm_ggml_v_silu(float32x4_t x) {
     return vdivq_f32(x, one_plus_exp_neg_x);
 }
 
+// computes sigmoid 1/(1+exp(-x)) in single precision vector
+inline static float32x4_t lm_ggml_v_sigmoid(float32x4_t x) {
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t exp_neg_x = lm_ggml_v_expf(vsubq_f32(zero, x));
+    return vdivq_f32(one, vaddq_f32(one, exp_neg_x));
+}
+
 #elif defined(__AVX512F__) && defined(__AVX512DQ__)
 
 // adapted from arm limited optimized routine
@@ -610,6 +618,14 @@ inline static __m512 lm_ggml_v_silu(__m512 x) {
     return _mm512_div_ps(x, one_plus_exp_neg_x);
 }
 
+// computes sigmoid 1/(1+exp(-x)) in single precision vector
+inline static __m512 lm_ggml_v_sigmoid(__m512 x) {
+    const __m512 one = _mm512_set1_ps(1);
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 exp_neg_x = lm_ggml_v_expf(_mm512_sub_ps(zero, x));
+    return _mm512_div_ps(one, _mm512_add_ps(one, exp_neg_x));
+}
+
 #elif defined(__AVX2__) && defined(__FMA__)
 
 // adapted from arm limited optimized routine
@@ -665,6 +681,14 @@ inline static __m256 lm_ggml_v_silu(__m256 x) {
     return _mm256_div_ps(x, one_plus_exp_neg_x);
 }
 
+// computes sigmoid 1/(1+exp(-x)) in single precision vector
+inline static __m256 lm_ggml_v_sigmoid(__m256 x) {
+    const __m256 one = _mm256_set1_ps(1);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 exp_neg_x = lm_ggml_v_expf(_mm256_sub_ps(zero, x));
+    return _mm256_div_ps(one, _mm256_add_ps(one, exp_neg_x));
+}
+
 #elif defined(__SSE2__) // __AVX2__ / __ARM_NEON
 
 #if defined(__FMA__)
@@ -719,6 +743,14 @@ inline static __m128 lm_ggml_v_silu(__m128 x) {
     return _mm_div_ps(x, one_plus_exp_neg_x);
 }
 
+// computes sigmoid 1/(1+exp(-x)) in single precision vector
+inline static __m128 lm_ggml_v_sigmoid(__m128 x) {
+    const __m128 one = _mm_set1_ps(1);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 exp_neg_x = lm_ggml_v_expf(_mm_sub_ps(zero, x));
+    return _mm_div_ps(one, _mm_add_ps(one, exp_neg_x));
+}
+
 #endif // __ARM_NEON / __AVX2__ / __SSE2__
 
 inline static void lm_ggml_vec_silu_f16(const int n, lm_ggml_fp16_t * y, const lm_ggml_fp16_t * x) {
@@ -59,6 +59,16 @@ LM_GGML_BACKEND_API bool lm_ggml_backend_metal_supports_family(lm_ggml_backend_t
 // capture all command buffers committed the next time `lm_ggml_backend_graph_compute` is called
 LM_GGML_BACKEND_API void lm_ggml_backend_metal_capture_next_compute(lm_ggml_backend_t backend);
 
+// cache the compiled pipelines in a MTLBinaryArchive at path, so backends created later (in this or
+// a later launch) skip compiling them for the GPU; NULL or "" disables it. Applies to backends
+// initialized after the call
+LM_GGML_BACKEND_API void lm_ggml_backend_metal_set_pipeline_cache(const char * path);
+
+// request (true) or end (false) residency of every Metal buffer through its residency set; buffers
+// allocated later follow the last call. Ending residency lets the OS page the memory out while idle
+// no-op without residency sets (macOS < 15, iOS < 18)
+LM_GGML_BACKEND_API void lm_ggml_backend_metal_set_residency(bool resident);
+
 LM_GGML_BACKEND_API lm_ggml_backend_reg_t lm_ggml_backend_metal_reg(void);
 
 #ifdef __cplusplus
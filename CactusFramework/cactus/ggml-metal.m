@@ -3,11 +3,15 @@
 #import "ggml-impl.h"
 #import "ggml-backend-impl.h"
 #import "ggml-metal-impl.h"
+#import "ggml-signpost.h"
 
 #import <Foundation/Foundation.h>
 
 #import <Metal/Metal.h>
 
+#include <pthread.h>
+#include <limits.h>
+
 #undef MIN
 #undef MAX
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -23,7 +27,7 @@
 #define TARGET_OS_VISION 0
 #endif
 
-// create residency sets only on macOS >= 15.0
+// create residency sets only on macOS >= 15.0, iOS and tvOS >= 18.0, visionOS >= 2.0
 #if !TARGET_CPU_X86_64 && TARGET_OS_OSX && __MAC_OS_X_VERSION_MAX_ALLOWED >= 150000 || \
     TARGET_OS_IOS && __IPHONE_OS_VERSION_MAX_ALLOWED >= 180000 || \
     TARGET_OS_TV && __TV_OS_VERSION_MAX_ALLOWED >= 180000 || \
@@ -67,10 +71,24 @@ static struct lm_ggml_backend_metal_device_context {
     /*.name                    =*/ "",
 };
 
+// guards the shared device and library, models may be loaded from several threads at once
+static pthread_mutex_t g_lm_ggml_ctx_dev_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// file the compiled pipelines are cached in between launches, empty for none
+static char g_lm_ggml_metal_pipeline_cache[PATH_MAX] = "";
+
+// residency sets of the live buffers, so residency can be ended and requested again process-wide
+// buffers created while residency is ended start out non-resident
+static pthread_mutex_t  g_lm_ggml_metal_rset_mutex = PTHREAD_MUTEX_INITIALIZER;
+static NSMutableArray * g_lm_ggml_metal_rsets      = nil;
+static bool             g_lm_ggml_metal_resident   = true;
+
 // acquire
 static id<MTLDevice> lm_ggml_backend_metal_device_acq(struct lm_ggml_backend_metal_device_context * ctx) {
     assert(ctx != NULL);
 
+    pthread_mutex_lock(&g_lm_ggml_ctx_dev_mutex);
+
     if (ctx->mtl_device == nil) {
         ctx->mtl_device = MTLCreateSystemDefaultDevice();
     }
@@ -99,12 +117,19 @@ static id<MTLDevice> lm_ggml_backend_metal_device_acq(struct lm_ggml_backend_met
 
     ctx->mtl_device_ref_count++;
 
-    return ctx->mtl_device;
+    id<MTLDevice> device = ctx->mtl_device;
+
+    pthread_mutex_unlock(&g_lm_ggml_ctx_dev_mutex);
+
+    return device;
 }
 
 // release
 static void lm_ggml_backend_metal_device_rel(struct lm_ggml_backend_metal_device_context * ctx) {
     assert(ctx != NULL);
+
+    pthread_mutex_lock(&g_lm_ggml_ctx_dev_mutex);
+
     assert(ctx->mtl_device_ref_count > 0);
 
     ctx->mtl_device_ref_count--;
@@ -120,6 +145,8 @@ static void lm_ggml_backend_metal_device_rel(struct lm_ggml_backend_metal_device
             ctx->mtl_device = nil;
         }
     }
+
+    pthread_mutex_unlock(&g_lm_ggml_ctx_dev_mutex);
 }
 
 // kernels
@@ -604,6 +631,8 @@ struct lm_ggml_metal_mem_pool {
 
     int n_heaps; // total number of heaps ever created (including those that were removed)
 
+    int64_t n_alloc; // total number of buffers allocated from the pool
+
     NSMutableArray * heaps;
     NSMutableArray * heaps_to_remove;
 };
@@ -612,6 +641,7 @@ static struct lm_ggml_metal_mem_pool * lm_ggml_metal_mem_pool_init(void) {
     struct lm_ggml_metal_mem_pool * mem_pool = calloc(1, sizeof(struct lm_ggml_metal_mem_pool));
 
     mem_pool->n_heaps = 0;
+    mem_pool->n_alloc = 0;
 
     mem_pool->heaps           = [[NSMutableArray alloc] init];
     mem_pool->heaps_to_remove = [[NSMutableArray alloc] init];
@@ -694,6 +724,8 @@ static void lm_ggml_metal_mem_pool_clear(struct lm_ggml_metal_mem_pool * mem_poo
 static id<MTLBuffer> lm_ggml_metal_mem_pool_alloc(struct lm_ggml_metal_mem_pool * mem_pool, size_t size) {
     const size_t alignment = 256;
 
+    mem_pool->n_alloc++;
+
     const size_t size_aligned = LM_GGML_PAD(size, alignment);
 
     // try one of the existing heaps
@@ -754,13 +786,246 @@ static id<MTLBuffer> lm_ggml_metal_mem_pool_alloc(struct lm_ggml_metal_mem_pool
     return buf;
 }
 
+//
+// lm_ggml_metal_cmd_list
+//
+// the encoder calls made for a range of graph nodes, recorded so that an identical graph can be submitted
+// again without going through lm_ggml_metal_encode_node
+//
+
+enum lm_ggml_metal_cmd_type {
+    LM_GGML_METAL_CMD_SET_PIPELINE,
+    LM_GGML_METAL_CMD_SET_BUFFER,
+    LM_GGML_METAL_CMD_SET_BYTES,
+    LM_GGML_METAL_CMD_SET_THREADGROUP_MEMORY,
+    LM_GGML_METAL_CMD_DISPATCH,
+};
+
+struct lm_ggml_metal_cmd {
+    enum lm_ggml_metal_cmd_type type;
+
+    NSUInteger index;
+    NSUInteger value; // buffer offset, offset of the argument bytes or threadgroup memory length
+    NSUInteger size;  // length of the argument bytes
+
+    id obj; // pipeline or buffer, owned by the backend or the buffer context (not retained)
+
+    MTLSize threadgroups;
+    MTLSize threads_per_threadgroup;
+};
+
+struct lm_ggml_metal_cmd_list {
+    struct lm_ggml_metal_cmd * cmds;
+    int n_cmds;
+    int n_cmds_max;
+
+    uint8_t * bytes;
+    size_t n_bytes;
+    size_t n_bytes_max;
+};
+
+static void lm_ggml_metal_cmd_list_reset(struct lm_ggml_metal_cmd_list * list) {
+    list->n_cmds  = 0;
+    list->n_bytes = 0;
+}
+
+static void lm_ggml_metal_cmd_list_free(struct lm_ggml_metal_cmd_list * list) {
+    free(list->cmds);
+    free(list->bytes);
+    memset(list, 0, sizeof(*list));
+}
+
+static struct lm_ggml_metal_cmd * lm_ggml_metal_cmd_list_push(struct lm_ggml_metal_cmd_list * list, enum lm_ggml_metal_cmd_type type) {
+    if (list->n_cmds == list->n_cmds_max) {
+        list->n_cmds_max = MAX(256, 2*list->n_cmds_max);
+        list->cmds = realloc(list->cmds, list->n_cmds_max*sizeof(struct lm_ggml_metal_cmd));
+        LM_GGML_ASSERT(list->cmds != NULL);
+    }
+    struct lm_ggml_metal_cmd * cmd = &list->cmds[list->n_cmds++];
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->type = type;
+    return cmd;
+}
+
+static size_t lm_ggml_metal_cmd_list_push_bytes(struct lm_ggml_metal_cmd_list * list, const void * bytes, size_t size) {
+    if (list->n_bytes + size > list->n_bytes_max) {
+        list->n_bytes_max = MAX(4096, MAX(list->n_bytes + size, 2*list->n_bytes_max));
+        list->bytes = realloc(list->bytes, list->n_bytes_max);
+        LM_GGML_ASSERT(list->bytes != NULL);
+    }
+    const size_t offs = list->n_bytes;
+    memcpy(list->bytes + offs, bytes, size);
+    list->n_bytes += size;
+    return offs;
+}
+
+static void lm_ggml_metal_cmd_list_replay(const struct lm_ggml_metal_cmd_list * list, id<MTLComputeCommandEncoder> encoder) {
+    for (int i = 0; i < list->n_cmds; ++i) {
+        const struct lm_ggml_metal_cmd * cmd = &list->cmds[i];
+        switch (cmd->type) {
+            case LM_GGML_METAL_CMD_SET_PIPELINE:
+                [encoder setComputePipelineState:cmd->obj]; break;
+            case LM_GGML_METAL_CMD_SET_BUFFER:
+                [encoder setBuffer:cmd->obj offset:cmd->value atIndex:cmd->index]; break;
+            case LM_GGML_METAL_CMD_SET_BYTES:
+                [encoder setBytes:list->bytes + cmd->value length:cmd->size atIndex:cmd->index]; break;
+            case LM_GGML_METAL_CMD_SET_THREADGROUP_MEMORY:
+                [encoder setThreadgroupMemoryLength:cmd->value atIndex:cmd->index]; break;
+            case LM_GGML_METAL_CMD_DISPATCH:
+                [encoder dispatchThreadgroups:cmd->threadgroups threadsPerThreadgroup:cmd->threads_per_threadgroup]; break;
+        }
+    }
+}
+
+// passes the calls of lm_ggml_metal_encode_node through to the encoder and records them
+// any other encoder method is forwarded as well, but marks the recording as not replayable
+@interface lm_ggml_metal_recording_encoder : NSObject {
+@public
+    id<MTLComputeCommandEncoder> encoder;
+    struct lm_ggml_metal_cmd_list * list;
+    bool replayable;
+}
+@end
+
+@implementation lm_ggml_metal_recording_encoder
+
+- (void)setComputePipelineState:(id<MTLComputePipelineState>)state {
+    [encoder setComputePipelineState:state];
+    lm_ggml_metal_cmd_list_push(list, LM_GGML_METAL_CMD_SET_PIPELINE)->obj = state;
+}
+
+- (void)setBuffer:(id<MTLBuffer>)buffer offset:(NSUInteger)offset atIndex:(NSUInteger)index {
+    [encoder setBuffer:buffer offset:offset atIndex:index];
+    struct lm_ggml_metal_cmd * cmd = lm_ggml_metal_cmd_list_push(list, LM_GGML_METAL_CMD_SET_BUFFER);
+    cmd->obj   = buffer;
+    cmd->value = offset;
+    cmd->index = index;
+}
+
+- (void)setBytes:(const void *)bytes length:(NSUInteger)length atIndex:(NSUInteger)index {
+    [encoder setBytes:bytes length:length atIndex:index];
+    const size_t offs = lm_ggml_metal_cmd_list_push_bytes(list, bytes, length);
+    struct lm_ggml_metal_cmd * cmd = lm_ggml_metal_cmd_list_push(list, LM_GGML_METAL_CMD_SET_BYTES);
+    cmd->value = offs;
+    cmd->size  = length;
+    cmd->index = index;
+}
+
+- (void)setThreadgroupMemoryLength:(NSUInteger)length atIndex:(NSUInteger)index {
+    [encoder setThreadgroupMemoryLength:length atIndex:index];
+    struct lm_ggml_metal_cmd * cmd = lm_ggml_metal_cmd_list_push(list, LM_GGML_METAL_CMD_SET_THREADGROUP_MEMORY);
+    cmd->value = length;
+    cmd->index = index;
+}
+
+- (void)dispatchThreadgroups:(MTLSize)threadgroups threadsPerThreadgroup:(MTLSize)threads {
+    [encoder dispatchThreadgroups:threadgroups threadsPerThreadgroup:threads];
+    struct lm_ggml_metal_cmd * cmd = lm_ggml_metal_cmd_list_push(list, LM_GGML_METAL_CMD_DISPATCH);
+    cmd->threadgroups            = threadgroups;
+    cmd->threads_per_threadgroup = threads;
+}
+
+- (id)forwardingTargetForSelector:(SEL)selector {
+    replayable = false;
+    return encoder;
+}
+
+@end
+
 struct lm_ggml_metal_command_buffer {
     id<MTLCommandBuffer> obj;
 
     // each command buffer has a memory pool from which it can allocate temporary buffers during the compute
     struct lm_ggml_metal_mem_pool * mem_pool;
+
+    // what the nodes of this command buffer encoded the last time they were recorded
+    struct lm_ggml_metal_cmd_list cmds;
+    bool cmds_replayable;
+};
+
+//
+// lm_ggml_metal_graph_key
+//
+// everything lm_ggml_metal_encode_node reads from a graph: topology, types, shapes, strides, data
+// addresses and op params; two graphs with the same key encode to the same commands
+//
+
+struct lm_ggml_metal_tensor_key {
+    int32_t type;
+    int32_t op;
+    int64_t ne[LM_GGML_MAX_DIMS];
+    size_t  nb[LM_GGML_MAX_DIMS];
+    void *  data;
+};
+
+struct lm_ggml_metal_graph_key {
+    uint8_t * data;
+    size_t size;
+    size_t size_max;
 };
 
+// bumped whenever a Metal buffer is freed, so that recorded commands never refer to a released MTLBuffer
+// even if a new buffer is later allocated at the same address
+static _Atomic uint64_t g_lm_ggml_metal_buffers_freed = 0;
+
+static void lm_ggml_metal_graph_key_append(struct lm_ggml_metal_graph_key * key, const void * data, size_t size) {
+    if (key->size + size > key->size_max) {
+        key->size_max = MAX(key->size + size, 2*key->size_max);
+        key->data = realloc(key->data, key->size_max);
+        LM_GGML_ASSERT(key->data != NULL);
+    }
+    memcpy(key->data + key->size, data, size);
+    key->size += size;
+}
+
+static void lm_ggml_metal_graph_key_append_tensor(struct lm_ggml_metal_graph_key * key, const struct lm_ggml_tensor * t) {
+    struct lm_ggml_metal_tensor_key tk;
+    memset(&tk, 0, sizeof(tk));
+    tk.type = t->type;
+    tk.op   = t->op;
+    for (int i = 0; i < LM_GGML_MAX_DIMS; ++i) {
+        tk.ne[i] = t->ne[i];
+        tk.nb[i] = t->nb[i];
+    }
+    tk.data = t->data;
+    lm_ggml_metal_graph_key_append(key, &tk, sizeof(tk));
+}
+
+// returns false for graphs whose encoding has side effects beyond the encoder calls
+static bool lm_ggml_metal_graph_key_build(struct lm_ggml_metal_graph_key * key, struct lm_ggml_cgraph * gf, int n_cb) {
+    key->size = 0;
+
+    const uint64_t n_freed = g_lm_ggml_metal_buffers_freed;
+    const int32_t header[2] = { gf->n_nodes, n_cb };
+    lm_ggml_metal_graph_key_append(key, &n_freed, sizeof(n_freed));
+    lm_ggml_metal_graph_key_append(key, header, sizeof(header));
+
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        const struct lm_ggml_tensor * node = lm_ggml_graph_node(gf, i);
+        if (node->op == LM_GGML_OP_SET) {
+            // a non-inplace SET copies src0 into dst on the CPU while encoding
+            return false;
+        }
+        lm_ggml_metal_graph_key_append_tensor(key, node);
+        lm_ggml_metal_graph_key_append(key, node->op_params, sizeof(node->op_params));
+
+        int32_t n_src = 0;
+        while (n_src < LM_GGML_MAX_SRC && node->src[n_src]) {
+            n_src++;
+        }
+        lm_ggml_metal_graph_key_append(key, &n_src, sizeof(n_src));
+        for (int j = 0; j < n_src; ++j) {
+            lm_ggml_metal_graph_key_append_tensor(key, node->src[j]);
+        }
+    }
+    return true;
+}
+
+static void lm_ggml_metal_graph_key_free(struct lm_ggml_metal_graph_key * key) {
+    free(key->data);
+    memset(key, 0, sizeof(*key));
+}
+
 struct lm_ggml_backend_metal_context {
     id<MTLDevice>       device;
     id<MTLCommandQueue> queue;
@@ -783,6 +1048,15 @@ struct lm_ggml_backend_metal_context {
 
     struct lm_ggml_cgraph * gf;
 
+    // graph replay: while the graph keeps the key of the last recorded one (the steady state of decoding),
+    // the recorded encoder calls are reissued instead of encoding each node again
+    bool replay_enabled;
+    bool replay_valid;  // every command buffer holds a replayable recording of the graph in replay_key
+    bool replay;        // the current compute reissues the recordings
+    bool record;        // the current compute records
+    struct lm_ggml_metal_graph_key replay_key;
+    struct lm_ggml_metal_graph_key replay_key_next;
+
     // the callback given to the thread pool
     void (^encode_async)(size_t ith);
 
@@ -964,6 +1238,63 @@ static id<MTLLibrary> lm_ggml_metal_load_library(id<MTLDevice> device, bool use_
     return metal_library;
 }
 
+// the archive at path, or an empty one when there is none or it cannot be read (e.g. it was
+// written by another OS version), nil without binary archive support
+static id lm_ggml_metal_open_pipeline_archive(id<MTLDevice> device, const char * path) {
+    if (@available(macOS 11.0, iOS 14.0, tvOS 14.0, *)) {
+        NSString * file = [NSString stringWithUTF8String:path];
+        MTLBinaryArchiveDescriptor * desc = [[MTLBinaryArchiveDescriptor alloc] init];
+        if ([[NSFileManager defaultManager] fileExistsAtPath:file]) {
+            desc.url = [NSURL fileURLWithPath:file];
+        }
+
+        NSError * error = nil;
+        id<MTLBinaryArchive> archive = [device newBinaryArchiveWithDescriptor:desc error:&error];
+        if (archive == nil && desc.url != nil) {
+            LM_GGML_LOG_WARN("%s: discarding pipeline cache %s: %s\n", __func__, path, [[error description] UTF8String]);
+            desc.url = nil;
+            archive = [device newBinaryArchiveWithDescriptor:desc error:&error];
+        }
+        [desc release];
+        return archive;
+    }
+    return nil;
+}
+
+// pipelines found in the archive skip the compile from AIR to GPU code; misses are compiled and
+// added, and *archive_dirty tells the caller to write the archive back
+static id<MTLComputePipelineState> lm_ggml_metal_new_pipeline(
+        id<MTLDevice> device,
+        id<MTLFunction> function,
+        id archive,
+        bool * archive_dirty,
+        NSError ** error) {
+    if (archive != nil) {
+        if (@available(macOS 11.0, iOS 14.0, tvOS 14.0, *)) {
+            MTLComputePipelineDescriptor * desc = [[MTLComputePipelineDescriptor alloc] init];
+            desc.computeFunction = function;
+            desc.binaryArchives  = @[archive];
+
+            id<MTLComputePipelineState> pipeline = [device newComputePipelineStateWithDescriptor:desc
+                                                                                         options:MTLPipelineOptionFailOnBinaryArchiveMiss
+                                                                                      reflection:nil
+                                                                                           error:nil];
+            if (pipeline == nil) {
+                if ([archive addComputePipelineFunctionsWithDescriptor:desc error:nil]) {
+                    *archive_dirty = true;
+                }
+                pipeline = [device newComputePipelineStateWithDescriptor:desc
+                                                                 options:MTLPipelineOptionNone
+                                                              reflection:nil
+                                                                   error:error];
+            }
+            [desc release];
+            return pipeline;
+        }
+    }
+    return [device newComputePipelineStateWithFunction:function error:error];
+}
+
 static struct lm_ggml_backend_metal_context * lm_ggml_metal_init(lm_ggml_backend_dev_t dev) {
     LM_GGML_LOG_INFO("%s: allocating\n", __func__);
 
@@ -994,10 +1325,12 @@ static struct lm_ggml_backend_metal_context * lm_ggml_metal_init(lm_ggml_backend
     ctx->d_queue = dispatch_queue_create("ggml-metal", DISPATCH_QUEUE_CONCURRENT);
 
     // load library
+    pthread_mutex_lock(&g_lm_ggml_ctx_dev_mutex);
     if (ctx_dev->mtl_library == nil) {
         ctx_dev->mtl_library = lm_ggml_metal_load_library(device, ctx_dev->use_bfloat);
     }
     id<MTLLibrary> metal_library = ctx_dev->mtl_library;
+    pthread_mutex_unlock(&g_lm_ggml_ctx_dev_mutex);
     if (metal_library == nil) {
         LM_GGML_LOG_ERROR("%s: error: metal library is nil\n", __func__);
         return NULL;
@@ -1052,6 +1385,11 @@ static struct lm_ggml_backend_metal_context * lm_ggml_metal_init(lm_ggml_backend
         ctx->cmd_bufs[i].mem_pool->device = device;
     }
 
+    ctx->replay_enabled = getenv("LM_GGML_METAL_NO_GRAPH_REPLAY") == NULL;
+    ctx->replay_valid = false;
+    ctx->replay = false;
+    ctx->record = false;
+
 #if TARGET_OS_OSX || (TARGET_OS_IOS && __clang_major__ >= 15)
     if (@available(macOS 10.12, iOS 16.0, *)) {
         LM_GGML_LOG_INFO("%s: recommendedMaxWorkingSetSize  = %8.2f MB\n", __func__, device.recommendedMaxWorkingSetSize / 1e6);
@@ -1066,11 +1404,20 @@ static struct lm_ggml_backend_metal_context * lm_ggml_metal_init(lm_ggml_backend
             ctx->kernels[i].pipeline = nil;
         }
 
+        char pipeline_cache[PATH_MAX];
+        pthread_mutex_lock(&g_lm_ggml_ctx_dev_mutex);
+        strncpy(pipeline_cache, g_lm_ggml_metal_pipeline_cache, sizeof(pipeline_cache));
+        pthread_mutex_unlock(&g_lm_ggml_ctx_dev_mutex);
+
+        const int64_t t_start = lm_ggml_time_us();
+        id archive = pipeline_cache[0] != '\0' ? lm_ggml_metal_open_pipeline_archive(device, pipeline_cache) : nil;
+        bool archive_dirty = false;
+
 #define LM_GGML_METAL_ADD_KERNEL(e, name, supported) \
         if (supported) { \
             struct lm_ggml_metal_kernel * kernel = &ctx->kernels[e]; \
             id<MTLFunction> metal_function = [metal_library newFunctionWithName:@"kernel_"#name]; \
-            kernel->pipeline = [device newComputePipelineStateWithFunction:metal_function error:&error]; \
+            kernel->pipeline = lm_ggml_metal_new_pipeline(device, metal_function, archive, &archive_dirty, &error); \
             LM_GGML_LOG_DEBUG("%s: loaded %-40s %16p | th_max = %4d | th_width = %4d\n", __func__, "kernel_"#name, (void *) kernel->pipeline, \
                     (int) kernel->pipeline.maxTotalThreadsPerThreadgroup, \
                     (int) kernel->pipeline.threadExecutionWidth); \
@@ -1461,6 +1808,23 @@ static struct lm_ggml_backend_metal_context * lm_ggml_metal_init(lm_ggml_backend
         LM_GGML_METAL_ADD_KERNEL(LM_GGML_METAL_KERNEL_TYPE_ARGMAX,                          argmax,                          true);
         LM_GGML_METAL_ADD_KERNEL(LM_GGML_METAL_KERNEL_TYPE_POOL_2D_AVG_F32,                 pool_2d_avg_f32,                 true);
         LM_GGML_METAL_ADD_KERNEL(LM_GGML_METAL_KERNEL_TYPE_POOL_2D_MAX_F32,                 pool_2d_max_f32,                 true);
+
+        if (archive != nil) {
+            if (@available(macOS 11.0, iOS 14.0, tvOS 14.0, *)) {
+                if (archive_dirty) {
+                    // written under the device lock, contexts may be created from several threads
+                    pthread_mutex_lock(&g_lm_ggml_ctx_dev_mutex);
+                    if (![archive serializeToURL:[NSURL fileURLWithPath:[NSString stringWithUTF8String:pipeline_cache]] error:&error]) {
+                        LM_GGML_LOG_WARN("%s: failed to write pipeline cache %s: %s\n", __func__, pipeline_cache, [[error description] UTF8String]);
+                        error = nil;
+                    }
+                    pthread_mutex_unlock(&g_lm_ggml_ctx_dev_mutex);
+                }
+            }
+            [archive release];
+        }
+        LM_GGML_LOG_INFO("%s: pipelines loaded in %.2f ms (cache %s)\n", __func__, (lm_ggml_time_us() - t_start) / 1000.0,
+                pipeline_cache[0] == '\0' ? "off" : (archive_dirty ? "updated" : "hit"));
     }
 
     return ctx;
@@ -1483,6 +1847,13 @@ static void lm_ggml_metal_free(struct lm_ggml_backend_metal_context * ctx) {
         lm_ggml_metal_mem_pool_free(ctx->cmd_bufs[i].mem_pool);
     }
 
+    for (int i = 0; i < LM_GGML_METAL_MAX_COMMAND_BUFFERS + 1; ++i) {
+        lm_ggml_metal_cmd_list_free(&ctx->cmd_bufs[i].cmds);
+    }
+
+    lm_ggml_metal_graph_key_free(&ctx->replay_key);
+    lm_ggml_metal_graph_key_free(&ctx->replay_key_next);
+
     dispatch_release(ctx->d_queue);
 
     free(ctx);
@@ -1542,7 +1913,16 @@ static bool lm_ggml_backend_metal_buffer_rset_init(
         }
 
         [ctx->rset commit];
-        [ctx->rset requestResidency];
+
+        pthread_mutex_lock(&g_lm_ggml_metal_rset_mutex);
+        if (g_lm_ggml_metal_rsets == nil) {
+            g_lm_ggml_metal_rsets = [[NSMutableArray alloc] init];
+        }
+        [g_lm_ggml_metal_rsets addObject:ctx->rset];
+        if (g_lm_ggml_metal_resident) {
+            [ctx->rset requestResidency];
+        }
+        pthread_mutex_unlock(&g_lm_ggml_metal_rset_mutex);
 
         return true;
     }
@@ -1559,7 +1939,13 @@ static void lm_ggml_backend_metal_buffer_rset_free(struct lm_ggml_backend_metal_
 #if defined(LM_GGML_METAL_HAS_RESIDENCY_SETS)
     if (@available(macOS 15.0, iOS 18.0, tvOS 18.0, visionOS 2.0, *)) {
         if (ctx->rset) {
-            [ctx->rset endResidency];
+            pthread_mutex_lock(&g_lm_ggml_metal_rset_mutex);
+            [g_lm_ggml_metal_rsets removeObjectIdenticalTo:ctx->rset];
+            if (g_lm_ggml_metal_resident) {
+                [ctx->rset endResidency];
+            }
+            pthread_mutex_unlock(&g_lm_ggml_metal_rset_mutex);
+
             [ctx->rset removeAllAllocations];
             [ctx->rset release];
         }
@@ -5146,6 +5532,26 @@ static enum lm_ggml_status lm_ggml_metal_graph_compute(
         ctx->n_nodes_per_cb = (ctx->n_nodes_1 + ctx->n_cb - 1) / ctx->n_cb;
 
         const bool should_capture = ctx->capture_next_compute;
+
+        // replay the recorded commands when the graph is the one they were recorded for, else record this one
+        ctx->replay = false;
+        ctx->record = false;
+        if (ctx->replay_enabled && !should_capture) {
+            const bool cacheable = lm_ggml_metal_graph_key_build(&ctx->replay_key_next, gf, n_cb);
+            if (cacheable && ctx->replay_valid &&
+                ctx->replay_key_next.size == ctx->replay_key.size &&
+                memcmp(ctx->replay_key_next.data, ctx->replay_key.data, ctx->replay_key.size) == 0) {
+                ctx->replay = true;
+            } else {
+                const struct lm_ggml_metal_graph_key tmp = ctx->replay_key;
+                ctx->replay_key      = ctx->replay_key_next;
+                ctx->replay_key_next = tmp;
+
+                ctx->replay_valid = false;
+                ctx->record = cacheable;
+            }
+        }
+
         if (should_capture) {
             ctx->capture_next_compute = false;
 
@@ -5193,11 +5599,21 @@ static enum lm_ggml_status lm_ggml_metal_graph_compute(
 
         dispatch_apply(n_cb, ctx->d_queue, ctx->encode_async);
 
+        if (ctx->record) {
+            bool replayable = true;
+            for (int i = 0; i <= n_cb; ++i) {
+                replayable = replayable && ctx->cmd_bufs[i].cmds_replayable;
+            }
+            ctx->replay_valid = replayable;
+        }
+
         // wait for completion and check status of each command buffer
         // needed to detect if the device ran out-of-memory for example (#1881)
         {
             id<MTLCommandBuffer> cmd_buf = ctx->cmd_bufs[n_cb].obj;
+            LM_GGML_SIGNPOST_BEGIN(sp_wait, "metal_wait", "cb=%d", n_cb);
             [cmd_buf waitUntilCompleted];
+            LM_GGML_SIGNPOST_END(sp_wait, "metal_wait");
 
             MTLCommandBufferStatus status = [cmd_buf status];
             if (status != MTLCommandBufferStatusCompleted) {
@@ -5212,7 +5628,9 @@ static enum lm_ggml_status lm_ggml_metal_graph_compute(
 
         for (int i = 0; i < n_cb; ++i) {
             id<MTLCommandBuffer> cmd_buf = ctx->cmd_bufs[i].obj;
+            LM_GGML_SIGNPOST_BEGIN(sp_wait, "metal_wait", "cb=%d", i);
             [cmd_buf waitUntilCompleted];
+            LM_GGML_SIGNPOST_END(sp_wait, "metal_wait");
 
             MTLCommandBufferStatus status = [cmd_buf status];
             if (status != MTLCommandBufferStatusCompleted) {
@@ -5239,6 +5657,7 @@ static enum lm_ggml_status lm_ggml_metal_graph_compute(
                 return LM_GGML_STATUS_ABORTED;
             }
 
+            LM_GGML_SIGNPOST_EVENT("metal_commit", "cb=%d", i + 1);
             [next_buffer commit];
         }
 
@@ -5258,6 +5677,8 @@ static enum lm_ggml_status lm_ggml_metal_graph_compute(
 static void lm_ggml_backend_metal_buffer_free_buffer(lm_ggml_backend_buffer_t buffer) {
     struct lm_ggml_backend_metal_buffer_context * ctx = (struct lm_ggml_backend_metal_buffer_context *)buffer->context;
 
+    g_lm_ggml_metal_buffers_freed++;
+
     for (int i = 0; i < ctx->n_buffers; i++) {
         [ctx->buffers[i].metal release];
     }
@@ -5619,30 +6040,66 @@ static void lm_ggml_backend_metal_set_n_cb(lm_ggml_backend_t backend, int n_cb)
             node_end   = n_nodes_0 + (MIN((cb_idx == n_cb_l - 1) ? n_nodes_1 : (cb_idx + 1) * n_nodes_per_cb, n_nodes_1));
         }
 
+        LM_GGML_SIGNPOST_BEGIN(sp_encode, "metal_encode", "cb=%d nodes=%d", cb_idx, node_end - node_start);
+
         const bool should_capture = ctx->capture_next_compute;
 
         struct lm_ggml_metal_mem_pool * mem_pool = ctx->cmd_bufs[cb_idx].mem_pool;
         lm_ggml_metal_mem_pool_reset(mem_pool);
 
-        for (int idx = node_start; idx < node_end; ++idx) {
-            if (should_capture) {
-                [encoder pushDebugGroup:[NSString stringWithCString:lm_ggml_op_desc(lm_ggml_graph_node(ctx->gf, idx)) encoding:NSUTF8StringEncoding]];
+        if (ctx->replay) {
+            lm_ggml_metal_cmd_list_replay(&ctx->cmd_bufs[cb_idx].cmds, encoder);
+        } else {
+            // temporary buffers from the memory pool only live for this compute, so nodes using them cannot be replayed
+            lm_ggml_metal_recording_encoder * recorder = nil;
+            const int64_t n_alloc = mem_pool->n_alloc;
+            bool encoded = true;
+
+            if (ctx->record) {
+                lm_ggml_metal_cmd_list_reset(&ctx->cmd_bufs[cb_idx].cmds);
+
+                recorder = [lm_ggml_metal_recording_encoder new];
+                recorder->encoder    = encoder;
+                recorder->list       = &ctx->cmd_bufs[cb_idx].cmds;
+                recorder->replayable = true;
             }
 
-            const bool res = lm_ggml_metal_encode_node(backend, idx, encoder, mem_pool);
+            id<MTLComputeCommandEncoder> target = recorder ? (id<MTLComputeCommandEncoder>) recorder : encoder;
 
-            if (should_capture) {
-                [encoder popDebugGroup];
+            for (int idx = node_start; idx < node_end; ++idx) {
+                if (should_capture) {
+                    [encoder pushDebugGroup:[NSString stringWithCString:lm_ggml_op_desc(lm_ggml_graph_node(ctx->gf, idx)) encoding:NSUTF8StringEncoding]];
+                }
+
+                const bool res = lm_ggml_metal_encode_node(backend, idx, target, mem_pool);
+
+                if (should_capture) {
+                    [encoder popDebugGroup];
+                }
+
+                if (!res) {
+                    encoded = false;
+                    break;
+                }
             }
 
-            if (!res) {
-                break;
+            if (recorder) {
+                ctx->cmd_bufs[cb_idx].cmds_replayable = recorder->replayable && encoded && mem_pool->n_alloc == n_alloc;
+                [recorder release];
             }
         }
 
         [encoder endEncoding];
+        LM_GGML_SIGNPOST_END(sp_encode, "metal_encode");
+#if defined(LM_GGML_USE_SIGNPOST)
+        // GPU execution itself cannot be bracketed from the CPU; report its measured span per buffer
+        [cmd_buf addCompletedHandler:^(id<MTLCommandBuffer> cb) {
+            LM_GGML_SIGNPOST_EVENT("metal_gpu", "cb=%d gpu_us=%.0f", cb_idx, (cb.GPUEndTime - cb.GPUStartTime) * 1e6);
+        }];
+#endif
 
         if (cb_idx < 2 || ctx->abort_callback == NULL) {
+            LM_GGML_SIGNPOST_EVENT("metal_commit", "cb=%d", cb_idx);
             [cmd_buf commit];
         }
     });
@@ -5721,6 +6178,31 @@ void lm_ggml_backend_metal_capture_next_compute(lm_ggml_backend_t backend) {
     ctx->capture_next_compute = true;
 }
 
+void lm_ggml_backend_metal_set_pipeline_cache(const char * path) {
+    pthread_mutex_lock(&g_lm_ggml_ctx_dev_mutex);
+    snprintf(g_lm_ggml_metal_pipeline_cache, sizeof(g_lm_ggml_metal_pipeline_cache), "%s", path ? path : "");
+    pthread_mutex_unlock(&g_lm_ggml_ctx_dev_mutex);
+}
+
+void lm_ggml_backend_metal_set_residency(bool resident) {
+    pthread_mutex_lock(&g_lm_ggml_metal_rset_mutex);
+    if (resident != g_lm_ggml_metal_resident) {
+        g_lm_ggml_metal_resident = resident;
+#if defined(LM_GGML_METAL_HAS_RESIDENCY_SETS)
+        if (@available(macOS 15.0, iOS 18.0, tvOS 18.0, visionOS 2.0, *)) {
+            for (id rset in g_lm_ggml_metal_rsets) {
+                if (resident) {
+                    [rset requestResidency];
+                } else {
+                    [rset endResidency];
+                }
+            }
+        }
+#endif
+    }
+    pthread_mutex_unlock(&g_lm_ggml_metal_rset_mutex);
+}
+
 // backend device
 
 static const char * lm_ggml_backend_metal_device_get_name(lm_ggml_backend_dev_t dev) {
@@ -11,6 +11,7 @@
 #include <cinttypes>
 #include <map>
 #include <random>
+#include <set>
 #include <vector>
 
 struct lm_ggml_opt_dataset {
@@ -67,6 +68,10 @@ struct lm_ggml_opt_context {
     lm_ggml_opt_get_optimizer_params get_opt_pars = nullptr;
     void * get_opt_pars_ud                     = nullptr;
     struct lm_ggml_tensor * adamw_params          = nullptr;
+
+    lm_ggml_opt_checkpoint_filter checkpoint_filter = nullptr;
+    void * checkpoint_filter_ud                  = nullptr;
+    enum lm_ggml_type opt_state_type                = LM_GGML_TYPE_F32;
 };
 
 struct lm_ggml_opt_result {
@@ -249,6 +254,9 @@ struct lm_ggml_opt_params lm_ggml_opt_default_params(
         /*opt_period      =*/ 1,
         /*get_opt_pars    =*/ lm_ggml_opt_get_default_optimizer_params,
         /*get_opt_pars_ud =*/ nullptr,
+        /*checkpoint_filter    =*/ nullptr,
+        /*checkpoint_filter_ud =*/ nullptr,
+        /*opt_state_type  =*/ LM_GGML_TYPE_F32,
     };
 }
 
@@ -312,6 +320,88 @@ static lm_ggml_cgraph * dup_graph(lm_ggml_context * ctx, lm_ggml_cgraph * src) {
     return dst;
 }
 
+// gradient checkpointing
+
+struct lm_ggml_opt_recompute {
+    lm_ggml_opt_context_t opt_ctx;
+    std::set<lm_ggml_tensor *> forward;                    // nodes of the forward pass
+    std::map<lm_ggml_tensor *, lm_ggml_tensor *> clones;      // forward node -> its recomputation
+    std::vector<lm_ggml_tensor *> order;                   // new node order of the backward graph
+
+    bool kept(const lm_ggml_tensor * node) const {
+        const int keep = LM_GGML_TENSOR_FLAG_INPUT | LM_GGML_TENSOR_FLAG_OUTPUT | LM_GGML_TENSOR_FLAG_PARAM | LM_GGML_TENSOR_FLAG_LOSS;
+        return (node->flags & keep) || opt_ctx->checkpoint_filter(node, opt_ctx->checkpoint_filter_ud);
+    }
+
+    // the clone runs the same op on recomputed sources, so it only lives while the backward pass
+    // of its segment needs it; clones are shared by all backward nodes that read the same result
+    lm_ggml_tensor * get(lm_ggml_tensor * node) {
+        if (node == nullptr || forward.find(node) == forward.end() || kept(node)) {
+            return node;
+        }
+        auto it = clones.find(node);
+        if (it != clones.end()) {
+            return it->second;
+        }
+
+        lm_ggml_tensor * clone = lm_ggml_new_tensor(opt_ctx->ctx_compute, node->type, LM_GGML_MAX_DIMS, node->ne);
+        clones[node] = clone;
+        clone->op = node->op;
+        for (int i = 0; i < LM_GGML_MAX_DIMS; i++) {
+            clone->nb[i] = node->nb[i];
+        }
+        clone->flags = node->flags;
+        memcpy(clone->op_params, node->op_params, sizeof(node->op_params));
+        lm_ggml_format_name(clone, "%s (recomputed)", node->name);
+        for (int i = 0; i < LM_GGML_MAX_SRC; i++) {
+            clone->src[i] = get(node->src[i]);
+        }
+        if (node->view_src) {
+            clone->view_src  = get(node->view_src);
+            clone->view_offs = node->view_offs;
+        }
+        order.push_back(clone);
+        return clone;
+    }
+};
+
+// Rewrites the backward pass of gb to read recomputed copies of the forward results the checkpoint
+// filter drops. The forward results are then freed by the allocator once the forward pass is done
+// with them, trading a second forward pass per segment for their memory.
+static lm_ggml_cgraph * lm_ggml_opt_recompute_graph(lm_ggml_opt_context_t opt_ctx, lm_ggml_cgraph * gb) {
+    const int n_forward = opt_ctx->gf->n_nodes;
+
+    lm_ggml_opt_recompute rc;
+    rc.opt_ctx = opt_ctx;
+    for (int i = 0; i < n_forward; i++) {
+        rc.forward.insert(gb->nodes[i]);
+    }
+    rc.order.assign(gb->nodes, gb->nodes + n_forward);
+
+    for (int i = n_forward; i < gb->n_nodes; i++) {
+        lm_ggml_tensor * node = gb->nodes[i];
+        for (int j = 0; j < LM_GGML_MAX_SRC; j++) {
+            node->src[j] = rc.get(node->src[j]);
+        }
+        if (node->view_src) {
+            node->view_src = rc.get(node->view_src);
+        }
+        rc.order.push_back(node);
+    }
+    if (rc.clones.empty()) {
+        return gb;
+    }
+
+    lm_ggml_cgraph * result = lm_ggml_new_graph_custom(opt_ctx->ctx_compute, gb->size + (int) rc.clones.size(), /*grads =*/ true);
+    lm_ggml_graph_cpy(gb, result);
+    for (const auto & it : rc.clones) {
+        lm_ggml_hash_insert(&result->visited_hash_set, it.second);
+    }
+    std::copy(rc.order.begin(), rc.order.end(), result->nodes);
+    result->n_nodes = (int) rc.order.size();
+    return result;
+}
+
 static void lm_ggml_opt_build(lm_ggml_opt_context_t opt_ctx) {
     LM_GGML_ASSERT(opt_ctx->ctx_compute && "no compute context set, either use static graphs or set one with lm_ggml_opt_prepare_alloc");
     LM_GGML_ASSERT((!opt_ctx->static_graphs || opt_ctx->inputs->data) && "when using static graphs the inputs must be allocated statically");
@@ -464,8 +554,8 @@ static void lm_ggml_opt_build(lm_ggml_opt_context_t opt_ctx) {
             for (int i = 0; i < n_nodes; ++i) {
                 lm_ggml_tensor * node = opt_ctx->gf->nodes[i];
                 if (node->flags & LM_GGML_TENSOR_FLAG_PARAM) {
-                    opt_ctx->grad_m[i] = lm_ggml_new_tensor(opt_ctx->ctx_static, LM_GGML_TYPE_F32, LM_GGML_MAX_DIMS, node->ne);
-                    opt_ctx->grad_v[i] = lm_ggml_new_tensor(opt_ctx->ctx_static, LM_GGML_TYPE_F32, LM_GGML_MAX_DIMS, node->ne);
+                    opt_ctx->grad_m[i] = lm_ggml_new_tensor(opt_ctx->ctx_static, opt_ctx->opt_state_type, LM_GGML_MAX_DIMS, node->ne);
+                    opt_ctx->grad_v[i] = lm_ggml_new_tensor(opt_ctx->ctx_static, opt_ctx->opt_state_type, LM_GGML_MAX_DIMS, node->ne);
                 } else {
                     opt_ctx->grad_m[i] = nullptr;
                     opt_ctx->grad_v[i] = nullptr;
@@ -477,6 +567,9 @@ static void lm_ggml_opt_build(lm_ggml_opt_context_t opt_ctx) {
     // gb_grad == graph backward gradients, forward pass, then backward pass to calculate gradients.
     opt_ctx->gb_grad = lm_ggml_graph_dup(opt_ctx->ctx_compute, opt_ctx->gf, /*force_grads =*/ true);
     lm_ggml_build_backward_expand(opt_ctx->ctx_compute, opt_ctx->gb_grad, opt_ctx->grad_accs.data());
+    if (opt_ctx->checkpoint_filter) {
+        opt_ctx->gb_grad = lm_ggml_opt_recompute_graph(opt_ctx, opt_ctx->gb_grad);
+    }
 
     if (opt_ctx->buf_static) {
         if (opt_ctx->build_type == LM_GGML_OPT_BUILD_TYPE_GRAD) {
@@ -534,8 +627,13 @@ lm_ggml_opt_context_t lm_ggml_opt_init(struct lm_ggml_opt_params params) {
     result->opt_period       = params.opt_period;
     result->get_opt_pars     = params.get_opt_pars;
     result->get_opt_pars_ud  = params.get_opt_pars_ud;
+    result->checkpoint_filter    = params.checkpoint_filter;
+    result->checkpoint_filter_ud = params.checkpoint_filter_ud;
+    result->opt_state_type   = params.opt_state_type;
 
     LM_GGML_ASSERT(result->opt_period >= 1);
+    LM_GGML_ASSERT(result->opt_state_type == LM_GGML_TYPE_F32 || result->opt_state_type == LM_GGML_TYPE_F16 ||
+                result->opt_state_type == LM_GGML_TYPE_BF16);
 
     result->static_graphs = result->ctx_compute;
 
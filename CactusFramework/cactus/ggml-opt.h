@@ -97,6 +97,9 @@ extern "C" {
     // casts userdata to lm_ggml_opt_optimizer_params and returns it
     LM_GGML_API struct lm_ggml_opt_optimizer_params lm_ggml_opt_get_constant_optimizer_params(void * userdata);
 
+    // returns whether the forward result of a tensor is kept for the backward pass (gradient checkpointing)
+    typedef bool (*lm_ggml_opt_checkpoint_filter)(const struct lm_ggml_tensor * tensor, void * userdata);
+
     // parameters for initializing a new optimization context
     struct lm_ggml_opt_params {
         lm_ggml_backend_sched_t backend_sched; // defines which backends are used to construct the compute graphs
@@ -114,6 +117,13 @@ extern "C" {
 
         lm_ggml_opt_get_optimizer_params get_opt_pars; // callback for calculating optimizer parameters
         void * get_opt_pars_ud;                     // userdata for calculating optimizer parameters
+
+        // if set, the backward pass keeps only the forward results the filter accepts (plus inputs,
+        // outputs and parameters) and recomputes the others from them when it needs them
+        lm_ggml_opt_checkpoint_filter checkpoint_filter;
+        void * checkpoint_filter_ud;
+
+        enum lm_ggml_type opt_state_type; // type of the AdamW momenta: F32, F16 or BF16
     };
 
     // get parameters for an optimization context with defaults set where possible
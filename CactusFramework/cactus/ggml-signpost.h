@@ -0,0 +1,41 @@
+#pragma once
+
+// os_signpost intervals for Instruments (Points of Interest / os_signpost instrument,
+// subsystem "com.cactus.ggml"). Compiled in only with -DLM_GGML_USE_SIGNPOST on Apple
+// platforms; otherwise every macro expands to nothing.
+//
+//   LM_GGML_SIGNPOST_BEGIN(sp, "graph_compute", "nodes=%d", n_nodes);
+//   ...
+//   LM_GGML_SIGNPOST_END(sp, "graph_compute");
+//
+// Interval names must be string literals and match between BEGIN and END.
+
+#if defined(LM_GGML_USE_SIGNPOST) && defined(__APPLE__)
+
+#include <os/signpost.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+os_log_t lm_ggml_signpost_log(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define LM_GGML_SIGNPOST_BEGIN(sp, name, ...) \
+    const os_signpost_id_t sp = os_signpost_id_generate(lm_ggml_signpost_log()); \
+    os_signpost_interval_begin(lm_ggml_signpost_log(), sp, name, __VA_ARGS__)
+#define LM_GGML_SIGNPOST_END(sp, name) \
+    os_signpost_interval_end(lm_ggml_signpost_log(), sp, name)
+#define LM_GGML_SIGNPOST_EVENT(name, ...) \
+    os_signpost_event_emit(lm_ggml_signpost_log(), OS_SIGNPOST_ID_EXCLUSIVE, name, __VA_ARGS__)
+
+#else
+
+#define LM_GGML_SIGNPOST_BEGIN(sp, name, ...)
+#define LM_GGML_SIGNPOST_END(sp, name)
+#define LM_GGML_SIGNPOST_EVENT(name, ...)
+
+#endif
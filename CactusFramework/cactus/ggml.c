@@ -3,6 +3,7 @@
 
 #include "ggml-backend.h"
 #include "ggml-impl.h"
+#include "ggml-signpost.h"
 #include "ggml-threading.h"
 #include "ggml-cpu.h"
 #include "ggml.h"
@@ -260,6 +261,23 @@ void lm_ggml_log_callback_default(enum lm_ggml_log_level level, const char * tex
     fflush(stderr);
 }
 
+#if defined(LM_GGML_USE_SIGNPOST) && defined(__APPLE__)
+#include <dispatch/dispatch.h>
+
+static os_log_t g_signpost_log;
+
+static void lm_ggml_signpost_log_init(void * ctx) {
+    (void) ctx;
+    g_signpost_log = os_log_create("com.cactus.ggml", OS_LOG_CATEGORY_POINTS_OF_INTEREST);
+}
+
+os_log_t lm_ggml_signpost_log(void) {
+    static dispatch_once_t once;
+    dispatch_once_f(&once, NULL, lm_ggml_signpost_log_init);
+    return g_signpost_log;
+}
+#endif
+
 //
 // end of logging block
 //
@@ -6125,6 +6143,46 @@ void lm_ggml_graph_clear(struct lm_ggml_cgraph * cgraph) {
     lm_ggml_hash_set_reset(&cgraph->visited_hash_set);
 }
 
+void lm_ggml_graph_prune(struct lm_ggml_cgraph * cgraph, const struct lm_ggml_tensor * drop, const struct lm_ggml_tensor * keep) {
+    const size_t hash_size = cgraph->visited_hash_set.size;
+    int32_t * n_uses = (int32_t *) calloc(hash_size, sizeof(int32_t));
+    bool    * needed = (bool    *) calloc(hash_size, sizeof(bool));
+    LM_GGML_ASSERT(n_uses && needed);
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct lm_ggml_tensor * node = cgraph->nodes[i];
+        for (int j = 0; j < LM_GGML_MAX_SRC && node->src[j]; j++) {
+            n_uses[lm_ggml_hash_find(&cgraph->visited_hash_set, node->src[j])]++;
+        }
+    }
+
+    // nodes are in topological order, so walking backwards sees every consumer before its sources
+    for (int i = cgraph->n_nodes - 1; i >= 0; i--) {
+        struct lm_ggml_tensor * node = cgraph->nodes[i];
+        const size_t h = lm_ggml_hash_find(&cgraph->visited_hash_set, node);
+        if (node == keep || (n_uses[h] == 0 && node != drop)) {
+            needed[h] = true;
+        }
+        if (!needed[h]) {
+            continue;
+        }
+        for (int j = 0; j < LM_GGML_MAX_SRC && node->src[j]; j++) {
+            needed[lm_ggml_hash_find(&cgraph->visited_hash_set, node->src[j])] = true;
+        }
+    }
+
+    int n_nodes = 0;
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        if (needed[lm_ggml_hash_find(&cgraph->visited_hash_set, cgraph->nodes[i])]) {
+            cgraph->nodes[n_nodes++] = cgraph->nodes[i];
+        }
+    }
+    cgraph->n_nodes = n_nodes;
+
+    free(n_uses);
+    free(needed);
+}
+
 int lm_ggml_graph_size(struct lm_ggml_cgraph * cgraph) {
     return cgraph->size;
 }
@@ -6532,6 +6590,7 @@ void lm_ggml_threadpool_params_init(struct lm_ggml_threadpool_params * p, int n_
     p->poll       = 50;    // hybrid-polling enabled
     p->strict_cpu = false; // no strict placement (all threads share same cpumask)
     p->paused     = false; // threads are ready to go
+    p->hybrid     = true;  // no-op unless the CPU reports more than one core type
     memset(p->cpumask, 0, LM_GGML_MAX_N_THREADS); // all-zero means use the default affinity (usually inherited)
 }
 
@@ -6546,5 +6605,6 @@ bool lm_ggml_threadpool_params_match(const struct lm_ggml_threadpool_params * p0
     if (p0->prio           != p1->prio       )    return false;
     if (p0->poll           != p1->poll       )    return false;
     if (p0->strict_cpu     != p1->strict_cpu )    return false;
+    if (p0->hybrid         != p1->hybrid     )    return false;
     return memcmp(p0->cpumask, p1->cpumask, LM_GGML_MAX_N_THREADS) == 0;
 }
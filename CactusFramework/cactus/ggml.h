@@ -2071,6 +2071,8 @@ extern "C" {
     LM_GGML_API void                 lm_ggml_graph_cpy       (struct lm_ggml_cgraph * src, struct lm_ggml_cgraph * dst);
     LM_GGML_API void                 lm_ggml_graph_reset     (struct lm_ggml_cgraph * cgraph); // set regular grads + optimizer momenta to 0, set loss grad to 1
     LM_GGML_API void                 lm_ggml_graph_clear     (struct lm_ggml_cgraph * cgraph);
+    // removes drop and every node that only drop depends on; nodes keep or any other output needs stay
+    LM_GGML_API void                 lm_ggml_graph_prune     (struct lm_ggml_cgraph * cgraph, const struct lm_ggml_tensor * drop, const struct lm_ggml_tensor * keep);
 
     LM_GGML_API int                   lm_ggml_graph_size   (struct lm_ggml_cgraph * cgraph);
     LM_GGML_API struct lm_ggml_tensor *  lm_ggml_graph_node   (struct lm_ggml_cgraph * cgraph, int i); // if i < 0, returns nodes[n_nodes + i]
@@ -2187,6 +2189,7 @@ extern "C" {
         uint32_t            poll;                        // polling level (0 - no polling, 100 - aggressive polling)
         bool                strict_cpu;                  // strict cpu placement
         bool                paused;                      // start in paused state
+        bool                hybrid;                      // weight work and QoS by core type on heterogeneous (P/E core) CPUs
     };
 
     struct lm_ggml_threadpool;     // forward declaration, see ggml.c
@@ -4,14 +4,19 @@
 #include "llama-mmap.h"
 #include "llama-model.h"
 
+#include <algorithm>
 #include <map>
 #include <cassert>
+#include <cmath>
+#include <random>
+#include <cstring>
 #include <stdexcept>
+#include <thread>
 
 // vec
 
 lm_ggml_tensor * llama_adapter_cvec::tensor_for(int il) const {
-    if (il < 0 || il < layer_start || il > layer_end || (size_t) il >= tensors.size()) {
+    if (il < 0 || il < layer_start || il > layer_end || (size_t) il >= tensors.size() || !nonzero[il]) {
         return nullptr;
     }
 
@@ -27,6 +32,15 @@ lm_ggml_tensor * llama_adapter_cvec::apply_to(lm_ggml_context * ctx, lm_ggml_ten
     return cur;
 }
 
+std::vector<bool> llama_adapter_cvec::layers() const {
+    std::vector<bool> res(tensors.size(), false);
+    for (size_t il = 0; il < tensors.size(); il++) {
+        res[il] = tensor_for((int) il) != nullptr;
+    }
+
+    return res;
+}
+
 bool llama_adapter_cvec::init(const llama_model & model) {
     const auto & hparams = model.hparams;
 
@@ -120,12 +134,17 @@ bool llama_adapter_cvec::apply(
     layer_start = il_start;
     layer_end   = il_end;
 
+    nonzero.assign(hparams.n_layer, false);
     for (size_t il = 1; il < hparams.n_layer; il++) {
         assert(tensors[il] != nullptr);
 
+        // layers past the data keep stale directions from an earlier vector, they are skipped instead
         const size_t off = n_embd * (il - 1); // buffer doesn't have data for layer 0, since it's never present
         if (off + n_embd <= len) {
-            lm_ggml_backend_tensor_set(tensors[il], data + off, 0, n_embd * lm_ggml_element_size(tensors[il]));
+            nonzero[il] = std::any_of(data + off, data + off + n_embd, [](float v) { return v != 0.0f; });
+            if (nonzero[il]) {
+                lm_ggml_backend_tensor_set(tensors[il], data + off, 0, n_embd * lm_ggml_element_size(tensors[il]));
+            }
         }
     }
 
@@ -386,3 +405,396 @@ llama_adapter_lora * llama_adapter_lora_init(llama_model * model, const char * p
 void llama_adapter_lora_free(llama_adapter_lora * adapter) {
     delete adapter;
 }
+
+size_t llama_adapter_lora_n_bytes(const llama_adapter_lora * adapter) {
+    size_t size = 0;
+    for (const auto & buf : adapter->bufs) {
+        size += lm_ggml_backend_buffer_get_size(buf.get());
+    }
+    return size;
+}
+
+static void llama_adapter_lora_init_trainable_impl(
+        llama_model & model, int32_t rank, float alpha,
+        bool (*filter)(const lm_ggml_tensor *, void *), void * userdata,
+        uint32_t seed, llama_adapter_lora & adapter) {
+    if (rank <= 0) {
+        throw std::runtime_error(format("invalid LoRA rank %d", rank));
+    }
+
+    // 2D layer weights only: norms and biases are vectors, token_embd would take the flipped layout
+    std::vector<lm_ggml_tensor *> targets;
+    for (const auto & it : model.tensors_by_name) {
+        lm_ggml_tensor * w = it.second;
+        if (it.first.rfind("blk.", 0) != 0 || lm_ggml_n_dims(w) != 2) {
+            continue;
+        }
+        if (filter && !filter(w, userdata)) {
+            continue;
+        }
+        targets.push_back(w);
+    }
+    if (targets.empty()) {
+        throw std::runtime_error("no model weight matches the LoRA target filter");
+    }
+
+    // the optimizer steps run on the CPU, keep the tensors there and in F32
+    auto * cpu_dev = lm_ggml_backend_dev_by_type(LM_GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (!cpu_dev) {
+        throw std::runtime_error(format("%s: no CPU backend found", __func__));
+    }
+    lm_ggml_backend_buffer_type_t buft = lm_ggml_backend_dev_buffer_type(cpu_dev);
+
+    lm_ggml_init_params params = {
+        /*.mem_size   =*/ 2*targets.size()*lm_ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    lm_ggml_context * ctx = lm_ggml_init(params);
+    if (!ctx) {
+        throw std::runtime_error("failed to create a context for the lora adapter");
+    }
+    adapter.ctxs.emplace_back(ctx);
+
+    for (lm_ggml_tensor * w : targets) {
+        lm_ggml_tensor * a = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F32, w->ne[0], rank);
+        lm_ggml_tensor * b = lm_ggml_new_tensor_2d(ctx, LM_GGML_TYPE_F32, rank, w->ne[1]);
+        lm_ggml_format_name(a, "%s.lora_a", w->name);
+        lm_ggml_format_name(b, "%s.lora_b", w->name);
+        adapter.ab_map[w->name] = llama_adapter_lora_weight(a, b);
+    }
+
+    lm_ggml_backend_buffer_ptr buf { lm_ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft) };
+    if (!buf) {
+        throw std::runtime_error("failed to allocate buffer for lora adapter\n");
+    }
+    lm_ggml_backend_buffer_clear(buf.get(), 0);
+
+    // Kaiming uniform A and zero B as in the LoRA paper: the adapter starts as a no-op and
+    // the gradient of B is not zero, so training moves away from the base model right away
+    std::mt19937 rng(seed);
+    std::vector<float> data;
+    for (auto & it : adapter.ab_map) {
+        lm_ggml_tensor * a = it.second.a;
+        const float bound = 1.0f / sqrtf((float) a->ne[0]);
+        std::uniform_real_distribution<float> dist(-bound, bound);
+        data.resize(lm_ggml_nelements(a));
+        for (float & v : data) {
+            v = dist(rng);
+        }
+        lm_ggml_backend_tensor_set(a, data.data(), 0, lm_ggml_nbytes(a));
+    }
+
+    LLAMA_LOG_INFO("%s: %10s LoRA buffer size = %8.2f MiB, %zu weights at rank %d\n", __func__,
+            lm_ggml_backend_buffer_name(buf.get()), lm_ggml_backend_buffer_get_size(buf.get())/1024.0/1024.0, targets.size(), rank);
+    adapter.bufs.emplace_back(std::move(buf));
+    adapter.alpha = alpha;
+}
+
+llama_adapter_lora * llama_adapter_lora_init_trainable(
+        llama_model * model, int32_t rank, float alpha,
+        bool (*filter)(const lm_ggml_tensor *, void *), void * userdata, uint32_t seed) {
+    llama_adapter_lora * adapter = new llama_adapter_lora();
+
+    try {
+        llama_adapter_lora_init_trainable_impl(*model, rank, alpha, filter, userdata, seed, *adapter);
+        return adapter;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to create lora adapter: %s\n", __func__, err.what());
+
+        delete adapter;
+    }
+
+    return nullptr;
+}
+
+bool llama_adapter_lora_copy(llama_adapter_lora * dst, const llama_adapter_lora * src) {
+    if (dst->ab_map.size() != src->ab_map.size()) {
+        return false;
+    }
+    for (const auto & it : dst->ab_map) {
+        const auto pos = src->ab_map.find(it.first);
+        if (pos == src->ab_map.end()) {
+            return false;
+        }
+        const llama_adapter_lora_weight & s = pos->second;
+        const llama_adapter_lora_weight & d = it.second;
+        if (s.a->type != d.a->type || s.b->type != d.b->type ||
+            !lm_ggml_are_same_shape(s.a, d.a) || !lm_ggml_are_same_shape(s.b, d.b)) {
+            return false;
+        }
+    }
+
+    std::vector<uint8_t> buf;
+    for (auto & it : dst->ab_map) {
+        const llama_adapter_lora_weight & s = src->ab_map.at(it.first);
+        for (auto pair : { std::make_pair(s.a, it.second.a), std::make_pair(s.b, it.second.b) }) {
+            buf.resize(lm_ggml_nbytes(pair.first));
+            lm_ggml_backend_tensor_get(pair.first, buf.data(), 0, buf.size());
+            lm_ggml_backend_tensor_set(pair.second, buf.data(), 0, buf.size());
+        }
+    }
+    dst->alpha = src->alpha;
+    return true;
+}
+
+bool llama_adapter_lora_save(const llama_adapter_lora * adapter, const llama_model * model, const char * path) {
+    // the adapter may live in device memory, gguf writes from host copies
+    lm_ggml_init_params params = {
+        /*.mem_size   =*/ 2*adapter->ab_map.size()*lm_ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    lm_ggml_context_ptr ctx { lm_ggml_init(params) };
+    if (!ctx) {
+        return false;
+    }
+
+    // sorted, so saving the same adapter twice gives the same file
+    std::map<std::string, llama_adapter_lora_weight> sorted(adapter->ab_map.begin(), adapter->ab_map.end());
+    std::vector<std::vector<uint8_t>> data;
+    data.reserve(2*sorted.size());
+
+    lm_gguf_context_ptr ctx_gguf { lm_gguf_init_empty() };
+    LLM_KV llm_kv = LLM_KV(LLM_ARCH_UNKNOWN);
+    lm_gguf_set_val_str(ctx_gguf.get(), llm_kv(LLM_KV_GENERAL_TYPE).c_str(), "adapter");
+    lm_gguf_set_val_str(ctx_gguf.get(), llm_kv(LLM_KV_GENERAL_ARCHITECTURE).c_str(), llm_arch_name(model->arch));
+    lm_gguf_set_val_str(ctx_gguf.get(), llm_kv(LLM_KV_ADAPTER_TYPE).c_str(), "lora");
+    lm_gguf_set_val_f32(ctx_gguf.get(), llm_kv(LLM_KV_ADAPTER_LORA_ALPHA).c_str(), adapter->alpha);
+
+    for (const auto & it : sorted) {
+        for (lm_ggml_tensor * src : { it.second.a, it.second.b }) {
+            lm_ggml_tensor * dst = lm_ggml_dup_tensor(ctx.get(), src);
+            lm_ggml_set_name(dst, src->name);
+            data.emplace_back(lm_ggml_nbytes(src));
+            lm_ggml_backend_tensor_get(src, data.back().data(), 0, data.back().size());
+            dst->data = data.back().data();
+            lm_gguf_add_tensor(ctx_gguf.get(), dst);
+        }
+    }
+
+    if (!lm_gguf_write_to_file(ctx_gguf.get(), path, false)) {
+        LLAMA_LOG_ERROR("%s: failed to write lora adapter to '%s'\n", __func__, path);
+        return false;
+    }
+    LLAMA_LOG_INFO("%s: saved %zu tensors to '%s'\n", __func__, data.size(), path);
+    return true;
+}
+
+// lora merge
+
+void llama_adapter_lora_merge::swap() {
+    for (auto & e : entries) {
+        std::swap(e.tensor->data,   e.merged->data);
+        std::swap(e.tensor->buffer, e.merged->buffer);
+        std::swap(e.tensor->extra,  e.merged->extra);
+    }
+    applied = !applied;
+}
+
+static bool llama_lora_can_dequantize(lm_ggml_type type) {
+    return type == LM_GGML_TYPE_F32 || lm_ggml_get_type_traits(type)->to_float != nullptr;
+}
+
+static void llama_lora_row_to_float(lm_ggml_type type, const void * src, float * dst, int64_t n) {
+    if (type == LM_GGML_TYPE_F32) {
+        memcpy(dst, src, n*sizeof(float));
+    } else {
+        lm_ggml_get_type_traits(type)->to_float(src, dst, n);
+    }
+}
+
+static std::vector<float> llama_lora_tensor_to_float(const lm_ggml_tensor * t) {
+    std::vector<uint8_t> raw(lm_ggml_nbytes(t));
+    lm_ggml_backend_tensor_get(t, raw.data(), 0, raw.size());
+
+    const size_t row_size = lm_ggml_row_size(t->type, t->ne[0]);
+    std::vector<float> out(lm_ggml_nelements(t));
+    for (int64_t r = 0; r < lm_ggml_nrows(t); ++r) {
+        llama_lora_row_to_float(t->type, raw.data() + r*row_size, out.data() + r*t->ne[0], t->ne[0]);
+    }
+    return out;
+}
+
+static void llama_adapter_lora_merge_impl(llama_model & model, llama_adapter_lora & adapter, float scale, int n_threads,
+                                          lm_ggml_abort_callback abort_callback, void * abort_callback_data, llama_adapter_lora_merge & merge) {
+    auto str_endswith = [](const std::string & str, const std::string & suffix) {
+        return str.size() >= suffix.size() && str.compare(str.size()-suffix.size(), suffix.size(), suffix) == 0;
+    };
+
+    // every model tensor carrying an adapted name, so a duplicated weight is merged as well
+    struct merge_job {
+        lm_ggml_tensor * tensor;
+        const llama_adapter_lora_weight * lw;
+        const llama_model::tensor_source * src;
+    };
+    std::vector<merge_job> jobs;
+    for (const auto & it : model.tensors_by_name) {
+        const auto ab = adapter.ab_map.find(it.first);
+        if (ab == adapter.ab_map.end()) {
+            continue;
+        }
+        lm_ggml_tensor * w = it.second;
+        const auto src = model.tensor_sources.find(it.first);
+        if (src == model.tensor_sources.end() || w->buffer == nullptr) {
+            throw std::runtime_error(format("weight '%s' has no data to merge into", w->name));
+        }
+        if (w->ne[3] != 1 || lm_ggml_quantize_requires_imatrix(w->type) || !llama_lora_can_dequantize(w->type) ||
+            !llama_lora_can_dequantize(ab->second.a->type) || !llama_lora_can_dequantize(ab->second.b->type)) {
+            throw std::runtime_error(format("weight '%s' (%s) cannot be requantized", w->name, lm_ggml_type_name(w->type)));
+        }
+        jobs.push_back({ w, &ab->second, &src->second });
+    }
+    if (jobs.empty()) {
+        throw std::runtime_error("the adapter applies to no weight of the model");
+    }
+
+    // the copies live in the buffer types of the weights they replace
+    std::map<lm_ggml_backend_buffer_type_t, lm_ggml_context *> ctx_map;
+    for (const auto & job : jobs) {
+        lm_ggml_backend_buffer_type_t buft = lm_ggml_backend_buffer_get_type(job.tensor->buffer);
+        auto it = ctx_map.find(buft);
+        if (it == ctx_map.end()) {
+            lm_ggml_init_params params = {
+                /*.mem_size   =*/ jobs.size()*lm_ggml_tensor_overhead(),
+                /*.mem_buffer =*/ NULL,
+                /*.no_alloc   =*/ true,
+            };
+            lm_ggml_context * buft_ctx = lm_ggml_init(params);
+            if (!buft_ctx) {
+                throw std::runtime_error("failed to create ggml context for merged weights");
+            }
+            merge.ctxs.emplace_back(buft_ctx);
+            it = ctx_map.emplace(buft, buft_ctx).first;
+        }
+        lm_ggml_tensor * merged = lm_ggml_dup_tensor(it->second, job.tensor);
+        lm_ggml_set_name(merged, job.tensor->name);
+        merge.entries.push_back({ job.tensor, merged });
+    }
+    for (auto & it : ctx_map) {
+        lm_ggml_backend_buffer_ptr buf { lm_ggml_backend_alloc_ctx_tensors_from_buft(it.second, it.first) };
+        if (!buf) {
+            throw std::runtime_error("failed to allocate buffer for merged weights");
+        }
+        lm_ggml_backend_buffer_set_usage(buf.get(), LM_GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+        merge.bufs.emplace_back(std::move(buf));
+    }
+
+    std::vector<std::unique_ptr<llama_file>> files(model.source_files.size());
+    std::vector<uint8_t> data;
+
+    for (size_t j = 0; j < jobs.size(); ++j) {
+        if (abort_callback && abort_callback(abort_callback_data)) {
+            throw std::runtime_error("merge aborted");
+        }
+        const merge_job & job = jobs[j];
+        lm_ggml_tensor * w = job.tensor;
+
+        // the tensor itself may be repacked or on a device, the file holds the plain rows
+        auto & file = files.at(job.src->idx);
+        if (!file) {
+            file.reset(new llama_file(model.source_files[job.src->idx].c_str(), "rb"));
+        }
+        data.resize(lm_ggml_nbytes(w));
+        file->seek(job.src->offs, SEEK_SET);
+        file->read_raw(data.data(), data.size());
+
+        const std::vector<float> a = llama_lora_tensor_to_float(job.lw->a);
+        const std::vector<float> b = llama_lora_tensor_to_float(job.lw->b);
+        const float s = job.lw->get_scale(adapter.alpha, scale);
+        const int64_t n_in   = w->ne[0];
+        const int64_t n_rows = w->ne[1];
+        const int64_t rank   = job.lw->b->ne[0];
+
+        // row o of the delta is sum_k U[o][k] * V[k]: U = B and V = A for a matmul weight; the token
+        // embeddings look A up by token and multiply with non-transposed B (see build_inp_embd)
+        std::vector<float> bt;
+        const bool is_token_embd = str_endswith(w->name, "token_embd.weight");
+        if (is_token_embd) {
+            bt.resize(rank*n_in);
+            for (int64_t e = 0; e < n_in; ++e) {
+                for (int64_t k = 0; k < rank; ++k) {
+                    bt[k*n_in + e] = b[e*rank + k];
+                }
+            }
+        }
+
+        const size_t row_size = lm_ggml_row_size(w->type, n_in);
+        const int64_t n_rows_all = n_rows*w->ne[2];
+
+        auto merge_rows = [&](int64_t r0, int64_t r1) {
+            std::vector<float> row(n_in);
+            for (int64_t r = r0; r < r1; ++r) {
+                const int64_t i2 = r / n_rows;
+                const int64_t o  = r % n_rows;
+                const float * u = is_token_embd ? a.data() + o*rank
+                                                : b.data() + ((job.lw->b->ne[2] > 1 ? i2 : 0)*n_rows + o)*rank;
+                const float * v = is_token_embd ? bt.data()
+                                                : a.data() + (job.lw->a->ne[2] > 1 ? i2 : 0)*rank*n_in;
+
+                uint8_t * dst = data.data() + r*row_size;
+                llama_lora_row_to_float(w->type, dst, row.data(), n_in);
+                for (int64_t k = 0; k < rank; ++k) {
+                    const float c = s*u[k];
+                    const float * vk = v + k*n_in;
+                    for (int64_t i = 0; i < n_in; ++i) {
+                        row[i] += c*vk[i];
+                    }
+                }
+                lm_ggml_quantize_chunk(w->type, row.data(), dst, 0, 1, n_in, nullptr);
+            }
+        };
+
+        const int64_t n_workers = std::max<int64_t>(1, std::min<int64_t>(n_threads, n_rows_all));
+        const int64_t per_worker = (n_rows_all + n_workers - 1)/n_workers;
+        std::vector<std::thread> workers;
+        for (int64_t t = 1; t < n_workers; ++t) {
+            workers.emplace_back(merge_rows, t*per_worker, std::min(n_rows_all, (t + 1)*per_worker));
+        }
+        merge_rows(0, std::min(n_rows_all, per_worker));
+        for (auto & worker : workers) {
+            worker.join();
+        }
+
+        lm_ggml_backend_tensor_set(merge.entries[j].merged, data.data(), 0, data.size());
+    }
+
+    LLAMA_LOG_INFO("%s: merged lora into %zu weights\n", __func__, jobs.size());
+}
+
+llama_adapter_lora_merge * llama_adapter_lora_merge_init(llama_model * model, llama_adapter_lora * adapter, float scale, int32_t n_threads,
+                                                         lm_ggml_abort_callback abort_callback, void * abort_callback_data) {
+    llama_adapter_lora_merge * merge = new llama_adapter_lora_merge();
+
+    try {
+        llama_adapter_lora_merge_impl(*model, *adapter, scale, n_threads, abort_callback, abort_callback_data, *merge);
+        return merge;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to merge lora adapter: %s\n", __func__, err.what());
+
+        delete merge;
+    }
+
+    return nullptr;
+}
+
+void llama_adapter_lora_merge_apply(llama_adapter_lora_merge * merge, bool merged) {
+    if (merge->applied != merged) {
+        merge->swap();
+    }
+}
+
+size_t llama_adapter_lora_merge_n_bytes(const llama_adapter_lora_merge * merge) {
+    size_t size = 0;
+    for (const auto & buf : merge->bufs) {
+        size += lm_ggml_backend_buffer_get_size(buf.get());
+    }
+    return size;
+}
+
+void llama_adapter_lora_merge_free(llama_adapter_lora_merge * merge) {
+    if (merge->applied) {
+        merge->swap();
+    }
+    delete merge;
+}
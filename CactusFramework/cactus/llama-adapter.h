@@ -4,6 +4,7 @@
 
 #include "ggml-cpp.h"
 
+#include <map>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -27,6 +28,9 @@ struct llama_adapter_cvec {
             int32_t il_start,
             int32_t il_end);
 
+    // layers that get an add, a change here changes the graph
+    std::vector<bool> layers() const;
+
 private:
     bool init(const llama_model & model);
 
@@ -37,6 +41,7 @@ private:
     std::vector<lm_ggml_backend_buffer_ptr> bufs;
 
     std::vector<lm_ggml_tensor *> tensors; // per layer
+    std::vector<bool> nonzero;             // per layer, all-zero directions are skipped
 };
 
 //
@@ -74,3 +79,27 @@ struct llama_adapter_lora {
 };
 
 using llama_adapter_loras = std::unordered_map<llama_adapter_lora *, float>;
+
+//
+// llama_adapter_lora_merge
+//
+
+// base weights with an adapter folded in, swapped with the model's tensors when applied
+struct llama_adapter_lora_merge {
+    struct entry {
+        lm_ggml_tensor * tensor; // the model's weight
+        lm_ggml_tensor * merged; // holds the other half of the swap: merged data, or the original once applied
+    };
+
+    std::vector<entry> entries;
+
+    std::vector<lm_ggml_context_ptr> ctxs;
+    std::vector<lm_ggml_backend_buffer_ptr> bufs;
+
+    bool applied = false;
+
+    void swap();
+};
+
+// adapters applied to the tokens of one sequence only, on top of the context-wide ones
+using llama_adapter_loras_seq = std::map<llama_seq_id, llama_adapter_loras>;
@@ -191,6 +191,10 @@ llama_ubatch llama_sbatch::split_seq(size_t n_ubatch) {
 }
 
 llama_sbatch::llama_sbatch(const llama_batch & batch, size_t n_embd, bool simple_split, bool logits_all) {
+    init(batch, n_embd, simple_split, logits_all);
+}
+
+void llama_sbatch::init(const llama_batch & batch, size_t n_embd, bool simple_split, bool logits_all) {
     LM_GGML_ASSERT(batch.n_tokens >= 0);
     this->batch = &batch;
     this->n_embd = n_embd;
@@ -199,12 +203,19 @@ llama_sbatch::llama_sbatch(const llama_batch & batch, size_t n_embd, bool simple
     n_tokens = batch.n_tokens;
     ids.resize(n_tokens);
     out_ids.clear();
+    seq.clear();
     // TODO: reserve out_ids and seq
 
     for (size_t i = 0; i < n_tokens; ++i) {
         ids[i] = i;
     }
 
+    // a single token is its own sequence, there is nothing to sort or group
+    if (n_tokens == 1 && !simple_split) {
+        seq.push_back({batch.n_seq_id[0], batch.seq_id[0], 0, 1});
+        return;
+    }
+
     if (simple_split) {
         seq.resize(1);
         llama_sbatch_seq & s = seq[0];
@@ -279,6 +290,10 @@ llama_sbatch::llama_sbatch(const llama_batch & batch, size_t n_embd, bool simple
 }
 
 llama_batch_allocr::llama_batch_allocr(struct llama_batch in_batch, llama_pos p0) {
+    init(in_batch, p0);
+}
+
+void llama_batch_allocr::init(struct llama_batch in_batch, llama_pos p0) {
     batch = in_batch;
     LM_GGML_ASSERT(batch.n_tokens > 0);
     if (!batch.pos) {
@@ -305,7 +320,7 @@ llama_batch_allocr::llama_batch_allocr(struct llama_batch in_batch, llama_pos p0
         batch.seq_id = seq_id.data();
     }
     if (!batch.logits) {
-        logits.resize(batch.n_tokens);
+        logits.assign(batch.n_tokens, 0);
         logits[logits.size() - 1] = true;
         batch.logits = logits.data();
     }
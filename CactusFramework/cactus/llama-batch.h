@@ -72,6 +72,9 @@ struct llama_sbatch {
 
     llama_sbatch() = default;
     llama_sbatch(const llama_batch & batch, size_t n_embd, bool simple_split = false, bool logits_all = false);
+
+    // starts splitting batch; the buffers keep their capacity, so an sbatch reused across decodes does not allocate
+    void init(const llama_batch & batch, size_t n_embd, bool simple_split = false, bool logits_all = false);
 };
 
 // temporary allocate memory for the input batch if needed
@@ -85,5 +88,9 @@ struct llama_batch_allocr {
     std::vector<int8_t>         logits;
 
     // optionally fulfill the batch returned by llama_batch_get_one
+    llama_batch_allocr() = default;
     llama_batch_allocr(struct llama_batch in_batch, llama_pos p0);
+
+    // same, reusing the buffers of the previous batch
+    void init(struct llama_batch in_batch, llama_pos p0);
 };
@@ -6,10 +6,73 @@
 #include "llama-model.h"
 #include "llama-kv-cache.h"
 
+#include "ggml-signpost.h"
+
+#include <algorithm>
+#include <bitset>
+#include <cstdlib>
 #include <cstring>
 #include <stdexcept>
 #include <cinttypes>
 
+// layers paged in ahead of the one being computed when the model streams its weights
+static constexpr int LLAMA_STREAM_LOOKAHEAD = 2;
+
+// argsort runs one threadgroup per row on Metal, so rows longer than this are reduced in chunks
+static constexpr int64_t LLAMA_TOP_K_CHUNK = 1024;
+
+// k largest values of every row of val [n, n_rows] with their ids (as f32), in descending order
+static void llama_build_top_k(
+        lm_ggml_context * ctx,
+         lm_ggml_tensor * val,
+         lm_ggml_tensor * ids,
+                int64_t   k,
+         lm_ggml_tensor ** top_val,
+         lm_ggml_tensor ** top_ids) {
+    const int64_t n      = val->ne[0];
+    const int64_t n_rows = val->ne[1];
+
+    if (n <= LLAMA_TOP_K_CHUNK) {
+        const int64_t n_top = std::min(k, n);
+
+        lm_ggml_tensor * order = lm_ggml_argsort(ctx, val, LM_GGML_SORT_ORDER_DESC);
+        order = lm_ggml_view_2d(ctx, order, n_top, n_rows, order->nb[1], 0);
+
+        *top_val = lm_ggml_reshape_2d(ctx, lm_ggml_get_rows(ctx, lm_ggml_reshape_3d(ctx, val, 1, n, n_rows), order), n_top, n_rows);
+        *top_ids = lm_ggml_reshape_2d(ctx, lm_ggml_get_rows(ctx, lm_ggml_reshape_3d(ctx, ids, 1, n, n_rows), order), n_top, n_rows);
+        return;
+    }
+
+    // reduce every full chunk to its k best, then the tail, then the candidates
+    const int64_t n_chunks = n / LLAMA_TOP_K_CHUNK;
+    const int64_t n_main   = n_chunks*LLAMA_TOP_K_CHUNK;
+
+    auto chunked = [&](lm_ggml_tensor * x) {
+        x = lm_ggml_cont(ctx, lm_ggml_view_3d(ctx, x, LLAMA_TOP_K_CHUNK, n_chunks, n_rows, LLAMA_TOP_K_CHUNK*x->nb[0], x->nb[1], 0));
+        return lm_ggml_reshape_2d(ctx, x, LLAMA_TOP_K_CHUNK, n_chunks*n_rows);
+    };
+
+    lm_ggml_tensor * cand_val;
+    lm_ggml_tensor * cand_ids;
+    llama_build_top_k(ctx, chunked(val), chunked(ids), k, &cand_val, &cand_ids);
+    cand_val = lm_ggml_reshape_2d(ctx, cand_val, cand_val->ne[0]*n_chunks, n_rows);
+    cand_ids = lm_ggml_reshape_2d(ctx, cand_ids, cand_ids->ne[0]*n_chunks, n_rows);
+
+    if (n > n_main) {
+        auto tail = [&](lm_ggml_tensor * x) {
+            return lm_ggml_cont(ctx, lm_ggml_view_2d(ctx, x, n - n_main, n_rows, x->nb[1], n_main*x->nb[0]));
+        };
+
+        lm_ggml_tensor * tail_val;
+        lm_ggml_tensor * tail_ids;
+        llama_build_top_k(ctx, tail(val), tail(ids), k, &tail_val, &tail_ids);
+        cand_val = lm_ggml_concat(ctx, cand_val, tail_val, 0);
+        cand_ids = lm_ggml_concat(ctx, cand_ids, tail_ids, 0);
+    }
+
+    llama_build_top_k(ctx, cand_val, cand_ids, k, top_val, top_ids);
+}
+
 //
 // llama_context
 //
@@ -20,6 +83,10 @@ llama_context::llama_context(
     model(model) {
     LLAMA_LOG_INFO("%s: constructing llama_context\n", __func__);
 
+    if (params.n_seq_max > LLAMA_MAX_PARALLEL_SEQUENCES) {
+        throw std::runtime_error("n_seq_max must be <= " + std::to_string(LLAMA_MAX_PARALLEL_SEQUENCES));
+    }
+
     t_start_us = model.t_start_us;
     t_load_us  = model.t_load_us;
 
@@ -33,12 +100,17 @@ llama_context::llama_context(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.defrag_max_cells = params.defrag_max_cells;
+    cparams.compute_shrink_ms = params.compute_shrink_ms;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
     cparams.no_perf          = params.no_perf;
+    cparams.swa_full         = params.swa_full;
     cparams.pooling_type     = params.pooling_type;
     cparams.warmup           = false;
+    cparams.embd_normalize   = false;
+    cparams.vocoder_istft    = true;
 
     cparams.n_ctx            = params.n_ctx           == 0    ? hparams.n_ctx_train           : params.n_ctx;
     cparams.rope_freq_base   = params.rope_freq_base  == 0.0f ? hparams.rope_freq_base_train  : params.rope_freq_base;
@@ -177,9 +249,12 @@ llama_context::llama_context(
     // init the memory module
     if (!hparams.vocab_only) {
         llama_memory_params params_mem = {
-            /*.type_k   =*/ params.type_k,
-            /*.type_v   =*/ params.type_v,
-            /*.swa_full =*/ params.swa_full,
+            /*.type_k          =*/ params.type_k,
+            /*.type_v          =*/ params.type_v,
+            /*.n_kv_recent     =*/ params.n_kv_recent,
+            /*.swa_full        =*/ params.swa_full,
+            /*.n_ckpt          =*/ params.n_state_ckpt,
+            /*.n_ckpt_interval =*/ params.n_state_ckpt_interval,
         };
 
         memory.reset(model.create_memory(params_mem, cparams));
@@ -251,6 +326,9 @@ llama_context::llama_context(
         if (pipeline_parallel) {
             LLAMA_LOG_INFO("%s: pipeline parallelism enabled (n_copies=%d)\n", __func__, lm_ggml_backend_sched_get_n_copies(sched.get()));
         }
+
+        // with several input copies every compute advances to the next one, which a reused graph would not
+        graph_reuse = lm_ggml_backend_sched_get_n_copies(sched.get()) == 1 && getenv("LLAMA_GRAPH_REUSE_DISABLE") == nullptr;
     }
 
     // reserve worst-case graph
@@ -318,8 +396,18 @@ llama_context::llama_context(
             n_nodes_tg  = lm_ggml_graph_n_nodes(gf);
         }
 
-        // reserve again with pp graph to avoid ggml-alloc reallocations during inference
-        {
+        // with compute_shrink_ms the pp graph above only checked that it fits, the buffers are
+        // grown to it on demand; otherwise reserve again with pp graph to avoid ggml-alloc
+        // reallocations during inference
+        const size_t size_pp = compute_buffer_size();
+        if (cparams.compute_shrink_ms > 0) {
+            lm_ggml_backend_sched_release_buffers(sched.get());
+            if (!graph_reserve(n_tokens_decode())) {
+                throw std::runtime_error("failed to allocate compute decode buffers");
+            }
+            LLAMA_LOG_INFO("%s: compute buffers sized for %u tokens, grown up to %.2f MiB for a full ubatch\n", __func__,
+                    n_tokens_decode(), size_pp / 1024.0 / 1024.0);
+        } else {
             llama_ubatch ubatch_pp = { true, n_tokens, n_tokens / n_seqs, n_seqs, &token, nullptr, nullptr, nullptr, nullptr, nullptr};
 
             n_outputs = ubatch_pp.n_tokens;
@@ -449,6 +537,65 @@ const llama_kv_cache * llama_context::get_kv_self() const {
     return kv_self;
 }
 
+uint32_t llama_context::n_tokens_decode() const {
+    return std::min(cparams.n_seq_max, std::min(cparams.n_ctx, cparams.n_ubatch));
+}
+
+bool llama_context::graph_reserve(uint32_t n_tokens) {
+    llama_kv_cache * kv_self = static_cast<llama_kv_cache *>(memory.get());
+
+    // simulate full KV cache
+    kv_self->set_full();
+
+    const auto n_outputs_save = n_outputs;
+
+    llama_token token = model.vocab.token_bos(); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
+    llama_ubatch ubatch = { true, n_tokens, n_tokens, 1, &token, nullptr, nullptr, nullptr, nullptr, nullptr};
+
+    n_outputs = ubatch.n_tokens;
+
+    auto * gf = graph_init();
+    graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_DEFAULT);
+
+    n_outputs = n_outputs_save;
+
+    lm_ggml_backend_sched_reset(sched.get());
+    return lm_ggml_backend_sched_reserve(sched.get(), gf);
+}
+
+size_t llama_context::compute_buffer_size() const {
+    size_t size = 0;
+    for (int i = 0; i < lm_ggml_backend_sched_get_n_backends(sched.get()); i++) {
+        size += lm_ggml_backend_sched_get_buffer_size(sched.get(), lm_ggml_backend_sched_get_backend(sched.get(), i));
+    }
+
+    return size;
+}
+
+size_t llama_context::shrink_compute_buffers() {
+    if (!memory || !sched) {
+        return 0;
+    }
+
+    const size_t size_prev = compute_buffer_size();
+    const int64_t t_start_us = lm_ggml_time_us();
+
+    // lazy logits and the kept graph live in the buffers about to be freed
+    logits_fetch_all();
+    graph_reuse_reset();
+    lm_ggml_backend_sched_release_buffers(sched.get());
+    if (!graph_reserve(n_tokens_decode())) {
+        LLAMA_LOG_ERROR("%s: failed to allocate compute buffers\n", __func__);
+    }
+    compute_grown = false;
+
+    const size_t size = compute_buffer_size();
+    LLAMA_LOG_INFO("%s: compute buffers %.2f MiB -> %.2f MiB in %.2f ms\n", __func__,
+            size_prev / 1024.0 / 1024.0, size / 1024.0 / 1024.0, (lm_ggml_time_us() - t_start_us) / 1000.0);
+
+    return size_prev > size ? size_prev - size : 0;
+}
+
 void llama_context::kv_self_update() {
     bool need_reserve = false;
 
@@ -456,8 +603,13 @@ void llama_context::kv_self_update() {
 
     need_reserve = kv_self->update(*this);
 
-    // reserve a worst case graph if needed
-    if (need_reserve) {
+    // with compute_shrink_ms the buffers stay at their current size, the next graph grows them
+    if (need_reserve && cparams.compute_shrink_ms > 0) {
+        if (!graph_reserve(n_tokens_decode())) {
+            LLAMA_LOG_ERROR("%s: failed to allocate compute buffers\n", __func__);
+        }
+    } else if (need_reserve) {
+        // reserve a worst case graph if needed
         LLAMA_LOG_DEBUG("%s: reserving a worst case graph\n", __func__);
 
         // build worst-case graph
@@ -486,6 +638,8 @@ enum llama_pooling_type llama_context::pooling_type() const {
 }
 
 float * llama_context::get_logits() {
+    logits_fetch_all();
+
     return logits;
 }
 
@@ -516,6 +670,8 @@ float * llama_context::get_logits_ith(int32_t i) {
             throw std::runtime_error(format("corrupt output buffer (j=%d, n_outputs=%d)", j, n_outputs));
         }
 
+        logits_fetch(j);
+
         return logits + j*model.vocab.n_tokens();
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
@@ -527,6 +683,76 @@ float * llama_context::get_logits_ith(int32_t i) {
     }
 }
 
+void llama_context::set_logits_lazy(bool value) {
+    if (!value) {
+        logits_fetch_all();
+    }
+    logits_lazy = value;
+}
+
+void llama_context::set_logits_top_k(int32_t value) {
+    logits_top_k = std::max(0, std::min(value, 512));
+    logits_top_val.clear();
+    logits_top_id.clear();
+}
+
+int32_t llama_context::get_logits_top_k_ith(int32_t i, llama_token * ids, float * values) {
+    const int32_t k = std::min<int32_t>(logits_top_k, model.vocab.n_tokens());
+    if (k == 0 || logits_top_val.empty()) {
+        return 0;
+    }
+
+    int32_t j = -1;
+    if (i < 0) {
+        j = n_outputs + i;
+    } else if ((size_t) i < output_ids.size()) {
+        j = output_ids[i];
+    }
+    if (j < 0 || j >= n_outputs || (size_t) (j + 1)*k > logits_top_val.size()) {
+        LLAMA_LOG_ERROR("%s: invalid logits id %d\n", __func__, i);
+        return 0;
+    }
+
+    for (int32_t c = 0; c < k; ++c) {
+        ids[c]    = (llama_token) logits_top_id[j*k + c];
+        values[c] = logits_top_val[j*k + c];
+    }
+
+    return k;
+}
+
+void llama_context::logits_fetch(int32_t j) {
+    const int32_t r = j - logits_lazy_row0;
+    if (r < 0 || r >= (int32_t) logits_lazy_pending.size() || !logits_lazy_pending[r]) {
+        return;
+    }
+
+    const size_t row_size = model.vocab.n_tokens()*sizeof(float);
+    lm_ggml_backend_tensor_get(t_logits_lazy, logits + (size_t) j*model.vocab.n_tokens(), r*row_size, row_size);
+    logits_lazy_pending[r] = 0;
+}
+
+void llama_context::logits_fetch_all() {
+    if (logits_lazy_pending.empty()) {
+        return;
+    }
+
+    const int32_t n_rows = logits_lazy_pending.size();
+    const size_t row_size = model.vocab.n_tokens()*sizeof(float);
+
+    // one copy for the whole range when nothing has been fetched yet
+    if (std::all_of(logits_lazy_pending.begin(), logits_lazy_pending.end(), [](uint8_t p) { return p != 0; })) {
+        lm_ggml_backend_tensor_get(t_logits_lazy, logits + (size_t) logits_lazy_row0*model.vocab.n_tokens(), 0, n_rows*row_size);
+    } else {
+        for (int32_t r = 0; r < n_rows; ++r) {
+            logits_fetch(logits_lazy_row0 + r);
+        }
+    }
+
+    logits_lazy_pending.clear();
+    t_logits_lazy = nullptr;
+}
+
 float * llama_context::get_embeddings() {
     return embd;
 }
@@ -570,12 +796,76 @@ float * llama_context::get_embeddings_ith(int32_t i) {
 }
 
 float * llama_context::get_embeddings_seq(llama_seq_id seq_id) {
-    auto it = embd_seq.find(seq_id);
-    if (it == embd_seq.end()) {
+    if (seq_id < 0 || (size_t) seq_id >= embd_seq_set.size() || !embd_seq_set[seq_id]) {
         return nullptr;
     }
 
-    return it->second.data();
+    const int64_t n_row = cparams.pooling_type == LLAMA_POOLING_TYPE_RANK ? 1 : model.hparams.n_embd;
+
+    return (embd_seq_out ? embd_seq_out : embd_seq.data()) + seq_id*n_row;
+}
+
+void llama_context::set_embeddings_seq_out(float * out, int32_t n_seq) {
+    LLAMA_LOG_DEBUG("%s: out = %p, n_seq = %d\n", __func__, (void *) out, n_seq);
+
+    embd_seq_out   = out;
+    embd_seq_out_n = out ? std::min<int32_t>(std::max<int32_t>(n_seq, 0), LLAMA_MAX_PARALLEL_SEQUENCES) : 0;
+
+    // rows written to the previous output are no longer reachable
+    std::fill(embd_seq_set.begin(), embd_seq_set.end(), 0);
+}
+
+void llama_context::embd_seq_extract(const llama_ubatch & ubatch, lm_ggml_backend_t backend_embd, lm_ggml_tensor * t_embd) {
+    // the pooled tensor holds the row of sequence s at column s, rank pooling a single score
+    const int64_t n_row = cparams.pooling_type == LLAMA_POOLING_TYPE_RANK ? 1 : model.hparams.n_embd;
+
+    float * out   = embd_seq_out;
+    int32_t n_out = embd_seq_out_n;
+    if (out == nullptr) {
+        embd_seq.resize(LLAMA_MAX_PARALLEL_SEQUENCES*n_row);
+        out   = embd_seq.data();
+        n_out = LLAMA_MAX_PARALLEL_SEQUENCES;
+    }
+    embd_seq_set.resize(LLAMA_MAX_PARALLEL_SEQUENCES, 0);
+
+    std::bitset<LLAMA_MAX_PARALLEL_SEQUENCES> seen;
+    llama_seq_id s_min = LLAMA_MAX_PARALLEL_SEQUENCES;
+    llama_seq_id s_max = -1;
+
+    for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
+        const llama_seq_id seq_id = ubatch.seq_id[s][0];
+        if (seen[seq_id]) {
+            continue;
+        }
+        if (seq_id >= n_out) {
+            LLAMA_LOG_WARN("%s: no row for seq_id %d in the embeddings output of %d rows\n", __func__, seq_id, n_out);
+            continue;
+        }
+        seen.set(seq_id);
+        s_min = std::min(s_min, seq_id);
+        s_max = std::max(s_max, seq_id);
+    }
+
+    if (seen.none()) {
+        return;
+    }
+
+    if (seen.count() == (size_t) (s_max - s_min + 1)) {
+        // a run of sequence ids, the common case for batched embeddings, is a single copy
+        lm_ggml_backend_tensor_get_async(backend_embd, t_embd, out + s_min*n_row, (s_min*n_row)*sizeof(float), (s_max - s_min + 1)*n_row*sizeof(float));
+    } else {
+        for (llama_seq_id seq_id = s_min; seq_id <= s_max; ++seq_id) {
+            if (seen[seq_id]) {
+                lm_ggml_backend_tensor_get_async(backend_embd, t_embd, out + seq_id*n_row, (seq_id*n_row)*sizeof(float), n_row*sizeof(float));
+            }
+        }
+    }
+
+    for (llama_seq_id seq_id = s_min; seq_id <= s_max; ++seq_id) {
+        if (seen[seq_id]) {
+            embd_seq_set[seq_id] = 1;
+        }
+    }
 }
 
 void llama_context::attach_threadpool(
@@ -616,12 +906,54 @@ void llama_context::set_abort_callback(bool (*abort_callback)(void * data), void
     }
 }
 
+bool llama_context::layer_stream_eval_callback(lm_ggml_tensor * t, bool ask, void * user_data) {
+    llama_context * lctx = (llama_context *) user_data;
+    const auto & cparams = lctx->cparams;
+
+    const bool is_out = strncmp(t->name, "l_out-", 6) == 0;
+    if (ask) {
+        // the scheduler stops at the first node either side asks for and reports only that one
+        lctx->layer_stream_user_ask = cparams.cb_eval && cparams.cb_eval(t, true, cparams.cb_eval_user_data);
+        return is_out || lctx->layer_stream_user_ask;
+    }
+
+    if (is_out) {
+        const int il = atoi(t->name + 6);
+        lctx->layer_stream_seen = true;
+        lctx->model.stream_layer(il, false);
+        lctx->model.stream_layer(il + LLAMA_STREAM_LOOKAHEAD, true);
+    }
+    if (lctx->layer_stream_user_ask) {
+        return cparams.cb_eval(t, false, cparams.cb_eval_user_data);
+    }
+    return true;
+}
+
+void llama_context::set_eval_callback(lm_ggml_backend_sched_eval_callback cb_eval, void * cb_eval_user_data) {
+    LLAMA_LOG_DEBUG("%s: call\n", __func__);
+
+    cparams.cb_eval           = cb_eval;
+    cparams.cb_eval_user_data = cb_eval_user_data;
+}
+
 void llama_context::set_embeddings(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.embeddings = value;
 }
 
+void llama_context::set_embeddings_normalize(bool value) {
+    LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
+
+    cparams.embd_normalize = value;
+}
+
+void llama_context::set_vocoder_istft(bool value) {
+    LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
+
+    cparams.vocoder_istft = value;
+}
+
 void llama_context::set_causal_attn(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
@@ -634,11 +966,34 @@ void llama_context::set_warmup(bool value) {
     cparams.warmup = value;
 }
 
+bool llama_context::set_layer_skip(const bool * skip, int32_t n) {
+    if (n <= 0) {
+        cparams.layer_skip.clear();
+        return true;
+    }
+    if (!model.supports_layer_skip()) {
+        LLAMA_LOG_WARN("%s: layer skipping is not supported by this architecture\n", __func__);
+        return false;
+    }
+    // draft tokens committed to the cache prune the SWA window, which drops cells the full pass
+    // still attends to unless the SWA cache keeps them all
+    if (model.hparams.swa_type != LLAMA_SWA_TYPE_NONE && !cparams.swa_full) {
+        LLAMA_LOG_WARN("%s: layer skipping needs swa_full on a sliding-window model\n", __func__);
+        return false;
+    }
+
+    cparams.layer_skip.assign(skip, skip + std::min<int32_t>(n, model.hparams.n_layer));
+
+    return true;
+}
+
 void llama_context::set_adapter_lora(
             llama_adapter_lora * adapter,
             float scale) {
     LLAMA_LOG_DEBUG("%s: adapter = %p, scale = %f\n", __func__, (void *) adapter, scale);
 
+    graph_reuse_reset();
+
     loras[adapter] = scale;
 }
 
@@ -648,6 +1003,7 @@ bool llama_context::rm_adapter_lora(
 
     auto pos = loras.find(adapter);
     if (pos != loras.end()) {
+        graph_reuse_reset();
         loras.erase(pos);
         return true;
     }
@@ -658,9 +1014,34 @@ bool llama_context::rm_adapter_lora(
 void llama_context::clear_adapter_lora() {
     LLAMA_LOG_DEBUG("%s: call\n", __func__);
 
+    graph_reuse_reset();
+
     loras.clear();
 }
 
+void llama_context::set_adapter_lora_seq(
+            llama_adapter_lora * adapter,
+            float scale,
+            llama_seq_id seq_id) {
+    LLAMA_LOG_DEBUG("%s: adapter = %p, scale = %f, seq_id = %d\n", __func__, (void *) adapter, scale, seq_id);
+
+    graph_reuse_reset();
+
+    loras_seq[seq_id][adapter] = scale;
+}
+
+void llama_context::clear_adapter_lora_seq(llama_seq_id seq_id) {
+    LLAMA_LOG_DEBUG("%s: seq_id = %d\n", __func__, seq_id);
+
+    graph_reuse_reset();
+
+    if (seq_id < 0) {
+        loras_seq.clear();
+    } else {
+        loras_seq.erase(seq_id);
+    }
+}
+
 bool llama_context::apply_adapter_cvec(
             const float * data,
                  size_t   len,
@@ -669,7 +1050,15 @@ bool llama_context::apply_adapter_cvec(
                 int32_t   il_end) {
     LLAMA_LOG_DEBUG("%s: il_start = %d, il_end = %d\n", __func__, il_start, il_end);
 
-    return cvec.apply(model, data, len, n_embd, il_start, il_end);
+    // the directions are read at compute time, a kept graph only goes stale when layers gain or lose their add
+    const std::vector<bool> layers_prev = cvec.layers();
+
+    const bool res = cvec.apply(model, data, len, n_embd, il_start, il_end);
+    if (!res || cvec.layers() != layers_prev) {
+        graph_reuse_reset();
+    }
+
+    return res;
 }
 
 int llama_context::encode(llama_batch & inp_batch) {
@@ -678,9 +1067,9 @@ int llama_context::encode(llama_batch & inp_batch) {
         return -1;
     }
 
-    // temporary allocate memory for the input batch if needed
+    // fill in what the input batch leaves out, in buffers kept from the previous call
     // note: during encode, we always pass the full sequence starting from pos = 0
-    llama_batch_allocr batch_allocr(inp_batch, inp_batch.pos ? -1 : 0);
+    batch_allocr.init(inp_batch, inp_batch.pos ? -1 : 0);
 
     const llama_batch & batch = batch_allocr.batch;
     const int32_t n_tokens = batch.n_tokens;
@@ -705,13 +1094,13 @@ int llama_context::encode(llama_batch & inp_batch) {
         t_compute_start_us = lm_ggml_time_us();
     }
 
-    embd_seq.clear();
+    std::fill(embd_seq_set.begin(), embd_seq_set.end(), 0);
 
     n_queued_tokens += n_tokens;
 
     const int64_t n_embd = hparams.n_embd;
 
-    llama_sbatch sbatch = llama_sbatch(batch, n_embd, /* simple_split */ true, /* logits_all */ true);
+    sbatch.init(batch, n_embd, /* simple_split */ true, /* logits_all */ true);
 
     const llama_ubatch ubatch = sbatch.split_simple(n_tokens);
 
@@ -782,33 +1171,14 @@ int llama_context::encode(llama_batch & inp_batch) {
             case LLAMA_POOLING_TYPE_LAST:
                 {
                     // extract sequence embeddings
-                    auto & embd_seq_out = embd_seq;
-                    embd_seq_out.clear();
-
                     LM_GGML_ASSERT(!ubatch.equal_seqs); // TODO: handle equal splits
 
-                    for (int32_t i = 0; i < n_tokens; i++) {
-                        const llama_seq_id seq_id = ubatch.seq_id[i][0];
-                        if (embd_seq_out.find(seq_id) != embd_seq_out.end()) {
-                            continue;
-                        }
-                        embd_seq_out[seq_id].resize(n_embd);
-                        lm_ggml_backend_tensor_get_async(backend_embd, t_embd, embd_seq_out[seq_id].data(), (n_embd*seq_id)*sizeof(float), n_embd*sizeof(float));
-                    }
+                    embd_seq_extract(ubatch, backend_embd, t_embd);
                 } break;
             case LLAMA_POOLING_TYPE_RANK:
                 {
                     // extract the rerank score - a single float per sequence
-                    auto & embd_seq_out = embd_seq;
-
-                    for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
-                        const llama_seq_id seq_id = ubatch.seq_id[s][0];
-                        if (embd_seq_out.find(seq_id) != embd_seq_out.end()) {
-                            continue;
-                        }
-                        embd_seq_out[seq_id].resize(1);
-                        lm_ggml_backend_tensor_get_async(backend_embd, t_embd, embd_seq_out[seq_id].data(), (seq_id)*sizeof(float), sizeof(float));
-                    }
+                    embd_seq_extract(ubatch, backend_embd, t_embd);
                 } break;
             case LLAMA_POOLING_TYPE_UNSPECIFIED:
                 {
@@ -866,8 +1236,8 @@ int llama_context::decode(llama_batch & inp_batch) {
 
     llama_kv_cache * kv_self = static_cast<llama_kv_cache *>(memory.get());
 
-    // temporary allocate memory for the input batch if needed
-    llama_batch_allocr batch_allocr(inp_batch, inp_batch.pos ? -1 : kv_self->seq_pos_max(0) + 1);
+    // fill in what the input batch leaves out, in buffers kept from the previous call
+    batch_allocr.init(inp_batch, inp_batch.pos ? -1 : kv_self->seq_pos_max(0) + 1);
 
     const llama_batch & batch = batch_allocr.batch;
 
@@ -892,6 +1262,17 @@ int llama_context::decode(llama_batch & inp_batch) {
         }
     }
 
+    if (batch.seq_id) {
+        for (int64_t i = 0; i < n_tokens_all; ++i) {
+            for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+                if (batch.seq_id[i][s] < 0 || batch.seq_id[i][s] >= LLAMA_MAX_PARALLEL_SEQUENCES) {
+                    LLAMA_LOG_ERROR("%s: invalid seq_id[%" PRId64 "][%d] = %d > %d\n", __func__, i, s, batch.seq_id[i][s], LLAMA_MAX_PARALLEL_SEQUENCES);
+                    return -1;
+                }
+            }
+        }
+    }
+
     LM_GGML_ASSERT(n_tokens_all <= cparams.n_batch);
 
     LM_GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
@@ -904,7 +1285,7 @@ int llama_context::decode(llama_batch & inp_batch) {
     // this indicates we are doing pooled embedding, so we ignore batch.logits and output all tokens
     const bool embd_pooled = cparams.embeddings && cparams.pooling_type != LLAMA_POOLING_TYPE_NONE;
 
-    embd_seq.clear();
+    std::fill(embd_seq_set.begin(), embd_seq_set.end(), 0);
 
     int64_t n_outputs_all = 0;
 
@@ -920,7 +1301,7 @@ int llama_context::decode(llama_batch & inp_batch) {
         n_outputs_all = 1;
     }
 
-    llama_sbatch sbatch = kv_self->sbatch_init(batch, /* logits_all */ n_outputs_all == n_tokens_all);
+    kv_self->sbatch_init(sbatch, batch, /* logits_all */ n_outputs_all == n_tokens_all);
 
     // reserve output buffer
     if (output_reserve(n_outputs_all) < n_outputs_all) {
@@ -928,9 +1309,24 @@ int llama_context::decode(llama_batch & inp_batch) {
         return -2;
     };
 
+    if (logits_top_k > 0) {
+        const size_t n_top = n_outputs_all*std::min<int64_t>(logits_top_k, n_vocab);
+        logits_top_val.resize(n_top);
+        logits_top_id.resize(n_top);
+    } else {
+        logits_top_val.clear();
+        logits_top_id.clear();
+    }
+
     // handle any pending defrags/shifts
     kv_self_update();
 
+    // the memory a prefill grew is given back once decoding has gone on without one for a while
+    if (compute_grown && cparams.compute_shrink_ms != UINT32_MAX && n_tokens_all <= n_tokens_decode() &&
+        lm_ggml_time_us() - t_compute_large_us >= (int64_t) cparams.compute_shrink_ms * 1000) {
+        shrink_compute_buffers();
+    }
+
     int64_t n_outputs_prev = 0;
 
     while (sbatch.n_tokens > 0) {
@@ -953,25 +1349,101 @@ int llama_context::decode(llama_batch & inp_batch) {
             n_outputs = n_outputs_new;
         }
 
+        // snapshot the recurrent states this ubatch continues from before the graph overwrites them
+        for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
+            if (kv_self->seq_checkpoint_due(ubatch.seq_id[s][0])) {
+                synchronize();
+                kv_self->seq_checkpoint(ubatch.seq_id[s][0]);
+            }
+        }
+
         // find KV slot
         if (!kv_self->find_slot(ubatch)) {
             return 1;
         }
 
-        lm_ggml_backend_sched_reset(sched.get());
-        lm_ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+        if (cparams.compute_shrink_ms > 0 && ubatch.n_tokens > n_tokens_decode()) {
+            compute_grown      = true;
+            t_compute_large_us = lm_ggml_time_us();
+        }
 
-        auto * gf = graph_init();
-        auto res = graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_DECODER);
+        if (model.is_layer_streaming()) {
+            lm_ggml_backend_sched_set_eval_callback(sched.get(), layer_stream_eval_callback, this);
+        } else {
+            lm_ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+        }
+
+        std::vector<int64_t> key;
+        const bool reusable = graph_reuse_key(ubatch, key);
+
+        lm_ggml_cgraph * gf        = nullptr;
+        lm_ggml_tensor * t_top_val = nullptr;
+        lm_ggml_tensor * t_top_ids = nullptr;
+
+        if (reusable && gf_prev != nullptr && key == gf_key_prev) {
+            // same shape and cache views as the previous ubatch: the graph stays allocated in the
+            // scheduler, only the cache stores move to the new head and the inputs are set again
+            if (!logits_lazy_pending.empty()) {
+                synchronize();
+                logits_fetch_all();
+            }
 
-        // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (lm_ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+            gf        = gf_prev;
+            t_top_val = t_top_val_prev;
+            t_top_ids = t_top_ids_prev;
 
-        lm_ggml_backend_sched_alloc_graph(sched.get(), gf);
+            gf_res_prev->update_kv_stores();
+            n_reused++;
+        } else {
+            lm_ggml_backend_sched_reset(sched.get());
+
+            gf = graph_init();
+            gf_res_prev = graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_DECODER);
+
+            // select the top-k candidates of every output row on the backend, next to the logits
+            if (logits_top_k > 0 && !cparams.embeddings && gf_res_prev->get_logits() && n_outputs > 0) {
+                lm_ggml_context * ctx0 = ctx_compute.get();
+                lm_ggml_tensor  * t_val = gf_res_prev->get_logits();
+                lm_ggml_tensor  * t_ids = lm_ggml_repeat(ctx0, lm_ggml_arange(ctx0, 0.0f, (float) n_vocab, 1.0f), t_val);
+
+                llama_build_top_k(ctx0, t_val, t_ids, logits_top_k, &t_top_val, &t_top_ids);
+                lm_ggml_set_output(t_top_val);
+                lm_ggml_set_output(t_top_ids);
+                lm_ggml_build_forward_expand(gf, t_top_val);
+                lm_ggml_build_forward_expand(gf, t_top_ids);
+            }
+
+            // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (lm_ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+
+            lm_ggml_backend_sched_alloc_graph(sched.get(), gf);
+
+            if (reusable) {
+                gf_prev        = gf;
+                gf_key_prev    = std::move(key);
+                t_top_val_prev = t_top_val;
+                t_top_ids_prev = t_top_ids;
+            }
+        }
+
+        llm_graph_result_i * res = gf_res_prev.get();
 
         res->set_inputs(&ubatch);
 
+        if (model.is_layer_streaming()) {
+            layer_stream_seen = false;
+            for (int il = 0; il < LLAMA_STREAM_LOOKAHEAD; il++) {
+                model.stream_layer(il, true);
+            }
+        }
+
         const auto compute_status = graph_compute(gf, ubatch.n_tokens > 1);
+
+        if (model.is_layer_streaming() && !layer_stream_seen && !layer_stream_warned) {
+            LLAMA_LOG_WARN("%s: no layer outputs in the graph, layer weights are paged in by faults only\n", __func__);
+            layer_stream_warned = true;
+        }
         if (compute_status != LM_GGML_STATUS_SUCCESS) {
+            graph_reuse_reset();
             switch (compute_status) {
                 case LM_GGML_STATUS_ABORTED:
                     return 2;
@@ -1006,7 +1478,23 @@ int llama_context::decode(llama_batch & inp_batch) {
             if (n_outputs) {
                 LM_GGML_ASSERT( n_outputs_prev + n_outputs <= n_outputs_all);
                 LM_GGML_ASSERT((n_outputs_prev + n_outputs)*n_vocab <= (int64_t) logits_size);
-                lm_ggml_backend_tensor_get_async(backend_res, t_logits, logits_out, 0, n_outputs*n_vocab*sizeof(float));
+                // only the rows of the last ubatch can be left behind: earlier ones are overwritten by the next graph
+                if (logits_lazy && sbatch.n_tokens == 0) {
+                    t_logits_lazy    = t_logits;
+                    logits_lazy_row0 = n_outputs_prev;
+                    logits_lazy_pending.assign(n_outputs, 1);
+                } else {
+                    lm_ggml_backend_tensor_get_async(backend_res, t_logits, logits_out, 0, n_outputs*n_vocab*sizeof(float));
+                }
+            }
+
+            if (t_top_val) {
+                const int64_t k = t_top_val->ne[0];
+                lm_ggml_backend_t backend_top = lm_ggml_backend_sched_get_tensor_backend(sched.get(), t_top_val);
+                LM_GGML_ASSERT(backend_top != nullptr);
+                LM_GGML_ASSERT((n_outputs_prev + n_outputs)*k <= (int64_t) logits_top_val.size());
+                lm_ggml_backend_tensor_get_async(backend_top, t_top_val, logits_top_val.data() + n_outputs_prev*k, 0, n_outputs*k*sizeof(float));
+                lm_ggml_backend_tensor_get_async(backend_top, t_top_ids, logits_top_id.data()  + n_outputs_prev*k, 0, n_outputs*k*sizeof(float));
             }
         }
 
@@ -1033,30 +1521,12 @@ int llama_context::decode(llama_batch & inp_batch) {
                 case LLAMA_POOLING_TYPE_LAST:
                     {
                         // extract sequence embeddings (cleared before processing each batch)
-                        auto & embd_seq_out = embd_seq;
-
-                        for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
-                            const llama_seq_id seq_id = ubatch.seq_id[s][0];
-                            if (embd_seq_out.find(seq_id) != embd_seq_out.end()) {
-                                continue;
-                            }
-                            embd_seq_out[seq_id].resize(n_embd);
-                            lm_ggml_backend_tensor_get_async(backend_embd, t_embd, embd_seq_out[seq_id].data(), (n_embd*seq_id)*sizeof(float), n_embd*sizeof(float));
-                        }
+                        embd_seq_extract(ubatch, backend_embd, t_embd);
                     } break;
                 case LLAMA_POOLING_TYPE_RANK:
                     {
                         // extract the rerank score - a single float per sequence
-                        auto & embd_seq_out = embd_seq;
-
-                        for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
-                            const llama_seq_id seq_id = ubatch.seq_id[s][0];
-                            if (embd_seq_out.find(seq_id) != embd_seq_out.end()) {
-                                continue;
-                            }
-                            embd_seq_out[seq_id].resize(1);
-                            lm_ggml_backend_tensor_get_async(backend_embd, t_embd, embd_seq_out[seq_id].data(), (seq_id)*sizeof(float), sizeof(float));
-                        }
+                        embd_seq_extract(ubatch, backend_embd, t_embd);
                     } break;
                 case LLAMA_POOLING_TYPE_UNSPECIFIED:
                     {
@@ -1098,6 +1568,10 @@ int llama_context::decode(llama_batch & inp_batch) {
 
             LM_GGML_ASSERT((size_t) n_outputs == out_ids.size());
 
+            // the rows are swapped on the host
+            synchronize();
+            logits_fetch_all();
+
             // TODO: is there something more efficient which also minimizes swaps?
             // selection sort, to minimize swaps (from https://en.wikipedia.org/wiki/Selection_sort)
             for (int32_t i = 0; i < n_outputs - 1; ++i) {
@@ -1109,6 +1583,11 @@ int llama_context::decode(llama_batch & inp_batch) {
                 }
                 if (j_min == i) { continue; }
                 std::swap(out_ids[i], out_ids[j_min]);
+                if (!logits_top_val.empty()) {
+                    const int32_t k = logits_top_val.size() / n_outputs;
+                    std::swap_ranges(logits_top_val.begin() + i*k, logits_top_val.begin() + (i + 1)*k, logits_top_val.begin() + j_min*k);
+                    std::swap_ranges(logits_top_id.begin()  + i*k, logits_top_id.begin()  + (i + 1)*k, logits_top_id.begin()  + j_min*k);
+                }
                 if (logits_size > 0) {
                     for (uint32_t k = 0; k < n_vocab; k++) {
                         std::swap(logits[i*n_vocab + k], logits[j_min*n_vocab + k]);
@@ -1136,8 +1615,10 @@ int llama_context::decode(llama_batch & inp_batch) {
     }
 
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
-    // overlap with device computation.
-    lm_ggml_backend_sched_reset(sched.get());
+    // overlap with device computation. A graph kept for reuse stays allocated instead.
+    if (gf_prev == nullptr) {
+        lm_ggml_backend_sched_reset(sched.get());
+    }
 
     return 0;
 }
@@ -1147,6 +1628,10 @@ int llama_context::decode(llama_batch & inp_batch) {
 //
 
 int32_t llama_context::output_reserve(int32_t n_outputs) {
+    // rows still on the backend belong to the previous batch
+    logits_lazy_pending.clear();
+    t_logits_lazy = nullptr;
+
     const auto & hparams = model.hparams;
     const auto & vocab   = model.vocab;
 
@@ -1202,6 +1687,7 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
             LLAMA_LOG_ERROR("%s: failed to allocate output buffer of size %.2f MiB\n", __func__, new_size / (1024.0 * 1024.0));
             return 0;
         }
+        lm_ggml_backend_buffer_set_category(buf_output.get(), "output");
     }
 
     float * output_base = (float *) lm_ggml_backend_buffer_get_base(buf_output.get());
@@ -1227,6 +1713,14 @@ int32_t llama_context::graph_max_nodes() const {
 }
 
 lm_ggml_cgraph * llama_context::graph_init() {
+    // the lazy logits tensor lives in the compute context that is about to be reset
+    if (!logits_lazy_pending.empty()) {
+        synchronize();
+        logits_fetch_all();
+    }
+
+    graph_reuse_reset();
+
     lm_ggml_init_params params = {
         /*.mem_size   =*/ buf_compute_meta.size(),
         /*.mem_buffer =*/ buf_compute_meta.data(),
@@ -1238,12 +1732,65 @@ lm_ggml_cgraph * llama_context::graph_init() {
     return lm_ggml_new_graph_custom(ctx_compute.get(), graph_max_nodes(), false);
 }
 
+bool llama_context::graph_reuse_key(const llama_ubatch & ubatch, std::vector<int64_t> & key) const {
+    // embeddings and cross-attention inputs are not kept in sync with a reused graph
+    if (!graph_reuse || cparams.embeddings || !cross.v_embd.empty()) {
+        return false;
+    }
+
+    key = {
+        ubatch.n_tokens,
+        ubatch.n_seq_tokens,
+        ubatch.n_seqs,
+        ubatch.equal_seqs,
+        ubatch.embd != nullptr,
+        n_outputs,
+        logits_top_k,
+        cparams.causal_attn,
+        cparams.warmup,
+    };
+
+    for (size_t il = 0; il < cparams.layer_skip.size(); il++) {
+        if (cparams.layer_skip[il]) {
+            key.push_back(-(int64_t) il - 1);
+        }
+    }
+
+    // which per-sequence adapters the graph applies depends on the sequences in the ubatch
+    const auto loras_seq_used = llm_graph_input_lora_seq::used(&loras_seq, ubatch);
+    key.push_back((int64_t) loras_seq_used.size());
+    for (const auto * adapter : loras_seq_used) {
+        key.push_back((int64_t) (intptr_t) adapter);
+    }
+
+    const llama_kv_cache * kv_self = static_cast<const llama_kv_cache *>(memory.get());
+
+    return kv_self != nullptr && kv_self->get_graph_key(key);
+}
+
+void llama_context::graph_reuse_reset() {
+    if (gf_prev == nullptr) {
+        gf_res_prev.reset();
+        return;
+    }
+
+    // the scheduler still holds the allocation of the kept graph
+    lm_ggml_backend_sched_reset(sched.get());
+
+    gf_prev = nullptr;
+    gf_res_prev.reset();
+    gf_key_prev.clear();
+    t_top_val_prev = nullptr;
+    t_top_ids_prev = nullptr;
+}
+
 llm_graph_result_ptr llama_context::graph_build(
             lm_ggml_context * ctx,
              lm_ggml_cgraph * gf,
       const llama_ubatch & ubatch,
             llm_graph_type gtype) {
-    return model.build_graph(
+    LM_GGML_SIGNPOST_BEGIN(sp_build, "graph_build", "tokens=%u type=%d", ubatch.n_tokens, (int) gtype);
+    auto res = model.build_graph(
             {
                 /*.ctx         =*/ ctx,
                 /*.arch        =*/ model.arch,
@@ -1254,11 +1801,14 @@ llm_graph_result_ptr llama_context::graph_build(
                 /*.backend_cpu =*/ backend_cpu,
                 /*.cvec        =*/ &cvec,
                 /*.loras       =*/ &loras,
+                /*.loras_seq   =*/ &loras_seq,
                 /*.memory      =*/ memory.get(),
                 /*.cross       =*/ &cross,
                 /*.n_outputs   =*/ n_outputs,
                 /*.cb          =*/ graph_get_cb(),
             }, gf, gtype);
+    LM_GGML_SIGNPOST_END(sp_build, "graph_build");
+    return res;
 }
 
 lm_ggml_status llama_context::graph_compute(
@@ -1278,7 +1828,9 @@ lm_ggml_status llama_context::graph_compute(
         set_n_threads_fn.second(set_n_threads_fn.first, n_threads);
     }
 
+    LM_GGML_SIGNPOST_BEGIN(sp_compute, "graph_compute", "nodes=%d threads=%d", lm_ggml_graph_n_nodes(gf), n_threads);
     auto status = lm_ggml_backend_sched_graph_compute_async(sched.get(), gf);
+    LM_GGML_SIGNPOST_END(sp_compute, "graph_compute");
     if (status != LM_GGML_STATUS_SUCCESS) {
         LLAMA_LOG_ERROR("%s: lm_ggml_backend_sched_graph_compute_async failed with error %d\n", __func__, status);
     }
@@ -1688,6 +2240,8 @@ size_t llama_context::state_write_data(llama_io_write_i & io) {
     {
         LLAMA_LOG_DEBUG("%s: - writing logits\n", __func__);
 
+        logits_fetch_all();
+
         const uint64_t logits_size = std::min((uint64_t) this->logits_size, (uint64_t) n_outputs * model.vocab.n_tokens());
 
         io.write(&logits_size, sizeof(logits_size));
@@ -1846,6 +2400,7 @@ llama_perf_context_data llama_context::perf_get_data() const {
     data.t_eval_ms   = 1e-3 * t_eval_us;
     data.n_p_eval    = std::max(1, n_p_eval);
     data.n_eval      = std::max(1, n_eval);
+    data.n_reused    = std::max(0, n_reused);
 
     return data;
 }
@@ -1854,6 +2409,7 @@ void llama_context::perf_reset() {
     t_start_us  = lm_ggml_time_us();
     t_eval_us   = n_eval = 0;
     t_p_eval_us = n_p_eval = 0;
+    n_reused    = 0;
 }
 
 //
@@ -1876,18 +2432,26 @@ static void llama_set_param(struct lm_ggml_tensor * tensor, llama_opt_param_filt
     lm_ggml_set_param(tensor);
 }
 
+static bool llama_opt_checkpoint_layer_out(const struct lm_ggml_tensor * tensor, void * userdata) {
+    LM_GGML_UNUSED(userdata);
+    return strncmp(tensor->name, "l_out-", 6) == 0;
+}
+
 void llama_context::opt_init(struct llama_model * model, struct llama_opt_params lopt_params) {
     LM_GGML_ASSERT(!opt_ctx);
-    model->hparams.n_ctx_train = lopt_params.n_ctx_train > 0 ? lopt_params.n_ctx_train : n_ctx();
-    const uint32_t n_batch     = std::min(this->n_batch(),  model->hparams.n_ctx_train);
+    // kept on the context, the model may be shared with contexts that are not training
+    opt_n_ctx = lopt_params.n_ctx_train > 0 ? lopt_params.n_ctx_train : n_ctx();
+    const uint32_t n_batch     = std::min(this->n_batch(),  opt_n_ctx);
     const uint32_t n_ubatch    = std::min(this->n_ubatch(), n_batch);
-    LM_GGML_ASSERT(model->hparams.n_ctx_train % n_batch  == 0);
-    LM_GGML_ASSERT(n_batch                    % n_ubatch == 0);
+    LM_GGML_ASSERT(opt_n_ctx % n_batch  == 0);
+    LM_GGML_ASSERT(n_batch   % n_ubatch == 0);
 
     lm_ggml_opt_params opt_params = lm_ggml_opt_default_params(sched.get(), LM_GGML_OPT_LOSS_TYPE_CROSS_ENTROPY);
     opt_params.opt_period      = n_batch / n_ubatch;
     opt_params.get_opt_pars    = lopt_params.get_opt_pars;
     opt_params.get_opt_pars_ud = lopt_params.get_opt_pars_ud;
+    opt_params.checkpoint_filter = lopt_params.checkpoint_layers ? llama_opt_checkpoint_layer_out : nullptr;
+    opt_params.opt_state_type  = lopt_params.opt_state_type;
 
     opt_ctx = lm_ggml_opt_init(opt_params);
 
@@ -1914,6 +2478,13 @@ void llama_context::opt_init(struct llama_model * model, struct llama_opt_params
             llama_set_param(reinterpret_cast<struct lm_ggml_tensor **>(&layer)[i], param_filter, param_filter_ud);
         }
     }
+
+    for (auto & it : loras) {
+        for (auto & ab : it.first->ab_map) {
+            llama_set_param(ab.second.a, param_filter, param_filter_ud);
+            llama_set_param(ab.second.b, param_filter, param_filter_ud);
+        }
+    }
 }
 
 void llama_context::opt_epoch_iter(
@@ -1928,7 +2499,7 @@ void llama_context::opt_epoch_iter(
         int64_t                          ndata_in_loop,
         int64_t                          t_loop_start) {
     LM_GGML_ASSERT(opt_ctx);
-    const uint32_t n_ctx    = llama_model_n_ctx_train(&model);
+    const uint32_t n_ctx    = opt_n_ctx;
     const uint32_t n_batch  = std::min(this->n_batch(),  n_ctx);
     const uint32_t n_ubatch = std::min(this->n_ubatch(), n_batch);
 
@@ -1954,11 +2525,11 @@ void llama_context::opt_epoch_iter(
         // this indicates we are doing pooled embedding, so we ignore batch.logits and output all tokens
         const bool embd_pooled = cparams.embeddings && cparams.pooling_type != LLAMA_POOLING_TYPE_NONE;
 
-        embd_seq.clear();
+        std::fill(embd_seq_set.begin(), embd_seq_set.end(), 0);
 
         int64_t n_outputs_all = n_tokens_all;
 
-        llama_sbatch sbatch = kv_self->sbatch_init(batch, /*logits_all =*/ true);
+        kv_self->sbatch_init(sbatch, batch, /*logits_all =*/ true);
 
         // reserve output buffer
         if (output_reserve(n_outputs_all) < n_outputs_all) {
@@ -1984,7 +2555,8 @@ void llama_context::opt_epoch_iter(
             struct lm_ggml_context * ctx_compute_opt;
             {
                 const size_t size_gf = lm_ggml_graph_size(gf);
-                const size_t size_meta = 4*size_gf*lm_ggml_tensor_overhead() + 2*lm_ggml_graph_overhead_custom(size_gf, /*grads = */ true);
+                // room for the recomputed forward nodes and their graph when checkpointing
+                const size_t size_meta = 5*size_gf*lm_ggml_tensor_overhead() + 3*lm_ggml_graph_overhead_custom(2*size_gf, /*grads = */ true);
                 struct lm_ggml_init_params params = {
                     /*.mem_size   =*/ size_meta,
                     /*.mem_buffer =*/ nullptr,
@@ -2024,7 +2596,7 @@ void llama_context::opt_epoch(
         int64_t                   idata_split,
         lm_ggml_opt_epoch_callback   callback_train,
         lm_ggml_opt_epoch_callback   callback_eval) {
-    const uint32_t n_ctx    = this->n_ctx();
+    const uint32_t n_ctx    = opt_n_ctx;
     const uint32_t n_batch  = std::min(cparams.n_batch,  n_ctx);
     const uint32_t n_ubatch = std::min(cparams.n_ubatch, n_batch);
     const  int64_t ndata    = lm_ggml_opt_dataset_ndata(dataset);
@@ -2088,10 +2660,15 @@ llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.defrag_max_cells            =*/ 0,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ LM_GGML_TYPE_F16,
         /*.type_v                      =*/ LM_GGML_TYPE_F16,
+        /*.n_kv_recent                 =*/ 0,
+        /*.compute_shrink_ms           =*/ 0,
+        /*.n_state_ckpt                =*/ 0,
+        /*.n_state_ckpt_interval       =*/ 0,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
         /*.embeddings                  =*/ false,
@@ -2128,9 +2705,23 @@ llama_context * llama_init_from_model(
         params.flash_attn = false;
     }
 
-    if (lm_ggml_is_quantized(params.type_v) && !params.flash_attn) {
-        LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
-        return nullptr;
+    const bool kv_tiered = params.n_kv_recent > 0 && (lm_ggml_is_quantized(params.type_k) || lm_ggml_is_quantized(params.type_v));
+
+    // the tiered KV cache attends over two tensors, which only the non-flash path can do
+    if (params.flash_attn && kv_tiered) {
+        LLAMA_LOG_WARN("%s: flash_attn is not compatible with the tiered KV cache - forcing off\n", __func__);
+        params.flash_attn = false;
+    }
+
+    // the quantized V cache is only read by the flash-attention kernels, whose vec variants decode the
+    // cache blocks in place for single-token queries
+    if (lm_ggml_is_quantized(params.type_v) && !params.flash_attn && !kv_tiered) {
+        if (model->arch == LLM_ARCH_GROK) {
+            LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
+            return nullptr;
+        }
+        LLAMA_LOG_WARN("%s: V cache quantization requires flash_attn - forcing on\n", __func__);
+        params.flash_attn = true;
     }
 
     try {
@@ -2213,22 +2804,42 @@ void llama_set_abort_callback(llama_context * ctx, bool (*abort_callback)(void *
     ctx->set_abort_callback(abort_callback, abort_callback_data);
 }
 
+void llama_set_eval_callback(llama_context * ctx, lm_ggml_backend_sched_eval_callback cb_eval, void * cb_eval_user_data) {
+    ctx->set_eval_callback(cb_eval, cb_eval_user_data);
+}
+
 void llama_set_embeddings(llama_context * ctx, bool embeddings) {
     ctx->set_embeddings(embeddings);
 }
 
+void llama_set_embeddings_normalize(llama_context * ctx, bool normalize) {
+    ctx->set_embeddings_normalize(normalize);
+}
+
 void llama_set_causal_attn(llama_context * ctx, bool causal_attn) {
     ctx->set_causal_attn(causal_attn);
 }
 
+void llama_set_vocoder_istft(llama_context * ctx, bool istft) {
+    ctx->set_vocoder_istft(istft);
+}
+
 void llama_set_warmup(llama_context * ctx, bool warmup) {
     ctx->set_warmup(warmup);
 }
 
+bool llama_set_layer_skip(llama_context * ctx, const bool * skip, int32_t n) {
+    return ctx->set_layer_skip(skip, n);
+}
+
 void llama_synchronize(llama_context * ctx) {
     ctx->synchronize();
 }
 
+size_t llama_shrink_compute_buffers(llama_context * ctx) {
+    return ctx->shrink_compute_buffers();
+}
+
 float * llama_get_logits(llama_context * ctx) {
     ctx->synchronize();
 
@@ -2241,6 +2852,22 @@ float * llama_get_logits_ith(llama_context * ctx, int32_t i) {
     return ctx->get_logits_ith(i);
 }
 
+void llama_set_logits_lazy(llama_context * ctx, bool lazy) {
+    ctx->synchronize();
+
+    ctx->set_logits_lazy(lazy);
+}
+
+void llama_set_logits_top_k(llama_context * ctx, int32_t k) {
+    ctx->set_logits_top_k(k);
+}
+
+int32_t llama_get_logits_top_k_ith(llama_context * ctx, int32_t i, llama_token * ids, float * logits) {
+    ctx->synchronize();
+
+    return ctx->get_logits_top_k_ith(i, ids, logits);
+}
+
 float * llama_get_embeddings(llama_context * ctx) {
     ctx->synchronize();
 
@@ -2259,6 +2886,12 @@ float * llama_get_embeddings_seq(llama_context * ctx, llama_seq_id seq_id) {
     return ctx->get_embeddings_seq(seq_id);
 }
 
+void llama_set_embeddings_seq_out(llama_context * ctx, float * out, int32_t n_seq) {
+    ctx->synchronize();
+
+    ctx->set_embeddings_seq_out(out, n_seq);
+}
+
 // llama adapter API
 
 int32_t llama_set_adapter_lora(
@@ -2282,6 +2915,24 @@ void llama_clear_adapter_lora(llama_context * ctx) {
     ctx->clear_adapter_lora();
 }
 
+int32_t llama_set_adapter_lora_seq(
+            llama_context * ctx,
+            llama_adapter_lora * adapter,
+            float scale,
+            llama_seq_id seq_id) {
+    if (seq_id < 0) {
+        return -1;
+    }
+
+    ctx->set_adapter_lora_seq(adapter, scale, seq_id);
+
+    return 0;
+}
+
+void llama_clear_adapter_lora_seq(llama_context * ctx, llama_seq_id seq_id) {
+    ctx->clear_adapter_lora_seq(seq_id);
+}
+
 int32_t llama_apply_adapter_cvec(
         llama_context * ctx,
                  const float * data,
@@ -2386,6 +3037,43 @@ void llama_kv_self_seq_keep(llama_context * ctx, llama_seq_id seq_id) {
     kv->seq_keep(seq_id);
 }
 
+void llama_kv_self_seq_set_quota(
+        llama_context * ctx,
+         llama_seq_id   seq_id,
+             uint32_t   n_max_cells,
+  llama_kv_evict_policy policy,
+             uint32_t   n_sink) {
+    auto * kv = ctx->get_kv_self();
+    if (!kv) {
+        return;
+    }
+
+    kv->seq_set_quota(seq_id, n_max_cells, policy, n_sink);
+}
+
+bool llama_kv_self_seq_checkpoint(llama_context * ctx, llama_seq_id seq_id) {
+    auto * kv = ctx->get_kv_self();
+    if (!kv) {
+        return false;
+    }
+
+    // the state is read back from the cache buffers, a graph still running may be writing it
+    ctx->synchronize();
+
+    return kv->seq_checkpoint(seq_id);
+}
+
+llama_pos llama_kv_self_seq_rollback(llama_context * ctx, llama_seq_id seq_id, llama_pos p) {
+    auto * kv = ctx->get_kv_self();
+    if (!kv) {
+        return p;
+    }
+
+    ctx->synchronize();
+
+    return kv->seq_rollback(seq_id, p);
+}
+
 void llama_kv_self_seq_add(
         llama_context * ctx,
          llama_seq_id   seq_id,
@@ -2442,6 +3130,15 @@ void llama_kv_self_defrag(llama_context * ctx) {
     kv->defrag_sched(-1.0f);
 }
 
+llama_kv_defrag_stats llama_kv_self_defrag_stats(const llama_context * ctx) {
+    const auto * kv = ctx->get_kv_self();
+    if (!kv) {
+        return {};
+    }
+
+    return kv->get_defrag_stats();
+}
+
 bool llama_kv_self_can_shift(const llama_context * ctx) {
     const auto * kv = ctx->get_kv_self();
     if (!kv) {
@@ -2622,6 +3319,7 @@ void llama_perf_context_print(const llama_context * ctx) {
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, data.t_eval_ms, data.n_eval, data.t_eval_ms / data.n_eval, 1e3 / data.t_eval_ms * data.n_eval);
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (t_end_ms - data.t_start_ms), (data.n_p_eval + data.n_eval));
+    LLAMA_LOG_INFO("%s:    graphs reused = %10d\n", __func__, data.n_reused);
 }
 
 void llama_perf_context_reset(llama_context * ctx) {
@@ -28,6 +28,9 @@ struct llama_context {
 
     void synchronize();
 
+    // frees the compute buffers and reserves them for the decode graph, returns the bytes freed
+    size_t shrink_compute_buffers();
+
     const llama_model   & get_model()   const;
     const llama_cparams & get_cparams() const;
 
@@ -54,10 +57,16 @@ struct llama_context {
     float * get_logits();
     float * get_logits_ith(int32_t i);
 
+    void    set_logits_lazy(bool value);
+    void    set_logits_top_k(int32_t value);
+    int32_t get_logits_top_k_ith(int32_t i, llama_token * ids, float * values);
+
     float * get_embeddings();
     float * get_embeddings_ith(int32_t i);
     float * get_embeddings_seq(llama_seq_id seq_id);
 
+    void set_embeddings_seq_out(float * out, int32_t n_seq);
+
     void attach_threadpool(
             lm_ggml_threadpool_t threadpool,
             lm_ggml_threadpool_t threadpool_batch);
@@ -68,9 +77,14 @@ struct llama_context {
 
     void set_abort_callback(bool (*abort_callback)(void * data), void * abort_callback_data);
 
+    void set_eval_callback(lm_ggml_backend_sched_eval_callback cb_eval, void * cb_eval_user_data);
+
     void set_embeddings (bool value);
+    void set_embeddings_normalize(bool value);
+    void set_vocoder_istft(bool value);
     void set_causal_attn(bool value);
     void set_warmup(bool value);
+    bool set_layer_skip(const bool * skip, int32_t n);
 
     void set_adapter_lora(
             llama_adapter_lora * adapter,
@@ -81,6 +95,13 @@ struct llama_context {
 
     void clear_adapter_lora();
 
+    void set_adapter_lora_seq(
+            llama_adapter_lora * adapter,
+            float scale,
+            llama_seq_id seq_id);
+
+    void clear_adapter_lora_seq(llama_seq_id seq_id);
+
     bool apply_adapter_cvec(
             const float * data,
                  size_t   len,
@@ -169,6 +190,13 @@ private:
     // Returns max number of outputs for which space was reserved.
     int32_t output_reserve(int32_t n_outputs);
 
+    // copy lazily kept logits rows from the backend into the host buffer
+    void logits_fetch(int32_t j);
+    void logits_fetch_all();
+
+    // queue the copies of the pooled rows of the ubatch's sequences into the sequence embeddings output
+    void embd_seq_extract(const llama_ubatch & ubatch, lm_ggml_backend_t backend_embd, lm_ggml_tensor * t_embd);
+
     //
     // graph
     //
@@ -191,8 +219,27 @@ private:
       const llama_ubatch & ubatch,
           llm_graph_type   gtype);
 
+    // everything the decoder graph of ubatch is built from, except the KV cache head
+    // returns false if the graph cannot be reused by a later ubatch
+    bool graph_reuse_key(const llama_ubatch & ubatch, std::vector<int64_t> & key) const;
+
+    // drop the graph kept for reuse, e.g. because ctx_compute is about to be reset
+    void graph_reuse_reset();
+
+    // tokens of the graph compute buffers are sized for with compute_shrink_ms: one per sequence
+    uint32_t n_tokens_decode() const;
+
+    // reserves the compute buffers for n_tokens over a full KV cache
+    bool graph_reserve(uint32_t n_tokens);
+
+    size_t compute_buffer_size() const;
+
     llm_graph_cb graph_get_cb() const;
 
+    // scheduler callback while the model streams its layers: splits compute at every layer output
+    // to page the next layers in and the finished one out, and forwards to cparams.cb_eval
+    static bool layer_stream_eval_callback(lm_ggml_tensor * t, bool ask, void * user_data);
+
     // TODO: read/write lora adapters and cvec
     size_t state_write_data(llama_io_write_i & io);
     size_t state_read_data (llama_io_read_i  & io);
@@ -209,6 +256,7 @@ private:
     llama_cparams       cparams;
     llama_adapter_cvec  cvec;
     llama_adapter_loras loras;
+    llama_adapter_loras_seq loras_seq;
 
     llama_cross cross; // TODO: tmp for handling cross-attention - need something better probably
 
@@ -218,20 +266,39 @@ private:
     size_t  logits_size = 0; // capacity (of floats) for logits
     float * logits      = nullptr;
 
+    // lazy logits: rows [logits_lazy_row0, logits_lazy_row0 + logits_lazy_pending.size()) are still in t_logits_lazy
+    bool                   logits_lazy      = false;
+    lm_ggml_tensor *       t_logits_lazy    = nullptr;
+    int32_t                logits_lazy_row0 = 0;
+    std::vector<uint8_t>   logits_lazy_pending;
+
+    // top-k candidates selected on the backend (2-dimensional arrays: [n_outputs][logits_top_k])
+    int32_t            logits_top_k = 0;
+    std::vector<float> logits_top_val;
+    std::vector<float> logits_top_id;
+
     // embeddings output (2-dimensional array: [n_outputs][n_embd])
     // populated only when pooling_type == LLAMA_POOLING_TYPE_NONE
     size_t  embd_size = 0; // capacity (of floats) for embeddings
     float * embd      = nullptr;
 
-    // sequence embeddings output (map of [n_embd] vectors)
+    // sequence embeddings output (2-dimensional array: [LLAMA_MAX_PARALLEL_SEQUENCES][n_embd], one float per
+    // sequence for rank pooling), row s holds sequence s. Written to embd_seq_out instead when the caller set one
     // populated only when pooling_type != LLAMA_POOLING_TYPE_NONE
-    std::map<llama_seq_id, std::vector<float>> embd_seq;
+    std::vector<float>   embd_seq;
+    std::vector<uint8_t> embd_seq_set;       // rows written by the last batch
+    float *              embd_seq_out   = nullptr;
+    int32_t              embd_seq_out_n = 0; // rows of embd_seq_out
 
     int32_t n_outputs     = 0; // number of actually-used outputs in the current ubatch or last logical batch
     int32_t n_outputs_max = 0; // capacity (of tokens positions) for the output buffers
 
     std::vector<int32_t> output_ids; // map batch token positions to ids of the logits and embd buffers
 
+    // input batch bookkeeping, kept so that decoding a token does not allocate
+    llama_batch_allocr batch_allocr;
+    llama_sbatch       sbatch;
+
     lm_ggml_backend_sched_ptr sched;
 
     lm_ggml_backend_t backend_cpu = nullptr;
@@ -239,8 +306,27 @@ private:
 
     lm_ggml_context_ptr ctx_compute;
 
+    // the last decoder graph, kept allocated in the scheduler while it can be reused
+    bool                    graph_reuse = true;
+    lm_ggml_cgraph *        gf_prev     = nullptr;
+    llm_graph_result_ptr    gf_res_prev;
+    std::vector<int64_t>    gf_key_prev;
+    lm_ggml_tensor *        t_top_val_prev = nullptr;
+    lm_ggml_tensor *        t_top_ids_prev = nullptr;
+
+    // with compute_shrink_ms: whether a ubatch larger than n_tokens_decode() ran since the last
+    // shrink, and when the last one did
+    bool    compute_grown      = false;
+    int64_t t_compute_large_us = 0;
+
+    // layer streaming state of the graph being computed
+    bool layer_stream_user_ask = false; // cb_eval asked for the node the scheduler stopped at
+    bool layer_stream_seen     = false; // a layer output was reached
+    bool layer_stream_warned   = false;
+
     // training
     lm_ggml_opt_context_t opt_ctx = nullptr;
+    uint32_t opt_n_ctx = 0; // tokens per datapoint, the context size the model is trained for
 
     lm_ggml_threadpool_t threadpool       = nullptr;
     lm_ggml_threadpool_t threadpool_batch = nullptr;
@@ -273,4 +359,5 @@ private:
 
     mutable int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     mutable int32_t n_eval   = 0; // number of eval calls
+    mutable int32_t n_reused = 0; // number of decoder graphs computed again without a rebuild
 };
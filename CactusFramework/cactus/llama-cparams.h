@@ -3,6 +3,9 @@
 #include "llama.h"
 
 #include <cstdint>
+#include <vector>
+
+#define LLAMA_MAX_PARALLEL_SEQUENCES 64
 
 struct llama_cparams {
     uint32_t n_ctx;           // context size used during inference
@@ -23,6 +26,8 @@ struct llama_cparams {
     float yarn_beta_fast;
     float yarn_beta_slow;
     float defrag_thold;
+    uint32_t defrag_max_cells;
+    uint32_t compute_shrink_ms;
 
     bool embeddings;
     bool causal_attn;
@@ -31,9 +36,15 @@ struct llama_cparams {
     bool no_perf;
     bool warmup;
     bool op_offload;
+    bool swa_full;
+    bool embd_normalize; // L2-normalize pooled embeddings in the graph
+    bool vocoder_istft;  // WavTokenizer graphs end in the ISTFT and output PCM, else the spectrum
 
     enum llama_pooling_type pooling_type;
 
+    // repeating layers the graph leaves out (the draft pass of self-speculation), empty runs all
+    std::vector<bool> layer_skip;
+
     lm_ggml_backend_sched_eval_callback cb_eval;
     void * cb_eval_user_data;
 };
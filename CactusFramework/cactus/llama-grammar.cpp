@@ -816,7 +816,7 @@ static bool llama_grammar_detect_left_recursion(
 }
 
 const llama_grammar_rules & llama_grammar_get_rules(const struct llama_grammar * grammar) {
-    return grammar->rules;
+    return *grammar->rules;
 }
 
 llama_grammar_stacks & llama_grammar_get_stacks(struct llama_grammar * grammar) {
@@ -841,7 +841,7 @@ void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
             if (!llama_grammar_is_end_of_sequence(pos)) {
                 new_stack.push_back(pos);
             }
-            llama_grammar_advance_stack(grammar->rules, new_stack, stacks_new);
+            llama_grammar_advance_stack(*grammar->rules, new_stack, stacks_new);
         }
     }
 
@@ -962,7 +962,7 @@ struct llama_grammar * llama_grammar_init_impl(
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
     return new llama_grammar {
         vocab,
-        std::move(vec_rules),
+        std::make_shared<const llama_grammar_rules>(std::move(vec_rules)),
         std::move(stacks),
         /* .partial_utf8 = */     {},
         /* .lazy =*/              false,
@@ -973,7 +973,7 @@ struct llama_grammar * llama_grammar_init_impl(
     };
 }
 
-struct llama_grammar * llama_grammar_init_impl(
+static struct llama_grammar * llama_grammar_parse_impl(
         const struct llama_vocab * vocab,
                       const char * grammar_str,
                       const char * grammar_root,
@@ -1067,7 +1067,7 @@ struct llama_grammar * llama_grammar_init_impl(
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
     return new llama_grammar {
         vocab,
-        std::move(vec_rules),
+        std::make_shared<const llama_grammar_rules>(std::move(vec_rules)),
         std::move(stacks),
         /* .partial_utf8 = */     {},
         /* .lazy = */             lazy,
@@ -1078,6 +1078,68 @@ struct llama_grammar * llama_grammar_init_impl(
     };
 }
 
+static const size_t LLAMA_GRAMMAR_CACHE_SIZE = 8;
+
+struct llama_grammar * llama_grammar_init_impl(
+        const struct llama_vocab * vocab,
+                      const char * grammar_str,
+                      const char * grammar_root,
+                              bool lazy,
+                     const char ** trigger_patterns,
+                            size_t num_trigger_patterns,
+               const llama_token * trigger_tokens,
+                            size_t num_trigger_tokens) {
+    if (vocab == nullptr) {
+        return llama_grammar_parse_impl(vocab, grammar_str, grammar_root, lazy,
+                                        trigger_patterns, num_trigger_patterns, trigger_tokens, num_trigger_tokens);
+    }
+
+    std::string key = grammar_str;
+    key += '\0';
+    key += grammar_root;
+    key += lazy ? '1' : '0';
+    for (size_t i = 0; i < num_trigger_patterns; i++) {
+        key += '\0';
+        key += trigger_patterns[i];
+    }
+    key += '\0';
+    for (size_t i = 0; i < num_trigger_tokens; i++) {
+        key += std::to_string(trigger_tokens[i]) + ",";
+    }
+
+    auto & cache = vocab->grammar_cache();
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        for (auto & entry : cache.entries) {
+            if (entry.key == key) {
+                entry.last_use = ++cache.n_uses;
+                return llama_grammar_clone_impl(*entry.grammar);
+            }
+        }
+    }
+
+    auto * grammar = llama_grammar_parse_impl(vocab, grammar_str, grammar_root, lazy,
+                                              trigger_patterns, num_trigger_patterns, trigger_tokens, num_trigger_tokens);
+    if (grammar == nullptr) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    for (const auto & entry : cache.entries) {
+        if (entry.key == key) {
+            return grammar;
+        }
+    }
+    if (cache.entries.size() >= LLAMA_GRAMMAR_CACHE_SIZE) {
+        auto oldest = std::min_element(cache.entries.begin(), cache.entries.end(),
+                [](const llama_grammar_cache::entry & a, const llama_grammar_cache::entry & b) { return a.last_use < b.last_use; });
+        cache.entries.erase(oldest);
+    }
+    cache.entries.push_back({ std::move(key), std::unique_ptr<const llama_grammar>(llama_grammar_clone_impl(*grammar)), ++cache.n_uses });
+
+    return grammar;
+}
+
 void llama_grammar_free_impl(struct llama_grammar * grammar) {
     if (grammar == nullptr) {
         return;
@@ -1087,6 +1149,7 @@ void llama_grammar_free_impl(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & grammar) {
+    // the rules are shared, so the stacks can be copied as they are
     auto * result = new llama_grammar {
         grammar.vocab,
         grammar.rules,
@@ -1099,20 +1162,178 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
         grammar.trigger_patterns,
     };
 
-    // redirect elements in stacks to point to new rules
-    for (size_t is = 0; is < result->stacks.size(); is++) {
-        for (size_t ie = 0; ie < result->stacks[is].size(); ie++) {
-            for (size_t ir0 = 0; ir0 < grammar.rules.size(); ir0++) {
-                for (size_t ir1 = 0; ir1 < grammar.rules[ir0].size(); ir1++) {
-                    if (grammar.stacks[is][ie] == &grammar.rules[ir0][ir1]) {
-                        result->stacks[is][ie] =  &result->rules[ir0][ir1];
-                    }
-                }
+    result->masks = grammar.masks;
+
+    return result;
+}
+
+llama_grammar_token_trie::llama_grammar_token_trie(const llama_vocab & vocab) {
+    const uint32_t n_vocab = vocab.n_tokens();
+
+    is_partial.assign(n_vocab, 0);
+
+    std::vector<std::vector<uint32_t>> seqs(n_vocab);
+    std::vector<llama_token> order;
+    order.reserve(n_vocab);
+
+    for (uint32_t id = 0; id < n_vocab; ++id) {
+        const std::string & piece = vocab.token_to_piece(id);
+        if (piece.empty() || piece[0] == 0) {
+            continue;
+        }
+        auto decoded = decode_utf8(piece, {});
+        if (decoded.second.n_remain < 0) {
+            // invalid UTF-8 never matches, leaving it out of the trie rejects it
+            continue;
+        }
+        if (decoded.second.n_remain > 0) {
+            is_partial[id] = 1;
+            continue;
+        }
+        decoded.first.pop_back(); // terminating 0
+        seqs[id] = std::move(decoded.first);
+        order.push_back(id);
+    }
+
+    std::sort(order.begin(), order.end(), [&](llama_token a, llama_token b) {
+        return seqs[a] != seqs[b] ? seqs[a] < seqs[b] : a < b;
+    });
+
+    tokens.reserve(order.size());
+
+    // root
+    node_chr.push_back(0);
+    node_end.push_back(0);
+    node_tok.push_back(0);
+
+    // path[d] is the node of the current piece at depth d
+    std::vector<uint32_t> path = { 0 };
+    const std::vector<uint32_t> * prev = nullptr;
+
+    for (const llama_token id : order) {
+        const auto & seq = seqs[id];
+
+        size_t n_common = 0;
+        if (prev != nullptr) {
+            while (n_common < prev->size() && n_common < seq.size() && (*prev)[n_common] == seq[n_common]) {
+                n_common++;
             }
         }
+        while (path.size() > n_common + 1) {
+            node_end[path.back()] = node_chr.size();
+            path.pop_back();
+        }
+        for (size_t d = n_common; d < seq.size(); ++d) {
+            path.push_back(node_chr.size());
+            node_chr.push_back(seq[d]);
+            node_end.push_back(0);
+            node_tok.push_back(tokens.size());
+        }
+        tokens.push_back(id);
+        prev = &seq;
     }
+    while (!path.empty()) {
+        node_end[path.back()] = node_chr.size();
+        path.pop_back();
+    }
+    node_tok.push_back(tokens.size());
 
-    return result;
+    LLAMA_LOG_DEBUG("%s: %zu nodes for %zu tokens\n", __func__, node_chr.size(), tokens.size());
+}
+
+// marks every token under `node` whose remaining code points can be consumed starting from `stack`
+static void llama_grammar_trie_allow(
+        const llama_grammar_rules      & rules,
+        const llama_grammar_token_trie & trie,
+                              uint32_t   node,
+        const llama_grammar_stack      & stack,
+                 std::vector<uint32_t> & mask) {
+    for (uint32_t t = trie.node_tok[node]; t < trie.node_tok[node + 1]; ++t) {
+        const uint32_t id = trie.tokens[t];
+        mask[id >> 5] |= 1u << (id & 31);
+    }
+
+    if (stack.empty()) {
+        return;
+    }
+
+    const llama_grammar_element * pos = stack.back();
+
+    llama_grammar_stacks next_stacks;
+    for (uint32_t child = node + 1; child < trie.node_end[node]; child = trie.node_end[child]) {
+        const auto match = llama_grammar_match_char(pos, trie.node_chr[child]);
+        if (!match.first) {
+            continue;
+        }
+        llama_grammar_stack stack_after(stack.begin(), stack.end() - 1);
+        if (!llama_grammar_is_end_of_sequence(match.second)) {
+            stack_after.push_back(match.second);
+        }
+        next_stacks.clear();
+        llama_grammar_advance_stack(rules, stack_after, next_stacks);
+        for (const auto & next : next_stacks) {
+            llama_grammar_trie_allow(rules, trie, child, next, mask);
+        }
+    }
+}
+
+static const size_t LLAMA_GRAMMAR_MASK_CACHE_SIZE     = 64;
+static const size_t LLAMA_GRAMMAR_MASK_MIN_CANDIDATES = 256;
+
+// returns the allowed-token mask of the current stacks, or nullptr when it is not cached and
+// `build` is false
+static std::shared_ptr<const std::vector<uint32_t>> llama_grammar_get_mask(const struct llama_grammar & grammar, bool build) {
+    auto & cache = *grammar.masks;
+
+    std::vector<uint64_t> signature;
+    for (const auto & stack : grammar.stacks) {
+        for (const llama_grammar_element * pos : stack) {
+            signature.push_back((uint64_t) (uintptr_t) pos);
+        }
+        signature.push_back(UINT64_MAX);
+    }
+
+    uint64_t key = 0xcbf29ce484222325ULL;
+    for (const uint64_t ref : signature) {
+        key = (key ^ ref) * 0x100000001b3ULL;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        auto it = cache.entries.find(key);
+        if (it != cache.entries.end() && it->second.stacks == signature) {
+            it->second.last_use = ++cache.n_uses;
+            return it->second.mask;
+        }
+    }
+    if (!build) {
+        return nullptr;
+    }
+
+    const auto & trie = grammar.vocab->grammar_trie();
+
+    auto mask = std::make_shared<std::vector<uint32_t>>((trie.is_partial.size() + 31) / 32, 0);
+    for (const auto & stack : grammar.stacks) {
+        llama_grammar_trie_allow(*grammar.rules, trie, 0, stack, *mask);
+    }
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if (cache.entries.find(key) == cache.entries.end() && cache.entries.size() >= LLAMA_GRAMMAR_MASK_CACHE_SIZE) {
+        auto oldest = cache.entries.begin();
+        for (auto e = cache.entries.begin(); e != cache.entries.end(); ++e) {
+            if (e->second.last_use < oldest->second.last_use) {
+                oldest = e;
+            }
+        }
+        cache.entries.erase(oldest);
+    }
+
+    auto & entry = cache.entries[key];
+    entry.stacks   = std::move(signature);
+    entry.mask     = mask;
+    entry.last_use = ++cache.n_uses;
+
+    return mask;
 }
 
 void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_data_array * cur_p) {
@@ -1136,6 +1357,14 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
     llama_grammar_candidates candidates_grammar;
     candidates_grammar.reserve(cur_p->size);
 
+    // large candidate sets are filtered with the token mask of the current state; small ones only
+    // use it when it is already cached, checking a few tokens directly is cheaper than a trie walk
+    std::shared_ptr<const std::vector<uint32_t>> mask;
+    if (grammar.partial_utf8.n_remain == 0) {
+        mask = llama_grammar_get_mask(grammar, cur_p->size >= LLAMA_GRAMMAR_MASK_MIN_CANDIDATES);
+    }
+    const llama_grammar_token_trie * trie = mask ? &grammar.vocab->grammar_trie() : nullptr;
+
     for (size_t i = 0; i < cur_p->size; ++i) {
         const llama_token id      = cur_p->data[i].id;
         const std::string & piece = grammar.vocab->token_to_piece(id);
@@ -1146,13 +1375,17 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
             }
         } else if (piece.empty() || piece[0] == 0) {
             cur_p->data[i].logit = -INFINITY;
+        } else if (mask && !trie->is_partial[id]) {
+            if (!((*mask)[id >> 5] & (1u << (id & 31)))) {
+                cur_p->data[i].logit = -INFINITY;
+            }
         } else {
             candidates_decoded.push_back(decode_utf8(piece, grammar.partial_utf8));
             candidates_grammar.push_back({ i, candidates_decoded.back().first.data(), candidates_decoded.back().second });
         }
     }
 
-    const auto rejects = llama_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+    const auto rejects = llama_grammar_reject_candidates(*grammar.rules, grammar.stacks, candidates_grammar);
     for (const auto & reject : rejects) {
         cur_p->data[reject.index].logit = -INFINITY;
     }
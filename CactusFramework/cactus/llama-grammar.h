@@ -3,8 +3,11 @@
 #include "llama.h"
 
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 struct llama_vocab;
@@ -111,12 +114,45 @@ struct llama_grammar_trigger_pattern {
     std::regex  regex;
 };
 
+// trie over the decoded code points of every token piece, built once per vocab; lets a grammar
+// state be matched against the whole vocab while walking each shared prefix only once
+struct llama_grammar_token_trie {
+    // nodes in preorder: the children of node i start at i + 1, and the subtree of a child ends at
+    // node_end[child], where its next sibling starts
+    std::vector<uint32_t> node_chr;
+    std::vector<uint32_t> node_end;
+
+    // tokens whose piece ends at node i are tokens[node_tok[i], node_tok[i + 1])
+    std::vector<uint32_t>    node_tok;
+    std::vector<llama_token> tokens;
+
+    // tokens ending in an incomplete UTF-8 sequence (byte fallback); these are checked per token
+    std::vector<uint8_t> is_partial;
+
+    explicit llama_grammar_token_trie(const llama_vocab & vocab);
+};
+
+// allowed-token bitmasks of recently visited grammar states, keyed by the exact set of stacks; shared
+// by the clones of a grammar, which also share its rules
+struct llama_grammar_mask_cache {
+    struct entry {
+        std::vector<uint64_t>                        stacks;
+        std::shared_ptr<const std::vector<uint32_t>> mask;
+        uint64_t                                     last_use = 0;
+    };
+
+    std::mutex                          mutex;
+    std::unordered_map<uint64_t, entry> entries;
+    uint64_t                            n_uses = 0;
+};
+
 struct llama_grammar {
     // note: allow null vocab for testing (not great)
     const llama_vocab * vocab;
 
-    const llama_grammar_rules  rules;  // TODO: shared ptr
-          llama_grammar_stacks stacks;
+    // immutable once parsed and shared by all clones, so stack elements stay valid across them
+    std::shared_ptr<const llama_grammar_rules> rules;
+    llama_grammar_stacks                       stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
@@ -132,6 +168,21 @@ struct llama_grammar {
                              trigger_patterns;         // Regular expressions that trigger a lazy grammar. Must be a full match of the entire generated
                                                        // string, and the grammar will be given the string from the first match group onwards.
 
+    std::shared_ptr<llama_grammar_mask_cache> masks = std::make_shared<llama_grammar_mask_cache>();
+};
+
+// parsed grammars of a vocab, so requests repeating a grammar (e.g. the same tool schemas) get a
+// copy of it without parsing, compiling trigger patterns or building token masks again
+struct llama_grammar_cache {
+    struct entry {
+        std::string                          key;
+        std::unique_ptr<const llama_grammar> grammar;
+        uint64_t                             last_use = 0;
+    };
+
+    std::mutex         mutex;
+    std::vector<entry> entries;
+    uint64_t           n_uses = 0;
 };
 
 //
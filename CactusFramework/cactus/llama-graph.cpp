@@ -5,9 +5,13 @@
 #include "llama-cparams.h"
 #include "llama-kv-cache.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cinttypes>
 #include <cmath>
 #include <cstring>
+#include <map>
+#include <mutex>
 
 void llm_graph_input_embd::set_input(const llama_ubatch * ubatch) {
     if (ubatch->token) {
@@ -122,6 +126,77 @@ void llm_graph_input_out_ids::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+std::vector<llama_adapter_lora *> llm_graph_input_lora_seq::used(const llama_adapter_loras_seq * loras_seq, const llama_ubatch & ubatch) {
+    std::vector<llama_adapter_lora *> adapters;
+    if (loras_seq == nullptr || loras_seq->empty() || ubatch.seq_id == nullptr) {
+        return adapters;
+    }
+
+    for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
+        const auto it = loras_seq->find(ubatch.seq_id[s][0]);
+        if (it == loras_seq->end()) {
+            continue;
+        }
+        for (const auto & lora : it->second) {
+            if (std::find(adapters.begin(), adapters.end(), lora.first) == adapters.end()) {
+                adapters.push_back(lora.first);
+            }
+        }
+    }
+
+    // unordered_map iteration differs between sequences, keep the graph (and its reuse key) stable
+    std::sort(adapters.begin(), adapters.end());
+
+    return adapters;
+}
+
+void llm_graph_input_lora_seq::set_input(const llama_ubatch * ubatch) {
+    const int64_t n_tokens     = ubatch->n_tokens;
+    const int64_t n_seq_tokens = ubatch->n_seq_tokens;
+    const int64_t n_seqs       = ubatch->n_seqs;
+
+    std::vector<float> data(n_tokens);
+    std::vector<float> data_out;
+
+    for (size_t i = 0; i < adapters.size(); ++i) {
+        for (int64_t s = 0; s < n_seqs; ++s) {
+            const auto it = loras_seq->find(ubatch->seq_id[s][0]);
+            float scale = 0.0f;
+            if (it != loras_seq->end()) {
+                const auto pos = it->second.find(adapters[i]);
+                if (pos != it->second.end()) {
+                    scale = pos->second;
+                }
+            }
+            for (int64_t j = 0; j < n_seq_tokens; ++j) {
+                data[s*n_seq_tokens + j] = scale;
+            }
+        }
+
+        if (tok_scale[i]) {
+            lm_ggml_backend_tensor_set(tok_scale[i], data.data(), 0, n_tokens*sizeof(float));
+        }
+
+        // same rows, in the same order, as llm_graph_input_out_ids
+        if (out_scale[i]) {
+            data_out.clear();
+            if (n_outputs == n_tokens) {
+                data_out = data;
+            } else if (ubatch->output) {
+                for (int64_t t = 0; t < n_tokens; ++t) {
+                    if (ubatch->output[t]) {
+                        data_out.push_back(data[t]);
+                    }
+                }
+            } else if (n_outputs == 1) {
+                data_out.push_back(data[n_tokens - 1]);
+            }
+            LM_GGML_ASSERT((int32_t) data_out.size() == n_outputs);
+            lm_ggml_backend_tensor_set(out_scale[i], data_out.data(), 0, n_outputs*sizeof(float));
+        }
+    }
+}
+
 void llm_graph_input_mean::set_input(const llama_ubatch * ubatch) {
     if (cparams.embeddings && cparams.pooling_type == LLAMA_POOLING_TYPE_MEAN) {
         const int64_t n_tokens     = ubatch->n_tokens;
@@ -231,6 +306,54 @@ void llm_graph_input_cls::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+// The basis only depends on the transform size, so it is built once per process; the envelope is
+// that of an utterance of n_tokens frames, trimmed like the audio
+void llm_graph_input_istft::set_input(const llama_ubatch * ubatch) {
+    static std::mutex basis_mutex;
+    static std::map<std::pair<int64_t, int64_t>, std::vector<float>> basis_cache;
+
+    const int64_t n_tokens = ubatch->n_tokens;
+    const int64_t n_bins   = n_fft/2 + 1;
+    const int64_t n_pad    = (n_fft - n_hop)/2;
+
+    std::vector<float> hann(n_fft);
+    for (int64_t j = 0; j < n_fft; ++j) {
+        hann[j] = 0.5 * (1.0 - cosf((2.0 * M_PI * j) / n_fft));
+    }
+
+    if (basis) {
+        std::lock_guard<std::mutex> lock(basis_mutex);
+        std::vector<float> & data = basis_cache[std::make_pair(n_fft, n_spec)];
+        if (data.empty()) {
+            // out[j] = hann[j] * Re(sum_{k<=n/2} X[k] e^{+2*pi*i*j*k/n}) / (n/2 + 1), real parts then imaginary
+            data.assign(n_spec*n_fft, 0.0f);
+            for (int64_t j = 0; j < n_fft; ++j) {
+                float * row = data.data() + j*n_spec;
+                for (int64_t k = 0; k < n_bins; ++k) {
+                    const double angle = 2.0 * M_PI * (double) ((j*k) % n_fft) / n_fft;
+                    row[k]          =  (float) (hann[j] * cos(angle) / n_bins);
+                    row[n_bins + k] = -(float) (hann[j] * sin(angle) / n_bins);
+                }
+            }
+        }
+        lm_ggml_backend_tensor_set(basis, data.data(), 0, lm_ggml_nbytes(basis));
+    }
+
+    if (inv_env) {
+        std::vector<float> env(n_tokens*n_hop, 0.0f);
+        for (int64_t l = 0; l < n_tokens; ++l) {
+            const int64_t at = l*n_hop - n_pad;
+            for (int64_t j = std::max<int64_t>(0, -at); j < n_fft && at + j < (int64_t) env.size(); ++j) {
+                env[at + j] += hann[j] * hann[j];
+            }
+        }
+        for (auto & e : env) {
+            e = 1.0f / e;
+        }
+        lm_ggml_backend_tensor_set(inv_env, env.data(), 0, lm_ggml_nbytes(inv_env));
+    }
+}
+
 void llm_graph_input_s_copy::set_input(const llama_ubatch * ubatch) {
     LM_GGML_UNUSED(ubatch);
 
@@ -409,6 +532,23 @@ void llm_graph_input_attn_cross::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+//
+// llm_graph_result
+//
+
+void llm_graph_result::update_kv_stores() {
+    for (const auto & store : kv_stores) {
+        const size_t offs = store.kv->get_store_offset(store.il, store.v);
+
+        // lm_ggml_cpy returns a view of the destination view, both alias the cache tensor
+        for (lm_ggml_tensor * t : { store.cpy->src[1], store.cpy }) {
+            LM_GGML_ASSERT(t->view_src != nullptr && t->view_src->data != nullptr);
+            t->view_offs = offs;
+            t->data      = (char *) t->view_src->data + offs;
+        }
+    }
+}
+
 //
 // llm_graph_context
 //
@@ -448,9 +588,11 @@ llm_graph_context::llm_graph_context(const llm_graph_params & params) :
     backend_cpu      (params.backend_cpu),
     cvec             (params.cvec),
     loras            (params.loras),
+    loras_seq        (params.loras_seq),
     memory           (params.memory),
     cross            (params.cross),
     cb_func          (params.cb),
+    loras_seq_used   (llm_graph_input_lora_seq::used(params.loras_seq, params.ubatch)),
     res              (std::make_unique<llm_graph_result>()) {
     }
 
@@ -464,6 +606,11 @@ void llm_graph_context::cb(lm_ggml_tensor * cur, const char * name, int il) cons
     }
 }
 
+bool llm_graph_context::layer_skipped(int il) const {
+    // the last layer selects the output rows, the first one takes the embeddings
+    return il > 0 && il < n_layer - 1 && il < (int) cparams.layer_skip.size() && cparams.layer_skip[il];
+}
+
 lm_ggml_tensor * llm_graph_context::build_cvec(
          lm_ggml_tensor * cur,
                  int   il) const {
@@ -493,9 +640,65 @@ lm_ggml_tensor * llm_graph_context::build_lora_mm(
         res = lm_ggml_add(ctx0, res, ab_cur);
     }
 
+    for (size_t i = 0; i < loras_seq_used.size(); ++i) {
+        llama_adapter_lora * lora = loras_seq_used[i];
+        llama_adapter_lora_weight * lw = lora->get_weight(w);
+        if (lw == nullptr) {
+            continue;
+        }
+
+        lm_ggml_tensor * ab_cur = lm_ggml_mul_mat(
+                ctx0, lw->b,
+                lm_ggml_mul_mat(ctx0, lw->a, cur)
+                );
+
+        ab_cur = build_lora_seq_scale(ab_cur, i, lw->get_scale(lora->alpha, 1.0f));
+        res = lm_ggml_add(ctx0, res, ab_cur);
+    }
+
     return res;
 }
 
+lm_ggml_tensor * llm_graph_context::build_lora_seq_scale(
+          lm_ggml_tensor * delta,
+                  size_t   i,
+                   float   scale) const {
+    if (inp_lora_seq == nullptr) {
+        auto inp = std::make_unique<llm_graph_input_lora_seq>(loras_seq, loras_seq_used, n_outputs);
+        inp->tok_scale.assign(loras_seq_used.size(), nullptr);
+        inp->out_scale.assign(loras_seq_used.size(), nullptr);
+        inp_lora_seq = (llm_graph_input_lora_seq *) res->add_input(std::move(inp));
+    }
+
+    // only scales a weight of the graph uses are created, the others would never be allocated
+    auto get_scale = [&](std::vector<lm_ggml_tensor *> & scales, int64_t n_rows) {
+        if (scales[i] == nullptr) {
+            scales[i] = lm_ggml_new_tensor_2d(ctx0, LM_GGML_TYPE_F32, 1, n_rows);
+            lm_ggml_set_input(scales[i]);
+        }
+        return scales[i];
+    };
+
+    lm_ggml_tensor * mask = nullptr;
+    if (delta->ne[1] == n_tokens && delta->ne[2] == 1 && delta->ne[3] == 1) {
+        mask = get_scale(inp_lora_seq->tok_scale, n_tokens);
+    } else if (delta->ne[2] == n_tokens && delta->ne[3] == 1) {
+        // e.g. [n_out, n_expert_used, n_tokens] of mul_mat_id
+        mask = lm_ggml_reshape_3d(ctx0, get_scale(inp_lora_seq->tok_scale, n_tokens), 1, 1, n_tokens);
+    } else if (delta->ne[1] == n_outputs && delta->ne[2] == 1 && delta->ne[3] == 1) {
+        mask = get_scale(inp_lora_seq->out_scale, n_outputs);
+    } else {
+        LM_GGML_ABORT("per-sequence lora delta [%" PRId64 ", %" PRId64 ", %" PRId64 "] has no token dimension",
+                delta->ne[0], delta->ne[1], delta->ne[2]);
+    }
+
+    delta = lm_ggml_mul(ctx0, delta, mask);
+    if (scale != 1.0f) {
+        delta = lm_ggml_scale(ctx0, delta, scale);
+    }
+    return delta;
+}
+
 lm_ggml_tensor * llm_graph_context::build_lora_mm_id(
           lm_ggml_tensor * w,   // lm_ggml_tensor * as
           lm_ggml_tensor * cur, // lm_ggml_tensor * b
@@ -521,6 +724,26 @@ lm_ggml_tensor * llm_graph_context::build_lora_mm_id(
         res = lm_ggml_add(ctx0, res, ab_cur);
     }
 
+    for (size_t i = 0; i < loras_seq_used.size(); ++i) {
+        llama_adapter_lora * lora = loras_seq_used[i];
+        llama_adapter_lora_weight * lw = lora->get_weight(w);
+        if (lw == nullptr) {
+            continue;
+        }
+
+        const float rank  = (float) lw->b->ne[0];
+        const float scale = lora->alpha ? lora->alpha / rank : 1.0f;
+
+        lm_ggml_tensor * ab_cur = lm_ggml_mul_mat_id(
+                ctx0, lw->b,
+                lm_ggml_mul_mat_id(ctx0, lw->a, cur, ids),
+                ids
+                );
+
+        ab_cur = build_lora_seq_scale(ab_cur, i, scale);
+        res = lm_ggml_add(ctx0, res, ab_cur);
+    }
+
     return res;
 }
 
@@ -646,12 +869,14 @@ lm_ggml_tensor * llm_graph_context::build_ffn(
         case LLM_FFN_SWIGLU:
             {
                 // Project to 4h. If using swiglu double the output width, see https://arxiv.org/pdf/2002.05202.pdf
+                // SiLU runs over the whole contiguous projection and the multiply reads both halves as strided
+                // views, which takes two kernels instead of copying each half out first
                 int64_t split_point = cur->ne[0] / 2;
-                lm_ggml_tensor * x0 = lm_ggml_cont(ctx0, lm_ggml_view_2d(ctx0, cur, split_point, cur->ne[1], cur->nb[1], 0));
-                lm_ggml_tensor * x1 = lm_ggml_cont(ctx0, lm_ggml_view_2d(ctx0, cur, split_point, cur->ne[1], cur->nb[1], split_point * lm_ggml_element_size(cur)));
+                lm_ggml_tensor * act = lm_ggml_silu(ctx0, cur);
+                cb(act, "ffn_silu", il);
 
-                x0 = lm_ggml_silu(ctx0, x0);
-                cb(cur, "ffn_silu", il);
+                lm_ggml_tensor * x0 = lm_ggml_view_2d(ctx0, act, split_point, cur->ne[1], act->nb[1], 0);
+                lm_ggml_tensor * x1 = lm_ggml_view_2d(ctx0, cur, split_point, cur->ne[1], cur->nb[1], split_point * lm_ggml_element_size(cur));
 
                 cur = lm_ggml_mul(ctx0, x0, x1);
                 cb(cur, "ffn_mul", il);
@@ -868,6 +1093,21 @@ lm_ggml_tensor * llm_graph_context::build_inp_embd(lm_ggml_tensor * tok_embd) co
 
             cur = lm_ggml_add(ctx0, cur, inpL_delta);
         }
+
+        for (size_t i = 0; i < loras_seq_used.size(); ++i) {
+            llama_adapter_lora * lora = loras_seq_used[i];
+            llama_adapter_lora_weight * lw = lora->get_weight(tok_embd);
+            if (lw == nullptr) {
+                continue;
+            }
+
+            lm_ggml_tensor * inpL_delta = lm_ggml_mul_mat(
+                        ctx0, lw->b, // non-transposed lora_b
+                        lm_ggml_get_rows(ctx0, lw->a, inp->tokens)
+                        );
+
+            cur = lm_ggml_add(ctx0, cur, build_lora_seq_scale(inpL_delta, i, lw->get_scale(lora->alpha, 1.0f)));
+        }
     } else {
         inp->embd = lm_ggml_new_tensor_2d(ctx0, LM_GGML_TYPE_F32, n_embd, ubatch.n_tokens);
         lm_ggml_set_input(inp->embd);
@@ -1173,6 +1413,76 @@ lm_ggml_tensor * llm_graph_context::build_attn_mha(
     return cur;
 }
 
+lm_ggml_tensor * llm_graph_context::build_attn_mha_tiered(
+         lm_ggml_cgraph * gf,
+         lm_ggml_tensor * q,
+         lm_ggml_tensor * k_cold,
+         lm_ggml_tensor * v_cold,
+         lm_ggml_tensor * k,
+         lm_ggml_tensor * v,
+         lm_ggml_tensor * kq_b,
+         lm_ggml_tensor * kq_mask,
+         lm_ggml_tensor * v_mla,
+             float     kq_scale) const {
+    LM_GGML_ASSERT(kq_b == nullptr && "the tiered KV cache does not support KQ bias");
+
+    q      = lm_ggml_permute(ctx0, q,      0, 2, 1, 3);
+    k_cold = lm_ggml_permute(ctx0, k_cold, 0, 2, 1, 3);
+    v_cold = lm_ggml_permute(ctx0, v_cold, 0, 2, 1, 3);
+    k      = lm_ggml_permute(ctx0, k,      0, 2, 1, 3);
+    v      = lm_ggml_permute(ctx0, v,      0, 2, 1, 3);
+
+    const auto n_tokens = q->ne[1];
+    const auto n_head   = q->ne[2];
+    const auto n_cold   = k_cold->ne[1];
+
+    // the scores of both tiers are joined so that one softmax with the full KQ mask covers them
+    lm_ggml_tensor * kq_c = lm_ggml_mul_mat(ctx0, k_cold, q);
+    lm_ggml_mul_mat_set_prec(kq_c, LM_GGML_PREC_F32);
+
+    lm_ggml_tensor * kq_h = lm_ggml_mul_mat(ctx0, k, q);
+    lm_ggml_mul_mat_set_prec(kq_h, LM_GGML_PREC_F32);
+
+    lm_ggml_tensor * kq = lm_ggml_concat(ctx0, kq_c, kq_h, 0);
+
+    if (arch == LLM_ARCH_GROK) {
+        kq = lm_ggml_tanh(ctx0, lm_ggml_scale(ctx0, kq, 0.08838834764831845f/30.0f));
+        kq = lm_ggml_scale(ctx0, kq, 30);
+    }
+
+    if (hparams.attn_soft_cap) {
+        kq = lm_ggml_scale(ctx0, kq, 1.0f / hparams.f_attn_logit_softcapping);
+        kq = lm_ggml_tanh (ctx0, kq);
+        kq = lm_ggml_scale(ctx0, kq, hparams.f_attn_logit_softcapping);
+    }
+
+    kq = lm_ggml_soft_max_ext(ctx0, kq, kq_mask, kq_scale, hparams.f_max_alibi_bias);
+
+    lm_ggml_tensor * kq_pc = lm_ggml_view_3d(ctx0, kq, n_cold,           n_tokens, n_head, kq->nb[1], kq->nb[2], 0);
+    lm_ggml_tensor * kq_ph = lm_ggml_view_3d(ctx0, kq, kq->ne[0] - n_cold, n_tokens, n_head, kq->nb[1], kq->nb[2], n_cold*kq->nb[0]);
+
+    lm_ggml_tensor * kqv = lm_ggml_add(ctx0,
+            lm_ggml_mul_mat(ctx0, v_cold, kq_pc),
+            lm_ggml_mul_mat(ctx0, v,      kq_ph));
+
+    if (v_mla) {
+        kqv = lm_ggml_mul_mat(ctx0, v_mla, kqv);
+    }
+
+    lm_ggml_tensor * cur = lm_ggml_permute(ctx0, kqv, 0, 2, 1, 3);
+
+    cur = lm_ggml_cont_2d(ctx0, cur, cur->ne[0]*n_head, n_tokens);
+
+    if (!cparams.offload_kqv) {
+        // all nodes between the KV store and the attention output are run on the CPU
+        lm_ggml_backend_sched_set_tensor_backend(sched, cur, backend_cpu);
+    }
+
+    lm_ggml_build_forward_expand(gf, cur);
+
+    return cur;
+}
+
 llm_graph_input_attn_no_cache * llm_graph_context::build_attn_inp_no_cache() const {
     auto inp = std::make_unique<llm_graph_input_attn_no_cache>(hparams, cparams);
 
@@ -1272,8 +1582,12 @@ lm_ggml_tensor * llm_graph_context::build_attn(
 
     // store to KV cache
     {
-        lm_ggml_build_forward_expand(gf, kv_self->cpy_k(ctx0, k_cur, il));
-        lm_ggml_build_forward_expand(gf, kv_self->cpy_v(ctx0, v_cur, il));
+        lm_ggml_tensor * k_cpy = kv_self->cpy_k(ctx0, k_cur, il);
+        lm_ggml_tensor * v_cpy = kv_self->cpy_v(ctx0, v_cur, il);
+        res->add_kv_store(k_cpy, kv_self, il, false);
+        res->add_kv_store(v_cpy, kv_self, il, true);
+        lm_ggml_build_forward_expand(gf, k_cpy);
+        lm_ggml_build_forward_expand(gf, v_cpy);
     }
 
     const auto & kq_mask = inp->get_kq_mask();
@@ -1282,7 +1596,13 @@ lm_ggml_tensor * llm_graph_context::build_attn(
     lm_ggml_tensor * k = kv_self->get_k(ctx0, il);
     lm_ggml_tensor * v = kv_self->get_v(ctx0, il);
 
-    lm_ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, kq_scale);
+    // the older cells of a tiered cache are read from their requantized tier
+    lm_ggml_tensor * k_cold = kv_self->get_k_cold(ctx0, il);
+    lm_ggml_tensor * v_cold = kv_self->get_v_cold(ctx0, il);
+
+    lm_ggml_tensor * cur = k_cold
+        ? build_attn_mha_tiered(gf, q, k_cold, v_cold, k, v, kq_b, kq_mask, v_mla, kq_scale)
+        : build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, kq_scale);
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1352,8 +1672,12 @@ lm_ggml_tensor * llm_graph_context::build_attn(
 
     // store to KV cache
     {
-        lm_ggml_build_forward_expand(gf, kv->cpy_k(ctx0, k_cur, il));
-        lm_ggml_build_forward_expand(gf, kv->cpy_v(ctx0, v_cur, il));
+        lm_ggml_tensor * k_cpy = kv->cpy_k(ctx0, k_cur, il);
+        lm_ggml_tensor * v_cpy = kv->cpy_v(ctx0, v_cur, il);
+        res->add_kv_store(k_cpy, kv, il, false);
+        res->add_kv_store(v_cpy, kv, il, true);
+        lm_ggml_build_forward_expand(gf, k_cpy);
+        lm_ggml_build_forward_expand(gf, v_cpy);
     }
 
     const auto & kq_mask = is_swa ? inp->get_kq_mask_swa() : inp->get_kq_mask();
@@ -1584,12 +1908,78 @@ void llm_graph_context::build_pooling(
             }
     }
 
+    // the pooled rows leave the device normalized, rerank scores are left alone
+    if (cparams.embd_normalize && pooling_type != LLAMA_POOLING_TYPE_NONE && pooling_type != LLAMA_POOLING_TYPE_RANK) {
+        cur = lm_ggml_l2_norm(ctx0, cur, 1e-12f);
+    }
+
     cb(cur, "result_embd_pooled", -1);
     res->t_embd_pooled = cur;
 
     lm_ggml_build_forward_expand(gf, cur);
 }
 
+lm_ggml_tensor * llm_graph_context::build_istft(
+         lm_ggml_tensor * cur,
+             int64_t   n_fft,
+             int64_t   n_hop) const {
+    const int64_t n_bins = n_fft/2 + 1;
+    const int64_t n_pad  = (n_fft - n_hop)/2;
+    // the Metal matrix-matrix kernels need the reduced dimension in multiples of 32
+    const int64_t n_spec = LM_GGML_PAD(2*n_bins, 32);
+
+    LM_GGML_ASSERT(cur->ne[0] == 2*n_bins);
+    LM_GGML_ASSERT(n_fft == 4*n_hop && "overlap-add assumes frames of four hops");
+
+    auto inp = std::make_unique<llm_graph_input_istft>(n_fft, n_hop, n_spec);
+
+    inp->basis = lm_ggml_new_tensor_2d(ctx0, LM_GGML_TYPE_F32, n_spec, n_fft);
+    lm_ggml_set_input(inp->basis);
+
+    inp->inv_env = lm_ggml_new_tensor_1d(ctx0, LM_GGML_TYPE_F32, n_hop*n_tokens);
+    lm_ggml_set_input(inp->inv_env);
+
+    lm_ggml_tensor * basis   = inp->basis;
+    lm_ggml_tensor * inv_env = inp->inv_env;
+
+    res->add_input(std::move(inp));
+
+    lm_ggml_tensor * mag = lm_ggml_cont(ctx0, lm_ggml_view_2d(ctx0, cur, n_bins, n_tokens, cur->nb[1], 0));
+    lm_ggml_tensor * phi = lm_ggml_cont(ctx0, lm_ggml_view_2d(ctx0, cur, n_bins, n_tokens, cur->nb[1], n_bins*lm_ggml_element_size(cur)));
+
+    // min(exp(mag), 1e2) as exp(min(mag, ln(1e2))); Metal has no exp, so e^x = sigmoid(x)/sigmoid(-x)
+    mag = lm_ggml_clamp(ctx0, mag, -INFINITY, logf(1e2f));
+    mag = lm_ggml_div(ctx0, lm_ggml_sigmoid(ctx0, mag), lm_ggml_sigmoid(ctx0, lm_ggml_neg(ctx0, mag)));
+
+    cur = lm_ggml_concat(ctx0,
+            lm_ggml_mul(ctx0, mag, lm_ggml_cos(ctx0, phi)),
+            lm_ggml_mul(ctx0, mag, lm_ggml_sin(ctx0, phi)), 0);
+    cur = lm_ggml_pad(ctx0, cur, n_spec - 2*n_bins, 0, 0, 0);
+    cb(cur, "istft_spec", -1);
+
+    // inverse transform and window in one product: [n_fft, n_tokens]
+    lm_ggml_tensor * frames = lm_ggml_mul_mat(ctx0, basis, cur);
+    cb(frames, "istft_frames", -1);
+
+    // overlap-add: quarter b of frame l lands on hop l + b
+    cur = lm_ggml_pad(ctx0, lm_ggml_view_2d(ctx0, frames, n_hop, n_tokens, frames->nb[1], 0), 0, 3, 0, 0);
+    for (int64_t b = 1; b < 4; ++b) {
+        lm_ggml_tensor * quarter = lm_ggml_cont(ctx0,
+                lm_ggml_view_2d(ctx0, frames, n_hop, n_tokens, frames->nb[1], b*n_hop*lm_ggml_element_size(frames)));
+        cur = lm_ggml_acc_inplace(ctx0, cur, quarter, cur->nb[1], cur->nb[2], cur->nb[3], b*cur->nb[1]);
+    }
+
+    // the utterance starts n_pad into the first frame
+    cur = lm_ggml_view_1d(ctx0, cur, n_hop*n_tokens, n_pad*lm_ggml_element_size(cur));
+    cur = lm_ggml_mul(ctx0, cur, inv_env);
+    cb(cur, "istft_audio", -1);
+
+    // the samples lead the output, which keeps n_embd floats per token for the embedding readback
+    cur = lm_ggml_pad(ctx0, cur, (2*n_bins - n_hop)*n_tokens, 0, 0, 0);
+
+    return lm_ggml_reshape_2d(ctx0, cur, 2*n_bins, n_tokens);
+}
+
 int32_t llama_relative_position_bucket(llama_pos x, llama_pos y, uint64_t n_buckets, bool bidirectional) {
     // TODO move to hparams if a T5 variant appears that uses a different value
     const int64_t max_distance = 128;
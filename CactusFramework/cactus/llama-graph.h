@@ -186,6 +186,22 @@ public:
     const llama_cparams & cparams;
 };
 
+// windowed inverse DFT basis and inverse window envelope of the WavTokenizer ISTFT
+class llm_graph_input_istft : public llm_graph_input_i {
+public:
+    llm_graph_input_istft(int64_t n_fft, int64_t n_hop, int64_t n_spec) : n_fft(n_fft), n_hop(n_hop), n_spec(n_spec) {}
+    virtual ~llm_graph_input_istft() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    lm_ggml_tensor * basis   = nullptr; // F32 [n_spec, n_fft]
+    lm_ggml_tensor * inv_env = nullptr; // F32 [n_hop*n_batch]
+
+    const int64_t n_fft;
+    const int64_t n_hop;
+    const int64_t n_spec; // rows of the spectrum, n_fft + 2 padded for the matrix kernels
+};
+
 class llm_graph_input_s_copy : public llm_graph_input_i {
 public:
     llm_graph_input_s_copy(const llama_kv_cache_recurrent * kv_self) : kv_self(kv_self) {}
@@ -223,6 +239,30 @@ public:
     const llama_cross * cross;
 };
 
+// per-token scales of the per-sequence adapters used by the ubatch: a token's scale is the one set
+// for its (first) sequence, 0 when that sequence does not use the adapter
+class llm_graph_input_lora_seq : public llm_graph_input_i {
+public:
+    llm_graph_input_lora_seq(
+            const llama_adapter_loras_seq * loras_seq,
+            std::vector<llama_adapter_lora *> adapters,
+            int32_t n_outputs) : loras_seq(loras_seq), adapters(std::move(adapters)), n_outputs(n_outputs) {}
+    virtual ~llm_graph_input_lora_seq() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    // adapters set on the sequences of ubatch, in order of first use
+    static std::vector<llama_adapter_lora *> used(const llama_adapter_loras_seq * loras_seq, const llama_ubatch & ubatch);
+
+    std::vector<lm_ggml_tensor *> tok_scale; // F32 [1, n_batch] per adapter
+    std::vector<lm_ggml_tensor *> out_scale; // F32 [1, n_outputs] per adapter, the rows kept by out_ids
+
+    const llama_adapter_loras_seq * loras_seq;
+    const std::vector<llama_adapter_lora *> adapters;
+
+    const int32_t n_outputs;
+};
+
 class llm_graph_input_attn_no_cache : public llm_graph_input_i {
 public:
     llm_graph_input_attn_no_cache(const llama_hparams & hparams, const llama_cparams & cparams) :
@@ -330,6 +370,9 @@ public:
     virtual lm_ggml_tensor * get_embd_pooled() = 0;
 
     virtual void set_inputs(const llama_ubatch * ubatch) = 0;
+
+    // point the KV cache stores of a reused graph at the current head of their cache
+    virtual void update_kv_stores() = 0;
 };
 
 using llm_graph_result_ptr = std::unique_ptr<llm_graph_result_i>;
@@ -355,6 +398,12 @@ public:
         return inputs.back().get();
     }
 
+    void update_kv_stores() override;
+
+    void add_kv_store(lm_ggml_tensor * cpy, const llama_kv_cache_unified * kv, int32_t il, bool v) {
+        kv_stores.push_back({ cpy, kv, il, v });
+    }
+
     // important graph nodes
     lm_ggml_tensor * t_tokens      = nullptr;
     lm_ggml_tensor * t_logits      = nullptr;
@@ -362,6 +411,16 @@ public:
     lm_ggml_tensor * t_embd_pooled = nullptr;
 
     std::vector<llm_graph_input_ptr> inputs;
+
+    // the K/V copies into the cache, the only nodes whose placement depends on the cache head
+    struct kv_store {
+        lm_ggml_tensor * cpy;
+        const llama_kv_cache_unified * kv;
+        int32_t il;
+        bool    v;
+    };
+
+    std::vector<kv_store> kv_stores;
 };
 
 //
@@ -385,6 +444,7 @@ struct llm_graph_params {
 
     const llama_adapter_cvec  * cvec;
     const llama_adapter_loras * loras;
+    const llama_adapter_loras_seq * loras_seq;
     const llama_memory_i      * memory;
     const llama_cross         * cross;
 
@@ -437,11 +497,16 @@ struct llm_graph_context {
 
     const llama_adapter_cvec  * cvec;
     const llama_adapter_loras * loras;
+    const llama_adapter_loras_seq * loras_seq;
     const llama_memory_i      * memory;
     const llama_cross         * cross;
 
     const llm_graph_cb & cb_func;
 
+    // per-sequence adapters of this ubatch, their input is created by the first weight they apply to
+    const std::vector<llama_adapter_lora *> loras_seq_used;
+    mutable llm_graph_input_lora_seq * inp_lora_seq = nullptr;
+
     std::unique_ptr<llm_graph_result> res;
 
     llm_graph_context(const llm_graph_params & params);
@@ -450,6 +515,9 @@ struct llm_graph_context {
 
     void cb(lm_ggml_tensor * cur, const char * name, int il) const;
 
+    // layer il is left out of this graph, its residual stream passes through unchanged
+    bool layer_skipped(int il) const;
+
     //
     // common
     //
@@ -469,6 +537,13 @@ struct llm_graph_context {
               lm_ggml_tensor * cur, // lm_ggml_tensor * b
               lm_ggml_tensor * ids) const;
 
+    // delta of the i-th per-sequence adapter, masked and scaled per token; the token dimension is
+    // the one of length n_tokens (or n_outputs, after out_ids)
+    lm_ggml_tensor * build_lora_seq_scale(
+              lm_ggml_tensor * delta,
+                      size_t   i,
+                       float   scale) const;
+
     lm_ggml_tensor * build_norm(
              lm_ggml_tensor * cur,
              lm_ggml_tensor * mw,
@@ -540,6 +615,19 @@ struct llm_graph_context {
              lm_ggml_tensor * v_mla,   // [n_embd_head_v_mla, n_embd_head_v, n_head_v]
                    float   kq_scale) const;
 
+    // attention over a tiered KV cache: the cold cells are the first columns of kq_mask
+    lm_ggml_tensor * build_attn_mha_tiered(
+             lm_ggml_cgraph * gf,
+             lm_ggml_tensor * q,       // [n_embd_head_q, n_head_q, n_tokens]
+             lm_ggml_tensor * k_cold,  // [n_embd_head_k, n_head_k, n_cold]
+             lm_ggml_tensor * v_cold,  // [n_cold, n_head_v, n_embd_head_v]
+             lm_ggml_tensor * k,       // [n_embd_head_k, n_head_k, n_hot]
+             lm_ggml_tensor * v,       // [n_hot, n_head_v, n_embd_head_v]
+             lm_ggml_tensor * kq_b,
+             lm_ggml_tensor * kq_mask,
+             lm_ggml_tensor * v_mla,
+                   float   kq_scale) const;
+
     llm_graph_input_attn_no_cache * build_attn_inp_no_cache() const;
 
     lm_ggml_tensor * build_attn(
@@ -634,6 +722,16 @@ struct llm_graph_context {
             lm_ggml_tensor * cls_b,
             lm_ggml_tensor * cls_out,
             lm_ggml_tensor * cls_out_b) const;
+
+    //
+    // audio
+    //
+
+    // log-magnitude and phase rows [n_fft + 2, n_tokens] to PCM, n_hop samples per token
+    lm_ggml_tensor * build_istft(
+             lm_ggml_tensor * cur,
+                 int64_t   n_fft,
+                 int64_t   n_hop) const;
 };
 
 // TODO: better name
@@ -9,6 +9,7 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstring>
 #include <limits>
 #include <map>
 #include <stdexcept>
@@ -33,11 +34,28 @@ llama_kv_cache_unified::llama_kv_cache_unified(
                  uint32_t    n_seq_max,
                  uint32_t    n_pad,
                  uint32_t    n_swa,
-           llama_swa_type    swa_type) :
+           llama_swa_type    swa_type,
+                 uint32_t    kv_size_hot) :
     model(model), hparams(model.hparams), v_trans(v_trans),
     n_seq_max(n_seq_max), n_pad(n_pad), n_swa(n_swa), swa_type(swa_type) {
 
     LM_GGML_ASSERT(kv_size % n_pad == 0);
+    LM_GGML_ASSERT(kv_size_hot % n_pad == 0);
+
+    // tiered: kv_size cells of type_k/type_v behind a ring of kv_size_hot F16 cells
+    const bool tiered = kv_size_hot > 0;
+
+    if (tiered) {
+        // the cold V rows run along the cells and are read by lm_ggml_mul_mat, so V has to be transposed
+        LM_GGML_ASSERT(v_trans && "the tiered KV cache requires a transposed V cache");
+
+        for (lm_ggml_type type : { type_k, type_v }) {
+            if (page_size % lm_ggml_blck_size(type) != 0 || lm_ggml_quantize_requires_imatrix(type) ||
+                (type != LM_GGML_TYPE_F32 && lm_ggml_get_type_traits(type)->to_float == nullptr)) {
+                throw std::runtime_error(format("KV cache type %s cannot back the tiered KV cache", lm_ggml_type_name(type)));
+            }
+        }
+    }
 
     // create a context for each buffer type
     std::map<lm_ggml_backend_buffer_type_t, lm_ggml_context *> ctx_map;
@@ -45,7 +63,7 @@ llama_kv_cache_unified::llama_kv_cache_unified(
         auto it = ctx_map.find(buft);
         if (it == ctx_map.end()) {
             lm_ggml_init_params params = {
-                /*.mem_size   =*/ size_t(2u*hparams.n_layer*lm_ggml_tensor_overhead()),
+                /*.mem_size   =*/ size_t((tiered ? 4u : 2u)*hparams.n_layer*lm_ggml_tensor_overhead()),
                 /*.mem_buffer =*/ NULL,
                 /*.no_alloc   =*/ true,
             };
@@ -64,11 +82,18 @@ llama_kv_cache_unified::llama_kv_cache_unified(
         return it->second;
     };
 
-    head = 0;
-    size = kv_size;
+    size_cold = tiered ? kv_size : 0;
+
+    const uint32_t size_hot = tiered ? kv_size_hot : kv_size;
+
+    head = size_cold;
+    size = size_cold + size_hot;
     used = 0;
 
-    cells.resize(kv_size);
+    hot_next = size_cold;
+
+    cells.resize(size);
+    pages.resize((size + page_size - 1)/page_size);
 
     for (uint32_t il = 0; il < hparams.n_layer; il++) {
         if (filter && !filter(il)) {
@@ -100,14 +125,25 @@ llama_kv_cache_unified::llama_kv_cache_unified(
         lm_ggml_tensor * k;
         lm_ggml_tensor * v;
 
-        k = lm_ggml_new_tensor_2d(ctx, type_k, n_embd_k_gqa, kv_size);
-        v = lm_ggml_new_tensor_2d(ctx, type_v, n_embd_v_gqa, kv_size);
+        k = lm_ggml_new_tensor_2d(ctx, tiered ? LM_GGML_TYPE_F16 : type_k, n_embd_k_gqa, size_hot);
+        v = lm_ggml_new_tensor_2d(ctx, tiered ? LM_GGML_TYPE_F16 : type_v, n_embd_v_gqa, size_hot);
 
         lm_ggml_format_name(k, "cache_k_l%d", il);
         lm_ggml_format_name(v, "cache_v_l%d", il);
 
+        lm_ggml_tensor * k_cold = nullptr;
+        lm_ggml_tensor * v_cold = nullptr;
+
+        if (tiered) {
+            k_cold = lm_ggml_new_tensor_2d(ctx, type_k, n_embd_k_gqa, size_cold);
+            v_cold = lm_ggml_new_tensor_2d(ctx, type_v, size_cold, n_embd_v_gqa);
+
+            lm_ggml_format_name(k_cold, "cache_k_cold_l%d", il);
+            lm_ggml_format_name(v_cold, "cache_v_cold_l%d", il);
+        }
+
         map_layer_ids[il] = layers.size();
-        layers.push_back({ il, k, v });
+        layers.push_back({ il, k, v, k_cold, v_cold });
     }
 
     // allocate tensors and initialize the buffers to avoid NaNs in the padding
@@ -119,6 +155,7 @@ llama_kv_cache_unified::llama_kv_cache_unified(
         if (!buf) {
             throw std::runtime_error("failed to allocate buffer for kv cache");
         }
+        lm_ggml_backend_buffer_set_category(buf, "kv_cache");
 
         LLAMA_LOG_INFO("%s: %10s KV buffer size = %8.2f MiB\n", __func__, lm_ggml_backend_buffer_name(buf), lm_ggml_backend_buffer_get_size(buf)/1024.0/1024.0);
 
@@ -134,18 +171,29 @@ llama_kv_cache_unified::llama_kv_cache_unified(
                 (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f), kv_size, (int) layers.size(), n_seq_max,
                 lm_ggml_type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f),
                 lm_ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
+
+        if (tiered) {
+            LLAMA_LOG_INFO("%s: tiered: %u cells as K (%s), V (%s) behind %u recent cells as F16\n", __func__,
+                    size_cold, lm_ggml_type_name(type_k), lm_ggml_type_name(type_v), size_hot);
+        }
     }
 }
 
 void llama_kv_cache_unified::clear() {
     for (uint32_t i = 0; i < size; ++i) {
-        cells[i].pos = -1;
-        cells[i].seq_id.clear();
+        cells.pos[i] = -1;
+        cells.seq_id[i].clear();
     }
 
-    head = 0;
+    for (auto & page : pages) {
+        page = kv_page();
+    }
+
+    head = size_cold;
     used = 0;
 
+    hot_next = size_cold;
+
     for (auto & buf : bufs) {
         lm_ggml_backend_buffer_clear(buf.get(), 0);
     }
@@ -162,29 +210,37 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
         p1 = std::numeric_limits<llama_pos>::max();
     }
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].pos >= p0 && cells[i].pos < p1) {
-            if (seq_id < 0) {
-                cells[i].seq_id.clear();
-            } else if (cells[i].has_seq_id(seq_id)) {
-                cells[i].seq_id.erase(seq_id);
-            } else {
-                continue;
-            }
+    for (uint32_t ip = 0; ip < pages.size(); ++ip) {
+        if (!page_has_seq(ip, seq_id)) {
+            continue;
+        }
 
-            if (cells[i].is_empty()) {
-                // keep count of the number of used cells
-                if (cells[i].pos >= 0) {
-                    used--;
+        for (uint32_t i = page_begin(ip); i < page_end(ip); ++i) {
+            if (cells.pos[i] >= p0 && cells.pos[i] < p1) {
+                if (seq_id < 0) {
+                    cells.seq_id[i].clear();
+                } else if (cells.has_seq_id(i, seq_id)) {
+                    cells.seq_id[i].erase(seq_id);
+                } else {
+                    continue;
                 }
 
-                cells[i].pos = -1;
+                if (cells.is_empty(i)) {
+                    // keep count of the number of used cells
+                    if (cells.pos[i] >= 0) {
+                        used--;
+                    }
 
-                if (new_head == size) {
-                    new_head = i;
+                    cells.pos[i] = -1;
+
+                    if (new_head == size) {
+                        new_head = i;
+                    }
                 }
             }
         }
+
+        page_sync(page_begin(ip), page_end(ip));
     }
 
     // If we freed up a slot, set head to it so searching can start there.
@@ -211,10 +267,20 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
     // otherwise, this is the KV of a Transformer-like model
     head = 0;
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id_src) && cells[i].pos >= p0 && cells[i].pos < p1) {
-            cells[i].seq_id.insert(seq_id_dst);
+    // the destination only gains a bit on the source's cells: both read the same K/V rows, and a cell
+    // is never written again once used, so the shared prefix needs no copy
+    for (uint32_t ip = 0; ip < pages.size(); ++ip) {
+        if (!page_has_seq(ip, seq_id_src)) {
+            continue;
         }
+
+        for (uint32_t i = page_begin(ip); i < page_end(ip); ++i) {
+            if (cells.has_seq_id(i, seq_id_src) && cells.pos[i] >= p0 && cells.pos[i] < p1) {
+                cells.seq_id[i].insert(seq_id_dst);
+            }
+        }
+
+        page_sync(page_begin(ip), page_end(ip));
     }
 }
 
@@ -222,23 +288,25 @@ void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
     uint32_t new_head = size;
 
     for (uint32_t i = 0; i < size; ++i) {
-        if (!cells[i].has_seq_id(seq_id)) {
-            if (cells[i].pos >= 0) {
+        if (!cells.has_seq_id(i, seq_id)) {
+            if (cells.pos[i] >= 0) {
                 used--;
             }
 
-            cells[i].pos = -1;
-            cells[i].seq_id.clear();
+            cells.pos[i] = -1;
+            cells.seq_id[i].clear();
 
             if (new_head == size){
                 new_head = i;
             }
         } else {
-            cells[i].seq_id.clear();
-            cells[i].seq_id.insert(seq_id);
+            cells.seq_id[i].clear();
+            cells.seq_id[i].insert(seq_id);
         }
     }
 
+    page_sync(0, size);
+
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != size && new_head < head) {
         head = new_head;
@@ -265,24 +333,32 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
         return;
     }
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id) && cells[i].pos >= p0 && cells[i].pos < p1) {
-            has_shift = true;
+    for (uint32_t ip = 0; ip < pages.size(); ++ip) {
+        if (!page_has_seq(ip, seq_id)) {
+            continue;
+        }
 
-            cells[i].pos   += delta;
-            cells[i].delta += delta;
+        for (uint32_t i = page_begin(ip); i < page_end(ip); ++i) {
+            if (cells.has_seq_id(i, seq_id) && cells.pos[i] >= p0 && cells.pos[i] < p1) {
+                has_shift = true;
 
-            if (cells[i].pos < 0) {
-                if (!cells[i].is_empty()) {
-                    used--;
-                }
-                cells[i].pos = -1;
-                cells[i].seq_id.clear();
-                if (new_head == size) {
-                    new_head = i;
+                cells.pos[i]   += delta;
+                cells.delta[i] += delta;
+
+                if (cells.pos[i] < 0) {
+                    if (!cells.is_empty(i)) {
+                        used--;
+                    }
+                    cells.pos[i] = -1;
+                    cells.seq_id[i].clear();
+                    if (new_head == size) {
+                        new_head = i;
+                    }
                 }
             }
         }
+
+        page_sync(page_begin(ip), page_end(ip));
     }
 
     // If we freed up a slot, set head to it so searching can start there.
@@ -308,14 +384,20 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
         return;
     }
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id) && cells[i].pos >= p0 && cells[i].pos < p1) {
-            has_shift = true;
+    for (uint32_t ip = 0; ip < pages.size(); ++ip) {
+        if (!page_has_seq(ip, seq_id)) {
+            continue;
+        }
 
-            {
-                llama_pos p_old = cells[i].pos;
-                cells[i].pos   /= d;
-                cells[i].delta += cells[i].pos - p_old;
+        for (uint32_t i = page_begin(ip); i < page_end(ip); ++i) {
+            if (cells.has_seq_id(i, seq_id) && cells.pos[i] >= p0 && cells.pos[i] < p1) {
+                has_shift = true;
+
+                {
+                    llama_pos p_old = cells.pos[i];
+                    cells.pos[i]   /= d;
+                    cells.delta[i] += cells.pos[i] - p_old;
+                }
             }
         }
     }
@@ -324,9 +406,15 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
 llama_pos llama_kv_cache_unified::seq_pos_min(llama_seq_id seq_id) const {
     llama_pos result = std::numeric_limits<llama_pos>::max();
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id)) {
-            result = std::min(result, cells[i].pos);
+    for (uint32_t ip = 0; ip < pages.size(); ++ip) {
+        if (!page_has_seq(ip, seq_id)) {
+            continue;
+        }
+
+        for (uint32_t i = page_begin(ip); i < page_end(ip); ++i) {
+            if (cells.has_seq_id(i, seq_id)) {
+                result = std::min(result, cells.pos[i]);
+            }
         }
     }
 
@@ -340,19 +428,38 @@ llama_pos llama_kv_cache_unified::seq_pos_min(llama_seq_id seq_id) const {
 llama_pos llama_kv_cache_unified::seq_pos_max(llama_seq_id seq_id) const {
     llama_pos result = -1;
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id)) {
-            result = std::max(result, cells[i].pos);
+    for (uint32_t ip = 0; ip < pages.size(); ++ip) {
+        if (!page_has_seq(ip, seq_id)) {
+            continue;
+        }
+
+        for (uint32_t i = page_begin(ip); i < page_end(ip); ++i) {
+            if (cells.has_seq_id(i, seq_id)) {
+                result = std::max(result, cells.pos[i]);
+            }
         }
     }
 
     return result;
 }
 
+void llama_kv_cache_unified::page_sync(uint32_t i0, uint32_t i1) {
+    for (uint32_t ip = i0/page_size; ip < pages.size() && page_begin(ip) < i1; ++ip) {
+        kv_page & page = pages[ip];
+
+        page = kv_page();
+
+        for (uint32_t i = page_begin(ip); i < page_end(ip); ++i) {
+            page.seq_id.bits |= cells.seq_id[i].bits;
+            page.used += !cells.is_empty(i);
+        }
+    }
+}
+
 void llama_kv_cache_unified::restore() {
     for (const auto & [id, cell] : recovery.cells) {
         // TODO: move to new `struct kv_cells`
-        const bool is_empty0 = cells[id].is_empty();
+        const bool is_empty0 = cells.is_empty(id);
         const bool is_empty1 = cell.is_empty();
 
         if (!is_empty0 && is_empty1) {
@@ -361,7 +468,9 @@ void llama_kv_cache_unified::restore() {
             used++;
         }
 
-        cells[id] = cell;
+        cells.set(id, cell);
+
+        page_sync(id, id + 1);
     }
 
     recovery.clear();
@@ -410,7 +519,7 @@ bool llama_kv_cache_unified::update(llama_context & lctx) {
             has_shift = false;
 
             for (uint32_t i = 0; i < size; ++i) {
-                cells[i].delta = 0;
+                cells.delta[i] = 0;
             }
         }
     }
@@ -418,7 +527,11 @@ bool llama_kv_cache_unified::update(llama_context & lctx) {
     if (do_defrag) {
         LLAMA_LOG_DEBUG("%s: defragmenting KV cache\n", __func__);
 
-        if (defrag_prepare(lctx.graph_max_nodes())) {
+        bool moved = false;
+
+        const uint32_t n_max_cells = defrag_info.forced ? 0 : lctx.get_cparams().defrag_max_cells;
+
+        if (defrag_prepare(lctx.graph_max_nodes(), n_max_cells)) {
             lm_ggml_backend_sched_reset(sched);
 
             auto * gf = lctx.graph_init();
@@ -432,15 +545,40 @@ bool llama_kv_cache_unified::update(llama_context & lctx) {
             lctx.graph_compute(gf, false);
 
             need_reserve = true;
+            moved        = true;
+
+            uint64_t row_bytes = 0;
+            for (const auto & layer : layers) {
+                row_bytes += lm_ggml_row_size(layer.k->type, layer.k->ne[0]) + lm_ggml_row_size(layer.v->type, layer.v->ne[0]);
+            }
+
+            defrag_info.n_steps++;
+            defrag_info.n_cells_moved += defrag_info.n_cells;
+            defrag_info.n_bytes_moved += defrag_info.n_cells*row_bytes;
         }
 
-        do_defrag = false;
+        // a bounded step leaves the remaining holes to the next updates
+        do_defrag = moved && defrag_info.partial;
+
+        if (!do_defrag) {
+            defrag_info.forced = false;
+        }
     }
 
     return need_reserve;
 }
 
 void llama_kv_cache_unified::defrag_sched(float thold) {
+    // the cold pages cannot be rewritten in part and the hot ring is compacted by the requantization
+    if (size_cold > 0) {
+        return;
+    }
+
+    // moving cells would break the ring order the placement relies on
+    if (ring) {
+        return;
+    }
+
     // - do not defrag small contexts (i.e. < 2048 tokens)
     // - count the padding towards the number of used tokens
     const float fragmentation = n >= 2048 ? std::max(0.0f, 1.0f - (float(used + n_pad)/n)) : 0.0f;
@@ -449,23 +587,115 @@ void llama_kv_cache_unified::defrag_sched(float thold) {
     if (fragmentation > thold) {
         LLAMA_LOG_DEBUG("%s: fragmentation: %.2f - requesting defrag\n", __func__, fragmentation);
 
+        // a scheduled defrag runs in bounded steps so that no single decode absorbs all of it
+        defrag_info.forced = thold < 0.0f || (do_defrag && defrag_info.forced);
+
         do_defrag = true;
     }
 }
 
+llama_kv_defrag_stats llama_kv_cache_unified::get_defrag_stats() const {
+    llama_kv_defrag_stats res = {};
+
+    const uint32_t n_kv = cell_max();
+
+    res.fragmentation = n_kv > 0 ? 1.0f - float(used)/n_kv : 0.0f;
+    res.n_steps       = defrag_info.n_steps;
+    res.n_cells_moved = defrag_info.n_cells_moved;
+    res.n_bytes_moved = defrag_info.n_bytes_moved;
+    res.pending       = do_defrag;
+
+    return res;
+}
+
+void llama_kv_cache_unified::seq_set_quota(llama_seq_id seq_id, uint32_t n_max_cells, llama_kv_evict_policy policy, uint32_t n_sink) {
+    LM_GGML_ASSERT(seq_id >= 0 && (uint32_t) seq_id < n_seq_max);
+
+    if (n_max_cells == 0) {
+        seq_quotas.erase(seq_id);
+        return;
+    }
+
+    auto & quota = seq_quotas[seq_id];
+
+    quota.n_max_cells = n_max_cells;
+    quota.n_sink      = n_sink;
+    quota.policy      = policy;
+}
+
+bool llama_kv_cache_unified::quota_apply(const llama_ubatch & ubatch) {
+    std::vector<llama_pos> pos;
+
+    for (const auto & [seq_id, quota] : seq_quotas) {
+        uint32_t n_new = 0;
+        for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+            for (int32_t j = 0; j < ubatch.n_seq_id[i]; ++j) {
+                n_new += ubatch.seq_id[i][j] == seq_id;
+            }
+        }
+
+        if (n_new == 0) {
+            continue;
+        }
+
+        if (n_new > quota.n_max_cells) {
+            LLAMA_LOG_ERROR("%s: ubatch of %u cells exceeds the quota of %u cells of seq %d\n", __func__, n_new, quota.n_max_cells, seq_id);
+            return false;
+        }
+
+        pos.clear();
+        for (uint32_t ip = 0; ip < pages.size(); ++ip) {
+            if (!page_has_seq(ip, seq_id)) {
+                continue;
+            }
+            for (uint32_t i = page_begin(ip); i < page_end(ip); ++i) {
+                if (cells.has_seq_id(i, seq_id)) {
+                    pos.push_back(cells.pos[i]);
+                }
+            }
+        }
+
+        if (pos.size() + n_new <= quota.n_max_cells) {
+            continue;
+        }
+
+        if (quota.policy == LLAMA_KV_EVICT_POLICY_NONE) {
+            LLAMA_LOG_WARN("%s: seq %d is at its quota of %u cells\n", __func__, seq_id, quota.n_max_cells);
+            return false;
+        }
+
+        const uint32_t n_evict = pos.size() + n_new - quota.n_max_cells;
+
+        // the sink is whatever of the first n_sink cells the eviction can spare
+        const uint32_t n_keep = quota.policy == LLAMA_KV_EVICT_POLICY_SINK ? std::min<uint32_t>(quota.n_sink, pos.size() - n_evict) : 0;
+
+        std::sort(pos.begin(), pos.end());
+
+        const llama_pos p0 = pos[n_keep];
+        const llama_pos p1 = pos[n_keep + n_evict - 1] + 1;
+
+        LLAMA_LOG_DEBUG("%s: seq %d over its quota of %u cells, evicting positions [%d, %d)\n", __func__, seq_id, quota.n_max_cells, p0, p1);
+
+        seq_rm(seq_id, p0, p1);
+    }
+
+    return true;
+}
+
 void llama_kv_cache_unified::set_full() {
     n = size;
+    n_cold = size_cold;
 
     // when simulating a full KV cache, the specific value of the "head" pointer is not important because it does not
     //   affect the shapes of the tensors in the compute graph - it only affects the offsets of the K/V views.
     //   we should only guarantee that the head position won't cause out-of-bounds view of the K, V tensors, so
     //   setting it to 0 is the simplest way to achieve that
     // ref: https://github.com/ggml-org/llama.cpp/issues/13359
-    head = 0;
+    head = size_cold;
 }
 
-llama_sbatch llama_kv_cache_unified::sbatch_init(const llama_batch & batch, bool logits_all) {
-    return llama_sbatch(batch, hparams.n_embd, true, logits_all);
+void llama_kv_cache_unified::sbatch_init(llama_sbatch & sbatch, const llama_batch & batch, bool logits_all) {
+    sbatch.init(batch, hparams.n_embd, true, logits_all);
 }
 
 llama_ubatch llama_kv_cache_unified::ubatch_next(llama_sbatch & sbatch, uint32_t n_ubatch, bool embd_pooled) const {
@@ -476,16 +706,29 @@ llama_ubatch llama_kv_cache_unified::ubatch_next(llama_sbatch & sbatch, uint32_t
 bool llama_kv_cache_unified::find_slot(const llama_ubatch & ubatch) {
     const uint32_t n_tokens = ubatch.n_tokens;
 
-    // if we have enough unused cells before the current head ->
-    //   better to start searching from the beginning of the cache, hoping to fill it
-    if (head > used + 2*ubatch.n_tokens) {
+    if (!seq_quotas.empty() && !quota_apply(ubatch)) {
+        return false;
+    }
+
+    // the ubatches only go to the hot cells; a plain cache is all hot
+    const uint32_t cell0   = size_cold;
+    const uint32_t n_cells = size - cell0;
+
+    if (size_cold > 0) {
+        // the hot cells are used as a ring, so the cells ahead of it are the oldest ones
+        head = hot_next;
+    } else if (ring) {
+        head = ring_head();
+    } else if (head > used + 2*ubatch.n_tokens) {
+        // if we have enough unused cells before the current head ->
+        //   better to start searching from the beginning of the cache, hoping to fill it
         head = 0;
     }
 
     // otherwise, one cell per token.
 
-    if (n_tokens > size) {
-        LLAMA_LOG_ERROR("%s: n_tokens = %d > size = %d\n", __func__, n_tokens, size);
+    if (n_tokens > n_cells) {
+        LLAMA_LOG_ERROR("%s: n_tokens = %d > size = %d\n", __func__, n_tokens, n_cells);
         return false;
     }
 
@@ -498,10 +741,10 @@ bool llama_kv_cache_unified::find_slot(const llama_ubatch & ubatch) {
         std::string ss;
         if (n_swa > 0) {
             for (uint32_t i = 0; i < size; ++i) {
-                if (cells[i].pos == -1) {
+                if (cells.pos[i] == -1) {
                     ss += '.';
                 } else {
-                    ss += std::to_string(*cells[i].seq_id.begin());
+                    ss += std::to_string(cells.seq_id[i].first());
                 }
                 if (i%256 == 255) {
                     ss += '\n';
@@ -517,13 +760,21 @@ bool llama_kv_cache_unified::find_slot(const llama_ubatch & ubatch) {
     while (true) {
         if (head + n_tokens > size) {
             n_tested += size - head;
-            head = 0;
+            head = cell0;
+            continue;
+        }
+
+        // a page with no free cell left cannot hold any part of the slot
+        if (head % page_size == 0 && pages[head/page_size].used == page_end(head/page_size) - head &&
+            n_tested + page_end(head/page_size) - head < n_cells) {
+            n_tested += page_end(head/page_size) - head;
+            head      = page_end(head/page_size);
             continue;
         }
 
         bool found = true;
         for (uint32_t i = 0; i < n_tokens; i++) {
-            if (cells[head + i].pos >= 0) {
+            if (cells.pos[head + i] >= 0) {
                 found = false;
                 head     += i + 1;
                 n_tested += i + 1;
@@ -535,7 +786,16 @@ bool llama_kv_cache_unified::find_slot(const llama_ubatch & ubatch) {
             break;
         }
 
-        if (n_tested >= size) {
+        if (n_tested >= n_cells) {
+            if (size_cold > 0) {
+                // the ring is full: requantize the oldest hot cells, a page at a time, and take their place
+                head = hot_next + n_tokens > size ? cell0 : hot_next;
+
+                if (tier_evict(head, std::min(size, head + LM_GGML_PAD(n_tokens, page_size)))) {
+                    break;
+                }
+            }
+
             //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
             return false;
         }
@@ -544,22 +804,27 @@ bool llama_kv_cache_unified::find_slot(const llama_ubatch & ubatch) {
     for (uint32_t i = 0; i < n_tokens; ++i) {
         // remember the original state
         if (recovery.cells.find(head + i) == recovery.cells.end()) {
-            recovery.cells[head + i] = cells[head + i];
+            recovery.cells[head + i] = cells.get(head + i);
         }
 
-        cells[head + i].pos = ubatch.pos[i];
+        cells.pos[head + i] = ubatch.pos[i];
 
         for (int32_t j = 0; j < ubatch.n_seq_id[i]; j++) {
-            cells[head + i].seq_id.insert(ubatch.seq_id[i][j]);
+            cells.seq_id[head + i].insert(ubatch.seq_id[i][j]);
         }
     }
 
+    page_sync(head, head + n_tokens);
+
     used += n_tokens;
 
+    hot_next = head + n_tokens;
+
     // a heuristic, to avoid attending the full cache if it is not yet utilized
     // after enough generations, the benefit from this heuristic disappears
     // if we start defragmenting the cache, the benefit from this will be more important
-    n = std::min(size, std::max(n_pad, LM_GGML_PAD(cell_max(), n_pad)));
+    n_cold = cold_max();
+    n = n_cold + std::min(n_cells, std::max(n_pad, LM_GGML_PAD(std::max(cell_max(), cell0) - cell0, n_pad)));
 
 #ifdef FIND_SLOT_DEBUG
     LLAMA_LOG_WARN("end:   n = %5d, used = %5d, head = %5d, n_swa = %5d\n", n, used, head, n_swa);
@@ -572,6 +837,13 @@ bool llama_kv_cache_unified::get_can_shift() const {
     return true;
 }
 
+bool llama_kv_cache_unified::get_graph_key(std::vector<int64_t> & key) const {
+    // the views read n cells, the first n_cold of them from the cold tensors
+    key.push_back(n);
+    key.push_back(n_cold);
+    return true;
+}
+
 uint32_t llama_kv_cache_unified::get_n() const {
     return n;
 }
@@ -586,7 +858,7 @@ lm_ggml_tensor * llama_kv_cache_unified::get_k(lm_ggml_context * ctx, int32_t il
     auto * k = layers[ikv].k;
 
     return lm_ggml_view_3d(ctx, k,
-            hparams.n_embd_head_k, hparams.n_head_kv(il), n,
+            hparams.n_embd_head_k, hparams.n_head_kv(il), n - n_cold,
             lm_ggml_row_size(k->type, hparams.n_embd_head_k),
             lm_ggml_row_size(k->type, hparams.n_embd_k_gqa(il)),
             0);
@@ -600,7 +872,7 @@ lm_ggml_tensor * llama_kv_cache_unified::get_v(lm_ggml_context * ctx, int32_t il
     if (!v_trans) {
         // note: v->nb[1] <= v->nb[2]
         return lm_ggml_view_3d(ctx, v,
-                hparams.n_embd_head_v, hparams.n_head_kv(il), n,
+                hparams.n_embd_head_v, hparams.n_head_kv(il), n - n_cold,
                 lm_ggml_row_size(v->type, hparams.n_embd_head_v),    // v->nb[1]
                 lm_ggml_row_size(v->type, hparams.n_embd_v_gqa(il)), // v->nb[2]
                 0);
@@ -608,12 +880,41 @@ lm_ggml_tensor * llama_kv_cache_unified::get_v(lm_ggml_context * ctx, int32_t il
 
     // note: v->nb[1] > v->nb[2]
     return lm_ggml_view_3d(ctx, v,
-            n, hparams.n_head_kv(il), hparams.n_embd_head_v,
+            n - n_cold, hparams.n_head_kv(il), hparams.n_embd_head_v,
             lm_ggml_row_size(v->type, v->ne[1]*hparams.n_embd_head_v), // v->nb[1]
             lm_ggml_row_size(v->type, v->ne[1]),                       // v->nb[2]
             0);
 }
 
+lm_ggml_tensor * llama_kv_cache_unified::get_k_cold(lm_ggml_context * ctx, int32_t il) const {
+    if (n_cold == 0) {
+        return nullptr;
+    }
+
+    auto * k = layers[map_layer_ids.at(il)].k_cold;
+
+    return lm_ggml_view_3d(ctx, k,
+            hparams.n_embd_head_k, hparams.n_head_kv(il), n_cold,
+            lm_ggml_row_size(k->type, hparams.n_embd_head_k),
+            lm_ggml_row_size(k->type, hparams.n_embd_k_gqa(il)),
+            0);
+}
+
+lm_ggml_tensor * llama_kv_cache_unified::get_v_cold(lm_ggml_context * ctx, int32_t il) const {
+    if (n_cold == 0) {
+        return nullptr;
+    }
+
+    auto * v = layers[map_layer_ids.at(il)].v_cold;
+
+    // note: each row of v holds one channel for all the cold cells
+    return lm_ggml_view_3d(ctx, v,
+            n_cold, hparams.n_head_kv(il), hparams.n_embd_head_v,
+            v->nb[1]*hparams.n_embd_head_v,
+            v->nb[1],
+            0);
+}
+
 lm_ggml_tensor * llama_kv_cache_unified::cpy_k(lm_ggml_context * ctx, lm_ggml_tensor * k_cur, int32_t il) const {
     const int32_t ikv = map_layer_ids.at(il);
 
@@ -623,7 +924,7 @@ lm_ggml_tensor * llama_kv_cache_unified::cpy_k(lm_ggml_context * ctx, lm_ggml_te
 
     lm_ggml_tensor * k_view = lm_ggml_view_1d(ctx, k,
             n_tokens*hparams.n_embd_k_gqa(il),
-            lm_ggml_row_size(k->type, hparams.n_embd_k_gqa(il))*head);
+            get_store_offset(il, false));
 
     return lm_ggml_cpy(ctx, k_cur, k_view);
 }
@@ -642,12 +943,12 @@ lm_ggml_tensor * llama_kv_cache_unified::cpy_v(lm_ggml_context * ctx, lm_ggml_te
     if (!v_trans) {
         v_view = lm_ggml_view_1d(ctx, v,
                 n_tokens*hparams.n_embd_v_gqa(il),
-                lm_ggml_row_size(v->type, hparams.n_embd_v_gqa(il))*head);
+                get_store_offset(il, true));
     } else {
         // note: the V cache is transposed when not using flash attention
         v_view = lm_ggml_view_2d(ctx, v, n_tokens, hparams.n_embd_v_gqa(il),
                 (v->ne[1])*lm_ggml_element_size(v),
-                (    head)*lm_ggml_element_size(v));
+                get_store_offset(il, true));
 
         v_cur = lm_ggml_transpose(ctx, v_cur);
     }
@@ -655,6 +956,44 @@ lm_ggml_tensor * llama_kv_cache_unified::cpy_v(lm_ggml_context * ctx, lm_ggml_te
     return lm_ggml_cpy(ctx, v_cur, v_view);
 }
 
+size_t llama_kv_cache_unified::get_store_offset(int32_t il, bool v) const {
+    const int32_t ikv = map_layer_ids.at(il);
+
+    if (!v) {
+        return lm_ggml_row_size(layers[ikv].k->type, hparams.n_embd_k_gqa(il))*(head - size_cold);
+    }
+
+    // the transposed V cache stores one channel per row
+    return v_trans ? (head - size_cold)*lm_ggml_element_size(layers[ikv].v)
+                   : lm_ggml_row_size(layers[ikv].v->type, hparams.n_embd_v_gqa(il))*(head - size_cold);
+}
+
+void llama_kv_cache_unified::set_ring(bool ring) {
+    this->ring = ring;
+}
+
+uint32_t llama_kv_cache_unified::get_ring_room() const {
+    return ring ? size - ring_head() : size;
+}
+
+uint32_t llama_kv_cache_unified::ring_head() const {
+    if (used == 0) {
+        return 0;
+    }
+
+    // cells freed behind the cursor (a rolled back tail or a failed ubatch) are the start of the run
+    uint32_t res = hot_next < size ? hot_next : 0;
+    for (uint32_t n_back = 0; n_back < size; ++n_back) {
+        const uint32_t prev = (res == 0 ? size : res) - 1;
+        if (cells.pos[prev] >= 0) {
+            break;
+        }
+        res = prev;
+    }
+
+    return res;
+}
+
 void llama_kv_cache_unified::prune_swa(llama_seq_id seq_id, llama_pos pmin, llama_pos pmax) {
     // no pruning is needed when the cache does not use SWA
     LM_GGML_ASSERT(swa_type != LLAMA_SWA_TYPE_NONE && "do not prune non-SWA cache");
@@ -662,7 +1001,7 @@ void llama_kv_cache_unified::prune_swa(llama_seq_id seq_id, llama_pos pmin, llam
     int n_attended = 0;
 
     for (uint32_t i = 0; i < size; ++i) {
-        const llama_pos p0 = cells[i].pos;
+        const llama_pos p0 = cells.pos[i];
 
         if (p0 <= pmin && !is_masked_swa(p0, pmin)) {
             n_attended++;
@@ -670,24 +1009,26 @@ void llama_kv_cache_unified::prune_swa(llama_seq_id seq_id, llama_pos pmin, llam
 
         if (is_masked_swa(p0, pmax)) {
             if (seq_id < 0) {
-                cells[i].seq_id.clear();
-            } else if (cells[i].has_seq_id(seq_id)) {
-                cells[i].seq_id.erase(seq_id);
+                cells.seq_id[i].clear();
+            } else if (cells.has_seq_id(i, seq_id)) {
+                cells.seq_id[i].erase(seq_id);
             } else {
                 continue;
             }
 
-            if (cells[i].is_empty()) {
+            if (cells.is_empty(i)) {
                 // keep count of the number of used cells
-                if (cells[i].pos >= 0) {
+                if (cells.pos[i] >= 0) {
                     used--;
                 }
 
-                cells[i].pos = -1;
+                cells.pos[i] = -1;
             }
         }
     }
 
+    page_sync(0, size);
+
     if (n_attended < std::min<int>(n_swa, pmin)) {
         LLAMA_LOG_WARN("%s: partial SWA cache detected - possible loss of information, pmin = %d, n_attended = %d, n_swa = %d\n", __func__, pmin, n_attended, n_swa);
     }
@@ -715,20 +1056,58 @@ void llama_kv_cache_unified::set_input_kq_mask(lm_ggml_tensor * dst, const llama
     //      xxxxx-----
     //      xxxxx-----
     // To visualize the mask, see https://github.com/ggml-org/llama.cpp/pull/12615
+    //
+    // The cells a sequence may attend are gathered once per distinct sequence into seq_pos (their
+    // position, or -1), after which each row is a plain compare-and-select over a dense array.
+    std::vector<llama_pos> seq_pos(n_kv);
+    llama_seq_id seq_pos_id = -1;
+
     for (int h = 0; h < 1; ++h) {
         for (int s = 0; s < n_seqs; ++s) {
             const llama_seq_id seq_id = ubatch->seq_id[s][0];
 
+            if (s == 0 || seq_id != seq_pos_id) {
+                // n_cold and size_cold are whole pages, so a page of columns is a page of cells
+                for (int i = 0; i < n_kv; i += page_size) {
+                    const int i1 = std::min<int>(n_kv, i + page_size);
+                    const int c0 = cell_of(i);
+
+                    // none of the page belongs to the sequence
+                    if (!pages[c0/page_size].seq_id.has(seq_id)) {
+                        std::fill(seq_pos.begin() + i, seq_pos.begin() + i1, -1);
+                        continue;
+                    }
+
+                    for (int k = i; k < i1; ++k) {
+                        seq_pos[k] = cells.has_seq_id(c0 + k - i, seq_id) ? cells.pos[c0 + k - i] : -1;
+                    }
+                }
+                seq_pos_id = seq_id;
+            }
+
+            const llama_pos * p0s = seq_pos.data();
+
             for (int j = 0; j < n_seq_tokens; ++j) {
                 const llama_pos p1 = ubatch->pos[s*n_seq_tokens + j];
 
+                float * row = data + h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv;
+
+                if (swa_type == LLAMA_SWA_TYPE_NONE && !hparams.use_alibi) {
+                    // other sequences, empty cells and (if causal) future tokens
+                    const llama_pos p_max = causal_attn ? p1 : std::numeric_limits<llama_pos>::max();
+                    for (int i = 0; i < n_kv; ++i) {
+                        row[i] = (p0s[i] >= 0 && p0s[i] <= p_max) ? 0.0f : -INFINITY;
+                    }
+                    continue;
+                }
+
                 for (int i = 0; i < n_kv; ++i) {
-                    const llama_pos p0 = cells[i].pos;
+                    const llama_pos p0 = p0s[i];
 
                     bool masked = false;
 
                     // mask the token if not the same sequence
-                    masked = masked || (!cells[i].has_seq_id(seq_id));
+                    masked = masked || (p0 < 0);
 
                     // mask future tokens
                     masked = masked || (causal_attn && p0 > p1);
@@ -744,7 +1123,7 @@ void llama_kv_cache_unified::set_input_kq_mask(lm_ggml_tensor * dst, const llama
                         f = -std::abs(p0 - p1);
                     }
 
-                    data[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
+                    row[i] = f;
                 }
             }
         }
@@ -766,7 +1145,7 @@ void llama_kv_cache_unified::set_input_k_shift(lm_ggml_tensor * dst) const {
     int32_t * data = (int32_t *) dst->data;
 
     for (uint32_t i = 0; i < size; ++i) {
-        data[i] = cells[i].delta;
+        data[i] = cells.delta[i];
     }
 }
 
@@ -783,7 +1162,7 @@ void llama_kv_cache_unified::set_input_pos_bucket(lm_ggml_tensor * dst, const ll
     for (int h = 0; h < 1; ++h) {
         for (int j = 0; j < n_tokens; ++j) {
             for (int i = 0; i < n_kv; ++i) {
-                data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(cells[i].pos, ubatch->pos[j], hparams.n_rel_attn_bkts, false);
+                data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(cells.pos[cell_of(i)], ubatch->pos[j], hparams.n_rel_attn_bkts, false);
             }
         }
     }
@@ -803,7 +1182,7 @@ size_t llama_kv_cache_unified::size_k_bytes() const {
     size_t size_k_bytes = 0;
 
     for (const auto & layer : layers) {
-        size_k_bytes += lm_ggml_nbytes(layer.k);
+        size_k_bytes += lm_ggml_nbytes(layer.k) + (layer.k_cold ? lm_ggml_nbytes(layer.k_cold) : 0);
     }
 
     return size_k_bytes;
@@ -813,7 +1192,7 @@ size_t llama_kv_cache_unified::size_v_bytes() const {
     size_t size_v_bytes = 0;
 
     for (const auto & layer : layers) {
-        size_v_bytes += lm_ggml_nbytes(layer.v);
+        size_v_bytes += lm_ggml_nbytes(layer.v) + (layer.v_cold ? lm_ggml_nbytes(layer.v_cold) : 0);
     }
 
     return size_v_bytes;
@@ -894,9 +1273,13 @@ llm_graph_result_ptr llama_kv_cache_unified::build_graph_shift(
 
     auto inp = std::make_unique<llm_graph_input_k_shift>(this);
 
-    inp->k_shift = lm_ggml_new_tensor_1d(ctx, LM_GGML_TYPE_I32, cparams.n_ctx);
+    inp->k_shift = lm_ggml_new_tensor_1d(ctx, LM_GGML_TYPE_I32, size);
     lm_ggml_set_input(inp->k_shift);
 
+    // the hot cells follow the cold ones in k_shift
+    lm_ggml_tensor * k_shift_hot  = size_cold > 0 ? lm_ggml_view_1d(ctx, inp->k_shift, size - size_cold, size_cold*sizeof(int32_t)) : inp->k_shift;
+    lm_ggml_tensor * k_shift_cold = size_cold > 0 ? lm_ggml_view_1d(ctx, inp->k_shift, size_cold, 0) : nullptr;
+
     for (const auto & layer : layers) {
         const uint32_t il = layer.il;
 
@@ -910,14 +1293,25 @@ llm_graph_result_ptr llama_kv_cache_unified::build_graph_shift(
 
         lm_ggml_tensor * k =
             lm_ggml_view_3d(ctx, layer.k,
-                n_embd_head_k, n_head_kv, size,
+                n_embd_head_k, n_head_kv, size - size_cold,
                 lm_ggml_row_size(layer.k->type, n_embd_head_k),
                 lm_ggml_row_size(layer.k->type, n_embd_k_gqa),
                 0);
 
-        lm_ggml_tensor * cur = build_rope_shift(cparams, ctx, k, inp->k_shift, rope_factors, freq_base_l, freq_scale_l);
+        lm_ggml_tensor * cur = build_rope_shift(cparams, ctx, k, k_shift_hot, rope_factors, freq_base_l, freq_scale_l);
 
         lm_ggml_build_forward_expand(gf, cur);
+
+        if (layer.k_cold) {
+            lm_ggml_tensor * k_cold =
+                lm_ggml_view_3d(ctx, layer.k_cold,
+                    n_embd_head_k, n_head_kv, size_cold,
+                    lm_ggml_row_size(layer.k_cold->type, n_embd_head_k),
+                    lm_ggml_row_size(layer.k_cold->type, n_embd_k_gqa),
+                    0);
+
+            lm_ggml_build_forward_expand(gf, build_rope_shift(cparams, ctx, k_cold, k_shift_cold, rope_factors, freq_base_l, freq_scale_l));
+        }
     }
 
     res->add_input(std::move(inp));
@@ -1072,7 +1466,7 @@ llm_graph_result_ptr llama_kv_cache_unified::build_graph_defrag(
     return res;
 }
 
-bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
+bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes, uint32_t n_max_cells) {
     const uint32_t n_layer = layers.size();
 
     const uint32_t n_kv   = cell_max();
@@ -1103,32 +1497,42 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
     ids.clear();
     ids.resize(n_kv, n_kv);
 
-    for (uint32_t i0 = 0; i0 < n_used; ++i0) {
-        const auto & cell0 = cells[i0];
+    defrag_info.n_cells = 0;
+    defrag_info.partial = false;
 
-        if (!cell0.is_empty()) {
+    for (uint32_t i0 = 0; i0 < n_used; ++i0) {
+        if (!cells.is_empty(i0)) {
             ids[i0] = i0;
 
             continue;
         }
 
+        // out of budget for this step - the next one picks up from this hole
+        if (n_max_cells > 0 && defrag_info.n_cells == n_max_cells) {
+            defrag_info.partial = true;
+            break;
+        }
+
         // found a hole - fill it with data from the end of the cache
 
         uint32_t nh = 1;
 
         // determine the size of the hole
-        while (i0 + nh < n_used && cells[i0 + nh].is_empty()) {
+        while (i0 + nh < n_used && cells.is_empty(i0 + nh)) {
             nh++;
         }
 
+        // fill as much of the hole as the budget allows
+        if (n_max_cells > 0) {
+            nh = std::min(nh, n_max_cells - defrag_info.n_cells);
+        }
+
         uint32_t nf = 0;
         uint32_t is = n_kv - 1;
 
         // starting from the end, find nh non-empty cells
         for (; is > i0; --is) {
-            const auto & cell1 = cells[is];
-
-            if (cell1.is_empty() || ids[is] != n_kv) {
+            if (cells.is_empty(is) || ids[is] != n_kv) {
                 continue;
             }
 
@@ -1153,72 +1557,235 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
         // should we stop searching for the next move?
         bool stop = false;
 
-        // go back and move the nf cells to the hole
-        for (; i1 < n_kv; ++i1) {
-            auto & cell1 = cells[i1];
+        // go back and move the nf cells to the hole
+        for (; i1 < n_kv; ++i1) {
+            if (cells.is_empty(i1) || ids[i1] != n_kv) {
+                if (n_moves == max_moves) {
+                    stop = true;
+                    break;
+                }
+
+                cont = false;
+                continue;
+            }
+
+            // this cell goes to (i0 + nf)
+            ids[i1] = i0 + nf;
+
+            // move the cell meta data
+            cells.set(i0 + nf, cells.get(i1));
+
+            // clear the old cell and move the head there
+            cells.set(i1, kv_cell());
+            head = n_used;
+
+            if (!cont) {
+                n_moves++;
+                cont = true;
+            }
+
+            nf++;
+
+            defrag_info.n_cells++;
+
+            if (nf == nh) {
+                break;
+            }
+        }
+
+        if (stop || n_moves == max_moves) {
+            defrag_info.partial = true;
+            break;
+        }
+
+        //LLAMA_LOG_INFO("(tmp log) KV defrag: move [%u, %u) to [%u, %u)\n", is, i1 + 1, i0, i0 + nh);
+
+        i0 += nh - 1;
+    }
+
+    if (n_moves == 0) {
+        return false;
+    }
+
+    page_sync(0, size);
+
+    LLAMA_LOG_DEBUG("%s: (tmp log) KV defrag cell moves: %u\n", __func__, n_moves);
+
+    LLAMA_LOG_DEBUG("%s: expected gf nodes: %u\n", __func__, 6*n_moves*n_layer);
+
+    return true;
+}
+
+uint32_t llama_kv_cache_unified::cell_max() const {
+    for (uint32_t ip = pages.size(); ip > 0; --ip) {
+        if (pages[ip - 1].used == 0) {
+            continue;
+        }
+
+        for (uint32_t i = page_end(ip - 1); i > page_begin(ip - 1); --i) {
+            if (cells.pos[i - 1] >= 0 && !cells.is_empty(i - 1)) {
+                return i;
+            }
+        }
+    }
+
+    return 0;
+}
+
+uint32_t llama_kv_cache_unified::cold_max() const {
+    for (uint32_t ip = size_cold/page_size; ip > 0; --ip) {
+        if (pages[ip - 1].used > 0) {
+            return page_end(ip - 1);
+        }
+    }
+
+    return 0;
+}
+
+static void kv_cold_to_f32(lm_ggml_type type, const void * src, float * dst, int64_t n) {
+    if (type == LM_GGML_TYPE_F32) {
+        memcpy(dst, src, n*sizeof(float));
+    } else {
+        lm_ggml_get_type_traits(type)->to_float(src, dst, n);
+    }
+}
+
+void llama_kv_cache_unified::tier_store_k(const kv_layer & layer, uint32_t c0, uint32_t n, const lm_ggml_fp16_t * k) const {
+    lm_ggml_tensor * t = layer.k_cold;
+
+    const int64_t n_embd = t->ne[0];
+
+    std::vector<float>   f32(n*n_embd);
+    std::vector<uint8_t> dst(n*t->nb[1]);
+
+    lm_ggml_fp16_to_fp32_row(k, f32.data(), n*n_embd);
+    lm_ggml_quantize_chunk(t->type, f32.data(), dst.data(), 0, n, n_embd, nullptr);
+
+    lm_ggml_backend_tensor_set(t, dst.data(), c0*t->nb[1], dst.size());
+}
+
+void llama_kv_cache_unified::tier_store_v(const kv_layer & layer, uint32_t c0, uint32_t n, const lm_ggml_fp16_t * v, size_t ld) const {
+    lm_ggml_tensor * t = layer.v_cold;
+
+    // the blocks of a channel run along the cells, so the last page is completed with zeros
+    const int64_t n_embd = t->ne[1];
+    const int64_t n_blk  = LM_GGML_PAD(n, page_size);
+
+    const size_t row_size = lm_ggml_row_size(t->type, n_blk);
+
+    std::vector<float>   f32(n_embd*n_blk, 0.0f);
+    std::vector<uint8_t> dst(n_embd*row_size);
+
+    for (int64_t j = 0; j < n_embd; ++j) {
+        lm_ggml_fp16_to_fp32_row(v + j*ld, f32.data() + j*n_blk, n);
+    }
+
+    lm_ggml_quantize_chunk(t->type, f32.data(), dst.data(), 0, n_embd, n_blk, nullptr);
+
+    for (int64_t j = 0; j < n_embd; ++j) {
+        lm_ggml_backend_tensor_set(t, dst.data() + j*row_size, j*t->nb[1] + lm_ggml_row_size(t->type, c0), row_size);
+    }
+}
+
+bool llama_kv_cache_unified::tier_evict(uint32_t i0, uint32_t i1) {
+    std::vector<uint32_t> src;
+
+    for (uint32_t i = i0; i < i1; ++i) {
+        if (!cells.is_empty(i)) {
+            src.push_back(i);
+        }
+    }
+
+    if (src.empty()) {
+        return true;
+    }
+
+    // only whole free pages: a page of cold V is quantized along its cells and written once
+    const uint32_t n_pages = (src.size() + page_size - 1)/page_size;
+
+    std::vector<uint32_t> dst_pages;
+
+    for (uint32_t ip = 0; ip < size_cold/page_size && dst_pages.size() < n_pages; ++ip) {
+        if (pages[ip].used == 0) {
+            dst_pages.push_back(ip);
+        }
+    }
 
-            if (cell1.is_empty() || ids[i1] != n_kv) {
-                if (n_moves == max_moves) {
-                    stop = true;
-                    break;
-                }
+    if (dst_pages.size() < n_pages) {
+        LLAMA_LOG_DEBUG("%s: no free cold pages left for %zu cells\n", __func__, src.size());
+        return false;
+    }
 
-                cont = false;
-                continue;
-            }
+    const uint32_t n_span   = i1 - i0;
+    const uint32_t size_hot = size - size_cold;
 
-            // this cell goes to (i0 + nf)
-            ids[i1] = i0 + nf;
+    std::vector<lm_ggml_fp16_t> span;
+    std::vector<lm_ggml_fp16_t> page;
 
-            // move the cell meta data
-            cells[i0 + nf] = cell1;
+    for (const auto & layer : layers) {
+        LM_GGML_ASSERT(layer.k->type == LM_GGML_TYPE_F16 && layer.v->type == LM_GGML_TYPE_F16);
 
-            // clear the old cell and move the head there
-            cell1 = kv_cell();
-            head = n_used;
+        const int64_t n_embd_k = layer.k->ne[0];
+        const int64_t n_embd_v = layer.v->ne[0];
 
-            if (!cont) {
-                n_moves++;
-                cont = true;
-            }
+        // keys: the rows of the span, gathered a page at a time
+        span.resize(n_span*n_embd_k);
+        lm_ggml_backend_tensor_get(layer.k, span.data(), (i0 - size_cold)*layer.k->nb[1], span.size()*sizeof(lm_ggml_fp16_t));
 
-            nf++;
+        for (uint32_t p = 0; p < n_pages; ++p) {
+            const uint32_t t0 = p*page_size;
+            const uint32_t nt = std::min<uint32_t>(page_size, src.size() - t0);
 
-            if (nf == nh) {
-                break;
+            page.resize(nt*n_embd_k);
+            for (uint32_t t = 0; t < nt; ++t) {
+                memcpy(page.data() + t*n_embd_k, span.data() + (src[t0 + t] - i0)*n_embd_k, n_embd_k*sizeof(lm_ggml_fp16_t));
             }
+
+            tier_store_k(layer, dst_pages[p]*page_size, nt, page.data());
         }
 
-        if (stop || n_moves == max_moves) {
-            break;
+        // values: the span of every channel row
+        span.resize(n_embd_v*n_span);
+        for (int64_t j = 0; j < n_embd_v; ++j) {
+            lm_ggml_backend_tensor_get(layer.v, span.data() + j*n_span, (j*size_hot + i0 - size_cold)*sizeof(lm_ggml_fp16_t), n_span*sizeof(lm_ggml_fp16_t));
         }
 
-        //LLAMA_LOG_INFO("(tmp log) KV defrag: move [%u, %u) to [%u, %u)\n", is, i1 + 1, i0, i0 + nh);
+        for (uint32_t p = 0; p < n_pages; ++p) {
+            const uint32_t t0 = p*page_size;
+            const uint32_t nt = std::min<uint32_t>(page_size, src.size() - t0);
 
-        i0 += nh - 1;
-    }
+            page.resize(n_embd_v*page_size);
+            for (int64_t j = 0; j < n_embd_v; ++j) {
+                for (uint32_t t = 0; t < nt; ++t) {
+                    page[j*page_size + t] = span[j*n_span + src[t0 + t] - i0];
+                }
+            }
 
-    if (n_moves == 0) {
-        return false;
+            tier_store_v(layer, dst_pages[p]*page_size, nt, page.data(), page_size);
+        }
     }
 
-    LLAMA_LOG_DEBUG("%s: (tmp log) KV defrag cell moves: %u\n", __func__, n_moves);
-
-    LLAMA_LOG_DEBUG("%s: expected gf nodes: %u\n", __func__, 6*n_moves*n_layer);
+    for (uint32_t t = 0; t < src.size(); ++t) {
+        const uint32_t i = src[t];
+        const uint32_t c = dst_pages[t/page_size]*page_size + t%page_size;
 
-    return true;
-}
+        // a cell of the pending batch keeps its recovery, which must then also clear its cold copy
+        if (recovery.cells.find(i) != recovery.cells.end() && recovery.cells.find(c) == recovery.cells.end()) {
+            recovery.cells[c] = cells.get(c);
+        }
 
-uint32_t llama_kv_cache_unified::cell_max() const {
-    for (uint32_t i = size; i > 0; --i) {
-        const kv_cell & cell = cells[i - 1];
+        cells.set(c, cells.get(i));
+        cells.set(i, kv_cell());
+    }
 
-        if (cell.pos >= 0 && !cell.is_empty()) {
-            return i;
-        }
+    page_sync(i0, i1);
+    for (uint32_t ip : dst_pages) {
+        page_sync(page_begin(ip), page_end(ip));
     }
 
-    return 0;
+    LLAMA_LOG_DEBUG("%s: requantized %zu cells from [%u, %u) into %u cold pages\n", __func__, src.size(), i0, i1, n_pages);
+
+    return true;
 }
 
 bool llama_kv_cache_unified::is_masked_swa(llama_pos p0, llama_pos p1) const {
@@ -1257,8 +1824,12 @@ void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq
     // Find all the ranges of cells with this seq id (or all, when -1)
     uint32_t cell_range_begin = size;
     for (uint32_t i = 0; i < size; ++i) {
-        const auto & cell = cells[i];
-        if ((seq_id == -1 && !cell.is_empty()) || cell.has_seq_id(seq_id)) {
+        // a range does not cross from the cold tier into the hot one
+        if (i == size_cold && cell_range_begin != size) {
+            cell_ranges.emplace_back(cell_range_begin, i);
+            cell_range_begin = size;
+        }
+        if ((seq_id == -1 && !cells.is_empty(i)) || cells.has_seq_id(i, seq_id)) {
             ++cell_count;
             if (cell_range_begin == size) {
                 cell_range_begin = i;
@@ -1274,6 +1845,20 @@ void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq
         cell_ranges.emplace_back(cell_range_begin, size);
     }
 
+    // a ring is written oldest first, so that it reads back as one run in ring order
+    if (ring && !cell_ranges.empty()) {
+        const uint32_t h = ring_head();
+
+        auto it = std::lower_bound(cell_ranges.begin(), cell_ranges.end(), h,
+                [](const std::pair<uint32_t, uint32_t> & range, uint32_t i) { return range.second <= i; });
+        if (it != cell_ranges.end() && it->first < h) {
+            const uint32_t end = it->second;
+            it->second = h;
+            it = cell_ranges.emplace(it + 1, h, end);
+        }
+        std::rotate(cell_ranges.begin(), it, cell_ranges.end());
+    }
+
     // DEBUG CHECK: Sum of cell counts in ranges should equal the total cell count
     uint32_t cell_count_check = 0;
     for (const auto & range : cell_ranges) {
@@ -1291,9 +1876,11 @@ void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_i
     uint32_t cell_count;
     io.read_to(&cell_count, sizeof(cell_count));
 
+    kv_tier_run cold;
+
     bool res = true;
-    res = res && state_read_meta(io, cell_count, seq_id);
-    res = res && state_read_data(io, cell_count);
+    res = res && state_read_meta(io, cell_count, cold, seq_id);
+    res = res && state_read_data(io, cell_count, cold);
 
     if (!res) {
         if (seq_id == -1) {
@@ -1305,19 +1892,37 @@ void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_i
     }
 }
 
+void llama_kv_cache_unified::state_write_cold(llama_io_write_i & io, const lm_ggml_tensor * t, size_t offset, size_t i0, size_t n) const {
+    const size_t blck    = lm_ggml_blck_size(t->type);
+    const size_t blk_sz  = lm_ggml_type_size(t->type);
+    const size_t b0      = i0/blck;
+    const size_t b1      = (i0 + n + blck - 1)/blck;
+
+    std::vector<uint8_t>        src((b1 - b0)*blk_sz);
+    std::vector<float>          f32((b1 - b0)*blck);
+    std::vector<lm_ggml_fp16_t> f16(n);
+
+    lm_ggml_backend_tensor_get(t, src.data(), offset + b0*blk_sz, src.size());
+    kv_cold_to_f32(t->type, src.data(), f32.data(), f32.size());
+    lm_ggml_fp32_to_fp16_row(f32.data() + i0 - b0*blck, f16.data(), n);
+
+    io.write(f16.data(), f16.size()*sizeof(lm_ggml_fp16_t));
+}
+
 void llama_kv_cache_unified::state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id) const {
     for (const auto & range : cell_ranges) {
         for (uint32_t i = range.first; i < range.second; ++i) {
-            const auto & cell = cells[i];
-            const llama_pos pos      = cell.pos;
-            const uint32_t  n_seq_id = seq_id == -1 ? cell.seq_id.size() : 0;
+            const llama_pos pos      = cells.pos[i];
+            const uint32_t  n_seq_id = seq_id == -1 ? cells.seq_id[i].size() : 0;
 
             io.write(&pos,      sizeof(pos));
             io.write(&n_seq_id, sizeof(n_seq_id));
 
             if (n_seq_id) {
-                for (auto seq_id : cell.seq_id) {
-                    io.write(&seq_id, sizeof(seq_id));
+                for (llama_seq_id id = 0; id < LLAMA_MAX_PARALLEL_SEQUENCES; ++id) {
+                    if (cells.seq_id[i].has(id)) {
+                        io.write(&id, sizeof(id));
+                    }
                 }
             }
         }
@@ -1352,7 +1957,11 @@ void llama_kv_cache_unified::state_write_data(llama_io_write_i & io, const std::
         for (const auto & range : cell_ranges) {
             const size_t range_size = range.second - range.first;
             const size_t buf_size = range_size * k_size_row;
-            io.write_tensor(layer.k, range.first * k_size_row, buf_size);
+            if (range.first < size_cold) {
+                state_write_cold(io, layer.k_cold, range.first*layer.k_cold->nb[1], 0, range_size*n_embd_k_gqa);
+                continue;
+            }
+            io.write_tensor(layer.k, (range.first - size_cold) * k_size_row, buf_size);
         }
     }
 
@@ -1374,12 +1983,12 @@ void llama_kv_cache_unified::state_write_data(llama_io_write_i & io, const std::
             for (const auto & range : cell_ranges) {
                 const size_t range_size = range.second - range.first;
                 const size_t buf_size = range_size * v_size_row;
-                io.write_tensor(layer.v, range.first * v_size_row, buf_size);
+                io.write_tensor(layer.v, (range.first - size_cold) * v_size_row, buf_size);
             }
         }
     } else {
         // When v is transposed, we also need the element size and get the element ranges from each row
-        const uint32_t kv_size = size;
+        const uint32_t kv_size = size - size_cold;
 
         for (const auto & layer : layers) {
             const uint32_t il = layer.il;
@@ -1402,7 +2011,11 @@ void llama_kv_cache_unified::state_write_data(llama_io_write_i & io, const std::
                 // Read each range of cells of v_size_el length each into tmp_buf and write out
                 for (const auto & range : cell_ranges) {
                     const size_t range_size = range.second - range.first;
-                    const size_t src_offset = (range.first + j * kv_size) * v_size_el;
+                    if (range.first < size_cold) {
+                        state_write_cold(io, layer.v_cold, j*layer.v_cold->nb[1], range.first, range_size);
+                        continue;
+                    }
+                    const size_t src_offset = (range.first - size_cold + j * kv_size) * v_size_el;
                     const size_t buf_size = range_size * v_size_el;
                     io.write_tensor(layer.v, src_offset, buf_size);
                 }
@@ -1411,7 +2024,12 @@ void llama_kv_cache_unified::state_write_data(llama_io_write_i & io, const std::
     }
 }
 
-bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell_count, llama_seq_id dest_seq_id) {
+bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell_count, kv_tier_run & cold, llama_seq_id dest_seq_id) {
+    // a tiered cache restores up to half of the hot ring into it and the older cells into the cold tier
+    const uint32_t n_hot = size_cold > 0 ? std::min(cell_count, (size - size_cold)/2) : cell_count;
+
+    cold.n = cell_count - n_hot;
+
     if (dest_seq_id != -1) {
         // single sequence
 
@@ -1439,6 +2057,46 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
             batch.seq_id[i] = &dest_seq_id;
         }
 
+        if (cold.n > 0) {
+            // first fit over runs of free cold pages
+            const uint32_t n_pages = (cold.n + page_size - 1)/page_size;
+
+            uint32_t ip0 = 0;
+            uint32_t run = 0;
+            for (uint32_t ip = 0; ip < size_cold/page_size && run < n_pages; ++ip) {
+                if (pages[ip].used > 0) {
+                    run = 0;
+                    continue;
+                }
+                if (run++ == 0) {
+                    ip0 = ip;
+                }
+            }
+
+            if (run < n_pages) {
+                LLAMA_LOG_ERROR("%s: failed to find %u free cold pages in kv cache\n", __func__, n_pages);
+                return false;
+            }
+
+            cold.c0 = page_begin(ip0);
+
+            for (uint32_t i = 0; i < cold.n; ++i) {
+                cells.pos[cold.c0 + i] = batch.pos[i];
+                cells.seq_id[cold.c0 + i].insert(dest_seq_id);
+            }
+
+            page_sync(cold.c0, cold.c0 + cold.n);
+
+            used += cold.n;
+
+            // the hot part goes through the ring as a ubatch of the remaining cells
+            batch.n_tokens  = n_hot;
+            batch.token    += cold.n;
+            batch.pos      += cold.n;
+            batch.n_seq_id += cold.n;
+            batch.seq_id   += cold.n;
+        }
+
         if (!find_slot(batch)) {
             LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
             return false;
@@ -1448,31 +2106,31 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
 
         // DEBUG CHECK: kv.head should be our first cell, kv.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
         // Assume that this is one contiguous block of cells
-        LM_GGML_ASSERT(head + cell_count <= size);
-        LM_GGML_ASSERT(cells[head].pos == batch.pos[0]);
-        LM_GGML_ASSERT(cells[head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-        LM_GGML_ASSERT(cells[head].has_seq_id(dest_seq_id));
-        LM_GGML_ASSERT(cells[head + cell_count - 1].has_seq_id(dest_seq_id));
+        LM_GGML_ASSERT(head + n_hot <= size);
+        LM_GGML_ASSERT(cells.pos[head] == batch.pos[0]);
+        LM_GGML_ASSERT(cells.pos[head + n_hot - 1] == batch.pos[n_hot - 1]);
+        LM_GGML_ASSERT(cells.has_seq_id(head, dest_seq_id));
+        LM_GGML_ASSERT(cells.has_seq_id(head + n_hot - 1, dest_seq_id));
     } else {
         // whole KV cache restore
 
-        if (cell_count > size) {
+        if (cell_count > size || cold.n > size_cold) {
             LLAMA_LOG_ERROR("%s: not enough cells in kv cache\n", __func__);
             return false;
         }
 
         clear();
 
-        for (uint32_t i = 0; i < cell_count; ++i) {
-            kv_cell & cell = cells[i];
-
+        for (uint32_t k = 0; k < cell_count; ++k) {
             llama_pos pos;
             uint32_t  n_seq_id;
 
             io.read_to(&pos,      sizeof(pos));
             io.read_to(&n_seq_id, sizeof(n_seq_id));
 
-            cell.pos = pos;
+            const uint32_t i = k < cold.n ? k : size_cold + k - cold.n;
+
+            cells.pos[i] = pos;
 
             for (uint32_t j = 0; j < n_seq_id; ++j) {
                 llama_seq_id seq_id;
@@ -1483,18 +2141,23 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
                     return false;
                 }
 
-                cell.seq_id.insert(seq_id);
+                cells.seq_id[i].insert(seq_id);
             }
         }
 
-        head = 0;
-        used = cell_count;
+        page_sync(0, size);
+
+        head     = size_cold;
+        hot_next = size_cold + n_hot;
+        used     = cell_count;
+
+        cold.c0 = 0;
     }
 
     return true;
 }
 
-bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell_count) {
+bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell_count, const kv_tier_run & cold) {
     uint32_t v_trans;
     uint32_t n_layer;
 
@@ -1539,8 +2202,15 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
         }
 
         if (cell_count) {
+            const uint32_t n_hot = cell_count - cold.n;
+
+            // The cold cells come first and are requantized into their pages
+            if (cold.n) {
+                tier_store_k(layer, cold.c0, cold.n, (const lm_ggml_fp16_t *) io.read(cold.n * k_size_row));
+            }
+
             // Read and set the keys for the whole cell range
-            lm_ggml_backend_tensor_set(layer.k, io.read(cell_count * k_size_row), head * k_size_row, cell_count * k_size_row);
+            lm_ggml_backend_tensor_set(layer.k, io.read(n_hot * k_size_row), (head - size_cold) * k_size_row, n_hot * k_size_row);
         }
     }
 
@@ -1570,7 +2240,7 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
 
             if (cell_count) {
                 // Read and set the values for the whole cell range
-                lm_ggml_backend_tensor_set(layer.v, io.read(cell_count * v_size_row), head * v_size_row, cell_count * v_size_row);
+                lm_ggml_backend_tensor_set(layer.v, io.read(cell_count * v_size_row), (head - size_cold) * v_size_row, cell_count * v_size_row);
             }
         }
     } else {
@@ -1607,10 +2277,21 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
             }
 
             if (cell_count) {
+                const uint32_t n_hot = cell_count - cold.n;
+
+                std::vector<lm_ggml_fp16_t> cold_v(cold.n * n_embd_v_gqa);
+
                 // For each row in the transposed matrix, read the values for the whole cell range
                 for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
-                    const size_t dst_offset = (head + j * size) * v_size_el;
-                    lm_ggml_backend_tensor_set(layer.v, io.read(cell_count * v_size_el), dst_offset, cell_count * v_size_el);
+                    if (cold.n) {
+                        memcpy(cold_v.data() + j * cold.n, io.read(cold.n * v_size_el), cold.n * v_size_el);
+                    }
+                    const size_t dst_offset = (head - size_cold + j * (size - size_cold)) * v_size_el;
+                    lm_ggml_backend_tensor_set(layer.v, io.read(n_hot * v_size_el), dst_offset, n_hot * v_size_el);
+                }
+
+                if (cold.n) {
+                    tier_store_v(layer, cold.c0, cold.n, cold_v.data(), cold.n);
                 }
             }
         }
@@ -1633,13 +2314,18 @@ llama_kv_cache_unified_iswa::llama_kv_cache_unified_iswa(
                  uint32_t   kv_size,
                  uint32_t   n_seq_max,
                  uint32_t   n_batch,
+                 uint32_t   n_ubatch,
                  uint32_t   n_pad) : hparams(model.hparams) {
     llama_kv_cache_unified::layer_filter_cb filter_base = [&](int32_t il) { return !model.hparams.is_swa(il); };
     llama_kv_cache_unified::layer_filter_cb filter_swa  = [&](int32_t il) { return  model.hparams.is_swa(il); };
 
     const uint32_t size_base = kv_size;
 
-    uint32_t size_swa = std::min(size_base, LM_GGML_PAD(hparams.n_swa*n_seq_max + n_batch, n_pad));
+    // a single sequence is pruned before each ubatch and fills the SWA cache as a ring, so the cache only
+    // holds the window and one ubatch; interleaved sequences fragment it and keep room for a whole batch
+    const bool ring = n_seq_max == 1;
+
+    uint32_t size_swa = std::min(size_base, LM_GGML_PAD(hparams.n_swa*n_seq_max + (ring ? n_ubatch : n_batch), n_pad));
 
     // when using full-size SWA cache, we set the SWA cache size to be equal to the base cache size and disable pruning
     if (swa_full) {
@@ -1655,14 +2341,16 @@ llama_kv_cache_unified_iswa::llama_kv_cache_unified_iswa(
     kv_base = std::make_unique<llama_kv_cache_unified>(
             model, std::move(filter_base), type_k, type_v,
             v_trans, offload, size_base, n_seq_max, n_pad,
-            0, LLAMA_SWA_TYPE_NONE);
+            0, LLAMA_SWA_TYPE_NONE, 0);
 
     LLAMA_LOG_INFO("%s: creating     SWA KV cache, size = %u cells\n", __func__, size_swa);
 
     kv_swa = std::make_unique<llama_kv_cache_unified>(
             model, std::move(filter_swa), type_k, type_v,
             v_trans, offload, size_swa, n_seq_max, n_pad,
-            hparams.n_swa, hparams.swa_type);
+            hparams.n_swa, hparams.swa_type, 0);
+
+    kv_swa->set_ring(ring && do_prune);
 }
 
 void llama_kv_cache_unified_iswa::clear() {
@@ -1718,9 +2406,10 @@ void llama_kv_cache_unified_iswa::commit() {
     kv_swa ->commit();
 
     // slide the attention window, forgetting/pruning old tokens that are outside the window
+    // (each ubatch has already pruned up to its first token, see find_slot())
     if (do_prune) {
         for (const auto & [seq_id, entry] : pending.pos) {
-            kv_swa->prune_swa(seq_id, entry.pmin, entry.pmax);
+            kv_swa->prune_swa(seq_id, entry.pmax, entry.pmax);
         }
 
     }
@@ -1742,12 +2431,31 @@ void llama_kv_cache_unified_iswa::defrag_sched(float thold) {
     kv_swa ->defrag_sched(thold);
 }
 
+void llama_kv_cache_unified_iswa::seq_set_quota(llama_seq_id seq_id, uint32_t n_max_cells, llama_kv_evict_policy policy, uint32_t n_sink) {
+    kv_base->seq_set_quota(seq_id, n_max_cells, policy, n_sink);
+    kv_swa ->seq_set_quota(seq_id, n_max_cells, policy, n_sink);
+}
+
+llama_kv_defrag_stats llama_kv_cache_unified_iswa::get_defrag_stats() const {
+    const llama_kv_defrag_stats base = kv_base->get_defrag_stats();
+    const llama_kv_defrag_stats swa  = kv_swa ->get_defrag_stats();
+
+    llama_kv_defrag_stats res = base;
+
+    res.n_steps       += swa.n_steps;
+    res.n_cells_moved += swa.n_cells_moved;
+    res.n_bytes_moved += swa.n_bytes_moved;
+    res.pending        = base.pending || swa.pending;
+
+    return res;
+}
+
 void llama_kv_cache_unified_iswa::set_full() {
     kv_base->set_full();
     kv_swa ->set_full();
 }
 
-llama_sbatch llama_kv_cache_unified_iswa::sbatch_init(const llama_batch & batch, bool logits_all) {
+void llama_kv_cache_unified_iswa::sbatch_init(llama_sbatch & sbatch, const llama_batch & batch, bool logits_all) {
     pending.clear();
 
     if (do_prune) {
@@ -1757,27 +2465,47 @@ llama_sbatch llama_kv_cache_unified_iswa::sbatch_init(const llama_batch & batch,
                 const llama_pos    pos    = batch.pos[i];
 
                 if (pending.pos.find(seq_id) == pending.pos.end()) {
-                    pending.pos[seq_id].pmin = pos;
                     pending.pos[seq_id].pmax = pos;
                 } else {
-                    pending.pos[seq_id].pmin = std::min(pending.pos[seq_id].pmin, pos);
                     pending.pos[seq_id].pmax = std::max(pending.pos[seq_id].pmax, pos);
                 }
             }
         }
     }
 
-    return llama_sbatch(batch, hparams.n_embd, true, logits_all);
+    sbatch.init(batch, hparams.n_embd, true, logits_all);
 }
 
 llama_ubatch llama_kv_cache_unified_iswa::ubatch_next(llama_sbatch & sbatch, uint32_t n_ubatch, bool embd_pooled) const {
-    LM_GGML_UNUSED(embd_pooled);
+    // a ubatch stops at the end of the SWA ring and the next one continues from its start;
+    // pooled embeddings need a whole sequence in one ubatch
+    if (!embd_pooled) {
+        n_ubatch = std::max(1u, std::min(n_ubatch, kv_swa->get_ring_room()));
+    }
+
     return sbatch.split_simple(n_ubatch);
 }
 
 bool llama_kv_cache_unified_iswa::find_slot(const llama_ubatch & batch) {
     bool res = true;
 
+    // forget what no token of this ubatch attends anymore before placing it, instead of only after
+    // the whole batch, so that its cells are free for the ubatch
+    if (do_prune) {
+        std::unordered_map<llama_seq_id, llama_pos> pos_first;
+
+        for (uint32_t i = 0; i < batch.n_tokens; ++i) {
+            for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+                auto it = pos_first.emplace(batch.seq_id[i][s], batch.pos[i]).first;
+                it->second = std::min(it->second, batch.pos[i]);
+            }
+        }
+
+        for (const auto & [seq_id, pos] : pos_first) {
+            kv_swa->prune_swa(seq_id, pos - 1, pos);
+        }
+    }
+
     res = res & kv_base->find_slot(batch);
     res = res & kv_swa ->find_slot(batch);
 
@@ -1788,6 +2516,10 @@ bool llama_kv_cache_unified_iswa::get_can_shift() const {
     return kv_base->get_size() == kv_swa->get_size();
 }
 
+bool llama_kv_cache_unified_iswa::get_graph_key(std::vector<int64_t> & key) const {
+    return kv_base->get_graph_key(key) && kv_swa->get_graph_key(key);
+}
+
 void llama_kv_cache_unified_iswa::state_write(llama_io_write_i & io, llama_seq_id seq_id) const {
     kv_base->state_write(io, seq_id);
     kv_swa ->state_write(io, seq_id);
@@ -1816,11 +2548,13 @@ llama_kv_cache_recurrent::llama_kv_cache_recurrent(
                 lm_ggml_type   type_v,
                      bool   offload,
                  uint32_t   kv_size,
-                 uint32_t   n_seq_max) : hparams(model.hparams), n_seq_max(n_seq_max) {
+                 uint32_t   n_seq_max,
+                 uint32_t   n_ckpt,
+                 uint32_t   n_ckpt_interval) : hparams(model.hparams), n_seq_max(n_seq_max), n_ckpt(n_ckpt), n_ckpt_interval(n_ckpt_interval) {
     const int32_t n_layer = hparams.n_layer;
 
-    LLAMA_LOG_INFO("%s: kv_size = %u, n_seq_max = %u, type_k = '%s', type_v = '%s', n_layer = %d\n",
-            __func__, kv_size, n_seq_max, lm_ggml_type_name(type_k), lm_ggml_type_name(type_v), n_layer);
+    LLAMA_LOG_INFO("%s: kv_size = %u, n_seq_max = %u, type_k = '%s', type_v = '%s', n_layer = %d, n_ckpt = %u\n",
+            __func__, kv_size, n_seq_max, lm_ggml_type_name(type_k), lm_ggml_type_name(type_v), n_layer, n_ckpt);
 
     head = 0;
     size = kv_size;
@@ -1835,7 +2569,7 @@ llama_kv_cache_recurrent::llama_kv_cache_recurrent(
         auto it = ctx_map.find(buft);
         if (it == ctx_map.end()) {
             lm_ggml_init_params params = {
-                /*.mem_size   =*/ size_t(2u*n_layer*lm_ggml_tensor_overhead()),
+                /*.mem_size   =*/ size_t(4u*n_layer*lm_ggml_tensor_overhead()),
                 /*.mem_buffer =*/ NULL,
                 /*.no_alloc   =*/ true,
             };
@@ -1854,6 +2588,9 @@ llama_kv_cache_recurrent::llama_kv_cache_recurrent(
         return it->second;
     };
 
+    const uint32_t n_ckpt_slots = n_ckpt*std::max(1u, n_seq_max);
+    ckpts.resize(n_ckpt_slots);
+
     k_l.reserve(n_layer);
     v_l.reserve(n_layer);
 
@@ -1885,6 +2622,15 @@ llama_kv_cache_recurrent::llama_kv_cache_recurrent(
         lm_ggml_format_name(v, "cache_v_l%d", i);
         k_l.push_back(k);
         v_l.push_back(v);
+
+        if (n_ckpt_slots > 0) {
+            lm_ggml_tensor * k_c = lm_ggml_new_tensor_1d(ctx, type_k, n_embd_k_gqa*n_ckpt_slots);
+            lm_ggml_tensor * v_c = lm_ggml_new_tensor_1d(ctx, type_v, n_embd_v_gqa*n_ckpt_slots);
+            lm_ggml_format_name(k_c, "cache_k_ckpt_l%d", i);
+            lm_ggml_format_name(v_c, "cache_v_ckpt_l%d", i);
+            k_ckpt.push_back(k_c);
+            v_ckpt.push_back(v_c);
+        }
     }
 
     // allocate tensors and initialize the buffers to avoid NaNs in the padding
@@ -1896,6 +2642,7 @@ llama_kv_cache_recurrent::llama_kv_cache_recurrent(
         if (!buf) {
             throw std::runtime_error("failed to allocate buffer for kv cache");
         }
+        lm_ggml_backend_buffer_set_category(buf, "kv_cache");
         lm_ggml_backend_buffer_clear(buf, 0);
         LLAMA_LOG_INFO("%s: %10s KV buffer size = %8.2f MiB\n", __func__, lm_ggml_backend_buffer_name(buf), lm_ggml_backend_buffer_get_size(buf)/1024.0/1024.0);
         bufs.emplace_back(buf);
@@ -1910,6 +2657,16 @@ llama_kv_cache_recurrent::llama_kv_cache_recurrent(
                 lm_ggml_type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f),
                 lm_ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
     }
+
+    if (!ckpts.empty()) {
+        size_t memory_size_ckpt = 0;
+        for (uint32_t il = 0; il < k_ckpt.size(); ++il) {
+            memory_size_ckpt += lm_ggml_nbytes(k_ckpt[il]) + lm_ggml_nbytes(v_ckpt[il]);
+        }
+
+        LLAMA_LOG_INFO("%s: state checkpoints = %u per sequence every %u tokens, %7.2f MiB\n", __func__,
+                n_ckpt, n_ckpt_interval, (float)memory_size_ckpt / (1024.0f * 1024.0f));
+    }
 }
 
 void llama_kv_cache_recurrent::clear() {
@@ -1922,6 +2679,8 @@ void llama_kv_cache_recurrent::clear() {
     head = 0;
     used = 0;
 
+    ckpt_drop(-1);
+
     for (auto & buf : bufs) {
         lm_ggml_backend_buffer_clear(buf.get(), 0);
     }
@@ -1961,6 +2720,12 @@ bool llama_kv_cache_recurrent::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_p
         if (p0 != p1 && (p0 != 0 || p1 != std::numeric_limits<llama_pos>::max())) {
             return false;
         }
+        // every cell is cleared below, no sequence keeps a tail
+        if (p0 != p1) {
+            for (uint32_t i = 0; i < size; ++i) {
+                cells[i].tail = -1;
+            }
+        }
     }
 
     for (uint32_t i = 0; i < size; ++i) {
@@ -1991,6 +2756,11 @@ bool llama_kv_cache_recurrent::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_p
         head = new_head;
     }
 
+    // a snapshot depends on every position before it
+    if (p0 < p1) {
+        ckpt_drop(seq_id, p0);
+    }
+
     return true;
 }
 
@@ -2028,6 +2798,14 @@ void llama_kv_cache_recurrent::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_
             cell_src.seq_id.insert(seq_id_dst);
             tail_dst.tail = tail_src.tail;
         }
+
+        // the copy can roll back as far as its source
+        ckpt_drop(seq_id_dst);
+        for (auto & slot : ckpts) {
+            if (slot.has_seq_id(seq_id_src)) {
+                slot.seq_id.insert(seq_id_dst);
+            }
+        }
     }
 }
 
@@ -2057,6 +2835,16 @@ void llama_kv_cache_recurrent::seq_keep(llama_seq_id seq_id) {
         }
     }
 
+    for (auto & slot : ckpts) {
+        const bool keep = slot.has_seq_id(seq_id);
+        slot.seq_id.clear();
+        if (keep) {
+            slot.seq_id.insert(seq_id);
+        } else {
+            slot.pos = -1;
+        }
+    }
+
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != size && new_head < head) {
         head = new_head;
@@ -2088,6 +2876,8 @@ void llama_kv_cache_recurrent::seq_add(llama_seq_id seq_id, llama_pos p0, llama_
             kv_cell & cell = cells[tail_id];
             if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
                 cell.pos += delta;
+                // snapshots may be shared with sequences that keep their positions
+                ckpt_drop(seq_id);
             }
         }
     }
@@ -2118,6 +2908,7 @@ void llama_kv_cache_recurrent::seq_div(llama_seq_id seq_id, llama_pos p0, llama_
             kv_cell & cell = cells[tail_id];
             if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
                 cell.pos /= d;
+                ckpt_drop(seq_id);
             }
         }
     }
@@ -2173,15 +2964,215 @@ void llama_kv_cache_recurrent::defrag_sched(float thold) {
     // noop
 }
 
+llama_kv_defrag_stats llama_kv_cache_recurrent::get_defrag_stats() const {
+    return {};
+}
+
+void llama_kv_cache_recurrent::seq_set_quota(llama_seq_id seq_id, uint32_t n_max_cells, llama_kv_evict_policy policy, uint32_t n_sink) {
+    // a recurrent state holds one cell per sequence
+    LM_GGML_UNUSED(seq_id);
+    LM_GGML_UNUSED(n_max_cells);
+    LM_GGML_UNUSED(policy);
+    LM_GGML_UNUSED(n_sink);
+}
+
+bool llama_kv_cache_recurrent::seq_checkpoint(llama_seq_id seq_id) {
+    if (ckpts.empty() || seq_id < 0 || (uint32_t) seq_id >= size) {
+        return false;
+    }
+
+    const int32_t tail_id = cells[seq_id].tail;
+    if (tail_id < 0 || cells[tail_id].pos < 0) {
+        return false;
+    }
+
+    const kv_cell & cell = cells[tail_id];
+
+    const int32_t last = ckpt_find(seq_id, cell.pos + 1);
+    if (last >= 0 && ckpts[last].pos == cell.pos) {
+        return true;
+    }
+
+    // the sequences at this state share the snapshot, each of them gives up its oldest one if full
+    for (const llama_seq_id id : cell.seq_id) {
+        uint32_t n_held = 0;
+        int32_t  oldest = -1;
+        for (uint32_t i = 0; i < ckpts.size(); ++i) {
+            if (ckpts[i].has_seq_id(id)) {
+                n_held++;
+                if (oldest < 0 || ckpts[i].pos < ckpts[oldest].pos) {
+                    oldest = i;
+                }
+            }
+        }
+        if (n_held >= n_ckpt) {
+            ckpts[oldest].seq_id.erase(id);
+            if (ckpts[oldest].is_empty()) {
+                ckpts[oldest].pos = -1;
+            }
+        }
+    }
+
+    // every sequence holds at most n_ckpt - 1 slots now, so one of the n_ckpt*n_seq_max is free
+    int32_t slot_id = -1;
+    for (uint32_t i = 0; i < ckpts.size(); ++i) {
+        if (ckpts[i].is_empty()) {
+            slot_id = i;
+            break;
+        }
+    }
+    LM_GGML_ASSERT(slot_id >= 0);
+
+    // the state of the cell is in the row of its source while a copy is pending
+    const int32_t row = cell.src >= 0 && (uint32_t) cell.src < size ? cell.src : -1;
+
+    ckpt_copy_rows(k_ckpt, v_ckpt, slot_id, k_l, v_l, row);
+
+    ckpts[slot_id].pos    = cell.pos;
+    ckpts[slot_id].seq_id = cell.seq_id;
+
+    return true;
+}
+
+bool llama_kv_cache_recurrent::seq_checkpoint_due(llama_seq_id seq_id) const {
+    if (ckpts.empty() || n_ckpt_interval == 0 || seq_id < 0 || (uint32_t) seq_id >= size) {
+        return false;
+    }
+
+    const int32_t tail_id = cells[seq_id].tail;
+    if (tail_id < 0 || cells[tail_id].pos < 0) {
+        return false;
+    }
+
+    const llama_pos pos = cells[tail_id].pos;
+    const int32_t   last = ckpt_find(seq_id, pos + 1);
+
+    return pos - (last >= 0 ? ckpts[last].pos : -1) >= (llama_pos) n_ckpt_interval;
+}
+
+llama_pos llama_kv_cache_recurrent::seq_rollback(llama_seq_id seq_id, llama_pos p) {
+    if (seq_id < 0 || (uint32_t) seq_id >= size) {
+        return -1;
+    }
+
+    p = std::max(p, 0);
+
+    kv_cell & seq_meta = cells[seq_id];
+    if (seq_meta.tail < 0) {
+        ckpt_drop(seq_id);
+        return 0;
+    }
+    if (cells[seq_meta.tail].pos < p) {
+        // nothing at or after p
+        ckpt_drop(seq_id, p);
+        return cells[seq_meta.tail].pos + 1;
+    }
+
+    const int32_t slot_id = ckpt_find(seq_id, p);
+    if (slot_id < 0) {
+        seq_rm(seq_id, -1, -1);
+        return 0;
+    }
+
+    const ckpt_slot & slot = ckpts[slot_id];
+
+    // restore in place if the state is not shared, otherwise into a cell of its own
+    int32_t cell_id = seq_meta.tail;
+    if (cells[cell_id].seq_id.size() > 1) {
+        cells[cell_id].seq_id.erase(seq_id);
+
+        // the sequences sharing the old cell leave at least one of the max(1, n_seq_max) cells empty
+        cell_id = -1;
+        for (uint32_t i = 0; i < size; ++i) {
+            if (cells[i].is_empty()) {
+                cell_id = i;
+                break;
+            }
+        }
+        LM_GGML_ASSERT(cell_id >= 0);
+
+        cells[cell_id].seq_id.insert(seq_id);
+        seq_meta.tail = cell_id;
+        used++;
+    }
+
+    ckpt_copy_rows(k_l, v_l, cell_id, k_ckpt, v_ckpt, slot_id);
+
+    cells[cell_id].pos = slot.pos;
+    cells[cell_id].src = cell_id;
+
+    const llama_pos p_resume = slot.pos + 1;
+
+    ckpt_drop(seq_id, p_resume);
+
+    return p_resume;
+}
+
+int32_t llama_kv_cache_recurrent::ckpt_find(llama_seq_id seq_id, llama_pos p_max) const {
+    int32_t res = -1;
+
+    for (uint32_t i = 0; i < ckpts.size(); ++i) {
+        const ckpt_slot & slot = ckpts[i];
+        if (slot.has_seq_id(seq_id) && slot.pos < p_max && (res < 0 || slot.pos > ckpts[res].pos)) {
+            res = i;
+        }
+    }
+
+    return res;
+}
+
+void llama_kv_cache_recurrent::ckpt_drop(llama_seq_id seq_id, llama_pos p_min) {
+    for (auto & slot : ckpts) {
+        if (slot.is_empty() || slot.pos < p_min) {
+            continue;
+        }
+        if (seq_id < 0) {
+            slot.seq_id.clear();
+        } else {
+            slot.seq_id.erase(seq_id);
+        }
+        if (slot.is_empty()) {
+            slot.pos = -1;
+        }
+    }
+}
+
+void llama_kv_cache_recurrent::ckpt_copy_rows(
+        const std::vector<lm_ggml_tensor *> & dst_k, const std::vector<lm_ggml_tensor *> & dst_v, int32_t i_dst,
+        const std::vector<lm_ggml_tensor *> & src_k, const std::vector<lm_ggml_tensor *> & src_v, int32_t i_src) {
+    auto copy_row = [&](lm_ggml_tensor * dst, const lm_ggml_tensor * src, size_t row_size) {
+        if (i_src < 0) {
+            lm_ggml_backend_tensor_memset(dst, 0, i_dst*row_size, row_size);
+            return;
+        }
+
+        // the cache and its checkpoints share a buffer type, on unified memory this stays a memcpy
+        if (lm_ggml_backend_buffer_is_host(dst->buffer)) {
+            memcpy((char *) dst->data + i_dst*row_size, (const char *) src->data + i_src*row_size, row_size);
+            return;
+        }
+
+        ckpt_staging.resize(row_size);
+        lm_ggml_backend_tensor_get(src, ckpt_staging.data(), i_src*row_size, row_size);
+        lm_ggml_backend_tensor_set(dst, ckpt_staging.data(), i_dst*row_size, row_size);
+    };
+
+    for (uint32_t il = 0; il < k_l.size(); ++il) {
+        copy_row(dst_k[il], src_k[il], lm_ggml_nbytes(k_l[il])/size);
+        copy_row(dst_v[il], src_v[il], lm_ggml_nbytes(v_l[il])/size);
+    }
+}
+
 void llama_kv_cache_recurrent::set_full() {
     n = size;
     head = 0;
 }
 
-llama_sbatch llama_kv_cache_recurrent::sbatch_init(
+void llama_kv_cache_recurrent::sbatch_init(
+        llama_sbatch & sbatch,
         const llama_batch & batch,
         bool logits_all) {
-    return llama_sbatch(batch, hparams.n_embd, false, logits_all);
+    sbatch.init(batch, hparams.n_embd, false, logits_all);
 }
 
 llama_ubatch llama_kv_cache_recurrent::ubatch_next(llama_sbatch & sbatch, uint32_t n_ubatch, bool embd_pooled) const {
@@ -2242,6 +3233,7 @@ bool llama_kv_cache_recurrent::find_slot(
                         used -= 1;
                     }
                 }
+                ckpt_drop(seq_id);
             }
         }
     }
@@ -2380,10 +3372,15 @@ int32_t llama_kv_cache_recurrent::s_copy(int i) const {
     kv_cell & cell = const_cast<kv_cell &>(cells[cell_id]);
 
     // prevent out-of-bound sources
-    if (cell.src < 0 || (uint32_t) cell.src >= size) {
+    if (cell.src >= 0 && (uint32_t) cell.src >= size) {
         cell.src = cell_id;
     }
 
+    // a cleared state copies itself, src stays negative until s_mask() zeroes it (it is set after this)
+    if (cell.src < 0) {
+        return cell_id;
+    }
+
     int32_t res = cell.src;
 
     // TODO: do not mutate the KV cache
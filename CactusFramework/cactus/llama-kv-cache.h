@@ -1,12 +1,15 @@
 #pragma once
 
 #include "llama.h"
+#include "llama-cparams.h"
 #include "llama-io.h"
 #include "llama-graph.h"
 #include "llama-memory.h"
 
 #include "ggml-cpp.h"
 
+#include <algorithm>
+#include <bitset>
 #include <set>
 #include <unordered_map>
 #include <vector>
@@ -32,8 +35,29 @@ struct llama_kv_cache : public llama_memory_i {
     virtual bool update(llama_context & lctx) = 0;
 
     // schedule a defrag if the fragmentation threshold is exceeded. otherwise, do nothing
+    // a negative thold forces a whole defrag, a scheduled one may be split over several updates
     virtual void defrag_sched(float thold) = 0;
 
+    virtual llama_kv_defrag_stats get_defrag_stats() const = 0;
+
+    // limit the cells of a sequence, n_max_cells == 0 removes the quota
+    virtual void seq_set_quota(llama_seq_id seq_id, uint32_t n_max_cells, llama_kv_evict_policy policy, uint32_t n_sink) = 0;
+
+    // snapshot the state of a sequence for seq_rollback, caches that can remove any range keep none
+    virtual bool seq_checkpoint(llama_seq_id seq_id) { LM_GGML_UNUSED(seq_id); return false; }
+
+    // whether the state a ubatch of seq_id starts from is due for an automatic checkpoint
+    virtual bool seq_checkpoint_due(llama_seq_id seq_id) const { LM_GGML_UNUSED(seq_id); return false; }
+
+    // remove [p, inf) of a sequence, returns the position decoding resumes at or -1 on failure
+    virtual llama_pos seq_rollback(llama_seq_id seq_id, llama_pos p) {
+        p = std::max(p, 0);
+        if (!seq_rm(seq_id, p, -1)) {
+            return -1;
+        }
+        return std::min(p, seq_pos_max(seq_id) + 1);
+    }
+
     // simulate full cache, used for allocating worst-case compute buffers
     virtual void set_full() = 0;
 
@@ -44,7 +68,8 @@ struct llama_kv_cache : public llama_memory_i {
     // =============================================================================================================
     // TODO: refactor  and simplify this
 
-    virtual llama_sbatch sbatch_init(const llama_batch & batch, bool logits_all) = 0;
+    // sbatch is owned by the caller and reused across batches
+    virtual void sbatch_init(llama_sbatch & sbatch, const llama_batch & batch, bool logits_all) = 0;
 
     // different KV caches require different batch splitting strategies
     virtual llama_ubatch ubatch_next(llama_sbatch & sbatch, uint32_t n_ubatch, bool embd_pooled) const = 0;
@@ -59,6 +84,11 @@ struct llama_kv_cache : public llama_memory_i {
 
     bool get_can_edit() const override { return get_can_shift(); }
 
+    // appends the cache state a graph built for the current slot depends on, other than the head its
+    // K/V stores write at; with equal keys and the same ubatch shape the graph can be reused
+    // returns false if graphs of this cache cannot be reused
+    virtual bool get_graph_key(std::vector<int64_t> & key) const { LM_GGML_UNUSED(key); return false; }
+
     //
     // state write/read
     //
@@ -108,7 +138,8 @@ public:
                      uint32_t    n_seq_max,
                      uint32_t    n_pad,
                      uint32_t    n_swa,
-               llama_swa_type    swa_type);
+               llama_swa_type    swa_type,
+                     uint32_t    kv_size_hot);
 
     ~llama_kv_cache_unified() = default;
 
@@ -138,9 +169,13 @@ public:
 
     void defrag_sched(float thold) override;
 
+    llama_kv_defrag_stats get_defrag_stats() const override;
+
+    void seq_set_quota(llama_seq_id seq_id, uint32_t n_max_cells, llama_kv_evict_policy policy, uint32_t n_sink) override;
+
     void set_full() override;
 
-    llama_sbatch sbatch_init(const llama_batch & batch, bool logits_all) override;
+    void sbatch_init(llama_sbatch & sbatch, const llama_batch & batch, bool logits_all) override;
     llama_ubatch ubatch_next(llama_sbatch & sbatch, uint32_t n_ubatch, bool embd_pooled) const override;
 
     // updates the cache head
@@ -150,6 +185,8 @@ public:
 
     bool get_can_shift() const override;
 
+    bool get_graph_key(std::vector<int64_t> & key) const override;
+
     // state write/load
 
     void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const override;
@@ -166,12 +203,26 @@ public:
     lm_ggml_tensor * get_k(lm_ggml_context * ctx, int32_t il) const;
     lm_ggml_tensor * get_v(lm_ggml_context * ctx, int32_t il) const;
 
+    // views of the cold cells of a tiered cache, nullptr while none of them is attended
+    lm_ggml_tensor * get_k_cold(lm_ggml_context * ctx, int32_t il) const;
+    lm_ggml_tensor * get_v_cold(lm_ggml_context * ctx, int32_t il) const;
+
     // store k_cur and v_cur in the cache based on the current head location
     lm_ggml_tensor * cpy_k(lm_ggml_context * ctx, lm_ggml_tensor * k_cur, int32_t il) const;
     lm_ggml_tensor * cpy_v(lm_ggml_context * ctx, lm_ggml_tensor * v_cur, int32_t il) const;
 
+    // byte offset of the current head in the K (or V) tensor of layer il, where cpy_k (cpy_v) writes
+    size_t get_store_offset(int32_t il, bool v) const;
+
     void prune_swa(llama_seq_id seq_id, llama_pos pmin, llama_pos pmax);
 
+    // ring placement: each slot starts where the free cells are in ring order, so a single sequence
+    // pruned before every ubatch keeps one contiguous run of free cells (set for a window-sized SWA cache)
+    void set_ring(bool ring);
+
+    // cells from the next ring slot to the end of the cache, the most one ubatch can take without wrapping
+    uint32_t get_ring_room() const;
+
     void set_input_kq_mask   (lm_ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
     void set_input_k_shift   (lm_ggml_tensor * dst) const;
     void set_input_pos_bucket(lm_ggml_tensor * dst, const llama_ubatch * ubatch) const;
@@ -180,15 +231,51 @@ private:
     const llama_model & model;
     const llama_hparams & hparams;
 
+    // one bit per sequence, so a membership test in the attention mask is a single lookup
+    struct kv_seq_set {
+        std::bitset<LLAMA_MAX_PARALLEL_SEQUENCES> bits;
+
+        bool has(llama_seq_id id) const {
+            return id >= 0 && id < LLAMA_MAX_PARALLEL_SEQUENCES && bits.test(id);
+        }
+
+        void insert(llama_seq_id id) {
+            LM_GGML_ASSERT(id >= 0 && id < LLAMA_MAX_PARALLEL_SEQUENCES);
+            bits.set(id);
+        }
+
+        void erase(llama_seq_id id) {
+            if (id >= 0 && id < LLAMA_MAX_PARALLEL_SEQUENCES) {
+                bits.reset(id);
+            }
+        }
+
+        void clear()        { bits.reset(); }
+        bool empty() const  { return bits.none(); }
+        uint32_t size() const { return bits.count(); }
+
+        llama_seq_id first() const {
+            for (llama_seq_id id = 0; id < LLAMA_MAX_PARALLEL_SEQUENCES; ++id) {
+                if (bits.test(id)) {
+                    return id;
+                }
+            }
+            return -1;
+        }
+
+        bool operator==(const kv_seq_set & other) const {
+            return bits == other.bits;
+        }
+    };
+
     struct kv_cell {
         llama_pos pos   = -1;
         llama_pos delta =  0;
 
-        // TODO: replace with bitset uint64_t
-        std::set<llama_seq_id> seq_id;
+        kv_seq_set seq_id;
 
         bool has_seq_id(const llama_seq_id & id) const {
-            return seq_id.find(id) != seq_id.end();
+            return seq_id.has(id);
         }
 
         bool is_empty() const {
@@ -207,6 +294,10 @@ private:
 
         lm_ggml_tensor * k;
         lm_ggml_tensor * v;
+
+        // cold tier of a tiered cache: K rows per cell, V transposed with each row quantized along the cells
+        lm_ggml_tensor * k_cold = nullptr;
+        lm_ggml_tensor * v_cold = nullptr;
     };
 
     bool has_shift = false;
@@ -220,6 +311,17 @@ private:
     // computed before each graph build
     uint32_t n = 0;
 
+    // tiered cache: the cells [0, size_cold) live in the cold tensors and are only ever written a whole
+    // page at a time, the cells [size_cold, size) live in k/v as F16 and take the ubatches like a ring
+    uint32_t size_cold = 0;
+    uint32_t n_cold    = 0; // cold cells attended, the first n_cold of the n mask columns
+    uint32_t hot_next  = 0; // the hot cell after the last slot, where the ring continues
+
+    bool ring = false;
+
+    // where the free run that follows the newest cells begins, hot_next once a rollback is undone
+    uint32_t ring_head() const;
+
     const uint32_t n_seq_max = 1;
 
     // required padding
@@ -233,9 +335,67 @@ private:
     std::vector<lm_ggml_context_ptr>        ctxs;
     std::vector<lm_ggml_backend_buffer_ptr> bufs;
 
-    std::vector<kv_cell>  cells;  // TODO: replace with `struct kv_cells`
+    // the cells as parallel arrays, so the scans and the mask builder each stream one dense array;
+    // kv_cell remains the value type for recovery and defrag moves
+    struct kv_cells {
+        std::vector<llama_pos>  pos;
+        std::vector<llama_pos>  delta;
+        std::vector<kv_seq_set> seq_id;
+
+        void resize(uint32_t n) {
+            pos.assign(n, -1);
+            delta.assign(n, 0);
+            seq_id.assign(n, kv_seq_set());
+        }
+
+        bool is_empty(uint32_t i) const {
+            return seq_id[i].empty();
+        }
+
+        bool has_seq_id(uint32_t i, llama_seq_id id) const {
+            return seq_id[i].has(id);
+        }
+
+        kv_cell get(uint32_t i) const {
+            kv_cell cell;
+            cell.pos    = pos[i];
+            cell.delta  = delta[i];
+            cell.seq_id = seq_id[i];
+            return cell;
+        }
+
+        void set(uint32_t i, const kv_cell & cell) {
+            pos[i]    = cell.pos;
+            delta[i]  = cell.delta;
+            seq_id[i] = cell.seq_id;
+        }
+    };
+
+    kv_cells              cells;
     std::vector<kv_layer> layers;
 
+    // cells grouped in fixed-size pages, each keeping the union of its cells' sequences and its
+    // count of non-empty cells, so per-sequence scans, the mask and find_slot skip whole pages
+    static constexpr uint32_t page_size = 32;
+
+    struct kv_page {
+        kv_seq_set seq_id;
+        uint32_t   used = 0;
+    };
+
+    std::vector<kv_page> pages;
+
+    uint32_t page_begin(uint32_t ip) const { return ip*page_size; }
+    uint32_t page_end  (uint32_t ip) const { return std::min(size, (ip + 1)*page_size); }
+
+    // a negative seq_id matches any page with a non-empty cell
+    bool page_has_seq(uint32_t ip, llama_seq_id seq_id) const {
+        return seq_id < 0 ? pages[ip].used > 0 : pages[ip].seq_id.has(seq_id);
+    }
+
+    // recompute the pages overlapping the cells [i0, i1)
+    void page_sync(uint32_t i0, uint32_t i1);
+
     // model layer id -> KV cache layer id
     std::unordered_map<int32_t, int32_t> map_layer_ids;
 
@@ -248,17 +408,60 @@ private:
         std::unordered_map<uint32_t, kv_cell> cells;
     } recovery;
 
+    struct kv_quota {
+        uint32_t n_max_cells = 0;
+        uint32_t n_sink      = 0;
+
+        llama_kv_evict_policy policy = LLAMA_KV_EVICT_POLICY_NONE;
+    };
+
+    // seq_id -> cell quota
+    std::unordered_map<llama_seq_id, kv_quota> seq_quotas;
+
+    // make room under the quotas of the sequences in the ubatch, false if a quota cannot be met
+    bool quota_apply(const llama_ubatch & ubatch);
+
     // defrag
     struct {
         std::vector<uint32_t> ids;
+
+        uint32_t n_cells = 0;     // moved by the prepared step
+        bool     partial = false; // the prepared step left holes behind
+        bool     forced  = false; // requested with a negative thold, not bounded by defrag_max_cells
+
+        uint32_t n_steps       = 0;
+        uint64_t n_cells_moved = 0;
+        uint64_t n_bytes_moved = 0;
     } defrag_info;
 
-    // return true if cells have been moved
-    bool defrag_prepare(int32_t n_max_nodes);
+    // return true if cells have been moved, at most n_max_cells of them when > 0
+    bool defrag_prepare(int32_t n_max_nodes, uint32_t n_max_cells);
 
     // find how many cells are currently in use
     uint32_t cell_max() const;
 
+    // end of the last cold page in use
+    uint32_t cold_max() const;
+
+    // cell behind mask column i: the cold columns come first, then the hot ones
+    uint32_t cell_of(uint32_t i) const {
+        return i < n_cold ? i : i - n_cold + size_cold;
+    }
+
+    // requantize the non-empty hot cells in [i0, i1) into free cold pages and free them
+    bool tier_evict(uint32_t i0, uint32_t i1);
+
+    // write n cells given as F16 to the cold cells [c0, c0 + n) of a layer, c0 being page aligned:
+    // the K rows one after the other, the V rows transposed with ld values from one channel to the next
+    void tier_store_k(const kv_layer & layer, uint32_t c0, uint32_t n, const lm_ggml_fp16_t * k) const;
+    void tier_store_v(const kv_layer & layer, uint32_t c0, uint32_t n, const lm_ggml_fp16_t * v, size_t ld) const;
+
+    // state for a tiered cache: the cold cells [c0, c0 + n) of a restore, the rest goes to the hot ring
+    struct kv_tier_run {
+        uint32_t c0 = 0;
+        uint32_t n  = 0;
+    };
+
     size_t total_size() const;
 
     size_t size_k_bytes() const;
@@ -288,8 +491,11 @@ private:
     void state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id = -1) const;
     void state_write_data(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) const;
 
-    bool state_read_meta(llama_io_read_i & io, uint32_t cell_count, llama_seq_id dest_seq_id = -1);
-    bool state_read_data(llama_io_read_i & io, uint32_t cell_count);
+    bool state_read_meta(llama_io_read_i & io, uint32_t cell_count, kv_tier_run & cold, llama_seq_id dest_seq_id = -1);
+    bool state_read_data(llama_io_read_i & io, uint32_t cell_count, const kv_tier_run & cold);
+
+    // write the elements [i0, i0 + n) of the cold row data at offset as F16
+    void state_write_cold(llama_io_write_i & io, const lm_ggml_tensor * t, size_t offset, size_t i0, size_t n) const;
 };
 
 //
@@ -312,6 +518,7 @@ public:
                      uint32_t   kv_size,
                      uint32_t   n_seq_max,
                      uint32_t   n_batch,
+                     uint32_t   n_ubatch,
                      uint32_t   n_pad);
 
     ~llama_kv_cache_unified_iswa() = default;
@@ -342,15 +549,21 @@ public:
 
     void defrag_sched(float thold) override;
 
+    llama_kv_defrag_stats get_defrag_stats() const override;
+
+    void seq_set_quota(llama_seq_id seq_id, uint32_t n_max_cells, llama_kv_evict_policy policy, uint32_t n_sink) override;
+
     void set_full() override;
 
-    llama_sbatch sbatch_init(const llama_batch & batch, bool logits_all) override;
+    void sbatch_init(llama_sbatch & sbatch, const llama_batch & batch, bool logits_all) override;
     llama_ubatch ubatch_next(llama_sbatch & sbatch, uint32_t n_ubatch, bool embd_pooled) const override;
 
     bool find_slot(const llama_ubatch & batch) override;
 
     bool get_can_shift() const override;
 
+    bool get_graph_key(std::vector<int64_t> & key) const override;
+
     // state write/load
 
     void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const override;
@@ -370,7 +583,6 @@ private:
 
     struct {
         struct entry {
-            llama_pos pmin;
             llama_pos pmax;
         };
 
@@ -418,7 +630,9 @@ public:
                     lm_ggml_type   type_v,
                          bool   offload,
                      uint32_t   kv_size,
-                     uint32_t   n_seq_max);
+                     uint32_t   n_seq_max,
+                     uint32_t   n_ckpt,
+                     uint32_t   n_ckpt_interval);
 
     ~llama_kv_cache_recurrent() = default;
 
@@ -448,9 +662,18 @@ public:
 
     void defrag_sched(float thold) override;
 
+    llama_kv_defrag_stats get_defrag_stats() const override;
+
+    void seq_set_quota(llama_seq_id seq_id, uint32_t n_max_cells, llama_kv_evict_policy policy, uint32_t n_sink) override;
+
+    bool seq_checkpoint(llama_seq_id seq_id) override;
+    bool seq_checkpoint_due(llama_seq_id seq_id) const override;
+
+    llama_pos seq_rollback(llama_seq_id seq_id, llama_pos p) override;
+
     void set_full() override;
 
-    llama_sbatch sbatch_init(const llama_batch & batch, bool logits_all) override;
+    void sbatch_init(llama_sbatch & sbatch, const llama_batch & batch, bool logits_all) override;
     llama_ubatch ubatch_next(llama_sbatch & sbatch, uint32_t n_ubatch, bool embd_pooled) const override;
 
     bool find_slot(const llama_ubatch & batch) override;
@@ -496,9 +719,45 @@ private:
 
     const uint32_t n_seq_max = 1;
 
+    // a snapshot of the state of every layer at pos, shared by the sequences that were at that
+    // state when it was taken; rows of k_ckpt/v_ckpt live next to the cells they are copied from
+    struct ckpt_slot {
+        llama_pos pos = -1;
+
+        std::set<llama_seq_id> seq_id;
+
+        bool has_seq_id(const llama_seq_id & id) const {
+            return seq_id.find(id) != seq_id.end();
+        }
+
+        bool is_empty() const {
+            return seq_id.empty();
+        }
+    };
+
+    const uint32_t n_ckpt          = 0; // per sequence, the oldest is dropped for a new one
+    const uint32_t n_ckpt_interval = 0;
+
+    std::vector<ckpt_slot> ckpts; // n_ckpt*n_seq_max, enough for every sequence to hold n_ckpt
+
+    std::vector<lm_ggml_tensor *> k_ckpt; // per layer
+    std::vector<lm_ggml_tensor *> v_ckpt;
+
+    std::vector<uint8_t> ckpt_staging; // for rows of buffers that are not host memory
+
     std::vector<lm_ggml_context_ptr>        ctxs;
     std::vector<lm_ggml_backend_buffer_ptr> bufs;
 
+    // newest checkpoint of seq_id with a pos below p_max, -1 if there is none
+    int32_t ckpt_find(llama_seq_id seq_id, llama_pos p_max) const;
+
+    // drop the checkpoints of seq_id (all sequences if < 0) at p_min and after
+    void ckpt_drop(llama_seq_id seq_id, llama_pos p_min = 0);
+
+    // copy the state rows of every layer, a negative src zeroes dst
+    void ckpt_copy_rows(const std::vector<lm_ggml_tensor *> & dst_k, const std::vector<lm_ggml_tensor *> & dst_v, int32_t i_dst,
+                        const std::vector<lm_ggml_tensor *> & src_k, const std::vector<lm_ggml_tensor *> & src_v, int32_t i_src);
+
     // find how many cells are currently in use
     uint32_t cell_max() const;
 
@@ -7,8 +7,15 @@ struct llama_memory_params {
     lm_ggml_type type_k;
     lm_ggml_type type_v;
 
+    // F16 cells kept ahead of the quantized tier, 0 = not tiered
+    uint32_t n_kv_recent;
+
     // use full-size SWA cache
     bool swa_full;
+
+    // recurrent state checkpoints per sequence and the tokens between automatic ones
+    uint32_t n_ckpt;
+    uint32_t n_ckpt_interval;
 };
 
 // general concept of LLM memory
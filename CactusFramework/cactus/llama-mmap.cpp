@@ -354,6 +354,25 @@ struct llama_mmap::impl {
         mapped_fragments = std::move(new_mapped_fragments);
     }
 
+    void advise(size_t first, size_t last, bool willneed) {
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        if (willneed) {
+            // widen to whole pages, reading a neighbour's page early is harmless
+            first &= ~(page_size - 1);
+            last = std::min(size, (last + page_size - 1) & ~(page_size - 1));
+        } else {
+            // narrow to whole pages, a shared page may still be in use by a neighbour
+            align_range(&first, &last, page_size);
+        }
+        if (last <= first) {
+            return;
+        }
+        if (madvise((char *) addr + first, last - first, willneed ? MADV_WILLNEED : MADV_DONTNEED)) {
+            LLAMA_LOG_WARN("warning: madvise(.., %s) failed: %s\n",
+                    willneed ? "MADV_WILLNEED" : "MADV_DONTNEED", strerror(errno));
+        }
+    }
+
     ~impl() {
         for (const auto & frag : mapped_fragments) {
             if (munmap((char *) addr + frag.first, frag.second - frag.first)) {
@@ -411,6 +430,30 @@ struct llama_mmap::impl {
         LM_GGML_UNUSED(last);
     }
 
+    void advise(size_t first, size_t last, bool willneed) {
+        // there is no cheap way to drop file-backed pages from a view, the working set
+        // manager trims them under pressure
+        if (!willneed || last <= first) {
+            return;
+        }
+#if _WIN32_WINNT >= 0x602
+        BOOL (WINAPI *pPrefetchVirtualMemory) (HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG);
+        HMODULE hKernel32 = GetModuleHandleW(L"kernel32.dll");
+
+        pPrefetchVirtualMemory = (decltype(pPrefetchVirtualMemory))(void *) GetProcAddress(hKernel32, "PrefetchVirtualMemory");
+
+        if (pPrefetchVirtualMemory) {
+            WIN32_MEMORY_RANGE_ENTRY range;
+            range.VirtualAddress = (char *) addr + first;
+            range.NumberOfBytes = (SIZE_T) (std::min(size, last) - first);
+            if (!pPrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0)) {
+                LLAMA_LOG_WARN("warning: PrefetchVirtualMemory failed: %s\n",
+                        llama_format_win_err(GetLastError()).c_str());
+            }
+        }
+#endif
+    }
+
     ~impl() {
         if (!UnmapViewOfFile(addr)) {
             LLAMA_LOG_WARN("warning: UnmapViewOfFile failed: %s\n",
@@ -432,6 +475,12 @@ struct llama_mmap::impl {
 
         throw std::runtime_error("mmap not supported");
     }
+
+    void advise(size_t first, size_t last, bool willneed) {
+        LM_GGML_UNUSED(first);
+        LM_GGML_UNUSED(last);
+        LM_GGML_UNUSED(willneed);
+    }
 #endif
 
     void * addr;
@@ -445,6 +494,7 @@ size_t llama_mmap::size() const { return pimpl->size; }
 void * llama_mmap::addr() const { return pimpl->addr; }
 
 void llama_mmap::unmap_fragment(size_t first, size_t last) { pimpl->unmap_fragment(first, last); }
+void llama_mmap::advise(size_t first, size_t last, bool willneed) { pimpl->advise(first, last, willneed); }
 
 #if defined(_POSIX_MEMLOCK_RANGE) || defined(_WIN32)
 const bool llama_mmap::SUPPORTED  = true;
@@ -44,6 +44,10 @@ struct llama_mmap {
 
     void unmap_fragment(size_t first, size_t last);
 
+    // hint that [first, last) is about to be read (willneed) or may be dropped from memory;
+    // the pages stay mapped and are read back from the file on the next access
+    void advise(size_t first, size_t last, bool willneed);
+
     static const bool SUPPORTED;
 
 private:
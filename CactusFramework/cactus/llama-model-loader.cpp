@@ -3,9 +3,16 @@
 #include "ggml.h"
 
 #include <array>
+#include <atomic>
 #include <cinttypes>
+#include <condition_variable>
+#include <cstdio>
 #include <cstring>
+#include <deque>
 #include <future>
+#include <mutex>
+#include <thread>
+#include <sys/stat.h>
 
 static const size_t kiB = 1024;
 static const size_t MiB = 1024*kiB;
@@ -445,6 +452,7 @@ llama_model_loader::llama_model_loader(
         std::vector<std::string> & splits,
         bool use_mmap,
         bool check_tensors,
+        bool use_repack_cache,
         const llama_model_kv_override * param_overrides_p,
         const llama_model_tensor_buft_override * param_tensor_buft_overrides_p) {
     int trace = 0;
@@ -452,6 +460,11 @@ llama_model_loader::llama_model_loader(
         trace = atoi(getenv("LLAMA_TRACE"));
     }
 
+    if (use_repack_cache) {
+        repack_cache_fname  = fname + ".repack.gguf";
+        repack_source_fname = fname;
+    }
+
     if (param_overrides_p != nullptr) {
         for (const struct llama_model_kv_override * p = param_overrides_p; p->key[0] != 0; p++) {
             kv_overrides.insert({std::string(p->key), *p});
@@ -476,6 +489,7 @@ llama_model_loader::llama_model_loader(
     llm_kv = LLM_KV(llm_arch_from_string(arch_name));
 
     files.emplace_back(new llama_file(fname.c_str(), "rb"));
+    file_names.emplace_back(fname);
     contexts.emplace_back(ctx);
 
     // Save tensors data offset of the main file.
@@ -544,6 +558,7 @@ llama_model_loader::llama_model_loader(
             }
 
             files.emplace_back(new llama_file(fname_split, "rb"));
+            file_names.emplace_back(fname_split);
             contexts.emplace_back(ctx);
 
             // Save tensors data offset info of the shard.
@@ -848,6 +863,176 @@ void llama_model_loader::init_mappings(bool prefetch, llama_mlocks * mlock_mmaps
     for (const auto & it : weights_map) {
         size_data += lm_ggml_nbytes(it.second.tensor);
     }
+
+    repack_cache_open();
+}
+
+// bump when a repacked layout changes without changing its name
+static const uint32_t LLAMA_REPACK_CACHE_VERSION = 1;
+
+static const char * LLAMA_REPACK_KEY_VERSION      = "repack.version";
+static const char * LLAMA_REPACK_KEY_SOURCE_SIZE  = "repack.source.size";
+static const char * LLAMA_REPACK_KEY_SOURCE_MTIME = "repack.source.mtime";
+static const char * LLAMA_REPACK_KEY_LAYOUTS      = "repack.layouts";
+
+static bool llama_repack_source_stat(const std::string & fname, uint64_t & size, uint64_t & mtime) {
+    struct stat st;
+    if (stat(fname.c_str(), &st) != 0) {
+        return false;
+    }
+    size  = (uint64_t) st.st_size;
+    mtime = (uint64_t) st.st_mtime;
+    return true;
+}
+
+void llama_model_loader::repack_cache_open() {
+    if (repack_cache_fname.empty()) {
+        return;
+    }
+
+    uint64_t source_size  = 0;
+    uint64_t source_mtime = 0;
+    if (!llama_repack_source_stat(repack_source_fname, source_size, source_mtime)) {
+        repack_cache_fname.clear();
+        return;
+    }
+
+    // a missing cache is the first load, not an error
+    struct stat st;
+    if (stat(repack_cache_fname.c_str(), &st) != 0) {
+        return;
+    }
+
+    struct lm_ggml_context * ctx = nullptr;
+    struct lm_gguf_init_params params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &ctx,
+    };
+    lm_gguf_context_ptr meta_cache { lm_gguf_init_from_file(repack_cache_fname.c_str(), params) };
+    lm_ggml_context_ptr ctx_cache  { ctx };
+    if (!meta_cache) {
+        LLAMA_LOG_WARN("%s: ignoring unreadable repack cache %s\n", __func__, repack_cache_fname.c_str());
+        return;
+    }
+
+    const int64_t kid_version = lm_gguf_find_key(meta_cache.get(), LLAMA_REPACK_KEY_VERSION);
+    const int64_t kid_size    = lm_gguf_find_key(meta_cache.get(), LLAMA_REPACK_KEY_SOURCE_SIZE);
+    const int64_t kid_mtime   = lm_gguf_find_key(meta_cache.get(), LLAMA_REPACK_KEY_SOURCE_MTIME);
+    const int64_t kid_layouts = lm_gguf_find_key(meta_cache.get(), LLAMA_REPACK_KEY_LAYOUTS);
+    if (kid_version < 0 || kid_size < 0 || kid_mtime < 0 || kid_layouts < 0 ||
+        lm_gguf_get_val_u32(meta_cache.get(), kid_version) != LLAMA_REPACK_CACHE_VERSION ||
+        lm_gguf_get_val_u64(meta_cache.get(), kid_size)    != source_size ||
+        lm_gguf_get_val_u64(meta_cache.get(), kid_mtime)   != source_mtime ||
+        lm_gguf_get_arr_n(meta_cache.get(), kid_layouts)   != (size_t) lm_gguf_get_n_tensors(meta_cache.get())) {
+        LLAMA_LOG_INFO("%s: repack cache %s does not match the model, it will be rewritten\n", __func__, repack_cache_fname.c_str());
+        return;
+    }
+
+    try {
+        repack_cache_file    = std::make_unique<llama_file>(repack_cache_fname.c_str(), "rb");
+        repack_cache_mapping = std::make_unique<llama_mmap>(repack_cache_file.get(), 0);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_WARN("%s: failed to map repack cache %s: %s\n", __func__, repack_cache_fname.c_str(), err.what());
+        repack_cache_mapping.reset();
+        repack_cache_file.reset();
+        return;
+    }
+
+    repack_cache_meta = std::move(meta_cache);
+    repack_cache_ctx  = std::move(ctx_cache);
+}
+
+bool llama_model_loader::repack_cache_load(lm_ggml_tensor * cur, const char * layout) {
+    if (!repack_cache_mapping) {
+        return false;
+    }
+
+    const int64_t tid = lm_gguf_find_tensor(repack_cache_meta.get(), lm_ggml_get_name(cur));
+    if (tid < 0) {
+        return false;
+    }
+
+    const lm_ggml_tensor * cached = lm_ggml_get_tensor(repack_cache_ctx.get(), lm_ggml_get_name(cur));
+    const int64_t       kid    = lm_gguf_find_key(repack_cache_meta.get(), LLAMA_REPACK_KEY_LAYOUTS);
+    if (cached == nullptr || cached->type != cur->type || !lm_ggml_are_same_shape(cached, cur) ||
+        strcmp(lm_gguf_get_arr_str(repack_cache_meta.get(), kid, tid), layout) != 0) {
+        return false;
+    }
+
+    const size_t n_size = lm_ggml_nbytes(cur);
+    const size_t offs   = lm_gguf_get_data_offset(repack_cache_meta.get()) + lm_gguf_get_tensor_offset(repack_cache_meta.get(), tid);
+    if (offs + n_size > repack_cache_mapping->size()) {
+        return false;
+    }
+
+    // the repack buffer lives in host memory, see lm_ggml_backend_cpu_repack_layout
+    memcpy(cur->data, (const uint8_t *) repack_cache_mapping->addr() + offs, n_size);
+    return true;
+}
+
+void llama_model_loader::repack_cache_save() const {
+    uint64_t source_size  = 0;
+    uint64_t source_mtime = 0;
+    if (!llama_repack_source_stat(repack_source_fname, source_size, source_mtime)) {
+        return;
+    }
+
+    auto * dev = lm_ggml_backend_dev_by_type(LM_GGML_BACKEND_DEVICE_TYPE_CPU);
+    auto * repack_layout_fn = dev == nullptr ? nullptr : (decltype(lm_ggml_backend_cpu_repack_layout) *)
+        lm_ggml_backend_reg_get_proc_address(lm_ggml_backend_dev_backend_reg(dev), "lm_ggml_backend_cpu_repack_layout");
+    if (repack_layout_fn == nullptr) {
+        return;
+    }
+
+    lm_gguf_context_ptr ctx_out { lm_gguf_init_empty() };
+
+    std::vector<const char *> layouts;
+    for (lm_ggml_tensor * cur : repack_tensors) {
+        // the copy is written from host memory, not through the repack buffer which cannot be read back
+        lm_ggml_tensor t = *cur;
+        t.buffer = nullptr;
+        t.extra  = nullptr;
+        lm_gguf_add_tensor(ctx_out.get(), &t);
+        layouts.push_back(repack_layout_fn(cur));
+    }
+
+    lm_gguf_set_val_u32(ctx_out.get(), LLAMA_REPACK_KEY_VERSION,      LLAMA_REPACK_CACHE_VERSION);
+    lm_gguf_set_val_u64(ctx_out.get(), LLAMA_REPACK_KEY_SOURCE_SIZE,  source_size);
+    lm_gguf_set_val_u64(ctx_out.get(), LLAMA_REPACK_KEY_SOURCE_MTIME, source_mtime);
+    lm_gguf_set_arr_str(ctx_out.get(), LLAMA_REPACK_KEY_LAYOUTS, layouts.data(), layouts.size());
+
+    // write to a temporary file first so that an interrupted save never leaves a truncated cache behind
+    const std::string fname_tmp = repack_cache_fname + ".tmp";
+    size_t n_written = 0;
+    try {
+        llama_file file(fname_tmp.c_str(), "wb");
+
+        std::vector<uint8_t> buf(lm_gguf_get_meta_size(ctx_out.get()));
+        lm_gguf_get_meta_data(ctx_out.get(), buf.data());
+        file.write_raw(buf.data(), buf.size());
+
+        const size_t alignment = lm_gguf_get_alignment(ctx_out.get());
+        const std::vector<uint8_t> zeros(alignment, 0);
+        for (lm_ggml_tensor * cur : repack_tensors) {
+            const size_t n_size = lm_ggml_nbytes(cur);
+            file.write_raw(cur->data, n_size);
+            file.write_raw(zeros.data(), LM_GGML_PAD(n_size, alignment) - n_size);
+            n_written += n_size;
+        }
+    } catch (const std::exception & err) {
+        LLAMA_LOG_WARN("%s: failed to write repack cache %s: %s\n", __func__, repack_cache_fname.c_str(), err.what());
+        std::remove(fname_tmp.c_str());
+        return;
+    }
+
+    if (std::rename(fname_tmp.c_str(), repack_cache_fname.c_str()) != 0) {
+        LLAMA_LOG_WARN("%s: failed to write repack cache %s\n", __func__, repack_cache_fname.c_str());
+        std::remove(fname_tmp.c_str());
+        return;
+    }
+
+    LLAMA_LOG_INFO("%s: saved %zu repacked tensors (%.2f MiB) to %s\n", __func__,
+        repack_tensors.size(), n_written/1024.0/1024.0, repack_cache_fname.c_str());
 }
 
 void llama_model_loader::get_mapping_range(size_t * first, size_t * last, void ** addr, int idx, lm_ggml_context * ctx) const {
@@ -890,6 +1075,158 @@ void llama_model_loader::load_data_for(struct lm_ggml_tensor * cur) const {
     }
 }
 
+// more readers than this stop helping even on fast flash storage
+static const int LLAMA_LOAD_MAX_THREADS = 8;
+
+// Tensors that land in CPU memory (host buffers, CPU repack buffers) are read, repacked and validated
+// by these workers, each with its own file handles, while the loader thread maps the remaining
+// tensors and feeds the staged device uploads, so disk reads, repacking and uploads overlap
+struct llama_load_workers {
+    struct job {
+        lm_ggml_tensor * cur;
+        uint16_t      idx;  // source file
+        size_t        offs; // tensor data offset in the source file
+        const void  * src;  // mapped tensor data, read from the file if null
+    };
+
+    llama_load_workers(const std::vector<std::string> & file_names, bool check_tensors)
+        : file_names(file_names), check_tensors(check_tensors) {
+        const int n_threads = std::max(1, std::min<int>(std::thread::hardware_concurrency(), LLAMA_LOAD_MAX_THREADS));
+        for (int i = 0; i < n_threads; i++) {
+            threads.emplace_back([this] { run(); });
+        }
+    }
+
+    ~llama_load_workers() {
+        finish([] { return false; });
+    }
+
+    void push(const job & j) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(j);
+        }
+        cv_jobs.notify_one();
+    }
+
+    // wait for the queued jobs, calling progress every time one completes
+    // returns false if progress asked to stop, the remaining jobs are dropped
+    template <typename F>
+    bool finish(F progress) {
+        bool ok = true;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            closed = true;
+            cv_jobs.notify_all();
+            while (n_busy > 0 || (!jobs.empty() && !aborted)) {
+                cv_done.wait(lock);
+                lock.unlock();
+                ok = progress();
+                lock.lock();
+                if (!ok) {
+                    aborted = true;
+                    jobs.clear();
+                }
+            }
+        }
+        for (auto & t : threads) {
+            t.join();
+        }
+        threads.clear();
+        return ok;
+    }
+
+    std::atomic<size_t>        bytes_done { 0 };
+    std::string                error;         // first read failure
+    std::vector<std::string>   invalid;       // tensors that failed validation
+
+private:
+    void run() {
+        std::vector<std::unique_ptr<llama_file>> files(file_names.size());
+        std::vector<no_init<uint8_t>> read_buf;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv_jobs.wait(lock, [this] { return closed || !jobs.empty(); });
+            if (jobs.empty() || aborted) {
+                return;
+            }
+            const job j = jobs.front();
+            jobs.pop_front();
+            n_busy++;
+            lock.unlock();
+
+            std::string err;
+            bool valid = true;
+            try {
+                valid = load(j, files, read_buf);
+            } catch (const std::exception & e) {
+                err = e.what();
+            }
+
+            lock.lock();
+            n_busy--;
+            if (!err.empty() && error.empty()) {
+                error   = err;
+                aborted = true;
+                jobs.clear();
+            }
+            if (!valid) {
+                invalid.emplace_back(lm_ggml_get_name(j.cur));
+            }
+            cv_done.notify_one();
+        }
+    }
+
+    bool load(const job & j, std::vector<std::unique_ptr<llama_file>> & files, std::vector<no_init<uint8_t>> & read_buf) {
+        const size_t n_size = lm_ggml_nbytes(j.cur);
+        const void * data   = j.src;
+
+        if (data == nullptr) {
+            if (!files[j.idx]) {
+                files[j.idx] = std::make_unique<llama_file>(file_names[j.idx].c_str(), "rb");
+            }
+            files[j.idx]->seek(j.offs, SEEK_SET);
+            if (lm_ggml_backend_buffer_is_host(j.cur->buffer)) {
+                files[j.idx]->read_raw(j.cur->data, n_size);
+                data = j.cur->data;
+            } else {
+                read_buf.resize(n_size);
+                files[j.idx]->read_raw(read_buf.data(), n_size);
+                data = read_buf.data();
+            }
+        }
+        if (data != j.cur->data) {
+            lm_ggml_backend_tensor_set(j.cur, data, 0, n_size);
+        }
+
+        bytes_done += n_size;
+
+        return !check_tensors || lm_ggml_validate_row_data(j.cur->type, data, n_size);
+    }
+
+    const std::vector<std::string> & file_names;
+    const bool check_tensors;
+
+    std::vector<std::thread> threads;
+    std::mutex               mutex;
+    std::condition_variable  cv_jobs;
+    std::condition_variable  cv_done;
+    std::deque<job>          jobs;
+    int                      n_busy  = 0;
+    bool                     closed  = false;
+    bool                     aborted = false;
+};
+
+// tensors in CPU memory are safe to fill from several threads, device uploads stay on the loader thread
+static bool llama_load_on_cpu(const lm_ggml_tensor * cur) {
+    if (lm_ggml_backend_buffer_is_host(cur->buffer)) {
+        return true;
+    }
+    auto * dev = lm_ggml_backend_buft_get_device(lm_ggml_backend_buffer_get_type(cur->buffer));
+    return dev != nullptr && lm_ggml_backend_dev_type(dev) == LM_GGML_BACKEND_DEVICE_TYPE_CPU;
+}
+
 bool llama_model_loader::load_all_data(
         struct lm_ggml_context * ctx,
         llama_buf_map & bufs,
@@ -990,6 +1327,24 @@ bool llama_model_loader::load_all_data(
             lm_ggml_backend_name(upload_backend));
     }
 
+    // weights repacked for the CPU are taken from the repack cache when it holds them
+    decltype(lm_ggml_backend_cpu_repack_layout) * repack_layout_fn = nullptr;
+    if (!repack_cache_fname.empty()) {
+        auto * dev = lm_ggml_backend_dev_by_type(LM_GGML_BACKEND_DEVICE_TYPE_CPU);
+        if (dev) {
+            repack_layout_fn = (decltype(lm_ggml_backend_cpu_repack_layout) *)
+                lm_ggml_backend_reg_get_proc_address(lm_ggml_backend_dev_backend_reg(dev), "lm_ggml_backend_cpu_repack_layout");
+        }
+    }
+    size_t n_repack_cached = 0;
+
+    llama_load_workers workers(file_names, check_tensors);
+
+    auto report_progress = [&]() {
+        return !progress_callback ||
+            progress_callback((float) (size_done + workers.bytes_done) / size_data, progress_callback_user_data);
+    };
+
     for (struct lm_ggml_tensor * cur = lm_ggml_get_first_tensor(ctx); cur != NULL; cur = lm_ggml_get_next_tensor(ctx, cur)) {
         const auto * weight = get_weight(lm_ggml_get_name(cur));
         if (weight == nullptr) {
@@ -997,14 +1352,24 @@ bool llama_model_loader::load_all_data(
             continue;
         }
 
-        if (progress_callback) {
-            if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
-                return false;
-            }
+        if (!report_progress()) {
+            workers.finish([] { return false; });
+            return false;
         }
 
         size_t n_size = lm_ggml_nbytes(cur);
 
+        const char * layout = repack_layout_fn ? repack_layout_fn(cur) : nullptr;
+        if (layout != nullptr) {
+            repack_tensors.push_back(cur);
+            if (repack_cache_load(cur, layout)) {
+                n_repack_cached++;
+                size_done += n_size;
+                continue;
+            }
+            repack_cache_stale = true;
+        }
+
         if (use_mmap) {
             const auto & mapping = mappings.at(weight->idx);
             lm_ggml_backend_buffer_t buf_mmap = nullptr;
@@ -1013,14 +1378,21 @@ bool llama_model_loader::load_all_data(
             }
             uint8_t * data = (uint8_t *) mapping->addr() + weight->offs;
 
+            LM_GGML_ASSERT(buf_mmap || cur->data); // either we have a buffer to allocate the tensor in, or it is already allocated
+            const bool map = buf_mmap && cur->data == nullptr;
+            if (!map && llama_load_on_cpu(cur)) {
+                // copied or repacked out of the mapping, validated by the worker
+                workers.push({ cur, weight->idx, weight->offs, data });
+                continue;
+            }
+
             if (check_tensors) {
                 validation_result.emplace_back(std::async(std::launch::async, [cur, data, n_size] {
                     return std::make_pair(cur, lm_ggml_validate_row_data(cur->type, data, n_size));
                 }));
             }
 
-            LM_GGML_ASSERT(buf_mmap || cur->data); // either we have a buffer to allocate the tensor in, or it is already allocated
-            if (buf_mmap && cur->data == nullptr) {
+            if (map) {
                 lm_ggml_backend_tensor_alloc(buf_mmap, cur, data);
                 if (lmlocks) {
                     const auto & lmlock = lmlocks->at(weight->idx);
@@ -1034,42 +1406,39 @@ bool llama_model_loader::load_all_data(
                 lm_ggml_backend_tensor_set(cur, data, 0, n_size);
             }
         } else {
+            if (llama_load_on_cpu(cur)) {
+                // read, repacked and validated by a worker
+                workers.push({ cur, weight->idx, weight->offs, nullptr });
+                continue;
+            }
+
             const auto & file = files.at(weight->idx);
-            if (lm_ggml_backend_buffer_is_host(cur->buffer)) {
+
+            // If upload_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
+            if (upload_backend) {
                 file->seek(weight->offs, SEEK_SET);
-                file->read_raw(cur->data, n_size);
-                if (check_tensors) {
-                    validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
-                        return std::make_pair(cur, lm_ggml_validate_row_data(cur->type, cur->data, n_size));
-                    }));
+
+                size_t bytes_read = 0;
+
+                while (bytes_read < n_size) {
+                    size_t read_iteration = std::min<size_t>(buffer_size, n_size - bytes_read);
+
+                    lm_ggml_backend_event_synchronize(events[buffer_idx]);
+                    file->read_raw(host_ptrs[buffer_idx], read_iteration);
+                    lm_ggml_backend_tensor_set_async(upload_backend, cur, host_ptrs[buffer_idx], bytes_read, read_iteration);
+                    lm_ggml_backend_event_record(events[buffer_idx], upload_backend);
+
+                    bytes_read += read_iteration;
+                    ++buffer_idx;
+                    buffer_idx %= n_buffers;
                 }
             } else {
-                // If upload_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
-                if (upload_backend) {
-                    file->seek(weight->offs, SEEK_SET);
-
-                    size_t bytes_read = 0;
-
-                    while (bytes_read < n_size) {
-                        size_t read_iteration = std::min<size_t>(buffer_size, n_size - bytes_read);
-
-                        lm_ggml_backend_event_synchronize(events[buffer_idx]);
-                        file->read_raw(host_ptrs[buffer_idx], read_iteration);
-                        lm_ggml_backend_tensor_set_async(upload_backend, cur, host_ptrs[buffer_idx], bytes_read, read_iteration);
-                        lm_ggml_backend_event_record(events[buffer_idx], upload_backend);
-
-                        bytes_read += read_iteration;
-                        ++buffer_idx;
-                        buffer_idx %= n_buffers;
-                    }
-                } else {
-                    read_buf.resize(n_size);
-                    file->seek(weight->offs, SEEK_SET);
-                    file->read_raw(read_buf.data(), n_size);
-                    lm_ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
-                    if (check_tensors && !lm_ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
-                        throw std::runtime_error(format("tensor '%s' has invalid data", lm_ggml_get_name(cur)));
-                    }
+                read_buf.resize(n_size);
+                file->seek(weight->offs, SEEK_SET);
+                file->read_raw(read_buf.data(), n_size);
+                lm_ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
+                if (check_tensors && !lm_ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
+                    throw std::runtime_error(format("tensor '%s' has invalid data", lm_ggml_get_name(cur)));
                 }
             }
         }
@@ -1077,6 +1446,14 @@ bool llama_model_loader::load_all_data(
         size_done += n_size;
     }
 
+    if (!workers.finish(report_progress)) {
+        return false;
+    }
+    if (!workers.error.empty()) {
+        throw std::runtime_error(workers.error);
+    }
+    size_done += workers.bytes_done;
+
     // free temporary resources used for async uploads
     for (auto * event : events) {
         lm_ggml_backend_event_synchronize(event);
@@ -1089,6 +1466,10 @@ bool llama_model_loader::load_all_data(
 
     // check validation results
     bool validation_failed = false;
+    for (const auto & name : workers.invalid) {
+        LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, name.c_str());
+        validation_failed = true;
+    }
     for (auto & future : validation_result) {
         auto result = future.get();
         if (!result.second) {
@@ -1100,8 +1481,18 @@ bool llama_model_loader::load_all_data(
         throw std::runtime_error("found tensors with invalid data");
     }
 
+    if (n_repack_cached > 0) {
+        LLAMA_LOG_INFO("%s: %zu repacked tensors loaded from %s\n", __func__, n_repack_cached, repack_cache_fname.c_str());
+    }
+
     // check if this is the last call and do final cleanup
     if (size_done >= size_data) {
+        repack_cache_mapping.reset();
+        repack_cache_file.reset();
+        if (repack_cache_stale && !repack_tensors.empty()) {
+            repack_cache_save();
+        }
+
         // unmap offloaded tensors and metadata
         if (use_mmap) {
             for (uint32_t idx = 0; idx < mappings.size(); idx++) {
@@ -72,6 +72,7 @@ struct llama_model_loader {
     bool check_tensors;
 
     llama_files files;
+    std::vector<std::string> file_names; // by weight idx, the load workers open their own handles
     llama_ftype ftype;
     llama_fver  fver;
 
@@ -91,11 +92,23 @@ struct llama_model_loader {
     size_t size_data = 0;
     std::vector<std::pair<size_t, size_t>> mmaps_used;
 
+    // weights the CPU backend repacks while loading are kept in a GGUF next to the model,
+    // later loads copy them from there instead of reading and repacking the original data
+    std::string                   repack_cache_fname; // empty if disabled
+    std::string                   repack_source_fname;
+    lm_gguf_context_ptr              repack_cache_meta;
+    lm_ggml_context_ptr              repack_cache_ctx;
+    std::unique_ptr<llama_file>   repack_cache_file;
+    std::unique_ptr<llama_mmap>   repack_cache_mapping;
+    std::vector<lm_ggml_tensor *>    repack_tensors;      // every repacked tensor of this load
+    bool                          repack_cache_stale = false;
+
     llama_model_loader(
         const std::string & fname,
         std::vector<std::string> & splits, // optional, only need if the split does not follow naming scheme
         bool use_mmap,
         bool check_tensors,
+        bool use_repack_cache,
         const llama_model_kv_override * param_overrides_p,
         const llama_model_tensor_buft_override * param_tensor_buft_overrides_p);
 
@@ -155,6 +168,15 @@ struct llama_model_loader {
     // for backwards compatibility, does not support ggml-backend
     void load_data_for(struct lm_ggml_tensor * cur) const;
 
+    // map the repack cache if it was written for this model file, see repack_cache_fname
+    void repack_cache_open();
+
+    // copy the repacked data of cur in layout from the cache, returns false on a miss
+    bool repack_cache_load(lm_ggml_tensor * cur, const char * layout);
+
+    // write every tensor repacked during this load to the cache
+    void repack_cache_save() const;
+
     // Returns false if cancelled by progress_callback
     bool load_all_data(
             struct lm_ggml_context * ctx,
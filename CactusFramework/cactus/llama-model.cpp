@@ -361,6 +361,9 @@ static buft_list_t make_gpu_buft_list(lm_ggml_backend_dev_t dev, llama_split_mod
     return buft_list;
 }
 
+// tensors of one layer closer than this in the file are advised as one range
+static const size_t LLAMA_STREAM_MERGE_GAP = 64*1024;
+
 struct llama_model::impl {
     impl() {}
     ~impl() {}
@@ -397,6 +400,14 @@ struct llama_model::impl {
     std::vector<layer_dev> dev_layer;
 
     bool has_tensor_overrides;
+
+    // mmap'd byte ranges of each repeating layer's weights, only filled when streaming
+    struct stream_range {
+        llama_mmap * mapping;
+        size_t first;
+        size_t last;
+    };
+    std::vector<std::vector<stream_range>> stream_ranges;
 };
 
 llama_model::llama_model(const llama_model_params & params) : params(params), pimpl(std::make_unique<impl>()) {
@@ -4120,7 +4131,13 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
     ml.done_getting_tensors();
 
-    ml.init_mappings(true, use_mlock ? &pimpl->mlock_mmaps : nullptr);
+    // streamed layers are paged in on demand, prefetching the whole file would defeat the point
+    const bool use_layer_streaming = params.use_layer_streaming && ml.use_mmap && !use_mlock;
+    if (params.use_layer_streaming && !use_layer_streaming) {
+        LLAMA_LOG_WARN("%s: layer streaming needs mmap and no mlock, disabling it\n", __func__);
+    }
+
+    ml.init_mappings(!use_layer_streaming, use_mlock ? &pimpl->mlock_mmaps : nullptr);
     pimpl->mappings.reserve(ml.mappings.size());
 
     // create the backend buffers
@@ -4226,6 +4243,11 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         LLAMA_LOG_INFO("%s: %12s model buffer size = %8.2f MiB\n", __func__, lm_ggml_backend_buffer_name(buf.get()), lm_ggml_backend_buffer_get_size(buf.get()) / 1024.0 / 1024.0);
     }
 
+    source_files = ml.file_names;
+    for (const auto & it : ml.weights_map) {
+        tensor_sources[it.first] = { it.second.idx, it.second.offs };
+    }
+
     // populate tensors_by_name
     for (auto & ctx : pimpl->ctxs) {
         for (auto * cur = lm_ggml_get_first_tensor(ctx.get()); cur != NULL; cur = lm_ggml_get_next_tensor(ctx.get(), cur)) {
@@ -4248,9 +4270,80 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         }
     }
 
+    if (use_layer_streaming) {
+        // only weights still backed by the file are streamed: repacked, offloaded and
+        // non-repeating tensors live in their own buffers and stay resident. Offloaded weights can
+        // sit in the mapping too, wrapped by a GPU buffer (Metal maps it without a copy), and are
+        // left alone: the device reads those pages outside the CPU graph splits
+        pimpl->stream_ranges.assign(n_layer, {});
+        size_t n_stream_bytes = 0;
+        for (const auto & it : tensors_by_name) {
+            const char * name = it.first.c_str();
+            const lm_ggml_tensor * cur = it.second;
+            if (strncmp(name, "blk.", 4) != 0 || cur->data == nullptr || cur->buffer == nullptr) {
+                continue;
+            }
+            lm_ggml_backend_dev_t dev = lm_ggml_backend_buft_get_device(lm_ggml_backend_buffer_get_type(cur->buffer));
+            if (dev == nullptr || lm_ggml_backend_dev_type(dev) != LM_GGML_BACKEND_DEVICE_TYPE_CPU) {
+                continue;
+            }
+            const int il = atoi(name + 4);
+            if (il < 0 || il >= n_layer) {
+                continue;
+            }
+            const uint8_t * data = (const uint8_t *) cur->data;
+            for (const auto & mapping : pimpl->mappings) {
+                const uint8_t * base = (const uint8_t *) mapping->addr();
+                if (data >= base && data + lm_ggml_nbytes(cur) <= base + mapping->size()) {
+                    const size_t first = data - base;
+                    pimpl->stream_ranges[il].push_back({ mapping.get(), first, first + lm_ggml_nbytes(cur) });
+                    n_stream_bytes += lm_ggml_nbytes(cur);
+                    break;
+                }
+            }
+        }
+
+        // a layer's tensors are usually adjacent in the file, coalesce them to one madvise each
+        for (auto & ranges : pimpl->stream_ranges) {
+            std::sort(ranges.begin(), ranges.end(), [](const impl::stream_range & a, const impl::stream_range & b) {
+                return a.mapping != b.mapping ? a.mapping < b.mapping : a.first < b.first;
+            });
+            std::vector<impl::stream_range> merged;
+            for (const auto & r : ranges) {
+                if (!merged.empty() && merged.back().mapping == r.mapping && r.first <= merged.back().last + LLAMA_STREAM_MERGE_GAP) {
+                    merged.back().last = std::max(merged.back().last, r.last);
+                } else {
+                    merged.push_back(r);
+                }
+            }
+            ranges = std::move(merged);
+        }
+
+        // validation and repacking may have faulted the weights in while loading
+        for (int il = 0; il < n_layer; il++) {
+            stream_layer(il, false);
+        }
+
+        LLAMA_LOG_INFO("%s: streaming %d layers from mmap, %.2f MiB paged on demand\n", __func__,
+            n_layer, n_stream_bytes / 1024.0 / 1024.0);
+    }
+
     return true;
 }
 
+bool llama_model::is_layer_streaming() const {
+    return !pimpl->stream_ranges.empty();
+}
+
+void llama_model::stream_layer(int il, bool need) const {
+    if (il < 0 || il >= (int) pimpl->stream_ranges.size()) {
+        return;
+    }
+    for (const auto & r : pimpl->stream_ranges[il]) {
+        r.mapping->advise(r.first, r.last, need);
+    }
+}
+
 std::string llama_model::arch_name() const {
     return llm_arch_name(arch);
 }
@@ -4479,6 +4572,23 @@ bool llama_model::has_tensor_overrides() const {
     return pimpl->has_tensor_overrides;
 }
 
+bool llama_model::supports_layer_skip() const {
+    switch (arch) {
+        case LLM_ARCH_LLAMA:
+        case LLM_ARCH_MINICPM:
+        case LLM_ARCH_QWEN2:
+        case LLM_ARCH_QWEN3:
+        case LLM_ARCH_QWEN3MOE:
+        case LLM_ARCH_PHI3:
+        case LLM_ARCH_PHIMOE:
+        case LLM_ARCH_GEMMA2:
+        case LLM_ARCH_GEMMA3:
+            return true;
+        default:
+            return false;
+    }
+}
+
 const lm_ggml_tensor * llama_model::get_tensor(const char * name) const {
     auto it = std::find_if(tensors_by_name.begin(), tensors_by_name.end(),
             [name](const std::pair<std::string, lm_ggml_tensor *> & it) {
@@ -4534,6 +4644,10 @@ struct llm_build_llama : public llm_graph_context {
         const float kq_scale = hparams.f_attention_scale == 0.0f ? 1.0f/sqrtf(float(n_embd_head)) : hparams.f_attention_scale;
 
         for (int il = 0; il < n_layer; ++il) {
+            if (layer_skipped(il)) {
+                continue;
+            }
+
             lm_ggml_tensor * inpSA = inpL;
 
             // norm
@@ -6585,6 +6699,10 @@ struct llm_build_qwen2 : public llm_graph_context {
         auto * inp_attn = build_attn_inp_kv_unified();
 
         for (int il = 0; il < n_layer; ++il) {
+            if (layer_skipped(il)) {
+                continue;
+            }
+
             lm_ggml_tensor * inpSA = inpL;
 
             // norm
@@ -6983,6 +7101,10 @@ struct llm_build_qwen3 : public llm_graph_context {
         auto * inp_attn = build_attn_inp_kv_unified();
 
         for (int il = 0; il < n_layer; ++il) {
+            if (layer_skipped(il)) {
+                continue;
+            }
+
             lm_ggml_tensor * inpSA = inpL;
 
             // norm
@@ -7104,6 +7226,10 @@ struct llm_build_qwen3moe : public llm_graph_context {
         auto * inp_attn = build_attn_inp_kv_unified();
 
         for (int il = 0; il < n_layer; ++il) {
+            if (layer_skipped(il)) {
+                continue;
+            }
+
             lm_ggml_tensor * inpSA = inpL;
 
             // norm
@@ -7370,6 +7496,10 @@ struct llm_build_phi3 : public llm_graph_context {
         }
 
         for (int il = 0; il < n_layer; ++il) {
+            if (layer_skipped(il)) {
+                continue;
+            }
+
             auto * residual = inpL;
 
             // self-attention
@@ -8445,6 +8575,10 @@ struct llm_build_gemma2_iswa : public llm_graph_context {
         auto * inp_attn = build_attn_inp_kv_unified_iswa();
 
         for (int il = 0; il < n_layer; ++il) {
+            if (layer_skipped(il)) {
+                continue;
+            }
+
             // norm
             cur = build_norm(inpL,
                     model.layers[il].attn_norm, NULL,
@@ -8586,6 +8720,10 @@ struct llm_build_gemma3_iswa : public llm_graph_context {
         auto * inp_attn = build_attn_inp_kv_unified_iswa();
 
         for (int il = 0; il < n_layer; ++il) {
+            if (layer_skipped(il)) {
+                continue;
+            }
+
             const float freq_base_l  = model.get_rope_freq_base (cparams, il);
             const float freq_scale_l = model.get_rope_freq_scale(cparams, il);
 
@@ -12861,6 +12999,11 @@ struct llm_build_wavtokenizer_dec : public llm_graph_context {
 
         cur = lm_ggml_add(ctx0, cur, model.output_b);
 
+        // spectrum to PCM on the same backend, n_fft/4 samples per code
+        if (cparams.vocoder_istft) {
+            cur = build_istft(cur, n_embd - 2, (n_embd - 2)/4);
+        }
+
         cb(cur, "result_embd", -1);
         res->t_embd = cur;
 
@@ -13208,7 +13351,9 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                         LM_GGML_TYPE_F32,
                         cparams.offload_kqv,
                         std::max((uint32_t) 1, cparams.n_seq_max),
-                        cparams.n_seq_max);
+                        cparams.n_seq_max,
+                        params.n_ckpt,
+                        params.n_ckpt_interval);
             } break;
         default:
             {
@@ -13218,6 +13363,12 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
 
                 LLAMA_LOG_DEBUG("%s: n_ctx = %u (padded)\n", __func__, cparams.n_ctx);
 
+                const bool tiered = params.n_kv_recent > 0 && (lm_ggml_is_quantized(params.type_k) || lm_ggml_is_quantized(params.type_v));
+
+                if (tiered && hparams.swa_type != LLAMA_SWA_TYPE_NONE) {
+                    throw std::runtime_error("the tiered KV cache does not support SWA models");
+                }
+
                 if (hparams.swa_type != LLAMA_SWA_TYPE_NONE) {
                     LM_GGML_ASSERT(hparams.is_swa_any());
 
@@ -13231,6 +13382,7 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                             cparams.n_ctx,
                             cparams.n_seq_max,
                             cparams.n_batch,
+                            cparams.n_ubatch,
                             padding);
                 } else {
                     LM_GGML_ASSERT(!hparams.is_swa_any());
@@ -13246,7 +13398,8 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                             cparams.n_seq_max,
                             padding,
                             hparams.n_swa,
-                            hparams.swa_type);
+                            hparams.swa_type,
+                            tiered ? std::min(cparams.n_ctx, LM_GGML_PAD(params.n_kv_recent + cparams.n_ubatch, padding)) : 0);
                 }
             }
     }
@@ -13529,6 +13682,12 @@ llm_graph_result_ptr llama_model::build_graph(
     // add on pooling layer
     llm->build_pooling(gf, cls, cls_b, cls_out, cls_out_b);
 
+    // embeddings never read the logits, so skip the output projection unless an embedding depends on it
+    if (params.cparams.embeddings && llm->res->t_logits && llm->res->t_logits != llm->res->t_embd) {
+        lm_ggml_graph_prune(gf, llm->res->t_logits, llm->res->t_embd);
+        llm->res->t_logits = nullptr;
+    }
+
     return std::move(llm->res);
 }
 
@@ -13551,6 +13710,8 @@ llama_model_params llama_model_default_params() {
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.use_repack_cache            =*/ false,
+        /*.use_layer_streaming         =*/ false,
     };
 
 #ifdef LM_GGML_USE_METAL
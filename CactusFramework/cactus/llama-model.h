@@ -363,6 +363,15 @@ struct llama_model {
     // for quantize-stats only
     std::vector<std::pair<std::string, struct lm_ggml_tensor *>> tensors_by_name;
 
+    // where each weight's data lies in the model files, so the original can be read back after
+    // the tensor was repacked or uploaded (see llama_adapter_lora_merge_init)
+    struct tensor_source {
+        uint16_t idx;  // index in source_files
+        size_t   offs;
+    };
+    std::vector<std::string> source_files;
+    std::unordered_map<std::string, tensor_source> tensor_sources;
+
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
 
@@ -396,6 +405,14 @@ struct llama_model {
 
     bool has_tensor_overrides() const;
 
+    // whether the graph builder honours llama_cparams::layer_skip
+    bool supports_layer_skip() const;
+
+    // layer streaming (use_layer_streaming): page the mmap'd weights of repeating layer il in ahead
+    // of its use, or let the kernel drop them once the layer has run
+    bool is_layer_streaming() const;
+    void stream_layer(int il, bool need) const;
+
     const struct lm_ggml_tensor * get_tensor(const char * name) const;
 
     float get_rope_freq_base (const llama_cparams & cparams, int il) const;
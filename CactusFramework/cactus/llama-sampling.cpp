@@ -4,6 +4,8 @@
 #include "llama-vocab.h"
 #include "llama-grammar.h"
 
+#include "ggml-cpu.h"
+
 #include <algorithm>
 #include <cassert>
 #include <cfloat>
@@ -12,6 +14,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <numeric>
 #include <random>
 #include <unordered_map>
@@ -212,16 +215,18 @@ static void llama_sampler_softmax_impl(llama_token_data_array * cur_p) {
     }
 
     float max_l = cur_p->data[0].logit;
-    float cum_sum = 0.0f;
 
+    // the logits are gathered into a row so the exponentials go through the CPU backend's vector exp
+    thread_local std::vector<float> row;
+    row.resize(cur_p->size);
     for (size_t i = 0; i < cur_p->size; ++i) {
-        float p = expf(cur_p->data[i].logit - max_l);
-        cur_p->data[i].p = p;
-        cum_sum += p;
+        row[i] = cur_p->data[i].logit;
     }
+    const double cum_sum = lm_ggml_cpu_exp_sum_f32(row.data(), row.data(), (int64_t) cur_p->size, max_l);
 
+    const float inv_sum = (float) (1.0 / cum_sum);
     for (size_t i = 0; i < cur_p->size; ++i) {
-        cur_p->data[i].p /= cum_sum;
+        cur_p->data[i].p = row[i] * inv_sum;
     }
 }
 
@@ -1598,6 +1603,21 @@ struct llama_sampler * llama_sampler_init_grammar_lazy_patterns(
     return llama_sampler_init_grammar_impl(vocab, grammar_str, grammar_root, /* lazy= */ true, nullptr, 0, trigger_tokens, num_trigger_tokens, trigger_patterns, num_trigger_patterns);
 }
 
+// true if every token in `tokens` sits at its own index in cur_p, as candidates filled from the
+// logits do until a sampler reorders them
+template<typename T>
+static bool llama_sampler_by_id(const llama_token_data_array * cur_p, const std::unordered_map<llama_token, T> & tokens) {
+    if (cur_p->size <= tokens.size()) {
+        return false;
+    }
+    for (const auto & t : tokens) {
+        if (t.first < 0 || (size_t) t.first >= cur_p->size || cur_p->data[t.first].id != t.first) {
+            return false;
+        }
+    }
+    return true;
+}
+
 // penalties
 
 struct llama_sampler_penalties {
@@ -1655,29 +1675,40 @@ static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_tok
         return;
     }
 
-    // Apply frequency and presence penalties to the cur_p
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto token_iter = ctx->token_count.find(cur_p->data[i].id);
-        if (token_iter == ctx->token_count.end()) {
-            continue;
-        }
-
-        const int count = token_iter->second;
-
+    const auto penalize = [ctx](llama_token_data & cur, int count) {
         assert(count > 0 && count <= ctx->penalty_last_n);
 
         // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
         // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
-        if (cur_p->data[i].logit <= 0) {
-            cur_p->data[i].logit *= ctx->penalty_repeat;
+        if (cur.logit <= 0) {
+            cur.logit *= ctx->penalty_repeat;
         } else {
-            cur_p->data[i].logit /= ctx->penalty_repeat;
+            cur.logit /= ctx->penalty_repeat;
         }
 
-        cur_p->data[i].logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
-    }
+        cur.logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+    };
 
     cur_p->sorted = false;
+
+    // candidates that have not been shuffled in the vocabulary (i.e. idx == id) are penalized
+    // directly, one step per distinct recent token instead of a lookup per candidate
+    if (llama_sampler_by_id(cur_p, ctx->token_count)) {
+        for (const auto & tc : ctx->token_count) {
+            penalize(cur_p->data[tc.first], tc.second);
+        }
+        return;
+    }
+
+    // Apply frequency and presence penalties to the cur_p
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        const auto token_iter = ctx->token_count.find(cur_p->data[i].id);
+        if (token_iter == ctx->token_count.end()) {
+            continue;
+        }
+
+        penalize(cur_p->data[i], token_iter->second);
+    }
 }
 
 static void llama_sampler_penalties_reset(struct llama_sampler * smpl) {
@@ -1698,7 +1729,8 @@ static struct llama_sampler * llama_sampler_penalties_clone(const struct llama_s
     {
         auto * result_ctx = (llama_sampler_penalties *) result->ctx;
 
-        result_ctx->prev = ctx->prev;
+        result_ctx->prev        = ctx->prev;
+        result_ctx->token_count = ctx->token_count;
     }
 
     return result;
@@ -1827,9 +1859,16 @@ struct llama_sampler_dry {
     const int32_t dry_penalty_last_n;
 
     std::unordered_multimap<llama_token, std::vector<llama_token>> dry_processed_breakers;
-    std::vector<int> dry_repeat_count;
     std::unordered_map<llama_token, int> dry_max_token_repeat;
     ring_buffer<llama_token> last_tokens;
+
+    // repeat state kept up to date on accept: the positions of each token in last_tokens, and for
+    // each position p (ascending, nonzero only) the length of the longest sequence ending at p that
+    // also ends the history; positions count accepted tokens
+    int64_t                                               n_accepted = 0;
+    std::unordered_map<llama_token, std::deque<int64_t>>  dry_positions;
+    std::vector<std::pair<int64_t, int32_t>>              dry_repeat_len;
+    std::vector<std::pair<int64_t, int32_t>>              dry_repeat_len_next;
 };
 
 // Ported from Koboldcpp, original PR: https://github.com/LostRuins/koboldcpp/pull/982 (Original author: pi6am)
@@ -1885,6 +1924,29 @@ static void llama_sampler_dry_accept(struct llama_sampler * smpl, llama_token to
         return;
     }
 
+    if (ctx->last_tokens.size() == ctx->last_tokens.capacity) {
+        const auto it = ctx->dry_positions.find(ctx->last_tokens.front());
+        it->second.pop_front();
+        if (it->second.empty()) {
+            ctx->dry_positions.erase(it);
+        }
+    }
+
+    // a repeat ends at p after this token iff token(p) == token and it extends the one ending at p - 1
+    auto & positions = ctx->dry_positions[token];
+    auto & next      = ctx->dry_repeat_len_next;
+    next.clear();
+    size_t j = 0;
+    for (const int64_t p : positions) {
+        while (j < ctx->dry_repeat_len.size() && ctx->dry_repeat_len[j].first < p - 1) {
+            ++j;
+        }
+        const bool extends = j < ctx->dry_repeat_len.size() && ctx->dry_repeat_len[j].first == p - 1;
+        next.emplace_back(p, extends ? ctx->dry_repeat_len[j].second + 1 : 1);
+    }
+    std::swap(ctx->dry_repeat_len, next);
+
+    positions.push_back(ctx->n_accepted++);
     ctx->last_tokens.push_back(token);
 }
 
@@ -1903,7 +1965,6 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
         return;
     }
 
-    ctx->dry_repeat_count.assign(last_n_repeat, 0);
     ctx->dry_max_token_repeat.clear();
 
     // Step 1: Look for restart sequences to limit the maximum repetition length.
@@ -1967,15 +2028,10 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
         return;
     }
 
-    // Step 2: Iterate in reverse over the last N tokens of the context, using the "Z-algorithm" (in
-    // the reverse direction) to efficiently compute the positions and lengths of suffixes appearing
-    // elsewhere in the context. We limit the suffix length to `rep_limit` to respect restart sequences.
-    //
-    // This algorithm is not currently documented on Wikipedia, but there is a clear description here:
-    // https://ivanyu.me/blog/2014/10/15/z-algorithm/
-    //
-    // The code below is adapted from the public domain implementation by the same author here:
-    // https://github.com/ivanyu/string-algorithms/blob/master/z_algorithm.py
+    // Step 2: Look up the repeats that end the context. The accept step keeps, for each position,
+    // the length of the longest token sequence ending there that is also a suffix of the context,
+    // so this only visits positions of the last token. Repeats are clamped to the window and to
+    // `rep_limit` to respect restart sequences.
     //
     // Example:
     // Last N tokens: a b c c b c y a b c
@@ -1983,75 +2039,31 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
     //                    ^
     //   This `3` means that the last three tokens of the context (a b c) also appear here.
     //
-    // This step is worst case O(N) since the Z-algorithm is linear, despite the appearance of nested
-    // for/while loops. This can be seen by observing that the `lt` and `rt` bounds are set after each
-    // repeated suffix is detected (i.e. after each while loop when n > 0). These bound variables
-    // ensure that the inner while loops only examine each token in the context once as the outer
-    // for loop iterates over the context.
-
-    {
-        const int last = last_n_repeat - 1;
-        int rt = 0, lt = 0;
-
-        for (int k = 1; k < last_n_repeat; ++k) {
-            if (k > rt) {
-                // If k is outside the current Z-box, do naive computation.
-                int n = 0;
-                while (n + k < last_n_repeat && ctx->last_tokens.rat(n) == ctx->last_tokens.rat(n+k)) {
-                    ++n;
-                }
-                ctx->dry_repeat_count[last - k] = std::min(n, rep_limit);
-                if (n > 0) {
-                    lt = k;
-                    rt = k + n - 1;
-                }
-            } else {
-                // If k is inside the current Z-box, consider two cases.
-
-                int p = k - lt; // Pair index.
-                int right_part_len = rt - k + 1;
-
-                if (ctx->dry_repeat_count[last - p] < right_part_len) {
-                    int n = std::min(ctx->dry_repeat_count[last - p], rep_limit);
-                    ctx->dry_repeat_count[last - k] = n;
-                } else {
-                    int i = rt + 1;
-                    while (i < last_n_repeat && ctx->last_tokens.rat(i) == ctx->last_tokens.rat(i - k)) {
-                        i += 1;
-                    }
-
-                    int n = std::min(i - k, rep_limit);
-                    ctx->dry_repeat_count[last - k] = n;
-                    lt = k;
-                    rt = i - 1;
-                }
-            }
-        }
-    }
-
-    // Step 3: Iterate over dry_repeat_count and last_tokens, examining the maximum repeat length
-    // that would be generated by emitting each new token that would extend a sequence.
-    //
-    // Following the same example as above:
-    // Last N tokens: a b c c b c y a b c
-    // Repeat counts: 0 0 3 1 0 2 0 0 0 0
-    //
-    // For each non-zero, look ahead one token. This token, if emitted, would extend the repetition.
+    // Step 3: For each repeat, look ahead one token. This token, if emitted, would extend the
+    // repetition.
     // c: 3 -> 4 (from `a b c` to `a b c c`)
     // b: 1 -> 2 (from `c` to `c b`)
     // y: 2 -> 3 (from `b c` to `b c y`)
 
-    for (int i = 0; i < last_n_repeat - 1; ++i) {
-        int repeat_len = ctx->dry_repeat_count[i];
-        if (repeat_len >= ctx->dry_allowed_length) {
-            // This token ends a repeat, so the next token would continue one.
-            // By convention, the value of `repeat_len` only includes the tokens currently
-            // in the context, not the new token that would be added.
-            llama_token token = ctx->last_tokens.rat(last_n_repeat - 2 - i);
-            // Track the maximum sequence ending in this token.
-            const auto& it = ctx->dry_max_token_repeat.find(token);
-            if (it == ctx->dry_max_token_repeat.end() || it->second < repeat_len) {
-                ctx->dry_max_token_repeat[token] = repeat_len;
+    {
+        const int64_t end   = ctx->n_accepted - 1;
+        const int64_t start = end - last_n_repeat + 1;
+
+        for (const auto & rl : ctx->dry_repeat_len) {
+            const int64_t p = rl.first;
+            if (p < start || p >= end) {
+                continue;
+            }
+            const int repeat_len = (int) std::min<int64_t>({ rl.second, p - start + 1, rep_limit });
+            if (repeat_len >= ctx->dry_allowed_length) {
+                // By convention, the value of `repeat_len` only includes the tokens currently
+                // in the context, not the new token that would be added.
+                llama_token token = ctx->last_tokens.rat(end - p - 1);
+                // Track the maximum sequence ending in this token.
+                const auto& it = ctx->dry_max_token_repeat.find(token);
+                if (it == ctx->dry_max_token_repeat.end() || it->second < repeat_len) {
+                    ctx->dry_max_token_repeat[token] = repeat_len;
+                }
             }
         }
     }
@@ -2066,40 +2078,53 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
         max_exponent = FLOAT_MAX_LOG / std::log(ctx->dry_base);
     }
 
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto& af_kvp = ctx->dry_max_token_repeat.find(cur_p->data[i].id);
-        if (af_kvp != ctx->dry_max_token_repeat.end()) {
-            // Check all sequence breakers starting with this token
-            auto range = ctx->dry_processed_breakers.equal_range(cur_p->data[i].id);
-            bool is_single_token_breaker = false;
+    const auto penalize = [&](llama_token_data & cur, int max_repeat) {
+        // Check all sequence breakers starting with this token
+        auto range = ctx->dry_processed_breakers.equal_range(cur.id);
+        bool is_single_token_breaker = false;
 
-            for (auto it = range.first; it != range.second; ++it) {
-                if (it->second.empty()) {
-                    is_single_token_breaker = true;
-                    break;
-                }
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second.empty()) {
+                is_single_token_breaker = true;
+                break;
             }
+        }
 
-            // Apply penalty only if it's not a single-token sequence breaker
-            if (!is_single_token_breaker) {
-                int repeat_exp = af_kvp->second - ctx->dry_allowed_length;
-                if (max_exponent > 0 && repeat_exp > max_exponent) {
-                    repeat_exp = max_exponent;
-                }
-                float penalty = ctx->dry_multiplier * std::pow(ctx->dry_base, repeat_exp);
-                cur_p->data[i].logit -= penalty;
+        // Apply penalty only if it's not a single-token sequence breaker
+        if (!is_single_token_breaker) {
+            int repeat_exp = max_repeat - ctx->dry_allowed_length;
+            if (max_exponent > 0 && repeat_exp > max_exponent) {
+                repeat_exp = max_exponent;
             }
+            float penalty = ctx->dry_multiplier * std::pow(ctx->dry_base, repeat_exp);
+            cur.logit -= penalty;
         }
-    }
+    };
 
     cur_p->sorted = false;
+
+    if (llama_sampler_by_id(cur_p, ctx->dry_max_token_repeat)) {
+        for (const auto & af_kvp : ctx->dry_max_token_repeat) {
+            penalize(cur_p->data[af_kvp.first], af_kvp.second);
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        const auto& af_kvp = ctx->dry_max_token_repeat.find(cur_p->data[i].id);
+        if (af_kvp != ctx->dry_max_token_repeat.end()) {
+            penalize(cur_p->data[i], af_kvp->second);
+        }
+    }
 }
 
 static void llama_sampler_dry_reset(struct llama_sampler * smpl) {
     auto * ctx = (llama_sampler_dry *) smpl->ctx;
     ctx->last_tokens.clear();
-    ctx->dry_repeat_count.clear();
     ctx->dry_max_token_repeat.clear();
+    ctx->n_accepted = 0;
+    ctx->dry_positions.clear();
+    ctx->dry_repeat_len.clear();
 }
 
 static struct llama_sampler * llama_sampler_dry_clone(const struct llama_sampler * smpl) {
@@ -2114,9 +2139,11 @@ static struct llama_sampler * llama_sampler_dry_clone(const struct llama_sampler
     {
         auto * result_ctx = (llama_sampler_dry *) result->ctx;
         result_ctx->dry_processed_breakers = ctx->dry_processed_breakers;
-        result_ctx->dry_repeat_count = ctx->dry_repeat_count;
         result_ctx->dry_max_token_repeat = ctx->dry_max_token_repeat;
         result_ctx->last_tokens = ctx->last_tokens;
+        result_ctx->n_accepted = ctx->n_accepted;
+        result_ctx->dry_positions = ctx->dry_positions;
+        result_ctx->dry_repeat_len = ctx->dry_repeat_len;
     }
 
     return result;
@@ -2175,9 +2202,12 @@ struct llama_sampler * llama_sampler_init_dry(const struct llama_vocab * vocab,
             /* .dry_allowed_length     = */ dry_allowed_length,
             /* .dry_penalty_last_n     = */ dry_penalty_last_n,
             /* .dry_processed_breakers = */ std::move(processed_breakers),
-            /* .dry_repeat_count       = */ dry_enabled ? std::vector<int>(effective_dry_penalty_last_n, 0) : std::vector<int>{},
             /* .dry_max_token_repeat   = */ {},
             /* .last_tokens            = */ dry_enabled ? ring_buffer<llama_token>(effective_dry_penalty_last_n) : ring_buffer<llama_token>(0),
+            /* .n_accepted             = */ 0,
+            /* .dry_positions          = */ {},
+            /* .dry_repeat_len         = */ {},
+            /* .dry_repeat_len_next    = */ {},
         }
     );
 }
@@ -2,23 +2,31 @@
 
 #include "ggml.h"
 #include "gguf.h"
+#include "llama-grammar.h"
 #include "llama-impl.h"
 #include "llama-model-loader.h"
 
 #include "unicode.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <cfloat>
 #include <climits>
 #include <cstdarg>
 #include <cstring>
 #include <forward_list>
+#include <list>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <set>
+#include <thread>
 #include <unordered_map>
 #include <cctype>
+#include <condition_variable>
+#include <functional>
 
 //
 // helpers
@@ -275,6 +283,60 @@ struct llm_bigram_bpe {
     size_t size;
 };
 
+struct llm_bpe_merge {
+    int         rank;
+    llama_token id; // LLAMA_TOKEN_NULL when the merged text is not a token
+};
+
+// LRU cache from pre-tokenized words to their token ids, sharded by word hash so that
+// sessions tokenizing pieces of one input in parallel rarely wait on each other
+struct llm_bpe_word_cache {
+    static constexpr size_t n_shards        = 16;
+    static constexpr size_t max_shard_words = 1024;
+    static constexpr size_t max_word_len    = 256;
+
+    struct shard {
+        std::mutex mutex;
+        std::list<std::pair<std::string, std::vector<llama_token>>> entries; // most recently used first
+        std::unordered_map<std::string, decltype(entries)::iterator> index;
+    };
+
+    bool find(const std::string & word, std::vector<llama_token> & output) {
+        shard & s = get_shard(word);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.index.find(word);
+        if (it == s.index.end()) {
+            return false;
+        }
+        s.entries.splice(s.entries.begin(), s.entries, it->second);
+        output.insert(output.end(), it->second->second.begin(), it->second->second.end());
+        return true;
+    }
+
+    void add(const std::string & word, const llama_token * ids, size_t n) {
+        if (word.size() > max_word_len) {
+            return;
+        }
+        shard & s = get_shard(word);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (s.index.find(word) != s.index.end()) {
+            return;
+        }
+        if (s.entries.size() >= max_shard_words) {
+            s.index.erase(s.entries.back().first);
+            s.entries.pop_back();
+        }
+        s.entries.emplace_front(word, std::vector<llama_token>(ids, ids + n));
+        s.index.emplace(word, s.entries.begin());
+    }
+
+    shard & get_shard(const std::string & word) {
+        return shards[std::hash<std::string>{}(word) % n_shards];
+    }
+
+    std::array<shard, n_shards> shards;
+};
+
 struct llm_tokenizer_bpe : llm_tokenizer {
     llm_tokenizer_bpe(const llama_vocab & vocab) {
         LM_GGML_ASSERT(vocab.get_type() == LLAMA_VOCAB_TYPE_BPE);
@@ -434,9 +496,36 @@ struct llm_tokenizer_bpe : llm_tokenizer {
                 };
                 break;
         }
+
+        // the merge table over token ids, for the merges whose both sides are tokens
+        const std::vector<std::string> bpe_merges = vocab.get_bpe_merges();
+        merges.reserve(bpe_merges.size());
+        for (int rank = 0; rank < (int) bpe_merges.size(); ++rank) {
+            const std::string & merge = bpe_merges[rank];
+            const size_t pos = merge.find(' ', 1);
+            if (pos == std::string::npos) {
+                continue;
+            }
+            const llama_token left  = vocab.text_to_token(merge.substr(0, pos));
+            const llama_token right = vocab.text_to_token(merge.substr(pos + 1));
+            if (left == LLAMA_TOKEN_NULL || right == LLAMA_TOKEN_NULL) {
+                continue;
+            }
+            const llama_token merged = vocab.text_to_token(merge.substr(0, pos) + merge.substr(pos + 1));
+            merges.emplace(merge_key(left, right), llm_bpe_merge{rank, merged});
+        }
+    }
+
+    static uint64_t merge_key(llama_token left, llama_token right) {
+        return ((uint64_t) (uint32_t) left << 32) | (uint32_t) right;
     }
 
     std::vector<std::string> regex_exprs;
+
+    std::unordered_map<uint64_t, llm_bpe_merge> merges;
+
+    // shared by all sessions: the same words come back in every prompt of a chat
+    mutable llm_bpe_word_cache word_cache;
 };
 
 struct llm_tokenizer_bpe_session {
@@ -480,111 +569,167 @@ struct llm_tokenizer_bpe_session {
     }
 
     void tokenize(const std::string & text, std::vector<llama_token> & output) {
-        int final_prev_index = -1;
         const auto word_collection = unicode_regex_split(text, tokenizer.regex_exprs);
 
-        symbols_final.clear();
-
         for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
-
-            int index = 0;
-            size_t offset = 0;
+            if (tokenizer.word_cache.find(word, output)) {
+                continue;
+            }
+            const size_t n_output = output.size();
 
             //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-            if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
+            const llama_token token = vocab.get_ignore_merges() ? vocab.text_to_token(word) : LLAMA_TOKEN_NULL;
+            if (token != LLAMA_TOKEN_NULL) {
+                output.push_back(token);
+            } else if (!tokenize_word_ids(word, output)) {
+                tokenize_word(word, output);
             }
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
+            tokenizer.word_cache.add(word, output.data() + n_output, output.size() - n_output);
+        }
+    }
+
+private:
+    // words longer than this (in symbols) go through the priority queue instead of linear scans
+    static constexpr size_t max_linear_symbols = 256;
+
+    // merges the word over token ids, picking the lowest ranked adjacent pair by a linear scan;
+    // returns false, with output untouched, when a symbol or a merge result is not a token
+    bool tokenize_word_ids(const std::string & word, std::vector<llama_token> & output) {
+        ids.clear();
+        for (size_t offset = 0; offset < word.size(); ) {
+            const size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            const llama_token id = vocab.text_to_token(word.substr(offset, char_len));
+            if (id == LLAMA_TOKEN_NULL || ids.size() >= max_linear_symbols) {
+                return false;
+            }
+            ids.push_back(id);
+            offset += char_len;
+        }
+
+        // pair_ranks[i] / pair_ids[i] describe the merge of ids[i] and ids[i + 1]
+        pair_ranks.resize(ids.size());
+        pair_ids.resize(ids.size());
+        for (size_t i = 0; i < ids.size(); ++i) {
+            find_merge(i);
+        }
+
+        while (true) {
+            size_t best = 0;
+            for (size_t i = 1; i < pair_ranks.size(); ++i) {
+                if (pair_ranks[i] < pair_ranks[best]) {
+                    best = i;
+                }
             }
-            for (int i = 1; i < (int) symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
+            if (pair_ranks.empty() || pair_ranks[best] == INT_MAX) {
+                break;
+            }
+            if (pair_ids[best] == LLAMA_TOKEN_NULL) {
+                return false;
             }
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+            ids[best] = pair_ids[best];
+            ids.erase(ids.begin() + best + 1);
+            pair_ranks.erase(pair_ranks.begin() + best + 1);
+            pair_ids.erase(pair_ids.begin() + best + 1);
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+            find_merge(best);
+            if (best > 0) {
+                find_merge(best - 1);
+            }
+        }
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+        output.insert(output.end(), ids.begin(), ids.end());
+        return true;
+    }
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+    void find_merge(size_t i) {
+        pair_ranks[i] = INT_MAX;
+        pair_ids[i]   = LLAMA_TOKEN_NULL;
+        if (i + 1 >= ids.size()) {
+            return;
+        }
+        const auto it = tokenizer.merges.find(llm_tokenizer_bpe::merge_key(ids[i], ids[i + 1]));
+        if (it != tokenizer.merges.end()) {
+            pair_ranks[i] = it->second.rank;
+            pair_ids[i]   = it->second.id;
+        }
+    }
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+    void tokenize_word(const std::string & word, std::vector<llama_token> & output) {
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
+
+        int index = 0;
+        size_t offset = 0;
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+        }
+        for (int i = 1; i < (int) symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
+
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
+
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
+
+            if (left_symbol.n == 0 || right_symbol.n == 0) {
+                continue;
+            }
+            std::string left_token = std::string(left_symbol.text, left_symbol.n);
+            std::string right_token = std::string(right_symbol.text, right_symbol.n);
+            if (left_token + right_token != bigram.text) {
+                continue;  // Skip this bigram if it's outdated
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
-        }
 
-        symbols = symbols_final;
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        }
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+        for (const auto & symbol : symbols) {
+            if (symbol.n == 0) {
+                continue;
+            }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.text_to_token(str);
+            const std::string str = std::string(symbol.text, symbol.n);
+            const auto token = vocab.text_to_token(str);
 
-                if (token == LLAMA_TOKEN_NULL) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.text_to_token(byte_str);
-                        if (token_multibyte != LLAMA_TOKEN_NULL) {
-                            output.push_back(token_multibyte);
-                        }
+            if (token == LLAMA_TOKEN_NULL) {
+                for (auto j = str.begin(); j != str.end(); ++j) {
+                    std::string byte_str(1, *j);
+                    auto token_multibyte = vocab.text_to_token(byte_str);
+                    if (token_multibyte != LLAMA_TOKEN_NULL) {
+                        output.push_back(token_multibyte);
                     }
-                } else {
-                    output.push_back(token);
                 }
+            } else {
+                output.push_back(token);
             }
         }
     }
 
-private:
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
@@ -615,8 +760,11 @@ private:
     const llm_tokenizer_bpe & tokenizer;
 
     std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
     llm_bigram_bpe::queue work_queue;
+
+    std::vector<llama_token> ids;
+    std::vector<int>         pair_ranks;
+    std::vector<llama_token> pair_ids;
 };
 
 //
@@ -1280,6 +1428,10 @@ struct llama_vocab::impl {
 
     std::vector<llama_token> cache_special_tokens;
     std::vector<std::string> cache_token_to_piece; // llama_token_to_piece(special = true);
+
+    mutable std::once_flag                                  grammar_trie_once;
+    mutable std::unique_ptr<const llama_grammar_token_trie> grammar_trie;
+    mutable llama_grammar_cache                             grammar_cache;
     struct pair_hash {
         size_t operator()(const std::pair<std::string, std::string> & p) const {
             return std::hash<std::string>{}(p.first) ^  //create some hash for pair
@@ -1330,7 +1482,16 @@ struct llama_vocab::impl {
     std::vector<llama_token> tokenize(
             const std::string & raw_text,
                          bool   add_special,
-                         bool   parse_special = false) const;
+                         bool   parse_special = false,
+                      int32_t   n_threads     = 1) const;
+
+    size_t tokenize_reusable(
+            const std::string & text,
+                       size_t   n_shared,
+            const llama_token * prev_tokens,
+                       size_t   n_prev_tokens,
+                         bool   add_special,
+                       size_t & n_bytes) const;
 
     int32_t tokenize(
                    const char * text,
@@ -2377,10 +2538,189 @@ static std::string llama_decode_text(const std::string & text) {
     return decoded_text;
 }
 
+// a space between two ASCII letters: no BPE pre-tokenizer except SuperBPE matches across it,
+// so text split there tokenizes to the same tokens as the whole
+static bool llm_bpe_is_safe_split(const std::string & text, size_t pos) {
+    auto is_alpha = [](char c) {
+        c |= 0x20;
+        return c >= 'a' && c <= 'z';
+    };
+    return text[pos] == ' ' && is_alpha(text[pos - 1]) && is_alpha(text[pos + 1]);
+}
+
+// process-wide helper threads for parallel tokenization, started on first use and kept asleep in between;
+// one call uses them at a time, and a call that finds them busy tokenizes on its own thread
+struct llm_tokenizer_pool {
+    std::mutex run_mutex;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::vector<std::thread> threads;
+    const std::function<void()> * job = nullptr;
+    size_t n_wanted = 0;
+    size_t n_joined = 0;
+    size_t n_busy = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+
+    ~llm_tokenizer_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto & thread : threads) {
+            thread.join();
+        }
+    }
+
+    void worker_main() {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            if (n_joined == n_wanted) {
+                continue;
+            }
+            n_joined++;
+            lock.unlock();
+            (*job)();
+            lock.lock();
+            if (--n_busy == 0) {
+                done.notify_one();
+            }
+        }
+    }
+
+    // runs fn on the calling thread and on n_helpers pool threads; false, without running it, when busy
+    bool try_run(size_t n_helpers, const std::function<void()> & fn) {
+        std::unique_lock<std::mutex> run_lock(run_mutex, std::try_to_lock);
+        if (!run_lock.owns_lock()) {
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while (threads.size() < n_helpers) {
+                threads.emplace_back([this]() { worker_main(); });
+            }
+            job = &fn;
+            n_wanted = n_helpers;
+            n_joined = 0;
+            n_busy = n_helpers;
+            generation++;
+        }
+        wake.notify_all();
+        fn();
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&]() { return n_busy == 0; });
+        return true;
+    }
+};
+
+static llm_tokenizer_pool & llm_tokenizer_pool_get() {
+    static llm_tokenizer_pool pool;
+    return pool;
+}
+
+// tokenizes the fragments on up to n_threads threads, cutting raw text into pieces at safe split points;
+// false, leaving output untouched, when the raw text is too short to be worth splitting
+static bool llm_tokenize_bpe_parallel(
+        const llama_vocab & vocab,
+        const llm_tokenizer_bpe & tokenizer,
+        const std::forward_list<fragment_buffer_variant> & fragment_buffer,
+        std::vector<llama_token> & output,
+        int32_t n_threads) {
+    // pieces shorter than this are not worth handing to another thread
+    static constexpr size_t min_piece_len = 16*1024;
+
+    struct piece {
+        const fragment_buffer_variant * fragment;
+        size_t offset;
+        size_t length;
+    };
+
+    size_t n_text = 0;
+    for (const auto & fragment : fragment_buffer) {
+        if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
+            n_text += fragment.length;
+        }
+    }
+    if (n_text < 2*min_piece_len) {
+        return false;
+    }
+    // a few pieces per thread, so that threads finishing early pick up the rest
+    const size_t piece_len = std::max(min_piece_len, n_text / (4 * (size_t) n_threads));
+
+    std::vector<piece> pieces;
+    size_t n_text_pieces = 0;
+    for (const auto & fragment : fragment_buffer) {
+        if (fragment.type != FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
+            pieces.push_back({ &fragment, 0, 0 });
+            continue;
+        }
+        const size_t end = fragment.offset + fragment.length;
+        size_t start = fragment.offset;
+        while (end - start > piece_len) {
+            size_t pos = start + piece_len;
+            while (pos + 1 < end && !llm_bpe_is_safe_split(fragment.raw_text, pos)) {
+                pos++;
+            }
+            if (pos + 1 >= end) {
+                break;
+            }
+            pieces.push_back({ &fragment, start, pos - start });
+            n_text_pieces++;
+            start = pos;
+        }
+        pieces.push_back({ &fragment, start, end - start });
+        n_text_pieces++;
+    }
+
+    std::vector<std::vector<llama_token>> results(pieces.size());
+    std::atomic<size_t> next_piece(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    const std::function<void()> worker = [&]() {
+        try {
+            llm_tokenizer_bpe_session session(vocab, tokenizer);
+            for (size_t i = next_piece++; i < pieces.size(); i = next_piece++) {
+                const piece & p = pieces[i];
+                if (p.fragment->type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
+                    session.tokenize(p.fragment->raw_text.substr(p.offset, p.length), results[i]);
+                } else {
+                    session.append(p.fragment->token, results[i]);
+                }
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            error = std::current_exception();
+        }
+    };
+
+    const size_t n_workers = std::min((size_t) n_threads, n_text_pieces);
+    if (!llm_tokenizer_pool_get().try_run(n_workers - 1, worker)) {
+        worker();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    for (const auto & result : results) {
+        output.insert(output.end(), result.begin(), result.end());
+    }
+    return true;
+}
+
 std::vector<llama_token> llama_vocab::impl::tokenize(
         const std::string & raw_text,
         bool add_special,
-        bool parse_special) const {
+        bool parse_special,
+        int32_t n_threads) const {
     LM_GGML_ASSERT(tokenizer && "Tokenizer not initialized. Call llama_vocab::init_tokenizer() first.");
 
     std::vector<llama_token> output;
@@ -2451,16 +2791,21 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
                 if (add_special) {
                     session.append_bos(output);
                 }
-                for (const auto & fragment : fragment_buffer) {
-                    if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-                        std::string text = fragment.raw_text.substr(fragment.offset, fragment.length);
+                if (n_threads > 1 && pre_type != LLAMA_VOCAB_PRE_TYPE_SUPERBPE &&
+                        llm_tokenize_bpe_parallel(vocab, *static_cast<const llm_tokenizer_bpe *>(tokenizer.get()), fragment_buffer, output, n_threads)) {
+                    // tokenized in pieces
+                } else {
+                    for (const auto & fragment : fragment_buffer) {
+                        if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
+                            std::string text = fragment.raw_text.substr(fragment.offset, fragment.length);
 
 #ifdef PRETOKENIZERDEBUG
-                        LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
+                            LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
 #endif
-                        session.tokenize(text, output);
-                    } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
-                        session.append(fragment.token, output);
+                            session.tokenize(text, output);
+                        } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
+                            session.append(fragment.token, output);
+                        }
                     }
                 }
 
@@ -2637,6 +2982,47 @@ int32_t llama_vocab::impl::token_to_piece(llama_token token, char * buf, int32_t
     return 0;
 }
 
+size_t llama_vocab::impl::tokenize_reusable(
+        const std::string & text,
+        size_t n_shared,
+        const llama_token * prev_tokens,
+        size_t n_prev_tokens,
+        bool add_special,
+        size_t & n_bytes) const {
+    n_bytes = 0;
+    if (type != LLAMA_VOCAB_TYPE_BPE || pre_type == LLAMA_VOCAB_PRE_TYPE_SUPERBPE || (add_special && add_eos)) {
+        return 0;
+    }
+
+    size_t i = 0;
+    if (add_special && add_bos) {
+        if (n_prev_tokens == 0 || prev_tokens[0] != special_bos_id) {
+            return 0;
+        }
+        i = 1;
+    }
+
+    // a special token matched in the changed part may begin up to max_token_len bytes before it
+    n_shared = std::min(n_shared, text.size());
+    const size_t limit = n_shared > (size_t) max_token_len + 1 ? n_shared - max_token_len - 1 : 0;
+
+    size_t n_reusable = 0;
+    size_t offset = 0;
+    for (; i < n_prev_tokens; ++i) {
+        const std::string & piece = token_to_piece(prev_tokens[i]);
+        if (offset + piece.size() > limit || text.compare(offset, piece.size(), piece) != 0) {
+            break;
+        }
+        offset += piece.size();
+        if (offset > 0 && llm_bpe_is_safe_split(text, offset)) {
+            n_reusable = i + 1;
+            n_bytes = offset;
+        }
+    }
+
+    return n_reusable;
+}
+
 const std::string & llama_vocab::impl::token_to_piece(llama_token token) const {
     return cache_token_to_piece.at(token);
 }
@@ -3044,8 +3430,9 @@ int32_t llama_vocab::tokenize(
                  llama_token * tokens,
                      int32_t   n_tokens_max,
                         bool   add_special,
-                        bool   parse_special) const {
-    auto res = tokenize(std::string(text, text_len), add_special, parse_special);
+                        bool   parse_special,
+                     int32_t   n_threads) const {
+    auto res = tokenize(std::string(text, text_len), add_special, parse_special, n_threads);
     if (n_tokens_max < (int) res.size()) {
         // LLAMA_LOG_ERROR("%s: too many tokens\n", __func__);
         return -((int) res.size());
@@ -3061,14 +3448,36 @@ int32_t llama_vocab::tokenize(
 std::vector<llama_token> llama_vocab::tokenize(
         const std::string & raw_text,
         bool add_special,
-        bool parse_special) const {
-    return pimpl->tokenize(raw_text, add_special, parse_special);
+        bool parse_special,
+        int32_t n_threads) const {
+    return pimpl->tokenize(raw_text, add_special, parse_special, n_threads);
+}
+
+size_t llama_vocab::tokenize_reusable(
+        const std::string & text,
+        size_t n_shared,
+        const llama_token * prev_tokens,
+        size_t n_prev_tokens,
+        bool add_special,
+        size_t & n_bytes) const {
+    return pimpl->tokenize_reusable(text, n_shared, prev_tokens, n_prev_tokens, add_special, n_bytes);
 }
 
 const std::string & llama_vocab::token_to_piece(llama_token token) const {
     return pimpl->token_to_piece(token);
 }
 
+const llama_grammar_token_trie & llama_vocab::grammar_trie() const {
+    std::call_once(pimpl->grammar_trie_once, [this]() {
+        pimpl->grammar_trie.reset(new llama_grammar_token_trie(*this));
+    });
+    return *pimpl->grammar_trie;
+}
+
+llama_grammar_cache & llama_vocab::grammar_cache() const {
+    return pimpl->grammar_cache;
+}
+
 int32_t llama_vocab::token_to_piece(llama_token token, char * buf, int32_t length, int32_t lstrip, bool special) const {
     return pimpl->token_to_piece(token, buf, length, lstrip, special);
 }
@@ -3317,6 +3726,47 @@ int32_t llama_tokenize(
     return vocab->tokenize(text, text_len, tokens, n_tokens_max, add_special, parse_special);
 }
 
+int32_t llama_tokenize_parallel(
+    const struct llama_vocab * vocab,
+                  const char * text,
+                     int32_t   text_len,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    return vocab->tokenize(text, text_len, tokens, n_tokens_max, add_special, parse_special, n_threads);
+}
+
+int32_t llama_tokenize_incremental(
+    const struct llama_vocab * vocab,
+                  const char * text,
+                     int32_t   text_len,
+           const llama_token * prev_tokens,
+                     int32_t   n_prev_tokens,
+                     int32_t   n_shared,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads,
+                     int32_t * n_reused) {
+    const std::string raw_text(text, text_len);
+
+    size_t n_bytes = 0;
+    *n_reused = (int32_t) vocab->tokenize_reusable(raw_text, std::max(n_shared, 0), prev_tokens, std::max(n_prev_tokens, 0), add_special, n_bytes);
+
+    const auto res = *n_reused > 0
+        ? vocab->tokenize(raw_text.substr(n_bytes), false, parse_special, n_threads)
+        : vocab->tokenize(raw_text, add_special, parse_special, n_threads);
+    if (n_tokens_max < (int) res.size()) {
+        return -((int) res.size());
+    }
+    std::copy(res.begin(), res.end(), tokens);
+
+    return res.size();
+}
+
 int32_t llama_token_to_piece(
     const struct llama_vocab * vocab,
                  llama_token   token,
@@ -8,6 +8,8 @@
 
 struct LLM_KV;
 struct llama_model_loader;
+struct llama_grammar_token_trie;
+struct llama_grammar_cache;
 
 struct llama_vocab {
     struct token_data {
@@ -93,12 +95,25 @@ struct llama_vocab {
                   llama_token * tokens,
                       int32_t   n_tokens_max,
                          bool   add_special,
-                         bool   parse_special) const;
+                         bool   parse_special,
+                      int32_t   n_threads = 1) const;
 
+    // n_threads > 1 tokenizes long BPE inputs in pieces on that many threads, with the same result
     std::vector<llama_token> tokenize(
             const std::string & raw_text,
                          bool   add_special,
-                         bool   parse_special = false) const;
+                         bool   parse_special = false,
+                      int32_t   n_threads     = 1) const;
+
+    // number of leading prev_tokens, the tokenization of a text sharing its first n_shared bytes with text,
+    // after which text can be tokenized on its own; n_bytes receives the length of their text
+    size_t tokenize_reusable(
+            const std::string & text,
+                       size_t   n_shared,
+            const llama_token * prev_tokens,
+                       size_t   n_prev_tokens,
+                         bool   add_special,
+                       size_t & n_bytes) const;
 
     // does not write null-terminator to buf
     int32_t token_to_piece(
@@ -111,6 +126,12 @@ struct llama_vocab {
     // use cached data
     const std::string & token_to_piece(llama_token token) const;
 
+    // code point trie of the cached pieces, built on first use
+    const llama_grammar_token_trie & grammar_trie() const;
+
+    // grammars parsed against this vocab, see llama_grammar_init_impl
+    llama_grammar_cache & grammar_cache() const;
+
     int32_t detokenize(
             const llama_token * tokens,
                       int32_t   n_tokens,
@@ -216,6 +216,13 @@ extern "C" {
         LLAMA_ATTENTION_TYPE_NON_CAUSAL  = 1,
     };
 
+    // what a sequence gives up once it reaches its KV cell quota
+    enum llama_kv_evict_policy {
+        LLAMA_KV_EVICT_POLICY_NONE   = 0, // the ubatch that would exceed the quota fails to find a slot
+        LLAMA_KV_EVICT_POLICY_OLDEST = 1, // the oldest cells of the sequence are dropped
+        LLAMA_KV_EVICT_POLICY_SINK   = 2, // the first n_sink cells stay, the oldest after them are dropped (StreamingLLM)
+    };
+
     enum llama_split_mode {
         LLAMA_SPLIT_MODE_NONE  = 0, // single GPU
         LLAMA_SPLIT_MODE_LAYER = 1, // split layers and KV across GPUs
@@ -321,6 +328,8 @@ extern "C" {
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        bool use_repack_cache; // keep the weights repacked for the CPU in a side file next to the model
+        bool use_layer_streaming; // page mmap'd layer weights in just ahead of use and drop them after, for models larger than RAM
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -346,6 +355,7 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, <= 0 disabled (default)
+        uint32_t defrag_max_cells; // max KV cells a thold-scheduled defrag moves per update, the rest follow on later updates, 0 = unbounded
 
         lm_ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -353,6 +363,21 @@ extern "C" {
         enum lm_ggml_type type_k; // data type for K cache [EXPERIMENTAL]
         enum lm_ggml_type type_v; // data type for V cache [EXPERIMENTAL]
 
+        // with a quantized K or V type, keep the most recent cells in an F16 ring and requantize
+        // older ones a page at a time, 0 = disabled [EXPERIMENTAL]
+        uint32_t n_kv_recent;
+
+        // size the compute buffers for one token per sequence and grow them when a larger ubatch
+        // needs it; they shrink back once no larger ubatch ran for this many ms (0 = sized for the
+        // worst case up front, UINT32_MAX = only through llama_shrink_compute_buffers)
+        uint32_t compute_shrink_ms;
+
+        // recurrent models (Mamba, RWKV): state snapshots kept per sequence for
+        // llama_kv_self_seq_rollback, one taken every n_state_ckpt_interval tokens a ubatch starts
+        // from (0 = only through llama_kv_self_seq_checkpoint), n_state_ckpt = 0 disables them
+        uint32_t n_state_ckpt;
+        uint32_t n_state_ckpt_interval;
+
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
         // currently works only with CPU execution
@@ -401,6 +426,7 @@ extern "C" {
 
     // lora adapter
     struct llama_adapter_lora;
+    struct llama_adapter_lora_merge;
 
     // Helpers for getting default parameters
     // TODO: update API to start accepting pointers to params structs (https://github.com/ggml-org/llama.cpp/discussions/9172)
@@ -572,6 +598,60 @@ extern "C" {
     // Note: loaded adapters will be free when the associated model is deleted
     LLAMA_API void llama_adapter_lora_free(struct llama_adapter_lora * adapter);
 
+    // Size of the adapter's tensor buffers in bytes
+    LLAMA_API size_t llama_adapter_lora_n_bytes(const struct llama_adapter_lora * adapter);
+
+    // Create an untrained F32 adapter of the given rank for the layer weight matrices the filter
+    // accepts (NULL for all of them): A is initialized randomly from seed and B to zero, so the
+    // adapter starts as a no-op. Its tensors live in CPU memory, where the optimizer updates them
+    // Return NULL if no weight matches
+    LLAMA_API struct llama_adapter_lora * llama_adapter_lora_init_trainable(
+            struct llama_model * model,
+            int32_t rank,
+            float alpha,
+            bool (*filter)(const struct lm_ggml_tensor * weight, void * userdata),
+            void * userdata,
+            uint32_t seed);
+
+    // Copy the tensor data of src into dst, e.g. a saved adapter into a trainable one
+    // Return false, leaving dst unchanged, unless both adapt the same weights with the same shapes
+    LLAMA_API bool llama_adapter_lora_copy(
+            struct llama_adapter_lora * dst,
+            const struct llama_adapter_lora * src);
+
+    // Write the adapter to a GGUF file that llama_adapter_lora_init loads; returns false on failure
+    LLAMA_API bool llama_adapter_lora_save(
+            const struct llama_adapter_lora * adapter,
+            const struct llama_model * model,
+            const char * path);
+
+    // Merge an adapter into copies of the base weights it touches (W + scale*B*A, requantized to the
+    // weight's type), so an adapter used for a whole session costs nothing per token
+    // The originals are read back from the model files and the model is left untouched until the
+    // merge is applied, so this may run on another thread while contexts decode with the adapter set
+    // Return NULL if a weight cannot be merged, e.g. its type needs an importance matrix, or when
+    // abort_callback (optional) returns true; it is polled between weights
+    LLAMA_API struct llama_adapter_lora_merge * llama_adapter_lora_merge_init(
+            struct llama_model * model,
+            struct llama_adapter_lora * adapter,
+            float scale,
+            int32_t n_threads,
+            lm_ggml_abort_callback abort_callback,
+            void * abort_callback_data);
+
+    // Swap the merged weights into the model (merged = true) or the original ones back; this only
+    // exchanges tensor pointers. No context of the model may be decoding, and the adapter should
+    // not stay set on a context while merged.
+    LLAMA_API void llama_adapter_lora_merge_apply(
+            struct llama_adapter_lora_merge * merge,
+            bool merged);
+
+    // Size of the merged copies in bytes
+    LLAMA_API size_t llama_adapter_lora_merge_n_bytes(const struct llama_adapter_lora_merge * merge);
+
+    // Restores the original weights if the merge is applied, then frees the merged copies
+    LLAMA_API void llama_adapter_lora_merge_free(struct llama_adapter_lora_merge * merge);
+
     // The following functions operate on a llama_context, hence the naming: llama_verb_...
 
     // Add a loaded LoRA adapter to given context
@@ -590,12 +670,28 @@ extern "C" {
     // Remove all LoRA adapters from given context
     LLAMA_API void llama_clear_adapter_lora(struct llama_context * ctx);
 
+    // Add a loaded LoRA adapter for the tokens of one sequence only, on top of the adapters set on
+    // the whole context, so sequences using different adapters can be decoded in the same batch
+    // A token shared by several sequences uses the adapters of its first one
+    // Return -1 for a negative seq_id
+    LLAMA_API int32_t llama_set_adapter_lora_seq(
+            struct llama_context * ctx,
+            struct llama_adapter_lora * adapter,
+            float scale,
+            llama_seq_id seq_id);
+
+    // Remove the per-sequence adapters of seq_id, of every sequence if seq_id < 0
+    LLAMA_API void llama_clear_adapter_lora_seq(
+            struct llama_context * ctx,
+            llama_seq_id seq_id);
+
     // Apply a loaded control vector to a llama_context, or if data is NULL, clear
     // the currently loaded vector.
     // n_embd should be the size of a single layer's control, and data should point
     // to an n_embd x n_layers buffer starting from layer 1.
     // il_start and il_end are the layer range the vector should apply to (both inclusive)
     // See llama_control_vector_load in common to load a control vector.
+    // Layers whose direction is all zero get no add; changing only the data keeps a reused graph.
     LLAMA_API int32_t llama_apply_adapter_cvec(
             struct llama_context * ctx,
                      const float * data,
@@ -648,6 +744,31 @@ extern "C" {
             struct llama_context * ctx,
                     llama_seq_id   seq_id);
 
+    // Limits the KV cells of a sequence to n_max_cells, applying the policy when a ubatch would exceed it
+    // Evicted cells keep their positions, nothing is shifted
+    // n_max_cells == 0 : no quota
+    LLAMA_API void llama_kv_self_seq_set_quota(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                        uint32_t   n_max_cells,
+      enum llama_kv_evict_policy   policy,
+                        uint32_t   n_sink);
+
+    // Snapshots the current state of the sequence into its checkpoint ring, dropping its oldest one
+    // Returns false if the cache keeps no checkpoints (attention caches, n_state_ckpt == 0) or the sequence is empty
+    LLAMA_API bool llama_kv_self_seq_checkpoint(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id);
+
+    // Removes the positions [p, inf) of the specified sequence
+    // Attention caches remove them exactly, recurrent states are restored from the newest checkpoint
+    // before p and the positions from the returned one up to p have to be decoded again
+    // Returns the position decoding resumes at (<= p), -1 on failure
+    LLAMA_API llama_pos llama_kv_self_seq_rollback(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p);
+
     // Adds relative position "delta" to all tokens that belong to the specified sequence and have positions in [p0, p1)
     // If the KV cache is RoPEd, the KV data is updated accordingly:
     //   - lazily on next llama_decode()
@@ -693,6 +814,17 @@ extern "C" {
     //   - explicitly with llama_kv_self_update()
     LLAMA_API void llama_kv_self_defrag(struct llama_context * ctx);
 
+    struct llama_kv_defrag_stats {
+        float    fragmentation; // share of empty cells below the last used one
+        uint32_t n_steps;       // defrag graphs computed
+        uint64_t n_cells_moved;
+        uint64_t n_bytes_moved; // K and V bytes copied by the defrag graphs
+        bool     pending;       // a defrag is scheduled or only partly done
+    };
+
+    // Fragmentation of the KV cache and the defrag work done so far
+    LLAMA_API struct llama_kv_defrag_stats llama_kv_self_defrag_stats(const struct llama_context * ctx);
+
     // Check if the context supports KV cache shifting
     LLAMA_API bool llama_kv_self_can_shift(const struct llama_context * ctx);
 
@@ -865,6 +997,13 @@ extern "C" {
     // If true, embeddings will be returned but logits will not
     LLAMA_API void llama_set_embeddings(struct llama_context * ctx, bool embeddings);
 
+    // Set whether pooled embeddings (mean, cls and last pooling) are L2-normalized in the graph
+    LLAMA_API void llama_set_embeddings_normalize(struct llama_context * ctx, bool normalize);
+
+    // Set whether a WavTokenizer vocoder's graph ends in the ISTFT (the default), with n_fft/4 samples of
+    // PCM leading each token's embedding, or hands back the log-magnitude and phase spectrum
+    LLAMA_API void llama_set_vocoder_istft(struct llama_context * ctx, bool istft);
+
     // Set whether to use causal attention or not
     // If set to true, the model will only attend to the past tokens
     LLAMA_API void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn);
@@ -873,14 +1012,28 @@ extern "C" {
     // If true, all model tensors are activated during llama_decode() to load and cache their weights.
     LLAMA_API void llama_set_warmup(struct llama_context * ctx, bool warmup);
 
+    // Leave out the layers with skip[il] set from the graphs decoded from now on, sharing the weights
+    // and the KV cache of the full model; the first and the last layer always run. n == 0 runs all
+    // layers again. Returns false if the architecture does not support it (e.g. recurrent models), or
+    // for a sliding-window model whose context was created without swa_full
+    LLAMA_API bool llama_set_layer_skip(struct llama_context * ctx, const bool * skip, int32_t n);
+
     // Set abort callback
     LLAMA_API void llama_set_abort_callback(struct llama_context * ctx, lm_ggml_abort_callback abort_callback, void * abort_callback_data);
 
+    // Set the scheduler eval callback (same as llama_context_params.cb_eval), NULL to disable
+    // Nodes the callback asks for are computed and synchronized one range at a time
+    LLAMA_API void llama_set_eval_callback(struct llama_context * ctx, lm_ggml_backend_sched_eval_callback cb_eval, void * cb_eval_user_data);
+
     // Wait until all computations are finished
     // This is automatically done when using one of the functions below to obtain the computation results
     // and is not necessary to call it explicitly in most cases
     LLAMA_API void llama_synchronize(struct llama_context * ctx);
 
+    // Give back the compute memory that graphs larger than one token per sequence grew, e.g. on
+    // memory pressure; the next larger ubatch grows it again. Returns the bytes freed
+    LLAMA_API size_t llama_shrink_compute_buffers(struct llama_context * ctx);
+
     // Token logits obtained from the last call to llama_decode()
     // The logits for which llama_batch.logits[i] != 0 are stored contiguously
     // in the order they have appeared in the batch.
@@ -894,6 +1047,18 @@ extern "C" {
     // returns NULL for invalid ids.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
+    // Keep the logits of the last ubatch in the backend buffer and copy a row to the host only when
+    // llama_get_logits_ith (or llama_get_logits, for all rows) asks for it
+    // The rows stay available until the next graph is computed on the context
+    LLAMA_API void llama_set_logits_lazy(struct llama_context * ctx, bool lazy);
+
+    // Select the k largest logits of every output row on the backend while decoding (0 disables, max 512)
+    LLAMA_API void llama_set_logits_top_k(struct llama_context * ctx, int32_t k);
+
+    // Top-k candidates of the ith token in descending order of logit; ids and logits must hold k entries
+    // Returns the number of candidates written, 0 if top-k selection is disabled or i is invalid
+    LLAMA_API int32_t llama_get_logits_top_k_ith(struct llama_context * ctx, int32_t i, llama_token * ids, float * logits);
+
     // Get all output token embeddings.
     // when pooling_type == LLAMA_POOLING_TYPE_NONE or when using a generative model,
     // the embeddings for which llama_batch.logits[i] != 0 are stored contiguously
@@ -915,6 +1080,11 @@ extern "C" {
     // otherwise: float[n_embd] (1-dimensional)
     LLAMA_API float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id);
 
+    // Write the pooled embeddings of sequence s to out + s*n_embd (out + s for rank pooling) for s < n_seq,
+    // instead of a buffer of the context; NULL goes back to it. The rows are complete after llama_synchronize
+    // and llama_get_embeddings_seq points into out while it is set.
+    LLAMA_API void llama_set_embeddings_seq_out(struct llama_context * ctx, float * out, int32_t n_seq);
+
     //
     // Vocab
     //
@@ -996,6 +1166,37 @@ extern "C" {
                             bool   add_special,
                             bool   parse_special);
 
+    /// @details Same as llama_tokenize, but long inputs of BPE vocabs are cut at word boundaries that are safe for
+    ///          the pre-tokenizer and the pieces are tokenized on up to n_threads threads. The result is identical.
+    ///          Only raw text of 32 KB or more is split; the threads are a process-wide pool kept between calls.
+    LLAMA_API int32_t llama_tokenize_parallel(
+        const struct llama_vocab * vocab,
+                      const char * text,
+                         int32_t   text_len,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
+    /// @details Tokenizes text given prev_tokens, the tokens of an earlier text whose first n_shared bytes equal those of text.
+    ///          The first *n_reused of prev_tokens stay as they are and tokens receives only the tokens that follow them,
+    ///          the same as tokenizing text from scratch would give. *n_reused is 0 when nothing can be reused (non-BPE vocabs).
+    /// @return Same as llama_tokenize, counting the new tokens only
+    LLAMA_API int32_t llama_tokenize_incremental(
+        const struct llama_vocab * vocab,
+                      const char * text,
+                         int32_t   text_len,
+               const llama_token * prev_tokens,
+                         int32_t   n_prev_tokens,
+                         int32_t   n_shared,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads,
+                         int32_t * n_reused);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -1321,6 +1522,7 @@ extern "C" {
 
         int32_t n_p_eval;
         int32_t n_eval;
+        int32_t n_reused; // number of graphs reused
     };
 
     struct llama_perf_sampler_data {
@@ -1356,8 +1558,13 @@ extern "C" {
 
         lm_ggml_opt_get_optimizer_params get_opt_pars; // callback for calculating optimizer parameters
         void * get_opt_pars_ud;                     // userdata for calculating optimizer parameters
+
+        bool checkpoint_layers;            // keep only the layer outputs for the backward pass, recompute the rest
+        enum lm_ggml_type opt_state_type;     // AdamW momenta type: LM_GGML_TYPE_F32, LM_GGML_TYPE_F16 or LM_GGML_TYPE_BF16
     };
 
+    // The LoRA adapters set on the context with llama_set_adapter_lora are trained along with the
+    // model tensors; a param_filter matching only their tensors trains the adapters alone
     LLAMA_API void llama_opt_init(struct llama_context * lctx, struct llama_model * model, struct llama_opt_params lopt_params);
 
     LLAMA_API void llama_opt_epoch(
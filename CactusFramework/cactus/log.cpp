@@ -1,11 +1,15 @@
 #include "log.h"
 
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <cstdarg>
 #include <cstdio>
+#include <cstring>
+#include <memory>
 #include <mutex>
 #include <sstream>
+#include <string>
 #include <thread>
 #include <vector>
 
@@ -49,94 +53,122 @@ static std::vector<const char *> g_col = {
     "",
 };
 
-struct common_log_entry {
-    enum lm_ggml_log_level level;
+// prints one message; used for ring entries and for fast slots alike
+static void common_log_print(enum lm_ggml_log_level level, bool prefix, int64_t timestamp, const char * msg, FILE * file = nullptr) {
+    #if defined(__ANDROID__) && defined(RNLLAMA_ANDROID_ENABLE_LOGGING)
+    int android_log_priority;
+    switch (level) {
+        case LM_GGML_LOG_LEVEL_INFO:
+            android_log_priority = ANDROID_LOG_INFO;
+            break;
+        case LM_GGML_LOG_LEVEL_WARN:
+            android_log_priority = ANDROID_LOG_WARN;
+            break;
+        case LM_GGML_LOG_LEVEL_ERROR:
+            android_log_priority = ANDROID_LOG_ERROR;
+            break;
+        case LM_GGML_LOG_LEVEL_DEBUG:
+            android_log_priority = ANDROID_LOG_DEBUG;
+            break;
+        default:
+            android_log_priority = ANDROID_LOG_DEFAULT;
+            break;
+    }
 
-    bool prefix;
+    const char * tag = "RNLLAMA_LOG_ANDROID";
+    __android_log_print(android_log_priority, tag, "%s", msg);
+    LM_GGML_UNUSED(prefix);
+    LM_GGML_UNUSED(timestamp);
+    LM_GGML_UNUSED(file);
+    #else
+    FILE * fcur = file;
+    if (!fcur) {
+        // stderr displays DBG messages only when their verbosity level is not higher than the threshold
+        // these messages will still be logged to a file
+        if (level == LM_GGML_LOG_LEVEL_DEBUG && common_log_verbosity_thold < LOG_DEFAULT_DEBUG) {
+            return;
+        }
 
-    int64_t timestamp;
+        fcur = stdout;
 
-    std::vector<char> msg;
+        if (level != LM_GGML_LOG_LEVEL_NONE) {
+            fcur = stderr;
+        }
+    }
 
-    // signals the worker thread to stop
-    bool is_end;
+    if (level != LM_GGML_LOG_LEVEL_NONE && level != LM_GGML_LOG_LEVEL_CONT && prefix) {
+        if (timestamp) {
+            // [M.s.ms.us]
+            fprintf(fcur, "%s%d.%02d.%03d.%03d%s ",
+                    g_col[COMMON_LOG_COL_BLUE],
+                    (int) (timestamp / 1000000 / 60),
+                    (int) (timestamp / 1000000 % 60),
+                    (int) (timestamp / 1000 % 1000),
+                    (int) (timestamp % 1000),
+                    g_col[COMMON_LOG_COL_DEFAULT]);
+        }
 
-    #if defined(__ANDROID__) && defined(RNLLAMA_ANDROID_ENABLE_LOGGING)
-    void android_print() const {
-        int android_log_priority;
         switch (level) {
-            case LM_GGML_LOG_LEVEL_INFO:
-                android_log_priority = ANDROID_LOG_INFO;
-                break;
-            case LM_GGML_LOG_LEVEL_WARN:
-                android_log_priority = ANDROID_LOG_WARN;
-                break;
-            case LM_GGML_LOG_LEVEL_ERROR:
-                android_log_priority = ANDROID_LOG_ERROR;
-                break;
-            case LM_GGML_LOG_LEVEL_DEBUG:
-                android_log_priority = ANDROID_LOG_DEBUG;
-                break;
+            case LM_GGML_LOG_LEVEL_INFO:  fprintf(fcur, "%sI %s", g_col[COMMON_LOG_COL_GREEN],   g_col[COMMON_LOG_COL_DEFAULT]); break;
+            case LM_GGML_LOG_LEVEL_WARN:  fprintf(fcur, "%sW %s", g_col[COMMON_LOG_COL_MAGENTA], ""                        ); break;
+            case LM_GGML_LOG_LEVEL_ERROR: fprintf(fcur, "%sE %s", g_col[COMMON_LOG_COL_RED],     ""                        ); break;
+            case LM_GGML_LOG_LEVEL_DEBUG: fprintf(fcur, "%sD %s", g_col[COMMON_LOG_COL_YELLOW],  ""                        ); break;
             default:
-                android_log_priority = ANDROID_LOG_DEFAULT;
                 break;
         }
+    }
+
+    fprintf(fcur, "%s", msg);
 
-        const char * tag = "RNLLAMA_LOG_ANDROID";
-        __android_log_print(android_log_priority, tag, "%s", msg.data());
+    if (level == LM_GGML_LOG_LEVEL_WARN || level == LM_GGML_LOG_LEVEL_ERROR || level == LM_GGML_LOG_LEVEL_DEBUG) {
+        fprintf(fcur, "%s", g_col[COMMON_LOG_COL_DEFAULT]);
     }
+
+    fflush(fcur);
     #endif
+}
+
+struct common_log_entry {
+    enum lm_ggml_log_level level;
+
+    bool prefix;
+
+    int64_t timestamp;
+
+    std::vector<char> msg;
+
+    // signals the worker thread to stop
+    bool is_end;
 
     void print(FILE * file = nullptr) const {
-        #if defined(__ANDROID__) && defined(RNLLAMA_ANDROID_ENABLE_LOGGING)
-        android_print();
-        #else
-        FILE * fcur = file;
-        if (!fcur) {
-            // stderr displays DBG messages only when their verbosity level is not higher than the threshold
-            // these messages will still be logged to a file
-            if (level == LM_GGML_LOG_LEVEL_DEBUG && common_log_verbosity_thold < LOG_DEFAULT_DEBUG) {
-                return;
-            }
+        common_log_print(level, prefix, timestamp, msg.data(), file);
+    }
+};
 
-            fcur = stdout;
+// One message of common_log_addv. Slots form a bounded queue (Vyukov): a producer owns the slot
+// whose seq equals its ticket, publishes it with seq = ticket + 1, and the worker hands it back with
+// seq = ticket + COMMON_LOG_FAST_SLOTS.
+#define COMMON_LOG_FAST_SLOTS 256
+#define COMMON_LOG_FAST_MSG   256
 
-            if (level != LM_GGML_LOG_LEVEL_NONE) {
-                fcur = stderr;
-            }
-        }
+// after a message the worker polls for this long before sleeping until woken, so producers in a
+// burst never pay for a wakeup
+#define COMMON_LOG_FAST_LINGER_US 100000
+#define COMMON_LOG_FAST_POLL_MS   5
 
-        if (level != LM_GGML_LOG_LEVEL_NONE && level != LM_GGML_LOG_LEVEL_CONT && prefix) {
-            if (timestamp) {
-                // [M.s.ms.us]
-                fprintf(fcur, "%s%d.%02d.%03d.%03d%s ",
-                        g_col[COMMON_LOG_COL_BLUE],
-                        (int) (timestamp / 1000000 / 60),
-                        (int) (timestamp / 1000000 % 60),
-                        (int) (timestamp / 1000 % 1000),
-                        (int) (timestamp % 1000),
-                        g_col[COMMON_LOG_COL_DEFAULT]);
-            }
+struct common_log_fast_slot {
+    std::atomic<size_t> seq;
 
-            switch (level) {
-                case LM_GGML_LOG_LEVEL_INFO:  fprintf(fcur, "%sI %s", g_col[COMMON_LOG_COL_GREEN],   g_col[COMMON_LOG_COL_DEFAULT]); break;
-                case LM_GGML_LOG_LEVEL_WARN:  fprintf(fcur, "%sW %s", g_col[COMMON_LOG_COL_MAGENTA], ""                        ); break;
-                case LM_GGML_LOG_LEVEL_ERROR: fprintf(fcur, "%sE %s", g_col[COMMON_LOG_COL_RED],     ""                        ); break;
-                case LM_GGML_LOG_LEVEL_DEBUG: fprintf(fcur, "%sD %s", g_col[COMMON_LOG_COL_YELLOW],  ""                        ); break;
-                default:
-                    break;
-            }
-        }
+    enum lm_ggml_log_level level;
 
-        fprintf(fcur, "%s", msg.data());
+    bool prefix;
 
-        if (level == LM_GGML_LOG_LEVEL_WARN || level == LM_GGML_LOG_LEVEL_ERROR || level == LM_GGML_LOG_LEVEL_DEBUG) {
-            fprintf(fcur, "%s", g_col[COMMON_LOG_COL_DEFAULT]);
-        }
+    int64_t timestamp;
 
-        fflush(fcur);
-        #endif
-    }
+    char msg[COMMON_LOG_FAST_MSG];
+
+    // longer messages; keeps its capacity, so only the first long message per slot allocates
+    std::string spill;
 };
 
 struct common_log {
@@ -159,6 +191,13 @@ struct common_log {
         head = 0;
         tail = 0;
 
+        fast.reset(new common_log_fast_slot[COMMON_LOG_FAST_SLOTS]);
+        for (size_t i = 0; i < COMMON_LOG_FAST_SLOTS; i++) {
+            fast[i].seq.store(i, std::memory_order_relaxed);
+        }
+        fast_tail = 0;
+        fast_head = 0;
+
         resume();
     }
 
@@ -176,9 +215,12 @@ private:
 
     FILE * file;
 
-    bool prefix;
-    bool timestamps;
-    bool running;
+    std::atomic<bool> prefix;
+    std::atomic<bool> timestamps;
+    std::atomic<bool> running;
+
+    // set while the worker waits on cv; producers of the lock-free path only take mtx to wake it
+    std::atomic<bool> sleeping{false};
 
     int64_t t_start;
 
@@ -190,6 +232,114 @@ private:
     // worker thread copies into this
     common_log_entry cur;
 
+    // lock-free path, see common_log_fast_slot
+    std::unique_ptr<common_log_fast_slot[]> fast;
+    std::atomic<size_t> fast_tail;
+    size_t fast_head; // worker only
+
+    // a full queue wakes the worker out of its poll as well
+    void wake(bool full = false) {
+        if (full || sleeping.load(std::memory_order_seq_cst)) {
+            std::lock_guard<std::mutex> lock(mtx);
+            cv.notify_one();
+        }
+    }
+
+public:
+    // Formats into a free slot without locking. A full queue makes the caller wait for the worker
+    // rather than reorder or drop its messages; longer messages spill into the slot's string.
+    void addv(enum lm_ggml_log_level level, const char * prefix_str, bool newline, const char * fmt, va_list args) {
+        if (!running.load(std::memory_order_acquire)) {
+            // discard messages while the worker thread is paused
+            return;
+        }
+
+        size_t pos = fast_tail.load(std::memory_order_relaxed);
+        common_log_fast_slot * slot;
+        while (true) {
+            slot = &fast[pos % COMMON_LOG_FAST_SLOTS];
+            const size_t seq = slot->seq.load(std::memory_order_acquire);
+            const intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+            if (dif == 0) {
+                if (fast_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                if (!running.load(std::memory_order_acquire)) {
+                    return;
+                }
+                wake(true);
+                std::this_thread::yield();
+                pos = fast_tail.load(std::memory_order_relaxed);
+            } else {
+                pos = fast_tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        // cannot use args twice, so make a copy in case the message spills
+        va_list args_copy;
+        va_copy(args_copy, args);
+
+        const size_t n_head = prefix_str ? strlen(prefix_str) : 0;
+        const size_t n_tail = newline ? 1 : 0;
+        char * msg = slot->msg;
+        size_t n_body;
+        slot->spill.clear();
+        if (n_head + n_tail < COMMON_LOG_FAST_MSG) {
+            if (n_head > 0) {
+                memcpy(msg, prefix_str, n_head);
+            }
+            n_body = (size_t) vsnprintf(msg + n_head, COMMON_LOG_FAST_MSG - n_head - n_tail, fmt, args);
+        } else {
+            n_body = (size_t) vsnprintf(nullptr, 0, fmt, args);
+        }
+
+        const size_t n = n_head + n_body + n_tail;
+        if (n >= COMMON_LOG_FAST_MSG) {
+            slot->spill.resize(n);
+            msg = &slot->spill[0];
+            if (n_head > 0) {
+                memcpy(msg, prefix_str, n_head);
+            }
+            vsnprintf(msg + n_head, n_body + 1, fmt, args_copy);
+        }
+        va_end(args_copy);
+
+        if (newline) {
+            msg[n - 1] = '\n';
+        }
+        msg[n] = 0;
+
+        slot->level     = level;
+        slot->prefix    = prefix.load(std::memory_order_relaxed);
+        slot->timestamp = timestamps.load(std::memory_order_relaxed) ? t_us() - t_start : 0;
+        slot->seq.store(pos + 1, std::memory_order_seq_cst);
+
+        wake();
+    }
+
+private:
+    bool fast_ready() const {
+        return fast[fast_head % COMMON_LOG_FAST_SLOTS].seq.load(std::memory_order_seq_cst) == fast_head + 1;
+    }
+
+    // worker thread: prints every published slot and hands it back to the producers
+    bool drain_fast() {
+        bool drained = false;
+        while (fast_ready()) {
+            drained = true;
+            common_log_fast_slot & slot = fast[fast_head % COMMON_LOG_FAST_SLOTS];
+            const char * msg = slot.spill.empty() ? slot.msg : slot.spill.c_str();
+            common_log_print(slot.level, slot.prefix, slot.timestamp, msg);
+            if (file) {
+                common_log_print(slot.level, slot.prefix, slot.timestamp, msg, file);
+            }
+            slot.seq.store(fast_head + COMMON_LOG_FAST_SLOTS, std::memory_order_release);
+            fast_head++;
+        }
+        return drained;
+    }
+
 public:
     void add(enum lm_ggml_log_level level, const char * fmt, va_list args) {
         std::lock_guard<std::mutex> lock(mtx);
@@ -279,10 +429,26 @@ public:
         running = true;
 
         thrd = std::thread([this]() {
+            int64_t t_last = t_us();
             while (true) {
+                if (drain_fast()) {
+                    t_last = t_us();
+                }
+
                 {
                     std::unique_lock<std::mutex> lock(mtx);
-                    cv.wait(lock, [this]() { return head != tail; });
+                    const auto ready = [this]() { return head != tail || fast_ready(); };
+                    if (t_us() - t_last < COMMON_LOG_FAST_LINGER_US) {
+                        cv.wait_for(lock, std::chrono::milliseconds(COMMON_LOG_FAST_POLL_MS), ready);
+                    } else {
+                        sleeping = true;
+                        cv.wait(lock, ready);
+                        sleeping = false;
+                    }
+
+                    if (head == tail) {
+                        continue;
+                    }
 
                     cur = entries[head];
 
@@ -290,6 +456,7 @@ public:
                 }
 
                 if (cur.is_end) {
+                    drain_fast();
                     break;
                 }
 
@@ -410,6 +577,10 @@ void common_log_add(struct common_log * log, enum lm_ggml_log_level level, const
     va_end(args);
 }
 
+void common_log_addv(struct common_log * log, enum lm_ggml_log_level level, const char * prefix, bool newline, const char * fmt, va_list args) {
+    log->addv(level, prefix, newline, fmt, args);
+}
+
 void common_log_set_file(struct common_log * log, const char * file) {
     log->set_file(file);
 }
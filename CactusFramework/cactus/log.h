@@ -2,6 +2,8 @@
 
 #include "ggml.h" // for lm_ggml_log_level
 
+#include <cstdarg>
+
 #define LOG_CLR_TO_EOL  "\033[K\r"
 #define LOG_COL_DEFAULT "\033[0m"
 #define LOG_COL_BOLD    "\033[1m"
@@ -43,6 +45,11 @@ void                common_log_free  (struct common_log * log);
 LOG_ATTRIBUTE_FORMAT(3, 4)
 void common_log_add(struct common_log * log, enum lm_ggml_log_level level, const char * fmt, ...);
 
+// formats on the calling thread into a lock-free queue, without locking or allocating, and leaves
+// the writing to the worker thread; prefix is copied in front of the message, newline appends '\n'.
+// Messages keep their order per thread, not relative to common_log_add.
+void common_log_addv(struct common_log * log, enum lm_ggml_log_level level, const char * prefix, bool newline, const char * fmt, va_list args);
+
 // defaults: file = NULL, colors = false, prefix = false, timestamps = false
 //
 // regular log output:
@@ -481,14 +481,13 @@ class chat_template {
                 add_message(message);
             }
             flush_sys();
-        } else {
-            actual_messages = inputs.messages;
         }
+        // without polyfills the messages are converted straight from the inputs instead of being deep-copied twice first
+        const json & messages = needs_polyfills ? actual_messages : inputs.messages;
 
-        auto context = minja::Context::make(json({
-            {"messages", actual_messages},
-            {"add_generation_prompt", inputs.add_generation_prompt},
-        }));
+        auto context = minja::Context::make(Value::object());
+        context->set("messages", Value(messages));
+        context->set("add_generation_prompt", Value(inputs.add_generation_prompt));
         context->set("bos_token", opts.use_bos_token ? bos_token_ : "");
         context->set("eos_token", opts.use_eos_token ? eos_token_ : "");
         if (opts.define_strftime_now) {
@@ -2,10 +2,21 @@
 
 #include "common.h"
 #include "log.h"
+#include "ggml-cpu.h"
 
 #include <cmath>
 #include <unordered_map>
 #include <algorithm>
+#include <atomic>
+#include <random>
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#if defined(__APPLE__)
+#include <Accelerate/Accelerate.h>
+#endif
 
 // the ring buffer works similarly to std::deque, but with a fixed capacity
 // TODO: deduplicate with llama-impl.h
@@ -100,6 +111,55 @@ struct ring_buffer {
     std::vector<T> data;
 };
 
+static bool common_sampler_penalties_on(const common_params_sampling & params) {
+    return params.penalty_last_n > 0 &&
+        (params.penalty_repeat != 1.0f || params.penalty_freq != 0.0f || params.penalty_present != 0.0f);
+}
+
+// The default chain (penalties -> top-k -> top-p -> min-p -> temperature -> dist) with every other
+// stage a no-op runs on a small candidate window read straight from the logits row. Penalties may
+// only lower logits, so the k best penalized tokens are among the k + penalty_last_n best raw ones.
+// Returns that window, or 0 when the chain cannot be fused.
+static int32_t common_sampler_fuse_window(const common_params_sampling & params, size_t n_prev) {
+    if (params.mirostat != 0 || !params.logit_bias.empty() || params.samplers != common_params_sampling().samplers) {
+        return 0;
+    }
+    if (params.dry_multiplier != 0.0f || params.top_n_sigma > 0.0f || params.typ_p < 1.0f ||
+        params.xtc_probability > 0.0f || params.dynatemp_range > 0.0f) {
+        return 0;
+    }
+    if (params.temp > 0.0f && params.top_k <= 0) {
+        return 0;
+    }
+
+    int32_t window = params.temp <= 0.0f ? 1 : params.top_k;
+    if (common_sampler_penalties_on(params)) {
+        if (params.penalty_repeat < 1.0f || params.penalty_freq < 0.0f || params.penalty_present < 0.0f ||
+            (size_t) params.penalty_last_n > n_prev) {
+            return 0;
+        }
+        window += params.penalty_last_n;
+    }
+
+    // past a few thousand candidates the heap stops paying for itself
+    return window <= 4096 ? window : 0;
+}
+
+// max of 16 consecutive floats
+static inline float common_block_max16(const float * x) {
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t m = vmaxq_f32(vmaxq_f32(vld1q_f32(x),     vld1q_f32(x + 4)),
+                                    vmaxq_f32(vld1q_f32(x + 8), vld1q_f32(x + 12)));
+    return vmaxvq_f32(m);
+#else
+    float m = x[0];
+    for (int j = 1; j < 16; j++) {
+        m = std::max(m, x[j]);
+    }
+    return m;
+#endif
+}
+
 struct common_sampler {
     common_params_sampling params;
 
@@ -112,8 +172,16 @@ struct common_sampler {
 
     llama_token_data_array cur_p;
 
+    // logits row resolved ahead of time by common_sampler_sample_batch, reading rows from the
+    // context is not thread-safe
+    const float * logits_row = nullptr;
+
+    const float * get_logits(struct llama_context * ctx, int idx) const {
+        return logits_row ? logits_row : llama_get_logits_ith(ctx, idx);
+    }
+
     void set_logits(struct llama_context * ctx, int idx) {
-        const auto * logits = llama_get_logits_ith(ctx, idx);
+        const auto * logits = get_logits(ctx, idx);
 
         const llama_model * model = llama_get_model(ctx);
         const llama_vocab * vocab = llama_model_get_vocab(model);
@@ -128,6 +196,176 @@ struct common_sampler {
 
         cur_p = { cur.data(), cur.size(), -1, false };
     }
+
+    // fused fast path, see common_sampler_fuse_window
+    bool fused = false;
+    std::mt19937 rng{};
+    std::vector<llama_token> prev_sorted{};
+
+    // tokens accepted since the last reset, the history the penalties sampler sees
+    size_t n_accepted = 0;
+
+    // samples without building the n_vocab candidate array: cur ends up holding only the
+    // candidates that survive the chain, sorted, with their probabilities
+    // With a grammar, the candidate window grows until the k best allowed tokens beat every raw logit
+    // left out (penalties only lower logits). LLAMA_TOKEN_NULL means that would cover too much of
+    // the vocab, and the caller should use the full chain.
+    llama_token sample_fused(struct llama_context * ctx, int idx, struct llama_sampler * grammar = nullptr) {
+        const auto * logits = get_logits(ctx, idx);
+
+        const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+
+        const bool   penalties = common_sampler_penalties_on(params);
+        const size_t k         = std::min<size_t>(params.temp <= 0.0f ? 1 : params.top_k, n_vocab);
+        size_t       window    = std::min<size_t>(k + (penalties ? params.penalty_last_n : 0), n_vocab);
+
+        const auto by_logit = [](const llama_token_data & a, const llama_token_data & b) { return a.logit > b.logit; };
+
+        while (true) {
+            // one more than the window with a grammar, to bound the logits left out
+            const llama_token n_heap = std::min<size_t>(grammar ? window + 1 : window, n_vocab);
+
+            // min-heap of the best logits; blocks whose max cannot enter it are skipped whole
+            cur.clear();
+            for (llama_token id = 0; id < n_heap; id++) {
+                cur.push_back({ id, logits[id], 0.0f });
+            }
+            std::make_heap(cur.begin(), cur.end(), by_logit);
+
+            const auto offer = [&](llama_token id) {
+                if (logits[id] > cur.front().logit) {
+                    std::pop_heap(cur.begin(), cur.end(), by_logit);
+                    cur.back() = { id, logits[id], 0.0f };
+                    std::push_heap(cur.begin(), cur.end(), by_logit);
+                }
+            };
+
+            llama_token id = n_heap;
+            for (; id + 16 <= n_vocab; id += 16) {
+                if (common_block_max16(logits + id) <= cur.front().logit) {
+                    continue;
+                }
+                for (llama_token j = id; j < id + 16; j++) {
+                    offer(j);
+                }
+            }
+            for (; id < n_vocab; id++) {
+                offer(id);
+            }
+            std::sort_heap(cur.begin(), cur.end(), by_logit);
+
+            float bound = -INFINITY;
+            if (cur.size() > window) {
+                bound = cur.back().logit;
+                cur.pop_back();
+            }
+
+            if (penalties) {
+                penalize_window();
+            }
+
+            if (grammar == nullptr) {
+                break;
+            }
+
+            llama_token_data_array window_p = { cur.data(), cur.size(), -1, true };
+            llama_sampler_apply(grammar, &window_p);
+            cur.erase(std::remove_if(cur.begin(), cur.end(), [](const llama_token_data & c) { return c.logit == -INFINITY; }), cur.end());
+
+            if (cur.size() >= k && cur[k - 1].logit >= bound) {
+                break;
+            }
+
+            window *= 4;
+            if (window > (size_t) n_vocab / 4) {
+                return LLAMA_TOKEN_NULL;
+            }
+        }
+
+        return sample_window(k);
+    }
+
+    // same arithmetic as llama_sampler_penalties, on the candidates in cur, which stay sorted
+    void penalize_window() {
+        const auto by_logit = [](const llama_token_data & a, const llama_token_data & b) { return a.logit > b.logit; };
+
+        const size_t n_hist = std::min({ (size_t) params.penalty_last_n, prev.size(), n_accepted });
+        prev_sorted.clear();
+        for (size_t i = 0; i < n_hist; i++) {
+            prev_sorted.push_back(prev.rat(i));
+        }
+        std::sort(prev_sorted.begin(), prev_sorted.end());
+
+        for (auto & c : cur) {
+            const auto range = std::equal_range(prev_sorted.begin(), prev_sorted.end(), c.id);
+            const int count = (int) (range.second - range.first);
+            if (count == 0) {
+                continue;
+            }
+            c.logit = c.logit <= 0 ? c.logit * params.penalty_repeat : c.logit / params.penalty_repeat;
+            c.logit -= float(count) * params.penalty_freq + params.penalty_present;
+        }
+        std::stable_sort(cur.begin(), cur.end(), by_logit);
+    }
+
+    // the rest of the chain, top-k on, over the penalized candidates in cur
+    llama_token sample_window(size_t k) {
+        cur.resize(std::min(k, cur.size()));
+
+        if (params.temp <= 0.0f) {
+            cur[0].p = 1.0f;
+            cur_p = { cur.data(), 1, 0, true };
+            return cur[0].id;
+        }
+
+        const auto softmax = [this](float temp) {
+            const float max_logit = cur.front().logit;
+            float sum = 0.0f;
+            for (auto & c : cur) {
+                c.p = expf((c.logit - max_logit) / temp);
+                sum += c.p;
+            }
+            for (auto & c : cur) {
+                c.p /= sum;
+            }
+        };
+
+        const size_t min_keep = std::max<size_t>(1, params.min_keep);
+        softmax(1.0f);
+        if (params.top_p < 1.0f) {
+            float cum = 0.0f;
+            for (size_t i = 0; i < cur.size(); i++) {
+                cum += cur[i].p;
+                if (cum >= params.top_p && i + 1 >= min_keep) {
+                    cur.resize(i + 1);
+                    break;
+                }
+            }
+        }
+        if (params.min_p > 0.0f) {
+            const float threshold = cur.front().p * params.min_p;
+            size_t n_keep = cur.size();
+            while (n_keep > min_keep && cur[n_keep - 1].p < threshold) {
+                n_keep--;
+            }
+            cur.resize(n_keep);
+        }
+
+        softmax(params.temp);
+        const float r = std::uniform_real_distribution<float>(0.0f, 1.0f)(rng);
+        size_t selected = cur.size() - 1;
+        float cum = 0.0f;
+        for (size_t i = 0; i < cur.size(); i++) {
+            cum += cur[i].p;
+            if (r < cum) {
+                selected = i;
+                break;
+            }
+        }
+
+        cur_p = { cur.data(), cur.size(), (int64_t) selected, true };
+        return cur[selected].id;
+    }
 };
 
 std::string common_params_sampling::print() const {
@@ -146,6 +384,47 @@ std::string common_params_sampling::print() const {
     return std::string(result);
 }
 
+void common_grammar_triggers_to_patterns(const std::vector<common_grammar_trigger> & triggers,
+                                         std::vector<std::string> & trigger_patterns,
+                                         std::vector<llama_token> & trigger_tokens) {
+    std::vector<std::string> patterns_at_start;
+    std::vector<std::string> patterns_anywhere;
+    trigger_patterns.clear();
+    trigger_tokens.clear();
+    for (const auto & trigger : triggers) {
+        switch (trigger.type) {
+            case COMMON_GRAMMAR_TRIGGER_TYPE_WORD:
+            {
+                const auto & word = trigger.value;
+                patterns_anywhere.push_back(regex_escape(word));
+                break;
+            }
+            case COMMON_GRAMMAR_TRIGGER_TYPE_PATTERN:
+            case COMMON_GRAMMAR_TRIGGER_TYPE_PATTERN_START:
+            {
+                const auto & pattern = trigger.value;
+                (trigger.type == COMMON_GRAMMAR_TRIGGER_TYPE_PATTERN_START ? patterns_at_start : patterns_anywhere).push_back(pattern);
+                break;
+            }
+            case COMMON_GRAMMAR_TRIGGER_TYPE_TOKEN:
+            {
+                const auto token = trigger.token;
+                trigger_tokens.push_back(token);
+                break;
+            }
+            default:
+                LM_GGML_ASSERT(false && "unknown trigger type");
+        }
+    }
+
+    if (!patterns_at_start.empty()) {
+        trigger_patterns.push_back("^(" + string_join(patterns_at_start, "|") + ")[\\s\\S]*");
+    }
+    if (!patterns_anywhere.empty()) {
+        trigger_patterns.push_back("^[\\s\\S]*?(" + string_join(patterns_anywhere, "|") + ")[\\s\\S]*");
+    }
+}
+
 struct common_sampler * common_sampler_init(const struct llama_model * model, const struct common_params_sampling & params) {
     const llama_vocab * vocab = llama_model_get_vocab(model);
 
@@ -161,42 +440,9 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
         LM_GGML_ABORT("llguidance (cmake -DLLAMA_LLGUIDANCE=ON) is not enabled");
 #endif // LLAMA_USE_LLGUIDANCE
     } else {
-        std::vector<std::string> patterns_at_start;
-        std::vector<std::string> patterns_anywhere;
-        std::vector<llama_token> trigger_tokens;
-        for (const auto & trigger : params.grammar_triggers) {
-            switch (trigger.type) {
-                case COMMON_GRAMMAR_TRIGGER_TYPE_WORD:
-                {
-                    const auto & word = trigger.value;
-                    patterns_anywhere.push_back(regex_escape(word));
-                    break;
-                }
-                case COMMON_GRAMMAR_TRIGGER_TYPE_PATTERN:
-                case COMMON_GRAMMAR_TRIGGER_TYPE_PATTERN_START:
-                {
-                    const auto & pattern = trigger.value;
-                    (trigger.type == COMMON_GRAMMAR_TRIGGER_TYPE_PATTERN_START ? patterns_at_start : patterns_anywhere).push_back(pattern);
-                    break;
-                }
-                case COMMON_GRAMMAR_TRIGGER_TYPE_TOKEN:
-                {
-                    const auto token = trigger.token;
-                    trigger_tokens.push_back(token);
-                    break;
-                }
-                default:
-                    LM_GGML_ASSERT(false && "unknown trigger type");
-            }
-        }
-
         std::vector<std::string> trigger_patterns;
-        if (!patterns_at_start.empty()) {
-            trigger_patterns.push_back("^(" + string_join(patterns_at_start, "|") + ")[\\s\\S]*");
-        }
-        if (!patterns_anywhere.empty()) {
-            trigger_patterns.push_back("^[\\s\\S]*?(" + string_join(patterns_anywhere, "|") + ")[\\s\\S]*");
-        }
+        std::vector<llama_token> trigger_tokens;
+        common_grammar_triggers_to_patterns(params.grammar_triggers, trigger_patterns, trigger_tokens);
 
         std::vector<const char *> trigger_patterns_c;
         trigger_patterns_c.reserve(trigger_patterns.size());
@@ -285,6 +531,9 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
         LM_GGML_ASSERT(false && "unknown mirostat version");
     }
 
+    result->fused = common_sampler_fuse_window(params, result->prev.capacity) > 0;
+    result->rng.seed(llama_sampler_get_seed(result->chain));
+
     return result;
 }
 
@@ -306,16 +555,19 @@ void common_sampler_accept(struct common_sampler * gsmpl, llama_token token, boo
     llama_sampler_accept(gsmpl->chain, token);
 
     gsmpl->prev.push_back(token);
+    gsmpl->n_accepted++;
 }
 
 void common_sampler_reset(struct common_sampler * gsmpl) {
     llama_sampler_reset(gsmpl->grmr);
 
     llama_sampler_reset(gsmpl->chain);
+
+    gsmpl->n_accepted = 0;
 }
 
 struct common_sampler * common_sampler_clone(common_sampler * gsmpl) {
-    return new common_sampler {
+    auto * result = new common_sampler {
         /* .params = */ gsmpl->params,
         /* .grmr   = */ llama_sampler_clone(gsmpl->grmr),
         /* .chain  = */ llama_sampler_clone(gsmpl->chain),
@@ -323,6 +575,79 @@ struct common_sampler * common_sampler_clone(common_sampler * gsmpl) {
         /* .cur    = */ gsmpl->cur,
         /* .cur_p  = */ gsmpl->cur_p,
     };
+
+    result->fused      = gsmpl->fused;
+    result->rng        = gsmpl->rng;
+    result->n_accepted = gsmpl->n_accepted;
+
+    // cur_p points into the source's candidates
+    result->cur_p.data = result->cur.data();
+
+    return result;
+}
+
+bool common_sampler_reconfigure(struct common_sampler * gsmpl, const struct llama_model * model, const struct common_params_sampling & params) {
+    struct common_sampler * fresh = common_sampler_init(model, params);
+    if (!fresh) {
+        return false;
+    }
+
+    // the new chain only has to see as much history as its penalty and DRY samplers look back
+    const size_t n_hist = std::min(gsmpl->prev.size(), gsmpl->n_accepted);
+    size_t n_replay = 0;
+    if (params.mirostat == 0) {
+        for (const auto type : params.samplers) {
+            int32_t last_n = 0;
+            if (type == COMMON_SAMPLER_TYPE_PENALTIES) {
+                last_n = params.penalty_last_n;
+            } else if (type == COMMON_SAMPLER_TYPE_DRY && params.dry_multiplier != 0.0f) {
+                last_n = params.dry_penalty_last_n;
+            }
+            n_replay = std::max(n_replay, last_n < 0 ? n_hist : std::min<size_t>(last_n, n_hist));
+        }
+    }
+    for (size_t i = n_hist; i-- > 0;) {
+        const llama_token token = gsmpl->prev.rat(i);
+        fresh->prev.push_back(token);
+        if (i < n_replay) {
+            llama_sampler_accept(fresh->chain, token);
+        }
+    }
+    fresh->n_accepted = gsmpl->n_accepted;
+
+    std::swap(gsmpl->params, fresh->params);
+    std::swap(gsmpl->grmr,   fresh->grmr);
+    std::swap(gsmpl->chain,  fresh->chain);
+    std::swap(gsmpl->prev,   fresh->prev);
+    std::swap(gsmpl->fused,  fresh->fused);
+    std::swap(gsmpl->rng,    fresh->rng);
+
+    common_sampler_free(fresh);
+
+    return true;
+}
+
+void common_sampler_accept_prompt(struct common_sampler * gsmpl, const std::vector<llama_token> & tokens) {
+    // the history has to be complete and match the first tokens, null tokens (media) are never accepted
+    size_t i = 0;
+    bool seen = gsmpl->n_accepted <= gsmpl->prev.size();
+    for (size_t n = 0; seen && n < gsmpl->n_accepted; i++) {
+        if (i == tokens.size()) {
+            seen = false;
+        } else if (tokens[i] != LLAMA_TOKEN_NULL) {
+            seen = tokens[i] == gsmpl->prev.rat(gsmpl->n_accepted - 1 - n++);
+        }
+    }
+    if (!seen) {
+        common_sampler_reset(gsmpl);
+        i = 0;
+    }
+
+    for (; i < tokens.size(); i++) {
+        if (tokens[i] != LLAMA_TOKEN_NULL) {
+            common_sampler_accept(gsmpl, tokens[i], false);
+        }
+    }
 }
 
 void common_perf_print(const struct llama_context * ctx, const struct common_sampler * gsmpl) {
@@ -337,24 +662,33 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 }
 
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
-
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
-    auto & cur_p = gsmpl->cur_p; // initialized by set_logits
+    auto & cur_p = gsmpl->cur_p; // initialized by set_logits or sample_fused
 
-    if (grammar_first) {
-        llama_sampler_apply(grmr, &cur_p);
+    llama_token id = LLAMA_TOKEN_NULL;
+    if (gsmpl->fused) {
+        id = gsmpl->sample_fused(ctx, idx, grammar_first ? grmr : nullptr);
+        if (grammar_first && id != LLAMA_TOKEN_NULL) {
+            return id;
+        }
     }
+    if (id == LLAMA_TOKEN_NULL) {
+        gsmpl->set_logits(ctx, idx);
 
-    llama_sampler_apply(chain, &cur_p);
+        if (grammar_first) {
+            llama_sampler_apply(grmr, &cur_p);
+        }
+
+        llama_sampler_apply(chain, &cur_p);
 
-    LM_GGML_ASSERT(cur_p.selected != -1 && "no selected token during sampling - check your sampling configuration");
+        LM_GGML_ASSERT(cur_p.selected != -1 && "no selected token during sampling - check your sampling configuration");
 
-    const llama_token id = cur_p.data[cur_p.selected].id;
+        id = cur_p.data[cur_p.selected].id;
 
-    if (grammar_first) {
-        return id;
+        if (grammar_first) {
+            return id;
+        }
     }
 
     // check if it the sampled token fits the grammar
@@ -372,6 +706,13 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
+    if (gsmpl->fused) {
+        id = gsmpl->sample_fused(ctx, idx, grmr);
+        if (id != LLAMA_TOKEN_NULL) {
+            return id;
+        }
+    }
+
     gsmpl->set_logits(ctx, idx);
 
     llama_sampler_apply(grmr,  &cur_p);
@@ -382,6 +723,74 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
     return cur_p.data[cur_p.selected].id;
 }
 
+struct common_sampler_batch_job {
+    const std::vector<struct common_sampler *> * gsmpls;
+    struct llama_context * ctx;
+    const std::vector<int> * idxs;
+    std::vector<llama_token> * result;
+    std::atomic<size_t> next;
+};
+
+static void common_sampler_batch_task(struct lm_ggml_tensor * dst, int ith, int nth, void * userdata) {
+    LM_GGML_UNUSED(dst);
+    LM_GGML_UNUSED(ith);
+    LM_GGML_UNUSED(nth);
+    auto * job = static_cast<common_sampler_batch_job *>(userdata);
+    const size_t n = job->idxs->size();
+    for (size_t i = job->next++; i < n; i = job->next++) {
+        (*job->result)[i] = common_sampler_sample((*job->gsmpls)[i], job->ctx, (*job->idxs)[i]);
+    }
+}
+
+std::vector<llama_token> common_sampler_sample_batch(const std::vector<struct common_sampler *> & gsmpls, struct llama_context * ctx, const std::vector<int> & idxs, int n_threads, struct lm_ggml_threadpool * threadpool) {
+    LM_GGML_ASSERT(gsmpls.size() == idxs.size());
+
+    // below this many logits in total a row samples faster than the pool wakes up
+    static constexpr size_t min_parallel_logits = 256*1024;
+
+    const size_t n = idxs.size();
+
+    std::vector<llama_token> result(n, LLAMA_TOKEN_NULL);
+
+    // rows sharing a sampler have to be sampled in order
+    std::vector<struct common_sampler *> distinct(gsmpls);
+    std::sort(distinct.begin(), distinct.end());
+    n_threads = std::min<int>(n_threads, n);
+    const size_t n_logits = n * (size_t) llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+    if (n_threads <= 1 || threadpool == nullptr || n_logits < min_parallel_logits ||
+            std::adjacent_find(distinct.begin(), distinct.end()) != distinct.end()) {
+        for (size_t i = 0; i < n; i++) {
+            result[i] = common_sampler_sample(gsmpls[i], ctx, idxs[i]);
+        }
+        return result;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        gsmpls[i]->logits_row = llama_get_logits_ith(ctx, idxs[i]);
+    }
+
+    // the rows run as one custom op, a graph of a single node computed on the threadpool's workers
+    common_sampler_batch_job job = { &gsmpls, ctx, &idxs, &result, { 0 } };
+    struct lm_ggml_init_params ip = {
+        /*.mem_size   =*/ lm_ggml_tensor_overhead() + lm_ggml_graph_overhead_custom(1, false),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+    struct lm_ggml_context * gctx = lm_ggml_init(ip);
+    struct lm_ggml_tensor * node = lm_ggml_custom_4d(gctx, LM_GGML_TYPE_F32, 1, 1, 1, 1, nullptr, 0, common_sampler_batch_task, n_threads, &job);
+    struct lm_ggml_cgraph * gf = lm_ggml_new_graph_custom(gctx, 1, false);
+    lm_ggml_build_forward_expand(gf, node);
+    struct lm_ggml_cplan cplan = lm_ggml_graph_plan(gf, n_threads, threadpool);
+    lm_ggml_graph_compute(gf, &cplan);
+    lm_ggml_free(gctx);
+
+    for (auto * gsmpl : gsmpls) {
+        gsmpl->logits_row = nullptr;
+    }
+
+    return result;
+}
+
 std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sampler * gsmpl, struct llama_context * ctx, const std::vector<int> & idxs, const llama_tokens & draft, bool grammar_first) {
     LM_GGML_ASSERT(idxs.size() == draft.size() + 1 && "idxs.size() must be draft.size() + 1");
 
@@ -431,10 +840,110 @@ llama_token_data_array * common_sampler_get_candidates(struct common_sampler * g
     return &gsmpl->cur_p;
 }
 
+void common_logits_stats(const float * logits, int n_vocab, llama_token token, int n_top, common_token_stats & out) {
+    const auto by_logit = [](const llama_token_data & a, const llama_token_data & b) { return a.logit > b.logit; };
+
+    auto & top = out.top;
+    top.clear();
+    n_top = std::min(std::max(n_top, 0), n_vocab);
+
+    // pass 1: the max and a min-heap of the n_top best logits; blocks that cannot enter it are skipped whole
+    float max_logit = -INFINITY;
+    const auto offer = [&](llama_token id) {
+        if ((int) top.size() < n_top) {
+            top.push_back({ id, logits[id], 0.0f });
+            std::push_heap(top.begin(), top.end(), by_logit);
+        } else if (logits[id] > top.front().logit) {
+            std::pop_heap(top.begin(), top.end(), by_logit);
+            top.back() = { id, logits[id], 0.0f };
+            std::push_heap(top.begin(), top.end(), by_logit);
+        }
+    };
+
+    llama_token id = 0;
+    for (; id + 16 <= n_vocab; id += 16) {
+        const float m = common_block_max16(logits + id);
+        max_logit = std::max(max_logit, m);
+        if (n_top == 0 || ((int) top.size() == n_top && m <= top.front().logit)) {
+            continue;
+        }
+        for (llama_token j = id; j < id + 16; j++) {
+            offer(j);
+        }
+    }
+    for (; id < n_vocab; id++) {
+        max_logit = std::max(max_logit, logits[id]);
+        if (n_top > 0) {
+            offer(id);
+        }
+    }
+    std::sort_heap(top.begin(), top.end(), by_logit);
+
+    // pass 2: s = sum e^(x - m) and t = sum e^(x - m) (x - m), so that logZ = m + log s and H = log s - t / s
+    // chunks are summed in float and the chunk sums in double
+    constexpr int n_chunk = 1024;
+    double s = 0.0;
+    double t = 0.0;
+    for (int i0 = 0; i0 < n_vocab; i0 += n_chunk) {
+        const int n = std::min(n_chunk, n_vocab - i0);
+#if defined(__APPLE__)
+        float d[n_chunk];
+        float e[n_chunk];
+        const float neg_max = -max_logit;
+        float cs = 0.0f;
+        float ct = 0.0f;
+        vDSP_vsadd(logits + i0, 1, &neg_max, d, 1, (vDSP_Length) n);
+        vvexpf(e, d, &n);
+        vDSP_sve(e, 1, &cs, (vDSP_Length) n);
+        vDSP_dotpr(e, 1, d, 1, &ct, (vDSP_Length) n);
+#else
+        float cs = 0.0f;
+        float ct = 0.0f;
+        for (int i = i0; i < i0 + n; i++) {
+            const float d = logits[i] - max_logit;
+            const float e = expf(d);
+            cs += e;
+            ct += e * d;
+        }
+#endif
+        s += cs;
+        t += ct;
+    }
+
+    const float log_s = (float) std::log(s);
+    out.logsumexp = max_logit + log_s;
+    out.entropy   = log_s - (float) (t / s);
+    out.logprob   = token >= 0 && token < n_vocab ? logits[token] - out.logsumexp : -INFINITY;
+    for (auto & c : top) {
+        c.p = c.logit - out.logsumexp;
+    }
+}
+
 llama_token common_sampler_last(const struct common_sampler * gsmpl) {
     return gsmpl->prev.rat(0);
 }
 
+int32_t common_sampler_fused_window(const struct common_sampler * gsmpl) {
+    return gsmpl->fused && gsmpl->params.grammar.empty() ? common_sampler_fuse_window(gsmpl->params, gsmpl->prev.capacity) : 0;
+}
+
+llama_token common_sampler_sample_window(struct common_sampler * gsmpl, const llama_token * ids, const float * logits, size_t n) {
+    const int32_t window = common_sampler_fused_window(gsmpl);
+    if (window == 0 || n == 0) {
+        return LLAMA_TOKEN_NULL;
+    }
+
+    gsmpl->cur.clear();
+    for (size_t i = 0; i < n; i++) {
+        gsmpl->cur.push_back({ ids[i], logits[i], 0.0f });
+    }
+    if (common_sampler_penalties_on(gsmpl->params)) {
+        gsmpl->penalize_window();
+    }
+
+    return gsmpl->sample_window(gsmpl->params.temp <= 0.0f ? 1 : gsmpl->params.top_k);
+}
+
 std::string common_sampler_print(const struct common_sampler * gsmpl) {
     std::string result = "logits ";
 
@@ -36,6 +36,11 @@ struct common_sampler;
 
 // llama_sampler API overloads
 
+// split grammar triggers into the regex patterns and tokens a lazy grammar is initialized with
+void common_grammar_triggers_to_patterns(const std::vector<common_grammar_trigger> & triggers,
+                                         std::vector<std::string> & trigger_patterns,
+                                         std::vector<llama_token> & trigger_tokens);
+
 struct common_sampler * common_sampler_init(const struct llama_model * model, const struct common_params_sampling & params);
 
 void common_sampler_free(struct common_sampler * gsmpl);
@@ -45,6 +50,15 @@ void                    common_sampler_accept(struct common_sampler * gsmpl, lla
 void                    common_sampler_reset (struct common_sampler * gsmpl);
 struct common_sampler * common_sampler_clone (struct common_sampler * gsmpl);
 
+// rebuild the sampler for new params, keeping its accepted-token history
+// only the tail the new penalty/DRY samplers look back over is replayed into the chain
+// returns false (and leaves the sampler unchanged) if the new sampler cannot be created
+bool common_sampler_reconfigure(struct common_sampler * gsmpl, const struct llama_model * model, const struct common_params_sampling & params);
+
+// accept prompt tokens into the chain (not the grammar), skipping the leading tokens the sampler has
+// already accepted since its last reset; resets it first if its history is not a prefix of tokens
+void common_sampler_accept_prompt(struct common_sampler * gsmpl, const std::vector<llama_token> & tokens);
+
 // arguments can be nullptr to skip printing
 void common_perf_print(const struct llama_context * ctx, const struct common_sampler * gsmpl);
 
@@ -81,6 +95,12 @@ std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sample
 // assume idxs == [ 0, 1, 2, ..., draft.size() ]
 std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sampler * gsmpl, struct llama_context * ctx, const llama_tokens & draft, bool grammar_first = false);
 
+// sample one token per row: common_sampler_sample(gsmpls[i], ctx, idxs[i]) for every i, with the rows
+// spread over up to n_threads threads of threadpool (all rows run serially if two of them share a
+// sampler, without a threadpool, or when the rows are too few to be worth waking it)
+// the caller accepts the tokens
+std::vector<llama_token> common_sampler_sample_batch(const std::vector<struct common_sampler *> & gsmpls, struct llama_context * ctx, const std::vector<int> & idxs, int n_threads, struct lm_ggml_threadpool * threadpool);
+
 uint32_t common_sampler_get_seed(const struct common_sampler * gsmpl);
 
 // helpers
@@ -88,9 +108,31 @@ uint32_t common_sampler_get_seed(const struct common_sampler * gsmpl);
 // access the internal list of current candidate tokens
 llama_token_data_array * common_sampler_get_candidates(struct common_sampler * gsmpl);
 
+// statistics of the raw distribution softmax(logits), before any sampler touched it
+struct common_token_stats {
+    float logsumexp = 0.0f; // log of the partition function, logZ
+    float logprob   = 0.0f; // log-probability of the token asked about
+    float entropy   = 0.0f; // in nats
+
+    std::vector<llama_token_data> top; // the n_top most likely tokens, most likely first, .p is the log-probability
+};
+
+// fill out for one logits row in two reads of it and without a candidate array or a full softmax
+// the row is expected to be finite, as the model writes it
+void common_logits_stats(const float * logits, int n_vocab, llama_token token, int n_top, common_token_stats & out);
+
 // get the last accepted token
 llama_token common_sampler_last(const struct common_sampler * gsmpl);
 
+// candidates the fused chain reads from a logits row: top-k plus the penalty window, or 0 when the
+// chain, or a grammar, rules the fused path out
+int32_t common_sampler_fused_window(const struct common_sampler * gsmpl);
+
+// sample the fused chain from the n best raw logits of a row, sorted best first (e.g. selected on
+// the backend), where n is common_sampler_fused_window clamped to the vocab; the candidates that
+// survive are left in common_sampler_get_candidates. LLAMA_TOKEN_NULL if the chain is not fused.
+llama_token common_sampler_sample_window(struct common_sampler * gsmpl, const llama_token * ids, const float * logits, size_t n);
+
 // print the sampler chain into a string
 std::string common_sampler_print(const struct common_sampler * gsmpl);
 
@@ -10,6 +10,7 @@
 #include "ggml-alloc.h"
 #include "ggml-backend.h"
 #include "gguf.h"
+#include "llama-mmap.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -370,6 +371,12 @@ struct clip_ctx {
 
     lm_ggml_backend_t backend;
     lm_ggml_backend_t backend_cpu;
+
+    // weights stored in the backend's type are used in place from the mapped file,
+    // the mapping outlives the buffers that point into it
+    std::unique_ptr<llama_file> file;
+    std::unique_ptr<llama_mmap> mapping;
+    lm_ggml_backend_buffer_ptr buf_mmap;
     lm_ggml_backend_buffer_ptr buf;
 
     int max_nodes = 8192;
@@ -379,12 +386,35 @@ struct clip_ctx {
     bool debug_graph = false;
     std::vector<lm_ggml_tensor *> debug_print_tensors;
 
+    // graph of the last encode, kept allocated so consecutive images or slices of the same shape
+    // skip rebuilding it and re-running the scheduler's split and allocation passes
+    lm_ggml_cgraph * cached_gf = nullptr;
+    int cached_nx = 0;
+    int cached_ny = 0;
+    bool cached_is_audio = false;
+
+    // speed/accuracy overrides, see clip_context_params
+    lm_ggml_type weight_type = LM_GGML_TYPE_COUNT;
+    int image_max_side = 0;
+    int max_slices = 0;
+
     clip_ctx(clip_context_params & ctx_params) {
         debug_graph = std::getenv("MTMD_DEBUG_GRAPH") != nullptr;
+        weight_type    = ctx_params.weight_type;
+        image_max_side = ctx_params.image_max_side;
+        max_slices     = ctx_params.max_slices;
         backend_cpu = lm_ggml_backend_init_by_type(LM_GGML_BACKEND_DEVICE_TYPE_CPU, nullptr);
         if (!backend_cpu) {
             throw std::runtime_error("failed to initialize CPU backend");
         }
+        if (ctx_params.threadpool) {
+            lm_ggml_backend_dev_t dev = lm_ggml_backend_get_device(backend_cpu);
+            lm_ggml_backend_reg_t reg = dev ? lm_ggml_backend_dev_backend_reg(dev) : nullptr;
+            auto set_threadpool_fn = reg ? (decltype(lm_ggml_backend_cpu_set_threadpool) *) lm_ggml_backend_reg_get_proc_address(reg, "lm_ggml_backend_cpu_set_threadpool") : nullptr;
+            if (set_threadpool_fn) {
+                set_threadpool_fn(backend_cpu, ctx_params.threadpool);
+            }
+        }
         backend = ctx_params.use_gpu
                     ? lm_ggml_backend_init_by_type(LM_GGML_BACKEND_DEVICE_TYPE_GPU, nullptr)
                     : nullptr;
@@ -2251,15 +2281,21 @@ struct clip_model_loader {
         }
 
         // helper function
-        auto get_tensor = [&](const std::string & name, bool required = true) {
+        auto get_tensor = [&](const std::string & name, bool required = true, bool requantize = false) {
             lm_ggml_tensor * cur = lm_ggml_get_tensor(ctx_meta.get(), name.c_str());
             if (!cur && required) {
                 throw std::runtime_error(string_format("%s: unable to find tensor %s\n", __func__, name.c_str()));
             }
             if (cur) {
                 tensors_to_load.push_back(cur);
-                // add tensors to context
-                lm_ggml_tensor * data_tensor = lm_ggml_dup_tensor(ctx_clip.ctx_data.get(), cur);
+                // add tensors to context; matmul weights may be stored in a smaller type than the file's,
+                // in which case the load below converts them
+                lm_ggml_tensor * data_tensor;
+                if (requantize && can_requantize(cur, ctx_clip.weight_type)) {
+                    data_tensor = lm_ggml_new_tensor(ctx_clip.ctx_data.get(), ctx_clip.weight_type, lm_ggml_n_dims(cur), cur->ne);
+                } else {
+                    data_tensor = lm_ggml_dup_tensor(ctx_clip.ctx_data.get(), cur);
+                }
                 lm_ggml_set_name(data_tensor, cur->name);
                 cur = data_tensor;
             }
@@ -2286,10 +2322,10 @@ struct clip_model_loader {
         vision_model.layers.resize(hparams.n_layer);
         for (int il = 0; il < hparams.n_layer; ++il) {
             auto & layer = vision_model.layers[il];
-            layer.k_w    = get_tensor(string_format(TN_ATTN_K,      prefix, il, "weight"));
-            layer.q_w    = get_tensor(string_format(TN_ATTN_Q,      prefix, il, "weight"));
-            layer.v_w    = get_tensor(string_format(TN_ATTN_V,      prefix, il, "weight"));
-            layer.o_w    = get_tensor(string_format(TN_ATTN_OUTPUT, prefix, il, "weight"));
+            layer.k_w    = get_tensor(string_format(TN_ATTN_K,      prefix, il, "weight"), true, true);
+            layer.q_w    = get_tensor(string_format(TN_ATTN_Q,      prefix, il, "weight"), true, true);
+            layer.v_w    = get_tensor(string_format(TN_ATTN_V,      prefix, il, "weight"), true, true);
+            layer.o_w    = get_tensor(string_format(TN_ATTN_OUTPUT, prefix, il, "weight"), true, true);
             layer.k_norm = get_tensor(string_format(TN_ATTN_K_NORM, prefix, il, "weight"), false);
             layer.q_norm = get_tensor(string_format(TN_ATTN_Q_NORM, prefix, il, "weight"), false);
             layer.ln_1_w = get_tensor(string_format(TN_LN_1,        prefix, il, "weight"), false);
@@ -2305,11 +2341,11 @@ struct clip_model_loader {
             layer.ln_2_b = get_tensor(string_format(TN_LN_2,        prefix, il, "bias"), false);
 
             // ffn
-            layer.ff_up_w   = get_tensor(string_format(TN_FFN_UP,   prefix, il, "weight"));
+            layer.ff_up_w   = get_tensor(string_format(TN_FFN_UP,   prefix, il, "weight"), true, true);
             layer.ff_up_b   = get_tensor(string_format(TN_FFN_UP,   prefix, il, "bias"),   false);
-            layer.ff_gate_w = get_tensor(string_format(TN_FFN_GATE, prefix, il, "weight"), false);
+            layer.ff_gate_w = get_tensor(string_format(TN_FFN_GATE, prefix, il, "weight"), false, true);
             layer.ff_gate_b = get_tensor(string_format(TN_FFN_GATE, prefix, il, "bias"),   false);
-            layer.ff_down_w = get_tensor(string_format(TN_FFN_DOWN, prefix, il, "weight"));
+            layer.ff_down_w = get_tensor(string_format(TN_FFN_DOWN, prefix, il, "weight"), true, true);
             layer.ff_down_b = get_tensor(string_format(TN_FFN_DOWN, prefix, il, "bias"),   false);
 
             // some models already exported with legacy (incorrect) naming which is quite messy, let's fix it here
@@ -2486,39 +2522,163 @@ struct clip_model_loader {
         {
             std::vector<uint8_t> read_buf;
 
-            auto fin = std::ifstream(fname, std::ios::binary);
-            if (!fin) {
-                throw std::runtime_error(string_format("%s: failed to open %s\n", __func__, fname.c_str()));
+            lm_ggml_backend_buffer_type_t buft = lm_ggml_backend_get_default_buffer_type(ctx_clip.backend);
+            size_t first = 0;
+            size_t last  = 0;
+            if (map_tensors(buft, tensors_to_load, tensor_offset, first, last)) {
+                LOG_INF("%s: mapped %.2f MiB of %s in place\n", __func__, (last - first) / 1024.0 / 1024.0, fname.c_str());
             }
 
-            // alloc memory and offload data
-            lm_ggml_backend_buffer_type_t buft = lm_ggml_backend_get_default_buffer_type(ctx_clip.backend);
+            // alloc memory for whatever is not mapped
             ctx_clip.buf.reset(lm_ggml_backend_alloc_ctx_tensors_from_buft(ctx_clip.ctx_data.get(), buft));
-            lm_ggml_backend_buffer_set_usage(ctx_clip.buf.get(), LM_GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+            if (ctx_clip.buf) {
+                lm_ggml_backend_buffer_set_usage(ctx_clip.buf.get(), LM_GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+            }
+
+            std::ifstream fin;
+            if (!ctx_clip.mapping) {
+                fin.open(fname, std::ios::binary);
+                if (!fin) {
+                    throw std::runtime_error(string_format("%s: failed to open %s\n", __func__, fname.c_str()));
+                }
+            }
+
             for (auto & t : tensors_to_load) {
                 lm_ggml_tensor * cur = lm_ggml_get_tensor(ctx_clip.ctx_data.get(), t->name);
+                if (ctx_clip.buf_mmap && cur->buffer == ctx_clip.buf_mmap.get()) {
+                    continue;
+                }
                 const size_t offset = tensor_offset[t->name];
-                fin.seekg(offset, std::ios::beg);
-                if (!fin) {
-                    throw std::runtime_error(string_format("%s: failed to seek for tensor %s\n", __func__, t->name));
+                const uint8_t * src = nullptr;
+                if (ctx_clip.mapping) {
+                    src = (const uint8_t *) ctx_clip.mapping->addr() + offset;
+                } else {
+                    fin.seekg(offset, std::ios::beg);
+                    read_buf.resize(lm_ggml_nbytes(t));
+                    fin.read(reinterpret_cast<char *>(read_buf.data()), read_buf.size());
+                    if (!fin) {
+                        throw std::runtime_error(string_format("%s: failed to read tensor %s\n", __func__, t->name));
+                    }
+                    src = read_buf.data();
                 }
-                size_t num_bytes = lm_ggml_nbytes(cur);
-                if (lm_ggml_backend_buft_is_host(buft)) {
-                    // for the CPU and Metal backend, we can read directly into the tensor
-                    fin.read(reinterpret_cast<char *>(cur->data), num_bytes);
+                if (cur->type != t->type) {
+                    requantize_tensor(src, t, cur);
                 } else {
-                    // read into a temporary buffer first, then copy to device memory
-                    read_buf.resize(num_bytes);
-                    fin.read(reinterpret_cast<char *>(read_buf.data()), num_bytes);
-                    lm_ggml_backend_tensor_set(cur, read_buf.data(), 0, num_bytes);
+                    lm_ggml_backend_tensor_set(cur, src, 0, lm_ggml_nbytes(cur));
                 }
             }
-            fin.close();
+
+            if (ctx_clip.mapping) {
+                // the copied and requantized tensors were read once, only the mapped range stays
+                ctx_clip.mapping->unmap_fragment(0, first);
+                ctx_clip.mapping->unmap_fragment(last, ctx_clip.mapping->size());
+            }
 
             LOG_DBG("%s: loaded %zu tensors from %s\n", __func__, tensors_to_load.size(), fname.c_str());
         }
     }
 
+    // Maps the file and points every tensor kept in the file's type into it, as llama_model does
+    // for its weights: the pages are clean and backed by the file, so they can be reclaimed
+    // instead of holding a private copy. Needs a backend that wraps host memory (CPU, Metal on
+    // unified memory); [first, last) is the mapped range when true.
+    bool map_tensors(lm_ggml_backend_buffer_type_t buft, const std::vector<lm_ggml_tensor *> & tensors,
+                     std::map<std::string, size_t> & tensor_offset, size_t & first, size_t & last) {
+        if (!llama_mmap::SUPPORTED) {
+            return false;
+        }
+        lm_ggml_backend_dev_t dev = lm_ggml_backend_buft_get_device(buft);
+        if (!dev) {
+            // the CPU buffer type has no device
+            dev = lm_ggml_backend_dev_by_type(LM_GGML_BACKEND_DEVICE_TYPE_CPU);
+        }
+        if (!dev) {
+            return false;
+        }
+        lm_ggml_backend_dev_props props;
+        lm_ggml_backend_dev_get_props(dev, &props);
+        if (!props.caps.buffer_from_host_ptr || buft != lm_ggml_backend_dev_buffer_type(dev)) {
+            return false;
+        }
+
+        try {
+            ctx_clip.file.reset(new llama_file(fname.c_str(), "rb"));
+            ctx_clip.mapping.reset(new llama_mmap(ctx_clip.file.get()));
+        } catch (const std::exception & e) {
+            LOG_WRN("%s: unable to map %s, reading it instead: %s\n", __func__, fname.c_str(), e.what());
+            ctx_clip.mapping.reset();
+            ctx_clip.file.reset();
+            return false;
+        }
+
+        first = ctx_clip.mapping->size();
+        last  = 0;
+        for (const auto * t : tensors) {
+            const lm_ggml_tensor * cur = lm_ggml_get_tensor(ctx_clip.ctx_data.get(), t->name);
+            if (cur->type != t->type) {
+                continue;
+            }
+            first = std::min(first, tensor_offset[t->name]);
+            last  = std::max(last,  tensor_offset[t->name] + lm_ggml_nbytes(t));
+        }
+        if (first >= last || last > ctx_clip.mapping->size()) {
+            first = last = 0;
+            return false;
+        }
+
+        uint8_t * addr = (uint8_t *) ctx_clip.mapping->addr();
+        const size_t max_size = lm_ggml_get_max_tensor_size(ctx_clip.ctx_data.get());
+        ctx_clip.buf_mmap.reset(lm_ggml_backend_dev_buffer_from_host_ptr(dev, addr + first, last - first, max_size));
+        if (!ctx_clip.buf_mmap) {
+            LOG_WRN("%s: unable to wrap the mapping of %s in a %s buffer, copying it instead\n", __func__,
+                    fname.c_str(), lm_ggml_backend_buft_name(buft));
+            first = last = 0;
+            return false;
+        }
+        lm_ggml_backend_buffer_set_usage(ctx_clip.buf_mmap.get(), LM_GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+
+        for (const auto * t : tensors) {
+            lm_ggml_tensor * cur = lm_ggml_get_tensor(ctx_clip.ctx_data.get(), t->name);
+            if (cur->type == t->type) {
+                lm_ggml_backend_tensor_alloc(ctx_clip.buf_mmap.get(), cur, addr + tensor_offset[t->name]);
+            }
+        }
+        return true;
+    }
+
+    static bool can_requantize(const lm_ggml_tensor * t, lm_ggml_type type) {
+        if (type == LM_GGML_TYPE_COUNT || type == t->type || lm_ggml_n_dims(t) != 2) {
+            return false;
+        }
+        if (t->type != LM_GGML_TYPE_F32 && t->type != LM_GGML_TYPE_F16 && t->type != LM_GGML_TYPE_BF16) {
+            return false;
+        }
+        return t->ne[0] % lm_ggml_blck_size(type) == 0;
+    }
+
+    // quantizes a float tensor's file data row by row into the data tensor
+    static void requantize_tensor(const uint8_t * data, const lm_ggml_tensor * src, lm_ggml_tensor * dst) {
+        const int64_t n_per_row = src->ne[0];
+        const int64_t nrows     = lm_ggml_nrows(src);
+        const int64_t n         = n_per_row * nrows;
+
+        std::vector<float> f32;
+        const float * values = reinterpret_cast<const float *>(data);
+        if (src->type == LM_GGML_TYPE_F16) {
+            f32.resize(n);
+            lm_ggml_fp16_to_fp32_row(reinterpret_cast<const lm_ggml_fp16_t *>(data), f32.data(), n);
+            values = f32.data();
+        } else if (src->type == LM_GGML_TYPE_BF16) {
+            f32.resize(n);
+            lm_ggml_bf16_to_fp32_row(reinterpret_cast<const lm_ggml_bf16_t *>(data), f32.data(), n);
+            values = f32.data();
+        }
+
+        std::vector<uint8_t> quantized(lm_ggml_nbytes(dst));
+        lm_ggml_quantize_chunk(dst->type, values, quantized.data(), 0, nrows, n_per_row, nullptr);
+        lm_ggml_backend_tensor_set(dst, quantized.data(), 0, quantized.size());
+    }
+
     void alloc_compute_meta() {
         const auto & hparams = ctx_clip.vision_model.hparams;
         ctx_clip.buf_compute_meta.resize(ctx_clip.max_nodes * lm_ggml_tensor_overhead() + lm_ggml_graph_overhead());
@@ -2972,7 +3132,7 @@ struct llava_uhd {
 
     static int get_max_slices(struct clip_ctx * ctx) {
         if (clip_is_minicpmv(ctx)) {
-            return 9;
+            return ctx->max_slices > 0 ? std::min(ctx->max_slices, 9) : 9;
         }
         return 0;
     }
@@ -3210,6 +3370,12 @@ private:
     }
 };
 
+// longest side a dynamic-resolution model resizes to, lowered by image_max_side when set
+static int clip_max_image_side(const struct clip_ctx * ctx) {
+    const int image_size = ctx->vision_model.hparams.image_size;
+    return ctx->image_max_side > 0 ? std::min(ctx->image_max_side, image_size) : image_size;
+}
+
 // returns the normalized float tensor for llava-1.5, for spatial_unpad with anyres processing for llava-1.6 it returns the normalized image patch tensors as a vector
 // res_imgs memory is being allocated here, previous allocations will be freed if found
 bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, struct clip_image_f32_batch * res_imgs) {
@@ -3239,7 +3405,7 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, str
     } else if (ctx->proj_type == PROJECTOR_TYPE_QWEN2VL || ctx->proj_type == PROJECTOR_TYPE_QWEN25VL) {
         clip_image_u8 resized;
         auto patch_size = params.patch_size * 2;
-        auto new_size = image_manipulation::calc_size_preserved_ratio(original_size, patch_size, params.image_size);
+        auto new_size = image_manipulation::calc_size_preserved_ratio(original_size, patch_size, clip_max_image_side(ctx));
         image_manipulation::bicubic_resize(*img, resized, new_size.width, new_size.height);
 
         clip_image_f32_ptr img_f32(clip_image_f32_init());
@@ -3265,7 +3431,7 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, str
 
     } else if (ctx->proj_type == PROJECTOR_TYPE_PIXTRAL) {
         clip_image_u8 resized_image;
-        auto new_size = image_manipulation::calc_size_preserved_ratio(original_size, params.patch_size, params.image_size);
+        auto new_size = image_manipulation::calc_size_preserved_ratio(original_size, params.patch_size, clip_max_image_side(ctx));
         image_manipulation::bilinear_resize(*img, resized_image, new_size.width, new_size.height);
         clip_image_f32_ptr img_f32(clip_image_f32_init());
         normalize_image_u8_to_f32(resized_image, *img_f32, ctx->image_mean, ctx->image_std);
@@ -3332,6 +3498,65 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, str
     LM_GGML_ASSERT(false && "Unknown image preprocessing type");
 }
 
+// follows the branches of clip_image_preprocess without resizing or normalizing anything
+bool clip_image_preprocess_size(struct clip_ctx * ctx, int nx, int ny, struct clip_image_f32_batch * res_imgs) {
+    clip_image_size original_size{nx, ny};
+    auto & params = ctx->vision_model.hparams;
+    auto add_entry = [res_imgs](const clip_image_size & size) {
+        clip_image_f32_ptr res(clip_image_f32_init());
+        res->nx = size.width;
+        res->ny = size.height;
+        res_imgs->entries.push_back(std::move(res));
+    };
+    auto add_slices = [&]() {
+        auto const inst = llava_uhd::get_slice_instructions(ctx, original_size);
+        add_entry(inst.overview_size);
+        for (const auto & slice : inst.slices) {
+            add_entry(slice.size);
+        }
+        return inst.grid_size;
+    };
+    if (nx <= 0 || ny <= 0) {
+        return false;
+    }
+
+    if (clip_is_minicpmv(ctx) || (ctx->proj_type == PROJECTOR_TYPE_LLAMA4 && !params.image_grid_pinpoints.empty())) {
+        auto const grid = add_slices();
+        res_imgs->grid_x = grid.width;
+        res_imgs->grid_y = grid.height;
+        return true;
+
+    } else if (ctx->proj_type == PROJECTOR_TYPE_QWEN2VL || ctx->proj_type == PROJECTOR_TYPE_QWEN25VL) {
+        add_entry(image_manipulation::calc_size_preserved_ratio(original_size, params.patch_size * 2, clip_max_image_side(ctx)));
+        return true;
+
+    } else if (ctx->proj_type == PROJECTOR_TYPE_GLM_EDGE
+            || ctx->proj_type == PROJECTOR_TYPE_GEMMA3
+            || ctx->proj_type == PROJECTOR_TYPE_IDEFICS3
+            || ctx->proj_type == PROJECTOR_TYPE_INTERNVL
+    ) {
+        add_entry({params.image_size, params.image_size});
+        return true;
+
+    } else if (ctx->proj_type == PROJECTOR_TYPE_PIXTRAL) {
+        add_entry(image_manipulation::calc_size_preserved_ratio(original_size, params.patch_size, clip_max_image_side(ctx)));
+        return true;
+
+    } else if (ctx->proj_type == PROJECTOR_TYPE_LLAMA4) {
+        return false;
+    }
+
+    if (params.mm_patch_merge_type != PATCH_MERGE_SPATIAL_UNPAD) {
+        add_entry({params.image_size, params.image_size});
+        return true;
+
+    } else if (!params.image_grid_pinpoints.empty()) {
+        add_slices();
+        return true;
+    }
+    return false;
+}
+
 lm_ggml_tensor * clip_get_newline_tensor(const struct clip_ctx * ctx) {
     return ctx->vision_model.image_newline;
 }
@@ -3560,11 +3785,26 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
         return false; // only support batch size of 1
     }
 
-    // build the inference graph
-    ctx->debug_print_tensors.clear();
-    lm_ggml_backend_sched_reset(ctx->sched.get());
-    lm_ggml_cgraph * gf = clip_image_build_graph(ctx, imgs);
-    lm_ggml_backend_sched_alloc_graph(ctx->sched.get(), gf);
+    // build the inference graph, unless the previous one has the same shape
+    lm_ggml_cgraph * gf = ctx->cached_gf;
+    const bool reuse_graph = gf != nullptr && !ctx->debug_graph
+        && ctx->cached_is_audio == imgs.is_audio
+        && ctx->cached_nx == imgs.entries[0]->nx
+        && ctx->cached_ny == imgs.entries[0]->ny;
+    if (!reuse_graph) {
+        ctx->cached_gf = nullptr;
+        ctx->debug_print_tensors.clear();
+        lm_ggml_backend_sched_reset(ctx->sched.get());
+        gf = clip_image_build_graph(ctx, imgs);
+        if (!lm_ggml_backend_sched_alloc_graph(ctx->sched.get(), gf)) {
+            LOG_ERR("%s: failed to allocate the compute graph\n", __func__);
+            return false;
+        }
+        ctx->cached_gf = gf;
+        ctx->cached_nx = imgs.entries[0]->nx;
+        ctx->cached_ny = imgs.entries[0]->ny;
+        ctx->cached_is_audio = imgs.is_audio;
+    }
 
     // set inputs
     const auto & model   = ctx->vision_model;
@@ -3888,6 +4128,7 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
     auto status = lm_ggml_backend_sched_graph_compute(ctx->sched.get(), gf);
     if (status != LM_GGML_STATUS_SUCCESS) {
         LOG_ERR("%s: lm_ggml_backend_sched_graph_compute failed with error %d\n", __func__, status);
+        ctx->cached_gf = nullptr;
         return false;
     }
 
@@ -18,6 +18,10 @@ struct clip_image_f32_batch;
 struct clip_context_params {
     bool use_gpu;
     enum lm_ggml_log_level verbosity;
+    enum lm_ggml_type weight_type; // requantize layer weights to this type, LM_GGML_TYPE_COUNT keeps the file's types
+    int image_max_side;            // cap on the longest side for dynamic-resolution models, 0 = model default
+    int max_slices;                // cap on the number of slices for tiling models, 0 = model default
+    lm_ggml_threadpool_t threadpool; // CPU threadpool shared with other contexts, nullptr = one per graph
 };
 
 struct clip_ctx * clip_init(const char * fname, struct clip_context_params ctx_params);
@@ -81,6 +85,9 @@ bool clip_image_load_from_bytes(const unsigned char * bytes, size_t bytes_length
 /** preprocess img and store the result in res_imgs, pad_to_square may be overridden to false depending on model configuration */
 bool clip_image_preprocess(struct clip_ctx * ctx, const struct clip_image_u8 * img, struct clip_image_f32_batch * res_imgs );
 
+/** the sizes clip_image_preprocess would give an nx x ny image, as entries without pixels; enough for clip_n_output_tokens */
+bool clip_image_preprocess_size(struct clip_ctx * ctx, int nx, int ny, struct clip_image_f32_batch * res_imgs);
+
 struct lm_ggml_tensor * clip_get_newline_tensor(const struct clip_ctx * ctx);
 
 bool clip_image_encode      (struct clip_ctx * ctx, int n_threads, struct clip_image_f32 * img, float * vec);
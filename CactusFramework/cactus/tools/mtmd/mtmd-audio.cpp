@@ -32,6 +32,12 @@
 #include <fstream>
 #include <algorithm>
 
+#if defined(__APPLE__)
+#include <Accelerate/Accelerate.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 // most of the code here is copied from whisper.cpp
 
 // align x to upper multiple of n
@@ -77,6 +83,114 @@ struct whisper_global_cache {
 } global_cache;
 }
 
+// nonzero span [begin, end) of each mel filter row; the triangular filters cover a few FFT bins
+// each, so the filterbank is applied as short dot products instead of a dense n_mel x n_fft pass
+static std::vector<std::pair<int, int>> mel_filter_spans(const whisper_filters & filters) {
+    std::vector<std::pair<int, int>> spans(filters.n_mel, {0, 0});
+    for (int j = 0; j < filters.n_mel; j++) {
+        const float * row = filters.data.data() + (size_t)j * filters.n_fft;
+        int begin = 0;
+        int end = filters.n_fft;
+        while (begin < end && row[begin] == 0.0f) {
+            begin++;
+        }
+        while (end > begin && row[end - 1] == 0.0f) {
+            end--;
+        }
+        spans[j] = {begin, end};
+    }
+    return spans;
+}
+
+static float dot_f32(const float * a, const float * b, int n) {
+#if defined(__APPLE__)
+    float sum = 0.0f;
+    vDSP_dotpr(a, 1, b, 1, &sum, (vDSP_Length)n);
+    return sum;
+#else
+    int k = 0;
+    float sum = 0.0f;
+#if defined(__ARM_NEON)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; k + 4 <= n; k += 4) {
+        acc = vfmaq_f32(acc, vld1q_f32(a + k), vld1q_f32(b + k));
+    }
+    sum = vaddvq_f32(acc);
+#endif
+    for (; k < n; k++) {
+        sum += a[k] * b[k];
+    }
+    return sum;
+#endif
+}
+
+// mel filterbank and log of one power spectrum, written with stride dst_stride
+static void log_mel_from_power(const float * power, const whisper_filters & filters,
+                               const std::vector<std::pair<int, int>> & spans, float * dst, int dst_stride) {
+    for (int j = 0; j < filters.n_mel; j++) {
+        const int begin = spans[j].first;
+        const double sum = dot_f32(power + begin, filters.data.data() + (size_t)j * filters.n_fft + begin, spans[j].second - begin);
+        dst[(size_t)j * dst_stride] = log10(std::max(sum, 1e-10));
+    }
+}
+
+#if defined(__APPLE__)
+
+// WHISPER_N_FFT = 400 is not a length vDSP's DFT supports (2^n times 1, 3, 5 or 15), so the
+// real DFT of a block of frames is one GEMM against a [cos | -sin] basis, which runs on the
+// matrix units and beats a scalar FFT by a wide margin
+struct whisper_dft_basis {
+    static const int n_bins = WHISPER_N_FFT / 2 + 1;
+    std::vector<float> data; // WHISPER_N_FFT x (2 * n_bins), row-major
+
+    whisper_dft_basis() : data((size_t)WHISPER_N_FFT * 2 * n_bins) {
+        for (int n = 0; n < WHISPER_N_FFT; n++) {
+            for (int k = 0; k < n_bins; k++) {
+                const double t = 2.0 * M_PI * (double)((k * n) % WHISPER_N_FFT) / WHISPER_N_FFT;
+                data[(size_t)n * 2 * n_bins + k]          = (float)cos(t);
+                data[(size_t)n * 2 * n_bins + n_bins + k] = (float)-sin(t);
+            }
+        }
+    }
+};
+
+// log-mel values of frames [i0, i1): frame i holds samples [i * frame_step, + frame_size), zero
+// past n_samples; value (frame i, mel j) goes to dst[(i - i0) * frame_stride + j * mel_stride]
+static void log_mel_frames(const float * samples, int n_samples, int i0, int i1, int frame_size, int frame_step,
+                           const whisper_filters & filters, const std::vector<std::pair<int, int>> & spans,
+                           float * dst, int frame_stride, int mel_stride) {
+    static const whisper_dft_basis basis;
+    const int n_bins = whisper_dft_basis::n_bins;
+    WHISPER_ASSERT(frame_size == WHISPER_N_FFT && filters.n_fft == n_bins);
+
+    const int block = 256;
+    std::vector<float> frames((size_t)block * frame_size);
+    std::vector<float> spectrum((size_t)block * 2 * n_bins);
+    std::vector<float> power(n_bins);
+    for (int b0 = i0; b0 < i1; b0 += block) {
+        const int rows = std::min(block, i1 - b0);
+        for (int r = 0; r < rows; r++) {
+            const int offset = (b0 + r) * frame_step;
+            const int n_valid = std::max(0, std::min(frame_size, n_samples - offset));
+            float * frame = frames.data() + (size_t)r * frame_size;
+            if (n_valid > 0) {
+                vDSP_vmul(samples + offset, 1, global_cache.hann_window, 1, frame, 1, (vDSP_Length)n_valid);
+            }
+            std::fill(frame + n_valid, frame + frame_size, 0.0f);
+        }
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, rows, 2 * n_bins, frame_size,
+                    1.0f, frames.data(), frame_size, basis.data.data(), 2 * n_bins, 0.0f, spectrum.data(), 2 * n_bins);
+        for (int r = 0; r < rows; r++) {
+            const float * re = spectrum.data() + (size_t)r * 2 * n_bins;
+            const float * im = re + n_bins;
+            vDSP_vmma(re, 1, re, 1, im, 1, im, 1, power.data(), 1, (vDSP_Length)n_bins);
+            log_mel_from_power(power.data(), filters, spans, dst + (size_t)(b0 - i0 + r) * frame_stride, mel_stride);
+        }
+    }
+}
+
+#else
+
 // naive Discrete Fourier Transform
 // input is real-valued
 // output is complex-valued
@@ -87,10 +201,16 @@ static void dft(const float* in, int N, float* out) {
         float re = 0;
         float im = 0;
 
+        // t = 2*M_PI*k*n/N, stepped through the table without a modulo per term
+        const int idx_step = k * sin_cos_step;
+        int idx = 0;
         for (int n = 0; n < N; n++) {
-            int idx = (k * n * sin_cos_step) % (SIN_COS_N_COUNT); // t = 2*M_PI*k*n/N
             re += in[n]*global_cache.cos_vals[idx]; // cos(t)
             im -= in[n]*global_cache.sin_vals[idx]; // sin(t)
+            idx += idx_step;
+            if (idx >= SIN_COS_N_COUNT) {
+                idx -= SIN_COS_N_COUNT;
+            }
         }
 
         out[k*2 + 0] = re;
@@ -146,68 +266,66 @@ static void fft(float* in, int N, float* out) {
     }
 }
 
-static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const std::vector<float> & samples,
-                                              int n_samples, int frame_size, int frame_step, int n_threads,
-                                              const whisper_filters & filters, whisper_mel & mel) {
-    std::vector<float> fft_in(frame_size * 2, 0.0);
-    std::vector<float> fft_out(frame_size * 2 * 2 * 2);
-
-    int n_fft = filters.n_fft;
-    int i = ith;
-
+// log-mel values of frames [i0, i1): frame i holds samples [i * frame_step, + frame_size), zero
+// past n_samples; value (frame i, mel j) goes to dst[(i - i0) * frame_stride + j * mel_stride]
+static void log_mel_frames(const float * samples, int n_samples, int i0, int i1, int frame_size, int frame_step,
+                           const whisper_filters & filters, const std::vector<std::pair<int, int>> & spans,
+                           float * dst, int frame_stride, int mel_stride) {
+    const float * hann = global_cache.hann_window;
+    const int n_fft = filters.n_fft;
     // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
     WHISPER_ASSERT(n_fft == 1 + (frame_size / 2));
 
-    // calculate FFT only when fft_in are not all zero
-    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
+    std::vector<float> fft_in(frame_size * 2, 0.0);
+    std::vector<float> fft_out(frame_size * 2 * 2 * 2);
+    for (int i = i0; i < i1; i++) {
         const int offset = i * frame_step;
+        const int n_valid = std::max(0, std::min(frame_size, n_samples - offset));
 
         // apply Hann window (~10% faster)
-        for (int j = 0; j < std::min(frame_size, n_samples - offset); j++) {
+        for (int j = 0; j < n_valid; j++) {
             fft_in[j] = hann[j] * samples[offset + j];
         }
-
         // fill the rest with zeros
-        if (n_samples - offset < frame_size) {
-            std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
-        }
+        std::fill(fft_in.begin() + n_valid, fft_in.end(), 0.0);
 
-        // FFT
         fft(fft_in.data(), frame_size, fft_out.data());
 
-        // Calculate modulus^2 of complex numbers
-        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < n_fft; j++) {
+        // modulus^2 of the complex bins, in place over the first n_fft values
+        int j = 0;
+#if defined(__ARM_NEON)
+        for (; j + 4 <= n_fft; j += 4) {
+            const float32x4x2_t c = vld2q_f32(fft_out.data() + 2 * j);
+            vst1q_f32(fft_out.data() + j, vfmaq_f32(vmulq_f32(c.val[0], c.val[0]), c.val[1], c.val[1]));
+        }
+#endif
+        for (; j < n_fft; j++) {
             fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
         }
 
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
-            }
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
-            }
-            sum = log10(std::max(sum, 1e-10));
-            mel.data[j * mel.n_len + i] = sum;
+        log_mel_from_power(fft_out.data(), filters, spans, dst + (size_t)(i - i0) * frame_stride, mel_stride);
+    }
+}
+
+#endif
+
+// clamping and normalization
+static void normalize_log_mel(whisper_mel & mel) {
+    double mmax = -1e20;
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] > mmax) {
+            mmax = mel.data[i];
         }
     }
 
-    // Otherwise fft_out are all zero
-    double sum = log10(1e-10);
-    for (; i < mel.n_len; i += n_threads) {
-        for (int j = 0; j < mel.n_mel; j++) {
-            mel.data[j * mel.n_len + i] = sum;
+    mmax -= 8.0;
+
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] < mmax) {
+            mel.data[i] = mmax;
         }
+
+        mel.data[i] = (mel.data[i] + 4.0)/4.0;
     }
 }
 
@@ -225,67 +343,61 @@ static bool log_mel_spectrogram(
         whisper_mel & mel) {
     //const int64_t t_start_us = lm_ggml_time_us();
 
-    // Hann window
     WHISPER_ASSERT(frame_size == WHISPER_N_FFT && "Unsupported frame_size");
-    const float * hann = global_cache.hann_window;
 
     // Calculate the length of padding
     int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
     int64_t stage_2_pad = frame_size / 2;
 
-    // Initialize a vector and copy data from C array to it.
+    // Only the reflection pad at the start and the samples are materialized; frames past them see
+    // zeros, which is what the 30 seconds of silent padding at the end contribute
     std::vector<float> samples_padded;
-    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
+    samples_padded.resize(n_samples + stage_2_pad);
     std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
 
-    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
-    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
-
     // reflective pad 200 samples at the beginning of audio
     std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
 
     mel.n_mel     = n_mel;
     // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
     // Calculate number of frames + remove the last frame
-    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
+    mel.n_len     = (n_samples + stage_1_pad + stage_2_pad * 2 - frame_size) / frame_step;
     // Calculate semi-padded sample length to ensure compatibility
     mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
-    mel.data.resize(mel.n_mel * mel.n_len);
-
+    // frames past the audio are all zero: log10 of the 1e-10 floor
+    mel.data.assign((size_t)mel.n_mel * mel.n_len, (float)log10(1e-10));
+
+    const int n_padded = (int)samples_padded.size();
+    const int n_frames = std::min(n_padded / frame_step + 1, mel.n_len);
+    const auto spans = mel_filter_spans(filters);
+#if defined(__APPLE__)
+    // the DFT GEMM is already spread over the cores by Accelerate
+    const int n_workers = 1;
+    (void) n_threads;
+#else
+    const int n_workers = std::max(1, std::min(n_threads, n_frames / 64));
+#endif
     {
-        std::vector<std::thread> workers(n_threads - 1);
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, hann, std::cref(samples_padded),
-                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
-                    std::cref(filters), std::ref(mel));
+        auto work = [&](int iw) {
+            const int i0 = (int)((int64_t)n_frames * iw / n_workers);
+            const int i1 = (int)((int64_t)n_frames * (iw + 1) / n_workers);
+            log_mel_frames(samples_padded.data(), n_padded, i0, i1, frame_size, frame_step, filters, spans,
+                           mel.data.data() + i0, 1, mel.n_len);
+        };
+        std::vector<std::thread> workers;
+        for (int iw = 1; iw < n_workers; ++iw) {
+            workers.emplace_back(work, iw);
         }
 
         // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
-
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw].join();
-        }
-    }
+        work(0);
 
-    // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
+        for (auto & worker : workers) {
+            worker.join();
         }
     }
 
-    mmax -= 8.0;
-
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
-        }
-
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
-    }
+    normalize_log_mel(mel);
 
     // Dump log_mel_spectrogram
     if (debug) {
@@ -328,6 +440,11 @@ bool preprocess_audio(
         return false;
     }
 
+    split_mel(out_full, output);
+    return true;
+}
+
+void split_mel(const whisper_mel & out_full, std::vector<whisper_mel> & output) {
     // because the cgraph in clip.cpp only accepts 3000 frames each, we need to split the mel
     // we always expect the mel to have 3000 silent frames at the end
     // printf("n_len %d\n", out_full.n_len);
@@ -352,7 +469,85 @@ bool preprocess_audio(
 
         output.push_back(std::move(out_chunk));
     }
+}
+
+void mel_chunk_shapes(size_t n_samples, int n_mel, std::vector<whisper_mel> & output) {
+    if (n_samples == 0) {
+        return;
+    }
+    // n_len of log_mel_spectrogram, then the complete chunks split_mel keeps
+    const size_t frames_per_chunk = 3000;
+    const size_t n_len = (n_samples + WHISPER_SAMPLE_RATE * 30 + (WHISPER_N_FFT / 2) * 2 - WHISPER_N_FFT) / WHISPER_HOP_LENGTH;
+    for (size_t i = 0; i < n_len / frames_per_chunk; i++) {
+        whisper_mel chunk;
+        chunk.n_len     = frames_per_chunk;
+        chunk.n_mel     = n_mel;
+        chunk.n_len_org = n_mel; // unused
+        output.push_back(std::move(chunk));
+    }
+}
+
+// The first frame is centered on the first sample, so its window reaches WHISPER_N_FFT / 2 samples
+// of reflection padding before it
+static const int MEL_STREAM_PAD = WHISPER_N_FFT / 2;
+
+whisper_mel_stream::whisper_mel_stream(const whisper_filters & filters) : filters(filters), spans(mel_filter_spans(filters)) {
+    padded.resize(MEL_STREAM_PAD);
+}
 
+size_t whisper_mel_stream::n_samples() const {
+    return padded.size() - MEL_STREAM_PAD;
+}
+
+// A frame is computed as soon as its window is covered by real samples; those never change again
+void whisper_mel_stream::push(const float * samples, size_t n) {
+    const size_t n_before = n_samples();
+    padded.insert(padded.end(), samples, samples + n);
+    if (n_samples() <= (size_t)MEL_STREAM_PAD) {
+        return;
+    }
+    if (n_before <= (size_t)MEL_STREAM_PAD) {
+        std::reverse_copy(padded.begin() + MEL_STREAM_PAD + 1, padded.begin() + 2 * MEL_STREAM_PAD + 1, padded.begin());
+    }
+
+    if (padded.size() < (size_t)WHISPER_N_FFT) {
+        return;
+    }
+    const size_t n_complete = (padded.size() - WHISPER_N_FFT) / WHISPER_HOP_LENGTH + 1;
+    if (n_complete > n_frames) {
+        frames.resize(n_complete * filters.n_mel);
+        log_mel_frames(padded.data(), (int)padded.size(), (int)n_frames, (int)n_complete, WHISPER_N_FFT, WHISPER_HOP_LENGTH,
+                       filters, spans, frames.data() + n_frames * filters.n_mel, filters.n_mel, 1);
+        n_frames = n_complete;
+    }
+}
+
+// The spectrogram log_mel_spectrogram produces for the samples pushed so far: the stored frames,
+// the few that still overlap the end of the audio, then the silent padding, normalized together
+bool whisper_mel_stream::get(whisper_mel & mel) const {
+    const int n_real = (int)n_samples();
+    if (n_real <= MEL_STREAM_PAD) {
+        return false;
+    }
+    const int n = n_real + MEL_STREAM_PAD;
+
+    mel.n_mel     = filters.n_mel;
+    mel.n_len     = (n_real + WHISPER_SAMPLE_RATE * 30) / WHISPER_HOP_LENGTH;
+    mel.n_len_org = 1 + (n - WHISPER_N_FFT) / WHISPER_HOP_LENGTH;
+    mel.data.assign((size_t)mel.n_mel * mel.n_len, (float)log10(1e-10));
+
+    for (size_t i = 0; i < n_frames; i++) {
+        for (int j = 0; j < mel.n_mel; j++) {
+            mel.data[j * mel.n_len + i] = frames[i * mel.n_mel + j];
+        }
+    }
+    const int i_end = std::min(n / WHISPER_HOP_LENGTH + 1, mel.n_len);
+    if (i_end > (int)n_frames) {
+        log_mel_frames(padded.data(), n, (int)n_frames, i_end, WHISPER_N_FFT, WHISPER_HOP_LENGTH,
+                       filters, spans, mel.data.data() + n_frames, 1, mel.n_len);
+    }
+
+    normalize_log_mel(mel);
     return true;
 }
 
@@ -419,6 +614,22 @@ bool decode_audio_from_buf(const unsigned char * buf_in, size_t len, int target_
     return true;
 }
 
+bool get_audio_length_from_buf(const unsigned char * buf_in, size_t len, int target_sampler_rate, uint64_t & n_samples) {
+    ma_decoder_config decoder_config = ma_decoder_config_init(ma_format_f32, 1, target_sampler_rate);
+    ma_decoder decoder;
+    if (ma_decoder_init_memory(buf_in, len, &decoder_config, &decoder) != MA_SUCCESS) {
+        return false;
+    }
+    ma_uint64 frame_count = 0;
+    const ma_result result = ma_decoder_get_length_in_pcm_frames(&decoder, &frame_count);
+    ma_decoder_uninit(&decoder);
+    if (result != MA_SUCCESS) {
+        return false;
+    }
+    n_samples = frame_count;
+    return true;
+}
+
 } // namespace wav_utils
 
 
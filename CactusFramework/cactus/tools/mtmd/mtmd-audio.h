@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <vector>
 #include <string>
+#include <utility>
 
 #define WHISPER_ASSERT LM_GGML_ASSERT
 
@@ -38,6 +39,31 @@ extern bool preprocess_audio(
         const whisper_filters & filters,
         std::vector<whisper_mel> & output);
 
+// split a full spectrogram into the 3000-frame chunks the encoder accepts
+extern void split_mel(const whisper_mel & mel, std::vector<whisper_mel> & output);
+
+// shapes of the chunks preprocess_audio gives for n_samples, without computing their data
+extern void mel_chunk_shapes(size_t n_samples, int n_mel, std::vector<whisper_mel> & output);
+
+// log-mel spectrogram computed incrementally as samples arrive, so only the last few frames
+// and the normalization are left once the audio ends
+struct whisper_mel_stream {
+    whisper_mel_stream(const whisper_filters & filters);
+
+    void push(const float * samples, size_t n);
+    size_t n_samples() const;
+
+    // normalized spectrogram of everything pushed so far, identical to preprocess_audio's
+    bool get(whisper_mel & mel) const;
+
+private:
+    whisper_filters filters;
+    std::vector<std::pair<int, int>> spans; // nonzero bins of each filter row
+    std::vector<float> padded; // reflection padding followed by the samples
+    std::vector<float> frames; // unnormalized log-mel values, n_mel per computed frame
+    size_t n_frames = 0;
+};
+
 } // namespace whisper_preprocessor
 
 
@@ -52,6 +78,13 @@ extern bool decode_audio_from_buf(
         int target_sampler_rate,
         std::vector<float> & pcmf32_mono);
 
+// the number of samples decode_audio_from_buf would give, without decoding where the format's header has it
+extern bool get_audio_length_from_buf(
+        const unsigned char * buf_in,
+        size_t len,
+        int target_sampler_rate,
+        uint64_t & n_samples);
+
 } // namespace audio_helpers
 
 
@@ -2,6 +2,7 @@
 #include "clip-impl.h"
 #include "mtmd.h"
 #include "mtmd-audio.h"
+#include "stb_image.h"
 
 #include "llama.h"
 
@@ -21,6 +22,8 @@ struct mtmd_bitmap {
     std::vector<unsigned char> data;
     std::string id; // optional user-defined id, for ex: can be set to image hash, useful for KV cache tracking
     bool is_audio = false; // true if the bitmap is audio
+    bool is_mel = false;   // true if the audio is already a log-mel spectrogram (nx frames of ny bins)
+    bool size_only = false; // true if there is no data, only the size (nx samples for audio)
 };
 
 struct mtmd_image_tokens {
@@ -91,6 +94,10 @@ mtmd_context_params mtmd_context_params_default() {
     params.verbosity = LM_GGML_LOG_LEVEL_INFO;
     params.image_marker = MTMD_DEFAULT_IMAGE_MARKER;
     params.media_marker = mtmd_default_marker();
+    params.weight_type = LM_GGML_TYPE_COUNT;
+    params.image_max_side = 0;
+    params.max_slices = 0;
+    params.threadpool = nullptr;
     return params;
 }
 
@@ -141,6 +148,10 @@ struct mtmd_context {
         clip_context_params ctx_clip_params;
         ctx_clip_params.use_gpu   = ctx_params.use_gpu;
         ctx_clip_params.verbosity = ctx_params.verbosity;
+        ctx_clip_params.weight_type    = ctx_params.weight_type;
+        ctx_clip_params.image_max_side = ctx_params.image_max_side;
+        ctx_clip_params.max_slices     = ctx_params.max_slices;
+        ctx_clip_params.threadpool     = ctx_params.threadpool;
         ctx_clip = clip_init(mmproj_fname, ctx_clip_params);
         if (!ctx_clip) {
             throw std::runtime_error(string_format("Failed to load CLIP model from %s\n", mmproj_fname));
@@ -406,16 +417,22 @@ int32_t mtmd_tokenize(mtmd_context * ctx,
                 return 2;
             }
 
-            // convert mtmd_bitmap to clip_image_u8
-            clip_image_u8_ptr img_u8(clip_image_u8_init());
-            img_u8->nx = bitmaps[i_bm]->nx;
-            img_u8->ny = bitmaps[i_bm]->ny;
-            img_u8->buf.resize(bitmaps[i_bm]->data.size());
-            std::memcpy(img_u8->buf.data(), bitmaps[i_bm]->data.data(), img_u8->nx * img_u8->ny * 3);
-
-            // preprocess image
             clip_image_f32_batch batch_f32;
-            bool ok = clip_image_preprocess(ctx->ctx_clip, img_u8.get(), &batch_f32);
+            bool ok = true;
+            if (bitmaps[i_bm]->size_only) {
+                // only the sizes of the preprocessed images are needed to count their tokens
+                ok = clip_image_preprocess_size(ctx->ctx_clip, bitmaps[i_bm]->nx, bitmaps[i_bm]->ny, &batch_f32);
+            } else {
+                // convert mtmd_bitmap to clip_image_u8
+                clip_image_u8_ptr img_u8(clip_image_u8_init());
+                img_u8->nx = bitmaps[i_bm]->nx;
+                img_u8->ny = bitmaps[i_bm]->ny;
+                img_u8->buf.resize(bitmaps[i_bm]->data.size());
+                std::memcpy(img_u8->buf.data(), bitmaps[i_bm]->data.data(), img_u8->nx * img_u8->ny * 3);
+
+                // preprocess image
+                ok = clip_image_preprocess(ctx->ctx_clip, img_u8.get(), &batch_f32);
+            }
             if (!ok) {
                 LOG_ERR("Unable to preprocess image\n");
                 return 2;
@@ -535,7 +552,7 @@ int32_t mtmd_tokenize(mtmd_context * ctx,
                 return 2;
             }
 
-            if (bitmaps[i_bm]->data.size() == 0) {
+            if (bitmaps[i_bm]->data.size() == 0 && !bitmaps[i_bm]->size_only) {
                 LOG_ERR("%s: error: empty audio data\n", __func__);
                 return 2;
             }
@@ -545,7 +562,21 @@ int32_t mtmd_tokenize(mtmd_context * ctx,
             std::vector<whisper_preprocessor::whisper_mel> mel_spec_chunks;
             const float * samples = (const float *)bitmaps[i_bm]->data.data();
             size_t n_samples = bitmaps[i_bm]->data.size() / sizeof(float);
-            bool ok = whisper_preprocessor::preprocess_audio(samples, n_samples, ctx->w_filters, mel_spec_chunks);
+            bool ok = true;
+            if (bitmaps[i_bm]->size_only) {
+                whisper_preprocessor::mel_chunk_shapes(bitmaps[i_bm]->nx, ctx->w_filters.n_mel, mel_spec_chunks);
+                ok = !mel_spec_chunks.empty();
+            } else if (bitmaps[i_bm]->is_mel) {
+                // spectrogram from an audio stream, only the split is left
+                whisper_preprocessor::whisper_mel mel;
+                mel.n_len = bitmaps[i_bm]->nx;
+                mel.n_len_org = bitmaps[i_bm]->nx;
+                mel.n_mel = bitmaps[i_bm]->ny;
+                mel.data.assign(samples, samples + n_samples);
+                whisper_preprocessor::split_mel(mel, mel_spec_chunks);
+            } else {
+                ok = whisper_preprocessor::preprocess_audio(samples, n_samples, ctx->w_filters, mel_spec_chunks);
+            }
             if (!ok) {
                 LOG_ERR("Unable to preprocess audio\n");
                 return 2;
@@ -686,6 +717,24 @@ mtmd_bitmap * mtmd_helper_bitmap_init_from_buf(const unsigned char * buf, size_t
     return mtmd_bitmap_init(nx, ny, data);
 }
 
+mtmd_bitmap * mtmd_helper_bitmap_init_size_from_buf(const unsigned char * buf, size_t len) {
+    if (audio_helpers::is_audio_file((const char *)buf, len)) {
+        uint64_t n_samples = 0;
+        if (!audio_helpers::get_audio_length_from_buf(buf, len, COMMON_SAMPLE_RATE, n_samples) || n_samples == 0) {
+            return nullptr;
+        }
+        return mtmd_bitmap_init_audio_size_only(n_samples);
+    }
+
+    int nx = 0;
+    int ny = 0;
+    int comp = 0;
+    if (!stbi_info_from_memory(buf, (int)len, &nx, &ny, &comp) || nx <= 0 || ny <= 0) {
+        return nullptr;
+    }
+    return mtmd_bitmap_init_size_only(nx, ny);
+}
+
 mtmd_bitmap * mtmd_helper_bitmap_init_from_file(const char * fname) {
     std::vector<unsigned char> buf;
     FILE * f = fopen(fname, "rb");
@@ -739,6 +788,23 @@ mtmd_bitmap * mtmd_bitmap_init_from_audio(size_t n_samples,
     return bitmap;
 }
 
+mtmd_bitmap * mtmd_bitmap_init_size_only(uint32_t nx, uint32_t ny) {
+    mtmd_bitmap * bitmap = new mtmd_bitmap;
+    bitmap->nx = nx;
+    bitmap->ny = ny;
+    bitmap->size_only = true;
+    return bitmap;
+}
+
+mtmd_bitmap * mtmd_bitmap_init_audio_size_only(size_t n_samples) {
+    mtmd_bitmap * bitmap = new mtmd_bitmap;
+    bitmap->nx = n_samples;
+    bitmap->ny = 1;
+    bitmap->is_audio = true;
+    bitmap->size_only = true;
+    return bitmap;
+}
+
 uint32_t mtmd_bitmap_get_nx(const mtmd_bitmap * bitmap) {
     return bitmap->nx;
 }
@@ -777,6 +843,49 @@ void mtmd_bitmap_free(mtmd_bitmap * bitmap) {
     }
 }
 
+// mtmd_audio_stream
+
+struct mtmd_audio_stream {
+    whisper_preprocessor::whisper_mel_stream mel;
+};
+
+mtmd_audio_stream * mtmd_audio_stream_init(mtmd_context * ctx) {
+    if (!ctx->has_audio || ctx->w_filters.n_mel == 0) {
+        LOG_ERR("%s: error: model does not support audio input\n", __func__);
+        return nullptr;
+    }
+    return new mtmd_audio_stream{whisper_preprocessor::whisper_mel_stream(ctx->w_filters)};
+}
+
+void mtmd_audio_stream_push(mtmd_audio_stream * stream, const float * samples, size_t n_samples) {
+    stream->mel.push(samples, n_samples);
+}
+
+size_t mtmd_audio_stream_n_samples(const mtmd_audio_stream * stream) {
+    return stream->mel.n_samples();
+}
+
+mtmd_bitmap * mtmd_audio_stream_get_bitmap(const mtmd_audio_stream * stream) {
+    whisper_preprocessor::whisper_mel mel;
+    if (!stream->mel.get(mel)) {
+        return nullptr;
+    }
+    mtmd_bitmap * bitmap = new mtmd_bitmap;
+    bitmap->nx = mel.n_len;
+    bitmap->ny = mel.n_mel;
+    bitmap->is_audio = true;
+    bitmap->is_mel = true;
+    bitmap->data.resize(mel.data.size() * sizeof(float));
+    std::memcpy(bitmap->data.data(), mel.data.data(), bitmap->data.size());
+    return bitmap;
+}
+
+void mtmd_audio_stream_free(mtmd_audio_stream * stream) {
+    if (stream) {
+        delete stream;
+    }
+}
+
 // mtmd_input_chunks
 
 mtmd_input_chunks * mtmd_input_chunks_init() {
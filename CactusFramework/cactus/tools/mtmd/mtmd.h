@@ -55,6 +55,7 @@ enum mtmd_input_chunk_type {
 // opaque types
 struct mtmd_context;
 struct mtmd_bitmap;
+struct mtmd_audio_stream;
 struct mtmd_image_tokens;
 struct mtmd_input_chunk;
 struct mtmd_input_chunks;
@@ -71,6 +72,7 @@ struct mtmd_input_text {
 
 typedef struct mtmd_context      mtmd_context;
 typedef struct mtmd_bitmap       mtmd_bitmap;
+typedef struct mtmd_audio_stream mtmd_audio_stream;
 typedef struct mtmd_image_tokens mtmd_image_tokens;
 typedef struct mtmd_input_chunk  mtmd_input_chunk;
 typedef struct mtmd_input_chunks mtmd_input_chunks;
@@ -83,6 +85,13 @@ struct mtmd_context_params {
     enum lm_ggml_log_level verbosity;
     const char * image_marker; // deprecated, use media_marker instead
     const char * media_marker;
+
+    // speed/accuracy trade-offs for the projector
+    enum lm_ggml_type weight_type; // requantize f16/f32 layer weights at load (e.g. LM_GGML_TYPE_Q8_0), LM_GGML_TYPE_COUNT = as stored
+    int image_max_side;            // cap on the image's longest side (dynamic-resolution models), 0 = model default
+    int max_slices;                // cap on the number of image slices (tiling models), 0 = model default
+
+    lm_ggml_threadpool_t threadpool; // CPU threadpool shared with other contexts, nullptr = ggml creates one per graph
 };
 
 MTMD_API const char * mtmd_default_marker(void);
@@ -119,6 +128,10 @@ MTMD_API bool mtmd_support_audio(mtmd_context * ctx);
 //     the data is in float format (PCM F32)
 MTMD_API mtmd_bitmap *         mtmd_bitmap_init           (uint32_t nx, uint32_t ny, const unsigned char * data);
 MTMD_API mtmd_bitmap *         mtmd_bitmap_init_from_audio(size_t n_samples,         const float         * data);
+// bitmaps holding only the size of an image, or the sample count of 16 kHz mono audio; mtmd_tokenize()
+// counts their tokens without preprocessing anything, and the chunks it gives for them cannot be encoded
+MTMD_API mtmd_bitmap *         mtmd_bitmap_init_size_only      (uint32_t nx, uint32_t ny);
+MTMD_API mtmd_bitmap *         mtmd_bitmap_init_audio_size_only(size_t n_samples);
 MTMD_API uint32_t              mtmd_bitmap_get_nx     (const mtmd_bitmap * bitmap);
 MTMD_API uint32_t              mtmd_bitmap_get_ny     (const mtmd_bitmap * bitmap);
 MTMD_API const unsigned char * mtmd_bitmap_get_data   (const mtmd_bitmap * bitmap);
@@ -130,6 +143,18 @@ MTMD_API void                  mtmd_bitmap_free       (mtmd_bitmap * bitmap);
 MTMD_API const char * mtmd_bitmap_get_id(const mtmd_bitmap * bitmap);
 MTMD_API void         mtmd_bitmap_set_id(mtmd_bitmap * bitmap, const char * id);
 
+// mtmd_audio_stream
+//
+// takes 16 kHz mono PCM F32 as it is captured; the log-mel spectrogram is computed as samples
+// arrive, so producing the bitmap once the audio ends only finishes the last few frames
+// the stream must not outlive the mtmd_context it was created from
+MTMD_API mtmd_audio_stream * mtmd_audio_stream_init     (mtmd_context * ctx);
+MTMD_API void                mtmd_audio_stream_push     (mtmd_audio_stream * stream, const float * samples, size_t n_samples);
+MTMD_API size_t              mtmd_audio_stream_n_samples(const mtmd_audio_stream * stream);
+// audio bitmap of everything pushed so far (the stream can keep going); nullptr if too short
+MTMD_API mtmd_bitmap *       mtmd_audio_stream_get_bitmap(const mtmd_audio_stream * stream);
+MTMD_API void                mtmd_audio_stream_free     (mtmd_audio_stream * stream);
+
 
 // mtmd_input_chunks
 //
@@ -229,6 +254,10 @@ MTMD_API mtmd_bitmap * mtmd_helper_bitmap_init_from_file(const char * fname);
 // this function is thread-safe
 MTMD_API mtmd_bitmap * mtmd_helper_bitmap_init_from_buf(const unsigned char * buf, size_t len);
 
+// like mtmd_helper_bitmap_init_from_buf(), but gives a size-only bitmap read from the file's header
+// returns nullptr when the header does not have the size
+MTMD_API mtmd_bitmap * mtmd_helper_bitmap_init_size_from_buf(const unsigned char * buf, size_t len);
+
 // helper to count the total number of tokens from a list of chunks, useful to keep track of KV cache
 MTMD_API size_t mtmd_helper_get_n_tokens(const mtmd_input_chunks * chunks);
 
@@ -10,8 +10,11 @@
 #include <codecvt>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <locale>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <stdexcept>
 #include <string>
@@ -151,6 +154,39 @@ static std::vector<unicode_cpt_flags> unicode_cpt_flags_array() {
     return cpt_flags;
 }
 
+// two-level version of unicode_cpt_flags_array: identical blocks of 256 codepoints are stored once,
+// which keeps the whole table within a few hundred KB instead of 2 MB
+struct unicode_cpt_flags_table {
+    static constexpr uint32_t BLOCK_BITS = 8;
+    static constexpr uint32_t BLOCK_SIZE = 1u << BLOCK_BITS;
+
+    std::vector<uint32_t>          block_offset; // per block, into flags
+    std::vector<unicode_cpt_flags> flags;
+
+    unicode_cpt_flags_table() {
+        const auto cpt_flags = unicode_cpt_flags_array();
+        const size_t n_blocks = (cpt_flags.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        assert(cpt_flags.size() % BLOCK_SIZE == 0);
+
+        std::unordered_map<std::string, uint32_t> seen;
+        block_offset.resize(n_blocks);
+        for (size_t b = 0; b < n_blocks; ++b) {
+            const unicode_cpt_flags * block = cpt_flags.data() + b * BLOCK_SIZE;
+            std::string key(reinterpret_cast<const char *>(block), BLOCK_SIZE * sizeof(unicode_cpt_flags));
+            auto it = seen.find(key);
+            if (it == seen.end()) {
+                it = seen.emplace(std::move(key), (uint32_t) flags.size()).first;
+                flags.insert(flags.end(), block, block + BLOCK_SIZE);
+            }
+            block_offset[b] = it->second;
+        }
+    }
+
+    unicode_cpt_flags get(uint32_t cpt) const {
+        return flags[block_offset[cpt >> BLOCK_BITS] + (cpt & (BLOCK_SIZE - 1))];
+    }
+};
+
 static std::unordered_map<uint8_t, std::string> unicode_byte_to_utf8_map() {
     std::unordered_map<uint8_t, std::string> map;
     for (int ch = 0x21; ch <= 0x7E; ++ch) {  // u'!' to u'~'
@@ -352,7 +388,8 @@ static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & t
 }
 
 // LLAMA3 system regex: "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
-static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string & text, const std::vector<size_t> & offsets) {
+// QWEN2 is the same with \p{N} in place of \p{N}{1,3} (max_digits = 1)
+static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string & text, const std::vector<size_t> & offsets, size_t max_digits = 3) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
@@ -429,7 +466,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
             if (flags.is_number) {
                 size_t ini = pos;
                 while (_get_flags(pos).is_number) {
-                    if (++pos - ini >= 3 ) {
+                    if (++pos - ini >= max_digits) {
                         _add_token(pos);
                         ini = pos;
                     }
@@ -552,6 +589,558 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
+//
+// compiled pre-tokenizer regexes
+//
+
+// The ECMAScript subset the pre-tokenizer regexes use (alternation, groups, lookahead, classes with
+// \p{..}, greedy quantifiers, $) runs here on codepoints with a backtracking matcher, giving the same
+// splits as unicode_regex_split_stl: \p{..} has the collapsed-text meaning (ASCII per k_ucat_map) and
+// non-ASCII whitespace reads as \v. Patterns outside the subset still go through std::regex.
+
+enum unicode_regex_bit : uint8_t {
+    UNICODE_REGEX_SPACE = 0x01, // \s
+    UNICODE_REGEX_DIGIT = 0x02, // \d
+    UNICODE_REGEX_N     = 0x04,
+    UNICODE_REGEX_L     = 0x08,
+    UNICODE_REGEX_P     = 0x10,
+    UNICODE_REGEX_M     = 0x20,
+    UNICODE_REGEX_S     = 0x40,
+};
+
+// class bits of a codepoint, and the value literals are compared against
+static uint8_t unicode_regex_bits(uint32_t cpt, uint32_t & value) {
+    value = cpt;
+    if (cpt < 128) {
+        if (cpt == ' ' || (cpt >= 0x09 && cpt <= 0x0D)) {
+            return UNICODE_REGEX_SPACE;
+        }
+        if (cpt >= '0' && cpt <= '9') {
+            return UNICODE_REGEX_DIGIT | UNICODE_REGEX_N;
+        }
+        if ((cpt >= 'A' && cpt <= 'Z') || (cpt >= 'a' && cpt <= 'z')) {
+            return UNICODE_REGEX_L;
+        }
+        // same sets as k_ucat_map in unicode_regex_split
+        if (cpt != 0 && strchr("$+<=>^`|", (int) cpt) != nullptr) {
+            return UNICODE_REGEX_S;
+        }
+        if (cpt != 0 && strchr("!\"#%&'()*,-./:;?@[\\]_{}", (int) cpt) != nullptr) {
+            return UNICODE_REGEX_P;
+        }
+        return 0;
+    }
+    const auto flags = unicode_cpt_flags_from_cpt(cpt);
+    if (flags.is_whitespace) {
+        value = 0x0B;
+        return UNICODE_REGEX_SPACE;
+    }
+    switch (flags.category_flag()) {
+        case unicode_cpt_flags::NUMBER:      return UNICODE_REGEX_N;
+        case unicode_cpt_flags::LETTER:      return UNICODE_REGEX_L;
+        case unicode_cpt_flags::PUNCTUATION: return UNICODE_REGEX_P;
+        case unicode_cpt_flags::ACCENT_MARK: return UNICODE_REGEX_M;
+        case unicode_cpt_flags::SYMBOL:      return UNICODE_REGEX_S;
+        default:                             return 0;
+    }
+}
+
+struct unicode_regex_class {
+    bool    negate = false;
+    uint8_t bits   = 0; // matches a codepoint with any of these
+    uint8_t nbits  = 0; // matches a codepoint lacking any of these (\S, \D)
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+
+    // sorts and merges the ranges
+    void finalize() {
+        std::sort(ranges.begin(), ranges.end());
+        size_t n = 0;
+        for (const auto & r : ranges) {
+            if (n > 0 && r.first <= ranges[n - 1].second + 1) {
+                ranges[n - 1].second = std::max(ranges[n - 1].second, r.second);
+            } else {
+                ranges[n++] = r;
+            }
+        }
+        ranges.resize(n);
+    }
+
+    bool match(uint32_t value, uint8_t b) const {
+        bool hit = (b & bits) != 0 || (~b & nbits) != 0;
+        if (!hit && ranges.size() > 8) {
+            const auto it = std::upper_bound(ranges.begin(), ranges.end(), std::make_pair(value, UINT32_MAX));
+            hit = it != ranges.begin() && value <= (it - 1)->second;
+        }
+        for (size_t i = 0; !hit && ranges.size() <= 8 && i < ranges.size(); ++i) {
+            hit = ranges[i].first <= value && value <= ranges[i].second;
+        }
+        return hit != negate;
+    }
+};
+
+struct unicode_regex_node {
+    enum type_t { CHAR, CAT, ALT, REPEAT, LOOK, END } type = CAT;
+    int  cls = -1;
+    int  min = 1;
+    int  max = 1; // -1 for unbounded
+    bool neg = false;
+    std::vector<unicode_regex_node> children;
+};
+
+struct unicode_regex_inst {
+    enum op_t : uint8_t { CHAR, SPLIT, JMP, LOOK, END, MATCH } op;
+    bool neg = false;
+    int  x   = 0; // CHAR: class, SPLIT: preferred branch, JMP: target, LOOK: sub-program
+    int  y   = 0; // SPLIT: other branch, LOOK: continuation
+};
+
+struct unicode_regex_program {
+    std::vector<unicode_regex_class> classes;
+    std::vector<unicode_regex_inst>  code;
+};
+
+struct unicode_regex_parser {
+    const std::vector<uint32_t> & pat;
+    std::vector<unicode_regex_class> & classes;
+    size_t i = 0;
+    bool has_category = false;
+    bool has_non_ascii = false;
+
+    bool eof() const { return i >= pat.size(); }
+    uint32_t peek() const { return eof() ? 0 : pat[i]; }
+
+    [[noreturn]] static void unsupported() {
+        throw std::invalid_argument("unsupported regex");
+    }
+
+    int add_class(unicode_regex_class cls) {
+        classes.push_back(std::move(cls));
+        return (int) classes.size() - 1;
+    }
+
+    static uint8_t category_bits(uint32_t c) {
+        switch (c) {
+            case 'N': return UNICODE_REGEX_N;
+            case 'L': return UNICODE_REGEX_L;
+            case 'P': return UNICODE_REGEX_P;
+            case 'M': return UNICODE_REGEX_M;
+            case 'S': return UNICODE_REGEX_S;
+            default:  unsupported();
+        }
+    }
+
+    // escape after '\', into cls; returns true for a single literal (stored in lit)
+    bool parse_escape(unicode_regex_class & cls, uint32_t & lit) {
+        if (eof()) {
+            unsupported();
+        }
+        const uint32_t c = pat[i++];
+        switch (c) {
+            case 'p':
+                if (i + 2 >= pat.size() || pat[i] != '{' || pat[i + 2] != '}') {
+                    unsupported();
+                }
+                cls.bits |= category_bits(pat[i + 1]);
+                has_category = true;
+                i += 3;
+                return false;
+            case 's': cls.bits  |= UNICODE_REGEX_SPACE; return false;
+            case 'S': cls.nbits |= UNICODE_REGEX_SPACE; return false;
+            case 'd': cls.bits  |= UNICODE_REGEX_DIGIT; return false;
+            case 'D': cls.nbits |= UNICODE_REGEX_DIGIT; return false;
+            case 'r': lit = '\r'; return true;
+            case 'n': lit = '\n'; return true;
+            case 't': lit = '\t'; return true;
+            case 'f': lit = '\f'; return true;
+            case 'v': lit = '\v'; return true;
+            default:
+                if (c < 128 && isalnum((int) c)) {
+                    unsupported();
+                }
+                lit = c;
+                return true;
+        }
+    }
+
+    uint32_t literal(uint32_t c) {
+        has_non_ascii |= c >= 128;
+        return c;
+    }
+
+    int parse_class() {
+        unicode_regex_class cls;
+        if (peek() == '^') {
+            cls.negate = true;
+            i++;
+        }
+        while (!eof() && peek() != ']') {
+            uint32_t lo = pat[i++];
+            if (lo == '\\' && !parse_escape(cls, lo)) {
+                continue;
+            }
+            lo = literal(lo);
+            uint32_t hi = lo;
+            if (peek() == '-' && i + 1 < pat.size() && pat[i + 1] != ']') {
+                i++;
+                hi = pat[i++];
+                if (hi == '\\') {
+                    unicode_regex_class tmp;
+                    if (!parse_escape(tmp, hi)) {
+                        unsupported();
+                    }
+                }
+                hi = literal(hi);
+                if (hi < lo) {
+                    unsupported();
+                }
+            }
+            cls.ranges.push_back({ lo, hi });
+        }
+        if (eof()) {
+            unsupported();
+        }
+        i++; // ']'
+        cls.finalize();
+        return add_class(std::move(cls));
+    }
+
+    int parse_int() {
+        if (eof() || peek() < '0' || peek() > '9') {
+            unsupported();
+        }
+        int n = 0;
+        while (!eof() && peek() >= '0' && peek() <= '9') {
+            n = n * 10 + (int) (pat[i++] - '0');
+        }
+        return n;
+    }
+
+    unicode_regex_node parse_atom() {
+        unicode_regex_node node;
+        const uint32_t c = pat[i++];
+        if (c == '(') {
+            unicode_regex_node::type_t type = unicode_regex_node::CAT;
+            if (peek() == '?') {
+                if (i + 1 >= pat.size()) {
+                    unsupported();
+                }
+                const uint32_t kind = pat[i + 1];
+                if (kind == '=' || kind == '!') {
+                    type = unicode_regex_node::LOOK;
+                    node.neg = kind == '!';
+                } else if (kind != ':') {
+                    unsupported();
+                }
+                i += 2;
+            }
+            unicode_regex_node inner = parse_alt();
+            if (peek() != ')') {
+                unsupported();
+            }
+            i++;
+            if (type == unicode_regex_node::LOOK) {
+                node.type = type;
+                node.children.push_back(std::move(inner));
+                return node;
+            }
+            return inner;
+        }
+        if (c == '$') {
+            node.type = unicode_regex_node::END;
+            return node;
+        }
+        if (c == '[') {
+            node.type = unicode_regex_node::CHAR;
+            node.cls = parse_class();
+            return node;
+        }
+        if (c == '.' || c == '^' || c == ')' || c == '|' || c == '*' || c == '+' || c == '?' || c == '{' || c == '}' || c == ']') {
+            unsupported();
+        }
+        unicode_regex_class cls;
+        uint32_t lit = c;
+        if (c != '\\' || parse_escape(cls, lit)) {
+            lit = literal(lit);
+            cls.ranges.push_back({ lit, lit });
+        }
+        node.type = unicode_regex_node::CHAR;
+        node.cls = add_class(std::move(cls));
+        return node;
+    }
+
+    unicode_regex_node parse_seq() {
+        unicode_regex_node seq;
+        seq.type = unicode_regex_node::CAT;
+        while (!eof() && peek() != '|' && peek() != ')') {
+            unicode_regex_node atom = parse_atom();
+            int min = 1;
+            int max = 1;
+            const uint32_t q = peek();
+            if (q == '?' || q == '*' || q == '+') {
+                i++;
+                min = q == '+' ? 1 : 0;
+                max = q == '?' ? 1 : -1;
+            } else if (q == '{') {
+                i++;
+                min = max = parse_int();
+                if (peek() == ',') {
+                    i++;
+                    max = peek() == '}' ? -1 : parse_int();
+                }
+                if (peek() != '}' || (max >= 0 && max < min)) {
+                    unsupported();
+                }
+                i++;
+            }
+            if (peek() == '?' && (min != 1 || max != 1)) {
+                unsupported(); // lazy quantifiers
+            }
+            if (min == 1 && max == 1) {
+                seq.children.push_back(std::move(atom));
+                continue;
+            }
+            if (atom.type == unicode_regex_node::LOOK || atom.type == unicode_regex_node::END || (max < 0 && nullable(atom))) {
+                unsupported(); // a loop over an empty match would never end
+            }
+            unicode_regex_node rep;
+            rep.type = unicode_regex_node::REPEAT;
+            rep.min = min;
+            rep.max = max;
+            rep.children.push_back(std::move(atom));
+            seq.children.push_back(std::move(rep));
+        }
+        return seq;
+    }
+
+    unicode_regex_node parse_alt() {
+        unicode_regex_node alt;
+        alt.type = unicode_regex_node::ALT;
+        alt.children.push_back(parse_seq());
+        while (peek() == '|') {
+            i++;
+            alt.children.push_back(parse_seq());
+        }
+        return alt.children.size() == 1 ? std::move(alt.children[0]) : alt;
+    }
+
+    static bool nullable(const unicode_regex_node & node) {
+        switch (node.type) {
+            case unicode_regex_node::CHAR:   return false;
+            case unicode_regex_node::REPEAT: return node.min == 0 || nullable(node.children[0]);
+            case unicode_regex_node::ALT:
+                return std::any_of(node.children.begin(), node.children.end(), nullable);
+            case unicode_regex_node::CAT:
+                return std::all_of(node.children.begin(), node.children.end(), nullable);
+            default: return true;
+        }
+    }
+};
+
+static void unicode_regex_emit(const unicode_regex_node & node, std::vector<unicode_regex_inst> & code) {
+    switch (node.type) {
+        case unicode_regex_node::CHAR:
+            code.push_back({ unicode_regex_inst::CHAR, false, node.cls, 0 });
+            break;
+        case unicode_regex_node::END:
+            code.push_back({ unicode_regex_inst::END, false, 0, 0 });
+            break;
+        case unicode_regex_node::CAT:
+            for (const auto & child : node.children) {
+                unicode_regex_emit(child, code);
+            }
+            break;
+        case unicode_regex_node::ALT:
+            {
+                std::vector<size_t> jumps;
+                for (size_t k = 0; k < node.children.size(); ++k) {
+                    const bool last = k + 1 == node.children.size();
+                    const size_t split = code.size();
+                    if (!last) {
+                        code.push_back({ unicode_regex_inst::SPLIT, false, (int) split + 1, 0 });
+                    }
+                    unicode_regex_emit(node.children[k], code);
+                    if (!last) {
+                        jumps.push_back(code.size());
+                        code.push_back({ unicode_regex_inst::JMP, false, 0, 0 });
+                        code[split].y = (int) code.size();
+                    }
+                }
+                for (size_t j : jumps) {
+                    code[j].x = (int) code.size();
+                }
+            } break;
+        case unicode_regex_node::REPEAT:
+            {
+                const auto & body = node.children[0];
+                for (int k = 0; k < node.min; ++k) {
+                    unicode_regex_emit(body, code);
+                }
+                if (node.max < 0) {
+                    const size_t loop = code.size();
+                    code.push_back({ unicode_regex_inst::SPLIT, false, (int) loop + 1, 0 });
+                    unicode_regex_emit(body, code);
+                    code.push_back({ unicode_regex_inst::JMP, false, (int) loop, 0 });
+                    code[loop].y = (int) code.size();
+                    break;
+                }
+                std::vector<size_t> splits;
+                for (int k = node.min; k < node.max; ++k) {
+                    splits.push_back(code.size());
+                    code.push_back({ unicode_regex_inst::SPLIT, false, (int) code.size() + 1, 0 });
+                    unicode_regex_emit(body, code);
+                }
+                for (size_t s : splits) {
+                    code[s].y = (int) code.size();
+                }
+            } break;
+        case unicode_regex_node::LOOK:
+            {
+                const size_t look = code.size();
+                code.push_back({ unicode_regex_inst::LOOK, node.neg, (int) look + 1, 0 });
+                unicode_regex_emit(node.children[0], code);
+                code.push_back({ unicode_regex_inst::MATCH, false, 0, 0 });
+                code[look].y = (int) code.size();
+            } break;
+    }
+}
+
+// nullptr if the regex is outside the supported subset
+static std::unique_ptr<unicode_regex_program> unicode_regex_compile(const std::string & regex_expr) {
+    auto prog = std::make_unique<unicode_regex_program>();
+    const auto pat = unicode_cpts_from_utf8(regex_expr);
+    unicode_regex_parser parser { pat, prog->classes };
+    try {
+        const unicode_regex_node root = parser.parse_alt();
+        if (!parser.eof() || (parser.has_category && parser.has_non_ascii)) {
+            return nullptr;
+        }
+        unicode_regex_emit(root, prog->code);
+    } catch (const std::invalid_argument &) {
+        return nullptr;
+    }
+    prog->code.push_back({ unicode_regex_inst::MATCH, false, 0, 0 });
+    return prog;
+}
+
+static const unicode_regex_program * unicode_regex_get(const std::string & regex_expr) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::unique_ptr<unicode_regex_program>> programs;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = programs.find(regex_expr);
+    if (it == programs.end()) {
+        it = programs.emplace(regex_expr, unicode_regex_compile(regex_expr)).first;
+    }
+    return it->second.get();
+}
+
+struct unicode_regex_matcher {
+    const unicode_regex_program & prog;
+    const uint32_t * values;
+    const uint8_t  * bits;
+    size_t end; // the subject is [0, end) of the current piece
+    std::vector<std::pair<int, size_t>> stack;
+
+    // first match (in ECMAScript priority order) of the program at pc anchored at pos, or npos
+    size_t run(int pc0, size_t pos0, bool not_null) {
+        const size_t base = stack.size();
+        stack.push_back({ pc0, pos0 });
+        while (stack.size() > base) {
+            int    pc  = stack.back().first;
+            size_t pos = stack.back().second;
+            stack.pop_back();
+            while (true) {
+                const auto & in = prog.code[pc];
+                if (in.op == unicode_regex_inst::CHAR) {
+                    if (pos < end && prog.classes[in.x].match(values[pos], bits[pos])) {
+                        pc++;
+                        pos++;
+                        continue;
+                    }
+                } else if (in.op == unicode_regex_inst::SPLIT) {
+                    stack.push_back({ in.y, pos });
+                    pc = in.x;
+                    continue;
+                } else if (in.op == unicode_regex_inst::JMP) {
+                    pc = in.x;
+                    continue;
+                } else if (in.op == unicode_regex_inst::END) {
+                    if (pos == end) {
+                        pc++;
+                        continue;
+                    }
+                } else if (in.op == unicode_regex_inst::LOOK) {
+                    if ((run(in.x, pos, false) != std::string::npos) != in.neg) {
+                        pc = in.y;
+                        continue;
+                    }
+                } else if (!not_null || pos != pos0) { // MATCH
+                    stack.resize(base);
+                    return pos;
+                }
+                break; // this path failed, backtrack
+            }
+        }
+        return std::string::npos;
+    }
+};
+
+// same splitting as unicode_regex_split_stl, including its handling of empty matches
+static std::vector<size_t> unicode_regex_split_compiled(const unicode_regex_program & prog, const std::vector<uint32_t> & values,
+                                                        const std::vector<uint8_t> & bits, const std::vector<size_t> & offsets) {
+    std::vector<size_t> bpe_offsets;
+    bpe_offsets.reserve(offsets.size());
+
+    unicode_regex_matcher matcher { prog, nullptr, nullptr, 0, {} };
+    size_t start = 0;
+    for (auto offset : offsets) {
+        matcher.values = values.data() + start;
+        matcher.bits   = bits.data() + start;
+        matcher.end    = offset;
+
+        size_t start_idx = 0;
+        size_t pos = 0;
+        bool after_empty = false;
+        while (true) {
+            size_t m = pos;
+            size_t m_end = std::string::npos;
+            if (after_empty) {
+                // retry the empty match's position for a non-empty match before moving on
+                m_end = matcher.run(0, pos, true);
+                if (m_end == std::string::npos) {
+                    if (pos == offset) {
+                        break;
+                    }
+                    m = ++pos;
+                }
+            }
+            for (; m_end == std::string::npos && m <= offset; ++m) {
+                m_end = matcher.run(0, m, false);
+                if (m_end != std::string::npos) {
+                    break;
+                }
+            }
+            if (m_end == std::string::npos) {
+                break;
+            }
+            if (m > start_idx) {
+                bpe_offsets.emplace_back(m - start_idx);
+            }
+            bpe_offsets.emplace_back(m_end - m);
+            start_idx = m_end;
+            after_empty = m_end == m;
+            pos = m_end;
+        }
+
+        if (start_idx < offset) {
+            bpe_offsets.emplace_back(offset - start_idx);
+        }
+        start += offset;
+    }
+
+    return bpe_offsets;
+}
+
 static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets;
 
@@ -562,6 +1151,8 @@ static std::vector<size_t> unicode_regex_split_custom(const std::string & text,
             regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
 
         bpe_offsets = unicode_regex_split_custom_llama3(text, offsets);
+    } else if (regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets, 1);
     }
 
     return bpe_offsets;
@@ -614,26 +1205,52 @@ std::vector<uint32_t> unicode_cpts_normalize_nfd(const std::vector<uint32_t> & c
 }
 
 std::vector<uint32_t> unicode_cpts_from_utf8(const std::string & utf8) {
-    std::vector<uint32_t> result;
-    result.reserve(utf8.size());
+    // never more codepoints than bytes
+    std::vector<uint32_t> result(utf8.size());
+    const uint8_t * bytes = reinterpret_cast<const uint8_t *>(utf8.data());
+    size_t n = 0;
     size_t offset = 0;
     while (offset < utf8.size()) {
+        // ASCII runs are checked 16 bytes at a time and widened without decoding
+        while (offset + 16 <= utf8.size()) {
+            uint64_t lo;
+            uint64_t hi;
+            memcpy(&lo, bytes + offset, 8);
+            memcpy(&hi, bytes + offset + 8, 8);
+            if ((lo | hi) & 0x8080808080808080ull) {
+                break;
+            }
+            for (size_t i = 0; i < 16; ++i) {
+                result[n + i] = bytes[offset + i];
+            }
+            n += 16;
+            offset += 16;
+        }
+        if (offset >= utf8.size()) {
+            break;
+        }
+        if (bytes[offset] < 0x80) {
+            result[n++] = bytes[offset++];
+            continue;
+        }
         try {
-            result.push_back(unicode_cpt_from_utf8(utf8, offset));
+            result[n] = unicode_cpt_from_utf8(utf8, offset);
         }
         catch (const std::invalid_argument & /*ex*/) {
             // Silently ignore invalid UTF-8 input to avoid leaking the exception beyond llama_tokenize
             ++offset;
-            result.emplace_back(0xFFFD); // replacement character
+            result[n] = 0xFFFD; // replacement character
         }
+        ++n;
     }
+    result.resize(n);
     return result;
 }
 
 unicode_cpt_flags unicode_cpt_flags_from_cpt(const uint32_t cpt) {
     static const unicode_cpt_flags undef(unicode_cpt_flags::UNDEFINED);
-    static const auto cpt_flags = unicode_cpt_flags_array();
-    return cpt < cpt_flags.size() ? cpt_flags[cpt] : undef;
+    static const unicode_cpt_flags_table table;
+    return cpt < MAX_CODEPOINTS ? table.get(cpt) : undef;
 }
 
 unicode_cpt_flags unicode_cpt_flags_from_utf8(const std::string & utf8) {
@@ -693,24 +1310,16 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         { unicode_cpt_flags::SYMBOL,      "\\\x24\\\x2B\x3C-\x3E\x5E\x60\\\x7C" }, // $+<=>^`|
     };
 
-    // compute collapsed codepoints only if needed by at least one regex
-    bool need_collapse = false;
-    for (const auto & regex_expr : regex_exprs) {
-        // search for unicode categories
-        for (const auto & ucat : k_ucat_enum) {
-            if (std::string::npos != regex_expr.find(ucat.first)) {
-                need_collapse = true;
-                break;
-            }
-        }
-    }
-
     const auto cpts = unicode_cpts_from_utf8(text);
 
     // generate a "collapsed" representation of the text, where all codepoints are replaced by a single byte
     // ref: https://github.com/ggml-org/llama.cpp/pull/6920#issuecomment-2081479935
+    // only needed by regexes that fall back to std::regex
     std::string text_collapsed;
-    if (need_collapse) {
+    const auto collapse = [&]() {
+        if (!text_collapsed.empty() || cpts.empty()) {
+            return;
+        }
         // collapse all unicode categories
         text_collapsed.resize(cpts.size());
 
@@ -733,7 +1342,11 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
                 text_collapsed[i] = (char) 0xD0; // fallback
             }
         }
-    }
+    };
+
+    // per-codepoint classes for the compiled regexes
+    std::vector<uint32_t> cpt_values;
+    std::vector<uint8_t>  cpt_bits;
 
     std::vector<size_t> bpe_offsets = { cpts.size() };
 
@@ -746,6 +1359,18 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
             continue;
         }
 
+        if (const unicode_regex_program * prog = unicode_regex_get(regex_expr)) {
+            if (cpt_bits.size() != cpts.size()) {
+                cpt_values.resize(cpts.size());
+                cpt_bits.resize(cpts.size());
+                for (size_t i = 0; i < cpts.size(); ++i) {
+                    cpt_bits[i] = unicode_regex_bits(cpts[i], cpt_values[i]);
+                }
+            }
+            bpe_offsets = unicode_regex_split_compiled(*prog, cpt_values, cpt_bits, bpe_offsets);
+            continue;
+        }
+
         // fallback to general-purpose std::regex / std::wregex
         try {
             // if a unicode category is used in the regex, we use the collapsed text and replace the unicode category
@@ -807,6 +1432,8 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
                     regex_expr_collapsed += regex_expr[i];
                 }
 
+                collapse();
+
                 //printf("text_collapsed: %s\n", text_collapsed.c_str());
                 //printf("regex_expr_collapsed: %s\n", regex_expr_collapsed.c_str());
                 bpe_offsets = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);